@@ -29,10 +29,17 @@
 #include <sys/mman.h>
 #endif
 #include "config.h"
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/hbitmap.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/pc.h"
@@ -46,6 +53,7 @@
 #include "hw/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/sockets.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
@@ -113,26 +121,9 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
-
-#ifdef __ALTIVEC__
-#include <altivec.h>
-#define VECTYPE        vector unsigned char
-#define SPLAT(p)       vec_splat(vec_ld(0, p), 0)
-#define ALL_EQ(v1, v2) vec_all_eq(v1, v2)
-/* altivec.h may redefine the bool macro as vector type.
- * Reset it to POSIX semantics. */
-#undef bool
-#define bool _Bool
-#elif defined __SSE2__
-#include <emmintrin.h>
-#define VECTYPE        __m128i
-#define SPLAT(p)       _mm_set1_epi8(*(p))
-#define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
-#else
-#define VECTYPE        unsigned long
-#define SPLAT(p)       (*(p) * (~0UL / 255))
-#define ALL_EQ(v1, v2) ((v1) == (v2))
-#endif
+#define RAM_SAVE_FLAG_POSTCOPY 0x80
+/* in the postcopy phase, a page of ram_postcopy_page_size() */
+#define RAM_SAVE_FLAG_HOST_PAGE 0x100
 
 
 static struct defconfig_file {
@@ -164,19 +155,9 @@ int qemu_read_default_config_files(bool userconfig)
     return 0;
 }
 
-static int is_dup_page(uint8_t *page)
+static bool is_zero_page(uint8_t *p)
 {
-    VECTYPE *p = (VECTYPE *)page;
-    VECTYPE val = SPLAT(page);
-    int i;
-
-    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
-        if (!ALL_EQ(val, p[i])) {
-            return 0;
-        }
-    }
-
-    return 1;
+    return buffer_is_zero(p, TARGET_PAGE_SIZE);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -282,6 +263,18 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return size;
 }
 
+/* Pages of guest RAM are put without copying them, unless they have to
+   match what goes in the XBZRLE cache: a write to the page before it is
+   sent dirties it again.  */
+static void ram_put_page(QEMUFile *f, uint8_t *p)
+{
+    if (migrate_use_xbzrle()) {
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    } else {
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+    }
+}
+
 #define ENCODING_FLAG_XBZRLE 0x1
 
 static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
@@ -293,8 +286,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
 
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
         if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr,
-                         g_memdup(current_data, TARGET_PAGE_SIZE));
+            cache_insert(XBZRLE.cache, current_addr, current_data);
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
@@ -344,9 +336,11 @@ static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
-static unsigned long *migration_bitmap;
+static HBitmap *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
+/* how many times the dirty bitmap has been synced */
+static uint64_t ram_sync_count;
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -355,34 +349,26 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     unsigned long base = mr->ram_addr >> TARGET_PAGE_BITS;
     unsigned long nr = base + (start >> TARGET_PAGE_BITS);
     unsigned long size = base + (int128_get64(mr->size) >> TARGET_PAGE_BITS);
+    HBitmapIter hbi;
+    int64_t next;
 
-    unsigned long next = find_next_bit(migration_bitmap, size, nr);
+    hbitmap_iter_init(&hbi, migration_bitmap, nr);
+    next = hbitmap_iter_next(&hbi);
 
-    if (next < size) {
-        clear_bit(next, migration_bitmap);
+    if (next >= 0 && next < size) {
+        hbitmap_reset(migration_bitmap, next, 1);
         migration_dirty_pages--;
+    } else {
+        next = size;
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
-{
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
-
-    ret = test_and_set_bit(nr, migration_bitmap);
-
-    if (!ret) {
-        migration_dirty_pages++;
-    }
-    return ret;
-}
-
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
     ram_addr_t addr;
+    hwaddr len;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -394,17 +380,24 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    ram_sync_count++;
     memory_global_sync_dirty_bitmap(get_system_memory());
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
+        for (addr = 0; addr < block->length; addr += len) {
+            addr = memory_region_test_and_clear_dirty_run(block->mr, addr,
+                                                          block->length - addr,
+                                                          DIRTY_MEMORY_MIGRATION,
+                                                          &len);
+            if (!len) {
+                break;
             }
+            hbitmap_set(migration_bitmap,
+                        (block->mr->ram_addr + addr) >> TARGET_PAGE_BITS,
+                        len >> TARGET_PAGE_BITS);
         }
     }
+    migration_dirty_pages = hbitmap_count(migration_bitmap);
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
@@ -461,7 +454,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 
             /* In doubt sent page as normal */
             bytes_sent = -1;
-            if (is_dup_page(p)) {
+            if (is_zero_page(p)) {
                 acct_info.dup_pages++;
                 bytes_sent = save_block_hdr(f, block, offset, cont,
                                             RAM_SAVE_FLAG_COMPRESS);
@@ -479,7 +472,7 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
             /* XBZRLE overflow or normal page */
             if (bytes_sent == -1) {
                 bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                ram_put_page(f, p);
                 bytes_sent += TARGET_PAGE_SIZE;
                 acct_info.norm_pages++;
             }
@@ -497,6 +490,290 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     return bytes_sent;
 }
 
+/*
+ * Encoding pages on helper threads
+ *
+ * With migrate_set_encode_threads N, ram_save_batch() takes up to
+ * RAM_ENCODE_BATCH dirty pages at a time.  The migration thread and N
+ * helpers then check them for duplicate bytes and XBZRLE encode them
+ * against the cache, each taking the next page not yet taken, and the
+ * migration thread finally writes them to the stream in order.  Only the
+ * migration thread modifies the cache, and only while the helpers are
+ * idle.
+ */
+
+#define RAM_ENCODE_BATCH 64
+
+typedef struct RAMEncodeJob {
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *p;
+    /* the cached copy of the page, NULL on a cache miss */
+    uint8_t *prev;
+    bool dup;
+    uint8_t dup_byte;
+    int encoded_len;
+    uint8_t *current;
+    uint8_t *encoded;
+} RAMEncodeJob;
+
+typedef struct RAMEncodeThread {
+    QemuThread thread;
+    QemuSemaphore go;
+} RAMEncodeThread;
+
+static struct {
+    RAMEncodeThread *threads;
+    int nthreads;
+    bool quit;
+    QemuSemaphore done;
+    RAMEncodeJob jobs[RAM_ENCODE_BATCH];
+    int njobs;
+    int next;
+} encoder;
+
+static void ram_encode_job(RAMEncodeJob *job)
+{
+    job->dup = is_zero_page(job->p);
+    if (job->dup) {
+        job->dup_byte = *job->p;
+        return;
+    }
+    if (job->prev) {
+        memcpy(job->current, job->p, TARGET_PAGE_SIZE);
+        job->encoded_len = xbzrle_encode_buffer(job->prev, job->current,
+                                                TARGET_PAGE_SIZE, job->encoded,
+                                                TARGET_PAGE_SIZE);
+    }
+}
+
+static void ram_encode_jobs(void)
+{
+    int i;
+
+    while ((i = __sync_fetch_and_add(&encoder.next, 1)) < encoder.njobs) {
+        ram_encode_job(&encoder.jobs[i]);
+    }
+}
+
+static void *ram_encode_thread(void *opaque)
+{
+    RAMEncodeThread *t = opaque;
+
+    while (true) {
+        qemu_sem_wait(&t->go);
+        if (encoder.quit) {
+            break;
+        }
+        ram_encode_jobs();
+        qemu_sem_post(&encoder.done);
+    }
+    return NULL;
+}
+
+static void ram_encode_run(int njobs)
+{
+    int i;
+
+    encoder.njobs = njobs;
+    encoder.next = 0;
+    for (i = 0; i < encoder.nthreads; i++) {
+        qemu_sem_post(&encoder.threads[i].go);
+    }
+    ram_encode_jobs();
+    for (i = 0; i < encoder.nthreads; i++) {
+        qemu_sem_wait(&encoder.done);
+    }
+}
+
+static void ram_encode_start(int nthreads)
+{
+    int i;
+
+    if (!nthreads) {
+        return;
+    }
+    for (i = 0; i < RAM_ENCODE_BATCH; i++) {
+        encoder.jobs[i].current = g_malloc(TARGET_PAGE_SIZE);
+        encoder.jobs[i].encoded = g_malloc(TARGET_PAGE_SIZE);
+    }
+    encoder.quit = false;
+    qemu_sem_init(&encoder.done, 0);
+    encoder.threads = g_new0(RAMEncodeThread, nthreads);
+    encoder.nthreads = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        qemu_sem_init(&encoder.threads[i].go, 0);
+        qemu_thread_create(&encoder.threads[i].thread, ram_encode_thread,
+                           &encoder.threads[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_encode_stop(void)
+{
+    int i;
+
+    if (!encoder.threads) {
+        return;
+    }
+    encoder.quit = true;
+    for (i = 0; i < encoder.nthreads; i++) {
+        qemu_sem_post(&encoder.threads[i].go);
+        qemu_thread_join(&encoder.threads[i].thread);
+        qemu_sem_destroy(&encoder.threads[i].go);
+    }
+    qemu_sem_destroy(&encoder.done);
+    g_free(encoder.threads);
+    encoder.threads = NULL;
+    encoder.nthreads = 0;
+    for (i = 0; i < RAM_ENCODE_BATCH; i++) {
+        g_free(encoder.jobs[i].current);
+        g_free(encoder.jobs[i].encoded);
+    }
+}
+
+/* Writes the page of JOB as ram_save_block() would have.  */
+static int ram_save_encoded(QEMUFile *f, RAMEncodeJob *job, bool last_stage)
+{
+    RAMBlock *block = job->block;
+    ram_addr_t current_addr = block->offset + job->offset;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = job->p;
+    uint8_t *cached;
+    int bytes_sent = -1;
+
+    if (job->dup) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, job->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, job->dup_byte);
+        bytes_sent += 1;
+    } else if (migrate_use_xbzrle()) {
+        if (!job->prev) {
+            if (!last_stage) {
+                cache_insert(XBZRLE.cache, current_addr, job->p);
+                p = get_cached_data(XBZRLE.cache, current_addr);
+            }
+            acct_info.xbzrle_cache_miss++;
+        } else if (job->encoded_len == 0) {
+            DPRINTF("Skipping unmodified page\n");
+            return 0;
+        } else {
+            /* An insertion for an earlier page of the batch may have
+               evicted the copy the page was encoded against.  */
+            cached = cache_is_cached(XBZRLE.cache, current_addr) ?
+                get_cached_data(XBZRLE.cache, current_addr) : NULL;
+            if (job->encoded_len == -1) {
+                DPRINTF("Overflow\n");
+                acct_info.xbzrle_overflows++;
+                if (cached) {
+                    memcpy(cached, job->current, TARGET_PAGE_SIZE);
+                }
+                p = job->current;
+            } else {
+                if (!last_stage && cached) {
+                    memcpy(cached, job->current, TARGET_PAGE_SIZE);
+                }
+                bytes_sent = save_block_hdr(f, block, job->offset, cont,
+                                            RAM_SAVE_FLAG_XBZRLE);
+                qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+                qemu_put_be16(f, job->encoded_len);
+                qemu_put_buffer(f, job->encoded, job->encoded_len);
+                bytes_sent += job->encoded_len + 1 + 2;
+                acct_info.xbzrle_pages++;
+                acct_info.xbzrle_bytes += bytes_sent;
+            }
+        }
+    }
+
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, job->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        ram_put_page(f, p);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    last_sent_block = block;
+    return bytes_sent;
+}
+
+/*
+ * ram_save_batch: Writes up to RAM_ENCODE_BATCH pages of memory to the
+ * stream f, encoding them on the helper threads
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no dirty pages
+ */
+
+static int ram_save_batch(QEMUFile *f, bool last_stage)
+{
+    RAMBlock *block = last_seen_block;
+    ram_addr_t offset = last_offset;
+    bool complete_round = false;
+    int bytes_sent = 0;
+    int i, n;
+
+    if (!block) {
+        block = QTAILQ_FIRST(&ram_list.blocks);
+    }
+
+    do {
+        n = 0;
+        while (n < RAM_ENCODE_BATCH) {
+            MemoryRegion *mr = block->mr;
+            RAMEncodeJob *job;
+            ram_addr_t current_addr;
+
+            offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+            if (complete_round && block == last_seen_block &&
+                offset >= last_offset) {
+                break;
+            }
+            if (offset >= block->length) {
+                offset = 0;
+                block = QTAILQ_NEXT(block, next);
+                if (!block) {
+                    block = QTAILQ_FIRST(&ram_list.blocks);
+                    complete_round = true;
+                }
+                continue;
+            }
+
+            job = &encoder.jobs[n++];
+            job->block = block;
+            job->offset = offset;
+            job->p = memory_region_get_ram_ptr(mr) + offset;
+            job->prev = NULL;
+            job->encoded_len = -1;
+            current_addr = block->offset + offset;
+            if (migrate_use_xbzrle() &&
+                cache_is_cached(XBZRLE.cache, current_addr)) {
+                job->prev = get_cached_data(XBZRLE.cache, current_addr);
+            }
+        }
+
+        ram_encode_run(n);
+        for (i = 0; i < n; i++) {
+            bytes_sent += ram_save_encoded(f, &encoder.jobs[i], last_stage);
+        }
+        /* if all pages were unmodified, go on with the next ones */
+    } while (n && !bytes_sent);
+
+    last_seen_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
+/* Writes some pages of memory to the stream f, see ram_save_block().  */
+static int ram_save_pages(QEMUFile *f, bool last_stage)
+{
+    if (encoder.nthreads) {
+        return ram_save_batch(f, last_stage);
+    }
+    return ram_save_block(f, last_stage);
+}
+
 static uint64_t bytes_transferred;
 
 static ram_addr_t ram_save_remaining(void)
@@ -527,9 +804,11 @@ uint64_t ram_bytes_total(void)
 
 static void migration_end(void)
 {
+    ram_encode_stop();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
+        hbitmap_free(migration_bitmap);
         migration_bitmap = NULL;
     }
 
@@ -563,9 +842,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
 
-    migration_bitmap = bitmap_new(ram_pages);
-    bitmap_set(migration_bitmap, 0, ram_pages);
+    migration_bitmap = hbitmap_alloc(ram_pages, 0);
+    hbitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
+    ram_sync_count = 0;
 
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
@@ -583,6 +863,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
         acct_clear();
     }
+    ram_encode_start(migrate_encode_threads());
 
     memory_global_dirty_log_start();
     migration_bitmap_sync();
@@ -619,7 +900,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f, false);
+        bytes_sent = ram_save_pages(f, false);
         /* no more blocks to sent */
         if (bytes_sent == 0) {
             break;
@@ -656,18 +937,239 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return total_sent;
 }
 
+/*
+ * Postcopy
+ *
+ * With the postcopy capability, once all of RAM has been sent and the
+ * dirty bitmap synced again, the source stops and the destination starts
+ * without the pages that are still dirty.  ram_save_complete() only tells
+ * the destination which they are; it drops them and has them faulted on
+ * through userfaultfd, asking the source for the ones the guest touches.
+ * The source sends those first and the others in the background, with
+ * ram_postcopy_send(), until none is left.
+ *
+ * userfaultfd places whole host pages, so in that phase pages go by
+ * ram_postcopy_page_size(), from the start of their block.
+ */
+
+#define RAM_POSTCOPY_BATCH 64
+
+typedef struct RAMPostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPostcopyRequest) next;
+} RAMPostcopyRequest;
+
+/* Only used by the migration thread */
+static QSIMPLEQ_HEAD(, RAMPostcopyRequest) postcopy_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(postcopy_requests);
+
+static ram_addr_t ram_postcopy_page_size(void)
+{
+#ifndef _WIN32
+    return MAX(TARGET_PAGE_SIZE, getpagesize());
+#else
+    return TARGET_PAGE_SIZE;
+#endif
+}
+
+/* Whether the RAM has been sent once, and what was dirtied meanwhile
+   found again: postcopy is only worth it from there.  */
+bool ram_postcopy_ready(void)
+{
+    return ram_sync_count > 1;
+}
+
+/* Writes which pages the destination has to drop, by whole host pages,
+ * and makes the dirty bitmap cover the same.
+ */
+static void ram_postcopy_save_discards(QEMUFile *f)
+{
+    ram_addr_t unit = ram_postcopy_page_size();
+    uint64_t unit_pages = unit >> TARGET_PAGE_BITS;
+    RAMBlock *block;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    qemu_put_be32(f, unit);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t base = block->offset >> TARGET_PAGE_BITS;
+        uint64_t end = base + (block->length >> TARGET_PAGE_BITS);
+        uint64_t start = base, count = end - base;
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        while (count &&
+               hbitmap_next_dirty_area(migration_bitmap, &start, &count)) {
+            uint64_t first = base + QEMU_ALIGN_DOWN(start - base, unit_pages);
+            uint64_t last = MIN(base + QEMU_ALIGN_UP(start + count - base,
+                                                     unit_pages), end);
+
+            hbitmap_set(migration_bitmap, first, last - first);
+            qemu_put_be64(f, (first - base) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (last - first) << TARGET_PAGE_BITS);
+            start = last;
+            count = end - last;
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+
+    migration_dirty_pages = hbitmap_count(migration_bitmap);
+    reset_ram_globals();
+}
+
+void ram_postcopy_request(const char *idstr, uint64_t offset)
+{
+    RAMPostcopyRequest *req;
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+
+    if (!block || offset >= block->length) {
+        DPRINTF("Bad postcopy request for %s at %" PRIx64 "\n",
+                idstr, offset);
+        return;
+    }
+    req = g_new(RAMPostcopyRequest, 1);
+    req->block = block;
+    req->offset = QEMU_ALIGN_DOWN(offset, ram_postcopy_page_size());
+    QSIMPLEQ_INSERT_TAIL(&postcopy_requests, req, next);
+}
+
+/* Sends the host page at OFFSET in BLOCK, unless it already has been.  */
+static int ram_postcopy_send_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset)
+{
+    ram_addr_t len = MIN(ram_postcopy_page_size(), block->length - offset);
+    uint64_t nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p;
+    int bytes_sent;
+
+    if (!hbitmap_get(migration_bitmap, nr)) {
+        return 0;
+    }
+    hbitmap_reset(migration_bitmap, nr, len >> TARGET_PAGE_BITS);
+    migration_dirty_pages -= len >> TARGET_PAGE_BITS;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+    if (buffer_is_zero(p, len)) {
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_HOST_PAGE |
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent += 1;
+        acct_info.dup_pages += len >> TARGET_PAGE_BITS;
+    } else {
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_HOST_PAGE);
+        /* The source is stopped, the page does not change any more.  */
+        qemu_put_buffer_async(f, p, len);
+        bytes_sent += len;
+        acct_info.norm_pages += len >> TARGET_PAGE_BITS;
+    }
+    last_sent_block = block;
+    return bytes_sent;
+}
+
+/*
+ * ram_postcopy_send: Writes the pages the destination requested, then up
+ * to RAM_POSTCOPY_BATCH others, from the last one requested on
+ *
+ * Returns:  The number of bytes written, or a negative error.
+ *           0 means that all pages have been sent; the RAM migration is
+ *           then over.
+ */
+int ram_postcopy_send(QEMUFile *f)
+{
+    ram_addr_t unit = ram_postcopy_page_size();
+    RAMPostcopyRequest *req;
+    RAMBlock *block;
+    int bytes_sent = 0;
+    int ret, i = 0;
+
+    qemu_mutex_lock_ramlist();
+
+    while ((req = QSIMPLEQ_FIRST(&postcopy_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&postcopy_requests, next);
+        bytes_sent += ram_postcopy_send_page(f, req->block, req->offset);
+        /* the guest is likely to go on with the pages that follow */
+        last_seen_block = req->block;
+        last_offset = req->offset + unit;
+        g_free(req);
+    }
+
+    block = last_seen_block ? last_seen_block : QTAILQ_FIRST(&ram_list.blocks);
+    while (i < RAM_POSTCOPY_BATCH && migration_dirty_pages) {
+        uint64_t base = block->offset >> TARGET_PAGE_BITS;
+        uint64_t start = base + (last_offset >> TARGET_PAGE_BITS);
+        uint64_t count = (block->length - last_offset) >> TARGET_PAGE_BITS;
+
+        if (last_offset < block->length &&
+            hbitmap_next_dirty_area(migration_bitmap, &start, &count)) {
+            last_offset = QEMU_ALIGN_DOWN((start - base) << TARGET_PAGE_BITS,
+                                          unit);
+            bytes_sent += ram_postcopy_send_page(f, block, last_offset);
+            last_offset += unit;
+            i++;
+        } else {
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+            }
+            last_offset = 0;
+        }
+    }
+    last_seen_block = block;
+
+    qemu_mutex_unlock_ramlist();
+    bytes_transferred += bytes_sent;
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (migration_dirty_pages) {
+        return bytes_sent;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    bytes_transferred += 8;
+    /* stopping the dirty log needs the iothread lock */
+    qemu_mutex_lock_iothread();
+    migration_end();
+    qemu_mutex_unlock_iothread();
+    return 0;
+}
+
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
+    if (migrate_get_current()->postcopy) {
+        /* the pages go later, with ram_postcopy_send() */
+        ram_postcopy_save_discards(f);
+        qemu_mutex_unlock_ramlist();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
     while (true) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f, true);
+        bytes_sent = ram_save_pages(f, true);
         /* no more blocks to sent */
         if (bytes_sent == 0) {
             break;
@@ -695,6 +1197,204 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return remaining_size;
 }
 
+/*
+ * Live snapshots
+ *
+ * "savevm -l" saves RAM while the guest runs, as it was when the snapshot
+ * started.  The pages yet to be saved are set in snapshot_todo and their
+ * SNAPSHOT_DIRTY_FLAG is clear, so that a write to one of them first
+ * calls ram_snapshot_cow(), which keeps a copy of the page.
+ * ram_snapshot_save() writes those copies, then the pages that have not
+ * been written to, as they are.
+ */
+
+typedef struct RAMSnapshotCopy {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMSnapshotCopy) next;
+    uint8_t data[];
+} RAMSnapshotCopy;
+
+static HBitmap *snapshot_todo;
+static uint64_t snapshot_next;
+static uint32_t snapshot_version;
+static uint8_t *snapshot_buf;
+static RAMBlock *snapshot_sent_block;
+static QSIMPLEQ_HEAD(, RAMSnapshotCopy) snapshot_copies =
+    QSIMPLEQ_HEAD_INITIALIZER(snapshot_copies);
+
+static RAMBlock *ram_snapshot_block(ram_addr_t addr)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/* Writes a RAM block list, like ram_save_setup(), and starts tracking
+ * writes.  Called with the VM stopped.
+ */
+int ram_snapshot_begin(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    snapshot_todo = hbitmap_alloc(last_ram_offset() >> TARGET_PAGE_BITS, 0);
+    snapshot_next = 0;
+    snapshot_version = ram_list.version;
+    snapshot_sent_block = NULL;
+    snapshot_buf = g_malloc(TARGET_PAGE_SIZE);
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        hbitmap_set(snapshot_todo, block->offset >> TARGET_PAGE_BITS,
+                    block->length >> TARGET_PAGE_BITS);
+        qemu_ram_snapshot_track(block->offset, block->length, true);
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return qemu_file_get_error(f);
+}
+
+/* The page at ADDR is about to be written to.  */
+void ram_snapshot_cow(uint64_t addr)
+{
+    uint64_t nr = addr >> TARGET_PAGE_BITS;
+    RAMSnapshotCopy *copy;
+    RAMBlock *block;
+
+    if (!snapshot_todo || nr >= hbitmap_size(snapshot_todo) ||
+        !hbitmap_get(snapshot_todo, nr)) {
+        return;
+    }
+    block = ram_snapshot_block(addr);
+    if (!block) {
+        return;
+    }
+    hbitmap_reset(snapshot_todo, nr, 1);
+
+    copy = g_malloc(sizeof(*copy) + TARGET_PAGE_SIZE);
+    copy->block = block;
+    copy->offset = addr - block->offset;
+    memcpy(copy->data, memory_region_get_ram_ptr(block->mr) + copy->offset,
+           TARGET_PAGE_SIZE);
+    QSIMPLEQ_INSERT_TAIL(&snapshot_copies, copy, next);
+}
+
+static void ram_snapshot_put_page(QEMUFile *f, RAMBlock *block,
+                                  ram_addr_t offset, uint8_t *p)
+{
+    int cont = (block == snapshot_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    if (is_zero_page(p)) {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+    } else {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    }
+    snapshot_sent_block = block;
+}
+
+/*
+ * ram_snapshot_save: Writes pages of the snapshot to the stream f, for
+ * about budget_ns nanoseconds
+ *
+ * Returns:  1 if all the pages have been written
+ *           0 if there are more
+ *           negative on error
+ */
+int ram_snapshot_save(QEMUFile *f, int64_t budget_ns)
+{
+    int64_t t0 = qemu_get_clock_ns(rt_clock);
+    RAMSnapshotCopy *copy;
+    int ret = 1;
+    int i;
+
+    if (ram_list.version != snapshot_version) {
+        /* RAM blocks have come or gone since the start */
+        return -EINVAL;
+    }
+
+    for (i = 0; ; i++) {
+        uint64_t start, count;
+        RAMBlock *block;
+        ram_addr_t addr;
+
+        /* as in ram_save_iterate(), the clock is only read now and then */
+        if ((i & 63) == 63 &&
+            qemu_get_clock_ns(rt_clock) - t0 > budget_ns) {
+            ret = 0;
+            break;
+        }
+
+        copy = QSIMPLEQ_FIRST(&snapshot_copies);
+        if (copy) {
+            QSIMPLEQ_REMOVE_HEAD(&snapshot_copies, next);
+            ram_snapshot_put_page(f, copy->block, copy->offset, copy->data);
+            g_free(copy);
+            continue;
+        }
+
+        /* pages are only taken off snapshot_todo, so it is walked once */
+        start = snapshot_next;
+        count = hbitmap_size(snapshot_todo) - start;
+        if (!count ||
+            !hbitmap_next_dirty_area(snapshot_todo, &start, &count)) {
+            break;
+        }
+        addr = start << TARGET_PAGE_BITS;
+        block = ram_snapshot_block(addr);
+        snapshot_next = start + 1;
+        hbitmap_reset(snapshot_todo, start, 1);
+        qemu_ram_snapshot_track(addr, TARGET_PAGE_SIZE, false);
+        if (block) {
+            /* Writing to the file may run I/O completions that write to
+               the page, which is no longer tracked.  */
+            memcpy(snapshot_buf, memory_region_get_ram_ptr(block->mr) +
+                   addr - block->offset, TARGET_PAGE_SIZE);
+            ram_snapshot_put_page(f, block, addr - block->offset,
+                                  snapshot_buf);
+        }
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    return ret;
+}
+
+void ram_snapshot_end(void)
+{
+    RAMSnapshotCopy *copy;
+    RAMBlock *block;
+
+    if (!snapshot_todo) {
+        return;
+    }
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_ram_snapshot_track(block->offset, block->length, false);
+    }
+    while ((copy = QSIMPLEQ_FIRST(&snapshot_copies)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&snapshot_copies, next);
+        g_free(copy);
+    }
+    hbitmap_free(snapshot_todo);
+    snapshot_todo = NULL;
+    g_free(snapshot_buf);
+    snapshot_buf = NULL;
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     int ret, rc = 0;
@@ -766,8 +1466,409 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/* Puts a loaded page in place.  Code may have been translated from the
+ * page before the load, so it is only written if its contents changed, and
+ * then the translations go with them; those of unchanged pages, which the
+ * flash mostly is when a snapshot is restored again and again, stay valid.
+ */
+static void ram_load_page(void *host, const uint8_t *buf)
+{
+    qemu_ram_restore(qemu_ram_addr_from_host_nofail(host), buf,
+                     TARGET_PAGE_SIZE);
+}
+
+/*
+ * The destination side of postcopy: the pages the source has yet to send
+ * are pending.  A thread places them with userfaultfd as they come, and
+ * another one handles the faults on them, asking the source for the page
+ * the first time.  Faults on pages that are not pending are on pages that
+ * the precopy phase left out because they were zero.
+ */
+
+static bool postcopy_incoming;
+
+#ifdef CONFIG_USERFAULTFD
+typedef struct RAMPostcopyBlock {
+    RAMBlock *block;
+    uint8_t *host;
+    /* length registered with userfaultfd, whole host pages */
+    ram_addr_t length;
+    /* by host page: not placed yet, asked to the source */
+    unsigned long *pending;
+    unsigned long *requested;
+} RAMPostcopyBlock;
+
+static struct {
+    ram_addr_t unit;
+    /* the migration socket, that requests go back on */
+    int fd;
+    int uffd;
+    int quit_fds[2];
+    RAMPostcopyBlock *blocks;
+    int nb_blocks;
+    /* protects pending, requested and nb_pending */
+    QemuMutex lock;
+    uint64_t nb_pending;
+    QemuThread fault_thread;
+    QemuThread recv_thread;
+} postcopy_in;
+
+static RAMPostcopyBlock *ram_postcopy_find_block(uint8_t *host)
+{
+    int i;
+
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        RAMPostcopyBlock *b = &postcopy_in.blocks[i];
+        if (host >= b->host && host < b->host + b->length) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void ram_postcopy_send_request(RAMPostcopyBlock *b, ram_addr_t offset)
+{
+    uint8_t buf[8 + 1 + 256];
+    size_t len = strlen(b->block->idstr);
+
+    stq_be_p(buf, offset);
+    buf[8] = len;
+    memcpy(buf + 9, b->block->idstr, len);
+    if (qemu_send_full(postcopy_in.fd, buf, 9 + len, 0) != 9 + len) {
+        DPRINTF("Failed to request page %s:%" PRIx64 "\n",
+                b->block->idstr, (uint64_t)offset);
+    }
+}
+
+static void ram_postcopy_fault(uint8_t *addr)
+{
+    ram_addr_t unit = postcopy_in.unit;
+    RAMPostcopyBlock *b = ram_postcopy_find_block(addr);
+    ram_addr_t offset;
+    unsigned long nr;
+    bool request = false, pending;
+
+    if (!b) {
+        fprintf(stderr, "postcopy: fault outside of RAM at %p\n", addr);
+        return;
+    }
+    offset = QEMU_ALIGN_DOWN(addr - b->host, unit);
+    nr = offset / unit;
+
+    qemu_mutex_lock(&postcopy_in.lock);
+    pending = test_bit(nr, b->pending);
+    if (pending && !test_bit(nr, b->requested)) {
+        set_bit(nr, b->requested);
+        request = true;
+    }
+    qemu_mutex_unlock(&postcopy_in.lock);
+
+    if (request) {
+        ram_postcopy_send_request(b, offset);
+    } else if (!pending) {
+        struct uffdio_zeropage zero = {
+            .range = { .start = (uintptr_t)b->host + offset, .len = unit },
+        };
+
+        /* EEXIST: the page has been placed since the fault */
+        if (ioctl(postcopy_in.uffd, UFFDIO_ZEROPAGE, &zero) &&
+            errno == EEXIST) {
+            ioctl(postcopy_in.uffd, UFFDIO_WAKE, &zero.range);
+        }
+    }
+}
+
+static void *ram_postcopy_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2] = {
+        { .fd = postcopy_in.uffd, .events = POLLIN },
+        { .fd = postcopy_in.quit_fds[0], .events = POLLIN },
+    };
+    struct uffd_msg msg;
+
+    while (true) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (read(postcopy_in.uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            continue;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT) {
+            ram_postcopy_fault((uint8_t *)(uintptr_t)msg.arg.pagefault.address);
+        }
+    }
+    return NULL;
+}
+
+/* Places a pending page, from BUF or zero if BUF is NULL.  */
+static int ram_postcopy_place(RAMPostcopyBlock *b, ram_addr_t offset,
+                              uint8_t *buf)
+{
+    ram_addr_t unit = postcopy_in.unit;
+    unsigned long nr = offset / unit;
+    int r;
+
+    /* only this thread clears pending bits */
+    if (!test_bit(nr, b->pending)) {
+        return 0;
+    }
+    if (buf) {
+        struct uffdio_copy copy = {
+            .dst = (uintptr_t)b->host + offset,
+            .src = (uintptr_t)buf,
+            .len = unit,
+        };
+        r = ioctl(postcopy_in.uffd, UFFDIO_COPY, &copy);
+    } else {
+        struct uffdio_zeropage zero = {
+            .range = { .start = (uintptr_t)b->host + offset, .len = unit },
+        };
+        r = ioctl(postcopy_in.uffd, UFFDIO_ZEROPAGE, &zero);
+    }
+    if (r && errno != EEXIST) {
+        return -errno;
+    }
+
+    qemu_mutex_lock(&postcopy_in.lock);
+    clear_bit(nr, b->pending);
+    postcopy_in.nb_pending--;
+    qemu_mutex_unlock(&postcopy_in.lock);
+    return 0;
+}
+
+static void ram_postcopy_incoming_end(void)
+{
+    int i;
+
+    if (write(postcopy_in.quit_fds[1], "", 1) == 1) {
+        qemu_thread_join(&postcopy_in.fault_thread);
+    }
+    close(postcopy_in.quit_fds[0]);
+    close(postcopy_in.quit_fds[1]);
+    /* this unregisters the RAM */
+    close(postcopy_in.uffd);
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        g_free(postcopy_in.blocks[i].pending);
+        g_free(postcopy_in.blocks[i].requested);
+    }
+    g_free(postcopy_in.blocks);
+    postcopy_in.blocks = NULL;
+    postcopy_in.nb_blocks = 0;
+    qemu_mutex_destroy(&postcopy_in.lock);
+}
+
+static void *ram_postcopy_recv_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    ram_addr_t unit = postcopy_in.unit;
+    uint8_t *buf = qemu_memalign(unit, unit);
+    ram_addr_t addr;
+    int flags, ret = 0;
+
+    do {
+        RAMPostcopyBlock *b;
+        uint8_t *host;
+        ram_addr_t offset, len;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_HOST_PAGE) {
+            host = host_from_stream_offset(f, addr, flags);
+            b = host ? ram_postcopy_find_block(host) : NULL;
+            if (!b) {
+                ret = -EINVAL;
+                break;
+            }
+            offset = host - b->host;
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                qemu_get_byte(f);
+                ret = ram_postcopy_place(b, offset, NULL);
+            } else {
+                len = MIN(unit, b->block->length - offset);
+                qemu_get_buffer(f, buf, len);
+                memset(buf + len, 0, unit - len);
+                ret = ram_postcopy_place(b, offset, buf);
+            }
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    } while (!ret && !(flags & RAM_SAVE_FLAG_EOS));
+
+    qemu_vfree(buf);
+    if (!ret && postcopy_in.nb_pending) {
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        /* The guest cannot go on without the pages, nor the source, that
+           has stopped.  */
+        fprintf(stderr, "postcopy migration failed with %" PRIu64
+                " page(s) missing: %s\n", postcopy_in.nb_pending,
+                strerror(-ret));
+        exit(1);
+    }
+
+    ram_postcopy_incoming_end();
+    qemu_fclose(f);
+    DPRINTF("Completed postcopy load of VM\n");
+    return NULL;
+}
+
+/* Reads which pages are still to come, drops them and registers the RAM
+ * with userfaultfd.  */
+static int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    ram_addr_t unit = qemu_get_be32(f);
+    struct uffdio_api api = { .api = UFFD_API };
+    struct stat st;
+    RAMBlock *block;
+    int n = 0;
+
+    if (unit != ram_postcopy_page_size()) {
+        fprintf(stderr, "postcopy: host pages of %" PRIu64 " bytes on the"
+                " source, %" PRIu64 " here\n", (uint64_t)unit,
+                (uint64_t)ram_postcopy_page_size());
+        return -EINVAL;
+    }
+    if (mem_path) {
+        fprintf(stderr, "postcopy: not supported with -mem-path\n");
+        return -EINVAL;
+    }
+    postcopy_in.fd = qemu_get_fd(f);
+    if (postcopy_in.fd == -1 || fstat(postcopy_in.fd, &st) < 0 ||
+        !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "postcopy: the migration has to be on a socket\n");
+        return -EINVAL;
+    }
+
+    postcopy_in.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy_in.uffd < 0 || ioctl(postcopy_in.uffd, UFFDIO_API, &api)) {
+        fprintf(stderr, "postcopy: userfaultfd: %s\n", strerror(errno));
+        return -errno;
+    }
+    if (qemu_pipe(postcopy_in.quit_fds) < 0) {
+        close(postcopy_in.uffd);
+        return -errno;
+    }
+    postcopy_in.unit = unit;
+    postcopy_in.nb_pending = 0;
+    qemu_mutex_init(&postcopy_in.lock);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    postcopy_in.blocks = g_new0(RAMPostcopyBlock, n);
+    postcopy_in.nb_blocks = 0;
+
+    while (true) {
+        struct uffdio_register reg = { .mode = UFFDIO_REGISTER_MODE_MISSING };
+        RAMPostcopyBlock *b;
+        uint64_t offset, len;
+        char id[256];
+        uint8_t idlen;
+
+        idlen = qemu_get_byte(f);
+        if (!idlen) {
+            break;
+        }
+        qemu_get_buffer(f, (uint8_t *)id, idlen);
+        id[idlen] = 0;
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strcmp(id, block->idstr)) {
+                break;
+            }
+        }
+        if (!block || postcopy_in.nb_blocks == n) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        b = &postcopy_in.blocks[postcopy_in.nb_blocks++];
+        b->block = block;
+        b->host = memory_region_get_ram_ptr(block->mr);
+        b->length = QEMU_ALIGN_UP(block->length, unit);
+        b->pending = bitmap_new(b->length / unit);
+        b->requested = bitmap_new(b->length / unit);
+        if ((uintptr_t)b->host & (unit - 1)) {
+            fprintf(stderr, "postcopy: block %s not aligned to host pages\n",
+                    id);
+            return -EINVAL;
+        }
+        reg.range.start = (uintptr_t)b->host;
+        reg.range.len = b->length;
+        if (ioctl(postcopy_in.uffd, UFFDIO_REGISTER, &reg)) {
+            fprintf(stderr, "postcopy: cannot register block %s: %s\n",
+                    id, strerror(errno));
+            return -errno;
+        }
+
+        while (true) {
+            offset = qemu_get_be64(f);
+            len = qemu_get_be64(f);
+            if (!len) {
+                break;
+            }
+            if (offset + len > block->length || (offset & (unit - 1))) {
+                return -EINVAL;
+            }
+            len = QEMU_ALIGN_UP(len, unit);
+            qemu_madvise(b->host + offset, len, QEMU_MADV_DONTNEED);
+            bitmap_set(b->pending, offset / unit, len / unit);
+            postcopy_in.nb_pending += len / unit;
+            /* the pages are back to zero until they come */
+            qemu_ram_invalidate(block->offset + offset,
+                                MIN(len, block->length - offset));
+        }
+    }
+
+    qemu_thread_create(&postcopy_in.fault_thread, ram_postcopy_fault_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    postcopy_incoming = true;
+    return qemu_file_get_error(f);
+}
+
+int ram_postcopy_listen(QEMUFile *f)
+{
+    postcopy_incoming = false;
+    /* the thread does not run in a coroutine */
+    socket_set_block(qemu_get_fd(f));
+    qemu_thread_create(&postcopy_in.recv_thread, ram_postcopy_recv_thread,
+                       f, QEMU_THREAD_DETACHED);
+    return 0;
+}
+#else
+static int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    fprintf(stderr, "postcopy: not supported on this host\n");
+    return -EINVAL;
+}
+
+int ram_postcopy_listen(QEMUFile *f)
+{
+    return -ENOSYS;
+}
+#endif
+
+/* Whether the RAM just loaded is in the postcopy phase, and the rest of
+   the stream has to be given to ram_postcopy_listen().  */
+bool ram_postcopy_incoming(void)
+{
+    return postcopy_incoming;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    static uint8_t *page_buf;
     ram_addr_t addr;
     int flags, ret = 0;
     int error;
@@ -775,6 +1876,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
     seq_iter++;
 
+    if (!page_buf) {
+        page_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
     if (version_id < 4 || version_id > 4) {
         return -EINVAL;
     }
@@ -823,6 +1928,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_postcopy_incoming_start(f);
+            if (ret < 0) {
+                goto done;
+            }
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
@@ -833,7 +1945,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
+            memset(page_buf, ch, TARGET_PAGE_SIZE);
+            ram_load_page(host, page_buf);
 #ifndef _WIN32
             if (ch == 0 &&
                 (!kvm_enabled() || kvm_has_sync_mmu()) &&
@@ -849,17 +1962,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            qemu_get_buffer(f, page_buf, TARGET_PAGE_SIZE);
+            ram_load_page(host, page_buf);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 return -EINVAL;
             }
 
-            if (load_xbzrle(f, addr, host) < 0) {
+            /* The page is sent as a difference to what is already there.  */
+            memcpy(page_buf, host, TARGET_PAGE_SIZE);
+            if (load_xbzrle(f, addr, page_buf) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+            ram_load_page(host, page_buf);
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -86,12 +86,8 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
 
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
+static int64_t bdrv_throttle_account(BlockThrottleGroup *tg, bool is_write,
+                                     int nb_sectors);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -125,37 +121,137 @@ int is_windows_drive(const char *filename)
 }
 #endif
 
-/* throttling disk I/O limits */
-void bdrv_io_limits_disable(BlockDriverState *bs)
+/* throttling disk I/O limits
+ *
+ * Each limit is a leaky bucket.  The bytes or the operation of a request
+ * are added to the level of its buckets, which leak at the rate of their
+ * limit.  A request may start while the levels are within the burst
+ * sizes, so bursts go at full speed and the average stays at the limit.
+ *
+ * The buckets belong to a throttle group, which is shared by the drives
+ * that name it and private to a drive otherwise.  Each drive queues its
+ * throttled requests in order; the group wakes the drives in turn, from a
+ * timer set for when the buckets will have leaked enough.
+ */
+struct BlockThrottleGroup {
+    char *name;
+    BlockIOLimit limits;
+    /* Bucket levels, indexed by BLOCK_IO_LIMIT_* */
+    double bytes_level[3];
+    double ios_level[3];
+    /* When the buckets last leaked */
+    int64_t leak_time;
+    QEMUTimer *timer;
+    QLIST_HEAD(, BlockDriverState) members;
+    /* The drive woken last, which the others come after */
+    BlockDriverState *woken;
+    QLIST_ENTRY(BlockThrottleGroup) next;
+};
+
+static QLIST_HEAD(, BlockThrottleGroup) bdrv_throttle_groups =
+    QLIST_HEAD_INITIALIZER(bdrv_throttle_groups);
+
+/* Wake the first throttled request of the next drive that has one, unless
+ * the buckets are too full, in which case the timer will.  */
+static void bdrv_throttle_schedule_next(BlockThrottleGroup *tg)
 {
-    bs->io_limits_enabled = false;
+    BlockDriverState *bs, *start;
 
-    while (qemu_co_queue_next(&bs->throttled_reqs));
+    if (qemu_timer_pending(tg->timer) || QLIST_EMPTY(&tg->members)) {
+        return;
+    }
+
+    start = tg->woken ? tg->woken : QLIST_FIRST(&tg->members);
+    bs = start;
+    do {
+        bs = QLIST_NEXT(bs, throttle_group_next);
+        if (!bs) {
+            bs = QLIST_FIRST(&tg->members);
+        }
+        if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+            tg->woken = bs;
+            qemu_co_queue_next(&bs->throttled_reqs);
+            return;
+        }
+    } while (bs != start);
+}
+
+static void bdrv_throttle_timer(void *opaque)
+{
+    bdrv_throttle_schedule_next(opaque);
+}
+
+static BlockThrottleGroup *bdrv_throttle_group_get(const char *name)
+{
+    BlockThrottleGroup *tg;
 
-    if (bs->block_timer) {
-        qemu_del_timer(bs->block_timer);
-        qemu_free_timer(bs->block_timer);
-        bs->block_timer = NULL;
+    if (name) {
+        QLIST_FOREACH(tg, &bdrv_throttle_groups, next) {
+            if (tg->name && !strcmp(tg->name, name)) {
+                return tg;
+            }
+        }
     }
 
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    tg = g_malloc0(sizeof(*tg));
+    tg->name = g_strdup(name);
+    tg->leak_time = qemu_get_clock_ns(vm_clock);
+    tg->timer = qemu_new_timer_ns(vm_clock, bdrv_throttle_timer, tg);
+    QLIST_INIT(&tg->members);
+    QLIST_INSERT_HEAD(&bdrv_throttle_groups, tg, next);
+    return tg;
 }
 
-static void bdrv_block_timer(void *opaque)
+void bdrv_io_limits_disable(BlockDriverState *bs)
 {
-    BlockDriverState *bs = opaque;
+    BlockThrottleGroup *tg = bs->throttle_group;
+
+    bs->io_limits_enabled = false;
+
+    while (qemu_co_queue_next(&bs->throttled_reqs));
+
+    if (!tg) {
+        return;
+    }
+    bs->throttle_group = NULL;
+    QLIST_REMOVE(bs, throttle_group_next);
+    if (tg->woken == bs) {
+        tg->woken = NULL;
+    }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    if (QLIST_EMPTY(&tg->members)) {
+        QLIST_REMOVE(tg, next);
+        qemu_del_timer(tg->timer);
+        qemu_free_timer(tg->timer);
+        g_free(tg->name);
+        g_free(tg);
+    }
 }
 
+/* Join the throttle group named by the drive, giving it the limits of the
+ * drive, which the other members then share.  */
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
-    qemu_co_queue_init(&bs->throttled_reqs);
-    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
+    BlockThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *member;
+
+    if (!tg) {
+        qemu_co_queue_init(&bs->throttled_reqs);
+        tg = bdrv_throttle_group_get(bs->throttle_group_name);
+        QLIST_INSERT_HEAD(&tg->members, bs, throttle_group_next);
+        bs->throttle_group = tg;
+    }
     bs->io_limits_enabled = true;
+
+    tg->limits = bs->io_limits;
+    QLIST_FOREACH(member, &tg->members, throttle_group_next) {
+        member->io_limits = tg->limits;
+    }
+
+    /* Throttled requests check the new limits */
+    if (qemu_timer_pending(tg->timer)) {
+        qemu_mod_timer(tg->timer, qemu_get_clock_ns(vm_clock));
+    }
 }
 
 bool bdrv_io_limits_enabled(BlockDriverState *bs)
@@ -172,9 +268,17 @@ bool bdrv_io_limits_enabled(BlockDriverState *bs)
 static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      bool is_write, int nb_sectors)
 {
-    int64_t wait_time = -1;
+    BlockThrottleGroup *tg = bs->throttle_group;
+    int64_t wait_time;
+
+    if (!tg) {
+        return;
+    }
 
-    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+    /* Wait for the requests before this one, and for a group that is
+     * already over its limits.  */
+    if (!qemu_co_queue_empty(&bs->throttled_reqs) ||
+        qemu_timer_pending(tg->timer)) {
         qemu_co_queue_wait(&bs->throttled_reqs);
     }
 
@@ -185,13 +289,16 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      * be still in throttled_reqs queue.
      */
 
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
+    while ((tg = bs->throttle_group) != NULL &&
+           (wait_time = bdrv_throttle_account(tg, is_write,
+                                              nb_sectors)) > 0) {
+        qemu_mod_timer(tg->timer, wait_time + qemu_get_clock_ns(vm_clock));
         qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
     }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    if (tg) {
+        bdrv_throttle_schedule_next(tg);
+    }
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -1139,6 +1246,8 @@ void bdrv_reopen_abort(BDRVReopenState *reopen_state)
 }
 
 
+static void bdrv_save_backup_tracking(BlockDriverState *bs);
+
 void bdrv_close(BlockDriverState *bs)
 {
     bdrv_flush(bs);
@@ -1147,6 +1256,7 @@ void bdrv_close(BlockDriverState *bs)
     }
     bdrv_drain_all();
     notifier_list_notify(&bs->close_notifiers, bs);
+    bdrv_save_backup_tracking(bs);
 
     if (bs->drv) {
         if (bs == bs_snapshots) {
@@ -1267,14 +1377,12 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
+    /* i/o throttling */
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttle_group_name = bs_src->throttle_group_name;
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->throttle_group_next = bs_src->throttle_group_next;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
-    bs_dest->block_timer        = bs_src->block_timer;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -1287,6 +1395,8 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->backup_bitmap      = bs_src->backup_bitmap;
+    bs_dest->backup_bitmap_file = bs_src->backup_bitmap_file;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1317,11 +1427,12 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(bs_new->backup_bitmap == NULL);
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1340,7 +1451,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1383,6 +1494,7 @@ void bdrv_delete(BlockDriverState *bs)
     bdrv_close(bs);
 
     assert(bs != bs_snapshots);
+    g_free(bs->throttle_group_name);
     g_free(bs);
 }
 
@@ -2386,6 +2498,10 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
 
+    if (bs->backup_bitmap) {
+        hbitmap_set(bs->backup_bitmap, sector_num, nb_sectors);
+    }
+
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
@@ -2432,6 +2548,14 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
     }
+    if (ret == 0 && bs->backup_bitmap) {
+        /* The next backup has to copy everything again.  */
+        int granularity = hbitmap_granularity(bs->backup_bitmap);
+
+        hbitmap_free(bs->backup_bitmap);
+        bs->backup_bitmap = hbitmap_alloc(bs->total_sectors, granularity);
+        hbitmap_set(bs->backup_bitmap, 0, bs->total_sectors);
+    }
     return ret;
 }
 
@@ -2483,12 +2607,34 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
-/* throttling disk io limits */
+/* throttling disk io limits, shared with the drives of @group unless it is
+ * NULL or empty */
 void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits)
+                        BlockIOLimit *io_limits, const char *group)
 {
+    char *name;
+
+    if (group && !*group) {
+        group = NULL;
+    }
+
+    /* A drive that changes groups leaves its current one first */
+    if (bs->throttle_group && g_strcmp0(group, bs->throttle_group_name)) {
+        bdrv_io_limits_disable(bs);
+    }
+    name = g_strdup(group);
+    g_free(bs->throttle_group_name);
+    bs->throttle_group_name = name;
     bs->io_limits = *io_limits;
-    bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+
+    if (!bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_disable(bs);
+    } else if (bs->drv) {
+        bdrv_io_limits_enable(bs);
+    } else {
+        /* bdrv_open() enables them */
+        bs->io_limits_enabled = true;
+    }
 }
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
@@ -2868,6 +3014,29 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
                            bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
             info->inserted->iops_wr =
                            bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+
+            info->inserted->has_bps_max = true;
+            info->inserted->bps_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL];
+            info->inserted->has_bps_rd_max = true;
+            info->inserted->bps_rd_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_READ];
+            info->inserted->has_bps_wr_max = true;
+            info->inserted->bps_wr_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_WRITE];
+            info->inserted->has_iops_max = true;
+            info->inserted->iops_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL];
+            info->inserted->has_iops_rd_max = true;
+            info->inserted->iops_rd_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_READ];
+            info->inserted->has_iops_wr_max = true;
+            info->inserted->iops_wr_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_WRITE];
+            if (bs->throttle_group_name) {
+                info->inserted->has_group = true;
+                info->inserted->group = g_strdup(bs->throttle_group_name);
+            }
         }
     }
     return info;
@@ -3540,168 +3709,61 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 }
 
 /* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
+static double bdrv_throttle_burst(int64_t avg, int64_t max)
 {
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
+    return max ? max : (double)avg * BLOCK_IO_BURST_TIME /
+                       NANOSECONDS_PER_SECOND;
 }
 
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
+/* Return how long a request has to wait before the buckets it goes in
+ * are within their burst sizes, in nanoseconds.  If it need not, it is
+ * accounted for and 0 is returned.  */
+static int64_t bdrv_throttle_account(BlockThrottleGroup *tg, bool is_write,
+                                     int nb_sectors)
 {
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
+    BlockIOLimit *l = &tg->limits;
+    int kinds[2] = { BLOCK_IO_LIMIT_TOTAL, is_write };
+    double elapsed, wait = 0;
+    int64_t now;
+    int i, k;
 
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
+    now = qemu_get_clock_ns(vm_clock);
+    elapsed = (now - tg->leak_time) / NANOSECONDS_PER_SECOND;
+    tg->leak_time = now;
+    for (k = 0; k < 3; k++) {
+        tg->bytes_level[k] = MAX(tg->bytes_level[k] - l->bps[k] * elapsed, 0);
+        tg->ios_level[k] = MAX(tg->ios_level[k] - l->iops[k] * elapsed, 0);
+    }
+
+    for (i = 0; i < 2; i++) {
+        k = kinds[i];
+        if (l->bps[k]) {
+            wait = MAX(wait, (tg->bytes_level[k] -
+                              bdrv_throttle_burst(l->bps[k], l->bps_max[k])) /
+                             l->bps[k]);
         }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
+        if (l->iops[k]) {
+            wait = MAX(wait, (tg->ios_level[k] -
+                              bdrv_throttle_burst(l->iops[k],
+                                                  l->iops_max[k])) /
+                             l->iops[k]);
         }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
     }
-
-    return true;
-}
-
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
-{
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
+    if (wait > 0) {
+        /* Round up, so that the timer does not fire just too early */
+        return wait * NANOSECONDS_PER_SECOND + 1;
     }
 
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
+    for (i = 0; i < 2; i++) {
+        k = kinds[i];
+        if (l->bps[k]) {
+            tg->bytes_level[k] += (double)nb_sectors * BDRV_SECTOR_SIZE;
         }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
+        if (l->iops[k]) {
+            tg->ios_level[k] += 1;
         }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
     }
-
-    return false;
+    return 0;
 }
 
 /**************************************************************/
@@ -4095,6 +4157,28 @@ void bdrv_invalidate_cache_all(void)
     }
 }
 
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 void bdrv_clear_incoming_migration_all(void)
 {
     BlockDriverState *bs;
@@ -4148,6 +4232,11 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         bdrv_reset_dirty(bs, sector_num, nb_sectors);
     }
 
+    /* Discarded sectors may read differently, so they are backed up.  */
+    if (bs->backup_bitmap) {
+        hbitmap_set(bs->backup_bitmap, sector_num, nb_sectors);
+    }
+
     if (bs->drv->bdrv_co_discard) {
         return bs->drv->bdrv_co_discard(bs, sector_num, nb_sectors);
     } else if (bs->drv->bdrv_aio_discard) {
@@ -4357,6 +4446,88 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     }
 }
 
+/* Start tracking the writes to @bs for incremental backups.  The bitmap
+ * saved in @filename when @bs was last closed is taken over, with its own
+ * granularity; if there is none, or it does not match the size of @bs,
+ * everything is dirty.  The file is removed while tracking is on, so that
+ * a bitmap missing the writes done before a crash is never used.
+ */
+void bdrv_set_backup_tracking(BlockDriverState *bs, const char *filename,
+                              int granularity, Error **errp)
+{
+    int64_t nb_sectors;
+    HBitmap *hb = NULL;
+    gchar *buf;
+    gsize len;
+
+    assert((granularity & (granularity - 1)) == 0);
+    assert(granularity >= BDRV_SECTOR_SIZE);
+
+    if (bs->backup_bitmap) {
+        error_setg(errp, "Device '%s' already tracks writes for backups",
+                   bs->device_name);
+        return;
+    }
+
+    nb_sectors = bdrv_getlength(bs);
+    if (nb_sectors < 0) {
+        error_setg_errno(errp, -nb_sectors, "Could not get the size of '%s'",
+                         bs->device_name);
+        return;
+    }
+    nb_sectors >>= BDRV_SECTOR_BITS;
+
+    if (g_file_get_contents(filename, &buf, &len, NULL)) {
+        hb = hbitmap_deserialize((uint8_t *)buf, len);
+        g_free(buf);
+        if (hb && hbitmap_size(hb) !=
+            DIV_ROUND_UP(nb_sectors, 1 << hbitmap_granularity(hb)) <<
+            hbitmap_granularity(hb)) {
+            hbitmap_free(hb);
+            hb = NULL;
+        }
+    }
+    if (!hb) {
+        granularity >>= BDRV_SECTOR_BITS;
+        hb = hbitmap_alloc(nb_sectors, ffs(granularity) - 1);
+        hbitmap_set(hb, 0, nb_sectors);
+    }
+
+    if (unlink(filename) < 0 && errno != ENOENT) {
+        error_setg_errno(errp, errno, "Could not remove '%s'", filename);
+        hbitmap_free(hb);
+        return;
+    }
+
+    bs->backup_bitmap = hb;
+    bs->backup_bitmap_file = g_strdup(filename);
+}
+
+static void bdrv_save_backup_tracking(BlockDriverState *bs)
+{
+    uint8_t *buf;
+    size_t len;
+    GError *err = NULL;
+
+    if (!bs->backup_bitmap) {
+        return;
+    }
+
+    buf = hbitmap_serialize(bs->backup_bitmap, &len);
+    if (!g_file_set_contents(bs->backup_bitmap_file, (gchar *)buf, len,
+                             &err)) {
+        fprintf(stderr, "Could not save the backup bitmap of '%s': %s\n",
+                bs->device_name, err->message);
+        g_error_free(err);
+    }
+    g_free(buf);
+
+    hbitmap_free(bs->backup_bitmap);
+    bs->backup_bitmap = NULL;
+    g_free(bs->backup_bitmap_file);
+    bs->backup_bitmap_file = NULL;
+}
+
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
     assert(bs->in_use != in_use);
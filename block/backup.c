@@ -0,0 +1,374 @@
+/*
+ * Incremental image backup
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block/blockjob.h"
+#include "block/block_int.h"
+#include "qemu/ratelimit.h"
+
+#define SLICE_TIME    100000000ULL /* ns */
+
+/* Maximum size of one read or write, unless the bitmap is coarser.  */
+#define BACKUP_MAX_OP_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS)
+
+/* Granularity of the bitmap when writes to the source are not tracked.  */
+#define BACKUP_DEFAULT_GRANULARITY 65536
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    bool incremental;
+    BlockdevOnError on_source_error, on_target_error;
+
+    /* What the backup holds, tracked again if the job does not complete */
+    HBitmap *bitmap;
+    /* What is still to be copied, and where to look for it next */
+    HBitmap *todo;
+    int64_t sector_num;
+    int64_t sectors_in_slice;
+
+    int in_flight;
+    int max_in_flight;
+    int ret;
+    bool waiting_for_io;
+} BackupBlockJob;
+
+typedef struct BackupOp {
+    BackupBlockJob *s;
+    QEMUIOVector qiov;
+    void *buf;
+    int64_t sector_num;
+    int nb_sectors;
+} BackupOp;
+
+/* Set in @dst all the bits that are set in @src.  */
+static void backup_bitmap_merge(HBitmap *dst, const HBitmap *src)
+{
+    uint64_t start = 0, count = hbitmap_size(src);
+
+    while (hbitmap_next_dirty_area(src, &start, &count)) {
+        hbitmap_set(dst, start, count);
+        start += count;
+        count = hbitmap_size(src) - start;
+    }
+}
+
+/* See mirror_wait_for_io.  */
+static void coroutine_fn backup_wait_for_io(BackupBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void backup_iteration_done(BackupOp *op, int ret)
+{
+    BackupBlockJob *s = op->s;
+
+    trace_backup_iteration_done(s, op->sector_num, op->nb_sectors, ret);
+
+    s->in_flight--;
+    if (ret >= 0) {
+        s->common.offset += (int64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    qemu_vfree(op->buf);
+    qemu_iovec_destroy(&op->qiov);
+    g_slice_free(BackupOp, op);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* The sectors are copied again, unless the error is reported.  */
+static void backup_error(BackupOp *op, bool read, int ret)
+{
+    BackupBlockJob *s = op->s;
+    BlockErrorAction action;
+
+    hbitmap_set(s->todo, op->sector_num, op->nb_sectors);
+    if (read) {
+        action = block_job_error_action(&s->common, s->common.bs,
+                                        s->on_source_error, true, -ret);
+    } else {
+        action = block_job_error_action(&s->common, s->target,
+                                        s->on_target_error, false, -ret);
+    }
+    if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
+        s->ret = ret;
+    }
+}
+
+static void backup_write_complete(void *opaque, int ret)
+{
+    BackupOp *op = opaque;
+
+    if (ret < 0) {
+        backup_error(op, false, ret);
+    }
+    backup_iteration_done(op, ret);
+}
+
+/* An incremental backup must overwrite what the previous one had there,
+ * so zeroes are written too, but with bdrv_co_write_zeroes().  */
+static void coroutine_fn backup_co_write_zeroes(void *opaque)
+{
+    BackupOp *op = opaque;
+    int ret;
+
+    ret = bdrv_co_write_zeroes(op->s->target, op->sector_num, op->nb_sectors);
+    backup_write_complete(op, ret);
+}
+
+static void backup_read_complete(void *opaque, int ret)
+{
+    BackupOp *op = opaque;
+    BackupBlockJob *s = op->s;
+    Coroutine *co;
+
+    if (ret < 0) {
+        backup_error(op, true, ret);
+        backup_iteration_done(op, ret);
+        return;
+    }
+    if (buffer_is_zero(op->buf, op->qiov.size)) {
+        co = qemu_coroutine_create(backup_co_write_zeroes);
+        qemu_coroutine_enter(co, op);
+        return;
+    }
+    bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
+                    backup_write_complete, op);
+}
+
+/* Start copying the next run of dirty sectors, which must exist.  */
+static void backup_iteration(BackupBlockJob *s)
+{
+    BlockDriverState *source = s->common.bs;
+    uint64_t start, count, max_sectors, end;
+    BackupOp *op;
+
+    end = s->common.bs->total_sectors;
+    start = s->sector_num;
+    count = end - start;
+    if (!hbitmap_next_dirty_area(s->todo, &start, &count)) {
+        /* Sectors behind us failed and have to be copied again.  */
+        start = 0;
+        count = end;
+        hbitmap_next_dirty_area(s->todo, &start, &count);
+    }
+    assert(count > 0);
+
+    /* Both are powers of two, so runs stay aligned to the granularity.  */
+    max_sectors = MAX(BACKUP_MAX_OP_SECTORS,
+                      1 << hbitmap_granularity(s->todo));
+    count = MIN(count, max_sectors);
+    hbitmap_reset(s->todo, start, count);
+    s->sector_num = start + count;
+    s->sectors_in_slice += count;
+
+    op = g_slice_new(BackupOp);
+    op->s = s;
+    op->sector_num = start;
+    op->nb_sectors = count;
+    op->buf = qemu_blockalign(source, count * BDRV_SECTOR_SIZE);
+    qemu_iovec_init(&op->qiov, 1);
+    qemu_iovec_add(&op->qiov, op->buf, count * BDRV_SECTOR_SIZE);
+
+    s->in_flight++;
+    trace_backup_one_iteration(s, op->sector_num, op->nb_sectors);
+    bdrv_aio_readv(source, op->sector_num, &op->qiov, op->nb_sectors,
+                   backup_read_complete, op);
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    BackupBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end;
+    uint64_t last_pause_ns;
+    int ret = 0;
+    int n;
+
+    if (block_job_is_cancelled(&s->common)) {
+        goto immediate_exit;
+    }
+
+    end = bs->total_sectors;
+    if (!s->incremental) {
+        /* Copy everything that is allocated anywhere in the chain, on top
+         * of what was written since the last backup (discarded sectors).
+         */
+        for (sector_num = 0; sector_num < end; sector_num += n) {
+            ret = bdrv_co_is_allocated_above(bs, NULL, sector_num,
+                                             MIN(end - sector_num, INT_MAX),
+                                             &n);
+            if (ret < 0) {
+                goto immediate_exit;
+            }
+
+            assert(n > 0);
+            if (ret == 1) {
+                hbitmap_set(s->bitmap, sector_num, n);
+            }
+        }
+        ret = 0;
+    }
+
+    backup_bitmap_merge(s->todo, s->bitmap);
+    s->common.len = hbitmap_count(s->todo) * BDRV_SECTOR_SIZE;
+
+    last_pause_ns = qemu_get_clock_ns(rt_clock);
+    for (;;) {
+        uint64_t delay_ns;
+        int64_t cnt;
+
+        if (s->ret < 0) {
+            ret = s->ret;
+            goto immediate_exit;
+        }
+
+        cnt = hbitmap_count(s->todo);
+        if (cnt == 0 && s->in_flight == 0) {
+            break;
+        }
+
+        /* As in mirror_run, yield every SLICE_TIME nanoseconds even when
+         * no rate limit is applied.
+         */
+        if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
+            s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
+            if (s->in_flight >= s->max_in_flight || cnt == 0) {
+                backup_wait_for_io(s);
+            } else {
+                backup_iteration(s);
+            }
+            continue;
+        }
+
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit,
+                                                 s->sectors_in_slice);
+        } else {
+            delay_ns = 0;
+        }
+        s->sectors_in_slice = 0;
+
+        trace_backup_before_sleep(s, cnt, s->in_flight, delay_ns);
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            goto immediate_exit;
+        }
+        last_pause_ns = qemu_get_clock_ns(rt_clock);
+    }
+
+    ret = bdrv_flush(s->target);
+
+immediate_exit:
+    while (s->in_flight > 0) {
+        backup_wait_for_io(s);
+    }
+
+    if (ret < 0 || block_job_is_cancelled(&s->common)) {
+        /* The backup is not usable, so the next one has to copy it all.
+         * The image cannot be resized while the job runs, so both bitmaps
+         * have the same size.
+         */
+        if (bs->backup_bitmap) {
+            backup_bitmap_merge(bs->backup_bitmap, s->bitmap);
+        }
+    }
+
+    hbitmap_free(s->todo);
+    hbitmap_free(s->bitmap);
+    bdrv_iostatus_disable(s->target);
+    bdrv_close(s->target);
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void backup_iostatus_reset(BlockJob *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    bdrv_iostatus_reset(s->target);
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size = sizeof(BackupBlockJob),
+    .job_type      = "backup",
+    .set_speed     = backup_set_speed,
+    .iostatus_reset= backup_iostatus_reset,
+};
+
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, bool incremental, int max_in_flight,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    BackupBlockJob *s;
+    int granularity;
+
+    if (incremental && !bs->backup_bitmap) {
+        error_setg(errp, "Writes to device '%s' are not tracked for "
+                   "incremental backups", bdrv_get_device_name(bs));
+        return;
+    }
+
+    if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
+         on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
+        !bdrv_iostatus_is_enabled(bs)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "on-source-error");
+        return;
+    }
+
+    s = block_job_create(&backup_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->on_source_error = on_source_error;
+    s->on_target_error = on_target_error;
+    s->target = target;
+    s->incremental = incremental;
+    s->max_in_flight = max_in_flight;
+
+    /* The job takes the writes tracked so far, and the writes from now on
+     * go to the next backup.
+     */
+    if (bs->backup_bitmap) {
+        granularity = hbitmap_granularity(bs->backup_bitmap);
+        s->bitmap = bs->backup_bitmap;
+        bs->backup_bitmap = hbitmap_alloc(bs->total_sectors, granularity);
+    } else {
+        granularity = ffs(BACKUP_DEFAULT_GRANULARITY >> BDRV_SECTOR_BITS) - 1;
+        s->bitmap = hbitmap_alloc(bs->total_sectors, granularity);
+    }
+    s->todo = hbitmap_alloc(bs->total_sectors, granularity);
+
+    bdrv_set_enable_write_cache(s->target, true);
+    bdrv_set_on_error(s->target, on_target_error, on_target_error);
+    bdrv_iostatus_enable(s->target);
+    s->common.co = qemu_coroutine_create(backup_run);
+    trace_backup_start(bs, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
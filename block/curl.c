@@ -39,16 +39,37 @@
                    CURLPROTO_TFTP)
 
 #define CURL_NUM_STATES 8
-#define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
-#define READ_AHEAD_SIZE (256 * 1024)
-
-#define FIND_RET_NONE   0
-#define FIND_RET_OK     1
-#define FIND_RET_WAIT   2
+#define READ_AHEAD_SIZE (2 * 1024 * 1024)
+
+// The image is cached in clusters, and the least recently used ones go
+// first when the cache is full.
+#define CURL_CLUSTER_SIZE   (64 * 1024)
+#define CURL_CACHE_CLUSTERS 256
+
+// Longest run of clusters fetched by one ranged request.  Longer runs are
+// split, and the parts fetched in parallel.
+#define CURL_FETCH_CLUSTERS 8
+
+enum {
+    CURL_CLUSTER_QUEUED,        // wanted, but not requested yet
+    CURL_CLUSTER_LOADING,
+    CURL_CLUSTER_VALID,
+    CURL_CLUSTER_FAILED,
+};
 
 struct BDRVCURLState;
 
+typedef struct CURLCluster {
+    int64_t index;
+    int state;
+    int refs;                   // waiting requests that read from it
+    size_t len;                 // the last cluster of the image may be short
+    size_t filled;
+    char *buf;
+    QTAILQ_ENTRY(CURLCluster) lru;
+} CURLCluster;
+
 typedef struct CURLAIOCB {
     BlockDriverAIOCB common;
     QEMUBH *bh;
@@ -59,14 +80,20 @@ typedef struct CURLAIOCB {
 
     size_t start;
     size_t end;
+
+    // Clusters read are [first_cluster, last_cluster), clusters read
+    // ahead are [last_cluster, ra_end)
+    int64_t first_cluster;
+    int64_t last_cluster;
+    int64_t ra_end;
+    int ret;
+    QTAILQ_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
     CURL *curl;
-    char *orig_buf;
     size_t buf_start;
     size_t buf_off;
     size_t buf_len;
@@ -81,6 +108,15 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+
+    GHashTable *clusters;
+    QTAILQ_HEAD(CURLClusterHead, CURLCluster) lru;  // most recent first
+    int nb_clusters;
+    int nb_failed;
+    QTAILQ_HEAD(, CURLAIOCB) waiting;
+    size_t seq_next;            // where the next sequential read starts
+    size_t readahead;           // grows up to readahead_size
+    bool started;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -123,106 +159,199 @@ static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
-static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
+static CURLCluster *curl_cluster_find(BDRVCURLState *s, int64_t index)
 {
-    CURLState *s = ((CURLState*)opaque);
-    size_t realsize = size * nmemb;
-    int i;
+    return g_hash_table_lookup(s->clusters, &index);
+}
 
-    DPRINTF("CURL: Just reading %zd bytes\n", realsize);
+static void curl_cluster_free(BDRVCURLState *s, CURLCluster *cl)
+{
+    if (cl->state == CURL_CLUSTER_FAILED)
+        s->nb_failed--;
+    g_hash_table_remove(s->clusters, &cl->index);
+    QTAILQ_REMOVE(&s->lru, cl, lru);
+    s->nb_clusters--;
+    g_free(cl->buf);
+    g_free(cl);
+}
 
-    if (!s || !s->orig_buf)
-        goto read_end;
+// Returns the cluster, most recently used now, and queued for a fetch if
+// it is not cached
+static CURLCluster *curl_cluster_get(BDRVCURLState *s, int64_t index)
+{
+    CURLCluster *cl = curl_cluster_find(s, index);
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+    if (cl) {
+        QTAILQ_REMOVE(&s->lru, cl, lru);
+        if (cl->state == CURL_CLUSTER_FAILED) {
+            s->nb_failed--;
+            cl->state = CURL_CLUSTER_QUEUED;
+        }
+    } else {
+        cl = g_malloc0(sizeof(*cl));
+        cl->index = index;
+        cl->state = CURL_CLUSTER_QUEUED;
+        cl->len = MIN(CURL_CLUSTER_SIZE, s->len - index * CURL_CLUSTER_SIZE);
+        g_hash_table_insert(s->clusters, &cl->index, cl);
+        s->nb_clusters++;
+    }
+    QTAILQ_INSERT_HEAD(&s->lru, cl, lru);
 
-    for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
+    return cl;
+}
+
+// Clusters being fetched or waited for are kept, and the cache only grows
+// past its size when they fill it
+static void curl_cache_evict(BDRVCURLState *s)
+{
+    CURLCluster *cl, *prev;
 
-        if (!acb)
+    for (cl = QTAILQ_LAST(&s->lru, CURLClusterHead);
+         cl && s->nb_clusters > CURL_CACHE_CLUSTERS; cl = prev) {
+        prev = QTAILQ_PREV(cl, CURLClusterHead, lru);
+        if (cl->refs || cl->state == CURL_CLUSTER_LOADING)
             continue;
+        curl_cluster_free(s, cl);
+    }
+}
 
-        if ((s->buf_off >= acb->end)) {
-            qemu_iovec_from_buf(acb->qiov, 0, s->orig_buf + acb->start,
-                                acb->end - acb->start);
-            acb->common.cb(acb->common.opaque, 0);
-            qemu_aio_release(acb);
-            s->acb[i] = NULL;
-        }
+static void curl_copy_request(BDRVCURLState *s, CURLAIOCB *acb)
+{
+    size_t offset = acb->start;
+    size_t end = MAX(acb->start, MIN(acb->end, s->len));
+    size_t n, cl_off;
+    CURLCluster *cl;
+
+    for (; offset < end; offset += n) {
+        cl = curl_cluster_find(s, offset / CURL_CLUSTER_SIZE);
+        cl_off = offset % CURL_CLUSTER_SIZE;
+        n = MIN(end - offset, cl->len - cl_off);
+        qemu_iovec_from_buf(acb->qiov, offset - acb->start,
+                            cl->buf + cl_off, n);
     }
 
-read_end:
-    return realsize;
+    // The last sector may go past the end of the image
+    if (end < acb->end)
+        qemu_iovec_memset(acb->qiov, end - acb->start, 0, acb->end - end);
 }
 
-static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+// Completes the requests whose clusters are all cached, or one of which
+// could not be fetched
+static void curl_complete_requests(BDRVCURLState *s)
 {
-    int i;
-    size_t end = start + len;
+    QTAILQ_HEAD(, CURLAIOCB) done = QTAILQ_HEAD_INITIALIZER(done);
+    CURLAIOCB *acb, *next;
+    CURLCluster *cl, *prev;
+    bool pending, failed;
+    int64_t i;
+
+    QTAILQ_FOREACH_SAFE(acb, &s->waiting, next, next) {
+        pending = failed = false;
+        for (i = acb->first_cluster; i < acb->last_cluster; i++) {
+            cl = curl_cluster_find(s, i);
+            if (cl->state == CURL_CLUSTER_FAILED)
+                failed = true;
+            else if (cl->state != CURL_CLUSTER_VALID)
+                pending = true;
+        }
+        if (pending && !failed)
+            continue;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
-        CURLState *state = &s->states[i];
-        size_t buf_end = (state->buf_start + state->buf_off);
-        size_t buf_fend = (state->buf_start + state->buf_len);
+        QTAILQ_REMOVE(&s->waiting, acb, next);
+        acb->ret = failed ? -EIO : 0;
+        if (!failed)
+            curl_copy_request(s, acb);
+        for (i = acb->first_cluster; i < acb->last_cluster; i++)
+            curl_cluster_find(s, i)->refs--;
+        QTAILQ_INSERT_TAIL(&done, acb, next);
+    }
 
-        if (!state->orig_buf)
-            continue;
-        if (!state->buf_off)
-            continue;
+    // Failed clusters are fetched again by the next request for them
+    for (cl = QTAILQ_LAST(&s->lru, CURLClusterHead); cl && s->nb_failed;
+         cl = prev) {
+        prev = QTAILQ_PREV(cl, CURLClusterHead, lru);
+        if (cl->state == CURL_CLUSTER_FAILED && !cl->refs)
+            curl_cluster_free(s, cl);
+    }
+    curl_cache_evict(s);
+
+    // The callbacks may start new requests, so the lists are left alone
+    // from here on
+    QTAILQ_FOREACH_SAFE(acb, &done, next, next) {
+        acb->common.cb(acb->common.opaque, acb->ret);
+        qemu_aio_release(acb);
+    }
+}
+
+static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
+{
+    CURLState *s = ((CURLState*)opaque);
+    size_t realsize = size * nmemb;
+    size_t len = realsize;
+    const char *p = ptr;
+    CURLCluster *cl;
+    bool done = false;
+    size_t n;
 
-        // Does the existing buffer cover our section?
-        if ((start >= state->buf_start) &&
-            (start <= buf_end) &&
-            (end >= state->buf_start) &&
-            (end <= buf_end))
-        {
-            char *buf = state->orig_buf + (start - state->buf_start);
+    DPRINTF("CURL: Just reading %zd bytes\n", realsize);
 
-            qemu_iovec_from_buf(acb->qiov, 0, buf, len);
-            acb->common.cb(acb->common.opaque, 0);
+    if (!s || !s->in_use)
+        goto read_end;
 
-            return FIND_RET_OK;
+    // Anything past the range asked for is dropped
+    while (len && s->buf_off < s->buf_len) {
+        cl = curl_cluster_find(s->s,
+                               (s->buf_start + s->buf_off) / CURL_CLUSTER_SIZE);
+        assert(cl && cl->state == CURL_CLUSTER_LOADING);
+
+        n = MIN(len, cl->len - cl->filled);
+        memcpy(cl->buf + cl->filled, p, n);
+        cl->filled += n;
+        s->buf_off += n;
+        p += n;
+        len -= n;
+
+        if (cl->filled == cl->len) {
+            cl->state = CURL_CLUSTER_VALID;
+            done = true;
         }
+    }
 
-        // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
-            (start <= buf_fend) &&
-            (end >= state->buf_start) &&
-            (end <= buf_fend))
-        {
-            int j;
-
-            acb->start = start - state->buf_start;
-            acb->end = acb->start + len;
-
-            for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
-                    return FIND_RET_WAIT;
-                }
-            }
+    if (done)
+        curl_complete_requests(s->s);
+
+read_end:
+    return realsize;
+}
+
+// The clusters of the transfer that did not arrive are failed
+static void curl_fetch_done(CURLState *state, CURLcode result)
+{
+    BDRVCURLState *s = state->s;
+    CURLCluster *cl;
+    int64_t i;
+
+    if (result != CURLE_OK)
+        DPRINTF("CURL: Range %s failed: %s\n", state->range, state->errmsg);
+
+    for (i = state->buf_start / CURL_CLUSTER_SIZE;
+         i < DIV_ROUND_UP(state->buf_start + state->buf_len,
+                          CURL_CLUSTER_SIZE); i++) {
+        cl = curl_cluster_find(s, i);
+        if (cl && cl->state == CURL_CLUSTER_LOADING) {
+            cl->state = CURL_CLUSTER_FAILED;
+            s->nb_failed++;
         }
     }
 
-    return FIND_RET_NONE;
+    if (s->nb_failed)
+        curl_complete_requests(s);
 }
 
-static void curl_multi_do(void *arg)
+static void curl_multi_read(BDRVCURLState *s)
 {
-    BDRVCURLState *s = (BDRVCURLState *)arg;
-    int running;
-    int r;
     int msgs_in_queue;
 
-    if (!s->multi)
-        return;
-
-    do {
-        r = curl_multi_socket_all(s->multi, &running);
-    } while(r == CURLM_CALL_MULTI_PERFORM);
-
     /* Try to find done transfers, so we can free the easy
      * handle again. */
     do {
@@ -238,25 +367,13 @@ static void curl_multi_do(void *arg)
             case CURLMSG_DONE:
             {
                 CURLState *state = NULL;
-                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
+                CURLcode result = msg->data.result;
 
-                /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
-                    int i;
-                    for (i = 0; i < CURL_NUM_ACB; i++) {
-                        CURLAIOCB *acb = state->acb[i];
-
-                        if (acb == NULL) {
-                            continue;
-                        }
-
-                        acb->common.cb(acb->common.opaque, -EIO);
-                        qemu_aio_release(acb);
-                        state->acb[i] = NULL;
-                    }
-                }
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
 
+                /* The clusters that arrived were completed in curl_read_cb */
                 curl_clean_state(state);
+                curl_fetch_done(state, result);
                 break;
             }
             default:
@@ -269,32 +386,27 @@ static void curl_multi_do(void *arg)
 static CURLState *curl_init_state(BDRVCURLState *s)
 {
     CURLState *state = NULL;
-    int i, j;
+    int i;
 
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
+    for (i=0; i<CURL_NUM_STATES; i++) {
+        if (s->states[i].in_use)
+            continue;
 
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
-        }
-        if (!state) {
-            g_usleep(100);
-            curl_multi_do(s);
-        }
-    } while(!state);
+        state = &s->states[i];
+        state->in_use = 1;
+        break;
+    }
+    if (!state)
+        return NULL;
 
     if (state->curl)
         goto has_curl;
 
     state->curl = curl_easy_init();
-    if (!state->curl)
+    if (!state->curl) {
+        state->in_use = 0;
         return NULL;
+    }
     curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
     curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
@@ -335,6 +447,105 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+// Starts a ranged request for the n queued clusters from index.  Returns
+// -EBUSY when all the connections are in use.
+static int curl_fetch(BDRVCURLState *s, int64_t index, int64_t n)
+{
+    CURLState *state;
+    CURLCluster *cl;
+    size_t end;
+    int64_t i;
+
+    state = curl_init_state(s);
+    if (!state) {
+        for (i = 0; i < CURL_NUM_STATES; i++) {
+            if (s->states[i].in_use)
+                return -EBUSY;
+        }
+
+        // No transfer to wait for, so no connection will be free later on
+        for (i = index; i < index + n; i++) {
+            curl_cluster_find(s, i)->state = CURL_CLUSTER_FAILED;
+            s->nb_failed++;
+        }
+        return -EIO;
+    }
+
+    for (i = index; i < index + n; i++) {
+        cl = curl_cluster_find(s, i);
+        cl->state = CURL_CLUSTER_LOADING;
+        cl->filled = 0;
+        if (!cl->buf)
+            cl->buf = g_malloc(cl->len);
+    }
+
+    state->buf_start = index * CURL_CLUSTER_SIZE;
+    end = MIN((index + n) * CURL_CLUSTER_SIZE, s->len);
+    state->buf_len = end - state->buf_start;
+    state->buf_off = 0;
+
+    snprintf(state->range, 127, "%zd-%zd", state->buf_start, end - 1);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n",
+            state->buf_len, state->buf_start, state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+    s->started = true;
+
+    return 0;
+}
+
+// Fetches the queued clusters of the waiting requests, oldest request
+// first, with as many requests in parallel as there are connections
+static void curl_schedule(BDRVCURLState *s)
+{
+    CURLAIOCB *acb;
+    CURLCluster *cl;
+    int64_t i, n;
+    int ret;
+
+    QTAILQ_FOREACH(acb, &s->waiting, next) {
+        for (i = acb->first_cluster; i < acb->ra_end; i += MAX(n, 1)) {
+            for (n = 0; n < CURL_FETCH_CLUSTERS && i + n < acb->ra_end; n++) {
+                cl = curl_cluster_find(s, i + n);
+                if (!cl || cl->state != CURL_CLUSTER_QUEUED)
+                    break;
+            }
+            if (!n)
+                continue;
+
+            ret = curl_fetch(s, i, n);
+            if (ret == -EIO)
+                curl_complete_requests(s);
+            if (ret < 0)
+                return;
+        }
+    }
+}
+
+static void curl_multi_do(void *arg)
+{
+    BDRVCURLState *s = (BDRVCURLState *)arg;
+    int running;
+    int r;
+
+    if (!s->multi)
+        return;
+
+    // Requests for queued clusters start as transfers finish, and libcurl
+    // only sends them when called again
+    do {
+        s->started = false;
+
+        do {
+            r = curl_multi_socket_all(s->multi, &running);
+        } while(r == CURLM_CALL_MULTI_PERFORM);
+
+        curl_multi_read(s);
+        curl_schedule(s);
+    } while (s->started);
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
@@ -414,6 +625,10 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    s->clusters = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->waiting);
+
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
@@ -436,16 +651,9 @@ out_noclean:
 static int curl_aio_flush(void *opaque)
 {
     BDRVCURLState *s = opaque;
-    int i, j;
 
-    for (i=0; i < CURL_NUM_STATES; i++) {
-        for(j=0; j < CURL_NUM_ACB; j++) {
-            if (s->states[i].acb[j]) {
-                return 1;
-            }
-        }
-    }
-    return 0;
+    // Transfers that only read ahead are not waited for
+    return !QTAILQ_EMPTY(&s->waiting);
 }
 
 static void curl_aio_cancel(BlockDriverAIOCB *blockacb)
@@ -461,57 +669,51 @@ static const AIOCBInfo curl_aiocb_info = {
 
 static void curl_readv_bh_cb(void *p)
 {
-    CURLState *state;
-
     CURLAIOCB *acb = p;
     BDRVCURLState *s = acb->common.bs->opaque;
+    size_t end;
+    int64_t i;
 
     qemu_bh_delete(acb->bh);
     acb->bh = NULL;
 
-    size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
-
-    // In case we have the requested data already (e.g. read-ahead),
-    // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
-        case FIND_RET_OK:
-            qemu_aio_release(acb);
-            // fall through
-        case FIND_RET_WAIT:
-            return;
-        default:
-            break;
-    }
-
-    // No cache found, so let's start a new request
-    state = curl_init_state(s);
-    if (!state) {
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
-        return;
+    acb->start = acb->sector_num * SECTOR_SIZE;
+    acb->end = acb->start + acb->nb_sectors * SECTOR_SIZE;
+    end = MIN(acb->end, s->len);
+
+    // Read ahead further and further while the reads are sequential, and
+    // not at all for random reads
+    if (acb->start == s->seq_next) {
+        s->readahead = MIN(MAX(s->readahead * 2, CURL_CLUSTER_SIZE),
+                           s->readahead_size);
+    } else {
+        s->readahead = 0;
     }
+    s->seq_next = acb->end;
+
+    acb->first_cluster = acb->start / CURL_CLUSTER_SIZE;
+    if (end > acb->start)
+        acb->last_cluster = DIV_ROUND_UP(end, CURL_CLUSTER_SIZE);
+    else
+        acb->last_cluster = acb->first_cluster;
+    acb->ra_end = MIN(acb->last_cluster +
+                      DIV_ROUND_UP(s->readahead, CURL_CLUSTER_SIZE),
+                      DIV_ROUND_UP(s->len, CURL_CLUSTER_SIZE));
+
+    for (i = acb->first_cluster; i < acb->last_cluster; i++)
+        curl_cluster_get(s, i)->refs++;
+    for (; i < acb->ra_end; i++)
+        curl_cluster_get(s, i);
+    curl_cache_evict(s);
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
-
-    state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_malloc(state->buf_len);
-    state->acb[0] = acb;
-
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
-    curl_multi_do(s);
+    // In case we have the requested data already (e.g. read-ahead),
+    // the request completes now, but still reads further ahead
+    QTAILQ_INSERT_TAIL(&s->waiting, acb, next);
+    curl_schedule(s);
+    curl_complete_requests(s);
 
+    if (s->started)
+        curl_multi_do(s);
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -550,10 +752,11 @@ static void curl_close(BlockDriverState *bs)
             curl_easy_cleanup(s->states[i].curl);
             s->states[i].curl = NULL;
         }
-        if (s->states[i].orig_buf) {
-            g_free(s->states[i].orig_buf);
-            s->states[i].orig_buf = NULL;
-        }
+    }
+    if (s->clusters) {
+        while (!QTAILQ_EMPTY(&s->lru))
+            curl_cluster_free(s, QTAILQ_FIRST(&s->lru));
+        g_hash_table_destroy(s->clusters);
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
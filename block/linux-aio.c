@@ -40,6 +40,11 @@ struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
     int count;
+
+    /* requests held back while plugged */
+    struct iocb *pending[MAX_EVENTS];
+    int npending;
+    int plugged;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -77,6 +82,32 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Submits the requests held back while plugged, with as few io_submit calls
+ * as the kernel allows.  Those it refuses are completed with its error.
+ */
+static void qemu_laio_submit_pending(struct qemu_laio_state *s)
+{
+    int done = 0, ret = 0, i;
+
+    while (done < s->npending) {
+        ret = io_submit(s->ctx, s->npending - done, &s->pending[done]);
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    for (i = done; i < s->npending; i++) {
+        struct qemu_laiocb *laiocb =
+                container_of(s->pending[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+    }
+    s->npending = 0;
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
@@ -105,18 +136,35 @@ static int qemu_laio_flush_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
+    /* whoever waits for the requests does not want them held back */
+    if (s->npending) {
+        qemu_laio_submit_pending(s);
+    }
     return (s->count > 0) ? 1 : 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
-    int ret;
+    int i, ret;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* a request still held back can just be dropped */
+    for (i = 0; i < s->npending; i++) {
+        if (s->pending[i] == &laiocb->iocb) {
+            memmove(&s->pending[i], &s->pending[i + 1],
+                    (s->npending - i - 1) * sizeof(s->pending[0]));
+            s->npending--;
+            s->count--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -179,6 +227,14 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
+    if (s->plugged) {
+        s->pending[s->npending++] = iocbs;
+        if (s->npending == MAX_EVENTS) {
+            qemu_laio_submit_pending(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -190,6 +246,23 @@ out_free_aiocb:
     return NULL;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->npending) {
+        qemu_laio_submit_pending(s);
+    }
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
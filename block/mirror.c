@@ -18,7 +18,6 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -46,7 +45,9 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_in_flight;
     int ret;
+    bool waiting_for_io;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -56,6 +57,17 @@ typedef struct MirrorOp {
     int nb_sectors;
 } MirrorOp;
 
+/* Operations only wake up the job when it waits for them.  It can also
+ * be waiting for a bdrv_co_*() call of its own, which is not to be
+ * interrupted.  */
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -94,8 +106,11 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
         bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
     }
 
+    qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
-    qemu_coroutine_enter(s->common.co, NULL);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
 }
 
 static void mirror_write_complete(void *opaque, int ret)
@@ -115,6 +130,38 @@ static void mirror_write_complete(void *opaque, int ret)
     mirror_iteration_done(op, ret);
 }
 
+/* Zeroes are written with bdrv_co_write_zeroes(), so that the target
+ * stays sparse where the format allows.  */
+static void coroutine_fn mirror_co_write_zeroes(void *opaque)
+{
+    MirrorOp *op = opaque;
+    int ret;
+
+    ret = bdrv_co_write_zeroes(op->s->target, op->sector_num, op->nb_sectors);
+    mirror_write_complete(op, ret);
+}
+
+static void mirror_write_zeroes(MirrorOp *op)
+{
+    Coroutine *co;
+
+    trace_mirror_write_zeroes(op->s, op->sector_num, op->nb_sectors);
+    co = qemu_coroutine_create(mirror_co_write_zeroes);
+    qemu_coroutine_enter(co, op);
+}
+
+static bool mirror_qiov_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (!buffer_is_zero(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void mirror_read_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
@@ -132,6 +179,10 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    if (mirror_qiov_is_zero(&op->qiov)) {
+        mirror_write_zeroes(op);
+        return;
+    }
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
@@ -142,6 +193,8 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int nb_sectors, sectors_per_chunk, nb_chunks;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
     MirrorOp *op;
+    bool zero;
+    int ret, n;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
     if (s->sector_num < 0) {
@@ -177,7 +230,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 
     do {
@@ -213,7 +266,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -229,6 +282,12 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_chunk += added_chunks;
     } while (next_sector < end);
 
+    /* Nothing in the backing chain has data for these sectors, so they
+     * read as zeroes and need not be read at all.
+     */
+    ret = bdrv_co_is_allocated_above(source, NULL, sector_num, nb_sectors, &n);
+    zero = ret == 0 && n == nb_sectors;
+
     /* Allocate a MirrorOp that is used as an AIO callback.  */
     op = g_slice_new(MirrorOp);
     op->s = s;
@@ -236,15 +295,17 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->nb_sectors = nb_sectors;
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
-     * from s->buf_free.
+     * from s->buf_free.  Zeroes are written without a buffer.
      */
-    qemu_iovec_init(&op->qiov, nb_chunks);
+    qemu_iovec_init(&op->qiov, zero ? 1 : nb_chunks);
     next_sector = sector_num;
     while (nb_chunks-- > 0) {
-        MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
-        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
-        s->buf_free_count--;
-        qemu_iovec_add(&op->qiov, buf, s->granularity);
+        if (!zero) {
+            MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
+            QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+            s->buf_free_count--;
+            qemu_iovec_add(&op->qiov, buf, s->granularity);
+        }
 
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
@@ -261,6 +322,10 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Copy the dirty cluster.  */
     s->in_flight++;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
+    if (zero) {
+        mirror_write_zeroes(op);
+        return;
+    }
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
 }
@@ -285,7 +350,7 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -376,10 +441,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 mirror_iteration(s);
@@ -534,7 +599,8 @@ static BlockJobType mirror_job_type = {
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  int max_in_flight, MirrorSyncMode mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -573,6 +639,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->mode = mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = max_in_flight;
 
     bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
@@ -27,33 +27,108 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables are found by their offset through a hash index, and replaced in
+ * CLOCK order: the hand skips, and clears the referenced flag of, tables
+ * that have been used since it last passed them.
+ */
+
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;
     int     ref;
+    /* Next table in the same hash bucket, or -1 */
+    int     next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                tables;
+    int*                    buckets;
+    int                     bucket_mask;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
+    int                     clock_hand;
     bool                    depends_on_flush;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + (size_t)i * c->table_size;
+}
+
+static inline int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t off = (uint8_t *)table - c->tables;
+
+    if (off < 0 || off >= (ptrdiff_t)c->size * c->table_size ||
+        off % c->table_size) {
+        return -1;
+    }
+    return off / c->table_size;
+}
+
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return &c->buckets[(offset / c->table_size) & c->bucket_mask];
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    c->entries[i].next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].next;
+    }
+    *p = c->entries[i].next;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0; i = c->entries[i].next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
-    int i;
+    int i, num_buckets;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = s->cluster_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables * s->cluster_size);
 
+    num_buckets = 1;
+    while (num_buckets < num_tables * 2) {
+        num_buckets <<= 1;
+    }
+    c->bucket_mask = num_buckets - 1;
+    c->buckets = g_malloc(sizeof(*c->buckets) * num_buckets);
+    for (i = 0; i < num_buckets; i++) {
+        c->buckets[i] = -1;
+    }
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].next = -1;
     }
 
     return c;
@@ -65,9 +140,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -120,7 +196,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset, qcow2_cache_table(c, i),
         s->cluster_size);
     if (ret < 0) {
         return ret;
@@ -187,32 +263,26 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n;
 
+    /* The first round may only clear referenced flags */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
 
-    for (i = 0; i < c->size; i++) {
+        c->clock_hand = (c->clock_hand + 1) % c->size;
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -226,10 +296,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -247,28 +316,30 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
     c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_table(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,16 +361,12 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +376,10 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    if (i < 0) {
+        abort();
     }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
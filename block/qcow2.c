@@ -28,6 +28,7 @@
 #include "block/aes.h"
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
+#include "qemu/config-file.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
 
@@ -285,12 +286,39 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/* The cache sizes given with -qcow2, in tables of the image's cluster
+   size.  */
+static void qcow2_cache_sizes(BDRVQcowState *s, int *l2_tables,
+                              int *refcount_tables)
+{
+    QemuOptsList *list = qemu_find_opts("qcow2");
+    QemuOpts *opts = list ? QTAILQ_FIRST(&list->head) : NULL;
+    uint64_t l2_size, refcount_size;
+
+    *l2_tables = L2_CACHE_SIZE;
+    *refcount_tables = REFCOUNT_CACHE_SIZE;
+    if (!opts) {
+        return;
+    }
+
+    l2_size = qemu_opt_get_size(opts, "l2-cache-size",
+                                (uint64_t)L2_CACHE_SIZE * s->cluster_size);
+    refcount_size = qemu_opt_get_size(opts, "refcount-cache-size",
+                                      (uint64_t)REFCOUNT_CACHE_SIZE *
+                                      s->cluster_size);
+    *l2_tables = MIN(MAX(l2_size / s->cluster_size, MIN_L2_CACHE_SIZE),
+                     MAX_CACHE_SIZE);
+    *refcount_tables = MIN(MAX(refcount_size / s->cluster_size,
+                               REFCOUNT_CACHE_SIZE), MAX_CACHE_SIZE);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -430,8 +458,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    qcow2_cache_sizes(s, &l2_cache_size, &refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -1119,6 +1148,66 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
     return qcow2_update_header(bs);
 }
 
+enum {
+    PREALLOC_OFF,
+    PREALLOC_METADATA,
+    PREALLOC_FALLOC,            /* metadata, and space for all data */
+};
+
+/*
+ * Size of an image with all metadata and data clusters preallocated for
+ * TOTAL_SIZE bytes of guest data.  Refcount blocks and the refcount
+ * table count themselves as well, hence the loop.
+ */
+static int64_t preallocated_file_size(int64_t total_size, int cluster_size)
+{
+    int64_t clusters, l2_tables, l1_clusters;
+    int64_t refblocks = 0, reftable = 0, prev;
+
+    clusters = align_offset(total_size, cluster_size) / cluster_size;
+    l2_tables = DIV_ROUND_UP(clusters, cluster_size / sizeof(uint64_t));
+    l1_clusters = DIV_ROUND_UP(l2_tables * sizeof(uint64_t), cluster_size);
+
+    /* Header, data, L2 tables and L1 table */
+    clusters += 1 + l2_tables + l1_clusters;
+    do {
+        prev = refblocks + reftable;
+        refblocks = DIV_ROUND_UP(clusters + refblocks + reftable,
+                                 cluster_size / sizeof(uint16_t));
+        reftable = DIV_ROUND_UP(refblocks * sizeof(uint64_t), cluster_size);
+    } while (refblocks + reftable != prev);
+
+    return (clusters + refblocks + reftable) * cluster_size;
+}
+
+/* Create the image file with all of its space allocated */
+static int create_preallocated_file(const char *filename, int64_t size)
+{
+    BlockDriver *drv;
+    QEMUOptionParameter *options;
+    int ret;
+
+    drv = bdrv_find_protocol(filename);
+    if (drv == NULL) {
+        return -ENOENT;
+    }
+
+    options = append_option_parameters(NULL, drv->create_options);
+    set_option_parameter_int(options, BLOCK_OPT_SIZE, size);
+    if (!get_option_parameter(options, BLOCK_OPT_PREALLOC)) {
+        error_report("Protocol '%s' does not support preallocation=falloc",
+                     drv->format_name);
+        ret = -ENOTSUP;
+        goto out;
+    }
+    set_option_parameter(options, BLOCK_OPT_PREALLOC, "falloc");
+
+    ret = bdrv_create(drv, filename, options);
+out:
+    free_option_parameters(options);
+    return ret;
+}
+
 static int preallocate(BlockDriverState *bs)
 {
     uint64_t nb_sectors;
@@ -1151,8 +1240,6 @@ static int preallocate(BlockDriverState *bs)
             QLIST_REMOVE(meta, next_in_flight);
         }
 
-        /* TODO Preallocate data if requested */
-
         nb_sectors -= num;
         offset += num << 9;
     }
@@ -1208,7 +1295,13 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     uint8_t* refcount_table;
     int ret;
 
-    ret = bdrv_create_file(filename, options);
+    if (prealloc == PREALLOC_FALLOC) {
+        ret = create_preallocated_file(filename,
+            preallocated_file_size(total_size * BDRV_SECTOR_SIZE,
+                                   cluster_size));
+    } else {
+        ret = bdrv_create_file(filename, options);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -1318,7 +1411,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     uint64_t sectors = 0;
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
-    int prealloc = 0;
+    int prealloc = PREALLOC_OFF;
     int version = 2;
 
     /* Read out options */
@@ -1337,9 +1430,11 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             }
         } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
             if (!options->value.s || !strcmp(options->value.s, "off")) {
-                prealloc = 0;
+                prealloc = PREALLOC_OFF;
             } else if (!strcmp(options->value.s, "metadata")) {
-                prealloc = 1;
+                prealloc = PREALLOC_METADATA;
+            } else if (!strcmp(options->value.s, "falloc")) {
+                prealloc = PREALLOC_FALLOC;
             } else {
                 fprintf(stderr, "Invalid preallocation mode: '%s'\n",
                     options->value.s);
@@ -1670,7 +1765,7 @@ static QEMUOptionParameter qcow2_create_options[] = {
     {
         .name = BLOCK_OPT_PREALLOC,
         .type = OPT_STRING,
-        .help = "Preallocation mode (allowed values: off, metadata)"
+        .help = "Preallocation mode (allowed values: off, metadata, falloc)"
     },
     {
         .name = BLOCK_OPT_LAZY_REFCOUNTS,
@@ -1719,9 +1814,27 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_check = qcow2_check,
 };
 
+static QemuOptsList qemu_qcow2_opts = {
+    .name = "qcow2",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_qcow2_opts.head),
+    .desc = {
+        {
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the L2 table cache of each image",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the refcount block cache of each image",
+        },
+        { /* end of list */ }
+    },
+};
+
 static void bdrv_qcow2_init(void)
 {
     bdrv_register(&bdrv_qcow2);
+    qemu_add_opts(&qemu_qcow2_opts);
 }
 
 block_init(bdrv_qcow2_init);
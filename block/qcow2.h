@@ -52,10 +52,14 @@
 #define MAX_CLUSTER_BITS 21
 
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Upper bound for -qcow2 l2-cache-size and refcount-cache-size, in tables */
+#define MAX_CACHE_SIZE (1 << 20)
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 typedef struct QCowHeader {
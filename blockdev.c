@@ -275,6 +275,21 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
     return true;
 }
 
+/* A burst size needs the rate it is a burst of */
+static bool do_check_io_bursts(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if ((io_limits->bps_max[i] && !io_limits->bps[i]) ||
+            (io_limits->iops_max[i] && !io_limits->iops[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
 {
     const char *buf;
@@ -426,6 +441,18 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
 
     if (!do_check_io_limits(&io_limits)) {
         error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
@@ -433,6 +460,12 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
         return NULL;
     }
 
+    if (!do_check_io_bursts(&io_limits)) {
+        error_report("a burst size (bps_max, iops_rd_max, ...) needs "
+                     "the matching limit");
+        return NULL;
+    }
+
     if (qemu_opt_get(opts, "boot") != NULL) {
         fprintf(stderr, "qemu-kvm: boot=on|off is deprecated and will be "
                 "ignored. Future versions will reject this parameter. Please "
@@ -552,7 +585,8 @@ DriveInfo *drive_init(QemuOpts *opts, BlockInterfaceType block_default_type)
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
     /* disk I/O throttling */
-    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits,
+                       qemu_opt_get(opts, "throttle_group"));
 
     switch(type) {
     case IF_IDE:
@@ -957,7 +991,15 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
@@ -974,24 +1016,21 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
-
-    if (!do_check_io_limits(&io_limits)) {
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL] = has_bps_max ? bps_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]  = has_bps_rd_max ? bps_rd_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE] = has_bps_wr_max ? bps_wr_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL]= has_iops_max ? iops_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ] = has_iops_rd_max ? iops_rd_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE]= has_iops_wr_max ? iops_wr_max : 0;
+
+    if (!do_check_io_limits(&io_limits) || !do_check_io_bursts(&io_limits)) {
         error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
-
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
-        }
-    }
+    /* Without a group, the drive stays in the one it is in */
+    bdrv_set_io_limits(bs, &io_limits,
+                       has_group ? group : bs->throttle_group_name);
 }
 
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -1190,6 +1229,7 @@ void qmp_block_commit(const char *device,
 }
 
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
+#define DEFAULT_MIRROR_IN_FLIGHT  16
 
 void qmp_drive_mirror(const char *device, const char *target,
                       bool has_format, const char *format,
@@ -1198,6 +1238,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_granularity, uint32_t granularity,
                       bool has_buf_size, int64_t buf_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -1229,6 +1270,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = DEFAULT_MIRROR_IN_FLIGHT;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
@@ -1238,6 +1282,10 @@ void qmp_drive_mirror(const char *device, const char *target,
         error_set(errp, QERR_INVALID_PARAMETER, device);
         return;
     }
+    if (max_in_flight < 1 || max_in_flight > INT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1319,7 +1367,159 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
-    mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
+    mirror_start(bs, target_bs, speed, granularity, buf_size, max_in_flight,
+                 sync, on_source_error, on_target_error,
+                 block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
+void qmp_block_backup_tracking(const char *device, const char *file,
+                               bool has_granularity, uint32_t granularity,
+                               Error **errp)
+{
+    BlockDriverState *bs;
+
+    if (!has_granularity) {
+        granularity = 65536;
+    }
+    if (granularity < 512 || granularity > 1048576 * 64 ||
+        (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    bdrv_set_backup_tracking(bs, file, granularity, errp);
+}
+
+#define DEFAULT_BACKUP_IN_FLIGHT  16
+
+void qmp_drive_backup(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_incremental, bool incremental,
+                      bool has_speed, int64_t speed,
+                      bool has_max_in_flight, int64_t max_in_flight,
+                      bool has_on_source_error, BlockdevOnError on_source_error,
+                      bool has_on_target_error, BlockdevOnError on_target_error,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *target_bs;
+    BlockDriver *proto_drv;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int flags;
+    int64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_on_source_error) {
+        on_source_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_on_target_error) {
+        on_target_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+    if (!has_incremental) {
+        incremental = false;
+    }
+    if (!has_max_in_flight) {
+        max_in_flight = DEFAULT_BACKUP_IN_FLIGHT;
+    }
+
+    if (max_in_flight < 1 || max_in_flight > INT_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : "qcow2";
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    proto_drv = bdrv_find_protocol(target);
+    if (!proto_drv) {
+        error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+        return;
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_setg_errno(errp, -size, "bdrv_getlength failed");
+        return;
+    }
+
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        assert(format && drv);
+        bdrv_img_create(target, format,
+                        NULL, NULL, NULL, size, flags, &local_err);
+    }
+
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* The backing file of an existing target is opened, so that writes
+     * smaller than its clusters can copy the rest from there.
+     */
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    backup_start(bs, target_bs, speed, incremental, max_in_flight,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -1545,6 +1745,34 @@ QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations allowed in a burst",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations allowed in a burst",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations allowed in a burst",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes allowed in a burst",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes allowed in a burst",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes allowed in a burst",
+        },{
+            .name = "throttle_group",
+            .type = QEMU_OPT_STRING,
+            .help = "share the I/O limits with the drives of this group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -53,6 +53,7 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     job->cb            = cb;
     job->opaque        = opaque;
     job->busy          = true;
+    job->start_ns      = qemu_get_clock_ns(rt_clock);
     bs->job = job;
 
     /* Only set speed when necessary to avoid NotSupported error */
@@ -208,6 +209,9 @@ void block_job_sleep_ns(BlockJob *job, QEMUClock *clock, int64_t ns)
 BlockJobInfo *block_job_query(BlockJob *job)
 {
     BlockJobInfo *info = g_new0(BlockJobInfo, 1);
+    int64_t elapsed_ms = (qemu_get_clock_ns(rt_clock) - job->start_ns) /
+                         SCALE_MS;
+
     info->type      = g_strdup(job->job_type->job_type);
     info->device    = g_strdup(bdrv_get_device_name(job->bs));
     info->len       = job->len;
@@ -216,6 +220,7 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->offset    = job->offset;
     info->speed     = job->speed;
     info->io_status = job->iostatus;
+    info->throughput = job->offset * 1000 / MAX(elapsed_ms, 1);
     return info;
 }
 
@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <ucontext.h>
+#include <sys/mman.h>
 #include "qemu-common.h"
 #include "block/coroutine_int.h"
 
@@ -35,13 +36,13 @@
 #endif
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
-};
+    /* Freed coroutines a thread always keeps for reuse */
+    POOL_MIN_SIZE = 64,
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+    /* Up to this many are kept when the thread has had that many live at
+     * once, so that a burst of requests does not allocate every time */
+    POOL_MAX_SIZE = 1024,
+};
 
 typedef struct {
     Coroutine base;
@@ -63,6 +64,15 @@ typedef struct {
 
     /** The default coroutine */
     CoroutineUContext leader;
+
+    /** Free list to speed up creation, only used by this thread */
+    QSLIST_HEAD(, Coroutine) pool;
+    unsigned int pool_size;
+
+    /** Coroutines created and not yet deleted by this thread, and the
+     * most there have been at once */
+    int live;
+    int live_max;
 } CoroutineThreadState;
 
 static pthread_key_t thread_state_key;
@@ -77,6 +87,40 @@ union cc_arg {
     int i[2];
 };
 
+/*
+ * Stacks are mapped with MAP_NORESERVE so that only the pages a coroutine
+ * actually touches are committed, and with an inaccessible guard page
+ * below them so that an overflow faults instead of corrupting the heap.
+ */
+static size_t coroutine_guard_size(void)
+{
+    return getpagesize();
+}
+
+static void *coroutine_stack_alloc(size_t size)
+{
+    size_t guard = coroutine_guard_size();
+    uint8_t *p;
+
+    p = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        abort();
+    }
+    /* Stacks grow down on all hosts the ucontext backend is used on */
+    if (mprotect(p, guard, PROT_NONE) != 0) {
+        abort();
+    }
+    return p + guard;
+}
+
+static void coroutine_stack_free(void *stack, size_t size)
+{
+    size_t guard = coroutine_guard_size();
+
+    munmap((uint8_t *)stack - guard, size + guard);
+}
+
 static CoroutineThreadState *coroutine_get_thread_state(void)
 {
     CoroutineThreadState *s = pthread_getspecific(thread_state_key);
@@ -84,26 +128,41 @@ static CoroutineThreadState *coroutine_get_thread_state(void)
     if (!s) {
         s = g_malloc0(sizeof(*s));
         s->current = &s->leader.base;
+        QSLIST_INIT(&s->pool);
         pthread_setspecific(thread_state_key, s);
     }
     return s;
 }
 
+static void coroutine_free(CoroutineUContext *co);
+
+static void coroutine_pool_free(CoroutineThreadState *s)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &s->pool, pool_next, tmp) {
+        coroutine_free(DO_UPCAST(CoroutineUContext, base, co));
+    }
+    QSLIST_INIT(&s->pool);
+    s->pool_size = 0;
+}
+
 static void qemu_coroutine_thread_cleanup(void *opaque)
 {
     CoroutineThreadState *s = opaque;
 
+    coroutine_pool_free(s);
     g_free(s);
 }
 
 static void __attribute__((destructor)) coroutine_cleanup(void)
 {
-    Coroutine *co;
-    Coroutine *tmp;
+    CoroutineThreadState *s = pthread_getspecific(thread_state_key);
 
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        g_free(DO_UPCAST(CoroutineUContext, base, co)->stack);
-        g_free(co);
+    /* Thread-specific destructors do not run for the thread calling exit() */
+    if (s) {
+        coroutine_pool_free(s);
     }
 }
 
@@ -140,9 +199,11 @@ static void coroutine_trampoline(int i0, int i1)
     }
 }
 
+#define COROUTINE_STACK_SIZE (1 << 20)
+
 static Coroutine *coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
+    const size_t stack_size = COROUTINE_STACK_SIZE;
     CoroutineUContext *co;
     ucontext_t old_uc, uc;
     jmp_buf old_env;
@@ -160,7 +221,7 @@ static Coroutine *coroutine_new(void)
     }
 
     co = g_malloc0(sizeof(*co));
-    co->stack = g_malloc(stack_size);
+    co->stack = coroutine_stack_alloc(stack_size);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     uc.uc_link = &old_uc;
@@ -187,15 +248,19 @@ static Coroutine *coroutine_new(void)
 
 Coroutine *qemu_coroutine_new(void)
 {
+    CoroutineThreadState *s = coroutine_get_thread_state();
     Coroutine *co;
 
-    co = QSLIST_FIRST(&pool);
+    co = QSLIST_FIRST(&s->pool);
     if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
+        QSLIST_REMOVE_HEAD(&s->pool, pool_next);
+        s->pool_size--;
     } else {
         co = coroutine_new();
     }
+    if (++s->live > s->live_max) {
+        s->live_max = s->live;
+    }
     return co;
 }
 
@@ -213,23 +278,42 @@ static inline void valgrind_stack_deregister(CoroutineUContext *co)
 #endif
 #endif
 
+static void coroutine_free(CoroutineUContext *co)
+{
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    coroutine_stack_free(co->stack, COROUTINE_STACK_SIZE);
+    g_free(co);
+}
+
 void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
+    CoroutineThreadState *s = coroutine_get_thread_state();
+    unsigned int pool_max;
 
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, &co->base, pool_next);
+    /* A coroutine may end in another thread than the one that created
+     * it, which then pools it. */
+    if (s->live > 0) {
+        s->live--;
+    }
+    /* Forget old peaks a little every time the thread goes idle, so that
+     * the pool shrinks again after a burst that does not come back.  */
+    if (s->live == 0) {
+        s->live_max /= 2;
+    }
+
+    pool_max = MIN(MAX(s->live_max, POOL_MIN_SIZE), POOL_MAX_SIZE);
+    if (s->pool_size < pool_max) {
+        QSLIST_INSERT_HEAD(&s->pool, &co->base, pool_next);
         co->base.caller = NULL;
-        pool_size++;
+        s->pool_size++;
         return;
     }
 
-#ifdef CONFIG_VALGRIND_H
-    valgrind_stack_deregister(co);
-#endif
-
-    g_free(co->stack);
-    g_free(co);
+    coroutine_free(co);
 }
 
 CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
@@ -40,6 +40,10 @@
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
 #endif
 
 #ifdef CONFIG_LINUX
@@ -66,7 +70,7 @@ static bool cpu_thread_is_idle(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
 
-    if (cpu->stop || cpu->queued_work_first) {
+    if (cpu->stop || cpu->queued_work) {
         return false;
     }
     if (cpu->stopped || !runstate_is_running()) {
@@ -105,6 +109,10 @@ static QEMUTimer *icount_vm_timer;
 static QEMUTimer *icount_warp_timer;
 static int64_t vm_clock_warp_start;
 static int64_t qemu_icount;
+/* With -tcg cycles=on, the length in ns of the core clock cycles that
+   the instruction counter counts, once the board has reported it.  Until
+   then the counter ticks at 2^icount_time_shift ns as usual.  */
+static int64_t icount_cycle_ns;
 
 typedef struct TimersState {
     int64_t cpu_ticks_prev;
@@ -116,8 +124,16 @@ typedef struct TimersState {
 
 TimersState timers_state;
 
-/* Return the virtual CPU time, based on the instruction counter.  */
-int64_t cpu_get_icount(void)
+static int64_t icount_to_ns(int64_t icount)
+{
+    if (icount_cycle_ns) {
+        return icount * icount_cycle_ns;
+    }
+    return icount << icount_time_shift;
+}
+
+/* The instruction counter, up to the instruction being executed.  */
+int64_t cpu_get_icount_raw(void)
 {
     int64_t icount;
     CPUArchState *env = cpu_single_env;
@@ -129,7 +145,30 @@ int64_t cpu_get_icount(void)
         }
         icount -= (env->icount_decr.u16.low + env->icount_extra);
     }
-    return qemu_icount_bias + (icount << icount_time_shift);
+    return icount;
+}
+
+/* Return the virtual CPU time, based on the instruction counter.  */
+int64_t cpu_get_icount(void)
+{
+    return qemu_icount_bias + icount_to_ns(cpu_get_icount_raw());
+}
+
+void cpu_icount_set_cycle_time(int64_t ns)
+{
+    int64_t now;
+
+    if (!use_icount || !tcg_cycles || ns <= 0 || ns == icount_cycle_ns) {
+        return;
+    }
+    /* Virtual time carries on from where it is at the old rate.  */
+    now = cpu_get_icount();
+    icount_cycle_ns = ns;
+    qemu_icount_bias = now - icount_to_ns(cpu_get_icount_raw());
+    /* The budget of the running CPU was computed at the old rate.  */
+    if (cpu_single_env) {
+        cpu_exit(cpu_single_env);
+    }
 }
 
 /* return the host CPU cycle counter and handle stop/restart */
@@ -219,7 +258,7 @@ static void icount_adjust(void)
         icount_time_shift++;
     }
     last_delta = delta;
-    qemu_icount_bias = cur_icount - (qemu_icount << icount_time_shift);
+    qemu_icount_bias = cur_icount - icount_to_ns(qemu_icount);
 }
 
 static void icount_adjust_rt(void *opaque)
@@ -238,6 +277,9 @@ static void icount_adjust_vm(void *opaque)
 
 static int64_t qemu_icount_round(int64_t count)
 {
+    if (icount_cycle_ns) {
+        return (count + icount_cycle_ns - 1) / icount_cycle_ns;
+    }
     return (count + (1 << icount_time_shift) - 1) >> icount_time_shift;
 }
 
@@ -283,6 +325,46 @@ void qtest_clock_warp(int64_t dest)
     qemu_notify_event();
 }
 
+/* Number of cpu_set_fast_forward(true) not yet undone */
+static int vm_clock_fast_forward;
+
+void cpu_set_fast_forward(bool enable)
+{
+    vm_clock_fast_forward += enable ? 1 : -1;
+    assert(vm_clock_fast_forward >= 0);
+    if (enable) {
+        qemu_notify_event();
+    }
+}
+
+/* Moves the vm_clock straight to the next timer if the CPUs are all idle.
+ * Returns false if they are not, or if there is no timer to go to.
+ */
+static bool vm_clock_skip_idle(void)
+{
+    int64_t deadline;
+
+    if (!runstate_is_running() || !all_cpu_threads_idle() ||
+        !qemu_clock_has_timers(vm_clock)) {
+        return false;
+    }
+    if (use_icount) {
+        /* Account the real time that already passed, and wait no more. */
+        icount_warp_rt(NULL);
+        qemu_del_timer(icount_warp_timer);
+    }
+    deadline = qemu_clock_deadline(vm_clock);
+    if (deadline > 0) {
+        if (use_icount) {
+            qemu_icount_bias += deadline;
+        } else {
+            timers_state.cpu_clock_offset += deadline;
+        }
+    }
+    qemu_notify_event();
+    return true;
+}
+
 void qemu_clock_warp(QEMUClock *clock)
 {
     int64_t deadline;
@@ -292,7 +374,13 @@ void qemu_clock_warp(QEMUClock *clock)
      * applicable to other clocks.  But a clock argument removes the
      * need for if statements all over the place.
      */
-    if (clock != vm_clock || !use_icount) {
+    if (clock != vm_clock) {
+        return;
+    }
+    if (vm_clock_fast_forward && vm_clock_skip_idle()) {
+        return;
+    }
+    if (!use_icount) {
         return;
     }
 
@@ -355,11 +443,19 @@ static const VMStateDescription vmstate_timers = {
 void configure_icount(const char *option)
 {
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
+    if (!option && tcg_cycles) {
+        /* Counting cycles implies counting.  The board sets the rate.  */
+        option = "0";
+    }
     if (!option) {
         return;
     }
 
     icount_warp_timer = qemu_new_timer_ns(rt_clock, icount_warp_rt, NULL);
+    if (tcg_cycles && strcmp(option, "auto") == 0) {
+        fprintf(stderr, "-tcg cycles=on cannot be used with -icount auto\n");
+        exit(1);
+    }
     if (strcmp(option, "auto") != 0) {
         icount_time_shift = strtol(option, NULL, 0);
         use_icount = 1;
@@ -653,14 +749,11 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
     wi.done = false;
+    do {
+        wi.next = cpu->queued_work;
+    } while (__sync_val_compare_and_swap(&cpu->queued_work, wi.next, &wi)
+             != wi.next);
 
     qemu_cpu_kick(cpu);
     while (!wi.done) {
@@ -673,18 +766,32 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 
 static void flush_queued_work(CPUState *cpu)
 {
-    struct qemu_work_item *wi;
+    struct qemu_work_item *wi, *next, *list = NULL;
 
-    if (cpu->queued_work_first == NULL) {
+    if (cpu->queued_work == NULL) {
         return;
     }
 
-    while ((wi = cpu->queued_work_first)) {
-        cpu->queued_work_first = wi->next;
+    /* Take everything queued so far; producers only ever push, so there
+       is no ABA problem.  */
+    do {
+        wi = cpu->queued_work;
+    } while (__sync_val_compare_and_swap(&cpu->queued_work, wi, NULL) != wi);
+
+    /* The queue is a stack, run the items in the order they came.  */
+    while (wi) {
+        next = wi->next;
+        wi->next = list;
+        list = wi;
+        wi = next;
+    }
+    while ((wi = list)) {
+        /* WI lives on the stack of its waiter, which may return as soon
+           as it is done.  */
+        list = wi->next;
         wi->func(wi->data);
         wi->done = true;
     }
-    cpu->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
@@ -1091,6 +1198,25 @@ void vm_stop_force_state(RunState state)
     }
 }
 
+/* Lockstep rounds (see cpu_set_lockstep_quantum).  Each CPU runs from
+   qemu_icount == round_start towards round_end in turn; round_cpu is the
+   CPU being run and round_pos how far it got, round_reached the furthest
+   any CPU got.  Between calls to tcg_exec_all, qemu_icount is
+   round_reached, so that the rest of QEMU never sees time move back.  */
+static int64_t lockstep_quantum;
+static CPUArchState *round_cpu;
+static int64_t round_start, round_end, round_pos, round_reached;
+
+void cpu_set_lockstep_quantum(int64_t quantum_ns)
+{
+    lockstep_quantum = quantum_ns;
+}
+
+static bool tcg_lockstep(void)
+{
+    return use_icount && lockstep_quantum && first_cpu->next_cpu;
+}
+
 static int tcg_cpu_exec(CPUArchState *env)
 {
     int ret;
@@ -1107,7 +1233,12 @@ static int tcg_cpu_exec(CPUArchState *env)
         qemu_icount -= (env->icount_decr.u16.low + env->icount_extra);
         env->icount_decr.u16.low = 0;
         env->icount_extra = 0;
-        count = qemu_icount_round(qemu_clock_deadline(vm_clock));
+        if (tcg_lockstep()) {
+            qemu_icount = round_pos;
+            count = round_end - round_pos;
+        } else {
+            count = qemu_icount_round(qemu_clock_deadline(vm_clock));
+        }
         qemu_icount += count;
         decr = (count > 0xffff) ? 0xffff : count;
         count -= decr;
@@ -1129,6 +1260,53 @@ static int tcg_cpu_exec(CPUArchState *env)
     return ret;
 }
 
+static void tcg_exec_all_lockstep(void)
+{
+    CPUArchState *env;
+    CPUState *cpu;
+    int64_t pos;
+    int r;
+
+    if (round_cpu == NULL) {
+        round_start = round_reached = round_pos = qemu_icount;
+        round_end = round_start +
+                    MIN(qemu_icount_round(qemu_clock_deadline(vm_clock)),
+                        qemu_icount_round(lockstep_quantum));
+        round_cpu = first_cpu;
+    }
+    while (round_cpu != NULL && !exit_request) {
+        env = round_cpu;
+        cpu = ENV_GET_CPU(env);
+
+        qemu_clock_enable(vm_clock,
+                          (env->singlestep_enabled & SSTEP_NOTIMER) == 0);
+
+        if (cpu_can_run(cpu)) {
+            pos = round_pos;
+            if (pos < round_end) {
+                r = tcg_cpu_exec(env);
+                round_pos = qemu_icount;
+                round_reached = MAX(round_reached, round_pos);
+                if (r == EXCP_DEBUG) {
+                    cpu_handle_guest_debug(env);
+                    break;
+                }
+                /* Something other than halting stopped the CPU early, let
+                   it have the rest of its turn.  */
+                if (!env->halted && round_pos > pos && round_pos < round_end) {
+                    continue;
+                }
+            }
+        } else if (cpu->stop || cpu->stopped) {
+            break;
+        }
+        round_cpu = env->next_cpu;
+        round_pos = round_start;
+    }
+    qemu_icount = round_reached;
+    exit_request = 0;
+}
+
 static void tcg_exec_all(void)
 {
     int r;
@@ -1136,6 +1314,10 @@ static void tcg_exec_all(void)
     /* Account partial waits to the vm_clock.  */
     qemu_clock_warp(vm_clock);
 
+    if (tcg_lockstep()) {
+        tcg_exec_all_lockstep();
+        return;
+    }
     if (next_cpu == NULL) {
         next_cpu = first_cpu;
     }
@@ -1249,14 +1431,12 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
-void qmp_memsave(int64_t addr, int64_t size, const char *filename,
-                 bool has_cpu, int64_t cpu_index, Error **errp)
+/* Returns the CPU translating the virtual addresses of a memory command */
+static CPUArchState *qmp_memory_cpu(bool has_cpu, int64_t cpu_index,
+                                    Error **errp)
 {
-    FILE *f;
-    uint32_t l;
     CPUArchState *env;
     CPUState *cpu;
-    uint8_t buf[1024];
 
     if (!has_cpu) {
         cpu_index = 0;
@@ -1265,13 +1445,25 @@ void qmp_memsave(int64_t addr, int64_t size, const char *filename,
     for (env = first_cpu; env; env = env->next_cpu) {
         cpu = ENV_GET_CPU(env);
         if (cpu_index == cpu->cpu_index) {
-            break;
+            return env;
         }
     }
 
+    error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+              "a CPU number");
+    return NULL;
+}
+
+void qmp_memsave(int64_t addr, int64_t size, const char *filename,
+                 bool has_cpu, int64_t cpu_index, Error **errp)
+{
+    FILE *f;
+    uint32_t l;
+    CPUArchState *env;
+    uint8_t buf[1024];
+
+    env = qmp_memory_cpu(has_cpu, cpu_index, errp);
     if (env == NULL) {
-        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
-                  "a CPU number");
         return;
     }
 
@@ -1328,6 +1520,102 @@ exit:
     fclose(f);
 }
 
+/* Bounds what a single range of query-memory allocates */
+#define QMP_MEMORY_RANGE_MAX (16 * 1024 * 1024)
+
+/* Each range is taken in one go: physical memory is looked up once per
+ * region it covers, virtual memory once per page. */
+MemoryDataList *qmp_query_memory(MemoryRangeList *ranges,
+                                 bool has_physical, bool physical,
+                                 bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    MemoryDataList *head = NULL, **tail = &head, *entry;
+    CPUArchState *env = NULL;
+    MemoryRange *range;
+    uint8_t *buf;
+
+    if (!has_physical || !physical) {
+        env = qmp_memory_cpu(has_cpu_index, cpu_index, errp);
+        if (env == NULL) {
+            return NULL;
+        }
+    }
+
+    for (; ranges; ranges = ranges->next) {
+        range = ranges->value;
+        if (range->size < 0 || range->size > QMP_MEMORY_RANGE_MAX) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "size",
+                      "a size of at most 16 MiB");
+            goto fail;
+        }
+
+        buf = g_malloc(range->size);
+        if (env) {
+            if (cpu_memory_rw_debug(env, range->addr, buf, range->size,
+                                    0) < 0) {
+                g_free(buf);
+                error_setg(errp, "Range at 0x%" PRIx64 " is not mapped",
+                           range->addr);
+                goto fail;
+            }
+        } else {
+            cpu_physical_memory_rw(range->addr, buf, range->size, 0);
+        }
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->addr = range->addr;
+        entry->value->data = g_base64_encode(buf, range->size);
+        g_free(buf);
+
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+
+fail:
+    qapi_free_MemoryDataList(head);
+    return NULL;
+}
+
+void qmp_write_memory(MemoryDataList *ranges,
+                      bool has_physical, bool physical,
+                      bool has_cpu_index, int64_t cpu_index,
+                      Error **errp)
+{
+    CPUArchState *env = NULL;
+    MemoryData *range;
+    uint8_t *buf;
+    gsize len;
+    int ret = 0;
+
+    if (!has_physical || !physical) {
+        env = qmp_memory_cpu(has_cpu_index, cpu_index, errp);
+        if (env == NULL) {
+            return;
+        }
+    }
+
+    for (; ranges; ranges = ranges->next) {
+        range = ranges->value;
+        buf = g_base64_decode(range->data, &len);
+        if (env) {
+            ret = cpu_memory_rw_debug(env, range->addr, buf, len, 1);
+        } else {
+            cpu_physical_memory_write_rom(range->addr, buf, len);
+        }
+        g_free(buf);
+
+        if (ret < 0) {
+            error_setg(errp, "Range at 0x%" PRIx64 " is not mapped",
+                       range->addr);
+            return;
+        }
+    }
+}
+
 void qmp_inject_nmi(Error **errp)
 {
 #if defined(TARGET_I386)
@@ -1344,3 +1632,81 @@ void qmp_inject_nmi(Error **errp)
     error_set(errp, QERR_UNSUPPORTED);
 #endif
 }
+
+#ifndef _WIN32
+/* Gives the child of vm_fork a TCG thread of its own.  Only the thread
+ * that called fork() exists in the child, and nothing waits on the
+ * conditions any more, whatever state they were left in.  */
+static void qemu_tcg_fork_child(void)
+{
+    CPUArchState *env;
+
+    qemu_cond_init(&qemu_cpu_cond);
+    qemu_cond_init(&qemu_pause_cond);
+    qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_io_proceeded_cond);
+    iothread_requesting_mutex = false;
+
+    tcg_cpu_thread = NULL;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        cpu->created = false;
+        cpu->thread_kicked = false;
+        qemu_tcg_init_vcpu(cpu);
+    }
+}
+#endif
+
+VmForkInfo *qmp_vm_fork(Error **errp)
+{
+#ifndef _WIN32
+    VmForkInfo *info = NULL;
+    int saved_vm_running;
+    int status;
+    pid_t pid;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "vm-fork is only supported with TCG");
+        return NULL;
+    }
+
+    /* Fork at a quiescent point: the CPUs are stopped and there is no I/O
+     * in flight, so everything the child needs is in this thread and in
+     * memory, which the child gets a copy-on-write copy of.  */
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_PAUSED);
+    bdrv_drain_all();
+    bdrv_flush_all();
+
+    pid = fork();
+    if (pid < 0) {
+        error_setg_errno(errp, errno, "vm-fork failed");
+        goto out;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    if (pid == 0) {
+        qemu_tcg_fork_child();
+    } else {
+        /* The child carries on with the descriptors of this process, the
+         * monitor included, so this one does not touch them until the
+         * child has exited.  */
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        info->pid = pid;
+        info->has_status = true;
+        info->status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                         : 128 + WTERMSIG(status);
+    }
+
+out:
+    if (saved_vm_running) {
+        vm_start();
+    }
+    return info;
+#else
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+#endif
+}
@@ -70,8 +70,15 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
-    memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    tb_flush_jmp_cache_all(env);
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
@@ -115,7 +122,12 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
     }
 
     tb_flush_jmp_cache(env, addr);
@@ -185,6 +197,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -206,8 +222,44 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+/* Called on a miss in the main TLB.  If the page is in the victim TLB,
+   swap it back into the main TLB slot and return true; otherwise the
+   caller has to refill the entry with tlb_fill.  elt_ofs selects the
+   addr_read, addr_write or addr_code field to compare.  */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    target_ulong addr, size_t elt_ofs)
+{
+    int k;
+
+    env->tlb_miss_count++;
+    addr &= TARGET_PAGE_MASK;
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][k];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
+
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == addr) {
+            CPUTLBEntry tmptlb;
+            hwaddr tmpio;
+            CPUTLBEntry *tlb = &env->tlb_table[mmu_idx][index];
+            hwaddr *io = &env->iotlb[mmu_idx][index];
+            hwaddr *vio = &env->iotlb_v[mmu_idx][k];
+
+            tmptlb = *tlb; *tlb = *vtlb; *vtlb = tmptlb;
+            tmpio = *io; *io = *vio; *vio = tmpio;
+            env->tlb_victim_hit_count++;
+            return true;
+        }
     }
+    return false;
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -252,7 +304,8 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
     }
-    section = phys_page_find(address_space_memory.dispatch, paddr >> TARGET_PAGE_BITS);
+    section = phys_page_find(ENV_GET_CPU(env)->as->dispatch,
+                             paddr >> TARGET_PAGE_BITS);
 #if defined(DEBUG_TLB)
     printf("tlb_set_page: vaddr=" TARGET_FMT_lx " paddr=0x" TARGET_FMT_plx
            " prot=%x idx=%d pd=0x%08lx\n",
@@ -278,8 +331,22 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Keep the entry being replaced in the victim TLB, unless it
+       maps the same page.  */
+    if ((te->addr_read & te->addr_write & te->addr_code) !=
+        (target_ulong)-1 &&
+        (te->addr_read & TARGET_PAGE_MASK) != (vaddr & TARGET_PAGE_MASK) &&
+        (te->addr_write & TARGET_PAGE_MASK) != (vaddr & TARGET_PAGE_MASK) &&
+        (te->addr_code & TARGET_PAGE_MASK) != (vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -359,3 +426,35 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 #include "exec/softmmu_template.h"
 
 #undef env
+
+void dump_tlb_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUArchState *env;
+
+    cpu_fprintf(f, "TLB size            %d entries x %d MMU modes\n",
+                CPU_TLB_SIZE, NB_MMU_MODES);
+    cpu_fprintf(f, "victim TLB size     %d entries\n", CPU_VTLB_SIZE);
+    cpu_fprintf(f, "TLB full flushes    %d\n", tlb_flush_count);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        int mmu_idx, i, used = 0;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            for (i = 0; i < CPU_TLB_SIZE; i++) {
+                CPUTLBEntry *te = &env->tlb_table[mmu_idx][i];
+
+                if ((te->addr_read & te->addr_write & te->addr_code) !=
+                    (target_ulong)-1) {
+                    used++;
+                }
+            }
+        }
+        cpu_fprintf(f, "CPU #%d: %" PRIu64 " misses, %" PRIu64
+                    " victim hits (%d%%), %d entries in use\n",
+                    ENV_GET_CPU(env)->cpu_index, env->tlb_miss_count,
+                    env->tlb_victim_hit_count,
+                    env->tlb_miss_count ?
+                    (int)(env->tlb_victim_hit_count * 100 /
+                          env->tlb_miss_count) : 0,
+                    used);
+    }
+}
@@ -18,6 +18,7 @@ CONFIG_TMP105=y
 CONFIG_STELLARIS_INPUT=y
 CONFIG_SSD0303=y
 CONFIG_SSD0323=y
+CONFIG_ILI9341=y
 CONFIG_ADS7846=y
 CONFIG_MAX111X=y
 CONFIG_SSI=y
@@ -374,6 +374,19 @@ const char *lookup_symbol(target_ulong orig_addr)
 
 #if !defined(CONFIG_USER_ONLY)
 
+bool lookup_symbol_addr(const char *name, hwaddr *addr)
+{
+    struct syminfo *s;
+
+    for (s = syminfos; s; s = s->next) {
+        if (s->lookup_addr && s->lookup_addr(s, name, addr)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 #include "monitor/monitor.h"
 
 static int monitor_disas_is_physical;
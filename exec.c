@@ -49,6 +49,7 @@
 #include "translate-all.h"
 
 #include "exec/memory-internal.h"
+#include "migration/migration.h"
 
 //#define DEBUG_UNASSIGNED
 //#define DEBUG_SUBPAGE
@@ -172,10 +173,21 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
     }
 }
 
+static void phys_page_cache_flush(AddressSpaceDispatch *d)
+{
+    int i;
+
+    for (i = 0; i < PHYS_PAGE_CACHE_SIZE; i++) {
+        d->cache[i].index = PHYS_PAGE_CACHE_INVALID;
+    }
+}
+
 static void phys_page_set(AddressSpaceDispatch *d,
                           hwaddr index, hwaddr nb,
                           uint16_t leaf)
 {
+    phys_page_cache_flush(d);
+
     /* Wildly overreserve - it doesn't matter much. */
     phys_map_node_reserve(3 * P_L2_LEVELS);
 
@@ -184,11 +196,16 @@ static void phys_page_set(AddressSpaceDispatch *d,
 
 MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr index)
 {
+    PhysPageCacheEntry *ce = &d->cache[index & (PHYS_PAGE_CACHE_SIZE - 1)];
     PhysPageEntry lp = d->phys_map;
     PhysPageEntry *p;
     int i;
     uint16_t s_index = phys_section_unassigned;
 
+    if (ce->index == index) {
+        return &phys_sections[ce->section];
+    }
+
     for (i = P_L2_LEVELS - 1; i >= 0 && !lp.is_leaf; i--) {
         if (lp.ptr == PHYS_MAP_NODE_NIL) {
             goto not_found;
@@ -199,6 +216,8 @@ MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr index)
 
     s_index = lp.ptr;
 not_found:
+    ce->index = index;
+    ce->section = s_index;
     return &phys_sections[s_index];
 }
 
@@ -285,6 +304,7 @@ void cpu_exec_init(CPUArchState *env)
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
     cpu->thread_id = qemu_get_thread_id();
+    cpu->as = &address_space_memory;
 #endif
     *penv = env;
 #if defined(CONFIG_USER_ONLY)
@@ -312,6 +332,43 @@ static void breakpoint_invalidate(CPUArchState *env, target_ulong pc)
 #endif
 #endif /* TARGET_HAS_ICE */
 
+#if defined(TARGET_HAS_ICE) || !defined(CONFIG_USER_ONLY)
+/* The breakpoint and watchpoint indexes count the entries of the lists
+   for each pc or page, so that the common case of no entry there takes a
+   single lookup instead of a walk.  Keys are truncated to a host pointer:
+   a count is only a hint, and the list is walked when there is one.  */
+static void debug_index_add(GHashTable **index, target_ulong key)
+{
+    gpointer k = (gpointer)(uintptr_t)key;
+    guint n;
+
+    if (!*index) {
+        *index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    n = GPOINTER_TO_UINT(g_hash_table_lookup(*index, k));
+    g_hash_table_insert(*index, k, GUINT_TO_POINTER(n + 1));
+}
+
+static void debug_index_remove(GHashTable *index, target_ulong key)
+{
+    gpointer k = (gpointer)(uintptr_t)key;
+    guint n;
+
+    n = GPOINTER_TO_UINT(g_hash_table_lookup(index, k));
+    assert(n > 0);
+    if (n == 1) {
+        g_hash_table_remove(index, k);
+    } else {
+        g_hash_table_insert(index, k, GUINT_TO_POINTER(n - 1));
+    }
+}
+
+static bool debug_index_test(GHashTable *index, target_ulong key)
+{
+    return index && g_hash_table_lookup(index, (gpointer)(uintptr_t)key);
+}
+#endif
+
 #if defined(CONFIG_USER_ONLY)
 void cpu_watchpoint_remove_all(CPUArchState *env, int mask)
 
@@ -349,6 +406,7 @@ int cpu_watchpoint_insert(CPUArchState *env, target_ulong addr, target_ulong len
         QTAILQ_INSERT_HEAD(&env->watchpoints, wp, entry);
     else
         QTAILQ_INSERT_TAIL(&env->watchpoints, wp, entry);
+    debug_index_add(&env->watchpoint_index, addr >> TARGET_PAGE_BITS);
 
     tlb_flush_page(env, addr);
 
@@ -378,6 +436,8 @@ int cpu_watchpoint_remove(CPUArchState *env, target_ulong addr, target_ulong len
 void cpu_watchpoint_remove_by_ref(CPUArchState *env, CPUWatchpoint *watchpoint)
 {
     QTAILQ_REMOVE(&env->watchpoints, watchpoint, entry);
+    debug_index_remove(env->watchpoint_index,
+                       watchpoint->vaddr >> TARGET_PAGE_BITS);
 
     tlb_flush_page(env, watchpoint->vaddr);
 
@@ -413,6 +473,7 @@ int cpu_breakpoint_insert(CPUArchState *env, target_ulong pc, int flags,
         QTAILQ_INSERT_HEAD(&env->breakpoints, bp, entry);
     else
         QTAILQ_INSERT_TAIL(&env->breakpoints, bp, entry);
+    debug_index_add(&env->breakpoint_index, pc);
 
     breakpoint_invalidate(env, pc);
 
@@ -447,6 +508,7 @@ void cpu_breakpoint_remove_by_ref(CPUArchState *env, CPUBreakpoint *breakpoint)
 {
 #if defined(TARGET_HAS_ICE)
     QTAILQ_REMOVE(&env->breakpoints, breakpoint, entry);
+    debug_index_remove(env->breakpoint_index, breakpoint->pc);
 
     breakpoint_invalidate(env, breakpoint->pc);
 
@@ -467,6 +529,24 @@ void cpu_breakpoint_remove_all(CPUArchState *env, int mask)
 #endif
 }
 
+/* Whether a breakpoint is set at pc, for the translators.  */
+bool cpu_breakpoint_at(CPUArchState *env, target_ulong pc)
+{
+#if defined(TARGET_HAS_ICE)
+    CPUBreakpoint *bp;
+
+    if (!debug_index_test(env->breakpoint_index, pc)) {
+        return false;
+    }
+    QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
+        if (bp->pc == pc) {
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
 /* enable or disable single step mode. EXCP_DEBUG is returned by the
    CPU loop after each instruction */
 void cpu_single_step(CPUArchState *env, int enabled)
@@ -493,7 +573,7 @@ void cpu_reset_interrupt(CPUArchState *env, int mask)
 void cpu_exit(CPUArchState *env)
 {
     env->exit_request = 1;
-    cpu_unlink_tb(env);
+    env->tcg_exit_req = 1;
 }
 
 void cpu_abort(CPUArchState *env, const char *fmt, ...)
@@ -545,8 +625,10 @@ CPUArchState *cpu_copy(CPUArchState *env)
     /* Clone all break/watchpoints.
        Note: Once we support ptrace with hw-debug register access, make sure
        BP_CPU break/watchpoints are handled correctly on clone. */
-    QTAILQ_INIT(&env->breakpoints);
-    QTAILQ_INIT(&env->watchpoints);
+    QTAILQ_INIT(&new_env->breakpoints);
+    QTAILQ_INIT(&new_env->watchpoints);
+    new_env->breakpoint_index = NULL;
+    new_env->watchpoint_index = NULL;
 #if defined(TARGET_HAS_ICE)
     QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
         cpu_breakpoint_insert(new_env, bp->pc, bp->flags, NULL);
@@ -637,6 +719,9 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
 
     /* Make accesses to pages with watchpoints go via the
        watchpoint trap routines.  */
+    if (!debug_index_test(env->watchpoint_index, vaddr >> TARGET_PAGE_BITS)) {
+        return iotlb;
+    }
     QTAILQ_FOREACH(wp, &env->watchpoints, entry) {
         if (vaddr == (wp->vaddr & TARGET_PAGE_MASK)) {
             /* Avoid trapping reads of pages with a write breakpoint. */
@@ -949,6 +1034,33 @@ ram_addr_t last_ram_offset(void)
     return last;
 }
 
+/* Blocks smaller than a huge page cannot use one.  */
+#define RAM_HUGEPAGE_MIN_SIZE (2 * 1024 * 1024)
+
+static void qemu_ram_setup_hugepages(RAMBlock *block, ram_addr_t size,
+                                     bool hugetlbfs)
+{
+    QemuOpts *opts;
+    bool report;
+    int ret;
+
+    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    report = opts && qemu_opt_get(opts, "mem-hugepages");
+    if (hugetlbfs || size < RAM_HUGEPAGE_MIN_SIZE ||
+        (opts && !qemu_opt_get_bool(opts, "mem-hugepages", true))) {
+        ret = -1;
+    } else {
+        ret = qemu_madvise(block->host, size, QEMU_MADV_HUGEPAGE);
+    }
+    trace_qemu_ram_setup_hugepages(block->host, size, ret);
+    if (report) {
+        fprintf(stderr, "qemu: RAM block '%s' of %" PRIu64 " KiB uses %s\n",
+                memory_region_name(block->mr), (uint64_t)size / 1024,
+                hugetlbfs ? "hugetlbfs pages" :
+                ret == 0 ? "transparent huge pages" : "small pages");
+    }
+}
+
 static void qemu_ram_setup_dump(void *addr, ram_addr_t size)
 {
     int ret;
@@ -1019,6 +1131,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
     RAMBlock *block, *new_block;
+    bool hugetlbfs = false;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
@@ -1034,6 +1147,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
             new_block->host = file_ram_alloc(new_block, size, mem_path);
+            hugetlbfs = new_block->host != NULL;
             if (!new_block->host) {
                 new_block->host = qemu_vmalloc(size);
                 memory_try_enable_merging(new_block->host, size);
@@ -1079,7 +1193,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
 
     qemu_ram_setup_dump(new_block->host, size);
-    qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
+    qemu_ram_setup_hugepages(new_block, size, hugetlbfs);
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -1412,10 +1526,44 @@ static const MemoryRegionOps rom_mem_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/* Called before the page of RAM at ADDR is written to: while a live
+   snapshot runs, the first write to a page has to keep what it held.  */
+static inline void prepare_write(ram_addr_t addr)
+{
+    if (unlikely(!(cpu_physical_memory_get_dirty_flags(addr) &
+                   SNAPSHOT_DIRTY_FLAG))) {
+        ram_snapshot_cow(addr & TARGET_PAGE_MASK);
+        cpu_physical_memory_set_dirty_flags(addr, SNAPSHOT_DIRTY_FLAG);
+    }
+}
+
+/* For the code that writes RAM through a host pointer, before it does.  */
+void qemu_ram_prepare_write(ram_addr_t addr, ram_addr_t len)
+{
+    ram_addr_t end = addr + len;
+
+    for (addr &= TARGET_PAGE_MASK; addr < end; addr += TARGET_PAGE_SIZE) {
+        prepare_write(addr);
+    }
+}
+
+/* Makes the next write to each page of the LEN bytes of RAM at ADDR call
+   ram_snapshot_cow(), or stops it.  */
+void qemu_ram_snapshot_track(ram_addr_t addr, ram_addr_t len, bool track)
+{
+    if (track) {
+        cpu_physical_memory_reset_dirty(addr, addr + len, SNAPSHOT_DIRTY_FLAG);
+    } else {
+        cpu_physical_memory_set_dirty_range(addr, len, SNAPSHOT_DIRTY_FLAG);
+    }
+}
+
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
     int dirty_flags;
+
+    prepare_write(ram_addr);
     dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
     if (!(dirty_flags & CODE_DIRTY_FLAG)) {
 #if !defined(CONFIG_USER_ONLY)
@@ -1684,6 +1832,7 @@ static void mem_begin(MemoryListener *listener)
 
     destroy_all_mappings(d);
     d->phys_map.ptr = PHYS_MAP_NODE_NIL;
+    phys_page_cache_flush(d);
 }
 
 static void core_begin(MemoryListener *listener)
@@ -1757,6 +1906,7 @@ void address_space_init_dispatch(AddressSpace *as)
     AddressSpaceDispatch *d = g_new(AddressSpaceDispatch, 1);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
+    phys_page_cache_flush(d);
     d->listener = (MemoryListener) {
         .begin = mem_begin,
         .region_add = mem_add,
@@ -1908,6 +2058,7 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                 addr1 = memory_region_get_ram_addr(section->mr)
                     + memory_region_section_addr(section, addr);
                 /* RAM case */
+                prepare_write(addr1);
                 ptr = qemu_get_ram_ptr(addr1);
                 memcpy(ptr, buf, l);
                 invalidate_and_set_dirty(addr1, l);
@@ -1976,10 +2127,10 @@ void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
 }
 
 /* used for ROM loading : can write in RAM and ROM */
-void cpu_physical_memory_write_rom(hwaddr addr,
-                                   const uint8_t *buf, int len)
+void address_space_write_rom(AddressSpace *as, hwaddr addr,
+                             const uint8_t *buf, int len)
 {
-    AddressSpaceDispatch *d = address_space_memory.dispatch;
+    AddressSpaceDispatch *d = as->dispatch;
     int l;
     uint8_t *ptr;
     hwaddr page;
@@ -2000,6 +2151,7 @@ void cpu_physical_memory_write_rom(hwaddr addr,
             addr1 = memory_region_get_ram_addr(section->mr)
                 + memory_region_section_addr(section, addr);
             /* ROM/RAM case */
+            prepare_write(addr1);
             ptr = qemu_get_ram_ptr(addr1);
             memcpy(ptr, buf, l);
             invalidate_and_set_dirty(addr1, l);
@@ -2011,6 +2163,52 @@ void cpu_physical_memory_write_rom(hwaddr addr,
     }
 }
 
+void cpu_physical_memory_write_rom(hwaddr addr,
+                                   const uint8_t *buf, int len)
+{
+    address_space_write_rom(&address_space_memory, addr, buf, len);
+}
+
+/* Copies LEN bytes of BUF back into RAM at ADDR, leaving alone the pages
+ * that already hold them so that the code translated from those stays
+ * valid.  Returns the number of pages written.  */
+int qemu_ram_restore(ram_addr_t addr, const uint8_t *buf, ram_addr_t len)
+{
+    ram_addr_t l;
+    uint8_t *ptr;
+    int written = 0;
+
+    while (len > 0) {
+        l = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+        if (l > len) {
+            l = len;
+        }
+        ptr = qemu_get_ram_ptr(addr);
+        if (memcmp(ptr, buf, l) != 0) {
+            prepare_write(addr);
+            memcpy(ptr, buf, l);
+            invalidate_and_set_dirty(addr, l);
+            written++;
+        }
+        qemu_put_ram_ptr(ptr);
+        len -= l;
+        buf += l;
+        addr += l;
+    }
+    return written;
+}
+
+/* Drops the code translated from the LEN bytes of RAM at ADDR, whose
+ * contents are going to be replaced without a write through QEMU.  */
+void qemu_ram_invalidate(ram_addr_t addr, ram_addr_t len)
+{
+    ram_addr_t end = addr + len;
+
+    for (addr &= TARGET_PAGE_MASK; addr < end; addr += TARGET_PAGE_SIZE) {
+        invalidate_and_set_dirty(addr, TARGET_PAGE_SIZE);
+    }
+}
+
 typedef struct {
     void *buffer;
     hwaddr addr;
@@ -2112,6 +2310,9 @@ void *address_space_map(AddressSpace *as,
     rlen = todo;
     ret = qemu_ram_ptr_length(raddr, &rlen);
     *plen = rlen;
+    if (is_write) {
+        qemu_ram_prepare_write(raddr, rlen);
+    }
     return ret;
 }
 
@@ -2366,6 +2567,7 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
         unsigned long addr1 = (memory_region_get_ram_addr(section->mr)
                                & TARGET_PAGE_MASK)
             + memory_region_section_addr(section, addr);
+        prepare_write(addr1);
         ptr = qemu_get_ram_ptr(addr1);
         stl_p(ptr, val);
 
@@ -2401,9 +2603,12 @@ void stq_phys_notdirty(hwaddr addr, uint64_t val)
         io_mem_write(section->mr, addr + 4, val >> 32, 4);
 #endif
     } else {
-        ptr = qemu_get_ram_ptr((memory_region_get_ram_addr(section->mr)
-                                & TARGET_PAGE_MASK)
-                               + memory_region_section_addr(section, addr));
+        ram_addr_t addr1 = (memory_region_get_ram_addr(section->mr)
+                            & TARGET_PAGE_MASK)
+            + memory_region_section_addr(section, addr);
+
+        prepare_write(addr1);
+        ptr = qemu_get_ram_ptr(addr1);
         stq_p(ptr, val);
     }
 }
@@ -2437,6 +2642,7 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
         addr1 = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
             + memory_region_section_addr(section, addr);
         /* RAM case */
+        prepare_write(addr1);
         ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
@@ -2504,6 +2710,7 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
         addr1 = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
             + memory_region_section_addr(section, addr);
         /* RAM case */
+        prepare_write(addr1);
         ptr = qemu_get_ram_ptr(addr1);
         switch (endian) {
         case DEVICE_LITTLE_ENDIAN:
@@ -2573,9 +2780,9 @@ int cpu_memory_rw_debug(CPUArchState *env, target_ulong addr,
             l = len;
         phys_addr += (addr & ~TARGET_PAGE_MASK);
         if (is_write)
-            cpu_physical_memory_write_rom(phys_addr, buf, l);
+            address_space_write_rom(ENV_GET_CPU(env)->as, phys_addr, buf, l);
         else
-            cpu_physical_memory_rw(phys_addr, buf, l, is_write);
+            address_space_read(ENV_GET_CPU(env)->as, phys_addr, buf, l);
         len -= l;
         buf += l;
         addr += l;
@@ -42,6 +42,8 @@ these four paragraphs for those parts of this code that are retained.
 
 #include "fpu/softfloat.h"
 
+#include <float.h>
+
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
 | division and square root approximations.  (Can be specialized to target if
@@ -251,6 +253,65 @@ static float32 float32_squash_input_denormal(float32 a STATUS_PARAM)
     return a;
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path for the basic operations.  The host computes the result
+| itself when it must give the same bits and flags as the code below:
+| rounding to nearest even (which QEMU never changes on the host), inexact
+| already raised (so that it need not be detected), both inputs zero or
+| normal, and a normal result (so that no overflow, underflow or flush to
+| zero can have happened).  Otherwise the result is thrown away and computed
+| again in software.  Only hosts which compute floats at their own precision
+| (no x87 extended precision) take it.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define SOFTFLOAT_HOST_FPU 1
+#else
+#define SOFTFLOAT_HOST_FPU 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} float32_host;
+
+INLINE float float32_to_host(float32 a)
+{
+    float32_host u;
+
+    u.s = a;
+    return u.h;
+}
+
+INLINE float32 float32_from_host(float h)
+{
+    float32_host u;
+
+    u.h = h;
+    return u.s;
+}
+
+INLINE int float32_is_zero_or_normal(float32 a)
+{
+    int_fast16_t aExp = extractFloat32Exp(a);
+
+    return aExp != 0xFF && (aExp != 0 || extractFloat32Frac(a) == 0);
+}
+
+INLINE int float32_host_inputs_ok(float32 a, float32 b STATUS_PARAM)
+{
+    return SOFTFLOAT_HOST_FPU &&
+           STATUS(float_rounding_mode) == float_round_nearest_even &&
+           (STATUS(float_exception_flags) & float_flag_inexact) &&
+           float32_is_zero_or_normal(a) && float32_is_zero_or_normal(b);
+}
+
+/* Larger than the smallest normal and not infinite or NaN */
+INLINE int float32_host_result_ok(float32 z)
+{
+    return extractFloat32Exp(z) != 0xFF &&
+           (float32_val(z) & 0x7FFFFFFF) > 0x00800000;
+}
+
 /*----------------------------------------------------------------------------
 | Normalizes the subnormal single-precision floating-point value represented
 | by the denormalized significand `aSig'.  The normalized exponent and
@@ -433,6 +494,52 @@ static float64 float64_squash_input_denormal(float64 a STATUS_PARAM)
     return a;
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path for double precision; see float32_host_inputs_ok().
+*----------------------------------------------------------------------------*/
+typedef union {
+    float64 s;
+    double h;
+} float64_host;
+
+INLINE double float64_to_host(float64 a)
+{
+    float64_host u;
+
+    u.s = a;
+    return u.h;
+}
+
+INLINE float64 float64_from_host(double h)
+{
+    float64_host u;
+
+    u.h = h;
+    return u.s;
+}
+
+INLINE int float64_is_zero_or_normal(float64 a)
+{
+    int_fast16_t aExp = extractFloat64Exp(a);
+
+    return aExp != 0x7FF && (aExp != 0 || extractFloat64Frac(a) == 0);
+}
+
+INLINE int float64_host_inputs_ok(float64 a, float64 b STATUS_PARAM)
+{
+    return SOFTFLOAT_HOST_FPU &&
+           STATUS(float_rounding_mode) == float_round_nearest_even &&
+           (STATUS(float_exception_flags) & float_flag_inexact) &&
+           float64_is_zero_or_normal(a) && float64_is_zero_or_normal(b);
+}
+
+INLINE int float64_host_result_ok(float64 z)
+{
+    return extractFloat64Exp(z) != 0x7FF &&
+           (float64_val(z) & LIT64(0x7FFFFFFFFFFFFFFF)) >
+           LIT64(0x0010000000000000);
+}
+
 /*----------------------------------------------------------------------------
 | Normalizes the subnormal double-precision floating-point value represented
 | by the denormalized significand `aSig'.  The normalized exponent and
@@ -1867,6 +1974,15 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+
+    if (float32_host_inputs_ok(a, b STATUS_VAR)) {
+        float32 z = float32_from_host(float32_to_host(a) +
+                                      float32_to_host(b));
+        if (float32_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1890,6 +2006,15 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+
+    if (float32_host_inputs_ok(a, b STATUS_VAR)) {
+        float32 z = float32_from_host(float32_to_host(a) -
+                                      float32_to_host(b));
+        if (float32_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1918,6 +2043,14 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     uint64_t zSig64;
     uint32_t zSig;
 
+    if (float32_host_inputs_ok(a, b STATUS_VAR)) {
+        float32 z = float32_from_host(float32_to_host(a) *
+                                      float32_to_host(b));
+        if (float32_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1978,6 +2111,15 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+
+    if (float32_host_inputs_ok(a, b STATUS_VAR)) {
+        float32 z = float32_from_host(float32_to_host(a) /
+                                      float32_to_host(b));
+        if (float32_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -3430,6 +3572,15 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+
+    if (float64_host_inputs_ok(a, b STATUS_VAR)) {
+        float64 z = float64_from_host(float64_to_host(a) +
+                                      float64_to_host(b));
+        if (float64_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3453,6 +3604,15 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+
+    if (float64_host_inputs_ok(a, b STATUS_VAR)) {
+        float64 z = float64_from_host(float64_to_host(a) -
+                                      float64_to_host(b));
+        if (float64_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3479,6 +3639,14 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+    if (float64_host_inputs_ok(a, b STATUS_VAR)) {
+        float64 z = float64_from_host(float64_to_host(a) *
+                                      float64_to_host(b));
+        if (float64_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3541,6 +3709,15 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+
+    if (float64_host_inputs_ok(a, b STATUS_VAR)) {
+        float64 z = float64_from_host(float64_to_host(a) /
+                                      float64_to_host(b));
+        if (float64_host_result_ok(z)) {
+            return z;
+        }
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
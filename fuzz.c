@@ -0,0 +1,289 @@
+/*
+ * Firmware fuzzing against a snapshot
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "sysemu/fuzz.h"
+#include "sysemu/sysemu.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "char/char.h"
+#include "qmp-commands.h"
+
+/**
+ * Runs
+ *
+ * Every run starts from the state the machine is in right after its first
+ * reset, which is kept in memory as for -machine fast-reset=on, so that a
+ * run costs a reset and the code the input makes the firmware execute.
+ * Code translated from flash that earlier runs left alone is not
+ * translated again.  The input is handed to the front end of a character
+ * device, such as the USART a serial port is wired to, as fast as its
+ * receive FIFO takes it.  A run ends:
+ *
+ *  - when the input has all been taken and the guest has then run for the
+ *    idle time without being given more (status 0),
+ *  - when the guest takes a HardFault (status SIGSEGV),
+ *  - or when the run has lasted the timeout (status SIGKILL),
+ *
+ * all in virtual time.  The statuses are those afl-fuzz expects from a
+ * child killed by that signal.
+ *
+ * With input=FILE the runs are driven by afl-fuzz through the pipes of
+ * its fork server, in persistent mode: for every 4 bytes on the control
+ * pipe FILE is read and run, and the pid and then the status of the run
+ * are written back.  All runs are served by the same process, so the pid
+ * is QEMU's own.  Edge coverage comes from -tcg coverage=on.
+ */
+
+#define FUZZ_CTL_FD             198
+#define FUZZ_STATUS_FD          199
+
+#define FUZZ_DEFAULT_TIMEOUT_MS 1000
+#define FUZZ_DEFAULT_IDLE_US    1000
+
+/* How often input that did not fit is offered again.  */
+#define FUZZ_POLL_NS            10000
+
+typedef struct FuzzState {
+    char *chardev;
+    CharDriverState *chr;
+    char *input_path;
+    int64_t timeout_ns;
+    int64_t idle_ns;
+    QEMUTimer *timer;
+
+    /* Input not yet taken by the front end.  */
+    uint8_t *buf;
+    size_t pos, len, size;
+
+    bool running;
+    bool fault;
+    int64_t start;
+    int64_t last_input;
+} FuzzState;
+
+static FuzzState *fuzz;
+
+static void fuzz_queue(FuzzState *s, const uint8_t *data, size_t len)
+{
+    if (s->pos) {
+        memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->pos = 0;
+    }
+    if (s->len + len > s->size) {
+        s->size = s->len + len;
+        s->buf = g_realloc(s->buf, s->size);
+    }
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
+
+static void fuzz_feed(FuzzState *s, int64_t now)
+{
+    int n;
+
+    if (s->pos == s->len) {
+        return;
+    }
+    n = qemu_chr_be_can_write(s->chr);
+    if (n <= 0) {
+        return;
+    }
+    n = MIN(n, s->len - s->pos);
+    qemu_chr_be_write(s->chr, s->buf + s->pos, n);
+    s->pos += n;
+    s->last_input = now;
+}
+
+static void fuzz_write_status(uint32_t val)
+{
+    if (write(FUZZ_STATUS_FD, &val, sizeof(val)) != sizeof(val)) {
+        /* afl-fuzz has gone away.  */
+        qemu_system_shutdown_request();
+    }
+}
+
+static void fuzz_finish(FuzzState *s, int status)
+{
+    s->running = false;
+    s->fault = false;
+    s->pos = s->len = 0;
+    qemu_del_timer(s->timer);
+    vm_stop(RUN_STATE_PAUSED);
+    if (s->input_path) {
+        fuzz_write_status(status);
+    }
+}
+
+static void fuzz_tick(void *opaque)
+{
+    FuzzState *s = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    if (!s->running) {
+        /* Input from fuzz-input between runs.  */
+        fuzz_feed(s, now);
+        if (s->pos < s->len) {
+            qemu_mod_timer(s->timer, now + FUZZ_POLL_NS);
+        }
+        return;
+    }
+
+    if (s->fault) {
+        fuzz_finish(s, SIGSEGV);
+        return;
+    }
+    fuzz_feed(s, now);
+    if (s->pos == s->len && now - s->last_input >= s->idle_ns) {
+        fuzz_finish(s, 0);
+    } else if (now - s->start >= s->timeout_ns) {
+        fuzz_finish(s, SIGKILL);
+    } else if (s->pos < s->len) {
+        qemu_mod_timer(s->timer, MIN(now + FUZZ_POLL_NS,
+                                     s->start + s->timeout_ns));
+    } else {
+        qemu_mod_timer(s->timer, MIN(s->last_input + s->idle_ns,
+                                     s->start + s->timeout_ns));
+    }
+}
+
+static void fuzz_run(FuzzState *s, const uint8_t *data, size_t len)
+{
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_PAUSED);
+    }
+    qemu_system_reset(VMRESET_SILENT);
+    tcg_coverage_prev = 0;
+
+    s->pos = s->len = 0;
+    fuzz_queue(s, data, len);
+    s->running = true;
+    s->fault = false;
+    s->start = s->last_input = qemu_get_clock_ns(vm_clock);
+    fuzz_feed(s, s->start);
+    qemu_mod_timer(s->timer, s->start);
+    vm_start();
+}
+
+static void fuzz_ctl_read(void *opaque)
+{
+    FuzzState *s = opaque;
+    GError *err = NULL;
+    uint32_t val;
+    gchar *data;
+    gsize len;
+    ssize_t ret;
+
+    ret = read(FUZZ_CTL_FD, &val, sizeof(val));
+    if (ret < 0 && errno == EINTR) {
+        return;
+    }
+    if (ret != sizeof(val)) {
+        qemu_set_fd_handler(FUZZ_CTL_FD, NULL, NULL, NULL);
+        qemu_system_shutdown_request();
+        return;
+    }
+
+    fuzz_write_status(getpid());
+    if (!g_file_get_contents(s->input_path, &data, &len, &err)) {
+        fprintf(stderr, "qemu: fuzz: %s\n", err->message);
+        g_error_free(err);
+        exit(1);
+    }
+    fuzz_run(s, (uint8_t *)data, len);
+    g_free(data);
+}
+
+void fuzz_guest_fault(void)
+{
+    FuzzState *s = fuzz;
+
+    /* This runs in the CPU thread, which cannot stop the machine itself
+     * without racing with the next run.  */
+    if (s && s->running && !s->fault) {
+        s->fault = true;
+        qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+void qmp_fuzz_input(const char *data, Error **errp)
+{
+    FuzzState *s = fuzz;
+    guchar *buf;
+    gsize len;
+
+    if (!s || !s->chr) {
+        error_setg(errp, "Fuzzing is not enabled, see -fuzz");
+        return;
+    }
+    buf = g_base64_decode(data, &len);
+    fuzz_queue(s, buf, len);
+    g_free(buf);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock));
+}
+
+void fuzz_start(void)
+{
+    FuzzState *s = fuzz;
+    uint32_t hello = 0;
+
+    if (!s) {
+        return;
+    }
+    /* Serial ports only get their character devices with the machine.  */
+    s->chr = qemu_chr_find(s->chardev);
+    if (!s->chr) {
+        fprintf(stderr, "qemu: -fuzz: no character device '%s'\n",
+                s->chardev);
+        exit(1);
+    }
+    if (qemu_savevm_reset_state() < 0) {
+        fprintf(stderr, "qemu: fuzz: cannot take the snapshot runs start "
+                "from\n");
+        exit(1);
+    }
+    if (!s->input_path) {
+        return;
+    }
+
+    /* Runs only start when afl-fuzz asks for them.  */
+    autostart = 0;
+    if (write(FUZZ_STATUS_FD, &hello, sizeof(hello)) != sizeof(hello)) {
+        fprintf(stderr, "qemu: fuzz: input= needs the fork server pipes "
+                "of afl-fuzz\n");
+        exit(1);
+    }
+    qemu_set_fd_handler(FUZZ_CTL_FD, fuzz_ctl_read, NULL, s);
+}
+
+void fuzz_configure(QemuOpts *opts)
+{
+    FuzzState *s;
+
+    if (!opts) {
+        return;
+    }
+
+    s = g_new0(FuzzState, 1);
+    s->chardev = g_strdup(qemu_opt_get(opts, "chardev"));
+    if (!s->chardev) {
+        fprintf(stderr, "qemu: -fuzz: chardev is required\n");
+        exit(1);
+    }
+    s->input_path = g_strdup(qemu_opt_get(opts, "input"));
+    s->timeout_ns = qemu_opt_get_number(opts, "timeout",
+                                        FUZZ_DEFAULT_TIMEOUT_MS) * SCALE_MS;
+    s->idle_ns = qemu_opt_get_number(opts, "idle",
+                                     FUZZ_DEFAULT_IDLE_US) * SCALE_US;
+    if (s->timeout_ns <= 0) {
+        fprintf(stderr, "qemu: -fuzz: timeout must be positive\n");
+        exit(1);
+    }
+    s->timer = qemu_new_timer_ns(vm_clock, fuzz_tick, s);
+    fuzz = s;
+}
@@ -33,9 +33,12 @@
 #include "char/char.h"
 #include "sysemu/sysemu.h"
 #include "exec/gdbstub.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+/* Large enough for gdb to load a flash image in a few hundred packets.  */
+#define MAX_PACKET_LENGTH 16384
 
 #include "cpu.h"
 #include "qemu/sockets.h"
@@ -306,6 +309,10 @@ typedef struct GDBState {
 #endif
     char syscall_buf[256];
     gdb_syscall_complete_cb current_syscall_cb;
+#ifndef CONFIG_USER_ONLY
+    /* Taken when gdb starts reading it, for the reads that follow.  */
+    char *memory_map;
+#endif
 } GDBState;
 
 /* By default use no IRQs and no timers while single stepping so as to
@@ -438,6 +445,26 @@ static void hextomem(uint8_t *mem, const char *buf, int len)
     }
 }
 
+/* Decode the binary data of an 'X' or vFlashWrite packet, at most MAX
+   bytes of it.  '#', '$', '}' and '*' come as '}' and the byte xor 0x20.
+   Returns the number of bytes decoded.  */
+static int bintomem(uint8_t *mem, const char *buf, int buf_len, int max)
+{
+    int i, n = 0;
+
+    for (i = 0; i < buf_len && n < max; i++) {
+        if (buf[i] == '}') {
+            if (++i == buf_len) {
+                break;
+            }
+            mem[n++] = buf[i] ^ 0x20;
+        } else {
+            mem[n++] = buf[i];
+        }
+    }
+    return n;
+}
+
 /* return -1 if error, 0 if OK */
 static int put_packet_binary(GDBState *s, const char *buf, int len)
 {
@@ -1794,7 +1821,7 @@ static int cpu_gdb_write_register(CPUArchState *env, uint8_t *mem_buf, int n)
 static int num_g_regs = NUM_CORE_REGS;
 #endif
 
-#ifdef GDB_CORE_XML
+#if defined(GDB_CORE_XML) || !defined(CONFIG_USER_ONLY)
 /* Encode data using the encoding for 'x' packets.  */
 static int memtox(char *buf, const char *mem, int len)
 {
@@ -1816,6 +1843,36 @@ static int memtox(char *buf, const char *mem, int len)
     return p - buf;
 }
 
+/* Reply to a qXfer read of DATA, with the OFFSET,LENGTH that P points to.  */
+static void put_xfer_reply(GDBState *s, const char *data, const char *p)
+{
+    char buf[MAX_PACKET_LENGTH];
+    target_ulong addr, len, total_len;
+
+    addr = strtoul(p, (char **)&p, 16);
+    if (*p == ',')
+        p++;
+    len = strtoul(p, (char **)&p, 16);
+
+    total_len = strlen(data);
+    if (addr > total_len) {
+        put_packet(s, "E00");
+        return;
+    }
+    if (len > (MAX_PACKET_LENGTH - 5) / 2)
+        len = (MAX_PACKET_LENGTH - 5) / 2;
+    if (len < total_len - addr) {
+        buf[0] = 'm';
+        len = memtox(buf + 1, data + addr, len);
+    } else {
+        buf[0] = 'l';
+        len = memtox(buf + 1, data + addr, total_len - addr);
+    }
+    put_packet_binary(s, buf, len + 1);
+}
+#endif
+
+#ifdef GDB_CORE_XML
 static const char *get_feature_xml(const char *p, const char **newp)
 {
     size_t len;
@@ -1963,6 +2020,12 @@ static int gdb_breakpoint_insert(target_ulong addr, target_ulong len, int type)
     case GDB_WATCHPOINT_READ:
     case GDB_WATCHPOINT_ACCESS:
         for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            /* translators may fold loads of constant data into the code
+               while no watchpoint is set (see gen_ld32_literal in
+               target-arm); drop that code so the watchpoint sees them */
+            if (QTAILQ_EMPTY(&env->watchpoints)) {
+                tb_flush(env);
+            }
             err = cpu_watchpoint_insert(env, addr, len, xlat_gdb_type[type],
                                         NULL);
             if (err)
@@ -2076,7 +2139,147 @@ static CPUArchState *find_cpu(uint32_t thread_id)
     return NULL;
 }
 
-static int gdb_handle_packet(GDBState *s, const char *line_buf)
+#ifndef CONFIG_USER_ONLY
+typedef struct GDBFlash {
+    MemoryRegion *mr;
+    hwaddr block_size;
+    const GDBFlashOps *ops;
+    void *opaque;
+    QLIST_ENTRY(GDBFlash) next;
+} GDBFlash;
+
+static QLIST_HEAD(, GDBFlash) gdb_flashes =
+    QLIST_HEAD_INITIALIZER(gdb_flashes);
+
+void gdb_register_flash(MemoryRegion *mr, hwaddr block_size,
+                        const GDBFlashOps *ops, void *opaque)
+{
+    GDBFlash *flash = g_new0(GDBFlash, 1);
+
+    flash->mr = mr;
+    flash->block_size = block_size;
+    flash->ops = ops;
+    flash->opaque = opaque;
+    QLIST_INSERT_HEAD(&gdb_flashes, flash, next);
+}
+
+static GDBFlash *gdb_find_flash(MemoryRegion *mr)
+{
+    GDBFlash *flash;
+
+    QLIST_FOREACH(flash, &gdb_flashes, next) {
+        if (flash->mr == mr) {
+            return flash;
+        }
+    }
+    return NULL;
+}
+
+typedef struct GDBMemoryMap {
+    MemoryListener listener;
+    GString *xml;
+} GDBMemoryMap;
+
+static void gdb_memory_map_add(MemoryListener *listener,
+                               MemoryRegionSection *section)
+{
+    GDBMemoryMap *map = container_of(listener, GDBMemoryMap, listener);
+    GDBFlash *flash = gdb_find_flash(section->mr);
+    const char *type = "ram";
+
+    if (flash) {
+        type = "flash";
+    } else if (section->readonly || section->mr->rom_device ||
+               memory_region_is_rom(section->mr)) {
+        type = "rom";
+    }
+    g_string_append_printf(map->xml,
+                           "<memory type=\"%s\" start=\"0x%" PRIx64
+                           "\" length=\"0x%" PRIx64 "\">", type,
+                           (uint64_t)section->offset_within_address_space,
+                           section->size);
+    if (flash) {
+        g_string_append_printf(map->xml,
+                               "<property name=\"blocksize\">0x%" PRIx64
+                               "</property>", (uint64_t)flash->block_size);
+    }
+    g_string_append(map->xml, "</memory>\n");
+}
+
+/* gdb refuses to touch anything outside the memory map, so everything
+   that is mapped is listed, devices as RAM.  Flash that registered with
+   gdb_register_flash is programmed through the vFlash packets.  */
+static char *gdb_memory_map_xml(void)
+{
+    GDBMemoryMap map = {
+        .listener = {
+            .region_add = gdb_memory_map_add,
+        },
+    };
+
+    map.xml = g_string_new("<?xml version=\"1.0\"?>\n"
+                           "<!DOCTYPE memory-map PUBLIC "
+                           "\"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+                           "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+                           "<memory-map>\n");
+    /* Registering a listener replays the current map to it.  */
+    memory_listener_register(&map.listener, &address_space_memory);
+    memory_listener_unregister(&map.listener);
+    g_string_append(map.xml, "</memory-map>\n");
+    return g_string_free(map.xml, false);
+}
+
+/* vFlashErase:ADDR,LENGTH, vFlashWrite:ADDR:DATA and vFlashDone, with P
+   just after "vFlash".  Returns the reply, or NULL if P is none of them.  */
+static const char *gdb_handle_vflash(const char *p, int len, uint8_t *mem_buf,
+                                     int mem_len)
+{
+    const char *end = p + len;
+    MemoryRegionSection section;
+    GDBFlash *flash;
+    hwaddr addr, size;
+    bool erase;
+
+    if (strncmp(p, "Erase:", 6) == 0) {
+        erase = true;
+        addr = strtoull(p + 6, (char **)&p, 16);
+        if (*p++ != ',') {
+            return "E01";
+        }
+        size = strtoull(p, NULL, 16);
+    } else if (strncmp(p, "Write:", 6) == 0) {
+        erase = false;
+        addr = strtoull(p + 6, (char **)&p, 16);
+        if (*p++ != ':') {
+            return "E01";
+        }
+        size = bintomem(mem_buf, p, end - p, mem_len);
+    } else if (strcmp(p, "Done") == 0) {
+        /* Every erase and write has already taken effect.  */
+        return "OK";
+    } else {
+        return NULL;
+    }
+
+    section = memory_region_find(get_system_memory(), addr, size);
+    flash = section.mr ? gdb_find_flash(section.mr) : NULL;
+    if (!flash || section.size < size) {
+        return "E01";
+    }
+    if (erase) {
+        if (flash->ops->erase(flash->opaque, section.offset_within_region,
+                              size) < 0) {
+            return "E01";
+        }
+    } else if (flash->ops->write(flash->opaque, section.offset_within_region,
+                                 mem_buf, size) < 0) {
+        return "E01";
+    }
+    return "OK";
+}
+#endif
+
+static int gdb_handle_packet(GDBState *s, const char *line_buf, int line_len)
 {
     CPUArchState *env;
     const char *p;
@@ -2173,6 +2376,17 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 return RS_IDLE;
             }
             break;
+#ifndef CONFIG_USER_ONLY
+        } else if (strncmp(p, "Flash", 5) == 0) {
+            const char *reply = gdb_handle_vflash(p + 5,
+                                                  line_buf + line_len - p - 5,
+                                                  mem_buf, sizeof(mem_buf));
+            if (!reply) {
+                goto unknown_command;
+            }
+            put_packet(s, reply);
+            break;
+#endif
         } else {
             goto unknown_command;
         }
@@ -2252,7 +2466,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
-        if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
+        if (len > (sizeof(buf) - 1) / 2) {
+            put_packet(s, "E22");
+        } else if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
             put_packet (s, "E14");
         } else {
             memtohex(buf, mem_buf, len);
@@ -2266,6 +2482,10 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         len = strtoull(p, (char **)&p, 16);
         if (*p == ':')
             p++;
+        if (len > sizeof(mem_buf) || strlen(p) < len * 2) {
+            put_packet(s, "E22");
+            break;
+        }
         hextomem(mem_buf, p, len);
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0) {
             put_packet(s, "E14");
@@ -2273,6 +2493,23 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, "OK");
         }
         break;
+    case 'X':
+        /* Like 'M', with the data in binary.  */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, (char **)&p, 16);
+        if (*p == ':')
+            p++;
+        if (len > sizeof(mem_buf) ||
+            bintomem(mem_buf, p, line_buf + line_len - p, len) != len) {
+            put_packet(s, "E22");
+        } else if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
     case 'p':
         /* Older gdb are really dumb, and don't use 'g' if 'p' is avaialable.
            This works, but can be very slow.  Anything new enough to
@@ -2441,9 +2678,12 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (strncmp(p, "Supported", 9) == 0) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH - 1);
 #ifdef GDB_CORE_XML
             pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
+#endif
+#ifndef CONFIG_USER_ONLY
+            pstrcat(buf, sizeof(buf), ";qXfer:memory-map:read+");
 #endif
             put_packet(s, buf);
             break;
@@ -2451,7 +2691,6 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 #ifdef GDB_CORE_XML
         if (strncmp(p, "Xfer:features:read:", 19) == 0) {
             const char *xml;
-            target_ulong total_len;
 
             gdb_has_xml = 1;
             p += 19;
@@ -2464,27 +2703,18 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 
             if (*p == ':')
                 p++;
-            addr = strtoul(p, (char **)&p, 16);
-            if (*p == ',')
-                p++;
-            len = strtoul(p, (char **)&p, 16);
-
-            total_len = strlen(xml);
-            if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
-                put_packet(s, buf);
-                break;
-            }
-            if (len > (MAX_PACKET_LENGTH - 5) / 2)
-                len = (MAX_PACKET_LENGTH - 5) / 2;
-            if (len < total_len - addr) {
-                buf[0] = 'm';
-                len = memtox(buf + 1, xml + addr, len);
-            } else {
-                buf[0] = 'l';
-                len = memtox(buf + 1, xml + addr, total_len - addr);
+            put_xfer_reply(s, xml, p);
+            break;
+        }
+#endif
+#ifndef CONFIG_USER_ONLY
+        if (strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+            p += 22;
+            if (!s->memory_map || strtoul(p, NULL, 16) == 0) {
+                g_free(s->memory_map);
+                s->memory_map = gdb_memory_map_xml();
             }
-            put_packet_binary(s, buf, len + 1);
+            put_xfer_reply(s, s->memory_map, p);
             break;
         }
 #endif
@@ -2720,7 +2950,8 @@ static void gdb_read_byte(GDBState *s, int ch)
             } else {
                 reply = '+';
                 put_buffer(s, &reply, 1);
-                s->state = gdb_handle_packet(s, s->line_buf);
+                s->state = gdb_handle_packet(s, s->line_buf,
+                                             s->line_buf_index);
             }
             break;
         default:
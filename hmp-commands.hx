@@ -307,19 +307,25 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save it while the VM runs",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the VM only stops while its devices are saved: RAM is
+saved, as it was then, while the VM runs, and the snapshot appears once it
+is complete.  This needs TCG, and the VM state must go to a disk that the
+guest does not use, for example one given with @option{-drive if=none}.
 ETEXI
 
     {
@@ -930,6 +936,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_encode_threads",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of threads that check and XBZRLE "
+                      "encode pages for migrations (0 for none)",
+        .mhandler.cmd = hmp_migrate_set_encode_threads,
+    },
+
+STEXI
+@item migrate_set_encode_threads @var{value}
+@findex migrate_set_encode_threads
+Set the number of threads that help the migration thread to check pages for
+duplicates and XBZRLE encode them to @var{value}, from the next migration on.
 ETEXI
 
     {
@@ -1598,6 +1620,12 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tbs [@var{count}]
+show the @var{count} most executed translation blocks (default 20), when
+profiling is enabled with @option{-tcg profile=on}
+@item info tlb-stats
+show the softmmu TLB size and, for each CPU, how many main TLB misses
+were served from the victim TLB
 @item info numa
 show NUMA information
 @item info kvm
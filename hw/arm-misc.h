@@ -29,8 +29,38 @@ qemu_irq *armv7m_translated_init(MemoryRegion *address_space_mem,
                                  const char *kernel_filename,
                                  uint64_t (*kernel_translate_fn)(void *, uint64_t),
                                  void *kernel_translate_opaque,
+                                 MemoryRegion *flash,
                                  const char *cpu_model);
 
+/* Returns the address space whose root is address_space_mem, creating it
+   the first time.  This is address_space_memory for the system memory.  */
+AddressSpace *armv7m_address_space(MemoryRegion *address_space_mem);
+
+/* armv7m_nvic.c */
+typedef enum {
+    ARMV7M_DEEPSLEEP_NONE,      /* Sleep as for a plain WFI */
+    ARMV7M_DEEPSLEEP_STOP,      /* Core clock stopped, SysTick too */
+    ARMV7M_DEEPSLEEP_OFF,       /* Core off until the next reset */
+} ARMv7MDeepSleep;
+
+/* Called with SLEEP true when the CPU executes WFI with SCR.SLEEPDEEP set,
+   and returns what becomes of the core.  Called again with SLEEP false
+   when an exception wakes the core from ARMV7M_DEEPSLEEP_STOP.  */
+typedef ARMv7MDeepSleep ARMv7MDeepSleepFn(void *opaque, bool sleep);
+
+/* Sets who decides what deep sleep means (the power controller of the
+   chip).  Without one, deep sleep is the same as sleep.  */
+void armv7m_nvic_set_deepsleep_handler(DeviceState *nvic,
+                                       ARMv7MDeepSleepFn *fn, void *opaque);
+
+/* armv7m_pcsample.c */
+/* Starts sampling the PC of CPU if -pcsample was given.  */
+void armv7m_pcsample_init(ARMCPU *cpu);
+
+/* armv7m_itm.c */
+/* Maps the ITM and the DWT, with the stimulus ports written to CHR.  */
+void armv7m_itm_init(MemoryRegion *address_space_mem, CharDriverState *chr);
+
 /* arm_boot.c */
 struct arm_boot_info {
     uint64_t ram_size;
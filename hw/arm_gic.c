@@ -45,8 +45,9 @@ static inline int gic_get_current_cpu(GICState *s)
     return 0;
 }
 
-/* TODO: Many places that call this routine could be optimized.  */
-/* Update interrupt status after enabled or pending bits have been changed.  */
+/* Update interrupt status after enabled or pending bits have been changed.
+   Only the interrupts in the ready bitmap of each CPU are candidates, and
+   there are few of them at any time.  */
 void gic_update(GICState *s)
 {
     int best_irq;
@@ -54,10 +55,8 @@ void gic_update(GICState *s)
     int irq;
     int level;
     int cpu;
-    int cm;
 
     for (cpu = 0; cpu < NUM_CPU(s); cpu++) {
-        cm = 1 << cpu;
         s->current_pending[cpu] = 1023;
         if (!s->enabled || !s->cpu_enabled[cpu]) {
             qemu_irq_lower(s->parent_irq[cpu]);
@@ -65,12 +64,12 @@ void gic_update(GICState *s)
         }
         best_prio = 0x100;
         best_irq = 1023;
-        for (irq = 0; irq < s->num_irq; irq++) {
-            if (GIC_TEST_ENABLED(irq, cm) && GIC_TEST_PENDING(irq, cm)) {
-                if (GIC_GET_PRIORITY(irq, cpu) < best_prio) {
-                    best_prio = GIC_GET_PRIORITY(irq, cpu);
-                    best_irq = irq;
-                }
+        for (irq = find_first_bit(s->ready[cpu], s->num_irq);
+             irq < s->num_irq;
+             irq = find_next_bit(s->ready[cpu], s->num_irq, irq + 1)) {
+            if (GIC_GET_PRIORITY(irq, cpu) < best_prio) {
+                best_prio = GIC_GET_PRIORITY(irq, cpu);
+                best_irq = irq;
             }
         }
         level = 0;
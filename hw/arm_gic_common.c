@@ -89,6 +89,7 @@ static int gic_load(QEMUFile *f, void *opaque, int version_id)
         s->irq_state[i].level = qemu_get_byte(f);
         s->irq_state[i].model = qemu_get_byte(f);
         s->irq_state[i].trigger = qemu_get_byte(f);
+        gic_update_ready(s, i);
     }
 
     return 0;
@@ -126,6 +127,7 @@ static void arm_gic_common_reset(DeviceState *dev)
     GICState *s = FROM_SYSBUS(GICState, SYS_BUS_DEVICE(dev));
     int i;
     memset(s->irq_state, 0, GIC_MAXIRQ * sizeof(gic_irq_state));
+    memset(s->ready, 0, sizeof(s->ready));
     for (i = 0 ; i < s->num_cpu; i++) {
         if (s->revision == REV_11MPCORE) {
             s->priority_mask[i] = 0xf0;
@@ -22,6 +22,7 @@
 #define QEMU_ARM_GIC_INTERNAL_H
 
 #include "sysbus.h"
+#include "qemu/bitops.h"
 
 /* Maximum number of possible interrupts, determined by the GIC architecture */
 #define GIC_MAXIRQ 1020
@@ -36,11 +37,23 @@
    through the normal GIC interface.  */
 #define GIC_BASE_IRQ ((s->revision == REV_NVIC) ? 32 : 0)
 
-#define GIC_SET_ENABLED(irq, cm) s->irq_state[irq].enabled |= (cm)
-#define GIC_CLEAR_ENABLED(irq, cm) s->irq_state[irq].enabled &= ~(cm)
+#define GIC_SET_ENABLED(irq, cm) do {                                   \
+        s->irq_state[irq].enabled |= (cm);                              \
+        gic_update_ready(s, irq);                                       \
+    } while (0)
+#define GIC_CLEAR_ENABLED(irq, cm) do {                                 \
+        s->irq_state[irq].enabled &= ~(cm);                             \
+        gic_update_ready(s, irq);                                       \
+    } while (0)
 #define GIC_TEST_ENABLED(irq, cm) ((s->irq_state[irq].enabled & (cm)) != 0)
-#define GIC_SET_PENDING(irq, cm) s->irq_state[irq].pending |= (cm)
-#define GIC_CLEAR_PENDING(irq, cm) s->irq_state[irq].pending &= ~(cm)
+#define GIC_SET_PENDING(irq, cm) do {                                   \
+        s->irq_state[irq].pending |= (cm);                              \
+        gic_update_ready(s, irq);                                       \
+    } while (0)
+#define GIC_CLEAR_PENDING(irq, cm) do {                                 \
+        s->irq_state[irq].pending &= ~(cm);                             \
+        gic_update_ready(s, irq);                                       \
+    } while (0)
 #define GIC_TEST_PENDING(irq, cm) ((s->irq_state[irq].pending & (cm)) != 0)
 #define GIC_SET_ACTIVE(irq, cm) s->irq_state[irq].active |= (cm)
 #define GIC_CLEAR_ACTIVE(irq, cm) s->irq_state[irq].active &= ~(cm)
@@ -76,6 +89,10 @@ typedef struct GICState {
     int cpu_enabled[NCPU];
 
     gic_irq_state irq_state[GIC_MAXIRQ];
+    /* The interrupts which are both enabled and pending for each CPU, so
+     * that gic_update only looks at those.  Kept by the macros above.
+     */
+    unsigned long ready[NCPU][BITS_TO_LONGS(GIC_MAXIRQ)];
     int irq_target[GIC_MAXIRQ];
     int priority1[GIC_INTERNAL][NCPU];
     int priority2[GIC_MAXIRQ - GIC_INTERNAL];
@@ -98,6 +115,21 @@ typedef struct GICState {
     uint32_t revision;
 } GICState;
 
+/* Bring the ready bitmaps up to date with the state of irq.  */
+static inline void gic_update_ready(GICState *s, int irq)
+{
+    unsigned ready = s->irq_state[irq].enabled & s->irq_state[irq].pending;
+    int cpu;
+
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        if (ready & (1 << cpu)) {
+            set_bit(irq, s->ready[cpu]);
+        } else {
+            clear_bit(irq, s->ready[cpu]);
+        }
+    }
+}
+
 /* The special cases for the revision property: */
 #define REV_11MPCORE 0
 #define REV_NVIC 0xffffffff
@@ -45,6 +45,15 @@ static void arm_timer_update(arm_timer_state *s)
     }
 }
 
+/* Periodic expirations do not trigger while the interrupt is disabled
+   (see ptimer_set_trigger), so the raw status catches up with them here.  */
+static void arm_timer_catch_up(arm_timer_state *s)
+{
+    if (ptimer_take_expired(s->timer)) {
+        s->int_level = 1;
+    }
+}
+
 static uint32_t arm_timer_read(void *opaque, hwaddr offset)
 {
     arm_timer_state *s = (arm_timer_state *)opaque;
@@ -58,6 +67,7 @@ static uint32_t arm_timer_read(void *opaque, hwaddr offset)
     case 2: /* TimerControl */
         return s->control;
     case 4: /* TimerRIS */
+        arm_timer_catch_up(s);
         return s->int_level;
     case 5: /* TimerMIS */
         if ((s->control & TIMER_CTRL_IE) == 0)
@@ -110,7 +120,9 @@ static void arm_timer_write(void *opaque, hwaddr offset,
                messyness.  */
             ptimer_stop(s->timer);
         }
+        arm_timer_catch_up(s);
         s->control = value;
+        ptimer_set_trigger(s->timer, (s->control & TIMER_CTRL_IE) != 0);
         freq = s->freq;
         /* ??? Need to recalculate expiry time after changing divisor.  */
         switch ((value >> 2) & 3) {
@@ -125,6 +137,7 @@ static void arm_timer_write(void *opaque, hwaddr offset,
         }
         break;
     case 3: /* TimerIntClr */
+        arm_timer_catch_up(s);
         s->int_level = 0;
         break;
     case 6: /* TimerBGLoad */
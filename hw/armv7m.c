@@ -11,142 +11,293 @@
 #include "arm-misc.h"
 #include "loader.h"
 #include "elf.h"
+#include "exec/address-spaces.h"
+#include "exec/exec-all.h"
+#include "sysemu/sysemu.h"
+#include "char/char.h"
+
+/* Number of external interrupt lines on the NVIC.  This must be a multiple
+   of 32, and covers the 81 vectors of the STM32F2 parts.  */
+#define ARMV7M_NUM_IRQ 96
 
 /* Bitbanded IO.  Each word corresponds to a single bit.  */
 
+/* Size of the real memory window behind a 32Mb bitband alias.  */
+#define BITBAND_TARGET_SIZE (0x02000000 >> 5)
+
+typedef struct {
+    SysBusDevice busdev;
+    MemoryRegion iomem;
+    uint32_t base;
+    /* The memory the alias is in, the system memory unless set.  */
+    void *as_prop;
+    void *root_prop;
+    AddressSpace *as;
+    MemoryRegion *root;
+    /* The region behind the last accessed address, so that an access can
+       go straight to RAM or to the owning device.  Dropped whenever the
+       memory map changes.  */
+    MemoryListener listener;
+    MemoryRegionSection target;
+    uint8_t *target_ram;
+} BitBandState;
+
 /* Get the byte address of the real memory for a bitband access.  */
-static inline uint32_t bitband_addr(void * opaque, uint32_t addr)
+static inline uint32_t bitband_addr(BitBandState *s, uint32_t addr)
 {
-    uint32_t res;
+    return s->base | ((addr & 0x1ffffff) >> 5);
+}
 
-    res = *(uint32_t *)opaque;
-    res |= (addr & 0x1ffffff) >> 5;
-    return res;
+static void bitband_map_changed(MemoryListener *listener)
+{
+    BitBandState *s = container_of(listener, BitBandState, listener);
 
+    s->target.mr = NULL;
 }
 
-static uint32_t bitband_readb(void *opaque, hwaddr offset)
+static MemoryRegionSection *bitband_target(BitBandState *s, uint32_t addr,
+                                           unsigned size)
 {
-    uint8_t v;
-    cpu_physical_memory_read(bitband_addr(opaque, offset), &v, 1);
-    return (v & (1 << ((offset >> 2) & 7))) != 0;
+    MemoryRegionSection *t = &s->target;
+
+    if (t->mr &&
+        addr >= t->offset_within_address_space &&
+        addr + size <= t->offset_within_address_space + t->size) {
+        return t;
+    }
+
+    *t = memory_region_find(s->root, addr,
+                            s->base + BITBAND_TARGET_SIZE - addr);
+    if (!t->mr || t->offset_within_address_space != addr) {
+        /* Nothing mapped here.  */
+        t->mr = NULL;
+        return NULL;
+    }
+    s->target_ram = NULL;
+    if (memory_region_is_ram(t->mr) && !t->readonly) {
+        s->target_ram = (uint8_t *)memory_region_get_ram_ptr(t->mr)
+                        + t->offset_within_region;
+    }
+    return t;
 }
 
-static void bitband_writeb(void *opaque, hwaddr offset,
-                           uint32_t value)
+/* Accesses through the generic path, with the value in target order.  */
+static uint32_t bitband_load_slow(BitBandState *s, uint32_t addr,
+                                  unsigned size)
 {
-    uint32_t addr;
-    uint8_t mask;
-    uint8_t v;
-    addr = bitband_addr(opaque, offset);
-    mask = (1 << ((offset >> 2) & 7));
-    cpu_physical_memory_read(addr, &v, 1);
-    if (value & 1)
-        v |= mask;
-    else
-        v &= ~mask;
-    cpu_physical_memory_write(addr, &v, 1);
+    uint8_t buf[4];
+
+    address_space_read(s->as, addr, buf, size);
+    switch (size) {
+    case 1:
+        return ldub_p(buf);
+    case 2:
+        return lduw_p(buf);
+    default:
+        return ldl_p(buf);
+    }
 }
 
-static uint32_t bitband_readw(void *opaque, hwaddr offset)
+static void bitband_store_slow(BitBandState *s, uint32_t addr, uint32_t v,
+                               unsigned size)
 {
-    uint32_t addr;
-    uint16_t mask;
-    uint16_t v;
-    addr = bitband_addr(opaque, offset) & ~1;
-    mask = (1 << ((offset >> 2) & 15));
-    mask = tswap16(mask);
-    cpu_physical_memory_read(addr, (uint8_t *)&v, 2);
-    return (v & mask) != 0;
+    uint8_t buf[4];
+
+    switch (size) {
+    case 1:
+        stb_p(buf, v);
+        break;
+    case 2:
+        stw_p(buf, v);
+        break;
+    default:
+        stl_p(buf, v);
+        break;
+    }
+    address_space_write(s->as, addr, buf, size);
 }
 
-static void bitband_writew(void *opaque, hwaddr offset,
-                           uint32_t value)
+static uint32_t bitband_load(BitBandState *s, uint32_t addr, unsigned size)
 {
-    uint32_t addr;
-    uint16_t mask;
-    uint16_t v;
-    addr = bitband_addr(opaque, offset) & ~1;
-    mask = (1 << ((offset >> 2) & 15));
-    mask = tswap16(mask);
-    cpu_physical_memory_read(addr, (uint8_t *)&v, 2);
-    if (value & 1)
-        v |= mask;
-    else
-        v &= ~mask;
-    cpu_physical_memory_write(addr, (uint8_t *)&v, 2);
+    MemoryRegionSection *t = bitband_target(s, addr, size);
+    hwaddr offset;
+
+    if (!t) {
+        return bitband_load_slow(s, addr, size);
+    }
+    offset = addr - t->offset_within_address_space;
+    if (s->target_ram) {
+        switch (size) {
+        case 1:
+            return ldub_p(s->target_ram + offset);
+        case 2:
+            return lduw_p(s->target_ram + offset);
+        default:
+            return ldl_p(s->target_ram + offset);
+        }
+    }
+    return io_mem_read(t->mr, t->offset_within_region + offset, size);
+}
+
+static void bitband_store(BitBandState *s, uint32_t addr, uint32_t v,
+                          unsigned size)
+{
+    MemoryRegionSection *t = bitband_target(s, addr, size);
+    hwaddr offset;
+
+    if (!t) {
+        bitband_store_slow(s, addr, v, size);
+        return;
+    }
+    offset = addr - t->offset_within_address_space;
+    if (s->target_ram) {
+        if (!memory_region_get_dirty(t->mr, t->offset_within_region + offset,
+                                     size, DIRTY_MEMORY_CODE) ||
+            !memory_region_get_dirty(t->mr, t->offset_within_region + offset,
+                                     size, DIRTY_MEMORY_SNAPSHOT)) {
+            /* Translated code lives in this page, or a live snapshot has
+               yet to save it: let the generic path take care of it.  */
+            bitband_store_slow(s, addr, v, size);
+            return;
+        }
+        switch (size) {
+        case 1:
+            stb_p(s->target_ram + offset, v);
+            break;
+        case 2:
+            stw_p(s->target_ram + offset, v);
+            break;
+        default:
+            stl_p(s->target_ram + offset, v);
+            break;
+        }
+        memory_region_set_dirty(t->mr, t->offset_within_region + offset, size);
+        return;
+    }
+    io_mem_write(t->mr, t->offset_within_region + offset, v, size);
 }
 
-static uint32_t bitband_readl(void *opaque, hwaddr offset)
+static uint64_t bitband_read(void *opaque, hwaddr offset, unsigned size)
 {
+    BitBandState *s = opaque;
     uint32_t addr;
     uint32_t mask;
-    uint32_t v;
-    addr = bitband_addr(opaque, offset) & ~3;
-    mask = (1 << ((offset >> 2) & 31));
-    mask = tswap32(mask);
-    cpu_physical_memory_read(addr, (uint8_t *)&v, 4);
-    return (v & mask) != 0;
+
+    addr = bitband_addr(s, offset) & ~(size - 1);
+    mask = 1 << ((offset >> 2) & (size * 8 - 1));
+    return (bitband_load(s, addr, size) & mask) != 0;
 }
 
-static void bitband_writel(void *opaque, hwaddr offset,
-                           uint32_t value)
+static void bitband_write(void *opaque, hwaddr offset, uint64_t value,
+                          unsigned size)
 {
+    BitBandState *s = opaque;
     uint32_t addr;
     uint32_t mask;
     uint32_t v;
-    addr = bitband_addr(opaque, offset) & ~3;
-    mask = (1 << ((offset >> 2) & 31));
-    mask = tswap32(mask);
-    cpu_physical_memory_read(addr, (uint8_t *)&v, 4);
+
+    addr = bitband_addr(s, offset) & ~(size - 1);
+    mask = 1 << ((offset >> 2) & (size * 8 - 1));
+    v = bitband_load(s, addr, size);
     if (value & 1)
         v |= mask;
     else
         v &= ~mask;
-    cpu_physical_memory_write(addr, (uint8_t *)&v, 4);
+    bitband_store(s, addr, v, size);
 }
 
 static const MemoryRegionOps bitband_ops = {
-    .old_mmio = {
-        .read = { bitband_readb, bitband_readw, bitband_readl, },
-        .write = { bitband_writeb, bitband_writew, bitband_writel, },
-    },
+    .read = bitband_read,
+    .write = bitband_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 1,
+    .impl.max_access_size = 4,
 };
 
-typedef struct {
-    SysBusDevice busdev;
-    MemoryRegion iomem;
-    uint32_t base;
-} BitBandState;
-
 static int bitband_init(SysBusDevice *dev)
 {
     BitBandState *s = FROM_SYSBUS(BitBandState, dev);
 
-    memory_region_init_io(&s->iomem, &bitband_ops, &s->base, "bitband",
+    memory_region_init_io(&s->iomem, &bitband_ops, s, "bitband",
                           0x02000000);
     sysbus_init_mmio(dev, &s->iomem);
+    if (s->as_prop) {
+        s->as = s->as_prop;
+        s->root = s->root_prop;
+    } else {
+        s->as = &address_space_memory;
+        s->root = get_system_memory();
+    }
+    s->listener.commit = bitband_map_changed;
+    memory_listener_register(&s->listener, s->as);
     return 0;
 }
 
-static void armv7m_bitband_init(void)
+static void armv7m_bitband_init(AddressSpace *as, MemoryRegion *root)
 {
     DeviceState *dev;
 
     dev = qdev_create(NULL, "ARM,bitband-memory");
     qdev_prop_set_uint32(dev, "base", 0x20000000);
+    qdev_prop_set_ptr(dev, "address-space", as);
+    qdev_prop_set_ptr(dev, "memory", root);
     qdev_init_nofail(dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, 0x22000000);
+    sysbus_mmio_map_to(SYS_BUS_DEVICE(dev), 0, root, 0x22000000);
 
     dev = qdev_create(NULL, "ARM,bitband-memory");
     qdev_prop_set_uint32(dev, "base", 0x40000000);
+    qdev_prop_set_ptr(dev, "address-space", as);
+    qdev_prop_set_ptr(dev, "memory", root);
     qdev_init_nofail(dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, 0x42000000);
+    sysbus_mmio_map_to(SYS_BUS_DEVICE(dev), 0, root, 0x42000000);
+}
+
+/* Names the RAM of a machine in a secondary address space after the
+   address space, so that every machine in the process has distinct RAM
+   block names.  */
+static char *armv7m_ram_name(MemoryRegion *address_space_mem,
+                             const char *name)
+{
+    if (address_space_mem == get_system_memory()) {
+        return g_strdup(name);
+    }
+    return g_strdup_printf("%s.%s", memory_region_name(address_space_mem),
+                           name);
 }
 
 /* Board init.  */
 
+typedef struct ARMv7MAddressSpace {
+    MemoryRegion *root;
+    AddressSpace as;
+    QTAILQ_ENTRY(ARMv7MAddressSpace) next;
+} ARMv7MAddressSpace;
+
+static QTAILQ_HEAD(, ARMv7MAddressSpace) armv7m_address_spaces =
+    QTAILQ_HEAD_INITIALIZER(armv7m_address_spaces);
+
+AddressSpace *armv7m_address_space(MemoryRegion *address_space_mem)
+{
+    ARMv7MAddressSpace *s;
+
+    if (address_space_mem == get_system_memory()) {
+        return &address_space_memory;
+    }
+    QTAILQ_FOREACH(s, &armv7m_address_spaces, next) {
+        if (s->root == address_space_mem) {
+            return &s->as;
+        }
+    }
+    s = g_new0(ARMv7MAddressSpace, 1);
+    s->root = address_space_mem;
+    address_space_init(&s->as, address_space_mem);
+    s->as.name = memory_region_name(address_space_mem);
+    QTAILQ_INSERT_TAIL(&armv7m_address_spaces, s, next);
+    return &s->as;
+}
+
 static void armv7m_reset(void *opaque)
 {
     ARMCPU *cpu = opaque;
@@ -154,14 +305,58 @@ static void armv7m_reset(void *opaque)
     cpu_reset(CPU(cpu));
 }
 
+/* Number of blocks translated from each vector with -tcg pretranslate.  */
+#define ARMV7M_PRETRANSLATE_BLOCKS 8
+
+typedef struct {
+    ARMCPU *cpu;
+    MemoryRegion *address_space_mem;
+    bool done;
+} ARMV7MPretranslate;
+
+/* Translate the handlers the vector table points at, once the images are
+   in place and before the CPU first runs.  Vectors that do not point at
+   RAM or ROM are ignored, since translating them would abort.  */
+static void armv7m_pretranslate(void *opaque, int running, RunState state)
+{
+    ARMV7MPretranslate *p = opaque;
+    CPUARMState *env = &p->cpu->env;
+    MemoryRegionSection section;
+    uint8_t buf[4];
+    uint32_t addr;
+    int i;
+
+    if (!running || p->done) {
+        return;
+    }
+    p->done = true;
+    for (i = 1; i < 16 + ARMV7M_NUM_IRQ; i++) {
+        address_space_read(CPU(p->cpu)->as, env->v7m.vecbase + i * 4, buf, 4);
+        addr = ldl_p(buf) & ~1;
+        section = memory_region_find(p->address_space_mem, addr, 2);
+        if (!section.mr || !(memory_region_is_ram(section.mr) ||
+                             memory_region_is_romd(section.mr))) {
+            continue;
+        }
+        tb_pretranslate(env, addr, addr + (memory_region_size(section.mr) -
+                                           section.offset_within_region),
+                        ARMV7M_PRETRANSLATE_BLOCKS);
+    }
+}
+
 /* Init CPU and memory for a v7-M based board.
    flash_size and sram_size are in kb.
+   If flash is not NULL it is mapped at address 0 instead of a plain
+   read-only RAM block, so a board can supply its own flash model.
+   If address_space_mem is not the system memory, it becomes the root of a
+   separate address space for the new CPU, so that a board can run several
+   independent machines.  Images can only be loaded into the system memory.
    Returns the NVIC array.  */
 
 qemu_irq *armv7m_init(MemoryRegion *address_space_mem,
                       int flash_size, int sram_size,
                       const char *kernel_filename, const char *cpu_model) {
-    return armv7m_translated_init(address_space_mem, flash_size, sram_size, kernel_filename, NULL, NULL, cpu_model);
+    return armv7m_translated_init(address_space_mem, flash_size, sram_size, kernel_filename, NULL, NULL, NULL, cpu_model);
 }
 
 qemu_irq *armv7m_translated_init(MemoryRegion *address_space_mem,
@@ -169,22 +364,23 @@ qemu_irq *armv7m_translated_init(MemoryRegion *address_space_mem,
                                  const char *kernel_filename,
                                  uint64_t (*translate_fn)(void *, uint64_t),
                                  void *translate_opaque,
+                                 MemoryRegion *flash,
                                  const char *cpu_model)
 {
     ARMCPU *cpu;
     CPUARMState *env;
     DeviceState *nvic;
-    /* FIXME: make this local state.  */
-    static qemu_irq pic[64];
+    qemu_irq *pic = g_new(qemu_irq, ARMV7M_NUM_IRQ);
     qemu_irq *cpu_pic;
+    AddressSpace *as;
+    char *name;
     int image_size;
     uint64_t entry;
     uint64_t lowaddr;
     int i;
     int big_endian;
     MemoryRegion *sram = g_new(MemoryRegion, 1);
-    MemoryRegion *flash = g_new(MemoryRegion, 1);
-    MemoryRegion *hack = g_new(MemoryRegion, 1);
+    bool board_flash = flash != NULL;
 
     flash_size *= 1024;
     sram_size *= 1024;
@@ -199,6 +395,16 @@ qemu_irq *armv7m_translated_init(MemoryRegion *address_space_mem,
     }
     env = &cpu->env;
 
+    as = armv7m_address_space(address_space_mem);
+    if (as != &address_space_memory) {
+        if (kernel_filename) {
+            fprintf(stderr, "qemu: '%s' can only be loaded into the first "
+                    "machine\n", kernel_filename);
+            exit(1);
+        }
+    }
+    CPU(cpu)->as = as;
+
 #if 0
     /* > 32Mb SRAM gets complicated because it overlaps the bitband area.
        We don't have proper commandline options, so allocate half of memory
@@ -211,24 +417,42 @@ qemu_irq *armv7m_translated_init(MemoryRegion *address_space_mem,
     code_size = ram_size - sram_size;
 #endif
 
-    /* Flash programming is done via the SCU, so pretend it is ROM.  */
-    memory_region_init_ram(flash, "armv7m.flash", flash_size);
-    vmstate_register_ram_global(flash);
-    memory_region_set_readonly(flash, true);
+    if (!board_flash) {
+        /* Flash programming is done via the SCU, so pretend it is ROM.  */
+        flash = g_new(MemoryRegion, 1);
+        name = armv7m_ram_name(address_space_mem, "armv7m.flash");
+        memory_region_init_ram(flash, name, flash_size);
+        g_free(name);
+        vmstate_register_ram_global(flash);
+        memory_region_set_readonly(flash, true);
+    }
     memory_region_add_subregion(address_space_mem, 0, flash);
-    memory_region_init_ram(sram, "armv7m.sram", sram_size);
+    name = armv7m_ram_name(address_space_mem, "armv7m.sram");
+    memory_region_init_ram(sram, name, sram_size);
+    g_free(name);
     vmstate_register_ram_global(sram);
     memory_region_add_subregion(address_space_mem, 0x20000000, sram);
-    armv7m_bitband_init();
+    armv7m_bitband_init(as, address_space_mem);
 
     nvic = qdev_create(NULL, "armv7m_nvic");
     env->nvic = nvic;
+    /* Gives qtest "irq_intercept_in nvic" for the first machine.  */
+    if (as == &address_space_memory) {
+        object_property_add_child(qdev_get_machine(), "nvic", OBJECT(nvic),
+                                  NULL);
+    }
+    qdev_prop_set_uint32(nvic, "num-irq", ARMV7M_NUM_IRQ);
+    qdev_prop_set_ptr(nvic, "memory", address_space_mem);
     qdev_init_nofail(nvic);
     cpu_pic = arm_pic_init_cpu(cpu);
     sysbus_connect_irq(SYS_BUS_DEVICE(nvic), 0, cpu_pic[ARM_PIC_CPU_IRQ]);
-    for (i = 0; i < 64; i++) {
+    for (i = 0; i < ARMV7M_NUM_IRQ; i++) {
         pic[i] = qdev_get_gpio_in(nvic, i);
     }
+    /* The stimulus ports of the first machine go to "-chardev ...,id=itm",
+       where a debug probe would have put them on the SWO pin.  */
+    armv7m_itm_init(address_space_mem, as == &address_space_memory
+                                       ? qemu_chr_find("itm") : NULL);
 
 #ifdef TARGET_WORDS_BIGENDIAN
     big_endian = 1;
@@ -236,36 +460,46 @@ qemu_irq *armv7m_translated_init(MemoryRegion *address_space_mem,
     big_endian = 0;
 #endif
 
-    if (!kernel_filename) {
+    /* A board that supplies its own flash model may boot from whatever
+       that flash already holds.  */
+    if (!kernel_filename && !board_flash) {
         fprintf(stderr, "Guest image must be specified (using -kernel)\n");
         exit(1);
     }
 
-    image_size = load_elf(kernel_filename, translate_fn, translate_opaque, &entry, &lowaddr,
-                          NULL, big_endian, ELF_MACHINE, 1);
-    if (image_size < 0) {
-        image_size = load_image_targphys(kernel_filename, 0, flash_size);
-	lowaddr = 0;
-    }
-    if (image_size < 0) {
-        fprintf(stderr, "qemu: could not load kernel '%s'\n",
-                kernel_filename);
-        exit(1);
+    if (kernel_filename) {
+        image_size = load_elf(kernel_filename, translate_fn, translate_opaque,
+                              &entry, &lowaddr, NULL, big_endian, ELF_MACHINE, 1);
+        if (image_size < 0) {
+            image_size = load_image_targphys(kernel_filename, 0, flash_size);
+            lowaddr = 0;
+        }
+        if (image_size < 0) {
+            fprintf(stderr, "qemu: could not load kernel '%s'\n",
+                    kernel_filename);
+            exit(1);
+        }
     }
 
-    /* Hack to map an additional page of ram at the top of the address
-       space.  This stops qemu complaining about executing code outside RAM
-       when returning from an exception.  */
-    memory_region_init_ram(hack, "armv7m.hack", 0x1000);
-    vmstate_register_ram_global(hack);
-    memory_region_add_subregion(address_space_mem, 0xfffff000, hack);
-
     qemu_register_reset(armv7m_reset, cpu);
+    /* The symbols come from the image of the first machine.  */
+    if (as == &address_space_memory) {
+        armv7m_pcsample_init(cpu);
+    }
+    if (tcg_enabled() && tcg_pretranslate) {
+        ARMV7MPretranslate *p = g_new0(ARMV7MPretranslate, 1);
+
+        p->cpu = cpu;
+        p->address_space_mem = address_space_mem;
+        qemu_add_vm_change_state_handler(armv7m_pretranslate, p);
+    }
     return pic;
 }
 
 static Property bitband_properties[] = {
     DEFINE_PROP_UINT32("base", BitBandState, base, 0),
+    DEFINE_PROP_PTR("address-space", BitBandState, as_prop),
+    DEFINE_PROP_PTR("memory", BitBandState, root_prop),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -0,0 +1,400 @@
+/*
+ * ARMv7-M Instrumentation Trace Macrocell and Data Watchpoint and Trace unit
+ *
+ * The ITM carries what the firmware writes to its stimulus ports to a
+ * character device, either as the bare payload bytes, which is what
+ * ITM_SendChar() logging wants, or framed as ITM software source packets
+ * the way they would come out of the SWO pin, for SWO decoders.  Only
+ * the cycle counter of the DWT is implemented.
+ *
+ * This code is licensed under the GPL.
+ */
+
+#include "sysbus.h"
+#include "arm-misc.h"
+#include "char/char.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+#define ITM_BASE                0xe0000000
+#define DWT_BASE                0xe0001000
+
+#define ITM_TCR_ITMENA          (1 << 0)
+#define ITM_TCR_MASK            0x00ff0f1f
+
+#define DWT_CTRL_CYCCNTENA      (1 << 0)
+/* No comparators, no trace sampling, no profiling counters.  */
+#define DWT_CTRL_RO             ((1 << 27) | (1 << 26) | (1 << 25) | (1 << 24))
+#define DWT_CTRL_MASK           0x1fff
+
+#define ITM_BUF_SIZE            256
+#define ITM_FLUSH_MS            10
+
+/* ITM_SWO_FRAMES bit of ItmState.flags.  */
+#define ITM_SWO_FRAMES_BIT      0
+
+typedef struct {
+    SysBusDevice busdev;
+    MemoryRegion itm_iomem;
+    MemoryRegion dwt_iomem;
+    CharDriverState *chr;
+    uint32_t flags;
+
+    uint32_t ter;
+    uint32_t tpr;
+    uint32_t tcr;
+    struct {
+        uint32_t ctrl;
+        uint32_t cyccnt;
+        /* Instruction counter or vm_clock when cyccnt was last brought up
+           to date.  */
+        int64_t last;
+    } dwt;
+
+    /* Output is staged here and written out on a newline, when the buffer
+       fills up, or ITM_FLUSH_MS after the first byte.  */
+    uint8_t buf[ITM_BUF_SIZE];
+    int len;
+    bool synced;
+    QEMUTimer *flush_timer;
+    Notifier exit_notifier;
+} ItmState;
+
+#define TYPE_ARMV7M_ITM "armv7m_itm"
+#define ARMV7M_ITM(obj) \
+    OBJECT_CHECK(ItmState, (obj), TYPE_ARMV7M_ITM)
+
+static void itm_flush(ItmState *s)
+{
+    if (s->len) {
+        qemu_chr_fe_write(s->chr, s->buf, s->len);
+        s->len = 0;
+    }
+    qemu_del_timer(s->flush_timer);
+}
+
+static void itm_put(ItmState *s, const uint8_t *data, int n)
+{
+    bool newline = false;
+    int i;
+
+    if (s->len + n > ITM_BUF_SIZE) {
+        itm_flush(s);
+    }
+    if (s->len == 0) {
+        qemu_mod_timer(s->flush_timer,
+                       qemu_get_clock_ms(rt_clock) + ITM_FLUSH_MS);
+    }
+    for (i = 0; i < n; i++) {
+        s->buf[s->len++] = data[i];
+        newline |= data[i] == '\n';
+    }
+    if (newline || s->len == ITM_BUF_SIZE) {
+        itm_flush(s);
+    }
+}
+
+static void itm_stimulus_write(ItmState *s, int port, uint32_t value,
+                               unsigned size)
+{
+    /* Synchronization packet: at least 47 zero bits and a one.  */
+    static const uint8_t sync[] = { 0, 0, 0, 0, 0, 0x80 };
+    uint8_t packet[5];
+    int n = 0;
+    unsigned i;
+
+    if (!s->chr || !(s->tcr & ITM_TCR_ITMENA) || !(s->ter & (1 << port))) {
+        return;
+    }
+    if (s->flags & (1 << ITM_SWO_FRAMES_BIT)) {
+        if (!s->synced) {
+            itm_put(s, sync, sizeof(sync));
+            s->synced = true;
+        }
+        /* Software source packet header: port number and payload size of
+           1, 2 or 4 bytes encoded as 1, 2 or 3.  */
+        packet[n++] = (port << 3) | (size == 4 ? 3 : size);
+    }
+    for (i = 0; i < size; i++) {
+        packet[n++] = value >> (i * 8);
+    }
+    itm_put(s, packet, n);
+}
+
+static uint64_t itm_read(void *opaque, hwaddr offset, unsigned size)
+{
+    ItmState *s = opaque;
+
+    switch (offset) {
+    case 0x000 ... 0x07f: /* Stimulus Port.  */
+        /* The FIFO is always ready.  */
+        return 1;
+    case 0xe00: /* Trace Enable.  */
+        return s->ter;
+    case 0xe40: /* Trace Privilege.  */
+        return s->tpr;
+    case 0xe80: /* Trace Control.  */
+        return s->tcr;
+    case 0xfb4: /* Lock Status.  */
+        return 0;
+    }
+    qemu_log_mask(LOG_GUEST_ERROR, "ITM: Bad read offset 0x%x\n",
+                  (int)offset);
+    return 0;
+}
+
+static void itm_write(void *opaque, hwaddr offset, uint64_t value,
+                      unsigned size)
+{
+    ItmState *s = opaque;
+
+    switch (offset) {
+    case 0x000 ... 0x07f: /* Stimulus Port.  */
+        if (offset & 3) {
+            break;
+        }
+        itm_stimulus_write(s, offset >> 2, value, size);
+        return;
+    case 0xe00: /* Trace Enable.  */
+        s->ter = value;
+        return;
+    case 0xe40: /* Trace Privilege.  */
+        s->tpr = value & 0xf;
+        return;
+    case 0xe80: /* Trace Control.  */
+        s->tcr = value & ITM_TCR_MASK;
+        return;
+    case 0xfb0: /* Lock Access.  */
+        return;
+    }
+    qemu_log_mask(LOG_GUEST_ERROR, "ITM: Bad write offset 0x%x\n",
+                  (int)offset);
+}
+
+static const MemoryRegionOps itm_ops = {
+    .read = itm_read,
+    .write = itm_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 1,
+    .impl.max_access_size = 4,
+};
+
+/* Add the cycles since the last update to CYCCNT.  Under -icount the
+   instruction counter is the cycle count, exact with -tcg cycles=on and
+   one cycle per instruction otherwise.  Without it the cycles are worked
+   out from vm_clock and the core clock period the board reports, so a
+   change of the core clock is only seen at the next access.  */
+static void dwt_update(ItmState *s)
+{
+    int64_t now, cycles;
+
+    if (use_icount) {
+        now = cpu_get_icount_raw();
+        cycles = now - s->dwt.last;
+        s->dwt.last = now;
+    } else {
+        now = qemu_get_clock_ns(vm_clock);
+        if (system_clock_scale > 0) {
+            cycles = (now - s->dwt.last) / system_clock_scale;
+            s->dwt.last += cycles * system_clock_scale;
+        } else {
+            cycles = 0;
+            s->dwt.last = now;
+        }
+    }
+    if (s->dwt.ctrl & DWT_CTRL_CYCCNTENA) {
+        s->dwt.cyccnt += cycles;
+    }
+}
+
+static uint64_t dwt_read(void *opaque, hwaddr offset, unsigned size)
+{
+    ItmState *s = opaque;
+
+    if (size != 4) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "DWT: Bad read of size %d at offset 0x%x\n",
+                      size, (int)offset);
+        return 0;
+    }
+    switch (offset) {
+    case 0x000: /* Control.  */
+        return s->dwt.ctrl | DWT_CTRL_RO;
+    case 0x004: /* Cycle Count.  */
+        dwt_update(s);
+        return s->dwt.cyccnt;
+    case 0x008 ... 0x018: /* Profiling counters.  */
+        return 0;
+    case 0x01c: /* Program Counter Sample.  */
+        return cpu_single_env ? cpu_single_env->regs[15] : 0;
+    case 0xfb4: /* Lock Status.  */
+        return 0;
+    }
+    qemu_log_mask(LOG_UNIMP, "DWT: Read of unimplemented offset 0x%x\n",
+                  (int)offset);
+    return 0;
+}
+
+static void dwt_write(void *opaque, hwaddr offset, uint64_t value,
+                      unsigned size)
+{
+    ItmState *s = opaque;
+
+    if (size != 4) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "DWT: Bad write of size %d at offset 0x%x\n",
+                      size, (int)offset);
+        return;
+    }
+    switch (offset) {
+    case 0x000: /* Control.  */
+        dwt_update(s);
+        s->dwt.ctrl = value & DWT_CTRL_MASK;
+        return;
+    case 0x004: /* Cycle Count.  */
+        dwt_update(s);
+        s->dwt.cyccnt = value;
+        return;
+    case 0xfb0: /* Lock Access.  */
+        return;
+    }
+    qemu_log_mask(LOG_UNIMP, "DWT: Write to unimplemented offset 0x%x\n",
+                  (int)offset);
+}
+
+static const MemoryRegionOps dwt_ops = {
+    .read = dwt_read,
+    .write = dwt_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static void itm_flush_timer_expire(void *opaque)
+{
+    itm_flush(opaque);
+}
+
+static void itm_vm_state_change(void *opaque, int running, RunState state)
+{
+    if (!running) {
+        itm_flush(opaque);
+    }
+}
+
+static void itm_exit_notify(Notifier *notifier, void *data)
+{
+    ItmState *s = container_of(notifier, ItmState, exit_notifier);
+
+    itm_flush(s);
+}
+
+static int itm_post_load(void *opaque, int version_id)
+{
+    ItmState *s = opaque;
+
+    /* The counts are only meaningful within one run.  */
+    s->dwt.last = use_icount ? cpu_get_icount_raw()
+                             : qemu_get_clock_ns(vm_clock);
+    return 0;
+}
+
+static const VMStateDescription vmstate_itm = {
+    .name = "armv7m_itm",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = itm_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(ter, ItmState),
+        VMSTATE_UINT32(tpr, ItmState),
+        VMSTATE_UINT32(tcr, ItmState),
+        VMSTATE_UINT32(dwt.ctrl, ItmState),
+        VMSTATE_UINT32(dwt.cyccnt, ItmState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void itm_reset(DeviceState *dev)
+{
+    ItmState *s = ARMV7M_ITM(dev);
+
+    /* With a character device attached, start out the way a debug probe
+       would leave the ITM after setting up SWO, so that firmware which
+       only checks TCR and TER before writing gets its output.  */
+    if (s->chr) {
+        s->ter = 0xffffffff;
+        s->tcr = ITM_TCR_ITMENA;
+    } else {
+        s->ter = 0;
+        s->tcr = 0;
+    }
+    s->tpr = 0;
+    s->dwt.ctrl = 0;
+    s->dwt.cyccnt = 0;
+    itm_post_load(s, 0);
+}
+
+static int itm_init(SysBusDevice *dev)
+{
+    ItmState *s = ARMV7M_ITM(dev);
+
+    memory_region_init_io(&s->itm_iomem, &itm_ops, s, "armv7m.itm", 0x1000);
+    sysbus_init_mmio(dev, &s->itm_iomem);
+    memory_region_init_io(&s->dwt_iomem, &dwt_ops, s, "armv7m.dwt", 0x1000);
+    sysbus_init_mmio(dev, &s->dwt_iomem);
+
+    if (s->chr) {
+        s->flush_timer = qemu_new_timer_ms(rt_clock, itm_flush_timer_expire, s);
+        qemu_add_vm_change_state_handler(itm_vm_state_change, s);
+        s->exit_notifier.notify = itm_exit_notify;
+        qemu_add_exit_notifier(&s->exit_notifier);
+    }
+    return 0;
+}
+
+static Property itm_properties[] = {
+    DEFINE_PROP_CHR("chardev", ItmState, chr),
+    /* Frame the output as SWO packets instead of writing the payload.  */
+    DEFINE_PROP_BIT("swo", ItmState, flags, ITM_SWO_FRAMES_BIT, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void itm_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
+
+    sdc->init = itm_init;
+    dc->vmsd = &vmstate_itm;
+    dc->reset = itm_reset;
+    dc->props = itm_properties;
+    dc->no_user = 1;
+}
+
+static const TypeInfo itm_info = {
+    .name          = TYPE_ARMV7M_ITM,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(ItmState),
+    .class_init    = itm_class_init,
+};
+
+static void itm_register_types(void)
+{
+    type_register_static(&itm_info);
+}
+
+type_init(itm_register_types)
+
+void armv7m_itm_init(MemoryRegion *address_space_mem, CharDriverState *chr)
+{
+    DeviceState *dev = qdev_create(NULL, TYPE_ARMV7M_ITM);
+    SysBusDevice *busdev = SYS_BUS_DEVICE(dev);
+
+    if (chr) {
+        qdev_prop_set_chr(dev, "chardev", chr);
+    }
+    qdev_init_nofail(dev);
+    sysbus_mmio_map_to(busdev, 0, address_space_mem, ITM_BASE);
+    sysbus_mmio_map_to(busdev, 1, address_space_mem, DWT_BASE);
+}
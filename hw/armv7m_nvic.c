@@ -12,43 +12,85 @@
 
 #include "sysbus.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "arm-misc.h"
 #include "exec/address-spaces.h"
-#include "arm_gic_internal.h"
+#include "exec/exec-all.h"
+
+/* Vector 0 is the initial stack pointer, 1-15 are the system exceptions
+   and the external interrupts start at 16.  A v7M core may have up to
+   496 external interrupts.  */
+#define NVIC_FIRST_IRQ 16
+#define NVIC_MAX_IRQ 496
+#define NVIC_MAX_VECTORS (NVIC_FIRST_IRQ + NVIC_MAX_IRQ)
+
+/* Priorities range from -3 (Reset) to 255.  Every priority has its own
+   slot in the lookup tables, at the priority plus NVIC_PRIO_OFFSET.  */
+#define NVIC_PRIO_OFFSET 3
+#define NVIC_NUM_LEVELS (0x100 + NVIC_PRIO_OFFSET)
+#define NVIC_LEVEL_WORDS ((NVIC_NUM_LEVELS + 31) / 32)
+
+/* Execution priority of Thread mode with nothing active.  */
+#define NVIC_NOEXC_PRIO 0x100
+
+typedef struct {
+  int16_t prio;
+  uint8_t enabled;
+  uint8_t pending;
+  uint8_t active;
+  uint8_t level; /* State of the input line (external interrupts only).  */
+} nvic_vec;
 
 typedef struct {
-  GICState gic;
+  SysBusDevice busdev;
+  qemu_irq parent_irq;
+  nvic_vec vectors[NVIC_MAX_VECTORS];
+  uint32_t prigroup;
+  /* Lookup tables, derived from vectors[].  ready holds one bitmap of
+     vectors per priority level, with the bits of the vectors that are
+     both pending and enabled.  ready_levels has a bit for every level
+     whose bitmap is not empty, and active_levels one for every level at
+     which an exception is active.  Finding the next exception to take or
+     the current execution priority is then a find-first-set over a few
+     words, however many interrupts the firmware has enabled.  */
+  uint32_t *ready;
+  uint32_t ready_levels[NVIC_LEVEL_WORDS];
+  uint32_t active_levels[NVIC_LEVEL_WORDS];
+  uint16_t active_count[NVIC_NUM_LEVELS];
+  int num_active;
+  int num_irq_pending;
+  /* Highest priority pending and enabled vector, or 0.  */
+  int vectpending;
+  /* Level last given to parent_irq.  */
+  int cpu_irq_level;
   struct {
     uint32_t control;
     uint32_t reload;
     int64_t tick;
+    /* Time to the next zero crossing while the core clock is stopped.  */
+    int64_t left;
     QEMUTimer *timer;
   } systick;
+  /* System Control Register.  */
+  uint32_t scr;
+  /* What the CPU is in since a WFI with SLEEPDEEP (ARMv7MDeepSleep), and
+     who decides it.  */
+  int32_t deepsleep;
+  ARMv7MDeepSleepFn *deepsleep_fn;
+  void *deepsleep_opaque;
   MemoryRegion sysregmem;
-  MemoryRegion gic_iomem_alias;
-  MemoryRegion container;
+  /* Where sysregmem is mapped, the system memory unless set */
+  void *memory;
+  /* Debug Exception and Monitor Control.  The trace units do not look at
+     TRCENA, they are always powered.  */
+  uint32_t demcr;
   uint32_t num_irq;
+  uint32_t num_mpu_regions;
+  uint32_t num_vectors;
+  uint32_t vec_words;
 } nvic_state;
 
 #define TYPE_NVIC "armv7m_nvic"
-/**
- * NVICClass:
- * @parent_reset: the parent class' reset handler.
- *
- * A model of the v7M NVIC and System Controller
- */
-typedef struct NVICClass {
-  /*< private >*/
-  ARMGICClass parent_class;
-  /*< public >*/
-  int (*parent_init)(SysBusDevice *dev);
-  void (*parent_reset)(DeviceState *dev);
-} NVICClass;
-
-#define NVIC_CLASS(klass) \
-OBJECT_CLASS_CHECK(NVICClass, (klass), TYPE_NVIC)
-#define NVIC_GET_CLASS(obj) \
-OBJECT_GET_CLASS(NVICClass, (obj), TYPE_NVIC)
 #define NVIC(obj) \
 OBJECT_CHECK(nvic_state, (obj), TYPE_NVIC)
 
@@ -64,6 +106,10 @@ static const uint8_t nvic_id[] = {
 #define SYSTICK_CLKSOURCE (1 << 2)
 #define SYSTICK_COUNTFLAG (1 << 16)
 
+#define SCR_SLEEPONEXIT (1 << 1)
+#define SCR_SLEEPDEEP   (1 << 2)
+#define SCR_SEVONPEND   (1 << 4)
+
 int system_clock_scale;
 int external_ref_clock_scale = 1000;
 
@@ -76,17 +122,38 @@ static inline int64_t systick_scale(nvic_state *s)
     return external_ref_clock_scale;
 }
 
-static void systick_reload(nvic_state *s, int reset)
+/* The counter is not ticked.  systick.tick holds the time at which it next
+   reaches zero, and COUNTFLAG is brought up to date from it whenever the
+   registers are accessed.  The timer is only armed while the interrupt is
+   enabled, so a SysTick that is only polled never wakes the host, and does
+   not leave a deadline behind that would stop qemu_clock_warp from skipping
+   idle time under -icount.  */
+static void systick_schedule(nvic_state *s)
 {
-  if (reset)
-    s->systick.tick = qemu_get_clock_ns(vm_clock);
-  s->systick.tick += (s->systick.reload + 1) * systick_scale(s);
-  qemu_mod_timer(s->systick.timer, s->systick.tick);
+  if ((s->systick.control & (SYSTICK_ENABLE | SYSTICK_TICKINT))
+      == (SYSTICK_ENABLE | SYSTICK_TICKINT)) {
+    /* The interrupt may be taken up to 1/16 of a period late.  The next
+       tick is still counted from systick.tick, so the period does not
+       drift.  */
+    qemu_timer_set_slack_ns(s->systick.timer,
+                            (s->systick.reload + 1) * systick_scale(s) / 16);
+    qemu_mod_timer(s->systick.timer, s->systick.tick);
+  } else {
+    qemu_del_timer(s->systick.timer);
+  }
 }
 
-static void systick_timer_tick(void * opaque)
+/* Account for the zero crossings that happened up to now.  */
+static void systick_update(nvic_state *s)
 {
-  nvic_state *s = (nvic_state *)opaque;
+  int64_t now, period;
+
+  if ((s->systick.control & SYSTICK_ENABLE) == 0)
+    return;
+  now = qemu_get_clock_ns(vm_clock);
+  if (now < s->systick.tick)
+    return;
+
   s->systick.control |= SYSTICK_COUNTFLAG;
   if (s->systick.control & SYSTICK_TICKINT) {
     /* Trigger the interrupt.  */
@@ -94,11 +161,49 @@ static void systick_timer_tick(void * opaque)
   }
   if (s->systick.reload == 0) {
     s->systick.control &= ~SYSTICK_ENABLE;
+    s->systick.tick = 0;
   } else {
-    systick_reload(s, 0);
+    /* Skip all of the periods that have passed unobserved.  */
+    period = (s->systick.reload + 1) * systick_scale(s);
+    s->systick.tick += ((now - s->systick.tick) / period + 1) * period;
   }
 }
 
+static void systick_reload(nvic_state *s, int reset)
+{
+  if (reset)
+    s->systick.tick = qemu_get_clock_ns(vm_clock);
+  s->systick.tick += (s->systick.reload + 1) * systick_scale(s);
+  systick_schedule(s);
+}
+
+static void systick_timer_tick(void * opaque)
+{
+  nvic_state *s = (nvic_state *)opaque;
+
+  systick_update(s);
+  systick_schedule(s);
+}
+
+/* The core clock stops and starts again: the counter keeps its value in
+   between.  */
+static void systick_freeze(nvic_state *s)
+{
+  if ((s->systick.control & SYSTICK_ENABLE) == 0)
+    return;
+  systick_update(s);
+  s->systick.left = s->systick.tick - qemu_get_clock_ns(vm_clock);
+  qemu_del_timer(s->systick.timer);
+}
+
+static void systick_thaw(nvic_state *s)
+{
+  if ((s->systick.control & SYSTICK_ENABLE) == 0)
+    return;
+  s->systick.tick = qemu_get_clock_ns(vm_clock) + s->systick.left;
+  systick_schedule(s);
+}
+
 static void systick_reset(nvic_state *s)
 {
   s->systick.control = 0;
@@ -107,47 +212,442 @@ static void systick_reset(nvic_state *s)
   qemu_del_timer(s->systick.timer);
 }
 
+/* Priority lookup.  */
+
+static inline int nvic_find_first(const uint32_t *map, int words)
+{
+  int i;
+
+  for (i = 0; i < words; i++) {
+    if (map[i])
+      return i * 32 + ctz32(map[i]);
+  }
+  return -1;
+}
+
+static inline uint32_t *nvic_ready_map(nvic_state *s, int level)
+{
+  return s->ready + level * s->vec_words;
+}
+
+/* The part of a priority that decides preemption, as selected by
+   AIRCR.PRIGROUP.  The rest is the subpriority, which only orders
+   exceptions that are pending at the same time.  */
+static inline int nvic_group_prio(nvic_state *s, int prio)
+{
+  if (prio < 0)
+    return prio;
+  return prio & ~((2 << s->prigroup) - 1);
+}
+
+/* Add or remove vector n to/from the ready bitmap of its level.  */
+static void nvic_ready_update(nvic_state *s, int n)
+{
+  nvic_vec *vec = &s->vectors[n];
+  int level = vec->prio + NVIC_PRIO_OFFSET;
+  uint32_t *map = nvic_ready_map(s, level);
+  int i;
+
+  if (vec->pending && vec->enabled) {
+    map[n >> 5] |= 1u << (n & 31);
+    s->ready_levels[level >> 5] |= 1u << (level & 31);
+    return;
+  }
+  map[n >> 5] &= ~(1u << (n & 31));
+  for (i = 0; i < s->vec_words; i++) {
+    if (map[i])
+      return;
+  }
+  s->ready_levels[level >> 5] &= ~(1u << (level & 31));
+}
+
+static void nvic_active_update(nvic_state *s, int level, int delta)
+{
+  s->active_count[level] += delta;
+  if (s->active_count[level])
+    s->active_levels[level >> 5] |= 1u << (level & 31);
+  else
+    s->active_levels[level >> 5] &= ~(1u << (level & 31));
+}
+
+/* The priority the processor is running at, ignoring PRIMASK and
+   BASEPRI, which are handled by the CPU.  */
+static int nvic_exec_prio(nvic_state *s)
+{
+  int level = nvic_find_first(s->active_levels, NVIC_LEVEL_WORDS);
+
+  if (level < 0)
+    return NVIC_NOEXC_PRIO;
+  return nvic_group_prio(s, level - NVIC_PRIO_OFFSET);
+}
+
+static void nvic_update(nvic_state *s);
+
+/* An exception wakes the core from a deep sleep.  */
+static void nvic_wake(nvic_state *s)
+{
+  int deepsleep = s->deepsleep;
+
+  s->deepsleep = ARMV7M_DEEPSLEEP_NONE;
+  if (deepsleep == ARMV7M_DEEPSLEEP_STOP) {
+    systick_thaw(s);
+    s->deepsleep_fn(s->deepsleep_opaque, false);
+  }
+}
+
+/* Find the next exception to take and signal the CPU if it can preempt.
+   Among exceptions of the same priority the lowest numbered one wins.  */
+static void nvic_update(nvic_state *s)
+{
+  int level;
+
+  level = nvic_find_first(s->ready_levels, NVIC_LEVEL_WORDS);
+  if (level < 0) {
+    s->vectpending = 0;
+    s->cpu_irq_level = 0;
+    qemu_irq_lower(s->parent_irq);
+    return;
+  }
+  s->vectpending = nvic_find_first(nvic_ready_map(s, level), s->vec_words);
+  level = nvic_group_prio(s, level - NVIC_PRIO_OFFSET) < nvic_exec_prio(s);
+  if (level && s->deepsleep == ARMV7M_DEEPSLEEP_OFF) {
+    /* Only a reset brings the core back.  */
+    level = 0;
+  } else if (level && s->deepsleep != ARMV7M_DEEPSLEEP_NONE) {
+    /* Waking up restarts the clocks, which may change the exceptions
+       again.  */
+    nvic_wake(s);
+    nvic_update(s);
+    return;
+  }
+  s->cpu_irq_level = level;
+  qemu_set_irq(s->parent_irq, level);
+}
+
+/* These helpers keep the lookup tables in step with vectors[], they are
+   the only places that change the vector state.  The caller is
+   responsible for calling nvic_update afterwards.  */
+static void nvic_vec_set_pending(nvic_state *s, int n, int pending)
+{
+  nvic_vec *vec = &s->vectors[n];
+
+  if (vec->pending == pending)
+    return;
+  vec->pending = pending;
+  if (n >= NVIC_FIRST_IRQ)
+    s->num_irq_pending += pending ? 1 : -1;
+  nvic_ready_update(s, n);
+}
+
+static void nvic_vec_set_enabled(nvic_state *s, int n, int enabled)
+{
+  nvic_vec *vec = &s->vectors[n];
+
+  if (vec->enabled == enabled)
+    return;
+  vec->enabled = enabled;
+  nvic_ready_update(s, n);
+}
+
+static void nvic_vec_set_prio(nvic_state *s, int n, int prio)
+{
+  nvic_vec *vec = &s->vectors[n];
+  int pending = vec->pending;
+
+  if (vec->prio == prio)
+    return;
+  nvic_vec_set_pending(s, n, 0);
+  if (vec->active)
+    nvic_active_update(s, vec->prio + NVIC_PRIO_OFFSET, -1);
+  vec->prio = prio;
+  if (vec->active)
+    nvic_active_update(s, vec->prio + NVIC_PRIO_OFFSET, 1);
+  nvic_vec_set_pending(s, n, pending);
+}
+
+/* Rebuild the lookup tables from scratch, after reset or migration.  */
+static void nvic_recompute(nvic_state *s)
+{
+  nvic_vec *vec;
+  int n;
+
+  memset(s->ready, 0, NVIC_NUM_LEVELS * s->vec_words * sizeof(uint32_t));
+  memset(s->ready_levels, 0, sizeof(s->ready_levels));
+  memset(s->active_levels, 0, sizeof(s->active_levels));
+  memset(s->active_count, 0, sizeof(s->active_count));
+  s->num_active = 0;
+  s->num_irq_pending = 0;
+  for (n = 1; n < s->num_vectors; n++) {
+    vec = &s->vectors[n];
+    nvic_ready_update(s, n);
+    if (vec->active) {
+      nvic_active_update(s, vec->prio + NVIC_PRIO_OFFSET, 1);
+      s->num_active++;
+    }
+    if (n >= NVIC_FIRST_IRQ && vec->pending)
+      s->num_irq_pending++;
+  }
+  nvic_update(s);
+}
+
 /* The external routines use the hardware vector numbering, ie. the first
- IRQ is #16.  The internal GIC routines use #32 as the first IRQ.  */
+ IRQ is #16.  */
 void armv7m_nvic_set_pending(void *opaque, int irq)
 {
   nvic_state *s = (nvic_state *)opaque;
-  if (irq >= 16)
-    irq += 16;
-  gic_set_pending_private(&s->gic, 0, irq);
+
+  /* A configurable fault that is disabled escalates to HardFault.  */
+  if ((irq == ARMV7M_EXCP_MEM || irq == ARMV7M_EXCP_BUS
+       || irq == ARMV7M_EXCP_USAGE) && !s->vectors[irq].enabled)
+    irq = ARMV7M_EXCP_HARD;
+  if (s->vectors[irq].pending)
+    return;
+  nvic_vec_set_pending(s, irq, 1);
+  nvic_update(s);
+}
+
+/* Whether the highest priority pending exception can preempt the current
+   execution priority.  This is the level of the CPU interrupt line, but
+   it is also asked on exception return, before the CPU has seen it.  */
+bool armv7m_nvic_can_take_pending_exception(void *opaque)
+{
+  nvic_state *s = (nvic_state *)opaque;
+
+  if (s->vectpending == 0)
+    return false;
+  return nvic_group_prio(s, s->vectors[s->vectpending].prio)
+         < nvic_exec_prio(s);
 }
 
 /* Make pending IRQ active.  */
 int armv7m_nvic_acknowledge_irq(void *opaque)
 {
   nvic_state *s = (nvic_state *)opaque;
-  uint32_t irq;
+  nvic_vec *vec;
+  int irq;
 
-  irq = gic_acknowledge_irq(&s->gic, 0);
-  if (irq == 1023)
+  if (!armv7m_nvic_can_take_pending_exception(s))
     hw_error("Interrupt but no vector\n");
-  if (irq >= 32)
-    irq -= 16;
+  irq = s->vectpending;
+  vec = &s->vectors[irq];
+  /* Level triggered interrupts become pending again on return if the
+     line is still raised.  */
+  nvic_vec_set_pending(s, irq, 0);
+  vec->active = 1;
+  nvic_active_update(s, vec->prio + NVIC_PRIO_OFFSET, 1);
+  s->num_active++;
+  nvic_update(s);
   return irq;
 }
 
 void armv7m_nvic_complete_irq(void *opaque, int irq)
 {
   nvic_state *s = (nvic_state *)opaque;
-  if (irq >= 16)
-    irq += 16;
-  gic_complete_irq(&s->gic, 0, irq);
+  nvic_vec *vec = &s->vectors[irq];
+
+  if (!vec->active) {
+    qemu_log_mask(LOG_GUEST_ERROR,
+                  "NVIC: Return from inactive exception %d\n", irq);
+    return;
+  }
+  vec->active = 0;
+  nvic_active_update(s, vec->prio + NVIC_PRIO_OFFSET, -1);
+  s->num_active--;
+  if (vec->level)
+    nvic_vec_set_pending(s, irq, 1);
+  nvic_update(s);
+}
+
+void armv7m_nvic_wfi(void *opaque)
+{
+  nvic_state *s = (nvic_state *)opaque;
+
+  /* The CPU does not sleep if an exception is already waiting.  */
+  if (!(s->scr & SCR_SLEEPDEEP) || !s->deepsleep_fn || s->cpu_irq_level)
+    return;
+  s->deepsleep = s->deepsleep_fn(s->deepsleep_opaque, true);
+  if (s->deepsleep != ARMV7M_DEEPSLEEP_NONE) {
+    systick_freeze(s);
+  }
+}
+
+void armv7m_nvic_set_deepsleep_handler(DeviceState *nvic,
+                                       ARMv7MDeepSleepFn *fn, void *opaque)
+{
+  nvic_state *s = NVIC(nvic);
+
+  s->deepsleep_fn = fn;
+  s->deepsleep_opaque = opaque;
+}
+
+/* Process a change in an external IRQ input.  */
+static void nvic_set_irq(void *opaque, int irq, int level)
+{
+  nvic_state *s = (nvic_state *)opaque;
+  nvic_vec *vec;
+
+  irq += NVIC_FIRST_IRQ;
+  vec = &s->vectors[irq];
+  if (level == vec->level)
+    return;
+  vec->level = level;
+  if (level && !vec->pending) {
+    nvic_vec_set_pending(s, irq, 1);
+    nvic_update(s);
+  }
+}
+
+/* The floating point extension registers of the SCB, present when the CPU
+   has an FPU.  Return false for offsets the CPU does not implement.  */
+static bool nvic_fp_readl(uint32_t offset, uint32_t *val)
+{
+  CPUARMState *env = cpu_single_env;
+
+  if (!arm_feature(env, ARM_FEATURE_VFP)) {
+    return false;
+  }
+  switch (offset) {
+    case 0xd88: /* Coprocessor Access Control.  */
+      *val = env->v7m.cpacr;
+      break;
+    case 0xf34: /* Floating Point Context Control.  */
+      *val = env->v7m.fpccr;
+      break;
+    case 0xf38: /* Floating Point Context Address.  */
+      *val = env->v7m.fpcar;
+      break;
+    case 0xf3c: /* Floating Point Default Status Control.  */
+      *val = env->v7m.fpdscr;
+      break;
+    case 0xf40: /* MVFR0.  */
+      *val = env->vfp.xregs[ARM_VFP_MVFR0];
+      break;
+    case 0xf44: /* MVFR1.  */
+      *val = env->vfp.xregs[ARM_VFP_MVFR1];
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+static bool nvic_fp_writel(uint32_t offset, uint32_t value)
+{
+  CPUARMState *env = cpu_single_env;
+
+  if (!arm_feature(env, ARM_FEATURE_VFP)) {
+    return false;
+  }
+  switch (offset) {
+    case 0xd88: /* Coprocessor Access Control.  */
+      /* Only CP10 and CP11 exist.  The change takes effect from the next
+         TB, which an ISB starts.  */
+      env->v7m.cpacr = value & 0x00f00000;
+      break;
+    case 0xf34: /* Floating Point Context Control.  */
+      env->v7m.fpccr = value & (V7M_FPCCR_ASPEN | V7M_FPCCR_LSPEN
+                                | V7M_FPCCR_LSPACT);
+      break;
+    case 0xf38: /* Floating Point Context Address.  */
+      env->v7m.fpcar = value & ~7;
+      break;
+    case 0xf3c: /* Floating Point Default Status Control.  */
+      env->v7m.fpdscr = value & 0x07c00000;
+      break;
+    case 0xf40: /* MVFR0.  */
+    case 0xf44: /* MVFR1.  */
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+/* The PMSAv7 MPU registers.  The region state lives in the CPU, where
+   the TLB fill looks it up; every change that can affect a lookup
+   flushes the TLB, so the softmmu fast path needs no MPU checks.  */
+static uint32_t nvic_mpu_readl(nvic_state *s, uint32_t offset)
+{
+  CPUARMState *env = cpu_single_env;
+  int rnr = env->v7m.mpu_rnr;
+
+  switch (offset) {
+    case 0xd90: /* MPU Type.  */
+      return s->num_mpu_regions << 8;
+    case 0xd94: /* MPU Control.  */
+      return env->v7m.mpu_ctrl;
+    case 0xd98: /* MPU Region Number.  */
+      return rnr;
+    case 0xd9c: /* MPU Region Base Address and aliases.  */
+    case 0xda4:
+    case 0xdac:
+    case 0xdb4:
+      return env->v7m.mpu_rbar[rnr] | rnr;
+    default: /* MPU Region Attribute and Size and aliases.  */
+      return env->v7m.mpu_rasr[rnr];
+  }
+}
+
+static void nvic_mpu_writel(nvic_state *s, uint32_t offset, uint32_t value)
+{
+  CPUARMState *env = cpu_single_env;
+
+  switch (offset) {
+    case 0xd90: /* MPU Type.  */
+      return;
+    case 0xd94: /* MPU Control.  */
+      if ((value ^ env->v7m.mpu_ctrl) & V7M_MPU_CTRL_ENABLE) {
+        /* The TBs translated with lazy C and V flags must not run while
+           loads and stores can fault (see ARM_TBFLAG_LAZY_CC).  */
+        tb_flush(env);
+        tb_invalidated_flag = 1;
+      }
+      env->v7m.mpu_ctrl = value & (V7M_MPU_CTRL_ENABLE | V7M_MPU_CTRL_HFNMIENA
+                                   | V7M_MPU_CTRL_PRIVDEFENA);
+      tlb_flush(env, 1);
+      return;
+    case 0xd98: /* MPU Region Number.  */
+      if (value >= s->num_mpu_regions) {
+        qemu_log_mask(LOG_GUEST_ERROR, "NVIC: MPU region %u out of range\n",
+                      value);
+        return;
+      }
+      env->v7m.mpu_rnr = value;
+      return;
+    case 0xd9c: /* MPU Region Base Address and aliases.  */
+    case 0xda4:
+    case 0xdac:
+    case 0xdb4:
+      if (value & 0x10) {
+        /* VALID: the REGION field selects the region.  */
+        if ((value & 0xf) >= s->num_mpu_regions) {
+          qemu_log_mask(LOG_GUEST_ERROR,
+                        "NVIC: MPU region %u out of range\n", value & 0xf);
+          return;
+        }
+        env->v7m.mpu_rnr = value & 0xf;
+      }
+      env->v7m.mpu_rbar[env->v7m.mpu_rnr] = value & ~0x1f;
+      break;
+    default: /* MPU Region Attribute and Size and aliases.  */
+      env->v7m.mpu_rasr[env->v7m.mpu_rnr] = value & 0x173fff3f;
+      break;
+  }
+  if (env->v7m.mpu_ctrl & V7M_MPU_CTRL_ENABLE) {
+    tlb_flush(env, 1);
+  }
 }
 
 static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
 {
   uint32_t val;
-  int irq;
 
   switch (offset) {
     case 4: /* Interrupt Control Type.  */
-      return (s->num_irq / 32) - 1;
+      return (s->num_irq + 31) / 32 - 1;
     case 0x10: /* SysTick Control and Status.  */
+      systick_update(s);
+      systick_schedule(s);
       val = s->systick.control;
       s->systick.control &= ~SYSTICK_COUNTFLAG;
       return val;
@@ -156,6 +656,8 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
     case 0x18: /* SysTick Current Value.  */
     {
       int64_t t;
+      systick_update(s);
+      systick_schedule(s);
       if ((s->systick.control & SYSTICK_ENABLE) == 0)
         return 0;
       t = qemu_get_clock_ns(vm_clock);
@@ -175,71 +677,60 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
       return cpu_single_env->cp15.c0_cpuid;
     case 0xd04: /* Interrypt Control State.  */
       /* VECTACTIVE */
-      val = s->gic.running_irq[0];
-      if (val == 1023) {
-        val = 0;
-      } else if (val >= 32) {
-        val -= 16;
-      }
+      val = cpu_single_env->v7m.exception;
       /* RETTOBASE */
-      if (s->gic.running_irq[0] == 1023
-          || s->gic.last_active[s->gic.running_irq[0]][0] == 1023) {
+      if (s->num_active <= 1) {
         val |= (1 << 11);
       }
       /* VECTPENDING */
-      if (s->gic.current_pending[0] != 1023)
-        val |= (s->gic.current_pending[0] << 12);
+      val |= (s->vectpending << 12);
       /* ISRPENDING */
-      for (irq = 32; irq < s->num_irq; irq++) {
-        if (s->gic.irq_state[irq].pending) {
-          val |= (1 << 22);
-          break;
-        }
-      }
+      if (s->num_irq_pending)
+        val |= (1 << 22);
       /* PENDSTSET */
-      if (s->gic.irq_state[ARMV7M_EXCP_SYSTICK].pending)
+      if (s->vectors[ARMV7M_EXCP_SYSTICK].pending)
         val |= (1 << 26);
       /* PENDSVSET */
-      if (s->gic.irq_state[ARMV7M_EXCP_PENDSV].pending)
+      if (s->vectors[ARMV7M_EXCP_PENDSV].pending)
         val |= (1 << 28);
       /* NMIPENDSET */
-      if (s->gic.irq_state[ARMV7M_EXCP_NMI].pending)
+      if (s->vectors[ARMV7M_EXCP_NMI].pending)
         val |= (1 << 31);
       return val;
     case 0xd08: /* Vector Table Offset.  */
       return cpu_single_env->v7m.vecbase;
     case 0xd0c: /* Application Interrupt/Reset Control.  */
-      return 0xfa05000;
+      return 0xfa050000 | (s->prigroup << 8);
     case 0xd10: /* System Control.  */
       /* TODO: Implement SLEEPONEXIT.  */
-      return 0;
+      return s->scr;
     case 0xd14: /* Configuration Control.  */
       /* TODO: Implement Configuration Control bits.  */
       return 0;
     case 0xd24: /* System Handler Status.  */
       val = 0;
-      if (s->gic.irq_state[ARMV7M_EXCP_MEM].active) val |= (1 << 0);
-      if (s->gic.irq_state[ARMV7M_EXCP_BUS].active) val |= (1 << 1);
-      if (s->gic.irq_state[ARMV7M_EXCP_USAGE].active) val |= (1 << 3);
-      if (s->gic.irq_state[ARMV7M_EXCP_SVC].active) val |= (1 << 7);
-      if (s->gic.irq_state[ARMV7M_EXCP_DEBUG].active) val |= (1 << 8);
-      if (s->gic.irq_state[ARMV7M_EXCP_PENDSV].active) val |= (1 << 10);
-      if (s->gic.irq_state[ARMV7M_EXCP_SYSTICK].active) val |= (1 << 11);
-      if (s->gic.irq_state[ARMV7M_EXCP_USAGE].pending) val |= (1 << 12);
-      if (s->gic.irq_state[ARMV7M_EXCP_MEM].pending) val |= (1 << 13);
-      if (s->gic.irq_state[ARMV7M_EXCP_BUS].pending) val |= (1 << 14);
-      if (s->gic.irq_state[ARMV7M_EXCP_SVC].pending) val |= (1 << 15);
-      if (s->gic.irq_state[ARMV7M_EXCP_MEM].enabled) val |= (1 << 16);
-      if (s->gic.irq_state[ARMV7M_EXCP_BUS].enabled) val |= (1 << 17);
-      if (s->gic.irq_state[ARMV7M_EXCP_USAGE].enabled) val |= (1 << 18);
+      if (s->vectors[ARMV7M_EXCP_MEM].active) val |= (1 << 0);
+      if (s->vectors[ARMV7M_EXCP_BUS].active) val |= (1 << 1);
+      if (s->vectors[ARMV7M_EXCP_USAGE].active) val |= (1 << 3);
+      if (s->vectors[ARMV7M_EXCP_SVC].active) val |= (1 << 7);
+      if (s->vectors[ARMV7M_EXCP_DEBUG].active) val |= (1 << 8);
+      if (s->vectors[ARMV7M_EXCP_PENDSV].active) val |= (1 << 10);
+      if (s->vectors[ARMV7M_EXCP_SYSTICK].active) val |= (1 << 11);
+      if (s->vectors[ARMV7M_EXCP_USAGE].pending) val |= (1 << 12);
+      if (s->vectors[ARMV7M_EXCP_MEM].pending) val |= (1 << 13);
+      if (s->vectors[ARMV7M_EXCP_BUS].pending) val |= (1 << 14);
+      if (s->vectors[ARMV7M_EXCP_SVC].pending) val |= (1 << 15);
+      if (s->vectors[ARMV7M_EXCP_MEM].enabled) val |= (1 << 16);
+      if (s->vectors[ARMV7M_EXCP_BUS].enabled) val |= (1 << 17);
+      if (s->vectors[ARMV7M_EXCP_USAGE].enabled) val |= (1 << 18);
       return val;
     case 0xd28: /* Configurable Fault Status.  */
-      /* TODO: Implement Fault Status.  */
-      qemu_log_mask(LOG_UNIMP, "Configurable Fault Status unimplemented\n");
-      return 0;
+      /* Only the MemManage faults raised by the MPU are recorded.  */
+      return cpu_single_env->v7m.cfsr;
+    case 0xd34: /* Mem Manage Address.  */
+      return cpu_single_env->v7m.mmfar;
     case 0xd2c: /* Hard Fault Status.  */
     case 0xd30: /* Debug Fault Status.  */
-    case 0xd34: /* Mem Manage Address.  */
     case 0xd38: /* Bus Fault Address.  */
     case 0xd3c: /* Aux Fault Status.  */
       /* TODO: Implement fault status registers.  */
@@ -271,7 +762,21 @@ static uint32_t nvic_readl(nvic_state *s, uint32_t offset)
       return 0x01111110;
     case 0xd70: /* ISAR4.  */
       return 0x01310102;
-      /* TODO: Implement debug registers.  */
+    case 0xd90 ... 0xdbb: /* MPU.  */
+      if (s->num_mpu_regions == 0) {
+        return 0;
+      }
+      return nvic_mpu_readl(s, offset & ~3);
+    case 0xd88: /* Coprocessor Access Control.  */
+    case 0xf34 ... 0xf44: /* Floating point extension.  */
+      if (nvic_fp_readl(offset, &val)) {
+        return val;
+      }
+      qemu_log_mask(LOG_GUEST_ERROR, "NVIC: Bad read offset 0x%x\n", offset);
+      return 0;
+    case 0xdfc: /* Debug Exception and Monitor Control.  */
+      return s->demcr;
+      /* TODO: Implement the other debug registers.  */
     default:
       qemu_log_mask(LOG_GUEST_ERROR, "NVIC: Bad read offset 0x%x\n", offset);
       return 0;
@@ -283,6 +788,7 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
   uint32_t oldval;
   switch (offset) {
     case 0x10: /* SysTick Control and Status.  */
+      systick_update(s);
       oldval = s->systick.control;
       s->systick.control &= 0xfffffff8;
       s->systick.control |= value & 7;
@@ -291,7 +797,7 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
         if (value & SYSTICK_ENABLE) {
           if (s->systick.tick) {
             s->systick.tick += now;
-            qemu_mod_timer(s->systick.timer, s->systick.tick);
+            systick_schedule(s);
           } else {
             systick_reload(s, 1);
           }
@@ -305,6 +811,9 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
         /* This is a hack. Force the timer to be reloaded
          when the reference clock is changed.  */
         systick_reload(s, 1);
+      } else {
+        /* TICKINT may have changed.  */
+        systick_schedule(s);
       }
       break;
     case 0x14: /* SysTick Reload Value.  */
@@ -316,26 +825,27 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
       break;
     case 0xd04: /* Interrupt Control State.  */
       if (value & (1 << 31)) {
-        armv7m_nvic_set_pending(s, ARMV7M_EXCP_NMI);
+        nvic_vec_set_pending(s, ARMV7M_EXCP_NMI, 1);
       }
       if (value & (1 << 28)) {
-        armv7m_nvic_set_pending(s, ARMV7M_EXCP_PENDSV);
+        nvic_vec_set_pending(s, ARMV7M_EXCP_PENDSV, 1);
       } else if (value & (1 << 27)) {
-        s->gic.irq_state[ARMV7M_EXCP_PENDSV].pending = 0;
-        gic_update(&s->gic);
+        nvic_vec_set_pending(s, ARMV7M_EXCP_PENDSV, 0);
       }
       if (value & (1 << 26)) {
-        armv7m_nvic_set_pending(s, ARMV7M_EXCP_SYSTICK);
+        nvic_vec_set_pending(s, ARMV7M_EXCP_SYSTICK, 1);
       } else if (value & (1 << 25)) {
-        s->gic.irq_state[ARMV7M_EXCP_SYSTICK].pending = 0;
-        gic_update(&s->gic);
+        nvic_vec_set_pending(s, ARMV7M_EXCP_SYSTICK, 0);
       }
+      nvic_update(s);
       break;
     case 0xd08: /* Vector Table Offset.  */
       cpu_single_env->v7m.vecbase = value & 0xffffff80;
       break;
     case 0xd0c: /* Application Interrupt/Reset Control.  */
       if ((value >> 16) == 0x05fa) {
+        s->prigroup = (value >> 8) & 7;
+        nvic_update(s);
         if (value & 2) {
           qemu_log_mask(LOG_UNIMP, "VECTCLRACTIVE unimplemented\n");
         }
@@ -345,21 +855,33 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
       }
       break;
     case 0xd10: /* System Control.  */
+      s->scr = value & (SCR_SLEEPONEXIT | SCR_SLEEPDEEP | SCR_SEVONPEND);
+      break;
     case 0xd14: /* Configuration Control.  */
       /* TODO: Implement control registers.  */
-      qemu_log_mask(LOG_UNIMP, "NVIC: SCR and CCR unimplemented\n");
+      qemu_log_mask(LOG_UNIMP, "NVIC: CCR unimplemented\n");
       break;
     case 0xd24: /* System Handler Control.  */
       /* TODO: Real hardware allows you to set/clear the active bits
        under some circumstances.  We don't implement this.  */
-      s->gic.irq_state[ARMV7M_EXCP_MEM].enabled = (value & (1 << 16)) != 0;
-      s->gic.irq_state[ARMV7M_EXCP_BUS].enabled = (value & (1 << 17)) != 0;
-      s->gic.irq_state[ARMV7M_EXCP_USAGE].enabled = (value & (1 << 18)) != 0;
+      nvic_vec_set_enabled(s, ARMV7M_EXCP_MEM, (value & (1 << 16)) != 0);
+      nvic_vec_set_enabled(s, ARMV7M_EXCP_BUS, (value & (1 << 17)) != 0);
+      nvic_vec_set_enabled(s, ARMV7M_EXCP_USAGE, (value & (1 << 18)) != 0);
+      nvic_update(s);
+      break;
+    case 0xd28: /* Configurable Fault Status.  Write one to clear.  */
+      cpu_single_env->v7m.cfsr &= ~value;
+      break;
+    case 0xd34: /* Mem Manage Address.  */
+      cpu_single_env->v7m.mmfar = value;
+      break;
+    case 0xd90 ... 0xdbb: /* MPU.  */
+      if (s->num_mpu_regions) {
+        nvic_mpu_writel(s, offset & ~3, value);
+      }
       break;
-    case 0xd28: /* Configurable Fault Status.  */
     case 0xd2c: /* Hard Fault Status.  */
     case 0xd30: /* Debug Fault Status.  */
-    case 0xd34: /* Mem Manage Address.  */
     case 0xd38: /* Bus Fault Address.  */
     case 0xd3c: /* Aux Fault Status.  */
       qemu_log_mask(LOG_UNIMP,
@@ -367,7 +889,18 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
       break;
     case 0xf00: /* Software Triggered Interrupt Register */
       if ((value & 0x1ff) < s->num_irq) {
-        gic_set_pending_private(&s->gic, 0, value & 0x1ff);
+        nvic_vec_set_pending(s, (value & 0x1ff) + NVIC_FIRST_IRQ, 1);
+        nvic_update(s);
+      }
+      break;
+    case 0xdfc: /* Debug Exception and Monitor Control.  */
+      s->demcr = value & 0x010f07f1;
+      break;
+    case 0xd88: /* Coprocessor Access Control.  */
+    case 0xf34 ... 0xf44: /* Floating point extension.  */
+      if (!nvic_fp_writel(offset, value)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "NVIC: Bad write offset 0x%x\n", offset);
       }
       break;
     default:
@@ -376,19 +909,96 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
   }
 }
 
+/* Set/Clear Enable, Set/Clear Pending and Active Bit registers.  These
+   have one bit per external interrupt, bits past the last one are
+   RAZ/WI.  */
+static uint32_t nvic_irq_bits_read(nvic_state *s, uint32_t offset,
+                                   unsigned size)
+{
+  int irq = (offset & 0x7f) * 8 + NVIC_FIRST_IRQ;
+  uint32_t val = 0;
+  nvic_vec *vec;
+  int i;
+
+  for (i = 0; i < size * 8 && irq + i < s->num_vectors; i++) {
+    vec = &s->vectors[irq + i];
+    switch (offset & ~0x7f) {
+      case 0x100: /* Set Enable.  */
+      case 0x180: /* Clear Enable.  */
+        if (vec->enabled)
+          val |= (1 << i);
+        break;
+      case 0x200: /* Set Pending.  */
+      case 0x280: /* Clear Pending.  */
+        if (vec->pending)
+          val |= (1 << i);
+        break;
+      case 0x300: /* Active.  */
+        if (vec->active)
+          val |= (1 << i);
+        break;
+    }
+  }
+  return val;
+}
+
+static void nvic_irq_bits_write(nvic_state *s, uint32_t offset,
+                                uint32_t value, unsigned size)
+{
+  int irq = (offset & 0x7f) * 8 + NVIC_FIRST_IRQ;
+  nvic_vec *vec;
+  int i;
+
+  for (i = 0; i < size * 8 && irq + i < s->num_vectors; i++) {
+    if ((value & (1 << i)) == 0)
+      continue;
+    vec = &s->vectors[irq + i];
+    switch (offset & ~0x7f) {
+      case 0x100: /* Set Enable.  */
+        nvic_vec_set_enabled(s, irq + i, 1);
+        break;
+      case 0x180: /* Clear Enable.  */
+        nvic_vec_set_enabled(s, irq + i, 0);
+        break;
+      case 0x200: /* Set Pending.  */
+        nvic_vec_set_pending(s, irq + i, 1);
+        break;
+      case 0x280: /* Clear Pending.  */
+        /* A raised level triggered interrupt stays pending.  */
+        nvic_vec_set_pending(s, irq + i, vec->level && !vec->active);
+        break;
+    }
+  }
+  nvic_update(s);
+}
+
 static uint64_t nvic_sysreg_read(void *opaque, hwaddr addr,
                                  unsigned size)
 {
   nvic_state *s = (nvic_state *)opaque;
   uint32_t offset = addr;
-  int i;
+  int i, n;
   uint32_t val;
 
   switch (offset) {
+    case 0x100 ... 0x13f: /* Set Enable.  */
+    case 0x180 ... 0x1bf: /* Clear Enable.  */
+    case 0x200 ... 0x23f: /* Set Pending.  */
+    case 0x280 ... 0x2bf: /* Clear Pending.  */
+    case 0x300 ... 0x33f: /* Active Bit.  */
+      return nvic_irq_bits_read(s, offset, size);
+    case 0x400 ... 0x5ef: /* Interrupt Priority.  */
+      val = 0;
+      for (i = 0; i < size; i++) {
+        n = (offset - 0x400) + i + NVIC_FIRST_IRQ;
+        if (n < s->num_vectors)
+          val |= s->vectors[n].prio << (i * 8);
+      }
+      return val;
     case 0xd18 ... 0xd23: /* System Handler Priority.  */
       val = 0;
       for (i = 0; i < size; i++) {
-        val |= s->gic.priority1[(offset - 0xd14) + i][0] << (i * 8);
+        val |= s->vectors[(offset - 0xd14) + i].prio << (i * 8);
       }
       return val;
     case 0xfe0 ... 0xfff: /* ID.  */
@@ -410,15 +1020,31 @@ static void nvic_sysreg_write(void *opaque, hwaddr addr,
 {
   nvic_state *s = (nvic_state *)opaque;
   uint32_t offset = addr;
-  int i;
+  int i, n;
 
   switch (offset) {
+    case 0x100 ... 0x13f: /* Set Enable.  */
+    case 0x180 ... 0x1bf: /* Clear Enable.  */
+    case 0x200 ... 0x23f: /* Set Pending.  */
+    case 0x280 ... 0x2bf: /* Clear Pending.  */
+      nvic_irq_bits_write(s, offset, value, size);
+      return;
+    case 0x300 ... 0x33f: /* Active Bit.  */
+      return;
+    case 0x400 ... 0x5ef: /* Interrupt Priority.  */
+      for (i = 0; i < size; i++) {
+        n = (offset - 0x400) + i + NVIC_FIRST_IRQ;
+        if (n < s->num_vectors)
+          nvic_vec_set_prio(s, n, (value >> (i * 8)) & 0xff);
+      }
+      nvic_update(s);
+      return;
     case 0xd18 ... 0xd23: /* System Handler Priority.  */
       for (i = 0; i < size; i++) {
-        s->gic.priority1[(offset - 0xd14) + i][0] =
-        (value >> (i * 8)) & 0xff;
+        nvic_vec_set_prio(s, (offset - 0xd14) + i,
+                          (value >> (i * 8)) & 0xff);
       }
-      gic_update(&s->gic);
+      nvic_update(s);
       return;
   }
   if (size == 4) {
@@ -435,16 +1061,45 @@ static const MemoryRegionOps nvic_sysreg_ops = {
   .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
-static const VMStateDescription vmstate_nvic = {
-  .name = "armv7m_nvic",
+static int nvic_post_load(void *opaque, int version_id)
+{
+  nvic_recompute((nvic_state *)opaque);
+  return 0;
+}
+
+static const VMStateDescription vmstate_nvic_vec = {
+  .name = "armv7m_nvic_vec",
   .version_id = 1,
   .minimum_version_id = 1,
   .minimum_version_id_old = 1,
   .fields      = (VMStateField[]) {
+    VMSTATE_INT16(prio, nvic_vec),
+    VMSTATE_UINT8(enabled, nvic_vec),
+    VMSTATE_UINT8(pending, nvic_vec),
+    VMSTATE_UINT8(active, nvic_vec),
+    VMSTATE_UINT8(level, nvic_vec),
+    VMSTATE_END_OF_LIST()
+  }
+};
+
+static const VMStateDescription vmstate_nvic = {
+  .name = "armv7m_nvic",
+  .version_id = 4,
+  .minimum_version_id = 2,
+  .minimum_version_id_old = 2,
+  .post_load = nvic_post_load,
+  .fields      = (VMStateField[]) {
+    VMSTATE_STRUCT_ARRAY(vectors, nvic_state, NVIC_MAX_VECTORS, 1,
+                         vmstate_nvic_vec, nvic_vec),
+    VMSTATE_UINT32(prigroup, nvic_state),
     VMSTATE_UINT32(systick.control, nvic_state),
     VMSTATE_UINT32(systick.reload, nvic_state),
     VMSTATE_INT64(systick.tick, nvic_state),
     VMSTATE_TIMER(systick.timer, nvic_state),
+    VMSTATE_UINT32_V(demcr, nvic_state, 3),
+    VMSTATE_UINT32_V(scr, nvic_state, 4),
+    VMSTATE_INT32_V(deepsleep, nvic_state, 4),
+    VMSTATE_INT64_V(systick.left, nvic_state, 4),
     VMSTATE_END_OF_LIST()
   }
 };
@@ -452,97 +1107,86 @@ static const VMStateDescription vmstate_nvic = {
 static void armv7m_nvic_reset(DeviceState *dev)
 {
   nvic_state *s = NVIC(dev);
-  NVICClass *nc = NVIC_GET_CLASS(s);
-  nc->parent_reset(dev);
-  /* Common GIC reset resets to disabled; the NVIC doesn't have
-   * per-CPU interfaces so mark our non-existent CPU interface
-   * as enabled by default, and with a priority mask which allows
-   * all interrupts through.
-   */
-  s->gic.cpu_enabled[0] = 1;
-  s->gic.priority_mask[0] = 0x100;
-  /* The NVIC as a whole is always enabled. */
-  s->gic.enabled = 1;
+  int n;
+
+  memset(s->vectors, 0, sizeof(s->vectors));
+  s->vectors[ARMV7M_EXCP_RESET].prio = -3;
+  s->vectors[ARMV7M_EXCP_NMI].prio = -2;
+  s->vectors[ARMV7M_EXCP_HARD].prio = -1;
+  /* The system exceptions are always enabled, except for the
+     configurable faults which are enabled through SHCSR.  */
+  for (n = 1; n < NVIC_FIRST_IRQ; n++) {
+    s->vectors[n].enabled = 1;
+  }
+  s->vectors[ARMV7M_EXCP_MEM].enabled = 0;
+  s->vectors[ARMV7M_EXCP_BUS].enabled = 0;
+  s->vectors[ARMV7M_EXCP_USAGE].enabled = 0;
+  s->prigroup = 0;
+  s->demcr = 0;
+  s->scr = 0;
+  s->deepsleep = ARMV7M_DEEPSLEEP_NONE;
+  nvic_recompute(s);
   systick_reset(s);
 }
 
 static int armv7m_nvic_init(SysBusDevice *dev)
 {
   nvic_state *s = NVIC(dev);
-  NVICClass *nc = NVIC_GET_CLASS(s);
-
-  /* The NVIC always has only one CPU */
-  s->gic.num_cpu = 1;
-  /* Tell the common code we're an NVIC */
-  s->gic.revision = 0xffffffff;
-  s->num_irq = s->gic.num_irq;
-  nc->parent_init(dev);
-  gic_init_irqs_and_distributor(&s->gic, s->num_irq);
-  /* The NVIC and system controller register area looks like this:
-   *  0..0xff : system control registers, including systick
-   *  0x100..0xcff : GIC-like registers
-   *  0xd00..0xfff : system control registers
-   * We use overlaying to put the GIC like registers
-   * over the top of the system control register region.
-   */
-  memory_region_init(&s->container, "nvic", 0x1000);
-  /* The system register region goes at the bottom of the priority
-   * stack as it covers the whole page.
+
+  if (s->num_irq > NVIC_MAX_IRQ) {
+    hw_error("requested %u interrupt lines exceeds NVIC maximum %d\n",
+             s->num_irq, NVIC_MAX_IRQ);
+  }
+  if (s->num_mpu_regions != 0 && s->num_mpu_regions != 8) {
+    hw_error("NVIC: %u MPU regions requested, only 0 or 8 are supported\n",
+             s->num_mpu_regions);
+  }
+  s->num_vectors = NVIC_FIRST_IRQ + s->num_irq;
+  s->vec_words = (s->num_vectors + 31) / 32;
+  s->ready = g_new0(uint32_t, NVIC_NUM_LEVELS * s->vec_words);
+
+  qdev_init_gpio_in(&dev->qdev, nvic_set_irq, s->num_irq);
+  sysbus_init_irq(dev, &s->parent_irq);
+  /* The NVIC and system controller registers share one page, mapped
+   * into system memory at the location required by the v7M architecture.
    */
   memory_region_init_io(&s->sysregmem, &nvic_sysreg_ops, s,
                         "nvic_sysregs", 0x1000);
-  memory_region_add_subregion(&s->container, 0, &s->sysregmem);
-  /* Alias the GIC region so we can get only the section of it
-   * we need, and layer it on top of the system register region.
-   */
-  memory_region_init_alias(&s->gic_iomem_alias, "nvic-gic", &s->gic.iomem,
-                           0x100, 0xc00);
-  memory_region_add_subregion_overlap(&s->container, 0x100,
-                                      &s->gic_iomem_alias, 1);
-  /* Map the whole thing into system memory at the location required
-   * by the v7M architecture.
-   */
-  memory_region_add_subregion(get_system_memory(), 0xe000e000, &s->container);
+  memory_region_add_subregion(s->memory ? s->memory : get_system_memory(),
+                              0xe000e000, &s->sysregmem);
   s->systick.timer = qemu_new_timer_ns(vm_clock, systick_timer_tick, s);
   return 0;
 }
 
-static void armv7m_nvic_instance_init(Object *obj)
-{
-  /* We have a different default value for the num-irq property
-   * than our superclass. This function runs after qdev init
-   * has set the defaults from the Property array and before
-   * any user-specified property setting, so just modify the
-   * value in the GICState struct.
-   */
-  GICState *s = ARM_GIC_COMMON(obj);
+static Property armv7m_nvic_properties[] = {
   /* The ARM v7m may have anything from 0 to 496 external interrupt
    * IRQ lines. We default to 64. Other boards may differ and should
    * set the num-irq property appropriately.
    */
-  s->num_irq = 64;
-}
+  DEFINE_PROP_UINT32("num-irq", nvic_state, num_irq, 64),
+  /* 8 for the optional PMSAv7 MPU, or 0 if the part has none.  */
+  DEFINE_PROP_UINT32("num-mpu-regions", nvic_state, num_mpu_regions, 8),
+  DEFINE_PROP_PTR("memory", nvic_state, memory),
+  DEFINE_PROP_END_OF_LIST(),
+};
 
 static void armv7m_nvic_class_init(ObjectClass *klass, void *data)
 {
-  NVICClass *nc = NVIC_CLASS(klass);
   DeviceClass *dc = DEVICE_CLASS(klass);
   SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
-  nc->parent_reset = dc->reset;
-  nc->parent_init = sdc->init;
   sdc->init = armv7m_nvic_init;
   dc->vmsd  = &vmstate_nvic;
   dc->reset = armv7m_nvic_reset;
+  dc->props = armv7m_nvic_properties;
+  dc->no_user = 1;
 }
 
 static const TypeInfo armv7m_nvic_info = {
   .name          = TYPE_NVIC,
-  .parent        = TYPE_ARM_GIC_COMMON,
-  .instance_init = armv7m_nvic_instance_init,
+  .parent        = TYPE_SYS_BUS_DEVICE,
   .instance_size = sizeof(nvic_state),
   .class_init    = armv7m_nvic_class_init,
-  .class_size    = sizeof(NVICClass),
 };
 
 static void armv7m_nvic_register_types(void)
@@ -550,4 +1194,4 @@ static void armv7m_nvic_register_types(void)
   type_register_static(&armv7m_nvic_info);
 }
 
-type_init(armv7m_nvic_register_types)
\ No newline at end of file
+type_init(armv7m_nvic_register_types)
@@ -0,0 +1,291 @@
+/*
+ * ARMv7-M statistical profiler
+ *
+ * Samples the program counter of the guest CPU at a fixed interval of
+ * virtual time, resolves it through the symbols of the ELF image, and
+ * writes a profile in the folded stacks format read by flame graph
+ * tools: one line per call stack, outermost function first, followed by
+ * the number of samples.
+ *
+ * This code is licensed under the GPL.
+ */
+
+#include "hw.h"
+#include "arm-misc.h"
+#include "disas/disas.h"
+#include "qemu/config-file.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+/* Exception return values are loaded into LR on exception entry.  */
+#define EXC_RETURN_MIN          0xfffffff0
+#define EXC_RETURN_PROCESS_SP   (1 << 2)
+
+#define PCSAMPLE_DEFAULT_INTERVAL_US    1000
+#define PCSAMPLE_DEFAULT_DEPTH          32
+#define PCSAMPLE_MAX_DEPTH              256
+
+typedef enum {
+    PCSAMPLE_UNWIND_NONE,
+    PCSAMPLE_UNWIND_LR,
+    PCSAMPLE_UNWIND_FP,
+} PCSampleUnwind;
+
+typedef struct {
+    CPUARMState *env;
+    char *filename;
+    int64_t interval_ns;
+    PCSampleUnwind unwind;
+    int depth;
+    QEMUTimer *timer;
+    /* Folded stack -> number of samples.  */
+    GHashTable *stacks;
+    bool dirty;
+    GString *key;
+} PCSampleState;
+
+static PCSampleState *pcsample;
+
+static bool pcsample_read_word(CPUARMState *env, uint32_t addr, uint32_t *val)
+{
+    uint8_t buf[4];
+
+    if ((addr & 3) || cpu_memory_rw_debug(env, addr, buf, 4, 0) != 0) {
+        return false;
+    }
+    *val = ldl_le_p(buf);
+    return true;
+}
+
+/* Returns the PC the exception described by EXC_RETURN interrupted.  The
+ * hardware stacked it 24 bytes into the frame.  FRAME_SP is the main stack
+ * pointer at exception entry if known, or 0.  */
+static bool pcsample_exception_pc(CPUARMState *env, uint32_t exc_return,
+                                  uint32_t frame_sp, uint32_t *pc)
+{
+    if (exc_return & EXC_RETURN_PROCESS_SP) {
+        /* Handlers run on the main stack, so the process stack pointer
+         * is still where the exception left it.  */
+        frame_sp = env->v7m.current_sp ? env->regs[13] : env->v7m.other_sp;
+    }
+    return frame_sp && pcsample_read_word(env, frame_sp + 24, pc);
+}
+
+/* Walks the frame records that r7 points to: the caller's r7 followed by
+ * the return address, as pushed by "push {r7, lr}; mov r7, sp".  Returns
+ * the number of PCs stored, innermost first.  */
+static int pcsample_unwind_fp(CPUARMState *env, uint32_t *pcs, int depth)
+{
+    uint32_t fp = env->regs[7];
+    uint32_t lr = env->regs[14];
+    uint32_t next_fp;
+    int n = 0;
+
+    pcs[n++] = env->regs[15];
+
+    /* A leaf function may not have a frame record of its own, in which
+     * case its return address is only in LR.  If it does have one, LR
+     * either matches the record or points into the function itself.  */
+    if (n < depth && lr < EXC_RETURN_MIN && lr != 0 &&
+        (!pcsample_read_word(env, fp + 4, &next_fp) || next_fp != lr)) {
+        pcs[n++] = lr & ~1;
+    }
+
+    while (n < depth) {
+        if (!pcsample_read_word(env, fp, &next_fp) ||
+            !pcsample_read_word(env, fp + 4, &lr)) {
+            break;
+        }
+        if (lr >= EXC_RETURN_MIN) {
+            /* The record was pushed by the handler on entry, so the
+             * exception frame is right above it.  */
+            if (!pcsample_exception_pc(env, lr, fp + 8, &pcs[n])) {
+                break;
+            }
+            n++;
+        } else {
+            pcs[n++] = lr & ~1;
+        }
+        /* Frames are further up the stack the further out they are.  */
+        if (next_fp <= fp) {
+            break;
+        }
+        fp = next_fp;
+    }
+    return n;
+}
+
+/* Takes the caller from LR.  This is only right while LR still holds the
+ * return address, as it does in leaf functions, but needs nothing from
+ * the compiler.  */
+static int pcsample_unwind_lr(CPUARMState *env, uint32_t *pcs, int depth)
+{
+    uint32_t lr = env->regs[14];
+    int n = 0;
+
+    pcs[n++] = env->regs[15];
+    if (n < depth) {
+        if (lr >= EXC_RETURN_MIN) {
+            if (pcsample_exception_pc(env, lr, 0, &pcs[n])) {
+                n++;
+            }
+        } else if (lr != 0) {
+            pcs[n++] = lr & ~1;
+        }
+    }
+    return n;
+}
+
+static void pcsample_append_frame(GString *key, uint32_t pc)
+{
+    const char *sym = lookup_symbol(pc);
+
+    if (key->len) {
+        g_string_append_c(key, ';');
+    }
+    if (sym[0]) {
+        g_string_append(key, sym);
+    } else {
+        g_string_append_printf(key, "0x%08" PRIx32, pc);
+    }
+}
+
+static void pcsample_take(PCSampleState *s)
+{
+    uint32_t pcs[PCSAMPLE_MAX_DEPTH];
+    const char *prev = NULL;
+    gpointer count;
+    int n, i;
+
+    switch (s->unwind) {
+    case PCSAMPLE_UNWIND_FP:
+        n = pcsample_unwind_fp(s->env, pcs, s->depth);
+        break;
+    case PCSAMPLE_UNWIND_LR:
+        n = pcsample_unwind_lr(s->env, pcs, s->depth);
+        break;
+    default:
+        pcs[0] = s->env->regs[15];
+        n = 1;
+        break;
+    }
+
+    g_string_truncate(s->key, 0);
+    for (i = n - 1; i >= 0; i--) {
+        const char *sym = lookup_symbol(pcs[i]);
+
+        /* LR often still points into the sampled function itself.  */
+        if (sym[0] && prev == sym) {
+            continue;
+        }
+        prev = sym;
+        pcsample_append_frame(s->key, pcs[i]);
+    }
+
+    count = g_hash_table_lookup(s->stacks, s->key->str);
+    if (count) {
+        (*(uint64_t *)count)++;
+    } else {
+        uint64_t *c = g_new(uint64_t, 1);
+
+        *c = 1;
+        g_hash_table_insert(s->stacks, g_strdup(s->key->str), c);
+    }
+    s->dirty = true;
+}
+
+static void pcsample_tick(void *opaque)
+{
+    PCSampleState *s = opaque;
+
+    pcsample_take(s);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock) + s->interval_ns);
+}
+
+static void pcsample_write_stack(gpointer key, gpointer value, gpointer opaque)
+{
+    fprintf(opaque, "%s %" PRIu64 "\n", (char *)key, *(uint64_t *)value);
+}
+
+static void pcsample_dump(PCSampleState *s)
+{
+    FILE *f;
+
+    if (!s->dirty) {
+        return;
+    }
+    f = fopen(s->filename, "w");
+    if (!f) {
+        fprintf(stderr, "qemu: pcsample: %s: %s\n", s->filename,
+                strerror(errno));
+        return;
+    }
+    g_hash_table_foreach(s->stacks, pcsample_write_stack, f);
+    fclose(f);
+    s->dirty = false;
+}
+
+static void pcsample_vm_state_change(void *opaque, int running,
+                                     RunState state)
+{
+    /* Write the profile whenever the guest stops, so that it can be looked
+     * at without quitting.  */
+    if (!running) {
+        pcsample_dump(opaque);
+    }
+}
+
+static void pcsample_exit(void)
+{
+    pcsample_dump(pcsample);
+}
+
+void armv7m_pcsample_init(ARMCPU *cpu)
+{
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("pcsample"), NULL);
+    PCSampleState *s;
+    const char *unwind;
+
+    if (!opts || pcsample) {
+        return;
+    }
+
+    s = g_new0(PCSampleState, 1);
+    s->env = &cpu->env;
+    s->filename = g_strdup(qemu_opt_get(opts, "file"));
+    if (!s->filename) {
+        fprintf(stderr, "qemu: -pcsample: file is required\n");
+        exit(1);
+    }
+    s->interval_ns = qemu_opt_get_number(opts, "interval",
+                                         PCSAMPLE_DEFAULT_INTERVAL_US) * 1000;
+    if (s->interval_ns <= 0) {
+        fprintf(stderr, "qemu: -pcsample: interval must be positive\n");
+        exit(1);
+    }
+    s->depth = qemu_opt_get_number(opts, "depth", PCSAMPLE_DEFAULT_DEPTH);
+    s->depth = MAX(1, MIN(s->depth, PCSAMPLE_MAX_DEPTH));
+
+    unwind = qemu_opt_get(opts, "unwind");
+    if (!unwind || !strcmp(unwind, "lr")) {
+        s->unwind = PCSAMPLE_UNWIND_LR;
+    } else if (!strcmp(unwind, "fp")) {
+        s->unwind = PCSAMPLE_UNWIND_FP;
+    } else if (!strcmp(unwind, "none")) {
+        s->unwind = PCSAMPLE_UNWIND_NONE;
+    } else {
+        fprintf(stderr, "qemu: -pcsample: unwind must be none, lr or fp\n");
+        exit(1);
+    }
+
+    s->stacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    s->key = g_string_new(NULL);
+    /* Virtual time only advances while the guest runs, and with -icount
+     * the samples fall every so many instructions.  */
+    s->timer = qemu_new_timer_ns(vm_clock, pcsample_tick, s);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock) + s->interval_ns);
+
+    qemu_add_vm_change_state_handler(pcsample_vm_state_change, s);
+    pcsample = s;
+    atexit(pcsample_exit);
+}
@@ -22,12 +22,17 @@ typedef void QEMUMachineInitFunc(QEMUMachineInitArgs *args);
 
 typedef void QEMUMachineResetFunc(void);
 
+typedef size_t QEMUMachineTbSizeFunc(void);
+
 typedef struct QEMUMachine {
     const char *name;
     const char *alias;
     const char *desc;
     QEMUMachineInitFunc *init;
     QEMUMachineResetFunc *reset;
+    /* Size in bytes of the translation buffer to use when -tb-size is not
+     * given, or NULL to size it from the RAM size.  Called before init.  */
+    QEMUMachineTbSizeFunc *tb_size;
     BlockInterfaceType block_default_type;
     int max_cpus;
     unsigned int no_serial:1,
@@ -36,7 +41,8 @@ typedef struct QEMUMachine {
         use_sclp:1,
         no_floppy:1,
         no_cdrom:1,
-        no_sdcard:1;
+        no_sdcard:1,
+        no_net:1;
     int is_default;
     const char *default_machine_opts;
     const char *boot_order;
@@ -21,6 +21,10 @@
 
 #include "hw.h"
 #include "clktree.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/types.h"
+#include "qmp-commands.h"
+#include "trace.h"
 
 
 /* DEFINITIONS*/
@@ -57,9 +61,25 @@ struct Clk {
     unsigned input_count;
     int selected_input;
     struct Clk *input[CLKTREE_MAX_INPUT];
+
+    /* Set when the output needs to be recalculated at the end of the
+     * update. */
+    bool dirty;
+    /* The state the users were last told about. */
+    uint32_t notified_freq;
+    bool notified_enabled;
+
+    /* All clocks, in the order they were created.  A clock can only be
+     * created after its inputs, so this is a topological order of the tree.
+     */
+    struct Clk *next;
 };
 
-static void clktree_recalc_output_freq(Clk clk);
+/* Clocks are recalculated and users notified when the outermost update
+ * ends (see clktree_begin_update). */
+static unsigned clktree_update_depth;
+static bool clktree_any_dirty;
+static Clk clktree_first, clktree_last;
 
 
 
@@ -88,20 +108,31 @@ static void clktree_print_state(Clk clk)
 }
 #endif
 
-static void clktree_set_input_freq(Clk clk, uint32_t input_freq)
+/* Marks the clock as needing a recalculation, which is done when the
+ * outermost update ends. */
+static void clktree_mark_dirty(Clk clk)
 {
-    clk->input_freq = input_freq;
-
-    clktree_recalc_output_freq(clk);
+    clk->dirty = true;
+    clktree_any_dirty = true;
 }
 
-/* Recalculates the output frequency based on the clock's input_freq variable.
- */
-static void clktree_recalc_output_freq(Clk clk) {
+/* Recalculates the output frequency of a dirty clock, marking its children
+ * dirty if it changed.  The clock's input must already be up to date. */
+static void clktree_recalc_output_freq(Clk clk)
+{
     int i;
-    Clk next_clk, next_clk_input;
+    Clk input_clk;
     uint32_t new_output_freq;
 
+    clk->dirty = false;
+
+    /* Source clocks keep the frequency they were created with.  Other
+     * clocks follow their selected input, or get 0 if there is none. */
+    if(clk->input_count > 1) {
+        input_clk = clktree_get_input_clk(clk);
+        clk->input_freq = input_clk ? input_clk->output_freq : 0;
+    }
+
     /* Get the output frequency, or 0 if the output is disabled. */
     new_output_freq = clk->enabled ?
                             muldiv64(clk->input_freq,
@@ -109,48 +140,140 @@ static void clktree_recalc_output_freq(Clk clk) {
                                      clk->divisor)
                             : 0;
 
-    /* if the frequency has changed. */
-   if(new_output_freq != clk->output_freq) {
-       clk->output_freq = new_output_freq;
+    if(new_output_freq != clk->output_freq) {
+        clk->output_freq = new_output_freq;
+
+        /* The children are later in the clock list, so they are
+         * recalculated in the same pass. */
+        for(i=0; i < clk->output_count; i++) {
+            assert(clk->output[i] != NULL);
+            clk->output[i]->dirty = true;
+        }
+    }
+}
+
+/* Tells the users of the clock about its new state, if it changed since
+ * they were last notified.  Returns true if it did. */
+static bool clktree_notify_users(Clk clk)
+{
+    int i;
+
+    if(clk->output_freq == clk->notified_freq &&
+       clk->enabled == clk->notified_enabled) {
+        return false;
+    }
+
+    trace_clktree_change(clk->name, clk->input_freq, clk->output_freq,
+                         clk->enabled);
+
+    /* Record the new state first, in case a user starts another update. */
+    clk->notified_enabled = clk->enabled;
+    if(clk->output_freq != clk->notified_freq) {
+        clk->notified_freq = clk->output_freq;
 
 #ifdef DEBUG_CLKTREE
         clktree_print_state(clk);
 #endif
 
         /* Check the new frequency against the max frequency. */
-        if(new_output_freq > clk->max_output_freq) {
+        if(clk->output_freq > clk->max_output_freq) {
             fprintf(stderr, "%s: Clock %s output frequency (%d Hz) exceeds max frequency (%d Hz).\n",
                     __FUNCTION__,
                     clk->name,
-                    new_output_freq,
+                    clk->output_freq,
                     clk->max_output_freq);
         }
+    }
+
+    for(i=0; i < clk->user_count; i++) {
+        qemu_set_irq(clk->user[i], 1);
+    }
+    return true;
+}
 
-        /* Notify users of change. */
-        for(i=0; i < clk->user_count; i++) {
-            qemu_set_irq(clk->user[i], 1);
+/* Sends a STM32_CLOCK_CHANGE event listing the changed clocks (see
+ * QMP/qmp-events.txt). */
+static void clktree_send_change_event(QList *changed)
+{
+    QDict *data = qdict_new();
+
+    qdict_put(data, "clocks", changed);
+    monitor_protocol_event(QEVENT_STM32_CLOCK_CHANGE, QOBJECT(data));
+    QDECREF(data);
+}
+
+/* Recalculates the dirty part of the tree in a single pass, and then
+ * notifies the users of every clock that changed.  Users therefore only
+ * see the final frequencies, once per update. */
+static void clktree_update(void)
+{
+    Clk clk;
+    QList *changed;
+    QDict *info;
+
+    if(!clktree_any_dirty) {
+        return;
+    }
+    clktree_any_dirty = false;
+
+    for(clk = clktree_first; clk != NULL; clk = clk->next) {
+        if(clk->dirty) {
+            clktree_recalc_output_freq(clk);
         }
+    }
 
-        /* Propagate the frequency change to the child clocks */
-        for(i=0; i < clk->output_count; i++) {
-            next_clk = clk->output[i];
-            assert(next_clk != NULL);
-
-            /* Only propagate the change if the child has selected the current
-             * clock as input.
-             */
-            next_clk_input = clktree_get_input_clk(next_clk);
-            if(next_clk_input == clk) {
-                /* Recursively propagate changes.  The clock tree should not be
-                 * too deep, so we shouldn't have to recurse too many times.
-                 */
-                clktree_set_input_freq(next_clk, new_output_freq);
-            }
+    changed = qlist_new();
+    for(clk = clktree_first; clk != NULL; clk = clk->next) {
+        if(clktree_notify_users(clk)) {
+            info = qdict_new();
+            qdict_put(info, "name", qstring_from_str(clk->name));
+            qdict_put(info, "output-freq", qint_from_int(clk->output_freq));
+            qdict_put(info, "enabled", qbool_from_int(clk->enabled));
+            qlist_append(changed, info);
         }
     }
+    if(qlist_empty(changed)) {
+        QDECREF(changed);
+    } else {
+        clktree_send_change_event(changed);
+    }
 }
 
 
+/* Only the settings of a clock are saved.  Its frequencies follow from them
+ * and from its inputs, which are loaded first (the clocks are registered in
+ * creation order), so they are recalculated as each clock is loaded. */
+static int clktree_post_load(void *opaque, int version_id)
+{
+    Clk clk = (Clk)opaque;
+
+    if((clk->selected_input + 1) >= clk->input_count) {
+        return -EINVAL;
+    }
+
+    clktree_begin_update();
+    clktree_mark_dirty(clk);
+    clktree_commit();
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_clktree_clk = {
+    .name = "clktree_clk",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = clktree_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_BOOL(enabled, struct Clk),
+        VMSTATE_UINT16(multiplier, struct Clk),
+        VMSTATE_UINT16(divisor, struct Clk),
+        VMSTATE_INT32(selected_input, struct Clk),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+
 /* Generic create routine used by the public create routines. */
 static Clk clktree_create_generic(
                     const char *name,
@@ -179,6 +302,21 @@ static Clk clktree_create_generic(
     clk->input[0] = NULL;
     clk->selected_input = CLKTREE_NO_INPUT;
 
+    clk->notified_freq = 0;
+    clk->notified_enabled = enabled;
+
+    clk->next = NULL;
+    if(clktree_last) {
+        clktree_last->next = clk;
+    } else {
+        clktree_first = clk;
+    }
+    clktree_last = clk;
+
+    vmstate_register(NULL, -1, &vmstate_clktree_clk, clk);
+
+    clktree_mark_dirty(clk);
+
     return clk;
 }
 
@@ -191,6 +329,20 @@ static Clk clktree_create_generic(
 
 
 /* PUBLIC FUNCTIONS */
+void clktree_begin_update(void)
+{
+    clktree_update_depth++;
+}
+
+void clktree_commit(void)
+{
+    assert(clktree_update_depth > 0);
+
+    if(--clktree_update_depth == 0) {
+        clktree_update();
+    }
+}
+
 bool clktree_is_enabled(Clk clk)
 {
     return clk->enabled;
@@ -219,8 +371,10 @@ Clk clktree_create_src_clk(
     Clk clk;
 
     clk = clktree_create_generic(name, 1, 1, enabled);
+    clk->input_freq = src_freq;
 
-    clktree_set_input_freq(clk, src_freq);
+    clktree_begin_update();
+    clktree_commit();
 
     return clk;
 }
@@ -239,6 +393,7 @@ Clk clktree_create_clk(
     Clk clk, input_clk;
 
     clk = clktree_create_generic(name, multiplier, divisor, enabled);
+    clk->max_output_freq = max_output_freq;
 
     /* Add the input clock connections. */
     va_start(input_clks, selected_input);
@@ -267,7 +422,9 @@ void clktree_set_scale(Clk clk, uint16_t multiplier, uint16_t divisor)
     clk->multiplier = multiplier;
     clk->divisor = divisor;
 
-    clktree_recalc_output_freq(clk);
+    clktree_begin_update();
+    clktree_mark_dirty(clk);
+    clktree_commit();
 }
 
 
@@ -275,25 +432,64 @@ void clktree_set_enabled(Clk clk, bool enabled)
 {
     clk->enabled = enabled;
 
-    clktree_recalc_output_freq(clk);
+    clktree_begin_update();
+    clktree_mark_dirty(clk);
+    clktree_commit();
 }
 
 
 void clktree_set_selected_input(Clk clk, int selected_input)
 {
-    uint32_t input_freq;
-
     assert((selected_input + 1) < clk->input_count);
 
     clk->selected_input = selected_input;
 
-    /* Get the input clock frequency.  If there is no input, this should be 0.
-     */
-    if(selected_input > -1) {
-        input_freq = clktree_get_input_clk(clk)->output_freq;
-    } else {
-        input_freq = 0;
+    clktree_begin_update();
+    clktree_mark_dirty(clk);
+    clktree_commit();
+}
+
+
+Stm32ClockInfoList *qmp_query_stm32_clocks(Error **errp)
+{
+    Stm32ClockInfoList *head = NULL, **tail = &head, *entry;
+    Stm32ClockInfo *info;
+    StringList **output_tail, *output;
+    Clk clk, input_clk;
+    int i;
+
+    for(clk = clktree_first; clk != NULL; clk = clk->next) {
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(clk->name);
+        input_clk = clktree_get_input_clk(clk);
+        if(input_clk) {
+            info->has_input = true;
+            info->input = g_strdup(input_clk->name);
+        }
+        info->input_freq = clk->input_freq;
+        info->output_freq = clk->output_freq;
+        info->multiplier = clk->multiplier;
+        info->divisor = clk->divisor;
+        info->enabled = clk->enabled;
+        if(clk->max_output_freq != CLKTREE_NO_MAX_FREQ) {
+            info->has_max_freq = true;
+            info->max_freq = clk->max_output_freq;
+        }
+        output_tail = &info->outputs;
+        for(i = 0; i < clk->output_count; i++) {
+            output = g_malloc0(sizeof(*output));
+            output->value = g_malloc0(sizeof(*output->value));
+            output->value->str = g_strdup(clk->output[i]->name);
+            *output_tail = output;
+            output_tail = &output->next;
+        }
+        info->users = clk->user_count;
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
     }
 
-    clktree_set_input_freq(clk, input_freq);
+    return head;
 }
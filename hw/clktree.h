@@ -36,6 +36,17 @@
 
 typedef struct Clk *Clk;
 
+/* Group several changes to the clock tree into one update.  Changes made
+ * between clktree_begin_update and the matching clktree_commit are only
+ * propagated when the outermost commit is reached: the tree is then
+ * recalculated once, and the users of each clock whose frequency or enabled
+ * state changed are notified once, with the final values.  Until then,
+ * clktree_get_output_freq returns the frequencies from before the update.
+ * Updates may be nested.  Each change made outside an update is committed
+ * immediately. */
+void clktree_begin_update(void);
+void clktree_commit(void);
+
 /* Check if the clock output is enabled. */
 bool clktree_is_enabled(Clk clk);
 
@@ -46,7 +57,8 @@ bool clktree_is_enabled(Clk clk);
  */
 uint32_t clktree_get_output_freq(Clk clk);
 
-/* Add an IRQ to receive notifications when the clock frequency is updated. */
+/* Add an IRQ to receive notifications when the clock frequency is updated or
+ * the clock is enabled or disabled. */
 void clktree_adduser(Clk clk, qemu_irq user);
 
 /* Create a source clock (e.g. oscillator) with the given frequency. */
@@ -0,0 +1,365 @@
+/*
+ * Co-simulation bridge
+ *
+ * A sysbus device whose MMIO region and interrupt lines are implemented
+ * by another process, e.g. a SystemC or Verilator model of a peripheral,
+ * talking to QEMU through rings in shared memory (see cosim.h).  Stores
+ * are posted: QEMU queues them and goes on, and the load that follows
+ * them waits for all of them and itself in one round trip.
+ *
+ * With addr set the device maps itself, so that it can be added with
+ * -device anywhere in the address space, e.g. in the peripheral space of
+ * an STM32:
+ *
+ *   -device cosim,path=/dev/shm/uart9,addr=0x40007c00,size=0x400,irq=82
+ *
+ * connects its first interrupt line to input 82 of the NVIC, and the
+ * following ones, num-irqs in all, to the inputs after it.
+ *
+ * QEMU waits for the peer, for at most timeout ms, at the first access
+ * or at the end of the first quantum, whichever comes first.  If the
+ * peer is not there by then, or stops answering, the region reads as
+ * zero from then on.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+#include <sched.h>
+
+#include "sysbus.h"
+#include "cosim.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+
+/* Polls for the peer before giving up the host CPU between polls.  */
+#define COSIM_SPIN              1000
+
+#define COSIM_DEFAULT_QUANTUM_NS    100000
+#define COSIM_DEFAULT_TIMEOUT_MS    5000
+
+#define COSIM_LOAD(field)       (*(volatile uint32_t *)&(field))
+#define COSIM_STORE(field, val) (*(volatile uint32_t *)&(field) = (val))
+
+typedef enum {
+    COSIM_WAITING,              /* For the peer to be ready */
+    COSIM_ONLINE,
+    COSIM_LOST,                 /* The peer stopped answering */
+} CosimLink;
+
+typedef struct CosimState {
+    SysBusDevice busdev;
+    MemoryRegion iomem;
+    char *path;
+    uint32_t size;
+    uint64_t addr;
+    int32_t nvic_irq;
+    uint32_t num_irqs;
+    uint32_t quantum_ns;
+    uint32_t timeout_ms;
+
+    CosimShared *shm;
+    CosimLink link;
+    uint32_t next_id;
+    uint32_t irq_level;
+    qemu_irq irq[COSIM_MAX_IRQS];
+    QEMUTimer *timer;
+} CosimState;
+
+static void cosim_lost(CosimState *s, const char *what)
+{
+    error_report("cosim: %s: %s, accesses to it are now ignored",
+                 s->path, what);
+    s->link = COSIM_LOST;
+}
+
+/* Waits until COND is true of S, for at most the timeout.  */
+static bool cosim_wait(CosimState *s, bool (*cond)(CosimState *s))
+{
+    int64_t deadline = 0;
+    int n = 0;
+
+    while (!cond(s)) {
+        if (++n < COSIM_SPIN) {
+            continue;
+        }
+        n = 0;
+        if (!deadline) {
+            deadline = get_clock() + s->timeout_ms * SCALE_MS;
+        } else if (get_clock() > deadline) {
+            return false;
+        }
+        sched_yield();
+    }
+    smp_rmb();
+    return true;
+}
+
+static bool cosim_peer_ready(CosimState *s)
+{
+    return COSIM_LOAD(s->shm->peer.ready) != 0;
+}
+
+static bool cosim_req_space(CosimState *s)
+{
+    return s->shm->qemu.req_head - COSIM_LOAD(s->shm->peer.req_tail) <
+           COSIM_RING_SIZE;
+}
+
+static bool cosim_resp_ready(CosimState *s)
+{
+    return COSIM_LOAD(s->shm->peer.resp_head) != s->shm->qemu.resp_tail;
+}
+
+static bool cosim_online(CosimState *s)
+{
+    if (s->link == COSIM_WAITING) {
+        if (!cosim_wait(s, cosim_peer_ready)) {
+            cosim_lost(s, "no peer");
+            return false;
+        }
+        s->link = COSIM_ONLINE;
+    }
+    return s->link == COSIM_ONLINE;
+}
+
+static void cosim_update_irqs(CosimState *s)
+{
+    uint32_t level = COSIM_LOAD(s->shm->peer.irq_level);
+    uint32_t changed = level ^ s->irq_level;
+    int i;
+
+    for (i = 0; i < s->num_irqs; i++) {
+        if (changed & (1u << i)) {
+            qemu_set_irq(s->irq[i], (level >> i) & 1);
+        }
+    }
+    s->irq_level = level;
+}
+
+/* Queues a request and returns its id.  */
+static uint32_t cosim_post(CosimState *s, uint32_t type, hwaddr addr,
+                           uint64_t data, unsigned size)
+{
+    CosimRequest *req;
+    uint32_t head = s->shm->qemu.req_head;
+
+    if (!cosim_req_space(s) && !cosim_wait(s, cosim_req_space)) {
+        cosim_lost(s, "request ring full");
+        return 0;
+    }
+    req = &s->shm->req[head % COSIM_RING_SIZE];
+    req->type = type;
+    req->id = s->next_id++;
+    req->addr = addr;
+    req->data = data;
+    req->time = qemu_get_clock_ns(vm_clock);
+    req->size = size;
+    smp_wmb();
+    COSIM_STORE(s->shm->qemu.req_head, head + 1);
+    return req->id;
+}
+
+/* Waits for the response to request ID.  */
+static bool cosim_response(CosimState *s, uint32_t id, uint64_t *data)
+{
+    CosimResponse resp;
+    uint32_t tail;
+
+    for (;;) {
+        if (!cosim_wait(s, cosim_resp_ready)) {
+            cosim_lost(s, "no response");
+            return false;
+        }
+        tail = s->shm->qemu.resp_tail;
+        resp = s->shm->resp[tail % COSIM_RING_SIZE];
+        /* The peer may reuse the entry as soon as it is released.  */
+        smp_mb();
+        COSIM_STORE(s->shm->qemu.resp_tail, tail + 1);
+        if (resp.id == id) {
+            if (data) {
+                *data = resp.data;
+            }
+            cosim_update_irqs(s);
+            return true;
+        }
+    }
+}
+
+static uint64_t cosim_read(void *opaque, hwaddr addr, unsigned size)
+{
+    CosimState *s = opaque;
+    uint64_t data = 0;
+    uint32_t id;
+
+    if (!cosim_online(s)) {
+        return 0;
+    }
+    id = cosim_post(s, COSIM_READ, addr, 0, size);
+    if (s->link != COSIM_ONLINE || !cosim_response(s, id, &data)) {
+        return 0;
+    }
+    return data;
+}
+
+static void cosim_write(void *opaque, hwaddr addr, uint64_t data,
+                        unsigned size)
+{
+    CosimState *s = opaque;
+
+    if (cosim_online(s)) {
+        cosim_post(s, COSIM_WRITE, addr, data, size);
+    }
+}
+
+static const MemoryRegionOps cosim_ops = {
+    .read = cosim_read,
+    .write = cosim_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+    },
+};
+
+/* The end of a quantum: wait for the peer to get there too.  */
+static void cosim_tick(void *opaque)
+{
+    CosimState *s = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint32_t id;
+
+    if (cosim_online(s)) {
+        id = cosim_post(s, COSIM_SYNC, 0, 0, 0);
+        if (s->link == COSIM_ONLINE) {
+            cosim_response(s, id, NULL);
+        }
+    }
+    if (s->link != COSIM_LOST) {
+        qemu_mod_timer(s->timer, now + s->quantum_ns);
+    }
+}
+
+static void cosim_reset(DeviceState *d)
+{
+    CosimState *s = FROM_SYSBUS(CosimState, SYS_BUS_DEVICE(d));
+
+    /* Before the peer is there, it has nothing to reset.  */
+    if (s->link == COSIM_ONLINE) {
+        cosim_post(s, COSIM_RESET, 0, 0, 0);
+    }
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock) + s->quantum_ns);
+}
+
+static int cosim_init(SysBusDevice *dev)
+{
+    CosimState *s = FROM_SYSBUS(CosimState, dev);
+    Object *nvic;
+    void *p;
+    int fd, i;
+
+    if (!s->path) {
+        error_report("cosim: path is required");
+        return -1;
+    }
+    if (s->num_irqs > COSIM_MAX_IRQS) {
+        error_report("cosim: num-irqs must be at most %d", COSIM_MAX_IRQS);
+        return -1;
+    }
+    if (!s->quantum_ns) {
+        error_report("cosim: quantum must be positive");
+        return -1;
+    }
+
+    fd = open(s->path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(CosimShared)) < 0) {
+        error_report("cosim: %s: %s", s->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    p = mmap(NULL, sizeof(CosimShared), PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        error_report("cosim: %s: %s", s->path, strerror(errno));
+        return -1;
+    }
+    s->shm = p;
+
+    /* Whatever an earlier run left there goes.  The peer may be waiting
+     * for the magic number already, so it comes last.  */
+    memset(s->shm, 0, sizeof(CosimShared));
+    s->shm->version = COSIM_VERSION;
+    s->shm->ring_size = COSIM_RING_SIZE;
+    s->shm->num_irqs = s->num_irqs;
+    smp_wmb();
+    s->shm->magic = COSIM_MAGIC;
+    s->link = COSIM_WAITING;
+
+    memory_region_init_io(&s->iomem, &cosim_ops, s, "cosim", s->size);
+    sysbus_init_mmio(dev, &s->iomem);
+    for (i = 0; i < s->num_irqs; i++) {
+        sysbus_init_irq(dev, &s->irq[i]);
+    }
+
+    if (s->addr != (uint64_t)-1) {
+        sysbus_mmio_map(dev, 0, s->addr);
+    }
+    if (s->nvic_irq >= 0) {
+        nvic = object_resolve_path_type("", "armv7m_nvic", NULL);
+        if (!nvic) {
+            error_report("cosim: irq needs an ARMv7-M NVIC");
+            return -1;
+        }
+        for (i = 0; i < s->num_irqs; i++) {
+            sysbus_connect_irq(dev, i,
+                               qdev_get_gpio_in(DEVICE(nvic),
+                                                s->nvic_irq + i));
+        }
+    }
+
+    s->timer = qemu_new_timer_ns(vm_clock, cosim_tick, s);
+    return 0;
+}
+
+static Property cosim_properties[] = {
+    DEFINE_PROP_STRING("path", CosimState, path),
+    DEFINE_PROP_UINT32("size", CosimState, size, 0x400),
+    DEFINE_PROP_UINT64("addr", CosimState, addr, (uint64_t)-1),
+    DEFINE_PROP_INT32("irq", CosimState, nvic_irq, -1),
+    DEFINE_PROP_UINT32("num-irqs", CosimState, num_irqs, 1),
+    DEFINE_PROP_UINT32("quantum", CosimState, quantum_ns,
+                       COSIM_DEFAULT_QUANTUM_NS),
+    DEFINE_PROP_UINT32("timeout", CosimState, timeout_ms,
+                       COSIM_DEFAULT_TIMEOUT_MS),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void cosim_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = cosim_init;
+    dc->reset = cosim_reset;
+    dc->props = cosim_properties;
+    dc->desc = "MMIO device implemented by another process";
+}
+
+static const TypeInfo cosim_info = {
+    .name          = "cosim",
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(CosimState),
+    .class_init    = cosim_class_init,
+};
+
+static void cosim_register_types(void)
+{
+    type_register_static(&cosim_info);
+}
+
+type_init(cosim_register_types)
@@ -0,0 +1,90 @@
+/*
+ * Co-simulation bridge, shared memory layout
+ *
+ * The cosim device forwards the MMIO accesses to its region to another
+ * process, typically a SystemC or Verilator model, through a file that
+ * both map.  This header describes that file and has no dependencies on
+ * the rest of QEMU, so that the other side can use it as is.
+ *
+ * The file holds a CosimShared structure.  QEMU creates it and fills in
+ * the header; the peer sets peer.ready once it serves requests.  Both
+ * rings are single producer, single consumer: the head is only written
+ * by the producer and the tail only by the consumer.  Indexes run freely
+ * and are taken modulo ring_size.  An entry is written before the index
+ * that publishes it, and read after the index that published it, with
+ * the memory barriers that implies.
+ *
+ * Requests are handled in order.  COSIM_WRITE needs no response: QEMU
+ * does not wait, so a run of stores costs no round trip.  COSIM_READ and
+ * COSIM_SYNC get a response with the same id and type; QEMU waits for it.
+ * The time of a request is the virtual time of the access, in
+ * nanoseconds.  COSIM_SYNC is sent once every quantum and only answered
+ * when the peer has caught up with its time, which keeps both sides
+ * within one quantum of each other.  COSIM_RESET is sent when the
+ * machine is reset.
+ *
+ * The peer drives the interrupt lines through peer.irq_level, one bit per
+ * line, which QEMU looks at after each response.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_COSIM_H
+#define HW_COSIM_H
+
+#include <stdint.h>
+
+#define COSIM_MAGIC         0x4d534f43  /* "COSM" */
+#define COSIM_VERSION       1
+#define COSIM_RING_SIZE     256
+#define COSIM_MAX_IRQS      32
+
+enum {
+    COSIM_WRITE = 1,
+    COSIM_READ = 2,
+    COSIM_SYNC = 3,
+    COSIM_RESET = 4,
+};
+
+typedef struct CosimRequest {
+    uint32_t type;
+    uint32_t id;
+    uint64_t addr;              /* Offset into the region */
+    uint64_t data;              /* COSIM_WRITE only */
+    uint64_t time;
+    uint32_t size;              /* Access size in bytes */
+    uint32_t reserved;
+} CosimRequest;
+
+typedef struct CosimResponse {
+    uint32_t type;
+    uint32_t id;
+    uint64_t data;              /* COSIM_READ only */
+} CosimResponse;
+
+typedef struct CosimShared {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t num_irqs;
+
+    /* Written by QEMU only */
+    struct {
+        uint32_t req_head;
+        uint32_t resp_tail;
+    } qemu __attribute__((aligned(64)));
+
+    /* Written by the peer only */
+    struct {
+        uint32_t req_tail;
+        uint32_t resp_head;
+        uint32_t irq_level;
+        uint32_t ready;
+    } peer __attribute__((aligned(64)));
+
+    CosimRequest req[COSIM_RING_SIZE] __attribute__((aligned(64)));
+    CosimResponse resp[COSIM_RING_SIZE];
+} CosimShared;
+
+#endif
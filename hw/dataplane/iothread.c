@@ -0,0 +1,114 @@
+/*
+ * Dedicated thread running an AioContext
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "hw/dataplane/iothread.h"
+
+struct IOThread {
+    AioContext *ctx;
+    QemuThread thread;
+    QEMUBH *start_bh;
+    bool running;
+    bool stopping;
+
+    /* Kicks aio_poll() out of select() when stopping.  It also makes
+     * aio_poll() block, whatever the handlers of the devices say.  */
+    EventNotifier stop_notifier;
+};
+
+static void iothread_stop_read(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+static int iothread_stop_flush(EventNotifier *e)
+{
+    return 1;
+}
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *t = opaque;
+
+    while (!t->stopping) {
+        aio_poll(t->ctx, true);
+    }
+    return NULL;
+}
+
+static void iothread_start_bh(void *opaque)
+{
+    IOThread *t = opaque;
+
+    qemu_bh_delete(t->start_bh);
+    t->start_bh = NULL;
+    qemu_thread_create(&t->thread, iothread_run, t, QEMU_THREAD_JOINABLE);
+}
+
+IOThread *iothread_new(void)
+{
+    IOThread *t = g_new0(IOThread, 1);
+
+    t->ctx = aio_context_new();
+    if (event_notifier_init(&t->stop_notifier, 0) < 0) {
+        fprintf(stderr, "failed to init iothread stop notifier\n");
+        exit(1);
+    }
+    aio_set_event_notifier(t->ctx, &t->stop_notifier, iothread_stop_read,
+                           iothread_stop_flush);
+    return t;
+}
+
+void iothread_free(IOThread *t)
+{
+    if (!t) {
+        return;
+    }
+
+    iothread_stop(t);
+    aio_set_event_notifier(t->ctx, &t->stop_notifier, NULL, NULL);
+    event_notifier_cleanup(&t->stop_notifier);
+    aio_context_unref(t->ctx);
+    g_free(t);
+}
+
+AioContext *iothread_get_aio_context(IOThread *t)
+{
+    return t->ctx;
+}
+
+void iothread_start(IOThread *t)
+{
+    if (t->running) {
+        return;
+    }
+    t->running = true;
+    t->stopping = false;
+    t->start_bh = qemu_bh_new(iothread_start_bh, t);
+    qemu_bh_schedule(t->start_bh);
+}
+
+void iothread_stop(IOThread *t)
+{
+    if (!t->running) {
+        return;
+    }
+
+    /* Stop thread or cancel pending thread creation BH */
+    if (t->start_bh) {
+        qemu_bh_delete(t->start_bh);
+        t->start_bh = NULL;
+    } else {
+        t->stopping = true;
+        event_notifier_set(&t->stop_notifier);
+        qemu_thread_join(&t->thread);
+    }
+    t->running = false;
+}
@@ -0,0 +1,34 @@
+/*
+ * Dedicated thread running an AioContext
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_IOTHREAD_H
+#define HW_DATAPLANE_IOTHREAD_H
+
+#include "block/aio.h"
+
+/* A thread that does nothing but aio_poll() its own AioContext.  Devices
+ * hook their host notifiers and completion notifiers into the context
+ * with aio_set_event_notifier(), so that their virtqueues are processed
+ * outside the global mutex.  Any number of devices may share one thread.
+ */
+typedef struct IOThread IOThread;
+
+IOThread *iothread_new(void);
+void iothread_free(IOThread *t);
+AioContext *iothread_get_aio_context(IOThread *t);
+
+/* The thread is created from a bottom half of the main loop, so it
+ * inherits the cpuset of the iothread rather than the vcpu's.  */
+void iothread_start(IOThread *t);
+
+/* Returns once the thread has exited.  Handlers stay registered, and the
+ * caller may then run aio_poll() on the context itself, for example to
+ * wait for requests still in flight.  */
+void iothread_stop(IOThread *t);
+
+#endif /* HW_DATAPLANE_IOTHREAD_H */
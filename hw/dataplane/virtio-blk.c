@@ -14,8 +14,9 @@
 
 #include "trace.h"
 #include "qemu/iov.h"
-#include "event-poll.h"
 #include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "iothread.h"
 #include "vring.h"
 #include "ioq.h"
 #include "migration/migration.h"
@@ -30,54 +31,93 @@ enum {
                                      * VRING_MAX with indirect descriptors */
 };
 
-typedef struct {
+typedef struct VirtIOBlockRequest VirtIOBlockRequest;
+typedef struct VirtIOBlockQueue VirtIOBlockQueue;
+
+struct VirtIOBlockRequest {
     struct iocb iocb;               /* Linux AIO control block */
     QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
     unsigned int head;              /* vring descriptor index */
     struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
     QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
-} VirtIOBlockRequest;
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool stopping;
-    QEMUBH *start_bh;
-    QemuThread thread;
+    /* The rest is only used for requests that go through the block layer */
+    VirtIOBlockQueue *q;
+    int type;                       /* VIRTIO_BLK_T_IN, _OUT or _FLUSH */
+    int64_t sector_num;
+    QEMUIOVector qiov;              /* guest buffers, kept until completion */
+    int ret;
+    QSIMPLEQ_ENTRY(VirtIOBlockRequest) next;
+};
 
-    VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+/*
+ * Requests are taken off the vring in the dataplane thread.  For raw
+ * files opened with aio=native they are then submitted with Linux AIO
+ * right there.  Any other drive is accessed through the block layer,
+ * which only runs in the main loop: requests are handed to it through
+ * submit_queue and come back through complete_queue, so the vring is
+ * still only touched by the dataplane thread.  That keeps image formats,
+ * block jobs and I/O throttling working.
+ *
+ * Every virtqueue of a multiqueue device has a dataplane thread of its
+ * own, with its own AioContext, interrupt and Linux AIO context, so the
+ * queues share nothing but the image.
+ */
+struct VirtIOBlockQueue {
+    VirtIOBlockDataPlane *s;
+    unsigned int index;             /* virtqueue number */
 
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
+    EventNotifier *host_notifier;   /* virtqueue notify */
 
-    EventPoll event_poll;           /* event poller */
-    EventHandler io_handler;        /* Linux AIO completion handler */
-    EventHandler notify_handler;    /* virtqueue notify handler */
+    IOThread *iothread;             /* runs ctx */
+    AioContext *ctx;
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       dataplane thread) */
+    IOQueue ioqueue;                /* Linux AIO queue */
     VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
                                              queue */
 
+    /* Block layer requests on their way to and from the main loop.  The
+     * queues are protected by lock.  */
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, VirtIOBlockRequest) submit_queue;
+    QSIMPLEQ_HEAD(, VirtIOBlockRequest) complete_queue;
+    EventNotifier submit_notifier;  /* set by the dataplane thread */
+    EventNotifier complete_notifier; /* set by the main loop */
+    bool submit_pending;            /* submit_notifier must be set */
+
     unsigned int num_reqs;
+};
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor, -1 to go
+                                       through the block layer */
+
+    VirtIODevice *vdev;
+    unsigned int num_queues;
+    VirtIOBlockQueue *queues;
 
     Error *migration_blocker;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockQueue *q = opaque;
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
     struct virtio_blk_inhdr hdr;
     int len;
@@ -90,7 +130,7 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
         len = 0;
     }
 
-    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+    trace_virtio_blk_data_plane_complete_request(q, req->head, ret);
 
     if (req->read_qiov) {
         assert(req->bounce_iov);
@@ -112,12 +152,12 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    vring_push(&q->vring, req->head, len + sizeof(hdr));
 
-    s->num_reqs--;
+    q->num_reqs--;
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+static void complete_request_early(VirtIOBlockQueue *q, unsigned int head,
                                    QEMUIOVector *inhdr, unsigned char status)
 {
     struct virtio_blk_inhdr hdr = {
@@ -128,33 +168,164 @@ static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
     qemu_iovec_destroy(inhdr);
     g_slice_free(QEMUIOVector, inhdr);
 
-    vring_push(&s->vring, head, sizeof(hdr));
-    notify_guest(s);
+    vring_push(&q->vring, head, sizeof(hdr));
+    notify_guest(q);
+}
+
+/* Runs in the main loop */
+static void complete_request_bdrv(void *opaque, int ret)
+{
+    VirtIOBlockRequest *req = opaque;
+    VirtIOBlockQueue *q = req->q;
+
+    req->ret = ret;
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INSERT_TAIL(&q->complete_queue, req, next);
+    qemu_mutex_unlock(&q->lock);
+    event_notifier_set(&q->complete_notifier);
+}
+
+/* Runs in the main loop */
+static void handle_submit(EventNotifier *e)
+{
+    VirtIOBlockQueue *q = container_of(e, VirtIOBlockQueue, submit_notifier);
+    BlockDriverState *bs = q->s->blk->conf.bs;
+    QSIMPLEQ_HEAD(, VirtIOBlockRequest) reqs;
+    VirtIOBlockRequest *req;
+    BlockDriverAIOCB *acb;
+
+    event_notifier_test_and_clear(e);
+
+    QSIMPLEQ_INIT(&reqs);
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_CONCAT(&reqs, &q->submit_queue);
+    qemu_mutex_unlock(&q->lock);
+
+    bdrv_io_plug(bs);
+    while ((req = QSIMPLEQ_FIRST(&reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+
+        switch (req->type) {
+        case VIRTIO_BLK_T_IN:
+            acb = bdrv_aio_readv(bs, req->sector_num, &req->qiov,
+                                 req->qiov.size / BDRV_SECTOR_SIZE,
+                                 complete_request_bdrv, req);
+            break;
+        case VIRTIO_BLK_T_OUT:
+            acb = bdrv_aio_writev(bs, req->sector_num, &req->qiov,
+                                  req->qiov.size / BDRV_SECTOR_SIZE,
+                                  complete_request_bdrv, req);
+            break;
+        default: /* VIRTIO_BLK_T_FLUSH */
+            acb = bdrv_aio_flush(bs, complete_request_bdrv, req);
+            break;
+        }
+        if (!acb) {
+            complete_request_bdrv(req, -EIO);
+        }
+    }
+    bdrv_io_unplug(bs);
+}
+
+static int submit_flush(EventNotifier *e)
+{
+    VirtIOBlockQueue *q = container_of(e, VirtIOBlockQueue, submit_notifier);
+    int busy;
+
+    qemu_mutex_lock(&q->lock);
+    busy = !QSIMPLEQ_EMPTY(&q->submit_queue);
+    qemu_mutex_unlock(&q->lock);
+    return busy;
+}
+
+static void queue_bdrv_request(VirtIOBlockQueue *q, int type,
+                               struct iovec *iov, unsigned int iov_cnt,
+                               int64_t sector_num, unsigned int head,
+                               QEMUIOVector *inhdr)
+{
+    VirtIOBlockRequest *req = g_slice_new0(VirtIOBlockRequest);
+
+    req->q = q;
+    req->type = type;
+    req->sector_num = sector_num;
+    req->head = head;
+    req->inhdr = inhdr;
+
+    /* The iovecs only live until process_vring() returns */
+    qemu_iovec_init(&req->qiov, iov_cnt);
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0,
+                          iov_size(iov, iov_cnt));
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INSERT_TAIL(&q->submit_queue, req, next);
+    qemu_mutex_unlock(&q->lock);
+
+    q->num_reqs++;
+    q->submit_pending = true;
+}
+
+static void finish_bdrv_request(VirtIOBlockQueue *q, VirtIOBlockRequest *req)
+{
+    struct virtio_blk_inhdr hdr;
+    int len = 0;
+
+    if (likely(req->ret == 0)) {
+        hdr.status = VIRTIO_BLK_S_OK;
+        len = req->qiov.size;
+    } else {
+        hdr.status = VIRTIO_BLK_S_IOERR;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(q, req->head, req->ret);
+
+    qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
+    qemu_iovec_destroy(req->inhdr);
+    g_slice_free(QEMUIOVector, req->inhdr);
+
+    /* Same length convention as complete_request() */
+    vring_push(&q->vring, req->head, len + sizeof(hdr));
+
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOBlockRequest, req);
+    q->num_reqs--;
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+static void do_get_id_cmd(VirtIOBlockQueue *q,
                           struct iovec *iov, unsigned int iov_cnt,
                           unsigned int head, QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->s;
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when shorter than buffer */
     strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+    complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+static int do_rdwr_cmd(VirtIOBlockQueue *q, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
                        long long offset, unsigned int head,
                        QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->s;
     struct iocb *iocb;
     QEMUIOVector qiov;
     struct iovec *bounce_iov = NULL;
     QEMUIOVector *read_qiov = NULL;
 
+    if (s->fd < 0) {
+        if (iov_size(iov, iov_cnt) % BDRV_SECTOR_SIZE) {
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
+            return 0;
+        }
+        queue_bdrv_request(q, read ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT,
+                           iov, iov_cnt, offset / BDRV_SECTOR_SIZE,
+                           head, inhdr);
+        return 0;
+    }
+
     qemu_iovec_init_external(&qiov, iov, iov_cnt);
     if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
         void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
@@ -176,7 +347,7 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
         iov_cnt = 1;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt, offset);
 
     /* Fill in virtio block metadata needed for completion */
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
@@ -191,7 +362,8 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
+    VirtIOBlockQueue *q = container_of(ioq, VirtIOBlockQueue, ioqueue);
+    VirtIOBlockDataPlane *s = q->s;
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -223,29 +395,33 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(q, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(q, false, iov, out_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_UNSUPP);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
+        if (s->fd < 0) {
+            queue_bdrv_request(q, VIRTIO_BLK_T_FLUSH, NULL, 0, 0, head, inhdr);
+            return 0;
+        }
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
         if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
         } else {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
         }
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, head, inhdr);
+        do_get_id_cmd(q, in_iov, in_num, head, inhdr);
         return 0;
 
     default:
@@ -256,11 +432,9 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
     }
 }
 
-static void handle_notify(EventHandler *handler)
+static void process_vring(VirtIOBlockQueue *q)
 {
-    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
-                                           notify_handler);
-
+    VirtIODevice *vdev = q->s->vdev;
     /* There is one array of iovecs into which all new requests are extracted
      * from the vring.  Requests are read from the vring and the translated
      * descriptors are written to the iovecs array.  The iovecs do not have to
@@ -288,19 +462,19 @@ static void handle_notify(EventHandler *handler)
 
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(vdev, &q->vring);
 
         for (;;) {
-            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            head = vring_pop(vdev, &q->vring, iov, end, &out_num, &in_num);
             if (head < 0) {
                 break; /* no more requests */
             }
 
-            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+            trace_virtio_blk_data_plane_process_request(q, out_num, in_num,
                                                         head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
-                vring_set_broken(&s->vring);
+            if (process_request(&q->ioqueue, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&q->vring);
                 break;
             }
             iov += out_num + in_num;
@@ -310,7 +484,7 @@ static void handle_notify(EventHandler *handler)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(vdev, &q->vring)) {
                 break;
             }
         } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -322,11 +496,19 @@ static void handle_notify(EventHandler *handler)
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
+    if (q->s->fd < 0) {
+        if (q->submit_pending) {
+            q->submit_pending = false;
+            event_notifier_set(&q->submit_notifier);
+        }
+        return;
+    }
+
+    num_queued = ioq_num_queued(&q->ioqueue);
     if (num_queued > 0) {
-        s->num_reqs += num_queued;
+        q->num_reqs += num_queued;
 
-        int rc = ioq_submit(&s->ioqueue);
+        int rc = ioq_submit(&q->ioqueue);
         if (unlikely(rc < 0)) {
             fprintf(stderr, "ioq_submit failed %d\n", rc);
             exit(1);
@@ -334,42 +516,70 @@ static void handle_notify(EventHandler *handler)
     }
 }
 
-static void handle_io(EventHandler *handler)
+static void handle_notify(void *opaque)
 {
-    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
-                                           io_handler);
+    VirtIOBlockQueue *q = opaque;
+
+    event_notifier_test_and_clear(q->host_notifier);
+    process_vring(q);
+}
 
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
+/* If there were more requests than iovecs, the vring will not be empty yet
+ * so check again.  There should now be enough resources to process more
+ * requests.
+ */
+static void process_more(VirtIOBlockQueue *q)
+{
+    if (unlikely(vring_more_avail(&q->vring)) && !q->s->stopping) {
+        process_vring(q);
     }
+}
 
-    /* If there were more requests than iovecs, the vring will not be empty yet
-     * so check again.  There should now be enough resources to process more
-     * requests.
-     */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->notify_handler);
+static void handle_io(void *opaque)
+{
+    VirtIOBlockQueue *q = opaque;
+
+    event_notifier_test_and_clear(ioq_get_notifier(&q->ioqueue));
+    if (ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+        notify_guest(q);
     }
+    process_more(q);
 }
 
-static void *data_plane_thread(void *opaque)
+static void handle_complete(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockQueue *q = opaque;
+    QSIMPLEQ_HEAD(, VirtIOBlockRequest) reqs;
+    VirtIOBlockRequest *req;
 
-    do {
-        event_poll(&s->event_poll);
-    } while (!s->stopping || s->num_reqs > 0);
-    return NULL;
+    event_notifier_test_and_clear(&q->complete_notifier);
+
+    QSIMPLEQ_INIT(&reqs);
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_CONCAT(&reqs, &q->complete_queue);
+    qemu_mutex_unlock(&q->lock);
+
+    if (QSIMPLEQ_EMPTY(&reqs)) {
+        return;
+    }
+    while ((req = QSIMPLEQ_FIRST(&reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        finish_bdrv_request(q, req);
+    }
+    notify_guest(q);
+    process_more(q);
 }
 
-static void start_data_plane_bh(void *opaque)
+static int flush_notify(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    return 1;
+}
+
+static int flush_reqs(void *opaque)
+{
+    VirtIOBlockQueue *q = opaque;
 
-    qemu_bh_delete(s->start_bh);
-    s->start_bh = NULL;
-    qemu_thread_create(&s->thread, data_plane_thread,
-                       s, QEMU_THREAD_JOINABLE);
+    return q->num_reqs > 0;
 }
 
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
@@ -377,6 +587,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
 {
     VirtIOBlockDataPlane *s;
     int fd;
+    int i;
 
     *dataplane = NULL;
 
@@ -389,26 +600,37 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return false;
     }
 
-    if (blk->config_wce) {
+    /* Without a file for Linux AIO, requests go through the block layer */
+    fd = raw_get_aio_fd(blk->conf.bs);
+
+    if (fd >= 0 && blk->config_wce) {
         error_report("device is incompatible with x-data-plane, "
                      "use config-wce=off");
         return false;
     }
 
-    fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
-        error_report("drive is incompatible with x-data-plane, "
-                     "use format=raw,cache=none,aio=native");
-        return false;
-    }
-
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->fd = fd;
     s->blk = blk;
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->index = i;
+        q->iothread = iothread_new();
+        q->ctx = iothread_get_aio_context(q->iothread);
+        qemu_mutex_init(&q->lock);
+        QSIMPLEQ_INIT(&q->submit_queue);
+        QSIMPLEQ_INIT(&q->complete_queue);
+    }
 
     /* Prevent block operations that conflict with data plane thread */
-    bdrv_set_in_use(blk->conf.bs, 1);
+    if (fd >= 0) {
+        bdrv_set_in_use(blk->conf.bs, 1);
+    }
 
     error_setg(&s->migration_blocker,
             "x-data-plane does not support migration");
@@ -420,6 +642,8 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
 
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    int i;
+
     if (!s) {
         return;
     }
@@ -427,91 +651,159 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     migrate_del_blocker(s->migration_blocker);
     error_free(s->migration_blocker);
-    bdrv_set_in_use(s->blk->conf.bs, 0);
+    if (s->fd >= 0) {
+        bdrv_set_in_use(s->blk->conf.bs, 0);
+    }
+    for (i = 0; i < s->num_queues; i++) {
+        iothread_free(s->queues[i].iothread);
+        qemu_mutex_destroy(&s->queues[i].lock);
+    }
+    g_free(s->queues);
     g_free(s);
 }
 
-void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+static bool start_queue(VirtIOBlockQueue *q)
 {
+    VirtIOBlockDataPlane *s = q->s;
     VirtQueue *vq;
     int i;
 
-    if (s->started) {
-        return;
+    vq = virtio_get_queue(s->vdev, q->index);
+    if (!vring_setup(&q->vring, s->vdev, q->index)) {
+        return false;
     }
+    q->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        return;
+    /* Set up virtqueue notify */
+    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
+                                            q->index, true) != 0) {
+        fprintf(stderr, "virtio-blk failed to set host notifier\n");
+        exit(1);
+    }
+    q->host_notifier = virtio_queue_get_host_notifier(vq);
+    aio_set_fd_handler(q->ctx, event_notifier_get_fd(q->host_notifier),
+                       handle_notify, NULL, flush_notify, q);
+
+    if (s->fd >= 0) {
+        /* Set up ioqueue */
+        ioq_init(&q->ioqueue, s->fd, REQ_MAX);
+        for (i = 0; i < ARRAY_SIZE(q->requests); i++) {
+            ioq_put_iocb(&q->ioqueue, &q->requests[i].iocb);
+        }
+        aio_set_fd_handler(q->ctx,
+                           event_notifier_get_fd(ioq_get_notifier(&q->ioqueue)),
+                           handle_io, NULL, flush_reqs, q);
+    } else {
+        /* Set up the hand-over to and from the main loop */
+        if (event_notifier_init(&q->submit_notifier, 0) < 0 ||
+            event_notifier_init(&q->complete_notifier, 0) < 0) {
+            fprintf(stderr, "virtio-blk failed to init dataplane "
+                    "notifiers\n");
+            exit(1);
+        }
+        qemu_aio_set_event_notifier(&q->submit_notifier, handle_submit,
+                                    submit_flush);
+        aio_set_fd_handler(q->ctx, event_notifier_get_fd(&q->complete_notifier),
+                           handle_complete, NULL, flush_reqs, q);
     }
+    return true;
+}
 
-    event_poll_init(&s->event_poll);
+/* Called once the dataplane thread of Q is gone, so this thread can run
+ * its AioContext to complete the requests in flight.  The vring is left
+ * alone.  */
+static void stop_queue(VirtIOBlockQueue *q)
+{
+    VirtIOBlockDataPlane *s = q->s;
 
-    /* Set up guest notifier (irq) */
-    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1,
-                                              true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set guest notifier, "
-                "ensure -enable-kvm is set\n");
-        exit(1);
+    aio_set_fd_handler(q->ctx, event_notifier_get_fd(q->host_notifier),
+                       NULL, NULL, NULL, NULL);
+    if (s->fd >= 0) {
+        while (q->num_reqs > 0) {
+            aio_poll(q->ctx, true);
+        }
+        aio_set_fd_handler(q->ctx,
+                           event_notifier_get_fd(ioq_get_notifier(&q->ioqueue)),
+                           NULL, NULL, NULL, NULL);
+        ioq_cleanup(&q->ioqueue);
+    } else {
+        while (q->num_reqs > 0) {
+            handle_submit(&q->submit_notifier);
+            bdrv_drain_all();
+            handle_complete(q);
+        }
+        qemu_aio_set_event_notifier(&q->submit_notifier, NULL, NULL);
+        aio_set_fd_handler(q->ctx, event_notifier_get_fd(&q->complete_notifier),
+                           NULL, NULL, NULL, NULL);
+        event_notifier_cleanup(&q->submit_notifier);
+        event_notifier_cleanup(&q->complete_notifier);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    /* Set up virtqueue notify */
-    if (s->vdev->binding->set_host_notifier(s->vdev->binding_opaque,
-                                            0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
+    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, q->index,
+                                        false);
+    vring_teardown(&q->vring);
+}
+
+void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    int i;
+
+    if (s->started) {
+        return;
+    }
+
+    /* Set up guest notifiers (irqs), one per queue */
+    if (s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                              s->num_queues, true) != 0) {
+        fprintf(stderr, "virtio-blk failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
         exit(1);
     }
-    event_poll_add(&s->event_poll, &s->notify_handler,
-                   virtio_queue_get_host_notifier(vq),
-                   handle_notify);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    for (i = 0; i < s->num_queues; i++) {
+        if (!start_queue(&s->queues[i])) {
+            while (--i >= 0) {
+                stop_queue(&s->queues[i]);
+            }
+            s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                                  s->num_queues, false);
+            return;
+        }
     }
-    event_poll_add(&s->event_poll, &s->io_handler,
-                   ioq_get_notifier(&s->ioqueue), handle_io);
 
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockQueue *q = &s->queues[i];
 
-    /* Spawn thread in BH so it inherits iothread cpusets */
-    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
-    qemu_bh_schedule(s->start_bh);
+        /* Kick right away to begin processing requests already in vring */
+        event_notifier_set(q->host_notifier);
+        iothread_start(q->iothread);
+    }
 }
 
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
+    int i;
+
     if (!s->started || s->stopping) {
         return;
     }
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
-    if (s->start_bh) {
-        qemu_bh_delete(s->start_bh);
-        s->start_bh = NULL;
-    } else {
-        event_poll_notify(&s->event_poll);
-        qemu_thread_join(&s->thread);
+    for (i = 0; i < s->num_queues; i++) {
+        iothread_stop(s->queues[i].iothread);
+    }
+    for (i = 0; i < s->num_queues; i++) {
+        stop_queue(&s->queues[i]);
     }
 
-    ioq_cleanup(&s->ioqueue);
-
-    s->vdev->binding->set_host_notifier(s->vdev->binding_opaque, 0, false);
-
-    event_poll_cleanup(&s->event_poll);
-
-    /* Clean up guest notifier (irq) */
-    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, 1, false);
+    /* Clean up guest notifiers (irqs) */
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                          s->num_queues, false);
 
-    vring_teardown(&s->vring);
     s->started = false;
     s->stopping = false;
 }
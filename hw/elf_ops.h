@@ -88,6 +88,22 @@ static const char *glue(lookup_symbol, SZ)(struct syminfo *s,
     return "";
 }
 
+static bool glue(lookup_addr, SZ)(struct syminfo *s, const char *name,
+                                  hwaddr *addr)
+{
+    struct elf_sym *syms = glue(s->disas_symtab.elf, SZ);
+    unsigned int i;
+
+    for (i = 0; i < s->disas_num_syms; i++) {
+        if (!strcmp(s->disas_strtab + syms[i].st_name, name)) {
+            *addr = syms[i].st_value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static int glue(symcmp, SZ)(const void *s0, const void *s1)
 {
     struct elf_sym *sym0 = (struct elf_sym *)s0;
@@ -173,6 +189,7 @@ static int glue(load_symbols, SZ)(struct elfhdr *ehdr, int fd, int must_swab,
     /* Commit */
     s = g_malloc0(sizeof(*s));
     s->lookup_symbol = glue(lookup_symbol, SZ);
+    s->lookup_addr = glue(lookup_addr, SZ);
     glue(s->disas_symtab.elf, SZ) = syms;
     s->disas_num_syms = nsyms;
     s->disas_strtab = str;
@@ -187,7 +204,7 @@ static int glue(load_symbols, SZ)(struct elfhdr *ehdr, int fd, int must_swab,
     return -1;
 }
 
-static int glue(load_elf, SZ)(const char *name, int fd,
+static int glue(load_elf, SZ)(const char *name, int fd, RomMapping *map,
                               uint64_t (*translate_fn)(void *, uint64_t),
                               void *translate_opaque,
                               int must_swab, uint64_t *pentry,
@@ -253,13 +270,20 @@ static int glue(load_elf, SZ)(const char *name, int fd,
         ph = &phdr[i];
         if (ph->p_type == PT_LOAD) {
             mem_size = ph->p_memsz;
-            /* XXX: avoid allocating */
-            data = g_malloc0(mem_size);
-            if (ph->p_filesz > 0) {
-                if (lseek(fd, ph->p_offset, SEEK_SET) < 0)
-                    goto fail;
-                if (read(fd, data, ph->p_filesz) != ph->p_filesz)
-                    goto fail;
+            /* Segments that are all file contents are used from the
+               mapping as they are, the rest are read to zeroed memory.  */
+            if (map && mem_size > 0 && ph->p_filesz == mem_size &&
+                ph->p_offset <= map->size &&
+                mem_size <= map->size - ph->p_offset) {
+                data = NULL;
+            } else {
+                data = g_malloc0(mem_size);
+                if (ph->p_filesz > 0) {
+                    if (lseek(fd, ph->p_offset, SEEK_SET) < 0)
+                        goto fail;
+                    if (read(fd, data, ph->p_filesz) != ph->p_filesz)
+                        goto fail;
+                }
             }
             /* address_offset is hack for kernel images that are
                linked at the wrong physical address.  */
@@ -281,7 +305,11 @@ static int glue(load_elf, SZ)(const char *name, int fd,
             }
 
             snprintf(label, sizeof(label), "phdr #%d: %s", i, name);
-            rom_add_blob_fixed(label, data, mem_size, addr);
+            if (data) {
+                rom_add_blob_fixed(label, data, mem_size, addr);
+            } else {
+                rom_add_mapped(label, map, ph->p_offset, mem_size, addr);
+            }
 
             total_size += mem_size;
             if (addr < low)
@@ -0,0 +1,235 @@
+/*
+ * GPIO indicator (LED) sink
+ *
+ * Follows a GPIO line driving an LED or a similar indicator without
+ * printing every change: firmware blinking an LED fast, or dimming it by
+ * PWM, changes it far more often than anyone can read.  The transitions
+ * go into a small ring (log-size entries, see query-gpio-indicators), and
+ * a GPIO_INDICATOR event with the state, the number of toggles and the
+ * duty cycle is sent at most once every period ms of virtual time while
+ * the line changes, plus once after it settles.  A line that does not
+ * change costs nothing.
+ *
+ * The period of all indicators can be set with e.g.
+ *
+ *   -global gpio-indicator.period=100
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "sysbus.h"
+#include "gpio_indicator.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qjson.h"
+#include "qemu/error-report.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+typedef struct GpioIndicator {
+    SysBusDevice busdev;
+    char *name;
+    uint32_t period_ms;
+    uint32_t log_size;
+
+    int level;
+    uint64_t toggles;
+
+    /* The current summary window: its start, the toggles in it and the
+     * time the line was high in it up to mark. */
+    int64_t window_start;
+    int64_t window_on_ns;
+    int64_t mark;
+    uint32_t window_toggles;
+    QEMUTimer *timer;
+
+    /* Latest transitions, each (time << 1) | level; log_count entries
+     * ending before log_head. */
+    int64_t *log;
+    uint32_t log_head, log_count;
+
+    QTAILQ_ENTRY(GpioIndicator) link;
+} GpioIndicator;
+
+static QTAILQ_HEAD(, GpioIndicator) gpio_indicators =
+    QTAILQ_HEAD_INITIALIZER(gpio_indicators);
+
+static void gpio_indicator_account(GpioIndicator *s, int64_t now)
+{
+    if (s->level) {
+        s->window_on_ns += now - s->mark;
+    }
+    s->mark = now;
+}
+
+static void gpio_indicator_send_summary(GpioIndicator *s, int64_t now)
+{
+    QObject *data;
+    int64_t window = now - s->window_start;
+
+    data = qobject_from_jsonf("{ 'name': %s, 'state': %i, 'toggles': %d, "
+                              "'duty-cycle': %f }",
+                              s->name, s->level, (int)s->window_toggles,
+                              window ? 100.0 * s->window_on_ns / window :
+                              100.0 * s->level);
+    monitor_protocol_event(QEVENT_GPIO_INDICATOR, data);
+    qobject_decref(data);
+}
+
+static void gpio_indicator_tick(void *opaque)
+{
+    GpioIndicator *s = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    bool idle = s->window_toggles == 0;
+
+    gpio_indicator_account(s, now);
+    gpio_indicator_send_summary(s, now);
+
+    /* That was the last report if the line no longer changes.  */
+    if (!idle) {
+        s->window_start = now;
+        s->window_on_ns = 0;
+        s->window_toggles = 0;
+        qemu_mod_timer(s->timer, now + s->period_ms * SCALE_MS);
+    }
+}
+
+static void gpio_indicator_set(void *opaque, int n, int level)
+{
+    GpioIndicator *s = opaque;
+    int64_t now;
+
+    level = level != 0;
+    if (level == s->level) {
+        return;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    trace_gpio_indicator_set(s->name, level);
+
+    if (!qemu_timer_pending(s->timer)) {
+        s->window_start = now;
+        s->window_on_ns = 0;
+        s->mark = now;
+        s->window_toggles = 0;
+        qemu_mod_timer(s->timer, now + s->period_ms * SCALE_MS);
+    }
+    gpio_indicator_account(s, now);
+    s->level = level;
+    s->toggles++;
+    s->window_toggles++;
+
+    if (s->log_size) {
+        s->log[s->log_head] = (now << 1) | level;
+        s->log_head = (s->log_head + 1) % s->log_size;
+        if (s->log_count < s->log_size) {
+            s->log_count++;
+        }
+    }
+}
+
+GpioIndicatorInfoList *qmp_query_gpio_indicators(Error **errp)
+{
+    GpioIndicatorInfoList *head = NULL, **tail = &head, *e;
+    GpioIndicatorTransitionList *t;
+    GpioIndicator *s;
+    uint32_t i;
+
+    QTAILQ_FOREACH(s, &gpio_indicators, link) {
+        e = g_new0(GpioIndicatorInfoList, 1);
+        e->value = g_new0(GpioIndicatorInfo, 1);
+        e->value->name = g_strdup(s->name);
+        e->value->state = s->level;
+        e->value->toggles = s->toggles;
+
+        /* Newest first, each prepended to the list.  */
+        for (i = 0; i < s->log_count; i++) {
+            int64_t entry = s->log[(s->log_head + s->log_size - s->log_count +
+                                    i) % s->log_size];
+
+            t = g_new0(GpioIndicatorTransitionList, 1);
+            t->value = g_new0(GpioIndicatorTransition, 1);
+            t->value->time = entry >> 1;
+            t->value->state = entry & 1;
+            t->next = e->value->transitions;
+            e->value->transitions = t;
+        }
+
+        *tail = e;
+        tail = &e->next;
+    }
+    return head;
+}
+
+static void gpio_indicator_reset(DeviceState *d)
+{
+    GpioIndicator *s = FROM_SYSBUS(GpioIndicator, SYS_BUS_DEVICE(d));
+
+    qemu_del_timer(s->timer);
+    s->level = 0;
+    s->toggles = 0;
+    s->window_toggles = 0;
+    s->log_head = 0;
+    s->log_count = 0;
+}
+
+static int gpio_indicator_init(SysBusDevice *dev)
+{
+    GpioIndicator *s = FROM_SYSBUS(GpioIndicator, dev);
+
+    if (!s->name) {
+        s->name = g_strdup("indicator");
+    }
+    if (!s->period_ms) {
+        error_report("gpio-indicator: period must be positive");
+        return -1;
+    }
+
+    qdev_init_gpio_in(&dev->qdev, gpio_indicator_set, 1);
+    s->timer = qemu_new_timer_ns(vm_clock, gpio_indicator_tick, s);
+    s->log = g_new0(int64_t, s->log_size);
+    QTAILQ_INSERT_TAIL(&gpio_indicators, s, link);
+    return 0;
+}
+
+DeviceState *gpio_indicator_create(const char *name)
+{
+    DeviceState *dev = qdev_create(NULL, "gpio-indicator");
+
+    qdev_prop_set_string(dev, "name", name);
+    qdev_init_nofail(dev);
+    return dev;
+}
+
+static Property gpio_indicator_properties[] = {
+    DEFINE_PROP_STRING("name", GpioIndicator, name),
+    DEFINE_PROP_UINT32("period", GpioIndicator, period_ms, 1000),
+    DEFINE_PROP_UINT32("log-size", GpioIndicator, log_size, 64),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void gpio_indicator_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = gpio_indicator_init;
+    dc->reset = gpio_indicator_reset;
+    dc->props = gpio_indicator_properties;
+    dc->desc = "LED or other indicator on a GPIO line";
+}
+
+static const TypeInfo gpio_indicator_info = {
+    .name          = "gpio-indicator",
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(GpioIndicator),
+    .class_init    = gpio_indicator_class_init,
+};
+
+static void gpio_indicator_register_types(void)
+{
+    type_register_static(&gpio_indicator_info);
+}
+
+type_init(gpio_indicator_register_types)
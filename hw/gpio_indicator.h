@@ -0,0 +1,17 @@
+/*
+ * GPIO indicator (LED) sink
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_GPIO_INDICATOR_H
+#define HW_GPIO_INDICATOR_H
+
+#include "qdev.h"
+
+/* Creates a "gpio-indicator" called NAME.  Its input line 0 is what the
+ * board connects the LED's GPIO pin to. */
+DeviceState *gpio_indicator_create(const char *name);
+
+#endif
@@ -0,0 +1,639 @@
+/*
+ * ILI9341 TFT LCD controller
+ *
+ * A 240x320 RGB565 panel driven through the 16-bit 8080 parallel interface,
+ * as found on the FSMC of STM32 boards.  The GRAM is kept in host memory and
+ * the rectangle the writes went to is remembered, so that the console only
+ * converts and redraws what changed since the last refresh.  Runs of pixel
+ * data (from a DMA controller) can be written at once through
+ * ili9341_burst_write.
+ *
+ * Only the 16 bits per pixel format (COLMOD 0x55) is emulated, and memory
+ * reads return pixels in that format rather than in the 18-bit one of the
+ * controller.  The panel is shown upright (240 wide); set
+ *
+ *   -global ili9341.landscape=on
+ *
+ * for a panel mounted on its side (320 wide), and bgr=on for a panel whose
+ * subpixels are in BGR order, which firmware then sets MADCTL BGR for.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "sysbus.h"
+#include "ili9341.h"
+#include "ui/console.h"
+#include "ui/pixel_ops.h"
+#include "qemu/log.h"
+#include "trace.h"
+
+#define ILI9341_WIDTH 240
+#define ILI9341_HEIGHT 320
+
+#define ILI9341_NOP         0x00
+#define ILI9341_SWRESET     0x01
+#define ILI9341_RDDPM       0x0a
+#define ILI9341_RDDMADCTL   0x0b
+#define ILI9341_RDDCOLMOD   0x0c
+#define ILI9341_SLPIN       0x10
+#define ILI9341_SLPOUT      0x11
+#define ILI9341_INVOFF      0x20
+#define ILI9341_INVON       0x21
+#define ILI9341_DISPOFF     0x28
+#define ILI9341_DISPON      0x29
+#define ILI9341_CASET       0x2a
+#define ILI9341_PASET       0x2b
+#define ILI9341_RAMWR       0x2c
+#define ILI9341_RAMRD       0x2e
+#define ILI9341_MADCTL      0x36
+#define ILI9341_COLMOD      0x3a
+#define ILI9341_RAMWRC      0x3c
+#define ILI9341_RAMRDC      0x3e
+#define ILI9341_RDID4       0xd3
+
+#define ILI9341_MADCTL_MY   0x80
+#define ILI9341_MADCTL_MX   0x40
+#define ILI9341_MADCTL_MV   0x20
+#define ILI9341_MADCTL_BGR  0x08
+
+#define ILI9341_COLMOD_16BPP 0x55
+#define ILI9341_COLMOD_RESET 0x66
+
+/* Property flags */
+#define ILI9341_LANDSCAPE   0
+#define ILI9341_BGR         1
+
+typedef struct Ili9341 {
+    SysBusDevice busdev;
+
+    /* Properties */
+    uint32_t rs_bit;
+    uint32_t flags;
+
+    MemoryRegion iomem;
+    DisplayState *ds;
+
+    /* The last command, and the number of parameters written or reads done
+     * since */
+    uint8_t cmd;
+    uint8_t count;
+    uint8_t params[4];
+
+    uint8_t madctl;
+    uint8_t colmod;
+    bool sleeping;
+    bool display_on;
+    bool inverted;
+
+    /* The column and page address windows, and the address counter in
+     * them */
+    uint16_t sc, ec, sp, ep;
+    uint16_t x, y;
+
+    /* Indexed by panel row and column, whatever MADCTL says */
+    uint16_t gram[ILI9341_HEIGHT * ILI9341_WIDTH];
+
+    /* The panel rectangle written since the last refresh, empty if
+     * dirty_col0 > dirty_col1 */
+    int32_t dirty_col0, dirty_col1, dirty_row0, dirty_row1;
+    bool invalidate;
+} Ili9341;
+
+static void ili9341_clear_dirty(Ili9341 *s)
+{
+    s->dirty_col0 = ILI9341_WIDTH;
+    s->dirty_col1 = -1;
+    s->dirty_row0 = ILI9341_HEIGHT;
+    s->dirty_row1 = -1;
+}
+
+static void ili9341_mark_dirty(Ili9341 *s, int col0, int col1,
+                               int row0, int row1)
+{
+    s->dirty_col0 = MIN(s->dirty_col0, col0);
+    s->dirty_col1 = MAX(s->dirty_col1, col1);
+    s->dirty_row0 = MIN(s->dirty_row0, row0);
+    s->dirty_row1 = MAX(s->dirty_row1, row1);
+}
+
+/* The panel column and row the address counter points to, which are out
+ * of the panel if the window is. */
+static int ili9341_col(Ili9341 *s)
+{
+    int col = (s->madctl & ILI9341_MADCTL_MV) ? s->y : s->x;
+
+    return (s->madctl & ILI9341_MADCTL_MX) ? ILI9341_WIDTH - 1 - col : col;
+}
+
+static int ili9341_row(Ili9341 *s)
+{
+    int row = (s->madctl & ILI9341_MADCTL_MV) ? s->x : s->y;
+
+    return (s->madctl & ILI9341_MADCTL_MY) ? ILI9341_HEIGHT - 1 - row : row;
+}
+
+static bool ili9341_in_panel(int col, int row)
+{
+    return col >= 0 && col < ILI9341_WIDTH && row >= 0 && row < ILI9341_HEIGHT;
+}
+
+/* Moves the address counter n columns on, which must not go further than
+ * one past the end of the window, going to the next page when it does. */
+static void ili9341_advance(Ili9341 *s, int n)
+{
+    s->x += n;
+    if (s->x > s->ec || s->x < s->sc) {
+        s->x = s->sc;
+        s->y = (s->y >= s->ep || s->y < s->sp) ? s->sp : s->y + 1;
+    }
+}
+
+/* Writes count pixels, little endian halfwords at buf, from the address
+ * counter on.  The pixels of a window column run are stored in one go. */
+static void ili9341_write_pixels(Ili9341 *s, const uint8_t *buf,
+                                 uint32_t count)
+{
+    int col, row, col_step, row_step, n, i;
+    int col0, col1, row0, row1;
+
+    if (s->madctl & ILI9341_MADCTL_MV) {
+        col_step = 0;
+        row_step = (s->madctl & ILI9341_MADCTL_MY) ? -1 : 1;
+    } else {
+        col_step = (s->madctl & ILI9341_MADCTL_MX) ? -1 : 1;
+        row_step = 0;
+    }
+
+    while (count) {
+        n = s->x <= s->ec ? MIN(count, s->ec - s->x + 1) : 1;
+        col = ili9341_col(s);
+        row = ili9341_row(s);
+
+        col0 = MAX(MIN(col, col + col_step * (n - 1)), 0);
+        col1 = MIN(MAX(col, col + col_step * (n - 1)), ILI9341_WIDTH - 1);
+        row0 = MAX(MIN(row, row + row_step * (n - 1)), 0);
+        row1 = MIN(MAX(row, row + row_step * (n - 1)), ILI9341_HEIGHT - 1);
+        if (col0 <= col1 && row0 <= row1) {
+            for (i = 0; i < n; i++) {
+                if (ili9341_in_panel(col, row)) {
+                    s->gram[row * ILI9341_WIDTH + col] = lduw_le_p(buf);
+                }
+                buf += 2;
+                col += col_step;
+                row += row_step;
+            }
+            ili9341_mark_dirty(s, col0, col1, row0, row1);
+        } else {
+            buf += 2 * n;
+        }
+
+        count -= n;
+        ili9341_advance(s, n);
+    }
+}
+
+static uint16_t ili9341_read_pixel(Ili9341 *s)
+{
+    int col = ili9341_col(s), row = ili9341_row(s);
+    uint16_t value = 0;
+
+    if (ili9341_in_panel(col, row)) {
+        value = s->gram[row * ILI9341_WIDTH + col];
+    }
+    ili9341_advance(s, 1);
+    return value;
+}
+
+static void ili9341_reset_state(Ili9341 *s)
+{
+    s->cmd = ILI9341_NOP;
+    s->count = 0;
+    s->madctl = 0;
+    s->colmod = ILI9341_COLMOD_RESET;
+    s->sleeping = true;
+    s->display_on = false;
+    s->inverted = false;
+    s->sc = 0;
+    s->ec = ILI9341_WIDTH - 1;
+    s->sp = 0;
+    s->ep = ILI9341_HEIGHT - 1;
+    s->x = 0;
+    s->y = 0;
+    s->invalidate = true;
+}
+
+static void ili9341_write_command(Ili9341 *s, uint8_t cmd)
+{
+    trace_ili9341_command(s, cmd);
+
+    s->cmd = cmd;
+    s->count = 0;
+
+    switch (cmd) {
+    case ILI9341_SWRESET:
+        ili9341_reset_state(s);
+        break;
+    case ILI9341_SLPIN:
+    case ILI9341_SLPOUT:
+        s->sleeping = cmd == ILI9341_SLPIN;
+        s->invalidate = true;
+        break;
+    case ILI9341_INVOFF:
+    case ILI9341_INVON:
+        s->inverted = cmd == ILI9341_INVON;
+        s->invalidate = true;
+        break;
+    case ILI9341_DISPOFF:
+    case ILI9341_DISPON:
+        s->display_on = cmd == ILI9341_DISPON;
+        s->invalidate = true;
+        break;
+    case ILI9341_RAMWR:
+    case ILI9341_RAMRD:
+        s->x = s->sc;
+        s->y = s->sp;
+        break;
+    default:
+        break;
+    }
+}
+
+static void ili9341_write_param(Ili9341 *s, uint8_t value)
+{
+    switch (s->cmd) {
+    case ILI9341_CASET:
+    case ILI9341_PASET:
+        if (s->count < 4) {
+            s->params[s->count++] = value;
+        }
+        if (s->count == 4) {
+            if (s->cmd == ILI9341_CASET) {
+                s->sc = (s->params[0] << 8) | s->params[1];
+                s->ec = (s->params[2] << 8) | s->params[3];
+            } else {
+                s->sp = (s->params[0] << 8) | s->params[1];
+                s->ep = (s->params[2] << 8) | s->params[3];
+            }
+        }
+        break;
+    case ILI9341_MADCTL:
+        s->madctl = value;
+        s->invalidate = true;
+        break;
+    case ILI9341_COLMOD:
+        s->colmod = value;
+        if ((value & 0x07) != (ILI9341_COLMOD_16BPP & 0x07)) {
+            qemu_log_mask(LOG_UNIMP, "ili9341: pixel format 0x%02x is not "
+                          "emulated, 16 bits per pixel are used\n", value);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Takes count values at buf written to the data register, each one size
+ * bytes (up to 2) wide. */
+static void ili9341_write_data(Ili9341 *s, const uint8_t *buf,
+                               uint32_t count, unsigned size)
+{
+    if (s->cmd == ILI9341_RAMWR || s->cmd == ILI9341_RAMWRC) {
+        if (size == 2) {
+            ili9341_write_pixels(s, buf, count);
+            return;
+        }
+        /* A pixel per byte fills in the low bits only */
+        while (count--) {
+            uint8_t pixel[2] = { *buf++, 0 };
+            ili9341_write_pixels(s, pixel, 1);
+        }
+        return;
+    }
+
+    while (count--) {
+        ili9341_write_param(s, *buf);
+        buf += size;
+    }
+}
+
+static uint16_t ili9341_read_data(Ili9341 *s)
+{
+    static const uint8_t id4[] = { 0x00, 0x93, 0x41 };
+    uint8_t n;
+
+    /* The first read after a read command is a dummy one. */
+    n = s->count;
+    if (n < 0xff) {
+        s->count++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    switch (s->cmd) {
+    case ILI9341_RDDPM:
+        return n == 1 ? 0x80 | (s->sleeping ? 0 : 0x10) |
+                                (s->display_on ? 0x04 : 0) : 0;
+    case ILI9341_RDDMADCTL:
+        return n == 1 ? s->madctl : 0;
+    case ILI9341_RDDCOLMOD:
+        return n == 1 ? s->colmod : 0;
+    case ILI9341_RDID4:
+        return n <= ARRAY_SIZE(id4) ? id4[n - 1] : 0;
+    case ILI9341_RAMRD:
+    case ILI9341_RAMRDC:
+        return ili9341_read_pixel(s);
+    default:
+        return 0;
+    }
+}
+
+static bool ili9341_is_data(Ili9341 *s, hwaddr offset)
+{
+    return (offset >> s->rs_bit) & 1;
+}
+
+static uint64_t ili9341_read(void *opaque, hwaddr offset, unsigned size)
+{
+    Ili9341 *s = (Ili9341 *)opaque;
+    uint64_t value;
+
+    if (!ili9341_is_data(s, offset)) {
+        return 0;
+    }
+    /* A word access is two halfword accesses on the 16-bit bus */
+    value = ili9341_read_data(s);
+    if (size == 4) {
+        value |= (uint64_t)ili9341_read_data(s) << 16;
+    }
+    return value;
+}
+
+static void ili9341_write(void *opaque, hwaddr offset, uint64_t value,
+                          unsigned size)
+{
+    Ili9341 *s = (Ili9341 *)opaque;
+    uint8_t buf[4];
+
+    stl_le_p(buf, value);
+    ili9341_burst_write(s, offset, buf, size, size);
+}
+
+static const MemoryRegionOps ili9341_ops = {
+    .read = ili9341_read,
+    .write = ili9341_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    }
+};
+
+void ili9341_burst_write(void *opaque, hwaddr offset, const uint8_t *buf,
+                         uint32_t len, unsigned size)
+{
+    Ili9341 *s = (Ili9341 *)opaque;
+    uint32_t i;
+
+    /* Anything wider than the bus is split into halfwords, low first. */
+    if (size > 2) {
+        size = 2;
+    }
+
+    if (ili9341_is_data(s, offset)) {
+        ili9341_write_data(s, buf, len / size, size);
+        return;
+    }
+    for (i = 0; i + size <= len; i += size) {
+        ili9341_write_command(s, buf[i]);
+    }
+}
+
+/* Converts count RGB565 pixels, step apart at src, to the console's
+ * format. */
+static void ili9341_draw_line(int bpp, uint8_t *d, const uint16_t *src,
+                              int count, int step, uint16_t invert,
+                              bool swap)
+{
+    unsigned int r, g, b, t, color;
+    uint16_t v;
+    int i;
+
+    if (bpp == 16 && step == 1 && !invert && !swap) {
+        memcpy(d, src, count * 2);
+        return;
+    }
+
+    for (i = 0; i < count; i++, src += step) {
+        v = *src ^ invert;
+        r = (v >> 8) & 0xf8;
+        g = (v >> 3) & 0xfc;
+        b = (v << 3) & 0xf8;
+        if (swap) {
+            t = r;
+            r = b;
+            b = t;
+        }
+        switch (bpp) {
+        case 8:
+            *d++ = rgb_to_pixel8(r, g, b);
+            break;
+        case 15:
+            *(uint16_t *)d = rgb_to_pixel15(r, g, b);
+            d += 2;
+            break;
+        case 16:
+            *(uint16_t *)d = rgb_to_pixel16(r, g, b);
+            d += 2;
+            break;
+        case 24:
+            color = rgb_to_pixel24(r, g, b);
+            d[0] = color;
+            d[1] = color >> 8;
+            d[2] = color >> 16;
+            d += 3;
+            break;
+        case 32:
+            *(uint32_t *)d = rgb_to_pixel32(r, g, b);
+            d += 4;
+            break;
+        }
+    }
+}
+
+static void ili9341_update_display(void *opaque)
+{
+    Ili9341 *s = (Ili9341 *)opaque;
+    int bpp = ds_get_bits_per_pixel(s->ds);
+    int dest_width = (bpp + 7) / 8;
+    int linesize = ds_get_linesize(s->ds);
+    int x0, x1, y0, y1, x, y, step;
+    const uint16_t *src;
+    uint8_t *dest;
+    uint16_t invert;
+    bool swap;
+
+    if (bpp == 0) {
+        return;
+    }
+    if (s->invalidate) {
+        ili9341_mark_dirty(s, 0, ILI9341_WIDTH - 1, 0, ILI9341_HEIGHT - 1);
+        s->invalidate = false;
+    }
+    if (s->dirty_col0 > s->dirty_col1) {
+        return;
+    }
+
+    /* On its side, the first console line is the last panel column. */
+    if (s->flags & (1 << ILI9341_LANDSCAPE)) {
+        x0 = s->dirty_row0;
+        x1 = s->dirty_row1;
+        y0 = ILI9341_WIDTH - 1 - s->dirty_col1;
+        y1 = ILI9341_WIDTH - 1 - s->dirty_col0;
+        step = ILI9341_WIDTH;
+    } else {
+        x0 = s->dirty_col0;
+        x1 = s->dirty_col1;
+        y0 = s->dirty_row0;
+        y1 = s->dirty_row1;
+        step = 1;
+    }
+    ili9341_clear_dirty(s);
+
+    invert = s->inverted ? 0xffff : 0;
+    swap = (!!(s->madctl & ILI9341_MADCTL_BGR) !=
+            !!(s->flags & (1 << ILI9341_BGR))) !=
+           !!is_surface_bgr(s->ds->surface);
+
+    for (y = y0; y <= y1; y++) {
+        dest = ds_get_data(s->ds) + y * linesize + x0 * dest_width;
+        if (s->sleeping || !s->display_on) {
+            memset(dest, 0, (x1 - x0 + 1) * dest_width);
+            continue;
+        }
+        if (step != 1) {
+            src = &s->gram[x0 * ILI9341_WIDTH + ILI9341_WIDTH - 1 - y];
+        } else {
+            src = &s->gram[y * ILI9341_WIDTH + x0];
+        }
+        x = x1 - x0 + 1;
+        ili9341_draw_line(bpp, dest, src, x, step, invert, swap);
+    }
+
+    dpy_gfx_update(s->ds, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+static void ili9341_invalidate_display(void *opaque)
+{
+    Ili9341 *s = (Ili9341 *)opaque;
+
+    s->invalidate = true;
+}
+
+static void ili9341_reset(DeviceState *dev)
+{
+    Ili9341 *s = FROM_SYSBUS(Ili9341, SYS_BUS_DEVICE(dev));
+
+    ili9341_reset_state(s);
+}
+
+static int ili9341_init(SysBusDevice *dev)
+{
+    Ili9341 *s = FROM_SYSBUS(Ili9341, dev);
+
+    if (s->rs_bit >= 32) {
+        hw_error("ili9341: rs_bit must be less than 32");
+    }
+
+    memory_region_init_io(&s->iomem, &ili9341_ops, s, "ili9341",
+                          2ULL << s->rs_bit);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    s->ds = graphic_console_init(ili9341_update_display,
+                                 ili9341_invalidate_display,
+                                 NULL, NULL, s);
+    if (s->flags & (1 << ILI9341_LANDSCAPE)) {
+        qemu_console_resize(s->ds, ILI9341_HEIGHT, ILI9341_WIDTH);
+    } else {
+        qemu_console_resize(s->ds, ILI9341_WIDTH, ILI9341_HEIGHT);
+    }
+    ili9341_clear_dirty(s);
+
+    return 0;
+}
+
+static int ili9341_post_load(void *opaque, int version_id)
+{
+    Ili9341 *s = (Ili9341 *)opaque;
+
+    s->invalidate = true;
+    return 0;
+}
+
+static const VMStateDescription vmstate_ili9341 = {
+    .name = "ili9341",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = ili9341_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT8(cmd, Ili9341),
+        VMSTATE_UINT8(count, Ili9341),
+        VMSTATE_UINT8_ARRAY(params, Ili9341, 4),
+        VMSTATE_UINT8(madctl, Ili9341),
+        VMSTATE_UINT8(colmod, Ili9341),
+        VMSTATE_BOOL(sleeping, Ili9341),
+        VMSTATE_BOOL(display_on, Ili9341),
+        VMSTATE_BOOL(inverted, Ili9341),
+        VMSTATE_UINT16(sc, Ili9341),
+        VMSTATE_UINT16(ec, Ili9341),
+        VMSTATE_UINT16(sp, Ili9341),
+        VMSTATE_UINT16(ep, Ili9341),
+        VMSTATE_UINT16(x, Ili9341),
+        VMSTATE_UINT16(y, Ili9341),
+        VMSTATE_UINT16_ARRAY(gram, Ili9341, ILI9341_HEIGHT * ILI9341_WIDTH),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property ili9341_properties[] = {
+    DEFINE_PROP_UINT32("rs_bit", Ili9341, rs_bit, 17),
+    DEFINE_PROP_BIT("landscape", Ili9341, flags, ILI9341_LANDSCAPE, false),
+    DEFINE_PROP_BIT("bgr", Ili9341, flags, ILI9341_BGR, false),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void ili9341_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = ili9341_init;
+    dc->reset = ili9341_reset;
+    dc->props = ili9341_properties;
+    dc->vmsd = &vmstate_ili9341;
+}
+
+static TypeInfo ili9341_info = {
+    .name  = "ili9341",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Ili9341),
+    .class_init = ili9341_class_init
+};
+
+static void ili9341_register_types(void)
+{
+    type_register_static(&ili9341_info);
+}
+
+type_init(ili9341_register_types)
+
+DeviceState *ili9341_create(unsigned rs_bit)
+{
+    DeviceState *dev = qdev_create(NULL, "ili9341");
+
+    qdev_prop_set_uint32(dev, "rs_bit", rs_bit);
+    qdev_init_nofail(dev);
+    return dev;
+}
@@ -0,0 +1,24 @@
+/*
+ * ILI9341 TFT LCD controller
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ILI9341_H
+#define HW_ILI9341_H
+
+#include "qdev.h"
+
+/* Creates an "ili9341" on a 16-bit parallel bus whose data/command select
+ * (D/CX) is wired to bit rs_bit of the byte address: its MMIO region 0 is
+ * 2 << rs_bit bytes, the command register below 1 << rs_bit and the data
+ * register above. */
+DeviceState *ili9341_create(unsigned rs_bit);
+
+/* Takes the len bytes at buf, written size bytes at a time to offset of the
+ * MMIO region, in one go (see Stm32FsmcBurstFn).  opaque is the device. */
+void ili9341_burst_write(void *opaque, hwaddr offset, const uint8_t *buf,
+                         uint32_t len, unsigned size);
+
+#endif
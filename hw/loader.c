@@ -53,6 +53,9 @@
 #include "exec/address-spaces.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static int roms_loaded;
 
@@ -249,6 +252,54 @@ static void *load_at(int fd, int offset, int size)
     return ptr;
 }
 
+/* A copy-on-write mapping of an image file, shared by the ROMs that point
+ * into it.  The pages are only read from the file when the ROMs are
+ * copied into guest memory, and are shared with the page cache until
+ * someone writes to them.  */
+typedef struct RomMapping {
+    void *base;
+    size_t size;
+    int refcount;
+} RomMapping;
+
+static RomMapping *rom_map_file(int fd)
+{
+#ifndef _WIN32
+    RomMapping *map;
+    off_t size;
+    void *base;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        return NULL;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    map = g_malloc0(sizeof(*map));
+    map->base = base;
+    map->size = size;
+    map->refcount = 1;
+    return map;
+#else
+    return NULL;
+#endif
+}
+
+static void rom_mapping_unref(RomMapping *map)
+{
+#ifndef _WIN32
+    if (map && --map->refcount == 0) {
+        munmap(map->base, map->size);
+        g_free(map);
+    }
+#endif
+}
+
+static int rom_add_mapped(const char *name, RomMapping *map,
+                          size_t offset, size_t len, hwaddr addr);
+
 #ifdef ELF_CLASS
 #undef ELF_CLASS
 #endif
@@ -289,6 +340,7 @@ int load_elf(const char *filename, uint64_t (*translate_fn)(void *, uint64_t),
 {
     int fd, data_order, target_data_order, must_swab, ret;
     uint8_t e_ident[EI_NIDENT];
+    RomMapping *map;
 
     fd = open(filename, O_RDONLY | O_BINARY);
     if (fd < 0) {
@@ -318,15 +370,21 @@ int load_elf(const char *filename, uint64_t (*translate_fn)(void *, uint64_t),
         goto fail;
     }
 
+    /* Without a mapping the segments are read into memory instead.  */
+    map = rom_map_file(fd);
+
     lseek(fd, 0, SEEK_SET);
     if (e_ident[EI_CLASS] == ELFCLASS64) {
-        ret = load_elf64(filename, fd, translate_fn, translate_opaque, must_swab,
-                         pentry, lowaddr, highaddr, elf_machine, clear_lsb);
+        ret = load_elf64(filename, fd, map, translate_fn, translate_opaque,
+                         must_swab, pentry, lowaddr, highaddr, elf_machine,
+                         clear_lsb);
     } else {
-        ret = load_elf32(filename, fd, translate_fn, translate_opaque, must_swab,
-                         pentry, lowaddr, highaddr, elf_machine, clear_lsb);
+        ret = load_elf32(filename, fd, map, translate_fn, translate_opaque,
+                         must_swab, pentry, lowaddr, highaddr, elf_machine,
+                         clear_lsb);
     }
 
+    rom_mapping_unref(map);
     close(fd);
     return ret;
 
@@ -538,6 +596,8 @@ struct Rom {
     int isrom;
     char *fw_dir;
     char *fw_file;
+    /* Set if data points into a file mapping rather than the heap.  */
+    RomMapping *map;
 
     hwaddr addr;
     QTAILQ_ENTRY(Rom) next;
@@ -647,6 +707,24 @@ int rom_add_blob(const char *name, const void *blob, size_t len,
     return 0;
 }
 
+/* Like rom_add_blob, but the contents come straight from LEN bytes at
+ * OFFSET in MAP and are not copied.  */
+static int rom_add_mapped(const char *name, RomMapping *map,
+                          size_t offset, size_t len, hwaddr addr)
+{
+    Rom *rom;
+
+    rom = g_malloc0(sizeof(*rom));
+    rom->name    = g_strdup(name);
+    rom->addr    = addr;
+    rom->romsize = len;
+    rom->map     = map;
+    rom->data    = (uint8_t *)map->base + offset;
+    map->refcount++;
+    rom_insert(rom);
+    return 0;
+}
+
 int rom_add_vga(const char *file)
 {
     return rom_add_file(file, "vgaroms", 0, -1);
@@ -657,6 +735,22 @@ int rom_add_option(const char *file, int32_t bootindex)
     return rom_add_file(file, "genroms", 0, bootindex);
 }
 
+/* Whether guest memory still holds the contents of ROM, in which case
+ * writing them again would only throw away the code translated from it.  */
+static bool rom_unchanged(Rom *rom)
+{
+    MemoryRegionSection section;
+    uint8_t *host;
+
+    section = memory_region_find(get_system_memory(), rom->addr, rom->romsize);
+    if (section.size != rom->romsize || !memory_region_is_ram(section.mr)) {
+        return false;
+    }
+    host = memory_region_get_ram_ptr(section.mr) +
+           section.offset_within_region;
+    return memcmp(host, rom->data, rom->romsize) == 0;
+}
+
 static void rom_reset(void *unused)
 {
     Rom *rom;
@@ -668,10 +762,18 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
+        if (!rom->isrom && rom_unchanged(rom)) {
+            continue;
+        }
         cpu_physical_memory_write_rom(rom->addr, rom->data, rom->romsize);
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
+            if (rom->map) {
+                rom_mapping_unref(rom->map);
+                rom->map = NULL;
+            } else {
+                g_free(rom->data);
+            }
             rom->data = NULL;
         }
     }
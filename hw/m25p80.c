@@ -567,6 +567,30 @@ static uint32_t m25p80_transfer8(SSISlave *ss, uint32_t tx)
     return r;
 }
 
+/* Reads are copied straight out of the storage; everything else goes
+ * through the byte at a time state machine. */
+static void m25p80_transfer_bulk(SSISlave *ss, const uint8_t *tx, uint8_t *rx,
+                                 uint32_t len)
+{
+    Flash *s = FROM_SSI_SLAVE(Flash, ss);
+    uint32_t chunk;
+
+    while (len) {
+        if (s->state != STATE_READ) {
+            *rx++ = m25p80_transfer8(ss, *tx++);
+            len--;
+            continue;
+        }
+        chunk = MIN(len, s->size - s->cur_addr);
+        DB_PRINT("READ 0x%lx+%x\n", s->cur_addr, chunk);
+        memcpy(rx, s->storage + s->cur_addr, chunk);
+        s->cur_addr = (s->cur_addr + chunk) % s->size;
+        rx += chunk;
+        tx += chunk;
+        len -= chunk;
+    }
+}
+
 static int m25p80_init(SSISlave *ss)
 {
     DriveInfo *dinfo;
@@ -647,6 +671,7 @@ static void m25p80_class_init(ObjectClass *klass, void *data)
 
     k->init = m25p80_init;
     k->transfer = m25p80_transfer8;
+    k->transfer_bulk = m25p80_transfer_bulk;
     k->set_cs = m25p80_cs;
     k->cs_polarity = SSI_CS_LOW;
     dc->props = m25p80_properties;
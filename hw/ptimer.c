@@ -19,6 +19,11 @@ struct ptimer_state
     int64_t period;
     int64_t last_event;
     int64_t next_event;
+    /* Periodic expirations do not trigger, so they do not arm the timer
+       either; the count is computed when it is read.  */
+    uint8_t lazy;
+    /* An expiration passed while lazy.  */
+    uint8_t expired;
     QEMUBH *bh;
     QEMUTimer *timer;
 };
@@ -48,7 +53,49 @@ static void ptimer_reload(ptimer_state *s)
     if (s->period_frac) {
         s->next_event += ((int64_t)s->period_frac * s->delta) >> 32;
     }
-    qemu_mod_timer(s->timer, s->next_event);
+    if (s->lazy && s->enabled == 1) {
+        qemu_del_timer(s->timer);
+    } else {
+        qemu_mod_timer(s->timer, s->next_event);
+    }
+}
+
+/* Move a lazy periodic timer along by the periods that have passed
+   since its last expiration, without triggering.  */
+static void ptimer_catch_up(ptimer_state *s, int64_t now)
+{
+    int64_t period_ns;
+    int64_t n;
+
+    if (!s->lazy || s->enabled != 1 || now < s->next_event) {
+        return;
+    }
+
+    period_ns = s->limit * s->period;
+    if (s->period_frac) {
+        period_ns += ((int64_t)s->period_frac * s->limit) >> 32;
+    }
+    if (period_ns <= 0) {
+        return;
+    }
+
+    n = (now - s->next_event) / period_ns;
+    s->last_event = s->next_event + n * period_ns;
+    s->next_event = s->last_event + period_ns;
+    s->delta = s->limit;
+    s->expired = 1;
+}
+
+/* Artificially limit timeout rate to something achievable under QEMU.
+   Otherwise, QEMU spends all its time generating timer interrupts, and
+   there is no forward progress.  About ten microseconds is the fastest
+   that really works on the current generation of host machines.  */
+static uint64_t ptimer_clamp_limit(ptimer_state *s, uint64_t limit)
+{
+    if (limit * s->period < 10000 && s->period) {
+        limit = 10000 / s->period;
+    }
+    return limit;
 }
 
 static void ptimer_tick(void *opaque)
@@ -70,6 +117,7 @@ uint64_t ptimer_get_count(ptimer_state *s)
 
     if (s->enabled) {
         now = qemu_get_clock_ns(vm_clock);
+        ptimer_catch_up(s, now);
         /* Figure out the current counter value.  */
         if (now - s->next_event > 0
             || s->period == 0) {
@@ -180,17 +228,10 @@ void ptimer_set_freq(ptimer_state *s, uint32_t freq)
    count = limit.  */
 void ptimer_set_limit(ptimer_state *s, uint64_t limit, int reload)
 {
-    /*
-     * Artificially limit timeout rate to something
-     * achievable under QEMU.  Otherwise, QEMU spends all
-     * its time generating timer interrupts, and there
-     * is no forward progress.
-     * About ten microseconds is the fastest that really works
-     * on the current generation of host machines.
-     */
-
-    if (limit * s->period < 10000 && s->period) {
-        limit = 10000 / s->period;
+    /* Expirations that do not trigger cannot flood QEMU, so a lazy
+       timer keeps the limit it is given.  */
+    if (!s->lazy) {
+        limit = ptimer_clamp_limit(s, limit);
     }
 
     s->limit = limit;
@@ -202,6 +243,61 @@ void ptimer_set_limit(ptimer_state *s, uint64_t limit, int reload)
     }
 }
 
+/* Choose whether periodic expirations trigger.  While they do not, a
+   periodic timer costs nothing until it is read, which suits free running
+   counters whose interrupt is masked.  One-shot expirations always
+   trigger.  */
+void ptimer_set_trigger(ptimer_state *s, int enabled)
+{
+    if (s->lazy == !enabled) {
+        return;
+    }
+
+    ptimer_catch_up(s, qemu_get_clock_ns(vm_clock));
+    s->lazy = !enabled;
+    if (!s->lazy) {
+        s->limit = ptimer_clamp_limit(s, s->limit);
+    }
+    if (s->enabled == 1) {
+        if (s->lazy) {
+            qemu_del_timer(s->timer);
+        } else {
+            qemu_mod_timer(s->timer, s->next_event);
+        }
+    }
+}
+
+/* Return whether a periodic expiration has passed without triggering
+   since the last call.  */
+int ptimer_take_expired(ptimer_state *s)
+{
+    int expired;
+
+    ptimer_catch_up(s, qemu_get_clock_ns(vm_clock));
+    expired = s->expired;
+    s->expired = 0;
+    return expired;
+}
+
+static bool ptimer_lazy_needed(void *opaque)
+{
+    ptimer_state *s = opaque;
+
+    return s->lazy || s->expired;
+}
+
+static const VMStateDescription vmstate_ptimer_lazy = {
+    .name = "ptimer/lazy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT8(lazy, ptimer_state),
+        VMSTATE_UINT8(expired, ptimer_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 const VMStateDescription vmstate_ptimer = {
     .name = "ptimer",
     .version_id = 1,
@@ -217,6 +313,14 @@ const VMStateDescription vmstate_ptimer = {
         VMSTATE_INT64(next_event, ptimer_state),
         VMSTATE_TIMER(timer, ptimer_state),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_ptimer_lazy,
+            .needed = ptimer_lazy_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
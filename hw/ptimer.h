@@ -24,6 +24,8 @@ uint64_t ptimer_get_count(ptimer_state *s);
 void ptimer_set_count(ptimer_state *s, uint64_t count);
 void ptimer_run(ptimer_state *s, int oneshot);
 void ptimer_stop(ptimer_state *s);
+void ptimer_set_trigger(ptimer_state *s, int enabled);
+int ptimer_take_expired(ptimer_state *s);
 
 extern const VMStateDescription vmstate_ptimer;
 
@@ -1762,3 +1762,93 @@ void sd_enable(SDState *sd, bool enable)
 {
     sd->enable = enable;
 }
+
+/* Block transfers for hosts which move the data of block read and write
+ * commands to and from the card's drive themselves, rather than a byte at
+ * a time through sd_read_data and sd_write_data.  */
+uint32_t sd_block_transfer_begin(SDState *sd, uint32_t max_blocks,
+                                 uint64_t *addr, uint32_t *blk_len,
+                                 bool *write)
+{
+    uint32_t io_len, blocks;
+
+    if (!sd->bdrv || !bdrv_is_inserted(sd->bdrv) || !sd->enable)
+        return 0;
+
+    if (sd->card_status & (ADDRESS_ERROR | WP_VIOLATION))
+        return 0;
+
+    /* Only whole blocks can be handed out.  */
+    if (sd->data_offset != 0)
+        return 0;
+
+    switch (sd->current_cmd) {
+    case 17:	/* CMD17:  READ_SINGLE_BLOCK */
+    case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
+        if (sd->state != sd_sendingdata_state)
+            return 0;
+        io_len = (sd->ocr & (1 << 30)) ? 512 : sd->blk_len;
+        *write = false;
+        break;
+
+    case 24:	/* CMD24:  WRITE_SINGLE_BLOCK */
+    case 25:	/* CMD25:  WRITE_MULTIPLE_BLOCK */
+        if (sd->state != sd_receivingdata_state)
+            return 0;
+        io_len = sd->blk_len;
+        *write = true;
+        break;
+
+    default:
+        return 0;
+    }
+
+    if (sd->current_cmd == 17 || sd->current_cmd == 24)
+        max_blocks = MIN(max_blocks, 1);
+
+    for (blocks = 0; blocks < max_blocks; blocks++) {
+        uint64_t start = sd->data_start + (uint64_t)blocks * io_len;
+
+        if (start + io_len > sd->size)
+            break;
+        if (*write && sd_wp_addr(sd, start))
+            break;
+    }
+
+    *addr = sd->data_start;
+    *blk_len = io_len;
+    return blocks;
+}
+
+void sd_block_transfer_done(SDState *sd, uint32_t blocks)
+{
+    uint32_t io_len;
+
+    if (blocks == 0)
+        return;
+
+    switch (sd->current_cmd) {
+    case 17:	/* CMD17:  READ_SINGLE_BLOCK */
+        sd->state = sd_transfer_state;
+        break;
+
+    case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
+        io_len = (sd->ocr & (1 << 30)) ? 512 : sd->blk_len;
+        sd->data_start += (uint64_t)blocks * io_len;
+        if (sd->data_start + io_len > sd->size)
+            sd->card_status |= ADDRESS_ERROR;
+        break;
+
+    case 24:	/* CMD24:  WRITE_SINGLE_BLOCK */
+        sd->blk_written++;
+        sd->csd[14] |= 0x40;
+        sd->state = sd_transfer_state;
+        break;
+
+    case 25:	/* CMD25:  WRITE_MULTIPLE_BLOCK */
+        sd->blk_written += blocks;
+        sd->data_start += (uint64_t)blocks * sd->blk_len;
+        sd->csd[14] |= 0x40;
+        break;
+    }
+}
@@ -77,4 +77,15 @@ void sd_set_cb(SDState *sd, qemu_irq readonly, qemu_irq insert);
 bool sd_data_ready(SDState *sd);
 void sd_enable(SDState *sd, bool enable);
 
+/* A host which moves block data itself calls sd_block_transfer_begin once
+ * a block read or write command has been accepted.  It returns how many of
+ * the next max_blocks blocks (0 if none) may be read from or written to
+ * the card's drive directly, starting at byte offset addr, whether the
+ * data goes to the card and the block length.  The host then transfers
+ * them and reports how many it did with sd_block_transfer_done.  */
+uint32_t sd_block_transfer_begin(SDState *sd, uint32_t max_blocks,
+                                 uint64_t *addr, uint32_t *blk_len,
+                                 bool *write);
+void sd_block_transfer_done(SDState *sd, uint32_t blocks);
+
 #endif	/* __hw_sd_h */
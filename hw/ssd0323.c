@@ -56,7 +56,6 @@ typedef struct {
     int col;
     int col_start;
     int col_end;
-    int redraw;
     int remap;
     enum ssd0323_mode mode;
     uint8_t framebuffer[128 * 80 / 2];
@@ -70,6 +69,11 @@ static uint32_t ssd0323_transfer(SSISlave *dev, uint32_t data)
     case SSD0323_DATA:
         DPRINTF("data 0x%02x\n", data);
         s->framebuffer[s->col + s->row * 64] = data;
+        /* Each byte is two pixels; rows from 64 on are not shown.  */
+        if (s->row < 64) {
+            dpy_gfx_damage(s->ds, s->col * 2 * MAGNIFY, s->row * MAGNIFY,
+                           2 * MAGNIFY, MAGNIFY);
+        }
         if (s->remap & REMAP_VERTICAL) {
             s->row++;
             if (s->row > s->row_end) {
@@ -89,7 +93,6 @@ static uint32_t ssd0323_transfer(SSISlave *dev, uint32_t data)
                 s->row = s->row_start;
             }
         }
-        s->redraw = 1;
         break;
     case SSD0323_CMD:
         DPRINTF("cmd 0x%02x\n", data);
@@ -185,8 +188,10 @@ static void ssd0323_update_display(void *opaque)
     char colortab[MAGNIFY * 64];
     char *p;
     int dest_width;
+    int dx, dy, dw, dh;
+    int y0, y1;
 
-    if (!s->redraw)
+    if (!dpy_gfx_take_damage(s->ds, &dx, &dy, &dw, &dh))
         return;
 
     switch (ds_get_bits_per_pixel(s->ds)) {
@@ -234,9 +239,12 @@ static void ssd0323_update_display(void *opaque)
         }
         p += dest_width;
     }
+    /* Redraw the damaged rows only.  */
+    y0 = dy / MAGNIFY;
+    y1 = MIN((dy + dh - 1) / MAGNIFY, 63);
     /* TODO: Implement row/column remapping.  */
-    dest = ds_get_data(s->ds);
-    for (y = 0; y < 64; y++) {
+    dest = ds_get_data(s->ds) + y0 * MAGNIFY * dest_width * 128 * MAGNIFY;
+    for (y = y0; y <= y1; y++) {
         line = y;
         src = s->framebuffer + 64 * line;
         for (x = 0; x < 64; x++) {
@@ -259,14 +267,14 @@ static void ssd0323_update_display(void *opaque)
             dest += dest_width * 128 * MAGNIFY;
         }
     }
-    s->redraw = 0;
-    dpy_gfx_update(s->ds, 0, 0, 128 * MAGNIFY, 64 * MAGNIFY);
+    dpy_gfx_update(s->ds, 0, y0 * MAGNIFY, 128 * MAGNIFY,
+                   (y1 - y0 + 1) * MAGNIFY);
 }
 
 static void ssd0323_invalidate_display(void * opaque)
 {
     ssd0323_state *s = (ssd0323_state *)opaque;
-    s->redraw = 1;
+    dpy_gfx_damage(s->ds, 0, 0, 128 * MAGNIFY, 64 * MAGNIFY);
 }
 
 /* Command/data input.  */
@@ -293,7 +301,8 @@ static void ssd0323_save(QEMUFile *f, void *opaque)
     qemu_put_be32(f, s->col);
     qemu_put_be32(f, s->col_start);
     qemu_put_be32(f, s->col_end);
-    qemu_put_be32(f, s->redraw);
+    /* Was the redraw flag: the display is always redrawn after a load */
+    qemu_put_be32(f, 1);
     qemu_put_be32(f, s->remap);
     qemu_put_be32(f, s->mode);
     qemu_put_buffer(f, s->framebuffer, sizeof(s->framebuffer));
@@ -320,13 +329,14 @@ static int ssd0323_load(QEMUFile *f, void *opaque, int version_id)
     s->col = qemu_get_be32(f);
     s->col_start = qemu_get_be32(f);
     s->col_end = qemu_get_be32(f);
-    s->redraw = qemu_get_be32(f);
+    qemu_get_be32(f);
     s->remap = qemu_get_be32(f);
     s->mode = qemu_get_be32(f);
     qemu_get_buffer(f, s->framebuffer, sizeof(s->framebuffer));
 
     ss->cs = qemu_get_be32(f);
 
+    ssd0323_invalidate_display(s);
     return 0;
 }
 
@@ -340,6 +350,7 @@ static int ssd0323_init(SSISlave *dev)
                                  ssd0323_invalidate_display,
                                  NULL, NULL, s);
     qemu_console_resize(s->ds, 128 * MAGNIFY, 64 * MAGNIFY);
+    ssd0323_invalidate_display(s);
 
     qdev_init_gpio_in(&dev->qdev, ssd0323_cd, 1);
 
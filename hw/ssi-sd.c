@@ -195,6 +195,27 @@ static uint32_t ssi_sd_transfer(SSISlave *dev, uint32_t val)
     return 0xff;
 }
 
+/* Data blocks are read without going through the command state machine
+ * for every byte. */
+static void ssi_sd_transfer_bulk(SSISlave *dev, const uint8_t *tx,
+                                 uint8_t *rx, uint32_t len)
+{
+    ssi_sd_state *s = FROM_SSI_SLAVE(ssi_sd_state, dev);
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        if (s->mode == SSI_SD_DATA_READ && tx[i] != 0x4d) {
+            rx[i] = sd_read_data(s->sd);
+            if (!sd_data_ready(s->sd)) {
+                DPRINTF("Data read end\n");
+                s->mode = SSI_SD_CMD;
+            }
+        } else {
+            rx[i] = ssi_sd_transfer(dev, tx[i]);
+        }
+    }
+}
+
 static void ssi_sd_save(QEMUFile *f, void *opaque)
 {
     SSISlave *ss = SSI_SLAVE(opaque);
@@ -256,6 +277,7 @@ static void ssi_sd_class_init(ObjectClass *klass, void *data)
 
     k->init = ssi_sd_init;
     k->transfer = ssi_sd_transfer;
+    k->transfer_bulk = ssi_sd_transfer_bulk;
     k->cs_polarity = SSI_CS_LOW;
 }
 
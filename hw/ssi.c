@@ -41,13 +41,20 @@ static void ssi_cs_default(void *opaque, int n, int level)
     s->cs = cs;
 }
 
+static bool ssi_slave_selected(SSISlave *dev)
+{
+    SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
+
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSISlave *dev, uint32_t val)
 {
     SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-            (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-            ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_slave_selected(dev)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -121,6 +128,41 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       uint32_t len)
+{
+    BusChild *kid;
+    SSISlaveClass *ssc;
+    uint8_t *buf = NULL;
+    uint32_t i;
+
+    memset(rx, 0, len);
+
+    QTAILQ_FOREACH(kid, &bus->qbus.children, sibling) {
+        SSISlave *slave = SSI_SLAVE(kid->child);
+        ssc = SSI_SLAVE_GET_CLASS(slave);
+        if (ssc->transfer_raw == ssi_transfer_raw_default &&
+                ssc->transfer_bulk) {
+            if (!ssi_slave_selected(slave)) {
+                continue;
+            }
+            if (!buf) {
+                buf = g_malloc(len);
+            }
+            ssc->transfer_bulk(slave, tx, buf, len);
+            for (i = 0; i < len; i++) {
+                rx[i] |= buf[i];
+            }
+        } else {
+            for (i = 0; i < len; i++) {
+                rx[i] |= ssc->transfer_raw(slave, tx[i]);
+            }
+        }
+    }
+
+    g_free(buf);
+}
+
 const VMStateDescription vmstate_ssi_slave = {
     .name = "SSISlave",
     .version_id = 1,
@@ -53,6 +53,14 @@ typedef struct SSISlaveClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSISlave *dev, uint32_t val);
+
+    /* Optional.  Exchanges a run of len 8-bit frames in one call, rx[i]
+     * being the reply to tx[i].  Only used with the default transfer_raw,
+     * and only while the device cs is active.  Devices without it are sent
+     * the frames one at a time.
+     */
+    void (*transfer_bulk)(SSISlave *dev, const uint8_t *tx, uint8_t *rx,
+                          uint32_t len);
 } SSISlaveClass;
 
 struct SSISlave {
@@ -83,6 +91,10 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/* Transfers len 8-bit frames, as a series of ssi_transfer calls would.  */
+void ssi_transfer_bulk(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                       uint32_t len);
+
 /* Automatically connect all children nodes a spi controller as slaves */
 void ssi_auto_connect_slaves(DeviceState *parent, qemu_irq *cs_lines,
                              SSIBus *bus);
@@ -42,6 +42,10 @@ do { fprintf(stderr, "stellaris_enet: error: " fmt , ## __VA_ARGS__);} while (0)
 #define SE_TCTL_CRC     0x04
 #define SE_TCTL_DUPLEX  0x08
 
+/* Frames are sent from a bottom half, so that the frames software writes
+   in one go are passed on together, outside of the MMIO handler.  */
+#define SE_TX_QUEUE_LEN 4
+
 typedef struct {
     SysBusDevice busdev;
     uint32_t ris;
@@ -66,6 +70,12 @@ typedef struct {
     uint8_t *rx_fifo;
     int rx_fifo_len;
     int next_packet;
+    struct {
+        uint8_t data[2048];
+        int len;
+    } tx_queue[SE_TX_QUEUE_LEN];
+    int tx_queue_len;
+    QEMUBH *tx_bh;
     NICState *nic;
     NICConf conf;
     qemu_irq irq;
@@ -77,6 +87,29 @@ static void stellaris_enet_update(stellaris_enet_state *s)
     qemu_set_irq(s->irq, (s->ris & s->im) != 0);
 }
 
+static void stellaris_enet_flush_tx(void *opaque)
+{
+    stellaris_enet_state *s = (stellaris_enet_state *)opaque;
+    int i;
+
+    for (i = 0; i < s->tx_queue_len; i++) {
+        qemu_send_packet(qemu_get_queue(s->nic), s->tx_queue[i].data,
+                         s->tx_queue[i].len);
+    }
+    s->tx_queue_len = 0;
+}
+
+static void stellaris_enet_queue_tx(stellaris_enet_state *s)
+{
+    if (s->tx_queue_len == SE_TX_QUEUE_LEN) {
+        stellaris_enet_flush_tx(s);
+    }
+    memcpy(s->tx_queue[s->tx_queue_len].data, s->tx_fifo, s->tx_frame_len);
+    s->tx_queue[s->tx_queue_len].len = s->tx_frame_len;
+    s->tx_queue_len++;
+    qemu_bh_schedule(s->tx_bh);
+}
+
 /* TODO: Implement MAC address filtering.  */
 static ssize_t stellaris_enet_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
@@ -156,8 +189,7 @@ static uint64_t stellaris_enet_read(void *opaque, hwaddr offset,
             s->rx_fifo = s->rx[s->next_packet].data;
             DPRINTF("RX FIFO start packet len=%d\n", s->rx_fifo_len);
         }
-        val = s->rx_fifo[0] | (s->rx_fifo[1] << 8) | (s->rx_fifo[2] << 16)
-              | (s->rx_fifo[3] << 24);
+        val = ldl_le_p(s->rx_fifo);
         s->rx_fifo += 4;
         s->rx_fifo_len -= 4;
         if (s->rx_fifo_len <= 0) {
@@ -167,6 +199,10 @@ static uint64_t stellaris_enet_read(void *opaque, hwaddr offset,
                 s->next_packet = 0;
             s->np--;
             DPRINTF("RX done np=%d\n", s->np);
+            /* Packets refused while the fifo was full can come in now.  */
+            if (s->np == 30) {
+                qemu_flush_queued_packets(qemu_get_queue(s->nic));
+            }
         }
         return val;
     case 0x14: /* IA0 */
@@ -247,10 +283,8 @@ static void stellaris_enet_write(void *opaque, hwaddr offset,
                 s->tx_fifo[s->tx_fifo_len++] = value >> 24;
             }
         } else {
-            s->tx_fifo[s->tx_fifo_len++] = value;
-            s->tx_fifo[s->tx_fifo_len++] = value >> 8;
-            s->tx_fifo[s->tx_fifo_len++] = value >> 16;
-            s->tx_fifo[s->tx_fifo_len++] = value >> 24;
+            stl_le_p(&s->tx_fifo[s->tx_fifo_len], value);
+            s->tx_fifo_len += 4;
             if (s->tx_fifo_len >= s->tx_frame_len) {
                 /* We don't implement explicit CRC, so just chop it off.  */
                 if ((s->tctl & SE_TCTL_CRC) == 0)
@@ -259,8 +293,7 @@ static void stellaris_enet_write(void *opaque, hwaddr offset,
                     memset(&s->tx_fifo[s->tx_frame_len], 0, 60 - s->tx_frame_len);
                     s->tx_fifo_len = 60;
                 }
-                qemu_send_packet(qemu_get_queue(s->nic), s->tx_fifo,
-                                 s->tx_frame_len);
+                stellaris_enet_queue_tx(s);
                 s->tx_frame_len = -1;
                 s->ris |= SE_INT_TXEMP;
                 stellaris_enet_update(s);
@@ -326,6 +359,9 @@ static void stellaris_enet_save(QEMUFile *f, void *opaque)
     stellaris_enet_state *s = (stellaris_enet_state *)opaque;
     int i;
 
+    /* Frames are not part of the state once software has written them.  */
+    stellaris_enet_flush_tx(s);
+
     qemu_put_be32(f, s->ris);
     qemu_put_be32(f, s->im);
     qemu_put_be32(f, s->rctl);
@@ -388,6 +424,8 @@ static void stellaris_enet_cleanup(NetClientState *nc)
 
     unregister_savevm(&s->busdev.qdev, "stellaris_enet", s);
 
+    qemu_bh_delete(s->tx_bh);
+
     memory_region_destroy(&s->mmio);
 
     g_free(s);
@@ -410,6 +448,7 @@ static int stellaris_enet_init(SysBusDevice *dev)
     sysbus_init_mmio(dev, &s->mmio);
     sysbus_init_irq(dev, &s->irq);
     qemu_macaddr_default_if_unset(&s->conf.macaddr);
+    s->tx_bh = qemu_bh_new(stellaris_enet_flush_tx, s);
 
     s->nic = qemu_new_nic(&net_stellaris_enet_info, &s->conf,
                           object_get_typename(OBJECT(dev)), dev->qdev.id, s);
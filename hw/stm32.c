@@ -21,6 +21,8 @@
 
 #include "stm32.h"
 #include "exec/address-spaces.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/config-file.h"
 
 /* DEFINITIONS */
 
@@ -46,15 +48,63 @@ void stm32_hw_warn(const char *fmt, ...)
 
 /* INITIALIZATION */
 
+const Stm32Part *stm32_get_part(const Stm32Part *parts)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    const char *name = machine_opts ? qemu_opt_get(machine_opts, "part") : NULL;
+    const Stm32Part *part;
+
+    if (name == NULL) {
+        return &parts[0];
+    }
+    for (part = parts; part->name != NULL; part++) {
+        if (strcasecmp(part->name, name) == 0) {
+            return part;
+        }
+    }
+
+    fprintf(stderr, "Unknown STM32 part %s.  Supported parts:", name);
+    for (part = parts; part->name != NULL; part++) {
+        fprintf(stderr, " %s", part->name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* A Thumb-2 instruction translates to a few tens of bytes of host code.  Not
+ * all of the flash holds code and code is rarely translated more than once,
+ * so 16 bytes of buffer per byte of memory leaves plenty of room while
+ * keeping small parts down to a couple of megabytes.
+ */
+#define STM32_TB_BYTES_PER_BYTE 16
+
+size_t stm32_part_tb_size(const Stm32Part *part)
+{
+    return (size_t)(part->flash_size + part->ram_size) * 1024 *
+           STM32_TB_BYTES_PER_BYTE;
+}
+
+void stm32_prop_set_link(DeviceState *dev, const char *name,
+                         DeviceState *target)
+{
+    Error *errp = NULL;
+
+    if (target) {
+        object_property_set_link(OBJECT(dev), OBJECT(target), name, &errp);
+        assert_no_error(errp);
+    }
+}
+
 /* I copied sysbus_create_varargs and split it into two parts.  This is so that
  * you can set properties before calling the device init function.
  */
 
-DeviceState *stm32_init_periph(DeviceState *dev, stm32_periph_t periph,
-                                        hwaddr addr, qemu_irq irq)
+DeviceState *stm32_init_periph(MemoryRegion *address_space_mem,
+                               DeviceState *dev, stm32_periph_t periph,
+                               hwaddr addr, qemu_irq irq)
 {
     qdev_init_nofail(dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, addr);
+    sysbus_mmio_map_to(SYS_BUS_DEVICE(dev), 0, address_space_mem, addr);
     if (irq) {
         sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, irq);
     }
@@ -25,6 +25,8 @@
 #include "arm-misc.h"
 #include "qemu-common.h"
 #include "sysbus.h"
+#include "qemu/notify.h"
+#include "clktree.h"
 
 #define ENUM_STRING(x) [x] = #x
 #define ARRAY_LENGTH(array) (sizeof((array))/sizeof((array)[0]))
@@ -60,6 +62,41 @@
 void stm32_hw_warn(const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 1, 2)));
 
+/* Poll detection.  Firmware often spins on a status register until a flag
+ * changes (e.g. USART_SR.TXE).  A peripheral can report each read of such a
+ * register, along with the time until which its value cannot change.  Once
+ * the same tight loop has read the register STM32_POLL_THRESHOLD times in a
+ * row, the CPU is parked until that time, until an interrupt, or until the
+ * peripheral is accessed again (see stm32_poll_break).  With -icount, the
+ * vm_clock then skips straight to the wake-up time.
+ */
+#define STM32_POLL_THRESHOLD 8
+
+/* For stm32_poll_read: the value only changes on an event that the
+ * peripheral reports with stm32_poll_break. */
+#define STM32_POLL_FOREVER INT64_MAX
+
+typedef struct Stm32Poll {
+    /* Private */
+    hwaddr offset;
+    uintptr_t host_pc;
+    unsigned count;
+    bool parked;
+    struct CPUARMState *env;
+    QEMUTimer *timer;
+} Stm32Poll;
+
+void stm32_poll_init(Stm32Poll *p);
+
+/* Call for each read of a polled status register that has no side effects.
+ * until is the vm_clock time until which the value read cannot change. */
+void stm32_poll_read(Stm32Poll *p, hwaddr offset, int64_t until);
+
+/* Call for any other access to the peripheral, and whenever the state of a
+ * polled register changes other than at the time given to stm32_poll_read.
+ * This wakes a parked CPU. */
+void stm32_poll_break(Stm32Poll *p);
+
 
 
 
@@ -123,6 +160,8 @@ typedef int32_t stm32_periph_t;
 
 
 /* IRQs */
+#define STM32_RTC_IRQ 3
+#define STM32_FLASH_IRQ 4
 #define STM32_RCC_IRQ 5
 
 #define STM32_UART1_IRQ 37
@@ -132,6 +171,30 @@ typedef int32_t stm32_periph_t;
 #define STM32_UART5_IRQ 53
 #define STM32_UART6_IRQ 71
 
+#define STM32_SPI1_IRQ 35
+#define STM32_SPI2_IRQ 36
+#define STM32_SPI3_IRQ 51
+
+#define STM32_I2C1_EV_IRQ 31
+#define STM32_I2C1_ER_IRQ 32
+#define STM32_I2C2_EV_IRQ 33
+#define STM32_I2C2_ER_IRQ 34
+
+#define STM32_USB_HP_CAN_TX_IRQ 19
+#define STM32_USB_LP_CAN_RX0_IRQ 20
+#define STM32_CAN_RX1_IRQ 21
+#define STM32_CAN_SCE_IRQ 22
+#define STM32_OTG_FS_IRQ 67
+#define STM32_OTG_HS_IRQ 77
+
+#define STM32_ETH_IRQ 61
+#define STM32_SDIO_IRQ 49
+#define STM32_CRYP_IRQ 79
+#define STM32_HASH_RNG_IRQ 80
+
+#define STM32_ADC1_2_IRQ 18
+#define STM32_ADC3_IRQ 47
+
 #define STM32_EXTI0_IRQ 6
 #define STM32_EXTI1_IRQ 7
 #define STM32_EXTI2_IRQ 8
@@ -139,11 +202,56 @@ typedef int32_t stm32_periph_t;
 #define STM32_EXTI4_IRQ 10
 #define STM32_EXTI9_5_IRQ 23
 #define STM32_EXTI15_10_IRQ 40
+#define STM32_WWDG_IRQ 0
 #define STM32_PVD_IRQ 1
 #define STM32_RTCAlarm_IRQ 41
 #define STM32_OTG_FS_WKUP_IRQ 42
 #define STM32_ETH_WKUP_IRQ 62
 
+#define STM32_TIM1_BRK_IRQ 24
+#define STM32_TIM1_UP_IRQ 25
+#define STM32_TIM1_TRG_COM_IRQ 26
+#define STM32_TIM1_CC_IRQ 27
+#define STM32_TIM2_IRQ 28
+#define STM32_TIM3_IRQ 29
+#define STM32_TIM4_IRQ 30
+#define STM32_TIM5_IRQ 50
+#define STM32_TIM6_IRQ 54
+#define STM32_TIM7_IRQ 55
+#define STM32_TIM8_BRK_IRQ 43
+#define STM32_TIM8_UP_IRQ 44
+#define STM32_TIM8_TRG_COM_IRQ 45
+#define STM32_TIM8_CC_IRQ 46
+
+#define STM32_DMA1_CHANNEL1_IRQ 11
+#define STM32_DMA1_CHANNEL2_IRQ 12
+#define STM32_DMA1_CHANNEL3_IRQ 13
+#define STM32_DMA1_CHANNEL4_IRQ 14
+#define STM32_DMA1_CHANNEL5_IRQ 15
+#define STM32_DMA1_CHANNEL6_IRQ 16
+#define STM32_DMA1_CHANNEL7_IRQ 17
+#define STM32_DMA2_CHANNEL1_IRQ 56
+#define STM32_DMA2_CHANNEL2_IRQ 57
+#define STM32_DMA2_CHANNEL3_IRQ 58
+#define STM32_DMA2_CHANNEL4_5_IRQ 59
+
+#define STM32_DMA1_STREAM0_IRQ 11
+#define STM32_DMA1_STREAM1_IRQ 12
+#define STM32_DMA1_STREAM2_IRQ 13
+#define STM32_DMA1_STREAM3_IRQ 14
+#define STM32_DMA1_STREAM4_IRQ 15
+#define STM32_DMA1_STREAM5_IRQ 16
+#define STM32_DMA1_STREAM6_IRQ 17
+#define STM32_DMA1_STREAM7_IRQ 47
+#define STM32_DMA2_STREAM0_IRQ 56
+#define STM32_DMA2_STREAM1_IRQ 57
+#define STM32_DMA2_STREAM2_IRQ 58
+#define STM32_DMA2_STREAM3_IRQ 59
+#define STM32_DMA2_STREAM4_IRQ 60
+#define STM32_DMA2_STREAM5_IRQ 68
+#define STM32_DMA2_STREAM6_IRQ 69
+#define STM32_DMA2_STREAM7_IRQ 70
+
 
 
 
@@ -156,6 +264,15 @@ void stm32_exti_set_gpio(Stm32Exti *s, unsigned exti_line, const uint8_t gpio_in
 /* Unassigns the specified EXTI line from the specified GPIO. */
 void stm32_exti_reset_gpio(Stm32Exti *s, unsigned exti_line, const uint8_t gpio_index);
 
+/* Called by a GPIO when some of its input pins change.  rising and falling
+ * hold the pins that went high and low. */
+void stm32_exti_gpio_edges(Stm32Exti *s, unsigned gpio_index,
+                           uint16_t rising, uint16_t falling);
+
+/* Called by the peripherals wired to the lines above the GPIO ones (PVD,
+ * RTC alarm, USB wakeup...) when their output goes high. */
+void stm32_exti_line_rising(Stm32Exti *s, unsigned line);
+
 
 
 
@@ -165,10 +282,37 @@ typedef struct Stm32Gpio Stm32Gpio;
 
 #define STM32_GPIO_PIN_COUNT 16
 
-/* Sets the EXTI IRQ for the specified pin.  When a change occurs
- * on this pin, and interrupt will be generated on this IRQ.
+/* Sets the EXTI controller to tell about input changes on this GPIO, which
+ * is the EXTI's GPIO number gpio_index (0 for GPIOA, 1 for GPIOB...). */
+void stm32_gpio_set_exti(Stm32Gpio *s, Stm32Exti *exti, unsigned gpio_index);
+
+/* Changes the pins in mask to the levels in value, as if they had each
+ * been set through the GPIO's input IRQs. */
+void stm32_gpio_set_inputs(Stm32Gpio *s, uint16_t mask, uint16_t value);
+
+/* The same, for a change that happened at time (in vm_clock nanoseconds,
+ * no later than now), which is the time the bus notifiers are given. */
+void stm32_gpio_set_inputs_at(Stm32Gpio *s, uint16_t mask, uint16_t value,
+                              int64_t time);
+
+/* One change of the input pins, for stm32_gpio_queue_inputs. */
+typedef struct Stm32GpioInput {
+    /* When the change happens, in vm_clock nanoseconds */
+    int64_t time;
+    /* Pins that are set, and their new levels */
+    uint16_t mask;
+    uint16_t value;
+} Stm32GpioInput;
+
+/* Queues a series of input changes (e.g. from an encoder or hall sensor
+ * model), which must be in time order and no earlier than any already
+ * queued.  Changes that are due are made at once, the others from a timer.
+ * Several changes can fall due together, in which case a pending EXTI flag
+ * only records the first of them, as it would if the firmware had not yet
+ * serviced it.
  */
-void stm32_gpio_set_exti_irq(Stm32Gpio *s, unsigned pin, qemu_irq in_irq);
+void stm32_gpio_queue_inputs(Stm32Gpio *s, const Stm32GpioInput *inputs,
+                             unsigned count);
 
 /* GPIO pin mode */
 #define STM32_GPIO_MODE_IN 0
@@ -187,6 +331,48 @@ uint8_t stm32_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin);
 #define STM32_GPIO_OUT_ALT_OPEN 3
 uint8_t stm32_gpio_get_config_bits(Stm32Gpio *s, unsigned pin);
 
+/* GPIO pin mode (STM32F2XX MODER register) */
+#define STM32F2XX_GPIO_MODE_IN 0
+#define STM32F2XX_GPIO_MODE_OUT 1
+#define STM32F2XX_GPIO_MODE_AF 2
+#define STM32F2XX_GPIO_MODE_ANALOG 3
+uint8_t stm32f2xx_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin);
+
+/* Gets the alternate function number (AFRL/AFRH) selected for the pin
+ * (STM32F2XX only). */
+uint8_t stm32f2xx_gpio_get_af(Stm32Gpio *s, unsigned pin);
+
+/* The pins in the given MODER mode, and the pins in alternate function
+ * mode with the given AF number, as masks (STM32F2XX only).  These are
+ * kept up to date by MODER and AFRL/AFRH writes, so checking whether a
+ * peripheral owns a pin costs a single AND. */
+uint16_t stm32f2xx_gpio_get_mode_pins(Stm32Gpio *s, uint8_t mode);
+uint16_t stm32f2xx_gpio_get_af_pins(Stm32Gpio *s, uint8_t af);
+
+/* Passed as the data argument to GPIO bus notifiers.  Describes a single
+ * write to the port's output register.
+ */
+typedef struct Stm32GpioBusEvent {
+    /* Output pins whose level changed */
+    uint16_t changed;
+    /* New value of the output register */
+    uint16_t value;
+    /* When the change happened, in vm_clock nanoseconds.  For queued input
+     * changes this is their own time, which may be a little before the
+     * current time. */
+    int64_t time;
+} Stm32GpioBusEvent;
+
+/* Adds a notifier that is called once for each write to ODR, BSRR or BRR
+ * that changes at least one output pin, with a Stm32GpioBusEvent
+ * describing the whole port.  The per-pin output IRQs still fire as well.
+ */
+void stm32_gpio_add_bus_notifier(Stm32Gpio *s, Notifier *notifier);
+
+/* Adds a notifier that is called whenever input pins change level, with a
+ * Stm32GpioBusEvent whose value is the new state of all input pins. */
+void stm32_gpio_add_input_notifier(Stm32Gpio *s, Notifier *notifier);
+
 
 
 
@@ -196,22 +382,73 @@ uint8_t stm32_gpio_get_config_bits(Stm32Gpio *s, unsigned pin);
 /* RCC */
 typedef struct Stm32Rcc Stm32Rcc;
 
-/* Checks if the specified peripheral clock is enabled.
- * Generates a hardware error if not.
+/* The abstract type of the F1 and F2 RCCs, which the "stm32_rcc" link
+ * property of every peripheral points to. */
+#define TYPE_STM32_RCC "stm32_rcc"
+
+/* What happens when software accesses a peripheral whose clock is disabled.
+ * This is chosen with the "periph_clk_check" property of the RCC. */
+typedef enum {
+    /* Stop with a hardware error (the default, since this is usually a
+     * bug in the firmware) */
+    STM32_PERIPH_CLK_ERROR,
+    /* Ignore the access, as the chip does (reads return 0) */
+    STM32_PERIPH_CLK_IGNORE,
+    /* Ignore the access, warning about the first one */
+    STM32_PERIPH_CLK_LOG
+} Stm32PeriphClkCheck;
+
+/* A peripheral's copy of the state of its clock.  The peripheral subscribes
+ * to its clock once with stm32_rcc_periph_clk_init, after which enabled and
+ * freq are kept up to date by the clock tree, so that register accesses can
+ * check the clock without going through the RCC.
  */
-void stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph, SysBusDevice *busdev);
+typedef struct Stm32PeriphClk {
+    bool enabled;
+    uint32_t freq;
+
+    /* Private */
+    Clk clk;
+    SysBusDevice *busdev;
+    Stm32PeriphClkCheck check;
+    bool logged;
+    qemu_irq handler;
+} Stm32PeriphClk;
+
+/* Subscribes pc to the clock of the specified peripheral.  If handler is
+ * not NULL, it is raised whenever the clock changes, after pc has been
+ * updated. */
+void stm32_rcc_periph_clk_init(Stm32PeriphClk *pc, Stm32Rcc *s,
+                               stm32_periph_t periph, SysBusDevice *busdev,
+                               qemu_irq handler);
+
+/* Handles an access while the clock is disabled, according to the RCC's
+ * periph_clk_check setting.  Returns false if the access must be ignored. */
+bool stm32_periph_clk_disabled_access(Stm32PeriphClk *pc);
+
+/* Stops the high-speed clocks (HSI, HSE and the PLLs) for the Stop and
+ * Standby modes, or starts the HSI again and selects it as the system clock,
+ * as the chip does when it wakes up from Stop (STM32F1XX only).  Peripherals
+ * that run on the low-speed clocks keep running. */
+void stm32f1xx_rcc_set_stop_mode(Stm32Rcc *s, bool stop);
+
+/* Turns the LSI on until the next system reset, whatever LSION says, as
+ * the IWDG does when it is started (STM32F1XX only). */
+void stm32f1xx_rcc_force_lsi(Stm32Rcc *s);
 
-/* Sets the IRQ to be called when the specified peripheral clock changes
- * frequency. */
-void stm32_rcc_set_periph_clk_irq(
-        Stm32Rcc *s,
-        stm32_periph_t periph,
-        qemu_irq periph_irq);
+/* Adds a notifier called when software resets the backup domain (the RTC
+ * and the backup registers) with the BDRST bit of RCC_BDCR (STM32F1XX
+ * only).  The power on reset of the backup domain is left to the
+ * peripherals, which must not reset their backup domain state on a system
+ * reset. */
+void stm32f1xx_rcc_add_backup_reset_notifier(Stm32Rcc *s, Notifier *notifier);
 
-/* Gets the frequency of the specified peripheral clock. */
-uint32_t stm32_rcc_get_periph_freq(
-        Stm32Rcc *s,
-        stm32_periph_t periph);
+/* To be called by a peripheral before each register access.  Returns
+ * false if the access must be ignored because the clock is disabled. */
+static inline bool stm32_periph_clk_check(Stm32PeriphClk *pc)
+{
+    return pc->enabled || stm32_periph_clk_disabled_access(pc);
+}
 
 
 
@@ -222,7 +459,7 @@ uint32_t stm32_rcc_get_periph_freq(
 
 
 /* UART */
-#define STM32_UART_COUNT 5
+#define STM32_UART_COUNT 6
 
 typedef struct Stm32Uart Stm32Uart;
 
@@ -233,6 +470,308 @@ typedef struct Stm32Uart Stm32Uart;
 void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
                         uint32_t afio_board_map);
 
+/* GPIO outputs of the UART requesting DMA transfers.  They follow
+ * RXNE and TXE while DMAR and DMAT are set in USART_CR3. */
+#define STM32_UART_DMA_RX_REQ 0
+#define STM32_UART_DMA_TX_REQ 1
+
+
+
+
+/* TIMER */
+typedef struct Stm32Timer Stm32Timer;
+
+/* GPIO outputs of the timer that are pulsed on its trigger events.  TRGO
+ * follows the master mode selected in TIMx_CR2, and the CC outputs pulse on
+ * the compare events of the output compare channels that have their output
+ * enabled (n is numbered from 0).
+ */
+#define STM32_TIMER_TRGO 0
+#define STM32_TIMER_CC_TRIGGER(n) (1 + (n))
+#define STM32_TIMER_TRIGGER_COUNT 5
+
+/* Makes the TIn input of the timer (n is numbered from 0) follow an input
+ * pin of a GPIO port.  The capture channels that take TIn latch the counter
+ * as it was at the time of the edge. */
+void stm32_timer_connect_input(Stm32Timer *s, int n, Stm32Gpio *gpio,
+                               unsigned pin);
+
+
+
+
+/* SPI */
+typedef struct Stm32Spi Stm32Spi;
+
+/* GPIO outputs of the SPI requesting DMA transfers.  They follow RXNE and
+ * TXE while RXDMAEN and TXDMAEN are set in SPI_CR2. */
+#define STM32_SPI_DMA_RX_REQ 0
+#define STM32_SPI_DMA_TX_REQ 1
+
+/* Gets the SSI bus that the SPI's slaves should be attached to. */
+SSIBus *stm32_spi_get_bus(Stm32Spi *s);
+
+
+
+
+/* I2C */
+typedef struct Stm32I2c Stm32I2c;
+
+/* Gets the I2C bus that the controller's slaves should be attached to. */
+i2c_bus *stm32_i2c_get_bus(Stm32I2c *s);
+
+
+
+
+/* USB */
+typedef struct Stm32Usb Stm32Usb;
+
+/* The host link of the USB devices, shared by the OTG cores in device mode
+ * (see stm32_usb.c for the records) */
+
+/* Largest packet a full speed endpoint can have */
+#define STM32_USB_MAX_PACKET 1023
+
+/* Handshakes of the host link */
+#define STM32_USB_LINK_ACK 0
+#define STM32_USB_LINK_NAK 1
+#define STM32_USB_LINK_STALL 2
+/* The device did not answer (it is not addressed, or the endpoint is
+ * disabled) */
+#define STM32_USB_LINK_NO_RESPONSE 3
+
+#define STM32_USB_LINK_FLAG_WAIT_BIT 0
+
+#define STM32_USB_LINK_HEADER_SIZE 8
+#define STM32_USB_LINK_TOKEN_RESET 0
+
+
+
+
+/* CAN */
+typedef struct Stm32Can Stm32Can;
+
+/* A data or remote frame.  id is an 11-bit standard identifier, or a
+ * 29-bit extended one if ide is set. */
+typedef struct Stm32CanFrame {
+    uint32_t id;
+    bool ide;
+    bool rtr;
+    uint8_t dlc;
+    uint8_t data[8];
+} Stm32CanFrame;
+
+/* Virtual CAN buses, which connect the CAN controllers of all the
+ * microcontrollers in the process.  A hub is created the first time its id
+ * is looked up. */
+typedef struct Stm32CanHub Stm32CanHub;
+typedef struct Stm32CanHubPort Stm32CanHubPort;
+
+/* Called with every frame another port sends on the hub. */
+typedef void Stm32CanReceiveFunc(void *opaque, const Stm32CanFrame *frame);
+
+Stm32CanHub *stm32_can_hub_find(int id);
+Stm32CanHubPort *stm32_can_hub_add_port(Stm32CanHub *hub,
+                                        Stm32CanReceiveFunc *receive,
+                                        void *opaque);
+void stm32_can_hub_send(Stm32CanHubPort *port, const Stm32CanFrame *frame);
+
+/* Bridges the hub to a SocketCAN interface of the host (Linux only).  A
+ * hub can be connected to one interface; connecting it again to the same
+ * one does nothing. */
+void stm32_can_hub_connect_host(Stm32CanHub *hub, const char *ifname);
+
+
+
+
+/* ETH (STM32F2XX) */
+typedef struct Stm32Eth Stm32Eth;
+
+
+
+
+/* SDIO (STM32F2XX) */
+typedef struct Stm32Sdio Stm32Sdio;
+
+
+
+
+/* CRYP (STM32F2XX) */
+typedef struct Stm32Cryp Stm32Cryp;
+
+/* GPIO outputs of the CRYP requesting DMA transfers to CRYP_DIN and from
+ * CRYP_DOUT. */
+#define STM32_CRYP_DMA_IN_REQ 0
+#define STM32_CRYP_DMA_OUT_REQ 1
+
+
+
+
+/* HASH (STM32F2XX) */
+typedef struct Stm32Hash Stm32Hash;
+
+
+
+
+/* RNG (STM32F2XX) */
+typedef struct Stm32Rng Stm32Rng;
+
+
+
+
+/* USB OTG (STM32F2XX) */
+typedef struct Stm32Otg Stm32Otg;
+
+
+
+
+/* ADC */
+typedef struct Stm32Adc Stm32Adc;
+
+/* GPIO output of the ADC requesting DMA transfers of ADC_DR.  It is raised
+ * when a regular conversion completes while DMA is set in ADC_CR2, and
+ * lowered when ADC_DR is read. */
+#define STM32_ADC_DMA_REQ 0
+
+/* GPIO inputs of the ADC for its external triggers.  A pulse on the input
+ * for an EXTSEL (JEXTSEL) value starts the regular (injected) group if
+ * that trigger is selected. */
+#define STM32_ADC_EXT_TRIGGER(extsel) (extsel)
+#define STM32_ADC_JEXT_TRIGGER(jextsel) (8 + (jextsel))
+#define STM32_ADC_TRIGGER_COUNT 16
+
+/* Number of analog input channels, including the temperature sensor and
+ * VREFINT */
+#define STM32_ADC_CHANNEL_COUNT 18
+
+/* Sets the 12-bit value that conversions of channel give from now on, when
+ * the ADC is not replaying a sample stream. */
+void stm32_adc_set_input(Stm32Adc *s, int channel, uint16_t value);
+
+
+
+
+/* DMA */
+typedef struct Stm32Dma Stm32Dma;
+
+/* Every channel has this many request inputs, which are ORed together the
+ * same way the peripheral requests are on the real chip.  Use STM32_DMA_REQ
+ * to get the GPIO input number of a request (channel is numbered from 1,
+ * as in the reference manual).
+ */
+#define STM32_DMA_REQ_PER_CHANNEL 4
+#define STM32_DMA_REQ(channel, slot) \
+            (((channel) - 1) * STM32_DMA_REQ_PER_CHANNEL + (slot))
+
+/* Lets a peripheral move a whole block through a channel at once instead
+ * of raising its request for every beat.  stm32_dma_block_begin returns
+ * the number of beats the channel still has to transfer between the
+ * peripheral register at par and memory (in the direction given by
+ * to_mem), or 0 if the channel is not set up for such a transfer (it must
+ * be enabled, use data of size bytes on both sides and not increment par).
+ * The memory address and increment (in bytes) are returned in mar and
+ * mstep.  Once the data has been moved, stm32_dma_block_end accounts for
+ * count beats of transfer, setting the flags and raising the interrupts as
+ * the beats would have.
+ */
+uint32_t stm32_dma_block_begin(Stm32Dma *s, int channel, hwaddr par,
+                               bool to_mem, uint32_t size, hwaddr *mar,
+                               uint32_t *mstep);
+void stm32_dma_block_end(Stm32Dma *s, int channel, uint32_t count);
+
+/* Gets the number of beats an enabled channel was started with, which a
+ * circular transfer restarts from (0 if the channel is disabled). */
+uint32_t stm32_dma_get_reload(Stm32Dma *s, int channel);
+
+/* Gets the address space the controller's transfers go through, which the
+ * memory addresses of block transfers refer to. */
+AddressSpace *stm32_dma_get_address_space(Stm32Dma *s);
+
+/* DMA stream controller (STM32F2XX) */
+typedef struct Stm32f2xxDma Stm32f2xxDma;
+
+/* The GPIO input number of a request, as given in the "DMA request
+ * mapping" tables of RM0033.  Only the channel selected by a stream's
+ * CHSEL field triggers it. */
+#define STM32F2XX_DMA_REQ(stream, channel) ((stream) * 8 + (channel))
+
+/* Lets a peripheral move a whole block through the stream serving request
+ * req at once, as stm32_dma_block_begin does on the F1.
+ * stm32f2xx_dma_block_begin returns the number of bytes the stream may
+ * still transfer between the peripheral register at par and the
+ * contiguous memory at mar (in the direction given by to_mem), or 0 if
+ * the stream is not set up for such a transfer (it must be enabled, not
+ * increment par, increment memory and have an empty FIFO).  Once the data
+ * has been moved, stm32f2xx_dma_block_end accounts for len bytes of it.
+ * If last is set, a stream the peripheral is the flow controller of is
+ * completed (len may be 0 to only signal the end of the transfer).
+ */
+uint32_t stm32f2xx_dma_block_begin(Stm32f2xxDma *s, int req, hwaddr par,
+                                   bool to_mem, hwaddr *mar);
+void stm32f2xx_dma_block_end(Stm32f2xxDma *s, int req, uint32_t len,
+                             bool last);
+
+
+
+
+/* FSMC (STM32F1XX) */
+typedef struct Stm32Fsmc Stm32Fsmc;
+
+/* The NOR/SRAM bank, made of four 64 MiB sub-banks (NE1 to NE4). */
+#define STM32_FSMC_NOR_ADDR 0x60000000
+#define STM32_FSMC_NOR_BANKS 4
+
+/* Takes the len bytes at buf, written size bytes at a time to the single
+ * address at offset of a sub-bank, in one go. */
+typedef void Stm32FsmcBurstFn(void *opaque, hwaddr offset,
+                              const uint8_t *buf, uint32_t len,
+                              unsigned size);
+
+/* Attaches the region mr of an external device to sub-bank bank (numbered
+ * from 0 for NE1), where it is seen while the sub-bank is enabled.  If burst
+ * is not NULL, runs of writes to one address can be given to the device at
+ * once through it. */
+void stm32_fsmc_attach(Stm32Fsmc *s, int bank, MemoryRegion *mr,
+                       Stm32FsmcBurstFn *burst, void *opaque);
+
+/* Writes the len bytes at buf to addr, size bytes at a time, as a DMA
+ * channel that does not increment addr would.  Returns false without
+ * writing anything if addr is not on an enabled sub-bank whose device takes
+ * bursts (len may be 0 to only check that). */
+bool stm32_fsmc_burst_write(Stm32Fsmc *s, hwaddr addr, const uint8_t *buf,
+                            uint32_t len, unsigned size);
+
+
+
+
+/* CRC (STM32F1XX) */
+typedef struct Stm32Crc Stm32Crc;
+
+#define STM32_CRC_ADDR 0x40023000
+
+/* Feeds the CRC unit with the len bytes at buf, written size bytes at a
+ * time to addr, as a DMA channel that does not increment addr would.
+ * Returns false without feeding anything if addr is not CRC_DR or the unit
+ * is not clocked (len may be 0 to only check that). */
+bool stm32_crc_burst_write(Stm32Crc *s, hwaddr addr, const uint8_t *buf,
+                           uint32_t len, unsigned size);
+
+
+
+
+/* FLASH */
+/* Lets the flash device map a raw (non-ELF) kernel image from its file
+ * instead of having it copied into RAM.  The pages stay in the host's page
+ * cache, so processes running the same image share them until the guest
+ * programs the flash.  Must be called before the device is initialized.
+ * Returns true if the image was taken, in which case the caller must not
+ * load it again. */
+bool stm32_flash_map_kernel(DeviceState *dev, const char *kernel_filename);
+/* Connects the flash interface to the CPU that fetches from it, which
+ * then models its wait states and prefetch buffer under -tcg cycles=on.
+ * BASE is where the flash is mapped, and BOOT_ALIAS tells whether it also
+ * appears at 0x00000000. */
+void stm32_flash_set_cpu(DeviceState *dev, ARMCPU *cpu, uint32_t base,
+                         bool boot_alias);
 
 
 
@@ -254,31 +793,122 @@ typedef struct Stm32Afio Stm32Afio;
  * of the mapping values defined above. */
 uint32_t stm32_afio_get_periph_map(Stm32Afio *s, int32_t periph_num);
 
-void stm32_afio_uart_check_tx_pin_callback(Stm32Uart *s);
+/* Alternate function signals whose pins the AFIO keeps track of. */
+typedef enum {
+    STM32_AFIO_USART1_TX,
+    STM32_AFIO_USART1_RX,
+    STM32_AFIO_USART2_TX,
+    STM32_AFIO_USART2_RX,
+    STM32_AFIO_USART3_TX,
+    STM32_AFIO_USART3_RX,
+    STM32_AFIO_UART4_TX,
+    STM32_AFIO_UART4_RX,
+    STM32_AFIO_UART5_TX,
+    STM32_AFIO_UART5_RX,
+    STM32_AFIO_SPI1_SCK,
+    STM32_AFIO_SPI1_MISO,
+    STM32_AFIO_SPI1_MOSI,
+    STM32_AFIO_I2C1_SCL,
+    STM32_AFIO_I2C1_SDA,
+    STM32_AFIO_TIM1_CH1,
+    STM32_AFIO_TIM2_CH1,
+    STM32_AFIO_TIM3_CH1,
+    STM32_AFIO_TIM4_CH1,
+    STM32_AFIO_CAN_RX,
+    STM32_AFIO_CAN_TX,
+    STM32_AFIO_ROUTE_COUNT
+} Stm32AfioRoute;
+
+/* Tells whether the pin the current remapping gives the signal is
+ * configured for it (alternate function output, or input).  This is
+ * looked up in a mask the AFIO keeps up to date, so it is cheap enough
+ * to call on every data register access. */
+bool stm32_afio_route_valid(Stm32Afio *s, Stm32AfioRoute route);
+
+/* Called by the GPIOs when their CRL or CRH is written. */
+void stm32_afio_gpio_config_changed(Stm32Afio *s);
+
+/* Sets the AFIO to tell about configuration changes on this GPIO. */
+void stm32_gpio_set_afio(Stm32Gpio *s, Stm32Afio *afio);
 
 
 
 /* STM32 PERIPHERALS - GENERAL */
-DeviceState *stm32_init_periph(DeviceState *dev, stm32_periph_t periph,
+/* Points the link property name of dev (such as "stm32_rcc") at target,
+ * which must have been initialized already.  A NULL target leaves the link
+ * unset, for peripherals the part does not have. */
+void stm32_prop_set_link(DeviceState *dev, const char *name,
+                         DeviceState *target);
+
+/* Initializes the peripheral and maps it at addr in address_space_mem. */
+DeviceState *stm32_init_periph(MemoryRegion *address_space_mem,
+                               DeviceState *dev, stm32_periph_t periph,
                                hwaddr addr, qemu_irq irq);
 
 /* STM32 MICROCONTROLLER - GENERAL */
 typedef struct Stm32 Stm32;
 
+/* PART DESCRIPTIONS */
+/* One part number of an STM32 family.  A part has the first gpio_count GPIO
+ * ports of its family; its other peripherals are given by periphs, where bit
+ * n stands for the family's stm32_periph_t n.  Peripherals the part does not
+ * have are not created.
+ */
+typedef struct Stm32Part {
+    const char *name;
+    uint32_t flash_size; /* in KiB */
+    uint32_t ram_size; /* in KiB */
+    unsigned gpio_count;
+    uint64_t periphs;
+} Stm32Part;
+
+#define STM32_PERIPH_BIT(periph) (1ULL << (periph))
+#define STM32_PART_HAS(part, periph) \
+    (((part)->periphs & STM32_PERIPH_BIT(periph)) != 0)
+
+/* The parts of each family, ending with a NULL name.  The first part of each
+ * list is the default. */
+extern const Stm32Part stm32f1xx_parts[];
+extern const Stm32Part stm32f2xx_parts[];
+
+/* Returns the part selected with "-machine part=NAME" from the list, or the
+ * first part if none was selected.  Exits if the part is not in the list. */
+const Stm32Part *stm32_get_part(const Stm32Part *parts);
+
+/* Returns the translation buffer size for a part, scaled to the code it can
+ * hold (its flash and RAM) rather than to the -m RAM size, which the STM32
+ * boards do not use. */
+size_t stm32_part_tb_size(const Stm32Part *part);
+
 /* Initialize the STM32 microcontroller.  Returns arrays
- * of GPIOs and UARTs so that connections can be made. */
+ * of GPIOs, UARTs, SPIs and I2Cs, and the FSMC, so that connections can be
+ * made.  Entries for peripherals the part does not have are set to NULL.
+ *
+ * A board can create several microcontrollers, numbered from 0 by node.
+ * Node 0 lives in the system memory; every other node gets an address
+ * space of its own, its flash from "-drive if=pflash,index=<node>" (the
+ * kernel image can only be given to node 0, unless it is a raw image), and
+ * looks up the chardevs it is connected to by id with "node<node>."
+ * prepended. */
+#define STM32_NODE_MAX 16
+
 void stm32f1xx_init(
-            ram_addr_t flash_size,
-            ram_addr_t ram_size,
+            int node,
+            const Stm32Part *part,
             const char *kernel_filename,
             Stm32Gpio **stm32_gpio,
             Stm32Uart **stm32_uart,
+            Stm32Spi **stm32_spi,
+            Stm32I2c **stm32_i2c,
+            Stm32Fsmc **stm32_fsmc,
             uint32_t osc_freq,
             uint32_t osc32_freq);
 
+/* cpu_model is the -cpu option, NULL for the Cortex-M3 of the F2 (the
+ * FPU of a "cortex-m4f" model allows F4 firmware to run). */
 void stm32f2xx_init(
-                    ram_addr_t flash_size,
-                    ram_addr_t ram_size,
+                    const Stm32Part *part,
+                    const char *cpu_model,
                     const char *kernel_filename,
                     Stm32Gpio **stm32_gpio,
                     Stm32Uart **stm32_uart,
@@ -0,0 +1,1015 @@
+/*
+ * STM32 Microcontroller analog to digital converter
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * There are no analog inputs.  Every conversion takes the next sample of a
+ * stream of 16-bit little-endian values instead (of which the low 12 bits
+ * are used), whatever channel it converts, so that the values converted on
+ * a real board can be recorded in conversion order and played back.  The
+ * stream is either the file named by the "samples" property, which is
+ * mapped into memory and replayed from the start once its end is reached,
+ * or the character device given by the "chardev" property, which is read
+ * into a FIFO as much at a time as fits.  A conversion that finds the FIFO
+ * empty gets the previous sample again.  Without a stream, a conversion
+ * takes the value last given to its channel with stm32_adc_set_input (0
+ * out of reset), so that an analog waveform can be played on the inputs.
+ *
+ * A conversion takes the sample time plus 12.5 ADC clock cycles, timed from
+ * the ADC clock of the clock tree.  As with the timers, the converter is not
+ * ticked: the conversions that have completed are accounted for whenever
+ * software looks at the registers, and a QEMUTimer is only armed when a
+ * result has to be handed over on time.  Unless the analog watchdog
+ * interrupt is enabled, that is at the end of a group, so the DMA moves the
+ * results of a scan one group at a time.
+ *
+ * The regular and injected groups, the scan, continuous, discontinuous and
+ * auto-injection modes, the analog watchdog, the external triggers and the
+ * DMA request are implemented.  The dual modes, injected discontinuous mode
+ * and the temperature sensor are not modelled, and calibration only takes
+ * its time.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "char/char.h"
+#include "sysemu/replay.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_ADC
+
+#ifdef DEBUG_STM32_ADC
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_ADC: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define ADC_SR_OFFSET 0x00
+#define ADC_SR_AWD_BIT 0
+#define ADC_SR_EOC_BIT 1
+#define ADC_SR_JEOC_BIT 2
+#define ADC_SR_JSTRT_BIT 3
+#define ADC_SR_STRT_BIT 4
+
+#define ADC_CR1_OFFSET 0x04
+#define ADC_CR1_AWDCH_MASK 0x0000001f
+#define ADC_CR1_EOCIE_BIT 5
+#define ADC_CR1_AWDIE_BIT 6
+#define ADC_CR1_JEOCIE_BIT 7
+#define ADC_CR1_SCAN_BIT 8
+#define ADC_CR1_AWDSGL_BIT 9
+#define ADC_CR1_JAUTO_BIT 10
+#define ADC_CR1_DISCEN_BIT 11
+#define ADC_CR1_JDISCEN_BIT 12
+#define ADC_CR1_DISCNUM_START 13
+#define ADC_CR1_DISCNUM_MASK 0x0000e000
+#define ADC_CR1_DUALMOD_MASK 0x000f0000
+#define ADC_CR1_JAWDEN_BIT 22
+#define ADC_CR1_AWDEN_BIT 23
+
+#define ADC_CR2_OFFSET 0x08
+#define ADC_CR2_ADON_BIT 0
+#define ADC_CR2_CONT_BIT 1
+#define ADC_CR2_CAL_BIT 2
+#define ADC_CR2_RSTCAL_BIT 3
+#define ADC_CR2_DMA_BIT 8
+#define ADC_CR2_ALIGN_BIT 11
+#define ADC_CR2_JEXTSEL_START 12
+#define ADC_CR2_JEXTSEL_MASK 0x00007000
+#define ADC_CR2_JEXTTRIG_BIT 15
+#define ADC_CR2_EXTSEL_START 17
+#define ADC_CR2_EXTSEL_MASK 0x000e0000
+#define ADC_CR2_EXTTRIG_BIT 20
+#define ADC_CR2_JSWSTART_BIT 21
+#define ADC_CR2_SWSTART_BIT 22
+
+#define ADC_SMPR1_OFFSET 0x0c
+#define ADC_SMPR2_OFFSET 0x10
+#define ADC_JOFR1_OFFSET 0x14
+#define ADC_JOFR4_OFFSET 0x20
+#define ADC_HTR_OFFSET 0x24
+#define ADC_LTR_OFFSET 0x28
+#define ADC_SQR1_OFFSET 0x2c
+#define ADC_SQR1_L_START 20
+#define ADC_SQR1_L_MASK 0x00f00000
+#define ADC_SQR2_OFFSET 0x30
+#define ADC_SQR3_OFFSET 0x34
+#define ADC_JSQR_OFFSET 0x38
+#define ADC_JSQR_JL_START 20
+#define ADC_JSQR_JL_MASK 0x00300000
+#define ADC_JDR1_OFFSET 0x3c
+#define ADC_JDR4_OFFSET 0x48
+#define ADC_DR_OFFSET 0x4c
+
+/* The EXTSEL and JEXTSEL value that selects SWSTART and JSWSTART */
+#define ADC_EXTSEL_SWSTART 7
+
+#define ADC_DATA_MASK 0x0fff
+
+/* Channels 16 and 17 are the temperature sensor and VREFINT. */
+#define ADC_CHANNEL_COUNT STM32_ADC_CHANNEL_COUNT
+
+#define ADC_INJ_COUNT 4
+
+/* Calibration time in ADC clock cycles */
+#define ADC_CAL_CYCLES 83
+
+/* Number of external triggers that are remembered while their group is
+ * being converted (see stm32_adc_trigger_irq_handler) */
+#define STM32_ADC_MAX_TRIGGERS 64
+
+/* Size in bytes of the FIFO the character device is read into */
+#define STM32_ADC_FIFO_SIZE 0x10000
+
+/* Total conversion time for each sample time (SMPx) setting, in halves of
+ * an ADC clock cycle: the sample time plus 12.5 cycles. */
+static const uint32_t stm32_adc_conv_half_cycles[8] = {
+    28, 40, 52, 82, 108, 136, 168, 504
+};
+
+struct Stm32Adc {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    char *samples_path;
+    CharDriverState *chr;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    /* Register Values */
+    uint32_t
+        ADC_SR,
+        ADC_CR1,
+        ADC_CR2,
+        ADC_SMPR[2],
+        ADC_JOFR[ADC_INJ_COUNT],
+        ADC_HTR,
+        ADC_LTR,
+        ADC_SQR[3],
+        ADC_JSQR,
+        ADC_JDR[ADC_INJ_COUNT],
+        ADC_DR;
+
+    /* ADC clock frequency in Hz (0 if the clock is off) */
+    uint32_t freq;
+
+    /* The conversion in progress, of the channel at the current rank of
+     * the injected or the regular group. */
+    bool converting, conv_injected;
+    int64_t conv_end_ns;
+
+    /* Whether each group has been triggered and not finished yet, and the
+     * rank of its next conversion.  A regular group that is interrupted by
+     * the injected group carries on where it was afterwards. */
+    bool reg_started, inj_started;
+    int reg_rank, inj_rank;
+    /* Conversions left of the current subgroup in discontinuous mode */
+    int disc_left;
+    /* External triggers to serve once each group is finished */
+    uint32_t reg_triggers, inj_triggers;
+
+    /* End of the calibration in progress */
+    int64_t cal_end_ns;
+
+    /* Set while stm32_adc_sync hands out results, since the DMA reads
+     * ADC_DR from there. */
+    bool syncing;
+
+    /* The mapped sample file */
+    GMappedFile *samples_file;
+    const uint8_t *samples;
+    size_t samples_len, samples_pos;
+
+    /* Samples received from the character device */
+    uint8_t fifo[STM32_ADC_FIFO_SIZE];
+    uint32_t fifo_start, fifo_len;
+
+    uint32_t last_sample;
+
+    /* Values of the analog inputs, used without a stream */
+    uint16_t input[ADC_CHANNEL_COUNT];
+
+    QEMUTimer *timer;
+
+    qemu_irq irq;
+    int curr_irq_level;
+
+    qemu_irq dma_req;
+};
+
+
+
+
+/* SAMPLES */
+
+static int stm32_adc_can_receive(void *opaque)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    return STM32_ADC_FIFO_SIZE - s->fifo_len;
+}
+
+static void stm32_adc_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+    uint32_t pos, chunk;
+
+    assert(size <= STM32_ADC_FIFO_SIZE - s->fifo_len);
+
+    while (size > 0) {
+        pos = (s->fifo_start + s->fifo_len) % STM32_ADC_FIFO_SIZE;
+        chunk = MIN(size, STM32_ADC_FIFO_SIZE - pos);
+        memcpy(&s->fifo[pos], buf, chunk);
+        s->fifo_len += chunk;
+        buf += chunk;
+        size -= chunk;
+    }
+}
+
+/* Takes the next sample from the stream, or the input of channel if there
+ * is none. */
+static uint32_t stm32_adc_next_sample(Stm32Adc *s, int channel)
+{
+    if (!s->samples && !s->chr) {
+        return channel < ADC_CHANNEL_COUNT ? s->input[channel] : 0;
+    }
+    if (s->samples) {
+        s->last_sample = lduw_le_p(s->samples + s->samples_pos);
+        s->samples_pos += 2;
+        if (s->samples_pos + 2 > s->samples_len) {
+            s->samples_pos = 0;
+        }
+    } else if (s->fifo_len >= 2) {
+        s->last_sample = s->fifo[s->fifo_start] |
+            (s->fifo[(s->fifo_start + 1) % STM32_ADC_FIFO_SIZE] << 8);
+        s->fifo_start = (s->fifo_start + 2) % STM32_ADC_FIFO_SIZE;
+        s->fifo_len -= 2;
+        qemu_chr_accept_input(s->chr);
+    }
+
+    return s->last_sample & ADC_DATA_MASK;
+}
+
+
+
+
+/* CONVERSIONS */
+
+static uint32_t stm32_adc_smp(Stm32Adc *s, int channel)
+{
+    if (channel >= ADC_CHANNEL_COUNT) {
+        return 0;
+    } else if (channel >= 10) {
+        return (s->ADC_SMPR[0] >> (3 * (channel - 10))) & 0x7;
+    } else {
+        return (s->ADC_SMPR[1] >> (3 * channel)) & 0x7;
+    }
+}
+
+static int64_t stm32_adc_conv_ns(Stm32Adc *s, int channel)
+{
+    return muldiv64(stm32_adc_conv_half_cycles[stm32_adc_smp(s, channel)],
+                    get_ticks_per_sec(), 2 * s->freq);
+}
+
+/* Number of conversions in the regular group.  Only the first channel is
+ * converted unless SCAN is set. */
+static int stm32_adc_reg_length(Stm32Adc *s)
+{
+    if (!IS_BIT_SET(s->ADC_CR1, ADC_CR1_SCAN_BIT)) {
+        return 1;
+    }
+    return ((s->ADC_SQR[0] & ADC_SQR1_L_MASK) >> ADC_SQR1_L_START) + 1;
+}
+
+/* The channel at a rank (counted from 0) of the regular group.  SQR3 holds
+ * the first six ranks, SQR2 the next six and SQR1 the last four. */
+static int stm32_adc_reg_channel(Stm32Adc *s, int rank)
+{
+    return (s->ADC_SQR[2 - rank / 6] >> (5 * (rank % 6))) & 0x1f;
+}
+
+static int stm32_adc_inj_length(Stm32Adc *s)
+{
+    return ((s->ADC_JSQR & ADC_JSQR_JL_MASK) >> ADC_JSQR_JL_START) + 1;
+}
+
+/* The channel at a rank of the injected group.  A group of fewer than four
+ * conversions uses the last of the JSQx fields. */
+static int stm32_adc_inj_channel(Stm32Adc *s, int rank)
+{
+    int jsq = ADC_INJ_COUNT - stm32_adc_inj_length(s) + rank;
+
+    return (s->ADC_JSQR >> (5 * jsq)) & 0x1f;
+}
+
+static void stm32_adc_update_irq(Stm32Adc *s)
+{
+    int new_irq_level =
+        (IS_BIT_SET(s->ADC_SR, ADC_SR_EOC_BIT) &&
+         IS_BIT_SET(s->ADC_CR1, ADC_CR1_EOCIE_BIT)) ||
+        (IS_BIT_SET(s->ADC_SR, ADC_SR_JEOC_BIT) &&
+         IS_BIT_SET(s->ADC_CR1, ADC_CR1_JEOCIE_BIT)) ||
+        (IS_BIT_SET(s->ADC_SR, ADC_SR_AWD_BIT) &&
+         IS_BIT_SET(s->ADC_CR1, ADC_CR1_AWDIE_BIT));
+
+    if (new_irq_level != s->curr_irq_level) {
+        trace_stm32_adc_irq(s, new_irq_level);
+        qemu_set_irq(s->irq, new_irq_level);
+        s->curr_irq_level = new_irq_level;
+    }
+}
+
+/* Sets a group up to be converted.  In discontinuous mode the regular group
+ * carries on from the rank after the last subgroup. */
+static void stm32_adc_begin_regular(Stm32Adc *s)
+{
+    s->reg_started = true;
+    if (IS_BIT_SET(s->ADC_CR1, ADC_CR1_DISCEN_BIT)) {
+        s->disc_left = ((s->ADC_CR1 & ADC_CR1_DISCNUM_MASK) >>
+                        ADC_CR1_DISCNUM_START) + 1;
+    } else {
+        s->reg_rank = 0;
+    }
+    SET_BIT(s->ADC_SR, ADC_SR_STRT_BIT);
+}
+
+static void stm32_adc_begin_injected(Stm32Adc *s)
+{
+    s->inj_started = true;
+    s->inj_rank = 0;
+    SET_BIT(s->ADC_SR, ADC_SR_JSTRT_BIT);
+}
+
+/* Starts the next conversion at time t, injected channels going first. */
+static void stm32_adc_start_next(Stm32Adc *s, int64_t t)
+{
+    int channel;
+
+    s->converting = false;
+    if (!IS_BIT_SET(s->ADC_CR2, ADC_CR2_ADON_BIT) || s->freq == 0) {
+        return;
+    }
+
+    if (s->inj_started) {
+        s->conv_injected = true;
+        channel = stm32_adc_inj_channel(s, s->inj_rank);
+    } else if (s->reg_started) {
+        s->conv_injected = false;
+        channel = stm32_adc_reg_channel(s, s->reg_rank);
+    } else {
+        return;
+    }
+
+    s->converting = true;
+    s->conv_end_ns = t + stm32_adc_conv_ns(s, channel);
+}
+
+static void stm32_adc_watchdog(Stm32Adc *s, int channel, uint32_t value,
+                               bool injected)
+{
+    int en_bit = injected ? ADC_CR1_JAWDEN_BIT : ADC_CR1_AWDEN_BIT;
+
+    if (!IS_BIT_SET(s->ADC_CR1, en_bit)) {
+        return;
+    }
+    if (IS_BIT_SET(s->ADC_CR1, ADC_CR1_AWDSGL_BIT) &&
+        channel != (s->ADC_CR1 & ADC_CR1_AWDCH_MASK)) {
+        return;
+    }
+    if (value > s->ADC_HTR || value < s->ADC_LTR) {
+        SET_BIT(s->ADC_SR, ADC_SR_AWD_BIT);
+    }
+}
+
+/* Injected results have their offset subtracted, the sign being extended
+ * to the left (right aligned) or kept in bit 15 (left aligned). */
+static void stm32_adc_complete_injected(Stm32Adc *s)
+{
+    int channel = stm32_adc_inj_channel(s, s->inj_rank);
+    uint32_t value = stm32_adc_next_sample(s, channel);
+    int32_t data = (int32_t)value - (int32_t)s->ADC_JOFR[s->inj_rank];
+
+    stm32_adc_watchdog(s, channel, value, true);
+    if (IS_BIT_SET(s->ADC_CR2, ADC_CR2_ALIGN_BIT)) {
+        data <<= 3;
+    }
+    s->ADC_JDR[s->inj_rank] = data & 0xffff;
+
+    s->inj_rank++;
+    if (s->inj_rank == stm32_adc_inj_length(s)) {
+        s->inj_started = false;
+        SET_BIT(s->ADC_SR, ADC_SR_JEOC_BIT);
+        if (s->inj_triggers > 0) {
+            s->inj_triggers--;
+            stm32_adc_begin_injected(s);
+        }
+    }
+}
+
+static void stm32_adc_complete_regular(Stm32Adc *s)
+{
+    int channel = stm32_adc_reg_channel(s, s->reg_rank);
+    uint32_t value = stm32_adc_next_sample(s, channel);
+    bool group_end, subgroup_end = false;
+
+    stm32_adc_watchdog(s, channel, value, false);
+    s->ADC_DR = IS_BIT_SET(s->ADC_CR2, ADC_CR2_ALIGN_BIT) ? value << 4 : value;
+
+    s->reg_rank++;
+    group_end = (s->reg_rank >= stm32_adc_reg_length(s));
+    if (IS_BIT_SET(s->ADC_CR1, ADC_CR1_DISCEN_BIT)) {
+        subgroup_end = (--s->disc_left == 0);
+    }
+    if (group_end) {
+        s->reg_rank = 0;
+        if (IS_BIT_SET(s->ADC_CR1, ADC_CR1_JAUTO_BIT)) {
+            stm32_adc_begin_injected(s);
+        }
+    }
+    if (group_end || subgroup_end) {
+        SET_BIT(s->ADC_SR, ADC_SR_EOC_BIT);
+        s->reg_started = group_end &&
+                         IS_BIT_SET(s->ADC_CR2, ADC_CR2_CONT_BIT) &&
+                         !IS_BIT_SET(s->ADC_CR1, ADC_CR1_DISCEN_BIT);
+        if (!s->reg_started && s->reg_triggers > 0) {
+            s->reg_triggers--;
+            stm32_adc_begin_regular(s);
+        }
+    }
+
+    if (IS_BIT_SET(s->ADC_CR2, ADC_CR2_DMA_BIT)) {
+        qemu_irq_raise(s->dma_req);
+    }
+}
+
+/* Completes the conversion in progress and starts the next one from the
+ * time it ended. */
+static void stm32_adc_complete(Stm32Adc *s)
+{
+    if (s->conv_injected) {
+        stm32_adc_complete_injected(s);
+    } else {
+        stm32_adc_complete_regular(s);
+    }
+    stm32_adc_start_next(s, s->conv_end_ns);
+}
+
+/* Brings the conversions and the calibration up to date with vm_clock. */
+static void stm32_adc_sync(Stm32Adc *s)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    if (s->syncing) {
+        return;
+    }
+    s->syncing = true;
+
+    while (s->converting && s->conv_end_ns <= now) {
+        stm32_adc_complete(s);
+    }
+    if (IS_BIT_SET(s->ADC_CR2, ADC_CR2_CAL_BIT) && s->cal_end_ns <= now) {
+        RESET_BIT(s->ADC_CR2, ADC_CR2_CAL_BIT);
+    }
+
+    s->syncing = false;
+}
+
+/* End of the group (or discontinuous subgroup) of the conversion in
+ * progress. */
+static int64_t stm32_adc_group_end_ns(Stm32Adc *s)
+{
+    int64_t t = s->conv_end_ns;
+    int rank, last;
+
+    if (s->conv_injected) {
+        for (rank = s->inj_rank + 1; rank < stm32_adc_inj_length(s); rank++) {
+            t += stm32_adc_conv_ns(s, stm32_adc_inj_channel(s, rank));
+        }
+    } else {
+        last = stm32_adc_reg_length(s);
+        if (IS_BIT_SET(s->ADC_CR1, ADC_CR1_DISCEN_BIT)) {
+            last = MIN(last, s->reg_rank + s->disc_left);
+        }
+        for (rank = s->reg_rank + 1; rank < last; rank++) {
+            t += stm32_adc_conv_ns(s, stm32_adc_reg_channel(s, rank));
+        }
+    }
+    return t;
+}
+
+/* Arms the timer for the end of the next conversion whose result has to be
+ * seen on time: every conversion when the watchdog can interrupt,
+ * otherwise the last of a group when there is an interrupt or DMA to
+ * serve. */
+static void stm32_adc_schedule(Stm32Adc *s)
+{
+    bool watchdog_irq = IS_BIT_SET(s->ADC_CR1, ADC_CR1_AWDIE_BIT) &&
+                        (s->ADC_CR1 & ((1 << ADC_CR1_AWDEN_BIT) |
+                                       (1 << ADC_CR1_JAWDEN_BIT)));
+    bool group_end =
+        IS_BIT_SET(s->ADC_CR1, ADC_CR1_EOCIE_BIT) ||
+        IS_BIT_SET(s->ADC_CR1, ADC_CR1_JEOCIE_BIT) ||
+        IS_BIT_SET(s->ADC_CR2, ADC_CR2_DMA_BIT);
+
+    if (!s->converting || !(watchdog_irq || group_end)) {
+        qemu_del_timer(s->timer);
+    } else if (watchdog_irq) {
+        qemu_mod_timer(s->timer, s->conv_end_ns);
+    } else {
+        qemu_mod_timer(s->timer, stm32_adc_group_end_ns(s));
+    }
+}
+
+static void stm32_adc_expire(void *opaque)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    stm32_adc_sync(s);
+    stm32_adc_update_irq(s);
+    stm32_adc_schedule(s);
+}
+
+/* Triggers the regular group.  A trigger is ignored while the group is
+ * already being converted. */
+static void stm32_adc_start_regular(Stm32Adc *s)
+{
+    if (!IS_BIT_SET(s->ADC_CR2, ADC_CR2_ADON_BIT) || s->reg_started) {
+        return;
+    }
+
+    stm32_adc_begin_regular(s);
+    if (!s->converting) {
+        stm32_adc_start_next(s, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/* Triggers the injected group.  A regular conversion in progress is thrown
+ * away, and done again once the injected group is finished. */
+static void stm32_adc_start_injected(Stm32Adc *s)
+{
+    if (!IS_BIT_SET(s->ADC_CR2, ADC_CR2_ADON_BIT) || s->inj_started) {
+        return;
+    }
+
+    stm32_adc_begin_injected(s);
+    if (!s->converting || !s->conv_injected) {
+        stm32_adc_start_next(s, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/* Stops converting and forgets the groups in progress. */
+static void stm32_adc_stop(Stm32Adc *s)
+{
+    s->converting = false;
+    s->reg_started = false;
+    s->inj_started = false;
+    s->reg_rank = 0;
+    s->inj_rank = 0;
+    s->reg_triggers = 0;
+    s->inj_triggers = 0;
+}
+
+/* Handles a pulse from one of the timers (see STM32_ADC_EXT_TRIGGER).  QEMU
+ * only serves its timers every so often, so the timer events come in bunches
+ * and a trigger may well arrive while its group is still being converted
+ * for the previous one.  Such triggers are counted and then served one
+ * after the other, rather than ignored as on the real chip. */
+static void stm32_adc_trigger_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+    uint32_t extsel = (s->ADC_CR2 & ADC_CR2_EXTSEL_MASK) >>
+                      ADC_CR2_EXTSEL_START;
+    uint32_t jextsel = (s->ADC_CR2 & ADC_CR2_JEXTSEL_MASK) >>
+                       ADC_CR2_JEXTSEL_START;
+
+    if (!level) {
+        return;
+    }
+
+    stm32_adc_sync(s);
+    if (n == STM32_ADC_EXT_TRIGGER(extsel) &&
+        IS_BIT_SET(s->ADC_CR2, ADC_CR2_EXTTRIG_BIT)) {
+        if (s->reg_started) {
+            s->reg_triggers = MIN(s->reg_triggers + 1, STM32_ADC_MAX_TRIGGERS);
+        } else {
+            stm32_adc_start_regular(s);
+        }
+    } else if (n == STM32_ADC_JEXT_TRIGGER(jextsel) &&
+               IS_BIT_SET(s->ADC_CR2, ADC_CR2_JEXTTRIG_BIT)) {
+        if (s->inj_started) {
+            s->inj_triggers = MIN(s->inj_triggers + 1, STM32_ADC_MAX_TRIGGERS);
+        } else {
+            stm32_adc_start_injected(s);
+        }
+    }
+    stm32_adc_update_irq(s);
+    stm32_adc_schedule(s);
+}
+
+/* Handle a change in the ADC clock.  A conversion in progress when the clock
+ * stops is started again once it is back. */
+static void stm32_adc_clk_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    assert(n == 0);
+
+    stm32_adc_sync(s);
+    s->freq = s->clk.freq;
+    DPRINTF("%s clock is set to %lu Hz.\n", s->busdev.qdev.id,
+            (unsigned long)s->freq);
+    if (s->freq == 0 || !s->converting) {
+        stm32_adc_start_next(s, qemu_get_clock_ns(vm_clock));
+    }
+    stm32_adc_schedule(s);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_adc_ADC_CR1_write(Stm32Adc *s, uint32_t new_value,
+                                    bool init)
+{
+    if (new_value & ADC_CR1_DUALMOD_MASK) {
+        stm32_hw_warn("%s: dual modes are not supported", s->busdev.qdev.id);
+    }
+    if (IS_BIT_SET(new_value, ADC_CR1_JDISCEN_BIT)) {
+        stm32_hw_warn("%s: injected discontinuous mode is not supported",
+                      s->busdev.qdev.id);
+    }
+    s->ADC_CR1 = new_value & 0x00cfffff;
+}
+
+static void stm32_adc_ADC_CR2_write(Stm32Adc *s, uint32_t new_value,
+                                    bool init)
+{
+    uint32_t old_value = s->ADC_CR2;
+    bool was_on = IS_BIT_SET(old_value, ADC_CR2_ADON_BIT);
+    uint32_t sel;
+
+    new_value &= 0x00fef90f;
+    /* CAL is only cleared by the hardware, and RSTCAL completes at once. */
+    s->ADC_CR2 = (new_value | (old_value & (1 << ADC_CR2_CAL_BIT))) &
+                 ~(1 << ADC_CR2_RSTCAL_BIT);
+
+    if (!IS_BIT_SET(new_value, ADC_CR2_ADON_BIT)) {
+        stm32_adc_stop(s);
+        return;
+    }
+    if (!was_on) {
+        /* Power up.  The stabilization time is not modelled. */
+        if (!init && s->freq > 14000000) {
+            stm32_hw_warn("%s: ADC clock (%lu Hz) exceeds 14 MHz",
+                          s->busdev.qdev.id, (unsigned long)s->freq);
+        }
+        return;
+    }
+
+    /* Writing ADON again starts a regular conversion, unless some other bit
+     * is changed at the same time. */
+    if (new_value == (old_value & ~(1 << ADC_CR2_CAL_BIT)) ||
+        new_value == old_value) {
+        stm32_adc_start_regular(s);
+    }
+
+    if (IS_BIT_SET(new_value, ADC_CR2_CAL_BIT) &&
+        !IS_BIT_SET(old_value, ADC_CR2_CAL_BIT)) {
+        s->cal_end_ns = qemu_get_clock_ns(vm_clock) +
+                        muldiv64(ADC_CAL_CYCLES, get_ticks_per_sec(),
+                                 MAX(s->freq, 1));
+    }
+
+    /* SWSTART and JSWSTART are cleared as soon as their group starts. */
+    sel = (new_value & ADC_CR2_EXTSEL_MASK) >> ADC_CR2_EXTSEL_START;
+    if (IS_BIT_SET(new_value, ADC_CR2_SWSTART_BIT)) {
+        RESET_BIT(s->ADC_CR2, ADC_CR2_SWSTART_BIT);
+        if (IS_BIT_SET(new_value, ADC_CR2_EXTTRIG_BIT) &&
+            sel == ADC_EXTSEL_SWSTART) {
+            stm32_adc_start_regular(s);
+        }
+    }
+    sel = (new_value & ADC_CR2_JEXTSEL_MASK) >> ADC_CR2_JEXTSEL_START;
+    if (IS_BIT_SET(new_value, ADC_CR2_JSWSTART_BIT)) {
+        RESET_BIT(s->ADC_CR2, ADC_CR2_JSWSTART_BIT);
+        if (IS_BIT_SET(new_value, ADC_CR2_JEXTTRIG_BIT) &&
+            sel == ADC_EXTSEL_SWSTART) {
+            stm32_adc_start_injected(s);
+        }
+    }
+}
+
+static uint32_t stm32_adc_ADC_DR_read(Stm32Adc *s)
+{
+    RESET_BIT(s->ADC_SR, ADC_SR_EOC_BIT);
+    qemu_irq_lower(s->dma_req);
+    return s->ADC_DR;
+}
+
+static uint64_t stm32_adc_readw(Stm32Adc *s, hwaddr offset)
+{
+    stm32_adc_sync(s);
+
+    switch (offset) {
+        case ADC_SR_OFFSET:
+            return s->ADC_SR;
+        case ADC_CR1_OFFSET:
+            return s->ADC_CR1;
+        case ADC_CR2_OFFSET:
+            return s->ADC_CR2;
+        case ADC_SMPR1_OFFSET:
+            return s->ADC_SMPR[0];
+        case ADC_SMPR2_OFFSET:
+            return s->ADC_SMPR[1];
+        case ADC_JOFR1_OFFSET ... ADC_JOFR4_OFFSET:
+            return s->ADC_JOFR[(offset - ADC_JOFR1_OFFSET) / 4];
+        case ADC_HTR_OFFSET:
+            return s->ADC_HTR;
+        case ADC_LTR_OFFSET:
+            return s->ADC_LTR;
+        case ADC_SQR1_OFFSET ... ADC_SQR3_OFFSET:
+            return s->ADC_SQR[(offset - ADC_SQR1_OFFSET) / 4];
+        case ADC_JSQR_OFFSET:
+            return s->ADC_JSQR;
+        case ADC_JDR1_OFFSET ... ADC_JDR4_OFFSET:
+            return s->ADC_JDR[(offset - ADC_JDR1_OFFSET) / 4];
+        case ADC_DR_OFFSET:
+            return stm32_adc_ADC_DR_read(s);
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_adc_writew(Stm32Adc *s, hwaddr offset, uint64_t value)
+{
+    /* Account for the conversions done under the old settings before
+     * changing anything. */
+    stm32_adc_sync(s);
+
+    switch (offset) {
+        case ADC_SR_OFFSET:
+            /* Flags are cleared by writing 0. */
+            s->ADC_SR &= value;
+            break;
+        case ADC_CR1_OFFSET:
+            stm32_adc_ADC_CR1_write(s, value, false);
+            break;
+        case ADC_CR2_OFFSET:
+            stm32_adc_ADC_CR2_write(s, value, false);
+            break;
+        case ADC_SMPR1_OFFSET:
+            s->ADC_SMPR[0] = value & 0x00ffffff;
+            break;
+        case ADC_SMPR2_OFFSET:
+            s->ADC_SMPR[1] = value & 0x3fffffff;
+            break;
+        case ADC_JOFR1_OFFSET ... ADC_JOFR4_OFFSET:
+            s->ADC_JOFR[(offset - ADC_JOFR1_OFFSET) / 4] = value & ADC_DATA_MASK;
+            break;
+        case ADC_HTR_OFFSET:
+            s->ADC_HTR = value & ADC_DATA_MASK;
+            break;
+        case ADC_LTR_OFFSET:
+            s->ADC_LTR = value & ADC_DATA_MASK;
+            break;
+        case ADC_SQR1_OFFSET:
+            s->ADC_SQR[0] = value & 0x00ffffff;
+            break;
+        case ADC_SQR2_OFFSET:
+        case ADC_SQR3_OFFSET:
+            s->ADC_SQR[(offset - ADC_SQR1_OFFSET) / 4] = value & 0x3fffffff;
+            break;
+        case ADC_JSQR_OFFSET:
+            s->ADC_JSQR = value & 0x003fffff;
+            break;
+        case ADC_JDR1_OFFSET ... ADC_JDR4_OFFSET:
+        case ADC_DR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+
+    stm32_adc_update_irq(s);
+    stm32_adc_schedule(s);
+}
+
+static uint64_t stm32_adc_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            /* The DMA reads ADC_DR as a halfword when PSIZE is 16 bits. */
+            value = STM32_REG_READH_VALUE(offset, stm32_adc_readw(s, offset & ~3));
+            break;
+        case WORD_ACCESS_SIZE:
+            value = stm32_adc_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_adc_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_adc_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Adc *s = (Stm32Adc *)opaque;
+
+    trace_stm32_adc_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_adc_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_adc_ops = {
+    .read = stm32_adc_read,
+    .write = stm32_adc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_adc_reset(DeviceState *dev)
+{
+    Stm32Adc *s = FROM_SYSBUS(Stm32Adc, SYS_BUS_DEVICE(dev));
+    int n;
+
+    s->ADC_SR = 0;
+    stm32_adc_ADC_CR1_write(s, 0x00000000, true);
+    s->ADC_CR2 = 0;
+    stm32_adc_ADC_CR2_write(s, 0x00000000, true);
+    s->ADC_SMPR[0] = 0;
+    s->ADC_SMPR[1] = 0;
+    for (n = 0; n < ADC_INJ_COUNT; n++) {
+        s->ADC_JOFR[n] = 0;
+        s->ADC_JDR[n] = 0;
+    }
+    s->ADC_HTR = ADC_DATA_MASK;
+    s->ADC_LTR = 0;
+    s->ADC_SQR[0] = 0;
+    s->ADC_SQR[1] = 0;
+    s->ADC_SQR[2] = 0;
+    s->ADC_JSQR = 0;
+    s->ADC_DR = 0;
+
+    s->samples_pos = 0;
+    s->last_sample = 0;
+
+    qemu_del_timer(s->timer);
+    qemu_irq_lower(s->dma_req);
+    stm32_adc_update_irq(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_adc_set_input(Stm32Adc *s, int channel, uint16_t value)
+{
+    assert(channel >= 0 && channel < ADC_CHANNEL_COUNT);
+
+    /* The conversions that completed before now take the old value. */
+    stm32_adc_sync(s);
+    s->input[channel] = value & ADC_DATA_MASK;
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_adc_instance_init(Object *obj)
+{
+    Stm32Adc *s = FROM_SYSBUS(Stm32Adc, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_adc_init(SysBusDevice *dev)
+{
+    Stm32Adc *s = FROM_SYSBUS(Stm32Adc, dev);
+    qemu_irq *clk_irq;
+    GError *err = NULL;
+
+
+    memory_region_init_io(&s->iomem, &stm32_adc_ops, s,
+                          "adc", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out(&dev->qdev, &s->dma_req, 1);
+    qdev_init_gpio_in(&dev->qdev, stm32_adc_trigger_irq_handler,
+                      STM32_ADC_TRIGGER_COUNT);
+
+    s->timer = qemu_new_timer_ns(vm_clock, stm32_adc_expire, s);
+
+    /* Register handler for ADC clock changes. */
+    clk_irq = qemu_allocate_irqs(stm32_adc_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev,
+                              clk_irq[0]);
+    s->freq = s->clk.freq;
+
+    if (s->samples_path && s->chr) {
+        hw_error("stm32_adc: samples and chardev cannot both be given");
+    }
+    if (s->samples_path) {
+        s->samples_file = g_mapped_file_new(s->samples_path, FALSE, &err);
+        if (!s->samples_file) {
+            hw_error("stm32_adc: cannot map %s: %s", s->samples_path,
+                     err->message);
+        }
+        s->samples = (const uint8_t *)g_mapped_file_get_contents(s->samples_file);
+        s->samples_len = g_mapped_file_get_length(s->samples_file);
+        if (s->samples_len < 2) {
+            hw_error("stm32_adc: %s holds no samples", s->samples_path);
+        }
+    }
+    if (s->chr) {
+        qemu_chr_add_handlers(s->chr, stm32_adc_can_receive,
+                              stm32_adc_receive, NULL, s);
+        replay_register_char_driver(s->chr);
+    }
+
+    return 0;
+}
+
+static Property stm32_adc_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Adc, periph, -1),
+    DEFINE_PROP_STRING("samples", Stm32Adc, samples_path),
+    DEFINE_PROP_CHR("chardev", Stm32Adc, chr),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_adc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_adc_init;
+    dc->reset = stm32_adc_reset;
+    dc->props = stm32_adc_properties;
+}
+
+static TypeInfo stm32_adc_info = {
+    .name  = "stm32_adc",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Adc),
+    .instance_init = stm32_adc_instance_init,
+    .class_init = stm32_adc_class_init
+};
+
+static void stm32_adc_register_types(void)
+{
+    type_register_static(&stm32_adc_info);
+}
+
+type_init(stm32_adc_register_types)
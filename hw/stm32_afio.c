@@ -20,6 +20,7 @@
  */
 
 #include "stm32f1xx.h"
+#include "trace.h"
 
 
 
@@ -32,6 +33,8 @@
 #define AFIO_MAPR_USART3_REMAP_MASK 0x00000030
 #define AFIO_MAPR_USART2_REMAP_BIT 3
 #define AFIO_MAPR_USART1_REMAP_BIT 2
+/* The remap fields.  SWJ_CFG (bits 26:24) is write-only. */
+#define AFIO_MAPR_REMAP_MASK 0x001fffff
 
 #define AFIO_EXTICR_START 0x08
 #define AFIO_EXTICR_COUNT 4
@@ -43,19 +46,107 @@
 
 #define AFIO_EXTI_PER_CR 4
 
+#define AFIO_MAX_GPIO (STM32F1XX_GPIOG - STM32F1XX_GPIOA + 1)
+
+/* PIN ROUTING */
+
+/* What a route's pin has to be configured as. */
+typedef enum {
+    AFIO_PIN_AF_OUT,    /* Alternate function output */
+    AFIO_PIN_IN,        /* Input */
+    AFIO_PIN_ANY        /* Either (e.g. timer channels, capture or compare) */
+} Stm32AfioPinKind;
+
+#define AFIO_NO_PIN { -1, 0 }
+
+/* Where the signal of a route ends up for each value of its peripheral's
+ * MAPR field (RM0008 section 9.3).  A field of width 0 means the
+ * peripheral cannot be remapped.  Pins are given as GPIO index (0 for
+ * GPIOA...) and pin number; values the reference manual leaves unused
+ * have no pin. */
+typedef struct {
+    stm32_periph_t periph;
+    uint8_t mapr_start;
+    uint8_t mapr_width;
+    Stm32AfioPinKind kind;
+    struct {
+        int8_t gpio_index;
+        uint8_t pin;
+    } pins[4];
+} Stm32AfioRouteDesc;
+
+static const Stm32AfioRouteDesc stm32_afio_routes[STM32_AFIO_ROUTE_COUNT] = {
+    [STM32_AFIO_USART1_TX] = { STM32F1XX_UART1, 2, 1, AFIO_PIN_AF_OUT,
+                               { { 0, 9 }, { 1, 6 } } },
+    [STM32_AFIO_USART1_RX] = { STM32F1XX_UART1, 2, 1, AFIO_PIN_IN,
+                               { { 0, 10 }, { 1, 7 } } },
+    [STM32_AFIO_USART2_TX] = { STM32F1XX_UART2, 3, 1, AFIO_PIN_AF_OUT,
+                               { { 0, 2 }, { 3, 5 } } },
+    [STM32_AFIO_USART2_RX] = { STM32F1XX_UART2, 3, 1, AFIO_PIN_IN,
+                               { { 0, 3 }, { 3, 6 } } },
+    [STM32_AFIO_USART3_TX] = { STM32F1XX_UART3, 4, 2, AFIO_PIN_AF_OUT,
+                               { { 1, 10 }, { 2, 10 }, AFIO_NO_PIN,
+                                 { 3, 8 } } },
+    [STM32_AFIO_USART3_RX] = { STM32F1XX_UART3, 4, 2, AFIO_PIN_IN,
+                               { { 1, 11 }, { 2, 11 }, AFIO_NO_PIN,
+                                 { 3, 9 } } },
+    [STM32_AFIO_UART4_TX] = { STM32F1XX_UART4, 0, 0, AFIO_PIN_AF_OUT,
+                              { { 2, 10 } } },
+    [STM32_AFIO_UART4_RX] = { STM32F1XX_UART4, 0, 0, AFIO_PIN_IN,
+                              { { 2, 11 } } },
+    [STM32_AFIO_UART5_TX] = { STM32F1XX_UART5, 0, 0, AFIO_PIN_AF_OUT,
+                              { { 2, 12 } } },
+    [STM32_AFIO_UART5_RX] = { STM32F1XX_UART5, 0, 0, AFIO_PIN_IN,
+                              { { 3, 2 } } },
+    [STM32_AFIO_SPI1_SCK] = { STM32F1XX_SPI1, 0, 1, AFIO_PIN_AF_OUT,
+                              { { 0, 5 }, { 1, 3 } } },
+    [STM32_AFIO_SPI1_MISO] = { STM32F1XX_SPI1, 0, 1, AFIO_PIN_IN,
+                               { { 0, 6 }, { 1, 4 } } },
+    [STM32_AFIO_SPI1_MOSI] = { STM32F1XX_SPI1, 0, 1, AFIO_PIN_AF_OUT,
+                               { { 0, 7 }, { 1, 5 } } },
+    [STM32_AFIO_I2C1_SCL] = { STM32F1XX_I2C1, 1, 1, AFIO_PIN_AF_OUT,
+                              { { 1, 6 }, { 1, 8 } } },
+    [STM32_AFIO_I2C1_SDA] = { STM32F1XX_I2C1, 1, 1, AFIO_PIN_AF_OUT,
+                              { { 1, 7 }, { 1, 9 } } },
+    [STM32_AFIO_TIM1_CH1] = { STM32F1XX_TIM1, 6, 2, AFIO_PIN_ANY,
+                              { { 0, 8 }, { 0, 8 }, AFIO_NO_PIN,
+                                { 4, 9 } } },
+    [STM32_AFIO_TIM2_CH1] = { STM32F1XX_TIM2, 8, 2, AFIO_PIN_ANY,
+                              { { 0, 0 }, { 0, 15 }, { 0, 0 },
+                                { 0, 15 } } },
+    [STM32_AFIO_TIM3_CH1] = { STM32F1XX_TIM3, 10, 2, AFIO_PIN_ANY,
+                              { { 0, 6 }, AFIO_NO_PIN, { 1, 4 },
+                                { 2, 6 } } },
+    [STM32_AFIO_TIM4_CH1] = { STM32F1XX_TIM4, 12, 1, AFIO_PIN_ANY,
+                              { { 1, 6 }, { 3, 12 } } },
+    [STM32_AFIO_CAN_RX] = { STM32F1XX_CAN, 13, 2, AFIO_PIN_IN,
+                            { { 0, 11 }, AFIO_NO_PIN, { 1, 8 },
+                              { 3, 0 } } },
+    [STM32_AFIO_CAN_TX] = { STM32F1XX_CAN, 13, 2, AFIO_PIN_AF_OUT,
+                            { { 0, 12 }, AFIO_NO_PIN, { 1, 9 },
+                              { 3, 1 } } },
+};
+
 struct Stm32Afio {
     /* Inherited */
     SysBusDevice busdev;
 
     /* Properties */
-    void *stm32_rcc_prop;
-    void *stm32_exti_prop;
+    Stm32Rcc *stm32_rcc;
+    Stm32Exti *stm32_exti;
+    void *stm32_gpio_prop;
+    uint32_t gpio_count;
 
     /* Private */
     MemoryRegion iomem;
 
-    Stm32Rcc *stm32_rcc;
-    Stm32Exti *stm32_exti;
+    Stm32PeriphClk clk;
+    Stm32Gpio **stm32_gpio;
+
+    /* Bit n is set when route n (Stm32AfioRoute) goes to a pin that is
+     * configured for it.  Rebuilt when MAPR or a GPIO's CRL/CRH is
+     * written, so that checking a route needs no look-up. */
+    uint32_t route_valid;
 
     uint32_t
         USART1_REMAP,
@@ -70,21 +161,70 @@ struct Stm32Afio {
 
 
 
+/* HELPER FUNCTIONS */
+
+static uint32_t stm32_afio_route_map(Stm32Afio *s,
+                                     const Stm32AfioRouteDesc *route)
+{
+    return (s->AFIO_MAPR >> route->mapr_start) &
+           ((1 << route->mapr_width) - 1);
+}
+
+static bool stm32_afio_check_route(Stm32Afio *s,
+                                   const Stm32AfioRouteDesc *route)
+{
+    uint32_t map = stm32_afio_route_map(s, route);
+    int gpio_index = route->pins[map].gpio_index;
+    unsigned pin = route->pins[map].pin;
+    uint8_t mode, config;
+
+    if((gpio_index < 0) || (gpio_index >= s->gpio_count)) {
+        return false;
+    }
+
+    mode = stm32_gpio_get_mode_bits(s->stm32_gpio[gpio_index], pin);
+    config = stm32_gpio_get_config_bits(s->stm32_gpio[gpio_index], pin);
+    if(mode == STM32_GPIO_MODE_IN) {
+        return (route->kind != AFIO_PIN_AF_OUT) &&
+               (config != STM32_GPIO_IN_ANALOG);
+    } else {
+        return (route->kind != AFIO_PIN_IN) &&
+               ((config == STM32_GPIO_OUT_ALT_PUSHPULL) ||
+                (config == STM32_GPIO_OUT_ALT_OPEN));
+    }
+}
+
+static void stm32_afio_update_routes(Stm32Afio *s)
+{
+    int i;
+
+    s->route_valid = 0;
+    for(i = 0; i < STM32_AFIO_ROUTE_COUNT; i++) {
+        if(stm32_afio_check_route(s, &stm32_afio_routes[i])) {
+            s->route_valid |= 1 << i;
+        }
+    }
+}
+
+
+
 /* REGISTER IMPLEMENTATION */
 
 static uint32_t stm32_afio_AFIO_MAPR_read(Stm32Afio *s)
 {
-    return (s->USART1_REMAP << AFIO_MAPR_USART1_REMAP_BIT) |
-           (s->USART2_REMAP << AFIO_MAPR_USART2_REMAP_BIT) |
-           (s->USART3_REMAP << AFIO_MAPR_USART3_REMAP_START);
+    return s->AFIO_MAPR;
 }
 
 static void stm32_afio_AFIO_MAPR_write(Stm32Afio *s, uint32_t new_value,
                                         bool init)
 {
-    s->USART1_REMAP = GET_BIT_VALUE(s->AFIO_MAPR, AFIO_MAPR_USART1_REMAP_BIT);
-    s->USART2_REMAP = GET_BIT_VALUE(s->AFIO_MAPR, AFIO_MAPR_USART2_REMAP_BIT);
+    s->AFIO_MAPR = new_value & AFIO_MAPR_REMAP_MASK;
+
+    s->USART1_REMAP = GET_BIT_VALUE(new_value, AFIO_MAPR_USART1_REMAP_BIT);
+    s->USART2_REMAP = GET_BIT_VALUE(new_value, AFIO_MAPR_USART2_REMAP_BIT);
     s->USART3_REMAP = (new_value & AFIO_MAPR_USART3_REMAP_MASK) >> AFIO_MAPR_USART3_REMAP_START;
+
+    stm32_afio_update_routes(s);
 }
 
 /* Write the External Interrupt Configuration Register.
@@ -177,16 +317,24 @@ static uint64_t stm32_afio_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
     Stm32Afio *s = (Stm32Afio *)opaque;
+    uint64_t value;
 
-    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, STM32F1XX_AFIO, &s->busdev);
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
 
     switch(size) {
         case 4:
-            return stm32_afio_readw(opaque, offset);
+            value = stm32_afio_readw(opaque, offset);
+            break;
         default:
             STM32_BAD_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_afio_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_afio_write(void *opaque, hwaddr offset,
@@ -194,7 +342,11 @@ static void stm32_afio_write(void *opaque, hwaddr offset,
 {
     Stm32Afio *s = (Stm32Afio *)opaque;
 
-    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, STM32F1XX_AFIO, &s->busdev);
+    trace_stm32_afio_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
 
     switch(size) {
         case 4:
@@ -232,17 +384,27 @@ static void stm32_afio_reset(DeviceState *dev)
 
 uint32_t stm32_afio_get_periph_map(Stm32Afio *s, stm32_periph_t periph)
 {
-    switch(periph) {
-        case STM32F1XX_UART1:
-            return s->USART1_REMAP;
-        case STM32F1XX_UART2:
-            return s->USART2_REMAP;
-        case STM32F1XX_UART3:
-            return s->USART3_REMAP;
-        default:
-            hw_error("Invalid peripheral");
-            break;
+    int i;
+
+    for(i = 0; i < STM32_AFIO_ROUTE_COUNT; i++) {
+        if(stm32_afio_routes[i].periph == periph) {
+            return stm32_afio_route_map(s, &stm32_afio_routes[i]);
+        }
     }
+    hw_error("Invalid peripheral");
+    return 0;
+}
+
+bool stm32_afio_route_valid(Stm32Afio *s, Stm32AfioRoute route)
+{
+    assert(route < STM32_AFIO_ROUTE_COUNT);
+
+    return IS_BIT_SET(s->route_valid, route);
+}
+
+void stm32_afio_gpio_config_changed(Stm32Afio *s)
+{
+    stm32_afio_update_routes(s);
 }
 
 
@@ -250,23 +412,72 @@ uint32_t stm32_afio_get_periph_map(Stm32Afio *s, stm32_periph_t periph)
 
 /* DEVICE INITIALIZATION */
 
+static void stm32_afio_instance_init(Object *obj)
+{
+    Stm32Afio *s = FROM_SYSBUS(Stm32Afio, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32_exti", "stm32_exti",
+                             (Object **)&s->stm32_exti, NULL);
+}
+
 static int stm32_afio_init(SysBusDevice *dev)
 {
+    int i;
+
     Stm32Afio *s = FROM_SYSBUS(Stm32Afio, dev);
 
-    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
-    s->stm32_exti = (Stm32Exti *)s->stm32_exti_prop;
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_AFIO, dev,
+                              NULL);
+    s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
+
+    if(s->gpio_count > AFIO_MAX_GPIO) {
+        hw_error("stm32_afio: gpio_count must be at most %d", AFIO_MAX_GPIO);
+    }
 
     memory_region_init_io(&s->iomem, &stm32_afio_ops, s,
                           "afio", 0x03ff);
     sysbus_init_mmio(dev, &s->iomem);
 
+    /* Have the GPIOs report their configuration changes. */
+    for(i = 0; i < s->gpio_count; i++) {
+        stm32_gpio_set_afio(s->stm32_gpio[i], s);
+    }
+
     return 0;
 }
 
+/* Rebuilds the route cache from the loaded MAPR.  The GPIOs rebuild it
+ * again when they are loaded, in case they come after. */
+static int stm32_afio_post_load(void *opaque, int version_id)
+{
+    stm32_afio_update_routes((Stm32Afio *)opaque);
+
+    return 0;
+}
+
+/* The EXTI saves the routing that EXTICR selects, so restoring the
+ * registers is enough. */
+static const VMStateDescription vmstate_stm32_afio = {
+    .name = "stm32_afio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_afio_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(USART1_REMAP, Stm32Afio),
+        VMSTATE_UINT32(USART2_REMAP, Stm32Afio),
+        VMSTATE_UINT32(USART3_REMAP, Stm32Afio),
+        VMSTATE_UINT32(AFIO_MAPR, Stm32Afio),
+        VMSTATE_UINT32_ARRAY(AFIO_EXTICR, Stm32Afio, AFIO_EXTICR_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_afio_properties[] = {
-    DEFINE_PROP_PTR("stm32_rcc", Stm32Afio, stm32_rcc_prop),
-    DEFINE_PROP_PTR("stm32_exti", Stm32Afio, stm32_exti_prop),
+    DEFINE_PROP_PTR("stm32_gpio", Stm32Afio, stm32_gpio_prop),
+    DEFINE_PROP_UINT32("gpio_count", Stm32Afio, gpio_count, 0),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -278,12 +489,14 @@ static void stm32_afio_class_init(ObjectClass *klass, void *data)
     k->init = stm32_afio_init;
     dc->reset = stm32_afio_reset;
     dc->props = stm32_afio_properties;
+    dc->vmsd = &vmstate_stm32_afio;
 }
 
 static TypeInfo stm32_afio_info = {
     .name  = "stm32_afio",
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_size  = sizeof(Stm32Afio),
+    .instance_init = stm32_afio_instance_init,
     .class_init = stm32_afio_class_init
 };
 
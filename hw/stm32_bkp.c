@@ -0,0 +1,266 @@
+/*
+ * STM32 Microcontroller BKP (Backup Registers) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The backup registers are in the backup domain: they are cleared at power
+ * on and by a backup domain reset (BDRST in RCC_BDCR), and keep their value
+ * through a system reset and in snapshots.  The tamper pin is not
+ * emulated, so tamper events never happen.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+/* BKP_DR1 to BKP_DR10 are at 0x04 to 0x28, BKP_DR11 to BKP_DR42 (only on
+ * high-density parts) at 0x40 to 0xbc. */
+#define BKP_DR1_OFFSET 0x04
+#define BKP_DR11_OFFSET 0x40
+#define BKP_DR_LOW_COUNT 10
+#define BKP_DR_MAX_COUNT 42
+
+#define BKP_RTCCR_OFFSET 0x2c
+#define BKP_RTCCR_MASK 0x03ff
+
+#define BKP_CR_OFFSET 0x30
+#define BKP_CR_MASK 0x0003
+
+#define BKP_CSR_OFFSET 0x34
+/* Only TPIE is stored: CTE and CTI read as 0, and TEF and TIF are never
+ * set. */
+#define BKP_CSR_MASK 0x0004
+
+typedef struct Stm32Bkp {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+    uint32_t dr_count;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+    Notifier backup_reset_notifier;
+
+    uint16_t BKP_DR[BKP_DR_MAX_COUNT];
+    uint32_t
+        BKP_RTCCR,
+        BKP_CR,
+        BKP_CSR;
+} Stm32Bkp;
+
+
+
+
+/* HELPER FUNCTIONS */
+
+/* Returns the index of the data register at offset, or -1. */
+static int stm32_bkp_dr_index(Stm32Bkp *s, hwaddr offset)
+{
+    int n;
+
+    if(offset >= BKP_DR1_OFFSET &&
+       offset < BKP_DR1_OFFSET + BKP_DR_LOW_COUNT * 4) {
+        n = (offset - BKP_DR1_OFFSET) / 4;
+    } else if(offset >= BKP_DR11_OFFSET) {
+        n = BKP_DR_LOW_COUNT + (offset - BKP_DR11_OFFSET) / 4;
+    } else {
+        return -1;
+    }
+    return (offset % 4 == 0 && n < s->dr_count) ? n : -1;
+}
+
+static void stm32_bkp_backup_reset(Notifier *notifier, void *data)
+{
+    Stm32Bkp *s = container_of(notifier, Stm32Bkp, backup_reset_notifier);
+
+    memset(s->BKP_DR, 0, sizeof(s->BKP_DR));
+    s->BKP_RTCCR = 0;
+    s->BKP_CR = 0;
+    s->BKP_CSR = 0;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_bkp_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+    uint64_t value;
+    int n;
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    switch(offset) {
+        case BKP_RTCCR_OFFSET:
+            value = s->BKP_RTCCR;
+            break;
+        case BKP_CR_OFFSET:
+            value = s->BKP_CR;
+            break;
+        case BKP_CSR_OFFSET:
+            value = s->BKP_CSR;
+            break;
+        default:
+            n = stm32_bkp_dr_index(s, offset);
+            if(n < 0) {
+                STM32_BAD_REG(offset, size);
+                value = 0;
+            } else {
+                value = s->BKP_DR[n];
+            }
+            break;
+    }
+
+    trace_stm32_bkp_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_bkp_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Bkp *s = (Stm32Bkp *)opaque;
+    int n;
+
+    trace_stm32_bkp_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(offset) {
+        case BKP_RTCCR_OFFSET:
+            s->BKP_RTCCR = value & BKP_RTCCR_MASK;
+            break;
+        case BKP_CR_OFFSET:
+            s->BKP_CR = value & BKP_CR_MASK;
+            break;
+        case BKP_CSR_OFFSET:
+            s->BKP_CSR = value & BKP_CSR_MASK;
+            break;
+        default:
+            n = stm32_bkp_dr_index(s, offset);
+            if(n < 0) {
+                STM32_BAD_REG(offset, size);
+            } else {
+                s->BKP_DR[n] = value;
+            }
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_bkp_ops = {
+    .read = stm32_bkp_read,
+    .write = stm32_bkp_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 2,
+        .max_access_size = 4,
+    }
+};
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_bkp_instance_init(Object *obj)
+{
+    Stm32Bkp *s = FROM_SYSBUS(Stm32Bkp, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_bkp_init(SysBusDevice *dev)
+{
+    Stm32Bkp *s = FROM_SYSBUS(Stm32Bkp, dev);
+
+    if(s->dr_count > BKP_DR_MAX_COUNT) {
+        hw_error("stm32_bkp: dr_count must be at most %d", BKP_DR_MAX_COUNT);
+    }
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_BKP, dev,
+                              NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_bkp_ops, s,
+                          "bkp", 0x03ff);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    /* Power on reset of the backup domain.  There is no dc->reset, since
+     * a system reset leaves all the registers alone. */
+    s->backup_reset_notifier.notify = stm32_bkp_backup_reset;
+    stm32f1xx_rcc_add_backup_reset_notifier(s->stm32_rcc,
+                                            &s->backup_reset_notifier);
+    stm32_bkp_backup_reset(&s->backup_reset_notifier, NULL);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_bkp = {
+    .name = "stm32_bkp",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(BKP_DR, Stm32Bkp, BKP_DR_MAX_COUNT),
+        VMSTATE_UINT32(BKP_RTCCR, Stm32Bkp),
+        VMSTATE_UINT32(BKP_CR, Stm32Bkp),
+        VMSTATE_UINT32(BKP_CSR, Stm32Bkp),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_bkp_properties[] = {
+    DEFINE_PROP_UINT32("dr_count", Stm32Bkp, dr_count, BKP_DR_LOW_COUNT),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_bkp_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_bkp_init;
+    dc->props = stm32_bkp_properties;
+    dc->vmsd = &vmstate_stm32_bkp;
+}
+
+static TypeInfo stm32_bkp_info = {
+    .name  = "stm32_bkp",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Bkp),
+    .instance_init = stm32_bkp_instance_init,
+    .class_init = stm32_bkp_class_init
+};
+
+static void stm32_bkp_register_types(void)
+{
+    type_register_static(&stm32_bkp_info);
+}
+
+type_init(stm32_bkp_register_types)
@@ -0,0 +1,1102 @@
+/*
+ * STM32 Microcontroller bxCAN controller
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The controller has the three transmit mailboxes, the two three-message
+ * receive FIFOs and the filter banks of the reference manual, and sends
+ * and receives its frames on one of the virtual CAN buses of
+ * stm32_can_hub.c, which the "canbus" property selects.  A frame takes
+ * the time given by CAN_BTR and the peripheral clock to send (bit stuffing
+ * is not counted), after which it is delivered to the other controllers
+ * on the bus.  The loop back and silent modes are modelled.
+ *
+ * The acceptance filters are translated into a table whenever they have
+ * changed, the next time a frame comes in: every filter of the table
+ * compares the frame's identifier, laid out as in CAN_RIxR, with one
+ * masked value, and the table is ordered by the filter priority rules, so
+ * the first match decides the FIFO and the filter match index.
+ *
+ * Bus errors, arbitration between controllers and the error counters are
+ * not modelled: every frame is received correctly by every other node.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_CAN
+
+#ifdef DEBUG_STM32_CAN
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_CAN: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define CAN_MCR_OFFSET 0x000
+#define CAN_MCR_INRQ_BIT 0
+#define CAN_MCR_SLEEP_BIT 1
+#define CAN_MCR_TXFP_BIT 2
+#define CAN_MCR_RFLM_BIT 3
+#define CAN_MCR_AWUM_BIT 5
+#define CAN_MCR_TTCM_BIT 7
+#define CAN_MCR_RESET_BIT 15
+
+#define CAN_MSR_OFFSET 0x004
+#define CAN_MSR_INAK_BIT 0
+#define CAN_MSR_SLAK_BIT 1
+#define CAN_MSR_ERRI_BIT 2
+#define CAN_MSR_WKUI_BIT 3
+#define CAN_MSR_SLAKI_BIT 4
+/* Flags which software clears by writing 1 */
+#define CAN_MSR_W1C_MASK 0x0000001c
+/* SAMP and RX: the bus is idle (recessive) */
+#define CAN_MSR_IDLE 0x00000c00
+
+#define CAN_TSR_OFFSET 0x008
+#define CAN_TSR_RQCP_BIT(m) (8 * (m))
+#define CAN_TSR_TXOK_BIT(m) (8 * (m) + 1)
+#define CAN_TSR_TERR_BIT(m) (8 * (m) + 3)
+#define CAN_TSR_ABRQ_BIT(m) (8 * (m) + 7)
+#define CAN_TSR_MAILBOX_MASK(m) (0x0000008f << (8 * (m)))
+#define CAN_TSR_CODE_START 24
+#define CAN_TSR_TME_BIT(m) (26 + (m))
+#define CAN_TSR_LOW_BIT(m) (29 + (m))
+
+#define CAN_RF0R_OFFSET 0x00c
+#define CAN_RF1R_OFFSET 0x010
+#define CAN_RFR_FULL_BIT 3
+#define CAN_RFR_FOVR_BIT 4
+#define CAN_RFR_RFOM_BIT 5
+
+#define CAN_IER_OFFSET 0x014
+#define CAN_IER_TMEIE_BIT 0
+#define CAN_IER_FMPIE_BIT(f) (1 + 3 * (f))
+#define CAN_IER_FFIE_BIT(f) (2 + 3 * (f))
+#define CAN_IER_FOVIE_BIT(f) (3 + 3 * (f))
+#define CAN_IER_ERRIE_BIT 15
+#define CAN_IER_WKUIE_BIT 16
+#define CAN_IER_SLKIE_BIT 17
+
+#define CAN_ESR_OFFSET 0x018
+
+#define CAN_BTR_OFFSET 0x01c
+#define CAN_BTR_BRP_MASK 0x000003ff
+#define CAN_BTR_TS1_START 16
+#define CAN_BTR_TS1_MASK 0x000f0000
+#define CAN_BTR_TS2_START 20
+#define CAN_BTR_TS2_MASK 0x00700000
+#define CAN_BTR_LBKM_BIT 30
+#define CAN_BTR_SILM_BIT 31
+
+/* Transmit mailboxes, then receive FIFO mailboxes, 0x10 bytes apart */
+#define CAN_TX_MAILBOX_OFFSET 0x180
+#define CAN_RX_MAILBOX_OFFSET 0x1b0
+#define CAN_MAILBOX_END 0x1d0
+#define CAN_TIR_TXRQ_BIT 0
+#define CAN_XIR_RTR_BIT 1
+#define CAN_XIR_IDE_BIT 2
+#define CAN_TDTR_TGT_BIT 8
+
+#define CAN_FMR_OFFSET 0x200
+#define CAN_FMR_FINIT_BIT 0
+#define CAN_FM1R_OFFSET 0x204
+#define CAN_FS1R_OFFSET 0x20c
+#define CAN_FFA1R_OFFSET 0x214
+#define CAN_FA1R_OFFSET 0x21c
+#define CAN_FR_OFFSET 0x240
+
+#define STM32_CAN_TX_MAILBOX_COUNT 3
+#define STM32_CAN_FIFO_COUNT 2
+#define STM32_CAN_FIFO_DEPTH 3
+#define STM32_CAN_FILTER_BANK_MAX 28
+
+/* Frame length in bits, without bit stuffing.  It includes the
+ * intermission, and eight bits for every data byte. */
+#define STM32_CAN_STD_FRAME_BITS 47
+#define STM32_CAN_EXT_FRAME_BITS 67
+
+typedef struct {
+    uint32_t IR, DTR, DLR, DHR;
+} Stm32CanMailbox;
+
+typedef struct {
+    Stm32CanMailbox mailbox[STM32_CAN_FIFO_DEPTH];
+    int head, count;
+    bool full, overrun;
+} Stm32CanFifo;
+
+/* One filter of the translated table.  A frame matches if its identifier
+ * word, masked with mask, equals value. */
+typedef struct {
+    uint32_t mask, value;
+    uint8_t fifo;
+    uint8_t fmi;
+} Stm32CanFilter;
+
+struct Stm32Can {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    /* Id of the virtual CAN bus */
+    uint32_t canbus;
+    /* SocketCAN interface the bus is bridged to, if any */
+    char *host;
+    uint32_t filter_bank_count;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    Stm32CanHubPort *port;
+
+    /* Register Values */
+    uint32_t
+        CAN_MCR,
+        CAN_MSR,
+        CAN_TSR,
+        CAN_IER,
+        CAN_ESR,
+        CAN_BTR,
+        CAN_FMR,
+        CAN_FM1R,
+        CAN_FS1R,
+        CAN_FFA1R,
+        CAN_FA1R;
+    uint32_t CAN_FR[STM32_CAN_FILTER_BANK_MAX][2];
+
+    Stm32CanMailbox tx_mailbox[STM32_CAN_TX_MAILBOX_COUNT];
+    /* When each pending mailbox was requested, for TXFP */
+    uint32_t tx_seq[STM32_CAN_TX_MAILBOX_COUNT];
+    uint32_t tx_seq_next;
+    /* The mailbox being sent, or -1 */
+    int tx_current;
+    QEMUTimer *tx_timer;
+
+    Stm32CanFifo fifo[STM32_CAN_FIFO_COUNT];
+
+    Stm32CanFilter filter[STM32_CAN_FILTER_BANK_MAX * 4];
+    int filter_count;
+    bool filter_dirty;
+
+    qemu_irq tx_irq, rx_irq[STM32_CAN_FIFO_COUNT], sce_irq;
+};
+
+
+
+
+/* INTERRUPTS */
+
+static void stm32_can_update_irq(Stm32Can *s)
+{
+    bool level;
+    int f;
+
+    /* Lines are numbered TX, RX0, RX1, SCE in the traces. */
+    level = IS_BIT_SET(s->CAN_IER, CAN_IER_TMEIE_BIT) &&
+            (IS_BIT_SET(s->CAN_TSR, CAN_TSR_RQCP_BIT(0)) ||
+             IS_BIT_SET(s->CAN_TSR, CAN_TSR_RQCP_BIT(1)) ||
+             IS_BIT_SET(s->CAN_TSR, CAN_TSR_RQCP_BIT(2)));
+    trace_stm32_can_irq(s, 0, level);
+    qemu_set_irq(s->tx_irq, level);
+
+    for (f = 0; f < STM32_CAN_FIFO_COUNT; f++) {
+        Stm32CanFifo *fifo = &s->fifo[f];
+
+        level = (IS_BIT_SET(s->CAN_IER, CAN_IER_FMPIE_BIT(f)) &&
+                 fifo->count) ||
+                (IS_BIT_SET(s->CAN_IER, CAN_IER_FFIE_BIT(f)) &&
+                 fifo->full) ||
+                (IS_BIT_SET(s->CAN_IER, CAN_IER_FOVIE_BIT(f)) &&
+                 fifo->overrun);
+        trace_stm32_can_irq(s, 1 + f, level);
+        qemu_set_irq(s->rx_irq[f], level);
+    }
+
+    level = (IS_BIT_SET(s->CAN_IER, CAN_IER_ERRIE_BIT) &&
+             IS_BIT_SET(s->CAN_MSR, CAN_MSR_ERRI_BIT)) ||
+            (IS_BIT_SET(s->CAN_IER, CAN_IER_WKUIE_BIT) &&
+             IS_BIT_SET(s->CAN_MSR, CAN_MSR_WKUI_BIT)) ||
+            (IS_BIT_SET(s->CAN_IER, CAN_IER_SLKIE_BIT) &&
+             IS_BIT_SET(s->CAN_MSR, CAN_MSR_SLAKI_BIT));
+    trace_stm32_can_irq(s, 1 + STM32_CAN_FIFO_COUNT, level);
+    qemu_set_irq(s->sce_irq, level);
+}
+
+
+
+
+/* BIT TIMING */
+
+/* Length of one bit in ns, or 0 if frames should take no time. */
+static int64_t stm32_can_ns_per_bit(Stm32Can *s)
+{
+    uint32_t quanta;
+
+    if (s->clk.freq == 0) {
+        return 0;
+    }
+    /* Synchronization segment plus the two bit segments */
+    quanta = 3 + ((s->CAN_BTR & CAN_BTR_TS1_MASK) >> CAN_BTR_TS1_START) +
+             ((s->CAN_BTR & CAN_BTR_TS2_MASK) >> CAN_BTR_TS2_START);
+
+    return muldiv64(((s->CAN_BTR & CAN_BTR_BRP_MASK) + 1) * quanta,
+                    get_ticks_per_sec(), s->clk.freq);
+}
+
+/* The value of the 16-bit time triggered communication counter, which
+ * counts bits. */
+static uint32_t stm32_can_time(Stm32Can *s)
+{
+    int64_t ns_per_bit;
+
+    if (!IS_BIT_SET(s->CAN_MCR, CAN_MCR_TTCM_BIT)) {
+        return 0;
+    }
+    ns_per_bit = stm32_can_ns_per_bit(s);
+    if (ns_per_bit == 0) {
+        return 0;
+    }
+    return (qemu_get_clock_ns(vm_clock) / ns_per_bit) & 0xffff;
+}
+
+
+
+
+/* ACCEPTANCE FILTERS */
+
+/* Lays out a 16-bit scale filter value or mask as a 32-bit one. */
+static uint32_t stm32_can_filter16_to_32(uint16_t f)
+{
+    return ((uint32_t)(f >> 5) << 21) |       /* STID[10:0] */
+           ((uint32_t)(f & 0x7) << 18) |      /* EXID[17:15] */
+           GET_BIT_MASK(CAN_XIR_IDE_BIT, IS_BIT_SET(f, 3)) |
+           GET_BIT_MASK(CAN_XIR_RTR_BIT, IS_BIT_SET(f, 4));
+}
+
+static void stm32_can_add_filter(Stm32Can *s, uint32_t value, uint32_t mask,
+                                 int fifo, int fmi)
+{
+    Stm32CanFilter *filter = &s->filter[s->filter_count++];
+
+    filter->mask = mask;
+    filter->value = value & mask;
+    filter->fifo = fifo;
+    filter->fmi = fmi;
+}
+
+/* Rebuilds the filter table from the filter bank registers.  The filters
+ * are numbered for each FIFO separately, inactive banks included.  The
+ * table lists the 32-bit list, 32-bit mask, 16-bit list and 16-bit mask
+ * filters, in this order, and by number within each group (RM0008
+ * "Filter match index"). */
+static void stm32_can_compile_filters(Stm32Can *s)
+{
+    uint8_t first_fmi[STM32_CAN_FILTER_BANK_MAX];
+    int fmi_next[STM32_CAN_FIFO_COUNT] = {0, 0};
+    int bank, group;
+
+    for (bank = 0; bank < s->filter_bank_count; bank++) {
+        bool scale32 = IS_BIT_SET(s->CAN_FS1R, bank);
+        bool list = IS_BIT_SET(s->CAN_FM1R, bank);
+        int fifo = IS_BIT_SET(s->CAN_FFA1R, bank);
+
+        first_fmi[bank] = fmi_next[fifo];
+        fmi_next[fifo] += scale32 ? (list ? 2 : 1) : (list ? 4 : 2);
+    }
+
+    s->filter_count = 0;
+    for (group = 0; group < 4; group++) {
+        bool scale32 = group < 2;
+        bool list = (group & 1) == 0;
+
+        for (bank = 0; bank < s->filter_bank_count; bank++) {
+            const uint32_t *fr = s->CAN_FR[bank];
+            int fifo = IS_BIT_SET(s->CAN_FFA1R, bank);
+            int fmi = first_fmi[bank];
+            int i;
+
+            if (!IS_BIT_SET(s->CAN_FA1R, bank) ||
+                IS_BIT_SET(s->CAN_FS1R, bank) != scale32 ||
+                IS_BIT_SET(s->CAN_FM1R, bank) != list) {
+                continue;
+            }
+            if (scale32 && list) {
+                stm32_can_add_filter(s, fr[0], 0xfffffffe, fifo, fmi);
+                stm32_can_add_filter(s, fr[1], 0xfffffffe, fifo, fmi + 1);
+            } else if (scale32) {
+                stm32_can_add_filter(s, fr[0], fr[1] & 0xfffffffe, fifo, fmi);
+            } else if (list) {
+                for (i = 0; i < 4; i++) {
+                    stm32_can_add_filter(s,
+                            stm32_can_filter16_to_32(fr[i / 2] >> (16 * (i & 1))),
+                            stm32_can_filter16_to_32(0xffff), fifo, fmi + i);
+                }
+            } else {
+                for (i = 0; i < 2; i++) {
+                    stm32_can_add_filter(s,
+                            stm32_can_filter16_to_32(fr[i]),
+                            stm32_can_filter16_to_32(fr[i] >> 16),
+                            fifo, fmi + i);
+                }
+            }
+        }
+    }
+
+    DPRINTF("%s: %d filters\n", s->busdev.qdev.id, s->filter_count);
+    s->filter_dirty = false;
+}
+
+/* Finds the filter that accepts the identifier word, or returns NULL if
+ * the frame is to be dropped. */
+static const Stm32CanFilter *stm32_can_match(Stm32Can *s, uint32_t ir)
+{
+    const Stm32CanFilter *filter, *end;
+
+    if (s->filter_dirty) {
+        stm32_can_compile_filters(s);
+    }
+
+    end = s->filter + s->filter_count;
+    for (filter = s->filter; filter < end; filter++) {
+        if ((ir & filter->mask) == filter->value) {
+            return filter;
+        }
+    }
+    return NULL;
+}
+
+
+
+
+/* RECEPTION */
+
+/* The identifier of a frame as laid out in CAN_TIxR and CAN_RIxR */
+static uint32_t stm32_can_frame_ir(const Stm32CanFrame *frame)
+{
+    return (frame->ide ? (frame->id << 3) : (frame->id << 21)) |
+           GET_BIT_MASK(CAN_XIR_IDE_BIT, frame->ide) |
+           GET_BIT_MASK(CAN_XIR_RTR_BIT, frame->rtr);
+}
+
+static void stm32_can_rx_frame(Stm32Can *s, const Stm32CanFrame *frame)
+{
+    const Stm32CanFilter *filter;
+    Stm32CanMailbox *mailbox;
+    Stm32CanFifo *fifo;
+    uint32_t ir;
+
+    if (!s->clk.enabled || IS_BIT_SET(s->CAN_MSR, CAN_MSR_INAK_BIT) ||
+        IS_BIT_SET(s->CAN_FMR, CAN_FMR_FINIT_BIT)) {
+        return;
+    }
+
+    if (IS_BIT_SET(s->CAN_MSR, CAN_MSR_SLAK_BIT)) {
+        /* The start of frame wakes the controller up, but the frame
+         * itself is lost. */
+        SET_BIT(s->CAN_MSR, CAN_MSR_WKUI_BIT);
+        if (IS_BIT_SET(s->CAN_MCR, CAN_MCR_AWUM_BIT)) {
+            RESET_BIT(s->CAN_MCR, CAN_MCR_SLEEP_BIT);
+            RESET_BIT(s->CAN_MSR, CAN_MSR_SLAK_BIT);
+        }
+        stm32_can_update_irq(s);
+        return;
+    }
+
+    ir = stm32_can_frame_ir(frame);
+    filter = stm32_can_match(s, ir);
+    if (!filter) {
+        return;
+    }
+
+    fifo = &s->fifo[filter->fifo];
+    if (fifo->count == STM32_CAN_FIFO_DEPTH) {
+        fifo->overrun = true;
+        if (IS_BIT_SET(s->CAN_MCR, CAN_MCR_RFLM_BIT)) {
+            stm32_can_update_irq(s);
+            return;
+        }
+        /* The last message is overwritten. */
+        fifo->count--;
+    }
+    mailbox = &fifo->mailbox[(fifo->head + fifo->count) % STM32_CAN_FIFO_DEPTH];
+    fifo->count++;
+    fifo->full = fifo->count == STM32_CAN_FIFO_DEPTH;
+
+    mailbox->IR = ir;
+    mailbox->DTR = (stm32_can_time(s) << 16) | (filter->fmi << 8) |
+                   frame->dlc;
+    mailbox->DLR = ldl_le_p(&frame->data[0]);
+    mailbox->DHR = ldl_le_p(&frame->data[4]);
+
+    DPRINTF("%s: frame 0x%x into FIFO %d, filter %d\n", s->busdev.qdev.id,
+            frame->id, filter->fifo, filter->fmi);
+
+    stm32_can_update_irq(s);
+}
+
+/* A frame from another node on the bus */
+static void stm32_can_receive(void *opaque, const Stm32CanFrame *frame)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+
+    /* In loop back mode the receive pin is not listened to. */
+    if (!IS_BIT_SET(s->CAN_BTR, CAN_BTR_LBKM_BIT)) {
+        stm32_can_rx_frame(s, frame);
+    }
+}
+
+static void stm32_can_fifo_release(Stm32Can *s, int f)
+{
+    Stm32CanFifo *fifo = &s->fifo[f];
+
+    if (fifo->count) {
+        fifo->head = (fifo->head + 1) % STM32_CAN_FIFO_DEPTH;
+        fifo->count--;
+        fifo->full = false;
+    }
+}
+
+
+
+
+/* TRANSMISSION */
+
+static bool stm32_can_tx_pending(Stm32Can *s, int m)
+{
+    return IS_BIT_SET(s->tx_mailbox[m].IR, CAN_TIR_TXRQ_BIT);
+}
+
+/* Tells whether mailbox a is sent before mailbox b: in request order with
+ * TXFP set, by identifier otherwise. */
+static bool stm32_can_tx_before(Stm32Can *s, int a, int b)
+{
+    if (IS_BIT_SET(s->CAN_MCR, CAN_MCR_TXFP_BIT)) {
+        return (int32_t)(s->tx_seq[a] - s->tx_seq[b]) < 0;
+    }
+    return (s->tx_mailbox[a].IR & ~1) < (s->tx_mailbox[b].IR & ~1) ||
+           ((s->tx_mailbox[a].IR & ~1) == (s->tx_mailbox[b].IR & ~1) &&
+            a < b);
+}
+
+static void stm32_can_tx_done(Stm32Can *s);
+
+/* Starts sending the mailbox with the highest priority, if the controller
+ * is in normal mode and not sending already. */
+static void stm32_can_tx_start(Stm32Can *s)
+{
+    Stm32CanMailbox *mailbox;
+    int64_t ns_per_bit;
+    int m, next = -1, bits;
+
+    if (s->tx_current >= 0 ||
+        (s->CAN_MSR & (GET_BIT_MASK_ONE(CAN_MSR_INAK_BIT) |
+                       GET_BIT_MASK_ONE(CAN_MSR_SLAK_BIT)))) {
+        return;
+    }
+    for (m = 0; m < STM32_CAN_TX_MAILBOX_COUNT; m++) {
+        if (stm32_can_tx_pending(s, m) &&
+            (next < 0 || stm32_can_tx_before(s, m, next))) {
+            next = m;
+        }
+    }
+    if (next < 0) {
+        return;
+    }
+
+    s->tx_current = next;
+    mailbox = &s->tx_mailbox[next];
+    bits = IS_BIT_SET(mailbox->IR, CAN_XIR_IDE_BIT) ?
+           STM32_CAN_EXT_FRAME_BITS : STM32_CAN_STD_FRAME_BITS;
+    if (!IS_BIT_SET(mailbox->IR, CAN_XIR_RTR_BIT)) {
+        bits += 8 * MIN(mailbox->DTR & 0xf, 8);
+    }
+    ns_per_bit = stm32_can_ns_per_bit(s);
+    if (ns_per_bit == 0) {
+        stm32_can_tx_done(s);
+    } else {
+        qemu_mod_timer(s->tx_timer,
+                       qemu_get_clock_ns(vm_clock) + bits * ns_per_bit);
+    }
+}
+
+static void stm32_can_tx_done(Stm32Can *s)
+{
+    int m = s->tx_current;
+    Stm32CanMailbox *mailbox = &s->tx_mailbox[m];
+    bool silent = IS_BIT_SET(s->CAN_BTR, CAN_BTR_SILM_BIT);
+    bool loopback = IS_BIT_SET(s->CAN_BTR, CAN_BTR_LBKM_BIT);
+    Stm32CanFrame frame;
+
+    s->tx_current = -1;
+
+    if (IS_BIT_SET(s->CAN_MCR, CAN_MCR_TTCM_BIT)) {
+        uint32_t time = stm32_can_time(s);
+
+        mailbox->DTR = (mailbox->DTR & 0x0000ffff) | (time << 16);
+        if (IS_BIT_SET(mailbox->DTR, CAN_TDTR_TGT_BIT)) {
+            mailbox->DHR = (mailbox->DHR & 0x0000ffff) | (time << 16);
+        }
+    }
+
+    frame.ide = IS_BIT_SET(mailbox->IR, CAN_XIR_IDE_BIT);
+    frame.rtr = IS_BIT_SET(mailbox->IR, CAN_XIR_RTR_BIT);
+    frame.id = frame.ide ? mailbox->IR >> 3 : mailbox->IR >> 21;
+    frame.dlc = mailbox->DTR & 0xf;
+    stl_le_p(&frame.data[0], mailbox->DLR);
+    stl_le_p(&frame.data[4], mailbox->DHR);
+
+    DPRINTF("%s: sent frame 0x%x from mailbox %d\n", s->busdev.qdev.id,
+            frame.id, m);
+
+    if (!silent) {
+        stm32_can_hub_send(s->port, &frame);
+    }
+    if (loopback) {
+        stm32_can_rx_frame(s, &frame);
+    }
+
+    RESET_BIT(mailbox->IR, CAN_TIR_TXRQ_BIT);
+    s->CAN_TSR &= ~CAN_TSR_MAILBOX_MASK(m);
+    SET_BIT(s->CAN_TSR, CAN_TSR_RQCP_BIT(m));
+    SET_BIT(s->CAN_TSR, CAN_TSR_TME_BIT(m));
+    if (silent && !loopback) {
+        /* Nobody sees the frame, so nobody acknowledges it. */
+        SET_BIT(s->CAN_TSR, CAN_TSR_TERR_BIT(m));
+    } else {
+        SET_BIT(s->CAN_TSR, CAN_TSR_TXOK_BIT(m));
+    }
+
+    stm32_can_update_irq(s);
+    stm32_can_tx_start(s);
+}
+
+static void stm32_can_tx_timer_expire(void *opaque)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+
+    if (s->tx_current >= 0) {
+        stm32_can_tx_done(s);
+    }
+}
+
+/* Empties a pending mailbox without sending it. */
+static void stm32_can_tx_abort(Stm32Can *s, int m)
+{
+    RESET_BIT(s->tx_mailbox[m].IR, CAN_TIR_TXRQ_BIT);
+    s->CAN_TSR &= ~CAN_TSR_MAILBOX_MASK(m);
+    SET_BIT(s->CAN_TSR, CAN_TSR_RQCP_BIT(m));
+    SET_BIT(s->CAN_TSR, CAN_TSR_TME_BIT(m));
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+/* Puts everything but the filters in their reset state, which leaves the
+ * controller in sleep mode. */
+static void stm32_can_master_reset(Stm32Can *s)
+{
+    int m, f;
+
+    qemu_del_timer(s->tx_timer);
+    s->tx_current = -1;
+    for (m = 0; m < STM32_CAN_TX_MAILBOX_COUNT; m++) {
+        memset(&s->tx_mailbox[m], 0, sizeof(s->tx_mailbox[m]));
+    }
+    for (f = 0; f < STM32_CAN_FIFO_COUNT; f++) {
+        memset(&s->fifo[f], 0, sizeof(s->fifo[f]));
+    }
+    s->CAN_MCR = 0x00010002;
+    s->CAN_MSR = CAN_MSR_IDLE | GET_BIT_MASK_ONE(CAN_MSR_SLAK_BIT);
+    s->CAN_TSR = 0x1c000000;
+    s->CAN_IER = 0;
+    s->CAN_ESR = 0;
+    s->CAN_BTR = 0x01230000;
+}
+
+static void stm32_can_CAN_MCR_write(Stm32Can *s, uint32_t new_value)
+{
+    bool slak;
+
+    if (IS_BIT_SET(new_value, CAN_MCR_RESET_BIT)) {
+        stm32_can_master_reset(s);
+        stm32_can_update_irq(s);
+        return;
+    }
+
+    s->CAN_MCR = new_value & 0x000100ff;
+
+    /* Mode changes take effect at once, as if the bus were idle. */
+    slak = !IS_BIT_SET(s->CAN_MCR, CAN_MCR_INRQ_BIT) &&
+           IS_BIT_SET(s->CAN_MCR, CAN_MCR_SLEEP_BIT);
+    if (slak && !IS_BIT_SET(s->CAN_MSR, CAN_MSR_SLAK_BIT)) {
+        SET_BIT(s->CAN_MSR, CAN_MSR_SLAKI_BIT);
+    }
+    CHANGE_BIT(s->CAN_MSR, CAN_MSR_SLAK_BIT, slak);
+    CHANGE_BIT(s->CAN_MSR, CAN_MSR_INAK_BIT,
+               IS_BIT_SET(s->CAN_MCR, CAN_MCR_INRQ_BIT));
+
+    DPRINTF("%s: %s mode\n", s->busdev.qdev.id,
+            IS_BIT_SET(s->CAN_MSR, CAN_MSR_INAK_BIT) ? "initialization" :
+            slak ? "sleep" : "normal");
+
+    stm32_can_tx_start(s);
+    stm32_can_update_irq(s);
+}
+
+static void stm32_can_CAN_TSR_write(Stm32Can *s, uint32_t new_value)
+{
+    int m;
+
+    for (m = 0; m < STM32_CAN_TX_MAILBOX_COUNT; m++) {
+        if (IS_BIT_SET(new_value, CAN_TSR_ABRQ_BIT(m)) &&
+            stm32_can_tx_pending(s, m) && s->tx_current != m) {
+            stm32_can_tx_abort(s, m);
+        } else if (IS_BIT_SET(new_value, CAN_TSR_RQCP_BIT(m))) {
+            /* Clears RQCP, TXOK, ALST and TERR. */
+            s->CAN_TSR &= ~(0x0000000f << (8 * m));
+        }
+    }
+
+    stm32_can_update_irq(s);
+}
+
+/* Works out CODE and LOW, which depend on the mailboxes. */
+static uint32_t stm32_can_CAN_TSR_read(Stm32Can *s)
+{
+    uint32_t value = s->CAN_TSR & 0x1c8f8f8f;
+    int m, pending = 0, low = -1;
+
+    for (m = STM32_CAN_TX_MAILBOX_COUNT - 1; m >= 0; m--) {
+        if (!stm32_can_tx_pending(s, m)) {
+            value = (value & ~(3 << CAN_TSR_CODE_START)) |
+                    (m << CAN_TSR_CODE_START);
+            continue;
+        }
+        pending++;
+        if (low < 0 || stm32_can_tx_before(s, low, m)) {
+            low = m;
+        }
+    }
+    if (pending > 1) {
+        SET_BIT(value, CAN_TSR_LOW_BIT(low));
+    }
+
+    return value;
+}
+
+static uint32_t stm32_can_CAN_RFR_read(Stm32Can *s, int f)
+{
+    Stm32CanFifo *fifo = &s->fifo[f];
+
+    return fifo->count |
+           GET_BIT_MASK(CAN_RFR_FULL_BIT, fifo->full) |
+           GET_BIT_MASK(CAN_RFR_FOVR_BIT, fifo->overrun);
+}
+
+static void stm32_can_CAN_RFR_write(Stm32Can *s, int f, uint32_t new_value)
+{
+    Stm32CanFifo *fifo = &s->fifo[f];
+
+    if (IS_BIT_SET(new_value, CAN_RFR_FULL_BIT)) {
+        fifo->full = false;
+    }
+    if (IS_BIT_SET(new_value, CAN_RFR_FOVR_BIT)) {
+        fifo->overrun = false;
+    }
+    if (IS_BIT_SET(new_value, CAN_RFR_RFOM_BIT)) {
+        stm32_can_fifo_release(s, f);
+    }
+
+    stm32_can_update_irq(s);
+}
+
+static void stm32_can_tx_mailbox_write(Stm32Can *s, hwaddr offset,
+                                       uint32_t new_value)
+{
+    int m = offset / 0x10;
+    Stm32CanMailbox *mailbox = &s->tx_mailbox[m];
+
+    /* A pending mailbox is write protected. */
+    if (!IS_BIT_SET(s->CAN_TSR, CAN_TSR_TME_BIT(m))) {
+        return;
+    }
+
+    switch (offset & 0xc) {
+        case 0x0:
+            mailbox->IR = new_value;
+            if (IS_BIT_SET(new_value, CAN_TIR_TXRQ_BIT)) {
+                RESET_BIT(s->CAN_TSR, CAN_TSR_TME_BIT(m));
+                s->tx_seq[m] = s->tx_seq_next++;
+                stm32_can_tx_start(s);
+            }
+            break;
+        case 0x4:
+            mailbox->DTR = new_value & 0xffff010f;
+            break;
+        case 0x8:
+            mailbox->DLR = new_value;
+            break;
+        case 0xc:
+            mailbox->DHR = new_value;
+            break;
+    }
+}
+
+static uint32_t stm32_can_mailbox_read(const Stm32CanMailbox *mailbox,
+                                       hwaddr offset)
+{
+    switch (offset & 0xc) {
+        case 0x0:
+            return mailbox->IR;
+        case 0x4:
+            return mailbox->DTR;
+        case 0x8:
+            return mailbox->DLR;
+        default:
+            return mailbox->DHR;
+    }
+}
+
+static uint32_t stm32_can_rx_mailbox_read(Stm32Can *s, hwaddr offset)
+{
+    Stm32CanFifo *fifo = &s->fifo[offset / 0x10];
+
+    return stm32_can_mailbox_read(&fifo->mailbox[fifo->head], offset);
+}
+
+/* Writes to a filter register, which only take effect in filter
+ * initialization mode (for the bank registers, also while the bank is
+ * not active). */
+static void stm32_can_filter_write(Stm32Can *s, hwaddr offset,
+                                   uint32_t new_value)
+{
+    uint32_t bank_mask = (1 << s->filter_bank_count) - 1;
+    bool finit = IS_BIT_SET(s->CAN_FMR, CAN_FMR_FINIT_BIT);
+
+    switch (offset) {
+        case CAN_FMR_OFFSET:
+            s->CAN_FMR = (s->CAN_FMR & ~1) | (new_value & 1);
+            break;
+        case CAN_FM1R_OFFSET:
+            if (finit) {
+                s->CAN_FM1R = new_value & bank_mask;
+            }
+            break;
+        case CAN_FS1R_OFFSET:
+            if (finit) {
+                s->CAN_FS1R = new_value & bank_mask;
+            }
+            break;
+        case CAN_FFA1R_OFFSET:
+            if (finit) {
+                s->CAN_FFA1R = new_value & bank_mask;
+            }
+            break;
+        case CAN_FA1R_OFFSET:
+            s->CAN_FA1R = new_value & bank_mask;
+            break;
+        default: {
+            int bank = (offset - CAN_FR_OFFSET) / 8;
+
+            if (offset < CAN_FR_OFFSET || bank >= s->filter_bank_count) {
+                STM32_BAD_REG(offset, 4);
+                return;
+            }
+            if (finit || !IS_BIT_SET(s->CAN_FA1R, bank)) {
+                s->CAN_FR[bank][(offset / 4) & 1] = new_value;
+            }
+            break;
+        }
+    }
+    s->filter_dirty = true;
+}
+
+static uint32_t stm32_can_filter_read(Stm32Can *s, hwaddr offset)
+{
+    int bank;
+
+    switch (offset) {
+        case CAN_FMR_OFFSET:
+            return s->CAN_FMR;
+        case CAN_FM1R_OFFSET:
+            return s->CAN_FM1R;
+        case CAN_FS1R_OFFSET:
+            return s->CAN_FS1R;
+        case CAN_FFA1R_OFFSET:
+            return s->CAN_FFA1R;
+        case CAN_FA1R_OFFSET:
+            return s->CAN_FA1R;
+    }
+    bank = (offset - CAN_FR_OFFSET) / 8;
+    if (offset < CAN_FR_OFFSET || bank >= s->filter_bank_count) {
+        STM32_BAD_REG(offset, 4);
+        return 0;
+    }
+    return s->CAN_FR[bank][(offset / 4) & 1];
+}
+
+static uint32_t stm32_can_readw(Stm32Can *s, hwaddr offset)
+{
+    if (offset >= CAN_TX_MAILBOX_OFFSET && offset < CAN_RX_MAILBOX_OFFSET) {
+        return stm32_can_mailbox_read(
+                &s->tx_mailbox[(offset - CAN_TX_MAILBOX_OFFSET) / 0x10],
+                offset);
+    }
+    if (offset >= CAN_RX_MAILBOX_OFFSET && offset < CAN_MAILBOX_END) {
+        return stm32_can_rx_mailbox_read(s, offset - CAN_RX_MAILBOX_OFFSET);
+    }
+    if (offset >= CAN_FMR_OFFSET) {
+        return stm32_can_filter_read(s, offset);
+    }
+
+    switch (offset) {
+        case CAN_MCR_OFFSET:
+            return s->CAN_MCR;
+        case CAN_MSR_OFFSET:
+            return s->CAN_MSR;
+        case CAN_TSR_OFFSET:
+            return stm32_can_CAN_TSR_read(s);
+        case CAN_RF0R_OFFSET:
+            return stm32_can_CAN_RFR_read(s, 0);
+        case CAN_RF1R_OFFSET:
+            return stm32_can_CAN_RFR_read(s, 1);
+        case CAN_IER_OFFSET:
+            return s->CAN_IER;
+        case CAN_ESR_OFFSET:
+            return s->CAN_ESR;
+        case CAN_BTR_OFFSET:
+            return s->CAN_BTR;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_can_writew(Stm32Can *s, hwaddr offset, uint32_t value)
+{
+    if (offset >= CAN_TX_MAILBOX_OFFSET && offset < CAN_RX_MAILBOX_OFFSET) {
+        stm32_can_tx_mailbox_write(s, offset - CAN_TX_MAILBOX_OFFSET, value);
+        return;
+    }
+    if (offset >= CAN_RX_MAILBOX_OFFSET && offset < CAN_MAILBOX_END) {
+        STM32_RO_REG(offset);
+        return;
+    }
+    if (offset >= CAN_FMR_OFFSET) {
+        stm32_can_filter_write(s, offset, value);
+        return;
+    }
+
+    switch (offset) {
+        case CAN_MCR_OFFSET:
+            stm32_can_CAN_MCR_write(s, value);
+            break;
+        case CAN_MSR_OFFSET:
+            s->CAN_MSR &= ~(value & CAN_MSR_W1C_MASK);
+            stm32_can_update_irq(s);
+            break;
+        case CAN_TSR_OFFSET:
+            stm32_can_CAN_TSR_write(s, value);
+            break;
+        case CAN_RF0R_OFFSET:
+            stm32_can_CAN_RFR_write(s, 0, value);
+            break;
+        case CAN_RF1R_OFFSET:
+            stm32_can_CAN_RFR_write(s, 1, value);
+            break;
+        case CAN_IER_OFFSET:
+            s->CAN_IER = value & 0x00038f7f;
+            stm32_can_update_irq(s);
+            break;
+        case CAN_ESR_OFFSET:
+            /* Only LEC can be written. */
+            s->CAN_ESR = (s->CAN_ESR & ~0x70) | (value & 0x70);
+            break;
+        case CAN_BTR_OFFSET:
+            if (!IS_BIT_SET(s->CAN_MSR, CAN_MSR_INAK_BIT)) {
+                stm32_hw_warn("%s: CAN_BTR can only be written in "
+                              "initialization mode", s->busdev.qdev.id);
+                break;
+            }
+            s->CAN_BTR = value & 0xc37f03ff;
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+static uint64_t stm32_can_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case BYTE_ACCESS_SIZE:
+        case HALFWORD_ACCESS_SIZE:
+            /* Mailbox data is often read a byte at a time. */
+            value = stm32_can_readw(s, offset & ~3);
+            value = (value >> (8 * (offset & 3))) & ((1 << (8 * size)) - 1);
+            break;
+        case WORD_ACCESS_SIZE:
+            value = stm32_can_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_can_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_can_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Can *s = (Stm32Can *)opaque;
+
+    trace_stm32_can_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_can_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_can_ops = {
+    .read = stm32_can_read,
+    .write = stm32_can_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_can_reset(DeviceState *dev)
+{
+    Stm32Can *s = FROM_SYSBUS(Stm32Can, SYS_BUS_DEVICE(dev));
+
+    stm32_can_master_reset(s);
+    s->CAN_FMR = 0x2a1c0e01;
+    s->CAN_FM1R = 0;
+    s->CAN_FS1R = 0;
+    s->CAN_FFA1R = 0;
+    s->CAN_FA1R = 0;
+    s->filter_dirty = true;
+
+    stm32_can_update_irq(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_can_instance_init(Object *obj)
+{
+    Stm32Can *s = FROM_SYSBUS(Stm32Can, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_can_init(SysBusDevice *dev)
+{
+    Stm32Can *s = FROM_SYSBUS(Stm32Can, dev);
+    Stm32CanHub *hub;
+    int f;
+
+    if (s->filter_bank_count > STM32_CAN_FILTER_BANK_MAX) {
+        hw_error("stm32_can: at most %d filter banks are supported\n",
+                 STM32_CAN_FILTER_BANK_MAX);
+    }
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_can_ops, s,
+                          "can", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->tx_irq);
+    for (f = 0; f < STM32_CAN_FIFO_COUNT; f++) {
+        sysbus_init_irq(dev, &s->rx_irq[f]);
+    }
+    sysbus_init_irq(dev, &s->sce_irq);
+
+    s->tx_timer = qemu_new_timer_ns(vm_clock, stm32_can_tx_timer_expire, s);
+
+    hub = stm32_can_hub_find(s->canbus);
+    s->port = stm32_can_hub_add_port(hub, stm32_can_receive, s);
+    if (s->host) {
+        stm32_can_hub_connect_host(hub, s->host);
+    }
+
+    return 0;
+}
+
+static Property stm32_can_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Can, periph, -1),
+    DEFINE_PROP_UINT32("canbus", Stm32Can, canbus, 0),
+    DEFINE_PROP_STRING("host", Stm32Can, host),
+    DEFINE_PROP_UINT32("filter_banks", Stm32Can, filter_bank_count, 14),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_can_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_can_init;
+    dc->reset = stm32_can_reset;
+    dc->props = stm32_can_properties;
+}
+
+static TypeInfo stm32_can_info = {
+    .name  = "stm32_can",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Can),
+    .instance_init = stm32_can_instance_init,
+    .class_init = stm32_can_class_init
+};
+
+static void stm32_can_register_types(void)
+{
+    type_register_static(&stm32_can_info);
+}
+
+type_init(stm32_can_register_types)
@@ -0,0 +1,246 @@
+/*
+ * STM32 virtual CAN bus
+ *
+ * A hub broadcasts the frames sent on one of its ports to all the other
+ * ports, the same way the net hubs do for packets.  The CAN controllers of
+ * every microcontroller in the process that name the same hub id share one
+ * bus.  A hub can also be connected to a SocketCAN interface of the host,
+ * which is read in batches with recvmmsg so that the main loop keeps up
+ * with a fully loaded 1 Mbit/s bus.
+ *
+ * Arbitration and acknowledgement are not modelled: every frame sent is
+ * delivered to every other port once its sender has finished sending it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+
+#ifdef CONFIG_LINUX
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#endif
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_CAN_HUB
+
+#ifdef DEBUG_STM32_CAN_HUB
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_CAN_HUB: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+/* Number of frames read from the host with one recvmmsg call */
+#define STM32_CAN_HOST_BATCH 32
+
+struct Stm32CanHubPort {
+    QLIST_ENTRY(Stm32CanHubPort) next;
+    Stm32CanHub *hub;
+    Stm32CanReceiveFunc *receive;
+    void *opaque;
+};
+
+struct Stm32CanHub {
+    int id;
+    QLIST_ENTRY(Stm32CanHub) next;
+    QLIST_HEAD(, Stm32CanHubPort) ports;
+    /* The host interface the hub is connected to, if any */
+    char *host_ifname;
+};
+
+static QLIST_HEAD(, Stm32CanHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
+
+
+
+
+/* HOST BACKEND */
+
+#ifdef CONFIG_LINUX
+typedef struct {
+    Stm32CanHubPort *port;
+    int fd;
+    struct can_frame frames[STM32_CAN_HOST_BATCH];
+    struct iovec iov[STM32_CAN_HOST_BATCH];
+    struct mmsghdr msgs[STM32_CAN_HOST_BATCH];
+} Stm32CanHost;
+
+static void stm32_can_host_read(void *opaque)
+{
+    Stm32CanHost *h = (Stm32CanHost *)opaque;
+    Stm32CanFrame frame;
+    int count, i;
+
+    do {
+        count = recvmmsg(h->fd, h->msgs, STM32_CAN_HOST_BATCH,
+                         MSG_DONTWAIT, NULL);
+        for (i = 0; i < count; i++) {
+            const struct can_frame *cf = &h->frames[i];
+
+            if (h->msgs[i].msg_len != sizeof(*cf) ||
+                (cf->can_id & CAN_ERR_FLAG)) {
+                continue;
+            }
+            frame.ide = (cf->can_id & CAN_EFF_FLAG) != 0;
+            frame.rtr = (cf->can_id & CAN_RTR_FLAG) != 0;
+            frame.id = cf->can_id & (frame.ide ? CAN_EFF_MASK : CAN_SFF_MASK);
+            frame.dlc = MIN(cf->can_dlc, 8);
+            memcpy(frame.data, cf->data, sizeof(frame.data));
+            stm32_can_hub_send(h->port, &frame);
+        }
+        /* A full batch means more frames may be waiting. */
+    } while (count == STM32_CAN_HOST_BATCH);
+}
+
+static void stm32_can_host_receive(void *opaque, const Stm32CanFrame *frame)
+{
+    Stm32CanHost *h = (Stm32CanHost *)opaque;
+    struct can_frame cf;
+
+    memset(&cf, 0, sizeof(cf));
+    cf.can_id = frame->id;
+    if (frame->ide) {
+        cf.can_id |= CAN_EFF_FLAG;
+    }
+    if (frame->rtr) {
+        cf.can_id |= CAN_RTR_FLAG;
+    }
+    cf.can_dlc = frame->dlc;
+    memcpy(cf.data, frame->data, sizeof(cf.data));
+
+    if (write(h->fd, &cf, sizeof(cf)) != sizeof(cf)) {
+        DPRINTF("frame 0x%x dropped by %s\n", frame->id,
+                h->port->hub->host_ifname);
+    }
+}
+
+static void stm32_can_host_open(Stm32CanHub *hub, const char *ifname)
+{
+    Stm32CanHost *h;
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int fd, i;
+
+    fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd < 0) {
+        hw_error("stm32_can: cannot open a SocketCAN socket: %s\n",
+                 strerror(errno));
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        hw_error("stm32_can: no CAN interface '%s': %s\n", ifname,
+                 strerror(errno));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        hw_error("stm32_can: cannot bind to '%s': %s\n", ifname,
+                 strerror(errno));
+    }
+    socket_set_nonblock(fd);
+
+    h = g_new0(Stm32CanHost, 1);
+    h->fd = fd;
+    for (i = 0; i < STM32_CAN_HOST_BATCH; i++) {
+        h->iov[i].iov_base = &h->frames[i];
+        h->iov[i].iov_len = sizeof(h->frames[i]);
+        h->msgs[i].msg_hdr.msg_iov = &h->iov[i];
+        h->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    h->port = stm32_can_hub_add_port(hub, stm32_can_host_receive, h);
+    qemu_set_fd_handler(fd, stm32_can_host_read, NULL, h);
+}
+#else
+static void stm32_can_host_open(Stm32CanHub *hub, const char *ifname)
+{
+    hw_error("stm32_can: SocketCAN is only available on Linux hosts\n");
+}
+#endif
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+Stm32CanHub *stm32_can_hub_find(int id)
+{
+    Stm32CanHub *hub;
+
+    QLIST_FOREACH(hub, &hubs, next) {
+        if (hub->id == id) {
+            return hub;
+        }
+    }
+
+    hub = g_new0(Stm32CanHub, 1);
+    hub->id = id;
+    QLIST_INIT(&hub->ports);
+    QLIST_INSERT_HEAD(&hubs, hub, next);
+
+    return hub;
+}
+
+Stm32CanHubPort *stm32_can_hub_add_port(Stm32CanHub *hub,
+                                        Stm32CanReceiveFunc *receive,
+                                        void *opaque)
+{
+    Stm32CanHubPort *port = g_new0(Stm32CanHubPort, 1);
+
+    port->hub = hub;
+    port->receive = receive;
+    port->opaque = opaque;
+    QLIST_INSERT_HEAD(&hub->ports, port, next);
+
+    return port;
+}
+
+void stm32_can_hub_send(Stm32CanHubPort *source_port,
+                        const Stm32CanFrame *frame)
+{
+    Stm32CanHubPort *port;
+
+    DPRINTF("hub %d: frame 0x%x%s, %d bytes\n", source_port->hub->id,
+            frame->id, frame->rtr ? " (remote)" : "", frame->dlc);
+
+    QLIST_FOREACH(port, &source_port->hub->ports, next) {
+        if (port != source_port) {
+            port->receive(port->opaque, frame);
+        }
+    }
+}
+
+void stm32_can_hub_connect_host(Stm32CanHub *hub, const char *ifname)
+{
+    if (hub->host_ifname) {
+        if (strcmp(hub->host_ifname, ifname)) {
+            hw_error("stm32_can: CAN bus %d is already connected to '%s'\n",
+                     hub->id, hub->host_ifname);
+        }
+        return;
+    }
+    hub->host_ifname = g_strdup(ifname);
+    stm32_can_host_open(hub, ifname);
+}
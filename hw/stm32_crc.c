@@ -0,0 +1,312 @@
+/*
+ * STM32 Microcontroller CRC (CRC calculation unit) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The unit computes the CRC-32 of the Ethernet polynomial (0x04C11DB7) over
+ * the words written to CRC_DR, most significant bit first, without
+ * reflection or final xor, starting from 0xFFFFFFFF.  Each write takes one
+ * word: on the F1, narrower writes to CRC_DR are seen as the word they are
+ * zero extended to.
+ *
+ * The CRC is updated with tables, one or two words at a time (slicing by
+ * 4 and by 8).  The CRC32 instruction of SSE4.2 cannot be used: it computes
+ * the Castagnoli polynomial, bit reflected.  A memory-to-memory DMA
+ * transfer to CRC_DR is given to the unit as one burst, so that checking a
+ * firmware image costs one pass over it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "qemu/bitops.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+#define CRC_DR_OFFSET 0x00
+#define CRC_DR_RESET 0xffffffff
+
+#define CRC_IDR_OFFSET 0x04
+#define CRC_IDR_MASK 0xff
+
+#define CRC_CR_OFFSET 0x08
+#define CRC_CR_RESET_BIT 0
+
+#define CRC_POLY 0x04c11db7
+
+struct Stm32Crc {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    uint32_t
+        CRC_DR,
+        CRC_IDR;
+};
+
+/* crc_table[k][b] is the CRC of byte b followed by k zero bytes. */
+static uint32_t crc_table[8][256];
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_crc_init_table(void)
+{
+    uint32_t crc;
+    int i, j, k;
+
+    for(i = 0; i < 256; i++) {
+        crc = (uint32_t)i << 24;
+        for(j = 0; j < 8; j++) {
+            crc = (crc << 1) ^ ((crc & 0x80000000) ? CRC_POLY : 0);
+        }
+        crc_table[0][i] = crc;
+    }
+    for(k = 1; k < 8; k++) {
+        for(i = 0; i < 256; i++) {
+            crc = crc_table[k - 1][i];
+            crc_table[k][i] = (crc << 8) ^ crc_table[0][crc >> 24];
+        }
+    }
+}
+
+static inline uint32_t stm32_crc_word(uint32_t crc, uint32_t word)
+{
+    crc ^= word;
+    return crc_table[3][crc >> 24] ^
+           crc_table[2][(crc >> 16) & 0xff] ^
+           crc_table[1][(crc >> 8) & 0xff] ^
+           crc_table[0][crc & 0xff];
+}
+
+/* Feeds the two words w0 and w1, in this order. */
+static inline uint32_t stm32_crc_2words(uint32_t crc, uint32_t w0,
+                                        uint32_t w1)
+{
+    crc ^= w0;
+    return crc_table[7][crc >> 24] ^
+           crc_table[6][(crc >> 16) & 0xff] ^
+           crc_table[5][(crc >> 8) & 0xff] ^
+           crc_table[4][crc & 0xff] ^
+           crc_table[3][w1 >> 24] ^
+           crc_table[2][(w1 >> 16) & 0xff] ^
+           crc_table[1][(w1 >> 8) & 0xff] ^
+           crc_table[0][w1 & 0xff];
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_crc_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Crc *s = (Stm32Crc *)opaque;
+    uint64_t value;
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    switch(offset & ~3) {
+        case CRC_DR_OFFSET:
+            value = s->CRC_DR;
+            break;
+        case CRC_IDR_OFFSET:
+            value = s->CRC_IDR;
+            break;
+        case CRC_CR_OFFSET:
+            /* RESET reads as 0 */
+            value = 0;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+    value = extract64(value, (offset & 3) * 8, size * 8);
+
+    trace_stm32_crc_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_crc_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Crc *s = (Stm32Crc *)opaque;
+
+    trace_stm32_crc_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(offset) {
+        case CRC_DR_OFFSET:
+            s->CRC_DR = stm32_crc_word(s->CRC_DR, value);
+            break;
+        case CRC_IDR_OFFSET:
+            s->CRC_IDR = value & CRC_IDR_MASK;
+            break;
+        case CRC_CR_OFFSET:
+            if(IS_BIT_SET(value, CRC_CR_RESET_BIT)) {
+                s->CRC_DR = CRC_DR_RESET;
+            }
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_crc_ops = {
+    .read = stm32_crc_read,
+    .write = stm32_crc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    }
+};
+
+static void stm32_crc_reset(DeviceState *dev)
+{
+    Stm32Crc *s = FROM_SYSBUS(Stm32Crc, SYS_BUS_DEVICE(dev));
+
+    s->CRC_DR = CRC_DR_RESET;
+    s->CRC_IDR = 0;
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+bool stm32_crc_burst_write(Stm32Crc *s, hwaddr addr, const uint8_t *buf,
+                           uint32_t len, unsigned size)
+{
+    uint32_t crc;
+
+    if(addr != STM32_CRC_ADDR + CRC_DR_OFFSET ||
+       !stm32_periph_clk_check(&s->clk)) {
+        return false;
+    }
+
+    crc = s->CRC_DR;
+    switch(size) {
+        case 4:
+            for(; len >= 8; buf += 8, len -= 8) {
+                crc = stm32_crc_2words(crc, ldl_le_p(buf), ldl_le_p(buf + 4));
+            }
+            if(len >= 4) {
+                crc = stm32_crc_word(crc, ldl_le_p(buf));
+            }
+            break;
+        case 2:
+            for(; len >= 2; buf += 2, len -= 2) {
+                crc = stm32_crc_word(crc, lduw_le_p(buf));
+            }
+            break;
+        default:
+            for(; len; buf++, len--) {
+                crc = stm32_crc_word(crc, *buf);
+            }
+            break;
+    }
+    s->CRC_DR = crc;
+    return true;
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_crc_instance_init(Object *obj)
+{
+    Stm32Crc *s = FROM_SYSBUS(Stm32Crc, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_crc_init(SysBusDevice *dev)
+{
+    Stm32Crc *s = FROM_SYSBUS(Stm32Crc, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_CRC, dev,
+                              NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_crc_ops, s,
+                          "crc", 0x03ff);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_crc = {
+    .name = "stm32_crc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(CRC_DR, Stm32Crc),
+        VMSTATE_UINT32(CRC_IDR, Stm32Crc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_crc_properties[] = {
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_crc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_crc_init;
+    dc->reset = stm32_crc_reset;
+    dc->props = stm32_crc_properties;
+    dc->vmsd = &vmstate_stm32_crc;
+}
+
+static TypeInfo stm32_crc_info = {
+    .name  = "stm32_crc",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Crc),
+    .instance_init = stm32_crc_instance_init,
+    .class_init = stm32_crc_class_init
+};
+
+static void stm32_crc_register_types(void)
+{
+    stm32_crc_init_table();
+    type_register_static(&stm32_crc_info);
+}
+
+type_init(stm32_crc_register_types)
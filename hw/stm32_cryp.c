@@ -0,0 +1,673 @@
+/*
+ * STM32 Microcontroller CRYP (cryptographic processor) module (STM32F21X)
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual Rev 4"
+ *
+ * The AES modes (ECB, CBC and CTR, with 128, 192 and 256 bit keys) are
+ * emulated with the AES implementation of util/aes.c.  The DES and TDES
+ * modes are not.  The key preparation mode only clears CRYPEN: the
+ * decryption key schedule is always made from the key registers, so an AES
+ * decryption also works without it.  A block is processed as soon as the
+ * input FIFO holds 4 words and the output FIFO has room for them, so BUSY
+ * is never seen set.
+ *
+ * When both DMA requests are enabled and their streams are set up to move
+ * contiguous memory, the blocks go straight from the input buffer to the
+ * output buffer, as many as both streams allow in one call, without going
+ * through the FIFOs.  Otherwise the DMA streams feed and drain the FIFOs
+ * through the request lines.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "block/aes.h"
+#include "exec/cpu-common.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+#define CRYP_CR_OFFSET 0x00
+#define CRYP_CR_ALGODIR_BIT 2
+#define CRYP_CR_ALGOMODE_START 3
+#define CRYP_CR_ALGOMODE_MASK 0x00000038
+#define CRYP_CR_DATATYPE_START 6
+#define CRYP_CR_DATATYPE_MASK 0x000000c0
+#define CRYP_CR_KEYSIZE_START 8
+#define CRYP_CR_KEYSIZE_MASK 0x00000300
+#define CRYP_CR_FFLUSH_BIT 14
+#define CRYP_CR_CRYPEN_BIT 15
+#define CRYP_CR_MASK 0x000083fc
+
+#define CRYP_ALGOMODE_AES_ECB 4
+#define CRYP_ALGOMODE_AES_CBC 5
+#define CRYP_ALGOMODE_AES_CTR 6
+#define CRYP_ALGOMODE_AES_KEY 7
+
+#define CRYP_DATATYPE_32 0
+#define CRYP_DATATYPE_16 1
+#define CRYP_DATATYPE_8 2
+
+#define CRYP_SR_OFFSET 0x04
+#define CRYP_SR_IFEM_BIT 0
+#define CRYP_SR_IFNF_BIT 1
+#define CRYP_SR_OFNE_BIT 2
+#define CRYP_SR_OFFU_BIT 3
+
+#define CRYP_DIN_OFFSET 0x08
+#define CRYP_DOUT_OFFSET 0x0c
+
+#define CRYP_DMACR_OFFSET 0x10
+#define CRYP_DMACR_DIEN_BIT 0
+#define CRYP_DMACR_DOEN_BIT 1
+#define CRYP_DMACR_MASK 0x00000003
+
+#define CRYP_IMSCR_OFFSET 0x14
+#define CRYP_IMSCR_MASK 0x00000003
+#define CRYP_RISR_OFFSET 0x18
+#define CRYP_MISR_OFFSET 0x1c
+#define CRYP_RISR_INRIS_BIT 0
+#define CRYP_RISR_OUTRIS_BIT 1
+
+/* K0LR to K3RR, then IV0LR to IV1RR */
+#define CRYP_K0LR_OFFSET 0x20
+#define CRYP_K3RR_OFFSET 0x3c
+#define CRYP_IV0LR_OFFSET 0x40
+#define CRYP_IV1RR_OFFSET 0x4c
+
+#define CRYP_KEY_WORDS 8
+#define CRYP_IV_WORDS 4
+
+/* Both FIFOs are 8 words deep, and a block is 4 words. */
+#define CRYP_FIFO_SIZE 8
+#define CRYP_BLOCK_WORDS 4
+
+/* Block transfers are read, processed and written this much at a time. */
+#define CRYP_DMA_CHUNK_SIZE 4096
+
+struct Stm32Cryp {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    Stm32f2xxDma *stm32_dma;
+    /* STM32F2XX_DMA_REQ() numbers of the streams serving CRYP_IN and
+     * CRYP_OUT, or -1 */
+    int32_t dma_req_in;
+    int32_t dma_req_out;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    /* The words as written to DIN and as read from DOUT */
+    uint32_t in_fifo[CRYP_FIFO_SIZE];
+    uint32_t in_len;
+    uint32_t out_fifo[CRYP_FIFO_SIZE];
+    uint32_t out_len;
+
+    /* The key schedules are made again after the key or its size changed. */
+    bool key_valid;
+    AES_KEY enc_key;
+    AES_KEY dec_key;
+
+    uint32_t
+        CRYP_CR,
+        CRYP_DMACR,
+        CRYP_IMSCR,
+        CRYP_K[CRYP_KEY_WORDS],
+        CRYP_IV[CRYP_IV_WORDS];
+
+    qemu_irq irq;
+    qemu_irq dma_irq[2];
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static inline unsigned stm32_cryp_algomode(Stm32Cryp *s)
+{
+    return (s->CRYP_CR & CRYP_CR_ALGOMODE_MASK) >> CRYP_CR_ALGOMODE_START;
+}
+
+/* Blocks are only processed while enabled in a mode that is emulated. */
+static bool stm32_cryp_running(Stm32Cryp *s)
+{
+    unsigned mode = stm32_cryp_algomode(s);
+
+    return IS_BIT_SET(s->CRYP_CR, CRYP_CR_CRYPEN_BIT) &&
+           mode >= CRYP_ALGOMODE_AES_ECB && mode <= CRYP_ALGOMODE_AES_CTR;
+}
+
+/* Turns a word written to DIN into a word of the bit string the algorithm
+ * works on (most significant bit first), or such a word back into one read
+ * from DOUT, as DATATYPE says. */
+static uint32_t stm32_cryp_swap(Stm32Cryp *s, uint32_t word)
+{
+    uint32_t rev = 0;
+    int i;
+
+    switch ((s->CRYP_CR & CRYP_CR_DATATYPE_MASK) >> CRYP_CR_DATATYPE_START) {
+        case CRYP_DATATYPE_32:
+            return word;
+        case CRYP_DATATYPE_16:
+            return (word << 16) | (word >> 16);
+        case CRYP_DATATYPE_8:
+            return bswap32(word);
+        default:
+            for (i = 0; i < 32; i++) {
+                rev = (rev << 1) | ((word >> i) & 1);
+            }
+            return rev;
+    }
+}
+
+/* Makes the key schedules.  The key is right aligned in K0LR..K3RR, most
+ * significant word first, so a 128 bit key is in K2LR..K3RR. */
+static void stm32_cryp_set_key(Stm32Cryp *s)
+{
+    uint8_t key[CRYP_KEY_WORDS * 4];
+    unsigned keysize;
+    int i, bits;
+
+    keysize = (s->CRYP_CR & CRYP_CR_KEYSIZE_MASK) >> CRYP_CR_KEYSIZE_START;
+    bits = 128 + 64 * MIN(keysize, 2);
+    for (i = 0; i < CRYP_KEY_WORDS; i++) {
+        stl_be_p(key + i * 4, s->CRYP_K[i]);
+    }
+    AES_set_encrypt_key(key + sizeof(key) - bits / 8, bits, &s->enc_key);
+    AES_set_decrypt_key(key + sizeof(key) - bits / 8, bits, &s->dec_key);
+    s->key_valid = true;
+}
+
+/* Runs the algorithm on one block of the bit string, which may be done in
+ * place, and moves the IV registers on. */
+static void stm32_cryp_block(Stm32Cryp *s, const uint8_t *in, uint8_t *out)
+{
+    uint8_t iv[AES_BLOCK_SIZE], tmp[AES_BLOCK_SIZE];
+    bool decrypt = IS_BIT_SET(s->CRYP_CR, CRYP_CR_ALGODIR_BIT);
+    int i;
+
+    if (!s->key_valid) {
+        stm32_cryp_set_key(s);
+    }
+    for (i = 0; i < CRYP_IV_WORDS; i++) {
+        stl_be_p(iv + i * 4, s->CRYP_IV[i]);
+    }
+
+    switch (stm32_cryp_algomode(s)) {
+        case CRYP_ALGOMODE_AES_ECB:
+            if (decrypt) {
+                AES_decrypt(in, out, &s->dec_key);
+            } else {
+                AES_encrypt(in, out, &s->enc_key);
+            }
+            return;
+        case CRYP_ALGOMODE_AES_CBC:
+            if (decrypt) {
+                memcpy(tmp, in, AES_BLOCK_SIZE);
+                AES_decrypt(in, out, &s->dec_key);
+                for (i = 0; i < AES_BLOCK_SIZE; i++) {
+                    out[i] ^= iv[i];
+                }
+                memcpy(iv, tmp, AES_BLOCK_SIZE);
+            } else {
+                for (i = 0; i < AES_BLOCK_SIZE; i++) {
+                    tmp[i] = in[i] ^ iv[i];
+                }
+                AES_encrypt(tmp, out, &s->enc_key);
+                memcpy(iv, out, AES_BLOCK_SIZE);
+            }
+            break;
+        case CRYP_ALGOMODE_AES_CTR:
+            /* Both directions encrypt the counter, whose 32 least
+             * significant bits are incremented. */
+            AES_encrypt(iv, tmp, &s->enc_key);
+            for (i = 0; i < AES_BLOCK_SIZE; i++) {
+                out[i] = in[i] ^ tmp[i];
+            }
+            s->CRYP_IV[CRYP_IV_WORDS - 1]++;
+            return;
+        default:
+            abort();
+    }
+
+    for (i = 0; i < CRYP_IV_WORDS; i++) {
+        s->CRYP_IV[i] = ldl_be_p(iv + i * 4);
+    }
+}
+
+/* Moves the blocks waiting in the input FIFO through the algorithm for as
+ * long as the output FIFO has room for them. */
+static void stm32_cryp_process(Stm32Cryp *s)
+{
+    uint8_t block[AES_BLOCK_SIZE];
+    int i;
+
+    if (!stm32_cryp_running(s)) {
+        return;
+    }
+
+    while (s->in_len >= CRYP_BLOCK_WORDS &&
+           s->out_len <= CRYP_FIFO_SIZE - CRYP_BLOCK_WORDS) {
+        for (i = 0; i < CRYP_BLOCK_WORDS; i++) {
+            stl_be_p(block + i * 4, stm32_cryp_swap(s, s->in_fifo[i]));
+        }
+        s->in_len -= CRYP_BLOCK_WORDS;
+        memmove(s->in_fifo, s->in_fifo + CRYP_BLOCK_WORDS, s->in_len * 4);
+
+        stm32_cryp_block(s, block, block);
+
+        for (i = 0; i < CRYP_BLOCK_WORDS; i++) {
+            s->out_fifo[s->out_len++] = stm32_cryp_swap(s,
+                                                ldl_be_p(block + i * 4));
+        }
+    }
+}
+
+/* Runs the algorithm on the blocks at buf, laid out as the DMA would read
+ * them from memory and write them back. */
+static void stm32_cryp_mem_blocks(Stm32Cryp *s, uint8_t *buf, uint32_t len)
+{
+    bool swap = ((s->CRYP_CR & CRYP_CR_DATATYPE_MASK) >>
+                 CRYP_CR_DATATYPE_START) != CRYP_DATATYPE_8;
+    uint32_t i;
+
+    /* With byte data, the bit string is the memory as it is. */
+    if (swap) {
+        for (i = 0; i < len; i += 4) {
+            stl_be_p(buf + i, stm32_cryp_swap(s, ldl_le_p(buf + i)));
+        }
+    }
+    for (i = 0; i < len; i += AES_BLOCK_SIZE) {
+        stm32_cryp_block(s, buf + i, buf + i);
+    }
+    if (swap) {
+        for (i = 0; i < len; i += 4) {
+            stl_le_p(buf + i, stm32_cryp_swap(s, ldl_be_p(buf + i)));
+        }
+    }
+}
+
+static uint32_t stm32_cryp_RISR_read(Stm32Cryp *s)
+{
+    uint32_t value = 0;
+
+    if (IS_BIT_SET(s->CRYP_CR, CRYP_CR_CRYPEN_BIT) &&
+        s->in_len < CRYP_BLOCK_WORDS) {
+        SET_BIT(value, CRYP_RISR_INRIS_BIT);
+    }
+    if (s->out_len > 0) {
+        SET_BIT(value, CRYP_RISR_OUTRIS_BIT);
+    }
+    return value;
+}
+
+/* Updates the interrupt and the DMA request lines.  Raising a request may
+ * have the DMA access the FIFOs straight away. */
+static void stm32_cryp_update(Stm32Cryp *s)
+{
+    bool irq = (stm32_cryp_RISR_read(s) & s->CRYP_IMSCR) != 0;
+
+    trace_stm32_cryp_irq(s, irq);
+    qemu_set_irq(s->irq, irq);
+
+    qemu_set_irq(s->dma_irq[STM32_CRYP_DMA_IN_REQ],
+                 IS_BIT_SET(s->CRYP_DMACR, CRYP_DMACR_DIEN_BIT) &&
+                 stm32_cryp_running(s) &&
+                 s->in_len <= CRYP_FIFO_SIZE - CRYP_BLOCK_WORDS);
+    qemu_set_irq(s->dma_irq[STM32_CRYP_DMA_OUT_REQ],
+                 IS_BIT_SET(s->CRYP_DMACR, CRYP_DMACR_DOEN_BIT) &&
+                 s->out_len > 0);
+}
+
+/* Moves as many whole blocks as both DMA streams allow from memory to
+ * memory at once.  Returns false if the streams are not set up for that,
+ * in which case the data is left to the request lines. */
+static bool stm32_cryp_dma_block(Stm32Cryp *s)
+{
+    hwaddr base = s->busdev.mmio[0].addr;
+    uint8_t buf[CRYP_DMA_CHUNK_SIZE];
+    hwaddr in_mar = 0, out_mar = 0;
+    uint32_t len, done, chunk;
+
+    if (!s->stm32_dma || s->dma_req_in < 0 || s->dma_req_out < 0 ||
+        (s->CRYP_DMACR & CRYP_DMACR_MASK) != CRYP_DMACR_MASK ||
+        !stm32_cryp_running(s) || s->in_len != 0 || s->out_len != 0) {
+        return false;
+    }
+
+    len = stm32f2xx_dma_block_begin(s->stm32_dma, s->dma_req_in,
+                                    base + CRYP_DIN_OFFSET, false, &in_mar);
+    len = MIN(len, stm32f2xx_dma_block_begin(s->stm32_dma, s->dma_req_out,
+                                             base + CRYP_DOUT_OFFSET, true,
+                                             &out_mar));
+    len &= ~(AES_BLOCK_SIZE - 1);
+    if (len == 0) {
+        return false;
+    }
+
+    trace_stm32_cryp_dma_block(s, in_mar, out_mar, len);
+    for (done = 0; done < len; done += chunk) {
+        chunk = MIN(len - done, CRYP_DMA_CHUNK_SIZE);
+        cpu_physical_memory_read(in_mar + done, buf, chunk);
+        stm32_cryp_mem_blocks(s, buf, chunk);
+        cpu_physical_memory_write(out_mar + done, buf, chunk);
+    }
+
+    stm32f2xx_dma_block_end(s->stm32_dma, s->dma_req_in, len, false);
+    stm32f2xx_dma_block_end(s->stm32_dma, s->dma_req_out, len, false);
+    return true;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_cryp_CRYP_CR_write(Stm32Cryp *s, uint32_t new_value)
+{
+    s->CRYP_CR = new_value & CRYP_CR_MASK;
+    s->key_valid = false;
+
+    if (IS_BIT_SET(new_value, CRYP_CR_FFLUSH_BIT) &&
+        IS_BIT_RESET(new_value, CRYP_CR_CRYPEN_BIT)) {
+        s->in_len = 0;
+        s->out_len = 0;
+    }
+
+    if (IS_BIT_SET(s->CRYP_CR, CRYP_CR_CRYPEN_BIT)) {
+        switch (stm32_cryp_algomode(s)) {
+            case CRYP_ALGOMODE_AES_ECB:
+            case CRYP_ALGOMODE_AES_CBC:
+            case CRYP_ALGOMODE_AES_CTR:
+                break;
+            case CRYP_ALGOMODE_AES_KEY:
+                /* The key is prepared at once. */
+                RESET_BIT(s->CRYP_CR, CRYP_CR_CRYPEN_BIT);
+                break;
+            default:
+                stm32_hw_warn("%s: DES and TDES modes are not emulated",
+                              s->busdev.qdev.id);
+                break;
+        }
+    }
+    stm32_cryp_process(s);
+}
+
+static void stm32_cryp_CRYP_DIN_write(Stm32Cryp *s, uint32_t new_value)
+{
+    if (s->in_len < CRYP_FIFO_SIZE) {
+        s->in_fifo[s->in_len++] = new_value;
+    }
+    stm32_cryp_process(s);
+}
+
+static uint32_t stm32_cryp_CRYP_DOUT_read(Stm32Cryp *s)
+{
+    uint32_t value;
+
+    if (s->out_len == 0) {
+        return 0;
+    }
+    value = s->out_fifo[0];
+    s->out_len--;
+    memmove(s->out_fifo, s->out_fifo + 1, s->out_len * 4);
+    stm32_cryp_process(s);
+    stm32_cryp_update(s);
+    return value;
+}
+
+static uint64_t stm32_cryp_readw(Stm32Cryp *s, hwaddr offset)
+{
+    uint32_t value;
+
+    switch (offset) {
+        case CRYP_CR_OFFSET:
+            return s->CRYP_CR;
+        case CRYP_SR_OFFSET:
+            value = 0;
+            CHANGE_BIT(value, CRYP_SR_IFEM_BIT, s->in_len == 0);
+            CHANGE_BIT(value, CRYP_SR_IFNF_BIT, s->in_len < CRYP_FIFO_SIZE);
+            CHANGE_BIT(value, CRYP_SR_OFNE_BIT, s->out_len > 0);
+            CHANGE_BIT(value, CRYP_SR_OFFU_BIT, s->out_len == CRYP_FIFO_SIZE);
+            return value;
+        case CRYP_DIN_OFFSET:
+            /* Reads the word at the head of the FIFO */
+            return s->in_len ? s->in_fifo[0] : 0;
+        case CRYP_DOUT_OFFSET:
+            return stm32_cryp_CRYP_DOUT_read(s);
+        case CRYP_DMACR_OFFSET:
+            return s->CRYP_DMACR;
+        case CRYP_IMSCR_OFFSET:
+            return s->CRYP_IMSCR;
+        case CRYP_RISR_OFFSET:
+            return stm32_cryp_RISR_read(s);
+        case CRYP_MISR_OFFSET:
+            return stm32_cryp_RISR_read(s) & s->CRYP_IMSCR;
+        case CRYP_K0LR_OFFSET ... CRYP_K3RR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case CRYP_IV0LR_OFFSET ... CRYP_IV1RR_OFFSET:
+            return s->CRYP_IV[(offset - CRYP_IV0LR_OFFSET) / 4];
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_cryp_writew(Stm32Cryp *s, hwaddr offset, uint32_t value)
+{
+    switch (offset) {
+        case CRYP_CR_OFFSET:
+            stm32_cryp_CRYP_CR_write(s, value);
+            break;
+        case CRYP_SR_OFFSET:
+        case CRYP_DOUT_OFFSET:
+        case CRYP_RISR_OFFSET:
+        case CRYP_MISR_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        case CRYP_DIN_OFFSET:
+            stm32_cryp_CRYP_DIN_write(s, value);
+            break;
+        case CRYP_DMACR_OFFSET:
+            s->CRYP_DMACR = value & CRYP_DMACR_MASK;
+            break;
+        case CRYP_IMSCR_OFFSET:
+            s->CRYP_IMSCR = value & CRYP_IMSCR_MASK;
+            break;
+        case CRYP_K0LR_OFFSET ... CRYP_K3RR_OFFSET:
+            s->CRYP_K[(offset - CRYP_K0LR_OFFSET) / 4] = value;
+            s->key_valid = false;
+            break;
+        case CRYP_IV0LR_OFFSET ... CRYP_IV1RR_OFFSET:
+            s->CRYP_IV[(offset - CRYP_IV0LR_OFFSET) / 4] = value;
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return;
+    }
+
+    stm32_cryp_dma_block(s);
+    stm32_cryp_update(s);
+}
+
+static uint64_t stm32_cryp_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Cryp *s = (Stm32Cryp *)opaque;
+    uint64_t value;
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32_cryp_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_cryp_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_cryp_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Cryp *s = (Stm32Cryp *)opaque;
+
+    trace_stm32_cryp_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_cryp_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_cryp_ops = {
+    .read = stm32_cryp_read,
+    .write = stm32_cryp_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_cryp_reset(DeviceState *dev)
+{
+    Stm32Cryp *s = FROM_SYSBUS(Stm32Cryp, SYS_BUS_DEVICE(dev));
+
+    s->in_len = 0;
+    s->out_len = 0;
+    s->key_valid = false;
+
+    s->CRYP_CR = 0;
+    s->CRYP_DMACR = 0;
+    s->CRYP_IMSCR = 0;
+    memset(s->CRYP_K, 0, sizeof(s->CRYP_K));
+    memset(s->CRYP_IV, 0, sizeof(s->CRYP_IV));
+
+    stm32_cryp_update(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_cryp_instance_init(Object *obj)
+{
+    Stm32Cryp *s = FROM_SYSBUS(Stm32Cryp, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32f2xx_dma", "stm32f2xx_dma",
+                             (Object **)&s->stm32_dma, NULL);
+}
+
+static int stm32_cryp_init(SysBusDevice *dev)
+{
+    Stm32Cryp *s = FROM_SYSBUS(Stm32Cryp, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_cryp_ops, s,
+                          "cryp", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out(&dev->qdev, s->dma_irq, ARRAY_SIZE(s->dma_irq));
+
+    return 0;
+}
+
+static int stm32_cryp_post_load(void *opaque, int version_id)
+{
+    Stm32Cryp *s = (Stm32Cryp *)opaque;
+
+    s->key_valid = false;
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_cryp = {
+    .name = "stm32_cryp",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_cryp_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(in_fifo, Stm32Cryp, CRYP_FIFO_SIZE),
+        VMSTATE_UINT32(in_len, Stm32Cryp),
+        VMSTATE_UINT32_ARRAY(out_fifo, Stm32Cryp, CRYP_FIFO_SIZE),
+        VMSTATE_UINT32(out_len, Stm32Cryp),
+        VMSTATE_UINT32(CRYP_CR, Stm32Cryp),
+        VMSTATE_UINT32(CRYP_DMACR, Stm32Cryp),
+        VMSTATE_UINT32(CRYP_IMSCR, Stm32Cryp),
+        VMSTATE_UINT32_ARRAY(CRYP_K, Stm32Cryp, CRYP_KEY_WORDS),
+        VMSTATE_UINT32_ARRAY(CRYP_IV, Stm32Cryp, CRYP_IV_WORDS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_cryp_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Cryp, periph, -1),
+    DEFINE_PROP_INT32("dma_req_in", Stm32Cryp, dma_req_in, -1),
+    DEFINE_PROP_INT32("dma_req_out", Stm32Cryp, dma_req_out, -1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_cryp_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_cryp_init;
+    dc->reset = stm32_cryp_reset;
+    dc->props = stm32_cryp_properties;
+    dc->vmsd = &vmstate_stm32_cryp;
+}
+
+static TypeInfo stm32_cryp_info = {
+    .name  = "stm32_cryp",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Cryp),
+    .instance_init = stm32_cryp_instance_init,
+    .class_init = stm32_cryp_class_init
+};
+
+static void stm32_cryp_register_types(void)
+{
+    type_register_static(&stm32_cryp_info);
+}
+
+type_init(stm32_cryp_register_types)
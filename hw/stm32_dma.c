@@ -0,0 +1,802 @@
+/*
+ * STM32 Microcontroller DMA controller (STM32F1XX)
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * Peripheral-to-memory and memory-to-peripheral channels perform one beat
+ * each time their request line is found asserted, and keep going for as long
+ * as the peripheral holds it.  Memory-to-memory channels run to completion
+ * as soon as they are enabled; when both sides increment with the same data
+ * size the transfer is done as a few bulk copies rather than beat by beat.
+ * Transfer errors (TEIF) are not modelled.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "exec/address-spaces.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_DMA
+
+#ifdef DEBUG_STM32_DMA
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_DMA: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define STM32_DMA_MAX_CHANNELS 7
+
+#define DMA_ISR_OFFSET 0x00
+#define DMA_IFCR_OFFSET 0x04
+
+/* Flags of channel n start at bit 4 * n in ISR and IFCR. */
+#define DMA_ISR_GIF_BIT 0
+#define DMA_ISR_TCIF_BIT 1
+#define DMA_ISR_HTIF_BIT 2
+#define DMA_ISR_TEIF_BIT 3
+#define DMA_ISR_CHANNEL_MASK 0xf
+
+/* Registers of channel n start at 0x08 + 0x14 * n. */
+#define DMA_CHANNEL_START 0x08
+#define DMA_CHANNEL_SIZE 0x14
+#define DMA_CCR_OFFSET 0x00
+#define DMA_CCR_EN_BIT 0
+#define DMA_CCR_TCIE_BIT 1
+#define DMA_CCR_HTIE_BIT 2
+#define DMA_CCR_TEIE_BIT 3
+#define DMA_CCR_DIR_BIT 4
+#define DMA_CCR_CIRC_BIT 5
+#define DMA_CCR_PINC_BIT 6
+#define DMA_CCR_MINC_BIT 7
+#define DMA_CCR_PSIZE_START 8
+#define DMA_CCR_PSIZE_MASK 0x00000300
+#define DMA_CCR_MSIZE_START 10
+#define DMA_CCR_MSIZE_MASK 0x00000c00
+#define DMA_CCR_PL_START 12
+#define DMA_CCR_PL_MASK 0x00003000
+#define DMA_CCR_MEM2MEM_BIT 14
+#define DMA_CNDTR_OFFSET 0x04
+#define DMA_CPAR_OFFSET 0x08
+#define DMA_CMAR_OFFSET 0x0c
+
+/* Size of the bounce buffer used for memory-to-memory copies */
+#define STM32_DMA_COPY_CHUNK 4096
+
+typedef struct {
+    /* Register Values */
+    uint32_t
+        DMA_CCR,
+        DMA_CNDTR,
+        DMA_CPAR,
+        DMA_CMAR;
+
+    /* Transfer state, latched from the registers when the channel is
+     * enabled. */
+    uint32_t ndtr_reload;
+    uint32_t par, mar;
+
+    /* Bit mask of the asserted request inputs */
+    uint32_t req;
+} Stm32DmaChannel;
+
+struct Stm32Dma {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    /* The memory the transfers go through, the system memory unless set */
+    void *address_space_prop;
+    /* The FSMC, whose devices take runs of writes to one address at once */
+    Stm32Fsmc *stm32_fsmc;
+    /* The CRC unit, which takes runs of words to its data register */
+    Stm32Crc *stm32_crc;
+    /* Number of channels (7 for DMA1, 5 for DMA2) */
+    uint32_t channel_count;
+    /* Number of interrupt lines.  If there are fewer lines than channels,
+     * the remaining channels share the last line (DMA2 channels 4 and 5 on
+     * most F1 parts). */
+    uint32_t irq_count;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+    AddressSpace *as;
+
+    Stm32DmaChannel channel[STM32_DMA_MAX_CHANNELS];
+
+    /* Register Values */
+    uint32_t DMA_ISR;
+
+    /* Set while stm32_dma_run is transferring data, so that requests
+     * raised by the transfers themselves do not recurse. */
+    bool running;
+    /* Continues circular transfers which were paused after wrapping. */
+    QEMUBH *run_bh;
+
+    qemu_irq irq[STM32_DMA_MAX_CHANNELS];
+};
+
+
+
+
+/* TRANSFERS */
+
+static inline uint32_t stm32_dma_psize(Stm32DmaChannel *ch)
+{
+    return 1 << ((ch->DMA_CCR & DMA_CCR_PSIZE_MASK) >> DMA_CCR_PSIZE_START);
+}
+
+static inline uint32_t stm32_dma_msize(Stm32DmaChannel *ch)
+{
+    return 1 << ((ch->DMA_CCR & DMA_CCR_MSIZE_MASK) >> DMA_CCR_MSIZE_START);
+}
+
+static void stm32_dma_update_irq(Stm32Dma *s)
+{
+    int level[STM32_DMA_MAX_CHANNELS] = {0};
+    Stm32DmaChannel *ch;
+    uint32_t flags;
+    int n;
+
+    for (n = 0; n < s->channel_count; n++) {
+        ch = &s->channel[n];
+        flags = s->DMA_ISR >> (4 * n);
+        if ((IS_BIT_SET(flags, DMA_ISR_TCIF_BIT) &&
+             IS_BIT_SET(ch->DMA_CCR, DMA_CCR_TCIE_BIT)) ||
+            (IS_BIT_SET(flags, DMA_ISR_HTIF_BIT) &&
+             IS_BIT_SET(ch->DMA_CCR, DMA_CCR_HTIE_BIT)) ||
+            (IS_BIT_SET(flags, DMA_ISR_TEIF_BIT) &&
+             IS_BIT_SET(ch->DMA_CCR, DMA_CCR_TEIE_BIT))) {
+            level[MIN(n, s->irq_count - 1)] = 1;
+        }
+    }
+
+    for (n = 0; n < s->irq_count; n++) {
+        trace_stm32_dma_irq(s, n, level[n]);
+        qemu_set_irq(s->irq[n], level[n]);
+    }
+}
+
+static void stm32_dma_set_flag(Stm32Dma *s, int n, int flag_bit)
+{
+    SET_BIT(s->DMA_ISR, (4 * n + flag_bit));
+    SET_BIT(s->DMA_ISR, (4 * n + DMA_ISR_GIF_BIT));
+}
+
+/* Accounts for count beats of channel n having been transferred, raising
+ * the half and complete transfer flags as they are passed.  Returns true
+ * if a circular channel wrapped around. */
+static bool stm32_dma_advance(Stm32Dma *s, int n, uint32_t count)
+{
+    Stm32DmaChannel *ch = &s->channel[n];
+    uint32_t half = ch->ndtr_reload / 2;
+    bool wrapped = false;
+
+    if (ch->DMA_CNDTR > half && ch->DMA_CNDTR - count <= half) {
+        stm32_dma_set_flag(s, n, DMA_ISR_HTIF_BIT);
+    }
+    ch->DMA_CNDTR -= count;
+
+    if (ch->DMA_CNDTR == 0) {
+        stm32_dma_set_flag(s, n, DMA_ISR_TCIF_BIT);
+        DPRINTF("Channel %d transfer complete\n", n + 1);
+        if (IS_BIT_SET(ch->DMA_CCR, DMA_CCR_CIRC_BIT)) {
+            ch->DMA_CNDTR = ch->ndtr_reload;
+            ch->par = ch->DMA_CPAR;
+            ch->mar = ch->DMA_CMAR;
+            wrapped = true;
+        }
+    }
+
+    stm32_dma_update_irq(s);
+
+    return wrapped;
+}
+
+/* Performs a single beat of channel ch.  The data is zero extended or
+ * truncated to the destination size, as in RM0008 "Programmable data width,
+ * data alignment and endians". */
+static void stm32_dma_beat(Stm32Dma *s, Stm32DmaChannel *ch)
+{
+    uint8_t buf[4] = {0};
+    uint32_t psize = stm32_dma_psize(ch), msize = stm32_dma_msize(ch);
+
+    if (IS_BIT_SET(ch->DMA_CCR, DMA_CCR_DIR_BIT)) {
+        address_space_read(s->as, ch->mar, buf, msize);
+        address_space_write(s->as, ch->par, buf, psize);
+    } else {
+        address_space_read(s->as, ch->par, buf, psize);
+        address_space_write(s->as, ch->mar, buf, msize);
+    }
+
+    if (IS_BIT_SET(ch->DMA_CCR, DMA_CCR_PINC_BIT)) {
+        ch->par += psize;
+    }
+    if (IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MINC_BIT)) {
+        ch->mar += msize;
+    }
+}
+
+static void stm32_dma_copy(Stm32Dma *s, hwaddr dst, hwaddr src,
+                           uint32_t len)
+{
+    uint8_t buf[STM32_DMA_COPY_CHUNK];
+    uint32_t chunk;
+
+    while (len) {
+        chunk = MIN(len, sizeof(buf));
+        address_space_read(s->as, src, buf, chunk);
+        address_space_write(s->as, dst, buf, chunk);
+        src += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+/* Gives the len bytes at buf to the device at the single address dst, if
+ * it takes bursts: an FSMC device or the CRC unit. */
+static bool stm32_dma_burst_write(Stm32Dma *s, hwaddr dst,
+                                  const uint8_t *buf, uint32_t len,
+                                  uint32_t size)
+{
+    return (s->stm32_fsmc &&
+            stm32_fsmc_burst_write(s->stm32_fsmc, dst, buf, len, size)) ||
+           (s->stm32_crc &&
+            stm32_crc_burst_write(s->stm32_crc, dst, buf, len, size));
+}
+
+/* Copies len bytes from src to the single address dst, size bytes at a
+ * time, in chunks given to the device at dst.  Returns false without
+ * copying anything if that device does not take bursts. */
+static bool stm32_dma_burst(Stm32Dma *s, hwaddr dst, hwaddr src,
+                            uint32_t len, uint32_t size)
+{
+    uint8_t buf[STM32_DMA_COPY_CHUNK];
+    uint32_t chunk;
+
+    if (!stm32_dma_burst_write(s, dst, NULL, 0, size)) {
+        return false;
+    }
+
+    while (len) {
+        chunk = MIN(len, sizeof(buf));
+        address_space_read(s->as, src, buf, chunk);
+        stm32_dma_burst_write(s, dst, buf, chunk, size);
+        src += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+/* Runs a memory-to-memory transfer of channel n to completion. */
+static void stm32_dma_mem2mem(Stm32Dma *s, int n)
+{
+    Stm32DmaChannel *ch = &s->channel[n];
+    uint32_t size = stm32_dma_psize(ch);
+    uint32_t count, len;
+    hwaddr src, dst;
+    bool to_periph = IS_BIT_SET(ch->DMA_CCR, DMA_CCR_DIR_BIT);
+    bool pinc = IS_BIT_SET(ch->DMA_CCR, DMA_CCR_PINC_BIT);
+    bool minc = IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MINC_BIT);
+    bool bulk;
+
+    src = to_periph ? ch->mar : ch->par;
+    dst = to_periph ? ch->par : ch->mar;
+    len = ch->DMA_CNDTR * size;
+
+    /* A run from memory to one address, such as the data register of an
+     * LCD on the FSMC or of the CRC unit, may go to the device in one
+     * burst. */
+    if ((to_periph ? minc && !pinc : pinc && !minc) &&
+        size == stm32_dma_msize(ch)) {
+        while (ch->DMA_CNDTR) {
+            count = ch->DMA_CNDTR - ch->ndtr_reload / 2;
+            if (count == 0 || count > ch->DMA_CNDTR) {
+                count = ch->DMA_CNDTR;
+            }
+            if (!stm32_dma_burst(s, dst, src, count * size, size)) {
+                break;
+            }
+            src += count * size;
+            if (to_periph) {
+                ch->mar += count * size;
+            } else {
+                ch->par += count * size;
+            }
+            stm32_dma_advance(s, n, count);
+        }
+        if (!ch->DMA_CNDTR) {
+            return;
+        }
+    }
+
+    /* Copying in chunks is only equivalent to the beat by beat transfer if
+     * both sides move forward together and do not overlap. */
+    bulk = IS_BIT_SET(ch->DMA_CCR, DMA_CCR_PINC_BIT) &&
+           IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MINC_BIT) &&
+           size == stm32_dma_msize(ch) &&
+           (src + len <= dst || dst + len <= src);
+
+    if (!bulk) {
+        while (ch->DMA_CNDTR) {
+            stm32_dma_beat(s, ch);
+            stm32_dma_advance(s, n, 1);
+        }
+        return;
+    }
+
+    DPRINTF("Channel %d copying 0x%x bytes from 0x%08x to 0x%08x\n",
+            n + 1, len, (uint32_t)src, (uint32_t)dst);
+
+    /* Copy up to the half transfer point, then the rest, so that both
+     * flags are raised. */
+    while (ch->DMA_CNDTR) {
+        count = ch->DMA_CNDTR - ch->ndtr_reload / 2;
+        if (count == 0 || count > ch->DMA_CNDTR) {
+            count = ch->DMA_CNDTR;
+        }
+        stm32_dma_copy(s, dst, src, count * size);
+        src += count * size;
+        dst += count * size;
+        ch->par += count * size;
+        ch->mar += count * size;
+        stm32_dma_advance(s, n, count);
+    }
+}
+
+static bool stm32_dma_channel_ready(Stm32DmaChannel *ch)
+{
+    return IS_BIT_SET(ch->DMA_CCR, DMA_CCR_EN_BIT) &&
+           ch->DMA_CNDTR != 0 &&
+           (ch->req || IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT));
+}
+
+/* Picks the ready channel with the highest priority level, the lowest
+ * numbered one winning a tie.  Returns -1 if no channel is ready. */
+static int stm32_dma_next_channel(Stm32Dma *s, uint32_t skip)
+{
+    int n, best = -1;
+    uint32_t pl, best_pl = 0;
+
+    for (n = 0; n < s->channel_count; n++) {
+        if (IS_BIT_SET(skip, n) || !stm32_dma_channel_ready(&s->channel[n])) {
+            continue;
+        }
+        pl = (s->channel[n].DMA_CCR & DMA_CCR_PL_MASK) >> DMA_CCR_PL_START;
+        if (best < 0 || pl > best_pl) {
+            best = n;
+            best_pl = pl;
+        }
+    }
+
+    return best;
+}
+
+/* Services channels until none is ready.  A circular channel that wraps
+ * is left alone until the bottom half runs, so that a request which stays
+ * asserted cannot keep the CPU from running. */
+static void stm32_dma_run(Stm32Dma *s)
+{
+    uint32_t paused = 0;
+    int n;
+
+    if (s->running) {
+        return;
+    }
+    s->running = true;
+
+    while ((n = stm32_dma_next_channel(s, paused)) >= 0) {
+        if (IS_BIT_SET(s->channel[n].DMA_CCR, DMA_CCR_MEM2MEM_BIT)) {
+            stm32_dma_mem2mem(s, n);
+        } else {
+            stm32_dma_beat(s, &s->channel[n]);
+            if (stm32_dma_advance(s, n, 1)) {
+                SET_BIT(paused, n);
+                qemu_bh_schedule(s->run_bh);
+            }
+        }
+    }
+
+    s->running = false;
+}
+
+static void stm32_dma_run_bh(void *opaque)
+{
+    stm32_dma_run((Stm32Dma *)opaque);
+}
+
+static void stm32_dma_request_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    Stm32DmaChannel *ch = &s->channel[n / STM32_DMA_REQ_PER_CHANNEL];
+
+    CHANGE_BIT(ch->req, n % STM32_DMA_REQ_PER_CHANNEL, level);
+    if (level) {
+        stm32_dma_run(s);
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_dma_DMA_IFCR_write(Stm32Dma *s, uint32_t new_value)
+{
+    uint32_t clear = 0;
+    int n;
+
+    for (n = 0; n < s->channel_count; n++) {
+        if (IS_BIT_SET(new_value, (4 * n + DMA_ISR_GIF_BIT))) {
+            /* CGIF clears all of the channel's flags. */
+            clear |= DMA_ISR_CHANNEL_MASK << (4 * n);
+        } else {
+            clear |= new_value & (DMA_ISR_CHANNEL_MASK << (4 * n));
+        }
+    }
+    s->DMA_ISR &= ~clear;
+
+    /* GIF stays set while another flag of the channel is. */
+    for (n = 0; n < s->channel_count; n++) {
+        if (s->DMA_ISR & (DMA_ISR_CHANNEL_MASK << (4 * n))) {
+            SET_BIT(s->DMA_ISR, (4 * n + DMA_ISR_GIF_BIT));
+        }
+    }
+
+    stm32_dma_update_irq(s);
+}
+
+static void stm32_dma_DMA_CCR_write(Stm32Dma *s, int n, uint32_t new_value,
+                                    bool init)
+{
+    Stm32DmaChannel *ch = &s->channel[n];
+    bool was_enabled = IS_BIT_SET(ch->DMA_CCR, DMA_CCR_EN_BIT);
+
+    ch->DMA_CCR = new_value & 0x00007fff;
+
+    if (IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT) &&
+        IS_BIT_SET(ch->DMA_CCR, DMA_CCR_CIRC_BIT)) {
+        stm32_hw_warn("%s: Channel %d: circular mode cannot be used with "
+                      "memory to memory transfers, ignoring CIRC",
+                      s->busdev.qdev.id, n + 1);
+        RESET_BIT(ch->DMA_CCR, DMA_CCR_CIRC_BIT);
+    }
+
+    if (!was_enabled && IS_BIT_SET(ch->DMA_CCR, DMA_CCR_EN_BIT)) {
+        ch->ndtr_reload = ch->DMA_CNDTR;
+        ch->par = ch->DMA_CPAR;
+        ch->mar = ch->DMA_CMAR;
+        DPRINTF("Channel %d enabled, CCR=0x%04x CNDTR=%u CPAR=0x%08x "
+                "CMAR=0x%08x\n", n + 1, ch->DMA_CCR, ch->DMA_CNDTR,
+                ch->DMA_CPAR, ch->DMA_CMAR);
+    }
+
+    if (!init) {
+        stm32_dma_update_irq(s);
+        stm32_dma_run(s);
+    }
+}
+
+/* CNDTR, CPAR and CMAR may only be written while the channel is disabled. */
+static bool stm32_dma_check_disabled(Stm32Dma *s, int n, hwaddr offset)
+{
+    if (IS_BIT_SET(s->channel[n].DMA_CCR, DMA_CCR_EN_BIT)) {
+        stm32_hw_warn("%s: Channel %d: ignoring write to register 0x%x "
+                      "while the channel is enabled",
+                      s->busdev.qdev.id, n + 1, (int)offset);
+        return false;
+    }
+    return true;
+}
+
+static uint64_t stm32_dma_readw(Stm32Dma *s, hwaddr offset)
+{
+    Stm32DmaChannel *ch;
+    int n;
+
+    switch (offset) {
+        case DMA_ISR_OFFSET:
+            return s->DMA_ISR;
+        case DMA_IFCR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+    }
+
+    n = (offset - DMA_CHANNEL_START) / DMA_CHANNEL_SIZE;
+    if (n >= s->channel_count) {
+        STM32_BAD_REG(offset, 4);
+        return 0;
+    }
+    ch = &s->channel[n];
+
+    switch ((offset - DMA_CHANNEL_START) % DMA_CHANNEL_SIZE) {
+        case DMA_CCR_OFFSET:
+            return ch->DMA_CCR;
+        case DMA_CNDTR_OFFSET:
+            return ch->DMA_CNDTR;
+        case DMA_CPAR_OFFSET:
+            return ch->DMA_CPAR;
+        case DMA_CMAR_OFFSET:
+            return ch->DMA_CMAR;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_dma_writew(Stm32Dma *s, hwaddr offset, uint64_t value)
+{
+    Stm32DmaChannel *ch;
+    int n;
+
+    switch (offset) {
+        case DMA_ISR_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        case DMA_IFCR_OFFSET:
+            stm32_dma_DMA_IFCR_write(s, value);
+            return;
+    }
+
+    n = (offset - DMA_CHANNEL_START) / DMA_CHANNEL_SIZE;
+    if (n >= s->channel_count) {
+        STM32_BAD_REG(offset, 4);
+        return;
+    }
+    ch = &s->channel[n];
+
+    switch ((offset - DMA_CHANNEL_START) % DMA_CHANNEL_SIZE) {
+        case DMA_CCR_OFFSET:
+            stm32_dma_DMA_CCR_write(s, n, value, false);
+            break;
+        case DMA_CNDTR_OFFSET:
+            if (stm32_dma_check_disabled(s, n, offset)) {
+                ch->DMA_CNDTR = value & 0x0000ffff;
+            }
+            break;
+        case DMA_CPAR_OFFSET:
+            if (stm32_dma_check_disabled(s, n, offset)) {
+                ch->DMA_CPAR = value;
+            }
+            break;
+        case DMA_CMAR_OFFSET:
+            if (stm32_dma_check_disabled(s, n, offset)) {
+                ch->DMA_CMAR = value;
+            }
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+static uint64_t stm32_dma_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32_dma_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_dma_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_dma_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+
+    trace_stm32_dma_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_dma_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_dma_ops = {
+    .read = stm32_dma_read,
+    .write = stm32_dma_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_dma_reset(DeviceState *dev)
+{
+    Stm32Dma *s = FROM_SYSBUS(Stm32Dma, SYS_BUS_DEVICE(dev));
+    Stm32DmaChannel *ch;
+    int n;
+
+    s->DMA_ISR = 0;
+    for (n = 0; n < s->channel_count; n++) {
+        ch = &s->channel[n];
+        stm32_dma_DMA_CCR_write(s, n, 0x00000000, true);
+        ch->DMA_CNDTR = 0;
+        ch->DMA_CPAR = 0;
+        ch->DMA_CMAR = 0;
+    }
+
+    stm32_dma_update_irq(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+uint32_t stm32_dma_block_begin(Stm32Dma *s, int channel, hwaddr par,
+                               bool to_mem, uint32_t size, hwaddr *mar,
+                               uint32_t *mstep)
+{
+    Stm32DmaChannel *ch;
+
+    assert(channel >= 1 && channel <= s->channel_count);
+    ch = &s->channel[channel - 1];
+
+    if (s->running ||
+        !IS_BIT_SET(ch->DMA_CCR, DMA_CCR_EN_BIT) ||
+        IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT) ||
+        IS_BIT_SET(ch->DMA_CCR, DMA_CCR_DIR_BIT) == to_mem ||
+        IS_BIT_SET(ch->DMA_CCR, DMA_CCR_PINC_BIT) ||
+        ch->par != par ||
+        stm32_dma_psize(ch) != size || stm32_dma_msize(ch) != size) {
+        return 0;
+    }
+
+    *mar = ch->mar;
+    *mstep = IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MINC_BIT) ? size : 0;
+    return ch->DMA_CNDTR;
+}
+
+void stm32_dma_block_end(Stm32Dma *s, int channel, uint32_t count)
+{
+    Stm32DmaChannel *ch = &s->channel[channel - 1];
+
+    assert(count <= ch->DMA_CNDTR);
+    if (IS_BIT_SET(ch->DMA_CCR, DMA_CCR_MINC_BIT)) {
+        ch->mar += count * stm32_dma_msize(ch);
+    }
+    if (count && stm32_dma_advance(s, channel - 1, count)) {
+        qemu_bh_schedule(s->run_bh);
+    }
+}
+
+uint32_t stm32_dma_get_reload(Stm32Dma *s, int channel)
+{
+    Stm32DmaChannel *ch;
+
+    assert(channel >= 1 && channel <= s->channel_count);
+    ch = &s->channel[channel - 1];
+
+    return IS_BIT_SET(ch->DMA_CCR, DMA_CCR_EN_BIT) ? ch->ndtr_reload : 0;
+}
+
+
+
+
+AddressSpace *stm32_dma_get_address_space(Stm32Dma *s)
+{
+    return s->as;
+}
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_dma_instance_init(Object *obj)
+{
+    Stm32Dma *s = FROM_SYSBUS(Stm32Dma, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32_fsmc", "stm32_fsmc",
+                             (Object **)&s->stm32_fsmc, NULL);
+    object_property_add_link(obj, "stm32_crc", "stm32_crc",
+                             (Object **)&s->stm32_crc, NULL);
+}
+
+static int stm32_dma_init(SysBusDevice *dev)
+{
+    Stm32Dma *s = FROM_SYSBUS(Stm32Dma, dev);
+    int n;
+
+    if (s->channel_count == 0 || s->channel_count > STM32_DMA_MAX_CHANNELS) {
+        hw_error("stm32_dma: channel_count must be between 1 and %d",
+                 STM32_DMA_MAX_CHANNELS);
+    }
+    if (s->irq_count == 0 || s->irq_count > s->channel_count) {
+        hw_error("stm32_dma: irq_count must be between 1 and channel_count");
+    }
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+    s->as = s->address_space_prop ? (AddressSpace *)s->address_space_prop
+                                  : &address_space_memory;
+
+    memory_region_init_io(&s->iomem, &stm32_dma_ops, s,
+                          "dma", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    for (n = 0; n < s->irq_count; n++) {
+        sysbus_init_irq(dev, &s->irq[n]);
+    }
+
+    qdev_init_gpio_in(&dev->qdev, stm32_dma_request_irq_handler,
+                      s->channel_count * STM32_DMA_REQ_PER_CHANNEL);
+
+    s->run_bh = qemu_bh_new(stm32_dma_run_bh, s);
+
+    return 0;
+}
+
+static Property stm32_dma_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Dma, periph, -1),
+    DEFINE_PROP_PTR("address_space", Stm32Dma, address_space_prop),
+    DEFINE_PROP_UINT32("channel_count", Stm32Dma, channel_count,
+                       STM32_DMA_MAX_CHANNELS),
+    DEFINE_PROP_UINT32("irq_count", Stm32Dma, irq_count,
+                       STM32_DMA_MAX_CHANNELS),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_dma_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_dma_init;
+    dc->reset = stm32_dma_reset;
+    dc->props = stm32_dma_properties;
+}
+
+static TypeInfo stm32_dma_info = {
+    .name  = "stm32_dma",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Dma),
+    .instance_init = stm32_dma_instance_init,
+    .class_init = stm32_dma_class_init
+};
+
+static void stm32_dma_register_types(void)
+{
+    type_register_static(&stm32_dma_info);
+}
+
+type_init(stm32_dma_register_types)
@@ -0,0 +1,1273 @@
+/*
+ * STM32 Microcontroller Ethernet MAC (STM32F2XX)
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual Rev 4"
+ *
+ * The MAC sends and receives its frames on a QEMU network client
+ * ("-net nic,model=stm32_eth").  The DMA engine walks the transmit and
+ * receive descriptor lists of the reference manual, in ring or chained
+ * mode, with normal or enhanced (EDFE) descriptors:
+ *
+ * - A transmit poll demand (or starting the transmit process) sends every
+ *   frame the firmware has handed over, until the first descriptor the
+ *   DMA does not own, and raises the interrupt once for the whole batch.
+ *   If the network backend cannot take more frames, the walk stops and is
+ *   resumed when the backend has flushed its queue.
+ * - A received frame is stored only if the descriptors owned by the DMA
+ *   can hold all of it.  Otherwise the receive process suspends (RBUS)
+ *   and the frame is left queued in the network layer; a receive poll
+ *   demand flushes the queue into the ring again.
+ *
+ * Buffers are copied with one mapping of guest memory each.  The IPv4
+ * header and TCP/UDP checksums are inserted as the CIC field of a transmit
+ * descriptor asks (the pseudo header is always included).  The frame check
+ * sequence is appended to the received frames, as the MAC passes it on.
+ *
+ * A PHY modelled on the DP83848 of the STM3220G-EVAL board answers at
+ * the address given by the "phy_addr" property; it reports a 100 Mbit/s
+ * full duplex link that follows the link state of the network client.
+ *
+ * Flow control, the PMT wake up frames, the time stamps (PTP) and the
+ * MMC counters (which read as zero) are not modelled, and no receive
+ * checksum errors are ever reported.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "net/net.h"
+#include "net/checksum.h"
+#include "qemu/iov.h"
+#include "trace.h"
+#include <zlib.h>
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_ETH
+
+#ifdef DEBUG_STM32_ETH
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_ETH: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define ETH_MACCR_OFFSET 0x0000
+#define ETH_MACCR_RE_BIT 2
+#define ETH_MACCR_TE_BIT 3
+#define ETH_MACCR_MASK 0x02ff7efc
+
+#define ETH_MACFFR_OFFSET 0x0004
+#define ETH_MACFFR_PM_BIT 0
+#define ETH_MACFFR_HU_BIT 1
+#define ETH_MACFFR_HM_BIT 2
+#define ETH_MACFFR_DAIF_BIT 3
+#define ETH_MACFFR_PAM_BIT 4
+#define ETH_MACFFR_BFD_BIT 5
+#define ETH_MACFFR_HPF_BIT 10
+#define ETH_MACFFR_RA_BIT 31
+#define ETH_MACFFR_MASK 0x800007ff
+
+#define ETH_MACHTHR_OFFSET 0x0008
+#define ETH_MACHTLR_OFFSET 0x000c
+
+#define ETH_MACMIIAR_OFFSET 0x0010
+#define ETH_MACMIIAR_MB_BIT 0
+#define ETH_MACMIIAR_MW_BIT 1
+#define ETH_MACMIIAR_MR_START 6
+#define ETH_MACMIIAR_PA_START 11
+#define ETH_MACMIIAR_MASK 0x0000ffdf
+
+#define ETH_MACMIIDR_OFFSET 0x0014
+#define ETH_MACFCR_OFFSET 0x0018
+#define ETH_MACFCR_MASK 0xffff00bf
+#define ETH_MACVLANTR_OFFSET 0x001c
+#define ETH_MACVLANTR_MASK 0x0001ffff
+#define ETH_MACRWUFFR_OFFSET 0x0028
+#define ETH_MACPMTCSR_OFFSET 0x002c
+#define ETH_MACPMTCSR_MASK 0x80000207
+#define ETH_MACSR_OFFSET 0x0038
+#define ETH_MACIMR_OFFSET 0x003c
+#define ETH_MACIMR_MASK 0x00000208
+
+/* MAC address n high and low registers, 8 bytes apart */
+#define ETH_MACAHR_OFFSET 0x0040
+#define ETH_MACALR_OFFSET 0x0044
+#define ETH_MACAHR_AE_BIT 31
+#define ETH_MACAHR_SA_BIT 30
+#define ETH_MACAHR_MBC_START 24
+#define ETH_MACA0HR_MASK 0x0000ffff
+#define ETH_MACAHR_MASK 0xff00ffff
+#define STM32_ETH_MAC_ADDR_COUNT 4
+
+#define ETH_MMCCR_OFFSET 0x0100
+#define ETH_MMCCR_MASK 0x0000000f
+#define ETH_MMCRIR_OFFSET 0x0104
+#define ETH_MMCTIR_OFFSET 0x0108
+#define ETH_MMCRIMR_OFFSET 0x010c
+#define ETH_MMCRIMR_MASK 0x00020060
+#define ETH_MMCTIMR_OFFSET 0x0110
+#define ETH_MMCTIMR_MASK 0x0020c000
+#define ETH_MMCTGFSCCR_OFFSET 0x014c
+#define ETH_MMCTGFMSCCR_OFFSET 0x0150
+#define ETH_MMCTGFCR_OFFSET 0x0168
+#define ETH_MMCRFCECR_OFFSET 0x0194
+#define ETH_MMCRFAECR_OFFSET 0x0198
+#define ETH_MMCRGUFCR_OFFSET 0x01c4
+
+#define ETH_DMABMR_OFFSET 0x1000
+#define ETH_DMABMR_SR_BIT 0
+#define ETH_DMABMR_DSL_START 2
+#define ETH_DMABMR_DSL_MASK 0x0000007c
+#define ETH_DMABMR_EDFE_BIT 7
+#define ETH_DMABMR_MASK 0x07ffffff
+
+#define ETH_DMATPDR_OFFSET 0x1004
+#define ETH_DMARPDR_OFFSET 0x1008
+#define ETH_DMARDLAR_OFFSET 0x100c
+#define ETH_DMATDLAR_OFFSET 0x1010
+
+#define ETH_DMASR_OFFSET 0x1014
+#define ETH_DMASR_TS_BIT 0
+#define ETH_DMASR_TPSS_BIT 1
+#define ETH_DMASR_TBUS_BIT 2
+#define ETH_DMASR_RS_BIT 6
+#define ETH_DMASR_RBUS_BIT 7
+#define ETH_DMASR_RPSS_BIT 8
+#define ETH_DMASR_ERS_BIT 14
+#define ETH_DMASR_AIS_BIT 15
+#define ETH_DMASR_NIS_BIT 16
+#define ETH_DMASR_RPS_START 17
+#define ETH_DMASR_RPS_MASK 0x000e0000
+#define ETH_DMASR_TPS_START 20
+#define ETH_DMASR_TPS_MASK 0x00700000
+/* The interrupt flags, which are cleared by writing 1 to them */
+#define ETH_DMASR_W1C_MASK 0x0001e7ff
+/* The flags that make up NIS and AIS */
+#define ETH_DMASR_NORMAL_MASK 0x00004045
+#define ETH_DMASR_ABNORMAL_MASK 0x000027ba
+
+#define ETH_DMAOMR_OFFSET 0x1018
+#define ETH_DMAOMR_SR_BIT 1
+#define ETH_DMAOMR_ST_BIT 13
+#define ETH_DMAOMR_FTF_BIT 20
+#define ETH_DMAOMR_MASK 0x073020de
+
+#define ETH_DMAIER_OFFSET 0x101c
+#define ETH_DMAIER_MASK 0x0001e7ff
+#define ETH_DMAMFBOCR_OFFSET 0x1020
+#define ETH_DMACHTDR_OFFSET 0x1048
+#define ETH_DMACHRDR_OFFSET 0x104c
+#define ETH_DMACHTBAR_OFFSET 0x1050
+#define ETH_DMACHRBAR_OFFSET 0x1054
+
+/* DMA process states, as shown in ETH_DMASR TPS and RPS */
+#define STM32_ETH_PS_STOPPED 0
+#define STM32_ETH_PS_RUNNING 1
+#define STM32_ETH_RPS_WAITING 3
+#define STM32_ETH_RPS_SUSPENDED 4
+#define STM32_ETH_TPS_SUSPENDED 6
+
+/* Transmit descriptor */
+#define ETH_TDES0_OWN_BIT 31
+#define ETH_TDES0_IC_BIT 30
+#define ETH_TDES0_LS_BIT 29
+#define ETH_TDES0_FS_BIT 28
+#define ETH_TDES0_DP_BIT 26
+#define ETH_TDES0_CIC_START 22
+#define ETH_TDES0_CIC_MASK 0x00c00000
+#define ETH_TDES0_TER_BIT 21
+#define ETH_TDES0_TCH_BIT 20
+/* The status bits the DMA writes back */
+#define ETH_TDES0_STATUS_MASK 0x0003ffff
+
+/* Receive descriptor */
+#define ETH_RDES0_OWN_BIT 31
+#define ETH_RDES0_FL_START 16
+#define ETH_RDES0_FS_BIT 9
+#define ETH_RDES0_LS_BIT 8
+#define ETH_RDES0_FT_BIT 5
+#define ETH_RDES1_DIC_BIT 31
+#define ETH_RDES1_RER_BIT 15
+#define ETH_RDES1_RCH_BIT 14
+
+#define ETH_DES1_BS1_MASK 0x00001fff
+#define ETH_DES1_BS2_START 16
+#define ETH_DES1_BS2_MASK 0x1fff0000
+
+/* Enough for the largest frame the two buffers of a descriptor can hold,
+ * which is more than a jumbo frame. */
+#define STM32_ETH_FRAME_MAX 16384
+#define STM32_ETH_MIN_FRAME 60
+#define STM32_ETH_FCS_SIZE 4
+/* Bounds the descriptors walked at once, in case the firmware links a
+ * list into a loop that the DMA never gets to the end of. */
+#define STM32_ETH_DESC_MAX 4096
+
+/* PHY registers */
+#define PHY_BMCR 0x00
+#define PHY_BMCR_RESET_BIT 15
+#define PHY_BMCR_ANRESTART_BIT 9
+#define PHY_BMSR 0x01
+#define PHY_BMSR_LINK_BIT 2
+#define PHY_BMSR_ANCOMPLETE_BIT 5
+#define PHY_IDR1 0x02
+#define PHY_IDR2 0x03
+#define PHY_ANAR 0x04
+#define PHY_ANLPAR 0x05
+#define PHY_ANER 0x06
+/* DP83848 PHY status register */
+#define PHY_PHYSR 0x10
+#define PHY_PHYSR_LINK_BIT 0
+#define PHY_PHYSR_DUPLEX_BIT 2
+#define PHY_PHYSR_ANCOMPLETE_BIT 4
+
+#define PHY_BMCR_RESET_VALUE 0x3100
+#define PHY_BMSR_VALUE 0x7809
+#define PHY_IDR1_VALUE 0x2000
+#define PHY_IDR2_VALUE 0x5c90
+#define PHY_ANAR_RESET_VALUE 0x01e1
+#define PHY_ANLPAR_VALUE 0x45e1
+
+struct Stm32Eth {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    NICConf conf;
+    uint32_t phy_addr;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    NICState *nic;
+
+    /* The frame being gathered from the transmit descriptors */
+    uint8_t *tx_frame;
+    int tx_len;
+    /* The backend queued the last frame sent; the transmit walk resumes
+     * once it has been flushed. */
+    bool tx_waiting;
+
+    uint16_t phy_bmcr, phy_anar;
+
+    uint32_t
+        ETH_MACCR,
+        ETH_MACFFR,
+        ETH_MACHTHR,
+        ETH_MACHTLR,
+        ETH_MACMIIAR,
+        ETH_MACMIIDR,
+        ETH_MACFCR,
+        ETH_MACVLANTR,
+        ETH_MACPMTCSR,
+        ETH_MACIMR,
+        ETH_MACAHR[STM32_ETH_MAC_ADDR_COUNT],
+        ETH_MACALR[STM32_ETH_MAC_ADDR_COUNT],
+        ETH_MMCCR,
+        ETH_MMCRIMR,
+        ETH_MMCTIMR,
+        ETH_DMABMR,
+        ETH_DMARDLAR,
+        ETH_DMATDLAR,
+        ETH_DMASR,
+        ETH_DMAOMR,
+        ETH_DMAIER,
+        ETH_DMACHTDR,
+        ETH_DMACHRDR,
+        ETH_DMACHTBAR,
+        ETH_DMACHRBAR;
+
+    qemu_irq irq;
+};
+
+
+
+
+/* GUEST MEMORY */
+
+/* Copies between guest memory and buf with a single mapping, falling back
+ * to the slow path for buffers that are not all RAM. */
+static void stm32_eth_memory_rw(hwaddr addr, uint8_t *buf, int len,
+                                bool is_write)
+{
+    hwaddr plen = len;
+    void *p;
+
+    if (len == 0) {
+        return;
+    }
+    p = cpu_physical_memory_map(addr, &plen, is_write);
+    if (p && plen == len) {
+        if (is_write) {
+            memcpy(p, buf, len);
+        } else {
+            memcpy(buf, p, len);
+        }
+        cpu_physical_memory_unmap(p, plen, is_write, len);
+        return;
+    }
+    if (p) {
+        cpu_physical_memory_unmap(p, plen, is_write, 0);
+    }
+    cpu_physical_memory_rw(addr, buf, len, is_write);
+}
+
+/* Reads the four words of the descriptor at addr that the DMA uses. */
+static void stm32_eth_desc_read(hwaddr addr, uint32_t des[4])
+{
+    int i;
+
+    cpu_physical_memory_read(addr, (uint8_t *)des, 4 * sizeof(uint32_t));
+    for (i = 0; i < 4; i++) {
+        des[i] = le32_to_cpu(des[i]);
+    }
+}
+
+/* Gets the descriptor that follows the one at addr. */
+static uint32_t stm32_eth_desc_next(Stm32Eth *s, uint32_t addr,
+                                    const uint32_t des[4], bool chained,
+                                    bool end_of_ring, uint32_t list_addr)
+{
+    uint32_t size = IS_BIT_SET(s->ETH_DMABMR, ETH_DMABMR_EDFE_BIT) ? 32 : 16;
+    uint32_t skip = (s->ETH_DMABMR & ETH_DMABMR_DSL_MASK) >>
+                    ETH_DMABMR_DSL_START;
+
+    if (chained) {
+        return des[3];
+    }
+    if (end_of_ring) {
+        return list_addr;
+    }
+    return addr + size + skip * 4;
+}
+
+
+
+
+/* INTERRUPTS */
+
+static void stm32_eth_update_irq(Stm32Eth *s)
+{
+    uint32_t flags = s->ETH_DMASR & s->ETH_DMAIER;
+    bool level;
+
+    s->ETH_DMASR &= ~(GET_BIT_MASK_ONE(ETH_DMASR_NIS_BIT) |
+                      GET_BIT_MASK_ONE(ETH_DMASR_AIS_BIT));
+    if (s->ETH_DMASR & ETH_DMASR_NORMAL_MASK) {
+        s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_NIS_BIT);
+    }
+    if (s->ETH_DMASR & ETH_DMASR_ABNORMAL_MASK) {
+        s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_AIS_BIT);
+    }
+
+    level = ((flags & ETH_DMASR_NORMAL_MASK) &&
+             IS_BIT_SET(s->ETH_DMAIER, ETH_DMASR_NIS_BIT)) ||
+            ((flags & ETH_DMASR_ABNORMAL_MASK) &&
+             IS_BIT_SET(s->ETH_DMAIER, ETH_DMASR_AIS_BIT));
+    trace_stm32_eth_irq(s, level);
+    qemu_set_irq(s->irq, level);
+}
+
+static void stm32_eth_set_tps(Stm32Eth *s, uint32_t state)
+{
+    s->ETH_DMASR = (s->ETH_DMASR & ~ETH_DMASR_TPS_MASK) |
+                   (state << ETH_DMASR_TPS_START);
+}
+
+static void stm32_eth_set_rps(Stm32Eth *s, uint32_t state)
+{
+    s->ETH_DMASR = (s->ETH_DMASR & ~ETH_DMASR_RPS_MASK) |
+                   (state << ETH_DMASR_RPS_START);
+}
+
+static uint32_t stm32_eth_rps(Stm32Eth *s)
+{
+    return (s->ETH_DMASR & ETH_DMASR_RPS_MASK) >> ETH_DMASR_RPS_START;
+}
+
+
+
+
+/* TRANSMIT */
+
+static void stm32_eth_tx_run(Stm32Eth *s);
+
+static void stm32_eth_tx_sent(NetClientState *nc, ssize_t len)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+
+    s->tx_waiting = false;
+    stm32_eth_tx_run(s);
+}
+
+/* Inserts the checksums the CIC field of the last descriptor asks for. */
+static void stm32_eth_tx_checksum(uint8_t *frame, int len, int cic)
+{
+    int hlen;
+    uint16_t csum;
+
+    if (cic == 0 || len < 34 || frame[12] != 0x08 || frame[13] != 0x00 ||
+        (frame[14] & 0xf0) != 0x40) {
+        return;
+    }
+    hlen = (frame[14] & 0x0f) * 4;
+    if (hlen < 20 || 14 + hlen > len) {
+        return;
+    }
+    frame[24] = 0;
+    frame[25] = 0;
+    csum = net_checksum_finish(net_checksum_add(hlen, frame + 14));
+    frame[24] = csum >> 8;
+    frame[25] = csum & 0xff;
+
+    if (cic >= 2) {
+        net_checksum_calculate(frame, len);
+    }
+}
+
+/* Appends a transmit buffer to the frame being gathered.  What does not
+ * fit in the frame buffer is dropped. */
+static void stm32_eth_tx_gather(Stm32Eth *s, uint32_t addr, int len)
+{
+    len = MIN(len, STM32_ETH_FRAME_MAX - s->tx_len);
+    stm32_eth_memory_rw(addr, s->tx_frame + s->tx_len, len, false);
+    s->tx_len += len;
+    s->ETH_DMACHTBAR = addr;
+}
+
+/* Sends the frames of all the descriptors that the DMA owns, starting at
+ * the current one.  A frame can span several walks, if the firmware hands
+ * its descriptors over one at a time. */
+static void stm32_eth_tx_run(Stm32Eth *s)
+{
+    uint32_t des[4], addr;
+    bool interrupt = false;
+    int len, cic, n;
+
+    if (!IS_BIT_SET(s->ETH_DMAOMR, ETH_DMAOMR_ST_BIT) || s->tx_waiting) {
+        return;
+    }
+    stm32_eth_set_tps(s, STM32_ETH_PS_RUNNING);
+
+    for (n = 0; n < STM32_ETH_DESC_MAX; n++) {
+        addr = s->ETH_DMACHTDR;
+        stm32_eth_desc_read(addr, des);
+        if (!IS_BIT_SET(des[0], ETH_TDES0_OWN_BIT)) {
+            s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_TBUS_BIT);
+            stm32_eth_set_tps(s, STM32_ETH_TPS_SUSPENDED);
+            break;
+        }
+
+        if (IS_BIT_SET(des[0], ETH_TDES0_FS_BIT)) {
+            s->tx_len = 0;
+        }
+        stm32_eth_tx_gather(s, des[2], des[1] & ETH_DES1_BS1_MASK);
+        if (!IS_BIT_SET(des[0], ETH_TDES0_TCH_BIT)) {
+            stm32_eth_tx_gather(s, des[3], (des[1] & ETH_DES1_BS2_MASK) >>
+                                           ETH_DES1_BS2_START);
+        }
+        s->ETH_DMACHTDR = stm32_eth_desc_next(s, addr, des,
+                              IS_BIT_SET(des[0], ETH_TDES0_TCH_BIT),
+                              IS_BIT_SET(des[0], ETH_TDES0_TER_BIT),
+                              s->ETH_DMATDLAR);
+
+        /* Hand the descriptor back, with a clean status. */
+        des[0] &= ~(GET_BIT_MASK_ONE(ETH_TDES0_OWN_BIT) |
+                    ETH_TDES0_STATUS_MASK);
+        stl_le_phys(addr, des[0]);
+
+        if (!IS_BIT_SET(des[0], ETH_TDES0_LS_BIT)) {
+            continue;
+        }
+
+        len = s->tx_len;
+        s->tx_len = 0;
+        if (IS_BIT_SET(des[0], ETH_TDES0_IC_BIT)) {
+            interrupt = true;
+        }
+        if (!IS_BIT_SET(s->ETH_MACCR, ETH_MACCR_TE_BIT)) {
+            DPRINTF("transmitter disabled, frame of %d bytes dropped\n", len);
+            continue;
+        }
+        cic = (des[0] & ETH_TDES0_CIC_MASK) >> ETH_TDES0_CIC_START;
+        stm32_eth_tx_checksum(s->tx_frame, len, cic);
+        if (len < STM32_ETH_MIN_FRAME &&
+            !IS_BIT_SET(des[0], ETH_TDES0_DP_BIT)) {
+            memset(s->tx_frame + len, 0, STM32_ETH_MIN_FRAME - len);
+            len = STM32_ETH_MIN_FRAME;
+        }
+        DPRINTF("sending a frame of %d bytes\n", len);
+        if (qemu_send_packet_async(qemu_get_queue(s->nic), s->tx_frame, len,
+                                   stm32_eth_tx_sent) == 0) {
+            /* The frame has been queued; wait for the queue to drain. */
+            s->tx_waiting = true;
+            break;
+        }
+    }
+
+    if (interrupt) {
+        s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_TS_BIT);
+    }
+    stm32_eth_update_irq(s);
+}
+
+
+
+
+/* RECEIVE */
+
+static uint8_t stm32_eth_hash_index(const uint8_t *addr)
+{
+    /* The upper 6 bits of the bit-reversed CRC of the address, i.e. the
+     * lower 6 bits of the CRC reversed. */
+    uint32_t crc = crc32(0, addr, 6);
+    uint8_t index = 0;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        index = (index << 1) | ((crc >> i) & 1);
+    }
+    return index;
+}
+
+static bool stm32_eth_hash_match(Stm32Eth *s, const uint8_t *addr)
+{
+    uint8_t index = stm32_eth_hash_index(addr);
+
+    if (index >= 32) {
+        return IS_BIT_SET(s->ETH_MACHTHR, (index - 32));
+    }
+    return IS_BIT_SET(s->ETH_MACHTLR, index);
+}
+
+static bool stm32_eth_perfect_match(Stm32Eth *s, const uint8_t *addr)
+{
+    uint64_t mac;
+    int n, i;
+
+    for (n = 0; n < STM32_ETH_MAC_ADDR_COUNT; n++) {
+        if (n > 0 && (!IS_BIT_SET(s->ETH_MACAHR[n], ETH_MACAHR_AE_BIT) ||
+                      IS_BIT_SET(s->ETH_MACAHR[n], ETH_MACAHR_SA_BIT))) {
+            continue;
+        }
+        mac = ((uint64_t)(s->ETH_MACAHR[n] & 0xffff) << 32) |
+              s->ETH_MACALR[n];
+        for (i = 0; i < 6; i++) {
+            if (n > 0 && IS_BIT_SET(s->ETH_MACAHR[n],
+                                    (ETH_MACAHR_MBC_START + i))) {
+                continue;
+            }
+            if (addr[i] != ((mac >> (8 * i)) & 0xff)) {
+                break;
+            }
+        }
+        if (i == 6) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Applies the destination address filter of ETH_MACFFR. */
+static bool stm32_eth_filter(Stm32Eth *s, const uint8_t *dest)
+{
+    uint32_t ffr = s->ETH_MACFFR;
+    bool hash, match;
+
+    if (IS_BIT_SET(ffr, ETH_MACFFR_RA_BIT) ||
+        IS_BIT_SET(ffr, ETH_MACFFR_PM_BIT)) {
+        return true;
+    }
+    if (!memcmp(dest, "\xff\xff\xff\xff\xff\xff", 6)) {
+        return !IS_BIT_SET(ffr, ETH_MACFFR_BFD_BIT);
+    }
+    if (dest[0] & 1) {
+        if (IS_BIT_SET(ffr, ETH_MACFFR_PAM_BIT)) {
+            return true;
+        }
+        hash = IS_BIT_SET(ffr, ETH_MACFFR_HM_BIT);
+    } else {
+        hash = IS_BIT_SET(ffr, ETH_MACFFR_HU_BIT);
+    }
+
+    if (hash) {
+        match = stm32_eth_hash_match(s, dest);
+        if (match || !IS_BIT_SET(ffr, ETH_MACFFR_HPF_BIT)) {
+            return match;
+        }
+    }
+    match = stm32_eth_perfect_match(s, dest);
+    return IS_BIT_SET(ffr, ETH_MACFFR_DAIF_BIT) ? !match : match;
+}
+
+static int stm32_eth_can_receive(NetClientState *nc)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+
+    return s->clk.enabled &&
+           IS_BIT_SET(s->ETH_MACCR, ETH_MACCR_RE_BIT) &&
+           IS_BIT_SET(s->ETH_DMAOMR, ETH_DMAOMR_SR_BIT) &&
+           stm32_eth_rps(s) != STM32_ETH_RPS_SUSPENDED;
+}
+
+/* Checks that the descriptors the DMA owns, from the current one on, can
+ * hold len bytes. */
+static bool stm32_eth_rx_room(Stm32Eth *s, int len)
+{
+    uint32_t des[4], addr = s->ETH_DMACHRDR;
+    int n;
+
+    for (n = 0; n < STM32_ETH_DESC_MAX; n++) {
+        stm32_eth_desc_read(addr, des);
+        if (!IS_BIT_SET(des[0], ETH_RDES0_OWN_BIT)) {
+            return false;
+        }
+        len -= des[1] & ETH_DES1_BS1_MASK;
+        if (!IS_BIT_SET(des[1], ETH_RDES1_RCH_BIT)) {
+            len -= (des[1] & ETH_DES1_BS2_MASK) >> ETH_DES1_BS2_START;
+        }
+        if (len <= 0) {
+            return true;
+        }
+        addr = stm32_eth_desc_next(s, addr, des,
+                                   IS_BIT_SET(des[1], ETH_RDES1_RCH_BIT),
+                                   IS_BIT_SET(des[1], ETH_RDES1_RER_BIT),
+                                   s->ETH_DMARDLAR);
+    }
+    return false;
+}
+
+/* Copies the next len bytes of the frame in iov to a receive buffer. */
+static size_t stm32_eth_rx_scatter(Stm32Eth *s, const struct iovec *iov,
+                                   size_t offset, uint32_t addr, size_t len)
+{
+    hwaddr plen = len;
+    uint8_t *p;
+    size_t done;
+
+    if (len == 0) {
+        return 0;
+    }
+    s->ETH_DMACHRBAR = addr;
+    p = cpu_physical_memory_map(addr, &plen, true);
+    if (p && plen == len) {
+        done = iov_to_buf(iov, 2, offset, p, len);
+        cpu_physical_memory_unmap(p, plen, true, done);
+        return done;
+    }
+    if (p) {
+        cpu_physical_memory_unmap(p, plen, true, 0);
+    }
+    p = g_malloc(len);
+    done = iov_to_buf(iov, 2, offset, p, len);
+    cpu_physical_memory_write(addr, p, done);
+    g_free(p);
+    return done;
+}
+
+static ssize_t stm32_eth_receive(NetClientState *nc, const uint8_t *buf,
+                                 size_t size)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+    uint8_t fcs[STM32_ETH_FCS_SIZE];
+    struct iovec iov[2];
+    uint32_t des[4], addr, crc;
+    size_t total, offset;
+    bool first = true;
+
+    if (size < 14 || !stm32_eth_filter(s, buf)) {
+        return size;
+    }
+
+    /* The MAC passes the frame check sequence on to the DMA. */
+    crc = crc32(0, buf, size);
+    stl_le_p(fcs, crc);
+    iov[0].iov_base = (void *)buf;
+    iov[0].iov_len = size;
+    iov[1].iov_base = fcs;
+    iov[1].iov_len = sizeof(fcs);
+    total = size + sizeof(fcs);
+
+    if (!stm32_eth_rx_room(s, total)) {
+        DPRINTF("no receive descriptor for a frame of %d bytes\n", (int)size);
+        s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_RBUS_BIT);
+        stm32_eth_set_rps(s, STM32_ETH_RPS_SUSPENDED);
+        stm32_eth_update_irq(s);
+        return 0;
+    }
+
+    offset = 0;
+    for (;;) {
+        addr = s->ETH_DMACHRDR;
+        stm32_eth_desc_read(addr, des);
+        offset += stm32_eth_rx_scatter(s, iov, offset, des[2],
+                      MIN(des[1] & ETH_DES1_BS1_MASK, total - offset));
+        if (!IS_BIT_SET(des[1], ETH_RDES1_RCH_BIT)) {
+            offset += stm32_eth_rx_scatter(s, iov, offset, des[3],
+                          MIN((des[1] & ETH_DES1_BS2_MASK) >>
+                              ETH_DES1_BS2_START, total - offset));
+        }
+        s->ETH_DMACHRDR = stm32_eth_desc_next(s, addr, des,
+                              IS_BIT_SET(des[1], ETH_RDES1_RCH_BIT),
+                              IS_BIT_SET(des[1], ETH_RDES1_RER_BIT),
+                              s->ETH_DMARDLAR);
+
+        des[0] = first ? GET_BIT_MASK_ONE(ETH_RDES0_FS_BIT) : 0;
+        first = false;
+        if (offset == total) {
+            des[0] |= GET_BIT_MASK_ONE(ETH_RDES0_LS_BIT) |
+                      (total << ETH_RDES0_FL_START);
+            if (((buf[12] << 8) | buf[13]) >= 0x0600) {
+                des[0] |= GET_BIT_MASK_ONE(ETH_RDES0_FT_BIT);
+            }
+        }
+        stl_le_phys(addr, des[0]);
+        if (offset == total) {
+            break;
+        }
+    }
+
+    if (!IS_BIT_SET(des[1], ETH_RDES1_DIC_BIT)) {
+        s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_RS_BIT);
+    }
+    stm32_eth_set_rps(s, STM32_ETH_RPS_WAITING);
+    stm32_eth_update_irq(s);
+
+    return size;
+}
+
+/* Lets the network layer deliver the frames it has queued, now that the
+ * receive path may have become ready. */
+static void stm32_eth_rx_flush(Stm32Eth *s)
+{
+    if (stm32_eth_can_receive(qemu_get_queue(s->nic))) {
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    }
+}
+
+static void stm32_eth_clk_irq_handler(void *opaque, int n, int level)
+{
+    stm32_eth_rx_flush((Stm32Eth *)opaque);
+}
+
+
+
+
+/* PHY */
+
+static bool stm32_eth_link_up(Stm32Eth *s)
+{
+    return !qemu_get_queue(s->nic)->link_down;
+}
+
+static uint16_t stm32_eth_phy_read(Stm32Eth *s, int reg)
+{
+    bool link = stm32_eth_link_up(s);
+
+    switch (reg) {
+        case PHY_BMCR:
+            return s->phy_bmcr;
+        case PHY_BMSR:
+            return PHY_BMSR_VALUE |
+                   (link ? GET_BIT_MASK_ONE(PHY_BMSR_LINK_BIT) |
+                           GET_BIT_MASK_ONE(PHY_BMSR_ANCOMPLETE_BIT) : 0);
+        case PHY_IDR1:
+            return PHY_IDR1_VALUE;
+        case PHY_IDR2:
+            return PHY_IDR2_VALUE;
+        case PHY_ANAR:
+            return s->phy_anar;
+        case PHY_ANLPAR:
+            return link ? PHY_ANLPAR_VALUE : 0;
+        case PHY_ANER:
+            return link ? 0x0001 : 0;
+        case PHY_PHYSR:
+            /* 100 Mbit/s, full duplex */
+            return link ? GET_BIT_MASK_ONE(PHY_PHYSR_LINK_BIT) |
+                          GET_BIT_MASK_ONE(PHY_PHYSR_DUPLEX_BIT) |
+                          GET_BIT_MASK_ONE(PHY_PHYSR_ANCOMPLETE_BIT) : 0;
+        default:
+            return 0;
+    }
+}
+
+static void stm32_eth_phy_write(Stm32Eth *s, int reg, uint16_t value)
+{
+    switch (reg) {
+        case PHY_BMCR:
+            if (IS_BIT_SET(value, PHY_BMCR_RESET_BIT)) {
+                s->phy_bmcr = PHY_BMCR_RESET_VALUE;
+                s->phy_anar = PHY_ANAR_RESET_VALUE;
+                break;
+            }
+            /* Auto-negotiation completes at once. */
+            s->phy_bmcr = value & ~GET_BIT_MASK_ONE(PHY_BMCR_ANRESTART_BIT);
+            break;
+        case PHY_ANAR:
+            s->phy_anar = value;
+            break;
+        default:
+            break;
+    }
+}
+
+static void stm32_eth_MACMIIAR_write(Stm32Eth *s, uint32_t new_value)
+{
+    int pa = (new_value >> ETH_MACMIIAR_PA_START) & 0x1f;
+    int mr = (new_value >> ETH_MACMIIAR_MR_START) & 0x1f;
+
+    /* The management frame takes no time: the PHY register is read or
+     * written, and the MII busy bit cleared, as soon as it is set. */
+    if (IS_BIT_SET(new_value, ETH_MACMIIAR_MB_BIT)) {
+        if (IS_BIT_SET(new_value, ETH_MACMIIAR_MW_BIT)) {
+            if (pa == s->phy_addr) {
+                stm32_eth_phy_write(s, mr, s->ETH_MACMIIDR);
+            }
+        } else {
+            s->ETH_MACMIIDR = pa == s->phy_addr ?
+                              stm32_eth_phy_read(s, mr) : 0xffff;
+        }
+    }
+    s->ETH_MACMIIAR = new_value & ETH_MACMIIAR_MASK &
+                      ~GET_BIT_MASK_ONE(ETH_MACMIIAR_MB_BIT);
+}
+
+static void stm32_eth_link_status_changed(NetClientState *nc)
+{
+    DPRINTF("link %s\n", nc->link_down ? "down" : "up");
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_eth_dma_reset(Stm32Eth *s)
+{
+    s->ETH_DMABMR = 0x00002101;
+    s->ETH_DMARDLAR = 0;
+    s->ETH_DMATDLAR = 0;
+    s->ETH_DMASR = 0;
+    s->ETH_DMAOMR = 0;
+    s->ETH_DMAIER = 0;
+    s->ETH_DMACHTDR = 0;
+    s->ETH_DMACHRDR = 0;
+    s->ETH_DMACHTBAR = 0;
+    s->ETH_DMACHRBAR = 0;
+    s->tx_len = 0;
+}
+
+static void stm32_eth_mac_reset(Stm32Eth *s)
+{
+    int n;
+
+    s->ETH_MACCR = 0x00008000;
+    s->ETH_MACFFR = 0;
+    s->ETH_MACHTHR = 0;
+    s->ETH_MACHTLR = 0;
+    s->ETH_MACMIIAR = 0;
+    s->ETH_MACMIIDR = 0;
+    s->ETH_MACFCR = 0;
+    s->ETH_MACVLANTR = 0;
+    s->ETH_MACPMTCSR = 0;
+    s->ETH_MACIMR = 0;
+    for (n = 0; n < STM32_ETH_MAC_ADDR_COUNT; n++) {
+        s->ETH_MACAHR[n] = n == 0 ? 0x8000ffff : 0x0000ffff;
+        s->ETH_MACALR[n] = 0xffffffff;
+    }
+    s->ETH_MMCCR = 0;
+    s->ETH_MMCRIMR = 0;
+    s->ETH_MMCTIMR = 0;
+}
+
+static void stm32_eth_DMAOMR_write(Stm32Eth *s, uint32_t new_value)
+{
+    uint32_t changed = s->ETH_DMAOMR ^ new_value;
+
+    s->ETH_DMAOMR = new_value & ETH_DMAOMR_MASK &
+                    ~GET_BIT_MASK_ONE(ETH_DMAOMR_FTF_BIT);
+
+    if (IS_BIT_SET(changed, ETH_DMAOMR_ST_BIT)) {
+        if (IS_BIT_SET(new_value, ETH_DMAOMR_ST_BIT)) {
+            stm32_eth_tx_run(s);
+        } else {
+            stm32_eth_set_tps(s, STM32_ETH_PS_STOPPED);
+            s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_TPSS_BIT);
+        }
+    }
+    if (IS_BIT_SET(changed, ETH_DMAOMR_SR_BIT)) {
+        if (IS_BIT_SET(new_value, ETH_DMAOMR_SR_BIT)) {
+            stm32_eth_set_rps(s, STM32_ETH_RPS_WAITING);
+            stm32_eth_rx_flush(s);
+        } else {
+            stm32_eth_set_rps(s, STM32_ETH_PS_STOPPED);
+            s->ETH_DMASR |= GET_BIT_MASK_ONE(ETH_DMASR_RPSS_BIT);
+        }
+    }
+    stm32_eth_update_irq(s);
+}
+
+static uint32_t stm32_eth_readw(Stm32Eth *s, hwaddr offset)
+{
+    int n;
+
+    if (offset >= ETH_MACAHR_OFFSET &&
+        offset < ETH_MACAHR_OFFSET + STM32_ETH_MAC_ADDR_COUNT * 8) {
+        n = (offset - ETH_MACAHR_OFFSET) / 8;
+        return offset & 4 ? s->ETH_MACALR[n] : s->ETH_MACAHR[n];
+    }
+
+    switch (offset) {
+        case ETH_MACCR_OFFSET:
+            return s->ETH_MACCR;
+        case ETH_MACFFR_OFFSET:
+            return s->ETH_MACFFR;
+        case ETH_MACHTHR_OFFSET:
+            return s->ETH_MACHTHR;
+        case ETH_MACHTLR_OFFSET:
+            return s->ETH_MACHTLR;
+        case ETH_MACMIIAR_OFFSET:
+            return s->ETH_MACMIIAR;
+        case ETH_MACMIIDR_OFFSET:
+            return s->ETH_MACMIIDR;
+        case ETH_MACFCR_OFFSET:
+            return s->ETH_MACFCR;
+        case ETH_MACVLANTR_OFFSET:
+            return s->ETH_MACVLANTR;
+        case ETH_MACRWUFFR_OFFSET:
+        case ETH_MACSR_OFFSET:
+            return 0;
+        case ETH_MACPMTCSR_OFFSET:
+            return s->ETH_MACPMTCSR;
+        case ETH_MACIMR_OFFSET:
+            return s->ETH_MACIMR;
+        case ETH_MMCCR_OFFSET:
+            return s->ETH_MMCCR;
+        case ETH_MMCRIMR_OFFSET:
+            return s->ETH_MMCRIMR;
+        case ETH_MMCTIMR_OFFSET:
+            return s->ETH_MMCTIMR;
+        case ETH_MMCRIR_OFFSET:
+        case ETH_MMCTIR_OFFSET:
+        case ETH_MMCTGFSCCR_OFFSET:
+        case ETH_MMCTGFMSCCR_OFFSET:
+        case ETH_MMCTGFCR_OFFSET:
+        case ETH_MMCRFCECR_OFFSET:
+        case ETH_MMCRFAECR_OFFSET:
+        case ETH_MMCRGUFCR_OFFSET:
+            return 0;
+        case ETH_DMABMR_OFFSET:
+            return s->ETH_DMABMR;
+        case ETH_DMATPDR_OFFSET:
+        case ETH_DMARPDR_OFFSET:
+            return 0;
+        case ETH_DMARDLAR_OFFSET:
+            return s->ETH_DMARDLAR;
+        case ETH_DMATDLAR_OFFSET:
+            return s->ETH_DMATDLAR;
+        case ETH_DMASR_OFFSET:
+            return s->ETH_DMASR;
+        case ETH_DMAOMR_OFFSET:
+            return s->ETH_DMAOMR;
+        case ETH_DMAIER_OFFSET:
+            return s->ETH_DMAIER;
+        case ETH_DMAMFBOCR_OFFSET:
+            return 0;
+        case ETH_DMACHTDR_OFFSET:
+            return s->ETH_DMACHTDR;
+        case ETH_DMACHRDR_OFFSET:
+            return s->ETH_DMACHRDR;
+        case ETH_DMACHTBAR_OFFSET:
+            return s->ETH_DMACHTBAR;
+        case ETH_DMACHRBAR_OFFSET:
+            return s->ETH_DMACHRBAR;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_eth_writew(Stm32Eth *s, hwaddr offset, uint32_t value)
+{
+    int n;
+
+    if (offset >= ETH_MACAHR_OFFSET &&
+        offset < ETH_MACAHR_OFFSET + STM32_ETH_MAC_ADDR_COUNT * 8) {
+        n = (offset - ETH_MACAHR_OFFSET) / 8;
+        if (offset & 4) {
+            s->ETH_MACALR[n] = value;
+        } else if (n == 0) {
+            /* MO always reads as 1 */
+            s->ETH_MACAHR[0] = 0x80000000 | (value & ETH_MACA0HR_MASK);
+        } else {
+            s->ETH_MACAHR[n] = value & ETH_MACAHR_MASK;
+        }
+        return;
+    }
+
+    switch (offset) {
+        case ETH_MACCR_OFFSET:
+            s->ETH_MACCR = (value & ETH_MACCR_MASK) | 0x00008000;
+            stm32_eth_rx_flush(s);
+            stm32_eth_tx_run(s);
+            break;
+        case ETH_MACFFR_OFFSET:
+            s->ETH_MACFFR = value & ETH_MACFFR_MASK;
+            break;
+        case ETH_MACHTHR_OFFSET:
+            s->ETH_MACHTHR = value;
+            break;
+        case ETH_MACHTLR_OFFSET:
+            s->ETH_MACHTLR = value;
+            break;
+        case ETH_MACMIIAR_OFFSET:
+            stm32_eth_MACMIIAR_write(s, value);
+            break;
+        case ETH_MACMIIDR_OFFSET:
+            s->ETH_MACMIIDR = value & 0xffff;
+            break;
+        case ETH_MACFCR_OFFSET:
+            s->ETH_MACFCR = value & ETH_MACFCR_MASK;
+            break;
+        case ETH_MACVLANTR_OFFSET:
+            s->ETH_MACVLANTR = value & ETH_MACVLANTR_MASK;
+            break;
+        case ETH_MACRWUFFR_OFFSET:
+            break;
+        case ETH_MACPMTCSR_OFFSET:
+            s->ETH_MACPMTCSR = value & ETH_MACPMTCSR_MASK;
+            break;
+        case ETH_MACSR_OFFSET:
+            break;
+        case ETH_MACIMR_OFFSET:
+            s->ETH_MACIMR = value & ETH_MACIMR_MASK;
+            break;
+        case ETH_MMCCR_OFFSET:
+            /* The counters always read as zero, so resetting them (CR) and
+             * freezing them changes nothing. */
+            s->ETH_MMCCR = value & ETH_MMCCR_MASK & ~1;
+            break;
+        case ETH_MMCRIMR_OFFSET:
+            s->ETH_MMCRIMR = value & ETH_MMCRIMR_MASK;
+            break;
+        case ETH_MMCTIMR_OFFSET:
+            s->ETH_MMCTIMR = value & ETH_MMCTIMR_MASK;
+            break;
+        case ETH_DMABMR_OFFSET:
+            if (IS_BIT_SET(value, ETH_DMABMR_SR_BIT)) {
+                /* The software reset completes at once. */
+                stm32_eth_dma_reset(s);
+                stm32_eth_mac_reset(s);
+                stm32_eth_update_irq(s);
+                break;
+            }
+            s->ETH_DMABMR = value & ETH_DMABMR_MASK;
+            break;
+        case ETH_DMATPDR_OFFSET:
+            stm32_eth_tx_run(s);
+            break;
+        case ETH_DMARPDR_OFFSET:
+            if (IS_BIT_SET(s->ETH_DMAOMR, ETH_DMAOMR_SR_BIT)) {
+                stm32_eth_set_rps(s, STM32_ETH_RPS_WAITING);
+                stm32_eth_rx_flush(s);
+            }
+            break;
+        case ETH_DMARDLAR_OFFSET:
+            s->ETH_DMARDLAR = value & ~3;
+            s->ETH_DMACHRDR = s->ETH_DMARDLAR;
+            break;
+        case ETH_DMATDLAR_OFFSET:
+            s->ETH_DMATDLAR = value & ~3;
+            s->ETH_DMACHTDR = s->ETH_DMATDLAR;
+            break;
+        case ETH_DMASR_OFFSET:
+            s->ETH_DMASR &= ~(value & ETH_DMASR_W1C_MASK);
+            stm32_eth_update_irq(s);
+            break;
+        case ETH_DMAOMR_OFFSET:
+            stm32_eth_DMAOMR_write(s, value);
+            break;
+        case ETH_DMAIER_OFFSET:
+            s->ETH_DMAIER = value & ETH_DMAIER_MASK;
+            stm32_eth_update_irq(s);
+            break;
+        case ETH_DMAMFBOCR_OFFSET:
+        case ETH_DMACHTDR_OFFSET:
+        case ETH_DMACHRDR_OFFSET:
+        case ETH_DMACHTBAR_OFFSET:
+        case ETH_DMACHRBAR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+static uint64_t stm32_eth_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Eth *s = (Stm32Eth *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32_eth_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_eth_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_eth_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Eth *s = (Stm32Eth *)opaque;
+
+    trace_stm32_eth_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_eth_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_eth_ops = {
+    .read = stm32_eth_read,
+    .write = stm32_eth_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_eth_reset(DeviceState *dev)
+{
+    Stm32Eth *s = FROM_SYSBUS(Stm32Eth, SYS_BUS_DEVICE(dev));
+
+    stm32_eth_dma_reset(s);
+    stm32_eth_mac_reset(s);
+    s->phy_bmcr = PHY_BMCR_RESET_VALUE;
+    s->phy_anar = PHY_ANAR_RESET_VALUE;
+    s->tx_waiting = false;
+
+    stm32_eth_update_irq(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_eth_cleanup(NetClientState *nc)
+{
+    Stm32Eth *s = qemu_get_nic_opaque(nc);
+
+    s->nic = NULL;
+}
+
+static NetClientInfo net_stm32_eth_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(NICState),
+    .can_receive = stm32_eth_can_receive,
+    .receive = stm32_eth_receive,
+    .cleanup = stm32_eth_cleanup,
+    .link_status_changed = stm32_eth_link_status_changed,
+};
+
+static void stm32_eth_instance_init(Object *obj)
+{
+    Stm32Eth *s = FROM_SYSBUS(Stm32Eth, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_eth_init(SysBusDevice *dev)
+{
+    Stm32Eth *s = FROM_SYSBUS(Stm32Eth, dev);
+    qemu_irq *clk_irq;
+
+    /* Frames the network layer held back can come in once the clock is
+     * enabled. */
+    clk_irq = qemu_allocate_irqs(stm32_eth_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev,
+                              clk_irq[0]);
+
+    memory_region_init_io(&s->iomem, &stm32_eth_ops, s,
+                          "eth", 0x2000);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+
+    s->tx_frame = g_malloc(STM32_ETH_FRAME_MAX);
+
+    qemu_macaddr_default_if_unset(&s->conf.macaddr);
+    s->nic = qemu_new_nic(&net_stm32_eth_info, &s->conf,
+                          object_get_typename(OBJECT(dev)), dev->qdev.id, s);
+    qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
+
+    return 0;
+}
+
+static Property stm32_eth_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Eth, periph, -1),
+    DEFINE_NIC_PROPERTIES(Stm32Eth, conf),
+    DEFINE_PROP_UINT32("phy_addr", Stm32Eth, phy_addr, 1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_eth_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_eth_init;
+    dc->reset = stm32_eth_reset;
+    dc->props = stm32_eth_properties;
+}
+
+static TypeInfo stm32_eth_info = {
+    .name  = "stm32_eth",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Eth),
+    .instance_init = stm32_eth_instance_init,
+    .class_init = stm32_eth_class_init
+};
+
+static void stm32_eth_register_types(void)
+{
+    type_register_static(&stm32_eth_info);
+}
+
+type_init(stm32_eth_register_types)
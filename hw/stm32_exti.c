@@ -20,6 +20,10 @@
  */
 
 #include "stm32.h"
+#include "qemu/host-utils.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qjson.h"
+#include "trace.h"
 
 
 
@@ -45,6 +49,9 @@
 /* The number of IRQ connections to the NVIC */
 #define EXTI_IRQ_COUNT 10
 
+/* The EXTIxx fields of AFIO_EXTICR and SYSCFG_EXTICR are 4 bits wide. */
+#define EXTI_MAX_GPIO 16
+
 
 struct Stm32Exti {
     /* Inherited */
@@ -54,6 +61,7 @@ struct Stm32Exti {
     /* Array of Stm32Gpio pointers (one for each GPIO).  The QEMU property
      * library expects this to be a void pointer. */
     void *stm32_gpio_prop;
+    uint32_t gpio_count;
 
     /* Private */
     MemoryRegion iomem;
@@ -69,11 +77,14 @@ struct Stm32Exti {
         EXTI_SWIER,
         EXTI_PR;
 
-    /* An array of IRQs to handle interrupts when a GPIO pin changes.
-     * There are 16 IRQs, one for each GPIO pin.  Each IRQ will be registered
-     * with the appropriate GPIO based on the AFIO External Interrupt
-     * configuration register. */
-    qemu_irq *gpio_in_irqs;
+    /* Routing table: for each GPIO, the EXTI lines (one per pin number)
+     * that are assigned to it by the AFIO or SYSCFG External Interrupt
+     * configuration registers. */
+    uint16_t gpio_lines[EXTI_MAX_GPIO];
+
+    /* Lines that are unmasked and sensitive to rising and falling edges,
+     * derived from IMR, RTSR and FTSR. */
+    uint32_t rising_mask, falling_mask;
 
     qemu_irq irq[EXTI_IRQ_COUNT];
 };
@@ -96,23 +107,11 @@ static void stm32_exti_trigger(Stm32Exti *s, int line)
     }
 }
 
-/* We will assume that this handler will only be called if the pin actually
- * changed state. */
-static void stm32_exti_gpio_in_handler(void *opaque, int n, int level)
+/* Call whenever IMR, RTSR or FTSR change. */
+static void stm32_exti_update_masks(Stm32Exti *s)
 {
-    Stm32Exti *s = (Stm32Exti *)opaque;
-    unsigned pin = n;
-
-    assert(pin < STM32_GPIO_PIN_COUNT);
-
-    /* Check the level - if it is rising, then trigger an interrupt if the
-     * corresponding Rising Trigger Selection Register flag is set.  Otherwise,
-     * trigger if the Falling Trigger Selection Register flag is set.
-     */
-    if((level  && GET_BIT_VALUE(s->EXTI_RTSR, pin)) ||
-       (!level && GET_BIT_VALUE(s->EXTI_FTSR, pin))) {
-        stm32_exti_trigger(s, pin);
-    }
+    s->rising_mask = s->EXTI_IMR & s->EXTI_RTSR;
+    s->falling_mask = s->EXTI_IMR & s->EXTI_FTSR;
 }
 
 
@@ -137,6 +136,17 @@ static void update_TSR_bit(Stm32Exti *s, uint32_t *tsr_register, unsigned pos,
     CHANGE_BIT(*tsr_register, pos, new_bit_value);
 }
 
+/* Sends a STM32_EXTI_PENDING event (see QMP/qmp-events.txt). */
+static void stm32_exti_send_pending_event(Stm32Exti *s, unsigned pos)
+{
+    QObject *data;
+
+    data = qobject_from_jsonf("{ 'line': %d, 'pending': %d }",
+                              (int)pos, (int)s->EXTI_PR);
+    monitor_protocol_event(QEVENT_STM32_EXTI_PENDING, data);
+    qobject_decref(data);
+}
+
 /* Update the Pending Register.  This will trigger an interrupt if a bit is
  * set.
  */
@@ -159,6 +169,8 @@ static void stm32_exti_change_EXTI_PR_bit(Stm32Exti *s, unsigned pos,
             RESET_BIT(s->EXTI_SWIER, pos);
         }
 
+        trace_stm32_exti_irq(s, pos, new_bit_value);
+
         /* Update the IRQ for this EXTI line.  Some lines share the same
          * NVIC IRQ.
          */
@@ -186,6 +198,11 @@ static void stm32_exti_change_EXTI_PR_bit(Stm32Exti *s, unsigned pos,
 
         /* Update the register. */
         CHANGE_BIT(s->EXTI_PR, pos, new_bit_value);
+
+        if(new_bit_value &&
+           monitor_protocol_event_wanted(QEVENT_STM32_EXTI_PENDING)) {
+            stm32_exti_send_pending_event(s, pos);
+        }
     }
 }
 
@@ -226,6 +243,7 @@ static void stm32_exti_writew(void *opaque, hwaddr offset,
         switch (offset) {
             case EXTI_IMR_OFFSET:
                 s->EXTI_IMR = value;
+                stm32_exti_update_masks(s);
                 break;
             case EXTI_EMR_OFFSET:
                 /* Do nothing, events are not implemented yet.
@@ -273,24 +291,34 @@ static void stm32_exti_writew(void *opaque, hwaddr offset,
                     break;
             }
         }
+        stm32_exti_update_masks(s);
     }
 }
 
 static uint64_t stm32_exti_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
+    uint64_t value;
+
     switch(size) {
         case WORD_ACCESS_SIZE:
-            return stm32_exti_readw(opaque, offset);
+            value = stm32_exti_readw(opaque, offset);
+            break;
         default:
             STM32_BAD_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_exti_read(opaque, offset, size, value);
+    return value;
 }
 
 static void stm32_exti_write(void *opaque, hwaddr offset,
                        uint64_t value, unsigned size)
 {
+    trace_stm32_exti_write(opaque, offset, size, value);
+
     switch(size) {
         case WORD_ACCESS_SIZE:
             stm32_exti_writew(opaque, offset, value);
@@ -316,6 +344,7 @@ static void stm32_exti_reset(DeviceState *dev)
     s->EXTI_FTSR = 0x00000000;
     s->EXTI_SWIER = 0x00000000;
     s->EXTI_PR = 0x00000000;
+    stm32_exti_update_masks(s);
 }
 
 
@@ -324,18 +353,54 @@ static void stm32_exti_reset(DeviceState *dev)
 
 void stm32_exti_set_gpio(Stm32Exti *s, unsigned exti_line, const uint8_t gpio_index)
 {
-    assert(exti_line < EXTI_LINE_COUNT);
+    int i;
+
+    assert(exti_line < STM32_GPIO_PIN_COUNT);
+    assert(gpio_index < EXTI_MAX_GPIO);
 
-    /* Call the GPIO module with the EXTI lines IRQ handler. */
-    stm32_gpio_set_exti_irq(s->stm32_gpio[gpio_index], exti_line, s->gpio_in_irqs[exti_line]);
+    /* A line is connected to one GPIO at a time.  Selecting a GPIO that the
+     * chip does not have leaves the line unconnected. */
+    for(i = 0; i < EXTI_MAX_GPIO; i++) {
+        RESET_BIT(s->gpio_lines[i], exti_line);
+    }
+    SET_BIT(s->gpio_lines[gpio_index], exti_line);
 }
 
 void stm32_exti_reset_gpio(Stm32Exti *s, unsigned exti_line, const uint8_t gpio_index)
 {
-    assert(exti_line < EXTI_LINE_COUNT);
+    assert(exti_line < STM32_GPIO_PIN_COUNT);
+    assert(gpio_index < EXTI_MAX_GPIO);
+
+    RESET_BIT(s->gpio_lines[gpio_index], exti_line);
+}
+
+void stm32_exti_gpio_edges(Stm32Exti *s, unsigned gpio_index,
+                           uint16_t rising, uint16_t falling)
+{
+    uint32_t lines;
+    int line;
+
+    assert(gpio_index < EXTI_MAX_GPIO);
+
+    /* The pin numbers are also the EXTI line numbers. */
+    lines = ((rising & s->rising_mask) | (falling & s->falling_mask)) &
+            s->gpio_lines[gpio_index] & ~s->EXTI_PR;
+
+    while(lines) {
+        line = ctz32(lines);
+        stm32_exti_change_EXTI_PR_bit(s, line, 1);
+        lines &= lines - 1;
+    }
+}
+
+
+void stm32_exti_line_rising(Stm32Exti *s, unsigned line)
+{
+    assert(line >= STM32_GPIO_PIN_COUNT && line < EXTI_LINE_COUNT);
 
-    /* Call the GPIO module to clear its IRQ assignment. */
-    stm32_gpio_set_exti_irq(s->stm32_gpio[gpio_index], exti_line, NULL);
+    if(IS_BIT_SET(s->rising_mask, line)) {
+        stm32_exti_change_EXTI_PR_bit(s, line, 1);
+    }
 }
 
 
@@ -350,6 +415,10 @@ static int stm32_exti_init(SysBusDevice *dev)
 
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
 
+    if(s->gpio_count > EXTI_MAX_GPIO) {
+        hw_error("stm32_exti: gpio_count must be at most %d", EXTI_MAX_GPIO);
+    }
+
     memory_region_init_io(&s->iomem, &stm32_exti_ops, s,
             "exti", 0x03ff);
     sysbus_init_mmio(dev, &s->iomem);
@@ -358,15 +427,43 @@ static int stm32_exti_init(SysBusDevice *dev)
         sysbus_init_irq(dev, &s->irq[i]);
     }
 
-    /* Create the handlers to handle GPIO input pin changes. */
-    s->gpio_in_irqs = qemu_allocate_irqs(stm32_exti_gpio_in_handler, (void *)s,
-                                        STM32_GPIO_PIN_COUNT);
+    /* Have the GPIOs report their input pin changes. */
+    for(i = 0; i < s->gpio_count; i++) {
+        stm32_gpio_set_exti(s->stm32_gpio[i], s, i);
+    }
+
+    return 0;
+}
+
+/* The routing table is saved here rather than rebuilt from the AFIO or
+ * SYSCFG registers, which may be loaded after the EXTI. */
+static int stm32_exti_post_load(void *opaque, int version_id)
+{
+    stm32_exti_update_masks((Stm32Exti *)opaque);
 
     return 0;
 }
 
+static const VMStateDescription vmstate_stm32_exti = {
+    .name = "stm32_exti",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_exti_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(EXTI_IMR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_RTSR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_FTSR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_SWIER, Stm32Exti),
+        VMSTATE_UINT32(EXTI_PR, Stm32Exti),
+        VMSTATE_UINT16_ARRAY(gpio_lines, Stm32Exti, EXTI_MAX_GPIO),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_exti_properties[] = {
     DEFINE_PROP_PTR("stm32_gpio", Stm32Exti, stm32_gpio_prop),
+    DEFINE_PROP_UINT32("gpio_count", Stm32Exti, gpio_count, 0),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -378,6 +475,7 @@ static void stm32_exti_class_init(ObjectClass *klass, void *data)
     k->init = stm32_exti_init;
     dc->reset = stm32_exti_reset;
     dc->props = stm32_exti_properties;
+    dc->vmsd = &vmstate_stm32_exti;
 }
 
 static TypeInfo stm32_exti_info = {
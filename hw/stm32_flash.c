@@ -3,13 +3,24 @@
  * The STM32 family stores its Flash memory at some base address in memory
  * (0x08000000 for medium density devices), and then aliases it to the
  * boot memory space, which starts at 0x00000000 (the System Memory can also
- * be aliased to 0x00000000, but this is not implemented here).  The processor
- * executes the code in the aliased memory at 0x00000000, but we need to
- * implement the "real" flash memory as well.  This "real" flash memory will
- * pass reads through to the memory at 0x00000000, which is where QEMU loads
- * the executable image.  Note that this is opposite of real hardware, where the
- * memory at 0x00000000 passes reads through the "real" flash memory, but it
- * works the same either way.
+ * be aliased to 0x00000000, but this is not implemented here).
+ *
+ * The flash array is modelled as a ROM device: it is backed by host RAM, so
+ * guest reads and instruction fetches go straight through the softmmu TLB
+ * without calling into this file, and only writes trap into
+ * stm32_flash_write.  The board maps this region at 0x08000000 and maps an
+ * alias of it at 0x00000000, so both windows share the same backing store
+ * and an image linked for either address can be loaded directly.
+ *
+ * The Flash Program/Erase Controller (FPEC) registers are exposed as a
+ * second MMIO region.  Once unlocked through FLASH_KEYR, the flash can be
+ * programmed a half-word at a time and erased by page or as a whole.  Each
+ * operation only discards the translated code of the range it touched.  If
+ * a drive is attached (-drive if=pflash), the flash contents are read from
+ * it at startup and every program/erase writes the touched sectors back.
+ * Otherwise, a raw kernel image can be mapped from its file (see
+ * stm32_flash_map_kernel) so that many instances booting the same image
+ * share its pages in the host page cache.
  *
  * Copyright (C) 2010 Andre Beckus
  *
@@ -30,55 +41,708 @@
  */
 
 #include "stm32.h"
-//#include "exec-memory.h"
+#include "block/block.h"
+#include "exec/exec-all.h"
+#include "exec/gdbstub.h"
+#include "elf.h"
+#include "trace.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_FLASH
+
+#ifdef DEBUG_STM32_FLASH
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_FLASH: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define FLASH_ACR_OFFSET 0x00
+#define FLASH_ACR_PRFTBS_BIT 5
+#define FLASH_ACR_PRFTBE_BIT 4
+#define FLASH_ACR_LATENCY_MASK 0x7
+
+#define FLASH_KEYR_OFFSET 0x04
+
+#define FLASH_OPTKEYR_OFFSET 0x08
+
+#define FLASH_SR_OFFSET 0x0c
+#define FLASH_SR_EOP_BIT 5
+#define FLASH_SR_WRPRTERR_BIT 4
+#define FLASH_SR_PGERR_BIT 2
+#define FLASH_SR_BSY_BIT 0
+#define FLASH_SR_W1C_MASK 0x00000034
+
+#define FLASH_CR_OFFSET 0x10
+#define FLASH_CR_EOPIE_BIT 12
+#define FLASH_CR_ERRIE_BIT 10
+#define FLASH_CR_OPTWRE_BIT 9
+#define FLASH_CR_LOCK_BIT 7
+#define FLASH_CR_STRT_BIT 6
+#define FLASH_CR_OPTER_BIT 5
+#define FLASH_CR_OPTPG_BIT 4
+#define FLASH_CR_MER_BIT 2
+#define FLASH_CR_PER_BIT 1
+#define FLASH_CR_PG_BIT 0
+
+#define FLASH_AR_OFFSET 0x14
+
+#define FLASH_OBR_OFFSET 0x1c
+
+#define FLASH_WRPR_OFFSET 0x20
+
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xcdef89ab
+
+/* The value of an erased flash location */
+#define FLASH_ERASED_BYTE 0xff
+
+/* Size of a block in the backing image */
+#define FLASH_BDRV_SECTOR_SIZE 512
+
+/* The flash is read 64 bits at a time */
+#define FLASH_LINE_BYTES 8
 
 typedef struct {
+    /* Inherited */
     SysBusDevice busdev;
-    MemoryRegion iomem;
+
+    /* Properties */
     uint32_t size;
+    uint32_t page_size;
+    BlockDriverState *bs;
+    char *image;
+    /* Prepended to the name of the flash array, so that it is unique when
+     * a board has several microcontrollers. */
+    char *prefix;
+
+    /* Private */
+    /* Number of image sectors backing the flash array */
+    int64_t bs_sectors;
+
+    MemoryRegion mem;
+    MemoryRegion iomem;
+
+    /* Host pointer to the flash array */
+    uint8_t *storage;
+
+    /* Number of bytes at the start of storage mapped from the image file */
+    size_t image_size;
+
+    /* Number of correct keys written to FLASH_KEYR since the last lock */
+    int key_index;
+
+    /* The CPU that fetches from the flash, if it models its timing */
+    ARMCPU *cpu;
+
+    uint32_t
+        FLASH_ACR,
+        FLASH_SR,
+        FLASH_CR,
+        FLASH_AR;
+
+    qemu_irq irq;
 } Stm32Flash;
 
+
+
+/* FLASH ARRAY */
+
+/* Called before the flash array is modified, for live snapshots. */
+static void stm32_flash_prepare(Stm32Flash *s, uint32_t offset, uint32_t size)
+{
+    qemu_ram_prepare_write(memory_region_get_ram_addr(&s->mem) + offset,
+                           size);
+}
+
+/* Called after the flash array has been modified.  Only translation blocks
+ * generated from the modified range are thrown away, the rest of the
+ * translated code stays valid.  The modified range is then written back to
+ * the backing image, if there is one (rounded out to whole image sectors).
+ */
+static void stm32_flash_update(Stm32Flash *s, uint32_t offset, uint32_t size)
+{
+    ram_addr_t ram_addr = memory_region_get_ram_addr(&s->mem) + offset;
+    uint32_t sector_start, sector_end;
+
+    tb_invalidate_phys_range(ram_addr, ram_addr + size, 0);
+    memory_region_set_dirty(&s->mem, offset, size);
+
+    if (s->bs) {
+        sector_start = offset / FLASH_BDRV_SECTOR_SIZE;
+        sector_end = (offset + size + FLASH_BDRV_SECTOR_SIZE - 1) /
+                            FLASH_BDRV_SECTOR_SIZE;
+        sector_end = MIN(sector_end, s->bs_sectors);
+        if (sector_start >= sector_end) {
+            return;
+        }
+        if (bdrv_write(s->bs, sector_start,
+                       s->storage + (sector_start * FLASH_BDRV_SECTOR_SIZE),
+                       sector_end - sector_start) < 0) {
+            stm32_hw_warn("stm32_flash: Failed to write back flash image");
+        }
+    }
+}
+
+static void stm32_flash_update_irq(Stm32Flash *s)
+{
+    bool eop = IS_BIT_SET(s->FLASH_SR, FLASH_SR_EOP_BIT) &&
+               IS_BIT_SET(s->FLASH_CR, FLASH_CR_EOPIE_BIT);
+    bool err = (IS_BIT_SET(s->FLASH_SR, FLASH_SR_PGERR_BIT) ||
+                IS_BIT_SET(s->FLASH_SR, FLASH_SR_WRPRTERR_BIT)) &&
+               IS_BIT_SET(s->FLASH_CR, FLASH_CR_ERRIE_BIT);
+
+    trace_stm32_flash_irq(s, eop || err);
+    qemu_set_irq(s->irq, eop || err);
+}
+
+/* Operations complete instantly, so BSY is never seen set by the guest. */
+static void stm32_flash_complete(Stm32Flash *s, bool error)
+{
+    if (error) {
+        SET_BIT(s->FLASH_SR, FLASH_SR_PGERR_BIT);
+    } else {
+        SET_BIT(s->FLASH_SR, FLASH_SR_EOP_BIT);
+    }
+    stm32_flash_update_irq(s);
+}
+
+/* Program a half-word.  A location can only be programmed with a non-zero
+ * value after it has been erased.
+ */
+static void stm32_flash_program(Stm32Flash *s, hwaddr offset, uint16_t value)
+{
+    uint16_t old_value = lduw_le_p(s->storage + offset);
+
+    if (old_value != 0xffff && value != 0) {
+        DPRINTF("Programming non-erased half-word at 0x%x\n", (int)offset);
+        stm32_flash_complete(s, true);
+        return;
+    }
+
+    stm32_flash_prepare(s, offset, HALFWORD_ACCESS_SIZE);
+    stw_le_p(s->storage + offset, value);
+    stm32_flash_update(s, offset, HALFWORD_ACCESS_SIZE);
+    stm32_flash_complete(s, false);
+}
+
+static void stm32_flash_erase(Stm32Flash *s, uint32_t offset, uint32_t size)
+{
+    DPRINTF("Erasing 0x%x bytes at 0x%x\n", size, offset);
+    stm32_flash_prepare(s, offset, size);
+    memset(s->storage + offset, FLASH_ERASED_BYTE, size);
+    stm32_flash_update(s, offset, size);
+    stm32_flash_complete(s, false);
+}
+
+static void stm32_flash_page_erase(Stm32Flash *s)
+{
+    uint32_t offset = s->FLASH_AR;
+
+    /* FLASH_AR may hold either the absolute address or the offset. */
+    if (offset >= STM32_FLASH_ADDR_START) {
+        offset -= STM32_FLASH_ADDR_START;
+    }
+    if (offset >= s->size) {
+        stm32_hw_warn("stm32_flash: Page erase address 0x%x out of range",
+                      s->FLASH_AR);
+        stm32_flash_complete(s, true);
+        return;
+    }
+
+    offset &= ~(s->page_size - 1);
+    stm32_flash_erase(s, offset, s->page_size);
+}
+
+/* gdb's "load" programs the array directly, without going through the
+ * FPEC, so neither the lock nor FLASH_SR are touched.
+ */
+static int stm32_flash_gdb_erase(void *opaque, hwaddr offset, hwaddr size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+    hwaddr end = offset + size;
+
+    offset &= ~(hwaddr)(s->page_size - 1);
+    end = (end + s->page_size - 1) & ~(hwaddr)(s->page_size - 1);
+    if (end > s->size) {
+        return -1;
+    }
+    stm32_flash_prepare(s, offset, end - offset);
+    memset(s->storage + offset, FLASH_ERASED_BYTE, end - offset);
+    stm32_flash_update(s, offset, end - offset);
+    return 0;
+}
+
+static int stm32_flash_gdb_write(void *opaque, hwaddr offset,
+                                 const uint8_t *buf, hwaddr size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+
+    if (offset + size > s->size) {
+        return -1;
+    }
+    stm32_flash_prepare(s, offset, size);
+    memcpy(s->storage + offset, buf, size);
+    stm32_flash_update(s, offset, size);
+    return 0;
+}
+
+static const GDBFlashOps stm32_flash_gdb_ops = {
+    .erase = stm32_flash_gdb_erase,
+    .write = stm32_flash_gdb_write,
+};
+
 static uint64_t stm32_flash_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
-    uint32_t v = 0;
+    Stm32Flash *s = (Stm32Flash *)opaque;
+    uint64_t value;
 
-    /* Pass the read through to base memory at 0x00000000 where QEMU has loaded
-     * the executable image.
+    /* Only reached while the region is not in ROMD (readable) mode.  Serve
+     * the read from the backing store anyway.
      */
-    cpu_physical_memory_read(offset, (uint8_t *)&v, size);
-    return v;
+    switch(size) {
+        case BYTE_ACCESS_SIZE:
+            value = ldub_p(s->storage + offset);
+            break;
+        case HALFWORD_ACCESS_SIZE:
+            value = lduw_le_p(s->storage + offset);
+            break;
+        case WORD_ACCESS_SIZE:
+            value = ldl_le_p(s->storage + offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_flash_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_flash_write(void *opaque, hwaddr offset,
                        uint64_t value, unsigned size)
 {
-    /* Flash is treated as read only memory. */
-    hw_error("stm32_flash: Attempted to write flash memory (read only)");
+    Stm32Flash *s = (Stm32Flash *)opaque;
+
+    trace_stm32_flash_write(s, offset, size, value);
+
+    if (IS_BIT_SET(s->FLASH_CR, FLASH_CR_LOCK_BIT) ||
+        IS_BIT_RESET(s->FLASH_CR, FLASH_CR_PG_BIT)) {
+        stm32_hw_warn("stm32_flash: Attempted to write flash memory at 0x%x "
+                      "while not programming", (int)offset);
+        return;
+    }
+
+    /* The FPEC only programs half-words. */
+    if (size != HALFWORD_ACCESS_SIZE) {
+        stm32_hw_warn("stm32_flash: Flash must be programmed a half-word at "
+                      "a time (write of size %u at 0x%x)", size, (int)offset);
+        return;
+    }
+
+    stm32_flash_program(s, offset, value);
 }
 
 static const MemoryRegionOps stm32_flash_ops = {
     .read = stm32_flash_read,
     .write = stm32_flash_write,
+    .endianness = DEVICE_LITTLE_ENDIAN
+};
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+/* Passes the latency and prefetch settings on to the CPU.  Translated
+ * code has the old costs built in, so it is all thrown away.  This is
+ * also done from a store in translated code, as for CPACR: the store
+ * is the last instruction of its TB under -icount.  */
+static void stm32_flash_update_timing(Stm32Flash *s)
+{
+    CPUARMState *env;
+    int wait_states = s->FLASH_ACR & FLASH_ACR_LATENCY_MASK;
+    bool prefetch = IS_BIT_SET(s->FLASH_ACR, FLASH_ACR_PRFTBE_BIT);
+
+    if (!s->cpu) {
+        return;
+    }
+    env = &s->cpu->env;
+    if (env->flash_timing.wait_states == wait_states &&
+        env->flash_timing.prefetch == prefetch) {
+        return;
+    }
+    env->flash_timing.wait_states = wait_states;
+    env->flash_timing.prefetch = prefetch;
+    tb_flush(env);
+    tb_invalidated_flag = 1;
+}
+
+static void stm32_flash_FLASH_ACR_write(Stm32Flash *s, uint32_t new_value)
+{
+    /* The prefetch buffer status follows its enable immediately. */
+    s->FLASH_ACR = new_value & 0x1f;
+    if (IS_BIT_SET(new_value, FLASH_ACR_PRFTBE_BIT)) {
+        SET_BIT(s->FLASH_ACR, FLASH_ACR_PRFTBS_BIT);
+    }
+    stm32_flash_update_timing(s);
+}
+
+static void stm32_flash_FLASH_KEYR_write(Stm32Flash *s, uint32_t new_value)
+{
+    const uint32_t keys[] = { FLASH_KEY1, FLASH_KEY2 };
+
+    /* A wrong key locks the FPEC until the next reset. */
+    if (s->key_index < 0 || s->key_index >= ARRAY_LENGTH(keys) ||
+        new_value != keys[s->key_index]) {
+        stm32_hw_warn("stm32_flash: Bad unlock sequence, flash locked until "
+                      "reset");
+        s->key_index = -1;
+        return;
+    }
+
+    if (++s->key_index == ARRAY_LENGTH(keys)) {
+        RESET_BIT(s->FLASH_CR, FLASH_CR_LOCK_BIT);
+    }
+}
+
+static void stm32_flash_FLASH_SR_write(Stm32Flash *s, uint32_t new_value)
+{
+    s->FLASH_SR &= ~(new_value & FLASH_SR_W1C_MASK);
+    stm32_flash_update_irq(s);
+}
+
+static void stm32_flash_FLASH_CR_write(Stm32Flash *s, uint32_t new_value)
+{
+    if (IS_BIT_SET(s->FLASH_CR, FLASH_CR_LOCK_BIT)) {
+        stm32_hw_warn("stm32_flash: FLASH_CR written while locked");
+        return;
+    }
+
+    /* Setting LOCK relocks the FPEC and restarts the unlock sequence. */
+    if (IS_BIT_SET(new_value, FLASH_CR_LOCK_BIT)) {
+        s->key_index = 0;
+    }
+
+    if (IS_BIT_SET(new_value, FLASH_CR_OPTPG_BIT) ||
+        IS_BIT_SET(new_value, FLASH_CR_OPTER_BIT)) {
+        STM32_NOT_IMPL_REG(FLASH_CR_OFFSET, WORD_ACCESS_SIZE);
+    }
+
+    /* STRT always reads back as zero, because operations complete
+     * immediately.
+     */
+    s->FLASH_CR = new_value & ~GET_BIT_MASK_ONE(FLASH_CR_STRT_BIT);
+
+    if (IS_BIT_SET(new_value, FLASH_CR_STRT_BIT)) {
+        if (IS_BIT_SET(new_value, FLASH_CR_MER_BIT)) {
+            stm32_flash_erase(s, 0, s->size);
+        } else if (IS_BIT_SET(new_value, FLASH_CR_PER_BIT)) {
+            stm32_flash_page_erase(s);
+        }
+    }
+
+    stm32_flash_update_irq(s);
+}
+
+static uint64_t stm32_flash_regs_read(void *opaque, hwaddr offset,
+                          unsigned size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+    uint64_t value;
+
+    if (size != WORD_ACCESS_SIZE) {
+        STM32_BAD_REG(offset, size);
+    }
+
+    switch (offset) {
+        case FLASH_ACR_OFFSET:
+            value = s->FLASH_ACR;
+            break;
+        case FLASH_KEYR_OFFSET:
+        case FLASH_OPTKEYR_OFFSET:
+            STM32_WO_REG(offset);
+            value = 0;
+            break;
+        case FLASH_SR_OFFSET:
+            value = s->FLASH_SR;
+            break;
+        case FLASH_CR_OFFSET:
+            value = s->FLASH_CR;
+            break;
+        case FLASH_AR_OFFSET:
+            value = s->FLASH_AR;
+            break;
+        case FLASH_OBR_OFFSET:
+            /* No read protection, all option bytes erased. */
+            value = 0x03fffffc;
+            break;
+        case FLASH_WRPR_OFFSET:
+            /* No write protection. */
+            value = 0xffffffff;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_flash_regs_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_flash_regs_write(void *opaque, hwaddr offset,
+                       uint64_t value, unsigned size)
+{
+    Stm32Flash *s = (Stm32Flash *)opaque;
+
+    trace_stm32_flash_regs_write(s, offset, size, value);
+
+    if (size != WORD_ACCESS_SIZE) {
+        STM32_BAD_REG(offset, size);
+    }
+
+    switch (offset) {
+        case FLASH_ACR_OFFSET:
+            stm32_flash_FLASH_ACR_write(s, value);
+            break;
+        case FLASH_KEYR_OFFSET:
+            stm32_flash_FLASH_KEYR_write(s, value);
+            break;
+        case FLASH_OPTKEYR_OFFSET:
+            /* Option byte programming is not implemented. */
+            break;
+        case FLASH_SR_OFFSET:
+            stm32_flash_FLASH_SR_write(s, value);
+            break;
+        case FLASH_CR_OFFSET:
+            stm32_flash_FLASH_CR_write(s, value);
+            break;
+        case FLASH_AR_OFFSET:
+            s->FLASH_AR = value;
+            break;
+        case FLASH_OBR_OFFSET:
+        case FLASH_WRPR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_flash_regs_ops = {
+    .read = stm32_flash_regs_read,
+    .write = stm32_flash_regs_write,
     .endianness = DEVICE_NATIVE_ENDIAN
 };
 
+static void stm32_flash_reset(DeviceState *dev)
+{
+    Stm32Flash *s = FROM_SYSBUS(Stm32Flash, SYS_BUS_DEVICE(dev));
+
+    s->key_index = 0;
+    s->FLASH_ACR = 0x00000030;
+    s->FLASH_SR = 0x00000000;
+    s->FLASH_CR = 0x00000080;
+    s->FLASH_AR = 0x00000000;
+    stm32_flash_update_irq(s);
+    stm32_flash_update_timing(s);
+}
+
+
+
+/* DEVICE INITIALIZATION */
+
+bool stm32_flash_map_kernel(DeviceState *dev, const char *kernel_filename)
+{
+#ifdef _WIN32
+    return false;
+#else
+    uint8_t ident[SELFMAG];
+    bool raw = false;
+    int fd;
+
+    if (kernel_filename == NULL) {
+        return false;
+    }
+    fd = qemu_open(kernel_filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    /* ELF images are placed by their program headers, leave them to the
+     * regular loader. */
+    raw = read(fd, ident, SELFMAG) != SELFMAG ||
+          memcmp(ident, ELFMAG, SELFMAG) != 0;
+    qemu_close(fd);
+
+    if (raw) {
+        qdev_prop_set_string(dev, "image", kernel_filename);
+    }
+    return raw;
+#endif
+}
+
+void stm32_flash_set_cpu(DeviceState *dev, ARMCPU *cpu, uint32_t base,
+                         bool boot_alias)
+{
+    Stm32Flash *s = FROM_SYSBUS(Stm32Flash, SYS_BUS_DEVICE(dev));
+    CPUARMState *env = &cpu->env;
+
+    if (!tcg_cycles) {
+        return;
+    }
+    s->cpu = cpu;
+    env->flash_timing.base = base;
+    env->flash_timing.size = s->size;
+    env->flash_timing.boot_alias = boot_alias;
+    env->flash_timing.line_bytes = FLASH_LINE_BYTES;
+    stm32_flash_update_timing(s);
+}
+
+/* Maps the flash array with the image file at its start.  The mapping is
+ * private: pages are shared with the page cache (and so with every other
+ * process mapping the same file) until the guest programs them, at which
+ * point only the touched page is copied.  The rest of the array is
+ * anonymous memory.
+ */
+static uint8_t *stm32_flash_map_image(Stm32Flash *s)
+{
+#ifdef _WIN32
+    hw_error("stm32_flash: Mapping an image is not supported on this host");
+#else
+    struct stat st;
+    uint8_t *storage;
+    int fd;
+
+    fd = qemu_open(s->image, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        hw_error("stm32_flash: Could not open image '%s'", s->image);
+    }
+    s->image_size = MIN(st.st_size, s->size);
+
+    storage = mmap(NULL, s->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (storage == MAP_FAILED) {
+        hw_error("stm32_flash: Could not allocate the flash array");
+    }
+    if (s->image_size > 0 &&
+        mmap(storage, s->image_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        hw_error("stm32_flash: Could not map image '%s'", s->image);
+    }
+    qemu_close(fd);
+
+    /* The end of the last image page reads as zero, not as erased flash. */
+    memset(storage + s->image_size, FLASH_ERASED_BYTE,
+           s->size - s->image_size);
+    return storage;
+#endif
+}
+
 static int stm32_flash_init(SysBusDevice *dev)
 {
     Stm32Flash *s = FROM_SYSBUS(Stm32Flash, dev);
+    char *name = s->prefix ? g_strdup_printf("%s.stm32_flash", s->prefix)
+                           : g_strdup("stm32_flash");
+
+    if (s->image) {
+        s->storage = stm32_flash_map_image(s);
+        memory_region_init_rom_device_ptr(
+                &s->mem,
+                &stm32_flash_ops,
+                s,
+                name,
+                s->size,
+                s->storage);
+    } else {
+        memory_region_init_rom_device(
+                &s->mem,
+                &stm32_flash_ops,
+                s,
+                name,
+                s->size);
+        s->storage = memory_region_get_ram_ptr(&s->mem);
+    }
+    vmstate_register_ram(&s->mem, &dev->qdev);
+    g_free(name);
+    sysbus_init_mmio(dev, &s->mem);
 
-    memory_region_init_io(
-            &s->iomem,
-            &stm32_flash_ops,
-            &s,
-            "stm32_flash",
-            s->size);
+    memory_region_init_io(&s->iomem, &stm32_flash_regs_ops, s,
+            "stm32_flash_regs", 0x400);
     sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+
+    if (s->page_size == 0 || (s->page_size & (s->page_size - 1))) {
+        hw_error("stm32_flash: Page size must be a power of two");
+    }
+    gdb_register_flash(&s->mem, s->page_size, &stm32_flash_gdb_ops, s);
+
+    /* A mapped image has already been filled in by stm32_flash_map_image */
+    if (!s->image) {
+        memset(s->storage, FLASH_ERASED_BYTE, s->size);
+    }
+    if (s->bs) {
+        /* The image may be smaller than the flash.  Whatever is not covered
+         * by it stays erased.
+         */
+        int64_t image_size = MIN(bdrv_getlength(s->bs), s->size);
+
+        s->bs_sectors = image_size / FLASH_BDRV_SECTOR_SIZE;
+        if (image_size < 0 ||
+            bdrv_read(s->bs, 0, s->storage, s->bs_sectors) < 0) {
+            hw_error("stm32_flash: Failed to read flash image");
+        }
+        if (bdrv_is_read_only(s->bs)) {
+            stm32_hw_warn("stm32_flash: Flash image is read only, changes "
+                          "will not be saved");
+            s->bs = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* The flash array itself is saved as RAM (see stm32_flash_init). */
+static int stm32_flash_post_load(void *opaque, int version_id)
+{
+    stm32_flash_update_timing((Stm32Flash *)opaque);
+
     return 0;
 }
 
+static const VMStateDescription vmstate_stm32_flash = {
+    .name = "stm32_flash",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_flash_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_INT32(key_index, Stm32Flash),
+        VMSTATE_UINT32(FLASH_ACR, Stm32Flash),
+        VMSTATE_UINT32(FLASH_SR, Stm32Flash),
+        VMSTATE_UINT32(FLASH_CR, Stm32Flash),
+        VMSTATE_UINT32(FLASH_AR, Stm32Flash),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_flash_properties[] = {
     DEFINE_PROP_UINT32("size", Stm32Flash, size, 0),
+    DEFINE_PROP_UINT32("page_size", Stm32Flash, page_size, 1024),
+    DEFINE_PROP_DRIVE("drive", Stm32Flash, bs),
+    DEFINE_PROP_STRING("image", Stm32Flash, image),
+    DEFINE_PROP_STRING("prefix", Stm32Flash, prefix),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -88,7 +752,9 @@ static void stm32_flash_class_init(ObjectClass *klass, void *data)
     SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
 
     k->init = stm32_flash_init;
+    dc->reset = stm32_flash_reset;
     dc->props = stm32_flash_properties;
+    dc->vmsd = &vmstate_stm32_flash;
 }
 
 static TypeInfo stm32_flash_info = {
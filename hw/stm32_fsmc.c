@@ -0,0 +1,320 @@
+/*
+ * STM32 Microcontroller FSMC (Flexible Static Memory Controller) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * Only the NOR/SRAM bank (bank 1, at 0x60000000) is emulated.  It is split
+ * into four sub-banks of 64 MiB (NE1 to NE4 chip selects), and each one
+ * shows the device the board attached to it while MBKEN is set in its BCR
+ * and the FSMC clock is on.  The timing registers are stored but have no
+ * effect: accesses take no time.
+ *
+ * A device can also take a run of writes to one address at once, which is
+ * how DMA controllers feed data registers such as the one of an LCD.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+/* BCRx is at 0x00 + 8 * (x - 1), BTRx at 0x04 + 8 * (x - 1) and BWTRx at
+ * 0x104 + 8 * (x - 1). */
+#define FSMC_BCR_OFFSET 0x000
+#define FSMC_BWTR_OFFSET 0x104
+#define FSMC_BANK_STRIDE 0x08
+
+#define FSMC_BCR_MBKEN_BIT 0
+#define FSMC_BCR_MASK 0x000fff7f
+/* Reserved bit 7 reads as 1 */
+#define FSMC_BCR_FIXED 0x00000080
+#define FSMC_BCR1_RESET 0x000030db
+#define FSMC_BCR_RESET 0x000030d2
+
+#define FSMC_BTR_MASK 0x3fffffff
+#define FSMC_BTR_RESET 0x0fffffff
+#define FSMC_BWTR_MASK 0x300fffff
+#define FSMC_BWTR_RESET 0x0fffffff
+
+#define FSMC_NOR_BANK_SIZE 0x04000000
+
+struct Stm32Fsmc {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+
+    /* Private */
+    MemoryRegion iomem;
+    /* NOR/SRAM bank 1, holding the four sub-banks */
+    MemoryRegion nor;
+    MemoryRegion nor_bank[STM32_FSMC_NOR_BANKS];
+
+    Stm32PeriphClk clk;
+
+    /* The devices the board attached */
+    Stm32FsmcBurstFn *burst[STM32_FSMC_NOR_BANKS];
+    void *burst_opaque[STM32_FSMC_NOR_BANKS];
+
+    uint32_t
+        FSMC_BCR[STM32_FSMC_NOR_BANKS],
+        FSMC_BTR[STM32_FSMC_NOR_BANKS],
+        FSMC_BWTR[STM32_FSMC_NOR_BANKS];
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static bool stm32_fsmc_bank_enabled(Stm32Fsmc *s, int bank)
+{
+    return s->clk.enabled &&
+           IS_BIT_SET(s->FSMC_BCR[bank], FSMC_BCR_MBKEN_BIT);
+}
+
+/* Shows the sub-banks which are enabled. */
+static void stm32_fsmc_update_banks(Stm32Fsmc *s)
+{
+    int bank;
+
+    for(bank = 0; bank < STM32_FSMC_NOR_BANKS; bank++) {
+        memory_region_set_enabled(&s->nor_bank[bank],
+                                  stm32_fsmc_bank_enabled(s, bank));
+    }
+}
+
+static void stm32_fsmc_clk_irq_handler(void *opaque, int n, int level)
+{
+    stm32_fsmc_update_banks((Stm32Fsmc *)opaque);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_fsmc_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Fsmc *s = (Stm32Fsmc *)opaque;
+    int bank = (offset & 0xff) / FSMC_BANK_STRIDE;
+    uint64_t value;
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    if(offset < FSMC_BCR_OFFSET + STM32_FSMC_NOR_BANKS * FSMC_BANK_STRIDE) {
+        value = (offset & 4) ? s->FSMC_BTR[bank] : s->FSMC_BCR[bank];
+    } else if(offset >= FSMC_BWTR_OFFSET &&
+              offset < FSMC_BWTR_OFFSET +
+                       STM32_FSMC_NOR_BANKS * FSMC_BANK_STRIDE &&
+              (offset & 4)) {
+        value = s->FSMC_BWTR[bank];
+    } else {
+        STM32_BAD_REG(offset, size);
+        value = 0;
+    }
+
+    trace_stm32_fsmc_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_fsmc_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Fsmc *s = (Stm32Fsmc *)opaque;
+    int bank = (offset & 0xff) / FSMC_BANK_STRIDE;
+
+    trace_stm32_fsmc_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    if(offset < FSMC_BCR_OFFSET + STM32_FSMC_NOR_BANKS * FSMC_BANK_STRIDE) {
+        if(offset & 4) {
+            s->FSMC_BTR[bank] = value & FSMC_BTR_MASK;
+        } else {
+            s->FSMC_BCR[bank] = (value & FSMC_BCR_MASK) | FSMC_BCR_FIXED;
+            stm32_fsmc_update_banks(s);
+        }
+    } else if(offset >= FSMC_BWTR_OFFSET &&
+              offset < FSMC_BWTR_OFFSET +
+                       STM32_FSMC_NOR_BANKS * FSMC_BANK_STRIDE &&
+              (offset & 4)) {
+        s->FSMC_BWTR[bank] = value & FSMC_BWTR_MASK;
+    } else {
+        STM32_BAD_REG(offset, size);
+    }
+}
+
+static const MemoryRegionOps stm32_fsmc_ops = {
+    .read = stm32_fsmc_read,
+    .write = stm32_fsmc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    }
+};
+
+static void stm32_fsmc_reset(DeviceState *dev)
+{
+    Stm32Fsmc *s = FROM_SYSBUS(Stm32Fsmc, SYS_BUS_DEVICE(dev));
+    int bank;
+
+    for(bank = 0; bank < STM32_FSMC_NOR_BANKS; bank++) {
+        s->FSMC_BCR[bank] = bank == 0 ? FSMC_BCR1_RESET : FSMC_BCR_RESET;
+        s->FSMC_BTR[bank] = FSMC_BTR_RESET;
+        s->FSMC_BWTR[bank] = FSMC_BWTR_RESET;
+    }
+    stm32_fsmc_update_banks(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_fsmc_attach(Stm32Fsmc *s, int bank, MemoryRegion *mr,
+                       Stm32FsmcBurstFn *burst, void *opaque)
+{
+    assert(bank >= 0 && bank < STM32_FSMC_NOR_BANKS);
+    assert(memory_region_size(mr) <= FSMC_NOR_BANK_SIZE);
+
+    memory_region_add_subregion(&s->nor_bank[bank], 0, mr);
+    s->burst[bank] = burst;
+    s->burst_opaque[bank] = opaque;
+}
+
+bool stm32_fsmc_burst_write(Stm32Fsmc *s, hwaddr addr, const uint8_t *buf,
+                            uint32_t len, unsigned size)
+{
+    int bank;
+
+    if(addr < STM32_FSMC_NOR_ADDR ||
+       addr >= STM32_FSMC_NOR_ADDR +
+               STM32_FSMC_NOR_BANKS * FSMC_NOR_BANK_SIZE) {
+        return false;
+    }
+    addr -= STM32_FSMC_NOR_ADDR;
+    bank = addr / FSMC_NOR_BANK_SIZE;
+    if(!s->burst[bank] || !stm32_fsmc_bank_enabled(s, bank)) {
+        return false;
+    }
+
+    s->burst[bank](s->burst_opaque[bank], addr % FSMC_NOR_BANK_SIZE,
+                   buf, len, size);
+    return true;
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_fsmc_instance_init(Object *obj)
+{
+    Stm32Fsmc *s = FROM_SYSBUS(Stm32Fsmc, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_fsmc_init(SysBusDevice *dev)
+{
+    Stm32Fsmc *s = FROM_SYSBUS(Stm32Fsmc, dev);
+    qemu_irq *clk_irq;
+    char *name;
+    int bank;
+
+    clk_irq = qemu_allocate_irqs(stm32_fsmc_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_FSMC, dev,
+                              clk_irq[0]);
+
+    memory_region_init_io(&s->iomem, &stm32_fsmc_ops, s,
+                          "fsmc", 0x0fff);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    memory_region_init(&s->nor, "fsmc.nor",
+                       STM32_FSMC_NOR_BANKS * FSMC_NOR_BANK_SIZE);
+    for(bank = 0; bank < STM32_FSMC_NOR_BANKS; bank++) {
+        name = g_strdup_printf("fsmc.nor%d", bank + 1);
+        memory_region_init(&s->nor_bank[bank], name, FSMC_NOR_BANK_SIZE);
+        g_free(name);
+        memory_region_set_enabled(&s->nor_bank[bank], false);
+        memory_region_add_subregion(&s->nor, bank * FSMC_NOR_BANK_SIZE,
+                                    &s->nor_bank[bank]);
+    }
+    sysbus_init_mmio(dev, &s->nor);
+
+    return 0;
+}
+
+static int stm32_fsmc_post_load(void *opaque, int version_id)
+{
+    stm32_fsmc_update_banks((Stm32Fsmc *)opaque);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_fsmc = {
+    .name = "stm32_fsmc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_fsmc_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(FSMC_BCR, Stm32Fsmc, STM32_FSMC_NOR_BANKS),
+        VMSTATE_UINT32_ARRAY(FSMC_BTR, Stm32Fsmc, STM32_FSMC_NOR_BANKS),
+        VMSTATE_UINT32_ARRAY(FSMC_BWTR, Stm32Fsmc, STM32_FSMC_NOR_BANKS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_fsmc_properties[] = {
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_fsmc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_fsmc_init;
+    dc->reset = stm32_fsmc_reset;
+    dc->props = stm32_fsmc_properties;
+    dc->vmsd = &vmstate_stm32_fsmc;
+}
+
+static TypeInfo stm32_fsmc_info = {
+    .name  = "stm32_fsmc",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Fsmc),
+    .instance_init = stm32_fsmc_instance_init,
+    .class_init = stm32_fsmc_class_init
+};
+
+static void stm32_fsmc_register_types(void)
+{
+    type_register_static(&stm32_fsmc_info);
+}
+
+type_init(stm32_fsmc_register_types)
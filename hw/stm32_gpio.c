@@ -5,6 +5,7 @@
  *
  * Source code based on pl061.c
  * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ * and, for the STM32F2XX port layout, "RM0033 Reference Manual Rev 4"
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License as
@@ -23,6 +24,12 @@
 
 #include "sysbus.h"
 #include "stm32.h"
+#include "stm32f2xx.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qjson.h"
+#include "trace.h"
 
 
 
@@ -40,24 +47,54 @@
 #define GPIOx_CRL_INDEX 0
 #define GPIOx_CRH_INDEX 1
 
+/* STM32F2XX port layout */
+#define GPIOx_MODER_OFFSET 0x00
+#define GPIOx_OTYPER_OFFSET 0x04
+#define GPIOx_OSPEEDR_OFFSET 0x08
+#define GPIOx_PUPDR_OFFSET 0x0c
+#define GPIOx_F2_IDR_OFFSET 0x10
+#define GPIOx_F2_ODR_OFFSET 0x14
+#define GPIOx_F2_BSRR_OFFSET 0x18
+#define GPIOx_F2_LCKR_OFFSET 0x1c
+#define GPIOx_AFRL_OFFSET 0x20
+#define GPIOx_AFRH_OFFSET 0x24
+
+#define GPIOx_AFRL_INDEX 0
+#define GPIOx_AFRH_INDEX 1
+
 struct Stm32Gpio {
     /* Inherited */
     SysBusDevice busdev;
 
     /* Properties */
     stm32_periph_t periph;
-    void *stm32_rcc_prop;
+    Stm32Rcc *stm32_rcc;
 
     /* Private */
     MemoryRegion iomem;
 
-    Stm32Rcc *stm32_rcc;
+    Stm32PeriphClk clk;
 
     /* CRL = 0
      * CRH = 1
      */
     uint32_t GPIOx_CRy[2];
 
+    /* STM32F2XX configuration registers (AFRL = 0, AFRH = 1) */
+    uint32_t
+        GPIOx_MODER,
+        GPIOx_OTYPER,
+        GPIOx_OSPEEDR,
+        GPIOx_PUPDR,
+        GPIOx_AFRy[2];
+
+    /* STM32F2XX port layout.  The pins in each MODER mode, and the pins in
+     * alternate function mode for each AF number, updated when MODER or
+     * AFRL/AFRH is written. */
+    bool f2_layout;
+    uint16_t mode_pins[4];
+    uint16_t af_pins[16];
+
     /* 0 = input
      * 1 = output
      */
@@ -72,14 +109,31 @@ struct Stm32Gpio {
      */
     qemu_irq out_irq[STM32_GPIO_PIN_COUNT];
 
+    /* Notified once per output register write, with all of the changed
+     * pins (see stm32_gpio_add_bus_notifier). */
+    NotifierList bus_notifiers;
+    /* Notified when input pins change level */
+    NotifierList in_notifiers;
+
     uint16_t in;
 
-    /* EXTI IRQ to notify on input change - there is one EXTI IRQ per pin. */
-    qemu_irq exti_irq[STM32_GPIO_PIN_COUNT];
+    /* EXTI controller to notify on input change */
+    Stm32Exti *exti;
+    unsigned exti_gpio_index;
+
+    /* AFIO to notify on configuration change (STM32F1XX) */
+    Stm32Afio *afio;
+
+    /* Input changes waiting for their time (see stm32_gpio_queue_inputs).
+     * The queue holds input_count entries starting at input_head. */
+    Stm32GpioInput *input_queue;
+    unsigned input_head, input_count, input_size;
+    QEMUTimer *input_timer;
 };
 
 
 
+
 /* CALLBACKs */
 
 /* Trigger fired when a GPIO input pin changes state (based
@@ -92,15 +146,32 @@ static void stm32_gpio_in_trigger(void *opaque, int irq, int level)
 
     assert(pin < STM32_GPIO_PIN_COUNT);
 
-    /* Only proceed if the pin has actually changed value (the trigger
-     * will fire when the IRQ is set, even if it set to the same level). */
-    if(GET_BIT_VALUE(s->in, pin) != level) {
-        /* Update internal pin state. */
-        CHANGE_BIT(s->in, pin, level);
+    stm32_gpio_set_inputs(s, 1 << pin, level ? (1 << pin) : 0);
+}
 
-        /* Propagate the trigger to the EXTI module. */
-        qemu_set_irq(s->exti_irq[pin], level);
+/* Makes the queued input changes that are due, and sets the timer for the
+ * next one. */
+static void stm32_gpio_run_inputs(Stm32Gpio *s)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    Stm32GpioInput *input;
+
+    while(s->input_count > 0) {
+        input = &s->input_queue[s->input_head];
+        if(input->time > now) {
+            qemu_mod_timer(s->input_timer, input->time);
+            return;
+        }
+        s->input_head++;
+        s->input_count--;
+        stm32_gpio_set_inputs_at(s, input->mask, input->value, input->time);
     }
+    s->input_head = 0;
+}
+
+static void stm32_gpio_input_timer_expire(void *opaque)
+{
+    stm32_gpio_run_inputs((Stm32Gpio *)opaque);
 }
 
 
@@ -154,6 +225,22 @@ static void stm32_gpio_GPIOx_CRy_write(Stm32Gpio *s, int cr_index,
          */
         CHANGE_BIT(s->dir_mask, pin, pin_dir);
     }
+
+    if(s->afio) {
+        stm32_afio_gpio_config_changed(s->afio);
+    }
+}
+
+/* Sends a STM32_GPIO_OUTPUT event (see QMP/qmp-events.txt). */
+static void stm32_gpio_send_output_event(Stm32Gpio *s)
+{
+    QObject *data;
+
+    data = qobject_from_jsonf("{ 'port': %s, 'output': %d }",
+                              DEVICE(s)->id ? DEVICE(s)->id : "",
+                              (int)s->GPIOx_ODR);
+    monitor_protocol_event(QEVENT_STM32_GPIO_OUTPUT, data);
+    qobject_decref(data);
 }
 
 /* Write the Output Data Register.
@@ -166,6 +253,7 @@ static void stm32_gpio_GPIOx_ODR_write(Stm32Gpio *s, uint32_t new_value,
     uint32_t old_value;
     uint16_t changed, changed_out;
     unsigned pin;
+    Stm32GpioBusEvent event;
 
     old_value = s->GPIOx_ODR;
 
@@ -174,30 +262,38 @@ static void stm32_gpio_GPIOx_ODR_write(Stm32Gpio *s, uint32_t new_value,
     s->GPIOx_ODR = new_value & 0x0000ffff;
 
     /* Get pins that changed value */
-    changed = old_value ^ new_value;
+    changed = old_value ^ s->GPIOx_ODR;
 
     /* Get changed pins that are outputs - we will not touch input pins */
     changed_out = changed & s->dir_mask;
 
     if (changed_out) {
-        for (pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
-            /* If the value of this pin has changed, then update
-             * the output IRQ.
-             */
-            if (IS_BIT_SET(changed_out, pin)) {
-                qemu_set_irq(
-                        s->out_irq[pin],
-                        IS_BIT_SET(s->GPIOx_ODR, pin) ? 1 : 0);
-            }
+        event.changed = changed_out;
+        event.value = s->GPIOx_ODR;
+        event.time = qemu_get_clock_ns(vm_clock);
+        notifier_list_notify(&s->bus_notifiers, &event);
+
+        if (!init && monitor_protocol_event_wanted(QEVENT_STM32_GPIO_OUTPUT)) {
+            stm32_gpio_send_output_event(s);
+        }
+
+        /* Update the output IRQ of each pin that changed value. */
+        while (changed_out) {
+            pin = ctz32(changed_out);
+            changed_out &= changed_out - 1;
+            trace_stm32_gpio_out(s, pin, IS_BIT_SET(s->GPIOx_ODR, pin));
+            qemu_set_irq(
+                    s->out_irq[pin],
+                    IS_BIT_SET(s->GPIOx_ODR, pin) ? 1 : 0);
         }
     }
 }
 
 /* Write the Bit Set/Reset Register.
  * Setting a bit sets or resets the corresponding bit in the output
- * register.  The lower 16 bits perform resets, and the upper 16 bits
- * perform sets.  Register is write-only and so does not need to store
- * a value.
+ * register.  The lower 16 bits perform sets, and the upper 16 bits
+ * perform resets.  If both are requested for a pin, the set wins.
+ * Register is write-only and so does not need to store a value.
  */
 static void stm32_gpio_GPIOx_BSRR_write(Stm32Gpio *s, uint32_t new_value)
 {
@@ -205,13 +301,13 @@ static void stm32_gpio_GPIOx_BSRR_write(Stm32Gpio *s, uint32_t new_value)
 
     new_ODR = s->GPIOx_ODR;
 
-    /* Perform sets with upper halfword. */
-    new_ODR |= new_value & 0x0000ffff;
-
-    /* Perform resets. */
+    /* Perform resets with upper halfword. */
     new_ODR &= ~(new_value >> 16) & 0x0000ffff;
 
-    stm32_gpio_GPIOx_ODR_write(s, new_value, false);
+    /* Perform sets. */
+    new_ODR |= new_value & 0x0000ffff;
+
+    stm32_gpio_GPIOx_ODR_write(s, new_ODR, false);
 }
 
 /* Update the Bit Reset Register.
@@ -296,14 +392,20 @@ static uint64_t stm32_gpio_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
     Stm32Gpio *s = (Stm32Gpio *)opaque;
+    uint64_t value;
 
     switch(size) {
         case WORD_ACCESS_SIZE:
-            return stm32_gpio_readw(s, offset);
+            value = stm32_gpio_readw(s, offset);
+            break;
         default:
             STM32_BAD_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_gpio_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_gpio_write(void *opaque, hwaddr offset,
@@ -311,7 +413,11 @@ static void stm32_gpio_write(void *opaque, hwaddr offset,
 {
     Stm32Gpio *s = (Stm32Gpio *)opaque;
 
-    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph, &s->busdev);
+    trace_stm32_gpio_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
 
     switch(size) {
         case WORD_ACCESS_SIZE:
@@ -341,6 +447,218 @@ static void stm32_gpio_reset(DeviceState *dev)
 
 
 
+/* STM32F2XX Specific stuff */
+
+/* Recompute the pin masks from MODER and AFRL/AFRH.  Only pins in general
+ * purpose output mode are driven from ODR; alternate function outputs
+ * belong to the peripheral. */
+static void stm32f2xx_gpio_update_pins(Stm32Gpio *s)
+{
+    unsigned pin;
+
+    memset(s->mode_pins, 0, sizeof(s->mode_pins));
+    memset(s->af_pins, 0, sizeof(s->af_pins));
+    for(pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
+        uint8_t mode = stm32f2xx_gpio_get_mode_bits(s, pin);
+
+        s->mode_pins[mode] |= 1 << pin;
+        if(mode == STM32F2XX_GPIO_MODE_AF) {
+            s->af_pins[stm32f2xx_gpio_get_af(s, pin)] |= 1 << pin;
+        }
+    }
+    s->dir_mask = s->mode_pins[STM32F2XX_GPIO_MODE_OUT];
+}
+
+/* Update the Mode Register. */
+static void stm32f2xx_gpio_GPIOx_MODER_write(Stm32Gpio *s, uint32_t new_value,
+                                             bool init)
+{
+    s->GPIOx_MODER = new_value;
+    stm32f2xx_gpio_update_pins(s);
+}
+
+static void stm32f2xx_gpio_GPIOx_AFRy_write(Stm32Gpio *s, int afr_index,
+                                            uint32_t new_value)
+{
+    s->GPIOx_AFRy[afr_index] = new_value;
+    stm32f2xx_gpio_update_pins(s);
+}
+
+static uint64_t stm32f2xx_gpio_readw(Stm32Gpio *s, hwaddr offset)
+{
+    switch (offset) {
+        case GPIOx_MODER_OFFSET:
+            return s->GPIOx_MODER;
+        case GPIOx_OTYPER_OFFSET:
+            return s->GPIOx_OTYPER;
+        case GPIOx_OSPEEDR_OFFSET:
+            return s->GPIOx_OSPEEDR;
+        case GPIOx_PUPDR_OFFSET:
+            return s->GPIOx_PUPDR;
+        case GPIOx_F2_IDR_OFFSET:
+            return s->in;
+        case GPIOx_F2_ODR_OFFSET:
+            return s->GPIOx_ODR;
+        case GPIOx_F2_BSRR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case GPIOx_F2_LCKR_OFFSET:
+            /* Locking is not yet implemented */
+            return 0;
+        case GPIOx_AFRL_OFFSET:
+            return s->GPIOx_AFRy[GPIOx_AFRL_INDEX];
+        case GPIOx_AFRH_OFFSET:
+            return s->GPIOx_AFRy[GPIOx_AFRH_INDEX];
+        default:
+            STM32_BAD_REG(offset, WORD_ACCESS_SIZE);
+            return 0;
+    }
+}
+
+static void stm32f2xx_gpio_writew(Stm32Gpio *s, hwaddr offset,
+                                  uint64_t value)
+{
+    switch (offset) {
+        case GPIOx_MODER_OFFSET:
+            stm32f2xx_gpio_GPIOx_MODER_write(s, value, false);
+            break;
+        case GPIOx_OTYPER_OFFSET:
+            s->GPIOx_OTYPER = value & 0x0000ffff;
+            break;
+        case GPIOx_OSPEEDR_OFFSET:
+            s->GPIOx_OSPEEDR = value;
+            break;
+        case GPIOx_PUPDR_OFFSET:
+            s->GPIOx_PUPDR = value;
+            break;
+        case GPIOx_F2_IDR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case GPIOx_F2_ODR_OFFSET:
+            stm32_gpio_GPIOx_ODR_write(s, value, false);
+            break;
+        case GPIOx_F2_BSRR_OFFSET:
+            stm32_gpio_GPIOx_BSRR_write(s, value);
+            break;
+        case GPIOx_F2_LCKR_OFFSET:
+            /* Locking is not implemented */
+            STM32_NOT_IMPL_REG(offset, 4);
+            break;
+        case GPIOx_AFRL_OFFSET:
+            stm32f2xx_gpio_GPIOx_AFRy_write(s, GPIOx_AFRL_INDEX, value);
+            break;
+        case GPIOx_AFRH_OFFSET:
+            stm32f2xx_gpio_GPIOx_AFRy_write(s, GPIOx_AFRH_INDEX, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+/* The ST library accesses BSRR as two halfwords (BSRRL and BSRRH), so
+ * halfword accesses are supported on each register. */
+static uint64_t stm32f2xx_gpio_read(void *opaque, hwaddr offset,
+                                    unsigned size)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            if((offset & ~3) == GPIOx_F2_BSRR_OFFSET) {
+                STM32_WO_REG(offset);
+                value = 0;
+                break;
+            }
+            value = STM32_REG_READH_VALUE(offset,
+                                          stm32f2xx_gpio_readw(s, offset & ~3));
+            break;
+        case WORD_ACCESS_SIZE:
+            value = stm32f2xx_gpio_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_gpio_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32f2xx_gpio_write(void *opaque, hwaddr offset,
+                                 uint64_t value, unsigned size)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+
+    trace_stm32_gpio_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            if((offset & ~3) == GPIOx_F2_BSRR_OFFSET) {
+                /* BSRR does not hold a value, so the other half is 0. */
+                stm32_gpio_GPIOx_BSRR_write(s,
+                        STM32_REG_WRITEH_VALUE(offset, 0, value));
+            } else if((offset & ~3) == GPIOx_F2_IDR_OFFSET) {
+                STM32_RO_REG(offset);
+            } else {
+                stm32f2xx_gpio_writew(s, offset & ~3,
+                        STM32_REG_WRITEH_VALUE(offset,
+                                stm32f2xx_gpio_readw(s, offset & ~3), value));
+            }
+            break;
+        case WORD_ACCESS_SIZE:
+            stm32f2xx_gpio_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32f2xx_gpio_ops = {
+    .read = stm32f2xx_gpio_read,
+    .write = stm32f2xx_gpio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32f2xx_gpio_reset(DeviceState *dev)
+{
+    Stm32Gpio *s = FROM_SYSBUS(Stm32Gpio, SYS_BUS_DEVICE(dev));
+
+    s->GPIOx_AFRy[GPIOx_AFRL_INDEX] = 0x00000000;
+    s->GPIOx_AFRy[GPIOx_AFRH_INDEX] = 0x00000000;
+
+    /* Port A and B come out of reset with the debug pins configured. */
+    switch(s->periph) {
+        case STM32F2XX_GPIOA:
+            stm32f2xx_gpio_GPIOx_MODER_write(s, 0xa8000000, true);
+            s->GPIOx_OSPEEDR = 0x00000000;
+            s->GPIOx_PUPDR = 0x64000000;
+            break;
+        case STM32F2XX_GPIOB:
+            stm32f2xx_gpio_GPIOx_MODER_write(s, 0x00000280, true);
+            s->GPIOx_OSPEEDR = 0x000000c0;
+            s->GPIOx_PUPDR = 0x00000100;
+            break;
+        default:
+            stm32f2xx_gpio_GPIOx_MODER_write(s, 0x00000000, true);
+            s->GPIOx_OSPEEDR = 0x00000000;
+            s->GPIOx_PUPDR = 0x00000000;
+            break;
+    }
+    s->GPIOx_OTYPER = 0x00000000;
+    stm32_gpio_GPIOx_ODR_write(s, 0x00000000, true);
+}
+
+
+
+
 
 
 /* PUBLIC FUNCTIONS */
@@ -353,11 +671,100 @@ uint8_t stm32_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin) {
     return stm32_gpio_get_pin_config(s, pin) & 0x3;
 }
 
-void stm32_gpio_set_exti_irq(Stm32Gpio *s, unsigned pin, qemu_irq exti_irq)
-{
+uint8_t stm32f2xx_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin) {
     assert(pin < STM32_GPIO_PIN_COUNT);
 
-    s->exti_irq[pin] = exti_irq;
+    return (s->GPIOx_MODER >> (pin * 2)) & 0x3;
+}
+
+uint8_t stm32f2xx_gpio_get_af(Stm32Gpio *s, unsigned pin) {
+    assert(pin < STM32_GPIO_PIN_COUNT);
+
+    return (s->GPIOx_AFRy[pin / 8] >> ((pin % 8) * 4)) & 0xf;
+}
+
+uint16_t stm32f2xx_gpio_get_mode_pins(Stm32Gpio *s, uint8_t mode) {
+    assert(mode < ARRAY_LENGTH(s->mode_pins));
+
+    return s->mode_pins[mode];
+}
+
+uint16_t stm32f2xx_gpio_get_af_pins(Stm32Gpio *s, uint8_t af) {
+    assert(af < ARRAY_LENGTH(s->af_pins));
+
+    return s->af_pins[af];
+}
+
+void stm32_gpio_set_exti(Stm32Gpio *s, Stm32Exti *exti, unsigned gpio_index)
+{
+    s->exti = exti;
+    s->exti_gpio_index = gpio_index;
+}
+
+void stm32_gpio_set_afio(Stm32Gpio *s, Stm32Afio *afio)
+{
+    s->afio = afio;
+}
+
+void stm32_gpio_set_inputs_at(Stm32Gpio *s, uint16_t mask, uint16_t value,
+                              int64_t time)
+{
+    uint16_t changed = (s->in ^ value) & mask;
+
+    /* Only proceed if a pin has actually changed value (the input IRQs
+     * fire when they are set, even if they are set to the same level). */
+    Stm32GpioBusEvent event;
+
+    if(changed) {
+        s->in ^= changed;
+
+        /* Propagate the edges to the EXTI module. */
+        if(s->exti) {
+            stm32_exti_gpio_edges(s->exti, s->exti_gpio_index,
+                                  changed & value, changed & ~value);
+        }
+
+        event.changed = changed;
+        event.value = s->in;
+        event.time = time;
+        notifier_list_notify(&s->in_notifiers, &event);
+    }
+}
+
+void stm32_gpio_set_inputs(Stm32Gpio *s, uint16_t mask, uint16_t value)
+{
+    stm32_gpio_set_inputs_at(s, mask, value, qemu_get_clock_ns(vm_clock));
+}
+
+void stm32_gpio_queue_inputs(Stm32Gpio *s, const Stm32GpioInput *inputs,
+                             unsigned count)
+{
+    /* Move the waiting changes to the front before growing the queue. */
+    if(s->input_head > 0) {
+        memmove(s->input_queue, &s->input_queue[s->input_head],
+                s->input_count * sizeof(Stm32GpioInput));
+        s->input_head = 0;
+    }
+    if(s->input_count + count > s->input_size) {
+        s->input_size = s->input_count + count;
+        s->input_queue = g_renew(Stm32GpioInput, s->input_queue,
+                                 s->input_size);
+    }
+    memcpy(&s->input_queue[s->input_count], inputs,
+           count * sizeof(Stm32GpioInput));
+    s->input_count += count;
+
+    stm32_gpio_run_inputs(s);
+}
+
+void stm32_gpio_add_bus_notifier(Stm32Gpio *s, Notifier *notifier)
+{
+    notifier_list_add(&s->bus_notifiers, notifier);
+}
+
+void stm32_gpio_add_input_notifier(Stm32Gpio *s, Notifier *notifier)
+{
+    notifier_list_add(&s->in_notifiers, notifier);
 }
 
 
@@ -367,30 +774,148 @@ void stm32_gpio_set_exti_irq(Stm32Gpio *s, unsigned pin, qemu_irq exti_irq)
 
 /* DEVICE INITIALIZATION */
 
-static int stm32_gpio_init(SysBusDevice *dev)
+static void stm32_gpio_init_common(SysBusDevice *dev,
+                                   const MemoryRegionOps *ops)
 {
-    unsigned pin;
     Stm32Gpio *s = FROM_SYSBUS(Stm32Gpio, dev);
 
-    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
 
-    memory_region_init_io(&s->iomem, &stm32_gpio_ops, s,
+    memory_region_init_io(&s->iomem, ops, s,
                           "gpio", 0x03ff);
     sysbus_init_mmio(dev, &s->iomem);
 
     qdev_init_gpio_in(&dev->qdev, stm32_gpio_in_trigger, STM32_GPIO_PIN_COUNT);
     qdev_init_gpio_out(&dev->qdev, s->out_irq, STM32_GPIO_PIN_COUNT);
+    notifier_list_init(&s->bus_notifiers);
+    notifier_list_init(&s->in_notifiers);
 
-    for(pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
-        stm32_gpio_set_exti_irq(s, pin, NULL);
+    s->input_timer = qemu_new_timer_ns(vm_clock,
+                                       stm32_gpio_input_timer_expire, s);
+}
+
+static void stm32_gpio_instance_init(Object *obj)
+{
+    Stm32Gpio *s = FROM_SYSBUS(Stm32Gpio, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_gpio_init(SysBusDevice *dev)
+{
+    stm32_gpio_init_common(dev, &stm32_gpio_ops);
+
+    return 0;
+}
+
+static int stm32f2xx_gpio_init(SysBusDevice *dev)
+{
+    Stm32Gpio *s = FROM_SYSBUS(Stm32Gpio, dev);
+
+    stm32_gpio_init_common(dev, &stm32f2xx_gpio_ops);
+    s->f2_layout = true;
+
+    return 0;
+}
+
+/* The queued input changes are saved as a count followed by the changes, so
+ * that a snapshot taken while a pin bus client is replaying a recording
+ * carries on with it. */
+static void stm32_gpio_put_inputs(QEMUFile *f, void *pv, size_t size)
+{
+    Stm32Gpio *s = container_of(pv, Stm32Gpio, input_queue);
+    Stm32GpioInput *input;
+    unsigned i;
+
+    qemu_put_be32(f, s->input_count);
+    for(i = 0; i < s->input_count; i++) {
+        input = &s->input_queue[s->input_head + i];
+        qemu_put_sbe64(f, input->time);
+        qemu_put_be16(f, input->mask);
+        qemu_put_be16(f, input->value);
+    }
+}
+
+static int stm32_gpio_get_inputs(QEMUFile *f, void *pv, size_t size)
+{
+    Stm32Gpio *s = container_of(pv, Stm32Gpio, input_queue);
+    Stm32GpioInput *input;
+    unsigned i, count;
+
+    count = qemu_get_be32(f);
+    if(count > s->input_size) {
+        s->input_size = count;
+        s->input_queue = g_renew(Stm32GpioInput, s->input_queue,
+                                 s->input_size);
+    }
+    for(i = 0; i < count; i++) {
+        input = &s->input_queue[i];
+        input->time = qemu_get_sbe64(f);
+        input->mask = qemu_get_be16(f);
+        input->value = qemu_get_be16(f);
     }
+    s->input_head = 0;
+    s->input_count = count;
 
     return 0;
 }
 
+static const VMStateInfo vmstate_info_stm32_gpio_inputs = {
+    .name = "stm32_gpio_inputs",
+    .get  = stm32_gpio_get_inputs,
+    .put  = stm32_gpio_put_inputs,
+};
+
+/* Drives the outputs again from the loaded ODR, the way a write to it
+ * would. */
+static int stm32_gpio_post_load(void *opaque, int version_id)
+{
+    Stm32Gpio *s = (Stm32Gpio *)opaque;
+    uint16_t out;
+    unsigned pin;
+
+    if(s->f2_layout) {
+        stm32f2xx_gpio_update_pins(s);
+    }
+    if(s->afio) {
+        stm32_afio_gpio_config_changed(s->afio);
+    }
+    out = s->dir_mask;
+    while(out) {
+        pin = ctz32(out);
+        out &= out - 1;
+        qemu_set_irq(s->out_irq[pin], IS_BIT_SET(s->GPIOx_ODR, pin) ? 1 : 0);
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_gpio = {
+    .name = "stm32_gpio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_gpio_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(GPIOx_CRy, Stm32Gpio, 2),
+        VMSTATE_UINT32(GPIOx_MODER, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_OTYPER, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_OSPEEDR, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_PUPDR, Stm32Gpio),
+        VMSTATE_UINT32_ARRAY(GPIOx_AFRy, Stm32Gpio, 2),
+        VMSTATE_UINT16(dir_mask, Stm32Gpio),
+        VMSTATE_UINT32(GPIOx_ODR, Stm32Gpio),
+        VMSTATE_UINT16(in, Stm32Gpio),
+        VMSTATE_SINGLE(input_queue, Stm32Gpio, 0,
+                       vmstate_info_stm32_gpio_inputs, Stm32GpioInput *),
+        VMSTATE_TIMER(input_timer, Stm32Gpio),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_gpio_properties[] = {
     DEFINE_PROP_INT32("periph", Stm32Gpio, periph, -1),
-    DEFINE_PROP_PTR("stm32_rcc", Stm32Gpio, stm32_rcc_prop),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -402,18 +927,37 @@ static void stm32_gpio_class_init(ObjectClass *klass, void *data)
     k->init = stm32_gpio_init;
     dc->reset = stm32_gpio_reset;
     dc->props = stm32_gpio_properties;
+    dc->vmsd = &vmstate_stm32_gpio;
 }
 
 static TypeInfo stm32_gpio_info = {
     .name  = "stm32_gpio",
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_size  = sizeof(Stm32Gpio),
+    .instance_init = stm32_gpio_instance_init,
     .class_init = stm32_gpio_class_init
 };
 
+static void stm32f2xx_gpio_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32f2xx_gpio_init;
+    dc->reset = stm32f2xx_gpio_reset;
+}
+
+static TypeInfo stm32f2xx_gpio_info = {
+    .name  = "stm32f2xx_gpio",
+    .parent = "stm32_gpio",
+    .instance_size  = sizeof(Stm32Gpio),
+    .class_init = stm32f2xx_gpio_class_init
+};
+
 static void stm32_gpio_register_types(void)
 {
     type_register_static(&stm32_gpio_info);
+    type_register_static(&stm32f2xx_gpio_info);
 }
 
 type_init(stm32_gpio_register_types)
@@ -0,0 +1,731 @@
+/*
+ * STM32 Microcontroller HASH (hash processor) module (STM32F21X)
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual Rev 4"
+ *
+ * SHA-1 and MD5 digests of messages made of whole bytes are computed.  The
+ * HMAC mode and the context swapping registers are not emulated.  Words
+ * written to DIN go to the algorithm at once, but the last one is kept
+ * back until DCAL says how many of its bits are valid, so the FIFO is
+ * never seen full and BUSY never set.
+ *
+ * With DMAE set, the rest of the message is taken from the DMA stream in
+ * one go as soon as the stream is set up to move contiguous memory, and the
+ * digest is calculated at the end of it, as the end of the DMA transfer
+ * does on the real chip.  Streams which cannot be served that way feed DIN
+ * through the request line, and DCAL then has to be set by software.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "exec/cpu-common.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+#define HASH_CR_OFFSET 0x00
+#define HASH_CR_INIT_BIT 2
+#define HASH_CR_DMAE_BIT 3
+#define HASH_CR_DATATYPE_START 4
+#define HASH_CR_DATATYPE_MASK 0x00000030
+#define HASH_CR_MODE_BIT 6
+#define HASH_CR_ALGO_BIT 7
+#define HASH_CR_NBW_START 8
+#define HASH_CR_DINNE_BIT 12
+#define HASH_CR_LKEY_BIT 16
+/* The bits which are kept as written */
+#define HASH_CR_MASK 0x000100f8
+
+#define HASH_DATATYPE_32 0
+#define HASH_DATATYPE_16 1
+#define HASH_DATATYPE_8 2
+
+#define HASH_DIN_OFFSET 0x04
+
+#define HASH_STR_OFFSET 0x08
+#define HASH_STR_NBLW_MASK 0x0000001f
+#define HASH_STR_DCAL_BIT 8
+
+#define HASH_HR0_OFFSET 0x0c
+#define HASH_HR4_OFFSET 0x1c
+
+#define HASH_IMR_OFFSET 0x20
+#define HASH_IMR_MASK 0x00000003
+
+#define HASH_SR_OFFSET 0x24
+#define HASH_SR_DINIS_BIT 0
+#define HASH_SR_DCIS_BIT 1
+#define HASH_SR_DMAS_BIT 2
+/* The flags which are cleared by writing 0 */
+#define HASH_SR_CLEAR_MASK 0x00000003
+
+#define HASH_DIGEST_WORDS 5
+#define HASH_BLOCK_SIZE 64
+/* Words of a block, as counted by NBW */
+#define HASH_BLOCK_WORDS 16
+
+/* Block transfers are read and hashed this much at a time. */
+#define HASH_DMA_CHUNK_SIZE 4096
+
+#define HASH_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+struct Stm32Hash {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    Stm32f2xxDma *stm32_dma;
+    /* STM32F2XX_DMA_REQ() number of the stream serving HASH_IN, or -1 */
+    int32_t dma_req;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    /* The message so far: its length in bytes, the state of the algorithm
+     * (selected by ALGO at INIT) and the block not processed yet.  A full
+     * block is only processed once more data comes, so that the last word
+     * can still be cut at DCAL. */
+    bool md5;
+    uint64_t msg_len;
+    uint32_t state[HASH_DIGEST_WORDS];
+    uint8_t block[HASH_BLOCK_SIZE];
+    uint32_t block_len;
+    /* Words written to DIN since INIT */
+    uint32_t words;
+
+    /* The DMA request is held down while the block transfer is tried from
+     * dma_bh; it is only raised for streams it could not serve. */
+    QEMUBH *dma_bh;
+    bool dma_bh_pending;
+    bool dma_fallback;
+    /* The digest has been calculated at the end of the DMA transfer. */
+    bool dma_done;
+
+    uint32_t
+        HASH_CR,
+        HASH_STR,
+        HASH_HR[HASH_DIGEST_WORDS],
+        HASH_IMR,
+        HASH_SR;
+
+    qemu_irq irq;
+    qemu_irq dma_irq;
+};
+
+static const uint32_t stm32_hash_sha1_init[HASH_DIGEST_WORDS] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const uint32_t stm32_hash_md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t stm32_hash_md5_r[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_hash_sha1_block(uint32_t *h, const uint8_t *p)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ldl_be_p(p + i * 4);
+    }
+    for (; i < 80; i++) {
+        t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = HASH_ROL(t, 1);
+    }
+
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        t = HASH_ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = HASH_ROL(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static void stm32_hash_md5_block(uint32_t *h, const uint8_t *p)
+{
+    uint32_t m[16], a, b, c, d, f, t;
+    int i, g;
+
+    for (i = 0; i < 16; i++) {
+        m[i] = ldl_le_p(p + i * 4);
+    }
+
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    for (i = 0; i < 64; i++) {
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        t = a + f + stm32_hash_md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += HASH_ROL(t, stm32_hash_md5_r[(i / 16) * 4 + i % 4]);
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+static inline void stm32_hash_process(Stm32Hash *s, const uint8_t *p)
+{
+    if (s->md5) {
+        stm32_hash_md5_block(s->state, p);
+    } else {
+        stm32_hash_sha1_block(s->state, p);
+    }
+}
+
+/* Starts a new message, with the algorithm ALGO selects. */
+static void stm32_hash_start(Stm32Hash *s)
+{
+    s->md5 = IS_BIT_SET(s->HASH_CR, HASH_CR_ALGO_BIT);
+    /* MD5 starts from the first four SHA-1 words. */
+    memcpy(s->state, stm32_hash_sha1_init, sizeof(s->state));
+    s->msg_len = 0;
+    s->block_len = 0;
+    s->words = 0;
+}
+
+/* Appends len bytes to the message.  Whole blocks are hashed straight from
+ * data, but for the last one. */
+static void stm32_hash_feed(Stm32Hash *s, const uint8_t *data, uint32_t len)
+{
+    uint32_t n;
+
+    s->msg_len += len;
+    while (len > 0) {
+        if (s->block_len == HASH_BLOCK_SIZE) {
+            stm32_hash_process(s, s->block);
+            s->block_len = 0;
+        }
+        if (s->block_len == 0 && len > HASH_BLOCK_SIZE) {
+            stm32_hash_process(s, data);
+            data += HASH_BLOCK_SIZE;
+            len -= HASH_BLOCK_SIZE;
+            continue;
+        }
+        n = MIN(len, HASH_BLOCK_SIZE - s->block_len);
+        memcpy(s->block + s->block_len, data, n);
+        s->block_len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/* Turns a word written to DIN into the word of the message it stands for
+ * (most significant bit first), as DATATYPE says. */
+static uint32_t stm32_hash_swap(Stm32Hash *s, uint32_t word)
+{
+    uint32_t rev = 0;
+    int i;
+
+    switch ((s->HASH_CR & HASH_CR_DATATYPE_MASK) >> HASH_CR_DATATYPE_START) {
+        case HASH_DATATYPE_32:
+            return word;
+        case HASH_DATATYPE_16:
+            return (word << 16) | (word >> 16);
+        case HASH_DATATYPE_8:
+            return bswap32(word);
+        default:
+            for (i = 0; i < 32; i++) {
+                rev = (rev << 1) | ((word >> i) & 1);
+            }
+            return rev;
+    }
+}
+
+/* Appends the words at buf, laid out as the DMA reads them from memory.
+ * With byte data, the message is the memory as it is. */
+static void stm32_hash_feed_mem(Stm32Hash *s, uint8_t *buf, uint32_t len)
+{
+    uint32_t i;
+
+    if (((s->HASH_CR & HASH_CR_DATATYPE_MASK) >> HASH_CR_DATATYPE_START) !=
+        HASH_DATATYPE_8) {
+        for (i = 0; i < len; i += 4) {
+            stl_be_p(buf + i, stm32_hash_swap(s, ldl_le_p(buf + i)));
+        }
+    }
+    stm32_hash_feed(s, buf, len);
+    s->words += len / 4;
+}
+
+/* Ends the message, whose last word has NBLW valid bits, and puts its
+ * digest in HR0..HR4.  The next words start a new message. */
+static void stm32_hash_digest(Stm32Hash *s)
+{
+    uint8_t pad[HASH_BLOCK_SIZE + 8];
+    uint32_t nblw = s->HASH_STR & HASH_STR_NBLW_MASK;
+    uint32_t drop, pad_len;
+    uint64_t bits;
+    int i;
+
+    if (nblw % 8) {
+        stm32_hw_warn("%s: messages of whole bytes only are hashed",
+                      s->busdev.qdev.id);
+    }
+    /* The last word is still in the block (see stm32_hash_feed). */
+    drop = nblw ? (32 - nblw) / 8 : 0;
+    if (s->words > 0) {
+        s->block_len -= drop;
+        s->msg_len -= drop;
+    }
+
+    bits = s->msg_len * 8;
+    pad_len = HASH_BLOCK_SIZE - (s->msg_len + 8) % HASH_BLOCK_SIZE;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    if (s->md5) {
+        stq_le_p(pad + pad_len, bits);
+    } else {
+        stq_be_p(pad + pad_len, bits);
+    }
+    stm32_hash_feed(s, pad, pad_len + 8);
+    stm32_hash_process(s, s->block);
+
+    for (i = 0; i < HASH_DIGEST_WORDS; i++) {
+        /* The MD5 digest is little endian, but read as big endian words
+         * too. */
+        s->HASH_HR[i] = s->md5 ? bswap32(s->state[i]) : s->state[i];
+    }
+    if (s->md5) {
+        s->HASH_HR[HASH_DIGEST_WORDS - 1] = 0;
+    }
+
+    trace_stm32_hash_digest(s, s->msg_len - pad_len - 8);
+    SET_BIT(s->HASH_SR, HASH_SR_DCIS_BIT);
+    stm32_hash_start(s);
+}
+
+/* Updates the interrupt and the DMA request line.  Raising the request may
+ * have the DMA write DIN straight away. */
+static void stm32_hash_update(Stm32Hash *s)
+{
+    bool irq = (s->HASH_SR & s->HASH_IMR) != 0;
+
+    trace_stm32_hash_irq(s, irq);
+    qemu_set_irq(s->irq, irq);
+
+    qemu_set_irq(s->dma_irq, IS_BIT_SET(s->HASH_CR, HASH_CR_DMAE_BIT) &&
+                             !s->dma_bh_pending && !s->dma_done);
+}
+
+/* Takes the rest of the message from the DMA stream at once and
+ * calculates its digest.  Returns false if the stream is not set up for
+ * that. */
+static bool stm32_hash_dma_block(Stm32Hash *s)
+{
+    hwaddr din_addr = s->busdev.mmio[0].addr + HASH_DIN_OFFSET;
+    uint8_t buf[HASH_DMA_CHUNK_SIZE];
+    hwaddr mar = 0;
+    uint32_t len, done, chunk;
+
+    if (!s->stm32_dma || s->dma_req < 0) {
+        return false;
+    }
+
+    len = stm32f2xx_dma_block_begin(s->stm32_dma, s->dma_req, din_addr,
+                                    false, &mar) & ~3;
+    if (len == 0) {
+        return false;
+    }
+
+    trace_stm32_hash_dma_block(s, mar, len);
+    for (done = 0; done < len; done += chunk) {
+        chunk = MIN(len - done, HASH_DMA_CHUNK_SIZE);
+        cpu_physical_memory_read(mar + done, buf, chunk);
+        stm32_hash_feed_mem(s, buf, chunk);
+    }
+    stm32f2xx_dma_block_end(s->stm32_dma, s->dma_req, len, false);
+
+    s->dma_done = true;
+    stm32_hash_digest(s);
+    return true;
+}
+
+static void stm32_hash_dma_bh(void *opaque)
+{
+    Stm32Hash *s = (Stm32Hash *)opaque;
+    bool started = s->words > 0;
+
+    s->dma_bh_pending = false;
+    if (!stm32_hash_dma_block(s) && started) {
+        /* The stream is moving data, but not in a way it can be taken at
+         * once. */
+        s->dma_fallback = true;
+    }
+    stm32_hash_update(s);
+}
+
+/* Holds the DMA request down and tries a block transfer instead. */
+static void stm32_hash_dma_schedule(Stm32Hash *s)
+{
+    s->dma_bh_pending = true;
+    qemu_bh_schedule(s->dma_bh);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint32_t stm32_hash_HASH_CR_read(Stm32Hash *s)
+{
+    uint32_t value = s->HASH_CR;
+
+    value |= (s->words % HASH_BLOCK_WORDS) << HASH_CR_NBW_START;
+    CHANGE_BIT(value, HASH_CR_DINNE_BIT, s->words % HASH_BLOCK_WORDS != 0);
+    return value;
+}
+
+static void stm32_hash_HASH_CR_write(Stm32Hash *s, uint32_t new_value)
+{
+    bool dmae = IS_BIT_RESET(s->HASH_CR, HASH_CR_DMAE_BIT) &&
+                IS_BIT_SET(new_value, HASH_CR_DMAE_BIT);
+
+    s->HASH_CR = new_value & HASH_CR_MASK;
+
+    if (IS_BIT_SET(new_value, HASH_CR_INIT_BIT)) {
+        if (IS_BIT_SET(new_value, HASH_CR_MODE_BIT)) {
+            stm32_hw_warn("%s: HMAC mode is not emulated",
+                          s->busdev.qdev.id);
+        }
+        stm32_hash_start(s);
+        RESET_BIT(s->HASH_SR, HASH_SR_DCIS_BIT);
+        SET_BIT(s->HASH_SR, HASH_SR_DINIS_BIT);
+    }
+    if (dmae || (IS_BIT_SET(new_value, HASH_CR_INIT_BIT) &&
+                 IS_BIT_SET(new_value, HASH_CR_DMAE_BIT))) {
+        s->dma_fallback = false;
+        s->dma_done = false;
+        stm32_hash_dma_schedule(s);
+    }
+}
+
+static void stm32_hash_HASH_DIN_write(Stm32Hash *s, uint32_t new_value)
+{
+    uint8_t word[4];
+
+    stl_be_p(word, stm32_hash_swap(s, new_value));
+    stm32_hash_feed(s, word, 4);
+    s->words++;
+
+    RESET_BIT(s->HASH_SR, HASH_SR_DINIS_BIT);
+    if (s->words % HASH_BLOCK_WORDS == 0) {
+        SET_BIT(s->HASH_SR, HASH_SR_DINIS_BIT);
+    }
+
+    /* The stream is running: the rest of it may be moved at once. */
+    if (IS_BIT_SET(s->HASH_CR, HASH_CR_DMAE_BIT) && !s->dma_fallback &&
+        !s->dma_bh_pending) {
+        stm32_hash_dma_schedule(s);
+    }
+}
+
+static uint64_t stm32_hash_readw(Stm32Hash *s, hwaddr offset)
+{
+    switch (offset) {
+        case HASH_CR_OFFSET:
+            return stm32_hash_HASH_CR_read(s);
+        case HASH_DIN_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case HASH_STR_OFFSET:
+            return s->HASH_STR & HASH_STR_NBLW_MASK;
+        case HASH_HR0_OFFSET ... HASH_HR4_OFFSET:
+            return s->HASH_HR[(offset - HASH_HR0_OFFSET) / 4];
+        case HASH_IMR_OFFSET:
+            return s->HASH_IMR;
+        case HASH_SR_OFFSET:
+            return s->HASH_SR |
+                   (IS_BIT_SET(s->HASH_CR, HASH_CR_DMAE_BIT) <<
+                    HASH_SR_DMAS_BIT);
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_hash_writew(Stm32Hash *s, hwaddr offset, uint32_t value)
+{
+    switch (offset) {
+        case HASH_CR_OFFSET:
+            stm32_hash_HASH_CR_write(s, value);
+            break;
+        case HASH_DIN_OFFSET:
+            stm32_hash_HASH_DIN_write(s, value);
+            break;
+        case HASH_STR_OFFSET:
+            s->HASH_STR = value & HASH_STR_NBLW_MASK;
+            if (IS_BIT_SET(value, HASH_STR_DCAL_BIT)) {
+                stm32_hash_digest(s);
+            }
+            break;
+        case HASH_HR0_OFFSET ... HASH_HR4_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        case HASH_IMR_OFFSET:
+            s->HASH_IMR = value & HASH_IMR_MASK;
+            break;
+        case HASH_SR_OFFSET:
+            s->HASH_SR &= value | ~HASH_SR_CLEAR_MASK;
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return;
+    }
+
+    stm32_hash_update(s);
+}
+
+static uint64_t stm32_hash_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Hash *s = (Stm32Hash *)opaque;
+    uint64_t value;
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32_hash_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_hash_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_hash_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Hash *s = (Stm32Hash *)opaque;
+
+    trace_stm32_hash_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_hash_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_hash_ops = {
+    .read = stm32_hash_read,
+    .write = stm32_hash_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_hash_reset(DeviceState *dev)
+{
+    Stm32Hash *s = FROM_SYSBUS(Stm32Hash, SYS_BUS_DEVICE(dev));
+
+    qemu_bh_cancel(s->dma_bh);
+    s->dma_bh_pending = false;
+    s->dma_fallback = false;
+    s->dma_done = false;
+
+    s->HASH_CR = 0;
+    s->HASH_STR = 0;
+    memset(s->HASH_HR, 0, sizeof(s->HASH_HR));
+    s->HASH_IMR = 0;
+    s->HASH_SR = 0;
+    stm32_hash_start(s);
+
+    stm32_hash_update(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_hash_instance_init(Object *obj)
+{
+    Stm32Hash *s = FROM_SYSBUS(Stm32Hash, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32f2xx_dma", "stm32f2xx_dma",
+                             (Object **)&s->stm32_dma, NULL);
+}
+
+static int stm32_hash_init(SysBusDevice *dev)
+{
+    Stm32Hash *s = FROM_SYSBUS(Stm32Hash, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_hash_ops, s,
+                          "hash", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out(&dev->qdev, &s->dma_irq, 1);
+
+    s->dma_bh = qemu_bh_new(stm32_hash_dma_bh, s);
+
+    return 0;
+}
+
+static int stm32_hash_post_load(void *opaque, int version_id)
+{
+    Stm32Hash *s = (Stm32Hash *)opaque;
+
+    if (s->dma_bh_pending) {
+        qemu_bh_schedule(s->dma_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_hash = {
+    .name = "stm32_hash",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_hash_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_BOOL(md5, Stm32Hash),
+        VMSTATE_UINT64(msg_len, Stm32Hash),
+        VMSTATE_UINT32_ARRAY(state, Stm32Hash, HASH_DIGEST_WORDS),
+        VMSTATE_BUFFER(block, Stm32Hash),
+        VMSTATE_UINT32(block_len, Stm32Hash),
+        VMSTATE_UINT32(words, Stm32Hash),
+        VMSTATE_BOOL(dma_bh_pending, Stm32Hash),
+        VMSTATE_BOOL(dma_fallback, Stm32Hash),
+        VMSTATE_BOOL(dma_done, Stm32Hash),
+        VMSTATE_UINT32(HASH_CR, Stm32Hash),
+        VMSTATE_UINT32(HASH_STR, Stm32Hash),
+        VMSTATE_UINT32_ARRAY(HASH_HR, Stm32Hash, HASH_DIGEST_WORDS),
+        VMSTATE_UINT32(HASH_IMR, Stm32Hash),
+        VMSTATE_UINT32(HASH_SR, Stm32Hash),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_hash_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Hash, periph, -1),
+    DEFINE_PROP_INT32("dma_req", Stm32Hash, dma_req, -1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_hash_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_hash_init;
+    dc->reset = stm32_hash_reset;
+    dc->props = stm32_hash_properties;
+    dc->vmsd = &vmstate_stm32_hash;
+}
+
+static TypeInfo stm32_hash_info = {
+    .name  = "stm32_hash",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Hash),
+    .instance_init = stm32_hash_instance_init,
+    .class_init = stm32_hash_class_init
+};
+
+static void stm32_hash_register_types(void)
+{
+    type_register_static(&stm32_hash_info);
+}
+
+type_init(stm32_hash_register_types)
@@ -0,0 +1,800 @@
+/*
+ * STM32 Microcontroller I2C controller
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * Only master mode with 7-bit addresses is implemented.  The SR1/SR2 flags
+ * follow the event sequences of the reference manual (EV5 to EV8_2 and
+ * EV6 to EV7_1), including the data register plus shift register pipeline
+ * that the POS/ACK handling of two and three byte receptions relies on.
+ *
+ * By default every start condition, address and data byte takes its time
+ * on the bus, as given by CCR and the peripheral clock.  With the
+ * "no_bus_delay" property set each step of a transaction completes as soon
+ * as software triggers it, so the flags it waits for are already settled
+ * when SR1 is next read and polling loops do not spin while the bus is
+ * busy.  DMA requests, SMBus, PEC and slave mode are not modelled.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "i2c.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_I2C
+//#define STM32_I2C_NO_BUS_DELAY
+
+#ifdef DEBUG_STM32_I2C
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_I2C: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define I2C_CR1_OFFSET 0x00
+#define I2C_CR1_PE_BIT 0
+#define I2C_CR1_SMBUS_BIT 1
+#define I2C_CR1_START_BIT 8
+#define I2C_CR1_STOP_BIT 9
+#define I2C_CR1_ACK_BIT 10
+#define I2C_CR1_POS_BIT 11
+#define I2C_CR1_PEC_BIT 12
+#define I2C_CR1_SWRST_BIT 15
+
+#define I2C_CR2_OFFSET 0x04
+#define I2C_CR2_ITERREN_BIT 8
+#define I2C_CR2_ITEVTEN_BIT 9
+#define I2C_CR2_ITBUFEN_BIT 10
+#define I2C_CR2_DMAEN_BIT 11
+
+#define I2C_OAR1_OFFSET 0x08
+#define I2C_OAR2_OFFSET 0x0c
+#define I2C_DR_OFFSET 0x10
+
+#define I2C_SR1_OFFSET 0x14
+#define I2C_SR1_SB_BIT 0
+#define I2C_SR1_ADDR_BIT 1
+#define I2C_SR1_BTF_BIT 2
+#define I2C_SR1_ADD10_BIT 3
+#define I2C_SR1_STOPF_BIT 4
+#define I2C_SR1_RXNE_BIT 6
+#define I2C_SR1_TXE_BIT 7
+#define I2C_SR1_BERR_BIT 8
+#define I2C_SR1_ARLO_BIT 9
+#define I2C_SR1_AF_BIT 10
+#define I2C_SR1_OVR_BIT 11
+/* Error flags, which software clears by writing 0 */
+#define I2C_SR1_ERR_MASK 0x0000df00
+#define I2C_SR1_EVT_MASK 0x0000001f
+
+#define I2C_SR2_OFFSET 0x18
+#define I2C_SR2_MSL_BIT 0
+#define I2C_SR2_BUSY_BIT 1
+#define I2C_SR2_TRA_BIT 2
+
+#define I2C_CCR_OFFSET 0x1c
+#define I2C_CCR_FS_BIT 15
+#define I2C_CCR_DUTY_BIT 14
+#define I2C_CCR_CCR_MASK 0x00000fff
+
+#define I2C_TRISE_OFFSET 0x20
+
+/* Length of the bus steps, in SCL periods */
+#define STM32_I2C_CONDITION_BITS 1
+#define STM32_I2C_BYTE_BITS 9
+
+/* Bits of the "options" field */
+#define STM32_I2C_OPT_NO_BUS_DELAY_BIT 0
+
+#ifdef STM32_I2C_NO_BUS_DELAY
+#define STM32_I2C_NO_BUS_DELAY_DEFAULT true
+#else
+#define STM32_I2C_NO_BUS_DELAY_DEFAULT false
+#endif
+
+/* What the bus is busy doing */
+typedef enum {
+    STM32_I2C_STEP_NONE,
+    STM32_I2C_STEP_START,
+    STM32_I2C_STEP_ADDRESS,
+    STM32_I2C_STEP_TX_BYTE,
+    STM32_I2C_STEP_RX_BYTE,
+} stm32_i2c_step_t;
+
+struct Stm32I2c {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    /* See STM32_I2C_OPT_* */
+    uint32_t options;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    i2c_bus *bus;
+
+    /* Register Values */
+    uint32_t
+        I2C_CR1,
+        I2C_CR2,
+        I2C_OAR1,
+        I2C_OAR2,
+        I2C_SR1,
+        I2C_SR2,
+        I2C_CCR,
+        I2C_TRISE;
+
+    /* The data register, and the shift register behind it.  A received
+     * byte waits in the shift register while the data register is full;
+     * a byte to transmit waits in the data register while the shift
+     * register is busy. */
+    uint8_t dr;
+    bool tx_dr_full;
+    uint8_t shift;
+    bool rx_shift_full;
+
+    /* Address byte sent after the last start condition */
+    uint8_t address;
+    /* Set once a received byte has been NACKed: the slave will not send
+     * anything more in this transfer. */
+    bool rx_nacked;
+    /* The ACK bit sampled when the last byte was received, which decides
+     * the acknowledge of the next byte while POS is set. */
+    bool ack_latch;
+
+    /* Start and stop conditions requested while the bus was busy */
+    bool start_pending;
+    bool stop_pending;
+
+    stm32_i2c_step_t step;
+    QEMUTimer *bus_timer;
+
+    qemu_irq evt_irq, err_irq;
+    int curr_evt_level, curr_err_level;
+};
+
+
+
+
+/* TRANSFERS */
+
+static void stm32_i2c_update_irq(Stm32I2c *s)
+{
+    int new_evt_level, new_err_level;
+
+    new_evt_level = IS_BIT_SET(s->I2C_CR2, I2C_CR2_ITEVTEN_BIT) &&
+                    ((s->I2C_SR1 & I2C_SR1_EVT_MASK) ||
+                     (IS_BIT_SET(s->I2C_CR2, I2C_CR2_ITBUFEN_BIT) &&
+                      (IS_BIT_SET(s->I2C_SR1, I2C_SR1_TXE_BIT) ||
+                       IS_BIT_SET(s->I2C_SR1, I2C_SR1_RXNE_BIT))));
+    new_err_level = IS_BIT_SET(s->I2C_CR2, I2C_CR2_ITERREN_BIT) &&
+                    (s->I2C_SR1 & I2C_SR1_ERR_MASK);
+
+    if (new_evt_level != s->curr_evt_level) {
+        s->curr_evt_level = new_evt_level;
+        trace_stm32_i2c_irq(s, 0, new_evt_level);
+        qemu_set_irq(s->evt_irq, new_evt_level);
+    }
+    if (new_err_level != s->curr_err_level) {
+        s->curr_err_level = new_err_level;
+        trace_stm32_i2c_irq(s, 1, new_err_level);
+        qemu_set_irq(s->err_irq, new_err_level);
+    }
+}
+
+/* Length of one SCL period in ns, or 0 if steps should complete at once. */
+static int64_t stm32_i2c_ns_per_bit(Stm32I2c *s)
+{
+    uint32_t clk_freq, ccr, clocks;
+
+    if (IS_BIT_SET(s->options, STM32_I2C_OPT_NO_BUS_DELAY_BIT)) {
+        return 0;
+    }
+
+    clk_freq = s->clk.freq;
+    ccr = s->I2C_CCR & I2C_CCR_CCR_MASK;
+    if (clk_freq == 0 || ccr == 0) {
+        return 0;
+    }
+
+    /* SCL high plus low time, RM0008 I2C_CCR */
+    if (!IS_BIT_SET(s->I2C_CCR, I2C_CCR_FS_BIT)) {
+        clocks = 2 * ccr;
+    } else if (!IS_BIT_SET(s->I2C_CCR, I2C_CCR_DUTY_BIT)) {
+        clocks = 3 * ccr;
+    } else {
+        clocks = 25 * ccr;
+    }
+
+    return muldiv64(clocks, get_ticks_per_sec(), clk_freq);
+}
+
+static void stm32_i2c_step_done(Stm32I2c *s);
+
+static void stm32_i2c_start_step(Stm32I2c *s, stm32_i2c_step_t step,
+                                 int bits)
+{
+    int64_t ns_per_bit = stm32_i2c_ns_per_bit(s);
+
+    s->step = step;
+    if (ns_per_bit == 0) {
+        stm32_i2c_step_done(s);
+    } else {
+        qemu_mod_timer(s->bus_timer,
+                       qemu_get_clock_ns(vm_clock) + bits * ns_per_bit);
+    }
+}
+
+static void stm32_i2c_stop(Stm32I2c *s)
+{
+    DPRINTF("%s: stop\n", s->busdev.qdev.id);
+
+    i2c_end_transfer(s->bus);
+    s->stop_pending = false;
+    s->start_pending = false;
+    s->tx_dr_full = false;
+    RESET_BIT(s->I2C_CR1, I2C_CR1_STOP_BIT);
+    RESET_BIT(s->I2C_SR1, I2C_SR1_TXE_BIT);
+    RESET_BIT(s->I2C_SR1, I2C_SR1_BTF_BIT);
+    RESET_BIT(s->I2C_SR2, I2C_SR2_MSL_BIT);
+    RESET_BIT(s->I2C_SR2, I2C_SR2_BUSY_BIT);
+    RESET_BIT(s->I2C_SR2, I2C_SR2_TRA_BIT);
+}
+
+/* Starts receiving the next byte if the transfer goes on and there is
+ * room for it. */
+static void stm32_i2c_rx_next(Stm32I2c *s)
+{
+    if (s->step == STM32_I2C_STEP_NONE &&
+        IS_BIT_SET(s->I2C_SR2, I2C_SR2_MSL_BIT) &&
+        !IS_BIT_SET(s->I2C_SR2, I2C_SR2_TRA_BIT) &&
+        !IS_BIT_SET(s->I2C_SR1, I2C_SR1_ADDR_BIT) &&
+        !IS_BIT_SET(s->I2C_SR1, I2C_SR1_SB_BIT) &&
+        (s->address & 1) &&
+        !s->rx_nacked && !s->rx_shift_full &&
+        !s->start_pending && !s->stop_pending) {
+        stm32_i2c_start_step(s, STM32_I2C_STEP_RX_BYTE, STM32_I2C_BYTE_BITS);
+    }
+}
+
+/* Carries out the start or stop condition that software asked for while
+ * a byte was on the bus. */
+static void stm32_i2c_run_pending(Stm32I2c *s)
+{
+    if (s->stop_pending) {
+        stm32_i2c_stop(s);
+    } else if (s->start_pending) {
+        s->start_pending = false;
+        stm32_i2c_start_step(s, STM32_I2C_STEP_START,
+                             STM32_I2C_CONDITION_BITS);
+    }
+}
+
+static void stm32_i2c_tx_done(Stm32I2c *s)
+{
+    if (i2c_send(s->bus, s->shift)) {
+        DPRINTF("%s: byte 0x%02x NACKed\n", s->busdev.qdev.id, s->shift);
+        SET_BIT(s->I2C_SR1, I2C_SR1_AF_BIT);
+        s->tx_dr_full = false;
+        return;
+    }
+
+    DPRINTF("%s: sent 0x%02x\n", s->busdev.qdev.id, s->shift);
+
+    if (s->tx_dr_full && !s->stop_pending && !s->start_pending) {
+        s->shift = s->dr;
+        s->tx_dr_full = false;
+        SET_BIT(s->I2C_SR1, I2C_SR1_TXE_BIT);
+        stm32_i2c_start_step(s, STM32_I2C_STEP_TX_BYTE, STM32_I2C_BYTE_BITS);
+    } else if (!s->tx_dr_full) {
+        SET_BIT(s->I2C_SR1, I2C_SR1_BTF_BIT);
+    }
+}
+
+static void stm32_i2c_rx_done(Stm32I2c *s)
+{
+    uint8_t data = i2c_recv(s->bus);
+    bool ack;
+
+    if (IS_BIT_SET(s->I2C_CR1, I2C_CR1_POS_BIT)) {
+        ack = s->ack_latch;
+    } else {
+        ack = IS_BIT_SET(s->I2C_CR1, I2C_CR1_ACK_BIT);
+    }
+    s->ack_latch = IS_BIT_SET(s->I2C_CR1, I2C_CR1_ACK_BIT);
+
+    DPRINTF("%s: received 0x%02x, %s\n", s->busdev.qdev.id, data,
+            ack ? "ACK" : "NACK");
+
+    if (!ack) {
+        i2c_nack(s->bus);
+        s->rx_nacked = true;
+    }
+
+    if (IS_BIT_SET(s->I2C_SR1, I2C_SR1_RXNE_BIT)) {
+        /* The data register is still full: the clock is stretched. */
+        s->shift = data;
+        s->rx_shift_full = true;
+        SET_BIT(s->I2C_SR1, I2C_SR1_BTF_BIT);
+    } else {
+        s->dr = data;
+        SET_BIT(s->I2C_SR1, I2C_SR1_RXNE_BIT);
+    }
+}
+
+static void stm32_i2c_step_done(Stm32I2c *s)
+{
+    stm32_i2c_step_t step = s->step;
+
+    s->step = STM32_I2C_STEP_NONE;
+
+    switch (step) {
+        case STM32_I2C_STEP_START:
+            DPRINTF("%s: start\n", s->busdev.qdev.id);
+            RESET_BIT(s->I2C_CR1, I2C_CR1_START_BIT);
+            RESET_BIT(s->I2C_SR1, I2C_SR1_TXE_BIT);
+            RESET_BIT(s->I2C_SR1, I2C_SR1_BTF_BIT);
+            SET_BIT(s->I2C_SR1, I2C_SR1_SB_BIT);
+            SET_BIT(s->I2C_SR2, I2C_SR2_MSL_BIT);
+            SET_BIT(s->I2C_SR2, I2C_SR2_BUSY_BIT);
+            break;
+        case STM32_I2C_STEP_ADDRESS:
+            DPRINTF("%s: address 0x%02x\n", s->busdev.qdev.id, s->address);
+            s->ack_latch = IS_BIT_SET(s->I2C_CR1, I2C_CR1_ACK_BIT);
+            s->rx_nacked = false;
+            if (i2c_start_transfer(s->bus, s->address >> 1, s->address & 1)) {
+                SET_BIT(s->I2C_SR1, I2C_SR1_AF_BIT);
+            } else {
+                SET_BIT(s->I2C_SR1, I2C_SR1_ADDR_BIT);
+                CHANGE_BIT(s->I2C_SR2, I2C_SR2_TRA_BIT, !(s->address & 1));
+            }
+            break;
+        case STM32_I2C_STEP_TX_BYTE:
+            stm32_i2c_tx_done(s);
+            break;
+        case STM32_I2C_STEP_RX_BYTE:
+            stm32_i2c_rx_done(s);
+            break;
+        case STM32_I2C_STEP_NONE:
+            break;
+    }
+
+    if (s->step == STM32_I2C_STEP_NONE) {
+        stm32_i2c_run_pending(s);
+        stm32_i2c_rx_next(s);
+    }
+
+    stm32_i2c_update_irq(s);
+}
+
+static void stm32_i2c_bus_timer_expire(void *opaque)
+{
+    stm32_i2c_step_done((Stm32I2c *)opaque);
+}
+
+/* Drops any transfer in progress, as disabling the peripheral does. */
+static void stm32_i2c_abort(Stm32I2c *s)
+{
+    qemu_del_timer(s->bus_timer);
+    s->step = STM32_I2C_STEP_NONE;
+    i2c_end_transfer(s->bus);
+    s->tx_dr_full = false;
+    s->rx_shift_full = false;
+    s->start_pending = false;
+    s->stop_pending = false;
+    s->I2C_SR1 = 0;
+    s->I2C_SR2 = 0;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_i2c_I2C_CR2_write(Stm32I2c *s, uint32_t new_value,
+                                    bool init)
+{
+    s->I2C_CR2 = new_value & 0x00001f3f;
+
+    if (init) {
+        return;
+    }
+
+    if (IS_BIT_SET(s->I2C_CR2, I2C_CR2_DMAEN_BIT)) {
+        stm32_hw_warn("%s: DMA requests are not supported",
+                      s->busdev.qdev.id);
+    }
+
+    stm32_i2c_update_irq(s);
+}
+
+static void stm32_i2c_I2C_CR1_write(Stm32I2c *s, uint32_t new_value,
+                                    bool init)
+{
+    uint32_t old_value = s->I2C_CR1;
+
+    s->I2C_CR1 = new_value & 0x0000bfff;
+
+    if (init) {
+        return;
+    }
+
+    if (IS_BIT_SET(s->I2C_CR1, I2C_CR1_SWRST_BIT)) {
+        /* The peripheral is held under reset. */
+        stm32_i2c_abort(s);
+        s->I2C_CR1 = GET_BIT_MASK_ONE(I2C_CR1_SWRST_BIT);
+        stm32_i2c_I2C_CR2_write(s, 0x00000000, true);
+        s->I2C_OAR1 = 0;
+        s->I2C_OAR2 = 0;
+        s->I2C_CCR = 0;
+        s->I2C_TRISE = 0x00000002;
+        stm32_i2c_update_irq(s);
+        return;
+    }
+
+    if (!IS_BIT_SET(s->I2C_CR1, I2C_CR1_PE_BIT)) {
+        /* START, STOP, PEC and ACK are cleared by hardware when PE=0. */
+        stm32_i2c_abort(s);
+        s->I2C_CR1 &= ~0x00001700;
+        stm32_i2c_update_irq(s);
+        return;
+    }
+
+    if (IS_BIT_SET(s->I2C_CR1, I2C_CR1_SMBUS_BIT)) {
+        stm32_hw_warn("%s: SMBus mode is not supported", s->busdev.qdev.id);
+    }
+
+    if (IS_BIT_SET(s->I2C_CR1, I2C_CR1_STOP_BIT) &&
+        !IS_BIT_SET(old_value, I2C_CR1_STOP_BIT)) {
+        if (!IS_BIT_SET(s->I2C_SR2, I2C_SR2_MSL_BIT)) {
+            /* Nothing to stop (slave mode is not modelled). */
+            RESET_BIT(s->I2C_CR1, I2C_CR1_STOP_BIT);
+        } else if (s->step != STM32_I2C_STEP_NONE || s->tx_dr_full) {
+            s->stop_pending = true;
+        } else {
+            stm32_i2c_stop(s);
+        }
+    }
+
+    if (IS_BIT_SET(s->I2C_CR1, I2C_CR1_START_BIT) &&
+        !IS_BIT_SET(old_value, I2C_CR1_START_BIT)) {
+        if (s->step != STM32_I2C_STEP_NONE || s->stop_pending ||
+            s->tx_dr_full) {
+            s->start_pending = true;
+        } else {
+            stm32_i2c_start_step(s, STM32_I2C_STEP_START,
+                                 STM32_I2C_CONDITION_BITS);
+        }
+    }
+
+    stm32_i2c_update_irq(s);
+}
+
+static void stm32_i2c_I2C_SR1_write(Stm32I2c *s, uint32_t new_value)
+{
+    /* The error flags are cleared by writing 0, the others are read
+     * only. */
+    s->I2C_SR1 &= new_value | ~I2C_SR1_ERR_MASK;
+
+    stm32_i2c_update_irq(s);
+}
+
+/* Reading SR2 after SR1 ends the address phase (EV6). */
+static uint32_t stm32_i2c_I2C_SR2_read(Stm32I2c *s)
+{
+    uint32_t value = s->I2C_SR2;
+
+    if (IS_BIT_SET(s->I2C_SR1, I2C_SR1_ADDR_BIT)) {
+        RESET_BIT(s->I2C_SR1, I2C_SR1_ADDR_BIT);
+        if (IS_BIT_SET(s->I2C_SR2, I2C_SR2_TRA_BIT)) {
+            SET_BIT(s->I2C_SR1, I2C_SR1_TXE_BIT);
+        } else {
+            stm32_i2c_rx_next(s);
+        }
+        stm32_i2c_update_irq(s);
+    }
+
+    return value;
+}
+
+static uint32_t stm32_i2c_I2C_DR_read(Stm32I2c *s)
+{
+    uint32_t value = s->dr;
+
+    if (!IS_BIT_SET(s->I2C_SR1, I2C_SR1_RXNE_BIT)) {
+        return value;
+    }
+
+    RESET_BIT(s->I2C_SR1, I2C_SR1_RXNE_BIT);
+    if (s->rx_shift_full) {
+        s->dr = s->shift;
+        s->rx_shift_full = false;
+        SET_BIT(s->I2C_SR1, I2C_SR1_RXNE_BIT);
+        RESET_BIT(s->I2C_SR1, I2C_SR1_BTF_BIT);
+    }
+    stm32_i2c_rx_next(s);
+
+    stm32_i2c_update_irq(s);
+
+    return value;
+}
+
+static void stm32_i2c_I2C_DR_write(Stm32I2c *s, uint32_t new_value)
+{
+    new_value &= 0xff;
+
+    if (IS_BIT_SET(s->I2C_SR1, I2C_SR1_SB_BIT)) {
+        /* EV5: the address byte */
+        RESET_BIT(s->I2C_SR1, I2C_SR1_SB_BIT);
+        if ((new_value & 0xf8) == 0xf0) {
+            stm32_hw_warn("%s: 10-bit addressing is not supported",
+                          s->busdev.qdev.id);
+        }
+        s->address = new_value;
+        stm32_i2c_start_step(s, STM32_I2C_STEP_ADDRESS, STM32_I2C_BYTE_BITS);
+    } else if (IS_BIT_SET(s->I2C_SR2, I2C_SR2_MSL_BIT) &&
+               IS_BIT_SET(s->I2C_SR2, I2C_SR2_TRA_BIT) &&
+               !IS_BIT_SET(s->I2C_SR1, I2C_SR1_ADDR_BIT)) {
+        /* EV8: a data byte */
+        RESET_BIT(s->I2C_SR1, I2C_SR1_BTF_BIT);
+        if (s->step == STM32_I2C_STEP_NONE) {
+            s->shift = new_value;
+            SET_BIT(s->I2C_SR1, I2C_SR1_TXE_BIT);
+            stm32_i2c_start_step(s, STM32_I2C_STEP_TX_BYTE,
+                                 STM32_I2C_BYTE_BITS);
+        } else {
+            s->dr = new_value;
+            s->tx_dr_full = true;
+            RESET_BIT(s->I2C_SR1, I2C_SR1_TXE_BIT);
+        }
+    } else {
+        stm32_hw_warn("%s: ignoring write to I2C_DR outside of a master "
+                      "transmission", s->busdev.qdev.id);
+    }
+
+    stm32_i2c_update_irq(s);
+}
+
+static uint64_t stm32_i2c_readw(Stm32I2c *s, hwaddr offset)
+{
+    switch (offset) {
+        case I2C_CR1_OFFSET:
+            return s->I2C_CR1;
+        case I2C_CR2_OFFSET:
+            return s->I2C_CR2;
+        case I2C_OAR1_OFFSET:
+            return s->I2C_OAR1;
+        case I2C_OAR2_OFFSET:
+            return s->I2C_OAR2;
+        case I2C_DR_OFFSET:
+            return stm32_i2c_I2C_DR_read(s);
+        case I2C_SR1_OFFSET:
+            return s->I2C_SR1;
+        case I2C_SR2_OFFSET:
+            return stm32_i2c_I2C_SR2_read(s);
+        case I2C_CCR_OFFSET:
+            return s->I2C_CCR;
+        case I2C_TRISE_OFFSET:
+            return s->I2C_TRISE;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_i2c_writew(Stm32I2c *s, hwaddr offset, uint64_t value)
+{
+    switch (offset) {
+        case I2C_CR1_OFFSET:
+            stm32_i2c_I2C_CR1_write(s, value, false);
+            break;
+        case I2C_CR2_OFFSET:
+            stm32_i2c_I2C_CR2_write(s, value, false);
+            break;
+        case I2C_OAR1_OFFSET:
+            s->I2C_OAR1 = value & 0x000083ff;
+            break;
+        case I2C_OAR2_OFFSET:
+            s->I2C_OAR2 = value & 0x000000ff;
+            break;
+        case I2C_DR_OFFSET:
+            stm32_i2c_I2C_DR_write(s, value);
+            break;
+        case I2C_SR1_OFFSET:
+            stm32_i2c_I2C_SR1_write(s, value);
+            break;
+        case I2C_SR2_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case I2C_CCR_OFFSET:
+            s->I2C_CCR = value & 0x0000cfff;
+            break;
+        case I2C_TRISE_OFFSET:
+            s->I2C_TRISE = value & 0x0000003f;
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+static uint64_t stm32_i2c_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32I2c *s = (Stm32I2c *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            if (offset & 2) {
+                value = 0;
+                break;
+            }
+            value = stm32_i2c_readw(s, offset) & 0xffff;
+            break;
+        case WORD_ACCESS_SIZE:
+            value = stm32_i2c_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_i2c_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_i2c_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32I2c *s = (Stm32I2c *)opaque;
+
+    trace_stm32_i2c_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            if (offset & 2) {
+                break;
+            }
+            stm32_i2c_writew(s, offset, value & 0xffff);
+            break;
+        case WORD_ACCESS_SIZE:
+            stm32_i2c_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_i2c_ops = {
+    .read = stm32_i2c_read,
+    .write = stm32_i2c_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_i2c_reset(DeviceState *dev)
+{
+    Stm32I2c *s = FROM_SYSBUS(Stm32I2c, SYS_BUS_DEVICE(dev));
+
+    stm32_i2c_abort(s);
+    stm32_i2c_I2C_CR1_write(s, 0x00000000, true);
+    stm32_i2c_I2C_CR2_write(s, 0x00000000, true);
+    s->I2C_OAR1 = 0;
+    s->I2C_OAR2 = 0;
+    s->I2C_CCR = 0;
+    s->I2C_TRISE = 0x00000002;
+    s->dr = 0;
+
+    stm32_i2c_update_irq(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+i2c_bus *stm32_i2c_get_bus(Stm32I2c *s)
+{
+    return s->bus;
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_i2c_instance_init(Object *obj)
+{
+    Stm32I2c *s = FROM_SYSBUS(Stm32I2c, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_i2c_init(SysBusDevice *dev)
+{
+    Stm32I2c *s = FROM_SYSBUS(Stm32I2c, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_i2c_ops, s,
+                          "i2c", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->evt_irq);
+    sysbus_init_irq(dev, &s->err_irq);
+
+    /* Named after the device, so that slaves can be added with
+     * "-device ...,bus=STM32F1XX_I2C1.0". */
+    s->bus = i2c_init_bus(&dev->qdev, NULL);
+
+    s->bus_timer =
+          qemu_new_timer_ns(vm_clock, stm32_i2c_bus_timer_expire, s);
+
+    return 0;
+}
+
+static Property stm32_i2c_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32I2c, periph, -1),
+    /* Complete each step of a transaction at once instead of taking the
+     * bus time given by CCR. */
+    DEFINE_PROP_BIT("no_bus_delay", Stm32I2c, options,
+                    STM32_I2C_OPT_NO_BUS_DELAY_BIT,
+                    STM32_I2C_NO_BUS_DELAY_DEFAULT),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_i2c_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_i2c_init;
+    dc->reset = stm32_i2c_reset;
+    dc->props = stm32_i2c_properties;
+}
+
+static TypeInfo stm32_i2c_info = {
+    .name  = "stm32_i2c",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32I2c),
+    .instance_init = stm32_i2c_instance_init,
+    .class_init = stm32_i2c_class_init
+};
+
+static void stm32_i2c_register_types(void)
+{
+    type_register_static(&stm32_i2c_info);
+}
+
+type_init(stm32_i2c_register_types)
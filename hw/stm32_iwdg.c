@@ -0,0 +1,302 @@
+/*
+ * STM32 Microcontroller IWDG (Independent Watchdog) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The down-counter is not ticked: only the time at which it reaches 0 is
+ * kept, and moved on each refresh.  Firmware refreshes the watchdog all the
+ * time, far more often than it times out, so the timer is not moved with
+ * it: once armed, it is left alone unless the deadline comes earlier, and
+ * when it expires before the deadline it is armed again for it.
+ *
+ * On timeout, what -watchdog-action says is done (a system reset by
+ * default), with a WATCHDOG QMP event.  The prescaler and reload values
+ * written by software are used from the next refresh on.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "qemu/timer.h"
+#include "watchdog.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+#define IWDG_KR_OFFSET 0x00
+#define IWDG_KR_UNLOCK 0x5555
+#define IWDG_KR_REFRESH 0xaaaa
+#define IWDG_KR_START 0xcccc
+
+#define IWDG_PR_OFFSET 0x04
+#define IWDG_PR_MASK 0x7
+/* PR divides the LSI by 4 << PR, up to 256 */
+#define IWDG_PR_MAX_SHIFT 6
+
+#define IWDG_RLR_OFFSET 0x08
+#define IWDG_RLR_MASK 0xfff
+
+/* The values are updated at once, so PVU and RVU always read as 0 */
+#define IWDG_SR_OFFSET 0x0c
+
+typedef struct Stm32Iwdg {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    uint32_t
+        IWDG_PR,
+        IWDG_RLR;
+
+    bool started;
+    /* PR and RLR can be written */
+    bool unlocked;
+    /* When the counter reaches 0 */
+    int64_t deadline;
+
+    QEMUTimer *timer;
+} Stm32Iwdg;
+
+
+
+
+/* HELPER FUNCTIONS */
+
+/* Reloads the counter from RLR. */
+static void stm32_iwdg_refresh(Stm32Iwdg *s)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint64_t cycles;
+
+    /* The LSI is forced on once started. */
+    assert(s->clk.freq != 0);
+    cycles = (uint64_t)(s->IWDG_RLR + 1) <<
+             (MIN(s->IWDG_PR, IWDG_PR_MAX_SHIFT) + 2);
+    s->deadline = now + muldiv64(cycles, get_ticks_per_sec(), s->clk.freq);
+
+    /* Only a deadline earlier than the timer moves it. */
+    if(!qemu_timer_pending(s->timer) ||
+       qemu_timer_expire_time_ns(s->timer) > s->deadline) {
+        qemu_mod_timer(s->timer, s->deadline);
+    }
+}
+
+static void stm32_iwdg_expire(void *opaque)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+
+    if(qemu_get_clock_ns(vm_clock) < s->deadline) {
+        /* Refreshed since the timer was armed */
+        qemu_mod_timer(s->timer, s->deadline);
+        return;
+    }
+
+    trace_stm32_iwdg_timeout(s);
+    watchdog_perform_action();
+    /* Goes on counting if the action was not a reset. */
+    stm32_iwdg_refresh(s);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_iwdg_IWDG_KR_write(Stm32Iwdg *s, uint32_t new_value)
+{
+    /* Any other key than the unlock one locks PR and RLR again. */
+    s->unlocked = new_value == IWDG_KR_UNLOCK;
+
+    switch(new_value) {
+        case IWDG_KR_START:
+            if(!s->started) {
+                s->started = true;
+                stm32f1xx_rcc_force_lsi(s->stm32_rcc);
+            }
+            stm32_iwdg_refresh(s);
+            break;
+        case IWDG_KR_REFRESH:
+            if(s->started) {
+                stm32_iwdg_refresh(s);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static uint64_t stm32_iwdg_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+    uint64_t value;
+
+    switch(offset) {
+        case IWDG_KR_OFFSET:
+            /* Write only */
+            value = 0;
+            break;
+        case IWDG_PR_OFFSET:
+            value = s->IWDG_PR;
+            break;
+        case IWDG_RLR_OFFSET:
+            value = s->IWDG_RLR;
+            break;
+        case IWDG_SR_OFFSET:
+            value = 0;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_iwdg_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_iwdg_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Iwdg *s = (Stm32Iwdg *)opaque;
+
+    trace_stm32_iwdg_write(s, offset, size, value);
+
+    switch(offset) {
+        case IWDG_KR_OFFSET:
+            stm32_iwdg_IWDG_KR_write(s, value & 0xffff);
+            break;
+        case IWDG_PR_OFFSET:
+            if(s->unlocked) {
+                s->IWDG_PR = value & IWDG_PR_MASK;
+            }
+            break;
+        case IWDG_RLR_OFFSET:
+            if(s->unlocked) {
+                s->IWDG_RLR = value & IWDG_RLR_MASK;
+            }
+            break;
+        case IWDG_SR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_iwdg_ops = {
+    .read = stm32_iwdg_read,
+    .write = stm32_iwdg_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 2,
+        .max_access_size = 4,
+    }
+};
+
+static void stm32_iwdg_reset(DeviceState *dev)
+{
+    Stm32Iwdg *s = FROM_SYSBUS(Stm32Iwdg, SYS_BUS_DEVICE(dev));
+
+    s->IWDG_PR = 0;
+    s->IWDG_RLR = IWDG_RLR_MASK;
+    s->started = false;
+    s->unlocked = false;
+    qemu_del_timer(s->timer);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_iwdg_instance_init(Object *obj)
+{
+    Stm32Iwdg *s = FROM_SYSBUS(Stm32Iwdg, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_iwdg_init(SysBusDevice *dev)
+{
+    Stm32Iwdg *s = FROM_SYSBUS(Stm32Iwdg, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_IWDG, dev,
+                              NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_iwdg_ops, s,
+                          "iwdg", 0x03ff);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    s->timer = qemu_new_timer_ns(vm_clock, stm32_iwdg_expire, s);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_iwdg = {
+    .name = "stm32_iwdg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(IWDG_PR, Stm32Iwdg),
+        VMSTATE_UINT32(IWDG_RLR, Stm32Iwdg),
+        VMSTATE_BOOL(started, Stm32Iwdg),
+        VMSTATE_BOOL(unlocked, Stm32Iwdg),
+        VMSTATE_INT64(deadline, Stm32Iwdg),
+        VMSTATE_TIMER(timer, Stm32Iwdg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_iwdg_properties[] = {
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_iwdg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_iwdg_init;
+    dc->reset = stm32_iwdg_reset;
+    dc->props = stm32_iwdg_properties;
+    dc->vmsd = &vmstate_stm32_iwdg;
+}
+
+static TypeInfo stm32_iwdg_info = {
+    .name  = "stm32_iwdg",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Iwdg),
+    .instance_init = stm32_iwdg_instance_init,
+    .class_init = stm32_iwdg_class_init
+};
+
+static void stm32_iwdg_register_types(void)
+{
+    type_register_static(&stm32_iwdg_info);
+}
+
+type_init(stm32_iwdg_register_types)
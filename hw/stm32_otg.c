@@ -0,0 +1,2464 @@
+/*
+ * STM32 Microcontroller USB OTG FS and OTG HS cores
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual
+ * Rev 5", sections 28 and 29
+ *
+ * Both are the Synopsys OTG core.  The HS one has more endpoints, host
+ * channels and FIFO RAM, and its own DMA.  The "hs" property selects it.
+ *
+ * In host mode the core is the host controller of a USB bus, so the
+ * devices of hw/usb (usb-storage, usb-serial, usb-hub...) can be plugged
+ * into it with "-device ...,bus=ID.0", where ID is the core's id.  A host
+ * channel carries out as much of its transfer as it can at once: with DMA,
+ * the whole buffer is given to the device as one packet and copied to or
+ * from memory with one access, and in slave mode every packet that fits in
+ * the FIFOs goes in one packet too.  Transactions that are NAKed are
+ * retried at the next frame, or as soon as the device says it has data.
+ *
+ * In device mode the USB host is an external program, connected through
+ * the character device given by the "chardev" property with the host link
+ * of the USB full-speed device (see stm32_usb.c).  QEMU cannot give a
+ * guest's USB device to its own host, so this stands for USB redirection.
+ * OUT and SETUP packets go through the receive FIFO, or with DMA straight
+ * to memory, and IN packets are taken from the endpoint's transmit FIFO or
+ * from memory, one whole packet at a time.
+ *
+ * The mode is the one GUSBCFG forces, or host mode while a device is
+ * plugged into the bus (the ID pin of an A plug).  Each push window of the
+ * FIFOs goes to the transmit FIFO of the endpoint or channel of its
+ * number.  Session request and host negotiation, suspend and resume, the
+ * ULPI PHY, split transactions, the dedicated EP1 interrupts of the HS
+ * core and the direct FIFO access window are not modelled, and
+ * isochronous endpoints are treated as interrupt ones.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "char/char.h"
+#include "sysemu/replay.h"
+#include "qemu/timer.h"
+#include "usb.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_OTG
+
+#ifdef DEBUG_STM32_OTG
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_OTG: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+/* Core global registers */
+#define OTG_GOTGCTL_OFFSET 0x000
+#define OTG_GOTGCTL_SRQSCS_BIT 0
+#define OTG_GOTGCTL_SRQ_BIT 1
+#define OTG_GOTGCTL_CIDSTS_BIT 16
+#define OTG_GOTGCTL_ASVLD_BIT 18
+#define OTG_GOTGCTL_BSVLD_BIT 19
+#define OTG_GOTGCTL_MASK 0x00000e02
+
+#define OTG_GOTGINT_OFFSET 0x004
+#define OTG_GOTGINT_SRSSCHG_BIT 8
+#define OTG_GOTGINT_MASK 0x000e0304
+
+#define OTG_GAHBCFG_OFFSET 0x008
+#define OTG_GAHBCFG_GINT_BIT 0
+#define OTG_GAHBCFG_DMAEN_BIT 5
+#define OTG_GAHBCFG_TXFELVL_BIT 7
+#define OTG_GAHBCFG_PTXFELVL_BIT 8
+#define OTG_GAHBCFG_FS_MASK 0x00000181
+#define OTG_GAHBCFG_HS_MASK 0x000001bf
+
+#define OTG_GUSBCFG_OFFSET 0x00c
+#define OTG_GUSBCFG_PHYSEL_BIT 6
+#define OTG_GUSBCFG_FHMOD_BIT 29
+#define OTG_GUSBCFG_FDMOD_BIT 30
+#define OTG_GUSBCFG_MASK 0x7fffffff
+#define OTG_GUSBCFG_RESET 0x00000a00
+
+#define OTG_GRSTCTL_OFFSET 0x010
+#define OTG_GRSTCTL_CSRST_BIT 0
+#define OTG_GRSTCTL_HSRST_BIT 1
+#define OTG_GRSTCTL_RXFFLSH_BIT 4
+#define OTG_GRSTCTL_TXFFLSH_BIT 5
+#define OTG_GRSTCTL_TXFNUM_START 6
+#define OTG_GRSTCTL_TXFNUM_MASK 0x000007c0
+#define OTG_GRSTCTL_AHBIDL_BIT 31
+/* TXFNUM for flushing all the transmit FIFOs */
+#define OTG_TXFNUM_ALL 0x10
+
+#define OTG_GINTSTS_OFFSET 0x014
+#define OTG_GINTSTS_CMOD_BIT 0
+#define OTG_GINTSTS_OTGINT_BIT 2
+#define OTG_GINTSTS_SOF_BIT 3
+#define OTG_GINTSTS_RXFLVL_BIT 4
+#define OTG_GINTSTS_NPTXFE_BIT 5
+#define OTG_GINTSTS_GINAKEFF_BIT 6
+#define OTG_GINTSTS_GONAKEFF_BIT 7
+#define OTG_GINTSTS_USBRST_BIT 12
+#define OTG_GINTSTS_ENUMDNE_BIT 13
+#define OTG_GINTSTS_IEPINT_BIT 18
+#define OTG_GINTSTS_OEPINT_BIT 19
+#define OTG_GINTSTS_HPRTINT_BIT 24
+#define OTG_GINTSTS_HCINT_BIT 25
+#define OTG_GINTSTS_PTXFE_BIT 26
+#define OTG_GINTSTS_CIDSCHG_BIT 28
+#define OTG_GINTSTS_DISCINT_BIT 29
+#define OTG_GINTSTS_SRQINT_BIT 30
+/* The event flags, which software clears by writing 1.  The others
+ * reflect the state of the core. */
+#define OTG_GINTSTS_W1C_MASK 0xf030fc0a
+
+#define OTG_GINTMSK_OFFSET 0x018
+#define OTG_GINTMSK_MASK 0xf77cfcfe
+
+#define OTG_GRXSTSR_OFFSET 0x01c
+#define OTG_GRXSTSP_OFFSET 0x020
+#define OTG_GRXSTS_EPNUM_MASK 0x0000000f
+#define OTG_GRXSTS_BCNT_START 4
+#define OTG_GRXSTS_BCNT_MASK 0x00007ff0
+#define OTG_GRXSTS_DPID_START 15
+#define OTG_GRXSTS_PKTSTS_START 17
+#define OTG_GRXSTS_PKTSTS_MASK 0x001e0000
+
+/* Receive FIFO entries, in host mode... */
+#define OTG_PKTSTS_IN_DATA 2
+#define OTG_PKTSTS_IN_DONE 3
+/* ... and in device mode */
+#define OTG_PKTSTS_OUT_DATA 2
+#define OTG_PKTSTS_OUT_DONE 3
+#define OTG_PKTSTS_SETUP_DONE 4
+#define OTG_PKTSTS_SETUP_DATA 6
+
+#define OTG_GRXFSIZ_OFFSET 0x024
+#define OTG_GNPTXFSIZ_OFFSET 0x028
+#define OTG_FIFO_SIZE_RESET 0x00000200
+#define OTG_GNPTXSTS_OFFSET 0x02c
+/* Free request queue entries reported by HNPTXSTS and HPTXSTS */
+#define OTG_TXQ_FREE 8
+
+#define OTG_GCCFG_OFFSET 0x038
+#define OTG_GCCFG_PWRDWN_BIT 16
+#define OTG_GCCFG_MASK 0x003d0000
+
+#define OTG_CID_OFFSET 0x03c
+#define OTG_CID_FS_RESET 0x00001000
+#define OTG_CID_HS_RESET 0x00001100
+
+#define OTG_HPTXFSIZ_OFFSET 0x100
+#define OTG_HPTXFSIZ_RESET 0x02000600
+/* DIEPTXF1 and up, 4 bytes apart */
+#define OTG_DIEPTXF_OFFSET 0x104
+#define OTG_DIEPTXF_RESET 0x02000400
+
+/* Host mode registers */
+#define OTG_HCFG_OFFSET 0x400
+#define OTG_HCFG_FSLSS_BIT 2
+#define OTG_HCFG_MASK 0x00000007
+
+#define OTG_HFIR_OFFSET 0x404
+#define OTG_HFIR_RESET 0x0000ea60
+#define OTG_HFNUM_OFFSET 0x408
+#define OTG_HPTXSTS_OFFSET 0x410
+#define OTG_HAINT_OFFSET 0x414
+#define OTG_HAINTMSK_OFFSET 0x418
+
+#define OTG_HPRT_OFFSET 0x440
+#define OTG_HPRT_PCSTS_BIT 0
+#define OTG_HPRT_PCDET_BIT 1
+#define OTG_HPRT_PENA_BIT 2
+#define OTG_HPRT_PENCHNG_BIT 3
+#define OTG_HPRT_POCCHNG_BIT 5
+#define OTG_HPRT_PRES_BIT 6
+#define OTG_HPRT_PSUSP_BIT 7
+#define OTG_HPRT_PRST_BIT 8
+#define OTG_HPRT_PLSTS_START 10
+#define OTG_HPRT_PPWR_BIT 12
+#define OTG_HPRT_PSPD_START 17
+/* The bits software writes as they are */
+#define OTG_HPRT_RW_MASK 0x0001f1c0
+/* The change flags, which software clears by writing 1 */
+#define OTG_HPRT_W1C_MASK 0x0000002a
+
+/* Host channel n registers, 0x20 bytes apart */
+#define OTG_HC_OFFSET 0x500
+#define OTG_HC_SIZE 0x20
+#define OTG_HCCHAR 0x00
+#define OTG_HCSPLT 0x04
+#define OTG_HCINT 0x08
+#define OTG_HCINTMSK 0x0c
+#define OTG_HCTSIZ 0x10
+#define OTG_HCDMA 0x14
+
+#define OTG_HCCHAR_MPSIZ_MASK 0x000007ff
+#define OTG_HCCHAR_EPNUM_START 11
+#define OTG_HCCHAR_EPDIR_BIT 15
+#define OTG_HCCHAR_EPTYP_START 18
+#define OTG_HCCHAR_DAD_START 22
+#define OTG_HCCHAR_CHDIS_BIT 30
+#define OTG_HCCHAR_CHENA_BIT 31
+#define OTG_HCCHAR_MASK 0x3ffeffff
+
+#define OTG_HCINT_XFRC_BIT 0
+#define OTG_HCINT_CHH_BIT 1
+#define OTG_HCINT_STALL_BIT 3
+#define OTG_HCINT_NAK_BIT 4
+#define OTG_HCINT_ACK_BIT 5
+#define OTG_HCINT_TXERR_BIT 7
+#define OTG_HCINT_BBERR_BIT 8
+#define OTG_HCINT_MASK 0x000007ff
+
+#define OTG_HCTSIZ_XFRSIZ_MASK 0x0007ffff
+#define OTG_HCTSIZ_PKTCNT_START 19
+#define OTG_HCTSIZ_PKTCNT_MASK 0x1ff80000
+#define OTG_HCTSIZ_DPID_START 29
+#define OTG_HCTSIZ_DPID_MASK 0x60000000
+
+/* Data PIDs, as HCTSIZ and GRXSTS give them */
+#define OTG_DPID_DATA0 0
+#define OTG_DPID_DATA1 2
+#define OTG_DPID_SETUP 3
+
+/* Endpoint types, as HCCHAR, DIEPCTL and DOEPCTL give them */
+#define OTG_EPTYP_CONTROL 0
+#define OTG_EPTYP_ISO 1
+#define OTG_EPTYP_BULK 2
+#define OTG_EPTYP_INTERRUPT 3
+
+/* Device mode registers */
+#define OTG_DCFG_OFFSET 0x800
+#define OTG_DCFG_DAD_START 4
+#define OTG_DCFG_DAD_MASK 0x000007f0
+#define OTG_DCFG_MASK 0x03001ff7
+#define OTG_DCFG_RESET 0x02200000
+
+#define OTG_DCTL_OFFSET 0x804
+#define OTG_DCTL_SDIS_BIT 1
+#define OTG_DCTL_GINSTS_BIT 2
+#define OTG_DCTL_GONSTS_BIT 3
+#define OTG_DCTL_SGINAK_BIT 7
+#define OTG_DCTL_CGINAK_BIT 8
+#define OTG_DCTL_SGONAK_BIT 9
+#define OTG_DCTL_CGONAK_BIT 10
+#define OTG_DCTL_MASK 0x00000873
+
+#define OTG_DSTS_OFFSET 0x808
+#define OTG_DSTS_ENUMSPD_START 1
+#define OTG_DSTS_FNSOF_START 8
+/* Full speed, with the 48 MHz clock of the embedded PHY */
+#define OTG_ENUMSPD_FS_48MHZ 3
+
+#define OTG_DIEPMSK_OFFSET 0x810
+#define OTG_DOEPMSK_OFFSET 0x814
+#define OTG_DAINT_OFFSET 0x818
+#define OTG_DAINTMSK_OFFSET 0x81c
+#define OTG_DVBUSDIS_OFFSET 0x828
+#define OTG_DVBUSDIS_RESET 0x000017d7
+#define OTG_DVBUSPULSE_OFFSET 0x82c
+#define OTG_DVBUSPULSE_RESET 0x000005b8
+#define OTG_DTHRCTL_OFFSET 0x830
+#define OTG_DIEPEMPMSK_OFFSET 0x834
+#define OTG_DEACHINT_OFFSET 0x838
+#define OTG_DEACHINTMSK_OFFSET 0x83c
+#define OTG_DIEPEACHMSK1_OFFSET 0x844
+#define OTG_DOEPEACHMSK1_OFFSET 0x884
+
+/* IN endpoint n registers, and OUT endpoint n registers, 0x20 bytes
+ * apart */
+#define OTG_DIEP_OFFSET 0x900
+#define OTG_DOEP_OFFSET 0xb00
+#define OTG_EP_SIZE 0x20
+#define OTG_DxEPCTL 0x00
+#define OTG_DxEPINT 0x08
+#define OTG_DxEPTSIZ 0x10
+#define OTG_DxEPDMA 0x14
+#define OTG_DTXFSTS 0x18
+
+#define OTG_DxEPCTL_MPSIZ_MASK 0x000007ff
+/* MPSIZ of endpoint 0: 64, 32, 16 or 8 bytes */
+#define OTG_DxEPCTL0_MPSIZ_MASK 0x00000003
+#define OTG_DxEPCTL_USBAEP_BIT 15
+#define OTG_DxEPCTL_DPID_BIT 16
+#define OTG_DxEPCTL_NAKSTS_BIT 17
+#define OTG_DxEPCTL_EPTYP_START 18
+#define OTG_DxEPCTL_EPTYP_MASK 0x000c0000
+#define OTG_DxEPCTL_STALL_BIT 21
+#define OTG_DxEPCTL_CNAK_BIT 26
+#define OTG_DxEPCTL_SNAK_BIT 27
+#define OTG_DxEPCTL_SD0PID_BIT 28
+#define OTG_DxEPCTL_SODDFRM_BIT 29
+#define OTG_DxEPCTL_EPDIS_BIT 30
+#define OTG_DxEPCTL_EPENA_BIT 31
+/* The bits software writes as they are (TXFNUM only for IN endpoints,
+ * SNPM only for OUT ones) */
+#define OTG_DIEPCTL_RW_MASK 0x03ec87ff
+#define OTG_DOEPCTL_RW_MASK 0x003c87ff
+
+#define OTG_DIEPINT_XFRC_BIT 0
+#define OTG_DIEPINT_EPDISD_BIT 1
+#define OTG_DIEPINT_INEPNE_BIT 6
+#define OTG_DIEPINT_TXFE_BIT 7
+#define OTG_DIEPINT_MASK 0x0000005b
+
+#define OTG_DOEPINT_XFRC_BIT 0
+#define OTG_DOEPINT_EPDISD_BIT 1
+#define OTG_DOEPINT_STUP_BIT 3
+#define OTG_DOEPINT_MASK 0x0000005b
+
+#define OTG_DxEPTSIZ_XFRSIZ_MASK 0x0007ffff
+#define OTG_DxEPTSIZ0_XFRSIZ_MASK 0x0000007f
+#define OTG_DxEPTSIZ_PKTCNT_START 19
+#define OTG_DxEPTSIZ_PKTCNT_MASK 0x1ff80000
+#define OTG_DIEPTSIZ0_PKTCNT_MASK 0x00180000
+#define OTG_DOEPTSIZ0_PKTCNT_MASK 0x00080000
+#define OTG_DxEPTSIZ_MCNT_MASK 0x60000000
+#define OTG_DOEPTSIZ0_STUPCNT_START 29
+#define OTG_DOEPTSIZ0_STUPCNT_MASK 0x60000000
+
+#define OTG_PCGCCTL_OFFSET 0xe00
+#define OTG_PCGCCTL_STPPCLK_BIT 0
+#define OTG_PCGCCTL_MASK 0x00000013
+
+/* Push and pop windows of the FIFOs, 0x1000 bytes each */
+#define OTG_FIFO_OFFSET 0x1000
+#define OTG_FIFO_SIZE 0x1000
+
+#define OTG_FS_EP_COUNT 4
+#define OTG_FS_CH_COUNT 8
+#define OTG_FS_FIFO_WORDS 320
+#define OTG_HS_EP_COUNT 6
+#define OTG_HS_CH_COUNT 12
+#define OTG_HS_FIFO_WORDS 1024
+
+#define OTG_MAX_EP_COUNT OTG_HS_EP_COUNT
+#define OTG_MAX_CH_COUNT OTG_HS_CH_COUNT
+#define OTG_MAX_FIFO_WORDS OTG_HS_FIFO_WORDS
+
+#define OTG_FRAME_NS 1000000
+
+/* Words that len bytes take in a FIFO */
+#define OTG_WORDS(len) DIV_ROUND_UP(len, 4)
+
+/* A FIFO of words, in the FIFO RAM of the core */
+typedef struct {
+    uint32_t words[OTG_MAX_FIFO_WORDS];
+    unsigned head, count;
+} Stm32OtgFifo;
+
+typedef struct {
+    uint32_t
+        HCCHAR,
+        HCSPLT,
+        HCINT,
+        HCINTMSK,
+        HCTSIZ,
+        HCDMA;
+
+    /* The packet on the bus, which is in flight while busy is set */
+    USBPacket packet;
+    bool busy;
+    /* The data of the packet, len bytes and npkts packets.  OUT data is
+     * staged there until the device takes it. */
+    uint8_t *buf;
+    uint32_t buf_size;
+    int len, npkts;
+    bool staged;
+    /* NAKed, to be retried at the next frame or when the device wakes the
+     * endpoint up */
+    bool retry;
+} Stm32OtgChannel;
+
+typedef struct {
+    uint32_t
+        CTL,
+        INT,
+        TSIZ,
+        DMA;
+} Stm32OtgEp;
+
+struct Stm32Otg {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    CharDriverState *chr;
+    uint32_t hs;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    int ep_count, ch_count;
+    unsigned fifo_words;
+
+    USBBus bus;
+    USBPort port;
+
+    /* Register Values */
+    uint32_t
+        OTG_GOTGCTL,
+        OTG_GOTGINT,
+        OTG_GAHBCFG,
+        OTG_GUSBCFG,
+        OTG_GINTSTS,
+        OTG_GINTMSK,
+        OTG_GRXFSIZ,
+        OTG_GNPTXFSIZ,
+        OTG_GCCFG,
+        OTG_CID,
+        OTG_HPTXFSIZ,
+        OTG_DIEPTXF[OTG_MAX_EP_COUNT],
+
+        OTG_HCFG,
+        OTG_HFIR,
+        OTG_HAINTMSK,
+        OTG_HPRT,
+
+        OTG_DCFG,
+        OTG_DCTL,
+        OTG_DIEPMSK,
+        OTG_DOEPMSK,
+        OTG_DAINTMSK,
+        OTG_DVBUSDIS,
+        OTG_DVBUSPULSE,
+        OTG_DTHRCTL,
+        OTG_DIEPEMPMSK,
+        OTG_DEACHINTMSK,
+        OTG_DIEPEACHMSK1,
+        OTG_DOEPEACHMSK1,
+
+        OTG_PCGCCTL;
+
+    Stm32OtgChannel ch[OTG_MAX_CH_COUNT];
+    Stm32OtgEp in[OTG_MAX_EP_COUNT];
+    Stm32OtgEp out[OTG_MAX_EP_COUNT];
+
+    /* The receive FIFO, and the transmit FIFO of each endpoint (device
+     * mode) or channel (host mode) */
+    Stm32OtgFifo rx;
+    Stm32OtgFifo tx[OTG_MAX_CH_COUNT];
+
+    /* Whether the core was in host mode at the last check, for CIDSCHG */
+    bool host_mode;
+
+    /* vm_clock time of the start of frame 0: the end of the port reset in
+     * host mode, the last bus reset in device mode.  -1 when there are no
+     * frames. */
+    int64_t frame_base;
+    QEMUTimer *frame_timer;
+
+    /* The request being received from the host link, or held waiting for
+     * an endpoint */
+    uint8_t req[STM32_USB_LINK_HEADER_SIZE + STM32_USB_MAX_PACKET];
+    int req_len;
+    bool req_waiting;
+
+    qemu_irq irq;
+};
+
+
+
+
+/* FIFOS */
+
+static void stm32_otg_fifo_flush(Stm32OtgFifo *f)
+{
+    f->head = 0;
+    f->count = 0;
+}
+
+/* The caller checks that there is room. */
+static void stm32_otg_fifo_push(Stm32OtgFifo *f, uint32_t word)
+{
+    assert(f->count < OTG_MAX_FIFO_WORDS);
+    f->words[(f->head + f->count++) % OTG_MAX_FIFO_WORDS] = word;
+}
+
+static uint32_t stm32_otg_fifo_pop(Stm32OtgFifo *f)
+{
+    uint32_t word;
+
+    if (f->count == 0) {
+        return 0;
+    }
+    word = f->words[f->head];
+    f->head = (f->head + 1) % OTG_MAX_FIFO_WORDS;
+    f->count--;
+    return word;
+}
+
+static uint32_t stm32_otg_fifo_peek(Stm32OtgFifo *f)
+{
+    return f->count ? f->words[f->head] : 0;
+}
+
+/* The words of a packet are little endian, the last one padded. */
+static void stm32_otg_fifo_push_bytes(Stm32OtgFifo *f, const uint8_t *buf,
+                                      int len)
+{
+    uint8_t word[4];
+
+    for (; len >= 4; buf += 4, len -= 4) {
+        stm32_otg_fifo_push(f, ldl_le_p(buf));
+    }
+    if (len) {
+        memset(word, 0, sizeof(word));
+        memcpy(word, buf, len);
+        stm32_otg_fifo_push(f, ldl_le_p(word));
+    }
+}
+
+static void stm32_otg_fifo_pop_bytes(Stm32OtgFifo *f, uint8_t *buf, int len)
+{
+    uint8_t word[4];
+
+    for (; len >= 4; buf += 4, len -= 4) {
+        stl_le_p(buf, stm32_otg_fifo_pop(f));
+    }
+    if (len) {
+        stl_le_p(word, stm32_otg_fifo_pop(f));
+        memcpy(buf, word, len);
+    }
+}
+
+/* Size of a FIFO in words, from the depth in the upper half of its size
+ * register (the lower half of GRXFSIZ) */
+static unsigned stm32_otg_depth(Stm32Otg *s, uint32_t depth)
+{
+    return MIN(depth, s->fifo_words);
+}
+
+static unsigned stm32_otg_rx_free(Stm32Otg *s)
+{
+    unsigned depth = stm32_otg_depth(s, s->OTG_GRXFSIZ & 0xffff);
+
+    return depth > s->rx.count ? depth - s->rx.count : 0;
+}
+
+static void stm32_otg_rx_push_status(Stm32Otg *s, int num, int len, int dpid,
+                                     int pktsts)
+{
+    stm32_otg_fifo_push(&s->rx, num | (len << OTG_GRXSTS_BCNT_START) |
+                                (dpid << OTG_GRXSTS_DPID_START) |
+                                (pktsts << OTG_GRXSTS_PKTSTS_START));
+}
+
+
+
+
+/* MODES AND INTERRUPTS */
+
+static bool stm32_otg_is_host(Stm32Otg *s)
+{
+    if (IS_BIT_SET(s->OTG_GUSBCFG, OTG_GUSBCFG_FDMOD_BIT)) {
+        return false;
+    }
+    return IS_BIT_SET(s->OTG_GUSBCFG, OTG_GUSBCFG_FHMOD_BIT) ||
+           s->port.dev != NULL;
+}
+
+static bool stm32_otg_dma(Stm32Otg *s)
+{
+    return IS_BIT_SET(s->OTG_GAHBCFG, OTG_GAHBCFG_DMAEN_BIT);
+}
+
+static bool stm32_otg_ch_is_periodic(Stm32OtgChannel *ch)
+{
+    int eptyp = (ch->HCCHAR >> OTG_HCCHAR_EPTYP_START) & 3;
+
+    return eptyp == OTG_EPTYP_ISO || eptyp == OTG_EPTYP_INTERRUPT;
+}
+
+/* Free words of the transmit FIFO of the host's periodic or non-periodic
+ * channels, which share it */
+static unsigned stm32_otg_host_tx_free(Stm32Otg *s, bool periodic)
+{
+    unsigned depth, used = 0;
+    int n;
+
+    depth = stm32_otg_depth(s, (periodic ? s->OTG_HPTXFSIZ :
+                                           s->OTG_GNPTXFSIZ) >> 16);
+    for (n = 0; n < s->ch_count; n++) {
+        if (stm32_otg_ch_is_periodic(&s->ch[n]) == periodic) {
+            used += s->tx[n].count;
+        }
+    }
+    return depth > used ? depth - used : 0;
+}
+
+static unsigned stm32_otg_ep_tx_depth(Stm32Otg *s, int n)
+{
+    return stm32_otg_depth(s, (n ? s->OTG_DIEPTXF[n] : s->OTG_GNPTXFSIZ)
+                              >> 16);
+}
+
+static unsigned stm32_otg_ep_tx_free(Stm32Otg *s, int n)
+{
+    unsigned depth = stm32_otg_ep_tx_depth(s, n);
+
+    return depth > s->tx[n].count ? depth - s->tx[n].count : 0;
+}
+
+/* Whether a transmit FIFO is as empty as TXFELVL or PTXFELVL asks for */
+static bool stm32_otg_tx_empty(Stm32Otg *s, unsigned used, unsigned depth,
+                               int lvl_bit)
+{
+    return IS_BIT_SET(s->OTG_GAHBCFG, lvl_bit) ? used == 0 :
+                                                 used <= depth / 2;
+}
+
+static uint32_t stm32_otg_DIEPINT_read(Stm32Otg *s, int n)
+{
+    uint32_t value = s->in[n].INT;
+
+    if (stm32_otg_tx_empty(s, s->tx[n].count, stm32_otg_ep_tx_depth(s, n),
+                           OTG_GAHBCFG_TXFELVL_BIT)) {
+        SET_BIT(value, OTG_DIEPINT_TXFE_BIT);
+    }
+    return value;
+}
+
+/* An endpoint's bit is set while one of its unmasked events is. */
+static uint32_t stm32_otg_DAINT_read(Stm32Otg *s)
+{
+    uint32_t value = 0, mask;
+    int n;
+
+    for (n = 0; n < s->ep_count; n++) {
+        mask = s->OTG_DIEPMSK |
+               GET_BIT_MASK(OTG_DIEPINT_TXFE_BIT,
+                            IS_BIT_SET(s->OTG_DIEPEMPMSK, n));
+        if (stm32_otg_DIEPINT_read(s, n) & mask) {
+            SET_BIT(value, n);
+        }
+        if (s->out[n].INT & s->OTG_DOEPMSK) {
+            value |= 1 << (16 + n);
+        }
+    }
+    return value;
+}
+
+static uint32_t stm32_otg_HAINT_read(Stm32Otg *s)
+{
+    uint32_t value = 0;
+    int n;
+
+    for (n = 0; n < s->ch_count; n++) {
+        if (s->ch[n].HCINT & s->ch[n].HCINTMSK) {
+            SET_BIT(value, n);
+        }
+    }
+    return value;
+}
+
+static uint32_t stm32_otg_GINTSTS_read(Stm32Otg *s)
+{
+    uint32_t value = s->OTG_GINTSTS & OTG_GINTSTS_W1C_MASK;
+    uint32_t daint;
+
+    if (s->OTG_GOTGINT) {
+        SET_BIT(value, OTG_GINTSTS_OTGINT_BIT);
+    }
+    if (s->rx.count) {
+        SET_BIT(value, OTG_GINTSTS_RXFLVL_BIT);
+    }
+    if (stm32_otg_is_host(s)) {
+        unsigned np_depth = stm32_otg_depth(s, s->OTG_GNPTXFSIZ >> 16);
+        unsigned p_depth = stm32_otg_depth(s, s->OTG_HPTXFSIZ >> 16);
+
+        SET_BIT(value, OTG_GINTSTS_CMOD_BIT);
+        if (stm32_otg_tx_empty(s, np_depth -
+                                  stm32_otg_host_tx_free(s, false),
+                               np_depth, OTG_GAHBCFG_TXFELVL_BIT)) {
+            SET_BIT(value, OTG_GINTSTS_NPTXFE_BIT);
+        }
+        if (stm32_otg_tx_empty(s, p_depth - stm32_otg_host_tx_free(s, true),
+                               p_depth, OTG_GAHBCFG_PTXFELVL_BIT)) {
+            SET_BIT(value, OTG_GINTSTS_PTXFE_BIT);
+        }
+        if (s->OTG_HPRT & OTG_HPRT_W1C_MASK) {
+            SET_BIT(value, OTG_GINTSTS_HPRTINT_BIT);
+        }
+        if (stm32_otg_HAINT_read(s)) {
+            SET_BIT(value, OTG_GINTSTS_HCINT_BIT);
+        }
+    } else {
+        daint = stm32_otg_DAINT_read(s);
+        if (daint & 0xffff) {
+            SET_BIT(value, OTG_GINTSTS_IEPINT_BIT);
+        }
+        if (daint >> 16) {
+            SET_BIT(value, OTG_GINTSTS_OEPINT_BIT);
+        }
+        if (IS_BIT_SET(s->OTG_DCTL, OTG_DCTL_GINSTS_BIT)) {
+            SET_BIT(value, OTG_GINTSTS_GINAKEFF_BIT);
+        }
+        if (IS_BIT_SET(s->OTG_DCTL, OTG_DCTL_GONSTS_BIT)) {
+            SET_BIT(value, OTG_GINTSTS_GONAKEFF_BIT);
+        }
+    }
+    return value;
+}
+
+static void stm32_otg_update_irq(Stm32Otg *s)
+{
+    bool host = stm32_otg_is_host(s);
+    bool level;
+
+    /* A change of the ID pin, when the mode is not forced */
+    if (host != s->host_mode) {
+        s->host_mode = host;
+        SET_BIT(s->OTG_GINTSTS, OTG_GINTSTS_CIDSCHG_BIT);
+    }
+
+    level = IS_BIT_SET(s->OTG_GAHBCFG, OTG_GAHBCFG_GINT_BIT) &&
+            (stm32_otg_GINTSTS_read(s) & s->OTG_GINTMSK);
+    trace_stm32_otg_irq(s, level);
+    qemu_set_irq(s->irq, level);
+}
+
+
+
+
+/* FRAMES */
+
+static bool stm32_otg_ch_step(Stm32Otg *s, int n);
+
+static void stm32_otg_frame_arm(Stm32Otg *s)
+{
+    bool needed = false;
+    int64_t now, next;
+    int n;
+
+    if (s->frame_base >= 0) {
+        needed = IS_BIT_SET(s->OTG_GINTMSK, OTG_GINTSTS_SOF_BIT);
+        for (n = 0; n < s->ch_count; n++) {
+            needed |= s->ch[n].retry;
+        }
+    }
+    if (!needed) {
+        qemu_del_timer(s->frame_timer);
+        return;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    next = now + OTG_FRAME_NS - (now - s->frame_base) % OTG_FRAME_NS;
+    qemu_mod_timer(s->frame_timer, next);
+}
+
+static uint32_t stm32_otg_frame_number(Stm32Otg *s)
+{
+    if (s->frame_base < 0) {
+        return 0;
+    }
+    return (qemu_get_clock_ns(vm_clock) - s->frame_base) / OTG_FRAME_NS;
+}
+
+/* At each start of frame, the NAKed transactions are tried again. */
+static void stm32_otg_frame_timer_expire(void *opaque)
+{
+    Stm32Otg *s = (Stm32Otg *)opaque;
+    int n;
+
+    SET_BIT(s->OTG_GINTSTS, OTG_GINTSTS_SOF_BIT);
+    for (n = 0; n < s->ch_count; n++) {
+        if (s->ch[n].retry) {
+            s->ch[n].retry = false;
+            while (stm32_otg_ch_step(s, n)) {
+            }
+        }
+    }
+    stm32_otg_update_irq(s);
+    stm32_otg_frame_arm(s);
+}
+
+
+
+
+/* HOST CHANNELS */
+
+static int stm32_otg_ch_mps(Stm32OtgChannel *ch)
+{
+    return MAX(ch->HCCHAR & OTG_HCCHAR_MPSIZ_MASK, 1);
+}
+
+static int stm32_otg_ch_pktcnt(Stm32OtgChannel *ch)
+{
+    return (ch->HCTSIZ & OTG_HCTSIZ_PKTCNT_MASK) >> OTG_HCTSIZ_PKTCNT_START;
+}
+
+static int stm32_otg_ch_dpid(Stm32OtgChannel *ch)
+{
+    return (ch->HCTSIZ & OTG_HCTSIZ_DPID_MASK) >> OTG_HCTSIZ_DPID_START;
+}
+
+/* Toggles DATA0 and DATA1 once per packet. */
+static int stm32_otg_toggle(int dpid, int npkts)
+{
+    if (npkts & 1) {
+        return dpid == OTG_DPID_DATA0 ? OTG_DPID_DATA1 : OTG_DPID_DATA0;
+    }
+    return dpid;
+}
+
+/* Takes len bytes and npkts packets off the transfer size. */
+static void stm32_otg_ch_advance(Stm32OtgChannel *ch, int len, int npkts,
+                                 int dpid)
+{
+    uint32_t xfrsiz = ch->HCTSIZ & OTG_HCTSIZ_XFRSIZ_MASK;
+    int pktcnt = stm32_otg_ch_pktcnt(ch);
+
+    xfrsiz -= MIN(xfrsiz, len);
+    pktcnt -= MIN(pktcnt, npkts);
+    ch->HCTSIZ = (ch->HCTSIZ & ~(OTG_HCTSIZ_XFRSIZ_MASK |
+                                 OTG_HCTSIZ_PKTCNT_MASK |
+                                 OTG_HCTSIZ_DPID_MASK)) |
+                 xfrsiz | (pktcnt << OTG_HCTSIZ_PKTCNT_START) |
+                 (dpid << OTG_HCTSIZ_DPID_START);
+}
+
+static void stm32_otg_ch_buf_reserve(Stm32OtgChannel *ch, uint32_t size)
+{
+    if (size > ch->buf_size) {
+        ch->buf = g_realloc(ch->buf, size);
+        ch->buf_size = size;
+    }
+}
+
+/* Stops the transfer of a channel, e.g. because it is halted or its
+ * device is unplugged. */
+static void stm32_otg_ch_cancel(Stm32Otg *s, int n)
+{
+    Stm32OtgChannel *ch = &s->ch[n];
+
+    if (ch->busy) {
+        usb_cancel_packet(&ch->packet);
+        ch->busy = false;
+    }
+    ch->staged = false;
+    ch->retry = false;
+}
+
+/* Halts the channel, with the events that say why. */
+static void stm32_otg_ch_halt(Stm32Otg *s, int n, uint32_t events)
+{
+    Stm32OtgChannel *ch = &s->ch[n];
+
+    stm32_otg_ch_cancel(s, n);
+    ch->HCCHAR &= ~(GET_BIT_MASK_ONE(OTG_HCCHAR_CHENA_BIT) |
+                    GET_BIT_MASK_ONE(OTG_HCCHAR_CHDIS_BIT));
+    ch->HCINT |= events | GET_BIT_MASK_ONE(OTG_HCINT_CHH_BIT);
+}
+
+/* Stages the OUT or SETUP data of the channel: with DMA the rest of the
+ * transfer, in slave mode the whole packets in its FIFO.  Returns false if
+ * the FIFO does not hold a packet yet. */
+static bool stm32_otg_ch_stage_out(Stm32Otg *s, int n)
+{
+    Stm32OtgChannel *ch = &s->ch[n];
+    uint32_t xfrsiz = ch->HCTSIZ & OTG_HCTSIZ_XFRSIZ_MASK;
+    int pktcnt = MAX(stm32_otg_ch_pktcnt(ch), 1);
+    int mps = stm32_otg_ch_mps(ch);
+    unsigned words = 0;
+    int plen;
+
+    if (stm32_otg_dma(s)) {
+        stm32_otg_ch_buf_reserve(ch, xfrsiz);
+        cpu_physical_memory_read(ch->HCDMA, ch->buf, xfrsiz);
+        ch->len = xfrsiz;
+        ch->npkts = xfrsiz ? DIV_ROUND_UP(xfrsiz, mps) : 1;
+        ch->staged = true;
+        return true;
+    }
+
+    stm32_otg_ch_buf_reserve(ch, MIN(xfrsiz, pktcnt * mps));
+    ch->len = 0;
+    ch->npkts = 0;
+    while (ch->npkts < pktcnt) {
+        plen = MIN(mps, xfrsiz - ch->len);
+        if (words + OTG_WORDS(plen) > s->tx[n].count) {
+            break;
+        }
+        words += OTG_WORDS(plen);
+        ch->len += plen;
+        ch->npkts++;
+        if (plen < mps) {
+            break;
+        }
+    }
+    if (ch->npkts == 0) {
+        return false;
+    }
+
+    /* The packets are taken out of the FIFO one by one, so that the
+     * padding of their last words is dropped. */
+    for (plen = 0; plen < ch->len; plen += mps) {
+        stm32_otg_fifo_pop_bytes(&s->tx[n], ch->buf + plen,
+                                 MIN(mps, ch->len - plen));
+    }
+    ch->staged = true;
+    return true;
+}
+
+/* The device has answered the packet of the channel. */
+static void stm32_otg_ch_done(Stm32Otg *s, int n)
+{
+    Stm32OtgChannel *ch = &s->ch[n];
+    USBPacket *p = &ch->packet;
+    bool in = IS_BIT_SET(ch->HCCHAR, OTG_HCCHAR_EPDIR_BIT);
+    int mps = stm32_otg_ch_mps(ch);
+    int dpid = stm32_otg_ch_dpid(ch);
+    int len, npkts, plen, off;
+    bool last;
+
+    DPRINTF("channel %d: pid 0x%02x, %d bytes, status %d\n", n, p->pid,
+            p->status == USB_RET_SUCCESS ? p->actual_length : ch->len,
+            p->status);
+
+    switch (p->status) {
+        case USB_RET_SUCCESS:
+            break;
+        case USB_RET_NAK:
+            /* Periodic transactions are retried by software at the next
+             * frame, the others by the core. */
+            if (stm32_otg_ch_is_periodic(ch)) {
+                stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_NAK_BIT));
+            } else {
+                SET_BIT(ch->HCINT, OTG_HCINT_NAK_BIT);
+                ch->retry = true;
+                stm32_otg_frame_arm(s);
+            }
+            return;
+        case USB_RET_STALL:
+            stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_STALL_BIT));
+            return;
+        case USB_RET_BABBLE:
+            stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_BBERR_BIT));
+            return;
+        default:
+            stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_TXERR_BIT));
+            return;
+    }
+
+    if (!in) {
+        /* A SETUP is followed by DATA1 both ways, which software sets. */
+        dpid = stm32_otg_toggle(dpid, ch->npkts);
+        if (stm32_otg_dma(s)) {
+            ch->HCDMA += ch->len;
+        }
+        stm32_otg_ch_advance(ch, ch->len, ch->npkts, dpid);
+        ch->staged = false;
+        last = stm32_otg_ch_pktcnt(ch) == 0;
+    } else {
+        len = p->actual_length;
+        npkts = len ? DIV_ROUND_UP(len, mps) : 1;
+        last = len < ch->len || len % mps != 0 ||
+               stm32_otg_ch_pktcnt(ch) <= npkts;
+        if (stm32_otg_dma(s)) {
+            cpu_physical_memory_write(ch->HCDMA, ch->buf, len);
+            ch->HCDMA += len;
+            dpid = stm32_otg_toggle(dpid, npkts);
+        } else {
+            off = 0;
+            do {
+                plen = MIN(mps, len - off);
+                stm32_otg_rx_push_status(s, n, plen, dpid,
+                                         OTG_PKTSTS_IN_DATA);
+                stm32_otg_fifo_push_bytes(&s->rx, ch->buf + off, plen);
+                dpid = stm32_otg_toggle(dpid, 1);
+                off += plen;
+            } while (off < len);
+            if (last) {
+                stm32_otg_rx_push_status(s, n, 0, dpid, OTG_PKTSTS_IN_DONE);
+            }
+        }
+        stm32_otg_ch_advance(ch, len, npkts, dpid);
+    }
+
+    if (last) {
+        stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_XFRC_BIT) |
+                                GET_BIT_MASK_ONE(OTG_HCINT_ACK_BIT));
+    } else {
+        SET_BIT(ch->HCINT, OTG_HCINT_ACK_BIT);
+    }
+}
+
+/* Sends the next packet of an enabled channel.  Returns true if it was
+ * answered and the channel can go on, false if it is waiting (for the
+ * device, the FIFOs, the next frame) or done. */
+static bool stm32_otg_ch_step(Stm32Otg *s, int n)
+{
+    Stm32OtgChannel *ch = &s->ch[n];
+    bool in = IS_BIT_SET(ch->HCCHAR, OTG_HCCHAR_EPDIR_BIT);
+    int mps = stm32_otg_ch_mps(ch);
+    int epnum = (ch->HCCHAR >> OTG_HCCHAR_EPNUM_START) & 0xf;
+    int eptyp = (ch->HCCHAR >> OTG_HCCHAR_EPTYP_START) & 3;
+    int addr = (ch->HCCHAR >> OTG_HCCHAR_DAD_START) & 0x7f;
+    uint32_t xfrsiz = ch->HCTSIZ & OTG_HCTSIZ_XFRSIZ_MASK;
+    int pktcnt = MAX(stm32_otg_ch_pktcnt(ch), 1);
+    USBDevice *dev;
+    USBEndpoint *ep;
+    unsigned fit;
+    int pid;
+
+    if (!IS_BIT_SET(ch->HCCHAR, OTG_HCCHAR_CHENA_BIT) || ch->busy ||
+        ch->retry) {
+        return false;
+    }
+
+    dev = NULL;
+    if (stm32_otg_is_host(s) && IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PENA_BIT)) {
+        dev = usb_find_device(&s->port, addr);
+    }
+    if (!dev) {
+        stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_TXERR_BIT));
+        return false;
+    }
+
+    if (in) {
+        pid = USB_TOKEN_IN;
+        ch->len = MIN(xfrsiz, pktcnt * mps);
+        if (!stm32_otg_dma(s)) {
+            /* As many packets as the receive FIFO has room for, with their
+             * entries and the one that completes the transfer */
+            fit = stm32_otg_rx_free(s);
+            fit = fit > 1 ? (fit - 1) / (1 + OTG_WORDS(mps)) : 0;
+            if (fit == 0) {
+                return false;
+            }
+            ch->len = MIN(ch->len, fit * mps);
+        }
+        stm32_otg_ch_buf_reserve(ch, ch->len);
+    } else {
+        pid = eptyp == OTG_EPTYP_CONTROL &&
+              stm32_otg_ch_dpid(ch) == OTG_DPID_SETUP ?
+              USB_TOKEN_SETUP : USB_TOKEN_OUT;
+        if (!ch->staged && !stm32_otg_ch_stage_out(s, n)) {
+            return false;
+        }
+    }
+
+    ep = usb_ep_get(dev, pid, epnum);
+    usb_packet_setup(&ch->packet, pid, ep, n, false, true);
+    usb_packet_addbuf(&ch->packet, ch->buf, ch->len);
+    usb_handle_packet(dev, &ch->packet);
+    if (ch->packet.status == USB_RET_ASYNC) {
+        usb_device_flush_ep_queue(dev, ep);
+        ch->busy = true;
+        return false;
+    }
+    stm32_otg_ch_done(s, n);
+    return IS_BIT_SET(ch->HCCHAR, OTG_HCCHAR_CHENA_BIT) && !ch->retry;
+}
+
+/* Lets the enabled channels go on, after the FIFOs or the channels have
+ * changed. */
+static void stm32_otg_host_run(Stm32Otg *s)
+{
+    int n;
+
+    for (n = 0; n < s->ch_count; n++) {
+        while (stm32_otg_ch_step(s, n)) {
+        }
+    }
+}
+
+static void stm32_otg_HCCHAR_write(Stm32Otg *s, int n, uint32_t new_value)
+{
+    Stm32OtgChannel *ch = &s->ch[n];
+
+    ch->HCCHAR = new_value & OTG_HCCHAR_MASK;
+
+    if (IS_BIT_SET(new_value, OTG_HCCHAR_CHDIS_BIT)) {
+        /* The FIFO data of a halted transfer is written again when it is
+         * restarted. */
+        stm32_otg_ch_halt(s, n, 0);
+        stm32_otg_fifo_flush(&s->tx[n]);
+    } else if (IS_BIT_SET(new_value, OTG_HCCHAR_CHENA_BIT)) {
+        /* Software enables a channel again after a NAK, which sends the
+         * staged data again. */
+        SET_BIT(ch->HCCHAR, OTG_HCCHAR_CHENA_BIT);
+        ch->retry = false;
+        while (stm32_otg_ch_step(s, n)) {
+        }
+    }
+    stm32_otg_frame_arm(s);
+}
+
+
+
+
+/* HOST PORT */
+
+static void stm32_otg_port_update(Stm32Otg *s, bool connect_changed)
+{
+    bool connected = IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PPWR_BIT) &&
+                     s->port.dev != NULL;
+
+    if (connected != IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PCSTS_BIT) ||
+        connect_changed) {
+        CHANGE_BIT(s->OTG_HPRT, OTG_HPRT_PCSTS_BIT, connected);
+        if (connected) {
+            SET_BIT(s->OTG_HPRT, OTG_HPRT_PCDET_BIT);
+        } else {
+            SET_BIT(s->OTG_GINTSTS, OTG_GINTSTS_DISCINT_BIT);
+        }
+    }
+    if (!connected) {
+        RESET_BIT(s->OTG_HPRT, OTG_HPRT_PENA_BIT);
+        s->frame_base = -1;
+    }
+}
+
+static void stm32_otg_port_disable(Stm32Otg *s)
+{
+    int n;
+
+    for (n = 0; n < s->ch_count; n++) {
+        if (IS_BIT_SET(s->ch[n].HCCHAR, OTG_HCCHAR_CHENA_BIT)) {
+            stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_TXERR_BIT));
+        }
+    }
+}
+
+static uint32_t stm32_otg_HPRT_read(Stm32Otg *s)
+{
+    uint32_t value = s->OTG_HPRT;
+    int speed;
+
+    if (IS_BIT_SET(value, OTG_HPRT_PCSTS_BIT)) {
+        speed = s->port.dev->speed;
+        /* The pull up is on D+ at full speed, on D- at low speed. */
+        value |= (speed == USB_SPEED_LOW ? 2 : 1) << OTG_HPRT_PLSTS_START;
+        value |= (speed == USB_SPEED_HIGH ? 0 :
+                  speed == USB_SPEED_LOW ? 2 : 1) << OTG_HPRT_PSPD_START;
+    }
+    return value;
+}
+
+static void stm32_otg_HPRT_write(Stm32Otg *s, uint32_t new_value)
+{
+    uint32_t old_value = s->OTG_HPRT;
+
+    s->OTG_HPRT = (old_value & ~(OTG_HPRT_RW_MASK |
+                                 (new_value & OTG_HPRT_W1C_MASK))) |
+                  (new_value & OTG_HPRT_RW_MASK);
+
+    /* Writing 1 to PENA disables the port; only a reset enables it. */
+    if (IS_BIT_SET(new_value, OTG_HPRT_PENA_BIT)) {
+        RESET_BIT(s->OTG_HPRT, OTG_HPRT_PENA_BIT);
+    }
+    if (IS_BIT_SET(old_value, OTG_HPRT_PRES_BIT) &&
+        !IS_BIT_SET(new_value, OTG_HPRT_PRES_BIT)) {
+        RESET_BIT(s->OTG_HPRT, OTG_HPRT_PSUSP_BIT);
+    }
+    if (IS_BIT_SET(old_value, OTG_HPRT_PSUSP_BIT)) {
+        /* Only a resume or a reset clears PSUSP. */
+        SET_BIT(s->OTG_HPRT, OTG_HPRT_PSUSP_BIT);
+    }
+
+    stm32_otg_port_update(s, false);
+
+    if (IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PRST_BIT)) {
+        RESET_BIT(s->OTG_HPRT, OTG_HPRT_PENA_BIT);
+        RESET_BIT(s->OTG_HPRT, OTG_HPRT_PSUSP_BIT);
+    } else if (IS_BIT_SET(old_value, OTG_HPRT_PRST_BIT) &&
+               IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PCSTS_BIT)) {
+        /* The end of the reset enables the port, and the frames start. */
+        DPRINTF("port reset\n");
+        usb_device_reset(s->port.dev);
+        SET_BIT(s->OTG_HPRT, OTG_HPRT_PENA_BIT);
+        SET_BIT(s->OTG_HPRT, OTG_HPRT_PENCHNG_BIT);
+        s->frame_base = qemu_get_clock_ns(vm_clock);
+    }
+
+    if (!IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PENA_BIT)) {
+        stm32_otg_port_disable(s);
+    }
+    stm32_otg_frame_arm(s);
+}
+
+static uint32_t stm32_otg_HFNUM_read(Stm32Otg *s)
+{
+    uint32_t frivl = s->OTG_HFIR & 0xffff;
+    int64_t in_frame;
+
+    if (s->frame_base < 0) {
+        return 0;
+    }
+    in_frame = (qemu_get_clock_ns(vm_clock) - s->frame_base) % OTG_FRAME_NS;
+    return (stm32_otg_frame_number(s) & 0xffff) |
+           ((frivl - muldiv64(in_frame, frivl, OTG_FRAME_NS)) << 16);
+}
+
+static void stm32_otg_attach(USBPort *port)
+{
+    Stm32Otg *s = port->opaque;
+
+    DPRINTF("device attached\n");
+    stm32_otg_port_update(s, true);
+    stm32_otg_update_irq(s);
+}
+
+static void stm32_otg_detach(USBPort *port)
+{
+    Stm32Otg *s = port->opaque;
+    USBDevice *dev = port->dev;
+    bool connected = IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PCSTS_BIT);
+
+    DPRINTF("device detached\n");
+    stm32_otg_port_disable(s);
+    /* port->dev still points to the device. */
+    port->dev = NULL;
+    stm32_otg_port_update(s, connected);
+    port->dev = dev;
+    stm32_otg_frame_arm(s);
+    stm32_otg_update_irq(s);
+}
+
+static void stm32_otg_child_detach(USBPort *port, USBDevice *child)
+{
+    Stm32Otg *s = port->opaque;
+    int n;
+
+    for (n = 0; n < s->ch_count; n++) {
+        if (s->ch[n].busy && s->ch[n].packet.ep->dev == child) {
+            stm32_otg_ch_halt(s, n, GET_BIT_MASK_ONE(OTG_HCINT_TXERR_BIT));
+        }
+    }
+}
+
+static void stm32_otg_complete(USBPort *port, USBPacket *packet)
+{
+    Stm32Otg *s = port->opaque;
+    Stm32OtgChannel *ch = container_of(packet, Stm32OtgChannel, packet);
+    int n = ch - s->ch;
+
+    ch->busy = false;
+    stm32_otg_ch_done(s, n);
+    while (stm32_otg_ch_step(s, n)) {
+    }
+    stm32_otg_update_irq(s);
+}
+
+/* A device has data for an endpoint that was NAKed. */
+static void stm32_otg_wakeup_endpoint(USBBus *bus, USBEndpoint *ep)
+{
+    Stm32Otg *s = container_of(bus, Stm32Otg, bus);
+    int n;
+
+    for (n = 0; n < s->ch_count; n++) {
+        if (s->ch[n].retry && s->ch[n].packet.ep == ep) {
+            s->ch[n].retry = false;
+            while (stm32_otg_ch_step(s, n)) {
+            }
+        }
+    }
+    stm32_otg_frame_arm(s);
+    stm32_otg_update_irq(s);
+}
+
+static USBPortOps stm32_otg_port_ops = {
+    .attach = stm32_otg_attach,
+    .detach = stm32_otg_detach,
+    .child_detach = stm32_otg_child_detach,
+    .complete = stm32_otg_complete,
+};
+
+static USBBusOps stm32_otg_bus_ops = {
+    .wakeup_endpoint = stm32_otg_wakeup_endpoint,
+};
+
+
+
+
+/* DEVICE ENDPOINTS */
+
+static int stm32_otg_ep_mps(Stm32Otg *s, int n)
+{
+    static const int ep0_mps[] = {64, 32, 16, 8};
+
+    if (n == 0) {
+        return ep0_mps[s->in[0].CTL & OTG_DxEPCTL0_MPSIZ_MASK];
+    }
+    return MAX(s->in[n].CTL & OTG_DxEPCTL_MPSIZ_MASK, 1);
+}
+
+static int stm32_otg_out_mps(Stm32Otg *s, int n)
+{
+    if (n == 0) {
+        return stm32_otg_ep_mps(s, 0);
+    }
+    return MAX(s->out[n].CTL & OTG_DxEPCTL_MPSIZ_MASK, 1);
+}
+
+static uint32_t stm32_otg_xfrsiz_mask(int n)
+{
+    return n ? OTG_DxEPTSIZ_XFRSIZ_MASK : OTG_DxEPTSIZ0_XFRSIZ_MASK;
+}
+
+/* Takes a packet of len bytes off the transfer size of an endpoint, and
+ * returns the packets left. */
+static int stm32_otg_ep_advance(Stm32OtgEp *ep, int n, int len)
+{
+    uint32_t xfrsiz_mask = stm32_otg_xfrsiz_mask(n);
+    uint32_t xfrsiz = ep->TSIZ & xfrsiz_mask;
+    int pktcnt = (ep->TSIZ & OTG_DxEPTSIZ_PKTCNT_MASK) >>
+                 OTG_DxEPTSIZ_PKTCNT_START;
+
+    xfrsiz -= MIN(xfrsiz, len);
+    pktcnt -= MIN(pktcnt, 1);
+    ep->TSIZ = (ep->TSIZ & ~(xfrsiz_mask | OTG_DxEPTSIZ_PKTCNT_MASK)) |
+               xfrsiz | (pktcnt << OTG_DxEPTSIZ_PKTCNT_START);
+    return pktcnt;
+}
+
+/* The core is off the bus while it is in host mode, soft disconnected,
+ * its clocks are stopped or its embedded PHY is powered down. */
+static bool stm32_otg_device_connected(Stm32Otg *s)
+{
+    return s->clk.enabled && !stm32_otg_is_host(s) &&
+           !IS_BIT_SET(s->OTG_DCTL, OTG_DCTL_SDIS_BIT) &&
+           !IS_BIT_SET(s->OTG_PCGCCTL, OTG_PCGCCTL_STPPCLK_BIT) &&
+           (!IS_BIT_SET(s->OTG_GUSBCFG, OTG_GUSBCFG_PHYSEL_BIT) ||
+            IS_BIT_SET(s->OTG_GCCFG, OTG_GCCFG_PWRDWN_BIT));
+}
+
+/* Puts the device in the state a reset on the bus leaves it in. */
+static void stm32_otg_bus_reset(Stm32Otg *s)
+{
+    int n;
+
+    s->OTG_DCFG &= ~OTG_DCFG_DAD_MASK;
+    for (n = 0; n < s->ep_count; n++) {
+        SET_BIT(s->out[n].CTL, OTG_DxEPCTL_NAKSTS_BIT);
+        RESET_BIT(s->in[n].CTL, OTG_DxEPCTL_STALL_BIT);
+        RESET_BIT(s->out[n].CTL, OTG_DxEPCTL_STALL_BIT);
+    }
+    SET_BIT(s->OTG_GINTSTS, OTG_GINTSTS_USBRST_BIT);
+    SET_BIT(s->OTG_GINTSTS, OTG_GINTSTS_ENUMDNE_BIT);
+    s->frame_base = qemu_get_clock_ns(vm_clock);
+}
+
+/* A SETUP packet for control endpoint n, which always takes it */
+static int stm32_otg_setup(Stm32Otg *s, int n, const uint8_t *data, int len)
+{
+    Stm32OtgEp *ep = &s->out[n];
+    int stupcnt;
+
+    if (len != 8) {
+        stm32_hw_warn("stm32_otg: %d byte SETUP packet", len);
+        return STM32_USB_LINK_NO_RESPONSE;
+    }
+
+    if (stm32_otg_dma(s)) {
+        cpu_physical_memory_write(ep->DMA, data, len);
+        ep->DMA += len;
+        stupcnt = (ep->TSIZ & OTG_DOEPTSIZ0_STUPCNT_MASK) >>
+                  OTG_DOEPTSIZ0_STUPCNT_START;
+        stupcnt -= MIN(stupcnt, 1);
+        ep->TSIZ = (ep->TSIZ & ~OTG_DOEPTSIZ0_STUPCNT_MASK) |
+                   (stupcnt << OTG_DOEPTSIZ0_STUPCNT_START);
+        SET_BIT(ep->INT, OTG_DOEPINT_STUP_BIT);
+    } else {
+        /* The data, and the entry that sets STUP when it is popped */
+        if (stm32_otg_rx_free(s) < 2 + OTG_WORDS(len)) {
+            return STM32_USB_LINK_NAK;
+        }
+        stm32_otg_rx_push_status(s, n, len, OTG_DPID_DATA0,
+                                 OTG_PKTSTS_SETUP_DATA);
+        stm32_otg_fifo_push_bytes(&s->rx, data, len);
+        stm32_otg_rx_push_status(s, n, 0, OTG_DPID_DATA0,
+                                 OTG_PKTSTS_SETUP_DONE);
+    }
+
+    /* The data stage starts with DATA1 both ways. */
+    RESET_BIT(s->in[n].CTL, OTG_DxEPCTL_STALL_BIT);
+    RESET_BIT(ep->CTL, OTG_DxEPCTL_STALL_BIT);
+    SET_BIT(s->in[n].CTL, OTG_DxEPCTL_DPID_BIT);
+    SET_BIT(ep->CTL, OTG_DxEPCTL_DPID_BIT);
+    return STM32_USB_LINK_ACK;
+}
+
+static int stm32_otg_ep_handshake(Stm32Otg *s, uint32_t ctl, int n,
+                                  bool global_nak)
+{
+    if (n >= s->ep_count ||
+        (n && !IS_BIT_SET(ctl, OTG_DxEPCTL_USBAEP_BIT))) {
+        return STM32_USB_LINK_NO_RESPONSE;
+    }
+    if (IS_BIT_SET(ctl, OTG_DxEPCTL_STALL_BIT)) {
+        return STM32_USB_LINK_STALL;
+    }
+    if (!IS_BIT_SET(ctl, OTG_DxEPCTL_EPENA_BIT) ||
+        IS_BIT_SET(ctl, OTG_DxEPCTL_NAKSTS_BIT) || global_nak) {
+        return STM32_USB_LINK_NAK;
+    }
+    return STM32_USB_LINK_ACK;
+}
+
+/* An OUT data packet for endpoint n */
+static int stm32_otg_rx(Stm32Otg *s, int n, const uint8_t *data, int len)
+{
+    Stm32OtgEp *ep = &s->out[n];
+    int handshake, dpid, mps;
+    bool done;
+
+    handshake = stm32_otg_ep_handshake(s, ep->CTL, n,
+                    IS_BIT_SET(s->OTG_DCTL, OTG_DCTL_GONSTS_BIT));
+    if (handshake != STM32_USB_LINK_ACK) {
+        return handshake;
+    }
+
+    mps = stm32_otg_out_mps(s, n);
+    if (len > mps) {
+        stm32_hw_warn("stm32_otg: %d byte packet for a %d byte endpoint",
+                      len, mps);
+        return STM32_USB_LINK_NO_RESPONSE;
+    }
+    /* With the entry that completes the transfer */
+    if (!stm32_otg_dma(s) && stm32_otg_rx_free(s) < 2 + OTG_WORDS(len)) {
+        return STM32_USB_LINK_NAK;
+    }
+
+    dpid = IS_BIT_SET(ep->CTL, OTG_DxEPCTL_DPID_BIT) ? OTG_DPID_DATA1 :
+                                                       OTG_DPID_DATA0;
+    ep->CTL ^= GET_BIT_MASK_ONE(OTG_DxEPCTL_DPID_BIT);
+    done = stm32_otg_ep_advance(ep, n, len) == 0 || len < mps;
+
+    if (stm32_otg_dma(s)) {
+        cpu_physical_memory_write(ep->DMA, data, len);
+        ep->DMA += len;
+        if (done) {
+            RESET_BIT(ep->CTL, OTG_DxEPCTL_EPENA_BIT);
+            SET_BIT(ep->CTL, OTG_DxEPCTL_NAKSTS_BIT);
+            SET_BIT(ep->INT, OTG_DOEPINT_XFRC_BIT);
+        }
+    } else {
+        stm32_otg_rx_push_status(s, n, len, dpid, OTG_PKTSTS_OUT_DATA);
+        stm32_otg_fifo_push_bytes(&s->rx, data, len);
+        if (done) {
+            /* XFRC is set when software pops the entry. */
+            SET_BIT(ep->CTL, OTG_DxEPCTL_NAKSTS_BIT);
+            stm32_otg_rx_push_status(s, n, 0, dpid, OTG_PKTSTS_OUT_DONE);
+        }
+    }
+    return STM32_USB_LINK_ACK;
+}
+
+/* An IN token for endpoint n.  Returns the handshake and the length of the
+ * packet in *len. */
+static int stm32_otg_tx(Stm32Otg *s, int n, uint8_t *data, int *len)
+{
+    Stm32OtgEp *ep = &s->in[n];
+    int handshake, count, pktcnt;
+
+    handshake = stm32_otg_ep_handshake(s, ep->CTL, n,
+                    IS_BIT_SET(s->OTG_DCTL, OTG_DCTL_GINSTS_BIT));
+    pktcnt = (ep->TSIZ & OTG_DxEPTSIZ_PKTCNT_MASK) >>
+             OTG_DxEPTSIZ_PKTCNT_START;
+    if (handshake == STM32_USB_LINK_ACK && pktcnt == 0) {
+        handshake = STM32_USB_LINK_NAK;
+    }
+
+    count = MIN(stm32_otg_ep_mps(s, n), ep->TSIZ & stm32_otg_xfrsiz_mask(n));
+    if (handshake == STM32_USB_LINK_ACK && !stm32_otg_dma(s) &&
+        s->tx[n].count < OTG_WORDS(count)) {
+        handshake = STM32_USB_LINK_NAK;
+    }
+    if (handshake != STM32_USB_LINK_ACK) {
+        *len = 0;
+        return handshake;
+    }
+
+    if (stm32_otg_dma(s)) {
+        cpu_physical_memory_read(ep->DMA, data, count);
+        ep->DMA += count;
+    } else {
+        stm32_otg_fifo_pop_bytes(&s->tx[n], data, count);
+    }
+    /* Babble: more than the host asked for. */
+    *len = MIN(count, *len);
+
+    ep->CTL ^= GET_BIT_MASK_ONE(OTG_DxEPCTL_DPID_BIT);
+    if (stm32_otg_ep_advance(ep, n, count) == 0) {
+        RESET_BIT(ep->CTL, OTG_DxEPCTL_EPENA_BIT);
+        SET_BIT(ep->INT, OTG_DIEPINT_XFRC_BIT);
+    }
+    return STM32_USB_LINK_ACK;
+}
+
+/* Software has popped an entry of the receive FIFO. */
+static void stm32_otg_rx_popped(Stm32Otg *s, uint32_t status)
+{
+    int n = status & OTG_GRXSTS_EPNUM_MASK;
+    int pktsts = (status & OTG_GRXSTS_PKTSTS_MASK) >> OTG_GRXSTS_PKTSTS_START;
+
+    if (stm32_otg_is_host(s) || n >= s->ep_count) {
+        return;
+    }
+    switch (pktsts) {
+        case OTG_PKTSTS_SETUP_DONE:
+            SET_BIT(s->out[n].INT, OTG_DOEPINT_STUP_BIT);
+            break;
+        case OTG_PKTSTS_OUT_DONE:
+            RESET_BIT(s->out[n].CTL, OTG_DxEPCTL_EPENA_BIT);
+            SET_BIT(s->out[n].INT, OTG_DOEPINT_XFRC_BIT);
+            break;
+    }
+}
+
+static void stm32_otg_DxEPCTL_write(Stm32Otg *s, Stm32OtgEp *ep, int n,
+                                    bool in, uint32_t new_value)
+{
+    uint32_t rw_mask = in ? OTG_DIEPCTL_RW_MASK : OTG_DOEPCTL_RW_MASK;
+    uint32_t old_value = ep->CTL;
+
+    if (n == 0) {
+        /* Endpoint 0 is always an active control endpoint, and its OUT
+         * side has the packet size of its IN side. */
+        rw_mask &= ~(OTG_DxEPCTL_MPSIZ_MASK | OTG_DxEPCTL_EPTYP_MASK |
+                     GET_BIT_MASK_ONE(OTG_DxEPCTL_USBAEP_BIT));
+        if (in) {
+            rw_mask |= OTG_DxEPCTL0_MPSIZ_MASK;
+        }
+        new_value |= GET_BIT_MASK_ONE(OTG_DxEPCTL_USBAEP_BIT);
+        rw_mask |= GET_BIT_MASK_ONE(OTG_DxEPCTL_USBAEP_BIT);
+    }
+
+    /* EPENA is only set by software, and cleared by the core. */
+    ep->CTL = (old_value & ~rw_mask) | (new_value & rw_mask) |
+              (new_value & GET_BIT_MASK_ONE(OTG_DxEPCTL_EPENA_BIT));
+
+    if (IS_BIT_SET(new_value, OTG_DxEPCTL_CNAK_BIT)) {
+        RESET_BIT(ep->CTL, OTG_DxEPCTL_NAKSTS_BIT);
+    }
+    if (IS_BIT_SET(new_value, OTG_DxEPCTL_SNAK_BIT)) {
+        SET_BIT(ep->CTL, OTG_DxEPCTL_NAKSTS_BIT);
+        if (in) {
+            SET_BIT(ep->INT, OTG_DIEPINT_INEPNE_BIT);
+        }
+    }
+    if (IS_BIT_SET(new_value, OTG_DxEPCTL_SD0PID_BIT)) {
+        RESET_BIT(ep->CTL, OTG_DxEPCTL_DPID_BIT);
+    }
+    if (IS_BIT_SET(new_value, OTG_DxEPCTL_SODDFRM_BIT)) {
+        SET_BIT(ep->CTL, OTG_DxEPCTL_DPID_BIT);
+    }
+    if (IS_BIT_SET(new_value, OTG_DxEPCTL_EPDIS_BIT) &&
+        IS_BIT_SET(old_value, OTG_DxEPCTL_EPENA_BIT)) {
+        RESET_BIT(ep->CTL, OTG_DxEPCTL_EPENA_BIT);
+        SET_BIT(ep->INT, OTG_DIEPINT_EPDISD_BIT);
+    }
+}
+
+static void stm32_otg_DxEPTSIZ_write(Stm32OtgEp *ep, int n, bool in,
+                                     uint32_t new_value)
+{
+    uint32_t mask;
+
+    if (n) {
+        mask = OTG_DxEPTSIZ_XFRSIZ_MASK | OTG_DxEPTSIZ_PKTCNT_MASK |
+               OTG_DxEPTSIZ_MCNT_MASK;
+    } else if (in) {
+        mask = OTG_DxEPTSIZ0_XFRSIZ_MASK | OTG_DIEPTSIZ0_PKTCNT_MASK;
+    } else {
+        mask = OTG_DxEPTSIZ0_XFRSIZ_MASK | OTG_DOEPTSIZ0_PKTCNT_MASK |
+               OTG_DOEPTSIZ0_STUPCNT_MASK;
+    }
+    ep->TSIZ = new_value & mask;
+}
+
+
+
+
+/* HOST LINK */
+
+static void stm32_otg_respond(Stm32Otg *s, int handshake,
+                              const uint8_t *data, int len)
+{
+    uint8_t hdr[STM32_USB_LINK_HEADER_SIZE];
+
+    hdr[0] = s->req[0];
+    hdr[1] = handshake;
+    hdr[2] = s->req[2];
+    hdr[3] = 0;
+    stw_le_p(hdr + 4, len);
+    stw_le_p(hdr + 6, 0);
+    qemu_chr_fe_write(s->chr, hdr, sizeof(hdr));
+    if (len) {
+        qemu_chr_fe_write(s->chr, data, len);
+    }
+}
+
+/* Carries out the request in s->req.  Returns false if it has to wait for
+ * the endpoint. */
+static bool stm32_otg_run_request(Stm32Otg *s)
+{
+    uint8_t token = s->req[0];
+    uint8_t address = s->req[1];
+    uint8_t n = s->req[2] & 0xf;
+    bool wait = IS_BIT_SET(s->req[3], STM32_USB_LINK_FLAG_WAIT_BIT);
+    int len = lduw_le_p(s->req + 4);
+    uint8_t data[STM32_USB_MAX_PACKET];
+    int handshake;
+
+    if (!stm32_otg_device_connected(s)) {
+        stm32_otg_respond(s, STM32_USB_LINK_NO_RESPONSE, NULL, 0);
+        return true;
+    }
+
+    if (token == STM32_USB_LINK_TOKEN_RESET) {
+        DPRINTF("bus reset\n");
+        stm32_otg_bus_reset(s);
+        stm32_otg_frame_arm(s);
+        stm32_otg_update_irq(s);
+        stm32_otg_respond(s, STM32_USB_LINK_ACK, NULL, 0);
+        return true;
+    }
+
+    if (((s->OTG_DCFG & OTG_DCFG_DAD_MASK) >> OTG_DCFG_DAD_START) != address ||
+        n >= s->ep_count) {
+        stm32_otg_respond(s, STM32_USB_LINK_NO_RESPONSE, NULL, 0);
+        return true;
+    }
+
+    switch (token) {
+        case USB_TOKEN_SETUP:
+            handshake = stm32_otg_setup(s, n,
+                            s->req + STM32_USB_LINK_HEADER_SIZE, len);
+            len = 0;
+            break;
+        case USB_TOKEN_OUT:
+            handshake = stm32_otg_rx(s, n,
+                            s->req + STM32_USB_LINK_HEADER_SIZE, len);
+            len = 0;
+            break;
+        case USB_TOKEN_IN:
+            len = MIN(len, STM32_USB_MAX_PACKET);
+            handshake = stm32_otg_tx(s, n, data, &len);
+            break;
+        default:
+            stm32_hw_warn("stm32_otg: unknown token 0x%02x from the host",
+                          token);
+            handshake = STM32_USB_LINK_NO_RESPONSE;
+            len = 0;
+            break;
+    }
+
+    if (handshake == STM32_USB_LINK_NAK && wait) {
+        return false;
+    }
+
+    DPRINTF("token 0x%02x on EP%d: handshake %d, %d bytes\n", token, n,
+            handshake, len);
+    stm32_otg_update_irq(s);
+    stm32_otg_respond(s, handshake, data, len);
+    return true;
+}
+
+/* Retries a waiting request, once the firmware has changed an endpoint or
+ * a FIFO. */
+static void stm32_otg_retry(Stm32Otg *s)
+{
+    if (s->req_waiting && stm32_otg_run_request(s)) {
+        s->req_waiting = false;
+        s->req_len = 0;
+        qemu_chr_accept_input(s->chr);
+    }
+}
+
+static int stm32_otg_request_size(Stm32Otg *s)
+{
+    int len;
+
+    if (s->req_len < STM32_USB_LINK_HEADER_SIZE) {
+        return STM32_USB_LINK_HEADER_SIZE;
+    }
+    /* The length of an IN request is that of the packet it asks for. */
+    len = s->req[0] == USB_TOKEN_IN ? 0 : lduw_le_p(s->req + 4);
+    return STM32_USB_LINK_HEADER_SIZE + MIN(len, STM32_USB_MAX_PACKET);
+}
+
+static int stm32_otg_can_receive(void *opaque)
+{
+    Stm32Otg *s = (Stm32Otg *)opaque;
+
+    if (s->req_waiting) {
+        return 0;
+    }
+    return stm32_otg_request_size(s) - s->req_len;
+}
+
+static void stm32_otg_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32Otg *s = (Stm32Otg *)opaque;
+    int n;
+
+    while (size > 0 && !s->req_waiting) {
+        n = MIN(size, stm32_otg_request_size(s) - s->req_len);
+        memcpy(s->req + s->req_len, buf, n);
+        s->req_len += n;
+        buf += n;
+        size -= n;
+        if (s->req_len < stm32_otg_request_size(s)) {
+            continue;
+        }
+        if (stm32_otg_run_request(s)) {
+            s->req_len = 0;
+        } else {
+            s->req_waiting = true;
+        }
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+/* Flushes the transmit FIFO numbered by TXFNUM: an endpoint's in device
+ * mode, the non-periodic (0) or periodic (1) one in host mode. */
+static void stm32_otg_tx_flush(Stm32Otg *s, int txfnum)
+{
+    int n;
+
+    if (stm32_otg_is_host(s)) {
+        for (n = 0; n < s->ch_count; n++) {
+            if (txfnum == OTG_TXFNUM_ALL ||
+                stm32_otg_ch_is_periodic(&s->ch[n]) == (txfnum == 1)) {
+                stm32_otg_fifo_flush(&s->tx[n]);
+            }
+        }
+    } else {
+        for (n = 0; n < s->ep_count; n++) {
+            if (txfnum == OTG_TXFNUM_ALL || txfnum == n) {
+                stm32_otg_fifo_flush(&s->tx[n]);
+            }
+        }
+    }
+}
+
+/* The soft reset stops every transfer and flushes the FIFOs, leaving the
+ * configuration alone. */
+static void stm32_otg_soft_reset(Stm32Otg *s)
+{
+    int n;
+
+    for (n = 0; n < s->ch_count; n++) {
+        stm32_otg_ch_cancel(s, n);
+        s->ch[n].HCCHAR &= ~(GET_BIT_MASK_ONE(OTG_HCCHAR_CHENA_BIT) |
+                             GET_BIT_MASK_ONE(OTG_HCCHAR_CHDIS_BIT));
+        s->ch[n].HCINT = 0;
+    }
+    for (n = 0; n < s->ep_count; n++) {
+        RESET_BIT(s->in[n].CTL, OTG_DxEPCTL_EPENA_BIT);
+        RESET_BIT(s->out[n].CTL, OTG_DxEPCTL_EPENA_BIT);
+        s->in[n].INT = 0;
+        s->out[n].INT = 0;
+    }
+    for (n = 0; n < OTG_MAX_CH_COUNT; n++) {
+        stm32_otg_fifo_flush(&s->tx[n]);
+    }
+    stm32_otg_fifo_flush(&s->rx);
+    s->OTG_GINTSTS = 0;
+    s->OTG_GOTGINT = 0;
+}
+
+static void stm32_otg_GRSTCTL_write(Stm32Otg *s, uint32_t new_value)
+{
+    if (IS_BIT_SET(new_value, OTG_GRSTCTL_CSRST_BIT)) {
+        stm32_otg_soft_reset(s);
+    }
+    if (IS_BIT_SET(new_value, OTG_GRSTCTL_HSRST_BIT) &&
+        s->frame_base >= 0) {
+        s->frame_base = qemu_get_clock_ns(vm_clock);
+    }
+    if (IS_BIT_SET(new_value, OTG_GRSTCTL_RXFFLSH_BIT)) {
+        stm32_otg_fifo_flush(&s->rx);
+    }
+    if (IS_BIT_SET(new_value, OTG_GRSTCTL_TXFFLSH_BIT)) {
+        stm32_otg_tx_flush(s, (new_value & OTG_GRSTCTL_TXFNUM_MASK) >>
+                              OTG_GRSTCTL_TXFNUM_START);
+    }
+}
+
+static void stm32_otg_GOTGCTL_write(Stm32Otg *s, uint32_t new_value)
+{
+    s->OTG_GOTGCTL = new_value & OTG_GOTGCTL_MASK;
+
+    /* A session request always succeeds, the host being there. */
+    if (IS_BIT_SET(new_value, OTG_GOTGCTL_SRQ_BIT)) {
+        RESET_BIT(s->OTG_GOTGCTL, OTG_GOTGCTL_SRQ_BIT);
+        SET_BIT(s->OTG_GOTGCTL, OTG_GOTGCTL_SRQSCS_BIT);
+        SET_BIT(s->OTG_GOTGINT, OTG_GOTGINT_SRSSCHG_BIT);
+    }
+}
+
+static uint32_t stm32_otg_GOTGCTL_read(Stm32Otg *s)
+{
+    uint32_t value = s->OTG_GOTGCTL;
+
+    if (s->port.dev == NULL) {
+        SET_BIT(value, OTG_GOTGCTL_CIDSTS_BIT);
+    }
+    if (stm32_otg_is_host(s)) {
+        CHANGE_BIT(value, OTG_GOTGCTL_ASVLD_BIT,
+                   IS_BIT_SET(s->OTG_HPRT, OTG_HPRT_PPWR_BIT));
+    } else if (s->chr) {
+        SET_BIT(value, OTG_GOTGCTL_BSVLD_BIT);
+    }
+    return value;
+}
+
+static void stm32_otg_DCTL_write(Stm32Otg *s, uint32_t new_value)
+{
+    uint32_t status = s->OTG_DCTL & (GET_BIT_MASK_ONE(OTG_DCTL_GINSTS_BIT) |
+                                     GET_BIT_MASK_ONE(OTG_DCTL_GONSTS_BIT));
+
+    if (IS_BIT_SET(new_value, OTG_DCTL_SGINAK_BIT)) {
+        SET_BIT(status, OTG_DCTL_GINSTS_BIT);
+    }
+    if (IS_BIT_SET(new_value, OTG_DCTL_CGINAK_BIT)) {
+        RESET_BIT(status, OTG_DCTL_GINSTS_BIT);
+    }
+    if (IS_BIT_SET(new_value, OTG_DCTL_SGONAK_BIT)) {
+        SET_BIT(status, OTG_DCTL_GONSTS_BIT);
+    }
+    if (IS_BIT_SET(new_value, OTG_DCTL_CGONAK_BIT)) {
+        RESET_BIT(status, OTG_DCTL_GONSTS_BIT);
+    }
+    s->OTG_DCTL = (new_value & OTG_DCTL_MASK) | status;
+}
+
+static uint32_t stm32_otg_DSTS_read(Stm32Otg *s)
+{
+    return (OTG_ENUMSPD_FS_48MHZ << OTG_DSTS_ENUMSPD_START) |
+           ((stm32_otg_frame_number(s) & 0x3fff) << OTG_DSTS_FNSOF_START);
+}
+
+/* Reads of any FIFO window pop the receive FIFO. */
+static uint32_t stm32_otg_fifo_read(Stm32Otg *s)
+{
+    uint32_t value = stm32_otg_fifo_pop(&s->rx);
+
+    stm32_otg_host_run(s);
+    return value;
+}
+
+static void stm32_otg_fifo_write(Stm32Otg *s, int n, uint32_t value)
+{
+    unsigned free;
+
+    if (stm32_otg_is_host(s)) {
+        if (n >= s->ch_count) {
+            return;
+        }
+        free = stm32_otg_host_tx_free(s,
+                                      stm32_otg_ch_is_periodic(&s->ch[n]));
+    } else {
+        if (n >= s->ep_count) {
+            return;
+        }
+        free = stm32_otg_ep_tx_free(s, n);
+    }
+    if (free == 0) {
+        stm32_hw_warn("stm32_otg: write to full transmit FIFO %d", n);
+        return;
+    }
+    stm32_otg_fifo_push(&s->tx[n], value);
+    if (stm32_otg_is_host(s)) {
+        while (stm32_otg_ch_step(s, n)) {
+        }
+    }
+}
+
+static uint64_t stm32_otg_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Otg *s = (Stm32Otg *)opaque;
+    uint64_t value;
+    int n;
+
+    if (offset >= OTG_FIFO_OFFSET &&
+        offset < OTG_FIFO_OFFSET + OTG_MAX_CH_COUNT * OTG_FIFO_SIZE) {
+        value = stm32_otg_fifo_read(s);
+        stm32_otg_retry(s);
+        stm32_otg_update_irq(s);
+        trace_stm32_otg_read(s, offset, size, value);
+        return value;
+    }
+
+    if (offset >= OTG_HC_OFFSET &&
+        offset < OTG_HC_OFFSET + OTG_HC_SIZE * s->ch_count) {
+        Stm32OtgChannel *ch = &s->ch[(offset - OTG_HC_OFFSET) / OTG_HC_SIZE];
+
+        switch (offset % OTG_HC_SIZE) {
+            case OTG_HCCHAR:
+                value = ch->HCCHAR;
+                break;
+            case OTG_HCSPLT:
+                value = ch->HCSPLT;
+                break;
+            case OTG_HCINT:
+                value = ch->HCINT;
+                break;
+            case OTG_HCINTMSK:
+                value = ch->HCINTMSK;
+                break;
+            case OTG_HCTSIZ:
+                value = ch->HCTSIZ;
+                break;
+            case OTG_HCDMA:
+                value = ch->HCDMA;
+                break;
+            default:
+                value = 0;
+                break;
+        }
+        trace_stm32_otg_read(s, offset, size, value);
+        return value;
+    }
+
+    if ((offset >= OTG_DIEP_OFFSET &&
+         offset < OTG_DIEP_OFFSET + OTG_EP_SIZE * s->ep_count) ||
+        (offset >= OTG_DOEP_OFFSET &&
+         offset < OTG_DOEP_OFFSET + OTG_EP_SIZE * s->ep_count)) {
+        bool in = offset < OTG_DOEP_OFFSET;
+        Stm32OtgEp *ep;
+
+        n = (offset - (in ? OTG_DIEP_OFFSET : OTG_DOEP_OFFSET)) / OTG_EP_SIZE;
+        ep = in ? &s->in[n] : &s->out[n];
+        switch (offset % OTG_EP_SIZE) {
+            case OTG_DxEPCTL:
+                value = ep->CTL;
+                break;
+            case OTG_DxEPINT:
+                value = in ? stm32_otg_DIEPINT_read(s, n) : ep->INT;
+                break;
+            case OTG_DxEPTSIZ:
+                value = ep->TSIZ;
+                break;
+            case OTG_DxEPDMA:
+                value = ep->DMA;
+                break;
+            case OTG_DTXFSTS:
+                value = in ? stm32_otg_ep_tx_free(s, n) : 0;
+                break;
+            default:
+                value = 0;
+                break;
+        }
+        trace_stm32_otg_read(s, offset, size, value);
+        return value;
+    }
+
+    if (offset >= OTG_DIEPTXF_OFFSET &&
+        offset < OTG_DIEPTXF_OFFSET + 4 * (s->ep_count - 1)) {
+        value = s->OTG_DIEPTXF[(offset - OTG_DIEPTXF_OFFSET) / 4 + 1];
+        trace_stm32_otg_read(s, offset, size, value);
+        return value;
+    }
+
+    switch (offset) {
+        case OTG_GOTGCTL_OFFSET:
+            value = stm32_otg_GOTGCTL_read(s);
+            break;
+        case OTG_GOTGINT_OFFSET:
+            value = s->OTG_GOTGINT;
+            break;
+        case OTG_GAHBCFG_OFFSET:
+            value = s->OTG_GAHBCFG;
+            break;
+        case OTG_GUSBCFG_OFFSET:
+            value = s->OTG_GUSBCFG;
+            break;
+        case OTG_GRSTCTL_OFFSET:
+            /* Resets and flushes are done at once. */
+            value = GET_BIT_MASK_ONE(OTG_GRSTCTL_AHBIDL_BIT);
+            break;
+        case OTG_GINTSTS_OFFSET:
+            value = stm32_otg_GINTSTS_read(s);
+            break;
+        case OTG_GINTMSK_OFFSET:
+            value = s->OTG_GINTMSK;
+            break;
+        case OTG_GRXSTSR_OFFSET:
+            value = stm32_otg_fifo_peek(&s->rx);
+            break;
+        case OTG_GRXSTSP_OFFSET:
+            value = stm32_otg_fifo_pop(&s->rx);
+            stm32_otg_rx_popped(s, value);
+            stm32_otg_host_run(s);
+            stm32_otg_retry(s);
+            stm32_otg_update_irq(s);
+            break;
+        case OTG_GRXFSIZ_OFFSET:
+            value = s->OTG_GRXFSIZ;
+            break;
+        case OTG_GNPTXFSIZ_OFFSET:
+            value = s->OTG_GNPTXFSIZ;
+            break;
+        case OTG_GNPTXSTS_OFFSET:
+            value = (OTG_TXQ_FREE << 16) |
+                    (stm32_otg_is_host(s) ? stm32_otg_host_tx_free(s, false) :
+                                            stm32_otg_ep_tx_free(s, 0));
+            break;
+        case OTG_GCCFG_OFFSET:
+            value = s->OTG_GCCFG;
+            break;
+        case OTG_CID_OFFSET:
+            value = s->OTG_CID;
+            break;
+        case OTG_HPTXFSIZ_OFFSET:
+            value = s->OTG_HPTXFSIZ;
+            break;
+        case OTG_HCFG_OFFSET:
+            value = s->OTG_HCFG;
+            break;
+        case OTG_HFIR_OFFSET:
+            value = s->OTG_HFIR;
+            break;
+        case OTG_HFNUM_OFFSET:
+            value = stm32_otg_HFNUM_read(s);
+            break;
+        case OTG_HPTXSTS_OFFSET:
+            value = (OTG_TXQ_FREE << 16) | stm32_otg_host_tx_free(s, true);
+            break;
+        case OTG_HAINT_OFFSET:
+            value = stm32_otg_HAINT_read(s);
+            break;
+        case OTG_HAINTMSK_OFFSET:
+            value = s->OTG_HAINTMSK;
+            break;
+        case OTG_HPRT_OFFSET:
+            value = stm32_otg_HPRT_read(s);
+            break;
+        case OTG_DCFG_OFFSET:
+            value = s->OTG_DCFG;
+            break;
+        case OTG_DCTL_OFFSET:
+            value = s->OTG_DCTL;
+            break;
+        case OTG_DSTS_OFFSET:
+            value = stm32_otg_DSTS_read(s);
+            break;
+        case OTG_DIEPMSK_OFFSET:
+            value = s->OTG_DIEPMSK;
+            break;
+        case OTG_DOEPMSK_OFFSET:
+            value = s->OTG_DOEPMSK;
+            break;
+        case OTG_DAINT_OFFSET:
+            value = stm32_otg_DAINT_read(s);
+            break;
+        case OTG_DAINTMSK_OFFSET:
+            value = s->OTG_DAINTMSK;
+            break;
+        case OTG_DVBUSDIS_OFFSET:
+            value = s->OTG_DVBUSDIS;
+            break;
+        case OTG_DVBUSPULSE_OFFSET:
+            value = s->OTG_DVBUSPULSE;
+            break;
+        case OTG_DIEPEMPMSK_OFFSET:
+            value = s->OTG_DIEPEMPMSK;
+            break;
+        case OTG_DTHRCTL_OFFSET:
+            value = s->OTG_DTHRCTL;
+            break;
+        case OTG_DEACHINT_OFFSET:
+            /* The dedicated EP1 interrupts are not raised. */
+            value = 0;
+            break;
+        case OTG_DEACHINTMSK_OFFSET:
+            value = s->OTG_DEACHINTMSK;
+            break;
+        case OTG_DIEPEACHMSK1_OFFSET:
+            value = s->OTG_DIEPEACHMSK1;
+            break;
+        case OTG_DOEPEACHMSK1_OFFSET:
+            value = s->OTG_DOEPEACHMSK1;
+            break;
+        case OTG_PCGCCTL_OFFSET:
+            value = s->OTG_PCGCCTL;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_otg_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_otg_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Otg *s = (Stm32Otg *)opaque;
+    int n;
+
+    trace_stm32_otg_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    if (offset >= OTG_FIFO_OFFSET &&
+        offset < OTG_FIFO_OFFSET + OTG_MAX_CH_COUNT * OTG_FIFO_SIZE) {
+        stm32_otg_fifo_write(s, (offset - OTG_FIFO_OFFSET) / OTG_FIFO_SIZE,
+                             value);
+    } else if (offset >= OTG_HC_OFFSET &&
+               offset < OTG_HC_OFFSET + OTG_HC_SIZE * s->ch_count) {
+        Stm32OtgChannel *ch;
+
+        n = (offset - OTG_HC_OFFSET) / OTG_HC_SIZE;
+        ch = &s->ch[n];
+        switch (offset % OTG_HC_SIZE) {
+            case OTG_HCCHAR:
+                stm32_otg_HCCHAR_write(s, n, value);
+                break;
+            case OTG_HCSPLT:
+                ch->HCSPLT = s->hs ? value & 0x8001ffff : 0;
+                break;
+            case OTG_HCINT:
+                ch->HCINT &= ~value;
+                break;
+            case OTG_HCINTMSK:
+                ch->HCINTMSK = value & OTG_HCINT_MASK;
+                break;
+            case OTG_HCTSIZ:
+                ch->HCTSIZ = value;
+                break;
+            case OTG_HCDMA:
+                ch->HCDMA = s->hs ? value : 0;
+                break;
+        }
+    } else if ((offset >= OTG_DIEP_OFFSET &&
+                offset < OTG_DIEP_OFFSET + OTG_EP_SIZE * s->ep_count) ||
+               (offset >= OTG_DOEP_OFFSET &&
+                offset < OTG_DOEP_OFFSET + OTG_EP_SIZE * s->ep_count)) {
+        bool in = offset < OTG_DOEP_OFFSET;
+        Stm32OtgEp *ep;
+
+        n = (offset - (in ? OTG_DIEP_OFFSET : OTG_DOEP_OFFSET)) / OTG_EP_SIZE;
+        ep = in ? &s->in[n] : &s->out[n];
+        switch (offset % OTG_EP_SIZE) {
+            case OTG_DxEPCTL:
+                stm32_otg_DxEPCTL_write(s, ep, n, in, value);
+                break;
+            case OTG_DxEPINT:
+                ep->INT &= ~(value & (in ? OTG_DIEPINT_MASK :
+                                           OTG_DOEPINT_MASK));
+                break;
+            case OTG_DxEPTSIZ:
+                stm32_otg_DxEPTSIZ_write(ep, n, in, value);
+                break;
+            case OTG_DxEPDMA:
+                ep->DMA = s->hs ? value : 0;
+                break;
+        }
+    } else if (offset >= OTG_DIEPTXF_OFFSET &&
+               offset < OTG_DIEPTXF_OFFSET + 4 * (s->ep_count - 1)) {
+        s->OTG_DIEPTXF[(offset - OTG_DIEPTXF_OFFSET) / 4 + 1] = value;
+    } else {
+        switch (offset) {
+            case OTG_GOTGCTL_OFFSET:
+                stm32_otg_GOTGCTL_write(s, value);
+                break;
+            case OTG_GOTGINT_OFFSET:
+                s->OTG_GOTGINT &= ~(value & OTG_GOTGINT_MASK);
+                break;
+            case OTG_GAHBCFG_OFFSET:
+                s->OTG_GAHBCFG = value & (s->hs ? OTG_GAHBCFG_HS_MASK :
+                                                  OTG_GAHBCFG_FS_MASK);
+                break;
+            case OTG_GUSBCFG_OFFSET:
+                s->OTG_GUSBCFG = value & OTG_GUSBCFG_MASK;
+                if (!s->hs) {
+                    /* The FS core only has the embedded PHY. */
+                    SET_BIT(s->OTG_GUSBCFG, OTG_GUSBCFG_PHYSEL_BIT);
+                }
+                break;
+            case OTG_GRSTCTL_OFFSET:
+                stm32_otg_GRSTCTL_write(s, value);
+                break;
+            case OTG_GINTSTS_OFFSET:
+                s->OTG_GINTSTS &= ~(value & OTG_GINTSTS_W1C_MASK);
+                break;
+            case OTG_GINTMSK_OFFSET:
+                s->OTG_GINTMSK = value & OTG_GINTMSK_MASK;
+                break;
+            case OTG_GRXSTSR_OFFSET:
+            case OTG_GRXSTSP_OFFSET:
+            case OTG_GNPTXSTS_OFFSET:
+            case OTG_HFNUM_OFFSET:
+            case OTG_HPTXSTS_OFFSET:
+            case OTG_HAINT_OFFSET:
+            case OTG_DSTS_OFFSET:
+            case OTG_DAINT_OFFSET:
+                STM32_RO_REG(offset);
+                break;
+            case OTG_GRXFSIZ_OFFSET:
+                s->OTG_GRXFSIZ = value & 0xffff;
+                break;
+            case OTG_GNPTXFSIZ_OFFSET:
+                s->OTG_GNPTXFSIZ = value;
+                break;
+            case OTG_GCCFG_OFFSET:
+                s->OTG_GCCFG = value & OTG_GCCFG_MASK;
+                break;
+            case OTG_CID_OFFSET:
+                s->OTG_CID = value;
+                break;
+            case OTG_HPTXFSIZ_OFFSET:
+                s->OTG_HPTXFSIZ = value;
+                break;
+            case OTG_HCFG_OFFSET:
+                s->OTG_HCFG = (value & OTG_HCFG_MASK) |
+                              GET_BIT_MASK(OTG_HCFG_FSLSS_BIT, !s->hs);
+                break;
+            case OTG_HFIR_OFFSET:
+                s->OTG_HFIR = value & 0xffff;
+                break;
+            case OTG_HAINTMSK_OFFSET:
+                s->OTG_HAINTMSK = value & 0xffff;
+                break;
+            case OTG_HPRT_OFFSET:
+                stm32_otg_HPRT_write(s, value);
+                break;
+            case OTG_DCFG_OFFSET:
+                s->OTG_DCFG = value & OTG_DCFG_MASK;
+                break;
+            case OTG_DCTL_OFFSET:
+                stm32_otg_DCTL_write(s, value);
+                break;
+            case OTG_DIEPMSK_OFFSET:
+                s->OTG_DIEPMSK = value & OTG_DIEPINT_MASK;
+                break;
+            case OTG_DOEPMSK_OFFSET:
+                s->OTG_DOEPMSK = value & OTG_DOEPINT_MASK;
+                break;
+            case OTG_DAINTMSK_OFFSET:
+                s->OTG_DAINTMSK = value;
+                break;
+            case OTG_DVBUSDIS_OFFSET:
+                s->OTG_DVBUSDIS = value & 0xffff;
+                break;
+            case OTG_DVBUSPULSE_OFFSET:
+                s->OTG_DVBUSPULSE = value & 0xfff;
+                break;
+            case OTG_DIEPEMPMSK_OFFSET:
+                s->OTG_DIEPEMPMSK = value & 0xffff;
+                break;
+            case OTG_DTHRCTL_OFFSET:
+                s->OTG_DTHRCTL = value;
+                break;
+            case OTG_DEACHINT_OFFSET:
+                break;
+            case OTG_DEACHINTMSK_OFFSET:
+                s->OTG_DEACHINTMSK = value;
+                break;
+            case OTG_DIEPEACHMSK1_OFFSET:
+                s->OTG_DIEPEACHMSK1 = value;
+                break;
+            case OTG_DOEPEACHMSK1_OFFSET:
+                s->OTG_DOEPEACHMSK1 = value;
+                break;
+            case OTG_PCGCCTL_OFFSET:
+                s->OTG_PCGCCTL = value & OTG_PCGCCTL_MASK;
+                break;
+            default:
+                STM32_BAD_REG(offset, size);
+                break;
+        }
+    }
+
+    stm32_otg_frame_arm(s);
+    stm32_otg_update_irq(s);
+    stm32_otg_retry(s);
+}
+
+static const MemoryRegionOps stm32_otg_ops = {
+    .read = stm32_otg_read,
+    .write = stm32_otg_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_otg_reset(DeviceState *dev)
+{
+    Stm32Otg *s = FROM_SYSBUS(Stm32Otg, SYS_BUS_DEVICE(dev));
+    int n;
+
+    stm32_otg_soft_reset(s);
+
+    s->OTG_GOTGCTL = 0;
+    s->OTG_GAHBCFG = 0;
+    s->OTG_GUSBCFG = OTG_GUSBCFG_RESET |
+                     GET_BIT_MASK(OTG_GUSBCFG_PHYSEL_BIT, !s->hs);
+    s->OTG_GINTMSK = 0;
+    s->OTG_GRXFSIZ = OTG_FIFO_SIZE_RESET;
+    s->OTG_GNPTXFSIZ = OTG_FIFO_SIZE_RESET;
+    s->OTG_GCCFG = 0;
+    s->OTG_CID = s->hs ? OTG_CID_HS_RESET : OTG_CID_FS_RESET;
+    s->OTG_HPTXFSIZ = OTG_HPTXFSIZ_RESET;
+    for (n = 1; n < OTG_MAX_EP_COUNT; n++) {
+        s->OTG_DIEPTXF[n] = OTG_DIEPTXF_RESET;
+    }
+
+    s->OTG_HCFG = GET_BIT_MASK(OTG_HCFG_FSLSS_BIT, !s->hs);
+    s->OTG_HFIR = OTG_HFIR_RESET;
+    s->OTG_HAINTMSK = 0;
+    s->OTG_HPRT = 0;
+    for (n = 0; n < OTG_MAX_CH_COUNT; n++) {
+        s->ch[n].HCCHAR = 0;
+        s->ch[n].HCSPLT = 0;
+        s->ch[n].HCINTMSK = 0;
+        s->ch[n].HCTSIZ = 0;
+        s->ch[n].HCDMA = 0;
+    }
+
+    s->OTG_DCFG = OTG_DCFG_RESET;
+    s->OTG_DCTL = 0;
+    s->OTG_DIEPMSK = 0;
+    s->OTG_DOEPMSK = 0;
+    s->OTG_DAINTMSK = 0;
+    s->OTG_DVBUSDIS = OTG_DVBUSDIS_RESET;
+    s->OTG_DVBUSPULSE = OTG_DVBUSPULSE_RESET;
+    s->OTG_DTHRCTL = 0;
+    s->OTG_DIEPEMPMSK = 0;
+    s->OTG_DEACHINTMSK = 0;
+    s->OTG_DIEPEACHMSK1 = 0;
+    s->OTG_DOEPEACHMSK1 = 0;
+    for (n = 0; n < OTG_MAX_EP_COUNT; n++) {
+        s->in[n].CTL = 0;
+        s->in[n].TSIZ = 0;
+        s->in[n].DMA = 0;
+        s->out[n].CTL = 0;
+        s->out[n].TSIZ = 0;
+        s->out[n].DMA = 0;
+    }
+    SET_BIT(s->in[0].CTL, OTG_DxEPCTL_USBAEP_BIT);
+    SET_BIT(s->out[0].CTL, OTG_DxEPCTL_USBAEP_BIT);
+
+    s->OTG_PCGCCTL = 0;
+
+    s->host_mode = stm32_otg_is_host(s);
+    s->frame_base = -1;
+    qemu_del_timer(s->frame_timer);
+
+    stm32_otg_update_irq(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_otg_instance_init(Object *obj)
+{
+    Stm32Otg *s = FROM_SYSBUS(Stm32Otg, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_otg_init(SysBusDevice *dev)
+{
+    Stm32Otg *s = FROM_SYSBUS(Stm32Otg, dev);
+    int n;
+
+    if (s->hs) {
+        s->ep_count = OTG_HS_EP_COUNT;
+        s->ch_count = OTG_HS_CH_COUNT;
+        s->fifo_words = OTG_HS_FIFO_WORDS;
+    } else {
+        s->ep_count = OTG_FS_EP_COUNT;
+        s->ch_count = OTG_FS_CH_COUNT;
+        s->fifo_words = OTG_FS_FIFO_WORDS;
+    }
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_otg_ops, s,
+                          "otg", 0x40000);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+
+    for (n = 0; n < OTG_MAX_CH_COUNT; n++) {
+        usb_packet_init(&s->ch[n].packet);
+    }
+    usb_bus_new(&s->bus, &stm32_otg_bus_ops, DEVICE(dev));
+    usb_register_port(&s->bus, &s->port, s, 0, &stm32_otg_port_ops,
+                      USB_SPEED_MASK_LOW | USB_SPEED_MASK_FULL |
+                      (s->hs ? USB_SPEED_MASK_HIGH : 0));
+
+    s->frame_timer = qemu_new_timer_ns(vm_clock,
+                                       stm32_otg_frame_timer_expire, s);
+
+    if (s->chr) {
+        qemu_chr_add_handlers(s->chr, stm32_otg_can_receive,
+                              stm32_otg_receive, NULL, s);
+        replay_register_char_driver(s->chr);
+    }
+
+    return 0;
+}
+
+static Property stm32_otg_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Otg, periph, -1),
+    DEFINE_PROP_CHR("chardev", Stm32Otg, chr),
+    DEFINE_PROP_BIT("hs", Stm32Otg, hs, 0, false),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_otg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_otg_init;
+    dc->reset = stm32_otg_reset;
+    dc->props = stm32_otg_properties;
+}
+
+static TypeInfo stm32_otg_info = {
+    .name  = "stm32_otg",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Otg),
+    .instance_init = stm32_otg_instance_init,
+    .class_init = stm32_otg_class_init
+};
+
+static void stm32_otg_register_types(void)
+{
+    type_register_static(&stm32_otg_info);
+}
+
+type_init(stm32_otg_register_types)
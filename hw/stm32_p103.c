@@ -27,6 +27,13 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "boards.h"
+#include "ssi.h"
+#include "sysemu/blockdev.h"
+#include "sysemu/cpus.h"
+#include "char/char.h"
+#include "qemu/config-file.h"
+#include "gpio_indicator.h"
+#include "ili9341.h"
 
 
 typedef struct {
@@ -39,24 +46,6 @@ typedef struct {
 
 
 
-static void led_irq_handler(void *opaque, int n, int level)
-{
-    /* There should only be one IRQ for the LED */
-    assert(n == 0);
-
-    /* Assume that the IRQ is only triggered if the LED has changed state.
-     * If this is not correct, we may get multiple LED Offs or Ons in a row.
-     */
-    switch (level) {
-        case 0:
-            printf("LED Off\n");
-            break;
-        case 1:
-            printf("LED On\n");
-            break;
-    }
-}
-
 static void stm32_p103_key_event(void *opaque, int keycode)
 {
     Stm32P103 *s = (Stm32P103 *)opaque;
@@ -92,26 +81,40 @@ static void stm32_p103_key_event(void *opaque, int keycode)
 }
 
 
+/* With "-machine lcd=on", an ILI9341 on FSMC NE1, its D/CX on A16 (the
+ * command register at 0x60000000, the data register at 0x60020000), as on
+ * many evaluation boards with a 320x240 TFT module. */
+#define STM32_P103_LCD_BANK 0
+#define STM32_P103_LCD_RS_BIT 17
+
 static void stm32_p103_init(QEMUMachineInitArgs *args) {
     
-    qemu_irq *led_irq;
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    DeviceState *led_dev;
+    DeviceState *lcd_dev;
     Stm32P103 *s;
     Stm32Gpio *stm32_gpio[STM32F1XX_GPIO_COUNT];
     Stm32Uart *stm32_uart[STM32_UART_COUNT];
+    Stm32Spi *stm32_spi[STM32F1XX_SPI_COUNT];
+    Stm32I2c *stm32_i2c[STM32F1XX_I2C_COUNT];
+    Stm32Fsmc *stm32_fsmc;
 
     s = (Stm32P103 *)g_malloc0(sizeof(Stm32P103));
 
-    stm32f1xx_init(/*flash_size*/ 128,
-               /*ram_size*/ 20,
+    stm32f1xx_init(0,
+               stm32_get_part(stm32f1xx_parts),
                args->kernel_filename,
                stm32_gpio,
                stm32_uart,
+               stm32_spi,
+               stm32_i2c,
+               &stm32_fsmc,
                8000000,
                32768);
 
     /* Connect LED to GPIO C pin 12 */
-    led_irq = qemu_allocate_irqs(led_irq_handler, NULL, 1);
-    qdev_connect_gpio_out((DeviceState *)stm32_gpio[STM32_GPIOC_INDEX], 12, led_irq[0]);
+    led_dev = gpio_indicator_create("led");
+    qdev_connect_gpio_out((DeviceState *)stm32_gpio[STM32_GPIOC_INDEX], 12, qdev_get_gpio_in(led_dev, 0));
 
     /* Connect button to GPIO A pin 0 */
     s->button_irq = qdev_get_gpio_in((DeviceState *)stm32_gpio[STM32_GPIOA_INDEX], 0);
@@ -122,18 +125,152 @@ static void stm32_p103_init(QEMUMachineInitArgs *args) {
             stm32_uart[STM32_UART2_INDEX],
             serial_hds[0],
             STM32_USART2_NO_REMAP);
+
+    /* Connect a serial flash to SPI1 if "-drive if=mtd" was given, with its
+     * chip select on GPIO A pin 4 (NSS). */
+    if (drive_get(IF_MTD, 0, 0)) {
+        DeviceState *flash_dev = ssi_create_slave(
+                stm32_spi_get_bus(stm32_spi[STM32_SPI1_INDEX]), "m25p80");
+        qdev_connect_gpio_out((DeviceState *)stm32_gpio[STM32_GPIOA_INDEX], 4,
+                              qdev_get_gpio_in(flash_dev, 0));
+    }
+
+    if (machine_opts && qemu_opt_get_bool(machine_opts, "lcd", false)) {
+        if (!stm32_fsmc) {
+            fprintf(stderr, "stm32-p103: the part has no FSMC for the LCD\n");
+            exit(1);
+        }
+        lcd_dev = ili9341_create(STM32_P103_LCD_RS_BIT);
+        stm32_fsmc_attach(stm32_fsmc, STM32_P103_LCD_BANK,
+                          sysbus_mmio_get_region(SYS_BUS_DEVICE(lcd_dev), 0),
+                          ili9341_burst_write, lcd_dev);
+    }
  }
 
+/* Several P103 boards in one process, chained by their serial ports:
+ * USART1 of each node is wired to USART3 of the next one, the last node
+ * wrapping around to the first.  USART2 of node n goes to the nth -serial
+ * port, as on the single board.  Node n gets its flash from
+ * "-drive if=pflash,index=n", or else from -kernel if that is a raw image.
+ */
+#define STM32_P103_MULTI_DEFAULT_NODES 2
+#define STM32_P103_MULTI_DEFAULT_QUANTUM 10000 /* ns */
+
+static int stm32_p103_multi_nodes(void)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    int nodes = STM32_P103_MULTI_DEFAULT_NODES;
+
+    if (machine_opts) {
+        nodes = qemu_opt_get_number(machine_opts, "nodes", nodes);
+    }
+    if (nodes < 1 || nodes > STM32_NODE_MAX) {
+        fprintf(stderr, "stm32-p103-multi: nodes must be between 1 and %d\n",
+                STM32_NODE_MAX);
+        exit(1);
+    }
+    return nodes;
+}
+
+/* The nodes share one translation buffer */
+static size_t stm32_p103_multi_tb_size(void)
+{
+    return stm32_part_tb_size(stm32_get_part(stm32f1xx_parts)) *
+           stm32_p103_multi_nodes();
+}
+
+static void stm32_p103_multi_init(QEMUMachineInitArgs *args)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    const Stm32Part *part = stm32_get_part(stm32f1xx_parts);
+    Stm32Gpio *stm32_gpio[STM32F1XX_GPIO_COUNT];
+    Stm32Uart *stm32_uart[STM32_NODE_MAX][STM32_UART_COUNT];
+    Stm32Spi *stm32_spi[STM32F1XX_SPI_COUNT];
+    Stm32I2c *stm32_i2c[STM32F1XX_I2C_COUNT];
+    Stm32Fsmc *stm32_fsmc;
+    CharDriverState *link[2];
+    DeviceState *led_dev;
+    char *led_name;
+    int nodes = stm32_p103_multi_nodes();
+    int64_t quantum = STM32_P103_MULTI_DEFAULT_QUANTUM;
+    int n;
+
+    if (machine_opts) {
+        quantum = qemu_opt_get_number(machine_opts, "quantum", quantum);
+    }
+    cpu_set_lockstep_quantum(quantum);
+
+    /* Every node boots the same image; a raw binary is mapped into each
+       node's flash, an ELF can only be loaded into node 0.  */
+    for (n = 0; n < nodes; n++) {
+        stm32f1xx_init(n,
+                   part,
+                   args->kernel_filename,
+                   stm32_gpio,
+                   stm32_uart[n],
+                   stm32_spi,
+                   stm32_i2c,
+                   &stm32_fsmc,
+                   8000000,
+                   32768);
+
+        led_name = g_strdup_printf("node%d-led", n);
+        led_dev = gpio_indicator_create(led_name);
+        g_free(led_name);
+        qdev_connect_gpio_out((DeviceState *)stm32_gpio[STM32_GPIOC_INDEX], 12,
+                              qdev_get_gpio_in(led_dev, 0));
+
+        if (n < MAX_SERIAL_PORTS && serial_hds[n]) {
+            stm32_uart_connect(stm32_uart[n][STM32_UART2_INDEX],
+                               serial_hds[n], STM32_USART2_NO_REMAP);
+        }
+    }
+
+    for (n = 0; nodes > 1 && n < nodes; n++) {
+        qemu_chr_open_pair(&link[0], &link[1]);
+        stm32_uart_connect(stm32_uart[n][STM32_UART1_INDEX], link[0],
+                           STM32_USART1_NO_REMAP);
+        stm32_uart_connect(stm32_uart[(n + 1) % nodes][STM32_UART3_INDEX],
+                           link[1], STM32_USART3_NO_REMAP);
+    }
+}
+
+static size_t stm32_p103_tb_size(void)
+{
+    return stm32_part_tb_size(stm32_get_part(stm32f1xx_parts));
+}
+
 static QEMUMachine stm32_p103_machine = {
     .name = "stm32-p103",
     .desc = "Olimex STM32 p103 Dev Board",
-    .init = stm32_p103_init
+    .init = stm32_p103_init,
+    .tb_size = stm32_p103_tb_size,
+    /* The board has none of these, so do not create default backends for
+     * them. */
+    .no_parallel = 1,
+    .no_floppy = 1,
+    .no_cdrom = 1,
+    .no_sdcard = 1,
+    .no_net = 1,
 };
 
 
+static QEMUMachine stm32_p103_multi_machine = {
+    .name = "stm32-p103-multi",
+    .desc = "Several Olimex STM32 p103 Dev Boards linked by their USARTs",
+    .init = stm32_p103_multi_init,
+    .tb_size = stm32_p103_multi_tb_size,
+    .no_parallel = 1,
+    .no_floppy = 1,
+    .no_cdrom = 1,
+    .no_sdcard = 1,
+    .no_net = 1,
+};
+
 static void stm32_p103_machine_init(void)
 {
     qemu_register_machine(&stm32_p103_machine);
+    qemu_register_machine(&stm32_p103_multi_machine);
 }
 
 machine_init(stm32_p103_machine_init);
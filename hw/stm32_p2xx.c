@@ -32,24 +32,6 @@ typedef struct {
 
 
 
-static void led_irq_handler(void *opaque, int n, int level)
-{
-    /* There should only be one IRQ for the LED */
-    assert(n == 0);
-
-    /* Assume that the IRQ is only triggered if the LED has changed state.
-     * If this is not correct, we may get multiple LED Offs or Ons in a row.
-     */
-    switch (level) {
-        case 0:
-            printf("LED Off\n");
-            break;
-        case 1:
-            printf("LED On\n");
-            break;
-    }
-}
-
 static void stm32_p205_key_event(void *opaque, int keycode)
 {
     Stm32P205 *s = (Stm32P205 *)opaque;
@@ -87,15 +69,15 @@ static void stm32_p205_key_event(void *opaque, int keycode)
 
 static void stm32_p205_init(QEMUMachineInitArgs *args) {
     
-//    qemu_irq *led_irq;
+//    DeviceState *led_dev;
     Stm32P205 *s;
     Stm32Gpio *stm32_gpio[STM32F2XX_GPIO_COUNT];
     Stm32Uart *stm32_uart[STM32_UART_COUNT];
 
     s = (Stm32P205 *)g_malloc0(sizeof(Stm32P205));
 
-    stm32f2xx_init(/*flash_size*/ 1024,
-               /*ram_size*/ 128,
+    stm32f2xx_init(stm32_get_part(stm32f2xx_parts),
+               args->cpu_model,
                args->kernel_filename,
                stm32_gpio,
                stm32_uart,
@@ -103,24 +85,36 @@ static void stm32_p205_init(QEMUMachineInitArgs *args) {
                32768);
 
 //    /* Connect LED to GPIO C pin 12 */
-//    led_irq = qemu_allocate_irqs(led_irq_handler, NULL, 1);
-//    qdev_connect_gpio_out((DeviceState *)stm32_gpio[STM32_GPIOC_INDEX], 12, led_irq[0]);
+//    led_dev = gpio_indicator_create("led");
+//    qdev_connect_gpio_out((DeviceState *)stm32_gpio[STM32_GPIOC_INDEX], 12, qdev_get_gpio_in(led_dev, 0));
 //
 //    /* Connect button to GPIO A pin 0 */
 //    s->button_irq = qdev_get_gpio_in((DeviceState *)stm32_gpio[STM32_GPIOA_INDEX], 0);
 //    qemu_add_kbd_event_handler(stm32_p205_key_event, s);
 
     /* Connect RS232 to UART */
-//    stm32_uart_connect(
-//            stm32_uart[STM32_UART2_INDEX],
-//            serial_hds[0],
-//            STM32_USART2_NO_REMAP);
+    stm32_uart_connect(
+            stm32_uart[STM32_UART2_INDEX],
+            serial_hds[0],
+            STM32_USART2_NO_REMAP);
  }
 
+static size_t stm32_p205_tb_size(void)
+{
+    return stm32_part_tb_size(stm32_get_part(stm32f2xx_parts));
+}
+
 static QEMUMachine stm32_p205_machine = {
     .name = "stm32-p205",
     .desc = "Olimex STM32 p205 Dev Board",
-    .init = stm32_p205_init
+    .init = stm32_p205_init,
+    .tb_size = stm32_p205_tb_size,
+    /* The board has none of these, so do not create default backends for
+     * them. */
+    .no_parallel = 1,
+    .no_floppy = 1,
+    .no_cdrom = 1,
+    .no_sdcard = 1,
 };
 
 
@@ -0,0 +1,322 @@
+/*
+ * STM32 Microcontroller GPIO pin bus
+ *
+ * Streams GPIO output changes to a character device and applies input
+ * events received from it, so that an external test harness can follow and
+ * drive the pins without going through the monitor.
+ *
+ * Every record is 16 bytes, little endian:
+ *
+ *   offset  size  field
+ *        0     8  vm_clock time of the change, in ns (ignored on input)
+ *        8     1  port (0 = GPIOA, 1 = GPIOB, ...)
+ *        9     1  flags (output only, see PINBUS_FLAG_*)
+ *       10     2  mask of the pins that changed / are to be changed
+ *       12     2  pin values (only the bits in mask are meaningful)
+ *       14     2  reserved, must be zero
+ *
+ * Output records are queued in a ring buffer and written out from a bottom
+ * half, so the CPU never waits on the chardev.  If the ring fills up, a new
+ * change is merged into the newest queued record of the same port (and
+ * PINBUS_FLAG_COALESCED is set), or the oldest record is dropped (and
+ * PINBUS_FLAG_OVERFLOW is set on the next record).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "char/char.h"
+#include "sysemu/replay.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_PINBUS
+
+#ifdef DEBUG_STM32_PINBUS
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_PINBUS: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define PINBUS_RECORD_SIZE 16
+
+/* Intermediate edges of one or more pins in mask were lost. */
+#define PINBUS_FLAG_COALESCED_BIT 0
+/* Older records were dropped before this one. */
+#define PINBUS_FLAG_OVERFLOW_BIT 1
+
+/* Number of records in the output ring buffer (must be a power of 2) */
+#define PINBUS_RING_SIZE 4096
+
+/* Number of records encoded per chardev write */
+#define PINBUS_FLUSH_RECORDS 256
+
+typedef struct Stm32Pinbus Stm32Pinbus;
+
+typedef struct {
+    int64_t time;
+    uint8_t port;
+    uint8_t flags;
+    uint16_t mask;
+    uint16_t value;
+} Stm32PinbusRecord;
+
+typedef struct {
+    Notifier notifier;
+    Stm32Pinbus *pinbus;
+    uint8_t index;
+
+    /* Sequence number of this port's newest queued record */
+    uint32_t last_seq;
+    bool queued;
+
+    /* Input IRQs of the port's pins */
+    qemu_irq in_irq[STM32_GPIO_PIN_COUNT];
+} Stm32PinbusPort;
+
+struct Stm32Pinbus {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    CharDriverState *chr;
+    /* Array of Stm32Gpio pointers (one for each GPIO).  The QEMU property
+     * library expects this to be a void pointer. */
+    void *stm32_gpio_prop;
+    uint32_t gpio_count;
+
+    /* Private */
+    Stm32PinbusPort *ports;
+
+    /* Ring buffer of output records.  head and tail are free running
+     * sequence numbers, the ring holds tail - head records. */
+    Stm32PinbusRecord ring[PINBUS_RING_SIZE];
+    uint32_t head, tail;
+    bool overflow;
+    QEMUBH *flush_bh;
+
+    /* Partially received input record */
+    uint8_t in_buf[PINBUS_RECORD_SIZE];
+    int in_len;
+};
+
+
+
+/* OUTPUT */
+
+static Stm32PinbusRecord *stm32_pinbus_record(Stm32Pinbus *s, uint32_t seq)
+{
+    return &s->ring[seq & (PINBUS_RING_SIZE - 1)];
+}
+
+static void stm32_pinbus_flush(void *opaque)
+{
+    Stm32Pinbus *s = (Stm32Pinbus *)opaque;
+    uint8_t buf[PINBUS_FLUSH_RECORDS * PINBUS_RECORD_SIZE];
+    Stm32PinbusRecord *rec;
+    uint8_t *p;
+    int count;
+
+    while (s->head != s->tail) {
+        p = buf;
+        for (count = 0;
+             count < PINBUS_FLUSH_RECORDS && s->head != s->tail;
+             count++, s->head++) {
+            rec = stm32_pinbus_record(s, s->head);
+            stq_le_p(p, rec->time);
+            p[8] = rec->port;
+            p[9] = rec->flags;
+            stw_le_p(p + 10, rec->mask);
+            stw_le_p(p + 12, rec->value);
+            stw_le_p(p + 14, 0);
+            p += PINBUS_RECORD_SIZE;
+        }
+        qemu_chr_fe_write(s->chr, buf, p - buf);
+    }
+}
+
+static void stm32_pinbus_gpio_changed(Notifier *notifier, void *data)
+{
+    Stm32PinbusPort *port = container_of(notifier, Stm32PinbusPort, notifier);
+    Stm32Pinbus *s = port->pinbus;
+    Stm32GpioBusEvent *event = (Stm32GpioBusEvent *)data;
+    Stm32PinbusRecord *rec;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    if (s->tail - s->head == PINBUS_RING_SIZE) {
+        if (port->queued && port->last_seq - s->head < PINBUS_RING_SIZE) {
+            /* Fold the change into the port's newest pending record. */
+            rec = stm32_pinbus_record(s, port->last_seq);
+            rec->time = now;
+            rec->mask |= event->changed;
+            rec->value = event->value;
+            SET_BIT(rec->flags, PINBUS_FLAG_COALESCED_BIT);
+            return;
+        }
+        DPRINTF("Ring full, dropping a record\n");
+        s->head++;
+        s->overflow = true;
+    }
+
+    rec = stm32_pinbus_record(s, s->tail);
+    rec->time = now;
+    rec->port = port->index;
+    rec->flags = 0;
+    if (s->overflow) {
+        SET_BIT(rec->flags, PINBUS_FLAG_OVERFLOW_BIT);
+        s->overflow = false;
+    }
+    rec->mask = event->changed;
+    rec->value = event->value;
+    port->last_seq = s->tail++;
+    port->queued = true;
+
+    qemu_bh_schedule(s->flush_bh);
+}
+
+
+
+/* INPUT */
+
+static void stm32_pinbus_apply(Stm32Pinbus *s, const uint8_t *p)
+{
+    unsigned port_index = p[8];
+    uint16_t mask = lduw_le_p(p + 10);
+    uint16_t value = lduw_le_p(p + 12);
+    Stm32PinbusPort *port;
+    unsigned pin;
+
+    if (port_index >= s->gpio_count) {
+        stm32_hw_warn("stm32_pinbus: Input event for unknown port %u",
+                      port_index);
+        return;
+    }
+    port = &s->ports[port_index];
+
+    while (mask) {
+        pin = ctz32(mask);
+        mask &= mask - 1;
+        qemu_set_irq(port->in_irq[pin], IS_BIT_SET(value, pin) ? 1 : 0);
+    }
+}
+
+static int stm32_pinbus_can_receive(void *opaque)
+{
+    Stm32Pinbus *s = (Stm32Pinbus *)opaque;
+
+    /* Events are applied immediately, so any amount can be taken.  Ask for
+     * whole records where possible. */
+    return PINBUS_FLUSH_RECORDS * PINBUS_RECORD_SIZE - s->in_len;
+}
+
+static void stm32_pinbus_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32Pinbus *s = (Stm32Pinbus *)opaque;
+    int n;
+
+    /* Complete a record left over from a previous call. */
+    if (s->in_len) {
+        n = MIN(size, PINBUS_RECORD_SIZE - s->in_len);
+        memcpy(s->in_buf + s->in_len, buf, n);
+        s->in_len += n;
+        buf += n;
+        size -= n;
+        if (s->in_len < PINBUS_RECORD_SIZE) {
+            return;
+        }
+        stm32_pinbus_apply(s, s->in_buf);
+        s->in_len = 0;
+    }
+
+    while (size >= PINBUS_RECORD_SIZE) {
+        stm32_pinbus_apply(s, buf);
+        buf += PINBUS_RECORD_SIZE;
+        size -= PINBUS_RECORD_SIZE;
+    }
+
+    memcpy(s->in_buf, buf, size);
+    s->in_len = size;
+}
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_pinbus_init(SysBusDevice *dev)
+{
+    Stm32Pinbus *s = FROM_SYSBUS(Stm32Pinbus, dev);
+    Stm32Gpio **stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
+    Stm32PinbusPort *port;
+    unsigned i, pin;
+
+    if (!s->chr) {
+        hw_error("stm32_pinbus: A chardev is required");
+    }
+
+    s->ports = g_new0(Stm32PinbusPort, s->gpio_count);
+    for (i = 0; i < s->gpio_count; i++) {
+        port = &s->ports[i];
+        port->pinbus = s;
+        port->index = i;
+        port->notifier.notify = stm32_pinbus_gpio_changed;
+        stm32_gpio_add_bus_notifier(stm32_gpio[i], &port->notifier);
+        for (pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
+            port->in_irq[pin] = qdev_get_gpio_in((DeviceState *)stm32_gpio[i],
+                                                 pin);
+        }
+    }
+
+    s->flush_bh = qemu_bh_new(stm32_pinbus_flush, s);
+    qemu_chr_add_handlers(s->chr, stm32_pinbus_can_receive,
+                          stm32_pinbus_receive, NULL, s);
+    replay_register_char_driver(s->chr);
+
+    return 0;
+}
+
+static Property stm32_pinbus_properties[] = {
+    DEFINE_PROP_CHR("chardev", Stm32Pinbus, chr),
+    DEFINE_PROP_PTR("stm32_gpio", Stm32Pinbus, stm32_gpio_prop),
+    DEFINE_PROP_UINT32("gpio_count", Stm32Pinbus, gpio_count, 0),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_pinbus_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_pinbus_init;
+    dc->props = stm32_pinbus_properties;
+}
+
+static TypeInfo stm32_pinbus_info = {
+    .name  = "stm32_pinbus",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Pinbus),
+    .class_init = stm32_pinbus_class_init
+};
+
+static void stm32_pinbus_register_types(void)
+{
+    type_register_static(&stm32_pinbus_info);
+}
+
+type_init(stm32_pinbus_register_types)
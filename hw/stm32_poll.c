@@ -0,0 +1,254 @@
+/*
+ * STM32 Microcontroller status register poll detection
+ *
+ * A loop that does nothing but read a status register until it changes is
+ * recognised by decoding the guest code from the start of the translation
+ * block that makes the reads.  The CPU is then stopped, as with WFI, until
+ * the register can change.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "qemu/timer.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_POLL
+
+#ifdef DEBUG_STM32_POLL
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_POLL: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+/* Longest polling loop that is recognised, in bytes of code */
+#define STM32_POLL_MAX_LOOP_SIZE 32
+
+
+
+
+/* HELPER FUNCTIONS */
+
+/* Sign extends the low bits of value. */
+static int32_t stm32_poll_sext(uint32_t value, int bits)
+{
+    return ((int32_t)(value << (32 - bits))) >> (32 - bits);
+}
+
+/* Checks whether a 16-bit Thumb instruction leaves memory and the program
+ * flow alone: data processing, comparisons, loads, NOP.  Conditional
+ * branches are handled by the caller. */
+static bool stm32_poll_harmless16(uint16_t insn)
+{
+    if(insn < 0x4400) {
+        /* Shifts, add, subtract, move, compare and data processing */
+        return true;
+    } else if((insn & 0xff00) == 0x4500) {
+        /* CMP (high registers) */
+        return true;
+    } else if((insn & 0xf800) == 0x4800) {
+        /* LDR (literal) */
+        return true;
+    } else if((insn & 0xf000) == 0x5000) {
+        /* LDR, LDRH, LDRB, LDRSB, LDRSH (register) */
+        return (insn & 0x0800) || (insn & 0x0e00) == 0x0600;
+    } else if(insn >= 0x6000 && insn < 0xa000) {
+        /* LDR, LDRB, LDRH (immediate and SP relative) */
+        return (insn & 0x0800) != 0;
+    } else if((insn & 0xf000) == 0xa000 || (insn & 0xff00) == 0xb200) {
+        /* ADR, ADD (SP plus immediate), sign and zero extension */
+        return true;
+    }
+    return insn == 0xbf00;
+}
+
+/* Checks whether a 32-bit Thumb instruction leaves memory and the program
+ * flow alone.  Branches are handled by the caller. */
+static bool stm32_poll_harmless32(uint16_t hw1, uint16_t hw2)
+{
+    if((hw1 & 0xfa00) == 0xf000 && (hw2 & 0x8000) == 0) {
+        /* Data processing (modified immediate) */
+        return true;
+    } else if((hw1 & 0xfe00) == 0xea00) {
+        /* Data processing (shifted register) */
+        return true;
+    } else if((hw1 & 0xfe10) == 0xf810) {
+        /* Loads other than to the PC */
+        return (hw2 >> 12) != 0xf;
+    }
+    return false;
+}
+
+/* Checks whether the guest code starting at the translation block is a loop
+ * that only reads a register until it changes: it must end with a branch
+ * back to its first instruction, and contain nothing but harmless
+ * instructions and forward branches leaving the loop.  Skipping iterations
+ * of such a loop makes no difference to the state of the machine.
+ */
+static bool stm32_poll_is_tight_loop(CPUARMState *env, TranslationBlock *tb)
+{
+    uint8_t code[STM32_POLL_MAX_LOOP_SIZE + 2];
+    uint16_t hw1, hw2;
+    uint32_t s, j1, j2, pos;
+    int32_t offset;
+    target_ulong pc;
+
+    if(!env->thumb || cpu_memory_rw_debug(env, tb->pc, code,
+                                          sizeof(code), 0) != 0) {
+        return false;
+    }
+
+    for(pos = 0; pos < STM32_POLL_MAX_LOOP_SIZE; ) {
+        pc = tb->pc + pos;
+        hw1 = lduw_le_p(code + pos);
+        hw2 = lduw_le_p(code + pos + 2);
+
+        if((hw1 & 0xf000) == 0xd000 && (hw1 & 0x0e00) != 0x0e00) {
+            /* B<c> (encoding T1) */
+            offset = stm32_poll_sext((hw1 & 0xff) << 1, 9);
+            if(pc + 4 + offset == tb->pc) {
+                return true;
+            } else if(offset < 0) {
+                return false;
+            }
+            pos += 2;
+        } else if((hw1 & 0xf800) == 0xe000) {
+            /* B (encoding T2) */
+            offset = stm32_poll_sext((hw1 & 0x7ff) << 1, 12);
+            return pc + 4 + offset == tb->pc;
+        } else if((hw1 & 0xf500) == 0xb100) {
+            /* CBZ and CBNZ only branch forwards */
+            pos += 2;
+        } else if(hw1 < 0xe800) {
+            if(!stm32_poll_harmless16(hw1)) {
+                return false;
+            }
+            pos += 2;
+        } else if((hw1 & 0xf800) == 0xf000 && (hw2 & 0xd000) == 0x8000 &&
+                  (hw1 & 0x0380) != 0x0380) {
+            /* B<c>.W (encoding T3) */
+            s = (hw1 >> 10) & 1;
+            j1 = (hw2 >> 13) & 1;
+            j2 = (hw2 >> 11) & 1;
+            offset = stm32_poll_sext((s << 20) | (j2 << 19) | (j1 << 18) |
+                                     ((hw1 & 0x3f) << 12) |
+                                     ((hw2 & 0x7ff) << 1), 21);
+            if(pc + 4 + offset == tb->pc) {
+                return true;
+            } else if(offset < 0) {
+                return false;
+            }
+            pos += 4;
+        } else if((hw1 & 0xf800) == 0xf000 && (hw2 & 0xd000) == 0x9000) {
+            /* B.W (encoding T4) */
+            s = (hw1 >> 10) & 1;
+            j1 = (hw2 >> 13) & 1;
+            j2 = (hw2 >> 11) & 1;
+            offset = stm32_poll_sext((s << 24) | ((!(j1 ^ s)) << 23) |
+                                     ((!(j2 ^ s)) << 22) |
+                                     ((hw1 & 0x3ff) << 12) |
+                                     ((hw2 & 0x7ff) << 1), 25);
+            return pc + 4 + offset == tb->pc;
+        } else {
+            if(!stm32_poll_harmless32(hw1, hw2)) {
+                return false;
+            }
+            pos += 4;
+        }
+    }
+    return false;
+}
+
+static void stm32_poll_timer_expire(void *opaque)
+{
+    stm32_poll_break((Stm32Poll *)opaque);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_poll_init(Stm32Poll *p)
+{
+    p->offset = 0;
+    p->host_pc = 0;
+    p->count = 0;
+    p->parked = false;
+    p->env = NULL;
+    p->timer = qemu_new_timer_ns(vm_clock, stm32_poll_timer_expire, p);
+}
+
+void stm32_poll_read(Stm32Poll *p, hwaddr offset, int64_t until)
+{
+    CPUARMState *env = cpu_single_env;
+    TranslationBlock *tb;
+
+    /* Only reads made by the CPU count, and never while it is being
+     * debugged. */
+    if(env == NULL || env->singlestep_enabled ||
+       until <= qemu_get_clock_ns(vm_clock)) {
+        p->count = 0;
+        return;
+    }
+
+    /* Count the reads made by the same load instruction in a row. */
+    if(env->mem_io_pc != p->host_pc || offset != p->offset) {
+        p->host_pc = env->mem_io_pc;
+        p->offset = offset;
+        p->count = 0;
+    }
+    if(++p->count < STM32_POLL_THRESHOLD) {
+        return;
+    }
+    p->count = 0;
+
+    tb = tb_find_pc(env->mem_io_pc);
+    if(tb == NULL || !stm32_poll_is_tight_loop(env, tb)) {
+        return;
+    }
+
+    DPRINTF("parking CPU at 0x%08x until %lld\n", (unsigned)tb->pc,
+            (long long)until);
+
+    /* Stop the CPU at the end of this block, as if it had executed WFI.
+     * It wakes up on an interrupt, or when stm32_poll_break pokes it. */
+    p->parked = true;
+    p->env = env;
+    env->halted = 1;
+    cpu_exit(env);
+    if(until != STM32_POLL_FOREVER) {
+        qemu_mod_timer(p->timer, until);
+    }
+}
+
+void stm32_poll_break(Stm32Poll *p)
+{
+    p->count = 0;
+
+    if(p->parked) {
+        p->parked = false;
+        qemu_del_timer(p->timer);
+        /* Has no effect if the CPU already woke up for an interrupt. */
+        cpu_interrupt(p->env, CPU_INTERRUPT_EXITTB);
+    }
+}
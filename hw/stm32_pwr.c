@@ -0,0 +1,354 @@
+/*
+ * STM32 Microcontroller PWR (Power Control) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * Models the low-power modes the core enters with WFI:
+ *
+ * - Sleep (SLEEPDEEP clear): only the core stops, which the CPU does by
+ *   itself.
+ * - Stop (SLEEPDEEP set, PDDS clear): the high-speed clocks stop, and with
+ *   them the peripherals and SysTick.  Any interrupt, normally an EXTI
+ *   line, wakes the core up, running on the HSI.
+ * - Standby (SLEEPDEEP and PDDS set): the core is off.  An RTC alarm, or
+ *   a rising edge on the WKUP pin (PA0) if EWUP is set, resets the chip
+ *   with SBF and WUF set.
+ *
+ * In Stop and Standby nothing runs but the timers of the peripherals that
+ * still have a clock, so the vm_clock jumps from one of them to the next
+ * instead of waiting for real time (see cpu_set_fast_forward).  Firmware
+ * that sleeps most of the time then runs much faster than real time.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "arm-misc.h"
+#include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+#define PWR_CR_OFFSET 0x00
+#define PWR_CR_DBP_BIT 8
+#define PWR_CR_CSBF_BIT 3
+#define PWR_CR_CWUF_BIT 2
+#define PWR_CR_PDDS_BIT 1
+#define PWR_CR_LPDS_BIT 0
+/* The bits that read back as written (CWUF and CSBF read as 0) */
+#define PWR_CR_MASK 0x000001f3
+
+#define PWR_CSR_OFFSET 0x04
+#define PWR_CSR_EWUP_BIT 8
+#define PWR_CSR_SBF_BIT 1
+#define PWR_CSR_WUF_BIT 0
+
+/* The WKUP pin is PA0 */
+#define PWR_WKUP_PIN 0
+
+typedef enum {
+    PWR_RUN,
+    PWR_STOP,
+    PWR_STANDBY
+} Stm32PwrMode;
+
+typedef struct Stm32Pwr {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+    void *stm32_gpio_prop;
+    DeviceState *nvic;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+    Notifier wkup_notifier;
+
+    uint32_t mode;
+    /* Whether this PWR asked for the vm_clock to fast-forward */
+    bool fast_forward;
+    /* The chip was reset by a wakeup from Standby, which SBF survives */
+    bool standby_wakeup;
+
+    uint32_t
+        PWR_CR,
+        PWR_CSR;
+} Stm32Pwr;
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_pwr_set_fast_forward(Stm32Pwr *s, bool enable)
+{
+    if(s->fast_forward != enable) {
+        s->fast_forward = enable;
+        cpu_set_fast_forward(enable);
+    }
+}
+
+/* Called by the NVIC on WFI with SLEEPDEEP set, and on the interrupt that
+ * ends Stop mode. */
+static ARMv7MDeepSleep stm32_pwr_deepsleep(void *opaque, bool sleep)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    if(!sleep) {
+        trace_stm32_pwr_mode(s, PWR_RUN);
+        s->mode = PWR_RUN;
+        stm32f1xx_rcc_set_stop_mode(s->stm32_rcc, false);
+        stm32_pwr_set_fast_forward(s, false);
+        return ARMV7M_DEEPSLEEP_NONE;
+    }
+
+    s->mode = IS_BIT_SET(s->PWR_CR, PWR_CR_PDDS_BIT) ? PWR_STANDBY : PWR_STOP;
+    trace_stm32_pwr_mode(s, s->mode);
+    stm32f1xx_rcc_set_stop_mode(s->stm32_rcc, true);
+    stm32_pwr_set_fast_forward(s, true);
+    return s->mode == PWR_STANDBY ? ARMV7M_DEEPSLEEP_OFF :
+                                    ARMV7M_DEEPSLEEP_STOP;
+}
+
+/* A wakeup event: an RTC alarm, or a rising edge on WKUP. */
+static void stm32_pwr_wakeup_event(Stm32Pwr *s)
+{
+    SET_BIT(s->PWR_CSR, PWR_CSR_WUF_BIT);
+    if(s->mode == PWR_STANDBY) {
+        trace_stm32_pwr_mode(s, PWR_RUN);
+        s->standby_wakeup = true;
+        stm32_pwr_set_fast_forward(s, false);
+        qemu_system_reset_request();
+    }
+}
+
+/* Watches the WKUP pin for rising edges. */
+static void stm32_pwr_wkup_changed(Notifier *notifier, void *data)
+{
+    Stm32Pwr *s = container_of(notifier, Stm32Pwr, wkup_notifier);
+    Stm32GpioBusEvent *event = data;
+
+    if(IS_BIT_SET(event->changed, PWR_WKUP_PIN) &&
+       IS_BIT_SET(event->value, PWR_WKUP_PIN) &&
+       IS_BIT_SET(s->PWR_CSR, PWR_CSR_EWUP_BIT)) {
+        stm32_pwr_wakeup_event(s);
+    }
+}
+
+/* The alarm output of the RTC, which it pulses. */
+static void stm32_pwr_rtc_alarm(void *opaque, int n, int level)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    if(level) {
+        stm32_pwr_wakeup_event(s);
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_pwr_PWR_CR_write(Stm32Pwr *s, uint32_t new_value)
+{
+    if(IS_BIT_SET(new_value, PWR_CR_CWUF_BIT)) {
+        RESET_BIT(s->PWR_CSR, PWR_CSR_WUF_BIT);
+    }
+    if(IS_BIT_SET(new_value, PWR_CR_CSBF_BIT)) {
+        RESET_BIT(s->PWR_CSR, PWR_CSR_SBF_BIT);
+    }
+    s->PWR_CR = new_value & PWR_CR_MASK;
+}
+
+static void stm32_pwr_PWR_CSR_write(Stm32Pwr *s, uint32_t new_value)
+{
+    /* Only EWUP is writable */
+    CHANGE_BIT(s->PWR_CSR, PWR_CSR_EWUP_BIT,
+               IS_BIT_SET(new_value, PWR_CSR_EWUP_BIT));
+}
+
+static uint64_t stm32_pwr_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+    uint64_t value;
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    switch(offset) {
+        case PWR_CR_OFFSET:
+            value = s->PWR_CR;
+            break;
+        case PWR_CSR_OFFSET:
+            value = s->PWR_CSR;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_pwr_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_pwr_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    trace_stm32_pwr_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(offset) {
+        case PWR_CR_OFFSET:
+            stm32_pwr_PWR_CR_write(s, value);
+            break;
+        case PWR_CSR_OFFSET:
+            stm32_pwr_PWR_CSR_write(s, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_pwr_ops = {
+    .read = stm32_pwr_read,
+    .write = stm32_pwr_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    }
+};
+
+static void stm32_pwr_reset(DeviceState *dev)
+{
+    Stm32Pwr *s = FROM_SYSBUS(Stm32Pwr, SYS_BUS_DEVICE(dev));
+
+    stm32_pwr_set_fast_forward(s, false);
+    s->mode = PWR_RUN;
+    s->PWR_CR = 0;
+    s->PWR_CSR = 0;
+    if(s->standby_wakeup) {
+        s->standby_wakeup = false;
+        SET_BIT(s->PWR_CSR, PWR_CSR_SBF_BIT);
+        SET_BIT(s->PWR_CSR, PWR_CSR_WUF_BIT);
+    }
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_pwr_instance_init(Object *obj)
+{
+    Stm32Pwr *s = FROM_SYSBUS(Stm32Pwr, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "nvic", "armv7m_nvic",
+                             (Object **)&s->nvic, NULL);
+}
+
+static int stm32_pwr_init(SysBusDevice *dev)
+{
+    Stm32Pwr *s = FROM_SYSBUS(Stm32Pwr, dev);
+    Stm32Gpio **stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_PWR, dev,
+                              NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_pwr_ops, s,
+                          "pwr", 0x03ff);
+    sysbus_init_mmio(dev, &s->iomem);
+    qdev_init_gpio_in(&dev->qdev, stm32_pwr_rtc_alarm, 1);
+
+    armv7m_nvic_set_deepsleep_handler(s->nvic,
+                                      stm32_pwr_deepsleep, s);
+    s->wkup_notifier.notify = stm32_pwr_wkup_changed;
+    stm32_gpio_add_input_notifier(stm32_gpio[STM32_GPIOA_INDEX],
+                                  &s->wkup_notifier);
+
+    return 0;
+}
+
+/* The NVIC saves whether the core sleeps, and the RCC the clocks. */
+static int stm32_pwr_post_load(void *opaque, int version_id)
+{
+    Stm32Pwr *s = (Stm32Pwr *)opaque;
+
+    stm32_pwr_set_fast_forward(s, s->mode != PWR_RUN);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_pwr = {
+    .name = "stm32_pwr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_pwr_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(mode, Stm32Pwr),
+        VMSTATE_BOOL(standby_wakeup, Stm32Pwr),
+        VMSTATE_UINT32(PWR_CR, Stm32Pwr),
+        VMSTATE_UINT32(PWR_CSR, Stm32Pwr),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_pwr_properties[] = {
+    DEFINE_PROP_PTR("stm32_gpio", Stm32Pwr, stm32_gpio_prop),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_pwr_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_pwr_init;
+    dc->reset = stm32_pwr_reset;
+    dc->props = stm32_pwr_properties;
+    dc->vmsd = &vmstate_stm32_pwr;
+}
+
+static TypeInfo stm32_pwr_info = {
+    .name  = "stm32_pwr",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Pwr),
+    .instance_init = stm32_pwr_instance_init,
+    .class_init = stm32_pwr_class_init
+};
+
+static void stm32_pwr_register_types(void)
+{
+    type_register_static(&stm32_pwr_info);
+}
+
+type_init(stm32_pwr_register_types)
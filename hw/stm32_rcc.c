@@ -1,46 +1,118 @@
 #include "stm32_rcc.h"
 #include "stm32.h"
 #include "clktree.h"
+#include "qemu/timer.h"
 
 /* PUBLIC FUNCTIONS */
 
-void stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph, SysBusDevice *busdev)
+static void stm32_rcc_periph_clk_irq_handler(void *opaque, int n, int level)
 {
-    Clk clk = s->PERIPHCLK[periph];
+    Stm32PeriphClk *pc = (Stm32PeriphClk *)opaque;
 
+    pc->enabled = clktree_is_enabled(pc->clk);
+    pc->freq = clktree_get_output_freq(pc->clk);
+    if(pc->handler) {
+        qemu_irq_raise(pc->handler);
+    }
+}
+
+void stm32_rcc_periph_clk_init(Stm32PeriphClk *pc, Stm32Rcc *s,
+                               stm32_periph_t periph, SysBusDevice *busdev,
+                               qemu_irq handler)
+{
+    Clk clk;
+    const char *check;
+
+    if (!s) {
+        hw_error("%s: the stm32_rcc link is not set",
+                 object_get_typename(OBJECT(busdev)));
+    }
+    clk = s->PERIPHCLK[periph];
+    check = s->periph_clk_check;
     assert(clk != NULL);
 
-    if(!clktree_is_enabled(clk)) {
-        /* I assume writing to a peripheral register while the peripheral clock
-         * is disabled is a bug and give a warning to unsuspecting programmers.
-         * When I made this mistake on real hardware the write had no effect.
-         */
-        hw_error("Warning: You are attempting to use the %s peripheral while "
-                 "its clock is disabled.\n", busdev->qdev.id);
+    pc->clk = clk;
+    pc->busdev = busdev;
+    pc->handler = handler;
+    pc->logged = false;
+    if(check == NULL || strcmp(check, "error") == 0) {
+        pc->check = STM32_PERIPH_CLK_ERROR;
+    } else if(strcmp(check, "ignore") == 0) {
+        pc->check = STM32_PERIPH_CLK_IGNORE;
+    } else if(strcmp(check, "log") == 0) {
+        pc->check = STM32_PERIPH_CLK_LOG;
+    } else {
+        hw_error("stm32_rcc: periph_clk_check must be error, ignore or log");
     }
+
+    pc->enabled = clktree_is_enabled(clk);
+    pc->freq = clktree_get_output_freq(clk);
+    clktree_adduser(clk, *qemu_allocate_irqs(stm32_rcc_periph_clk_irq_handler,
+                                             pc, 1));
 }
 
-void stm32_rcc_set_periph_clk_irq(
-                                  Stm32Rcc *s,
-                                  stm32_periph_t periph,
-                                  qemu_irq periph_irq)
+bool stm32_periph_clk_disabled_access(Stm32PeriphClk *pc)
 {
-    Clk clk = s->PERIPHCLK[periph];
+    switch(pc->check) {
+        case STM32_PERIPH_CLK_ERROR:
+            /* I assume writing to a peripheral register while the peripheral
+             * clock is disabled is a bug and give a warning to unsuspecting
+             * programmers.  When I made this mistake on real hardware the
+             * write had no effect.
+             */
+            hw_error("Warning: You are attempting to use the %s peripheral "
+                     "while its clock is disabled.\n", pc->busdev->qdev.id);
+            break;
+        case STM32_PERIPH_CLK_LOG:
+            if(!pc->logged) {
+                stm32_hw_warn("%s accessed while its clock is disabled "
+                              "(ignoring this and any further accesses)",
+                              pc->busdev->qdev.id);
+                pc->logged = true;
+            }
+            break;
+        case STM32_PERIPH_CLK_IGNORE:
+            break;
+    }
+    return false;
+}
 
-    assert(clk != NULL);
+void stm32_rcc_startup_set(Stm32RccStartup *st, Clk clk, bool on,
+                           int64_t start)
+{
+    if(on && !clktree_is_enabled(clk)) {
+        st->ready_time = start + (int64_t)st->startup_us * SCALE_US;
+    }
+    clktree_set_enabled(clk, on);
+}
 
-    clktree_adduser(clk, periph_irq);
+bool stm32_rcc_startup_ready(Stm32RccStartup *st, Clk clk)
+{
+    return clktree_is_enabled(clk) &&
+           qemu_get_clock_ns(vm_clock) >= st->ready_time;
 }
 
-uint32_t stm32_rcc_get_periph_freq(
-                                   Stm32Rcc *s,
-                                   stm32_periph_t periph)
+int64_t stm32_rcc_startup_until(Stm32RccStartup *st, Clk clk, int64_t until)
 {
-    Clk clk;
+    if(clktree_is_enabled(clk) && st->ready_time < until &&
+       !stm32_rcc_startup_ready(st, clk)) {
+        return st->ready_time;
+    }
+    return until;
+}
 
-    clk = s->PERIPHCLK[periph];
+/* The RCCs of both families derive from this type, so that peripherals can
+ * link to either. */
+static TypeInfo stm32_rcc_info = {
+    .name  = TYPE_STM32_RCC,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Rcc),
+    .abstract = true,
+};
 
-    assert(clk != NULL);
+static void stm32_rcc_register_types(void)
+{
+    type_register_static(&stm32_rcc_info);
+}
 
-    return clktree_get_output_freq(clk);
-}
\ No newline at end of file
+type_init(stm32_rcc_register_types)
@@ -10,6 +10,9 @@ struct Stm32Rcc {
     /* Properties */
     uint32_t osc_freq;
     uint32_t osc32_freq;
+    /* What to do about accesses to peripherals whose clock is disabled:
+     * "error" (the default), "ignore" or "log" (see Stm32PeriphClkCheck). */
+    char *periph_clk_check;
 
     /* Private */
     MemoryRegion iomem;
@@ -18,3 +21,21 @@ struct Stm32Rcc {
     /* Peripheral clocks */
     Clk PERIPHCLK[];
 };
+
+/* Start-up of an oscillator or PLL.  After being switched on, the clock is
+ * only reported as ready startup_us microseconds later (at once if 0). */
+typedef struct Stm32RccStartup {
+    uint32_t startup_us; /* Property */
+    int64_t ready_time;
+} Stm32RccStartup;
+
+/* Switches clk on or off.  When it is switched on, it becomes ready
+ * startup_us after start (a vm_clock time, usually the current one). */
+void stm32_rcc_startup_set(Stm32RccStartup *st, Clk clk, bool on,
+                           int64_t start);
+
+bool stm32_rcc_startup_ready(Stm32RccStartup *st, Clk clk);
+
+/* Returns the time clk becomes ready if it is still starting up and that is
+ * before until, otherwise until. */
+int64_t stm32_rcc_startup_until(Stm32RccStartup *st, Clk clk, int64_t until);
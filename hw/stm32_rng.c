@@ -0,0 +1,423 @@
+/*
+ * STM32 Microcontroller RNG (random number generator) module (STM32F2XX)
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual Rev 4"
+ *
+ * The random words come from a host RNG backend (an rng-random reading
+ * /dev/urandom unless the "rng" link is set).  The backend is asked for
+ * entropy in large chunks, which are kept in a ring, so that reading RNG_DR
+ * only takes the next word from it; the ring is refilled once it is half
+ * empty.  DRDY is clear while the ring holds less than a word.  The clock
+ * and seed errors of the analog source are never raised.
+ *
+ * With the "seeded" property, the words come instead from a xorshift64*
+ * generator started from the "seed" property at reset, so that runs can be
+ * reproduced.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "qemu/rng.h"
+#include "qemu/rng-random.h"
+#include "qapi/qmp/qerror.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+#define RNG_CR_OFFSET 0x00
+#define RNG_CR_RNGEN_BIT 2
+#define RNG_CR_IE_BIT 3
+#define RNG_CR_MASK 0x0000000c
+
+#define RNG_SR_OFFSET 0x04
+#define RNG_SR_DRDY_BIT 0
+#define RNG_SR_CECS_BIT 1
+#define RNG_SR_SECS_BIT 2
+#define RNG_SR_CEIS_BIT 5
+#define RNG_SR_SEIS_BIT 6
+/* The bits which are cleared by writing 0 */
+#define RNG_SR_CLEAR_MASK 0x00000060
+
+#define RNG_DR_OFFSET 0x08
+
+/* Bytes of entropy kept ahead of the reads of RNG_DR.  A multiple of the
+ * word size, so that a word taken from the ring never wraps around. */
+#define RNG_RING_SIZE 4096
+
+struct Stm32Rng {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    RngBackend *rng;
+    uint32_t seeded;
+    uint64_t seed;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    RndRandom *default_backend;
+    /* An entropy request is in flight.  It belongs to this instance of the
+     * backend, so it is not migrated. */
+    bool request_pending;
+
+    /* The ring of random bytes: ring_count bytes starting at ring_start,
+     * which is always a multiple of 4. */
+    uint8_t ring[RNG_RING_SIZE];
+    uint32_t ring_start;
+    uint32_t ring_count;
+
+    /* State of the generator of the seeded mode */
+    uint64_t prng;
+
+    uint32_t
+        RNG_CR,
+        RNG_SR;
+
+    qemu_irq irq;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_rng_update(Stm32Rng *s)
+{
+    bool ready = IS_BIT_SET(s->RNG_CR, RNG_CR_RNGEN_BIT) && s->ring_count >= 4;
+    int irq;
+
+    if (ready) {
+        s->RNG_SR |= 1 << RNG_SR_DRDY_BIT;
+    } else {
+        s->RNG_SR &= ~(1 << RNG_SR_DRDY_BIT);
+    }
+
+    irq = IS_BIT_SET(s->RNG_CR, RNG_CR_IE_BIT) &&
+          (s->RNG_SR & ((1 << RNG_SR_DRDY_BIT) | RNG_SR_CLEAR_MASK)) != 0;
+    trace_stm32_rng_irq(s, irq);
+    qemu_set_irq(s->irq, irq);
+}
+
+/* Copies len bytes at the end of the ring, which must have room for them. */
+static void stm32_rng_push(Stm32Rng *s, const uint8_t *buf, uint32_t len)
+{
+    uint32_t end = (s->ring_start + s->ring_count) % RNG_RING_SIZE;
+    uint32_t n = MIN(len, RNG_RING_SIZE - end);
+
+    memcpy(s->ring + end, buf, n);
+    memcpy(s->ring, buf + n, len - n);
+    s->ring_count += len;
+}
+
+/* xorshift64* (Vigna), of which the high half of each output is used. */
+static uint32_t stm32_rng_prng_next(Stm32Rng *s)
+{
+    s->prng ^= s->prng >> 12;
+    s->prng ^= s->prng << 25;
+    s->prng ^= s->prng >> 27;
+    return (s->prng * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void stm32_rng_receive(void *opaque, const void *data, size_t size)
+{
+    Stm32Rng *s = (Stm32Rng *)opaque;
+
+    /* A request that was cancelled or superseded is answered with no data. */
+    s->request_pending = false;
+    if (size == 0) {
+        return;
+    }
+
+    size = MIN(size, RNG_RING_SIZE - s->ring_count);
+    trace_stm32_rng_receive(s, size, s->ring_count);
+    stm32_rng_push(s, data, size);
+    stm32_rng_update(s);
+}
+
+/* Fills the ring once it is half empty: at once from the generator in the
+ * seeded mode, otherwise with a request to the backend for all the room
+ * left. */
+static void stm32_rng_refill(Stm32Rng *s)
+{
+    uint8_t word[4];
+
+    if (s->ring_count > RNG_RING_SIZE / 2) {
+        return;
+    }
+
+    if (s->seeded) {
+        while (s->ring_count <= RNG_RING_SIZE - 4) {
+            stl_le_p(word, stm32_rng_prng_next(s));
+            stm32_rng_push(s, word, 4);
+        }
+    } else if (!s->request_pending) {
+        s->request_pending = true;
+        rng_backend_request_entropy(s->rng, RNG_RING_SIZE - s->ring_count,
+                                    stm32_rng_receive, s);
+    }
+}
+
+/* Takes the next word from the ring. */
+static uint32_t stm32_rng_pop(Stm32Rng *s)
+{
+    uint32_t value;
+
+    if (!IS_BIT_SET(s->RNG_CR, RNG_CR_RNGEN_BIT) || s->ring_count < 4) {
+        return 0;
+    }
+
+    value = ldl_le_p(s->ring + s->ring_start);
+    s->ring_start = (s->ring_start + 4) % RNG_RING_SIZE;
+    s->ring_count -= 4;
+    stm32_rng_refill(s);
+    stm32_rng_update(s);
+    return value;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint64_t stm32_rng_readw(Stm32Rng *s, hwaddr offset)
+{
+    switch (offset) {
+        case RNG_CR_OFFSET:
+            return s->RNG_CR;
+        case RNG_SR_OFFSET:
+            return s->RNG_SR;
+        case RNG_DR_OFFSET:
+            return stm32_rng_pop(s);
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_rng_writew(Stm32Rng *s, hwaddr offset, uint32_t value)
+{
+    switch (offset) {
+        case RNG_CR_OFFSET:
+            s->RNG_CR = value & RNG_CR_MASK;
+            break;
+        case RNG_SR_OFFSET:
+            s->RNG_SR &= value | ~RNG_SR_CLEAR_MASK;
+            break;
+        case RNG_DR_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return;
+    }
+
+    stm32_rng_update(s);
+}
+
+static uint64_t stm32_rng_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Rng *s = (Stm32Rng *)opaque;
+    uint64_t value;
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32_rng_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_rng_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_rng_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Rng *s = (Stm32Rng *)opaque;
+
+    trace_stm32_rng_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_rng_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_rng_ops = {
+    .read = stm32_rng_read,
+    .write = stm32_rng_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_rng_reset(DeviceState *dev)
+{
+    Stm32Rng *s = FROM_SYSBUS(Stm32Rng, SYS_BUS_DEVICE(dev));
+
+    /* Entropy already in the ring is still good, but the seeded mode
+     * starts its sequence again. */
+    if (s->seeded) {
+        /* xorshift64* must not start from 0 */
+        s->prng = s->seed ? s->seed : 1;
+        s->ring_start = 0;
+        s->ring_count = 0;
+    }
+
+    s->RNG_CR = 0;
+    s->RNG_SR = 0;
+    stm32_rng_refill(s);
+
+    stm32_rng_update(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_rng_instance_init(Object *obj)
+{
+    Stm32Rng *s = FROM_SYSBUS(Stm32Rng, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "rng", TYPE_RNG_BACKEND,
+                             (Object **)&s->rng, NULL);
+}
+
+static int stm32_rng_init(SysBusDevice *dev)
+{
+    Stm32Rng *s = FROM_SYSBUS(Stm32Rng, dev);
+    Error *local_err = NULL;
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_rng_ops, s,
+                          "rng", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+
+    if (s->seeded) {
+        return 0;
+    }
+
+    if (s->rng == NULL) {
+        /* /dev/random could keep the ring empty for a long time. */
+        s->default_backend = RNG_RANDOM(object_new(TYPE_RNG_RANDOM));
+        object_property_set_str(OBJECT(s->default_backend), "/dev/urandom",
+                                "filename", NULL);
+        object_property_add_child(OBJECT(dev), "default-backend",
+                                  OBJECT(s->default_backend), NULL);
+        object_property_set_link(OBJECT(dev), OBJECT(s->default_backend),
+                                 "rng", NULL);
+    }
+
+    rng_backend_open(s->rng, &local_err);
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int stm32_rng_post_load(void *opaque, int version_id)
+{
+    Stm32Rng *s = (Stm32Rng *)opaque;
+
+    if (s->ring_start >= RNG_RING_SIZE || s->ring_start % 4 != 0 ||
+        s->ring_count > RNG_RING_SIZE) {
+        return -EINVAL;
+    }
+
+    /* A request made before the load is still answered into the ring. */
+    stm32_rng_refill(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_rng = {
+    .name = "stm32_rng",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = stm32_rng_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_BUFFER(ring, Stm32Rng),
+        VMSTATE_UINT32(ring_start, Stm32Rng),
+        VMSTATE_UINT32(ring_count, Stm32Rng),
+        VMSTATE_UINT64(prng, Stm32Rng),
+        VMSTATE_UINT32(RNG_CR, Stm32Rng),
+        VMSTATE_UINT32(RNG_SR, Stm32Rng),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_rng_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Rng, periph, -1),
+    DEFINE_PROP_BIT("seeded", Stm32Rng, seeded, 0, false),
+    DEFINE_PROP_UINT64("seed", Stm32Rng, seed, 0),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_rng_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_rng_init;
+    dc->reset = stm32_rng_reset;
+    dc->props = stm32_rng_properties;
+    dc->vmsd = &vmstate_stm32_rng;
+}
+
+static TypeInfo stm32_rng_info = {
+    .name  = "stm32_rng",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Rng),
+    .instance_init = stm32_rng_instance_init,
+    .class_init = stm32_rng_class_init
+};
+
+static void stm32_rng_register_types(void)
+{
+    type_register_static(&stm32_rng_info);
+}
+
+type_init(stm32_rng_register_types)
@@ -0,0 +1,530 @@
+/*
+ * STM32 Microcontroller RTC (Real-Time Clock) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The counter is not ticked: its value is worked out from vm_clock when
+ * software reads it, and the timer is only armed for the events that have
+ * to happen on time - the alarm, which also goes to EXTI line 17 and to
+ * the PWR, and the second and overflow events when their interrupt is
+ * enabled.  Firmware that sleeps until an alarm days away then costs
+ * nothing until then, and with the fast-forward of the Stop and Standby
+ * modes it does not wait for it either.  The RTC follows vm_clock rather
+ * than rtc_clock for that reason, and so that it is deterministic with
+ * -icount.
+ *
+ * The prescaler, counter and alarm are in the backup domain: they are set
+ * at power on and by a backup domain reset (BDRST in RCC_BDCR), but keep
+ * counting through a system reset.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+#define RTC_CRH_OFFSET 0x00
+#define RTC_CRH_MASK 0x0007
+
+#define RTC_CRL_OFFSET 0x04
+#define RTC_CRL_RTOFF_BIT 5
+#define RTC_CRL_CNF_BIT 4
+#define RTC_CRL_RSF_BIT 3
+#define RTC_CRL_OWF_BIT 2
+#define RTC_CRL_ALRF_BIT 1
+#define RTC_CRL_SECF_BIT 0
+/* The event flags, which line up with their enable bits in RTC_CRH */
+#define RTC_CRL_FLAGS_MASK 0x0007
+
+#define RTC_PRLH_OFFSET 0x08
+#define RTC_PRLL_OFFSET 0x0c
+#define RTC_DIVH_OFFSET 0x10
+#define RTC_DIVL_OFFSET 0x14
+#define RTC_CNTH_OFFSET 0x18
+#define RTC_CNTL_OFFSET 0x1c
+#define RTC_ALRH_OFFSET 0x20
+#define RTC_ALRL_OFFSET 0x24
+
+#define RTC_PRL_MASK 0x000fffff
+
+/* The EXTI line of the alarm */
+#define RTC_ALARM_EXTI_LINE 17
+
+/* The longest the timer is armed for, in RTCCLK cycles, so that the time
+ * of the event can not overflow (17 years at 32768 Hz). */
+#define RTC_MAX_WAIT_CYCLES (1ULL << 44)
+
+typedef struct Stm32Rtc {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+    Stm32Exti *stm32_exti;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    /* The register interface runs on the BKP clock, the counter on
+     * RTCCLK. */
+    Stm32PeriphClk clk, rtcclk;
+    Notifier backup_reset_notifier;
+
+    uint32_t
+        RTC_CRH,
+        RTC_CRL;
+
+    /* Backup domain */
+    uint32_t prl, cnt, alr;
+
+    /* The counter as of the last sync.  cnt was last set ticks_done
+     * counter ticks after base_ns, at which time the prescaler was
+     * base_cycles RTCCLK cycles into the tick. */
+    int64_t base_ns;
+    uint32_t base_cycles;
+    uint64_t ticks_done;
+    /* The RTCCLK frequency the counter runs at since base_ns */
+    uint32_t freq;
+
+    QEMUTimer *timer;
+    qemu_irq irq;
+    /* Pulsed on each alarm, for the PWR to leave Standby */
+    qemu_irq alarm;
+} Stm32Rtc;
+
+
+
+
+/* HELPER FUNCTIONS */
+
+/* RTCCLK cycles from base_ns to now, plus base_cycles. */
+static uint64_t stm32_rtc_cycles(Stm32Rtc *s, int64_t now)
+{
+    if(s->freq == 0) {
+        return s->base_cycles;
+    }
+    return muldiv64(now - s->base_ns, s->freq, get_ticks_per_sec()) +
+           s->base_cycles;
+}
+
+/* Time at which counter tick number ticks (counted from base_ns) happens,
+ * rounded up so that a sync at that time sees the tick. */
+static int64_t stm32_rtc_tick_ns(Stm32Rtc *s, uint64_t ticks)
+{
+    uint64_t cycles = ticks * (s->prl + 1) - s->base_cycles;
+
+    return s->base_ns +
+           muldiv64(MIN(cycles, RTC_MAX_WAIT_CYCLES), get_ticks_per_sec(),
+                    s->freq) + 1;
+}
+
+/* Ticks from the current counter value until it reaches value (2^32 if it
+ * is there already). */
+static uint64_t stm32_rtc_ticks_to(Stm32Rtc *s, uint32_t value)
+{
+    uint32_t dist = value - s->cnt;
+
+    return dist ? dist : (1ULL << 32);
+}
+
+/* Advances the counter by ticks, setting the flags of the events on the
+ * way. */
+static void stm32_rtc_count(Stm32Rtc *s, uint64_t ticks)
+{
+    SET_BIT(s->RTC_CRL, RTC_CRL_SECF_BIT);
+    if(ticks >= stm32_rtc_ticks_to(s, 0)) {
+        SET_BIT(s->RTC_CRL, RTC_CRL_OWF_BIT);
+    }
+    if(ticks >= stm32_rtc_ticks_to(s, s->alr)) {
+        trace_stm32_rtc_alarm(s, s->alr);
+        SET_BIT(s->RTC_CRL, RTC_CRL_ALRF_BIT);
+        stm32_exti_line_rising(s->stm32_exti, RTC_ALARM_EXTI_LINE);
+        qemu_irq_pulse(s->alarm);
+    }
+    s->cnt += ticks;
+}
+
+/* Brings the counter and the event flags up to date with vm_clock. */
+static void stm32_rtc_sync(Stm32Rtc *s)
+{
+    uint64_t ticks;
+
+    ticks = stm32_rtc_cycles(s, qemu_get_clock_ns(vm_clock)) / (s->prl + 1);
+    if(ticks > s->ticks_done) {
+        stm32_rtc_count(s, ticks - s->ticks_done);
+        s->ticks_done = ticks;
+    }
+}
+
+/* Restarts the time base at now, where the counter is after a sync.  To
+ * be called before changing the frequency, the prescaler or the
+ * counter. */
+static void stm32_rtc_rebase(Stm32Rtc *s, int64_t now)
+{
+    s->base_cycles = stm32_rtc_cycles(s, now) - s->ticks_done * (s->prl + 1);
+    s->base_ns = now;
+    s->ticks_done = 0;
+}
+
+static void stm32_rtc_update_irq(Stm32Rtc *s)
+{
+    bool level = (s->RTC_CRL & s->RTC_CRH & RTC_CRL_FLAGS_MASK) != 0;
+
+    trace_stm32_rtc_irq(s, level);
+    qemu_set_irq(s->irq, level);
+}
+
+/* Arms the timer for the next alarm, or the next second or overflow if
+ * their interrupt is enabled. */
+static void stm32_rtc_schedule(Stm32Rtc *s)
+{
+    uint64_t next;
+
+    if(s->freq == 0) {
+        qemu_del_timer(s->timer);
+        return;
+    }
+
+    next = stm32_rtc_ticks_to(s, s->alr);
+    if(IS_BIT_SET(s->RTC_CRH, RTC_CRL_OWF_BIT)) {
+        next = MIN(next, stm32_rtc_ticks_to(s, 0));
+    }
+    if(IS_BIT_SET(s->RTC_CRH, RTC_CRL_SECF_BIT)) {
+        next = 1;
+    }
+    qemu_mod_timer(s->timer, stm32_rtc_tick_ns(s, s->ticks_done + next));
+}
+
+static void stm32_rtc_expire(void *opaque)
+{
+    Stm32Rtc *s = (Stm32Rtc *)opaque;
+
+    stm32_rtc_sync(s);
+    stm32_rtc_update_irq(s);
+    stm32_rtc_schedule(s);
+}
+
+/* Handle a change in RTCCLK. */
+static void stm32_rtc_clk_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Rtc *s = (Stm32Rtc *)opaque;
+
+    assert(n == 0);
+
+    stm32_rtc_sync(s);
+    stm32_rtc_rebase(s, qemu_get_clock_ns(vm_clock));
+    s->freq = s->rtcclk.freq;
+    stm32_rtc_schedule(s);
+}
+
+static void stm32_rtc_backup_reset(Notifier *notifier, void *data)
+{
+    Stm32Rtc *s = container_of(notifier, Stm32Rtc, backup_reset_notifier);
+
+    s->prl = 0x00008000;
+    s->cnt = 0;
+    s->alr = 0xffffffff;
+    s->base_ns = qemu_get_clock_ns(vm_clock);
+    s->base_cycles = 0;
+    s->ticks_done = 0;
+    stm32_rtc_schedule(s);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint32_t stm32_rtc_RTC_CRL_read(Stm32Rtc *s)
+{
+    /* The registers are synchronized as soon as RTCCLK runs. */
+    if(s->freq) {
+        SET_BIT(s->RTC_CRL, RTC_CRL_RSF_BIT);
+    }
+    return s->RTC_CRL;
+}
+
+static void stm32_rtc_RTC_CRL_write(Stm32Rtc *s, uint32_t new_value)
+{
+    /* RSF and the event flags are cleared by writing 0. */
+    s->RTC_CRL &= new_value | ~(RTC_CRL_FLAGS_MASK |
+                                GET_BIT_MASK_ONE(RTC_CRL_RSF_BIT));
+    CHANGE_BIT(s->RTC_CRL, RTC_CRL_CNF_BIT,
+               IS_BIT_SET(new_value, RTC_CRL_CNF_BIT));
+}
+
+/* The current value of the prescaler divider, which counts down from PRL
+ * to 0 in each tick. */
+static uint32_t stm32_rtc_div(Stm32Rtc *s)
+{
+    uint64_t cycles = stm32_rtc_cycles(s, qemu_get_clock_ns(vm_clock));
+
+    return s->prl - (cycles - s->ticks_done * (s->prl + 1));
+}
+
+static void stm32_rtc_set_prl(Stm32Rtc *s, uint32_t prl)
+{
+    stm32_rtc_rebase(s, qemu_get_clock_ns(vm_clock));
+    s->prl = prl & RTC_PRL_MASK;
+    s->base_cycles = MIN(s->base_cycles, s->prl);
+}
+
+static void stm32_rtc_set_cnt(Stm32Rtc *s, uint32_t cnt)
+{
+    stm32_rtc_rebase(s, qemu_get_clock_ns(vm_clock));
+    s->cnt = cnt;
+}
+
+static uint64_t stm32_rtc_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Rtc *s = (Stm32Rtc *)opaque;
+    uint64_t value;
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    stm32_rtc_sync(s);
+
+    switch(offset) {
+        case RTC_CRH_OFFSET:
+            value = s->RTC_CRH;
+            break;
+        case RTC_CRL_OFFSET:
+            value = stm32_rtc_RTC_CRL_read(s);
+            break;
+        case RTC_DIVH_OFFSET:
+            value = stm32_rtc_div(s) >> 16;
+            break;
+        case RTC_DIVL_OFFSET:
+            value = stm32_rtc_div(s) & 0xffff;
+            break;
+        case RTC_CNTH_OFFSET:
+            value = s->cnt >> 16;
+            break;
+        case RTC_CNTL_OFFSET:
+            value = s->cnt & 0xffff;
+            break;
+        case RTC_PRLH_OFFSET:
+        case RTC_PRLL_OFFSET:
+        case RTC_ALRH_OFFSET:
+        case RTC_ALRL_OFFSET:
+            /* Write only */
+            value = 0;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    /* Reading a flag may have set it. */
+    stm32_rtc_update_irq(s);
+    trace_stm32_rtc_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_rtc_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Rtc *s = (Stm32Rtc *)opaque;
+    bool cnf;
+
+    trace_stm32_rtc_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    stm32_rtc_sync(s);
+
+    /* The registers are 16 bits wide. */
+    value &= 0xffff;
+    /* The prescaler, counter and alarm can only be written in
+     * configuration mode. */
+    cnf = IS_BIT_SET(s->RTC_CRL, RTC_CRL_CNF_BIT);
+
+    switch(offset) {
+        case RTC_CRH_OFFSET:
+            s->RTC_CRH = value & RTC_CRH_MASK;
+            break;
+        case RTC_CRL_OFFSET:
+            stm32_rtc_RTC_CRL_write(s, value);
+            break;
+        case RTC_PRLH_OFFSET:
+            if(cnf) {
+                stm32_rtc_set_prl(s, (value << 16) | (s->prl & 0xffff));
+            }
+            break;
+        case RTC_PRLL_OFFSET:
+            if(cnf) {
+                stm32_rtc_set_prl(s, (s->prl & 0xffff0000) | value);
+            }
+            break;
+        case RTC_CNTH_OFFSET:
+            if(cnf) {
+                stm32_rtc_set_cnt(s, (value << 16) | (s->cnt & 0xffff));
+            }
+            break;
+        case RTC_CNTL_OFFSET:
+            if(cnf) {
+                stm32_rtc_set_cnt(s, (s->cnt & 0xffff0000) | value);
+            }
+            break;
+        case RTC_ALRH_OFFSET:
+            if(cnf) {
+                s->alr = (value << 16) | (s->alr & 0xffff);
+            }
+            break;
+        case RTC_ALRL_OFFSET:
+            if(cnf) {
+                s->alr = (s->alr & 0xffff0000) | value;
+            }
+            break;
+        case RTC_DIVH_OFFSET:
+        case RTC_DIVL_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+
+    stm32_rtc_update_irq(s);
+    stm32_rtc_schedule(s);
+}
+
+static const MemoryRegionOps stm32_rtc_ops = {
+    .read = stm32_rtc_read,
+    .write = stm32_rtc_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 2,
+        .max_access_size = 4,
+    }
+};
+
+/* Only the control registers are reset; the counter goes on. */
+static void stm32_rtc_reset(DeviceState *dev)
+{
+    Stm32Rtc *s = FROM_SYSBUS(Stm32Rtc, SYS_BUS_DEVICE(dev));
+
+    stm32_rtc_sync(s);
+    s->RTC_CRH = 0;
+    s->RTC_CRL = GET_BIT_MASK_ONE(RTC_CRL_RTOFF_BIT);
+    stm32_rtc_update_irq(s);
+    stm32_rtc_schedule(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_rtc_instance_init(Object *obj)
+{
+    Stm32Rtc *s = FROM_SYSBUS(Stm32Rtc, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32_exti", "stm32_exti",
+                             (Object **)&s->stm32_exti, NULL);
+}
+
+static int stm32_rtc_init(SysBusDevice *dev)
+{
+    Stm32Rtc *s = FROM_SYSBUS(Stm32Rtc, dev);
+    qemu_irq *clk_irq;
+
+
+    memory_region_init_io(&s->iomem, &stm32_rtc_ops, s,
+                          "rtc", 0x03ff);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    sysbus_init_irq(dev, &s->alarm);
+
+    s->timer = qemu_new_timer_ns(vm_clock, stm32_rtc_expire, s);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_BKP, dev,
+                              NULL);
+    clk_irq = qemu_allocate_irqs(stm32_rtc_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_periph_clk_init(&s->rtcclk, s->stm32_rcc, STM32F1XX_RTC, dev,
+                              clk_irq[0]);
+    s->freq = s->rtcclk.freq;
+
+    /* Power on reset of the backup domain */
+    s->backup_reset_notifier.notify = stm32_rtc_backup_reset;
+    stm32f1xx_rcc_add_backup_reset_notifier(s->stm32_rcc,
+                                            &s->backup_reset_notifier);
+    stm32_rtc_backup_reset(&s->backup_reset_notifier, NULL);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_rtc = {
+    .name = "stm32_rtc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(RTC_CRH, Stm32Rtc),
+        VMSTATE_UINT32(RTC_CRL, Stm32Rtc),
+        VMSTATE_UINT32(prl, Stm32Rtc),
+        VMSTATE_UINT32(cnt, Stm32Rtc),
+        VMSTATE_UINT32(alr, Stm32Rtc),
+        VMSTATE_INT64(base_ns, Stm32Rtc),
+        VMSTATE_UINT32(base_cycles, Stm32Rtc),
+        VMSTATE_UINT64(ticks_done, Stm32Rtc),
+        VMSTATE_UINT32(freq, Stm32Rtc),
+        VMSTATE_TIMER(timer, Stm32Rtc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_rtc_properties[] = {
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_rtc_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_rtc_init;
+    dc->reset = stm32_rtc_reset;
+    dc->props = stm32_rtc_properties;
+    dc->vmsd = &vmstate_stm32_rtc;
+}
+
+static TypeInfo stm32_rtc_info = {
+    .name  = "stm32_rtc",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Rtc),
+    .instance_init = stm32_rtc_instance_init,
+    .class_init = stm32_rtc_class_init
+};
+
+static void stm32_rtc_register_types(void)
+{
+    type_register_static(&stm32_rtc_info);
+}
+
+type_init(stm32_rtc_register_types)
@@ -0,0 +1,766 @@
+/*
+ * STM32 Microcontroller SDIO host controller (STM32F2XX)
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual Rev 4"
+ *
+ * The controller drives the SD card of the first "-sd" drive (or
+ * "-drive if=sd").  Commands are passed to the card model as soon as CMD
+ * is written with CPSMEN set, so the command path state machine is never
+ * seen active.
+ *
+ * The data path can be served in two ways:
+ *
+ * - When DMA is enabled (DMAEN) and the selected DMA2 stream is set up to
+ *   move whole 512 byte blocks between the FIFO and contiguous memory, the
+ *   blocks of a read or write command go straight between guest memory and
+ *   the drive as one asynchronous block layer request, so the CPU keeps
+ *   running while the host does the I/O.  The data path stays active
+ *   (RXACT/TXACT) until the request completes; DATAEND is raised then.
+ * - Otherwise the FIFO is read or written a word at a time, by the CPU or
+ *   by the DMA through its request line, and the card model moves the
+ *   data.  The FIFO never holds data itself: its flags show what the card
+ *   can provide or take.
+ *
+ * The stream may be set up with either the DMA or the SDIO as the flow
+ * controller.  CRC errors, data timeouts, FIFO under and overruns, stream
+ * and SDIO card (I/O) modes, CE-ATA commands and read wait are not
+ * modelled.  Responses to ACMD41 (R3) report CCRCFAIL as they carry no
+ * valid CRC, as on the real controller.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "sd.h"
+#include "sysemu/blockdev.h"
+#include "sysemu/dma.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_SDIO
+
+#ifdef DEBUG_STM32_SDIO
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_SDIO: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define SDIO_POWER_OFFSET 0x00
+#define SDIO_POWER_PWRCTRL_MASK 0x00000003
+#define SDIO_POWER_PWRCTRL_ON 0x00000003
+
+#define SDIO_CLKCR_OFFSET 0x04
+#define SDIO_CLKCR_MASK 0x00007fff
+
+#define SDIO_ARG_OFFSET 0x08
+
+#define SDIO_CMD_OFFSET 0x0c
+#define SDIO_CMD_CMDINDEX_MASK 0x0000003f
+#define SDIO_CMD_WAITRESP_START 6
+#define SDIO_CMD_WAITRESP_MASK 0x000000c0
+#define SDIO_CMD_CPSMEN_BIT 10
+#define SDIO_CMD_MASK 0x00007fff
+
+#define SDIO_WAITRESP_SHORT 1
+#define SDIO_WAITRESP_LONG 3
+
+#define SDIO_RESPCMD_OFFSET 0x10
+#define SDIO_RESP1_OFFSET 0x14
+#define SDIO_RESP4_OFFSET 0x20
+
+#define SDIO_DTIMER_OFFSET 0x24
+
+#define SDIO_DLEN_OFFSET 0x28
+#define SDIO_DLEN_MASK 0x01ffffff
+
+#define SDIO_DCTRL_OFFSET 0x2c
+#define SDIO_DCTRL_DTEN_BIT 0
+#define SDIO_DCTRL_DTDIR_BIT 1
+#define SDIO_DCTRL_DTMODE_BIT 2
+#define SDIO_DCTRL_DMAEN_BIT 3
+#define SDIO_DCTRL_DBLOCKSIZE_START 4
+#define SDIO_DCTRL_DBLOCKSIZE_MASK 0x000000f0
+#define SDIO_DCTRL_MASK 0x00000fff
+
+#define SDIO_DCOUNT_OFFSET 0x30
+
+#define SDIO_STA_OFFSET 0x34
+#define SDIO_STA_CCRCFAIL_BIT 0
+#define SDIO_STA_DCRCFAIL_BIT 1
+#define SDIO_STA_CTIMEOUT_BIT 2
+#define SDIO_STA_DTIMEOUT_BIT 3
+#define SDIO_STA_CMDREND_BIT 6
+#define SDIO_STA_CMDSENT_BIT 7
+#define SDIO_STA_DATAEND_BIT 8
+#define SDIO_STA_DBCKEND_BIT 10
+#define SDIO_STA_TXACT_BIT 12
+#define SDIO_STA_RXACT_BIT 13
+#define SDIO_STA_TXFIFOHE_BIT 14
+#define SDIO_STA_RXFIFOHF_BIT 15
+#define SDIO_STA_RXFIFOF_BIT 17
+#define SDIO_STA_TXFIFOE_BIT 18
+#define SDIO_STA_RXFIFOE_BIT 19
+#define SDIO_STA_RXDAVL_BIT 21
+/* The flags which are latched until cleared through ICR */
+#define SDIO_STA_STATIC_MASK 0x00c007ff
+
+#define SDIO_ICR_OFFSET 0x38
+
+#define SDIO_MASK_OFFSET 0x3c
+#define SDIO_MASK_MASK 0x00ffffff
+
+#define SDIO_FIFOCNT_OFFSET 0x48
+
+#define SDIO_FIFO_OFFSET 0x80
+#define SDIO_FIFO_END 0x100
+
+/* The FIFO is 32 words deep. */
+#define STM32_SDIO_FIFO_SIZE 128
+
+/* The only block size the block layer requests are made of */
+#define STM32_SDIO_SECTOR_SIZE 512
+
+#define STM32_SDIO_DMA_REQ_COUNT 2
+
+/* Card command indexes the controller needs to know about */
+#define SD_CMD_STOP_TRANSMISSION 12
+#define SD_ACMD_SD_SEND_OP_COND 41
+#define SD_CMD_APP_CMD 55
+
+struct Stm32Sdio {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    Stm32f2xxDma *stm32_dma;
+    /* STM32F2XX_DMA_REQ() numbers of the streams serving the SDIO, or -1 */
+    int32_t dma_req[STM32_SDIO_DMA_REQ_COUNT];
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    BlockDriverState *bs;
+    SDState *card;
+
+    /* The last command accepted was APP_CMD, so the next one is an
+     * application specific command. */
+    bool app_cmd;
+
+    /* Data path state */
+    bool data_active;
+    bool data_read;
+    uint32_t data_count;
+    uint32_t block_size;
+    uint32_t block_left;
+
+    /* The blocks being moved by the block layer */
+    bool aio_busy;
+    BlockDriverAIOCB *aiocb;
+    QEMUSGList sg;
+    int aio_req;
+    uint32_t aio_blocks;
+
+    /* Signals the end of a transfer made through the FIFO to the DMA
+     * streams, once the burst that read or wrote the last word is over. */
+    QEMUBH *dma_end_bh;
+
+    uint32_t
+        SDIO_POWER,
+        SDIO_CLKCR,
+        SDIO_ARG,
+        SDIO_CMD,
+        SDIO_RESPCMD,
+        SDIO_RESP[4],
+        SDIO_DTIMER,
+        SDIO_DLEN,
+        SDIO_DCTRL,
+        SDIO_STA,
+        SDIO_MASK;
+
+    qemu_irq irq;
+    qemu_irq dma_req_irq;
+};
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static uint32_t stm32_sdio_STA_read(Stm32Sdio *s)
+{
+    uint32_t value = s->SDIO_STA;
+
+    if (!s->data_active) {
+        return value;
+    }
+
+    if (s->data_read) {
+        SET_BIT(value, SDIO_STA_RXACT_BIT);
+        if (s->aio_busy || !sd_data_ready(s->card)) {
+            SET_BIT(value, SDIO_STA_RXFIFOE_BIT);
+        } else {
+            SET_BIT(value, SDIO_STA_RXDAVL_BIT);
+            if (s->data_count >= STM32_SDIO_FIFO_SIZE / 2) {
+                SET_BIT(value, SDIO_STA_RXFIFOHF_BIT);
+            }
+            if (s->data_count >= STM32_SDIO_FIFO_SIZE) {
+                SET_BIT(value, SDIO_STA_RXFIFOF_BIT);
+            }
+        }
+    } else {
+        SET_BIT(value, SDIO_STA_TXACT_BIT);
+        SET_BIT(value, SDIO_STA_TXFIFOE_BIT);
+        if (!s->aio_busy) {
+            SET_BIT(value, SDIO_STA_TXFIFOHE_BIT);
+        }
+    }
+
+    return value;
+}
+
+/* Updates the interrupt and the DMA request line.  Raising the request
+ * may have the DMA access the FIFO straight away. */
+static void stm32_sdio_update(Stm32Sdio *s)
+{
+    bool irq, dma_req;
+
+    irq = (stm32_sdio_STA_read(s) & s->SDIO_MASK) != 0;
+    trace_stm32_sdio_irq(s, irq);
+    qemu_set_irq(s->irq, irq);
+
+    dma_req = s->data_active && !s->aio_busy &&
+              IS_BIT_SET(s->SDIO_DCTRL, SDIO_DCTRL_DMAEN_BIT) &&
+              (!s->data_read || sd_data_ready(s->card));
+    qemu_set_irq(s->dma_req_irq, dma_req);
+}
+
+static void stm32_sdio_dma_end_bh(void *opaque)
+{
+    Stm32Sdio *s = (Stm32Sdio *)opaque;
+    int i;
+
+    for (i = 0; i < STM32_SDIO_DMA_REQ_COUNT; i++) {
+        if (s->stm32_dma && s->dma_req[i] >= 0) {
+            stm32f2xx_dma_block_end(s->stm32_dma, s->dma_req[i], 0, true);
+        }
+    }
+}
+
+static void stm32_sdio_data_stop(Stm32Sdio *s)
+{
+    if (s->aio_busy) {
+        bdrv_aio_cancel(s->aiocb);
+        qemu_sglist_destroy(&s->sg);
+        s->aio_busy = false;
+        s->aiocb = NULL;
+    }
+    s->data_active = false;
+}
+
+/* Accounts for len bytes having gone through the FIFO. */
+static void stm32_sdio_data_advance(Stm32Sdio *s, uint32_t len)
+{
+    len = MIN(len, s->data_count);
+    s->data_count -= len;
+    s->block_left -= MIN(len, s->block_left);
+
+    if (s->block_left == 0) {
+        SET_BIT(s->SDIO_STA, SDIO_STA_DBCKEND_BIT);
+        s->block_left = s->block_size;
+    }
+    if (s->data_count == 0) {
+        DPRINTF("Data transfer complete\n");
+        SET_BIT(s->SDIO_STA, SDIO_STA_DATAEND_BIT);
+        s->data_active = false;
+        if (IS_BIT_SET(s->SDIO_DCTRL, SDIO_DCTRL_DMAEN_BIT)) {
+            qemu_bh_schedule(s->dma_end_bh);
+        }
+    }
+}
+
+static void stm32_sdio_data_run(Stm32Sdio *s);
+
+static void stm32_sdio_aio_complete(void *opaque, int ret)
+{
+    Stm32Sdio *s = (Stm32Sdio *)opaque;
+    uint32_t len = s->aio_blocks * STM32_SDIO_SECTOR_SIZE;
+    bool last;
+
+    s->aio_busy = false;
+    s->aiocb = NULL;
+    qemu_sglist_destroy(&s->sg);
+
+    if (ret < 0) {
+        stm32_hw_warn("%s: host I/O error %d on the SD card",
+                      s->busdev.qdev.id, ret);
+        SET_BIT(s->SDIO_STA, SDIO_STA_DTIMEOUT_BIT);
+        s->data_active = false;
+        stm32f2xx_dma_block_end(s->stm32_dma, s->aio_req, 0, true);
+        stm32_sdio_update(s);
+        return;
+    }
+
+    DPRINTF("%u blocks %s\n", s->aio_blocks,
+            s->data_read ? "read" : "written");
+
+    sd_block_transfer_done(s->card, s->aio_blocks);
+    last = (len == s->data_count);
+    s->data_count -= len;
+    SET_BIT(s->SDIO_STA, SDIO_STA_DBCKEND_BIT);
+    if (last) {
+        SET_BIT(s->SDIO_STA, SDIO_STA_DATAEND_BIT);
+        s->data_active = false;
+    }
+    stm32f2xx_dma_block_end(s->stm32_dma, s->aio_req, len, last);
+
+    stm32_sdio_data_run(s);
+}
+
+/* Starts moving as many whole blocks as the DMA stream and the card allow
+ * with one block layer request.  Returns false if the transfer cannot be
+ * done this way, in which case it is left to the DMA request line. */
+static bool stm32_sdio_dma_block(Stm32Sdio *s)
+{
+    hwaddr fifo_addr = s->busdev.mmio[0].addr + SDIO_FIFO_OFFSET;
+    BlockDriverAIOCB *acb;
+    hwaddr mar = 0;
+    uint64_t addr;
+    uint32_t len = 0, blocks, blk_len;
+    bool write;
+    int i, req = -1;
+
+    if (!s->stm32_dma || !s->bs ||
+        s->block_size != STM32_SDIO_SECTOR_SIZE ||
+        s->block_left != s->block_size) {
+        return false;
+    }
+
+    for (i = 0; i < STM32_SDIO_DMA_REQ_COUNT && len == 0; i++) {
+        if (s->dma_req[i] >= 0) {
+            req = s->dma_req[i];
+            len = stm32f2xx_dma_block_begin(s->stm32_dma, req, fifo_addr,
+                                            s->data_read, &mar);
+        }
+    }
+    len = MIN(len, s->data_count);
+    if (len < STM32_SDIO_SECTOR_SIZE) {
+        return false;
+    }
+
+    blocks = sd_block_transfer_begin(s->card, len / STM32_SDIO_SECTOR_SIZE,
+                                     &addr, &blk_len, &write);
+    if (blocks == 0 || blk_len != STM32_SDIO_SECTOR_SIZE ||
+        addr % STM32_SDIO_SECTOR_SIZE || write == s->data_read) {
+        return false;
+    }
+    len = blocks * STM32_SDIO_SECTOR_SIZE;
+
+    DPRINTF("%s %u blocks at 0x%08llx, memory 0x%08x\n",
+            write ? "Writing" : "Reading", blocks,
+            (unsigned long long)addr, (uint32_t)mar);
+
+    qemu_sglist_init(&s->sg, 1, &dma_context_memory);
+    qemu_sglist_add(&s->sg, mar, len);
+    s->aio_req = req;
+    s->aio_blocks = blocks;
+    s->aio_busy = true;
+    stm32_sdio_update(s);
+
+    if (write) {
+        acb = dma_bdrv_write(s->bs, &s->sg, addr / STM32_SDIO_SECTOR_SIZE,
+                             stm32_sdio_aio_complete, s);
+    } else {
+        acb = dma_bdrv_read(s->bs, &s->sg, addr / STM32_SDIO_SECTOR_SIZE,
+                            stm32_sdio_aio_complete, s);
+    }
+    /* Unless the request already completed (and maybe started the next
+     * one). */
+    if (s->aio_busy && !s->aiocb) {
+        s->aiocb = acb;
+    }
+    return true;
+}
+
+/* Moves the data path on: starts a block layer request if possible, or
+ * lets the FIFO be accessed. */
+static void stm32_sdio_data_run(Stm32Sdio *s)
+{
+    if (s->data_active && !s->aio_busy &&
+        IS_BIT_SET(s->SDIO_DCTRL, SDIO_DCTRL_DMAEN_BIT) &&
+        stm32_sdio_dma_block(s)) {
+        return;
+    }
+    stm32_sdio_update(s);
+}
+
+static void stm32_sdio_send_command(Stm32Sdio *s)
+{
+    uint8_t response[16];
+    SDRequest request;
+    int index = s->SDIO_CMD & SDIO_CMD_CMDINDEX_MASK;
+    int waitresp = (s->SDIO_CMD & SDIO_CMD_WAITRESP_MASK) >>
+                   SDIO_CMD_WAITRESP_START;
+    int rlen = 0, n;
+    bool app_cmd = s->app_cmd;
+
+    /* An unpowered card does not answer. */
+    if ((s->SDIO_POWER & SDIO_POWER_PWRCTRL_MASK) == SDIO_POWER_PWRCTRL_ON) {
+        request.cmd = index;
+        request.arg = s->SDIO_ARG;
+        request.crc = 0;
+        rlen = sd_do_command(s->card, &request, response);
+    }
+    s->app_cmd = (index == SD_CMD_APP_CMD && rlen > 0);
+
+    DPRINTF("CMD%d arg 0x%08x: %d byte response\n", index, s->SDIO_ARG,
+            rlen);
+
+    if (waitresp != SDIO_WAITRESP_SHORT && waitresp != SDIO_WAITRESP_LONG) {
+        SET_BIT(s->SDIO_STA, SDIO_STA_CMDSENT_BIT);
+    } else if (rlen == 0) {
+        SET_BIT(s->SDIO_STA, SDIO_STA_CTIMEOUT_BIT);
+    } else {
+        memset(s->SDIO_RESP, 0, sizeof(s->SDIO_RESP));
+        for (n = 0; n < rlen / 4 && n < 4; n++) {
+            s->SDIO_RESP[n] = ldl_be_p(response + n * 4);
+        }
+        /* The command index of a long response is all ones. */
+        s->SDIO_RESPCMD = (rlen == 16) ? 0x3f : index;
+        if (app_cmd && index == SD_ACMD_SD_SEND_OP_COND) {
+            SET_BIT(s->SDIO_STA, SDIO_STA_CCRCFAIL_BIT);
+        } else {
+            SET_BIT(s->SDIO_STA, SDIO_STA_CMDREND_BIT);
+        }
+    }
+
+    if (index == SD_CMD_STOP_TRANSMISSION && s->data_active) {
+        stm32_sdio_data_stop(s);
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_sdio_SDIO_DCTRL_write(Stm32Sdio *s, uint32_t new_value)
+{
+    bool start = IS_BIT_SET(new_value, SDIO_DCTRL_DTEN_BIT) &&
+                 !s->data_active;
+
+    s->SDIO_DCTRL = new_value & SDIO_DCTRL_MASK;
+
+    if (!start) {
+        return;
+    }
+
+    if (IS_BIT_SET(new_value, SDIO_DCTRL_DTMODE_BIT)) {
+        stm32_hw_warn("%s: stream data transfers are not supported",
+                      s->busdev.qdev.id);
+        return;
+    }
+
+    s->data_active = true;
+    s->data_read = IS_BIT_SET(new_value, SDIO_DCTRL_DTDIR_BIT);
+    s->data_count = s->SDIO_DLEN;
+    s->block_size = 1 << ((new_value & SDIO_DCTRL_DBLOCKSIZE_MASK) >>
+                          SDIO_DCTRL_DBLOCKSIZE_START);
+    s->block_left = s->block_size;
+
+    DPRINTF("Data %s of %u bytes in blocks of %u\n",
+            s->data_read ? "read" : "write", s->data_count, s->block_size);
+
+    if (s->data_count == 0) {
+        SET_BIT(s->SDIO_STA, SDIO_STA_DATAEND_BIT);
+        s->data_active = false;
+    }
+}
+
+static uint32_t stm32_sdio_SDIO_FIFO_read(Stm32Sdio *s)
+{
+    uint32_t value = 0;
+    int n;
+
+    if (!s->data_active || !s->data_read || s->aio_busy ||
+        !sd_data_ready(s->card)) {
+        return 0;
+    }
+
+    for (n = 0; n < 4 && n < s->data_count; n++) {
+        value |= sd_read_data(s->card) << (n * 8);
+    }
+    stm32_sdio_data_advance(s, 4);
+    stm32_sdio_update(s);
+
+    return value;
+}
+
+static void stm32_sdio_SDIO_FIFO_write(Stm32Sdio *s, uint32_t new_value)
+{
+    int n;
+
+    if (!s->data_active || s->data_read || s->aio_busy) {
+        return;
+    }
+
+    for (n = 0; n < 4 && n < s->data_count; n++) {
+        sd_write_data(s->card, new_value >> (n * 8));
+    }
+    stm32_sdio_data_advance(s, 4);
+    stm32_sdio_update(s);
+}
+
+static uint64_t stm32_sdio_readw(Stm32Sdio *s, hwaddr offset)
+{
+    if (offset >= SDIO_FIFO_OFFSET && offset < SDIO_FIFO_END) {
+        return stm32_sdio_SDIO_FIFO_read(s);
+    }
+
+    switch (offset) {
+        case SDIO_POWER_OFFSET:
+            return s->SDIO_POWER;
+        case SDIO_CLKCR_OFFSET:
+            return s->SDIO_CLKCR;
+        case SDIO_ARG_OFFSET:
+            return s->SDIO_ARG;
+        case SDIO_CMD_OFFSET:
+            return s->SDIO_CMD;
+        case SDIO_RESPCMD_OFFSET:
+            return s->SDIO_RESPCMD;
+        case SDIO_RESP1_OFFSET ... SDIO_RESP4_OFFSET:
+            return s->SDIO_RESP[(offset - SDIO_RESP1_OFFSET) / 4];
+        case SDIO_DTIMER_OFFSET:
+            return s->SDIO_DTIMER;
+        case SDIO_DLEN_OFFSET:
+            return s->SDIO_DLEN;
+        case SDIO_DCTRL_OFFSET:
+            return s->SDIO_DCTRL;
+        case SDIO_DCOUNT_OFFSET:
+            return s->data_active ? s->data_count : 0;
+        case SDIO_STA_OFFSET:
+            return stm32_sdio_STA_read(s);
+        case SDIO_ICR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case SDIO_MASK_OFFSET:
+            return s->SDIO_MASK;
+        case SDIO_FIFOCNT_OFFSET:
+            return s->data_active ? (s->data_count + 3) / 4 : 0;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_sdio_writew(Stm32Sdio *s, hwaddr offset, uint32_t value)
+{
+    if (offset >= SDIO_FIFO_OFFSET && offset < SDIO_FIFO_END) {
+        stm32_sdio_SDIO_FIFO_write(s, value);
+        return;
+    }
+
+    switch (offset) {
+        case SDIO_POWER_OFFSET:
+            s->SDIO_POWER = value & SDIO_POWER_PWRCTRL_MASK;
+            break;
+        case SDIO_CLKCR_OFFSET:
+            s->SDIO_CLKCR = value & SDIO_CLKCR_MASK;
+            break;
+        case SDIO_ARG_OFFSET:
+            s->SDIO_ARG = value;
+            break;
+        case SDIO_CMD_OFFSET:
+            s->SDIO_CMD = value & SDIO_CMD_MASK;
+            if (IS_BIT_SET(value, SDIO_CMD_CPSMEN_BIT)) {
+                stm32_sdio_send_command(s);
+            }
+            break;
+        case SDIO_RESPCMD_OFFSET:
+        case SDIO_RESP1_OFFSET ... SDIO_RESP4_OFFSET:
+        case SDIO_DCOUNT_OFFSET:
+        case SDIO_STA_OFFSET:
+        case SDIO_FIFOCNT_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        case SDIO_DTIMER_OFFSET:
+            s->SDIO_DTIMER = value;
+            break;
+        case SDIO_DLEN_OFFSET:
+            s->SDIO_DLEN = value & SDIO_DLEN_MASK;
+            break;
+        case SDIO_DCTRL_OFFSET:
+            stm32_sdio_SDIO_DCTRL_write(s, value);
+            break;
+        case SDIO_ICR_OFFSET:
+            s->SDIO_STA &= ~(value & SDIO_STA_STATIC_MASK);
+            break;
+        case SDIO_MASK_OFFSET:
+            s->SDIO_MASK = value & SDIO_MASK_MASK;
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return;
+    }
+
+    stm32_sdio_data_run(s);
+}
+
+static uint64_t stm32_sdio_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Sdio *s = (Stm32Sdio *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32_sdio_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_sdio_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_sdio_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Sdio *s = (Stm32Sdio *)opaque;
+
+    trace_stm32_sdio_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32_sdio_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_sdio_ops = {
+    .read = stm32_sdio_read,
+    .write = stm32_sdio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_sdio_reset(DeviceState *dev)
+{
+    Stm32Sdio *s = FROM_SYSBUS(Stm32Sdio, SYS_BUS_DEVICE(dev));
+
+    stm32_sdio_data_stop(s);
+    s->app_cmd = false;
+
+    s->SDIO_POWER = 0;
+    s->SDIO_CLKCR = 0;
+    s->SDIO_ARG = 0;
+    s->SDIO_CMD = 0;
+    s->SDIO_RESPCMD = 0;
+    memset(s->SDIO_RESP, 0, sizeof(s->SDIO_RESP));
+    s->SDIO_DTIMER = 0;
+    s->SDIO_DLEN = 0;
+    s->SDIO_DCTRL = 0;
+    s->SDIO_STA = 0;
+    s->SDIO_MASK = 0;
+
+    stm32_sdio_update(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_sdio_instance_init(Object *obj)
+{
+    Stm32Sdio *s = FROM_SYSBUS(Stm32Sdio, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32f2xx_dma", "stm32f2xx_dma",
+                             (Object **)&s->stm32_dma, NULL);
+}
+
+static int stm32_sdio_init(SysBusDevice *dev)
+{
+    Stm32Sdio *s = FROM_SYSBUS(Stm32Sdio, dev);
+    DriveInfo *dinfo;
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_sdio_ops, s,
+                          "sdio", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out(&dev->qdev, &s->dma_req_irq, 1);
+
+    dinfo = drive_get(IF_SD, 0, 0);
+    s->bs = dinfo ? dinfo->bdrv : NULL;
+    s->card = sd_init(s->bs, false);
+
+    s->dma_end_bh = qemu_bh_new(stm32_sdio_dma_end_bh, s);
+
+    return 0;
+}
+
+static Property stm32_sdio_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Sdio, periph, -1),
+    DEFINE_PROP_INT32("dma_req0", Stm32Sdio, dma_req[0], -1),
+    DEFINE_PROP_INT32("dma_req1", Stm32Sdio, dma_req[1], -1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_sdio_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_sdio_init;
+    dc->reset = stm32_sdio_reset;
+    dc->props = stm32_sdio_properties;
+}
+
+static TypeInfo stm32_sdio_info = {
+    .name  = "stm32_sdio",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Sdio),
+    .instance_init = stm32_sdio_instance_init,
+    .class_init = stm32_sdio_class_init
+};
+
+static void stm32_sdio_register_types(void)
+{
+    type_register_static(&stm32_sdio_info);
+}
+
+type_init(stm32_sdio_register_types)
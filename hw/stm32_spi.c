@@ -0,0 +1,1023 @@
+/*
+ * STM32 Microcontroller SPI controller
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * Only master mode is implemented.  A frame written to SPI_DR is exchanged
+ * with the slaves on the SSI bus straight away, so TXE never stays clear and
+ * BSY is never seen set.  16-bit frames are sent as two bytes, most
+ * significant first (least significant first if LSBFIRST is set).  CRC
+ * calculation is not modelled.
+ *
+ * When TXDMAEN is set and the DMA channels are ready, the whole block is
+ * exchanged with the slaves in one go rather than byte by byte through the
+ * DMA request lines, which the slaves can then serve with a single copy
+ * (see ssi_transfer_bulk).
+ *
+ * On SPI2 and SPI3 of the high-density parts, the I2S mode plays the
+ * samples on the host's audio (master transmit only).  The samples go
+ * through a ring, which a timer on the virtual clock drains to AUD_write
+ * a period at a time, at the sample rate given by I2SPR and the I2S clock;
+ * the audio layer converts them to the host's rate.  With TXDMAEN set,
+ * the timer takes what is due straight from the DMA channel as a block
+ * (halfword data only), and the period is a quarter of the DMA buffer so
+ * that HT and TC come at the pace they would on the chip.  Without DMA,
+ * TXE stays set while the ring holds less than two periods.  Only the
+ * upper halves of 24 and 32 bit samples are played, and the PCM standard
+ * is played as mono.  The rate is latched when I2SE is set.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "ssi.h"
+#include "exec/memory.h"
+#include "audio/audio.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_SPI
+
+#ifdef DEBUG_STM32_SPI
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_SPI: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define SPI_CR1_OFFSET 0x00
+#define SPI_CR1_CPHA_BIT 0
+#define SPI_CR1_CPOL_BIT 1
+#define SPI_CR1_MSTR_BIT 2
+#define SPI_CR1_BR_START 3
+#define SPI_CR1_BR_MASK 0x00000038
+#define SPI_CR1_SPE_BIT 6
+#define SPI_CR1_LSBFIRST_BIT 7
+#define SPI_CR1_SSI_BIT 8
+#define SPI_CR1_SSM_BIT 9
+#define SPI_CR1_RXONLY_BIT 10
+#define SPI_CR1_DFF_BIT 11
+#define SPI_CR1_CRCNEXT_BIT 12
+#define SPI_CR1_CRCEN_BIT 13
+#define SPI_CR1_BIDIOE_BIT 14
+#define SPI_CR1_BIDIMODE_BIT 15
+
+#define SPI_CR2_OFFSET 0x04
+#define SPI_CR2_RXDMAEN_BIT 0
+#define SPI_CR2_TXDMAEN_BIT 1
+#define SPI_CR2_SSOE_BIT 2
+#define SPI_CR2_ERRIE_BIT 5
+#define SPI_CR2_RXNEIE_BIT 6
+#define SPI_CR2_TXEIE_BIT 7
+
+#define SPI_SR_OFFSET 0x08
+#define SPI_SR_RXNE_BIT 0
+#define SPI_SR_TXE_BIT 1
+#define SPI_SR_CHSIDE_BIT 2
+#define SPI_SR_UDR_BIT 3
+#define SPI_SR_CRCERR_BIT 4
+#define SPI_SR_MODF_BIT 5
+#define SPI_SR_OVR_BIT 6
+#define SPI_SR_BSY_BIT 7
+
+#define SPI_DR_OFFSET 0x0c
+#define SPI_CRCPR_OFFSET 0x10
+#define SPI_RXCRCR_OFFSET 0x14
+#define SPI_TXCRCR_OFFSET 0x18
+#define SPI_I2SCFGR_OFFSET 0x1c
+#define SPI_I2SCFGR_CHLEN_BIT 0
+#define SPI_I2SCFGR_DATLEN_MASK 0x00000006
+#define SPI_I2SCFGR_I2SSTD_START 4
+#define SPI_I2SCFGR_I2SSTD_MASK 0x00000030
+#define SPI_I2SCFGR_I2SSTD_PCM 3
+#define SPI_I2SCFGR_I2SCFG_START 8
+#define SPI_I2SCFGR_I2SCFG_MASK 0x00000300
+#define SPI_I2SCFGR_I2SCFG_MASTER_TX 2
+#define SPI_I2SCFGR_I2SE_BIT 10
+#define SPI_I2SCFGR_I2SMOD_BIT 11
+#define SPI_I2SPR_OFFSET 0x20
+#define SPI_I2SPR_I2SDIV_MASK 0x000000ff
+#define SPI_I2SPR_ODD_BIT 8
+#define SPI_I2SPR_MCKOE_BIT 9
+
+/* Size of the buffers used for DMA block transfers */
+#define STM32_SPI_DMA_CHUNK 4096
+
+/* Samples held by the I2S ring, more than two periods of stereo at
+ * 96 kHz */
+#define STM32_I2S_RING_SIZE 4096
+/* Bounds of the period of the I2S timer */
+#define STM32_I2S_MAX_PERIOD_NS 10000000
+#define STM32_I2S_MIN_PERIOD_NS 1000000
+
+struct Stm32Spi {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    Stm32Dma *stm32_dma;
+    /* DMA channels that the requests are connected to, for block
+     * transfers (0 if there are none). */
+    uint32_t dma_rx_channel;
+    uint32_t dma_tx_channel;
+    /* The I2S clock, for SPIs that have the I2S mode (-1 otherwise) */
+    stm32_periph_t i2s_periph;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    SSIBus *ssi;
+
+    /* Register Values */
+    uint32_t
+        SPI_CR1,
+        SPI_CR2,
+        SPI_SR,
+        SPI_CRCPR,
+        SPI_I2SCFGR,
+        SPI_I2SPR;
+
+    /* The last frame received */
+    uint32_t rx_data;
+
+    /* OVR is cleared by reading SPI_DR and then SPI_SR, MODF by reading
+     * SPI_SR and then writing SPI_CR1. */
+    bool dr_read_since_ovr_set;
+    bool sr_read_since_modf_set;
+
+    qemu_irq irq;
+    int curr_irq_level;
+
+    /* DMA request outputs (see STM32_SPI_DMA_*_REQ) */
+    qemu_irq dma_req[2];
+    int curr_dma_rx_level, curr_dma_tx_level;
+
+    /* I2S */
+    Stm32PeriphClk i2s_clk;
+    QEMUSoundCard card;
+    SWVoiceOut *voice;
+    QEMUTimer *i2s_timer;
+    bool i2s_running;
+    /* Latched when I2SE is set */
+    uint32_t i2s_rate;
+    int i2s_channels;
+    int i2s_halfwords; /* DR writes per sample */
+    /* Set when the next DR write is the lower half of a sample */
+    bool i2s_low_half;
+    /* Frames played since i2s_start_ns */
+    int64_t i2s_start_ns;
+    uint64_t i2s_frames;
+    int64_t i2s_period_ns;
+    /* Samples in host order, waiting to be played */
+    int16_t i2s_ring[STM32_I2S_RING_SIZE];
+    uint32_t i2s_ring_start, i2s_ring_count;
+};
+
+
+
+
+/* TRANSFERS */
+
+static uint8_t stm32_spi_reverse8(uint8_t value)
+{
+    value = ((value & 0xf0) >> 4) | ((value & 0x0f) << 4);
+    value = ((value & 0xcc) >> 2) | ((value & 0x33) << 2);
+    value = ((value & 0xaa) >> 1) | ((value & 0x55) << 1);
+    return value;
+}
+
+/* Sends len bytes to the slaves, in the order they go out on the wire. */
+static void stm32_spi_transfer_bytes(Stm32Spi *s, uint8_t *tx, uint8_t *rx,
+                                     uint32_t len)
+{
+    bool lsb_first = IS_BIT_SET(s->SPI_CR1, SPI_CR1_LSBFIRST_BIT);
+    uint32_t i;
+
+    /* Slaves see the data most significant bit first. */
+    if (lsb_first) {
+        for (i = 0; i < len; i++) {
+            tx[i] = stm32_spi_reverse8(tx[i]);
+        }
+    }
+
+    if (len == 1) {
+        rx[0] = ssi_transfer(s->ssi, tx[0]);
+    } else {
+        ssi_transfer_bulk(s->ssi, tx, rx, len);
+    }
+
+    if (lsb_first) {
+        for (i = 0; i < len; i++) {
+            rx[i] = stm32_spi_reverse8(rx[i]);
+        }
+    }
+}
+
+/* Latches a received frame into SPI_DR, or flags an overrun if the last
+ * one has not been read yet (the new frame is then lost). */
+static void stm32_spi_receive(Stm32Spi *s, uint32_t value)
+{
+    if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_BIDIMODE_BIT) &&
+        IS_BIT_SET(s->SPI_CR1, SPI_CR1_BIDIOE_BIT)) {
+        /* Transmit only bidirectional mode */
+        return;
+    }
+
+    if (IS_BIT_SET(s->SPI_SR, SPI_SR_RXNE_BIT)) {
+        DPRINTF("%s: overrun\n", s->busdev.qdev.id);
+        SET_BIT(s->SPI_SR, SPI_SR_OVR_BIT);
+        s->dr_read_since_ovr_set = false;
+    } else {
+        s->rx_data = value;
+        SET_BIT(s->SPI_SR, SPI_SR_RXNE_BIT);
+    }
+}
+
+static void stm32_spi_transfer_frame(Stm32Spi *s, uint32_t value)
+{
+    uint8_t tx[2], rx[2];
+
+    if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_DFF_BIT)) {
+        if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_LSBFIRST_BIT)) {
+            tx[0] = value;
+            tx[1] = value >> 8;
+            stm32_spi_transfer_bytes(s, tx, rx, 2);
+            value = rx[0] | (rx[1] << 8);
+        } else {
+            tx[0] = value >> 8;
+            tx[1] = value;
+            stm32_spi_transfer_bytes(s, tx, rx, 2);
+            value = (rx[0] << 8) | rx[1];
+        }
+    } else {
+        tx[0] = value;
+        stm32_spi_transfer_bytes(s, tx, rx, 1);
+        value = rx[0];
+    }
+
+    DPRINTF("%s: sent 0x%04x, received 0x%04x\n", s->busdev.qdev.id,
+            tx[0] | (IS_BIT_SET(s->SPI_CR1, SPI_CR1_DFF_BIT) ? tx[1] << 8 : 0),
+            value);
+
+    stm32_spi_receive(s, value);
+}
+
+/* Moves as much as the armed DMA channels allow in one go.  Only byte
+ * frames to a peripheral address that does not increment are handled;
+ * returns false if the channels are set up any other way, in which case
+ * the transfer is left to the request lines. */
+static bool stm32_spi_dma_block(Stm32Spi *s)
+{
+    uint8_t tx[STM32_SPI_DMA_CHUNK], rx[STM32_SPI_DMA_CHUNK];
+    hwaddr dr_addr = s->busdev.mmio[0].addr + SPI_DR_OFFSET;
+    hwaddr tx_mar, rx_mar = 0;
+    uint32_t tx_step, rx_step = 0;
+    uint32_t count, rx_count = 0, done, chunk;
+    uint8_t first_rx = 0;
+    bool rx_dma = IS_BIT_SET(s->SPI_CR2, SPI_CR2_RXDMAEN_BIT);
+    AddressSpace *as;
+
+    if (!s->stm32_dma || !s->dma_tx_channel ||
+        IS_BIT_SET(s->SPI_CR1, SPI_CR1_DFF_BIT)) {
+        return false;
+    }
+    as = stm32_dma_get_address_space(s->stm32_dma);
+
+    count = stm32_dma_block_begin(s->stm32_dma, s->dma_tx_channel, dr_addr,
+                                  false, 1, &tx_mar, &tx_step);
+    if (count == 0) {
+        return false;
+    }
+    if (rx_dma) {
+        if (IS_BIT_SET(s->SPI_SR, SPI_SR_RXNE_BIT) || !s->dma_rx_channel) {
+            return false;
+        }
+        rx_count = stm32_dma_block_begin(s->stm32_dma, s->dma_rx_channel,
+                                         dr_addr, true, 1, &rx_mar,
+                                         &rx_step);
+        if (rx_count == 0) {
+            return false;
+        }
+        count = MIN(count, rx_count);
+    }
+
+    DPRINTF("%s: DMA block of %u bytes from 0x%08x\n", s->busdev.qdev.id,
+            count, (uint32_t)tx_mar);
+
+    for (done = 0; done < count; done += chunk) {
+        chunk = MIN(count - done, sizeof(tx));
+        if (tx_step) {
+            address_space_read(as, tx_mar + done, tx, chunk);
+        } else {
+            address_space_read(as, tx_mar, tx, 1);
+            memset(tx + 1, tx[0], chunk - 1);
+        }
+        stm32_spi_transfer_bytes(s, tx, rx, chunk);
+        if (done == 0) {
+            first_rx = rx[0];
+        }
+        if (!rx_dma) {
+            continue;
+        }
+        if (rx_step) {
+            address_space_write(as, rx_mar + done, rx, chunk);
+        } else {
+            address_space_write(as, rx_mar, rx + chunk - 1, 1);
+        }
+    }
+
+    if (!rx_dma) {
+        /* Nothing reads the frames, so all but the first are overruns. */
+        stm32_spi_receive(s, first_rx);
+        if (count > 1) {
+            stm32_spi_receive(s, 0);
+        }
+    }
+
+    stm32_dma_block_end(s->stm32_dma, s->dma_tx_channel, count);
+    if (rx_dma) {
+        stm32_dma_block_end(s->stm32_dma, s->dma_rx_channel, count);
+    }
+
+    return true;
+}
+
+
+
+
+/* I2S */
+
+static void stm32_spi_update_irq(Stm32Spi *s);
+
+static bool stm32_spi_i2s_mode(Stm32Spi *s)
+{
+    return IS_BIT_SET(s->SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD_BIT);
+}
+
+/* Whether the timer takes the samples from the DMA channel, instead of the
+ * channel being driven by the request line. */
+static bool stm32_spi_i2s_dma(Stm32Spi *s)
+{
+    return s->i2s_running && s->stm32_dma && s->dma_tx_channel &&
+           IS_BIT_SET(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT);
+}
+
+/* Returns 0 if I2SPR does not give a valid rate. */
+static uint32_t stm32_spi_i2s_get_rate(Stm32Spi *s)
+{
+    uint32_t div = 2 * (s->SPI_I2SPR & SPI_I2SPR_I2SDIV_MASK) +
+                   IS_BIT_SET(s->SPI_I2SPR, SPI_I2SPR_ODD_BIT);
+    uint32_t bits;
+
+    if (div < 4) {
+        return 0;
+    }
+    if (IS_BIT_SET(s->SPI_I2SPR, SPI_I2SPR_MCKOE_BIT)) {
+        bits = 256;
+    } else {
+        bits = IS_BIT_SET(s->SPI_I2SCFGR, SPI_I2SCFGR_CHLEN_BIT) ? 64 : 32;
+    }
+    return s->i2s_clk.freq / (bits * div);
+}
+
+static int64_t stm32_spi_i2s_get_period(Stm32Spi *s)
+{
+    int64_t period = STM32_I2S_MAX_PERIOD_NS;
+    uint32_t beats;
+
+    if (stm32_spi_i2s_dma(s)) {
+        beats = stm32_dma_get_reload(s->stm32_dma, s->dma_tx_channel) / 4;
+        if (beats) {
+            period = MIN(period,
+                         muldiv64(beats / (s->i2s_channels * s->i2s_halfwords),
+                                  get_ticks_per_sec(), s->i2s_rate));
+        }
+    }
+    return MAX(period, STM32_I2S_MIN_PERIOD_NS);
+}
+
+/* Room left for samples written to SPI_DR, up to two periods ahead. */
+static uint32_t stm32_spi_i2s_room(Stm32Spi *s)
+{
+    uint32_t limit = muldiv64(2 * s->i2s_period_ns, s->i2s_rate,
+                              get_ticks_per_sec()) * s->i2s_channels;
+
+    limit = MIN(limit, STM32_I2S_RING_SIZE);
+    return s->i2s_ring_count < limit ? limit - s->i2s_ring_count : 0;
+}
+
+static void stm32_spi_i2s_push(Stm32Spi *s, uint16_t value)
+{
+    bool upper = !s->i2s_low_half;
+
+    if (s->i2s_halfwords == 2) {
+        s->i2s_low_half = upper;
+    }
+    if (upper && s->i2s_ring_count < STM32_I2S_RING_SIZE) {
+        s->i2s_ring[(s->i2s_ring_start + s->i2s_ring_count) %
+                    STM32_I2S_RING_SIZE] = value;
+        s->i2s_ring_count++;
+    }
+    if (!s->i2s_low_half && s->i2s_channels == 2) {
+        CHANGE_BIT(s->SPI_SR, SPI_SR_CHSIDE_BIT,
+                   !IS_BIT_SET(s->SPI_SR, SPI_SR_CHSIDE_BIT));
+    }
+}
+
+/* Moves up to count halfwords from the DMA channel to the ring. */
+static void stm32_spi_i2s_pull(Stm32Spi *s, uint32_t count)
+{
+    uint8_t buf[STM32_SPI_DMA_CHUNK];
+    hwaddr dr_addr = s->busdev.mmio[0].addr + SPI_DR_OFFSET;
+    AddressSpace *as = stm32_dma_get_address_space(s->stm32_dma);
+    hwaddr mar;
+    uint32_t mstep, chunk, i;
+
+    /* A circular channel that wraps is started again. */
+    while (count) {
+        chunk = stm32_dma_block_begin(s->stm32_dma, s->dma_tx_channel,
+                                      dr_addr, false, 2, &mar, &mstep);
+        if (chunk == 0) {
+            break;
+        }
+        chunk = MIN(MIN(chunk, count), sizeof(buf) / 2);
+        if (mstep) {
+            address_space_read(as, mar, buf, chunk * 2);
+        } else {
+            address_space_read(as, mar, buf, 2);
+            for (i = 1; i < chunk; i++) {
+                memcpy(buf + i * 2, buf, 2);
+            }
+        }
+        for (i = 0; i < chunk; i++) {
+            stm32_spi_i2s_push(s, lduw_le_p(buf + i * 2));
+        }
+        stm32_dma_block_end(s->stm32_dma, s->dma_tx_channel, chunk);
+        count -= chunk;
+    }
+}
+
+/* Plays the first count samples of the ring.  What the host cannot take
+ * is dropped, since the guest's time goes on regardless. */
+static void stm32_spi_i2s_play(Stm32Spi *s, uint32_t count)
+{
+    uint32_t chunk;
+
+    while (count) {
+        chunk = MIN(count, STM32_I2S_RING_SIZE - s->i2s_ring_start);
+        if (s->voice) {
+            AUD_write(s->voice, &s->i2s_ring[s->i2s_ring_start],
+                      chunk * sizeof(int16_t));
+        }
+        s->i2s_ring_start = (s->i2s_ring_start + chunk) % STM32_I2S_RING_SIZE;
+        s->i2s_ring_count -= chunk;
+        count -= chunk;
+    }
+}
+
+static void stm32_spi_i2s_timer_expire(void *opaque)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint64_t due;
+    uint32_t count;
+
+    due = muldiv64(now - s->i2s_start_ns, s->i2s_rate, get_ticks_per_sec()) -
+          s->i2s_frames;
+    s->i2s_frames += due;
+    count = MIN(due * s->i2s_channels, STM32_I2S_RING_SIZE);
+
+    if (stm32_spi_i2s_dma(s)) {
+        stm32_spi_i2s_pull(s, MIN(count, STM32_I2S_RING_SIZE -
+                                         s->i2s_ring_count) *
+                              s->i2s_halfwords);
+    }
+    count = MIN(count, s->i2s_ring_count);
+    stm32_spi_i2s_play(s, count - count % s->i2s_channels);
+
+    s->i2s_period_ns = stm32_spi_i2s_get_period(s);
+    qemu_mod_timer(s->i2s_timer, now + s->i2s_period_ns);
+
+    stm32_spi_update_irq(s);
+}
+
+/* The samples are written from the timer, at the guest's pace. */
+static void stm32_spi_i2s_audio_callback(void *opaque, int avail)
+{
+}
+
+static void stm32_spi_i2s_start(Stm32Spi *s)
+{
+    struct audsettings as;
+    uint32_t cfg = (s->SPI_I2SCFGR & SPI_I2SCFGR_I2SCFG_MASK) >>
+                   SPI_I2SCFGR_I2SCFG_START;
+    uint32_t std = (s->SPI_I2SCFGR & SPI_I2SCFGR_I2SSTD_MASK) >>
+                   SPI_I2SCFGR_I2SSTD_START;
+
+    if (cfg != SPI_I2SCFGR_I2SCFG_MASTER_TX) {
+        stm32_hw_warn("%s: only the I2S master transmit mode is supported",
+                      s->busdev.qdev.id);
+        return;
+    }
+    s->i2s_rate = stm32_spi_i2s_get_rate(s);
+    if (s->i2s_rate == 0) {
+        stm32_hw_warn("%s: invalid I2S prescaler 0x%x", s->busdev.qdev.id,
+                      s->SPI_I2SPR);
+        return;
+    }
+    s->i2s_channels = std == SPI_I2SCFGR_I2SSTD_PCM ? 1 : 2;
+    s->i2s_halfwords = (s->SPI_I2SCFGR & SPI_I2SCFGR_DATLEN_MASK) ? 2 : 1;
+    DPRINTF("%s: I2S at %u Hz, %d channel(s)\n", s->busdev.qdev.id,
+            s->i2s_rate, s->i2s_channels);
+
+    as.freq = s->i2s_rate;
+    as.nchannels = s->i2s_channels;
+    as.fmt = AUD_FMT_S16;
+    as.endianness = AUDIO_HOST_ENDIANNESS;
+    s->voice = AUD_open_out(&s->card, s->voice, "stm32_i2s", s,
+                            stm32_spi_i2s_audio_callback, &as);
+    if (s->voice) {
+        AUD_set_active_out(s->voice, 1);
+    }
+
+    s->i2s_running = true;
+    s->i2s_low_half = false;
+    RESET_BIT(s->SPI_SR, SPI_SR_CHSIDE_BIT);
+    s->i2s_ring_start = 0;
+    s->i2s_ring_count = 0;
+    s->i2s_start_ns = qemu_get_clock_ns(vm_clock);
+    s->i2s_frames = 0;
+    s->i2s_period_ns = stm32_spi_i2s_get_period(s);
+    qemu_mod_timer(s->i2s_timer, s->i2s_start_ns + s->i2s_period_ns);
+}
+
+static void stm32_spi_i2s_stop(Stm32Spi *s)
+{
+    if (!s->i2s_running) {
+        return;
+    }
+    s->i2s_running = false;
+    qemu_del_timer(s->i2s_timer);
+    if (s->voice) {
+        AUD_set_active_out(s->voice, 0);
+    }
+    s->i2s_ring_count = 0;
+    SET_BIT(s->SPI_SR, SPI_SR_TXE_BIT);
+}
+
+
+
+
+static void stm32_spi_update_irq(Stm32Spi *s)
+{
+    int new_irq_level, new_dma_rx_level, new_dma_tx_level;
+
+    if (IS_BIT_SET(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT) &&
+        IS_BIT_SET(s->SPI_CR1, SPI_CR1_SPE_BIT) &&
+        IS_BIT_SET(s->SPI_CR1, SPI_CR1_MSTR_BIT) &&
+        !stm32_spi_i2s_mode(s)) {
+        stm32_spi_dma_block(s);
+    }
+    if (s->i2s_running) {
+        CHANGE_BIT(s->SPI_SR, SPI_SR_TXE_BIT, stm32_spi_i2s_room(s) > 0);
+    }
+
+    new_irq_level =
+        (IS_BIT_SET(s->SPI_CR2, SPI_CR2_TXEIE_BIT) &&
+         IS_BIT_SET(s->SPI_SR, SPI_SR_TXE_BIT)) ||
+        (IS_BIT_SET(s->SPI_CR2, SPI_CR2_RXNEIE_BIT) &&
+         IS_BIT_SET(s->SPI_SR, SPI_SR_RXNE_BIT)) ||
+        (IS_BIT_SET(s->SPI_CR2, SPI_CR2_ERRIE_BIT) &&
+         (IS_BIT_SET(s->SPI_SR, SPI_SR_OVR_BIT) ||
+          IS_BIT_SET(s->SPI_SR, SPI_SR_MODF_BIT) ||
+          IS_BIT_SET(s->SPI_SR, SPI_SR_CRCERR_BIT)));
+    if (new_irq_level != s->curr_irq_level) {
+        s->curr_irq_level = new_irq_level;
+        trace_stm32_spi_irq(s, new_irq_level);
+        qemu_set_irq(s->irq, new_irq_level);
+    }
+
+    /* The transmit request is held back while a received frame waits for
+     * the receive channel, so that a full duplex transfer cannot overrun
+     * itself.  Raising a request may run DMA transfers, which call back
+     * into this function through the register accesses.  In I2S mode the
+     * request is only raised while the timer does not take the samples
+     * itself. */
+    new_dma_rx_level = IS_BIT_SET(s->SPI_CR2, SPI_CR2_RXDMAEN_BIT) &&
+                       IS_BIT_SET(s->SPI_SR, SPI_SR_RXNE_BIT);
+    new_dma_tx_level = IS_BIT_SET(s->SPI_CR2, SPI_CR2_TXDMAEN_BIT) &&
+                       IS_BIT_SET(s->SPI_SR, SPI_SR_TXE_BIT) &&
+                       !new_dma_rx_level &&
+                       (!stm32_spi_i2s_mode(s) ||
+                        (s->i2s_running && !stm32_spi_i2s_dma(s)));
+    if (new_dma_rx_level != s->curr_dma_rx_level) {
+        s->curr_dma_rx_level = new_dma_rx_level;
+        qemu_set_irq(s->dma_req[STM32_SPI_DMA_RX_REQ], new_dma_rx_level);
+    }
+    if (new_dma_tx_level != s->curr_dma_tx_level) {
+        s->curr_dma_tx_level = new_dma_tx_level;
+        qemu_set_irq(s->dma_req[STM32_SPI_DMA_TX_REQ], new_dma_tx_level);
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_spi_SPI_CR1_write(Stm32Spi *s, uint32_t new_value,
+                                    bool init)
+{
+    if (s->sr_read_since_modf_set) {
+        s->sr_read_since_modf_set = false;
+        RESET_BIT(s->SPI_SR, SPI_SR_MODF_BIT);
+    }
+
+    s->SPI_CR1 = new_value & 0x0000ffff;
+
+    if (init) {
+        return;
+    }
+
+    if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_SPE_BIT)) {
+        if (!IS_BIT_SET(s->SPI_CR1, SPI_CR1_MSTR_BIT)) {
+            stm32_hw_warn("%s: slave mode is not supported",
+                          s->busdev.qdev.id);
+        } else if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_SSM_BIT) &&
+                   !IS_BIT_SET(s->SPI_CR1, SPI_CR1_SSI_BIT)) {
+            /* NSS is driven low in master mode: mode fault.  The hardware
+             * then drops out of master mode and disables the SPI. */
+            DPRINTF("%s: mode fault\n", s->busdev.qdev.id);
+            SET_BIT(s->SPI_SR, SPI_SR_MODF_BIT);
+            RESET_BIT(s->SPI_CR1, SPI_CR1_SPE_BIT);
+            RESET_BIT(s->SPI_CR1, SPI_CR1_MSTR_BIT);
+        }
+        if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_RXONLY_BIT) ||
+            (IS_BIT_SET(s->SPI_CR1, SPI_CR1_BIDIMODE_BIT) &&
+             !IS_BIT_SET(s->SPI_CR1, SPI_CR1_BIDIOE_BIT))) {
+            stm32_hw_warn("%s: receive only modes are not supported",
+                          s->busdev.qdev.id);
+        }
+        if (IS_BIT_SET(s->SPI_CR1, SPI_CR1_CRCEN_BIT)) {
+            stm32_hw_warn("%s: CRC calculation is not supported",
+                          s->busdev.qdev.id);
+        }
+    }
+
+    stm32_spi_update_irq(s);
+}
+
+static void stm32_spi_SPI_CR2_write(Stm32Spi *s, uint32_t new_value,
+                                    bool init)
+{
+    s->SPI_CR2 = new_value & 0x000000e7;
+
+    if (!init) {
+        stm32_spi_update_irq(s);
+    }
+}
+
+static uint32_t stm32_spi_SPI_SR_read(Stm32Spi *s)
+{
+    uint32_t value = s->SPI_SR;
+
+    if (IS_BIT_SET(s->SPI_SR, SPI_SR_OVR_BIT) && s->dr_read_since_ovr_set) {
+        RESET_BIT(s->SPI_SR, SPI_SR_OVR_BIT);
+        stm32_spi_update_irq(s);
+    }
+    if (IS_BIT_SET(s->SPI_SR, SPI_SR_MODF_BIT)) {
+        s->sr_read_since_modf_set = true;
+    }
+
+    return value;
+}
+
+static void stm32_spi_SPI_SR_write(Stm32Spi *s, uint32_t new_value)
+{
+    /* Only CRCERR can be cleared by software. */
+    if (!IS_BIT_SET(new_value, SPI_SR_CRCERR_BIT)) {
+        RESET_BIT(s->SPI_SR, SPI_SR_CRCERR_BIT);
+    }
+
+    stm32_spi_update_irq(s);
+}
+
+static uint32_t stm32_spi_SPI_DR_read(Stm32Spi *s)
+{
+    if (IS_BIT_SET(s->SPI_SR, SPI_SR_OVR_BIT)) {
+        s->dr_read_since_ovr_set = true;
+    }
+    RESET_BIT(s->SPI_SR, SPI_SR_RXNE_BIT);
+
+    stm32_spi_update_irq(s);
+
+    return s->rx_data;
+}
+
+static void stm32_spi_SPI_DR_write(Stm32Spi *s, uint32_t new_value)
+{
+    if (stm32_spi_i2s_mode(s)) {
+        if (s->i2s_running) {
+            stm32_spi_i2s_push(s, new_value & 0xffff);
+            stm32_spi_update_irq(s);
+        }
+        return;
+    }
+
+    if (!IS_BIT_SET(s->SPI_CR1, SPI_CR1_SPE_BIT) ||
+        !IS_BIT_SET(s->SPI_CR1, SPI_CR1_MSTR_BIT)) {
+        stm32_hw_warn("%s: ignoring write to SPI_DR while the SPI is not "
+                      "enabled in master mode", s->busdev.qdev.id);
+        return;
+    }
+
+    stm32_spi_transfer_frame(s,
+            new_value & (IS_BIT_SET(s->SPI_CR1, SPI_CR1_DFF_BIT) ?
+                         0xffff : 0xff));
+
+    stm32_spi_update_irq(s);
+}
+
+static void stm32_spi_SPI_I2SCFGR_write(Stm32Spi *s, uint32_t new_value)
+{
+    bool enable;
+
+    if (s->i2s_periph < 0) {
+        if (IS_BIT_SET(new_value, SPI_I2SCFGR_I2SMOD_BIT)) {
+            STM32_NOT_IMPL_REG(SPI_I2SCFGR_OFFSET, 4);
+        }
+        return;
+    }
+
+    s->SPI_I2SCFGR = new_value & 0x00000fbf;
+
+    enable = IS_BIT_SET(s->SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD_BIT) &&
+             IS_BIT_SET(s->SPI_I2SCFGR, SPI_I2SCFGR_I2SE_BIT);
+    if (enable && !s->i2s_running) {
+        stm32_spi_i2s_start(s);
+    } else if (!enable) {
+        stm32_spi_i2s_stop(s);
+    }
+
+    stm32_spi_update_irq(s);
+}
+
+static uint64_t stm32_spi_readw(Stm32Spi *s, hwaddr offset)
+{
+    switch (offset) {
+        case SPI_CR1_OFFSET:
+            return s->SPI_CR1;
+        case SPI_CR2_OFFSET:
+            return s->SPI_CR2;
+        case SPI_SR_OFFSET:
+            return stm32_spi_SPI_SR_read(s);
+        case SPI_DR_OFFSET:
+            return stm32_spi_SPI_DR_read(s);
+        case SPI_CRCPR_OFFSET:
+            return s->SPI_CRCPR;
+        case SPI_RXCRCR_OFFSET:
+        case SPI_TXCRCR_OFFSET:
+            return 0;
+        case SPI_I2SCFGR_OFFSET:
+            return s->SPI_I2SCFGR;
+        case SPI_I2SPR_OFFSET:
+            return s->SPI_I2SPR;
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32_spi_writew(Stm32Spi *s, hwaddr offset, uint64_t value)
+{
+    switch (offset) {
+        case SPI_CR1_OFFSET:
+            stm32_spi_SPI_CR1_write(s, value, false);
+            break;
+        case SPI_CR2_OFFSET:
+            stm32_spi_SPI_CR2_write(s, value, false);
+            break;
+        case SPI_SR_OFFSET:
+            stm32_spi_SPI_SR_write(s, value);
+            break;
+        case SPI_DR_OFFSET:
+            stm32_spi_SPI_DR_write(s, value);
+            break;
+        case SPI_CRCPR_OFFSET:
+            s->SPI_CRCPR = value & 0x0000ffff;
+            break;
+        case SPI_RXCRCR_OFFSET:
+        case SPI_TXCRCR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case SPI_I2SCFGR_OFFSET:
+            stm32_spi_SPI_I2SCFGR_write(s, value);
+            break;
+        case SPI_I2SPR_OFFSET:
+            s->SPI_I2SPR = value & 0x000003ff;
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+static uint64_t stm32_spi_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case BYTE_ACCESS_SIZE:
+            /* Byte accesses are used by DMA transfers with an 8 bit
+             * peripheral size. */
+            if (offset != SPI_SR_OFFSET && offset != SPI_DR_OFFSET) {
+                STM32_BAD_REG(offset, size);
+                value = 0;
+                break;
+            }
+            value = stm32_spi_readw(s, offset) & 0xff;
+            break;
+        case HALFWORD_ACCESS_SIZE:
+            if (offset & 2) {
+                value = 0;
+                break;
+            }
+            value = stm32_spi_readw(s, offset) & 0xffff;
+            break;
+        case WORD_ACCESS_SIZE:
+            value = stm32_spi_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_spi_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_spi_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Spi *s = (Stm32Spi *)opaque;
+
+    trace_stm32_spi_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case BYTE_ACCESS_SIZE:
+            if (offset != SPI_SR_OFFSET && offset != SPI_DR_OFFSET) {
+                STM32_BAD_REG(offset, size);
+                break;
+            }
+            stm32_spi_writew(s, offset, value & 0xff);
+            break;
+        case HALFWORD_ACCESS_SIZE:
+            if (offset & 2) {
+                break;
+            }
+            stm32_spi_writew(s, offset, value & 0xffff);
+            break;
+        case WORD_ACCESS_SIZE:
+            stm32_spi_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_spi_ops = {
+    .read = stm32_spi_read,
+    .write = stm32_spi_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_spi_reset(DeviceState *dev)
+{
+    Stm32Spi *s = FROM_SYSBUS(Stm32Spi, SYS_BUS_DEVICE(dev));
+
+    stm32_spi_i2s_stop(s);
+    s->SPI_I2SCFGR = 0;
+    s->SPI_SR = GET_BIT_MASK_ONE(SPI_SR_TXE_BIT);
+    s->sr_read_since_modf_set = false;
+    s->dr_read_since_ovr_set = false;
+    stm32_spi_SPI_CR1_write(s, 0x00000000, true);
+    stm32_spi_SPI_CR2_write(s, 0x00000000, true);
+    s->SPI_CRCPR = 0x00000007;
+    s->SPI_I2SPR = 0x00000002;
+    s->rx_data = 0;
+
+    stm32_spi_update_irq(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+SSIBus *stm32_spi_get_bus(Stm32Spi *s)
+{
+    return s->ssi;
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_spi_instance_init(Object *obj)
+{
+    Stm32Spi *s = FROM_SYSBUS(Stm32Spi, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32_dma", "stm32_dma",
+                             (Object **)&s->stm32_dma, NULL);
+}
+
+static int stm32_spi_init(SysBusDevice *dev)
+{
+    Stm32Spi *s = FROM_SYSBUS(Stm32Spi, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_spi_ops, s,
+                          "spi", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out(&dev->qdev, s->dma_req, ARRAY_LENGTH(s->dma_req));
+
+    s->ssi = ssi_create_bus(&dev->qdev, "ssi");
+
+    if (s->i2s_periph >= 0) {
+        stm32_rcc_periph_clk_init(&s->i2s_clk, s->stm32_rcc, s->i2s_periph,
+                                  dev, NULL);
+        AUD_register_card("stm32_i2s", &s->card);
+        s->i2s_timer = qemu_new_timer_ns(vm_clock,
+                                         stm32_spi_i2s_timer_expire, s);
+    }
+
+    return 0;
+}
+
+static Property stm32_spi_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Spi, periph, -1),
+    DEFINE_PROP_UINT32("dma_rx_channel", Stm32Spi, dma_rx_channel, 0),
+    DEFINE_PROP_UINT32("dma_tx_channel", Stm32Spi, dma_tx_channel, 0),
+    DEFINE_PROP_INT32("i2s_periph", Stm32Spi, i2s_periph, -1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_spi_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_spi_init;
+    dc->reset = stm32_spi_reset;
+    dc->props = stm32_spi_properties;
+}
+
+static TypeInfo stm32_spi_info = {
+    .name  = "stm32_spi",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Spi),
+    .instance_init = stm32_spi_instance_init,
+    .class_init = stm32_spi_class_init
+};
+
+static void stm32_spi_register_types(void)
+{
+    type_register_static(&stm32_spi_info);
+}
+
+type_init(stm32_spi_register_types)
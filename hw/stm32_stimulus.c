@@ -0,0 +1,636 @@
+/*
+ * STM32 Microcontroller stimulus player
+ *
+ * Replays input pin and analog waveforms captured on a real board, from
+ * the file given by the "file" property.  The file is mapped into memory
+ * and read as the replay goes, so captures of any length can be played.
+ * Times are counted from the last system reset.  A single vm_clock timer
+ * is armed for the next change; when it expires, every change that is due
+ * is made in one go, the pins of a port that change at the same time in a
+ * single stm32_gpio_set_inputs_at call.
+ *
+ * The file is either a VCD (value change dump) file, recognised by its
+ * first character being '$', or a series of 16 byte records, little
+ * endian, in time order:
+ *
+ *   offset  size  field
+ *        0     8  time of the change, in ns
+ *        8     1  port (0 = GPIOA, 1 = GPIOB...) or ADC (0 = ADC1...)
+ *        9     1  ignored
+ *       10     2  mask of the pins to change, or ADC channel
+ *       12     2  pin values, or 12-bit sample
+ *       14     1  kind (0 = pins, 1 = ADC channel)
+ *       15     1  reserved, must be zero
+ *
+ * which is the record of the GPIO pin bus with a kind field, so that a pin
+ * bus capture can be replayed as it is.
+ *
+ * In a VCD file, the variables named PA0 to PG15 are pins, GPIOA to GPIOG
+ * are ports (vectors of up to 16 bits) and ADCn_INm is channel m of ADCn.
+ * Vector values are taken as they are, and real values are volts, scaled
+ * by the "vref_mv" property.  Other variables, and x and z values, are
+ * ignored.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_STIMULUS
+
+#ifdef DEBUG_STM32_STIMULUS
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_STIMULUS: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define STIMULUS_RECORD_SIZE 16
+
+#define STIMULUS_KIND_PINS 0
+#define STIMULUS_KIND_ADC 1
+
+/* Longest VCD identifier and value that are recognised */
+#define STIMULUS_MAX_TOKEN 64
+
+typedef enum {
+    STIMULUS_PIN,
+    STIMULUS_PORT,
+    STIMULUS_ADC_CHANNEL
+} Stm32StimulusKind;
+
+/* A VCD variable that is played */
+typedef struct {
+    Stm32StimulusKind kind;
+    /* GPIO or ADC index */
+    unsigned index;
+    /* Pin or channel */
+    unsigned bit;
+} Stm32StimulusSignal;
+
+typedef struct Stm32Stimulus {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    char *path;
+    /* Arrays of Stm32Gpio and Stm32Adc pointers (NULL for the ADCs that
+     * the part does not have) */
+    void *stm32_gpio_prop;
+    uint32_t gpio_count;
+    void *stm32_adc_prop;
+    uint32_t adc_count;
+    uint32_t vref_mv;
+
+    /* Private */
+    GMappedFile *file;
+    const char *data;
+    size_t len;
+
+    /* Where the changes start, and the next one to make */
+    bool vcd;
+    size_t start, pos;
+    bool done;
+
+    /* VCD time units to ns: multiplied by scale_mul, divided by
+     * scale_div */
+    uint64_t scale_mul;
+    uint32_t scale_div;
+    /* Identifier code to Stm32StimulusSignal */
+    GHashTable *signals;
+
+    /* vm_clock time of the reset, and time of the next changes from it */
+    int64_t base_ns;
+    int64_t next_ns;
+
+    /* Pin changes gathered for each port */
+    uint16_t *mask, *value;
+
+    QEMUTimer *timer;
+} Stm32Stimulus;
+
+
+
+/* CHANGES */
+
+static void stm32_stimulus_set_pins(Stm32Stimulus *s, unsigned port,
+                                    uint16_t mask, uint16_t value)
+{
+    if (port >= s->gpio_count) {
+        return;
+    }
+    s->mask[port] |= mask;
+    s->value[port] = (s->value[port] & ~mask) | (value & mask);
+}
+
+static void stm32_stimulus_set_adc(Stm32Stimulus *s, unsigned index,
+                                   unsigned channel, uint32_t value)
+{
+    Stm32Adc **stm32_adc = (Stm32Adc **)s->stm32_adc_prop;
+
+    if (index >= s->adc_count || !stm32_adc[index] ||
+        channel >= STM32_ADC_CHANNEL_COUNT) {
+        return;
+    }
+    stm32_adc_set_input(stm32_adc[index], channel, MIN(value, 0xfff));
+}
+
+/* Makes the pin changes gathered for time. */
+static void stm32_stimulus_flush(Stm32Stimulus *s, int64_t time)
+{
+    Stm32Gpio **stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
+    unsigned port;
+
+    for (port = 0; port < s->gpio_count; port++) {
+        if (s->mask[port]) {
+            stm32_gpio_set_inputs_at(stm32_gpio[port], s->mask[port],
+                                     s->value[port], time);
+            s->mask[port] = 0;
+        }
+    }
+}
+
+
+
+/* BINARY RECORDS */
+
+static int64_t stm32_stimulus_record_time(Stm32Stimulus *s)
+{
+    return ldq_le_p(s->data + s->pos);
+}
+
+/* Takes the records of the current time. */
+static void stm32_stimulus_records(Stm32Stimulus *s)
+{
+    const uint8_t *p;
+
+    while (s->pos + STIMULUS_RECORD_SIZE <= s->len &&
+           stm32_stimulus_record_time(s) <= s->next_ns) {
+        p = (const uint8_t *)s->data + s->pos;
+        if (p[14] == STIMULUS_KIND_ADC) {
+            stm32_stimulus_set_adc(s, p[8], lduw_le_p(p + 10),
+                                   lduw_le_p(p + 12));
+        } else {
+            stm32_stimulus_set_pins(s, p[8], lduw_le_p(p + 10),
+                                    lduw_le_p(p + 12));
+        }
+        s->pos += STIMULUS_RECORD_SIZE;
+    }
+
+    if (s->pos + STIMULUS_RECORD_SIZE <= s->len) {
+        s->next_ns = stm32_stimulus_record_time(s);
+    } else {
+        s->done = true;
+    }
+}
+
+
+
+/* VCD */
+
+/* Gets the next token, returning false at the end of the file. */
+static bool stm32_stimulus_token(Stm32Stimulus *s, const char **tok,
+                                 size_t *len)
+{
+    size_t start;
+
+    while (s->pos < s->len && g_ascii_isspace(s->data[s->pos])) {
+        s->pos++;
+    }
+    if (s->pos == s->len) {
+        return false;
+    }
+    start = s->pos;
+    while (s->pos < s->len && !g_ascii_isspace(s->data[s->pos])) {
+        s->pos++;
+    }
+    *tok = s->data + start;
+    *len = s->pos - start;
+    return true;
+}
+
+static bool stm32_stimulus_token_is(const char *tok, size_t len,
+                                    const char *word)
+{
+    return len == strlen(word) && memcmp(tok, word, len) == 0;
+}
+
+/* Copies a token into buf as a string, returning false if it does not
+ * fit. */
+static bool stm32_stimulus_token_copy(const char *tok, size_t len, char *buf)
+{
+    if (len >= STIMULUS_MAX_TOKEN) {
+        return false;
+    }
+    memcpy(buf, tok, len);
+    buf[len] = '\0';
+    return true;
+}
+
+static void stm32_stimulus_skip_to_end(Stm32Stimulus *s)
+{
+    const char *tok;
+    size_t len;
+
+    while (stm32_stimulus_token(s, &tok, &len) &&
+           !stm32_stimulus_token_is(tok, len, "$end")) {
+    }
+}
+
+/* Parses "1ns", "10 us", "100ps"... */
+static void stm32_stimulus_parse_timescale(Stm32Stimulus *s)
+{
+    char buf[STIMULUS_MAX_TOKEN] = "", *unit;
+    const char *tok;
+    size_t len, used;
+    uint64_t num;
+
+    while (stm32_stimulus_token(s, &tok, &len) &&
+           !stm32_stimulus_token_is(tok, len, "$end")) {
+        used = strlen(buf);
+        if (used + len < sizeof(buf)) {
+            memcpy(buf + used, tok, len);
+            buf[used + len] = '\0';
+        }
+    }
+
+    num = strtoull(buf, &unit, 10);
+    if (num == 0) {
+        num = 1;
+    }
+    s->scale_div = 1;
+    if (strcmp(unit, "s") == 0) {
+        s->scale_mul = num * 1000000000;
+    } else if (strcmp(unit, "ms") == 0) {
+        s->scale_mul = num * 1000000;
+    } else if (strcmp(unit, "us") == 0) {
+        s->scale_mul = num * 1000;
+    } else if (strcmp(unit, "ns") == 0) {
+        s->scale_mul = num;
+    } else if (strcmp(unit, "ps") == 0) {
+        s->scale_mul = num;
+        s->scale_div = 1000;
+    } else if (strcmp(unit, "fs") == 0) {
+        s->scale_mul = num;
+        s->scale_div = 1000000;
+    } else {
+        hw_error("stm32_stimulus: unknown timescale '%s' in %s", buf,
+                 s->path);
+    }
+}
+
+/* Finds what a variable reference names. */
+static bool stm32_stimulus_parse_name(const char *name,
+                                      Stm32StimulusSignal *sig)
+{
+    char *end;
+    unsigned long n;
+
+    if (g_ascii_strncasecmp(name, "GPIO", 4) == 0 &&
+        g_ascii_isalpha(name[4]) && name[5] == '\0') {
+        sig->kind = STIMULUS_PORT;
+        sig->index = g_ascii_toupper(name[4]) - 'A';
+        sig->bit = 0;
+        return true;
+    }
+    if (g_ascii_strncasecmp(name, "ADC", 3) == 0 &&
+        g_ascii_isdigit(name[3]) && name[3] != '0' &&
+        g_ascii_strncasecmp(name + 4, "_IN", 3) == 0 &&
+        g_ascii_isdigit(name[7])) {
+        n = strtoul(name + 7, &end, 10);
+        if (*end != '\0' || n >= STM32_ADC_CHANNEL_COUNT) {
+            return false;
+        }
+        sig->kind = STIMULUS_ADC_CHANNEL;
+        sig->index = name[3] - '1';
+        sig->bit = n;
+        return true;
+    }
+    if (g_ascii_toupper(name[0]) == 'P' && g_ascii_isalpha(name[1]) &&
+        g_ascii_isdigit(name[2])) {
+        n = strtoul(name + 2, &end, 10);
+        if (*end != '\0' || n >= STM32_GPIO_PIN_COUNT) {
+            return false;
+        }
+        sig->kind = STIMULUS_PIN;
+        sig->index = g_ascii_toupper(name[1]) - 'A';
+        sig->bit = n;
+        return true;
+    }
+    return false;
+}
+
+/* $var type size id reference [range] $end */
+static void stm32_stimulus_parse_var(Stm32Stimulus *s)
+{
+    char id[STIMULUS_MAX_TOKEN], name[STIMULUS_MAX_TOKEN];
+    Stm32StimulusSignal sig;
+    const char *tok;
+    size_t len;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (!stm32_stimulus_token(s, &tok, &len) ||
+            stm32_stimulus_token_is(tok, len, "$end")) {
+            return;
+        }
+        if (i == 2 && !stm32_stimulus_token_copy(tok, len, id)) {
+            id[0] = '\0';
+        }
+        if (i == 3 && !stm32_stimulus_token_copy(tok, len, name)) {
+            name[0] = '\0';
+        }
+    }
+    stm32_stimulus_skip_to_end(s);
+
+    if (id[0] && stm32_stimulus_parse_name(name, &sig)) {
+        DPRINTF("'%s' is %s\n", id, name);
+        g_hash_table_insert(s->signals, g_strdup(id),
+                            g_memdup(&sig, sizeof(sig)));
+    }
+}
+
+static void stm32_stimulus_parse_header(Stm32Stimulus *s)
+{
+    const char *tok;
+    size_t len;
+
+    s->scale_mul = 1;
+    s->scale_div = 1;
+
+    while (stm32_stimulus_token(s, &tok, &len)) {
+        if (stm32_stimulus_token_is(tok, len, "$timescale")) {
+            stm32_stimulus_parse_timescale(s);
+        } else if (stm32_stimulus_token_is(tok, len, "$var")) {
+            stm32_stimulus_parse_var(s);
+        } else if (stm32_stimulus_token_is(tok, len, "$enddefinitions")) {
+            stm32_stimulus_skip_to_end(s);
+            s->start = s->pos;
+            return;
+        } else if (tok[0] == '$') {
+            stm32_stimulus_skip_to_end(s);
+        }
+    }
+    hw_error("stm32_stimulus: no $enddefinitions in %s", s->path);
+}
+
+static void stm32_stimulus_vcd_change(Stm32Stimulus *s,
+                                      const Stm32StimulusSignal *sig,
+                                      uint32_t known, uint32_t value)
+{
+    switch (sig->kind) {
+        case STIMULUS_PIN:
+            if (IS_BIT_SET(known, 0)) {
+                stm32_stimulus_set_pins(s, sig->index, 1 << sig->bit,
+                                        (value & 1) << sig->bit);
+            }
+            break;
+        case STIMULUS_PORT:
+            stm32_stimulus_set_pins(s, sig->index, known, value);
+            break;
+        case STIMULUS_ADC_CHANNEL:
+            if (known) {
+                stm32_stimulus_set_adc(s, sig->index, sig->bit, value);
+            }
+            break;
+    }
+}
+
+static const Stm32StimulusSignal *stm32_stimulus_lookup(Stm32Stimulus *s,
+                                                        const char *tok,
+                                                        size_t len)
+{
+    char id[STIMULUS_MAX_TOKEN];
+
+    if (!stm32_stimulus_token_copy(tok, len, id)) {
+        return NULL;
+    }
+    return g_hash_table_lookup(s->signals, id);
+}
+
+/* Takes the changes up to the next time stamp. */
+static void stm32_stimulus_vcd_block(Stm32Stimulus *s)
+{
+    char buf[STIMULUS_MAX_TOKEN];
+    const Stm32StimulusSignal *sig;
+    const char *tok, *id;
+    size_t len, id_len;
+    uint32_t known, value;
+    uint64_t t;
+    size_t i;
+
+    while (stm32_stimulus_token(s, &tok, &len)) {
+        switch (tok[0]) {
+            case '#':
+                t = 0;
+                if (stm32_stimulus_token_copy(tok + 1, len - 1, buf)) {
+                    t = strtoull(buf, NULL, 10);
+                }
+                s->next_ns = s->scale_div == 1 ? t * s->scale_mul :
+                             muldiv64(t, s->scale_mul, s->scale_div);
+                return;
+            case '$':
+                /* $dumpvars, $dumpall... only hold value changes */
+                if (stm32_stimulus_token_is(tok, len, "$comment")) {
+                    stm32_stimulus_skip_to_end(s);
+                }
+                break;
+            case '0':
+            case '1':
+                sig = stm32_stimulus_lookup(s, tok + 1, len - 1);
+                if (sig) {
+                    stm32_stimulus_vcd_change(s, sig, 1, tok[0] - '0');
+                }
+                break;
+            case 'b':
+            case 'B':
+            case 'r':
+            case 'R':
+                if (!stm32_stimulus_token(s, &id, &id_len)) {
+                    break;
+                }
+                sig = stm32_stimulus_lookup(s, id, id_len);
+                if (!sig) {
+                    break;
+                }
+                if (tok[0] == 'r' || tok[0] == 'R') {
+                    if (!stm32_stimulus_token_copy(tok + 1, len - 1, buf)) {
+                        break;
+                    }
+                    value = MAX(strtod(buf, NULL), 0) * 4095000 /
+                            s->vref_mv + 0.5;
+                    stm32_stimulus_vcd_change(s, sig, 1, value);
+                    break;
+                }
+                /* Shorter vectors are zero extended. */
+                known = (tok[1] == '0' || tok[1] == '1') ? UINT32_MAX : 0;
+                value = 0;
+                for (i = 1; i < len; i++) {
+                    known <<= 1;
+                    value <<= 1;
+                    if (tok[i] == '0' || tok[i] == '1') {
+                        known |= 1;
+                        value |= tok[i] - '0';
+                    }
+                }
+                stm32_stimulus_vcd_change(s, sig, known & 0xffff, value);
+                break;
+            default:
+                /* x and z */
+                break;
+        }
+    }
+    s->done = true;
+}
+
+
+
+/* REPLAY */
+
+/* Makes the changes that are due, and arms the timer for the next ones. */
+static void stm32_stimulus_run(Stm32Stimulus *s)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t time;
+
+    while (!s->done && s->base_ns + s->next_ns <= now) {
+        time = s->base_ns + s->next_ns;
+        if (s->vcd) {
+            stm32_stimulus_vcd_block(s);
+        } else {
+            stm32_stimulus_records(s);
+        }
+        stm32_stimulus_flush(s, time);
+    }
+
+    if (!s->done) {
+        qemu_mod_timer(s->timer, s->base_ns + s->next_ns);
+    }
+}
+
+static void stm32_stimulus_timer_expire(void *opaque)
+{
+    stm32_stimulus_run((Stm32Stimulus *)opaque);
+}
+
+static void stm32_stimulus_reset(DeviceState *dev)
+{
+    Stm32Stimulus *s = FROM_SYSBUS(Stm32Stimulus, SYS_BUS_DEVICE(dev));
+
+    if (!s->file) {
+        return;
+    }
+
+    s->pos = s->start;
+    s->base_ns = qemu_get_clock_ns(vm_clock);
+    s->done = false;
+    memset(s->mask, 0, s->gpio_count * sizeof(uint16_t));
+    if (s->vcd) {
+        /* The initial values come before the first time stamp. */
+        s->next_ns = 0;
+    } else if (s->pos + STIMULUS_RECORD_SIZE <= s->len) {
+        s->next_ns = stm32_stimulus_record_time(s);
+    } else {
+        s->done = true;
+        return;
+    }
+
+    /* The other devices may not have been reset yet, so nothing is changed
+     * from here. */
+    qemu_mod_timer(s->timer, s->base_ns + s->next_ns);
+}
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_stimulus_init(SysBusDevice *dev)
+{
+    Stm32Stimulus *s = FROM_SYSBUS(Stm32Stimulus, dev);
+    GError *err = NULL;
+    size_t i;
+
+    if (!s->path) {
+        return 0;
+    }
+    if (s->vref_mv == 0) {
+        hw_error("stm32_stimulus: vref_mv must not be 0");
+    }
+
+    s->file = g_mapped_file_new(s->path, FALSE, &err);
+    if (!s->file) {
+        hw_error("stm32_stimulus: cannot map %s: %s", s->path, err->message);
+    }
+    s->data = g_mapped_file_get_contents(s->file);
+    s->len = g_mapped_file_get_length(s->file);
+
+    s->mask = g_new0(uint16_t, s->gpio_count);
+    s->value = g_new0(uint16_t, s->gpio_count);
+    s->signals = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       g_free);
+
+    for (i = 0; i < s->len && g_ascii_isspace(s->data[i]); i++) {
+    }
+    s->vcd = i < s->len && s->data[i] == '$';
+    if (s->vcd) {
+        stm32_stimulus_parse_header(s);
+    } else {
+        s->start = 0;
+    }
+
+    s->timer = qemu_new_timer_ns(vm_clock, stm32_stimulus_timer_expire, s);
+
+    return 0;
+}
+
+static Property stm32_stimulus_properties[] = {
+    DEFINE_PROP_STRING("file", Stm32Stimulus, path),
+    DEFINE_PROP_PTR("stm32_gpio", Stm32Stimulus, stm32_gpio_prop),
+    DEFINE_PROP_UINT32("gpio_count", Stm32Stimulus, gpio_count, 0),
+    DEFINE_PROP_PTR("stm32_adc", Stm32Stimulus, stm32_adc_prop),
+    DEFINE_PROP_UINT32("adc_count", Stm32Stimulus, adc_count, 0),
+    DEFINE_PROP_UINT32("vref_mv", Stm32Stimulus, vref_mv, 3300),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_stimulus_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_stimulus_init;
+    dc->reset = stm32_stimulus_reset;
+    dc->props = stm32_stimulus_properties;
+}
+
+static TypeInfo stm32_stimulus_info = {
+    .name  = "stm32_stimulus",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Stimulus),
+    .class_init = stm32_stimulus_class_init
+};
+
+static void stm32_stimulus_register_types(void)
+{
+    type_register_static(&stm32_stimulus_info);
+}
+
+type_init(stm32_stimulus_register_types)
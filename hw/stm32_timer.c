@@ -0,0 +1,1309 @@
+/*
+ * STM32 Microcontroller general purpose and advanced timers
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The counter is not ticked.  Its value at a point in time is computed from
+ * vm_clock and the timer's input clock frequency whenever software looks at
+ * it, and a single QEMUTimer is armed for the next update or compare event
+ * that has its interrupt enabled.  The time base is restarted whenever the
+ * prescaler or the input clock changes, so that no drift builds up.
+ *
+ * Only the internal clock is supported (no slave modes or external clock),
+ * and the DMA requests are not modelled.  The trigger outputs that other
+ * peripherals (the ADCs) use are GPIO outputs which are pulsed on the update
+ * and compare events.  The OCxREF master modes are approximated by pulsing
+ * TRGO on the compare events of the channel.
+ *
+ * Input capture channels follow GPIO input pins (see
+ * stm32_timer_connect_input) and latch the counter as it was at the time
+ * of the edge, without the input filter.  The output pins are not driven:
+ * the PWM modes are reported as the period and pulse width of the signal
+ * whenever these change (trace events and the STM32_TIMER_PWM QMP event),
+ * so that the edges cost nothing.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_TIMER
+
+#ifdef DEBUG_STM32_TIMER
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_TIMER: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define STM32_TIMER_MAX_CHANNELS 4
+
+#define TIMx_CR1_OFFSET 0x00
+#define TIMx_CR1_CEN_BIT 0
+#define TIMx_CR1_UDIS_BIT 1
+#define TIMx_CR1_URS_BIT 2
+#define TIMx_CR1_OPM_BIT 3
+#define TIMx_CR1_DIR_BIT 4
+#define TIMx_CR1_CMS_START 5
+#define TIMx_CR1_CMS_MASK 0x00000060
+#define TIMx_CR1_ARPE_BIT 7
+
+#define TIMx_CR2_OFFSET 0x04
+#define TIMx_CR2_MMS_START 4
+#define TIMx_CR2_MMS_MASK 0x00000070
+#define TIMx_CR2_MMS_RESET 0
+#define TIMx_CR2_MMS_ENABLE 1
+#define TIMx_CR2_MMS_UPDATE 2
+#define TIMx_CR2_MMS_COMPARE_PULSE 3
+#define TIMx_CR2_MMS_OC1REF 4
+
+#define TIMx_SMCR_OFFSET 0x08
+#define TIMx_SMCR_SMS_MASK 0x00000007
+
+#define TIMx_DIER_OFFSET 0x0c
+#define TIMx_DIER_UIE_BIT 0
+#define TIMx_DIER_CC1IE_BIT 1
+
+#define TIMx_SR_OFFSET 0x10
+#define TIMx_SR_UIF_BIT 0
+#define TIMx_SR_CC1IF_BIT 1
+#define TIMx_SR_COMIF_BIT 5
+#define TIMx_SR_TIF_BIT 6
+#define TIMx_SR_BIF_BIT 7
+#define TIMx_SR_CC1OF_BIT 9
+
+#define TIMx_EGR_OFFSET 0x14
+#define TIMx_EGR_UG_BIT 0
+
+#define TIMx_CCMR1_OFFSET 0x18
+#define TIMx_CCMR2_OFFSET 0x1c
+/* Each channel has 8 bits in CCMR1 (channels 1 and 2) or CCMR2 */
+#define TIMx_CCMR_CCS_MASK 0x03
+#define TIMx_CCMR_CCS_TI 1
+#define TIMx_CCMR_CCS_TI_PAIR 2
+#define TIMx_CCMR_ICPSC_START 2
+#define TIMx_CCMR_ICPSC_MASK 0x0c
+#define TIMx_CCMR_OCPE_BIT 3
+#define TIMx_CCMR_OCM_START 4
+#define TIMx_CCMR_OCM_MASK 0x70
+#define TIMx_CCMR_OCM_PWM1 6
+#define TIMx_CCMR_OCM_PWM2 7
+
+#define TIMx_CCER_OFFSET 0x20
+/* Each channel has 4 bits in CCER */
+#define TIMx_CCER_CC1E_BIT 0
+#define TIMx_CCER_CC1P_BIT 1
+#define TIMx_CNT_OFFSET 0x24
+#define TIMx_PSC_OFFSET 0x28
+#define TIMx_ARR_OFFSET 0x2c
+#define TIMx_RCR_OFFSET 0x30
+#define TIMx_CCR1_OFFSET 0x34
+#define TIMx_CCR4_OFFSET 0x40
+#define TIMx_BDTR_OFFSET 0x44
+#define TIMx_BDTR_MOE_BIT 15
+#define TIMx_DCR_OFFSET 0x48
+#define TIMx_DMAR_OFFSET 0x4c
+
+/* Interrupt flags that go to each of the four lines of an advanced timer
+ * (in NVIC order).  Other timers OR them onto one line. */
+#define TIMx_SR_BRK_IRQ_MASK (1 << TIMx_SR_BIF_BIT)
+#define TIMx_SR_UP_IRQ_MASK (1 << TIMx_SR_UIF_BIT)
+#define TIMx_SR_TRG_COM_IRQ_MASK ((1 << TIMx_SR_TIF_BIT) | \
+                                  (1 << TIMx_SR_COMIF_BIT))
+#define TIMx_SR_CC_IRQ_MASK 0x0000001e
+
+#define TIMER_IRQ_COUNT 4
+
+/* The counter is 16 bits wide. */
+#define TIMER_CNT_MAX 0xffff
+
+/* The GPIO input pin that TIn follows. */
+typedef struct {
+    Notifier notifier;
+    Stm32Timer *timer;
+    int n;
+    unsigned pin;
+} Stm32TimerInput;
+
+struct Stm32Timer {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    /* Number of capture/compare channels (0 for the basic timers) */
+    uint32_t channel_count;
+    /* Advanced control timers (TIM1 and TIM8) have a repetition counter
+     * and a break and dead-time register. */
+    uint32_t advanced;
+    /* Number of interrupt lines: 4 for the advanced timers (break, update,
+     * trigger/commutation, capture/compare), 1 for the others. */
+    uint32_t irq_count;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    /* Register Values */
+    uint32_t
+        TIMx_CR1,
+        TIMx_CR2,
+        TIMx_SMCR,
+        TIMx_DIER,
+        TIMx_SR,
+        TIMx_CCMR[2],
+        TIMx_CCER,
+        TIMx_PSC,
+        TIMx_ARR,
+        TIMx_RCR,
+        TIMx_CCR[STM32_TIMER_MAX_CHANNELS],
+        TIMx_BDTR,
+        TIMx_DCR;
+
+    /* Active (shadow) copies of the preloaded registers.  They are loaded
+     * from the registers above on update events. */
+    uint32_t psc, arr, ccr[STM32_TIMER_MAX_CHANNELS];
+    uint32_t rep_cnt;
+
+    /* Counter value and counting direction as of the last sync */
+    uint32_t cnt;
+    bool count_down;
+
+    /* Input clock frequency in Hz (0 if the clock is off) */
+    uint32_t freq;
+
+    /* Time base: ticks_done counter ticks have been accounted for since
+     * base_ns. */
+    int64_t base_ns;
+    uint64_t ticks_done;
+
+    QEMUTimer *timer;
+
+    Stm32TimerInput input[STM32_TIMER_MAX_CHANNELS];
+    /* Active edges counted towards the ICxPSC prescaler of each channel */
+    uint8_t ic_events[STM32_TIMER_MAX_CHANNELS];
+
+    /* PWM output of each channel as last reported: the period and the time
+     * the output is high in each period, in ns.  Both are 0 for channels
+     * that do not output a PWM signal. */
+    uint64_t pwm_period[STM32_TIMER_MAX_CHANNELS];
+    uint64_t pwm_pulse[STM32_TIMER_MAX_CHANNELS];
+
+    qemu_irq irq[TIMER_IRQ_COUNT];
+    qemu_irq trigger[STM32_TIMER_TRIGGER_COUNT];
+};
+
+
+
+
+/* COUNTER */
+
+static bool stm32_timer_center_aligned(Stm32Timer *s)
+{
+    return (s->TIMx_CR1 & TIMx_CR1_CMS_MASK) != 0;
+}
+
+/* Whether the counter advances at all.  The counter is blocked while the
+ * auto-reload value is zero. */
+static bool stm32_timer_counting(Stm32Timer *s)
+{
+    return IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_CEN_BIT) &&
+           (s->freq != 0) && (s->arr != 0);
+}
+
+/* The 8 bits of CCMR1 or CCMR2 that configure channel n. */
+static uint32_t stm32_timer_ccmr(Stm32Timer *s, int n)
+{
+    return (s->TIMx_CCMR[n / 2] >> ((n % 2) * 8)) & 0xff;
+}
+
+/* Whether channel n compares (as opposed to capturing). */
+static bool stm32_timer_output_compare(Stm32Timer *s, int n)
+{
+    return (stm32_timer_ccmr(s, n) & TIMx_CCMR_CCS_MASK) == 0;
+}
+
+static bool stm32_timer_ccr_preload(Stm32Timer *s, int n)
+{
+    return IS_BIT_SET(stm32_timer_ccmr(s, n), TIMx_CCMR_OCPE_BIT);
+}
+
+/* The TIx input (numbered from 0) that capture channel n takes, or -1. */
+static int stm32_timer_capture_input(Stm32Timer *s, int n)
+{
+    switch (stm32_timer_ccmr(s, n) & TIMx_CCMR_CCS_MASK) {
+        case TIMx_CCMR_CCS_TI:
+            return n;
+        case TIMx_CCMR_CCS_TI_PAIR:
+            /* TI2 for channel 1, TI1 for channel 2, and so on. */
+            return n ^ 1;
+        default:
+            /* TRC needs the slave mode controller. */
+            return -1;
+    }
+}
+
+static uint32_t stm32_timer_mms(Stm32Timer *s)
+{
+    return (s->TIMx_CR2 & TIMx_CR2_MMS_MASK) >> TIMx_CR2_MMS_START;
+}
+
+/* Whether the compare events of channel n pulse its trigger output.  Only
+ * channels with their output enabled are used to trigger the ADCs. */
+static bool stm32_timer_cc_triggers(Stm32Timer *s, int n)
+{
+    return s->trigger[STM32_TIMER_CC_TRIGGER(n)] &&
+           IS_BIT_SET(s->TIMx_CCER, (TIMx_CCER_CC1E_BIT + 4 * n)) &&
+           stm32_timer_output_compare(s, n);
+}
+
+/* Whether the compare events of channel n pulse TRGO. */
+static bool stm32_timer_cc_triggers_trgo(Stm32Timer *s, int n)
+{
+    uint32_t mms = stm32_timer_mms(s);
+
+    return s->trigger[STM32_TIMER_TRGO] &&
+           ((mms == TIMx_CR2_MMS_COMPARE_PULSE && n == 0) ||
+            mms == TIMx_CR2_MMS_OC1REF + n);
+}
+
+/* Pulses TRGO for an event if the master mode selects it. */
+static void stm32_timer_trgo_event(Stm32Timer *s, uint32_t mms)
+{
+    if (stm32_timer_mms(s) == mms) {
+        qemu_irq_pulse(s->trigger[STM32_TIMER_TRGO]);
+    }
+}
+
+/* Handles a compare match on channel n. */
+static void stm32_timer_cc_event(Stm32Timer *s, int n)
+{
+    SET_BIT(s->TIMx_SR, (TIMx_SR_CC1IF_BIT + n));
+    if (stm32_timer_cc_triggers(s, n)) {
+        qemu_irq_pulse(s->trigger[STM32_TIMER_CC_TRIGGER(n)]);
+    }
+    if (stm32_timer_cc_triggers_trgo(s, n)) {
+        qemu_irq_pulse(s->trigger[STM32_TIMER_TRGO]);
+    }
+}
+
+/* Time at which counter tick number ticks (counted from base_ns) happens,
+ * rounded up so that a sync at that time sees the tick. */
+static int64_t stm32_timer_tick_ns(Stm32Timer *s, uint64_t ticks)
+{
+    return s->base_ns +
+           muldiv64(ticks * (s->psc + 1), get_ticks_per_sec(), s->freq) + 1;
+}
+
+static void stm32_timer_rebase(Stm32Timer *s, int64_t now)
+{
+    s->base_ns = now;
+    s->ticks_done = 0;
+}
+
+/* Number of ticks from the current counter value to the end of the current
+ * counting phase.  For edge-aligned modes this is the tick that wraps the
+ * counter, for center-aligned modes the tick that reaches ARR or 0.
+ * *uev is set if reaching it is an overflow or underflow event.
+ */
+static uint64_t stm32_timer_to_boundary(Stm32Timer *s, bool *uev)
+{
+    *uev = true;
+    if (stm32_timer_center_aligned(s)) {
+        if (s->count_down) {
+            return s->cnt;
+        } else if (s->cnt > s->arr) {
+            /* Counts up to the end of the counter and wraps to 0. */
+            *uev = false;
+            return TIMER_CNT_MAX + 1 - s->cnt;
+        } else {
+            return s->arr - s->cnt;
+        }
+    } else if (s->count_down) {
+        return (uint64_t)s->cnt + 1;
+    } else if (s->cnt > s->arr) {
+        *uev = false;
+        return TIMER_CNT_MAX + 1 - s->cnt;
+    } else {
+        return (uint64_t)s->arr - s->cnt + 1;
+    }
+}
+
+/* Sets the compare flags of the channels whose CCR value is passed while
+ * the counter moves by ticks steps within the current phase.  boundary is
+ * set if those steps end on the phase boundary. */
+static void stm32_timer_compare(Stm32Timer *s, uint64_t ticks, bool boundary)
+{
+    uint32_t cms = (s->TIMx_CR1 & TIMx_CR1_CMS_MASK) >> TIMx_CR1_CMS_START;
+    uint64_t lo, hi;
+    bool wrap_to_zero = false, reload = false;
+    int n;
+
+    if (ticks == 0) {
+        return;
+    }
+
+    if (s->count_down) {
+        /* Visits cnt - 1 down to cnt - ticks ... */
+        if (boundary && !stm32_timer_center_aligned(s)) {
+            /* ... the last of which wraps to ARR. */
+            lo = 0;
+            reload = true;
+        } else {
+            lo = s->cnt - ticks;
+        }
+        hi = s->cnt - 1;
+        if (cms == 2) {
+            /* Center-aligned mode 2 only compares while counting up. */
+            return;
+        }
+    } else {
+        /* Visits cnt + 1 up to cnt + ticks, the last of which may wrap to
+         * 0 at the end of an edge-aligned phase. */
+        lo = (uint64_t)s->cnt + 1;
+        hi = (uint64_t)s->cnt + ticks;
+        if (boundary && (hi > s->arr || !stm32_timer_center_aligned(s))) {
+            hi--;
+            wrap_to_zero = true;
+        }
+        if (cms == 1) {
+            /* Center-aligned mode 1 only compares while counting down. */
+            return;
+        }
+    }
+
+    for (n = 0; n < s->channel_count; n++) {
+        if (!stm32_timer_output_compare(s, n)) {
+            continue;
+        }
+        if ((s->ccr[n] >= lo && s->ccr[n] <= hi) ||
+            (wrap_to_zero && s->ccr[n] == 0) ||
+            (reload && s->ccr[n] == s->arr)) {
+            stm32_timer_cc_event(s, n);
+        }
+    }
+}
+
+/* Loads the preloaded registers into their active copies. */
+static void stm32_timer_load_shadows(Stm32Timer *s)
+{
+    int n;
+
+    s->arr = s->TIMx_ARR;
+    for (n = 0; n < s->channel_count; n++) {
+        s->ccr[n] = s->TIMx_CCR[n];
+    }
+    s->rep_cnt = s->advanced ? (s->TIMx_RCR & 0xff) : 0;
+}
+
+/* Whether another update event would leave all of the active registers
+ * unchanged. */
+static bool stm32_timer_shadows_stable(Stm32Timer *s)
+{
+    int n;
+
+    if (IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_UDIS_BIT)) {
+        return true;
+    }
+    if (s->psc != s->TIMx_PSC || s->arr != s->TIMx_ARR) {
+        return false;
+    }
+    for (n = 0; n < s->channel_count; n++) {
+        if (s->ccr[n] != s->TIMx_CCR[n]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Handles an overflow or underflow.  Returns true if the counter has to
+ * stop counting with the current time base (one pulse mode or a new
+ * prescaler value). */
+static bool stm32_timer_overflow(Stm32Timer *s)
+{
+    if (IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_UDIS_BIT)) {
+        return false;
+    }
+    if (s->rep_cnt > 0) {
+        s->rep_cnt--;
+        return false;
+    }
+
+    /* Update event */
+    stm32_timer_load_shadows(s);
+    SET_BIT(s->TIMx_SR, TIMx_SR_UIF_BIT);
+    stm32_timer_trgo_event(s, TIMx_CR2_MMS_UPDATE);
+
+    if (IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_OPM_BIT)) {
+        RESET_BIT(s->TIMx_CR1, TIMx_CR1_CEN_BIT);
+        return true;
+    }
+    return s->psc != s->TIMx_PSC;
+}
+
+/* Skips whole counter periods in one go.  Called on a phase boundary when
+ * the next update events would not change anything, so only the repetition
+ * counter and the update flag need attention; the compare flags are set by
+ * the period that is still simulated afterwards. */
+static uint64_t stm32_timer_skip_periods(Stm32Timer *s, uint64_t ticks)
+{
+    uint64_t period, periods, overflows, rep;
+    bool center = stm32_timer_center_aligned(s);
+
+    period = center ? 2 * (uint64_t)s->arr : (uint64_t)s->arr + 1;
+    if (IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_OPM_BIT) || (s->cnt > s->arr) ||
+        (ticks / period < 2)) {
+        return 0;
+    }
+
+    periods = ticks / period - 1;
+    overflows = periods * (center ? 2 : 1);
+    if (!IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_UDIS_BIT)) {
+        if (overflows <= s->rep_cnt) {
+            s->rep_cnt -= overflows;
+        } else {
+            rep = s->advanced ? (s->TIMx_RCR & 0xff) + 1 : 1;
+            s->rep_cnt = rep - 1 - ((overflows - s->rep_cnt - 1) % rep);
+            SET_BIT(s->TIMx_SR, TIMx_SR_UIF_BIT);
+            stm32_timer_trgo_event(s, TIMx_CR2_MMS_UPDATE);
+        }
+    }
+    return periods * period;
+}
+
+/* Advances the counter by up to ticks steps.  Returns the number of steps
+ * taken, which is less than ticks if the counter had to stop (see
+ * stm32_timer_overflow). */
+static uint64_t stm32_timer_count(Stm32Timer *s, uint64_t ticks)
+{
+    uint64_t done = 0, step, to_boundary;
+    bool uev, boundary;
+
+    while (done < ticks) {
+        to_boundary = stm32_timer_to_boundary(s, &uev);
+        boundary = (ticks - done >= to_boundary);
+        step = boundary ? to_boundary : ticks - done;
+
+        stm32_timer_compare(s, step, boundary);
+        done += step;
+
+        if (!boundary) {
+            s->cnt += s->count_down ? -(int64_t)step : (int64_t)step;
+            break;
+        }
+
+        /* End of the phase */
+        if (stm32_timer_center_aligned(s)) {
+            if (s->count_down) {
+                s->cnt = 0;
+                s->count_down = false;
+            } else if (uev) {
+                s->cnt = s->arr;
+                s->count_down = true;
+            } else {
+                s->cnt = 0;
+            }
+        } else {
+            s->cnt = s->count_down ? s->arr : 0;
+        }
+        if (uev && stm32_timer_overflow(s)) {
+            break;
+        }
+
+        if (stm32_timer_shadows_stable(s)) {
+            done += stm32_timer_skip_periods(s, ticks - done);
+        }
+    }
+
+    return done;
+}
+
+/* Brings the counter and the status flags up to date with time now, which
+ * may be a little behind vm_clock for a queued input edge.  Nothing happens
+ * if the time base was restarted after now. */
+static void stm32_timer_sync_to(Stm32Timer *s, int64_t now)
+{
+    uint64_t ticks, done;
+
+    if (now < s->base_ns) {
+        return;
+    }
+
+    for (;;) {
+        if (!stm32_timer_counting(s)) {
+            stm32_timer_rebase(s, now);
+            return;
+        }
+
+        ticks = muldiv64(now - s->base_ns, s->freq, get_ticks_per_sec()) /
+                (s->psc + 1);
+        if (ticks <= s->ticks_done) {
+            return;
+        }
+
+        done = stm32_timer_count(s, ticks - s->ticks_done);
+        s->ticks_done += done;
+        if (s->ticks_done < ticks && stm32_timer_counting(s)) {
+            /* The prescaler changed at the update event.  Restart the time
+             * base at that event and continue with the new value. */
+            s->base_ns = stm32_timer_tick_ns(s, s->ticks_done) - 1;
+            s->ticks_done = 0;
+            s->psc = s->TIMx_PSC;
+        }
+    }
+}
+
+/* Brings the counter and the status flags up to date with vm_clock. */
+static void stm32_timer_sync(Stm32Timer *s)
+{
+    stm32_timer_sync_to(s, qemu_get_clock_ns(vm_clock));
+}
+
+static void stm32_timer_update_irq(Stm32Timer *s)
+{
+    static const uint32_t line_mask[TIMER_IRQ_COUNT] = {
+        TIMx_SR_BRK_IRQ_MASK, TIMx_SR_UP_IRQ_MASK,
+        TIMx_SR_TRG_COM_IRQ_MASK, TIMx_SR_CC_IRQ_MASK
+    };
+    uint32_t pending = s->TIMx_SR & s->TIMx_DIER;
+    int i;
+
+    if (s->irq_count == 1) {
+        trace_stm32_timer_irq(s, 0, (pending & 0xff) != 0);
+        qemu_set_irq(s->irq[0], (pending & 0xff) != 0);
+        return;
+    }
+    for (i = 0; i < TIMER_IRQ_COUNT; i++) {
+        trace_stm32_timer_irq(s, i, (pending & line_mask[i]) != 0);
+        qemu_set_irq(s->irq[i], (pending & line_mask[i]) != 0);
+    }
+}
+
+/* Gets the length of a period of the PWM signal of channel n, and the
+ * part of it during which the output is high, in counter ticks.  Returns
+ * false if the channel does not output a PWM signal. */
+static bool stm32_timer_pwm_ticks(Stm32Timer *s, int n, uint64_t *period,
+                                  uint64_t *high)
+{
+    uint32_t ocm = (stm32_timer_ccmr(s, n) & TIMx_CCMR_OCM_MASK) >>
+                   TIMx_CCMR_OCM_START;
+    uint64_t active;
+
+    if (!stm32_timer_counting(s) || !stm32_timer_output_compare(s, n) ||
+        (ocm != TIMx_CCMR_OCM_PWM1 && ocm != TIMx_CCMR_OCM_PWM2) ||
+        !IS_BIT_SET(s->TIMx_CCER, (TIMx_CCER_CC1E_BIT + 4 * n)) ||
+        (s->advanced && !IS_BIT_SET(s->TIMx_BDTR, TIMx_BDTR_MOE_BIT))) {
+        return false;
+    }
+
+    /* In PWM mode 1, OCxREF is active while CNT < CCR when counting up,
+     * and while CNT <= CCR when counting down. */
+    if (stm32_timer_center_aligned(s)) {
+        *period = 2 * (uint64_t)s->arr;
+        active = MIN(2 * (uint64_t)s->ccr[n], *period);
+    } else if (s->count_down) {
+        *period = (uint64_t)s->arr + 1;
+        active = MIN((uint64_t)s->ccr[n] + 1, *period);
+    } else {
+        *period = (uint64_t)s->arr + 1;
+        active = MIN((uint64_t)s->ccr[n], *period);
+    }
+
+    /* PWM mode 2 and an active low polarity each invert the output. */
+    if ((ocm == TIMx_CCMR_OCM_PWM2) !=
+        IS_BIT_SET(s->TIMx_CCER, (TIMx_CCER_CC1P_BIT + 4 * n))) {
+        active = *period - active;
+    }
+    *high = active;
+    return true;
+}
+
+/* Sends a STM32_TIMER_PWM event (see QMP/qmp-events.txt). */
+static void stm32_timer_send_pwm_event(Stm32Timer *s)
+{
+    QList *channels = qlist_new();
+    QObject *data;
+    int n;
+
+    for (n = 0; n < s->channel_count; n++) {
+        qlist_append_obj(channels,
+            qobject_from_jsonf("{ 'channel': %d, 'period': %" PRId64 ", "
+                               "'pulse': %" PRId64 " }", n + 1,
+                               (int64_t)s->pwm_period[n],
+                               (int64_t)s->pwm_pulse[n]));
+    }
+    data = qobject_from_jsonf("{ 'timer': %s, 'time': %" PRId64 ", "
+                              "'channels': %p }",
+                              DEVICE(s)->id ? DEVICE(s)->id : "",
+                              qemu_get_clock_ns(vm_clock),
+                              QOBJECT(channels));
+    monitor_protocol_event(QEVENT_STM32_TIMER_PWM, data);
+    qobject_decref(data);
+}
+
+/* Reports the PWM outputs whose period or pulse width changed.  Called once
+ * the registers and the active copies are up to date. */
+static void stm32_timer_update_pwm(Stm32Timer *s)
+{
+    uint64_t period, high, period_ns, pulse_ns;
+    bool changed = false;
+    int n;
+
+    for (n = 0; n < s->channel_count; n++) {
+        if (stm32_timer_pwm_ticks(s, n, &period, &high)) {
+            period_ns = muldiv64(period * (s->psc + 1), get_ticks_per_sec(),
+                                 s->freq);
+            pulse_ns = muldiv64(high * (s->psc + 1), get_ticks_per_sec(),
+                                s->freq);
+        } else {
+            period_ns = 0;
+            pulse_ns = 0;
+        }
+        if (period_ns != s->pwm_period[n] || pulse_ns != s->pwm_pulse[n]) {
+            s->pwm_period[n] = period_ns;
+            s->pwm_pulse[n] = pulse_ns;
+            trace_stm32_timer_pwm(s, n, period_ns, pulse_ns);
+            changed = true;
+        }
+    }
+
+    if (changed && monitor_protocol_event_wanted(QEVENT_STM32_TIMER_PWM)) {
+        stm32_timer_send_pwm_event(s);
+    }
+}
+
+/* Whether a channel outputs a PWM signal, as last reported. */
+static bool stm32_timer_pwm_active(Stm32Timer *s)
+{
+    int n;
+
+    for (n = 0; n < s->channel_count; n++) {
+        if (s->pwm_period[n] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The status flags whose events have to be handled when they happen: the
+ * ones with their interrupt enabled and the ones driving a trigger
+ * output. */
+static uint32_t stm32_timer_wake_mask(Stm32Timer *s)
+{
+    uint32_t mask = s->TIMx_DIER & (TIMx_SR_UP_IRQ_MASK | TIMx_SR_CC_IRQ_MASK);
+    int n;
+
+    if (s->trigger[STM32_TIMER_TRGO] &&
+        stm32_timer_mms(s) == TIMx_CR2_MMS_UPDATE) {
+        SET_BIT(mask, TIMx_SR_UIF_BIT);
+    }
+    for (n = 0; n < s->channel_count; n++) {
+        if (stm32_timer_cc_triggers(s, n) ||
+            stm32_timer_cc_triggers_trgo(s, n)) {
+            SET_BIT(mask, (TIMx_SR_CC1IF_BIT + n));
+        }
+    }
+    /* A PWM signal changes at the update event that loads the new
+     * preloaded values, which has to be reported on time. */
+    if (stm32_timer_pwm_active(s) && !stm32_timer_shadows_stable(s)) {
+        SET_BIT(mask, TIMx_SR_UIF_BIT);
+    }
+    return mask;
+}
+
+/* Arms the timer for the next event whose interrupt is enabled or which
+ * drives a trigger output. */
+static void stm32_timer_schedule(Stm32Timer *s)
+{
+    uint32_t wake = stm32_timer_wake_mask(s);
+    uint64_t next, dist;
+    bool uev;
+    int n;
+
+    if (!stm32_timer_counting(s) || !wake) {
+        qemu_del_timer(s->timer);
+        return;
+    }
+
+    /* Wake up at the end of the phase at the latest, even if only a
+     * compare event is wanted - the next match is worked out again from
+     * there. */
+    next = stm32_timer_to_boundary(s, &uev);
+    for (n = 0; n < s->channel_count; n++) {
+        if (!IS_BIT_SET(wake, (TIMx_SR_CC1IF_BIT + n)) ||
+            !stm32_timer_output_compare(s, n)) {
+            continue;
+        }
+        if (s->count_down && s->ccr[n] < s->cnt) {
+            dist = s->cnt - s->ccr[n];
+        } else if (!s->count_down && s->ccr[n] > s->cnt) {
+            dist = s->ccr[n] - s->cnt;
+        } else {
+            continue;
+        }
+        next = MIN(next, dist);
+    }
+
+    qemu_mod_timer(s->timer,
+                   stm32_timer_tick_ns(s, s->ticks_done + MAX(next, 1)));
+}
+
+static void stm32_timer_expire(void *opaque)
+{
+    Stm32Timer *s = (Stm32Timer *)opaque;
+
+    stm32_timer_sync(s);
+    stm32_timer_update_irq(s);
+    stm32_timer_update_pwm(s);
+    stm32_timer_schedule(s);
+}
+
+/* Handles an active edge of the input of capture channel n, which
+ * happened at time. */
+static void stm32_timer_capture(Stm32Timer *s, int n, int64_t time)
+{
+    uint32_t icpsc = (stm32_timer_ccmr(s, n) & TIMx_CCMR_ICPSC_MASK) >>
+                     TIMx_CCMR_ICPSC_START;
+
+    /* ICxPSC captures once every 1, 2, 4 or 8 events. */
+    if (++s->ic_events[n] < (1 << icpsc)) {
+        return;
+    }
+    s->ic_events[n] = 0;
+
+    stm32_timer_sync_to(s, time);
+    if (IS_BIT_SET(s->TIMx_SR, (TIMx_SR_CC1IF_BIT + n))) {
+        SET_BIT(s->TIMx_SR, (TIMx_SR_CC1OF_BIT + n));
+    }
+    s->TIMx_CCR[n] = s->cnt;
+    SET_BIT(s->TIMx_SR, (TIMx_SR_CC1IF_BIT + n));
+    trace_stm32_timer_capture(s, n, s->cnt, time);
+}
+
+/* Follows the GPIO input pin of TIn. */
+static void stm32_timer_input_changed(Notifier *notifier, void *data)
+{
+    Stm32TimerInput *input = container_of(notifier, Stm32TimerInput,
+                                          notifier);
+    Stm32GpioBusEvent *event = (Stm32GpioBusEvent *)data;
+    Stm32Timer *s = input->timer;
+    bool level, captured = false;
+    int n;
+
+    if (!IS_BIT_SET(event->changed, input->pin) || s->freq == 0) {
+        return;
+    }
+    level = IS_BIT_SET(event->value, input->pin);
+
+    for (n = 0; n < s->channel_count; n++) {
+        /* CCxP selects the falling edge instead of the rising one. */
+        if (stm32_timer_capture_input(s, n) != input->n ||
+            !IS_BIT_SET(s->TIMx_CCER, (TIMx_CCER_CC1E_BIT + 4 * n)) ||
+            level == IS_BIT_SET(s->TIMx_CCER, (TIMx_CCER_CC1P_BIT + 4 * n))) {
+            continue;
+        }
+        stm32_timer_capture(s, n, event->time);
+        captured = true;
+    }
+
+    if (captured) {
+        stm32_timer_update_irq(s);
+        stm32_timer_schedule(s);
+    }
+}
+
+/* Handle a change in the input clock. */
+static void stm32_timer_clk_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Timer *s = (Stm32Timer *)opaque;
+
+    assert(n == 0);
+
+    stm32_timer_sync(s);
+    s->freq = s->clk.freq;
+    stm32_timer_rebase(s, qemu_get_clock_ns(vm_clock));
+    DPRINTF("%s clock is set to %lu Hz.\n", s->busdev.qdev.id,
+            (unsigned long)s->freq);
+    stm32_timer_update_pwm(s);
+    stm32_timer_schedule(s);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_timer_TIMx_CR1_write(Stm32Timer *s, uint32_t new_value,
+                                       bool init)
+{
+    bool was_counting = IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_CEN_BIT);
+
+    s->TIMx_CR1 = new_value & 0x000003ff;
+
+    /* DIR is read-only and follows the counter in the center-aligned
+     * modes. */
+    if (!stm32_timer_center_aligned(s)) {
+        s->count_down = IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_DIR_BIT);
+    }
+    if (!was_counting && IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_CEN_BIT)) {
+        DPRINTF("%s enabled\n", s->busdev.qdev.id);
+        stm32_timer_rebase(s, qemu_get_clock_ns(vm_clock));
+        stm32_timer_trgo_event(s, TIMx_CR2_MMS_ENABLE);
+    }
+}
+
+static uint32_t stm32_timer_TIMx_CR1_read(Stm32Timer *s)
+{
+    uint32_t value = s->TIMx_CR1;
+
+    if (stm32_timer_center_aligned(s)) {
+        CHANGE_BIT(value, TIMx_CR1_DIR_BIT, s->count_down);
+    }
+    return value;
+}
+
+static void stm32_timer_TIMx_SMCR_write(Stm32Timer *s, uint32_t new_value,
+                                        bool init)
+{
+    if (new_value & TIMx_SMCR_SMS_MASK) {
+        stm32_hw_warn("%s: slave modes are not supported",
+                      s->busdev.qdev.id);
+    }
+    s->TIMx_SMCR = new_value & 0x0000fff7;
+}
+
+/* Generates the events requested by writing EGR. */
+static void stm32_timer_TIMx_EGR_write(Stm32Timer *s, uint32_t new_value)
+{
+    uint32_t flags;
+
+    if (IS_BIT_SET(new_value, TIMx_EGR_UG_BIT)) {
+        if (!IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_UDIS_BIT)) {
+            s->psc = s->TIMx_PSC;
+            stm32_timer_load_shadows(s);
+            if (!IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_URS_BIT)) {
+                SET_BIT(s->TIMx_SR, TIMx_SR_UIF_BIT);
+            }
+        }
+
+        /* Restart the counter and the prescaler. */
+        if (stm32_timer_center_aligned(s)) {
+            s->cnt = 0;
+            s->count_down = false;
+        } else {
+            s->cnt = s->count_down ? s->arr : 0;
+        }
+        stm32_timer_rebase(s, qemu_get_clock_ns(vm_clock));
+        stm32_timer_trgo_event(s, TIMx_CR2_MMS_RESET);
+    }
+
+    /* CCxG, COMG, TG and BG just set their flags. */
+    flags = (((1 << s->channel_count) - 1) << TIMx_SR_CC1IF_BIT) |
+            (1 << TIMx_SR_TIF_BIT);
+    if (s->advanced) {
+        flags |= (1 << TIMx_SR_COMIF_BIT) | (1 << TIMx_SR_BIF_BIT);
+    }
+    s->TIMx_SR |= new_value & flags;
+}
+
+static void stm32_timer_TIMx_ARR_write(Stm32Timer *s, uint32_t new_value)
+{
+    s->TIMx_ARR = new_value & TIMER_CNT_MAX;
+    if (!IS_BIT_SET(s->TIMx_CR1, TIMx_CR1_ARPE_BIT)) {
+        s->arr = s->TIMx_ARR;
+    }
+}
+
+static void stm32_timer_TIMx_CCR_write(Stm32Timer *s, int n,
+                                       uint32_t new_value)
+{
+    s->TIMx_CCR[n] = new_value & TIMER_CNT_MAX;
+    if (!stm32_timer_ccr_preload(s, n)) {
+        s->ccr[n] = s->TIMx_CCR[n];
+    }
+}
+
+static uint64_t stm32_timer_readw(Stm32Timer *s, hwaddr offset)
+{
+    int n;
+
+    switch (offset) {
+        case TIMx_CR1_OFFSET:
+            stm32_timer_sync(s);
+            return stm32_timer_TIMx_CR1_read(s);
+        case TIMx_CR2_OFFSET:
+            return s->TIMx_CR2;
+        case TIMx_SMCR_OFFSET:
+            return s->TIMx_SMCR;
+        case TIMx_DIER_OFFSET:
+            return s->TIMx_DIER;
+        case TIMx_SR_OFFSET:
+            stm32_timer_sync(s);
+            stm32_timer_update_irq(s);
+            return s->TIMx_SR;
+        case TIMx_EGR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+        case TIMx_CCMR1_OFFSET:
+            return s->TIMx_CCMR[0];
+        case TIMx_CCMR2_OFFSET:
+            return s->TIMx_CCMR[1];
+        case TIMx_CCER_OFFSET:
+            return s->TIMx_CCER;
+        case TIMx_CNT_OFFSET:
+            stm32_timer_sync(s);
+            return s->cnt;
+        case TIMx_PSC_OFFSET:
+            return s->TIMx_PSC;
+        case TIMx_ARR_OFFSET:
+            return s->TIMx_ARR;
+        case TIMx_CCR1_OFFSET ... TIMx_CCR4_OFFSET:
+            n = (offset - TIMx_CCR1_OFFSET) / 4;
+            if (n >= s->channel_count) {
+                STM32_BAD_REG(offset, 4);
+                return 0;
+            }
+            if (!stm32_timer_output_compare(s, n)) {
+                /* Reading a captured value clears its flag. */
+                RESET_BIT(s->TIMx_SR, (TIMx_SR_CC1IF_BIT + n));
+                stm32_timer_update_irq(s);
+            }
+            return s->TIMx_CCR[n];
+        case TIMx_DCR_OFFSET:
+            return s->TIMx_DCR;
+        case TIMx_DMAR_OFFSET:
+            STM32_NOT_IMPL_REG(offset, 4);
+            return 0;
+    }
+
+    if (s->advanced) {
+        switch (offset) {
+            case TIMx_RCR_OFFSET:
+                return s->TIMx_RCR;
+            case TIMx_BDTR_OFFSET:
+                return s->TIMx_BDTR;
+        }
+    }
+
+    STM32_BAD_REG(offset, 4);
+    return 0;
+}
+
+static void stm32_timer_writew(Stm32Timer *s, hwaddr offset,
+                               uint64_t value)
+{
+    int n;
+
+    /* Account for the time that passed under the old settings before
+     * changing anything. */
+    stm32_timer_sync(s);
+
+    switch (offset) {
+        case TIMx_CR1_OFFSET:
+            stm32_timer_TIMx_CR1_write(s, value, false);
+            break;
+        case TIMx_CR2_OFFSET:
+            s->TIMx_CR2 = value & 0x00007ffd;
+            break;
+        case TIMx_SMCR_OFFSET:
+            stm32_timer_TIMx_SMCR_write(s, value, false);
+            break;
+        case TIMx_DIER_OFFSET:
+            s->TIMx_DIER = value & 0x00007fff;
+            break;
+        case TIMx_SR_OFFSET:
+            /* Flags are cleared by writing 0. */
+            s->TIMx_SR &= value;
+            break;
+        case TIMx_EGR_OFFSET:
+            stm32_timer_TIMx_EGR_write(s, value);
+            break;
+        case TIMx_CCMR1_OFFSET:
+            s->TIMx_CCMR[0] = value & 0x0000ffff;
+            break;
+        case TIMx_CCMR2_OFFSET:
+            s->TIMx_CCMR[1] = value & 0x0000ffff;
+            break;
+        case TIMx_CCER_OFFSET:
+            s->TIMx_CCER = value & 0x00003fff;
+            /* The input prescalers restart while capture is disabled. */
+            for (n = 0; n < s->channel_count; n++) {
+                if (!IS_BIT_SET(s->TIMx_CCER, (TIMx_CCER_CC1E_BIT + 4 * n))) {
+                    s->ic_events[n] = 0;
+                }
+            }
+            break;
+        case TIMx_CNT_OFFSET:
+            s->cnt = value & TIMER_CNT_MAX;
+            stm32_timer_rebase(s, qemu_get_clock_ns(vm_clock));
+            break;
+        case TIMx_PSC_OFFSET:
+            /* Takes effect at the next update event. */
+            s->TIMx_PSC = value & 0x0000ffff;
+            break;
+        case TIMx_ARR_OFFSET:
+            stm32_timer_TIMx_ARR_write(s, value);
+            break;
+        case TIMx_CCR1_OFFSET ... TIMx_CCR4_OFFSET:
+            n = (offset - TIMx_CCR1_OFFSET) / 4;
+            if (n >= s->channel_count) {
+                STM32_BAD_REG(offset, 4);
+                break;
+            }
+            if (!stm32_timer_output_compare(s, n)) {
+                STM32_RO_REG(offset);
+                break;
+            }
+            stm32_timer_TIMx_CCR_write(s, n, value);
+            break;
+        case TIMx_RCR_OFFSET:
+            if (!s->advanced) {
+                STM32_BAD_REG(offset, 4);
+                break;
+            }
+            s->TIMx_RCR = value & 0x000000ff;
+            break;
+        case TIMx_BDTR_OFFSET:
+            if (!s->advanced) {
+                STM32_BAD_REG(offset, 4);
+                break;
+            }
+            s->TIMx_BDTR = value & 0x0000ffff;
+            break;
+        case TIMx_DCR_OFFSET:
+            s->TIMx_DCR = value & 0x00001f1f;
+            break;
+        case TIMx_DMAR_OFFSET:
+            STM32_NOT_IMPL_REG(offset, 4);
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+
+    stm32_timer_update_irq(s);
+    stm32_timer_update_pwm(s);
+    stm32_timer_schedule(s);
+}
+
+/* All of the registers are 16 bits wide, and the ST library accesses them
+ * as halfwords.  The upper halfwords are reserved. */
+static uint64_t stm32_timer_read(void *opaque, hwaddr offset,
+                                 unsigned size)
+{
+    Stm32Timer *s = (Stm32Timer *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            if (offset & 2) {
+                value = 0;
+                break;
+            }
+            value = stm32_timer_readw(s, offset) & 0xffff;
+            break;
+        case WORD_ACCESS_SIZE:
+            value = stm32_timer_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_timer_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_timer_write(void *opaque, hwaddr offset,
+                              uint64_t value, unsigned size)
+{
+    Stm32Timer *s = (Stm32Timer *)opaque;
+
+    trace_stm32_timer_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case HALFWORD_ACCESS_SIZE:
+            if (offset & 2) {
+                break;
+            }
+            stm32_timer_writew(s, offset, value & 0xffff);
+            break;
+        case WORD_ACCESS_SIZE:
+            stm32_timer_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_timer_ops = {
+    .read = stm32_timer_read,
+    .write = stm32_timer_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_timer_reset(DeviceState *dev)
+{
+    Stm32Timer *s = FROM_SYSBUS(Stm32Timer, SYS_BUS_DEVICE(dev));
+    int n;
+
+    stm32_timer_TIMx_CR1_write(s, 0x00000000, true);
+    s->TIMx_CR2 = 0;
+    stm32_timer_TIMx_SMCR_write(s, 0x00000000, true);
+    s->TIMx_DIER = 0;
+    s->TIMx_SR = 0;
+    s->TIMx_CCMR[0] = 0;
+    s->TIMx_CCMR[1] = 0;
+    s->TIMx_CCER = 0;
+    s->TIMx_PSC = 0;
+    s->TIMx_ARR = TIMER_CNT_MAX;
+    s->TIMx_RCR = 0;
+    for (n = 0; n < STM32_TIMER_MAX_CHANNELS; n++) {
+        s->TIMx_CCR[n] = 0;
+        s->ic_events[n] = 0;
+    }
+    s->TIMx_BDTR = 0;
+    s->TIMx_DCR = 0;
+
+    s->psc = 0;
+    stm32_timer_load_shadows(s);
+    s->cnt = 0;
+    s->count_down = false;
+    stm32_timer_rebase(s, qemu_get_clock_ns(vm_clock));
+
+    qemu_del_timer(s->timer);
+    stm32_timer_update_irq(s);
+    stm32_timer_update_pwm(s);
+}
+
+
+
+
+/* PUBLIC FUNCTIONS */
+
+void stm32_timer_connect_input(Stm32Timer *s, int n, Stm32Gpio *gpio,
+                               unsigned pin)
+{
+    Stm32TimerInput *input = &s->input[n];
+
+    assert(n < s->channel_count && pin < STM32_GPIO_PIN_COUNT);
+
+    input->timer = s;
+    input->n = n;
+    input->pin = pin;
+    input->notifier.notify = stm32_timer_input_changed;
+    stm32_gpio_add_input_notifier(gpio, &input->notifier);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_timer_instance_init(Object *obj)
+{
+    Stm32Timer *s = FROM_SYSBUS(Stm32Timer, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_timer_init(SysBusDevice *dev)
+{
+    Stm32Timer *s = FROM_SYSBUS(Stm32Timer, dev);
+    qemu_irq *clk_irq;
+    int i;
+
+    if (s->channel_count > STM32_TIMER_MAX_CHANNELS) {
+        hw_error("stm32_timer: channel_count must be at most %d",
+                 STM32_TIMER_MAX_CHANNELS);
+    }
+    if (s->irq_count != 1 && s->irq_count != TIMER_IRQ_COUNT) {
+        hw_error("stm32_timer: irq_count must be 1 or %d", TIMER_IRQ_COUNT);
+    }
+
+
+    memory_region_init_io(&s->iomem, &stm32_timer_ops, s,
+                          "timer", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    for (i = 0; i < s->irq_count; i++) {
+        sysbus_init_irq(dev, &s->irq[i]);
+    }
+    qdev_init_gpio_out(&dev->qdev, s->trigger, STM32_TIMER_TRIGGER_COUNT);
+
+    s->timer = qemu_new_timer_ns(vm_clock, stm32_timer_expire, s);
+
+    /* Register handler for input clock changes. */
+    clk_irq = qemu_allocate_irqs(stm32_timer_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev,
+                              clk_irq[0]);
+    s->freq = s->clk.freq;
+
+    return 0;
+}
+
+static Property stm32_timer_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Timer, periph, -1),
+    DEFINE_PROP_UINT32("channel_count", Stm32Timer, channel_count,
+                       STM32_TIMER_MAX_CHANNELS),
+    DEFINE_PROP_BIT("advanced", Stm32Timer, advanced, 0, false),
+    DEFINE_PROP_UINT32("irq_count", Stm32Timer, irq_count, 1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_timer_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_timer_init;
+    dc->reset = stm32_timer_reset;
+    dc->props = stm32_timer_properties;
+}
+
+static TypeInfo stm32_timer_info = {
+    .name  = "stm32_timer",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Timer),
+    .instance_init = stm32_timer_instance_init,
+    .class_init = stm32_timer_class_init
+};
+
+static void stm32_timer_register_types(void)
+{
+    type_register_static(&stm32_timer_info);
+}
+
+type_init(stm32_timer_register_types)
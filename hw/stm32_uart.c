@@ -24,6 +24,12 @@
 #include "stm32f1xx.h"
 #include "stm32f2xx.h"
 #include "char/char.h"
+#include "fifo.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/replay.h"
+#include "monitor/monitor.h"
+#include "qapi/qmp/qjson.h"
+#include "trace.h"
 
 
 /* DEFINITIONS*/
@@ -41,6 +47,7 @@
 #endif
 
 #define USART_SR_OFFSET 0x00
+#define USART_SR_CTS_BIT 9
 #define USART_SR_TXE_BIT 7
 #define USART_SR_TC_BIT 6
 #define USART_SR_RXNE_BIT 5
@@ -51,6 +58,7 @@
 #define USART_BRR_OFFSET 0x08
 
 #define USART_CR1_OFFSET 0x0c
+#define USART_CR1_OVER8_BIT 15 /* STM32F2XX only */
 #define USART_CR1_UE_BIT 13
 #define USART_CR1_M_BIT 12
 #define USART_CR1_PCE_BIT 10
@@ -66,11 +74,34 @@
 #define USART_CR2_STOP_MASK 0x00003000
 
 #define USART_CR3_OFFSET 0x14
+#define USART_CR3_ONEBIT_BIT 11 /* STM32F2XX only */
+#define USART_CR3_CTSIE_BIT 10
 #define USART_CR3_CTSE_BIT 9
 #define USART_CR3_RTSE_BIT 8
+#define USART_CR3_DMAT_BIT 7
+#define USART_CR3_DMAR_BIT 6
 
 #define USART_GTPR_OFFSET 0x18
 
+/* Bits of the "options" field */
+#define STM32_UART_OPT_NO_BAUD_DELAY_BIT 0
+
+/* Transmitted characters are staged and written to the character device
+ * in one go when a line is complete, the buffer is full, the VM stops, or
+ * the first staged character has waited this long.  With CTS flow control,
+ * what the character device does not take stays staged, and the transmitter
+ * waits once the buffer is full.  Writing is tried again when the character
+ * device says it can take more, or after the same delay.
+ */
+#define STM32_UART_TX_BUF_SIZE 256
+#define STM32_UART_TX_FLUSH_MS 10
+
+#ifdef STM32_UART_NO_BAUD_DELAY
+#define STM32_UART_NO_BAUD_DELAY_DEFAULT true
+#else
+#define STM32_UART_NO_BAUD_DELAY_DEFAULT false
+#endif
+
 
 struct Stm32Uart {
     /* Inherited */
@@ -78,28 +109,26 @@ struct Stm32Uart {
 
     /* Properties */
     stm32_periph_t periph;
-    union {
-        void *stm32_rcc_prop;
-        Stm32Rcc *stm32_rcc;
-    };
+    Stm32Rcc *stm32_rcc;
     union {
         void *stm32_gpio_prop;
         Stm32Gpio **stm32_gpio;
     };
-    union {
-        void *stm32_afio_prop;
-        Stm32Afio *stm32_afio;
-    };
+    /* Set on the STM32F1XX, where it checks the transmit pin */
+    Stm32Afio *stm32_afio;
+    /* See STM32_UART_OPT_* */
+    uint32_t options;
+    uint32_t rx_fifo_size;
+
+    /* Private */
+    MemoryRegion iomem;
+
     /* Checks the USART transmit pin's GPIO settings.  If the GPIO is not configured
      * properly, a hardware error is triggered.
      */
-    union {
-        void *check_tx_pin_prop;
-        void (*check_tx_pin_callback)(Stm32Uart *);
-    };
+    void (*check_tx_pin_callback)(Stm32Uart *);
 
-    /* Private */
-    MemoryRegion iomem;
+    Stm32PeriphClk clk;
 
     int uart_index;
 
@@ -117,6 +146,7 @@ struct Stm32Uart {
 
     /* Register Field Values */
     uint32_t
+        USART_SR_CTS,
         USART_SR_TXE,
         USART_SR_TC,
         USART_SR_RXNE,
@@ -133,10 +163,31 @@ struct Stm32Uart {
     /* Indicates whether the USART is currently receiving a byte. */
     bool receiving;
 
+    /* Bytes received from the character device that have not been moved
+     * into the data register yet.  The byte at the head of the FIFO is the
+     * one currently being received. */
+    Fifo8 rx_fifo;
+
+    /* The byte at the head of rx_fifo has been completely received, but
+     * is waiting for software to empty the data register. */
+    bool rx_pending;
+
     /* Timers used to simulate a delay corresponding to the baud rate. */
     struct QEMUTimer *rx_timer;
     struct QEMUTimer *tx_timer;
 
+    /* Characters transmitted by the guest but not yet written to chr. */
+    uint8_t tx_buf[STM32_UART_TX_BUF_SIZE];
+    int tx_len;
+    /* The character device did not take all of tx_buf.  This is the CTS
+     * input: the other end is not ready. */
+    bool tx_blocked;
+    /* With CTSE set, the character being transmitted could not be staged
+     * yet, so it is not complete. */
+    bool tx_waiting_cts;
+    struct QEMUTimer *tx_flush_timer;
+    Notifier exit_notifier;
+
     CharDriverState *chr;
 
     /* Stores the USART pin mapping used by the board.  This is used to check
@@ -147,6 +198,13 @@ struct Stm32Uart {
 
     qemu_irq irq;
     int curr_irq_level;
+
+    /* DMA request outputs (see STM32_UART_DMA_*_REQ) */
+    qemu_irq dma_req[2];
+    int curr_dma_rx_level, curr_dma_tx_level;
+
+    /* Detects software spinning on USART_SR */
+    Stm32Poll poll;
 };
 
 
@@ -154,95 +212,111 @@ struct Stm32Uart {
 /* STM32F1XX Specific stuff */
 
 /* Checks the USART transmit pin's GPIO settings.  If the GPIO is not configured
- * properly, a hardware error is triggered.
+ * properly, a hardware error is triggered.  The AFIO keeps track of the pin
+ * configuration, so this is a single bit test.
  */
-void stm32_afio_uart_check_tx_pin_callback(Stm32Uart *s)
+static void stm32_afio_uart_check_tx_pin_callback(Stm32Uart *s)
 {
-    int tx_periph, tx_pin;
-    int config;
+    Stm32AfioRoute tx_route;
 
     switch(s->periph) {
         case STM32F1XX_UART1:
-            switch(stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
-                case STM32_USART1_NO_REMAP:
-                    tx_periph = STM32F1XX_GPIOA;
-                    tx_pin = 9;
-                    break;
-                case STM32_USART1_REMAP:
-                    tx_periph = STM32F1XX_GPIOB;
-                    tx_pin = 6;
-                    break;
-                default:
-                    assert(false);
-                    break;
-            }
+            tx_route = STM32_AFIO_USART1_TX;
             break;
         case STM32F1XX_UART2:
-            switch(stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
-                case STM32_USART2_NO_REMAP:
-                    tx_periph = STM32F1XX_GPIOA;
-                    tx_pin = 2;
-                    break;
-                case STM32_USART2_REMAP:
-                    tx_periph = STM32F1XX_GPIOD;
-                    tx_pin = 5;
-                    break;
-                default:
-                    assert(false);
-                    break;
-            }
+            tx_route = STM32_AFIO_USART2_TX;
             break;
         case STM32F1XX_UART3:
-            switch(stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
-                case STM32_USART3_NO_REMAP:
-                    tx_periph = STM32F1XX_GPIOB;
-                    tx_pin = 10;
-                    break;
-                case STM32_USART3_PARTIAL_REMAP:
-                    tx_periph = STM32F1XX_GPIOC;
-                    tx_pin = 10;
-                    break;
-                case STM32_USART3_FULL_REMAP:
-                    tx_periph = STM32F1XX_GPIOD;
-                    tx_pin = 8;
-                    break;
-                default:
-                    assert(false);
-                    break;
-            }
+            tx_route = STM32_AFIO_USART3_TX;
+            break;
+        case STM32F1XX_UART4:
+            tx_route = STM32_AFIO_UART4_TX;
+            break;
+        case STM32F1XX_UART5:
+            tx_route = STM32_AFIO_UART5_TX;
             break;
         default:
             assert(false);
-            break;
-    }
-
-    Stm32Gpio *gpio_dev = s->stm32_gpio[tx_periph - STM32F1XX_GPIOA];
-
-    if(stm32_gpio_get_mode_bits(gpio_dev, tx_pin) == STM32_GPIO_MODE_IN) {
-        hw_error("UART TX pin needs to be configured as output");
+            return;
     }
 
-    config = stm32_gpio_get_config_bits(gpio_dev, tx_pin);
-    if((config != STM32_GPIO_OUT_ALT_PUSHPULL) &&
-       (config != STM32_GPIO_OUT_ALT_OPEN)) {
+    if(!stm32_afio_route_valid(s->stm32_afio, tx_route)) {
         hw_error("UART TX pin needs to be configured as "
                  "alternate function output");
     }
 }
 
 
+
+/* STM32F2XX Specific stuff */
+
+/* The STM32F2XX has no AFIO remapping - the software instead selects the
+ * USART's alternate function on one of the pins that can carry it
+ * (datasheet DS6329, table 9).  Checks that at least one of them is set up
+ * to do so.  If not, a hardware error is triggered.
+ */
+static void stm32f2xx_gpio_uart_check_tx_pin_callback(Stm32Uart *s)
+{
+    typedef struct {
+        uint8_t af;
+        struct {
+            int8_t gpio_idx;
+            int8_t pin;
+        } tx[3];
+    } Stm32f2xxUartTxPins;
+    static const Stm32f2xxUartTxPins tx_pin_desc[] = {
+        /* USART1 */ {7, {{STM32_GPIOA_INDEX, 9}, {STM32_GPIOB_INDEX, 6},
+                          {-1, -1}}},
+        /* USART2 */ {7, {{STM32_GPIOA_INDEX, 2}, {STM32_GPIOD_INDEX, 5},
+                          {-1, -1}}},
+        /* USART3 */ {7, {{STM32_GPIOB_INDEX, 10}, {STM32_GPIOC_INDEX, 10},
+                          {STM32_GPIOD_INDEX, 8}}},
+        /* UART4 */  {8, {{STM32_GPIOA_INDEX, 0}, {STM32_GPIOC_INDEX, 10},
+                          {-1, -1}}},
+        /* UART5 */  {8, {{STM32_GPIOC_INDEX, 12}, {-1, -1}, {-1, -1}}},
+        /* USART6 */ {8, {{STM32_GPIOC_INDEX, 6}, {STM32_GPIOG_INDEX, 14},
+                          {-1, -1}}},
+    };
+    const Stm32f2xxUartTxPins *desc;
+    int i;
+
+    assert(s->periph >= STM32F2XX_UART1 && s->periph <= STM32F2XX_UART6);
+    desc = &tx_pin_desc[s->periph - STM32F2XX_UART1];
+
+    for(i = 0; i < ARRAY_LENGTH(desc->tx) && desc->tx[i].gpio_idx >= 0; i++) {
+        Stm32Gpio *gpio_dev = s->stm32_gpio[desc->tx[i].gpio_idx];
+
+        if(stm32f2xx_gpio_get_af_pins(gpio_dev, desc->af) &
+           (1 << desc->tx[i].pin)) {
+            return;
+        }
+    }
+
+    hw_error("UART TX pin needs to be configured as "
+             "alternate function %d output", desc->af);
+}
+
+
+
 /* HELPER FUNCTIONS */
 
 /* Update the baud rate based on the USART's peripheral clock frequency. */
 static void stm32_uart_baud_update(Stm32Uart *s)
 {
-    uint32_t clk_freq = stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
+    uint32_t clk_freq = s->clk.freq;
+    uint32_t divider = s->USART_BRR;
     uint64_t ns_per_bit;
 
-    if((s->USART_BRR == 0) || (clk_freq == 0)) {
+    /* When oversampling by 8, the fraction is only three bits wide and
+     * the mantissa counts half as many clocks per bit. */
+    if(IS_BIT_SET(s->USART_CR1, USART_CR1_OVER8_BIT)) {
+        divider = ((s->USART_BRR >> 4) << 3) | (s->USART_BRR & 0x7);
+    }
+
+    if((divider == 0) || (clk_freq == 0)) {
         s->bits_per_sec = 0;
     } else {
-        s->bits_per_sec = clk_freq / s->USART_BRR;
+        s->bits_per_sec = clk_freq / divider;
         ns_per_bit = 1000000000LL / s->bits_per_sec;
 
         /* We assume 10 bits per character.  This may not be exactly
@@ -250,6 +324,13 @@ static void stm32_uart_baud_update(Stm32Uart *s)
         s->ns_per_char = ns_per_bit * 10;
     }
 
+    /* A character may complete up to 1/16 of a character time late, so
+     * that the USARTs running at one baud rate share host wakeups. */
+    qemu_timer_set_slack_ns(s->rx_timer, s->ns_per_char / 16);
+    qemu_timer_set_slack_ns(s->tx_timer, s->ns_per_char / 16);
+
+    trace_stm32_uart_baud(s, clk_freq, s->USART_BRR, s->bits_per_sec);
+
 #ifdef DEBUG_STM32_UART
     const char *periph_name = s->busdev.qdev.id;
     DPRINTF("%s clock is set to %lu Hz.\n",
@@ -281,25 +362,124 @@ static void stm32_uart_clk_irq_handler(void *opaque, int n, int level)
  * an interrupt-related flag is updated.
  */
 static void stm32_uart_update_irq(Stm32Uart *s) {
+    int new_dma_rx_level, new_dma_tx_level;
     /* Note that we are not checking the ORE flag, but we should be. */
     int new_irq_level =
        (s->USART_CR1_TCIE & s->USART_SR_TC) |
        (s->USART_CR1_TXEIE & s->USART_SR_TXE) |
        (s->USART_CR1_RXNEIE &
-               (s->USART_SR_ORE | s->USART_SR_RXNE));
+               (s->USART_SR_ORE | s->USART_SR_RXNE)) |
+       (GET_BIT_VALUE(s->USART_CR3, USART_CR3_CTSIE_BIT) & s->USART_SR_CTS);
 
     /* Only trigger an interrupt if the IRQ level changes.  We probably could
      * set the level regardless, but we will just check for good measure.
      */
     if(new_irq_level ^ s->curr_irq_level) {
+        trace_stm32_uart_irq(s, new_irq_level);
         qemu_set_irq(s->irq, new_irq_level);
         s->curr_irq_level = new_irq_level;
     }
+
+    /* The DMA requests follow the same flags.  Raising one may run DMA
+     * transfers which access the data register before this returns. */
+    new_dma_rx_level = IS_BIT_SET(s->USART_CR3, USART_CR3_DMAR_BIT) &&
+                       s->USART_SR_RXNE;
+    new_dma_tx_level = IS_BIT_SET(s->USART_CR3, USART_CR3_DMAT_BIT) &&
+                       s->USART_SR_TXE &&
+                       s->USART_CR1_UE && s->USART_CR1_TE;
+    if(new_dma_rx_level ^ s->curr_dma_rx_level) {
+        s->curr_dma_rx_level = new_dma_rx_level;
+        qemu_set_irq(s->dma_req[STM32_UART_DMA_RX_REQ], new_dma_rx_level);
+    }
+    if(new_dma_tx_level ^ s->curr_dma_tx_level) {
+        s->curr_dma_tx_level = new_dma_tx_level;
+        qemu_set_irq(s->dma_req[STM32_UART_DMA_TX_REQ], new_dma_tx_level);
+    }
 }
 
 
+static void stm32_uart_tx_complete(Stm32Uart *s);
 static void stm32_uart_start_tx(Stm32Uart *s, uint32_t value);
 
+/* Write out the staged transmit characters.  Without CTS flow control,
+ * what the character device does not take is lost, as it would be on the
+ * line. */
+static void stm32_uart_tx_flush(Stm32Uart *s)
+{
+    int len = s->tx_len;
+
+    qemu_del_timer(s->tx_flush_timer);
+    if(s->tx_len == 0) {
+        return;
+    }
+
+    if (s->chr) {
+        len = qemu_chr_fe_write(s->chr, s->tx_buf, s->tx_len);
+        if(len < 0) {
+            /* Errors do not go away by trying again */
+            len = s->tx_len;
+        }
+    }
+    s->tx_blocked = len < s->tx_len;
+    if(s->tx_blocked && IS_BIT_SET(s->USART_CR3, USART_CR3_CTSE_BIT)) {
+        memmove(s->tx_buf, s->tx_buf + len, s->tx_len - len);
+        s->tx_len -= len;
+        qemu_mod_timer(s->tx_flush_timer,
+                       qemu_get_clock_ms(rt_clock) + STM32_UART_TX_FLUSH_MS);
+    } else {
+        s->tx_len = 0;
+    }
+}
+
+/* With CTSE set, the transmitter waits while the other end is not ready
+ * and the staging buffer is full. */
+static bool stm32_uart_tx_stalled(Stm32Uart *s)
+{
+    return IS_BIT_SET(s->USART_CR3, USART_CR3_CTSE_BIT) &&
+           s->tx_len == STM32_UART_TX_BUF_SIZE;
+}
+
+/* A change of the CTS input sets the CTS flag, when CTSE is set. */
+static void stm32_uart_cts_update(Stm32Uart *s, bool was_blocked)
+{
+    if(s->tx_blocked != was_blocked) {
+        trace_stm32_uart_cts(s, !s->tx_blocked, s->tx_len);
+        if(IS_BIT_SET(s->USART_CR3, USART_CR3_CTSE_BIT)) {
+            s->USART_SR_CTS = 1;
+            stm32_uart_update_irq(s);
+        }
+    }
+}
+
+/* Let the character being transmitted take its time on the line. */
+static void stm32_uart_tx_shift(Stm32Uart *s)
+{
+    if (IS_BIT_SET(s->options, STM32_UART_OPT_NO_BAUD_DELAY_BIT)) {
+        /* If BAUD delays are not being simulated, then immediately mark the
+         * transmission as complete.
+         */
+        stm32_uart_tx_complete(s);
+    } else {
+        /* Otherwise, start the transmit delay timer. */
+        qemu_mod_timer(s->tx_timer,
+                       qemu_get_clock_ns(vm_clock) + s->ns_per_char);
+    }
+}
+
+/* Try to write out what the character device did not take, and let a
+ * transmitter that was waiting for it go on. */
+static void stm32_uart_tx_resume(Stm32Uart *s)
+{
+    bool was_blocked = s->tx_blocked;
+
+    stm32_uart_tx_flush(s);
+    stm32_uart_cts_update(s, was_blocked);
+    if(s->tx_waiting_cts && !stm32_uart_tx_stalled(s)) {
+        s->tx_waiting_cts = false;
+        stm32_uart_tx_shift(s);
+    }
+}
+
 /* Routine to be called when a transmit is complete. */
 static void stm32_uart_tx_complete(Stm32Uart *s)
 {
@@ -310,52 +490,170 @@ static void stm32_uart_tx_complete(Stm32Uart *s)
         stm32_uart_update_irq(s);
     } else {
         /* Otherwise, mark the transmit buffer as empty and
-         * start transmitting the value stored there.
+         * start transmitting the value stored there.  The IRQ is updated
+         * last, because a DMA request may refill the buffer immediately.
          */
         s->USART_SR_TXE = 1;
-        stm32_uart_update_irq(s);
         stm32_uart_start_tx(s, s->USART_TDR);
+        stm32_uart_update_irq(s);
     }
 }
 
 /* Start transmitting a character. */
 static void stm32_uart_start_tx(Stm32Uart *s, uint32_t value)
 {
-    uint64_t curr_time = qemu_get_clock_ns(vm_clock);
     uint8_t ch = value; //This will truncate the ninth bit
+    bool was_blocked = s->tx_blocked;
+
+    trace_stm32_uart_tx(s, ch);
 
     /* Reset the Transmission Complete flag to indicate a transmit is in
      * progress.
      */
     s->USART_SR_TC = 0;
 
-    /* Write the character out. */
+    /* Stage the character for the character device.  The guest-visible
+     * timing below does not depend on when it is actually written out. */
     if (s->chr) {
-        qemu_chr_fe_write(s->chr, &ch, 1);
+        if(s->tx_len == 0) {
+            qemu_mod_timer(s->tx_flush_timer,
+                           qemu_get_clock_ms(rt_clock) + STM32_UART_TX_FLUSH_MS);
+        }
+        s->tx_buf[s->tx_len++] = ch;
+        if((ch == '\n') || (s->tx_len == STM32_UART_TX_BUF_SIZE)) {
+            stm32_uart_tx_flush(s);
+            stm32_uart_cts_update(s, was_blocked);
+        }
     }
-#ifdef STM32_UART_NO_BAUD_DELAY
-    /* If BAUD delays are not being simulated, then immediately mark the
-     * transmission as complete.
+    if(stm32_uart_tx_stalled(s)) {
+        /* The character completes once the other end has taken some of
+         * the staged ones (see stm32_uart_tx_resume). */
+        s->tx_waiting_cts = true;
+    } else {
+        stm32_uart_tx_shift(s);
+    }
+}
+
+
+
+/* Sends a STM32_UART_OVERRUN event (see QMP/qmp-events.txt). */
+static void stm32_uart_send_overrun_event(Stm32Uart *s)
+{
+    QObject *data;
+
+    data = qobject_from_jsonf("{ 'device': %s }",
+                              DEVICE(s)->id ? DEVICE(s)->id : "");
+    monitor_protocol_event(QEVENT_STM32_UART_OVERRUN, data);
+    qobject_decref(data);
+}
+
+/* Move the byte at the head of the receive FIFO into the data register. */
+static void stm32_uart_rx_deliver(Stm32Uart *s)
+{
+    /* If there is already a character in the receive buffer, then
+     * set the overflow flag.
      */
-    curr_time = curr_time; //Avoid "variable unused" compiler error
-    stm32_uart_tx_complete(s);
-#else
-    /* Otherwise, start the transmit delay timer. */
-    qemu_mod_timer(s->tx_timer,  curr_time + s->ns_per_char);
-#endif
+    if(s->USART_SR_RXNE) {
+        s->USART_SR_ORE = 1;
+        s->sr_read_since_ore_set = false;
+        if(monitor_protocol_event_wanted(QEVENT_STM32_UART_OVERRUN)) {
+            stm32_uart_send_overrun_event(s);
+        }
+    }
+
+    /* Receive the character and mark the buffer as not empty. */
+    s->USART_RDR = fifo8_pop(&s->rx_fifo);
+    trace_stm32_uart_rx(s, s->USART_RDR, s->USART_SR_ORE);
+    s->USART_SR_RXNE = 1;
+    stm32_uart_update_irq(s);
+
+    /* There is room in the FIFO again. */
+    if (s->chr) {
+        qemu_chr_accept_input(s->chr);
+    }
+}
+
+/* Start receiving the next character in the FIFO, if there is one and the
+ * USART is idle.
+ */
+static void stm32_uart_rx_start(Stm32Uart *s)
+{
+    if(s->receiving || s->rx_pending || fifo8_is_empty(&s->rx_fifo)) {
+        return;
+    }
+
+    /* With RTSE set, nRTS is high while the data register is full, so the
+     * other end holds the next character back until software reads it. */
+    if(IS_BIT_SET(s->USART_CR3, USART_CR3_RTSE_BIT) && s->USART_SR_RXNE) {
+        return;
+    }
+
+    if (IS_BIT_SET(s->options, STM32_UART_OPT_NO_BAUD_DELAY_BIT)) {
+        /* Without BAUD delays, characters arrive as soon as software has
+         * emptied the data register. */
+        if(!s->USART_SR_RXNE) {
+            stm32_uart_rx_deliver(s);
+        }
+    } else {
+        /* Otherwise, the character arrives when the receive delay is
+         * finished. */
+        s->receiving = true;
+        qemu_mod_timer(s->rx_timer,
+                       qemu_get_clock_ns(vm_clock) + s->ns_per_char);
+    }
 }
 
 
 
 /* TIMER HANDLERS */
-/* Once the receive delay is finished, indicate the USART is finished receiving.
- * This will allow it to receive the next character.  The current character was
- * already received before starting the delay.
+/* Once the receive delay is finished, the character at the head of the FIFO
+ * has been received.  Move it into the data register and start receiving
+ * the next one.
  */
 static void stm32_uart_rx_timer_expire(void *opaque) {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
     s->receiving = false;
+    stm32_poll_break(&s->poll);
+
+#ifndef STM32_UART_ENABLE_OVERRUN
+    /* Unless overrun is enabled, do not overwrite the data register until
+     * software has read the previous character.
+     */
+    if(s->USART_SR_RXNE) {
+        s->rx_pending = true;
+        return;
+    }
+#endif
+
+    stm32_uart_rx_deliver(s);
+    stm32_uart_rx_start(s);
+}
+
+/* Do not hold back staged characters for more than STM32_UART_TX_FLUSH_MS. */
+static void stm32_uart_tx_flush_timer_expire(void *opaque) {
+    Stm32Uart *s = (Stm32Uart *)opaque;
+
+    stm32_uart_tx_resume(s);
+}
+
+/* Write out staged characters when the VM stops or QEMU exits, so that
+ * nothing is left behind. */
+static void stm32_uart_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
+
+    if(!running) {
+        stm32_uart_tx_flush(s);
+    }
+}
+
+static void stm32_uart_exit_notify(Notifier *notifier, void *data)
+{
+    Stm32Uart *s = container_of(notifier, Stm32Uart, exit_notifier);
+
+    stm32_uart_tx_flush(s);
 }
 
 /* When the transmit delay is complete, mark the transmit as complete
@@ -363,6 +661,7 @@ static void stm32_uart_rx_timer_expire(void *opaque) {
 static void stm32_uart_tx_timer_expire(void *opaque) {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
+    stm32_poll_break(&s->poll);
     stm32_uart_tx_complete(s);
 }
 
@@ -377,34 +676,15 @@ static int stm32_uart_can_receive(void *opaque)
     Stm32Uart *s = (Stm32Uart *)opaque;
 
     if(s->USART_CR1_UE && s->USART_CR1_RE) {
-        /* The USART can only receive if it is enabled. */
-        if(s->receiving) {
-            /* If the USART is already receiving, then it cannot receive another
-             * character yet.
-             */
-            return 0;
-        } else {
-#ifdef STM32_UART_ENABLE_OVERRUN
-            /* If overrun is enabled, then always allow the next character to be
-             * received even if the buffer already has a value.  This is how
-             * real hardware behaves.*/
-            return 1;
-#else
-            /* Otherwise, do not allow the next character to be received until
-             * software has read the previous one.
-             */
-            if(s->USART_SR_RXNE) {
-                return 0;
-            } else {
-                return 1;
-            }
-#endif
-        }
+        /* The USART can only receive if it is enabled.  Characters are
+         * buffered until they can be moved into the data register.
+         */
+        return s->rx_fifo.capacity - s->rx_fifo.num;
     } else {
-        /* Always allow a character to be received if the module is disabled.
-         * However, the character will just be ignored (just like on real
+        /* Always allow characters to be received if the module is disabled.
+         * However, the characters will just be ignored (just like on real
          * hardware). */
-        return 1;
+        return s->rx_fifo.capacity;
     }
 }
 
@@ -413,39 +693,30 @@ static void stm32_uart_event(void *opaque, int event)
     /* Do nothing */
 }
 
+/* The other end is ready for more characters. */
+static void stm32_uart_write_unblocked(void *opaque)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
+
+    stm32_poll_break(&s->poll);
+    stm32_uart_tx_resume(s);
+}
+
 static void stm32_uart_receive(void *opaque, const uint8_t *buf, int size)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
-    uint64_t curr_time = qemu_get_clock_ns(vm_clock);
+    int i;
 
     assert(size > 0);
 
-    /* Only handle the received character if the module is enabled, */
+    /* Only handle the received characters if the module is enabled, */
     if(s->USART_CR1_UE && s->USART_CR1_RE) {
-        /* If there is already a character in the receive buffer, then
-         * set the overflow flag.
-         */
-        if(s->USART_SR_RXNE) {
-            s->USART_SR_ORE = 1;
-            s->sr_read_since_ore_set = false;
-            stm32_uart_update_irq(s);
+        for(i = 0; i < size && !fifo8_is_full(&s->rx_fifo); i++) {
+            fifo8_push(&s->rx_fifo, buf[i]);
         }
-
-        /* Receive the character and mark the buffer as not empty. */
-        s->USART_RDR = *buf;
-        s->USART_SR_RXNE = 1;
-        stm32_uart_update_irq(s);
+        stm32_poll_break(&s->poll);
+        stm32_uart_rx_start(s);
     }
-
-#ifdef STM32_UART_NO_BAUD_DELAY
-    /* Do nothing - there is no delay before the module reports it can receive
-     * the next character. */
-    curr_time = curr_time; //Avoid "variable unused" compiler error
-#else
-    /* Indicate the module is receiving and start the delay. */
-    s->receiving = true;
-    qemu_mod_timer(s->rx_timer,  curr_time + s->ns_per_char);
-#endif
 }
 
 
@@ -453,6 +724,21 @@ static void stm32_uart_receive(void *opaque, const uint8_t *buf, int size)
 
 /* REGISTER IMPLEMENTATION */
 
+/* Returns the time until which USART_SR cannot change, unless software
+ * accesses the USART or a character arrives. */
+static int64_t stm32_uart_USART_SR_stable_until(Stm32Uart *s)
+{
+    int64_t until = STM32_POLL_FOREVER;
+
+    if(qemu_timer_pending(s->tx_timer)) {
+        until = qemu_timer_expire_time_ns(s->tx_timer);
+    }
+    if(qemu_timer_pending(s->rx_timer)) {
+        until = MIN(until, (int64_t)qemu_timer_expire_time_ns(s->rx_timer));
+    }
+    return until;
+}
+
 static uint32_t stm32_uart_USART_SR_read(Stm32Uart *s)
 {
     /* If the Overflow flag is set, reading the SR register is the first step
@@ -462,7 +748,8 @@ static uint32_t stm32_uart_USART_SR_read(Stm32Uart *s)
         s->sr_read_since_ore_set = true;
     }
 
-    return (s->USART_SR_TXE << USART_SR_TXE_BIT) |
+    return (s->USART_SR_CTS << USART_SR_CTS_BIT) |
+           (s->USART_SR_TXE << USART_SR_TXE_BIT) |
            (s->USART_SR_TC << USART_SR_TC_BIT) |
            (s->USART_SR_RXNE << USART_SR_RXNE_BIT) |
            (s->USART_SR_ORE << USART_SR_ORE_BIT);
@@ -474,7 +761,14 @@ static uint32_t stm32_uart_USART_SR_read(Stm32Uart *s)
 
 static void stm32_uart_USART_SR_write(Stm32Uart *s, uint32_t new_value)
 {
-    uint32_t new_TC, new_RXNE;
+    uint32_t new_CTS, new_TC, new_RXNE;
+
+    new_CTS = GET_BIT_VALUE(new_value, USART_SR_CTS_BIT);
+    /* The CTS flag can be cleared, but not set. */
+    if(new_CTS && !s->USART_SR_CTS) {
+        hw_error("Software attempted to set USART CTS bit\n");
+    }
+    s->USART_SR_CTS = new_CTS;
 
     new_TC = GET_BIT_VALUE(new_value, USART_SR_TC_BIT);
     /* The Transmit Complete flag can be cleared, but not set. */
@@ -525,6 +819,14 @@ static void stm32_uart_USART_DR_read(Stm32Uart *s, uint32_t *read_value)
         hw_error("Read value from USART_DR while it was empty.");
     }
 
+    /* A character that was waiting for the data register to be emptied can
+     * now be moved into it. */
+    if(s->rx_pending) {
+        s->rx_pending = false;
+        stm32_uart_rx_deliver(s);
+    }
+    stm32_uart_rx_start(s);
+
     stm32_uart_update_irq(s);
 }
 
@@ -586,7 +888,8 @@ static void stm32_uart_USART_CR1_write(Stm32Uart *s, uint32_t new_value,
         /* Check to make sure the correct mapping is selected when enabling the
          * USART.
          */
-        if(s->afio_board_map != stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
+        if(s->stm32_afio &&
+           s->afio_board_map != stm32_afio_get_periph_map(s->stm32_afio, s->periph)) {
             hw_error("Bad AFIO mapping for %s", s->busdev.qdev.id);
         }
     }
@@ -598,7 +901,10 @@ static void stm32_uart_USART_CR1_write(Stm32Uart *s, uint32_t new_value,
     s->USART_CR1_TE = GET_BIT_VALUE(new_value, USART_CR1_TE_BIT);
     s->USART_CR1_RE = GET_BIT_VALUE(new_value, USART_CR1_RE_BIT);
 
-    s->USART_CR1 = new_value & 0x00003fff;
+    s->USART_CR1 = new_value & 0x0000bfff;
+
+    /* OVER8 changes the meaning of BRR. */
+    stm32_uart_baud_update(s);
 
     stm32_uart_update_irq(s);
 }
@@ -612,7 +918,17 @@ static void stm32_uart_USART_CR2_write(Stm32Uart *s, uint32_t new_value,
 static void stm32_uart_USART_CR3_write(Stm32Uart *s, uint32_t new_value,
                                         bool init)
 {
-    s->USART_CR3 = new_value & 0x000007ff;
+    s->USART_CR3 = new_value & 0x00000fff;
+
+    if(!init) {
+        /* Without CTSE, a waiting transmitter goes on, and a data register
+         * that is full no longer holds the other end back. */
+        if(s->tx_blocked) {
+            stm32_uart_tx_resume(s);
+        }
+        stm32_uart_rx_start(s);
+        stm32_uart_update_irq(s);
+    }
 }
 
 static void stm32_uart_reset(DeviceState *dev)
@@ -623,11 +939,22 @@ static void stm32_uart_reset(DeviceState *dev)
      * read-only, so we do not call the "write" routine
      * like normal.
      */
+    s->USART_SR_CTS = 0;
     s->USART_SR_TXE = 1;
     s->USART_SR_TC = 1;
     s->USART_SR_RXNE = 0;
     s->USART_SR_ORE = 0;
 
+    /* A transmitter waiting for CTS is stopped; the staged characters are
+     * still written out. */
+    s->tx_waiting_cts = false;
+
+    /* Drop anything that was still being received. */
+    s->receiving = false;
+    s->rx_pending = false;
+    fifo8_reset(&s->rx_fifo);
+    qemu_del_timer(s->rx_timer);
+
     // Do not initialize USART_DR - it is documented as undefined at reset
     // and does not behave like normal registers.
     stm32_uart_USART_BRR_write(s, 0x00000000, true);
@@ -772,16 +1099,40 @@ static uint64_t stm32_uart_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
+    uint64_t value;
+
+    if(offset == USART_SR_OFFSET) {
+        stm32_poll_read(&s->poll, offset,
+                        stm32_uart_USART_SR_stable_until(s));
+    } else {
+        stm32_poll_break(&s->poll);
+    }
 
     switch(size) {
+        case BYTE_ACCESS_SIZE:
+            /* Byte accesses are used by DMA transfers with an 8 bit
+             * peripheral size. */
+            if(offset != USART_SR_OFFSET && offset != USART_DR_OFFSET) {
+                STM32_BAD_REG(offset, size);
+                value = 0;
+                break;
+            }
+            value = stm32_uart_readh(s, offset) & 0xff;
+            break;
         case HALFWORD_ACCESS_SIZE:
-            return stm32_uart_readh(s, offset);
+            value = stm32_uart_readh(s, offset);
+            break;
         case WORD_ACCESS_SIZE:
-            return stm32_uart_readw(s, offset);
+            value = stm32_uart_readw(s, offset);
+            break;
         default:
             STM32_BAD_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_uart_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_uart_write(void *opaque, hwaddr offset,
@@ -789,9 +1140,22 @@ static void stm32_uart_write(void *opaque, hwaddr offset,
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
-    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, s->periph, &s->busdev);
+    trace_stm32_uart_write(s, offset, size, value);
+
+    stm32_poll_break(&s->poll);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
 
     switch(size) {
+        case BYTE_ACCESS_SIZE:
+            if(offset != USART_SR_OFFSET && offset != USART_DR_OFFSET) {
+                STM32_BAD_REG(offset, size);
+                break;
+            }
+            stm32_uart_writeh(s, offset, value & 0xff);
+            break;
         case HALFWORD_ACCESS_SIZE:
             stm32_uart_writeh(s, offset, value);
             break;
@@ -819,6 +1183,7 @@ static const MemoryRegionOps stm32_uart_ops = {
 void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
                         uint32_t afio_board_map)
 {
+    stm32_uart_tx_flush(s);
     s->chr = chr;
     if (chr) {
         qemu_chr_add_handlers(
@@ -827,6 +1192,8 @@ void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
                 stm32_uart_receive,
                 stm32_uart_event,
                 (void *)s);
+        qemu_chr_fe_set_write_unblocked(s->chr, stm32_uart_write_unblocked);
+        replay_register_char_driver(s->chr);
     }
 
     s->afio_board_map = afio_board_map;
@@ -837,42 +1204,144 @@ void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
 
 /* DEVICE INITIALIZATION */
 
+static void stm32_uart_instance_init(Object *obj)
+{
+    Stm32Uart *s = FROM_SYSBUS(Stm32Uart, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32_afio", "stm32_afio",
+                             (Object **)&s->stm32_afio, NULL);
+}
+
 static int stm32_uart_init(SysBusDevice *dev)
 {
     qemu_irq *clk_irq;
     Stm32Uart *s = FROM_SYSBUS(Stm32Uart, dev);
 
-    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
-    s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
-    s->stm32_afio = (Stm32Afio *)s->stm32_afio_prop;
+    /* The F1 routes the pins through the AFIO, the F2 through the GPIO
+     * alternate functions. */
+    if(s->stm32_afio) {
+        s->check_tx_pin_callback = stm32_afio_uart_check_tx_pin_callback;
+    } else if(s->stm32_gpio) {
+        s->check_tx_pin_callback = stm32f2xx_gpio_uart_check_tx_pin_callback;
+    }
 
     memory_region_init_io(&s->iomem, &stm32_uart_ops, s,
                           "uart", 0x03ff);
     sysbus_init_mmio(dev, &s->iomem);
 
     sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out(&dev->qdev, s->dma_req, ARRAY_LENGTH(s->dma_req));
+
+    if(s->rx_fifo_size == 0) {
+        hw_error("stm32_uart: rx_fifo_size must not be zero");
+    }
+    fifo8_create(&s->rx_fifo, s->rx_fifo_size);
 
     s->rx_timer =
           qemu_new_timer_ns(vm_clock,(QEMUTimerCB *)stm32_uart_rx_timer_expire, s);
     s->tx_timer =
           qemu_new_timer_ns(vm_clock,(QEMUTimerCB *)stm32_uart_tx_timer_expire, s);
+    s->tx_flush_timer =
+          qemu_new_timer_ms(rt_clock,(QEMUTimerCB *)stm32_uart_tx_flush_timer_expire, s);
+    qemu_add_vm_change_state_handler(stm32_uart_vm_state_change, s);
+    stm32_poll_init(&s->poll);
+    s->exit_notifier.notify = stm32_uart_exit_notify;
+    qemu_add_exit_notifier(&s->exit_notifier);
 
     /* Register handlers to handle updates to the USART's peripheral clock. */
     clk_irq =
           qemu_allocate_irqs(stm32_uart_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev,
+                              clk_irq[0]);
 
     stm32_uart_reset((DeviceState *)s);
 
     return 0;
 }
 
+/* Staged characters belong to the host side, so they are written out
+ * rather than saved, except for what CTS flow control holds back. */
+static void stm32_uart_pre_save(void *opaque)
+{
+    stm32_uart_tx_flush((Stm32Uart *)opaque);
+}
+
+/* The baud rate follows from BRR and the peripheral clock, whose frequency
+ * the clock tree has already restored.  The pending receive and transmit
+ * timers are restored with the rest of the state. */
+static int stm32_uart_post_load(void *opaque, int version_id)
+{
+    Stm32Uart *s = (Stm32Uart *)opaque;
+
+    if(s->tx_len < 0 || s->tx_len > STM32_UART_TX_BUF_SIZE) {
+        return -EINVAL;
+    }
+
+    stm32_uart_baud_update(s);
+    if (s->chr) {
+        qemu_chr_accept_input(s->chr);
+    }
+    /* Try again to write what the other end had not taken. */
+    if(s->tx_len) {
+        qemu_mod_timer(s->tx_flush_timer, qemu_get_clock_ms(rt_clock));
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_uart = {
+    .name = "stm32_uart",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .pre_save = stm32_uart_pre_save,
+    .post_load = stm32_uart_post_load,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(USART_RDR, Stm32Uart),
+        VMSTATE_UINT32(USART_TDR, Stm32Uart),
+        VMSTATE_UINT32(USART_BRR, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1, Stm32Uart),
+        VMSTATE_UINT32(USART_CR2, Stm32Uart),
+        VMSTATE_UINT32(USART_CR3, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_TXE, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_TC, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_RXNE, Stm32Uart),
+        VMSTATE_UINT32(USART_SR_ORE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_UE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_TXEIE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_TCIE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_RXNEIE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_TE, Stm32Uart),
+        VMSTATE_UINT32(USART_CR1_RE, Stm32Uart),
+        VMSTATE_BOOL(sr_read_since_ore_set, Stm32Uart),
+        VMSTATE_BOOL(receiving, Stm32Uart),
+        VMSTATE_FIFO8(rx_fifo, Stm32Uart),
+        VMSTATE_BOOL(rx_pending, Stm32Uart),
+        VMSTATE_TIMER(rx_timer, Stm32Uart),
+        VMSTATE_TIMER(tx_timer, Stm32Uart),
+        VMSTATE_INT32(curr_irq_level, Stm32Uart),
+        VMSTATE_INT32(curr_dma_rx_level, Stm32Uart),
+        VMSTATE_INT32(curr_dma_tx_level, Stm32Uart),
+        VMSTATE_UINT32_V(USART_SR_CTS, Stm32Uart, 2),
+        VMSTATE_UINT8_ARRAY_V(tx_buf, Stm32Uart, STM32_UART_TX_BUF_SIZE, 2),
+        VMSTATE_INT32_V(tx_len, Stm32Uart, 2),
+        VMSTATE_BOOL_V(tx_blocked, Stm32Uart, 2),
+        VMSTATE_BOOL_V(tx_waiting_cts, Stm32Uart, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static Property stm32_uart_properties[] = {
     DEFINE_PROP_INT32("periph", Stm32Uart, periph, -1),
-    DEFINE_PROP_PTR("stm32_rcc", Stm32Uart, stm32_rcc_prop),
     DEFINE_PROP_PTR("stm32_gpio", Stm32Uart, stm32_gpio_prop),
-    DEFINE_PROP_PTR("stm32_afio", Stm32Uart, stm32_afio_prop),
-    DEFINE_PROP_PTR("stm32_check_tx_pin_callback", Stm32Uart, check_tx_pin_prop),
+    /* Ignore baud timing: characters are sent and received as fast as
+     * software can handle them. */
+    DEFINE_PROP_BIT("no_baud_delay", Stm32Uart, options,
+                    STM32_UART_OPT_NO_BAUD_DELAY_BIT,
+                    STM32_UART_NO_BAUD_DELAY_DEFAULT),
+    DEFINE_PROP_UINT32("rx_fifo_size", Stm32Uart, rx_fifo_size, 1024),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -884,12 +1353,14 @@ static void stm32_uart_class_init(ObjectClass *klass, void *data)
     k->init = stm32_uart_init;
     dc->reset = stm32_uart_reset;
     dc->props = stm32_uart_properties;
+    dc->vmsd = &vmstate_stm32_uart;
 }
 
 static TypeInfo stm32_uart_info = {
     .name  = "stm32_uart",
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_size  = sizeof(Stm32Uart),
+    .instance_init = stm32_uart_instance_init,
     .class_init = stm32_uart_class_init
 };
 
@@ -0,0 +1,808 @@
+/*
+ * STM32 Microcontroller USB full-speed device
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The packet memory area is plain RAM, mapped where the firmware sees it
+ * (every 16-bit word of the 512 bytes at a 32-bit address, the upper half
+ * of which reads back whatever was written to it), so copying packets in
+ * and out of it does not trap.  The model reads and writes whole packets
+ * there, through the buffer descriptor table.
+ *
+ * The USB host is an external program, connected through a character
+ * device.  It sends one transaction at a time and gets one response for
+ * each.  Every record starts with an 8-byte header, little endian:
+ *
+ *   offset  size  field
+ *        0     1  token: 0 for a bus reset, or USB_TOKEN_SETUP,
+ *                 USB_TOKEN_OUT or USB_TOKEN_IN (see hw/usb.h)
+ *        1     1  request: device address; response: handshake (see
+ *                 STM32_USB_LINK_*)
+ *        2     1  endpoint number
+ *        3     1  request: flags (see STM32_USB_LINK_FLAG_*); response: 0
+ *        4     2  length of the data following the header, or for an IN
+ *                 request the largest packet the host accepts
+ *        6     2  reserved, must be zero
+ *
+ * A request with STM32_USB_LINK_FLAG_WAIT set is not NAKed: it is held
+ * until the firmware makes the endpoint valid (or STALLs it), so the host
+ * does not have to poll.  No other request is read in the meantime.
+ *
+ * Double-buffered and isochronous endpoints, suspend and resume, and the
+ * ESOF, ERR and PMAOVR events are not modelled.  All correct transfers
+ * are reported on the low priority interrupt line.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32.h"
+#include "char/char.h"
+#include "sysemu/replay.h"
+#include "qemu/timer.h"
+#include "usb.h"
+#include "trace.h"
+
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32_USB
+
+#ifdef DEBUG_STM32_USB
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32_USB: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define USB_EPR_OFFSET 0x00
+#define USB_EPR_EA_MASK 0x000f
+#define USB_EPR_STAT_TX_START 4
+#define USB_EPR_STAT_TX_MASK 0x0030
+#define USB_EPR_DTOG_TX_BIT 6
+#define USB_EPR_CTR_TX_BIT 7
+#define USB_EPR_EP_KIND_BIT 8
+#define USB_EPR_EP_TYPE_START 9
+#define USB_EPR_EP_TYPE_MASK 0x0600
+#define USB_EPR_SETUP_BIT 11
+#define USB_EPR_STAT_RX_START 12
+#define USB_EPR_STAT_RX_MASK 0x3000
+#define USB_EPR_DTOG_RX_BIT 14
+#define USB_EPR_CTR_RX_BIT 15
+/* Bits which software writes as they are, toggles by writing 1, and
+ * clears by writing 0 */
+#define USB_EPR_RW_MASK 0x070f
+#define USB_EPR_TOGGLE_MASK 0x7070
+#define USB_EPR_W0C_MASK 0x8080
+
+#define USB_EP_TYPE_BULK 0
+#define USB_EP_TYPE_CONTROL 1
+#define USB_EP_TYPE_ISO 2
+
+#define USB_STAT_DISABLED 0
+#define USB_STAT_STALL 1
+#define USB_STAT_NAK 2
+#define USB_STAT_VALID 3
+
+#define USB_CNTR_OFFSET 0x40
+#define USB_CNTR_FRES_BIT 0
+#define USB_CNTR_PDWN_BIT 1
+#define USB_CNTR_SOFM_BIT 9
+#define USB_CNTR_CTRM_BIT 15
+
+#define USB_ISTR_OFFSET 0x44
+#define USB_ISTR_EP_ID_MASK 0x000f
+#define USB_ISTR_DIR_BIT 4
+#define USB_ISTR_SOF_BIT 9
+#define USB_ISTR_RESET_BIT 10
+#define USB_ISTR_CTR_BIT 15
+/* Event flags, which software clears by writing 0 */
+#define USB_ISTR_EVT_MASK 0x7f00
+
+#define USB_FNR_OFFSET 0x48
+#define USB_DADDR_OFFSET 0x4c
+#define USB_DADDR_ADD_MASK 0x007f
+#define USB_DADDR_EF_BIT 7
+#define USB_BTABLE_OFFSET 0x50
+
+#define STM32_USB_EP_COUNT 8
+#define STM32_USB_PMA_SIZE 512
+
+#define STM32_USB_SOF_PERIOD_NS 1000000
+
+struct Stm32Usb {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+    CharDriverState *chr;
+
+    /* Private */
+    MemoryRegion iomem;
+    MemoryRegion pma;
+    uint8_t *pma_ptr;
+
+    Stm32PeriphClk clk;
+
+    /* Register Values */
+    uint32_t
+        USB_EPR[STM32_USB_EP_COUNT],
+        USB_CNTR,
+        USB_ISTR,
+        USB_DADDR,
+        USB_BTABLE;
+
+    /* vm_clock time of the last bus reset, from which the frame number
+     * counts.  -1 until the host has reset the bus. */
+    int64_t bus_reset_time;
+    QEMUTimer *sof_timer;
+
+    /* The request being received from the host, or held waiting for an
+     * endpoint */
+    uint8_t req[STM32_USB_LINK_HEADER_SIZE + STM32_USB_MAX_PACKET];
+    int req_len;
+    bool req_waiting;
+
+    qemu_irq lp_irq, hp_irq;
+};
+
+
+
+
+/* PACKET MEMORY */
+
+/* Where a byte of the packet memory is kept in the PMA region */
+static inline uint8_t *stm32_usb_pma_byte(Stm32Usb *s, uint32_t addr)
+{
+    addr &= STM32_USB_PMA_SIZE - 1;
+    return s->pma_ptr + (addr & ~1) * 2 + (addr & 1);
+}
+
+static uint16_t stm32_usb_pma_read16(Stm32Usb *s, uint32_t addr)
+{
+    return lduw_le_p(stm32_usb_pma_byte(s, addr & ~1));
+}
+
+/* The PMA is RAM that is written here through its host pointer */
+static void stm32_usb_pma_prepare_write(Stm32Usb *s)
+{
+    qemu_ram_prepare_write(memory_region_get_ram_addr(&s->pma),
+                           STM32_USB_PMA_SIZE * 2);
+}
+
+static void stm32_usb_pma_write16(Stm32Usb *s, uint32_t addr, uint16_t value)
+{
+    stm32_usb_pma_prepare_write(s);
+    stw_le_p(stm32_usb_pma_byte(s, addr & ~1), value);
+}
+
+static void stm32_usb_pma_read(Stm32Usb *s, uint32_t addr, uint8_t *buf,
+                               int len)
+{
+    while (len--) {
+        *buf++ = *stm32_usb_pma_byte(s, addr++);
+    }
+}
+
+static void stm32_usb_pma_write(Stm32Usb *s, uint32_t addr,
+                                const uint8_t *buf, int len)
+{
+    stm32_usb_pma_prepare_write(s);
+    while (len--) {
+        *stm32_usb_pma_byte(s, addr++) = *buf++;
+    }
+}
+
+/* Entries of an endpoint in the buffer descriptor table */
+static uint32_t stm32_usb_bdt(Stm32Usb *s, int n, int entry)
+{
+    return (s->USB_BTABLE & 0xfff8) + n * 8 + entry * 2;
+}
+
+#define STM32_USB_BDT_ADDR_TX 0
+#define STM32_USB_BDT_COUNT_TX 1
+#define STM32_USB_BDT_ADDR_RX 2
+#define STM32_USB_BDT_COUNT_RX 3
+
+/* Size of an endpoint's reception buffer, from BL_SIZE and NUM_BLOCK */
+static int stm32_usb_rx_capacity(Stm32Usb *s, int n)
+{
+    uint16_t count_rx = stm32_usb_pma_read16(s,
+                            stm32_usb_bdt(s, n, STM32_USB_BDT_COUNT_RX));
+    int num_block = (count_rx >> 10) & 0x1f;
+
+    return IS_BIT_SET(count_rx, 15) ? (num_block + 1) * 32 : num_block * 2;
+}
+
+
+
+
+/* INTERRUPTS */
+
+static void stm32_usb_update_irq(Stm32Usb *s)
+{
+    bool ctr = false, level;
+    int n;
+
+    for (n = 0; n < STM32_USB_EP_COUNT; n++) {
+        if (s->USB_EPR[n] & (GET_BIT_MASK_ONE(USB_EPR_CTR_RX_BIT) |
+                             GET_BIT_MASK_ONE(USB_EPR_CTR_TX_BIT))) {
+            ctr = true;
+            break;
+        }
+    }
+
+    level = (s->USB_CNTR & s->USB_ISTR & USB_ISTR_EVT_MASK) ||
+            (IS_BIT_SET(s->USB_CNTR, USB_CNTR_CTRM_BIT) && ctr);
+    trace_stm32_usb_irq(s, level);
+    qemu_set_irq(s->lp_irq, level);
+}
+
+static void stm32_usb_sof_arm(Stm32Usb *s)
+{
+    int64_t now, next;
+
+    if (s->bus_reset_time < 0 ||
+        !IS_BIT_SET(s->USB_CNTR, USB_CNTR_SOFM_BIT)) {
+        qemu_del_timer(s->sof_timer);
+        return;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    next = now + STM32_USB_SOF_PERIOD_NS -
+           (now - s->bus_reset_time) % STM32_USB_SOF_PERIOD_NS;
+    qemu_mod_timer(s->sof_timer, next);
+}
+
+/* Start of frame events are only generated while they are enabled. */
+static void stm32_usb_sof_timer_expire(void *opaque)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    SET_BIT(s->USB_ISTR, USB_ISTR_SOF_BIT);
+    stm32_usb_update_irq(s);
+    stm32_usb_sof_arm(s);
+}
+
+
+
+
+/* TRANSACTIONS */
+
+static int stm32_usb_stat_tx(Stm32Usb *s, int n)
+{
+    return (s->USB_EPR[n] & USB_EPR_STAT_TX_MASK) >> USB_EPR_STAT_TX_START;
+}
+
+static int stm32_usb_stat_rx(Stm32Usb *s, int n)
+{
+    return (s->USB_EPR[n] & USB_EPR_STAT_RX_MASK) >> USB_EPR_STAT_RX_START;
+}
+
+static void stm32_usb_set_stat_tx(Stm32Usb *s, int n, int stat)
+{
+    s->USB_EPR[n] = (s->USB_EPR[n] & ~USB_EPR_STAT_TX_MASK) |
+                    (stat << USB_EPR_STAT_TX_START);
+}
+
+static void stm32_usb_set_stat_rx(Stm32Usb *s, int n, int stat)
+{
+    s->USB_EPR[n] = (s->USB_EPR[n] & ~USB_EPR_STAT_RX_MASK) |
+                    (stat << USB_EPR_STAT_RX_START);
+}
+
+/* Puts the device in the state a reset on the bus leaves it in. */
+static void stm32_usb_bus_reset(Stm32Usb *s)
+{
+    int n;
+
+    for (n = 0; n < STM32_USB_EP_COUNT; n++) {
+        s->USB_EPR[n] = 0;
+    }
+    s->USB_DADDR = 0;
+    SET_BIT(s->USB_ISTR, USB_ISTR_RESET_BIT);
+}
+
+/* Finds the endpoint register for an endpoint address, or returns -1. */
+static int stm32_usb_find_ep(Stm32Usb *s, int ep)
+{
+    int n;
+
+    for (n = 0; n < STM32_USB_EP_COUNT; n++) {
+        if ((s->USB_EPR[n] & USB_EPR_EA_MASK) == ep) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static int stm32_usb_handshake(int stat)
+{
+    switch (stat) {
+        case USB_STAT_STALL:
+            return STM32_USB_LINK_STALL;
+        case USB_STAT_NAK:
+            return STM32_USB_LINK_NAK;
+        case USB_STAT_VALID:
+            return STM32_USB_LINK_ACK;
+        default:
+            return STM32_USB_LINK_NO_RESPONSE;
+    }
+}
+
+/* A SETUP or OUT data packet for endpoint register n */
+static int stm32_usb_rx(Stm32Usb *s, int n, bool setup, const uint8_t *data,
+                        int len)
+{
+    uint32_t addr_rx = stm32_usb_bdt(s, n, STM32_USB_BDT_ADDR_RX);
+    uint32_t count_rx = stm32_usb_bdt(s, n, STM32_USB_BDT_COUNT_RX);
+    int stat = stm32_usb_stat_rx(s, n);
+
+    if (setup) {
+        /* A control endpoint always takes a SETUP. */
+        if ((s->USB_EPR[n] & USB_EPR_EP_TYPE_MASK) !=
+                USB_EP_TYPE_CONTROL << USB_EPR_EP_TYPE_START ||
+            stat == USB_STAT_DISABLED) {
+            return STM32_USB_LINK_NO_RESPONSE;
+        }
+    } else if (stat != USB_STAT_VALID) {
+        return stm32_usb_handshake(stat);
+    }
+
+    if (len > stm32_usb_rx_capacity(s, n)) {
+        stm32_hw_warn("stm32_usb: %d byte packet for a %d byte buffer", len,
+                      stm32_usb_rx_capacity(s, n));
+        return STM32_USB_LINK_NO_RESPONSE;
+    }
+
+    stm32_usb_pma_write(s, stm32_usb_pma_read16(s, addr_rx), data, len);
+    stm32_usb_pma_write16(s, count_rx,
+                          (stm32_usb_pma_read16(s, count_rx) & 0xfc00) | len);
+
+    SET_BIT(s->USB_EPR[n], USB_EPR_CTR_RX_BIT);
+    CHANGE_BIT(s->USB_EPR[n], USB_EPR_SETUP_BIT, setup);
+    stm32_usb_set_stat_rx(s, n, USB_STAT_NAK);
+    if (setup) {
+        /* The data stage starts with DATA1 both ways. */
+        stm32_usb_set_stat_tx(s, n, USB_STAT_NAK);
+        SET_BIT(s->USB_EPR[n], USB_EPR_DTOG_RX_BIT);
+        SET_BIT(s->USB_EPR[n], USB_EPR_DTOG_TX_BIT);
+    } else {
+        s->USB_EPR[n] ^= GET_BIT_MASK_ONE(USB_EPR_DTOG_RX_BIT);
+    }
+
+    return STM32_USB_LINK_ACK;
+}
+
+/* An IN token for endpoint register n.  Returns the handshake and the
+ * length of the packet in *len. */
+static int stm32_usb_tx(Stm32Usb *s, int n, uint8_t *data, int *len)
+{
+    int stat = stm32_usb_stat_tx(s, n);
+    int count;
+
+    if (stat != USB_STAT_VALID) {
+        *len = 0;
+        return stm32_usb_handshake(stat);
+    }
+
+    count = stm32_usb_pma_read16(s,
+                stm32_usb_bdt(s, n, STM32_USB_BDT_COUNT_TX)) & 0x3ff;
+    if (count > *len) {
+        /* Babble: more than the host asked for. */
+        count = *len;
+    }
+    stm32_usb_pma_read(s, stm32_usb_pma_read16(s,
+                           stm32_usb_bdt(s, n, STM32_USB_BDT_ADDR_TX)),
+                       data, count);
+    *len = count;
+
+    SET_BIT(s->USB_EPR[n], USB_EPR_CTR_TX_BIT);
+    stm32_usb_set_stat_tx(s, n, USB_STAT_NAK);
+    s->USB_EPR[n] ^= GET_BIT_MASK_ONE(USB_EPR_DTOG_TX_BIT);
+
+    return STM32_USB_LINK_ACK;
+}
+
+static void stm32_usb_respond(Stm32Usb *s, int handshake, const uint8_t *data,
+                              int len)
+{
+    uint8_t hdr[STM32_USB_LINK_HEADER_SIZE];
+
+    hdr[0] = s->req[0];
+    hdr[1] = handshake;
+    hdr[2] = s->req[2];
+    hdr[3] = 0;
+    stw_le_p(hdr + 4, len);
+    stw_le_p(hdr + 6, 0);
+    qemu_chr_fe_write(s->chr, hdr, sizeof(hdr));
+    if (len) {
+        qemu_chr_fe_write(s->chr, data, len);
+    }
+}
+
+/* Carries out the request in s->req.  Returns false if it has to wait for
+ * the endpoint. */
+static bool stm32_usb_run_request(Stm32Usb *s)
+{
+    uint8_t token = s->req[0];
+    uint8_t address = s->req[1];
+    uint8_t ep = s->req[2] & 0xf;
+    bool wait = IS_BIT_SET(s->req[3], STM32_USB_LINK_FLAG_WAIT_BIT);
+    int len = lduw_le_p(s->req + 4);
+    uint8_t data[STM32_USB_MAX_PACKET];
+    int handshake, n;
+
+    if (token == STM32_USB_LINK_TOKEN_RESET) {
+        DPRINTF("bus reset\n");
+        stm32_usb_bus_reset(s);
+        s->bus_reset_time = qemu_get_clock_ns(vm_clock);
+        stm32_usb_sof_arm(s);
+        stm32_usb_update_irq(s);
+        stm32_usb_respond(s, STM32_USB_LINK_ACK, NULL, 0);
+        return true;
+    }
+
+    /* A device that is powered down, held in reset or not addressed does
+     * not answer. */
+    n = stm32_usb_find_ep(s, ep);
+    if (!s->clk.enabled ||
+        (s->USB_CNTR & (GET_BIT_MASK_ONE(USB_CNTR_FRES_BIT) |
+                        GET_BIT_MASK_ONE(USB_CNTR_PDWN_BIT))) ||
+        !IS_BIT_SET(s->USB_DADDR, USB_DADDR_EF_BIT) ||
+        (s->USB_DADDR & USB_DADDR_ADD_MASK) != address || n < 0) {
+        stm32_usb_respond(s, STM32_USB_LINK_NO_RESPONSE, NULL, 0);
+        return true;
+    }
+
+    switch (token) {
+        case USB_TOKEN_SETUP:
+        case USB_TOKEN_OUT:
+            handshake = stm32_usb_rx(s, n, token == USB_TOKEN_SETUP,
+                                     s->req + STM32_USB_LINK_HEADER_SIZE, len);
+            len = 0;
+            break;
+        case USB_TOKEN_IN:
+            len = MIN(len, STM32_USB_MAX_PACKET);
+            handshake = stm32_usb_tx(s, n, data, &len);
+            break;
+        default:
+            stm32_hw_warn("stm32_usb: unknown token 0x%02x from the host",
+                          token);
+            handshake = STM32_USB_LINK_NO_RESPONSE;
+            len = 0;
+            break;
+    }
+
+    if (handshake == STM32_USB_LINK_NAK && wait) {
+        return false;
+    }
+
+    DPRINTF("token 0x%02x on EP%d: handshake %d, %d bytes\n", token, ep,
+            handshake, len);
+    stm32_usb_update_irq(s);
+    stm32_usb_respond(s, handshake, data, len);
+    return true;
+}
+
+/* Retries a waiting request, once the firmware has changed an endpoint. */
+static void stm32_usb_retry(Stm32Usb *s)
+{
+    if (s->req_waiting && stm32_usb_run_request(s)) {
+        s->req_waiting = false;
+        s->req_len = 0;
+        qemu_chr_accept_input(s->chr);
+    }
+}
+
+
+
+
+/* HOST LINK */
+
+static int stm32_usb_request_size(Stm32Usb *s)
+{
+    int len;
+
+    if (s->req_len < STM32_USB_LINK_HEADER_SIZE) {
+        return STM32_USB_LINK_HEADER_SIZE;
+    }
+    /* The length of an IN request is that of the packet it asks for. */
+    len = s->req[0] == USB_TOKEN_IN ? 0 : lduw_le_p(s->req + 4);
+    return STM32_USB_LINK_HEADER_SIZE + MIN(len, STM32_USB_MAX_PACKET);
+}
+
+static int stm32_usb_can_receive(void *opaque)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    if (s->req_waiting) {
+        return 0;
+    }
+    return stm32_usb_request_size(s) - s->req_len;
+}
+
+static void stm32_usb_receive(void *opaque, const uint8_t *buf, int size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+    int n;
+
+    while (size > 0 && !s->req_waiting) {
+        n = MIN(size, stm32_usb_request_size(s) - s->req_len);
+        memcpy(s->req + s->req_len, buf, n);
+        s->req_len += n;
+        buf += n;
+        size -= n;
+        if (s->req_len < stm32_usb_request_size(s)) {
+            continue;
+        }
+        if (stm32_usb_run_request(s)) {
+            s->req_len = 0;
+        } else {
+            s->req_waiting = true;
+        }
+    }
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_usb_EPR_write(Stm32Usb *s, int n, uint32_t new_value)
+{
+    uint32_t old_value = s->USB_EPR[n];
+
+    s->USB_EPR[n] = (new_value & USB_EPR_RW_MASK) |
+                    (old_value & GET_BIT_MASK_ONE(USB_EPR_SETUP_BIT)) |
+                    ((old_value ^ new_value) & USB_EPR_TOGGLE_MASK) |
+                    (old_value & new_value & USB_EPR_W0C_MASK);
+
+    if (IS_BIT_SET(s->USB_EPR[n], USB_EPR_EP_KIND_BIT) &&
+        (s->USB_EPR[n] & USB_EPR_EP_TYPE_MASK) ==
+            USB_EP_TYPE_BULK << USB_EPR_EP_TYPE_START) {
+        stm32_hw_warn("stm32_usb: double-buffered endpoints are not "
+                      "supported");
+    }
+
+    stm32_usb_update_irq(s);
+    stm32_usb_retry(s);
+}
+
+static void stm32_usb_CNTR_write(Stm32Usb *s, uint32_t new_value)
+{
+    bool fres = IS_BIT_SET(new_value, USB_CNTR_FRES_BIT);
+
+    if (fres && !IS_BIT_SET(s->USB_CNTR, USB_CNTR_FRES_BIT)) {
+        stm32_usb_bus_reset(s);
+    }
+    s->USB_CNTR = new_value & 0xff1f;
+
+    stm32_usb_sof_arm(s);
+    stm32_usb_update_irq(s);
+    stm32_usb_retry(s);
+}
+
+/* EP_ID and DIR give the endpoint with the lowest number that has a
+ * correct transfer pending. */
+static uint32_t stm32_usb_ISTR_read(Stm32Usb *s)
+{
+    uint32_t value = s->USB_ISTR & USB_ISTR_EVT_MASK;
+    int n;
+
+    for (n = 0; n < STM32_USB_EP_COUNT; n++) {
+        if (IS_BIT_SET(s->USB_EPR[n], USB_EPR_CTR_RX_BIT) ||
+            IS_BIT_SET(s->USB_EPR[n], USB_EPR_CTR_TX_BIT)) {
+            value |= n | GET_BIT_MASK_ONE(USB_ISTR_CTR_BIT) |
+                     GET_BIT_MASK(USB_ISTR_DIR_BIT,
+                                  IS_BIT_SET(s->USB_EPR[n],
+                                             USB_EPR_CTR_RX_BIT));
+            break;
+        }
+    }
+    return value;
+}
+
+static uint32_t stm32_usb_FNR_read(Stm32Usb *s)
+{
+    if (s->bus_reset_time < 0) {
+        return 0;
+    }
+    return ((qemu_get_clock_ns(vm_clock) - s->bus_reset_time) /
+            STM32_USB_SOF_PERIOD_NS) & 0x7ff;
+}
+
+static uint64_t stm32_usb_read(void *opaque, hwaddr offset,
+                               unsigned size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+    uint64_t value;
+
+    if (offset < USB_EPR_OFFSET + 4 * STM32_USB_EP_COUNT) {
+        value = s->USB_EPR[offset / 4];
+        trace_stm32_usb_read(s, offset, size, value);
+        return value;
+    }
+
+    switch (offset) {
+        case USB_CNTR_OFFSET:
+            value = s->USB_CNTR;
+            break;
+        case USB_ISTR_OFFSET:
+            value = stm32_usb_ISTR_read(s);
+            break;
+        case USB_FNR_OFFSET:
+            value = stm32_usb_FNR_read(s);
+            break;
+        case USB_DADDR_OFFSET:
+            value = s->USB_DADDR;
+            break;
+        case USB_BTABLE_OFFSET:
+            value = s->USB_BTABLE;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32_usb_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_usb_write(void *opaque, hwaddr offset,
+                            uint64_t value, unsigned size)
+{
+    Stm32Usb *s = (Stm32Usb *)opaque;
+
+    trace_stm32_usb_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    if (offset < USB_EPR_OFFSET + 4 * STM32_USB_EP_COUNT) {
+        stm32_usb_EPR_write(s, offset / 4, value & 0xffff);
+        return;
+    }
+
+    switch (offset) {
+        case USB_CNTR_OFFSET:
+            stm32_usb_CNTR_write(s, value);
+            break;
+        case USB_ISTR_OFFSET:
+            s->USB_ISTR &= value | ~USB_ISTR_EVT_MASK;
+            stm32_usb_update_irq(s);
+            break;
+        case USB_FNR_OFFSET:
+            STM32_RO_REG(offset);
+            break;
+        case USB_DADDR_OFFSET:
+            s->USB_DADDR = value & 0x00ff;
+            break;
+        case USB_BTABLE_OFFSET:
+            s->USB_BTABLE = value & 0xfff8;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+/* The registers are 16 bits wide, but read and written as words. */
+static const MemoryRegionOps stm32_usb_ops = {
+    .read = stm32_usb_read,
+    .write = stm32_usb_write,
+    .valid.min_access_size = 2,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_usb_reset(DeviceState *dev)
+{
+    Stm32Usb *s = FROM_SYSBUS(Stm32Usb, SYS_BUS_DEVICE(dev));
+    int n;
+
+    for (n = 0; n < STM32_USB_EP_COUNT; n++) {
+        s->USB_EPR[n] = 0;
+    }
+    s->USB_CNTR = GET_BIT_MASK_ONE(USB_CNTR_FRES_BIT) |
+                  GET_BIT_MASK_ONE(USB_CNTR_PDWN_BIT);
+    s->USB_ISTR = 0;
+    s->USB_DADDR = 0;
+    s->USB_BTABLE = 0;
+    s->bus_reset_time = -1;
+    qemu_del_timer(s->sof_timer);
+
+    stm32_usb_update_irq(s);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_usb_instance_init(Object *obj)
+{
+    Stm32Usb *s = FROM_SYSBUS(Stm32Usb, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_usb_init(SysBusDevice *dev)
+{
+    Stm32Usb *s = FROM_SYSBUS(Stm32Usb, dev);
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32_usb_ops, s,
+                          "usb", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    memory_region_init_ram(&s->pma, "stm32_usb.pma",
+                           STM32_USB_PMA_SIZE * 2);
+    s->pma_ptr = memory_region_get_ram_ptr(&s->pma);
+    memset(s->pma_ptr, 0, STM32_USB_PMA_SIZE * 2);
+    sysbus_init_mmio(dev, &s->pma);
+
+    sysbus_init_irq(dev, &s->lp_irq);
+    sysbus_init_irq(dev, &s->hp_irq);
+
+    s->sof_timer = qemu_new_timer_ns(vm_clock, stm32_usb_sof_timer_expire, s);
+
+    if (s->chr) {
+        qemu_chr_add_handlers(s->chr, stm32_usb_can_receive,
+                              stm32_usb_receive, NULL, s);
+        replay_register_char_driver(s->chr);
+    }
+
+    return 0;
+}
+
+static Property stm32_usb_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32Usb, periph, -1),
+    DEFINE_PROP_CHR("chardev", Stm32Usb, chr),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_usb_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_usb_init;
+    dc->reset = stm32_usb_reset;
+    dc->props = stm32_usb_properties;
+}
+
+static TypeInfo stm32_usb_info = {
+    .name  = "stm32_usb",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Usb),
+    .instance_init = stm32_usb_instance_init,
+    .class_init = stm32_usb_class_init
+};
+
+static void stm32_usb_register_types(void)
+{
+    type_register_static(&stm32_usb_info);
+}
+
+type_init(stm32_usb_register_types)
@@ -0,0 +1,410 @@
+/*
+ * STM32 Microcontroller WWDG (Window Watchdog) module
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * The down-counter is not ticked: its value is worked out from vm_clock
+ * when software reads it.  As for the IWDG, refreshing the counter does
+ * not move the timer, which is only moved when the next event comes
+ * earlier, and which is armed again when it expires before it.  The timer
+ * is not armed at all until the watchdog is activated.
+ *
+ * On timeout (T6 cleared), or when the counter is refreshed outside the
+ * window, what -watchdog-action says is done (a system reset by default),
+ * with a WATCHDOG QMP event.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f1xx.h"
+#include "qemu/timer.h"
+#include "watchdog.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+#define WWDG_CR_OFFSET 0x00
+#define WWDG_CR_WDGA_BIT 7
+#define WWDG_CR_T_MASK 0x7f
+/* The counter value that sets EWIF, and the one after it, which resets */
+#define WWDG_CR_T_EWI 0x40
+
+#define WWDG_CFR_OFFSET 0x04
+#define WWDG_CFR_EWI_BIT 9
+#define WWDG_CFR_WDGTB_START 7
+#define WWDG_CFR_WDGTB_MASK 0x00000180
+#define WWDG_CFR_W_MASK 0x7f
+#define WWDG_CFR_MASK 0x000003ff
+
+#define WWDG_SR_OFFSET 0x08
+#define WWDG_SR_EWIF_BIT 0
+
+/* PCLK1 cycles per counter tick with WDGTB = 0 */
+#define WWDG_TICK_CYCLES 4096
+
+typedef struct Stm32Wwdg {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    Stm32Rcc *stm32_rcc;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    uint32_t
+        WWDG_CFR,
+        WWDG_SR;
+
+    bool active;
+    /* The counter was t at base_ns, and has counted ticks_done ticks
+     * since. */
+    uint32_t t;
+    int64_t base_ns;
+    uint64_t ticks_done;
+    /* The PCLK1 frequency the counter runs at since base_ns */
+    uint32_t freq;
+
+    QEMUTimer *timer;
+    qemu_irq irq;
+} Stm32Wwdg;
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static uint32_t stm32_wwdg_tick_cycles(Stm32Wwdg *s)
+{
+    return WWDG_TICK_CYCLES <<
+           ((s->WWDG_CFR & WWDG_CFR_WDGTB_MASK) >> WWDG_CFR_WDGTB_START);
+}
+
+static uint32_t stm32_wwdg_counter(Stm32Wwdg *s)
+{
+    return (s->t - s->ticks_done) & WWDG_CR_T_MASK;
+}
+
+/* Time at which counter tick number ticks (counted from base_ns) happens,
+ * rounded up so that a sync at that time sees the tick. */
+static int64_t stm32_wwdg_tick_ns(Stm32Wwdg *s, uint64_t ticks)
+{
+    return s->base_ns + muldiv64(ticks * stm32_wwdg_tick_cycles(s),
+                                 get_ticks_per_sec(), s->freq) + 1;
+}
+
+static void stm32_wwdg_update_irq(Stm32Wwdg *s)
+{
+    bool level = IS_BIT_SET(s->WWDG_SR, WWDG_SR_EWIF_BIT) &&
+                 IS_BIT_SET(s->WWDG_CFR, WWDG_CFR_EWI_BIT);
+
+    trace_stm32_wwdg_irq(s, level);
+    qemu_set_irq(s->irq, level);
+}
+
+static void stm32_wwdg_timeout(Stm32Wwdg *s)
+{
+    trace_stm32_wwdg_timeout(s);
+    watchdog_perform_action();
+}
+
+/* Restarts the counter at value t. */
+static void stm32_wwdg_rebase(Stm32Wwdg *s, uint32_t t)
+{
+    s->t = t & WWDG_CR_T_MASK;
+    s->base_ns = qemu_get_clock_ns(vm_clock);
+    s->ticks_done = 0;
+}
+
+/* Brings the counter and EWIF up to date with vm_clock, and times out if
+ * T6 got cleared. */
+static void stm32_wwdg_sync(Stm32Wwdg *s)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint64_t ticks;
+
+    if(s->freq == 0) {
+        return;
+    }
+
+    ticks = muldiv64(now - s->base_ns, s->freq, get_ticks_per_sec()) /
+            stm32_wwdg_tick_cycles(s);
+    if(ticks <= s->ticks_done) {
+        return;
+    }
+    if(s->active && s->t >= WWDG_CR_T_EWI) {
+        if(ticks >= s->t - WWDG_CR_T_EWI) {
+            SET_BIT(s->WWDG_SR, WWDG_SR_EWIF_BIT);
+        }
+        if(ticks > s->t - WWDG_CR_T_EWI) {
+            stm32_wwdg_timeout(s);
+            /* Goes on counting if the action was not a reset. */
+            stm32_wwdg_rebase(s, WWDG_CR_T_MASK);
+            return;
+        }
+    }
+    s->ticks_done = ticks;
+}
+
+/* Arms the timer for the early wakeup interrupt or for the timeout,
+ * unless it is armed for earlier already. */
+static void stm32_wwdg_schedule(Stm32Wwdg *s)
+{
+    uint32_t counter = stm32_wwdg_counter(s);
+    uint64_t next;
+    int64_t when;
+
+    if(!s->active || s->freq == 0 || counter < WWDG_CR_T_EWI) {
+        qemu_del_timer(s->timer);
+        return;
+    }
+
+    next = counter - WWDG_CR_T_EWI + 1;
+    if(IS_BIT_SET(s->WWDG_CFR, WWDG_CFR_EWI_BIT) &&
+       !IS_BIT_SET(s->WWDG_SR, WWDG_SR_EWIF_BIT) &&
+       counter > WWDG_CR_T_EWI) {
+        next = counter - WWDG_CR_T_EWI;
+    }
+    when = stm32_wwdg_tick_ns(s, s->ticks_done + next);
+    if(!qemu_timer_pending(s->timer) ||
+       qemu_timer_expire_time_ns(s->timer) > when) {
+        qemu_mod_timer(s->timer, when);
+    }
+}
+
+static void stm32_wwdg_expire(void *opaque)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    stm32_wwdg_sync(s);
+    stm32_wwdg_update_irq(s);
+    stm32_wwdg_schedule(s);
+}
+
+/* Handle a change in PCLK1. */
+static void stm32_wwdg_clk_irq_handler(void *opaque, int n, int level)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    assert(n == 0);
+
+    stm32_wwdg_sync(s);
+    stm32_wwdg_rebase(s, stm32_wwdg_counter(s));
+    s->freq = s->clk.freq;
+    stm32_wwdg_schedule(s);
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static void stm32_wwdg_WWDG_CR_write(Stm32Wwdg *s, uint32_t new_value)
+{
+    uint32_t window = s->WWDG_CFR & WWDG_CFR_W_MASK;
+
+    /* Refreshing while the counter is above the window, or clearing T6,
+     * resets at once. */
+    if(s->active && stm32_wwdg_counter(s) > window) {
+        stm32_wwdg_timeout(s);
+    } else if(IS_BIT_SET(new_value, WWDG_CR_WDGA_BIT) &&
+              (new_value & WWDG_CR_T_MASK) < WWDG_CR_T_EWI) {
+        stm32_wwdg_timeout(s);
+    }
+
+    /* Only a reset clears WDGA. */
+    if(IS_BIT_SET(new_value, WWDG_CR_WDGA_BIT)) {
+        s->active = true;
+    }
+    stm32_wwdg_rebase(s, new_value);
+}
+
+static uint64_t stm32_wwdg_read(void *opaque, hwaddr offset,
+                                unsigned size)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+    uint64_t value;
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
+
+    stm32_wwdg_sync(s);
+
+    switch(offset) {
+        case WWDG_CR_OFFSET:
+            value = GET_BIT_MASK(WWDG_CR_WDGA_BIT, s->active) |
+                    stm32_wwdg_counter(s);
+            break;
+        case WWDG_CFR_OFFSET:
+            value = s->WWDG_CFR;
+            break;
+        case WWDG_SR_OFFSET:
+            value = s->WWDG_SR;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    stm32_wwdg_update_irq(s);
+    stm32_wwdg_schedule(s);
+    trace_stm32_wwdg_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32_wwdg_write(void *opaque, hwaddr offset,
+                             uint64_t value, unsigned size)
+{
+    Stm32Wwdg *s = (Stm32Wwdg *)opaque;
+
+    trace_stm32_wwdg_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    stm32_wwdg_sync(s);
+
+    switch(offset) {
+        case WWDG_CR_OFFSET:
+            stm32_wwdg_WWDG_CR_write(s, value);
+            break;
+        case WWDG_CFR_OFFSET:
+            /* The prescaler applies from the current counter value on. */
+            stm32_wwdg_rebase(s, stm32_wwdg_counter(s));
+            s->WWDG_CFR = value & WWDG_CFR_MASK;
+            break;
+        case WWDG_SR_OFFSET:
+            /* EWIF is cleared by writing 0. */
+            s->WWDG_SR &= value;
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+
+    stm32_wwdg_update_irq(s);
+    stm32_wwdg_schedule(s);
+}
+
+static const MemoryRegionOps stm32_wwdg_ops = {
+    .read = stm32_wwdg_read,
+    .write = stm32_wwdg_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 2,
+        .max_access_size = 4,
+    }
+};
+
+static void stm32_wwdg_reset(DeviceState *dev)
+{
+    Stm32Wwdg *s = FROM_SYSBUS(Stm32Wwdg, SYS_BUS_DEVICE(dev));
+
+    s->active = false;
+    s->WWDG_CFR = WWDG_CFR_W_MASK;
+    s->WWDG_SR = 0;
+    stm32_wwdg_rebase(s, WWDG_CR_T_MASK);
+    stm32_wwdg_update_irq(s);
+    qemu_del_timer(s->timer);
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_wwdg_instance_init(Object *obj)
+{
+    Stm32Wwdg *s = FROM_SYSBUS(Stm32Wwdg, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32_wwdg_init(SysBusDevice *dev)
+{
+    Stm32Wwdg *s = FROM_SYSBUS(Stm32Wwdg, dev);
+    qemu_irq *clk_irq;
+
+
+    memory_region_init_io(&s->iomem, &stm32_wwdg_ops, s,
+                          "wwdg", 0x03ff);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    sysbus_init_irq(dev, &s->irq);
+
+    s->timer = qemu_new_timer_ns(vm_clock, stm32_wwdg_expire, s);
+
+    clk_irq = qemu_allocate_irqs(stm32_wwdg_clk_irq_handler, (void *)s, 1);
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F1XX_WWDG, dev,
+                              clk_irq[0]);
+    s->freq = s->clk.freq;
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_wwdg = {
+    .name = "stm32_wwdg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(WWDG_CFR, Stm32Wwdg),
+        VMSTATE_UINT32(WWDG_SR, Stm32Wwdg),
+        VMSTATE_BOOL(active, Stm32Wwdg),
+        VMSTATE_UINT32(t, Stm32Wwdg),
+        VMSTATE_INT64(base_ns, Stm32Wwdg),
+        VMSTATE_UINT64(ticks_done, Stm32Wwdg),
+        VMSTATE_UINT32(freq, Stm32Wwdg),
+        VMSTATE_TIMER(timer, Stm32Wwdg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stm32_wwdg_properties[] = {
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_wwdg_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_wwdg_init;
+    dc->reset = stm32_wwdg_reset;
+    dc->props = stm32_wwdg_properties;
+    dc->vmsd = &vmstate_stm32_wwdg;
+}
+
+static TypeInfo stm32_wwdg_info = {
+    .name  = "stm32_wwdg",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Wwdg),
+    .instance_init = stm32_wwdg_instance_init,
+    .class_init = stm32_wwdg_class_init
+};
+
+static void stm32_wwdg_register_types(void)
+{
+    type_register_static(&stm32_wwdg_info);
+}
+
+type_init(stm32_wwdg_register_types)
@@ -22,6 +22,8 @@
 #include "stm32.h"
 #include "stm32f1xx.h"
 #include "exec/address-spaces.h"
+#include "sysemu/blockdev.h"
+#include "char/char.h"
 
 static const char *stm32f1xx_periph_name_arr[] = {
     ENUM_STRING(STM32F1XX_RCC),
@@ -51,12 +53,14 @@ static const char *stm32f1xx_periph_name_arr[] = {
     ENUM_STRING(STM32F1XX_TIM7),
     ENUM_STRING(STM32F1XX_TIM8),
     ENUM_STRING(STM32F1XX_BKP),
+    ENUM_STRING(STM32F1XX_RTC),
     ENUM_STRING(STM32F1XX_PWR),
     ENUM_STRING(STM32F1XX_I2C1),
     ENUM_STRING(STM32F1XX_I2C2),
     ENUM_STRING(STM32F1XX_I2S2),
     ENUM_STRING(STM32F1XX_I2S3),
     ENUM_STRING(STM32F1XX_WWDG),
+    ENUM_STRING(STM32F1XX_IWDG),
     ENUM_STRING(STM32F1XX_CAN1),
     ENUM_STRING(STM32F1XX_CAN2),
     ENUM_STRING(STM32F1XX_CAN),
@@ -67,48 +71,172 @@ static const char *stm32f1xx_periph_name_arr[] = {
     ENUM_STRING(STM32F1XX_EXTI),
     ENUM_STRING(STM32F1XX_SDIO),
     ENUM_STRING(STM32F1XX_FSMC),
+    ENUM_STRING(STM32F1XX_DMA1),
+    ENUM_STRING(STM32F1XX_DMA2),
+    ENUM_STRING(STM32F1XX_CRC),
     ENUM_STRING(STM32F1XX_PERIPH_COUNT),
 };
 
+#define P(periph) STM32_PERIPH_BIT(STM32F1XX_##periph)
+
+/* Peripherals of the medium-density performance line (STM32F103x8/B) */
+#define STM32F1XX_MD_PERIPHS \
+    (P(AFIO) | P(EXTI) | P(DMA1) | P(UART1) | P(UART2) | P(UART3) | \
+     P(ADC1) | P(ADC2) | P(TIM1) | P(TIM2) | P(TIM3) | P(TIM4) | \
+     P(SPI1) | P(SPI2) | P(I2C1) | P(I2C2) | P(USB) | P(CAN))
+
+/* Peripherals of the high-density performance line (STM32F103xC/D/E) */
+#define STM32F1XX_HD_PERIPHS \
+    (STM32F1XX_MD_PERIPHS | P(DMA2) | P(UART4) | P(UART5) | P(ADC3) | \
+     P(DAC) | P(TIM5) | P(TIM6) | P(TIM7) | P(TIM8) | P(SPI3) | P(SDIO) | \
+     P(FSMC) | P(I2S2) | P(I2S3))
+
+/* Medium-density parts have GPIO ports A to E and high-density parts A to G,
+ * whatever their package (RM0008 section 3.3). */
+const Stm32Part stm32f1xx_parts[] = {
+    /* What stm32-p103 has always emulated: every peripheral, with the
+     * memory of the STM32F103RB on the board. */
+    {"STM32F103",   128, 20, 7, STM32F1XX_HD_PERIPHS},
+    {"STM32F103C8",  64, 20, 5, STM32F1XX_MD_PERIPHS},
+    {"STM32F103CB", 128, 20, 5, STM32F1XX_MD_PERIPHS},
+    {"STM32F103R8",  64, 20, 5, STM32F1XX_MD_PERIPHS},
+    {"STM32F103RB", 128, 20, 5, STM32F1XX_MD_PERIPHS},
+    {"STM32F103V8",  64, 20, 5, STM32F1XX_MD_PERIPHS},
+    {"STM32F103VB", 128, 20, 5, STM32F1XX_MD_PERIPHS},
+    {"STM32F103RC", 256, 48, 7, STM32F1XX_HD_PERIPHS},
+    {"STM32F103RE", 512, 64, 7, STM32F1XX_HD_PERIPHS},
+    {"STM32F103VC", 256, 48, 7, STM32F1XX_HD_PERIPHS},
+    {"STM32F103VE", 512, 64, 7, STM32F1XX_HD_PERIPHS},
+    {"STM32F103ZC", 256, 48, 7, STM32F1XX_HD_PERIPHS},
+    {"STM32F103ZE", 512, 64, 7, STM32F1XX_HD_PERIPHS},
+    {NULL}
+};
+
+#undef P
+
+/* ORs the interrupt lines of peripherals that share an NVIC input. */
+typedef struct {
+    qemu_irq out;
+    uint32_t levels;
+} Stm32f1xxIrqOr;
+
+static void stm32f1xx_irq_or_handler(void *opaque, int n, int level)
+{
+    Stm32f1xxIrqOr *s = (Stm32f1xxIrqOr *)opaque;
+
+    CHANGE_BIT(s->levels, n, level);
+    qemu_set_irq(s->out, s->levels != 0);
+}
+
+static qemu_irq *stm32f1xx_irq_or(qemu_irq out, int n)
+{
+    Stm32f1xxIrqOr *s = g_new0(Stm32f1xxIrqOr, 1);
+
+    s->out = out;
+    return qemu_allocate_irqs(stm32f1xx_irq_or_handler, s, n);
+}
+
+/* Looks up a chardev of the node by its id. */
+static CharDriverState *stm32f1xx_find_chr(const char *prefix,
+                                           const char *name)
+{
+    CharDriverState *chr;
+    char *id;
+
+    if (!prefix) {
+        return qemu_chr_find(name);
+    }
+    id = g_strdup_printf("%s.%s", prefix, name);
+    chr = qemu_chr_find(id);
+    g_free(id);
+    return chr;
+}
+
 void stm32f1xx_init(
-            ram_addr_t flash_size,
-            ram_addr_t ram_size,
+            int node,
+            const Stm32Part *part,
             const char *kernel_filename,
             Stm32Gpio **stm32_gpio,
             Stm32Uart **stm32_uart,
+            Stm32Spi **stm32_spi,
+            Stm32I2c **stm32_i2c,
+            Stm32Fsmc **stm32_fsmc,
             uint32_t osc_freq,
             uint32_t osc32_freq)
 {
     MemoryRegion *address_space_mem = get_system_memory();
+    AddressSpace *as;
     qemu_irq *pic;
+    DriveInfo *flash_dinfo;
+    char *prefix = NULL;
     int i;
 
-    pic = armv7m_init(address_space_mem, flash_size, ram_size, kernel_filename, "cortex-m3");
+    assert(node >= 0 && node < STM32_NODE_MAX);
+    if (node > 0) {
+        prefix = g_strdup_printf("node%d", node);
+        address_space_mem = g_new(MemoryRegion, 1);
+        memory_region_init(address_space_mem, prefix, INT64_MAX);
+    }
+    as = armv7m_address_space(address_space_mem);
 
+    // The flash lives at 0x08000000 and is aliased at 0x00000000 (boot from main flash):
     DeviceState *flash_dev = qdev_create(NULL, "stm32_flash");
-    qdev_prop_set_uint32(flash_dev, "size", flash_size * 1024);
+    qdev_prop_set_uint32(flash_dev, "size", part->flash_size * 1024);
+    if (prefix) {
+        qdev_prop_set_string(flash_dev, "prefix", prefix);
+    }
+    flash_dinfo = drive_get(IF_PFLASH, 0, node);
+    if (flash_dinfo) {
+        qdev_prop_set_drive_nofail(flash_dev, "drive", flash_dinfo->bdrv);
+    } else if (stm32_flash_map_kernel(flash_dev, kernel_filename)) {
+        kernel_filename = NULL;
+    }
     qdev_init_nofail(flash_dev);
-    sysbus_mmio_map(SYS_BUS_DEVICE(flash_dev), 0, STM32_FLASH_ADDR_START);
+    sysbus_mmio_map_to(SYS_BUS_DEVICE(flash_dev), 0, address_space_mem, STM32_FLASH_ADDR_START);
+    MemoryRegion *flash_alias = g_new(MemoryRegion, 1);
+    memory_region_init_alias(flash_alias, "stm32f1xx.flash.alias",
+            sysbus_mmio_get_region(SYS_BUS_DEVICE(flash_dev), 0), 0, part->flash_size * 1024);
+
+    pic = armv7m_translated_init(address_space_mem, part->flash_size, part->ram_size, kernel_filename, NULL, NULL, flash_alias, "cortex-m3");
+    // Node N runs on CPU N, which fetches from both flash windows:
+    stm32_flash_set_cpu(flash_dev, ARM_CPU(qemu_get_cpu(node)), STM32_FLASH_ADDR_START, true);
+
+    // Flash program/erase controller:
+    sysbus_mmio_map_to(SYS_BUS_DEVICE(flash_dev), 1, address_space_mem, 0x40022000);
+    sysbus_connect_irq(SYS_BUS_DEVICE(flash_dev), 0, pic[STM32_FLASH_IRQ]);
 
     DeviceState *rcc_dev = qdev_create(NULL, "stm32f1xx_rcc");
     qdev_prop_set_uint32(rcc_dev, "osc_freq", osc_freq);
     qdev_prop_set_uint32(rcc_dev, "osc32_freq", osc32_freq);
-    stm32_init_periph(rcc_dev, STM32F1XX_RCC, 0x40021000, pic[STM32_RCC_IRQ]);
+    stm32_init_periph(address_space_mem, rcc_dev, STM32F1XX_RCC, 0x40021000, pic[STM32_RCC_IRQ]);
 
     DeviceState **gpio_dev = (DeviceState **)g_malloc0(sizeof(DeviceState *) * STM32F1XX_GPIO_COUNT);
-    for(i = 0; i < STM32F1XX_GPIO_COUNT; i++) {
+    for(i = 0; i < part->gpio_count; i++) {
         stm32_periph_t periph = STM32F1XX_GPIOA + i;
         gpio_dev[i] = qdev_create(NULL, "stm32_gpio");
         gpio_dev[i]->id = stm32f1xx_periph_name_arr[periph];
         qdev_prop_set_int32(gpio_dev[i], "periph", periph);
-        qdev_prop_set_ptr(gpio_dev[i], "stm32_rcc", rcc_dev);
-        stm32_init_periph(gpio_dev[i], periph, 0x40010800 + (i * 0x400), NULL);
+        stm32_prop_set_link(gpio_dev[i], "stm32_rcc", rcc_dev);
+        stm32_init_periph(address_space_mem, gpio_dev[i], periph, 0x40010800 + (i * 0x400), NULL);
+    }
+    for(i = 0; i < STM32F1XX_GPIO_COUNT; i++) {
         stm32_gpio[i] = (Stm32Gpio *)gpio_dev[i];
     }
 
+    // Stream pin changes to an external harness if "-chardev ...,id=stm32-pinbus" was given:
+    CharDriverState *pinbus_chr = stm32f1xx_find_chr(prefix, "stm32-pinbus");
+    if (pinbus_chr) {
+        DeviceState *pinbus_dev = qdev_create(NULL, "stm32_pinbus");
+        qdev_prop_set_chr(pinbus_dev, "chardev", pinbus_chr);
+        qdev_prop_set_ptr(pinbus_dev, "stm32_gpio", gpio_dev);
+        qdev_prop_set_uint32(pinbus_dev, "gpio_count", part->gpio_count);
+        qdev_init_nofail(pinbus_dev);
+    }
+
     DeviceState *exti_dev = qdev_create(NULL, "stm32_exti");
     qdev_prop_set_ptr(exti_dev, "stm32_gpio", gpio_dev);
-    stm32_init_periph(exti_dev, STM32F1XX_EXTI, 0x40010400, NULL);
+    qdev_prop_set_uint32(exti_dev, "gpio_count", part->gpio_count);
+    stm32_init_periph(address_space_mem, exti_dev, STM32F1XX_EXTI, 0x40010400, NULL);
     SysBusDevice *exti_busdev = SYS_BUS_DEVICE(exti_dev);
     sysbus_connect_irq(exti_busdev, 0, pic[STM32_EXTI0_IRQ]);
     sysbus_connect_irq(exti_busdev, 1, pic[STM32_EXTI1_IRQ]);
@@ -122,30 +250,424 @@ void stm32f1xx_init(
     sysbus_connect_irq(exti_busdev, 9, pic[STM32_OTG_FS_WKUP_IRQ]);
 
     DeviceState *afio_dev = qdev_create(NULL, "stm32_afio");
-    qdev_prop_set_ptr(afio_dev, "stm32_rcc", rcc_dev);
-    qdev_prop_set_ptr(afio_dev, "stm32_exti", exti_dev);
-    stm32_init_periph(afio_dev, STM32F1XX_AFIO, 0x40010000, NULL);
+    stm32_prop_set_link(afio_dev, "stm32_rcc", rcc_dev);
+    stm32_prop_set_link(afio_dev, "stm32_exti", exti_dev);
+    qdev_prop_set_ptr(afio_dev, "stm32_gpio", gpio_dev);
+    qdev_prop_set_uint32(afio_dev, "gpio_count", part->gpio_count);
+    stm32_init_periph(address_space_mem, afio_dev, STM32F1XX_AFIO, 0x40010000, NULL);
+
+    // The PWR takes over WFI with SLEEPDEEP set, and watches WKUP (PA0):
+    DeviceState *pwr_dev = qdev_create(NULL, "stm32_pwr");
+    stm32_prop_set_link(pwr_dev, "stm32_rcc", rcc_dev);
+    qdev_prop_set_ptr(pwr_dev, "stm32_gpio", gpio_dev);
+    stm32_prop_set_link(pwr_dev, "nvic", (DeviceState *)ARM_CPU(qemu_get_cpu(node))->env.nvic);
+    stm32_init_periph(address_space_mem, pwr_dev, STM32F1XX_PWR, 0x40007000, NULL);
+
+    // The backup domain, which a system reset leaves alone:
+    DeviceState *bkp_dev = qdev_create(NULL, "stm32_bkp");
+    stm32_prop_set_link(bkp_dev, "stm32_rcc", rcc_dev);
+    qdev_prop_set_uint32(bkp_dev, "dr_count", part->flash_size >= 256 ? 42 : 10);
+    stm32_init_periph(address_space_mem, bkp_dev, STM32F1XX_BKP, 0x40006c00, NULL);
+
+    DeviceState *rtc_dev = qdev_create(NULL, "stm32_rtc");
+    stm32_prop_set_link(rtc_dev, "stm32_rcc", rcc_dev);
+    stm32_prop_set_link(rtc_dev, "stm32_exti", exti_dev);
+    stm32_init_periph(address_space_mem, rtc_dev, STM32F1XX_RTC, 0x40002800, pic[STM32_RTC_IRQ]);
+    sysbus_connect_irq(SYS_BUS_DEVICE(rtc_dev), 1, qdev_get_gpio_in(pwr_dev, 0));
+
+    // Watchdogs, which do what -watchdog-action says when they time out:
+    DeviceState *iwdg_dev = qdev_create(NULL, "stm32_iwdg");
+    stm32_prop_set_link(iwdg_dev, "stm32_rcc", rcc_dev);
+    stm32_init_periph(address_space_mem, iwdg_dev, STM32F1XX_IWDG, 0x40003000, NULL);
+
+    DeviceState *wwdg_dev = qdev_create(NULL, "stm32_wwdg");
+    stm32_prop_set_link(wwdg_dev, "stm32_rcc", rcc_dev);
+    stm32_init_periph(address_space_mem, wwdg_dev, STM32F1XX_WWDG, 0x40002c00, pic[STM32_WWDG_IRQ]);
+
+    // External memories and LCDs, which the board attaches:
+    DeviceState *fsmc_dev = NULL;
+    if (STM32_PART_HAS(part, STM32F1XX_FSMC)) {
+        fsmc_dev = qdev_create(NULL, "stm32_fsmc");
+        stm32_prop_set_link(fsmc_dev, "stm32_rcc", rcc_dev);
+        stm32_init_periph(address_space_mem, fsmc_dev, STM32F1XX_FSMC, 0xa0000000, NULL);
+        sysbus_mmio_map_to(SYS_BUS_DEVICE(fsmc_dev), 1, address_space_mem, STM32_FSMC_NOR_ADDR);
+    }
+    *stm32_fsmc = (Stm32Fsmc *)fsmc_dev;
+
+    // The CRC unit, which DMA channels can feed in bursts:
+    DeviceState *crc_dev = qdev_create(NULL, "stm32_crc");
+    stm32_prop_set_link(crc_dev, "stm32_rcc", rcc_dev);
+    stm32_init_periph(address_space_mem, crc_dev, STM32F1XX_CRC, STM32_CRC_ADDR, NULL);
+
+    // Create DMA controllers.  DMA2 channels 4 and 5 share one interrupt:
+    DeviceState *dma_dev[2];
+    struct {
+        uint32_t addr;
+        uint8_t channel_count;
+        uint8_t irq_count;
+        uint8_t irq_idx;
+    } const dma_desc[] = {
+        {0x40020000, 7, 7, STM32_DMA1_CHANNEL1_IRQ},
+        {0x40020400, 5, 4, STM32_DMA2_CHANNEL1_IRQ},
+    };
+    for (i = 0; i < ARRAY_LENGTH(dma_desc); i++) {
+        const stm32_periph_t periph = STM32F1XX_DMA1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            dma_dev[i] = NULL;
+            continue;
+        }
+        dma_dev[i] = qdev_create(NULL, "stm32_dma");
+        dma_dev[i]->id = stm32f1xx_periph_name_arr[periph];
+        qdev_prop_set_int32(dma_dev[i], "periph", periph);
+        stm32_prop_set_link(dma_dev[i], "stm32_rcc", rcc_dev);
+        qdev_prop_set_ptr(dma_dev[i], "address_space", as);
+        stm32_prop_set_link(dma_dev[i], "stm32_fsmc", fsmc_dev);
+        stm32_prop_set_link(dma_dev[i], "stm32_crc", crc_dev);
+        qdev_prop_set_uint32(dma_dev[i], "channel_count", dma_desc[i].channel_count);
+        qdev_prop_set_uint32(dma_dev[i], "irq_count", dma_desc[i].irq_count);
+        stm32_init_periph(address_space_mem, dma_dev[i], periph, dma_desc[i].addr, NULL);
+        for (int j = 0; j < dma_desc[i].irq_count; j++) {
+            sysbus_connect_irq(SYS_BUS_DEVICE(dma_dev[i]), j, pic[dma_desc[i].irq_idx + j]);
+        }
+    }
 
-    // Create UARTs:
+    // Create UARTs.  The DMA request mapping is from RM0008 tables 78 and 79
+    // (a channel of 0 means the UART has no DMA request).  Peripherals
+    // the part does not have are skipped here and below, together with any
+    // DMA requests to a missing DMA controller:
     struct {
         uint32_t addr;
         uint8_t irq_idx;
+        uint8_t dma_idx;
+        uint8_t dma_rx_channel;
+        uint8_t dma_tx_channel;
     } const uart_desc[] = {
-        {0x40013800, STM32_UART1_IRQ},
-        {0x40004400, STM32_UART2_IRQ},
-        {0x40004800, STM32_UART3_IRQ},
-        {0x40004c00, STM32_UART4_IRQ},
-        {0x40005000, STM32_UART5_IRQ},
+        {0x40013800, STM32_UART1_IRQ, 0, 5, 4},
+        {0x40004400, STM32_UART2_IRQ, 0, 6, 7},
+        {0x40004800, STM32_UART3_IRQ, 0, 3, 2},
+        {0x40004c00, STM32_UART4_IRQ, 1, 3, 5},
+        {0x40005000, STM32_UART5_IRQ, 0, 0, 0},
     };
     for (int i = 0; i < ARRAY_LENGTH(uart_desc); ++i) {
         const stm32_periph_t periph = STM32F1XX_UART1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            stm32_uart[i] = NULL;
+            continue;
+        }
         DeviceState *uart_dev = qdev_create(NULL, "stm32_uart");
         uart_dev->id = stm32f1xx_periph_name_arr[periph];
         qdev_prop_set_int32(uart_dev, "periph", periph);
-        qdev_prop_set_ptr(uart_dev, "stm32_rcc", rcc_dev);
+        stm32_prop_set_link(uart_dev, "stm32_rcc", rcc_dev);
         qdev_prop_set_ptr(uart_dev, "stm32_gpio", gpio_dev);
-        qdev_prop_set_ptr(uart_dev, "stm32_afio", afio_dev);
-        qdev_prop_set_ptr(uart_dev, "stm32_check_tx_pin_callback", (void *)stm32_afio_uart_check_tx_pin_callback);
-        stm32_init_periph(uart_dev, periph, uart_desc[i].addr, pic[uart_desc[i].irq_idx]);
+        stm32_prop_set_link(uart_dev, "stm32_afio", afio_dev);
+        stm32_init_periph(address_space_mem, uart_dev, periph, uart_desc[i].addr, pic[uart_desc[i].irq_idx]);
+        if (uart_desc[i].dma_rx_channel && dma_dev[uart_desc[i].dma_idx]) {
+            qdev_connect_gpio_out(uart_dev, STM32_UART_DMA_RX_REQ,
+                    qdev_get_gpio_in(dma_dev[uart_desc[i].dma_idx],
+                                     STM32_DMA_REQ(uart_desc[i].dma_rx_channel, 0)));
+            qdev_connect_gpio_out(uart_dev, STM32_UART_DMA_TX_REQ,
+                    qdev_get_gpio_in(dma_dev[uart_desc[i].dma_idx],
+                                     STM32_DMA_REQ(uart_desc[i].dma_tx_channel, 0)));
+        }
+        stm32_uart[i] = (Stm32Uart *)uart_dev;
+    }
+
+    // Create timers.  TIM1 and TIM8 have four interrupt lines in the order
+    // break, update, trigger/commutation and capture/compare:
+    struct {
+        uint32_t addr;
+        uint8_t channel_count;
+        bool advanced;
+        uint8_t irq_count;
+        uint8_t irq_idx[4];
+    } const timer_desc[] = {
+        {0x40012c00, 4, true, 4, {STM32_TIM1_BRK_IRQ, STM32_TIM1_UP_IRQ,
+                                  STM32_TIM1_TRG_COM_IRQ, STM32_TIM1_CC_IRQ}},
+        {0x40000000, 4, false, 1, {STM32_TIM2_IRQ}},
+        {0x40000400, 4, false, 1, {STM32_TIM3_IRQ}},
+        {0x40000800, 4, false, 1, {STM32_TIM4_IRQ}},
+        {0x40000c00, 4, false, 1, {STM32_TIM5_IRQ}},
+        {0x40001000, 0, false, 1, {STM32_TIM6_IRQ}},
+        {0x40001400, 0, false, 1, {STM32_TIM7_IRQ}},
+        {0x40013400, 4, true, 4, {STM32_TIM8_BRK_IRQ, STM32_TIM8_UP_IRQ,
+                                  STM32_TIM8_TRG_COM_IRQ, STM32_TIM8_CC_IRQ}},
+    };
+    DeviceState *timer_dev[ARRAY_LENGTH(timer_desc)];
+    for (i = 0; i < ARRAY_LENGTH(timer_desc); i++) {
+        const stm32_periph_t periph = STM32F1XX_TIM1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            timer_dev[i] = NULL;
+            continue;
+        }
+        timer_dev[i] = qdev_create(NULL, "stm32_timer");
+        timer_dev[i]->id = stm32f1xx_periph_name_arr[periph];
+        qdev_prop_set_int32(timer_dev[i], "periph", periph);
+        stm32_prop_set_link(timer_dev[i], "stm32_rcc", rcc_dev);
+        qdev_prop_set_uint32(timer_dev[i], "channel_count", timer_desc[i].channel_count);
+        qdev_prop_set_bit(timer_dev[i], "advanced", timer_desc[i].advanced);
+        qdev_prop_set_uint32(timer_dev[i], "irq_count", timer_desc[i].irq_count);
+        stm32_init_periph(address_space_mem, timer_dev[i], periph, timer_desc[i].addr, NULL);
+        for (int j = 0; j < timer_desc[i].irq_count; j++) {
+            sysbus_connect_irq(SYS_BUS_DEVICE(timer_dev[i]), j, pic[timer_desc[i].irq_idx[j]]);
+        }
     }
+
+    // The TIx inputs follow the channel pins of the default mapping (the
+    // AFIO remaps are not followed).  TIM2 and TIM5 share PA0 to PA3:
+    static const struct {
+        uint8_t port;
+        uint8_t pin;
+    } timer_ch_pins[ARRAY_LENGTH(timer_desc)][4] = {
+        {{STM32_GPIOA_INDEX, 8}, {STM32_GPIOA_INDEX, 9},
+         {STM32_GPIOA_INDEX, 10}, {STM32_GPIOA_INDEX, 11}},
+        {{STM32_GPIOA_INDEX, 0}, {STM32_GPIOA_INDEX, 1},
+         {STM32_GPIOA_INDEX, 2}, {STM32_GPIOA_INDEX, 3}},
+        {{STM32_GPIOA_INDEX, 6}, {STM32_GPIOA_INDEX, 7},
+         {STM32_GPIOB_INDEX, 0}, {STM32_GPIOB_INDEX, 1}},
+        {{STM32_GPIOB_INDEX, 6}, {STM32_GPIOB_INDEX, 7},
+         {STM32_GPIOB_INDEX, 8}, {STM32_GPIOB_INDEX, 9}},
+        {{STM32_GPIOA_INDEX, 0}, {STM32_GPIOA_INDEX, 1},
+         {STM32_GPIOA_INDEX, 2}, {STM32_GPIOA_INDEX, 3}},
+        {}, {},
+        {{STM32_GPIOC_INDEX, 6}, {STM32_GPIOC_INDEX, 7},
+         {STM32_GPIOC_INDEX, 8}, {STM32_GPIOC_INDEX, 9}},
+    };
+    for (i = 0; i < ARRAY_LENGTH(timer_desc); i++) {
+        if (!timer_dev[i]) {
+            continue;
+        }
+        for (int j = 0; j < timer_desc[i].channel_count; j++) {
+            Stm32Gpio *gpio = stm32_gpio[timer_ch_pins[i][j].port];
+            if (gpio) {
+                stm32_timer_connect_input((Stm32Timer *)timer_dev[i], j, gpio,
+                                          timer_ch_pins[i][j].pin);
+            }
+        }
+    }
+
+    // Create ADCs.  ADC1 and ADC2 share an interrupt, and ADC2 has no DMA
+    // request.  The requests use slot 2 of their channels.  A sample stream
+    // can be fed to ADCn with "-chardev ...,id=stm32-adcN", or from a file
+    // with "-global stm32_adc.samples=FILE":
+    struct {
+        uint32_t addr;
+        uint8_t dma_idx;
+        uint8_t dma_channel;
+        const char *chr_name;
+    } const adc_desc[] = {
+        {0x40012400, 0, 1, "stm32-adc1"},
+        {0x40012800, 0, 0, "stm32-adc2"},
+        {0x40013c00, 1, 5, "stm32-adc3"},
+    };
+    qemu_irq *adc1_2_irq = stm32f1xx_irq_or(pic[STM32_ADC1_2_IRQ], 2);
+    DeviceState *adc_dev[ARRAY_LENGTH(adc_desc)];
+    for (i = 0; i < ARRAY_LENGTH(adc_desc); i++) {
+        const stm32_periph_t periph = STM32F1XX_ADC1 + i;
+        CharDriverState *adc_chr = stm32f1xx_find_chr(prefix,
+                                                      adc_desc[i].chr_name);
+        if (!STM32_PART_HAS(part, periph)) {
+            adc_dev[i] = NULL;
+            continue;
+        }
+        adc_dev[i] = qdev_create(NULL, "stm32_adc");
+        adc_dev[i]->id = stm32f1xx_periph_name_arr[periph];
+        qdev_prop_set_int32(adc_dev[i], "periph", periph);
+        stm32_prop_set_link(adc_dev[i], "stm32_rcc", rcc_dev);
+        if (adc_chr) {
+            qdev_prop_set_chr(adc_dev[i], "chardev", adc_chr);
+        }
+        stm32_init_periph(address_space_mem, adc_dev[i], periph, adc_desc[i].addr,
+                          i < 2 ? adc1_2_irq[i] : pic[STM32_ADC3_IRQ]);
+        if (adc_desc[i].dma_channel && dma_dev[adc_desc[i].dma_idx]) {
+            qdev_connect_gpio_out(adc_dev[i], STM32_ADC_DMA_REQ,
+                    qdev_get_gpio_in(dma_dev[adc_desc[i].dma_idx],
+                                     STM32_DMA_REQ(adc_desc[i].dma_channel, 2)));
+        }
+    }
+
+    // Connect the timer events that trigger the ADCs (RM0008 tables 69 to
+    // 72).  The EXTI and remapped TIM8 triggers of ADC1 and ADC2 are not
+    // connected.  An event that triggers several ADCs is split between them:
+#define ADC12 ((1 << 0) | (1 << 1))
+#define ADC3 (1 << 2)
+#define TRGO STM32_TIMER_TRGO
+#define CC(n) STM32_TIMER_CC_TRIGGER((n) - 1)
+    struct {
+        uint8_t timer_idx;
+        uint8_t output;
+        uint8_t adc_mask;
+        uint8_t input;
+    } const adc_trigger_desc[] = {
+        {0, CC(1), ADC12, STM32_ADC_EXT_TRIGGER(0)},
+        {0, CC(2), ADC12, STM32_ADC_EXT_TRIGGER(1)},
+        {0, CC(3), ADC12, STM32_ADC_EXT_TRIGGER(2)},
+        {1, CC(2), ADC12, STM32_ADC_EXT_TRIGGER(3)},
+        {2, TRGO,  ADC12, STM32_ADC_EXT_TRIGGER(4)},
+        {3, CC(4), ADC12, STM32_ADC_EXT_TRIGGER(5)},
+        {0, TRGO,  ADC12, STM32_ADC_JEXT_TRIGGER(0)},
+        {0, CC(4), ADC12, STM32_ADC_JEXT_TRIGGER(1)},
+        {1, TRGO,  ADC12, STM32_ADC_JEXT_TRIGGER(2)},
+        {1, CC(1), ADC12, STM32_ADC_JEXT_TRIGGER(3)},
+        {2, CC(4), ADC12, STM32_ADC_JEXT_TRIGGER(4)},
+        {3, TRGO,  ADC12, STM32_ADC_JEXT_TRIGGER(5)},
+        {2, CC(1), ADC3,  STM32_ADC_EXT_TRIGGER(0)},
+        {1, CC(3), ADC3,  STM32_ADC_EXT_TRIGGER(1)},
+        {0, CC(3), ADC3,  STM32_ADC_EXT_TRIGGER(2)},
+        {7, CC(1), ADC3,  STM32_ADC_EXT_TRIGGER(3)},
+        {7, TRGO,  ADC3,  STM32_ADC_EXT_TRIGGER(4)},
+        {4, CC(1), ADC3,  STM32_ADC_EXT_TRIGGER(5)},
+        {4, CC(3), ADC3,  STM32_ADC_EXT_TRIGGER(6)},
+        {0, TRGO,  ADC3,  STM32_ADC_JEXT_TRIGGER(0)},
+        {0, CC(4), ADC3,  STM32_ADC_JEXT_TRIGGER(1)},
+        {3, CC(3), ADC3,  STM32_ADC_JEXT_TRIGGER(2)},
+        {7, CC(2), ADC3,  STM32_ADC_JEXT_TRIGGER(3)},
+        {7, CC(4), ADC3,  STM32_ADC_JEXT_TRIGGER(4)},
+        {4, TRGO,  ADC3,  STM32_ADC_JEXT_TRIGGER(5)},
+        {4, CC(4), ADC3,  STM32_ADC_JEXT_TRIGGER(6)},
+    };
+#undef ADC12
+#undef ADC3
+#undef TRGO
+#undef CC
+    for (i = 0; i < ARRAY_LENGTH(timer_dev); i++) {
+        if (!timer_dev[i]) {
+            continue;
+        }
+        for (int out = 0; out < STM32_TIMER_TRIGGER_COUNT; out++) {
+            qemu_irq trigger = NULL;
+            for (int j = 0; j < ARRAY_LENGTH(adc_trigger_desc); j++) {
+                if (adc_trigger_desc[j].timer_idx != i ||
+                    adc_trigger_desc[j].output != out) {
+                    continue;
+                }
+                for (int k = 0; k < ARRAY_LENGTH(adc_dev); k++) {
+                    qemu_irq in;
+                    if (!IS_BIT_SET(adc_trigger_desc[j].adc_mask, k) ||
+                        !adc_dev[k]) {
+                        continue;
+                    }
+                    in = qdev_get_gpio_in(adc_dev[k], adc_trigger_desc[j].input);
+                    trigger = trigger ? qemu_irq_split(trigger, in) : in;
+                }
+            }
+            if (trigger) {
+                qdev_connect_gpio_out(timer_dev[i], out, trigger);
+            }
+        }
+    }
+
+    // Replay captured pin and analog waveforms with "-global stm32_stimulus.file=FILE":
+    Stm32Adc **stm32_adc = g_new0(Stm32Adc *, ARRAY_LENGTH(adc_dev));
+    for (i = 0; i < ARRAY_LENGTH(adc_dev); i++) {
+        stm32_adc[i] = (Stm32Adc *)adc_dev[i];
+    }
+    DeviceState *stimulus_dev = qdev_create(NULL, "stm32_stimulus");
+    qdev_prop_set_ptr(stimulus_dev, "stm32_gpio", gpio_dev);
+    qdev_prop_set_uint32(stimulus_dev, "gpio_count", part->gpio_count);
+    qdev_prop_set_ptr(stimulus_dev, "stm32_adc", stm32_adc);
+    qdev_prop_set_uint32(stimulus_dev, "adc_count", ARRAY_LENGTH(adc_dev));
+    qdev_init_nofail(stimulus_dev);
+
+    // Create SPIs.  The DMA request mapping is from RM0008 tables 78 and 79.
+    // The requests use slot 1 of their channels, since the UARTs use slot 0
+    // on some of the same channels:
+    struct {
+        uint32_t addr;
+        uint8_t irq_idx;
+        uint8_t dma_idx;
+        uint8_t dma_rx_channel;
+        uint8_t dma_tx_channel;
+        int i2s_periph;
+    } const spi_desc[] = {
+        {0x40013000, STM32_SPI1_IRQ, 0, 2, 3, -1},
+        {0x40003800, STM32_SPI2_IRQ, 0, 4, 5, STM32F1XX_I2S2},
+        {0x40003c00, STM32_SPI3_IRQ, 1, 1, 2, STM32F1XX_I2S3},
+    };
+    for (i = 0; i < ARRAY_LENGTH(spi_desc); i++) {
+        const stm32_periph_t periph = STM32F1XX_SPI1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            stm32_spi[i] = NULL;
+            continue;
+        }
+        DeviceState *spi_dev = qdev_create(NULL, "stm32_spi");
+        DeviceState *spi_dma_dev = dma_dev[spi_desc[i].dma_idx];
+        spi_dev->id = stm32f1xx_periph_name_arr[periph];
+        qdev_prop_set_int32(spi_dev, "periph", periph);
+        stm32_prop_set_link(spi_dev, "stm32_rcc", rcc_dev);
+        stm32_prop_set_link(spi_dev, "stm32_dma", spi_dma_dev);
+        qdev_prop_set_uint32(spi_dev, "dma_rx_channel", spi_desc[i].dma_rx_channel);
+        qdev_prop_set_uint32(spi_dev, "dma_tx_channel", spi_desc[i].dma_tx_channel);
+        if (spi_desc[i].i2s_periph >= 0 &&
+            STM32_PART_HAS(part, spi_desc[i].i2s_periph)) {
+            qdev_prop_set_int32(spi_dev, "i2s_periph", spi_desc[i].i2s_periph);
+        }
+        stm32_init_periph(address_space_mem, spi_dev, periph, spi_desc[i].addr, pic[spi_desc[i].irq_idx]);
+        if (spi_dma_dev) {
+            qdev_connect_gpio_out(spi_dev, STM32_SPI_DMA_RX_REQ,
+                    qdev_get_gpio_in(spi_dma_dev,
+                                     STM32_DMA_REQ(spi_desc[i].dma_rx_channel, 1)));
+            qdev_connect_gpio_out(spi_dev, STM32_SPI_DMA_TX_REQ,
+                    qdev_get_gpio_in(spi_dma_dev,
+                                     STM32_DMA_REQ(spi_desc[i].dma_tx_channel, 1)));
+        }
+        stm32_spi[i] = (Stm32Spi *)spi_dev;
+    }
+
+    // Create I2Cs:
+    struct {
+        uint32_t addr;
+        uint8_t evt_irq_idx;
+        uint8_t err_irq_idx;
+    } const i2c_desc[] = {
+        {0x40005400, STM32_I2C1_EV_IRQ, STM32_I2C1_ER_IRQ},
+        {0x40005800, STM32_I2C2_EV_IRQ, STM32_I2C2_ER_IRQ},
+    };
+    for (i = 0; i < ARRAY_LENGTH(i2c_desc); i++) {
+        const stm32_periph_t periph = STM32F1XX_I2C1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            stm32_i2c[i] = NULL;
+            continue;
+        }
+        DeviceState *i2c_dev = qdev_create(NULL, "stm32_i2c");
+        i2c_dev->id = stm32f1xx_periph_name_arr[periph];
+        qdev_prop_set_int32(i2c_dev, "periph", periph);
+        stm32_prop_set_link(i2c_dev, "stm32_rcc", rcc_dev);
+        stm32_init_periph(address_space_mem, i2c_dev, periph, i2c_desc[i].addr, pic[i2c_desc[i].evt_irq_idx]);
+        sysbus_connect_irq(SYS_BUS_DEVICE(i2c_dev), 1, pic[i2c_desc[i].err_irq_idx]);
+        stm32_i2c[i] = (Stm32I2c *)i2c_dev;
+    }
+
+    // Create the USB device and the CAN controller, which share two
+    // interrupt lines.  The USB host is an external program connected with
+    // "-chardev ...,id=stm32-usb".  All the nodes of a board share virtual
+    // CAN bus 0 unless "-global stm32_can.canbus=N" says otherwise, and
+    // "-global stm32_can.host=IFNAME" bridges the bus to a SocketCAN
+    // interface of the host:
+    qemu_irq *usb_can_tx_irq = stm32f1xx_irq_or(pic[STM32_USB_HP_CAN_TX_IRQ], 2);
+    qemu_irq *usb_can_rx0_irq = stm32f1xx_irq_or(pic[STM32_USB_LP_CAN_RX0_IRQ], 2);
+    if (STM32_PART_HAS(part, STM32F1XX_USB)) {
+        DeviceState *usb_dev = qdev_create(NULL, "stm32_usb");
+        CharDriverState *usb_chr = stm32f1xx_find_chr(prefix, "stm32-usb");
+        usb_dev->id = stm32f1xx_periph_name_arr[STM32F1XX_USB];
+        qdev_prop_set_int32(usb_dev, "periph", STM32F1XX_USB);
+        stm32_prop_set_link(usb_dev, "stm32_rcc", rcc_dev);
+        if (usb_chr) {
+            qdev_prop_set_chr(usb_dev, "chardev", usb_chr);
+        }
+        stm32_init_periph(address_space_mem, usb_dev, STM32F1XX_USB, 0x40005c00, usb_can_rx0_irq[0]);
+        sysbus_mmio_map_to(SYS_BUS_DEVICE(usb_dev), 1, address_space_mem, 0x40006000);
+        sysbus_connect_irq(SYS_BUS_DEVICE(usb_dev), 1, usb_can_tx_irq[0]);
+    }
+    if (STM32_PART_HAS(part, STM32F1XX_CAN)) {
+        DeviceState *can_dev = qdev_create(NULL, "stm32_can");
+        can_dev->id = stm32f1xx_periph_name_arr[STM32F1XX_CAN];
+        qdev_prop_set_int32(can_dev, "periph", STM32F1XX_CAN);
+        stm32_prop_set_link(can_dev, "stm32_rcc", rcc_dev);
+        stm32_init_periph(address_space_mem, can_dev, STM32F1XX_CAN, 0x40006400, usb_can_tx_irq[1]);
+        sysbus_connect_irq(SYS_BUS_DEVICE(can_dev), 1, usb_can_rx0_irq[1]);
+        sysbus_connect_irq(SYS_BUS_DEVICE(can_dev), 2, pic[STM32_CAN_RX1_IRQ]);
+        sysbus_connect_irq(SYS_BUS_DEVICE(can_dev), 3, pic[STM32_CAN_SCE_IRQ]);
+    }
+
+    g_free(prefix);
 }
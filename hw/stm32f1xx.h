@@ -29,12 +29,14 @@ enum {
     STM32F1XX_TIM7,
     STM32F1XX_TIM8,
     STM32F1XX_BKP,
+    STM32F1XX_RTC,
     STM32F1XX_PWR,
     STM32F1XX_I2C1,
     STM32F1XX_I2C2,
     STM32F1XX_I2S2,
     STM32F1XX_I2S3,
     STM32F1XX_WWDG,
+    STM32F1XX_IWDG,
     STM32F1XX_CAN1,
     STM32F1XX_CAN2,
     STM32F1XX_CAN,
@@ -45,7 +47,22 @@ enum {
     STM32F1XX_EXTI,
     STM32F1XX_SDIO,
     STM32F1XX_FSMC,
+    STM32F1XX_DMA1,
+    STM32F1XX_DMA2,
+    STM32F1XX_CRC,
     STM32F1XX_PERIPH_COUNT,
 };
 
 #define STM32F1XX_GPIO_COUNT (STM32F1XX_GPIOG - STM32F1XX_GPIOA + 1)
+#define STM32F1XX_SPI_COUNT (STM32F1XX_SPI3 - STM32F1XX_SPI1 + 1)
+
+/* Indexes used for accessing the SPI array */
+#define STM32_SPI1_INDEX 0
+#define STM32_SPI2_INDEX 1
+#define STM32_SPI3_INDEX 2
+
+#define STM32F1XX_I2C_COUNT (STM32F1XX_I2C2 - STM32F1XX_I2C1 + 1)
+
+/* Indexes used for accessing the I2C array */
+#define STM32_I2C1_INDEX 0
+#define STM32_I2C2_INDEX 1
@@ -21,6 +21,7 @@
  */
 
 #include "stm32f1xx_rcc.h"
+#include "trace.h"
 #include <stdio.h>
 
 
@@ -87,6 +88,10 @@ do { printf("STM32_RCC: " fmt , ## __VA_ARGS__); } while (0)
 #define RCC_APB1RSTR_OFFSET 0x10
 
 #define RCC_AHBENR_OFFSET 0x14
+#define RCC_AHBENR_FSMCEN_BIT 8
+#define RCC_AHBENR_CRCEN_BIT 6
+#define RCC_AHBENR_DMA2EN_BIT 1
+#define RCC_AHBENR_DMA1EN_BIT 0
 
 #define RCC_APB2ENR_OFFSET 0x18
 #define RCC_APB2ENR_ADC3EN_BIT   15
@@ -130,11 +135,15 @@ do { printf("STM32_RCC: " fmt , ## __VA_ARGS__); } while (0)
 #define RCC_APB1ENR_TIM2EN_BIT   0
 
 #define RCC_BDCR_OFFSET 0x20
+#define RCC_BDCR_BDRST_BIT 16
 #define RCC_BDCR_RTCEN_BIT 15
 #define RCC_BDCR_RTCSEL_START 8
 #define RCC_BDCR_RTCSEL_MASK 0x00000300
+#define RCC_BDCR_LSEBYP_BIT 2
 #define RCC_BDCR_LSERDY_BIT 1
 #define RCC_BDCR_LSEON_BIT 0
+/* The bits of RCC_BDCR that are not derived from the clocks */
+#define RCC_BDCR_MASK 0x00018304
 
 #define RCC_CSR_OFFSET 0x24
 #define RCC_CSR_LSIRDY_BIT 1
@@ -168,7 +177,7 @@ do { printf("STM32_RCC: " fmt , ## __VA_ARGS__); } while (0)
 
 /* Enable the peripheral clock if the specified bit is set in the value. */
 static void stm32_rcc_periph_enable(
-                                    Stm32Rcc *s,
+                                    Stm32f1xxRcc *s,
                                     uint32_t new_value,
                                     bool init,
                                     int periph,
@@ -177,6 +186,67 @@ static void stm32_rcc_periph_enable(
     clktree_set_enabled(s->PERIPHCLK[periph], IS_BIT_SET(new_value, bit_mask));
 }
 
+/* Switches SYSCLK to the source selected by SW once that source is ready, as
+ * the hardware does.  Until then SWS keeps reporting the previous source.
+ */
+static void stm32_rcc_update_sysclk(Stm32f1xxRcc *s)
+{
+    Stm32RccStartup *st;
+    Clk clk;
+    int64_t until;
+
+    switch(s->RCC_CFGR_SW) {
+        case SW_HSI_SELECTED:
+            st = NULL;
+            clk = s->HSICLK;
+            break;
+        case SW_HSE_SELECTED:
+            st = &s->hse_startup;
+            clk = s->HSECLK;
+            break;
+        case SW_PLL_SELECTED:
+            st = &s->pll_startup;
+            clk = s->PLLCLK;
+            break;
+        default:
+            hw_error("Invalid input selected for SYSCLK");
+            return;
+    }
+
+    if(st ? stm32_rcc_startup_ready(st, clk) : clktree_is_enabled(clk)) {
+        qemu_del_timer(s->sysclk_timer);
+        s->RCC_CFGR_SWS = s->RCC_CFGR_SW;
+        clktree_set_selected_input(s->SYSCLK, s->RCC_CFGR_SWS);
+    } else {
+        until = st ? stm32_rcc_startup_until(st, clk, STM32_POLL_FOREVER) :
+                     STM32_POLL_FOREVER;
+        if(until == STM32_POLL_FOREVER) {
+            qemu_del_timer(s->sysclk_timer);
+        } else {
+            qemu_mod_timer(s->sysclk_timer, until);
+        }
+    }
+}
+
+static void stm32_rcc_sysclk_timer_expire(void *opaque)
+{
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)opaque;
+
+    stm32_rcc_update_sysclk(s);
+}
+
+/* Returns the time at which the next ready flag gets set (for
+ * stm32_poll_read). */
+static int64_t stm32_rcc_next_ready(Stm32f1xxRcc *s)
+{
+    int64_t until = STM32_POLL_FOREVER;
+
+    until = stm32_rcc_startup_until(&s->hse_startup, s->HSECLK, until);
+    until = stm32_rcc_startup_until(&s->lse_startup, s->LSECLK, until);
+    until = stm32_rcc_startup_until(&s->pll_startup, s->PLLCLK, until);
+    return until;
+}
+
 
 
 
@@ -184,19 +254,22 @@ static void stm32_rcc_periph_enable(
 /* REGISTER IMPLEMENTATION */
 
 /* Read the configuration register. */
-static uint32_t stm32_rcc_RCC_CR_read(Stm32Rcc *s)
+static uint32_t stm32_rcc_RCC_CR_read(Stm32f1xxRcc *s)
 {
     /* Get the status of the clocks. */
     bool PLLON = clktree_is_enabled(s->PLLCLK);
     bool HSEON = clktree_is_enabled(s->HSECLK);
     bool HSION = clktree_is_enabled(s->HSICLK);
 
-    /* build the register value based on the clock states.  If a clock is on,
-     * then its ready bit is always set.
+    /* build the register value based on the clock states.  The PLL and HSE
+     * ready bits are set once their start-up time has passed, the HSI one
+     * as soon as it is on.
      */
-    return GET_BIT_MASK(RCC_CR_PLLRDY_BIT, PLLON) |
+    return GET_BIT_MASK(RCC_CR_PLLRDY_BIT,
+                        stm32_rcc_startup_ready(&s->pll_startup, s->PLLCLK)) |
     GET_BIT_MASK(RCC_CR_PLLON_BIT, PLLON) |
-    GET_BIT_MASK(RCC_CR_HSERDY_BIT, HSEON) |
+    GET_BIT_MASK(RCC_CR_HSERDY_BIT,
+                 stm32_rcc_startup_ready(&s->hse_startup, s->HSECLK)) |
     GET_BIT_MASK(RCC_CR_HSEON_BIT, HSEON) |
     GET_BIT_MASK(RCC_CR_HSIRDY_BIT, HSION) |
     GET_BIT_MASK(RCC_CR_HSION_BIT, HSION);
@@ -207,8 +280,9 @@ static uint32_t stm32_rcc_RCC_CR_read(Stm32Rcc *s)
  * saved - when the register is read, its value will be built using the clock
  * states.
  */
-static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
+static void stm32_rcc_RCC_CR_write(Stm32f1xxRcc *s, uint32_t new_value, bool init)
 {
+    int64_t now = qemu_get_clock_ns(vm_clock);
     bool new_PLLON, new_HSEON, new_HSION;
 
     new_PLLON = IS_BIT_SET(new_value, RCC_CR_PLLON_BIT);
@@ -216,7 +290,7 @@ static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
        s->RCC_CFGR_SW == SW_PLL_SELECTED) {
         stm32_hw_warn("PLL cannot be disabled while it is selected as the system clock.");
     }
-    clktree_set_enabled(s->PLLCLK, new_PLLON);
+    stm32_rcc_startup_set(&s->pll_startup, s->PLLCLK, new_PLLON, now);
 
     new_HSEON = IS_BIT_SET(new_value, RCC_CR_HSEON_BIT);
     if((clktree_is_enabled(s->HSECLK) && !new_HSEON) &&
@@ -226,7 +300,7 @@ static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
        ) {
         stm32_hw_warn("HSE oscillator cannot be disabled while it is driving the system clock.");
     }
-    clktree_set_enabled(s->HSECLK, new_HSEON);
+    stm32_rcc_startup_set(&s->hse_startup, s->HSECLK, new_HSEON, now);
 
     new_HSION = IS_BIT_SET(new_value, RCC_CR_HSION_BIT);
     if((clktree_is_enabled(s->HSECLK) && !new_HSEON) &&
@@ -237,26 +311,37 @@ static void stm32_rcc_RCC_CR_write(Stm32Rcc *s, uint32_t new_value, bool init)
         stm32_hw_warn("HSI oscillator cannot be disabled while it is driving the system clock.");
     }
     clktree_set_enabled(s->HSICLK, new_HSION);
+
+    /* A pending SYSCLK switch may now have a source (or lost it) */
+    stm32_rcc_update_sysclk(s);
 }
 
 
-static uint32_t stm32_rcc_RCC_CFGR_read(Stm32Rcc *s)
+static uint32_t stm32_rcc_RCC_CFGR_read(Stm32f1xxRcc *s)
 {
-    return (s->RCC_CFGR_PLLMUL << RCC_CFGR_PLLMUL_START) |
+    return (s->RCC_CFGR_MCO << RCC_CFGR_MCO_START) |
+    (s->RCC_CFGR_PLLMUL << RCC_CFGR_PLLMUL_START) |
     (s->RCC_CFGR_PLLXTPRE << RCC_CFGR_PLLXTPRE_BIT) |
     (s->RCC_CFGR_PLLSRC << RCC_CFGR_PLLSRC_BIT) |
+    (s->RCC_CFGR_ADCPRE << RCC_CFGR_ADCPRE_START) |
     (s->RCC_CFGR_PPRE2 << RCC_CFGR_PPRE2_START) |
     (s->RCC_CFGR_PPRE1 << RCC_CFGR_PPRE1_START) |
     (s->RCC_CFGR_HPRE << RCC_CFGR_HPRE_START) |
     (s->RCC_CFGR_SW << RCC_CFGR_SW_START) |
-    (s->RCC_CFGR_SW << RCC_CFGR_SWS_START);
+    (s->RCC_CFGR_SWS << RCC_CFGR_SWS_START);
 }
 
 
-static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
+static void stm32_rcc_RCC_CFGR_write(Stm32f1xxRcc *s, uint32_t new_value, bool init)
 {
     uint32_t new_PLLMUL, new_PLLXTPRE, new_PLLSRC;
 
+    /* MCO (values below 4 select no clock) */
+    s->RCC_CFGR_MCO = (new_value & RCC_CFGR_MCO_MASK) >> RCC_CFGR_MCO_START;
+    clktree_set_selected_input(s->MCOCLK, s->RCC_CFGR_MCO < 4 ?
+                                          CLKTREE_NO_INPUT :
+                                          s->RCC_CFGR_MCO - 4);
+
     /* PLLMUL */
     new_PLLMUL = (new_value & RCC_CFGR_PLLMUL_MASK) >> RCC_CFGR_PLLMUL_START;
     if(!init) {
@@ -295,20 +380,28 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
     clktree_set_selected_input(s->PLLCLK, new_PLLSRC);
     s->RCC_CFGR_PLLSRC = new_PLLSRC;
 
+    /* ADCPRE */
+    s->RCC_CFGR_ADCPRE = (new_value & RCC_CFGR_ADCPRE_MASK) >> RCC_CFGR_ADCPRE_START;
+    clktree_set_scale(s->ADCCLK, 1, 2 * (s->RCC_CFGR_ADCPRE + 1));
+
     /* PPRE2 */
     s->RCC_CFGR_PPRE2 = (new_value & RCC_CFGR_PPRE2_MASK) >> RCC_CFGR_PPRE2_START;
     if(s->RCC_CFGR_PPRE2 < 0x4) {
         clktree_set_scale(s->PCLK2, 1, 1);
+        clktree_set_scale(s->TIMCLK2, 1, 1);
     } else {
         clktree_set_scale(s->PCLK2, 1, 2 * (s->RCC_CFGR_PPRE2 - 3));
+        clktree_set_scale(s->TIMCLK2, 2, 1);
     }
 
     /* PPRE1 */
     s->RCC_CFGR_PPRE1 = (new_value & RCC_CFGR_PPRE1_MASK) >> RCC_CFGR_PPRE1_START;
     if(s->RCC_CFGR_PPRE1 < 4) {
         clktree_set_scale(s->PCLK1, 1, 1);
+        clktree_set_scale(s->TIMCLK1, 1, 1);
     } else {
         clktree_set_scale(s->PCLK1, 1, 2 * (s->RCC_CFGR_PPRE1 - 3));
+        clktree_set_scale(s->TIMCLK1, 2, 1);
     }
 
     /* HPRE */
@@ -321,21 +414,12 @@ static void stm32_rcc_RCC_CFGR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 
     /* SW */
     s->RCC_CFGR_SW = (new_value & RCC_CFGR_SW_MASK) >> RCC_CFGR_SW_START;
-    switch(s->RCC_CFGR_SW) {
-        case 0x0:
-        case 0x1:
-        case 0x2:
-            clktree_set_selected_input(s->SYSCLK, s->RCC_CFGR_SW);
-            break;
-        default:
-            hw_error("Invalid input selected for SYSCLK");
-            break;
-    }
+    stm32_rcc_update_sysclk(s);
 }
 
 /* Write the APB2 peripheral clock enable register
  * Enables/Disables the peripheral clocks based on each bit. */
-static void stm32_rcc_RCC_APB2ENR_write(Stm32Rcc *s, uint32_t new_value,
+static void stm32_rcc_RCC_APB2ENR_write(Stm32f1xxRcc *s, uint32_t new_value,
                                         bool init)
 {
     stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_UART1,
@@ -356,42 +440,136 @@ static void stm32_rcc_RCC_APB2ENR_write(Stm32Rcc *s, uint32_t new_value,
                             RCC_APB2ENR_IOPGEN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_GPIOF,
                             RCC_APB2ENR_IOPFEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_SPI1,
+                            RCC_APB2ENR_SPI1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM1,
+                            RCC_APB2ENR_TIM1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_ADC1,
+                            RCC_APB2ENR_ADC1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_ADC2,
+                            RCC_APB2ENR_ADC2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_ADC3,
+                            RCC_APB2ENR_ADC3EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM8,
+                            RCC_APB2ENR_TIM8EN_BIT);
 
     s->RCC_APB2ENR = new_value & 0x0000fffd;
 }
 
+/* Write the AHB peripheral clock enable register
+ * Enables/Disables the peripheral clocks based on each bit. */
+static void stm32_rcc_RCC_AHBENR_write(Stm32f1xxRcc *s, uint32_t new_value,
+                                       bool init)
+{
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_DMA1,
+                            RCC_AHBENR_DMA1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_DMA2,
+                            RCC_AHBENR_DMA2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_FSMC,
+                            RCC_AHBENR_FSMCEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_CRC,
+                            RCC_AHBENR_CRCEN_BIT);
+
+    s->RCC_AHBENR = new_value & 0x00000557;
+}
+
 /* Write the APB1 peripheral clock enable register
  * Enables/Disables the peripheral clocks based on each bit. */
-static void stm32_rcc_RCC_APB1ENR_write(Stm32Rcc *s, uint32_t new_value,
+static void stm32_rcc_RCC_APB1ENR_write(Stm32f1xxRcc *s, uint32_t new_value,
                                         bool init)
 {
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_PWR,
+                            RCC_APB1ENR_PWREN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_BKP,
+                            RCC_APB1ENR_BKPEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_WWDG,
+                            RCC_APB1ENR_WWDGEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_CAN,
+                            RCC_APB1ENR_CANEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_USB,
+                            RCC_APB1ENR_USBEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_I2C2,
+                            RCC_APB1ENR_I2C2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_I2C1,
+                            RCC_APB1ENR_I2C1EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_UART5,
                             RCC_APB1ENR_USART5EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_UART4,
                             RCC_APB1ENR_USART4EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_SPI3,
+                            RCC_APB1ENR_SPI3EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_I2S3,
+                            RCC_APB1ENR_SPI3EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_SPI2,
+                            RCC_APB1ENR_SPI2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_I2S2,
+                            RCC_APB1ENR_SPI2EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_UART3,
                             RCC_APB1ENR_USART3EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_UART2,
                             RCC_APB1ENR_USART2EN_BIT);
-
-    s->RCC_APB1ENR = new_value & 0x00005e7d;
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM7,
+                            RCC_APB1ENR_TIM7EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM6,
+                            RCC_APB1ENR_TIM6EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM5,
+                            RCC_APB1ENR_TIM5EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM4,
+                            RCC_APB1ENR_TIM4EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM3,
+                            RCC_APB1ENR_TIM3EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F1XX_TIM2,
+                            RCC_APB1ENR_TIM2EN_BIT);
+
+    s->RCC_APB1ENR = new_value & 0x3afec9ff;
 }
 
-static uint32_t stm32_rcc_RCC_BDCR_read(Stm32Rcc *s)
+static uint32_t stm32_rcc_RCC_BDCR_read(Stm32f1xxRcc *s)
 {
     bool lseon = clktree_is_enabled(s->LSECLK);
 
-    return GET_BIT_MASK(RCC_BDCR_LSERDY_BIT, lseon) |
+    return s->RCC_BDCR |
+    GET_BIT_MASK(RCC_BDCR_LSERDY_BIT,
+                 stm32_rcc_startup_ready(&s->lse_startup, s->LSECLK)) |
     GET_BIT_MASK(RCC_BDCR_LSEON_BIT, lseon);
 }
 
-static void stm32_rcc_RCC_BDCR_write(Stm32Rcc *s, uint32_t new_value, bool init)
+/* RCC_BDCR is in the backup domain, so it is only written by software, and
+ * reset at power on and by BDRST, not by a system reset. */
+static void stm32_rcc_RCC_BDCR_write(Stm32f1xxRcc *s, uint32_t new_value, bool init)
 {
-    clktree_set_enabled(s->LSECLK, IS_BIT_SET(new_value, RCC_BDCR_LSEON_BIT));
+    uint32_t rtcsel;
+
+    if(IS_BIT_SET(new_value, RCC_BDCR_BDRST_BIT)) {
+        /* The whole backup domain is held in reset while BDRST is set. */
+        new_value = GET_BIT_MASK_ONE(RCC_BDCR_BDRST_BIT);
+        if(!IS_BIT_SET(s->RCC_BDCR, RCC_BDCR_BDRST_BIT)) {
+            notifier_list_notify(&s->backup_reset_notifiers, NULL);
+        }
+    }
+
+    stm32_rcc_startup_set(&s->lse_startup, s->LSECLK,
+                          IS_BIT_SET(new_value, RCC_BDCR_LSEON_BIT),
+                          qemu_get_clock_ns(vm_clock));
+
+    /* Once selected, the RTC clock only changes after a backup domain
+     * reset. */
+    rtcsel = (s->RCC_BDCR & RCC_BDCR_RTCSEL_MASK) >> RCC_BDCR_RTCSEL_START;
+    if(rtcsel == 0 || IS_BIT_SET(new_value, RCC_BDCR_BDRST_BIT)) {
+        rtcsel = (new_value & RCC_BDCR_RTCSEL_MASK) >> RCC_BDCR_RTCSEL_START;
+    }
+    /* RTCSEL is 1 for LSE, 2 for LSI, 3 for HSE/128 and 0 for no clock. */
+    clktree_set_selected_input(s->PERIPHCLK[STM32F1XX_RTC],
+                               rtcsel ? rtcsel - 1 : CLKTREE_NO_INPUT);
+    clktree_set_enabled(s->PERIPHCLK[STM32F1XX_RTC],
+                        IS_BIT_SET(new_value, RCC_BDCR_RTCEN_BIT));
+
+    s->RCC_BDCR = (new_value & RCC_BDCR_MASK & ~RCC_BDCR_RTCSEL_MASK) |
+                  (rtcsel << RCC_BDCR_RTCSEL_START);
 }
 
 /* Works the same way as stm32_rcc_RCC_CR_read */
-static uint32_t stm32_rcc_RCC_CSR_read(Stm32Rcc *s)
+static uint32_t stm32_rcc_RCC_CSR_read(Stm32f1xxRcc *s)
 {
     bool lseon = clktree_is_enabled(s->LSICLK);
 
@@ -399,17 +577,19 @@ static uint32_t stm32_rcc_RCC_CSR_read(Stm32Rcc *s)
     GET_BIT_MASK(RCC_CSR_LSION_BIT, lseon);
 }
 
-/* Works the same way as stm32_rcc_RCC_CR_write */
-static void stm32_rcc_RCC_CSR_write(Stm32Rcc *s, uint32_t new_value, bool init)
+/* Works the same way as stm32_rcc_RCC_CR_write.  The LSI can not be
+ * turned off while the IWDG runs. */
+static void stm32_rcc_RCC_CSR_write(Stm32f1xxRcc *s, uint32_t new_value, bool init)
 {
-    clktree_set_enabled(s->LSICLK, IS_BIT_SET(new_value, RCC_CSR_LSION_BIT));
+    clktree_set_enabled(s->LSICLK, IS_BIT_SET(new_value, RCC_CSR_LSION_BIT) ||
+                                   s->lsi_forced);
 }
 
 
 
 static uint64_t stm32_rcc_readw(void *opaque, hwaddr offset)
 {
-    Stm32Rcc *s = (Stm32Rcc *)opaque;
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)opaque;
 
     switch (offset) {
         case RCC_CR_OFFSET:
@@ -420,9 +600,10 @@ static uint64_t stm32_rcc_readw(void *opaque, hwaddr offset)
             return 0;
         case RCC_APB2RSTR_OFFSET:
         case RCC_APB1RSTR_OFFSET:
-        case RCC_AHBENR_OFFSET:
             STM32_NOT_IMPL_REG(offset, 4);
             return 0;
+        case RCC_AHBENR_OFFSET:
+            return s->RCC_AHBENR;
         case RCC_APB2ENR_OFFSET:
             return s->RCC_APB2ENR;
         case RCC_APB1ENR_OFFSET:
@@ -447,7 +628,7 @@ static uint64_t stm32_rcc_readw(void *opaque, hwaddr offset)
 static void stm32_rcc_writew(void *opaque, hwaddr offset,
                              uint64_t value)
 {
-    Stm32Rcc *s = (Stm32Rcc *)opaque;
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)opaque;
 
     switch(offset) {
         case RCC_CR_OFFSET:
@@ -461,9 +642,11 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
             break;
         case RCC_APB2RSTR_OFFSET:
         case RCC_APB1RSTR_OFFSET:
-        case RCC_AHBENR_OFFSET:
             STM32_NOT_IMPL_REG(offset, 4);
             break;
+        case RCC_AHBENR_OFFSET:
+            stm32_rcc_RCC_AHBENR_write(s, value, false);
+            break;
         case RCC_APB2ENR_OFFSET:
             stm32_rcc_RCC_APB2ENR_write(s, value, false);
             break;
@@ -491,21 +674,50 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
 static uint64_t stm32_rcc_read(void *opaque, hwaddr offset,
                                unsigned size)
 {
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)opaque;
+    uint64_t value;
+
+    /* Besides on writes, the ready flags (and SWS) only change when an
+     * oscillator or the PLL has started up, so software waiting for them
+     * can sleep until then. */
+    if(offset == RCC_CR_OFFSET || offset == RCC_CFGR_OFFSET ||
+       offset == RCC_BDCR_OFFSET) {
+        stm32_poll_read(&s->poll, offset, stm32_rcc_next_ready(s));
+    } else {
+        stm32_poll_break(&s->poll);
+    }
+
     switch(size) {
         case 4:
-            return stm32_rcc_readw(opaque, offset);
+            value = stm32_rcc_readw(opaque, offset);
+            break;
         default:
             STM32_NOT_IMPL_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_rcc_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_rcc_write(void *opaque, hwaddr offset,
                             uint64_t value, unsigned size)
 {
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)opaque;
+
+    trace_stm32_rcc_write(s, offset, size, value);
+
+    stm32_poll_break(&s->poll);
+
     switch(size) {
         case 4:
+            /* A single write can change several clocks (e.g. the prescalers
+             * in RCC_CFGR), so the peripherals are only told about the end
+             * result. */
+            clktree_begin_update();
             stm32_rcc_writew(opaque, offset, value);
+            clktree_commit();
             break;
         default:
             STM32_NOT_IMPL_REG(offset, size);
@@ -522,21 +734,58 @@ static const MemoryRegionOps stm32_rcc_ops = {
 
 static void stm32_rcc_reset(DeviceState *dev)
 {
-    Stm32Rcc *s = FROM_SYSBUS(Stm32Rcc, SYS_BUS_DEVICE(dev));
+    Stm32f1xxRcc *s = FROM_SYSBUS(Stm32f1xxRcc, SYS_BUS_DEVICE(dev));
 
+    clktree_begin_update();
     stm32_rcc_RCC_CR_write(s, 0x00000083, true);
     stm32_rcc_RCC_CFGR_write(s, 0x00000000, true);
+    stm32_rcc_RCC_AHBENR_write(s, 0x00000014, true);
     stm32_rcc_RCC_APB2ENR_write(s, 0x00000000, true);
     stm32_rcc_RCC_APB1ENR_write(s, 0x00000000, true);
-    stm32_rcc_RCC_BDCR_write(s, 0x00000000, true);
+    s->lsi_forced = false;
     stm32_rcc_RCC_CSR_write(s, 0x0c000000, true);
+    clktree_commit();
+}
+
+void stm32f1xx_rcc_set_stop_mode(Stm32Rcc *rcc, bool stop)
+{
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)rcc;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    clktree_begin_update();
+    if(stop) {
+        stm32_rcc_startup_set(&s->pll_startup, s->PLLCLK, false, now);
+        stm32_rcc_startup_set(&s->hse_startup, s->HSECLK, false, now);
+        clktree_set_enabled(s->HSICLK, false);
+        qemu_del_timer(s->sysclk_timer);
+    } else {
+        clktree_set_enabled(s->HSICLK, true);
+        s->RCC_CFGR_SW = SW_HSI_SELECTED;
+        stm32_rcc_update_sysclk(s);
+    }
+    clktree_commit();
+}
+
+void stm32f1xx_rcc_force_lsi(Stm32Rcc *rcc)
+{
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)rcc;
+
+    s->lsi_forced = true;
+    clktree_set_enabled(s->LSICLK, true);
+}
+
+void stm32f1xx_rcc_add_backup_reset_notifier(Stm32Rcc *rcc, Notifier *notifier)
+{
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)rcc;
+
+    notifier_list_add(&s->backup_reset_notifiers, notifier);
 }
 
 /* IRQ handler to handle updates to the HCLK frequency.
  * This updates the SysTick scales. */
 static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
 {
-    Stm32Rcc *s = (Stm32Rcc *)opaque;
+    Stm32f1xxRcc *s = (Stm32f1xxRcc *)opaque;
 
     uint32_t hclk_freq = 0;
     uint32_t ext_ref_freq = 0;
@@ -553,6 +802,10 @@ static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
          */
         system_clock_scale = get_ticks_per_sec() / hclk_freq;
         external_ref_clock_scale = get_ticks_per_sec() / ext_ref_freq;
+
+        /* The core runs on HCLK too.  Its cycles are rounded the same way
+         * as SysTick's, so that SysTick counts them exactly. */
+        cpu_icount_set_cycle_time(system_clock_scale);
     }
 
 #ifdef DEBUG_STM32_RCC
@@ -570,12 +823,12 @@ static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
 /* DEVICE INITIALIZATION */
 
 /* Set up the clock tree */
-static void stm32_rcc_init_clk(Stm32Rcc *s)
+static void stm32_rcc_init_clk(Stm32f1xxRcc *s)
 {
     int i;
     qemu_irq *hclk_upd_irq =
     qemu_allocate_irqs(stm32_rcc_hclk_upd_irq_handler, s, 1);
-    Clk HSI_DIV2, HSE_DIV2;
+    Clk HSI_DIV2, HSE_DIV2, PLL_DIV2, HSE_DIV128;
 
     /* Make sure all the peripheral clocks are null initially.
      * This will be used for error checking to make sure
@@ -612,6 +865,14 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
     s->SYSCLK = clktree_create_clk("SYSCLK", 1, 1, true, 72000000, CLKTREE_NO_INPUT,
                                    s->HSICLK, s->HSECLK, s->PLLCLK, NULL);
 
+    /* The MCO pin can output SYSCLK, HSI, HSE or PLLCLK/2.  Its GPIO can
+     * not toggle faster than 50 MHz. */
+    PLL_DIV2 = clktree_create_clk("PLLCLK/2", 1, 2, true, CLKTREE_NO_MAX_FREQ, 0,
+                                  s->PLLCLK, NULL);
+    s->MCOCLK = clktree_create_clk("MCO", 1, 1, true, 50000000, CLKTREE_NO_INPUT,
+                                   s->SYSCLK, s->HSICLK, s->HSECLK, PLL_DIV2,
+                                   NULL);
+
     s->HCLK = clktree_create_clk("HCLK", 0, 1, true, 72000000, 0,
                                  s->SYSCLK, NULL);
     clktree_adduser(s->HCLK, hclk_upd_irq[0]);
@@ -620,6 +881,15 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
                                   s->HCLK, NULL);
     s->PCLK2 = clktree_create_clk("PCLK2", 0, 1, true, 72000000, 0,
                                   s->HCLK, NULL);
+    s->TIMCLK1 = clktree_create_clk("TIMCLK1", 1, 1, true, 72000000, 0,
+                                    s->PCLK1, NULL);
+    s->TIMCLK2 = clktree_create_clk("TIMCLK2", 1, 1, true, 72000000, 0,
+                                    s->PCLK2, NULL);
+    /* The ADC clock must not exceed 14 MHz, but ADCPRE is usually only set
+     * up by the code that uses the ADC, so the limit is checked by the ADC
+     * when it is switched on instead of here. */
+    s->ADCCLK = clktree_create_clk("ADCCLK", 1, 2, true, CLKTREE_NO_MAX_FREQ, 0,
+                                   s->PCLK2, NULL);
 
     /* Peripheral clocks */
     s->PERIPHCLK[STM32F1XX_GPIOA] = clktree_create_clk("GPIOA", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
@@ -637,6 +907,51 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
     s->PERIPHCLK[STM32F1XX_UART3] = clktree_create_clk("UART3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32F1XX_UART4] = clktree_create_clk("UART4", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32F1XX_UART5] = clktree_create_clk("UART5", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32F1XX_SPI1] = clktree_create_clk("SPI1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+    s->PERIPHCLK[STM32F1XX_SPI2] = clktree_create_clk("SPI2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_SPI3] = clktree_create_clk("SPI3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    /* The I2S clocks of the high-density parts (the PLL3 source of the
+     * connectivity line is not modelled) */
+    s->PERIPHCLK[STM32F1XX_I2S2] = clktree_create_clk("I2S2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->SYSCLK, NULL);
+    s->PERIPHCLK[STM32F1XX_I2S3] = clktree_create_clk("I2S3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->SYSCLK, NULL);
+
+    s->PERIPHCLK[STM32F1XX_I2C1] = clktree_create_clk("I2C1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_I2C2] = clktree_create_clk("I2C2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32F1XX_PWR] = clktree_create_clk("PWR", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_BKP] = clktree_create_clk("BKP", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_WWDG] = clktree_create_clk("WWDG", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    /* The IWDG has no enable bit: it runs on the LSI, which it turns on
+     * itself when it is started. */
+    s->PERIPHCLK[STM32F1XX_IWDG] = clktree_create_clk("IWDG", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0, s->LSICLK, NULL);
+    s->PERIPHCLK[STM32F1XX_CAN] = clktree_create_clk("CAN", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_USB] = clktree_create_clk("USB", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+
+    s->PERIPHCLK[STM32F1XX_ADC1] = clktree_create_clk("ADC1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->ADCCLK, NULL);
+    s->PERIPHCLK[STM32F1XX_ADC2] = clktree_create_clk("ADC2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->ADCCLK, NULL);
+    s->PERIPHCLK[STM32F1XX_ADC3] = clktree_create_clk("ADC3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->ADCCLK, NULL);
+
+    s->PERIPHCLK[STM32F1XX_TIM1] = clktree_create_clk("TIM1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK2, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM2] = clktree_create_clk("TIM2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM3] = clktree_create_clk("TIM3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM4] = clktree_create_clk("TIM4", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM5] = clktree_create_clk("TIM5", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM6] = clktree_create_clk("TIM6", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM7] = clktree_create_clk("TIM7", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK1, NULL);
+    s->PERIPHCLK[STM32F1XX_TIM8] = clktree_create_clk("TIM8", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->TIMCLK2, NULL);
+
+    s->PERIPHCLK[STM32F1XX_DMA1] = clktree_create_clk("DMA1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F1XX_DMA2] = clktree_create_clk("DMA2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F1XX_FSMC] = clktree_create_clk("FSMC", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F1XX_CRC] = clktree_create_clk("CRC", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+
+    /* RTCCLK, which the RTC counts.  The RTC registers themselves are on
+     * the BKP clock. */
+    HSE_DIV128 = clktree_create_clk("HSE/128", 1, 128, true, CLKTREE_NO_MAX_FREQ, 0,
+                                    s->HSECLK, NULL);
+    s->PERIPHCLK[STM32F1XX_RTC] = clktree_create_clk("RTC", 1, 1, false, CLKTREE_NO_MAX_FREQ, CLKTREE_NO_INPUT,
+                                                     s->LSECLK, s->LSICLK, HSE_DIV128, NULL);
 }
 
 
@@ -646,7 +961,7 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
 
 static int stm32_rcc_init(SysBusDevice *dev)
 {
-    Stm32Rcc *s = FROM_SYSBUS(Stm32Rcc, dev);
+    Stm32f1xxRcc *s = FROM_SYSBUS(Stm32f1xxRcc, dev);
 
     memory_region_init_io(&s->iomem, &stm32_rcc_ops, s,
                           "rcc", 0x1000);
@@ -656,14 +971,59 @@ static int stm32_rcc_init(SysBusDevice *dev)
     sysbus_init_irq(dev, &s->irq);
 
     stm32_rcc_init_clk(s);
+    s->sysclk_timer = qemu_new_timer_ns(vm_clock,
+                                        stm32_rcc_sysclk_timer_expire, s);
+    stm32_poll_init(&s->poll);
+    notifier_list_init(&s->backup_reset_notifiers);
+
+    /* Power on reset of the backup domain */
+    stm32_rcc_RCC_BDCR_write(s, 0x00000000, true);
 
     return 0;
 }
 
 
+/* The clocks are saved by the clock tree itself (see clktree.c), so only
+ * the register fields that are not derived from them are saved here. */
+static const VMStateDescription vmstate_stm32_rcc = {
+    .name = "stm32f1xx_rcc",
+    .version_id = 3,
+    .minimum_version_id = 3,
+    .minimum_version_id_old = 3,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(RCC_AHBENR, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_APB1ENR, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_APB2ENR, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_BDCR, Stm32f1xxRcc),
+        VMSTATE_BOOL(lsi_forced, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_MCO, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PLLMUL, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PLLXTPRE, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PLLSRC, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_ADCPRE, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PPRE1, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PPRE2, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_HPRE, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_SW, Stm32f1xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_SWS, Stm32f1xxRcc),
+        VMSTATE_INT64(hse_startup.ready_time, Stm32f1xxRcc),
+        VMSTATE_INT64(lse_startup.ready_time, Stm32f1xxRcc),
+        VMSTATE_INT64(pll_startup.ready_time, Stm32f1xxRcc),
+        VMSTATE_TIMER(sysclk_timer, Stm32f1xxRcc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+
 static Property stm32_rcc_properties[] = {
-    DEFINE_PROP_UINT32("osc_freq", Stm32Rcc, osc_freq, 0),
-    DEFINE_PROP_UINT32("osc32_freq", Stm32Rcc, osc32_freq, 0),
+    DEFINE_PROP_UINT32("osc_freq", Stm32f1xxRcc, osc_freq, 0),
+    DEFINE_PROP_UINT32("osc32_freq", Stm32f1xxRcc, osc32_freq, 0),
+    DEFINE_PROP_STRING("periph_clk_check", Stm32f1xxRcc, periph_clk_check),
+    DEFINE_PROP_UINT32("hse_startup_us", Stm32f1xxRcc,
+                       hse_startup.startup_us, 0),
+    DEFINE_PROP_UINT32("lse_startup_us", Stm32f1xxRcc,
+                       lse_startup.startup_us, 0),
+    DEFINE_PROP_UINT32("pll_lock_us", Stm32f1xxRcc, pll_startup.startup_us, 0),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -676,12 +1036,13 @@ static void stm32_rcc_class_init(ObjectClass *klass, void *data)
     k->init = stm32_rcc_init;
     dc->reset = stm32_rcc_reset;
     dc->props = stm32_rcc_properties;
+    dc->vmsd = &vmstate_stm32_rcc;
 }
 
 static TypeInfo stm32_rcc_info = {
     .name  = "stm32f1xx_rcc",
-    .parent = TYPE_SYS_BUS_DEVICE,
-    .instance_size  = sizeof(Stm32Rcc),
+    .parent = TYPE_STM32_RCC,
+    .instance_size  = sizeof(Stm32f1xxRcc),
     .class_init = stm32_rcc_class_init
 };
 
@@ -1,45 +1,75 @@
 #include "sysbus.h"
 #include "clktree.h"
 #include "stm32f1xx.h"
+#include "stm32_rcc.h"
 
-struct Stm32Rcc {
+typedef struct Stm32f1xxRcc {
     /* Inherited */
-    SysBusDevice busdev;
+    union {
+        Stm32Rcc inherited;
+        struct {
+            /* Inherited */
+            SysBusDevice busdev;
 
-    /* Properties */
-    uint32_t osc_freq;
-    uint32_t osc32_freq;
+            /* Properties */
+            uint32_t osc_freq;
+            uint32_t osc32_freq;
+            char *periph_clk_check;
 
-    /* Private */
-    MemoryRegion iomem;
+            /* Private */
+            MemoryRegion iomem;
+            qemu_irq irq;
+        };
+    };
+
+    /* Peripheral clocks */
+    Clk PERIPHCLK[STM32F1XX_PERIPH_COUNT], // MUST be first field after `inherited`, because Stm32Rcc's last field aliases this array
+    HSICLK,
+    HSECLK,
+    LSECLK,
+    LSICLK,
+    SYSCLK,
+    PLLXTPRECLK,
+    PLLCLK,
+    HCLK, /* Output from AHB Prescaler */
+    PCLK1, /* Output from APB1 Prescaler */
+    PCLK2, /* Output from APB2 Prescaler */
+    TIMCLK1, /* APB1 timer clock (twice PCLK1 unless APB1 is undivided) */
+    TIMCLK2, /* APB2 timer clock (twice PCLK2 unless APB2 is undivided) */
+    ADCCLK, /* Output from ADC Prescaler */
+    MCOCLK; /* Microcontroller clock output */
 
     /* Register Values */
     uint32_t
+    RCC_AHBENR,
     RCC_APB1ENR,
-    RCC_APB2ENR;
+    RCC_APB2ENR,
+    RCC_BDCR; /* The bits that are not derived from the clocks */
 
     /* Register Field Values */
     uint32_t
+    RCC_CFGR_MCO,
     RCC_CFGR_PLLMUL,
     RCC_CFGR_PLLXTPRE,
     RCC_CFGR_PLLSRC,
+    RCC_CFGR_ADCPRE,
     RCC_CFGR_PPRE1,
     RCC_CFGR_PPRE2,
     RCC_CFGR_HPRE,
-    RCC_CFGR_SW;
+    RCC_CFGR_SW,
+    RCC_CFGR_SWS;
 
-    Clk
-    HSICLK,
-    HSECLK,
-    LSECLK,
-    LSICLK,
-    SYSCLK,
-    PLLXTPRECLK,
-    PLLCLK,
-    HCLK, /* Output from AHB Prescaler */
-    PCLK1, /* Output from APB1 Prescaler */
-    PCLK2, /* Output from APB2 Prescaler */
-    PERIPHCLK[STM32F1XX_PERIPH_COUNT];
+    /* Oscillator and PLL start-up times (properties) and ready times */
+    Stm32RccStartup hse_startup, lse_startup, pll_startup;
+    /* Switches SYSCLK once the source selected by SW is ready */
+    QEMUTimer *sysclk_timer;
+
+    /* Detects software spinning on the ready flags */
+    Stm32Poll poll;
+
+    /* The IWDG keeps the LSI on until the next system reset */
+    bool lsi_forced;
 
-    qemu_irq irq;
-};
+    /* Told when software resets the backup domain with BDRST */
+    NotifierList backup_reset_notifiers;
+} Stm32f1xxRcc;
@@ -22,21 +22,175 @@
 #include "stm32.h"
 #include "stm32f2xx.h"
 #include "exec/address-spaces.h"
+#include "sysemu/blockdev.h"
+#include "char/char.h"
 #include "exec/memory.h"
+#include "net/net.h"
+#include "qemu/config-file.h"
+#include "qemu/rng.h"
 
-/* Init STM32F2XX CPU and memory.
- flash_size and sram_size are in kb. */
+static const char *stm32f2xx_periph_name_arr[] = {
+    ENUM_STRING(STM32F2XX_RCC),
+    ENUM_STRING(STM32F2XX_GPIOA),
+    ENUM_STRING(STM32F2XX_GPIOB),
+    ENUM_STRING(STM32F2XX_GPIOC),
+    ENUM_STRING(STM32F2XX_GPIOD),
+    ENUM_STRING(STM32F2XX_GPIOE),
+    ENUM_STRING(STM32F2XX_GPIOF),
+    ENUM_STRING(STM32F2XX_GPIOG),
+    ENUM_STRING(STM32F2XX_GPIOH),
+    ENUM_STRING(STM32F2XX_GPIOI),
+    ENUM_STRING(STM32F2XX_SYSCFG),
+    ENUM_STRING(STM32F2XX_UART1),
+    ENUM_STRING(STM32F2XX_UART2),
+    ENUM_STRING(STM32F2XX_UART3),
+    ENUM_STRING(STM32F2XX_UART4),
+    ENUM_STRING(STM32F2XX_UART5),
+    ENUM_STRING(STM32F2XX_UART6),
+    ENUM_STRING(STM32F2XX_ADC1),
+    ENUM_STRING(STM32F2XX_ADC2),
+    ENUM_STRING(STM32F2XX_ADC3),
+    ENUM_STRING(STM32F2XX_DAC),
+    ENUM_STRING(STM32F2XX_TIM1),
+    ENUM_STRING(STM32F2XX_TIM2),
+    ENUM_STRING(STM32F2XX_TIM3),
+    ENUM_STRING(STM32F2XX_TIM4),
+    ENUM_STRING(STM32F2XX_TIM5),
+    ENUM_STRING(STM32F2XX_TIM6),
+    ENUM_STRING(STM32F2XX_TIM7),
+    ENUM_STRING(STM32F2XX_TIM8),
+    ENUM_STRING(STM32F2XX_TIM9),
+    ENUM_STRING(STM32F2XX_TIM10),
+    ENUM_STRING(STM32F2XX_TIM11),
+    ENUM_STRING(STM32F2XX_BKP),
+    ENUM_STRING(STM32F2XX_PWR),
+    ENUM_STRING(STM32F2XX_I2C1),
+    ENUM_STRING(STM32F2XX_I2C2),
+    ENUM_STRING(STM32F2XX_I2S2),
+    ENUM_STRING(STM32F2XX_I2S3),
+    ENUM_STRING(STM32F2XX_WWDG),
+    ENUM_STRING(STM32F2XX_CAN1),
+    ENUM_STRING(STM32F2XX_CAN2),
+    ENUM_STRING(STM32F2XX_CAN),
+    ENUM_STRING(STM32F2XX_USB),
+    ENUM_STRING(STM32F2XX_SPI1),
+    ENUM_STRING(STM32F2XX_SPI2),
+    ENUM_STRING(STM32F2XX_SPI3),
+    ENUM_STRING(STM32F2XX_EXTI),
+    ENUM_STRING(STM32F2XX_SDIO),
+    ENUM_STRING(STM32F2XX_FSMC),
+    ENUM_STRING(STM32F2XX_DMA1),
+    ENUM_STRING(STM32F2XX_DMA2),
+    ENUM_STRING(STM32F2XX_ETH),
+    ENUM_STRING(STM32F2XX_CRYP),
+    ENUM_STRING(STM32F2XX_HASH),
+    ENUM_STRING(STM32F2XX_RNG),
+    ENUM_STRING(STM32F2XX_OTG_FS),
+    ENUM_STRING(STM32F2XX_OTG_HS),
+    ENUM_STRING(STM32F2XX_PERIPH_COUNT),
+};
 
-static uint64_t kernel_load_translate_fn(void *opaque, uint64_t from_addr) {
-    if (from_addr == STM32_FLASH_ADDR_START) {
-        return 0x00000000;
+/* Every STM32F205/F207 has all the peripherals that are emulated, but for
+ * the Ethernet MAC, which only the F207 has (it also adds the camera
+ * interface), and the cryptographic processor and hash processor, which
+ * only the F215/F217 have.  The parts differ in their memory sizes (the
+ * packages with fewer pins also leave out GPIO pins, but not the ports). */
+#define STM32F217_PERIPHS (~0ULL)
+#define STM32F215_PERIPHS (STM32F217_PERIPHS & ~STM32_PERIPH_BIT(STM32F2XX_ETH))
+#define STM32F207_PERIPHS (STM32F217_PERIPHS & \
+                           ~(STM32_PERIPH_BIT(STM32F2XX_CRYP) | \
+                             STM32_PERIPH_BIT(STM32F2XX_HASH)))
+#define STM32F205_PERIPHS (STM32F207_PERIPHS & ~STM32_PERIPH_BIT(STM32F2XX_ETH))
+
+const Stm32Part stm32f2xx_parts[] = {
+    /* What stm32-p205 has always emulated, which is the STM32F205RG on the
+     * board. */
+    {"STM32F205RG", 1024, 128, 9, STM32F205_PERIPHS},
+    {"STM32F205RB",  128,  64, 9, STM32F205_PERIPHS},
+    {"STM32F205RC",  256,  96, 9, STM32F205_PERIPHS},
+    {"STM32F205RE",  512, 128, 9, STM32F205_PERIPHS},
+    {"STM32F205RF",  768, 128, 9, STM32F205_PERIPHS},
+    {"STM32F205VG", 1024, 128, 9, STM32F205_PERIPHS},
+    {"STM32F205ZG", 1024, 128, 9, STM32F205_PERIPHS},
+    {"STM32F207VG", 1024, 128, 9, STM32F207_PERIPHS},
+    {"STM32F207ZG", 1024, 128, 9, STM32F207_PERIPHS},
+    {"STM32F207IG", 1024, 128, 9, STM32F207_PERIPHS},
+    {"STM32F215RG", 1024, 128, 9, STM32F215_PERIPHS},
+    {"STM32F215VG", 1024, 128, 9, STM32F215_PERIPHS},
+    {"STM32F215ZG", 1024, 128, 9, STM32F215_PERIPHS},
+    {"STM32F217VG", 1024, 128, 9, STM32F217_PERIPHS},
+    {"STM32F217ZG", 1024, 128, 9, STM32F217_PERIPHS},
+    {"STM32F217IG", 1024, 128, 9, STM32F217_PERIPHS},
+    {NULL}
+};
+
+
+/* Gets the DMA input for a peripheral request that is mapped to one or two
+ * streams (req[1] is -1 if there is only one). */
+static qemu_irq stm32f2xx_dma_req_irq(DeviceState *dma_dev, const int8_t req[2])
+{
+    qemu_irq irq = qdev_get_gpio_in(dma_dev, req[0]);
+
+    if (req[1] >= 0) {
+        irq = qemu_irq_split(irq, qdev_get_gpio_in(dma_dev, req[1]));
     }
-    return from_addr;
+    return irq;
 }
 
+/* ORs the interrupt lines of peripherals that share an NVIC input. */
+typedef struct {
+    qemu_irq out;
+    uint32_t levels;
+} Stm32f2xxIrqOr;
+
+static void stm32f2xx_irq_or_handler(void *opaque, int n, int level)
+{
+    Stm32f2xxIrqOr *s = (Stm32f2xxIrqOr *)opaque;
+
+    CHANGE_BIT(s->levels, n, level);
+    qemu_set_irq(s->out, s->levels != 0);
+}
+
+static qemu_irq *stm32f2xx_irq_or(qemu_irq out, int n)
+{
+    Stm32f2xxIrqOr *s = g_new0(Stm32f2xxIrqOr, 1);
+
+    s->out = out;
+    return qemu_allocate_irqs(stm32f2xx_irq_or_handler, s, n);
+}
+
+/* Gets the RNG backend given by the "rng" machine option, which is the id of
+ * an -object, or NULL for the default one. */
+static Object *stm32f2xx_find_rng(QemuOpts *machine_opts)
+{
+    const char *id = machine_opts ? qemu_opt_get(machine_opts, "rng") : NULL;
+    Object *obj;
+
+    if (!id) {
+        return NULL;
+    }
+    obj = object_resolve_path_component(
+              container_get(object_get_root(), "/objects"), id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_RNG_BACKEND)) {
+        fprintf(stderr, "rng: no RNG backend object with id '%s'\n", id);
+        exit(1);
+    }
+    return obj;
+}
+
+/* The CPU fetches its vector table through the boot alias at reset, so the
+ * SYSCFG has to select it first.  Reset handlers run in registration order and
+ * the bus reset that would otherwise reset the SYSCFG comes after the CPU's. */
+static void stm32f2xx_boot_reset(void *opaque)
+{
+    device_reset(DEVICE(opaque));
+}
+
+/* Init STM32F2XX CPU and memory. */
+
 void stm32f2xx_init(
-            ram_addr_t flash_size,
-            ram_addr_t ram_size,
+            const Stm32Part *part,
+            const char *cpu_model,
             const char *kernel_filename,
             Stm32Gpio **stm32_gpio,
             Stm32Uart **stm32_uart,
@@ -45,35 +199,87 @@ void stm32f2xx_init(
 {
     MemoryRegion *address_space_mem = get_system_memory();
     qemu_irq *pic;
+    DriveInfo *flash_dinfo;
     int i;
 
-    pic = armv7m_translated_init(address_space_mem, flash_size, ram_size, kernel_filename, kernel_load_translate_fn, NULL, "cortex-m3");
+    // The flash lives at 0x08000000.  What is aliased at 0x00000000 is
+    // chosen by the BOOT pins and SYSCFG_MEMRMP, see stm32f2xx_syscfg.c:
+    DeviceState *flash_dev = qdev_create(NULL, "stm32_flash");
+    qdev_prop_set_uint32(flash_dev, "size", part->flash_size * 1024);
+    flash_dinfo = drive_get(IF_PFLASH, 0, 0);
+    if (flash_dinfo) {
+        qdev_prop_set_drive_nofail(flash_dev, "drive", flash_dinfo->bdrv);
+    } else if (stm32_flash_map_kernel(flash_dev, kernel_filename)) {
+        kernel_filename = NULL;
+    }
+    qdev_init_nofail(flash_dev);
+    sysbus_mmio_map_to(SYS_BUS_DEVICE(flash_dev), 0, address_space_mem, STM32_FLASH_ADDR_START);
+
+    // The system memory holds ST's bootloader, which is not emulated, so
+    // booting from it only makes sense for a user supplied image:
+    MemoryRegion *system_mem = g_new(MemoryRegion, 1);
+    memory_region_init_ram(system_mem, "stm32f2xx.system", STM32F2XX_SYSTEM_MEMORY_SIZE);
+    vmstate_register_ram_global(system_mem);
+    memory_region_set_readonly(system_mem, true);
+    memory_region_add_subregion(address_space_mem, STM32F2XX_SYSTEM_MEMORY_ADDR, system_mem);
+
+    // One alias per SYSCFG_MEMRMP mode, all at 0x00000000 and only one of
+    // them enabled.  SRAM and FSMC are aliased through the system memory
+    // region, as the SRAM is created by armv7m and FSMC is not emulated:
+    uint64_t boot_size = part->flash_size * 1024;
+    MemoryRegion *boot_container = g_new(MemoryRegion, 1);
+    MemoryRegion *boot_alias = g_new(MemoryRegion, STM32F2XX_MEM_MODE_COUNT);
+    memory_region_init(boot_container, "stm32f2xx.boot", boot_size);
+    memory_region_init_alias(&boot_alias[STM32F2XX_MEM_MODE_FLASH], "stm32f2xx.boot.flash",
+            sysbus_mmio_get_region(SYS_BUS_DEVICE(flash_dev), 0), 0, boot_size);
+    memory_region_init_alias(&boot_alias[STM32F2XX_MEM_MODE_SYSTEM], "stm32f2xx.boot.system",
+            system_mem, 0, STM32F2XX_SYSTEM_MEMORY_SIZE);
+    memory_region_init_alias(&boot_alias[STM32F2XX_MEM_MODE_FSMC], "stm32f2xx.boot.fsmc",
+            address_space_mem, STM32F2XX_FSMC_BANK1_ADDR, boot_size);
+    memory_region_init_alias(&boot_alias[STM32F2XX_MEM_MODE_SRAM], "stm32f2xx.boot.sram",
+            address_space_mem, STM32F2XX_SRAM_ADDR, MIN(boot_size, part->ram_size * 1024));
+    for (i = 0; i < STM32F2XX_MEM_MODE_COUNT; i++) {
+        memory_region_set_enabled(&boot_alias[i], i == STM32F2XX_MEM_MODE_FLASH);
+        memory_region_add_subregion(boot_container, 0, &boot_alias[i]);
+    }
 
-    // Create alias at 0x08000000 for internal flash, that is hard-coded at 0x00000000 in armv7m.c:
-    // TODO: Let BOOT0 and BOOT1 configuration pins determine what is mapped at 0x00000000, see SYSCFG_MEMRMP.
-    MemoryRegionSection mrs = memory_region_find(address_space_mem, 0, WORD_ACCESS_SIZE);
-    MemoryRegion *flash_alias = g_new(MemoryRegion, 1);
-    memory_region_init_alias(flash_alias, "stm32f2xx.flash.alias", mrs.mr, 0, flash_size * 1024);
-    memory_region_add_subregion(address_space_mem, STM32_FLASH_ADDR_START, flash_alias);
+    DeviceState *syscfg_dev = qdev_create(NULL, "stm32f2xx_syscfg");
+    qemu_register_reset(stm32f2xx_boot_reset, syscfg_dev);
+
+    pic = armv7m_translated_init(address_space_mem, part->flash_size, part->ram_size, kernel_filename, NULL, NULL, boot_container, cpu_model);
 
     DeviceState *rcc_dev = qdev_create(NULL, "stm32f2xx_rcc");
     qdev_prop_set_uint32(rcc_dev, "osc_freq", osc_freq);
     qdev_prop_set_uint32(rcc_dev, "osc32_freq", osc32_freq);
-    stm32_init_periph(rcc_dev, STM32F2XX_RCC, 0x40023800, pic[STM32_RCC_IRQ]);
+    stm32_init_periph(address_space_mem, rcc_dev, STM32F2XX_RCC, 0x40023800, pic[STM32_RCC_IRQ]);
 
     DeviceState **gpio_dev = (DeviceState **)g_malloc0(sizeof(DeviceState *) * STM32F2XX_GPIO_COUNT);
-    for(i = 0; i < STM32F2XX_GPIO_COUNT; i++) {
+    for(i = 0; i < part->gpio_count; i++) {
         stm32_periph_t periph = STM32F2XX_GPIOA + i;
-        gpio_dev[i] = qdev_create(NULL, "stm32_gpio");
+        gpio_dev[i] = qdev_create(NULL, "stm32f2xx_gpio");
+        gpio_dev[i]->id = stm32f2xx_periph_name_arr[periph];
         qdev_prop_set_int32(gpio_dev[i], "periph", periph);
-        qdev_prop_set_ptr(gpio_dev[i], "stm32_rcc", rcc_dev);
-        stm32_init_periph(gpio_dev[i], periph, 0x40020000 + (i * 0x400), NULL);
+        stm32_prop_set_link(gpio_dev[i], "stm32_rcc", rcc_dev);
+        stm32_init_periph(address_space_mem, gpio_dev[i], periph, 0x40020000 + (i * 0x400), NULL);
+    }
+    for(i = 0; i < STM32F2XX_GPIO_COUNT; i++) {
         stm32_gpio[i] = (Stm32Gpio *)gpio_dev[i];
     }
 
+    // Stream pin changes to an external harness if "-chardev ...,id=stm32-pinbus" was given:
+    CharDriverState *pinbus_chr = qemu_chr_find("stm32-pinbus");
+    if (pinbus_chr) {
+        DeviceState *pinbus_dev = qdev_create(NULL, "stm32_pinbus");
+        qdev_prop_set_chr(pinbus_dev, "chardev", pinbus_chr);
+        qdev_prop_set_ptr(pinbus_dev, "stm32_gpio", gpio_dev);
+        qdev_prop_set_uint32(pinbus_dev, "gpio_count", part->gpio_count);
+        qdev_init_nofail(pinbus_dev);
+    }
+
     DeviceState *exti_dev = qdev_create(NULL, "stm32_exti");
     qdev_prop_set_ptr(exti_dev, "stm32_gpio", gpio_dev);
-    stm32_init_periph(exti_dev, STM32F2XX_EXTI, 0x40013C00, NULL);
+    qdev_prop_set_uint32(exti_dev, "gpio_count", part->gpio_count);
+    stm32_init_periph(address_space_mem, exti_dev, STM32F2XX_EXTI, 0x40013C00, NULL);
     SysBusDevice *exti_busdev = SYS_BUS_DEVICE(exti_dev);
     sysbus_connect_irq(exti_busdev, 0, pic[STM32_EXTI0_IRQ]);
     sysbus_connect_irq(exti_busdev, 1, pic[STM32_EXTI1_IRQ]);
@@ -86,17 +292,209 @@ void stm32f2xx_init(
     sysbus_connect_irq(exti_busdev, 8, pic[STM32_RTCAlarm_IRQ]);
     sysbus_connect_irq(exti_busdev, 9, pic[STM32_OTG_FS_WKUP_IRQ]);
 
-    DeviceState *syscfg_dev = qdev_create(NULL, "stm32f2xx_syscfg");
-    qdev_prop_set_ptr(syscfg_dev, "stm32_rcc", rcc_dev);
-    qdev_prop_set_ptr(syscfg_dev, "stm32_exti", exti_dev);
-    qdev_prop_set_bit(syscfg_dev, "boot0", 0);
-    qdev_prop_set_bit(syscfg_dev, "boot1", 0);
-    stm32_init_periph(syscfg_dev, STM32F2XX_SYSCFG, 0x40013800, NULL);
-
-//    stm32_uart[STM32_UART1_INDEX] = stm32_create_uart_dev(STM32_UART1, rcc_dev, gpio_dev, afio_dev, 0x40011000, pic[STM32_UART1_IRQ]);
-//    stm32_uart[STM32_UART2_INDEX] = stm32_create_uart_dev(STM32_UART2, rcc_dev, gpio_dev, afio_dev, 0x40004400, pic[STM32_UART2_IRQ]);
-//    stm32_uart[STM32_UART3_INDEX] = stm32_create_uart_dev(STM32_UART3, rcc_dev, gpio_dev, afio_dev, 0x40004800, pic[STM32_UART3_IRQ]);
-//    stm32_uart[STM32_UART4_INDEX] = stm32_create_uart_dev(STM32_UART4, rcc_dev, gpio_dev, afio_dev, 0x40004C00, pic[STM32_UART4_IRQ]);
-//    stm32_uart[STM32_UART5_INDEX] = stm32_create_uart_dev(STM32_UART5, rcc_dev, gpio_dev, afio_dev, 0x40005000, pic[STM32_UART5_IRQ]);
-//    stm32_uart[STM32_UART6_INDEX] = stm32_create_uart_dev(STM32_UART6, rcc_dev, gpio_dev, afio_dev, 0x40011400, pic[STM32_UART6_IRQ]);
+    stm32_prop_set_link(syscfg_dev, "stm32_rcc", rcc_dev);
+    stm32_prop_set_link(syscfg_dev, "stm32_exti", exti_dev);
+    qdev_prop_set_ptr(syscfg_dev, "boot_alias", boot_alias);
+    stm32_init_periph(address_space_mem, syscfg_dev, STM32F2XX_SYSCFG, 0x40013800, NULL);
+
+    // Create DMA controllers:
+    struct {
+        const char *name;
+        uint32_t addr;
+        uint8_t irq_idx[8];
+    } const dma_desc[] = {
+        {"DMA1", 0x40026000, {STM32_DMA1_STREAM0_IRQ, STM32_DMA1_STREAM1_IRQ,
+                              STM32_DMA1_STREAM2_IRQ, STM32_DMA1_STREAM3_IRQ,
+                              STM32_DMA1_STREAM4_IRQ, STM32_DMA1_STREAM5_IRQ,
+                              STM32_DMA1_STREAM6_IRQ, STM32_DMA1_STREAM7_IRQ}},
+        {"DMA2", 0x40026400, {STM32_DMA2_STREAM0_IRQ, STM32_DMA2_STREAM1_IRQ,
+                              STM32_DMA2_STREAM2_IRQ, STM32_DMA2_STREAM3_IRQ,
+                              STM32_DMA2_STREAM4_IRQ, STM32_DMA2_STREAM5_IRQ,
+                              STM32_DMA2_STREAM6_IRQ, STM32_DMA2_STREAM7_IRQ}},
+    };
+    DeviceState *dma_dev[ARRAY_LENGTH(dma_desc)];
+    for (i = 0; i < ARRAY_LENGTH(dma_desc); i++) {
+        const stm32_periph_t periph = STM32F2XX_DMA1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            dma_dev[i] = NULL;
+            continue;
+        }
+        dma_dev[i] = qdev_create(NULL, "stm32f2xx_dma");
+        dma_dev[i]->id = dma_desc[i].name;
+        qdev_prop_set_int32(dma_dev[i], "periph", periph);
+        stm32_prop_set_link(dma_dev[i], "stm32_rcc", rcc_dev);
+        stm32_init_periph(address_space_mem, dma_dev[i], periph, dma_desc[i].addr, NULL);
+        for (int j = 0; j < ARRAY_LENGTH(dma_desc[i].irq_idx); j++) {
+            sysbus_connect_irq(SYS_BUS_DEVICE(dma_dev[i]), j, pic[dma_desc[i].irq_idx[j]]);
+        }
+    }
+
+    // Create UARTs.  The DMA request mapping is from RM0033 tables 22 and 23.
+    // A request that can be served by two streams is wired to both:
+    struct {
+        uint32_t addr;
+        uint8_t irq_idx;
+        uint8_t dma_idx;
+        // STM32F2XX_DMA_REQ() numbers, or -1 for none
+        int8_t dma_rx_req[2];
+        int8_t dma_tx_req[2];
+    } const uart_desc[] = {
+        {0x40011000, STM32_UART1_IRQ, 1,
+         {STM32F2XX_DMA_REQ(2, 4), STM32F2XX_DMA_REQ(5, 4)},
+         {STM32F2XX_DMA_REQ(7, 4), -1}},
+        {0x40004400, STM32_UART2_IRQ, 0,
+         {STM32F2XX_DMA_REQ(5, 4), -1},
+         {STM32F2XX_DMA_REQ(6, 4), -1}},
+        {0x40004800, STM32_UART3_IRQ, 0,
+         {STM32F2XX_DMA_REQ(1, 4), -1},
+         {STM32F2XX_DMA_REQ(3, 4), STM32F2XX_DMA_REQ(4, 7)}},
+        {0x40004c00, STM32_UART4_IRQ, 0,
+         {STM32F2XX_DMA_REQ(2, 4), -1},
+         {STM32F2XX_DMA_REQ(4, 4), -1}},
+        {0x40005000, STM32_UART5_IRQ, 0,
+         {STM32F2XX_DMA_REQ(0, 4), -1},
+         {STM32F2XX_DMA_REQ(7, 4), -1}},
+        {0x40011400, STM32_UART6_IRQ, 1,
+         {STM32F2XX_DMA_REQ(1, 5), STM32F2XX_DMA_REQ(2, 5)},
+         {STM32F2XX_DMA_REQ(6, 5), STM32F2XX_DMA_REQ(7, 5)}},
+    };
+    for (i = 0; i < ARRAY_LENGTH(uart_desc); ++i) {
+        const stm32_periph_t periph = STM32F2XX_UART1 + i;
+        if (!STM32_PART_HAS(part, periph)) {
+            stm32_uart[i] = NULL;
+            continue;
+        }
+        DeviceState *uart_dev = qdev_create(NULL, "stm32_uart");
+        uart_dev->id = stm32f2xx_periph_name_arr[periph];
+        qdev_prop_set_int32(uart_dev, "periph", periph);
+        stm32_prop_set_link(uart_dev, "stm32_rcc", rcc_dev);
+        qdev_prop_set_ptr(uart_dev, "stm32_gpio", gpio_dev);
+        stm32_init_periph(address_space_mem, uart_dev, periph, uart_desc[i].addr, pic[uart_desc[i].irq_idx]);
+        if (dma_dev[uart_desc[i].dma_idx]) {
+            qdev_connect_gpio_out(uart_dev, STM32_UART_DMA_RX_REQ,
+                    stm32f2xx_dma_req_irq(dma_dev[uart_desc[i].dma_idx],
+                                          uart_desc[i].dma_rx_req));
+            qdev_connect_gpio_out(uart_dev, STM32_UART_DMA_TX_REQ,
+                    stm32f2xx_dma_req_irq(dma_dev[uart_desc[i].dma_idx],
+                                          uart_desc[i].dma_tx_req));
+        }
+        stm32_uart[i] = (Stm32Uart *)uart_dev;
+    }
+
+    // The Ethernet MAC uses the first NIC, "-net nic,model=stm32_eth":
+    if (STM32_PART_HAS(part, STM32F2XX_ETH)) {
+        DeviceState *eth_dev = qdev_create(NULL, "stm32_eth");
+        eth_dev->id = stm32f2xx_periph_name_arr[STM32F2XX_ETH];
+        qdev_prop_set_int32(eth_dev, "periph", STM32F2XX_ETH);
+        stm32_prop_set_link(eth_dev, "stm32_rcc", rcc_dev);
+        if (nd_table[0].used) {
+            qemu_check_nic_model(&nd_table[0], "stm32_eth");
+            qdev_set_nic_properties(eth_dev, &nd_table[0]);
+        }
+        stm32_init_periph(address_space_mem, eth_dev, STM32F2XX_ETH, 0x40028000, pic[STM32_ETH_IRQ]);
+    }
+
+    // The SDIO drives the card of the first SD drive ("-sd").  Its request
+    // is mapped to DMA2 stream 3 or 6, channel 4:
+    if (STM32_PART_HAS(part, STM32F2XX_SDIO)) {
+        const int8_t sdio_dma_req[2] = {STM32F2XX_DMA_REQ(3, 4),
+                                        STM32F2XX_DMA_REQ(6, 4)};
+        DeviceState *sdio_dev = qdev_create(NULL, "stm32_sdio");
+        sdio_dev->id = stm32f2xx_periph_name_arr[STM32F2XX_SDIO];
+        qdev_prop_set_int32(sdio_dev, "periph", STM32F2XX_SDIO);
+        stm32_prop_set_link(sdio_dev, "stm32_rcc", rcc_dev);
+        if (dma_dev[1]) {
+            stm32_prop_set_link(sdio_dev, "stm32f2xx_dma", dma_dev[1]);
+            qdev_prop_set_int32(sdio_dev, "dma_req0", sdio_dma_req[0]);
+            qdev_prop_set_int32(sdio_dev, "dma_req1", sdio_dma_req[1]);
+        }
+        stm32_init_periph(address_space_mem, sdio_dev, STM32F2XX_SDIO, 0x40012c00, pic[STM32_SDIO_IRQ]);
+        if (dma_dev[1]) {
+            qdev_connect_gpio_out(sdio_dev, 0,
+                    stm32f2xx_dma_req_irq(dma_dev[1], sdio_dma_req));
+        }
+    }
+
+    // CRYP_OUT and CRYP_IN are mapped to DMA2 streams 5 and 6, HASH_IN to
+    // stream 7, all on channel 2:
+    if (STM32_PART_HAS(part, STM32F2XX_CRYP)) {
+        DeviceState *cryp_dev = qdev_create(NULL, "stm32_cryp");
+        cryp_dev->id = stm32f2xx_periph_name_arr[STM32F2XX_CRYP];
+        qdev_prop_set_int32(cryp_dev, "periph", STM32F2XX_CRYP);
+        stm32_prop_set_link(cryp_dev, "stm32_rcc", rcc_dev);
+        if (dma_dev[1]) {
+            stm32_prop_set_link(cryp_dev, "stm32f2xx_dma", dma_dev[1]);
+            qdev_prop_set_int32(cryp_dev, "dma_req_in", STM32F2XX_DMA_REQ(6, 2));
+            qdev_prop_set_int32(cryp_dev, "dma_req_out", STM32F2XX_DMA_REQ(5, 2));
+        }
+        stm32_init_periph(address_space_mem, cryp_dev, STM32F2XX_CRYP, 0x50060000, pic[STM32_CRYP_IRQ]);
+        if (dma_dev[1]) {
+            qdev_connect_gpio_out(cryp_dev, STM32_CRYP_DMA_IN_REQ,
+                    qdev_get_gpio_in(dma_dev[1], STM32F2XX_DMA_REQ(6, 2)));
+            qdev_connect_gpio_out(cryp_dev, STM32_CRYP_DMA_OUT_REQ,
+                    qdev_get_gpio_in(dma_dev[1], STM32F2XX_DMA_REQ(5, 2)));
+        }
+    }
+    qemu_irq *hash_rng_irq = stm32f2xx_irq_or(pic[STM32_HASH_RNG_IRQ], 2);
+    if (STM32_PART_HAS(part, STM32F2XX_HASH)) {
+        DeviceState *hash_dev = qdev_create(NULL, "stm32_hash");
+        hash_dev->id = stm32f2xx_periph_name_arr[STM32F2XX_HASH];
+        qdev_prop_set_int32(hash_dev, "periph", STM32F2XX_HASH);
+        stm32_prop_set_link(hash_dev, "stm32_rcc", rcc_dev);
+        if (dma_dev[1]) {
+            stm32_prop_set_link(hash_dev, "stm32f2xx_dma", dma_dev[1]);
+            qdev_prop_set_int32(hash_dev, "dma_req", STM32F2XX_DMA_REQ(7, 2));
+        }
+        stm32_init_periph(address_space_mem, hash_dev, STM32F2XX_HASH, 0x50060400, hash_rng_irq[0]);
+        if (dma_dev[1]) {
+            qdev_connect_gpio_out(hash_dev, 0,
+                    qdev_get_gpio_in(dma_dev[1], STM32F2XX_DMA_REQ(7, 2)));
+        }
+    }
+    if (STM32_PART_HAS(part, STM32F2XX_RNG)) {
+        QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+        Object *rng = stm32f2xx_find_rng(machine_opts);
+        DeviceState *rng_dev = qdev_create(NULL, "stm32_rng");
+        rng_dev->id = stm32f2xx_periph_name_arr[STM32F2XX_RNG];
+        qdev_prop_set_int32(rng_dev, "periph", STM32F2XX_RNG);
+        stm32_prop_set_link(rng_dev, "stm32_rcc", rcc_dev);
+        if (rng) {
+            object_property_set_link(OBJECT(rng_dev), rng, "rng", NULL);
+        }
+        if (machine_opts && qemu_opt_get(machine_opts, "rng-seed")) {
+            qdev_prop_set_bit(rng_dev, "seeded", true);
+            qdev_prop_set_uint64(rng_dev, "seed",
+                    qemu_opt_get_number(machine_opts, "rng-seed", 0));
+        }
+        stm32_init_periph(address_space_mem, rng_dev, STM32F2XX_RNG, 0x50060800, hash_rng_irq[1]);
+    }
+
+    // USB OTG FS and HS: in host mode, devices are plugged into their buses,
+    // e.g. "-device usb-storage,bus=STM32F2XX_OTG_FS.0,drive=...".  In
+    // device mode the USB host talks to them through "-chardev
+    // ...,id=stm32-otg-fs" and "-chardev ...,id=stm32-otg-hs".
+    static const struct {
+        stm32_periph_t periph;
+        hwaddr addr;
+        int irq;
+        const char *chr_id;
+    } otg_desc[] = {
+        {STM32F2XX_OTG_FS, 0x50000000, STM32_OTG_FS_IRQ, "stm32-otg-fs"},
+        {STM32F2XX_OTG_HS, 0x40040000, STM32_OTG_HS_IRQ, "stm32-otg-hs"},
+    };
+    for (i = 0; i < ARRAY_LENGTH(otg_desc); ++i) {
+        const stm32_periph_t periph = otg_desc[i].periph;
+        if (STM32_PART_HAS(part, periph)) {
+            CharDriverState *otg_chr = qemu_chr_find(otg_desc[i].chr_id);
+            DeviceState *otg_dev = qdev_create(NULL, "stm32_otg");
+            otg_dev->id = stm32f2xx_periph_name_arr[periph];
+            qdev_prop_set_int32(otg_dev, "periph", periph);
+            qdev_prop_set_bit(otg_dev, "hs", periph == STM32F2XX_OTG_HS);
+            stm32_prop_set_link(otg_dev, "stm32_rcc", rcc_dev);
+            if (otg_chr) {
+                qdev_prop_set_chr(otg_dev, "chardev", otg_chr);
+            }
+            stm32_init_periph(address_space_mem, otg_dev, periph, otg_desc[i].addr, pic[otg_desc[i].irq]);
+        }
+    }
 }
@@ -51,7 +51,31 @@ enum {
     STM32F2XX_EXTI,
     STM32F2XX_SDIO,
     STM32F2XX_FSMC,
+    STM32F2XX_DMA1,
+    STM32F2XX_DMA2,
+    STM32F2XX_ETH,
+    STM32F2XX_CRYP,
+    STM32F2XX_HASH,
+    STM32F2XX_RNG,
+    STM32F2XX_OTG_FS,
+    STM32F2XX_OTG_HS,
     STM32F2XX_PERIPH_COUNT,
 };
 
 #define STM32F2XX_GPIO_COUNT (STM32F2XX_GPIOI - STM32F2XX_GPIOA + 1)
+
+/* What SYSCFG_MEMRMP MEM_MODE maps at 0x00000000 (RM0033 section 7.2.1).
+ * The board creates one alias per mode in a container at address 0, and the
+ * SYSCFG enables the selected one. */
+enum {
+    STM32F2XX_MEM_MODE_FLASH = 0,
+    STM32F2XX_MEM_MODE_SYSTEM,
+    STM32F2XX_MEM_MODE_FSMC,
+    STM32F2XX_MEM_MODE_SRAM,
+    STM32F2XX_MEM_MODE_COUNT,
+};
+
+#define STM32F2XX_SYSTEM_MEMORY_ADDR 0x1fff0000
+#define STM32F2XX_SYSTEM_MEMORY_SIZE (30 * 1024)
+#define STM32F2XX_SRAM_ADDR 0x20000000
+#define STM32F2XX_FSMC_BANK1_ADDR 0x60000000
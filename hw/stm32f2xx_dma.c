@@ -0,0 +1,954 @@
+/*
+ * STM32F2XX Microcontroller DMA stream controller
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual Rev 4"
+ *
+ * Each controller has 8 streams, and each stream selects one of 8 request
+ * channels.  When the selected request is found asserted, a whole peripheral
+ * burst (PBURST beats, or a single beat in direct mode) is transferred in one
+ * go, and the stream keeps going for as long as the request is held.
+ * Memory-to-memory streams run to completion as soon as they are enabled;
+ * when both sides increment contiguously the data is moved as bulk copies.
+ *
+ * The FIFO packs and unpacks data between the peripheral and memory sizes,
+ * but it is drained into memory as soon as it holds a full memory item
+ * rather than when the threshold is reached.  FIFO and direct mode errors
+ * (FEIF, DMEIF) and transfer errors (TEIF) are not modelled.
+ *
+ * When the peripheral is the flow controller (PFCTRL), NDTR starts from
+ * 0xFFFF and the stream is completed by the peripheral through
+ * stm32f2xx_dma_block_end, which is also how a peripheral moves a whole
+ * block at once instead of raising its request for every burst.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stm32f2xx.h"
+#include "exec/cpu-common.h"
+#include "trace.h"
+
+
+
+/* DEFINITIONS */
+
+/* See README for DEBUG details. */
+//#define DEBUG_STM32F2XX_DMA
+
+#ifdef DEBUG_STM32F2XX_DMA
+#define DPRINTF(fmt, ...)                                       \
+do { printf("STM32F2XX_DMA: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define DMA_LISR_OFFSET 0x00
+#define DMA_HISR_OFFSET 0x04
+#define DMA_LIFCR_OFFSET 0x08
+#define DMA_HIFCR_OFFSET 0x0c
+
+/* Flags of a stream, relative to the position of the stream's flags in
+ * LISR/HISR and LIFCR/HIFCR (see stm32f2xx_dma_flag_shift). */
+#define DMA_ISR_FEIF_BIT 0
+#define DMA_ISR_DMEIF_BIT 2
+#define DMA_ISR_TEIF_BIT 3
+#define DMA_ISR_HTIF_BIT 4
+#define DMA_ISR_TCIF_BIT 5
+#define DMA_ISR_STREAM_MASK 0x3d
+
+/* Registers of stream x start at 0x10 + 0x18 * x. */
+#define DMA_STREAM_START 0x10
+#define DMA_STREAM_SIZE 0x18
+#define DMA_SxCR_OFFSET 0x00
+#define DMA_SxCR_EN_BIT 0
+#define DMA_SxCR_DMEIE_BIT 1
+#define DMA_SxCR_TEIE_BIT 2
+#define DMA_SxCR_HTIE_BIT 3
+#define DMA_SxCR_TCIE_BIT 4
+#define DMA_SxCR_PFCTRL_BIT 5
+#define DMA_SxCR_DIR_START 6
+#define DMA_SxCR_DIR_MASK 0x000000c0
+#define DMA_SxCR_CIRC_BIT 8
+#define DMA_SxCR_PINC_BIT 9
+#define DMA_SxCR_MINC_BIT 10
+#define DMA_SxCR_PSIZE_START 11
+#define DMA_SxCR_PSIZE_MASK 0x00001800
+#define DMA_SxCR_MSIZE_START 13
+#define DMA_SxCR_MSIZE_MASK 0x00006000
+#define DMA_SxCR_PINCOS_BIT 15
+#define DMA_SxCR_PL_START 16
+#define DMA_SxCR_PL_MASK 0x00030000
+#define DMA_SxCR_DBM_BIT 18
+#define DMA_SxCR_CT_BIT 19
+#define DMA_SxCR_PBURST_START 21
+#define DMA_SxCR_PBURST_MASK 0x00600000
+#define DMA_SxCR_MBURST_START 23
+#define DMA_SxCR_MBURST_MASK 0x01800000
+#define DMA_SxCR_CHSEL_START 25
+#define DMA_SxCR_CHSEL_MASK 0x0e000000
+/* Bits which may be written while the stream is enabled */
+#define DMA_SxCR_ENABLED_MASK 0x0000001f
+#define DMA_SxNDTR_OFFSET 0x04
+#define DMA_SxPAR_OFFSET 0x08
+#define DMA_SxM0AR_OFFSET 0x0c
+#define DMA_SxM1AR_OFFSET 0x10
+#define DMA_SxFCR_OFFSET 0x14
+#define DMA_SxFCR_FTH_MASK 0x00000003
+#define DMA_SxFCR_DMDIS_BIT 2
+#define DMA_SxFCR_FS_START 3
+#define DMA_SxFCR_FEIE_BIT 7
+
+#define DMA_SxFCR_FS_LESS_THAN_QUARTER 0
+#define DMA_SxFCR_FS_EMPTY 4
+
+#define DMA_DIR_P2M 0
+#define DMA_DIR_M2P 1
+#define DMA_DIR_M2M 2
+
+#define STM32F2XX_DMA_STREAM_COUNT 8
+#define STM32F2XX_DMA_CHANNEL_COUNT 8
+
+/* The FIFO is four words deep. */
+#define STM32F2XX_DMA_FIFO_SIZE 16
+
+/* Size of the bounce buffer used for memory-to-memory copies */
+#define STM32F2XX_DMA_COPY_CHUNK 4096
+
+typedef struct {
+    /* Register Values */
+    uint32_t
+        DMA_SxCR,
+        DMA_SxNDTR,
+        DMA_SxPAR,
+        DMA_SxM0AR,
+        DMA_SxM1AR,
+        DMA_SxFCR;
+
+    /* Interrupt flags, see DMA_ISR_* */
+    uint32_t flags;
+
+    /* Transfer state, latched from the registers when the stream is
+     * enabled. */
+    uint32_t ndtr_reload;
+    uint32_t par, mar;
+
+    uint8_t fifo[STM32F2XX_DMA_FIFO_SIZE];
+    uint32_t fifo_len;
+
+    /* Bit mask of the asserted request channels */
+    uint32_t req;
+} Stm32f2xxDmaStream;
+
+struct Stm32f2xxDma {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32PeriphClk clk;
+
+    Stm32f2xxDmaStream stream[STM32F2XX_DMA_STREAM_COUNT];
+
+    /* Set while stm32f2xx_dma_run is transferring data, so that requests
+     * raised by the transfers themselves do not recurse. */
+    bool running;
+    /* Continues circular transfers which were paused after wrapping. */
+    QEMUBH *run_bh;
+
+    qemu_irq irq[STM32F2XX_DMA_STREAM_COUNT];
+};
+
+static const uint32_t stm32f2xx_dma_burst_beats[] = {1, 4, 8, 16};
+
+
+
+
+/* TRANSFERS */
+
+static inline unsigned stm32f2xx_dma_dir(Stm32f2xxDmaStream *st)
+{
+    return (st->DMA_SxCR & DMA_SxCR_DIR_MASK) >> DMA_SxCR_DIR_START;
+}
+
+/* Memory-to-memory transfers always go through the FIFO. */
+static inline bool stm32f2xx_dma_direct(Stm32f2xxDmaStream *st)
+{
+    return IS_BIT_RESET(st->DMA_SxFCR, DMA_SxFCR_DMDIS_BIT) &&
+           stm32f2xx_dma_dir(st) != DMA_DIR_M2M;
+}
+
+static inline uint32_t stm32f2xx_dma_psize(Stm32f2xxDmaStream *st)
+{
+    return 1 << ((st->DMA_SxCR & DMA_SxCR_PSIZE_MASK) >> DMA_SxCR_PSIZE_START);
+}
+
+/* In direct mode MSIZE is ignored and the memory side uses PSIZE. */
+static inline uint32_t stm32f2xx_dma_msize(Stm32f2xxDmaStream *st)
+{
+    if (stm32f2xx_dma_direct(st)) {
+        return stm32f2xx_dma_psize(st);
+    }
+    return 1 << ((st->DMA_SxCR & DMA_SxCR_MSIZE_MASK) >> DMA_SxCR_MSIZE_START);
+}
+
+static inline uint32_t stm32f2xx_dma_pstep(Stm32f2xxDmaStream *st)
+{
+    if (IS_BIT_RESET(st->DMA_SxCR, DMA_SxCR_PINC_BIT)) {
+        return 0;
+    }
+    return IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_PINCOS_BIT) ?
+           4 : stm32f2xx_dma_psize(st);
+}
+
+static inline uint32_t stm32f2xx_dma_mstep(Stm32f2xxDmaStream *st)
+{
+    return IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_MINC_BIT) ?
+           stm32f2xx_dma_msize(st) : 0;
+}
+
+/* Streams 0-3 are in LISR/LIFCR and 4-7 in HISR/HIFCR, at these bit
+ * positions. */
+static inline int stm32f2xx_dma_flag_shift(int x)
+{
+    static const int shift[] = {0, 6, 16, 22};
+
+    return shift[x % 4];
+}
+
+static void stm32f2xx_dma_update_irq(Stm32f2xxDma *s, int x)
+{
+    Stm32f2xxDmaStream *st = &s->stream[x];
+    uint32_t enabled = 0;
+
+    if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_TCIE_BIT)) {
+        SET_BIT(enabled, DMA_ISR_TCIF_BIT);
+    }
+    if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_HTIE_BIT)) {
+        SET_BIT(enabled, DMA_ISR_HTIF_BIT);
+    }
+    if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_TEIE_BIT)) {
+        SET_BIT(enabled, DMA_ISR_TEIF_BIT);
+    }
+    if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_DMEIE_BIT)) {
+        SET_BIT(enabled, DMA_ISR_DMEIF_BIT);
+    }
+    if (IS_BIT_SET(st->DMA_SxFCR, DMA_SxFCR_FEIE_BIT)) {
+        SET_BIT(enabled, DMA_ISR_FEIF_BIT);
+    }
+
+    trace_stm32f2xx_dma_irq(s, x, (st->flags & enabled) != 0);
+    qemu_set_irq(s->irq[x], (st->flags & enabled) != 0);
+}
+
+/* Writes whatever is left in the FIFO of a peripheral-to-memory stream out
+ * to memory. */
+static void stm32f2xx_dma_flush_fifo(Stm32f2xxDmaStream *st)
+{
+    if (st->fifo_len && stm32f2xx_dma_dir(st) != DMA_DIR_M2P) {
+        cpu_physical_memory_write(st->mar, st->fifo, st->fifo_len);
+        if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_MINC_BIT)) {
+            st->mar += st->fifo_len;
+        }
+    }
+    st->fifo_len = 0;
+}
+
+/* Loads the addresses the stream starts (or restarts) from. */
+static void stm32f2xx_dma_load(Stm32f2xxDmaStream *st)
+{
+    st->DMA_SxNDTR = st->ndtr_reload;
+    st->par = st->DMA_SxPAR;
+    st->mar = IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_CT_BIT) ?
+              st->DMA_SxM1AR : st->DMA_SxM0AR;
+}
+
+/* Moves one peripheral item of stream st, through the FIFO unless the
+ * stream is in direct mode.  The source of a memory-to-memory stream is on
+ * the peripheral port. */
+static void stm32f2xx_dma_beat(Stm32f2xxDmaStream *st)
+{
+    uint32_t psize = stm32f2xx_dma_psize(st);
+    uint32_t msize = stm32f2xx_dma_msize(st);
+    uint32_t mstep = stm32f2xx_dma_mstep(st);
+    uint8_t buf[4] = {0};
+
+    if (stm32f2xx_dma_dir(st) == DMA_DIR_M2P) {
+        if (stm32f2xx_dma_direct(st)) {
+            cpu_physical_memory_read(st->mar, buf, psize);
+            cpu_physical_memory_write(st->par, buf, psize);
+            st->mar += mstep;
+        } else {
+            while (st->fifo_len < psize) {
+                cpu_physical_memory_read(st->mar, st->fifo + st->fifo_len,
+                                         msize);
+                st->fifo_len += msize;
+                st->mar += mstep;
+            }
+            cpu_physical_memory_write(st->par, st->fifo, psize);
+            st->fifo_len -= psize;
+            memmove(st->fifo, st->fifo + psize, st->fifo_len);
+        }
+    } else {
+        cpu_physical_memory_read(st->par, buf, psize);
+        if (stm32f2xx_dma_direct(st)) {
+            cpu_physical_memory_write(st->mar, buf, psize);
+            st->mar += mstep;
+        } else {
+            memcpy(st->fifo + st->fifo_len, buf, psize);
+            st->fifo_len += psize;
+            while (st->fifo_len >= msize) {
+                cpu_physical_memory_write(st->mar, st->fifo, msize);
+                st->fifo_len -= msize;
+                memmove(st->fifo, st->fifo + msize, st->fifo_len);
+                st->mar += mstep;
+            }
+        }
+    }
+
+    st->par += stm32f2xx_dma_pstep(st);
+}
+
+/* Accounts for count items of stream x having been transferred, raising
+ * the half and complete transfer flags as they are passed.  Returns true
+ * if a circular or double buffer stream wrapped around. */
+static bool stm32f2xx_dma_advance(Stm32f2xxDma *s, int x, uint32_t count)
+{
+    Stm32f2xxDmaStream *st = &s->stream[x];
+    uint32_t half = st->ndtr_reload / 2;
+    bool wrapped = false;
+
+    if (st->DMA_SxNDTR > half && st->DMA_SxNDTR - count <= half) {
+        SET_BIT(st->flags, DMA_ISR_HTIF_BIT);
+    }
+    st->DMA_SxNDTR -= count;
+
+    if (st->DMA_SxNDTR == 0) {
+        SET_BIT(st->flags, DMA_ISR_TCIF_BIT);
+        stm32f2xx_dma_flush_fifo(st);
+        if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_DBM_BIT)) {
+            /* Switch to the other memory target. */
+            st->DMA_SxCR ^= GET_BIT_MASK_ONE(DMA_SxCR_CT_BIT);
+            stm32f2xx_dma_load(st);
+            wrapped = true;
+        } else if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_CIRC_BIT)) {
+            stm32f2xx_dma_load(st);
+            wrapped = true;
+        } else {
+            /* The stream disables itself at the end of a normal transfer. */
+            RESET_BIT(st->DMA_SxCR, DMA_SxCR_EN_BIT);
+        }
+        DPRINTF("Stream %d transfer complete\n", x);
+    }
+
+    stm32f2xx_dma_update_irq(s, x);
+
+    return wrapped;
+}
+
+static void stm32f2xx_dma_copy(hwaddr dst, hwaddr src, uint32_t len)
+{
+    uint8_t buf[STM32F2XX_DMA_COPY_CHUNK];
+    uint32_t chunk;
+
+    while (len) {
+        chunk = MIN(len, sizeof(buf));
+        cpu_physical_memory_read(src, buf, chunk);
+        cpu_physical_memory_write(dst, buf, chunk);
+        src += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+/* Runs a memory-to-memory transfer of stream x to completion. */
+static void stm32f2xx_dma_mem2mem(Stm32f2xxDma *s, int x)
+{
+    Stm32f2xxDmaStream *st = &s->stream[x];
+    uint32_t psize = stm32f2xx_dma_psize(st);
+    uint32_t count, len = st->DMA_SxNDTR * psize;
+    bool bulk;
+
+    /* Packing through the FIFO does not change the byte order, so if both
+     * sides are contiguous the whole transfer is a plain copy (as long as
+     * the two areas do not overlap). */
+    bulk = stm32f2xx_dma_pstep(st) == psize &&
+           IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_MINC_BIT) &&
+           st->fifo_len == 0 &&
+           (st->par + len <= st->mar || st->mar + len <= st->par);
+
+    if (!bulk) {
+        while (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_EN_BIT)) {
+            stm32f2xx_dma_beat(st);
+            stm32f2xx_dma_advance(s, x, 1);
+        }
+        return;
+    }
+
+    DPRINTF("Stream %d copying 0x%x bytes from 0x%08x to 0x%08x\n",
+            x, len, st->par, st->mar);
+
+    /* Copy up to the half transfer point, then the rest, so that both
+     * flags are raised. */
+    while (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_EN_BIT)) {
+        count = st->DMA_SxNDTR - st->ndtr_reload / 2;
+        if (count == 0 || count > st->DMA_SxNDTR) {
+            count = st->DMA_SxNDTR;
+        }
+        stm32f2xx_dma_copy(st->mar, st->par, count * psize);
+        st->par += count * psize;
+        st->mar += count * psize;
+        stm32f2xx_dma_advance(s, x, count);
+    }
+}
+
+/* Transfers one peripheral burst of stream x.  Returns true if the stream
+ * wrapped around. */
+static bool stm32f2xx_dma_burst(Stm32f2xxDma *s, int x)
+{
+    Stm32f2xxDmaStream *st = &s->stream[x];
+    uint32_t beats = 1;
+
+    if (!stm32f2xx_dma_direct(st)) {
+        beats = stm32f2xx_dma_burst_beats[
+                (st->DMA_SxCR & DMA_SxCR_PBURST_MASK) >> DMA_SxCR_PBURST_START];
+    }
+    beats = MIN(beats, st->DMA_SxNDTR);
+
+    while (beats--) {
+        stm32f2xx_dma_beat(st);
+        if (stm32f2xx_dma_advance(s, x, 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stm32f2xx_dma_stream_ready(Stm32f2xxDmaStream *st)
+{
+    unsigned channel;
+
+    if (IS_BIT_RESET(st->DMA_SxCR, DMA_SxCR_EN_BIT) || st->DMA_SxNDTR == 0) {
+        return false;
+    }
+    if (stm32f2xx_dma_dir(st) == DMA_DIR_M2M) {
+        return true;
+    }
+    channel = (st->DMA_SxCR & DMA_SxCR_CHSEL_MASK) >> DMA_SxCR_CHSEL_START;
+    return IS_BIT_SET(st->req, channel);
+}
+
+/* Picks the ready stream with the highest priority level, the lowest
+ * numbered one winning a tie.  Returns -1 if no stream is ready. */
+static int stm32f2xx_dma_next_stream(Stm32f2xxDma *s, uint32_t skip)
+{
+    int x, best = -1;
+    uint32_t pl, best_pl = 0;
+
+    for (x = 0; x < STM32F2XX_DMA_STREAM_COUNT; x++) {
+        if (IS_BIT_SET(skip, x) || !stm32f2xx_dma_stream_ready(&s->stream[x])) {
+            continue;
+        }
+        pl = (s->stream[x].DMA_SxCR & DMA_SxCR_PL_MASK) >> DMA_SxCR_PL_START;
+        if (best < 0 || pl > best_pl) {
+            best = x;
+            best_pl = pl;
+        }
+    }
+
+    return best;
+}
+
+/* Services streams until none is ready.  A circular stream that wraps is
+ * left alone until the bottom half runs, so that a request which stays
+ * asserted cannot keep the CPU from running. */
+static void stm32f2xx_dma_run(Stm32f2xxDma *s)
+{
+    uint32_t paused = 0;
+    int x;
+
+    if (s->running) {
+        return;
+    }
+    s->running = true;
+
+    while ((x = stm32f2xx_dma_next_stream(s, paused)) >= 0) {
+        if (stm32f2xx_dma_dir(&s->stream[x]) == DMA_DIR_M2M) {
+            stm32f2xx_dma_mem2mem(s, x);
+        } else if (stm32f2xx_dma_burst(s, x)) {
+            SET_BIT(paused, x);
+            qemu_bh_schedule(s->run_bh);
+        }
+    }
+
+    s->running = false;
+}
+
+static void stm32f2xx_dma_run_bh(void *opaque)
+{
+    stm32f2xx_dma_run((Stm32f2xxDma *)opaque);
+}
+
+static void stm32f2xx_dma_request_irq_handler(void *opaque, int n, int level)
+{
+    Stm32f2xxDma *s = (Stm32f2xxDma *)opaque;
+    Stm32f2xxDmaStream *st = &s->stream[n / STM32F2XX_DMA_CHANNEL_COUNT];
+
+    CHANGE_BIT(st->req, n % STM32F2XX_DMA_CHANNEL_COUNT, level);
+    if (level) {
+        stm32f2xx_dma_run(s);
+    }
+}
+
+
+/* Gets the stream serving request req, or NULL if it is not enabled with
+ * the request's channel selected. */
+static Stm32f2xxDmaStream *stm32f2xx_dma_req_stream(Stm32f2xxDma *s, int req)
+{
+    Stm32f2xxDmaStream *st;
+    unsigned channel;
+
+    assert(req >= 0 &&
+           req < STM32F2XX_DMA_STREAM_COUNT * STM32F2XX_DMA_CHANNEL_COUNT);
+    st = &s->stream[req / STM32F2XX_DMA_CHANNEL_COUNT];
+    channel = (st->DMA_SxCR & DMA_SxCR_CHSEL_MASK) >> DMA_SxCR_CHSEL_START;
+
+    if (IS_BIT_RESET(st->DMA_SxCR, DMA_SxCR_EN_BIT) ||
+        channel != req % STM32F2XX_DMA_CHANNEL_COUNT) {
+        return NULL;
+    }
+    return st;
+}
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint32_t stm32f2xx_dma_DMA_xISR_read(Stm32f2xxDma *s, int first)
+{
+    uint32_t value = 0;
+    int x;
+
+    for (x = first; x < first + 4; x++) {
+        value |= s->stream[x].flags << stm32f2xx_dma_flag_shift(x);
+    }
+    return value;
+}
+
+static void stm32f2xx_dma_DMA_xIFCR_write(Stm32f2xxDma *s, int first,
+                                          uint32_t new_value)
+{
+    int x;
+
+    for (x = first; x < first + 4; x++) {
+        s->stream[x].flags &= ~((new_value >> stm32f2xx_dma_flag_shift(x)) &
+                                DMA_ISR_STREAM_MASK);
+        stm32f2xx_dma_update_irq(s, x);
+    }
+}
+
+static void stm32f2xx_dma_DMA_SxCR_write(Stm32f2xxDma *s, int x,
+                                         uint32_t new_value, bool init)
+{
+    Stm32f2xxDmaStream *st = &s->stream[x];
+    bool was_enabled = IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_EN_BIT);
+
+    new_value &= 0x0fefffff;
+
+    if (was_enabled) {
+        /* Only the interrupt enables and EN itself can be changed while the
+         * stream is enabled. */
+        st->DMA_SxCR = (st->DMA_SxCR & ~DMA_SxCR_ENABLED_MASK) |
+                       (new_value & DMA_SxCR_ENABLED_MASK);
+        if (IS_BIT_RESET(new_value, DMA_SxCR_EN_BIT)) {
+            /* Disabling a stream in the middle of a transfer completes it. */
+            stm32f2xx_dma_flush_fifo(st);
+            SET_BIT(st->flags, DMA_ISR_TCIF_BIT);
+            DPRINTF("Stream %d disabled, NDTR=%u\n", x, st->DMA_SxNDTR);
+        }
+    } else {
+        st->DMA_SxCR = new_value;
+        if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_EN_BIT)) {
+            if (stm32f2xx_dma_dir(st) == DMA_DIR_M2M) {
+                /* The DMA is always the flow controller of memory to
+                 * memory transfers. */
+                RESET_BIT(st->DMA_SxCR, DMA_SxCR_PFCTRL_BIT);
+            }
+            if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_PFCTRL_BIT)) {
+                /* The peripheral decides when the transfer ends, so the
+                 * stream can neither wrap nor switch buffers. */
+                st->DMA_SxNDTR = 0xffff;
+                RESET_BIT(st->DMA_SxCR, DMA_SxCR_CIRC_BIT);
+                RESET_BIT(st->DMA_SxCR, DMA_SxCR_DBM_BIT);
+            }
+            if (stm32f2xx_dma_dir(st) == DMA_DIR_M2M &&
+                (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_CIRC_BIT) ||
+                 IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_DBM_BIT))) {
+                stm32_hw_warn("%s: Stream %d: circular and double buffer "
+                              "modes cannot be used with memory to memory "
+                              "transfers", s->busdev.qdev.id, x);
+                RESET_BIT(st->DMA_SxCR, DMA_SxCR_CIRC_BIT);
+                RESET_BIT(st->DMA_SxCR, DMA_SxCR_DBM_BIT);
+            }
+            if (stm32f2xx_dma_dir(st) == 3) {
+                stm32_hw_warn("%s: Stream %d: reserved transfer direction",
+                              s->busdev.qdev.id, x);
+                RESET_BIT(st->DMA_SxCR, DMA_SxCR_EN_BIT);
+            }
+            st->ndtr_reload = st->DMA_SxNDTR;
+            st->fifo_len = 0;
+            stm32f2xx_dma_load(st);
+            DPRINTF("Stream %d enabled, CR=0x%08x NDTR=%u PAR=0x%08x "
+                    "M0AR=0x%08x M1AR=0x%08x FCR=0x%02x\n", x, st->DMA_SxCR,
+                    st->DMA_SxNDTR, st->DMA_SxPAR, st->DMA_SxM0AR,
+                    st->DMA_SxM1AR, st->DMA_SxFCR);
+        }
+    }
+
+    if (!init) {
+        stm32f2xx_dma_update_irq(s, x);
+        stm32f2xx_dma_run(s);
+    }
+}
+
+static uint32_t stm32f2xx_dma_DMA_SxFCR_read(Stm32f2xxDmaStream *st)
+{
+    uint32_t fs = st->fifo_len ? DMA_SxFCR_FS_LESS_THAN_QUARTER :
+                                 DMA_SxFCR_FS_EMPTY;
+
+    return st->DMA_SxFCR | (fs << DMA_SxFCR_FS_START);
+}
+
+/* Most stream registers may only be written while the stream is disabled.
+ * In double buffer mode, the memory address which is not currently in use
+ * may be changed at any time. */
+static bool stm32f2xx_dma_check_writable(Stm32f2xxDma *s, int x,
+                                         hwaddr offset)
+{
+    Stm32f2xxDmaStream *st = &s->stream[x];
+    hwaddr reg = (offset - DMA_STREAM_START) % DMA_STREAM_SIZE;
+    bool ct = IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_CT_BIT);
+
+    if (IS_BIT_RESET(st->DMA_SxCR, DMA_SxCR_EN_BIT)) {
+        return true;
+    }
+    if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_DBM_BIT) &&
+        ((reg == DMA_SxM0AR_OFFSET && ct) ||
+         (reg == DMA_SxM1AR_OFFSET && !ct))) {
+        return true;
+    }
+
+    stm32_hw_warn("%s: Stream %d: ignoring write to register 0x%x while "
+                  "the stream is enabled", s->busdev.qdev.id, x, (int)offset);
+    return false;
+}
+
+static uint64_t stm32f2xx_dma_readw(Stm32f2xxDma *s, hwaddr offset)
+{
+    Stm32f2xxDmaStream *st;
+    int x;
+
+    switch (offset) {
+        case DMA_LISR_OFFSET:
+            return stm32f2xx_dma_DMA_xISR_read(s, 0);
+        case DMA_HISR_OFFSET:
+            return stm32f2xx_dma_DMA_xISR_read(s, 4);
+        case DMA_LIFCR_OFFSET:
+        case DMA_HIFCR_OFFSET:
+            STM32_WO_REG(offset);
+            return 0;
+    }
+
+    x = (offset - DMA_STREAM_START) / DMA_STREAM_SIZE;
+    if (x >= STM32F2XX_DMA_STREAM_COUNT) {
+        STM32_BAD_REG(offset, 4);
+        return 0;
+    }
+    st = &s->stream[x];
+
+    switch ((offset - DMA_STREAM_START) % DMA_STREAM_SIZE) {
+        case DMA_SxCR_OFFSET:
+            return st->DMA_SxCR;
+        case DMA_SxNDTR_OFFSET:
+            return st->DMA_SxNDTR;
+        case DMA_SxPAR_OFFSET:
+            return st->DMA_SxPAR;
+        case DMA_SxM0AR_OFFSET:
+            return st->DMA_SxM0AR;
+        case DMA_SxM1AR_OFFSET:
+            return st->DMA_SxM1AR;
+        case DMA_SxFCR_OFFSET:
+            return stm32f2xx_dma_DMA_SxFCR_read(st);
+        default:
+            STM32_BAD_REG(offset, 4);
+            return 0;
+    }
+}
+
+static void stm32f2xx_dma_writew(Stm32f2xxDma *s, hwaddr offset,
+                                 uint64_t value)
+{
+    Stm32f2xxDmaStream *st;
+    int x;
+
+    switch (offset) {
+        case DMA_LISR_OFFSET:
+        case DMA_HISR_OFFSET:
+            STM32_RO_REG(offset);
+            return;
+        case DMA_LIFCR_OFFSET:
+            stm32f2xx_dma_DMA_xIFCR_write(s, 0, value);
+            return;
+        case DMA_HIFCR_OFFSET:
+            stm32f2xx_dma_DMA_xIFCR_write(s, 4, value);
+            return;
+    }
+
+    x = (offset - DMA_STREAM_START) / DMA_STREAM_SIZE;
+    if (x >= STM32F2XX_DMA_STREAM_COUNT) {
+        STM32_BAD_REG(offset, 4);
+        return;
+    }
+    st = &s->stream[x];
+
+    switch ((offset - DMA_STREAM_START) % DMA_STREAM_SIZE) {
+        case DMA_SxCR_OFFSET:
+            stm32f2xx_dma_DMA_SxCR_write(s, x, value, false);
+            break;
+        case DMA_SxNDTR_OFFSET:
+            if (stm32f2xx_dma_check_writable(s, x, offset)) {
+                st->DMA_SxNDTR = value & 0x0000ffff;
+            }
+            break;
+        case DMA_SxPAR_OFFSET:
+            if (stm32f2xx_dma_check_writable(s, x, offset)) {
+                st->DMA_SxPAR = value;
+            }
+            break;
+        case DMA_SxM0AR_OFFSET:
+            if (stm32f2xx_dma_check_writable(s, x, offset)) {
+                st->DMA_SxM0AR = value;
+            }
+            break;
+        case DMA_SxM1AR_OFFSET:
+            if (stm32f2xx_dma_check_writable(s, x, offset)) {
+                st->DMA_SxM1AR = value;
+            }
+            break;
+        case DMA_SxFCR_OFFSET:
+            /* FEIE may always be changed, the rest only while disabled. */
+            if (IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_EN_BIT)) {
+                CHANGE_BIT(st->DMA_SxFCR, DMA_SxFCR_FEIE_BIT,
+                           IS_BIT_SET(value, DMA_SxFCR_FEIE_BIT));
+            } else {
+                st->DMA_SxFCR = value & 0x00000087;
+            }
+            stm32f2xx_dma_update_irq(s, x);
+            break;
+        default:
+            STM32_BAD_REG(offset, 4);
+            break;
+    }
+}
+
+static uint64_t stm32f2xx_dma_read(void *opaque, hwaddr offset,
+                                   unsigned size)
+{
+    Stm32f2xxDma *s = (Stm32f2xxDma *)opaque;
+    uint64_t value;
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            value = stm32f2xx_dma_readw(s, offset);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            value = 0;
+            break;
+    }
+
+    trace_stm32f2xx_dma_read(s, offset, size, value);
+    return value;
+}
+
+static void stm32f2xx_dma_write(void *opaque, hwaddr offset,
+                                uint64_t value, unsigned size)
+{
+    Stm32f2xxDma *s = (Stm32f2xxDma *)opaque;
+
+    trace_stm32f2xx_dma_write(s, offset, size, value);
+
+    if (!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
+
+    switch(size) {
+        case WORD_ACCESS_SIZE:
+            stm32f2xx_dma_writew(s, offset, value);
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32f2xx_dma_ops = {
+    .read = stm32f2xx_dma_read,
+    .write = stm32f2xx_dma_write,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32f2xx_dma_reset(DeviceState *dev)
+{
+    Stm32f2xxDma *s = FROM_SYSBUS(Stm32f2xxDma, SYS_BUS_DEVICE(dev));
+    Stm32f2xxDmaStream *st;
+    int x;
+
+    for (x = 0; x < STM32F2XX_DMA_STREAM_COUNT; x++) {
+        st = &s->stream[x];
+        /* Clear EN first so that the rest of the register can be reset. */
+        RESET_BIT(st->DMA_SxCR, DMA_SxCR_EN_BIT);
+        stm32f2xx_dma_DMA_SxCR_write(s, x, 0x00000000, true);
+        st->DMA_SxNDTR = 0;
+        st->DMA_SxPAR = 0;
+        st->DMA_SxM0AR = 0;
+        st->DMA_SxM1AR = 0;
+        st->DMA_SxFCR = 0x00000001;
+        st->flags = 0;
+        st->fifo_len = 0;
+        stm32f2xx_dma_update_irq(s, x);
+    }
+}
+
+
+
+
+uint32_t stm32f2xx_dma_block_begin(Stm32f2xxDma *s, int req, hwaddr par,
+                                   bool to_mem, hwaddr *mar)
+{
+    Stm32f2xxDmaStream *st = stm32f2xx_dma_req_stream(s, req);
+
+    if (s->running || !st ||
+        stm32f2xx_dma_dir(st) != (to_mem ? DMA_DIR_P2M : DMA_DIR_M2P) ||
+        IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_PINC_BIT) ||
+        IS_BIT_RESET(st->DMA_SxCR, DMA_SxCR_MINC_BIT) ||
+        st->par != par || st->fifo_len != 0) {
+        return 0;
+    }
+
+    *mar = st->mar;
+    return st->DMA_SxNDTR * stm32f2xx_dma_psize(st);
+}
+
+void stm32f2xx_dma_block_end(Stm32f2xxDma *s, int req, uint32_t len,
+                             bool last)
+{
+    Stm32f2xxDmaStream *st = stm32f2xx_dma_req_stream(s, req);
+    int x = req / STM32F2XX_DMA_CHANNEL_COUNT;
+    uint32_t count;
+
+    /* The guest may have stopped the stream while the block was in
+     * flight. */
+    if (!st) {
+        return;
+    }
+
+    count = MIN(len / stm32f2xx_dma_psize(st), st->DMA_SxNDTR);
+    st->mar += count * stm32f2xx_dma_psize(st);
+    if (count && stm32f2xx_dma_advance(s, x, count)) {
+        qemu_bh_schedule(s->run_bh);
+    }
+
+    if (last && IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_EN_BIT) &&
+        IS_BIT_SET(st->DMA_SxCR, DMA_SxCR_PFCTRL_BIT)) {
+        /* The peripheral ends the transfer: the stream completes just as
+         * if NDTR had run down. */
+        stm32f2xx_dma_flush_fifo(st);
+        SET_BIT(st->flags, DMA_ISR_TCIF_BIT);
+        RESET_BIT(st->DMA_SxCR, DMA_SxCR_EN_BIT);
+        stm32f2xx_dma_update_irq(s, x);
+        DPRINTF("Stream %d ended by the peripheral, NDTR=%u\n", x,
+                st->DMA_SxNDTR);
+    }
+}
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32f2xx_dma_instance_init(Object *obj)
+{
+    Stm32f2xxDma *s = FROM_SYSBUS(Stm32f2xxDma, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+}
+
+static int stm32f2xx_dma_init(SysBusDevice *dev)
+{
+    Stm32f2xxDma *s = FROM_SYSBUS(Stm32f2xxDma, dev);
+    int x;
+
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, s->periph, dev, NULL);
+
+    memory_region_init_io(&s->iomem, &stm32f2xx_dma_ops, s,
+                          "dma", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    for (x = 0; x < STM32F2XX_DMA_STREAM_COUNT; x++) {
+        sysbus_init_irq(dev, &s->irq[x]);
+    }
+
+    qdev_init_gpio_in(&dev->qdev, stm32f2xx_dma_request_irq_handler,
+                      STM32F2XX_DMA_STREAM_COUNT * STM32F2XX_DMA_CHANNEL_COUNT);
+
+    s->run_bh = qemu_bh_new(stm32f2xx_dma_run_bh, s);
+
+    return 0;
+}
+
+static Property stm32f2xx_dma_properties[] = {
+    DEFINE_PROP_INT32("periph", Stm32f2xxDma, periph, -1),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32f2xx_dma_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32f2xx_dma_init;
+    dc->reset = stm32f2xx_dma_reset;
+    dc->props = stm32f2xx_dma_properties;
+}
+
+static TypeInfo stm32f2xx_dma_info = {
+    .name  = "stm32f2xx_dma",
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32f2xxDma),
+    .instance_init = stm32f2xx_dma_instance_init,
+    .class_init = stm32f2xx_dma_class_init
+};
+
+static void stm32f2xx_dma_register_types(void)
+{
+    type_register_static(&stm32f2xx_dma_info);
+}
+
+type_init(stm32f2xx_dma_register_types)
@@ -21,6 +21,7 @@
  */
 
 #include "stm32f2xx_rcc.h"
+#include "trace.h"
 #include <stdio.h>
 
 
@@ -166,12 +167,19 @@ do { printf("STM32_RCC: " fmt , ## __VA_ARGS__); } while (0)
 #define RCC_AHB1ENR_GPIOBEN_BIT      1
 #define RCC_AHB1ENR_GPIOAEN_BIT      0
 
-#define RCC_AHB2ENR_OFFSET 0x34
+#define RCC_AHB2ENR_RESET_VALUE      0x00000000
+#define RCC_AHB2ENR_OFFSET           0x34
+#define RCC_AHB2ENR_OTGFSEN_BIT      7
+#define RCC_AHB2ENR_RNGEN_BIT        6
+#define RCC_AHB2ENR_HASHEN_BIT       5
+#define RCC_AHB2ENR_CRYPEN_BIT       4
+#define RCC_AHB2ENR_DCMIEN_BIT       0
 
 #define RCC_AHB3ENR_OFFSET 0x38
 
 #define RCC_APB1ENR_RESET_VALUE  0x00000000
 #define RCC_APB1ENR_OFFSET       0x40
+#define RCC_APB1ENR_MASK         0x36FEC9FF
 #define RCC_APB1ENR_DACEN_BIT    29
 #define RCC_APB1ENR_PWREN_BIT    28
 #define RCC_APB1ENR_BKPEN_BIT    27
@@ -277,6 +285,67 @@ static void stm32_rcc_periph_enable(
     clktree_set_enabled(s->PERIPHCLK[periph], IS_BIT_SET(new_value, bit_mask));
 }
 
+/* Switches SYSCLK to the source selected by SW once that source is ready, as
+ * the hardware does.  Until then SWS keeps reporting the previous source.
+ */
+static void stm32_rcc_update_sysclk(Stm32f2xxRcc *s)
+{
+    Stm32RccStartup *st;
+    Clk clk;
+    int64_t until;
+
+    switch(s->RCC_CFGR_SW) {
+        case SW_HSI_SELECTED:
+            st = NULL;
+            clk = s->HSICLK;
+            break;
+        case SW_HSE_SELECTED:
+            st = &s->hse_startup;
+            clk = s->HSECLK;
+            break;
+        case SW_PLL_SELECTED:
+            st = &s->pll_startup;
+            clk = s->PLLCLK;
+            break;
+        default:
+            hw_error("Invalid input selected for SYSCLK");
+            return;
+    }
+
+    if(st ? stm32_rcc_startup_ready(st, clk) : clktree_is_enabled(clk)) {
+        qemu_del_timer(s->sysclk_timer);
+        s->RCC_CFGR_SWS = s->RCC_CFGR_SW;
+        clktree_set_selected_input(s->SYSCLK, s->RCC_CFGR_SWS);
+    } else {
+        until = st ? stm32_rcc_startup_until(st, clk, STM32_POLL_FOREVER) :
+                     STM32_POLL_FOREVER;
+        if(until == STM32_POLL_FOREVER) {
+            qemu_del_timer(s->sysclk_timer);
+        } else {
+            qemu_mod_timer(s->sysclk_timer, until);
+        }
+    }
+}
+
+static void stm32_rcc_sysclk_timer_expire(void *opaque)
+{
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)opaque;
+
+    stm32_rcc_update_sysclk(s);
+}
+
+/* Returns the time at which the next ready flag gets set (for
+ * stm32_poll_read). */
+static int64_t stm32_rcc_next_ready(Stm32f2xxRcc *s)
+{
+    int64_t until = STM32_POLL_FOREVER;
+
+    until = stm32_rcc_startup_until(&s->hse_startup, s->HSECLK, until);
+    until = stm32_rcc_startup_until(&s->lse_startup, s->LSECLK, until);
+    until = stm32_rcc_startup_until(&s->pll_startup, s->PLLCLK, until);
+    return until;
+}
+
 
 
 
@@ -292,13 +361,16 @@ static uint32_t stm32_rcc_RCC_CR_read(Stm32f2xxRcc *s)
     const bool HSEON = clktree_is_enabled(s->HSECLK);
     const bool HSION = clktree_is_enabled(s->HSICLK);
 
-    /* build the register value based on the clock states.  If a clock is on,
-     * then its ready bit is always set.
+    /* build the register value based on the clock states.  The PLL and HSE
+     * ready bits are set once their start-up time has passed, the HSI one
+     * as soon as it is on.
      */
     return
-    GET_BIT_MASK(RCC_CR_PLLRDY_BIT, PLLON) |
+    GET_BIT_MASK(RCC_CR_PLLRDY_BIT,
+                 stm32_rcc_startup_ready(&s->pll_startup, s->PLLCLK)) |
     GET_BIT_MASK(RCC_CR_PLLON_BIT, PLLON) |
-    GET_BIT_MASK(RCC_CR_HSERDY_BIT, HSEON) |
+    GET_BIT_MASK(RCC_CR_HSERDY_BIT,
+                 stm32_rcc_startup_ready(&s->hse_startup, s->HSECLK)) |
     GET_BIT_MASK(RCC_CR_HSEON_BIT, HSEON) |
     GET_BIT_MASK(RCC_CR_HSIRDY_BIT, HSION) |
     GET_BIT_MASK(RCC_CR_HSION_BIT, HSION);
@@ -311,6 +383,7 @@ static uint32_t stm32_rcc_RCC_CR_read(Stm32f2xxRcc *s)
  */
 static void stm32_rcc_RCC_CR_write(Stm32f2xxRcc *s, uint32_t new_value, bool init)
 {
+    int64_t now = qemu_get_clock_ns(vm_clock);
     bool new_PLLON, new_HSEON, new_HSION;
 
     new_PLLON = IS_BIT_SET(new_value, RCC_CR_PLLON_BIT);
@@ -318,7 +391,7 @@ static void stm32_rcc_RCC_CR_write(Stm32f2xxRcc *s, uint32_t new_value, bool ini
        s->RCC_CFGR_SW == SW_PLL_SELECTED) {
         stm32_hw_warn("PLL cannot be disabled while it is selected as the system clock.");
     }
-    clktree_set_enabled(s->PLLCLK, new_PLLON);
+    stm32_rcc_startup_set(&s->pll_startup, s->PLLCLK, new_PLLON, now);
 
     new_HSEON = IS_BIT_SET(new_value, RCC_CR_HSEON_BIT);
     if((clktree_is_enabled(s->HSECLK) && !new_HSEON) &&
@@ -326,7 +399,7 @@ static void stm32_rcc_RCC_CR_write(Stm32f2xxRcc *s, uint32_t new_value, bool ini
        ) {
         stm32_hw_warn("HSE oscillator cannot be disabled while it is driving the system clock.");
     }
-    clktree_set_enabled(s->HSECLK, new_HSEON);
+    stm32_rcc_startup_set(&s->hse_startup, s->HSECLK, new_HSEON, now);
 
     new_HSION = IS_BIT_SET(new_value, RCC_CR_HSION_BIT);
     if((clktree_is_enabled(s->HSECLK) && !new_HSEON) &&
@@ -336,6 +409,9 @@ static void stm32_rcc_RCC_CR_write(Stm32f2xxRcc *s, uint32_t new_value, bool ini
     }
     clktree_set_enabled(s->HSICLK, new_HSION);
 
+    /* A pending SYSCLK switch may now have a source (or lost it) */
+    stm32_rcc_update_sysclk(s);
+
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_CR_PLLI2SON_CL_BIT, RCC_CR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_CR_CSSON_BIT, RCC_CR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, RCC_CR_HSICAL_MASK, RCC_CR_RESET_VALUE);
@@ -411,7 +487,7 @@ static uint32_t stm32_rcc_RCC_CFGR_read(Stm32f2xxRcc *s)
     (s->RCC_CFGR_PPRE1 << RCC_CFGR_PPRE1_START) |
     (s->RCC_CFGR_HPRE << RCC_CFGR_HPRE_START) |
     (s->RCC_CFGR_SW << RCC_CFGR_SW_START) |
-    (s->RCC_CFGR_SW << RCC_CFGR_SWS_START);
+    (s->RCC_CFGR_SWS << RCC_CFGR_SWS_START);
 }
 
 static void stm32_rcc_RCC_CFGR_write(Stm32f2xxRcc *s, uint32_t new_value, bool init)
@@ -442,16 +518,7 @@ static void stm32_rcc_RCC_CFGR_write(Stm32f2xxRcc *s, uint32_t new_value, bool i
 
     /* SW */
     s->RCC_CFGR_SW = (new_value & RCC_CFGR_SW_MASK) >> RCC_CFGR_SW_START;
-    switch(s->RCC_CFGR_SW) {
-        case 0x0:
-        case 0x1:
-        case 0x2:
-            clktree_set_selected_input(s->SYSCLK, s->RCC_CFGR_SW);
-            break;
-        default:
-            hw_error("Invalid input selected for SYSCLK");
-            break;
-    }
+    stm32_rcc_update_sysclk(s);
 
     WARN_UNIMPLEMENTED(new_value, RCC_CFGR_MCO2_MASK, RCC_CFGR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, RCC_CFGR_MCO2PRE_MASK, RCC_CFGR_RESET_VALUE);
@@ -498,6 +565,11 @@ static uint32_t stm32_rcc_RCC_AHB1ENR_read(Stm32f2xxRcc *s)
 
 static void stm32_rcc_RCC_AHB1ENR_write(Stm32f2xxRcc *s, uint32_t new_value, bool init)
 {
+    /* The MAC transmit and receive clocks are taken to follow the MAC clock. */
+    clktree_set_enabled(s->PERIPHCLK[STM32F2XX_OTG_HS], IS_BIT_SET(new_value, RCC_AHB1ENR_OTGHSEN_BIT));
+    clktree_set_enabled(s->PERIPHCLK[STM32F2XX_ETH], IS_BIT_SET(new_value, RCC_AHB1ENR_ETHMACEN_BIT));
+    clktree_set_enabled(s->PERIPHCLK[STM32F2XX_DMA2], IS_BIT_SET(new_value, RCC_AHB1ENR_DMA2EN_BIT));
+    clktree_set_enabled(s->PERIPHCLK[STM32F2XX_DMA1], IS_BIT_SET(new_value, RCC_AHB1ENR_DMA1EN_BIT));
     clktree_set_enabled(s->PERIPHCLK[STM32F2XX_GPIOI], IS_BIT_SET(new_value, RCC_AHB1ENR_GPIOIEN_BIT));
     clktree_set_enabled(s->PERIPHCLK[STM32F2XX_GPIOH], IS_BIT_SET(new_value, RCC_AHB1ENR_GPIOHEN_BIT));
     clktree_set_enabled(s->PERIPHCLK[STM32F2XX_GPIOG], IS_BIT_SET(new_value, RCC_AHB1ENR_GPIOGEN_BIT));
@@ -511,17 +583,23 @@ static void stm32_rcc_RCC_AHB1ENR_write(Stm32f2xxRcc *s, uint32_t new_value, boo
     s->RCC_AHB1ENR = new_value;
 
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_OTGHSULPIEN_BIT, RCC_AHB1ENR_RESET_VALUE);
-    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_OTGHSEN_BIT, RCC_AHB1ENR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_ETHMACPTPEN_BIT, RCC_AHB1ENR_RESET_VALUE);
-    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_ETHMACRXEN_BIT, RCC_AHB1ENR_RESET_VALUE);
-    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_ETHMACTXEN_BIT, RCC_AHB1ENR_RESET_VALUE);
-    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_ETHMACEN_BIT, RCC_AHB1ENR_RESET_VALUE);
-    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_DMA2EN_BIT, RCC_AHB1ENR_RESET_VALUE);
-    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_DMA1EN_BIT, RCC_AHB1ENR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_BKPSRAMEN_BIT, RCC_AHB1ENR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB1ENR_CRCEN_BIT, RCC_AHB1ENR_RESET_VALUE);
 }
 
+static void stm32_rcc_RCC_AHB2ENR_write(Stm32f2xxRcc *s, uint32_t new_value, bool init)
+{
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_OTG_FS, RCC_AHB2ENR_OTGFSEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_RNG, RCC_AHB2ENR_RNGEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_HASH, RCC_AHB2ENR_HASHEN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_CRYP, RCC_AHB2ENR_CRYPEN_BIT);
+
+    s->RCC_AHB2ENR = new_value;
+
+    WARN_UNIMPLEMENTED(new_value, 1 << RCC_AHB2ENR_DCMIEN_BIT, RCC_AHB2ENR_RESET_VALUE);
+}
+
 
 /* Write the APB2 peripheral clock enable register
  * Enables/Disables the peripheral clocks based on each bit. */
@@ -530,8 +608,9 @@ static void stm32_rcc_RCC_APB2ENR_write(Stm32f2xxRcc *s, uint32_t new_value,
 {
     /* TODO: enable/disable missing peripherals */
     stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_SYSCFG, RCC_APB2ENR_SYSCFGEN_BIT);
-//    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_UART1, RCC_APB2ENR_USART1EN_BIT);
-//    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_UART6, RCC_APB2ENR_USART6EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_UART1, RCC_APB2ENR_USART1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_UART6, RCC_APB2ENR_USART6EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_SDIO, RCC_APB2ENR_SDIOEN_BIT);
 
     s->RCC_APB2ENR = new_value & RCC_APB2ENR_MASK;
 }
@@ -550,20 +629,23 @@ static void stm32_rcc_RCC_APB1ENR_write(Stm32f2xxRcc *s, uint32_t new_value,
     stm32_rcc_periph_enable(s, new_value, init, STM32F2XX_UART2,
                             RCC_APB1ENR_USART2EN_BIT);
 
-    s->RCC_APB1ENR = new_value & 0x00005e7d;
+    s->RCC_APB1ENR = new_value & RCC_APB1ENR_MASK;
 }
 
 static uint32_t stm32_rcc_RCC_BDCR_read(Stm32f2xxRcc *s)
 {
     bool lseon = clktree_is_enabled(s->LSECLK);
 
-    return GET_BIT_MASK(RCC_BDCR_LSERDY_BIT, lseon) |
+    return GET_BIT_MASK(RCC_BDCR_LSERDY_BIT,
+                        stm32_rcc_startup_ready(&s->lse_startup, s->LSECLK)) |
     GET_BIT_MASK(RCC_BDCR_LSEON_BIT, lseon);
 }
 
 static void stm32_rcc_RCC_BDCR_write(Stm32f2xxRcc *s, uint32_t new_value, bool init)
 {
-    clktree_set_enabled(s->LSECLK, IS_BIT_SET(new_value, RCC_BDCR_LSEON_BIT));
+    stm32_rcc_startup_set(&s->lse_startup, s->LSECLK,
+                          IS_BIT_SET(new_value, RCC_BDCR_LSEON_BIT),
+                          qemu_get_clock_ns(vm_clock));
 
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_BDCR_BDRST_BIT, RCC_BDCR_RESET_VALUE);
     WARN_UNIMPLEMENTED(new_value, 1 << RCC_BDCR_RTCEN_BIT, RCC_BDCR_RESET_VALUE);
@@ -611,6 +693,7 @@ static uint64_t stm32_rcc_readw(void *opaque, hwaddr offset)
         case RCC_AHB1ENR_OFFSET:
             return stm32_rcc_RCC_AHB1ENR_read(s);
         case RCC_AHB2ENR_OFFSET:
+            return s->RCC_AHB2ENR;
         case RCC_AHB3ENR_OFFSET:
             STM32_NOT_IMPL_REG(offset, 4);
             return 0;
@@ -666,6 +749,8 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
             stm32_rcc_RCC_AHB1ENR_write(s, value, false);
             break;
         case RCC_AHB2ENR_OFFSET:
+            stm32_rcc_RCC_AHB2ENR_write(s, value, false);
+            break;
         case RCC_AHB3ENR_OFFSET:
         case RCC_APB1LPENR_OFFSET:
         case RCC_APB2LPENR_OFFSET:
@@ -704,21 +789,50 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
 static uint64_t stm32_rcc_read(void *opaque, hwaddr offset,
                                unsigned size)
 {
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)opaque;
+    uint64_t value;
+
+    /* Besides on writes, the ready flags (and SWS) only change when an
+     * oscillator or the PLL has started up, so software waiting for them
+     * can sleep until then. */
+    if(offset == RCC_CR_OFFSET || offset == RCC_CFGR_OFFSET ||
+       offset == RCC_BDCR_OFFSET) {
+        stm32_poll_read(&s->poll, offset, stm32_rcc_next_ready(s));
+    } else {
+        stm32_poll_break(&s->poll);
+    }
+
     switch(size) {
         case 4:
-            return stm32_rcc_readw(opaque, offset);
+            value = stm32_rcc_readw(opaque, offset);
+            break;
         default:
             STM32_NOT_IMPL_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_rcc_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_rcc_write(void *opaque, hwaddr offset,
                             uint64_t value, unsigned size)
 {
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)opaque;
+
+    trace_stm32_rcc_write(s, offset, size, value);
+
+    stm32_poll_break(&s->poll);
+
     switch(size) {
         case 4:
+            /* A single write can change several clocks (e.g. the prescalers
+             * in RCC_CFGR), so the peripherals are only told about the end
+             * result. */
+            clktree_begin_update();
             stm32_rcc_writew(opaque, offset, value);
+            clktree_commit();
             break;
         default:
             STM32_NOT_IMPL_REG(offset, size);
@@ -737,13 +851,16 @@ static void stm32_rcc_reset(DeviceState *dev)
 {
     Stm32f2xxRcc *s = FROM_SYSBUS(Stm32f2xxRcc, SYS_BUS_DEVICE(dev));
 
+    clktree_begin_update();
     stm32_rcc_RCC_CR_write(s, RCC_CR_RESET_VALUE, true);
     stm32_rcc_RCC_PLLCFGR_write(s, RCC_PLLCFGR_RESET_VALUE, true);
     stm32_rcc_RCC_CFGR_write(s, RCC_CFGR_RESET_VALUE, true);
+    stm32_rcc_RCC_AHB2ENR_write(s, RCC_AHB2ENR_RESET_VALUE, true);
     stm32_rcc_RCC_APB2ENR_write(s, RCC_APB2ENR_RESET_VALUE, true);
     stm32_rcc_RCC_APB1ENR_write(s, RCC_APB1ENR_RESET_VALUE, true);
     stm32_rcc_RCC_BDCR_write(s, RCC_BDCR_RESET_VALUE, true);
     stm32_rcc_RCC_CSR_write(s, RCC_CSR_RESET_VALUE, true);
+    clktree_commit();
 }
 
 /* IRQ handler to handle updates to the HCLK frequency.
@@ -767,6 +884,10 @@ static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
          */
         system_clock_scale = get_ticks_per_sec() / hclk_freq;
         external_ref_clock_scale = get_ticks_per_sec() / ext_ref_freq;
+
+        /* The core runs on HCLK too.  Its cycles are rounded the same way
+         * as SysTick's, so that SysTick counts them exactly. */
+        cpu_icount_set_cycle_time(system_clock_scale);
     }
 
 #ifdef DEBUG_STM32_RCC
@@ -844,6 +965,22 @@ static void stm32_rcc_init_clk(Stm32f2xxRcc *s)
     s->PERIPHCLK[STM32F2XX_UART3] = clktree_create_clk("UART3", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32F2XX_UART4] = clktree_create_clk("UART4", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
     s->PERIPHCLK[STM32F2XX_UART5] = clktree_create_clk("UART5", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
+    s->PERIPHCLK[STM32F2XX_UART6] = clktree_create_clk("UART6", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+
+    s->PERIPHCLK[STM32F2XX_DMA1] = clktree_create_clk("DMA1", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F2XX_DMA2] = clktree_create_clk("DMA2", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+
+    s->PERIPHCLK[STM32F2XX_ETH] = clktree_create_clk("ETH", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+
+    /* The register interface of the SDIO; the card clock (SDIOCLK, from
+     * the PLL48CLK output) is not modelled. */
+    s->PERIPHCLK[STM32F2XX_SDIO] = clktree_create_clk("SDIO", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK2, NULL);
+
+    s->PERIPHCLK[STM32F2XX_CRYP] = clktree_create_clk("CRYP", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F2XX_HASH] = clktree_create_clk("HASH", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F2XX_RNG] = clktree_create_clk("RNG", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F2XX_OTG_FS] = clktree_create_clk("OTG_FS", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
+    s->PERIPHCLK[STM32F2XX_OTG_HS] = clktree_create_clk("OTG_HS", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
 }
 
 
@@ -863,14 +1000,54 @@ static int stm32_rcc_init(SysBusDevice *dev)
     sysbus_init_irq(dev, &s->irq);
 
     stm32_rcc_init_clk(s);
+    s->sysclk_timer = qemu_new_timer_ns(vm_clock,
+                                        stm32_rcc_sysclk_timer_expire, s);
+    stm32_poll_init(&s->poll);
 
     return 0;
 }
 
 
+/* The clocks are saved by the clock tree itself (see clktree.c), so only
+ * the register fields that are not derived from them are saved here. */
+static const VMStateDescription vmstate_stm32_rcc = {
+    .name = "stm32f2xx_rcc",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT32(RCC_CIR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_APB1ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_APB2ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PPRE1, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PPRE2, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_HPRE, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_AHB1ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32_V(RCC_AHB2ENR, Stm32f2xxRcc, 2),
+        VMSTATE_UINT32(RCC_CFGR_SW, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_SWS, Stm32f2xxRcc),
+        VMSTATE_UINT8(RCC_PLLCFGR_PLLM, Stm32f2xxRcc),
+        VMSTATE_UINT8(RCC_PLLCFGR_PLLP, Stm32f2xxRcc),
+        VMSTATE_UINT8(RCC_PLLCFGR_PLLSRC, Stm32f2xxRcc),
+        VMSTATE_UINT16(RCC_PLLCFGR_PLLN, Stm32f2xxRcc),
+        VMSTATE_INT64(hse_startup.ready_time, Stm32f2xxRcc),
+        VMSTATE_INT64(lse_startup.ready_time, Stm32f2xxRcc),
+        VMSTATE_INT64(pll_startup.ready_time, Stm32f2xxRcc),
+        VMSTATE_TIMER(sysclk_timer, Stm32f2xxRcc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+
 static Property stm32_rcc_properties[] = {
     DEFINE_PROP_UINT32("osc_freq", Stm32f2xxRcc, osc_freq, 0),
     DEFINE_PROP_UINT32("osc32_freq", Stm32f2xxRcc, osc32_freq, 0),
+    DEFINE_PROP_STRING("periph_clk_check", Stm32f2xxRcc, periph_clk_check),
+    DEFINE_PROP_UINT32("hse_startup_us", Stm32f2xxRcc,
+                       hse_startup.startup_us, 0),
+    DEFINE_PROP_UINT32("lse_startup_us", Stm32f2xxRcc,
+                       lse_startup.startup_us, 0),
+    DEFINE_PROP_UINT32("pll_lock_us", Stm32f2xxRcc, pll_startup.startup_us, 0),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -883,11 +1060,12 @@ static void stm32_rcc_class_init(ObjectClass *klass, void *data)
     k->init = stm32_rcc_init;
     dc->reset = stm32_rcc_reset;
     dc->props = stm32_rcc_properties;
+    dc->vmsd = &vmstate_stm32_rcc;
 }
 
 static TypeInfo stm32_rcc_info = {
     .name  = "stm32f2xx_rcc",
-    .parent = TYPE_SYS_BUS_DEVICE,
+    .parent = TYPE_STM32_RCC,
     .instance_size  = sizeof(Stm32f2xxRcc),
     .class_init = stm32_rcc_class_init
 };
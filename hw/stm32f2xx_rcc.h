@@ -14,6 +14,7 @@ typedef struct Stm32f2xxRcc {
             /* Properties */
             uint32_t osc_freq;
             uint32_t osc32_freq;
+            char *periph_clk_check;
 
             /* Private */
             MemoryRegion iomem;
@@ -50,7 +51,9 @@ typedef struct Stm32f2xxRcc {
     RCC_CFGR_PPRE2,
     RCC_CFGR_HPRE,
     RCC_AHB1ENR,
-    RCC_CFGR_SW;
+    RCC_AHB2ENR,
+    RCC_CFGR_SW,
+    RCC_CFGR_SWS;
 
     uint8_t
     RCC_PLLCFGR_PLLM,
@@ -60,4 +63,11 @@ typedef struct Stm32f2xxRcc {
     uint16_t
     RCC_PLLCFGR_PLLN;
 
+    /* Oscillator and PLL start-up times (properties) and ready times */
+    Stm32RccStartup hse_startup, lse_startup, pll_startup;
+    /* Switches SYSCLK once the source selected by SW is ready */
+    QEMUTimer *sysclk_timer;
+
+    /* Detects software spinning on the ready flags */
+    Stm32Poll poll;
 } Stm32f2xxRcc;
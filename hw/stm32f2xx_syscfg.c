@@ -20,6 +20,7 @@
  */
 
 #include "stm32f2xx.h"
+#include "trace.h"
 
 
 
@@ -45,15 +46,16 @@ typedef struct {
     SysBusDevice busdev;
 
     /* Properties */
-    void *stm32_rcc_prop;
-    void *stm32_exti_prop;
+    Stm32Rcc *stm32_rcc;
+    Stm32Exti *stm32_exti;
+    void *boot_alias_prop;
     uint32_t boot_pins; //!< BOOT0 and BOOT1 pins
 
     /* Private */
     MemoryRegion iomem;
 
-    Stm32Rcc *stm32_rcc;
-    Stm32Exti *stm32_exti;
+    Stm32PeriphClk clk;
+    MemoryRegion *boot_alias; //!< STM32F2XX_MEM_MODE_COUNT regions at 0
 
     uint32_t
         USART1_REMAP,
@@ -71,15 +73,44 @@ static uint32_t stm32_syscfg_SYSCFG_MEMRMP_read(Stm32Syscfg *s)
     return s->SYSCFG_MEMRMP;
 }
 
+/* Enable the alias at 0x00000000 that MEM_MODE selects and disable the
+ * others, in one memory transaction.  Nothing needs to be done about
+ * translated code: TBs are looked up by the RAM address they were translated
+ * from, so those for the old mapping stay valid for when it comes back, and
+ * the TLB flush that the memory commit performs also empties the jump cache
+ * that finds TBs by guest address.  Rewriting the current mode is a no-op
+ * commit.
+ */
+static void stm32_syscfg_update_boot_alias(Stm32Syscfg *s)
+{
+    unsigned mode = s->SYSCFG_MEMRMP & SYSCFG_MEMRMP_MEM_MODE_MASK;
+    unsigned i;
+
+    if (!s->boot_alias) {
+        return;
+    }
+    memory_region_transaction_begin();
+    for (i = 0; i < STM32F2XX_MEM_MODE_COUNT; i++) {
+        memory_region_set_enabled(&s->boot_alias[i], i == mode);
+    }
+    memory_region_transaction_commit();
+}
+
 static void stm32_syscfg_SYSCFG_MEMRMP_write(Stm32Syscfg *s, uint32_t new_value,
                                         bool init)
 {
     if (init) {
         // "After reset these bits take the value selected by the BOOT pins."
-        s->SYSCFG_MEMRMP = (SYSCFG_MEMRMP_MEM_MODE_MASK & s->boot_pins);
+        // BOOT0 low boots from flash whatever BOOT1 is (RM0033 table 2).
+        if (s->boot_pins & 1) {
+            s->SYSCFG_MEMRMP = (SYSCFG_MEMRMP_MEM_MODE_MASK & s->boot_pins);
+        } else {
+            s->SYSCFG_MEMRMP = STM32F2XX_MEM_MODE_FLASH;
+        }
     } else {
-        s->SYSCFG_MEMRMP = new_value;
+        s->SYSCFG_MEMRMP = new_value & SYSCFG_MEMRMP_MEM_MODE_MASK;
     }
+    stm32_syscfg_update_boot_alias(s);
 }
 
 /* Write the External Interrupt Configuration Register.
@@ -178,16 +209,24 @@ static uint64_t stm32_syscfg_read(void *opaque, hwaddr offset,
                           unsigned size)
 {
     Stm32Syscfg *s = (Stm32Syscfg *)opaque;
+    uint64_t value;
 
-    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, STM32F2XX_SYSCFG, &s->busdev);
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return 0;
+    }
 
     switch(size) {
         case 4:
-            return stm32_syscfg_readw(opaque, offset);
+            value = stm32_syscfg_readw(opaque, offset);
+            break;
         default:
             STM32_BAD_REG(offset, size);
-            return 0;
+            value = 0;
+            break;
     }
+
+    trace_stm32_syscfg_read(s, offset, size, value);
+    return value;
 }
 
 static void stm32_syscfg_write(void *opaque, hwaddr offset,
@@ -195,7 +234,11 @@ static void stm32_syscfg_write(void *opaque, hwaddr offset,
 {
     Stm32Syscfg *s = (Stm32Syscfg *)opaque;
 
-    stm32_rcc_check_periph_clk((Stm32Rcc *)s->stm32_rcc, STM32F2XX_SYSCFG, &s->busdev);
+    trace_stm32_syscfg_write(s, offset, size, value);
+
+    if(!stm32_periph_clk_check(&s->clk)) {
+        return;
+    }
 
     switch(size) {
         case 4:
@@ -228,12 +271,23 @@ static void stm32_syscfg_reset(DeviceState *dev)
 
 /* DEVICE INITIALIZATION */
 
+static void stm32_syscfg_instance_init(Object *obj)
+{
+    Stm32Syscfg *s = FROM_SYSBUS(Stm32Syscfg, SYS_BUS_DEVICE(obj));
+
+    object_property_add_link(obj, "stm32_rcc", TYPE_STM32_RCC,
+                             (Object **)&s->stm32_rcc, NULL);
+    object_property_add_link(obj, "stm32_exti", "stm32_exti",
+                             (Object **)&s->stm32_exti, NULL);
+}
+
 static int stm32_syscfg_init(SysBusDevice *dev)
 {
     Stm32Syscfg *s = FROM_SYSBUS(Stm32Syscfg, dev);
 
-    s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
-    s->stm32_exti = (Stm32Exti *)s->stm32_exti_prop;
+    stm32_rcc_periph_clk_init(&s->clk, s->stm32_rcc, STM32F2XX_SYSCFG, dev,
+                              NULL);
+    s->boot_alias = (MemoryRegion *)s->boot_alias_prop;
 
     memory_region_init_io(&s->iomem, &stm32_syscfg_ops, s,
                           "syscfg", 0x03ff);
@@ -243,8 +297,7 @@ static int stm32_syscfg_init(SysBusDevice *dev)
 }
 
 static Property stm32_syscfg_properties[] = {
-    DEFINE_PROP_PTR("stm32_rcc", Stm32Syscfg, stm32_rcc_prop),
-    DEFINE_PROP_PTR("stm32_exti", Stm32Syscfg, stm32_exti_prop),
+    DEFINE_PROP_PTR("boot_alias", Stm32Syscfg, boot_alias_prop),
     DEFINE_PROP_BIT("boot0", Stm32Syscfg, boot_pins, 0, 0), // BOOT0 pin
     DEFINE_PROP_BIT("boot1", Stm32Syscfg, boot_pins, 1, 0), // BOOT1 pin
     DEFINE_PROP_END_OF_LIST()
@@ -264,6 +317,7 @@ static TypeInfo stm32_syscfg_info = {
     .name  = "stm32f2xx_syscfg",
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_size  = sizeof(Stm32Syscfg),
+    .instance_init = stm32_syscfg_instance_init,
     .class_init = stm32_syscfg_class_init
 };
 
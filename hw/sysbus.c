@@ -66,6 +66,17 @@ void sysbus_mmio_map(SysBusDevice *dev, int n, hwaddr addr)
                                 dev->mmio[n].memory);
 }
 
+void sysbus_mmio_map_to(SysBusDevice *dev, int n, MemoryRegion *parent,
+                        hwaddr addr)
+{
+    assert(n >= 0 && n < dev->num_mmio);
+    /* Unlike sysbus_mmio_map, this does not know how to move a region.  */
+    assert(dev->mmio[n].addr == (hwaddr)-1);
+
+    dev->mmio[n].addr = addr;
+    memory_region_add_subregion(parent, addr, dev->mmio[n].memory);
+}
+
 
 /* Request an IRQ source.  The actual IRQ object may be populated later.  */
 void sysbus_init_irq(SysBusDevice *dev, qemu_irq *p)
@@ -56,6 +56,10 @@ void sysbus_init_ioports(SysBusDevice *dev, pio_addr_t ioport, pio_addr_t size);
 
 void sysbus_connect_irq(SysBusDevice *dev, int n, qemu_irq irq);
 void sysbus_mmio_map(SysBusDevice *dev, int n, hwaddr addr);
+/* Maps the region into parent instead of the system memory, e.g. for a
+   machine with its own address space.  The region must not be mapped.  */
+void sysbus_mmio_map_to(SysBusDevice *dev, int n, MemoryRegion *parent,
+                        hwaddr addr);
 void sysbus_add_memory(SysBusDevice *dev, hwaddr addr,
                        MemoryRegion *mem);
 void sysbus_add_memory_overlap(SysBusDevice *dev, hwaddr addr,
@@ -29,7 +29,7 @@ typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
-    VirtQueue *vq;
+    VirtQueue **vqs;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
@@ -49,6 +49,7 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
@@ -65,8 +66,8 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(&s->vdev, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -120,21 +121,22 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     g_free(req);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = g_malloc(sizeof(*req));
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->next = NULL;
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
     if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
+        if (!virtqueue_pop(vq, &req->elem)) {
             g_free(req);
             return NULL;
         }
@@ -427,11 +429,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
+    bdrv_io_plug(s->bs);
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -531,7 +535,8 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = bdrv_enable_write_cache(s->bs);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    stw_raw(&blkcfg.num_queues, s->blk->num_queues);
+    memcpy(config, &blkcfg, s->vdev.config_len);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -539,7 +544,7 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = to_virtio_blk(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memcpy(&blkcfg, config, s->vdev.config_len);
     bdrv_set_enable_write_cache(s->bs, blkcfg.wce != 0);
 }
 
@@ -556,6 +561,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (s->blk->config_wce) {
         features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
     }
+    if (s->blk->num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCE);
 
@@ -595,6 +603,9 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     while (req) {
         qemu_put_sbyte(f, 1);
         qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        if (s->blk->num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -614,8 +625,17 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        VirtIOBlockReq *req = virtio_blk_alloc_request(s, s->vqs[0]);
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        if (s->blk->num_queues > 1) {
+            uint32_t n = qemu_get_be32(f);
+
+            if (n >= s->blk->num_queues) {
+                g_free(req);
+                return -EINVAL;
+            }
+            req->vq = s->vqs[n];
+        }
         req->next = s->rq;
         s->rq = req;
 
@@ -643,6 +663,8 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 {
     VirtIOBlock *s;
     static int virtio_blk_id;
+    size_t config_size;
+    int i;
 
     if (!blk->conf.bs) {
         error_report("drive property not set");
@@ -653,14 +675,28 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
         return NULL;
     }
 
+    if (blk->num_queues == 0) {
+        blk->num_queues = 1;
+    }
+    if (blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("virtio-blk supports at most %d queues",
+                     VIRTIO_PCI_QUEUE_MAX);
+        return NULL;
+    }
+
     blkconf_serial(&blk->conf, &blk->serial);
     if (blkconf_geometry(&blk->conf, NULL, 65535, 255, 255) < 0) {
         return NULL;
     }
 
+    /* Keep the config space of single queue devices as it always was, it
+     * is part of the migration stream.  */
+    config_size = sizeof(struct virtio_blk_config);
+    if (blk->num_queues == 1) {
+        config_size = offsetof(struct virtio_blk_config, unused0);
+    }
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
-                                          sizeof(struct virtio_blk_config),
-                                          sizeof(VirtIOBlock));
+                                          config_size, sizeof(VirtIOBlock));
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.set_config = virtio_blk_set_config;
@@ -673,9 +709,13 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->vqs = g_new(VirtQueue *, blk->num_queues);
+    for (i = 0; i < blk->num_queues; i++) {
+        s->vqs[i] = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    }
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     if (!virtio_blk_data_plane_create(&s->vdev, blk, &s->dataplane)) {
+        g_free(s->vqs);
         virtio_cleanup(&s->vdev);
         return NULL;
     }
@@ -704,5 +744,6 @@ void virtio_blk_exit(VirtIODevice *vdev)
 #endif
     unregister_savevm(s->qdev, "virtio-blk", s);
     blockdev_mark_auto_del(s->bs);
+    g_free(s->vqs);
     virtio_cleanup(vdev);
 }
@@ -34,6 +34,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -51,6 +52,9 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    /* Only part of the config space with VIRTIO_BLK_F_MQ */
+    uint8_t unused0[1];
+    uint16_t num_queues;
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -106,6 +110,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t num_queues;
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
@@ -36,6 +36,9 @@ typedef struct VirtIONetQueue {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    /* Inside a burst, used entries not flushed to the guest yet.  */
+    int rx_burst;
+    unsigned int rx_burst_used;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -883,7 +886,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, q->rx_burst_used + i++);
     }
 
     if (mhdr_cnt) {
@@ -893,12 +896,36 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(&n->vdev, q->rx_vq);
+    if (q->rx_burst) {
+        q->rx_burst_used += i;
+    } else {
+        virtqueue_flush(q->rx_vq, i);
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
 
     return size;
 }
 
+static void virtio_net_receive_burst_begin(NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    q->rx_burst++;
+}
+
+static void virtio_net_receive_burst_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (--q->rx_burst || !q->rx_burst_used) {
+        return;
+    }
+    virtqueue_flush(q->rx_vq, q->rx_burst_used);
+    q->rx_burst_used = 0;
+    virtio_notify(&n->vdev, q->rx_vq);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1279,6 +1306,8 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_burst_begin = virtio_net_receive_burst_begin,
+    .receive_burst_end = virtio_net_receive_burst_end,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
 };
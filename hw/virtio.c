@@ -16,6 +16,8 @@
 #include "trace.h"
 #include "qemu/error-report.h"
 #include "virtio.h"
+#include "exec/address-spaces.h"
+#include "hw/xen.h"
 #include "qemu/atomic.h"
 #include "virtio-bus.h"
 
@@ -57,6 +59,15 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+
+    /* Host pointers to the parts of the ring that are in RAM, NULL for
+     * those that are not and are accessed with ld*_phys()/st*_phys().
+     * Rebuilt when the ring moves and when the memory map changes.  */
+    VRingDesc *desc_host;
+    VRingAvail *avail_host;
+    VRingUsed *used_host;
+    MemoryRegion *used_mr;
+    hwaddr used_mr_offset;
 } VRing;
 
 struct VirtQueue
@@ -84,6 +95,56 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+/* Returns a host pointer to SIZE bytes of guest memory at ADDR if they
+ * are all in one RAM region, else NULL.  */
+static void *vring_map(hwaddr addr, hwaddr size, bool is_write,
+                       MemoryRegion **mr, hwaddr *mr_offset)
+{
+    MemoryRegionSection section;
+
+    if (!addr || !size || xen_enabled()) {
+        return NULL;
+    }
+    section = memory_region_find(get_system_memory(), addr, size);
+    if (!section.mr || section.offset_within_address_space != addr ||
+        section.size != size || !memory_region_is_ram(section.mr) ||
+        (is_write && section.readonly)) {
+        return NULL;
+    }
+    if (mr) {
+        *mr = section.mr;
+        *mr_offset = section.offset_within_region;
+    }
+    return (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+           section.offset_within_region;
+}
+
+static void virtqueue_map_rings(VirtQueue *vq)
+{
+    VRing *vring = &vq->vring;
+    unsigned int num = vring->num;
+
+    vring->desc_host = NULL;
+    vring->avail_host = NULL;
+    vring->used_host = NULL;
+    vring->used_mr = NULL;
+    if (!num || !vq->pa) {
+        return;
+    }
+
+    vring->desc_host = vring_map(vring->desc, num * sizeof(VRingDesc),
+                                 false, NULL, NULL);
+    /* Both rings end with the event index of the other side.  */
+    vring->avail_host = vring_map(vring->avail,
+                                  offsetof(VRingAvail, ring[num + 1]),
+                                  false, NULL, NULL);
+    vring->used_host = vring_map(vring->used,
+                                 offsetof(VRingUsed, ring[num]) +
+                                 sizeof(uint16_t),
+                                 true, &vring->used_mr,
+                                 &vring->used_mr_offset);
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -94,32 +155,74 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    virtqueue_map_rings(vq);
+}
+
+/* Indirect descriptor tables are mapped for as long as they are walked.  */
+static VRingDesc *vring_map_indirect(hwaddr desc_pa, unsigned int max)
+{
+    hwaddr size = max * sizeof(VRingDesc);
+    hwaddr len = size;
+    VRingDesc *desc;
+
+    if (!size) {
+        return NULL;
+    }
+    desc = cpu_physical_memory_map(desc_pa, &len, 0);
+    if (desc && len != size) {
+        cpu_physical_memory_unmap(desc, len, 0, 0);
+        desc = NULL;
+    }
+    return desc;
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static void vring_unmap_indirect(VRingDesc *desc, unsigned int max)
+{
+    if (desc) {
+        cpu_physical_memory_unmap(desc, max * sizeof(VRingDesc), 0, 0);
+    }
+}
+
+static inline uint64_t vring_desc_addr(hwaddr desc_pa, VRingDesc *desc,
+                                       int i)
 {
     hwaddr pa;
+    if (desc) {
+        return ldq_p(&desc[i].addr);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
     return ldq_phys(pa);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static inline uint32_t vring_desc_len(hwaddr desc_pa, VRingDesc *desc,
+                                      int i)
 {
     hwaddr pa;
+    if (desc) {
+        return ldl_p(&desc[i].len);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
     return ldl_phys(pa);
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_flags(hwaddr desc_pa, VRingDesc *desc,
+                                        int i)
 {
     hwaddr pa;
+    if (desc) {
+        return lduw_p(&desc[i].flags);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
     return lduw_phys(pa);
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_next(hwaddr desc_pa, VRingDesc *desc,
+                                       int i)
 {
     hwaddr pa;
+    if (desc) {
+        return lduw_p(&desc[i].next);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
     return lduw_phys(pa);
 }
@@ -127,6 +230,9 @@ static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     hwaddr pa;
+    if (vq->vring.avail_host) {
+        return lduw_p(&vq->vring.avail_host->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -134,6 +240,9 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
+    if (vq->vring.avail_host) {
+        return lduw_p(&vq->vring.avail_host->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -141,6 +250,9 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     hwaddr pa;
+    if (vq->vring.avail_host) {
+        return lduw_p(&vq->vring.avail_host->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
@@ -150,9 +262,23 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
+/* Stores through used_host bypass the dirty tracking st*_phys() do.  */
+static inline void vring_used_set_dirty(VirtQueue *vq, hwaddr offset,
+                                        hwaddr size)
+{
+    memory_region_set_dirty(vq->vring.used_mr,
+                            vq->vring.used_mr_offset + offset, size);
+}
+
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
+    if (vq->vring.used_host) {
+        stl_p(&vq->vring.used_host->ring[i].id, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].id),
+                             sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
     stl_phys(pa, val);
 }
@@ -160,6 +286,12 @@ static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
+    if (vq->vring.used_host) {
+        stl_p(&vq->vring.used_host->ring[i].len, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].len),
+                             sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
     stl_phys(pa, val);
 }
@@ -167,6 +299,9 @@ static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     hwaddr pa;
+    if (vq->vring.used_host) {
+        return lduw_p(&vq->vring.used_host->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
@@ -174,22 +309,45 @@ static uint16_t vring_used_idx(VirtQueue *vq)
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
+    if (vq->vring.used_host) {
+        stw_p(&vq->vring.used_host->idx, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, idx), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     stw_phys(pa, val);
 }
 
-static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+static inline uint16_t vring_used_flags(VirtQueue *vq)
 {
     hwaddr pa;
+    if (vq->vring.used_host) {
+        return lduw_p(&vq->vring.used_host->flags);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    return lduw_phys(pa);
 }
 
-static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+static inline void vring_used_flags_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
+    if (vq->vring.used_host) {
+        stw_p(&vq->vring.used_host->flags, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, flags), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    stw_phys(pa, val);
+}
+
+static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+{
+    vring_used_flags_set(vq, vring_used_flags(vq) | mask);
+}
+
+static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+{
+    vring_used_flags_set(vq, vring_used_flags(vq) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
@@ -198,6 +356,12 @@ static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
     if (!vq->notification) {
         return;
     }
+    if (vq->vring.used_host) {
+        stw_p(&vq->vring.used_host->ring[vq->vring.num], val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[vq->vring.num]),
+                             sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
     stw_phys(pa, val);
 }
@@ -316,17 +480,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
+static unsigned virtqueue_next_desc(hwaddr desc_pa, VRingDesc *desc,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(desc_pa, desc, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(desc_pa, desc, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -351,15 +515,17 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
         hwaddr desc_pa;
+        VRingDesc *desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc = vq->vring.desc_host;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(desc_pa, desc, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(desc_pa, desc, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -372,9 +538,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_len(desc_pa, desc, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(desc_pa, desc, i);
+            desc = vring_map_indirect(desc_pa, max);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
         }
 
         do {
@@ -384,15 +551,22 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (vring_desc_flags(desc_pa, desc, i) & VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(desc_pa, desc, i);
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += vring_desc_len(desc_pa, desc, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
-                goto done;
+                break;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(desc_pa, desc, i, max)) != max);
+
+        if (indirect) {
+            vring_unmap_indirect(desc, max);
+        }
+        if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+            goto done;
+        }
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -433,33 +607,32 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/* Collects the descriptor chain starting at HEAD into ELEM and maps it.  */
+static void virtqueue_read_elem(VirtQueue *vq, VirtQueueElement *elem,
+                                unsigned int head)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     hwaddr desc_pa = vq->vring.desc;
-
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    VRingDesc *desc = vq->vring.desc_host;
+    bool indirect = false;
 
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
 
     max = vq->vring.num;
+    i = head;
 
-    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-        vring_avail_event(vq, vring_avail_idx(vq));
-    }
-
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(desc_pa, desc, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(desc_pa, desc, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(desc_pa, desc, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(desc_pa, desc, i);
+        desc = vring_map_indirect(desc_pa, max);
+        indirect = true;
         i = 0;
     }
 
@@ -467,30 +640,34 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (vring_desc_flags(desc_pa, desc, i) & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, desc, i);
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, desc, i);
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = vring_desc_len(desc_pa, desc, i);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(desc_pa, desc, i, max)) != max);
+
+    if (indirect) {
+        vring_unmap_indirect(desc, max);
+    }
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -501,9 +678,43 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+}
+
+int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    unsigned int head;
+
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
+        return 0;
+
+    head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+    }
+
+    virtqueue_read_elem(vq, elem, head);
     return elem->in_num + elem->out_num;
 }
 
+int virtqueue_pop_many(VirtQueue *vq, VirtQueueElement *elems, int max)
+{
+    int i, n;
+
+    n = MIN(virtqueue_num_heads(vq, vq->last_avail_idx), max);
+    if (n <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        virtqueue_read_elem(vq, &elems[i],
+                            virtqueue_get_head(vq, vq->last_avail_idx++));
+    }
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+    }
+    return n;
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -554,6 +765,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        virtqueue_map_rings(&vdev->vq[i]);
     }
 }
 
@@ -710,6 +922,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_map_rings(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -889,6 +1102,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_common_cleanup(VirtIODevice *vdev)
 {
+    memory_listener_unregister(&vdev->memory_listener);
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -919,6 +1133,20 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     }
 }
 
+/* RAM may have moved under the rings.  */
+static void virtio_memory_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice,
+                                      memory_listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].pa) {
+            virtqueue_map_rings(&vdev->vq[i]);
+        }
+    }
+}
+
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
@@ -945,6 +1173,10 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     }
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change,
                                                      vdev);
+    vdev->memory_listener = (MemoryListener) {
+        .commit = virtio_memory_commit,
+    };
+    memory_listener_register(&vdev->memory_listener, &address_space_memory);
 }
 
 VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
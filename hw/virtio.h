@@ -19,6 +19,7 @@
 #include "qdev.h"
 #include "sysemu/sysemu.h"
 #include "qemu/event_notifier.h"
+#include "exec/memory.h"
 #ifdef CONFIG_LINUX
 #include "9p.h"
 #endif
@@ -158,6 +159,8 @@ struct VirtIODevice
     uint16_t device_id;
     bool vm_running;
     VMChangeStateEntry *vmstate;
+    /* Keeps the host mappings of the rings up to date.  */
+    MemoryListener memory_listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -192,6 +195,8 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+/* Pops up to MAX elements into ELEMS at once, returns how many.  */
+int virtqueue_pop_many(VirtQueue *vq, VirtQueueElement *elems, int max);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
@@ -266,6 +266,10 @@ void bdrv_invalidate_cache_all(void);
 
 void bdrv_clear_incoming_migration_all(void);
 
+/* Batch the requests submitted between the two, see BlockDriver */
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
 /* Ensure contents are flushed to disk.  */
 int bdrv_flush(BlockDriverState *bs);
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs);
@@ -362,6 +366,8 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 void bdrv_dirty_iter_init(BlockDriverState *bs, struct HBitmapIter *hbi);
 int64_t bdrv_get_dirty_count(BlockDriverState *bs);
+void bdrv_set_backup_tracking(BlockDriverState *bs, const char *filename,
+                              int granularity, Error **errp);
 
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
 void bdrv_disable_copy_on_read(BlockDriverState *bs);
@@ -378,6 +384,15 @@ static inline int raw_get_aio_fd(BlockDriverState *bs)
 }
 #endif
 
+#ifdef __linux__
+int raw_get_sendfile_fd(BlockDriverState *bs);
+#else
+static inline int raw_get_sendfile_fd(BlockDriverState *bs)
+{
+    return -ENOTSUP;
+}
+#endif
+
 enum BlockAcctType {
     BDRV_ACCT_READ,
     BDRV_ACCT_WRITE,
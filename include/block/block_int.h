@@ -42,7 +42,9 @@
 #define BLOCK_IO_LIMIT_WRITE    1
 #define BLOCK_IO_LIMIT_TOTAL    2
 
-#define BLOCK_IO_SLICE_TIME     100000000
+/* Burst size of a limit that does not give one, as the time it takes to
+ * leak at the rate of the limit.  */
+#define BLOCK_IO_BURST_TIME     100000000
 #define NANOSECONDS_PER_SECOND  1000000000.0
 
 #define BLOCK_OPT_SIZE              "size"
@@ -63,12 +65,13 @@ typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    /* Burst sizes in bytes and operations, 0 for BLOCK_IO_BURST_TIME */
+    int64_t bps_max[3];
+    int64_t iops_max[3];
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+/* Drives whose I/O is throttled together, see block.c */
+typedef struct BlockThrottleGroup BlockThrottleGroup;
 
 struct BlockDriver {
     const char *format_name;
@@ -128,6 +131,14 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs);
 
+    /*
+     * Hold back the requests submitted from now on until the matching
+     * unplug, so that they can be passed to the host in one go.  Calls
+     * nest.  Drivers without these pass them to bs->file.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -246,14 +257,12 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* I/O throttling; the limits are those of the group */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
+    char         *throttle_group_name;
+    BlockThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) throttle_group_next;
     CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
@@ -278,6 +287,9 @@ struct BlockDriverState {
     BlockDeviceIoStatus iostatus;
     char device_name[32];
     HBitmap *dirty_bitmap;
+    /* Writes since the last backup, saved to backup_bitmap_file on close */
+    HBitmap *backup_bitmap;
+    char *backup_bitmap_file;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
@@ -291,7 +303,7 @@ struct BlockDriverState {
 int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits);
+                        BlockIOLimit *io_limits, const char *group);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -347,6 +359,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
+ * @max_in_flight: The number of operations that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
@@ -361,7 +374,34 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  int max_in_flight, MirrorSyncMode mode,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp);
+
+/*
+ * backup_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @incremental: Whether to copy only what was written since the last backup.
+ * @max_in_flight: The number of operations that can be in flight at one time.
+ * @on_source_error: The action to take upon error reading from the source.
+ * @on_target_error: The action to take upon error writing to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a backup operation on @bs.  Clusters that are allocated in @bs, or
+ * with @incremental only those written since the last backup (see
+ * bdrv_set_backup_tracking), are copied to @target.  Writes made from then
+ * on are tracked for the next backup; if the job does not complete, the
+ * clusters it was to copy are tracked again too.
+ */
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, bool incremental, int max_in_flight,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
@@ -103,6 +103,9 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** When the job was created, to publish its throughput.  */
+    int64_t start_ns;
+
     /** The completion function that will be called when the job completes.  */
     BlockDriverCompletionFunc *cb;
 
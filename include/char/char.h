@@ -63,6 +63,7 @@ struct CharDriverState {
     IOEventHandler *chr_event;
     IOCanReadHandler *chr_can_read;
     IOReadHandler *chr_read;
+    void (*chr_write_unblocked)(void *opaque);
     void *handler_opaque;
     void (*chr_close)(struct CharDriverState *chr);
     void (*chr_accept_input)(struct CharDriverState *chr);
@@ -165,6 +166,19 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_set_write_unblocked:
+ *
+ * Ask to be told when a backend that consumed fewer bytes than it was given
+ * by @qemu_chr_fe_write can take more data.  The handler is called with the
+ * opaque passed to @qemu_chr_add_handlers, and is forgotten when the
+ * handlers are released.
+ *
+ * @fd_write_unblocked the handler, or NULL
+ */
+void qemu_chr_fe_set_write_unblocked(CharDriverState *s,
+                                     void (*fd_write_unblocked)(void *opaque));
+
 /**
  * @qemu_chr_fe_ioctl:
  *
@@ -215,6 +229,14 @@ int qemu_chr_be_can_write(CharDriverState *s);
  */
 void qemu_chr_be_write(CharDriverState *s, uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_be_write_unblocked:
+ *
+ * Tell the front end that the back end can take data again after a short
+ * @qemu_chr_fe_write.
+ */
+void qemu_chr_be_write_unblocked(CharDriverState *s);
+
 
 /**
  * @qemu_chr_be_event:
@@ -240,6 +262,10 @@ CharDriverState *qemu_chr_find(const char *name);
 
 QemuOpts *qemu_chr_parse_compat(const char *label, const char *filename);
 
+/* Creates two connected character devices, for linking two frontends
+   (e.g. two emulated serial ports) inside one process.  */
+void qemu_chr_open_pair(CharDriverState **chr0, CharDriverState **chr1);
+
 /* add an eventfd to the qemu devices that are polled */
 CharDriverState *qemu_chr_open_eventfd(int eventfd);
 
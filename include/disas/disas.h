@@ -14,6 +14,11 @@ void monitor_disas(Monitor *mon, CPUArchState *env,
 
 /* Look up symbol for debugging purpose.  Returns "" if unknown. */
 const char *lookup_symbol(target_ulong orig_addr);
+
+#if !defined(CONFIG_USER_ONLY)
+/* Look up the address of function symbol NAME.  Returns false if unknown. */
+bool lookup_symbol_addr(const char *name, hwaddr *addr);
+#endif
 #endif
 
 struct syminfo;
@@ -24,10 +29,15 @@ struct elf64_sym;
 typedef const char *(*lookup_symbol_t)(struct syminfo *s, target_ulong orig_addr);
 #else
 typedef const char *(*lookup_symbol_t)(struct syminfo *s, hwaddr orig_addr);
+typedef bool (*lookup_addr_t)(struct syminfo *s, const char *name,
+                              hwaddr *addr);
 #endif
 
 struct syminfo {
     lookup_symbol_t lookup_symbol;
+#if !defined(CONFIG_USER_ONLY)
+    lookup_addr_t lookup_addr;
+#endif
     unsigned int disas_num_syms;
     union {
       struct elf32_sym *elf32;
@@ -56,6 +56,10 @@ void qemu_put_ram_ptr(void *addr);
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
+int qemu_ram_restore(ram_addr_t addr, const uint8_t *buf, ram_addr_t len);
+void qemu_ram_invalidate(ram_addr_t addr, ram_addr_t len);
+void qemu_ram_prepare_write(ram_addr_t addr, ram_addr_t len);
+void qemu_ram_snapshot_track(ram_addr_t addr, ram_addr_t len, bool track);
 
 void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
                             int len, int is_write);
@@ -76,9 +76,25 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
+/* An entry of the jump cache only holds while its generation is that of
+   its page slice, so that flushing a slice is a matter of incrementing
+   its generation.  */
+typedef struct CPUTBJmpCacheEntry {
+    struct TranslationBlock *tb;
+    uint32_t gen;
+} CPUTBJmpCacheEntry;
+
 #if !defined(CONFIG_USER_ONLY)
+/* The TLB size is built into the generated code, so it can only be
+   changed at build time (e.g. --extra-cflags=-DCPU_TLB_BITS=10).  Some
+   TCG backends (ARM, PPC) can not handle more than 8 bits.  */
+#ifndef CPU_TLB_BITS
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Entries evicted from the TLB are kept in a small fully associative
+   victim TLB, which is searched before refilling from the page tables.  */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -112,12 +128,22 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
+    unsigned int vtlb_index;                                            \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;
 
+/* Counts for "info tlb-stats".  Hits in the main TLB are taken by the
+   generated code and not counted.  */
+#define CPU_COMMON_TLB_STATS                                            \
+    uint64_t tlb_miss_count;                                            \
+    uint64_t tlb_victim_hit_count;
+
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_STATS
 
 #endif
 
@@ -161,8 +187,11 @@ typedef struct CPUWatchpoint {
     uint32_t halted; /* Nonzero if the CPU is in suspend state */       \
     uint32_t interrupt_request;                                         \
     volatile sig_atomic_t exit_request;                                 \
+    /* Nonzero to make generated code return at the next TB entry.  */  \
+    volatile sig_atomic_t tcg_exit_req;                                 \
     CPU_COMMON_TLB                                                      \
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
+    CPUTBJmpCacheEntry tb_jmp_cache[TB_JMP_CACHE_SIZE];                 \
+    uint32_t tb_jmp_cache_gen[TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE];    \
     /* buffer for temporaries in the code generator */                  \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                 \
                                                                         \
@@ -179,11 +208,17 @@ typedef struct CPUWatchpoint {
     /* from this point: preserved by CPU reset */                       \
     /* ice debug support */                                             \
     QTAILQ_HEAD(breakpoints_head, CPUBreakpoint) breakpoints;            \
+    /* Number of breakpoints at each pc (see cpu_breakpoint_at).  */    \
+    GHashTable *breakpoint_index;                                       \
     int singlestep_enabled;                                             \
                                                                         \
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;            \
+    /* Number of watchpoints in each page.  */                          \
+    GHashTable *watchpoint_index;                                       \
     CPUWatchpoint *watchpoint_hit;                                      \
                                                                         \
+    CPU_COMMON_TLB_STATS                                                \
+                                                                        \
     struct GDBRegisterState *gdb_regs;                                  \
                                                                         \
     /* Core interrupt code */                                           \
@@ -81,9 +81,13 @@ void cpu_gen_init(void);
 int cpu_gen_code(CPUArchState *env, struct TranslationBlock *tb,
                  int *gen_code_size_ptr);
 bool cpu_restore_state(CPUArchState *env, uintptr_t searched_pc);
+/* find the TB whose generated code contains the host address tc_ptr.
+   Return NULL if not found */
+TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 void QEMU_NORETURN cpu_resume_from_signal(CPUArchState *env1, void *puc);
 void QEMU_NORETURN cpu_io_recompile(CPUArchState *env, uintptr_t retaddr);
+void cpu_icount_charge(CPUArchState *env, int cycles);
 TranslationBlock *tb_gen_code(CPUArchState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
@@ -114,6 +118,7 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial size of the physical TB hash table; it grows as needed */
 #define CODE_GEN_PHYS_HASH_BITS     15
 #define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
@@ -126,7 +131,7 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 #define CODE_GEN_AVG_BLOCK_SIZE 64
 #endif
 
-#if defined(__arm__) || defined(_ARCH_PPC) \
+#if defined(__arm__) || defined(__aarch64__) || defined(_ARCH_PPC) \
     || defined(__x86_64__) || defined(__i386__) \
     || defined(__sparc__) \
     || defined(CONFIG_TCG_INTERPRETER)
@@ -139,13 +144,17 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    /* data of the first page that the translator folded into the code
+       (literal pools), as offsets in the page; stores to it invalidate
+       the TB like stores to its code.  Empty if lit_start == lit_end. */
+    uint16_t lit_start;
+    uint16_t lit_end;
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_INVALID     0x10000 /* Invalidated, waiting to be evicted.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -166,6 +175,11 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* Counts kept with -tcg profile=on.  */
+    uint64_t exec_count;
+    uint32_t chain_exits;   /* returns to cpu_exec through unlinked goto_tb */
+    uint32_t io_count;      /* MMIO accesses */
+    uint16_t helper_calls;  /* calls in the generated code */
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -183,16 +197,43 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline TranslationBlock *tb_jmp_cache_get(CPUArchState *env,
+                                                 target_ulong pc)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    unsigned int h = tb_jmp_cache_hash_func(pc);
+    CPUTBJmpCacheEntry *e = &env->tb_jmp_cache[h];
+
+    if (e->gen != env->tb_jmp_cache_gen[h >> TB_JMP_PAGE_BITS]) {
+        return NULL;
+    }
+    return e->tb;
+}
+
+static inline void tb_jmp_cache_set(CPUArchState *env, target_ulong pc,
+                                    TranslationBlock *tb)
+{
+    unsigned int h = tb_jmp_cache_hash_func(pc);
+    CPUTBJmpCacheEntry *e = &env->tb_jmp_cache[h];
+
+    e->tb = tb;
+    e->gen = env->tb_jmp_cache_gen[h >> TB_JMP_PAGE_BITS];
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+void tb_flush_jmp_cache_all(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock *tb_find_phys(CPUArchState *env, target_ulong pc,
+                               tb_page_addr_t phys_pc, target_ulong cs_base,
+                               uint64_t flags);
+extern int tb_trace_count;
+extern int tb_trace_jmp_count;
+extern int64_t tb_gen_insn_count;
+void tb_profile_exit(uintptr_t next_tb);
+int tb_pretranslate(CPUArchState *env, target_ulong pc, target_ulong end,
+                    int max);
+void tb_profile_io(struct MemoryRegion *mr, uintptr_t retaddr);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -237,6 +278,9 @@ static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
     __asm __volatile__ ("swi 0x9f0002" : : "r" (_beg), "r" (_end), "r" (_flg));
 #endif
 }
+#elif defined(__aarch64__)
+void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
+#define tb_set_jmp_target1 aarch64_tb_set_jmp_target
 #elif defined(__sparc__)
 void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr);
 #else
@@ -346,6 +390,8 @@ void io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    target_ulong addr, size_t elt_ofs);
 
 #include "exec/softmmu_defs.h"
 
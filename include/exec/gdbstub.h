@@ -46,6 +46,24 @@ static inline int cpu_index(CPUArchState *env)
 int gdbserver_start(int);
 #else
 int gdbserver_start(const char *port);
+
+#include "exec/hwaddr.h"
+
+struct MemoryRegion;
+
+/* Programming a flash array on behalf of gdb's "load" (the vFlash
+   packets).  Offsets are relative to the start of the region.  Both
+   return 0, or -1 if the range cannot be erased or written.  */
+typedef struct GDBFlashOps {
+    int (*erase)(void *opaque, hwaddr offset, hwaddr size);
+    int (*write)(void *opaque, hwaddr offset, const uint8_t *buf,
+                 hwaddr size);
+} GDBFlashOps;
+
+/* Describe MR to gdb as flash erased BLOCK_SIZE bytes at a time, wherever
+   it is mapped.  */
+void gdb_register_flash(struct MemoryRegion *mr, hwaddr block_size,
+                        const GDBFlashOps *ops, void *opaque);
 #endif
 
 /* in gdbstub-xml.c, generated by scripts/feature_to_c.sh */
@@ -3,14 +3,26 @@
 
 #include "qemu/timer.h"
 
-/* Helpers for instruction counting code generation.  */
+/* Helpers for instruction counting code generation, and for the check
+   done on entry to every TB.  When tcg_exit_req is set, the TB returns to
+   cpu_exec before running any instruction, with TB + 3 as the value, so
+   that chained TBs see an interrupt or exit request without their jumps
+   being reset.  */
 
 static TCGArg *icount_arg;
 static int icount_label;
+static int exitreq_label;
 
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
+    TCGv_i32 flag;
+
+    exitreq_label = gen_new_label();
+    flag = tcg_temp_new_i32();
+    tcg_gen_ld_i32(flag, cpu_env, offsetof(CPUArchState, tcg_exit_req));
+    tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
+    tcg_temp_free_i32(flag);
 
     if (!use_icount)
         return;
@@ -29,6 +41,9 @@ static inline void gen_icount_start(void)
 
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
+    gen_set_label(exitreq_label);
+    tcg_gen_exit_tb((tcg_target_long)tb + 3);
+
     if (use_icount) {
         *icount_arg = num_insns;
         gen_set_label(icount_label);
@@ -36,6 +51,54 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
     }
 }
 
+/* Count executions of TB for -tcg profile=on.  */
+static inline void gen_tb_profile(TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i64 count;
+
+    if (!tcg_tb_profile)
+        return;
+
+    ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Count the edge into TB for -tcg coverage=on.  TBs that are chained run
+   this too, so the map sees every edge and not only those that go through
+   the main loop.  */
+static inline void gen_tb_coverage(TranslationBlock *tb)
+{
+    uint32_t cur;
+    TCGv_ptr ptr, prev_ptr;
+    TCGv_i32 val;
+
+    if (!tcg_coverage)
+        return;
+
+    cur = ((tb->pc >> 4) ^ (tb->pc << 8)) & (TCG_COVERAGE_MAP_SIZE - 1);
+    prev_ptr = tcg_const_ptr((tcg_target_long)&tcg_coverage_prev);
+    val = tcg_temp_new_i32();
+    tcg_gen_ld_i32(val, prev_ptr, 0);
+    tcg_gen_xori_i32(val, val, cur);
+    ptr = tcg_temp_new_ptr();
+    tcg_gen_ext_i32_ptr(ptr, val);
+    tcg_gen_addi_ptr(ptr, ptr, (tcg_target_long)tcg_coverage_map);
+    tcg_gen_ld8u_i32(val, ptr, 0);
+    tcg_gen_addi_i32(val, val, 1);
+    tcg_gen_st8_i32(val, ptr, 0);
+    tcg_gen_movi_i32(val, cur >> 1);
+    tcg_gen_st_i32(val, prev_ptr, 0);
+    tcg_temp_free_i32(val);
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_ptr(prev_ptr);
+}
+
 static inline void gen_io_start(void)
 {
     TCGv_i32 tmp = tcg_const_i32(1);
@@ -30,6 +30,17 @@ struct PhysPageEntry {
     uint16_t ptr : 15;
 };
 
+typedef struct PhysPageCacheEntry PhysPageCacheEntry;
+
+struct PhysPageCacheEntry {
+    hwaddr index;         /* page index, or PHYS_PAGE_CACHE_INVALID */
+    uint16_t section;     /* index into phys_sections */
+};
+
+#define PHYS_PAGE_CACHE_BITS 4
+#define PHYS_PAGE_CACHE_SIZE (1 << PHYS_PAGE_CACHE_BITS)
+#define PHYS_PAGE_CACHE_INVALID ((hwaddr)-1)
+
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
 
 struct AddressSpaceDispatch {
@@ -37,6 +48,10 @@ struct AddressSpaceDispatch {
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
+    /* Direct-mapped cache of recent phys_page_find() results, flushed
+     * whenever phys_map changes.
+     */
+    PhysPageCacheEntry cache[PHYS_PAGE_CACHE_SIZE];
     MemoryListener listener;
 };
 
@@ -58,6 +73,8 @@ void qemu_unregister_coalesced_mmio(hwaddr addr, ram_addr_t size);
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+/* clear on the pages that a live snapshot has yet to save */
+#define SNAPSHOT_DIRTY_FLAG  0x10
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
@@ -85,6 +102,43 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
     return ret;
 }
 
+/* Find the first run of pages in [start, end) with any of dirty_flags set,
+   skipping clean pages a word at a time.  Returns the start of the run and
+   its size in *length, which is 0 if there is none.  */
+static inline ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start,
+                                                        ram_addr_t end,
+                                                        int dirty_flags,
+                                                        ram_addr_t *length)
+{
+    const uint8_t *p = ram_list.phys_dirty;
+    unsigned long mask = dirty_flags * (~0UL / 0xff);
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t last = TARGET_PAGE_ALIGN(end) >> TARGET_PAGE_BITS;
+    ram_addr_t first;
+
+    while (page < last && (page % sizeof(long)) && !(p[page] & dirty_flags)) {
+        page++;
+    }
+    while (page + sizeof(long) <= last && !(page % sizeof(long)) &&
+           !(*(unsigned long *)(p + page) & mask)) {
+        page += sizeof(long);
+    }
+    while (page < last && !(p[page] & dirty_flags)) {
+        page++;
+    }
+    if (page == last) {
+        *length = 0;
+        return end;
+    }
+
+    first = page;
+    while (page < last && (p[page] & dirty_flags)) {
+        page++;
+    }
+    *length = (page - first) << TARGET_PAGE_BITS;
+    return first << TARGET_PAGE_BITS;
+}
+
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
@@ -37,6 +37,7 @@ typedef struct MemoryRegionMmio MemoryRegionMmio;
 #define DIRTY_MEMORY_VGA       0
 #define DIRTY_MEMORY_CODE      1
 #define DIRTY_MEMORY_MIGRATION 3
+#define DIRTY_MEMORY_SNAPSHOT  4
 
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
@@ -115,6 +116,7 @@ struct MemoryRegionOps {
 
 typedef struct CoalescedMemoryRange CoalescedMemoryRange;
 typedef struct MemoryRegionIoeventfd MemoryRegionIoeventfd;
+typedef struct MemoryRegionStats MemoryRegionStats;
 
 struct MemoryRegion {
     /* All fields are private - violators will be prosecuted */
@@ -134,6 +136,7 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    uint8_t direct_sizes; /* Access sizes that need no dispatch work */
     MemoryRegion *alias;
     hwaddr alias_offset;
     unsigned priority;
@@ -145,6 +148,7 @@ struct MemoryRegion {
     uint8_t dirty_log_mask;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    MemoryRegionStats *stats; /* Access counts, see mmio-stats-enable */
 };
 
 struct MemoryRegionPortio {
@@ -319,6 +323,24 @@ void memory_region_init_rom_device(MemoryRegion *mr,
                                    const char *name,
                                    uint64_t size);
 
+/**
+ * memory_region_init_rom_device_ptr:  Initialize a ROM memory region from
+ *                                     a user-provided pointer.  Writes are
+ *                                     handled via callbacks.
+ *
+ * @mr: the #MemoryRegion to be initialized.
+ * @ops: callbacks for write access handling.
+ * @name: the name of the region.
+ * @size: size of the region.
+ * @ptr: memory to be mapped; must contain at least @size bytes.
+ */
+void memory_region_init_rom_device_ptr(MemoryRegion *mr,
+                                       const MemoryRegionOps *ops,
+                                       void *opaque,
+                                       const char *name,
+                                       uint64_t size,
+                                       void *ptr);
+
 /**
  * memory_region_init_reservation: Initialize a memory region that reserves
  *                                 I/O space.
@@ -469,6 +491,27 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+
+/**
+ * memory_region_test_and_clear_dirty_run: Find the first run of dirty pages
+ *                                         for a specified client. It clears
+ *                                         them.
+ *
+ * Like memory_region_test_and_clear_dirty(), but looks for the first run of
+ * consecutive dirty pages in the range and clears only those, in one go.
+ * Returns the address of the run (relative to the start of the region), and
+ * its size in @len, which is 0 if the whole range is clean.
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @len: where to store the size of the run.
+ */
+hwaddr memory_region_test_and_clear_dirty_run(MemoryRegion *mr, hwaddr addr,
+                                              hwaddr size, unsigned client,
+                                              hwaddr *len);
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -862,6 +905,20 @@ void address_space_write(AddressSpace *as, hwaddr addr,
  */
 void address_space_read(AddressSpace *as, hwaddr addr, uint8_t *buf, int len);
 
+/**
+ * address_space_write_rom: write to an address space, including ROM.
+ *
+ * Like address_space_write, but also writes to ROM and ROM devices, and
+ * ignores anything that is not RAM or ROM.  Used for loading images and by
+ * debuggers.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @buf: buffer with the data transferred
+ */
+void address_space_write_rom(AddressSpace *as, hwaddr addr,
+                             const uint8_t *buf, int len);
+
 /* address_space_map: map a physical memory region into a host virtual address
  *
  * May map a subset of the requested range, given by and returned in @plen.
@@ -22,6 +22,19 @@ uint64_t helper_ldq_mmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 void helper_stq_mmu(CPUArchState *env, target_ulong addr, uint64_t val,
                     int mmu_idx);
 
+uint32_t helper_direct_ldb_mmu(CPUArchState *env, target_ulong addr,
+                               int mmu_idx);
+void helper_direct_stb_mmu(CPUArchState *env, target_ulong addr,
+                           uint32_t val, int mmu_idx);
+uint32_t helper_direct_ldw_mmu(CPUArchState *env, target_ulong addr,
+                               int mmu_idx);
+void helper_direct_stw_mmu(CPUArchState *env, target_ulong addr,
+                           uint32_t val, int mmu_idx);
+uint32_t helper_direct_ldl_mmu(CPUArchState *env, target_ulong addr,
+                               int mmu_idx);
+void helper_direct_stl_mmu(CPUArchState *env, target_ulong addr,
+                           uint32_t val, int mmu_idx);
+
 uint8_t helper_ldb_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 void helper_stb_cmmu(CPUArchState *env, target_ulong addr, uint8_t val,
 int mmu_idx);
@@ -68,6 +68,9 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = retaddr;
+    if (unlikely(tcg_tb_profile)) {
+        tb_profile_io(mr, retaddr);
+    }
     if (mr != &io_mem_ram && mr != &io_mem_rom
         && mr != &io_mem_unassigned
         && mr != &io_mem_notdirty
@@ -143,7 +146,10 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, addr,
+                            offsetof(CPUTLBEntry, ADDR_READ))) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -195,7 +201,10 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, addr,
+                            offsetof(CPUTLBEntry, ADDR_READ))) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -218,6 +227,9 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
     MemoryRegion *mr = iotlb_to_region(physaddr);
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
+    if (unlikely(tcg_tb_profile)) {
+        tb_profile_io(mr, retaddr);
+    }
     if (mr != &io_mem_ram && mr != &io_mem_rom
         && mr != &io_mem_unassigned
         && mr != &io_mem_notdirty
@@ -288,7 +300,10 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, addr,
+                            offsetof(CPUTLBEntry, addr_write))) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -338,11 +353,64 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, addr,
+                            offsetof(CPUTLBEntry, addr_write))) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
 
+#if SHIFT <= 2
+/* Accesses to a constant address which the translator expects to be a
+   device register.  TCG calls these directly from the generated code
+   instead of emitting the TLB lookup, so GETPC() is the access and the
+   default path must not use GETPC_EXT().  */
+uint32_t glue(glue(helper_direct_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
+                                                         target_ulong addr,
+                                                         int mmu_idx)
+{
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    uintptr_t retaddr = GETPC();
+
+    if (env->tlb_table[mmu_idx][index].addr_read
+        == ((addr & TARGET_PAGE_MASK) | TLB_MMIO)
+        && (addr & (DATA_SIZE - 1)) == 0) {
+        return glue(io_read, SUFFIX)(env, env->iotlb[mmu_idx][index],
+                                     addr, retaddr);
+    }
+#ifdef ALIGNED_ONLY
+    if ((addr & (DATA_SIZE - 1)) != 0) {
+        do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+    }
+#endif
+    return glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(env, addr, mmu_idx, retaddr);
+}
+
+void glue(glue(helper_direct_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
+                                                     target_ulong addr,
+                                                     uint32_t val,
+                                                     int mmu_idx)
+{
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    uintptr_t retaddr = GETPC();
+
+    if (env->tlb_table[mmu_idx][index].addr_write
+        == ((addr & TARGET_PAGE_MASK) | TLB_MMIO)
+        && (addr & (DATA_SIZE - 1)) == 0) {
+        glue(io_write, SUFFIX)(env, env->iotlb[mmu_idx][index], val,
+                               addr, retaddr);
+        return;
+    }
+#ifdef ALIGNED_ONLY
+    if ((addr & (DATA_SIZE - 1)) != 0) {
+        do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
+    }
+#endif
+    glue(glue(slow_st, SUFFIX), MMUSUFFIX)(env, addr, val, mmu_idx, retaddr);
+}
+#endif /* SHIFT <= 2 */
+
 #endif /* !defined(SOFTMMU_CODE_ACCESS) */
 
 #undef READ_ACCESS_TYPE
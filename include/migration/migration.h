@@ -29,6 +29,13 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Data queued to be sent: len bytes at data, or the next len bytes of the
+   buffer if data is NULL.  */
+typedef struct MigrationChunk {
+    const uint8_t *data;
+    size_t len;
+} MigrationChunk;
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -37,6 +44,9 @@ struct MigrationState
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
+    MigrationChunk *chunks;
+    int nb_chunks;
+    int chunks_capacity;
     QemuThread thread;
 
     QEMUFile *file;
@@ -45,6 +55,8 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional, lets pages be sent straight from guest RAM */
+    ssize_t (*writev)(MigrationState *s, struct iovec *iov, int iovcnt);
     void *opaque;
     MigrationParams params;
     int64_t total_time;
@@ -53,7 +65,13 @@ struct MigrationState
     int64_t dirty_pages_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int encode_threads;
     bool complete;
+    /* In the postcopy phase; the destination runs and sends page requests,
+       the part of one that has been read is in rp_buf.  */
+    bool postcopy;
+    uint8_t rp_buf[264];
+    size_t rp_len;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -129,7 +147,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
+int migrate_use_postcopy(void);
 int64_t migrate_xbzrle_cache_size(void);
+int migrate_encode_threads(void);
+
+#define MAX_MIGRATE_ENCODE_THREADS 64
 
 int64_t xbzrle_cache_resize(int64_t new_size);
+
+bool ram_postcopy_ready(void);
+void ram_postcopy_request(const char *idstr, uint64_t offset);
+int ram_postcopy_send(QEMUFile *f);
+bool ram_postcopy_incoming(void);
+int ram_postcopy_listen(QEMUFile *f);
+
+int ram_snapshot_begin(QEMUFile *f);
+void ram_snapshot_cow(uint64_t addr);
+int ram_snapshot_save(QEMUFile *f, int64_t budget_ns);
+void ram_snapshot_end(void);
 #endif
@@ -57,17 +57,20 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr);
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: insert a copy of the page into the cache. the previous value
+ * will be overwritten
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
  * @pdata: pointer to the page
  */
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * pages will be freed.  The cache is resized bit by bit by the following
+ * cache_insert calls, so this may be called from another thread.  Pointers
+ * returned by get_cached_data are only valid until the next cache_insert.
  *
  * Returns -1 on error new cache size on success
  *
@@ -31,6 +31,13 @@
 typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Like QEMUFilePutBufferFunc, but the handler may keep referring to buf
+ * instead of copying it, until the data has been written out or the file
+ * is closed.
+ */
+typedef int (QEMUFilePutBufferAsyncFunc)(void *opaque, const uint8_t *buf,
+                                         int64_t pos, int size);
+
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
  * bytes actually read should be returned.
@@ -65,6 +72,7 @@ typedef int64_t (QEMUFileGetRateLimit)(void *opaque);
 
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFilePutBufferAsyncFunc *put_buffer_async;
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileGetFD *get_fd;
@@ -81,8 +89,12 @@ QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
+int qemu_fflush(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+/* buf must stay valid and may be read at any time until the file is closed;
+ * changes to it afterwards may or may not make it to the file.  */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -45,6 +45,12 @@ typedef enum MonitorEvent {
     QEVENT_WAKEUP,
     QEVENT_BALLOON_CHANGE,
     QEVENT_SPICE_MIGRATE_COMPLETED,
+    QEVENT_STM32_CLOCK_CHANGE,
+    QEVENT_GPIO_INDICATOR,
+    QEVENT_STM32_GPIO_OUTPUT,
+    QEVENT_STM32_EXTI_PENDING,
+    QEVENT_STM32_UART_OVERRUN,
+    QEVENT_STM32_TIMER_PWM,
 
     /* Add to 'monitor_event_names' array in monitor.c when
      * defining new events here */
@@ -55,6 +61,7 @@ typedef enum MonitorEvent {
 int monitor_cur_is_qmp(void);
 
 void monitor_protocol_event(MonitorEvent event, QObject *data);
+bool monitor_protocol_event_wanted(MonitorEvent event);
 void monitor_init(CharDriverState *chr, int flags);
 
 int monitor_suspend(Monitor *mon);
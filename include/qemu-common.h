@@ -275,6 +275,25 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+extern int tcg_traces;
+extern int tcg_tb_profile;
+extern int tcg_pretranslate;
+extern int tcg_ebb;
+extern int tcg_cycles;
+extern int tcg_memfuncs;
+enum {
+    TCG_HUGEPAGES_AUTO,
+    TCG_HUGEPAGES_OFF,
+    TCG_HUGEPAGES_THP,
+    TCG_HUGEPAGES_HUGETLB,
+};
+extern int tcg_hugepages;
+#define TCG_COVERAGE_MAP_SIZE   (1 << 16)
+extern int tcg_coverage;
+extern uint8_t *tcg_coverage_map;
+extern uint32_t tcg_coverage_prev;
+void tcg_coverage_init(void);
+void tb_profile_dump_init(const char *filename, int64_t interval_ms);
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
@@ -326,11 +345,15 @@ ssize_t qemu_co_send_recv(int sockfd, void *buf, size_t bytes, bool do_send);
 #define qemu_co_send(sockfd, buf, bytes) \
   qemu_co_send_recv(sockfd, buf, bytes, true)
 
+/* Vectors of up to this many elements are not allocated on the heap */
+#define QEMU_IOVEC_LOCAL 4
+
 typedef struct QEMUIOVector {
     struct iovec *iov;
     int niov;
     int nalloc;
     size_t size;
+    struct iovec local[QEMU_IOVEC_LOCAL];
 } QEMUIOVector;
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
@@ -351,6 +374,8 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
 
 bool buffer_is_zero(const void *buf, size_t len);
+size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool test_buffer_is_zero_next_accel(void);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
@@ -79,6 +79,15 @@ bool hbitmap_empty(const HBitmap *hb);
  */
 int hbitmap_granularity(const HBitmap *hb);
 
+/**
+ * hbitmap_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bits in the HBitmap, rounded up to a multiple of
+ * 2^granularity.
+ */
+uint64_t hbitmap_size(const HBitmap *hb);
+
 /**
  * hbitmap_count:
  * @hb: HBitmap to operate on.
@@ -116,6 +125,53 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ *
+ * Return the first bit, at or after @start, that is not set in @hb, or -1
+ * if all remaining bits are set.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: Location of the first bit to look at (0-based).
+ * @count: Location of the number of bits to look at.
+ *
+ * Find the first run of set bits within the @count bits from @start, so
+ * that contiguous dirty data can be processed at once.  If there is one,
+ * return true and store its first bit in @start and its length, cut at
+ * the end of the range, in @count.  Otherwise return false, leaving
+ * @start and @count alone.
+ */
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count);
+
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @len: Location where to store the length of the result.
+ *
+ * Return the contents and granularity of @hb in a compact format that does
+ * not depend on the host, to be stored for example across restarts.  Runs
+ * of clear and set bits are stored as their lengths, unless storing the
+ * bits themselves is shorter.  The result is freed with g_free.
+ */
+uint8_t *hbitmap_serialize(const HBitmap *hb, size_t *len);
+
+/**
+ * hbitmap_deserialize:
+ * @buf: Data returned by hbitmap_serialize.
+ * @len: Length of @buf.
+ *
+ * Return a new HBitmap with the contents stored in @buf, or NULL if @buf
+ * is not valid.
+ */
+HBitmap *hbitmap_deserialize(const uint8_t *buf, size_t len);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
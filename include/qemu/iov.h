@@ -38,11 +38,63 @@ size_t iov_size(const struct iovec *iov, const unsigned int iov_cnt);
  * buffer pointed to by buf has enough space.  One possible
  * such "large" value is -1 (sinice size_t is unsigned),
  * so specifying `-1' as `bytes' means 'up to the end of iovec'.
+ *
+ * Copies within the first element, the most common case, are done
+ * inline.
  */
-size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
-                    size_t offset, const void *buf, size_t bytes);
-size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
-                  size_t offset, void *buf, size_t bytes);
+size_t iov_from_buf_full(const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, const void *buf, size_t bytes);
+size_t iov_to_buf_full(const struct iovec *iov, const unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes);
+
+static inline size_t
+iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
+             size_t offset, const void *buf, size_t bytes)
+{
+    if (iov_cnt && offset <= iov[0].iov_len &&
+        bytes <= iov[0].iov_len - offset) {
+        memcpy(iov[0].iov_base + offset, buf, bytes);
+        return bytes;
+    }
+    return iov_from_buf_full(iov, iov_cnt, offset, buf, bytes);
+}
+
+static inline size_t
+iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
+           size_t offset, void *buf, size_t bytes)
+{
+    if (iov_cnt && offset <= iov[0].iov_len &&
+        bytes <= iov[0].iov_len - offset) {
+        memcpy(buf, iov[0].iov_base + offset, bytes);
+        return bytes;
+    }
+    return iov_to_buf_full(iov, iov_cnt, offset, buf, bytes);
+}
+
+/*
+ * Position within an iovec, for copying data in sequence without
+ * walking the iovec from its start for each piece.
+ *
+ *   iov_cursor_init(&cur, iov, iov_cnt, offset);
+ *   iov_cursor_to_buf(&cur, &hdr, sizeof(hdr));
+ *   iov_cursor_to_buf(&cur, payload, len);
+ *
+ * copies the same bytes as two iov_to_buf() calls at `offset' and
+ * `offset + sizeof(hdr)'.  Each function returns the number of bytes
+ * actually processed, less than asked for at the end of the iovec.
+ */
+typedef struct IOVCursor {
+    const struct iovec *iov;
+    unsigned int iov_cnt;
+    unsigned int idx;           /* current element */
+    size_t offset;              /* within the current element */
+} IOVCursor;
+
+size_t iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                       unsigned int iov_cnt, size_t offset);
+size_t iov_cursor_skip(IOVCursor *cur, size_t bytes);
+size_t iov_cursor_from_buf(IOVCursor *cur, const void *buf, size_t bytes);
+size_t iov_cursor_to_buf(IOVCursor *cur, void *buf, size_t bytes);
 
 /**
  * Set data bytes pointed out by iovec `iov' of size `iov_cnt' elements,
@@ -299,6 +299,8 @@ void qemu_mutex_unlock_iothread(void);
 void qemu_fd_register(int fd);
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc);
+int qemu_iohandler_epoll_fill(uint32_t *timeout);
+void qemu_iohandler_epoll_poll(bool ready);
 
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
 void qemu_bh_schedule_idle(QEMUBH *bh);
@@ -53,6 +53,7 @@ void qemu_free_timer(QEMUTimer *ts);
 void qemu_del_timer(QEMUTimer *ts);
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time);
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time);
+void qemu_timer_set_slack_ns(QEMUTimer *ts, int64_t slack);
 bool qemu_timer_pending(QEMUTimer *ts);
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time);
 uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts);
@@ -138,6 +139,12 @@ void qemu_put_timer(QEMUFile *f, QEMUTimer *ts);
 
 /* icount */
 int64_t cpu_get_icount(void);
+/* The instruction counter itself, which counts cycles instead with
+   -tcg cycles=on.  */
+int64_t cpu_get_icount_raw(void);
+/* With -tcg cycles=on, boards report the period of the core clock here,
+   whenever it changes, so that each counted cycle takes that long.  */
+void cpu_icount_set_cycle_time(int64_t ns);
 int64_t cpu_get_clock(void);
 
 /*******************************************/
@@ -87,7 +87,9 @@ struct CPUState {
 #endif
     int thread_id;
     struct QemuCond *halt_cond;
-    struct qemu_work_item *queued_work_first, *queued_work_last;
+    /* Pushed by any thread without a lock, newest first, and taken as a
+       whole by the CPU thread.  */
+    struct qemu_work_item *queued_work;
     bool thread_kicked;
     bool created;
     bool stop;
@@ -98,6 +100,11 @@ struct CPUState {
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
 
+    /* Address space seen by the CPU's memory accesses, normally
+     * address_space_memory.  A board can give each CPU its own to run
+     * several independent machines in one process. */
+    struct AddressSpace *as;
+
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
 };
@@ -350,12 +350,17 @@ typedef void (ObjectFree)(void *obj);
  * The base for all classes.  The only thing that #ObjectClass contains is an
  * integer type handle.
  */
+#define OBJECT_CLASS_CAST_CACHE 4
+
 struct ObjectClass
 {
     /*< private >*/
     Type type;
     GSList *interfaces;
 
+    /* Typenames this class was last cast to, compared by address */
+    const char *cast_cache[OBJECT_CLASS_CAST_CACHE];
+
     ObjectUnparent *unparent;
 };
 
@@ -613,6 +618,11 @@ Object *object_dynamic_cast(Object *obj, const char *typename);
  * See object_dynamic_cast() for a description of the parameters of this
  * function.  The only difference in behavior is that this function asserts
  * instead of returning #NULL on failure.
+ *
+ * The last typenames a class was cast to are cached by address, so the
+ * checked casts done with #OBJECT_CHECK and a TYPE_ constant are cheap on
+ * hot paths.  If QEMU is configured with --disable-qom-cast-debug, no check
+ * is done at all and @obj is returned as is.
  */
 Object *object_dynamic_cast_assert(Object *obj, const char *typename);
 
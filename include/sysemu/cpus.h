@@ -13,6 +13,19 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* With -icount, runs the CPUs one after the other in rounds of at most
+ * quantum_ns of virtual time, each CPU seeing the clock advance only by
+ * its own instructions.  A board made of several independent machines
+ * uses this so that they run side by side rather than sharing time.
+ * 0 turns rounds off, which is the default. */
+void cpu_set_lockstep_quantum(int64_t quantum_ns);
+
+/* While fast-forward is on, the vm_clock does not wait for real time when
+ * all CPUs are idle, with or without -icount: it jumps to the next timer.
+ * For the low-power modes of a chip, where the firmware waits for a
+ * wakeup that may be hours away.  Calls nest. */
+void cpu_set_fast_forward(bool enable);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
@@ -0,0 +1,26 @@
+/*
+ * Firmware fuzzing against a snapshot
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef SYSEMU_FUZZ_H
+#define SYSEMU_FUZZ_H
+
+#include "qemu-common.h"
+#include "qemu/option.h"
+
+/* Set up fuzzing from the -fuzz options OPTS, or do nothing if NULL.  */
+void fuzz_configure(QemuOpts *opts);
+
+/* Called once the machine has been reset for the first time.  Takes the
+ * snapshot the runs start from and starts serving afl-fuzz.  */
+void fuzz_start(void);
+
+/* The guest took an exception that means it crashed, a HardFault on
+ * ARMv7-M.  Ends the current run as a crash.  */
+void fuzz_guest_fault(void);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Record and replay of device input
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef SYSEMU_REPLAY_H
+#define SYSEMU_REPLAY_H
+
+#include "qemu-common.h"
+
+typedef enum ReplayMode {
+    REPLAY_MODE_NONE,
+    REPLAY_MODE_RECORD,
+    REPLAY_MODE_PLAY,
+} ReplayMode;
+
+extern ReplayMode replay_mode;
+
+/* Parse "record=FILE" or "play=FILE".  Must be called after the
+ * instruction counter has been configured.  */
+void replay_configure(const char *option);
+
+/* Put the input of CHR under record/replay control.  Devices call this,
+ * in a deterministic order, for the character devices that feed guest
+ * visible state.  */
+void replay_register_char_driver(CharDriverState *chr);
+
+/* Called for every chunk of input a backend passes to its frontend.
+ * Returns true if the input must be dropped because it comes from the
+ * journal instead.  */
+bool replay_char_write(CharDriverState *chr, const uint8_t *buf, int len);
+
+#endif
@@ -67,6 +67,9 @@ void qemu_add_machine_init_done_notifier(Notifier *notify);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
+int load_vmstate_shm(const char *path);
+int qemu_savevm_reset_state(void);
+void qemu_loadvm_reset_state(void);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon, const QDict *qdict);
 
@@ -77,9 +80,11 @@ int qemu_savevm_state_begin(QEMUFile *f,
                             const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
+int qemu_savevm_state_postcopy(QEMUFile *f);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
 int qemu_loadvm_state(QEMUFile *f);
+int qemu_loadvm_postcopy_devices(void);
 
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
@@ -119,6 +124,7 @@ extern int graphic_rotate;
 extern int no_quit;
 extern int no_shutdown;
 extern int semihosting_enabled;
+extern CharDriverState *semihosting_chr;
 extern int old_param;
 extern int boot_menu;
 extern uint8_t *boot_splash_filedata;
@@ -176,6 +176,11 @@ struct DisplayState {
     bool have_gfx;
     bool have_text;
 
+    /* Damage reported with dpy_gfx_damage() and not drawn yet, from
+     * (damage_x0, damage_y0) included to (damage_x1, damage_y1) excluded */
+    bool damage_driven;
+    int damage_x0, damage_y0, damage_x1, damage_y1;
+
     QLIST_HEAD(, DisplayChangeListener) listeners;
 
     struct DisplayState *next;
@@ -245,6 +250,14 @@ static inline void dpy_gfx_update(DisplayState *s, int x, int y, int w, int h)
     }
 }
 
+/* Damage tracking for graphic consoles.  A device which reports every
+ * change of its contents with dpy_gfx_damage() (including on invalidate)
+ * has its update callback skipped while nothing is damaged; the callback
+ * gets the bounding rectangle of the damage with dpy_gfx_take_damage() and
+ * only needs to draw that.  */
+void dpy_gfx_damage(DisplayState *s, int x, int y, int w, int h);
+bool dpy_gfx_take_damage(DisplayState *s, int *x, int *y, int *w, int *h);
+
 static inline void dpy_gfx_resize(DisplayState *s)
 {
     struct DisplayChangeListener *dcl;
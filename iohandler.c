@@ -32,6 +32,10 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 typedef struct IOHandlerRecord {
     IOCanReadHandler *fd_read_poll;
     IOHandler *fd_read;
@@ -40,11 +44,122 @@ typedef struct IOHandlerRecord {
     QLIST_ENTRY(IOHandlerRecord) next;
     int fd;
     bool deleted;
+#ifdef CONFIG_EPOLL
+    /* Events currently registered with the epoll set.  */
+    uint32_t epoll_events;
+    /* The fd cannot be watched with epoll (a regular file, for example)
+       and is reported ready on every iteration, as select would.  */
+    bool no_epoll;
+    bool on_read_poll;
+    QLIST_ENTRY(IOHandlerRecord) read_poll_next;
+#endif
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+#ifdef CONFIG_EPOLL
+/* Handlers are registered with a persistent epoll set when they are
+   added or change, instead of being copied into fd_sets on every main
+   loop iteration.  Only handlers with an fd_read_poll callback have to
+   be looked at each time, and their registration only changes when the
+   callback's answer does.  The main loop polls the epoll fd together
+   with the glib and slirp fds.  */
+#define IOHANDLER_MAX_EVENTS 64
+
+static QLIST_HEAD(, IOHandlerRecord) read_poll_handlers =
+    QLIST_HEAD_INITIALIZER(read_poll_handlers);
+static int iohandler_epfd = -1;
+static int iohandler_deleted_count;
+static int iohandler_no_epoll_count;
+
+static int iohandler_epoll_fd(void)
+{
+    if (iohandler_epfd < 0) {
+#ifdef CONFIG_EPOLL_CREATE1
+        iohandler_epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+        iohandler_epfd = epoll_create(IOHANDLER_MAX_EVENTS);
+        if (iohandler_epfd >= 0) {
+            qemu_set_cloexec(iohandler_epfd);
+        }
+#endif
+        if (iohandler_epfd < 0) {
+            perror("epoll_create");
+            abort();
+        }
+    }
+    return iohandler_epfd;
+}
+
+static void iohandler_set_events(IOHandlerRecord *ioh, uint32_t events)
+{
+    struct epoll_event ev;
+    int ret;
+
+    if (ioh->no_epoll || events == ioh->epoll_events) {
+        return;
+    }
+
+    ev.events = events;
+    ev.data.ptr = ioh;
+    if (!events) {
+        /* Fails harmlessly if the fd was already closed.  */
+        epoll_ctl(iohandler_epoll_fd(), EPOLL_CTL_DEL, ioh->fd, &ev);
+        ioh->epoll_events = 0;
+        return;
+    }
+
+    if (ioh->epoll_events) {
+        ret = epoll_ctl(iohandler_epoll_fd(), EPOLL_CTL_MOD, ioh->fd, &ev);
+        if (ret < 0 && errno == ENOENT) {
+            /* The fd was closed and reopened behind our back.  */
+            ret = epoll_ctl(iohandler_epoll_fd(), EPOLL_CTL_ADD, ioh->fd, &ev);
+        }
+    } else {
+        ret = epoll_ctl(iohandler_epoll_fd(), EPOLL_CTL_ADD, ioh->fd, &ev);
+        if (ret < 0 && errno == EEXIST) {
+            ret = epoll_ctl(iohandler_epoll_fd(), EPOLL_CTL_MOD, ioh->fd, &ev);
+        }
+    }
+    if (ret < 0 && errno == EPERM) {
+        ioh->no_epoll = true;
+        iohandler_no_epoll_count++;
+        events = 0;
+    }
+    ioh->epoll_events = events;
+}
+
+/* Bring the registration of IOH up to date after its callbacks changed.
+   The read interest of a handler with an fd_read_poll callback is only
+   known at the next qemu_iohandler_epoll_fill, so it is kept as is.  */
+static void iohandler_update(IOHandlerRecord *ioh)
+{
+    bool read_poll = !ioh->deleted && ioh->fd_read && ioh->fd_read_poll;
+    uint32_t events = 0;
+
+    if (read_poll != ioh->on_read_poll) {
+        if (read_poll) {
+            QLIST_INSERT_HEAD(&read_poll_handlers, ioh, read_poll_next);
+        } else {
+            QLIST_REMOVE(ioh, read_poll_next);
+        }
+        ioh->on_read_poll = read_poll;
+    }
+
+    if (!ioh->deleted) {
+        if (read_poll) {
+            events |= ioh->epoll_events & EPOLLIN;
+        } else if (ioh->fd_read) {
+            events |= EPOLLIN;
+        }
+        if (ioh->fd_write) {
+            events |= EPOLLOUT;
+        }
+    }
+    iohandler_set_events(ioh, events);
+}
+#endif
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -61,7 +176,15 @@ int qemu_set_fd_handler2(int fd,
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
+#ifdef CONFIG_EPOLL
+                if (!ioh->deleted) {
+                    ioh->deleted = 1;
+                    iohandler_deleted_count++;
+                    iohandler_update(ioh);
+                }
+#else
                 ioh->deleted = 1;
+#endif
                 break;
             }
         }
@@ -73,12 +196,20 @@ int qemu_set_fd_handler2(int fd,
         ioh = g_malloc0(sizeof(IOHandlerRecord));
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
+#ifdef CONFIG_EPOLL
+        if (ioh->deleted) {
+            iohandler_deleted_count--;
+        }
+#endif
         ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+#ifdef CONFIG_EPOLL
+        iohandler_update(ioh);
+#endif
         qemu_notify_event();
     }
     return 0;
@@ -92,6 +223,80 @@ int qemu_set_fd_handler(int fd,
     return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
 }
 
+#ifdef CONFIG_EPOLL
+int qemu_iohandler_epoll_fill(uint32_t *timeout)
+{
+    IOHandlerRecord *ioh;
+    uint32_t events;
+
+    QLIST_FOREACH(ioh, &read_poll_handlers, read_poll_next) {
+        events = ioh->epoll_events & ~EPOLLIN;
+        if (ioh->fd_read_poll(ioh->opaque) != 0) {
+            events |= EPOLLIN;
+        }
+        iohandler_set_events(ioh, events);
+    }
+    if (iohandler_no_epoll_count) {
+        *timeout = 0;
+    }
+    return iohandler_epoll_fd();
+}
+
+void qemu_iohandler_epoll_poll(bool ready)
+{
+    struct epoll_event events[IOHANDLER_MAX_EVENTS];
+    IOHandlerRecord *pioh, *ioh;
+    uint32_t revents;
+    int i, n = 0;
+
+    if (ready) {
+        n = epoll_wait(iohandler_epoll_fd(), events, ARRAY_SIZE(events), 0);
+    }
+    for (i = 0; i < n; i++) {
+        ioh = events[i].data.ptr;
+        revents = events[i].events;
+        /* select reports hangups and errors as readable and writable.  */
+        if (!ioh->deleted && ioh->fd_read && (ioh->epoll_events & EPOLLIN)
+            && (revents & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            ioh->fd_read(ioh->opaque);
+        }
+        if (!ioh->deleted && ioh->fd_write
+            && (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            ioh->fd_write(ioh->opaque);
+        }
+    }
+
+    if (iohandler_no_epoll_count) {
+        QLIST_FOREACH(ioh, &io_handlers, next) {
+            if (!ioh->no_epoll) {
+                continue;
+            }
+            if (!ioh->deleted && ioh->fd_read &&
+                (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+                ioh->fd_read(ioh->opaque);
+            }
+            if (!ioh->deleted && ioh->fd_write) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+    }
+
+    /* Handlers deleted by the callbacks above may still have had events
+       in the array, so they are only freed now.  */
+    if (iohandler_deleted_count) {
+        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+            if (ioh->deleted) {
+                if (ioh->no_epoll) {
+                    iohandler_no_epoll_count--;
+                }
+                QLIST_REMOVE(ioh, next);
+                g_free(ioh);
+            }
+        }
+        iohandler_deleted_count = 0;
+    }
+}
+#else
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
     IOHandlerRecord *ioh;
@@ -135,6 +340,7 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int re
         }
     }
 }
+#endif
 
 /* reaping of zombies.  right now we're not passing the status to
    anyone, but it would be possible to add a callback.  */
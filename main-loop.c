@@ -114,6 +114,11 @@ static int qemu_signal_init(void)
 
 static AioContext *qemu_aio_context;
 
+AioContext *qemu_get_aio_context(void)
+{
+    return qemu_aio_context;
+}
+
 void qemu_notify_event(void)
 {
     if (!qemu_aio_context) {
@@ -151,7 +156,89 @@ static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
 static int n_poll_fds;
 static int max_priority;
 
-#ifndef _WIN32
+#ifdef CONFIG_EPOLL
+/* I/O handlers live in a persistent epoll set (see iohandler.c), which is
+   polled as one descriptor next to the glib sources.  Slirp still works
+   on fd_sets; its descriptors are copied into the poll array and back.  */
+static bool iohandler_ready;
+
+static int os_host_main_loop_wait(uint32_t timeout)
+{
+    GMainContext *context = g_main_context_default();
+    GPollFD *p, *epoll_pfd;
+    int glib_timeout = -1;
+    int i, n, fd, ret;
+
+    g_main_context_prepare(context, &max_priority);
+
+    n_poll_fds = g_main_context_query(context, max_priority, &glib_timeout,
+                                      poll_fds, ARRAY_SIZE(poll_fds) - 1);
+    g_assert(n_poll_fds < ARRAY_SIZE(poll_fds));
+    if (glib_timeout >= 0 && (uint32_t)glib_timeout < timeout) {
+        timeout = glib_timeout;
+    }
+
+    n = n_poll_fds;
+    epoll_pfd = &poll_fds[n++];
+    epoll_pfd->fd = qemu_iohandler_epoll_fill(&timeout);
+    epoll_pfd->events = G_IO_IN;
+    epoll_pfd->revents = 0;
+
+    for (fd = 0; fd <= nfds; fd++) {
+        gushort events = 0;
+
+        if (FD_ISSET(fd, &rfds)) {
+            events |= G_IO_IN;
+        }
+        if (FD_ISSET(fd, &wfds)) {
+            events |= G_IO_OUT;
+        }
+        if (FD_ISSET(fd, &xfds)) {
+            events |= G_IO_PRI;
+        }
+        if (events) {
+            g_assert(n < ARRAY_SIZE(poll_fds));
+            p = &poll_fds[n++];
+            p->fd = fd;
+            p->events = events;
+            p->revents = 0;
+        }
+    }
+
+    if (timeout > 0) {
+        qemu_mutex_unlock_iothread();
+    }
+
+    ret = g_poll(poll_fds, n, timeout == UINT32_MAX ? -1 : (int)timeout);
+
+    if (timeout > 0) {
+        qemu_mutex_lock_iothread();
+    }
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    for (i = n_poll_fds + 1; ret > 0 && i < n; i++) {
+        p = &poll_fds[i];
+        if ((p->events & G_IO_IN) && (p->revents & (G_IO_IN | G_IO_HUP |
+                                                    G_IO_ERR))) {
+            FD_SET(p->fd, &rfds);
+        }
+        if ((p->events & G_IO_OUT) && (p->revents & (G_IO_OUT | G_IO_ERR))) {
+            FD_SET(p->fd, &wfds);
+        }
+        if ((p->events & G_IO_PRI) && (p->revents & G_IO_PRI)) {
+            FD_SET(p->fd, &xfds);
+        }
+    }
+    iohandler_ready = ret > 0 && (epoll_pfd->revents & G_IO_IN);
+
+    if (g_main_context_check(context, max_priority, poll_fds, n_poll_fds)) {
+        g_main_context_dispatch(context);
+    }
+    return ret;
+}
+#elif !defined(_WIN32)
 static void glib_select_fill(int *max_fd, fd_set *rfds, fd_set *wfds,
                              fd_set *xfds, uint32_t *cur_timeout)
 {
@@ -417,9 +504,14 @@ int main_loop_wait(int nonblocking)
     slirp_update_timeout(&timeout);
     slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
 #endif
+#ifdef CONFIG_EPOLL
+    ret = os_host_main_loop_wait(timeout);
+    qemu_iohandler_epoll_poll(iohandler_ready);
+#else
     qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
     ret = os_host_main_loop_wait(timeout);
     qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
+#endif
 #ifdef CONFIG_SLIRP
     slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
 #endif
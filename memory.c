@@ -18,6 +18,7 @@
 #include "exec/ioport.h"
 #include "qemu/bitops.h"
 #include "sysemu/kvm.h"
+#include "qmp-commands.h"
 #include <assert.h>
 
 #include "exec/memory-internal.h"
@@ -240,6 +241,25 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+/* Whether two views would produce the same listener state, including
+ * dirty logging.
+ */
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; ++i) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ranges = NULL;
@@ -717,10 +737,23 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* Replace the view of @as by @new_view, which was rendered by the caller.
+ * If the view did not change, listeners only see region_nop for each range
+ * (the dispatch listeners rebuild their tables on begin).
+ */
+static void address_space_update_topology(AddressSpace *as, FlatView new_view)
 {
     FlatView old_view = *as->current_map;
-    FlatView new_view = generate_memory_topology(as->root);
+    FlatRange *fr;
+
+    if (flatview_equal(&old_view, &new_view)) {
+        FOR_EACH_FLAT_RANGE(fr, &old_view) {
+            MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, region_nop);
+        }
+        flatview_destroy(&new_view);
+        address_space_update_ioeventfds(as);
+        return;
+    }
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
@@ -739,18 +772,50 @@ void memory_region_transaction_begin(void)
 void memory_region_transaction_commit(void)
 {
     AddressSpace *as;
+    FlatView *views;
+    unsigned i, nr = 0;
+    bool changed = false;
 
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth && memory_region_update_pending) {
         memory_region_update_pending = false;
+
+        /* Render every view first.  If none of them changed (a BAR moved
+         * while decoding is off, a remap to the current setting, an
+         * eventfd update) the listeners are left alone: no table
+         * rebuild and no TLB flush.
+         */
+        QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+            ++nr;
+        }
+        views = g_new(FlatView, nr);
+        i = 0;
+        QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+            views[i] = generate_memory_topology(as->root);
+            changed |= !flatview_equal(as->current_map, &views[i]);
+            ++i;
+        }
+
+        if (!changed) {
+            i = 0;
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                flatview_destroy(&views[i++]);
+                address_space_update_ioeventfds(as);
+            }
+            g_free(views);
+            return;
+        }
+
         MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
+        i = 0;
         QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-            address_space_update_topology(as);
+            address_space_update_topology(as, views[i++]);
         }
 
         MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+        g_free(views);
     }
 }
 
@@ -816,6 +881,8 @@ void memory_region_init(MemoryRegion *mr,
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
     mr->flush_coalesced_mmio = false;
+    mr->direct_sizes = 0;
+    mr->stats = NULL;
 }
 
 static bool memory_region_access_valid(MemoryRegion *mr,
@@ -844,6 +911,18 @@ static bool memory_region_access_valid(MemoryRegion *mr,
     return true;
 }
 
+/* Whether the device implements accesses of SIZE itself, so that
+   access_with_adjusted_size would make exactly one call.  */
+static inline bool memory_region_access_native(MemoryRegion *mr,
+                                               unsigned size)
+{
+    unsigned impl_min = mr->ops->impl.min_access_size;
+    unsigned impl_max = mr->ops->impl.max_access_size;
+
+    return size >= (impl_min ? impl_min : 1)
+           && size <= (impl_max ? impl_max : 4);
+}
+
 static uint64_t memory_region_dispatch_read1(MemoryRegion *mr,
                                              hwaddr addr,
                                              unsigned size)
@@ -858,6 +937,12 @@ static uint64_t memory_region_dispatch_read1(MemoryRegion *mr,
         return mr->ops->old_mmio.read[bitops_ctzl(size)](mr->opaque, addr);
     }
 
+    if (memory_region_access_native(mr, size)) {
+        memory_region_read_accessor(mr, addr, &data, size, 0,
+                                    -1ULL >> (64 - size * 8));
+        return data;
+    }
+
     /* FIXME: support unaligned access */
     access_with_adjusted_size(addr, &data, size,
                               mr->ops->impl.min_access_size,
@@ -912,6 +997,12 @@ static void memory_region_dispatch_write(MemoryRegion *mr,
         return;
     }
 
+    if (memory_region_access_native(mr, size)) {
+        memory_region_write_accessor(mr, addr, &data, size, 0,
+                                     -1ULL >> (64 - size * 8));
+        return;
+    }
+
     /* FIXME: support unaligned access */
     access_with_adjusted_size(addr, &data, size,
                               mr->ops->impl.min_access_size,
@@ -919,6 +1010,201 @@ static void memory_region_dispatch_write(MemoryRegion *mr,
                               memory_region_write_accessor, mr);
 }
 
+/*
+ * MMIO access statistics
+ *
+ * While enabled, every access through io_mem_read/io_mem_write is counted
+ * against its region, and against one of MMIO_STATS_BUCKETS buckets of
+ * offsets the region is split into: a bucket per 32-bit register for
+ * regions of up to 1k, the usual size of a peripheral.  The counts are
+ * allocated the first time a region is accessed.  Accesses are dispatched
+ * with the iothread lock held, so plain counters do.
+ */
+
+#define MMIO_STATS_BUCKETS  256
+
+struct MemoryRegionStats {
+    MemoryRegion *mr;
+    QTAILQ_ENTRY(MemoryRegionStats) link;
+    unsigned bucket_shift;
+    uint64_t reads, writes;
+    uint64_t bucket_reads[MMIO_STATS_BUCKETS];
+    uint64_t bucket_writes[MMIO_STATS_BUCKETS];
+};
+
+static bool mmio_stats_enabled;
+static QTAILQ_HEAD(, MemoryRegionStats) mmio_stats =
+    QTAILQ_HEAD_INITIALIZER(mmio_stats);
+
+static void memory_region_stats_free(MemoryRegion *mr)
+{
+    if (mr->stats) {
+        QTAILQ_REMOVE(&mmio_stats, mr->stats, link);
+        g_free(mr->stats);
+        mr->stats = NULL;
+    }
+}
+
+static void memory_region_count_access(MemoryRegion *mr, hwaddr addr,
+                                       bool is_write)
+{
+    MemoryRegionStats *st = mr->stats;
+    uint64_t bucket;
+
+    if (!st) {
+        uint64_t size = memory_region_size(mr);
+
+        st = g_new0(MemoryRegionStats, 1);
+        st->mr = mr;
+        st->bucket_shift = 2;
+        while (st->bucket_shift < 56 &&
+               (size - 1) >> st->bucket_shift >= MMIO_STATS_BUCKETS) {
+            st->bucket_shift++;
+        }
+        QTAILQ_INSERT_TAIL(&mmio_stats, st, link);
+        mr->stats = st;
+    }
+
+    bucket = MIN(addr >> st->bucket_shift, MMIO_STATS_BUCKETS - 1);
+    if (is_write) {
+        st->writes++;
+        st->bucket_writes[bucket]++;
+    } else {
+        st->reads++;
+        st->bucket_reads[bucket]++;
+    }
+}
+
+void qmp_mmio_stats_enable(bool enable, Error **errp)
+{
+    if (enable && !mmio_stats_enabled) {
+        while (!QTAILQ_EMPTY(&mmio_stats)) {
+            memory_region_stats_free(QTAILQ_FIRST(&mmio_stats)->mr);
+        }
+    }
+    mmio_stats_enabled = enable;
+}
+
+static int mmio_region_stats_cmp(const void *a, const void *b)
+{
+    const MemoryRegionStats *sa = *(MemoryRegionStats * const *)a;
+    const MemoryRegionStats *sb = *(MemoryRegionStats * const *)b;
+    uint64_t ta = sa->reads + sa->writes, tb = sb->reads + sb->writes;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+typedef struct MmioBucketCount {
+    int bucket;
+    uint64_t count;
+} MmioBucketCount;
+
+static int mmio_bucket_count_cmp(const void *a, const void *b)
+{
+    const MmioBucketCount *ca = a, *cb = b;
+
+    if (ca->count != cb->count) {
+        return ca->count < cb->count ? -1 : 1;
+    }
+    return cb->bucket - ca->bucket;
+}
+
+/* The buckets of ST that were accessed at all, most accessed first.  */
+static MmioRegisterStatsList *mmio_register_stats(MemoryRegionStats *st)
+{
+    MmioBucketCount counts[MMIO_STATS_BUCKETS];
+    MmioRegisterStatsList *head = NULL, *e;
+    int i, n = 0;
+
+    for (i = 0; i < MMIO_STATS_BUCKETS; i++) {
+        if (st->bucket_reads[i] || st->bucket_writes[i]) {
+            counts[n].bucket = i;
+            counts[n].count = st->bucket_reads[i] + st->bucket_writes[i];
+            n++;
+        }
+    }
+    qsort(counts, n, sizeof(counts[0]), mmio_bucket_count_cmp);
+
+    for (i = 0; i < n; i++) {
+        int b = counts[i].bucket;
+
+        e = g_new0(MmioRegisterStatsList, 1);
+        e->value = g_new0(MmioRegisterStats, 1);
+        e->value->offset = (uint64_t)b << st->bucket_shift;
+        e->value->reads = st->bucket_reads[b];
+        e->value->writes = st->bucket_writes[b];
+        e->next = head;
+        head = e;
+    }
+    return head;
+}
+
+MmioRegionStatsList *qmp_query_mmio_stats(Error **errp)
+{
+    MmioRegionStatsList *head = NULL, *e;
+    MemoryRegionStats *st, **sorted;
+    MemoryRegion *mr;
+    int i, n = 0;
+
+    QTAILQ_FOREACH(st, &mmio_stats, link) {
+        n++;
+    }
+    sorted = g_new(MemoryRegionStats *, n);
+    i = 0;
+    QTAILQ_FOREACH(st, &mmio_stats, link) {
+        sorted[i++] = st;
+    }
+    qsort(sorted, n, sizeof(*sorted), mmio_region_stats_cmp);
+
+    /* Least accessed first, each prepended to the list.  */
+    for (i = 0; i < n; i++) {
+        st = sorted[i];
+        e = g_new0(MmioRegionStatsList, 1);
+        e->value = g_new0(MmioRegionStats, 1);
+        e->value->name = g_strdup(st->mr->name ? st->mr->name : "");
+        for (mr = st->mr; mr; mr = mr->parent) {
+            e->value->address += mr->addr;
+        }
+        e->value->size = memory_region_size(st->mr);
+        e->value->bucket_size = 1ULL << st->bucket_shift;
+        e->value->reads = st->reads;
+        e->value->writes = st->writes;
+        e->value->buckets = mmio_register_stats(st);
+        e->next = head;
+        head = e;
+    }
+    g_free(sorted);
+    return head;
+}
+
+/* Return the mask of access sizes for which an aligned access reaches
+   ops->read or ops->write exactly once, with no validation, splitting
+   or byte swapping in between.  */
+static uint8_t memory_region_direct_sizes(MemoryRegion *mr)
+{
+    const MemoryRegionOps *ops = mr->ops;
+    unsigned size, impl_min, impl_max;
+    uint8_t sizes = 0;
+
+    if (!ops->read || !ops->write || ops->valid.accepts
+        || memory_region_wrong_endianness(mr)) {
+        return 0;
+    }
+    impl_min = ops->impl.min_access_size ? ops->impl.min_access_size : 1;
+    impl_max = ops->impl.max_access_size ? ops->impl.max_access_size : 4;
+    for (size = 1; size <= 4; size <<= 1) {
+        if (ops->valid.max_access_size
+            && (size > ops->valid.max_access_size
+                || size < ops->valid.min_access_size)) {
+            continue;
+        }
+        if (size >= impl_min && size <= impl_max) {
+            sizes |= size;
+        }
+    }
+    return sizes;
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            const MemoryRegionOps *ops,
                            void *opaque,
@@ -931,6 +1217,7 @@ void memory_region_init_io(MemoryRegion *mr,
     mr->terminates = true;
     mr->destructor = memory_region_destructor_iomem;
     mr->ram_addr = ~(ram_addr_t)0;
+    mr->direct_sizes = memory_region_direct_sizes(mr);
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -980,6 +1267,24 @@ void memory_region_init_rom_device(MemoryRegion *mr,
     mr->rom_device = true;
     mr->destructor = memory_region_destructor_rom_device;
     mr->ram_addr = qemu_ram_alloc(size, mr);
+    mr->direct_sizes = memory_region_direct_sizes(mr);
+}
+
+void memory_region_init_rom_device_ptr(MemoryRegion *mr,
+                                       const MemoryRegionOps *ops,
+                                       void *opaque,
+                                       const char *name,
+                                       uint64_t size,
+                                       void *ptr)
+{
+    memory_region_init(mr, name, size);
+    mr->ops = ops;
+    mr->opaque = opaque;
+    mr->terminates = true;
+    mr->rom_device = true;
+    mr->destructor = memory_region_destructor_ram_from_ptr;
+    mr->ram_addr = qemu_ram_alloc_from_ptr(size, ptr, mr);
+    mr->direct_sizes = memory_region_direct_sizes(mr);
 }
 
 static uint64_t invalid_read(void *opaque, hwaddr addr,
@@ -1026,6 +1331,7 @@ void memory_region_destroy(MemoryRegion *mr)
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
     g_free(mr->ioeventfds);
+    memory_region_stats_free(mr);
 }
 
 uint64_t memory_region_size(MemoryRegion *mr)
@@ -1096,6 +1402,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     return ret;
 }
 
+hwaddr memory_region_test_and_clear_dirty_run(MemoryRegion *mr, hwaddr addr,
+                                              hwaddr size, unsigned client,
+                                              hwaddr *len)
+{
+    ram_addr_t start, run;
+
+    assert(mr->terminates);
+    start = cpu_physical_memory_find_dirty(mr->ram_addr + addr,
+                                           mr->ram_addr + addr + size,
+                                           1 << client, &run);
+    if (run) {
+        cpu_physical_memory_reset_dirty(start, start + run, 1 << client);
+    }
+    *len = run;
+    return start - mr->ram_addr;
+}
+
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -1588,12 +1911,29 @@ void address_space_destroy(AddressSpace *as)
 
 uint64_t io_mem_read(MemoryRegion *mr, hwaddr addr, unsigned size)
 {
+    if (unlikely(mmio_stats_enabled)) {
+        memory_region_count_access(mr, addr, false);
+    }
+    if ((mr->direct_sizes & size) && !(addr & (size - 1))
+        && !mr->flush_coalesced_mmio) {
+        return mr->ops->read(mr->opaque, addr, size)
+               & (-1ULL >> (64 - size * 8));
+    }
     return memory_region_dispatch_read(mr, addr, size);
 }
 
 void io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
+    if (unlikely(mmio_stats_enabled)) {
+        memory_region_count_access(mr, addr, true);
+    }
+    if ((mr->direct_sizes & size) && !(addr & (size - 1))
+        && !mr->flush_coalesced_mmio) {
+        mr->ops->write(mr->opaque, addr, val & (-1ULL >> (64 - size * 8)),
+                       size);
+        return;
+    }
     memory_region_dispatch_write(mr, addr, val, size);
 }
 
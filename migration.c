@@ -34,6 +34,11 @@
     do { } while (0)
 #endif
 
+/* There is no return path for postcopy there, see migrate_has_return_path */
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
 enum {
     MIG_STATE_ERROR,
     MIG_STATE_SETUP,
@@ -95,7 +100,16 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    if (ret >= 0 && ram_postcopy_incoming()) {
+        /* The rest of the RAM comes while the guest runs.  The devices
+           may touch it as they load, so they wait for the pages too.  */
+        ret = ram_postcopy_listen(f);
+        if (ret >= 0) {
+            ret = qemu_loadvm_postcopy_devices();
+        }
+    } else {
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
@@ -183,7 +197,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy ? "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -369,6 +383,7 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int encode_threads = s->encode_threads;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -379,6 +394,7 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->encode_threads = encode_threads;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -473,6 +489,21 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_encode_threads(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (value < 0 || value > MAX_MIGRATE_ENCODE_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of threads from 0 to "
+                  stringify(MAX_MIGRATE_ENCODE_THREADS));
+        return;
+    }
+
+    /* A migration in progress keeps the threads it started with.  */
+    s->encode_threads = value;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -502,6 +533,15 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+int migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
 int64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
@@ -511,37 +551,132 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+int migrate_encode_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->encode_threads;
+}
+
 /* migration thread support */
 
 
+/* At most this many chunks are handed to s->writev at a time.  */
+#define MIGRATION_MAX_IOV 64
+
+static ssize_t migrate_fd_put_iov(MigrationState *s, struct iovec *iov,
+                                  int iovcnt)
+{
+    ssize_t ret;
+
+    if (!s->writev) {
+        return migrate_fd_put_buffer(s, iov[0].iov_base, iov[0].iov_len);
+    }
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
+    return ret;
+}
+
+static void buffered_add_chunk(MigrationState *s, const uint8_t *data,
+                               size_t len)
+{
+    MigrationChunk *last = s->nb_chunks ? &s->chunks[s->nb_chunks - 1] : NULL;
+
+    if (last && !data && !last->data) {
+        last->len += len;
+        return;
+    }
+    if (last && data && last->data && last->data + last->len == data) {
+        last->len += len;
+        return;
+    }
+    if (s->nb_chunks == s->chunks_capacity) {
+        s->chunks_capacity = s->chunks_capacity * 2 + 16;
+        s->chunks = g_renew(MigrationChunk, s->chunks, s->chunks_capacity);
+    }
+    s->chunks[s->nb_chunks].data = data;
+    s->chunks[s->nb_chunks].len = len;
+    s->nb_chunks++;
+}
+
 static ssize_t buffered_flush(MigrationState *s)
 {
-    size_t offset = 0;
+    struct iovec iov[MIGRATION_MAX_IOV];
+    size_t offset = 0, total = 0;
     ssize_t ret = 0;
+    int head = 0;
 
     DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
 
-    while (s->bytes_xfer < s->xfer_limit && offset < s->buffer_size) {
-        size_t to_send = MIN(s->buffer_size - offset, s->xfer_limit - s->bytes_xfer);
-        ret = migrate_fd_put_buffer(s, s->buffer + offset, to_send);
+    while (s->bytes_xfer < s->xfer_limit && head < s->nb_chunks) {
+        size_t budget = s->xfer_limit - s->bytes_xfer;
+        size_t boff = offset, len = 0;
+        int i, n = 0;
+
+        for (i = head; i < s->nb_chunks && n < MIGRATION_MAX_IOV &&
+                 len < budget; i++) {
+            MigrationChunk *c = &s->chunks[i];
+
+            iov[n].iov_base = c->data ? (void *)c->data : s->buffer + boff;
+            iov[n].iov_len = MIN(c->len, budget - len);
+            if (!c->data) {
+                boff += c->len;
+            }
+            len += iov[n].iov_len;
+            n++;
+        }
+
+        ret = migrate_fd_put_iov(s, iov, n);
         if (ret <= 0) {
             DPRINTF("error flushing data, %zd\n", ret);
             break;
-        } else {
-            DPRINTF("flushed %zd byte(s)\n", ret);
-            offset += ret;
-            s->bytes_xfer += ret;
+        }
+        DPRINTF("flushed %zd byte(s)\n", ret);
+        s->bytes_xfer += ret;
+        total += ret;
+
+        /* drop what has been sent */
+        while (ret > 0) {
+            MigrationChunk *c = &s->chunks[head];
+            size_t l = MIN(c->len, ret);
+
+            if (c->data) {
+                c->data += l;
+            } else {
+                offset += l;
+            }
+            c->len -= l;
+            ret -= l;
+            if (!c->len) {
+                head++;
+            }
         }
     }
 
-    DPRINTF("flushed %zu of %zu byte(s)\n", offset, s->buffer_size);
+    DPRINTF("flushed %zu byte(s), %zu of %zu from the buffer\n",
+            total, offset, s->buffer_size);
     memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
     s->buffer_size -= offset;
+    memmove(s->chunks, s->chunks + head,
+            (s->nb_chunks - head) * sizeof(*s->chunks));
+    s->nb_chunks -= head;
 
     if (ret < 0) {
         return ret;
     }
-    return offset;
+    return total;
 }
 
 static int buffered_put_buffer(void *opaque, const uint8_t *buf,
@@ -573,10 +708,35 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf,
 
     memcpy(s->buffer + s->buffer_size, buf, size);
     s->buffer_size += size;
+    buffered_add_chunk(s, NULL, size);
 
     return size;
 }
 
+static int buffered_put_buffer_async(void *opaque, const uint8_t *buf,
+                                     int64_t pos, int size)
+{
+    MigrationState *s = opaque;
+    ssize_t error;
+
+    if (!s->writev) {
+        return buffered_put_buffer(opaque, buf, pos, size);
+    }
+
+    DPRINTF("queueing %d bytes at %" PRId64 "\n", size, pos);
+
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-error));
+        return error;
+    }
+
+    if (size > 0) {
+        buffered_add_chunk(s, buf, size);
+    }
+    return size;
+}
+
 static int buffered_close(void *opaque)
 {
     MigrationState *s = opaque;
@@ -586,7 +746,7 @@ static int buffered_close(void *opaque)
     DPRINTF("closing\n");
 
     s->xfer_limit = INT_MAX;
-    while (!qemu_file_get_error(s->file) && s->buffer_size) {
+    while (!qemu_file_get_error(s->file) && s->nb_chunks) {
         ret = buffered_flush(s);
         if (ret < 0) {
             break;
@@ -654,6 +814,116 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
+/* Page requests need a way back from the destination.  */
+static bool migrate_has_return_path(MigrationState *s)
+{
+#ifndef _WIN32
+    struct stat st;
+
+    return s->fd != -1 && fstat(s->fd, &st) == 0 && S_ISSOCK(st.st_mode);
+#else
+    return false;
+#endif
+}
+
+/* Reads the page requests that the destination sent, without waiting.
+ * Each is the offset of the page in its block, as be64, and the block id
+ * string, prefixed with its length.
+ */
+static int migrate_read_requests(MigrationState *s)
+{
+    ssize_t len;
+
+    while (true) {
+        len = qemu_recv(s->fd, s->rp_buf + s->rp_len,
+                        sizeof(s->rp_buf) - s->rp_len, MSG_DONTWAIT);
+        if (len == 0) {
+            return -EPIPE;
+        }
+        if (len < 0) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return socket_error() == EAGAIN ? 0 : -socket_error();
+        }
+        s->rp_len += len;
+
+        while (s->rp_len >= 9 && s->rp_len >= 9 + s->rp_buf[8]) {
+            size_t n = 9 + s->rp_buf[8];
+            char idstr[256];
+
+            memcpy(idstr, s->rp_buf + 9, s->rp_buf[8]);
+            idstr[s->rp_buf[8]] = 0;
+            ram_postcopy_request(idstr, ldq_be_p(s->rp_buf));
+            memmove(s->rp_buf, s->rp_buf + n, s->rp_len - n);
+            s->rp_len -= n;
+        }
+    }
+}
+
+/* Switches to postcopy and sends the rest of the RAM.  Called with the
+ * iothread lock held, returns without it.  The bandwidth limit does not
+ * apply any more: the guest waits for the pages it requests.
+ */
+static int migrate_postcopy(MigrationState *s)
+{
+    int64_t start_time, end_time;
+    int ret;
+
+    DPRINTF("switching to postcopy\n");
+    start_time = qemu_get_clock_ms(rt_clock);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_FINISH_MIGRATE);
+    } else {
+        vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+    s->postcopy = true;
+    s->xfer_limit = SIZE_MAX;
+    ret = qemu_savevm_state_postcopy(s->file);
+    if (ret >= 0) {
+        ret = qemu_fflush(s->file);
+    }
+    while (ret >= 0 && s->nb_chunks) {
+        ret = buffered_flush(s);
+    }
+    end_time = qemu_get_clock_ms(rt_clock);
+    s->downtime = end_time - start_time;
+    qemu_mutex_unlock_iothread();
+
+    while (ret >= 0) {
+        ret = migrate_read_requests(s);
+        if (ret < 0) {
+            break;
+        }
+        ret = ram_postcopy_send(s->file);
+        if (ret >= 0) {
+            int ret2 = qemu_fflush(s->file);
+
+            while (ret2 >= 0 && s->nb_chunks) {
+                ret2 = buffered_flush(s);
+            }
+            if (ret2 < 0) {
+                ret = ret2;
+            }
+        }
+        if (ret == 0) {
+            break;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    if (ret < 0) {
+        /* The destination has started, so the source stays stopped.  */
+        qemu_savevm_state_cancel();
+    } else {
+        migrate_fd_completed(s);
+        s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+    }
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
 static void *buffered_file_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -690,7 +960,12 @@ static void *buffered_file_thread(void *opaque)
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size &&
+                migrate_use_postcopy() && ram_postcopy_ready() &&
+                migrate_has_return_path(s)) {
+                ret = migrate_postcopy(s);
+                break;
+            } else if (pending_size && pending_size >= max_size) {
                 ret = qemu_savevm_state_iterate(s->file);
                 if (ret < 0) {
                     qemu_mutex_unlock_iothread();
@@ -755,12 +1030,14 @@ out:
         migrate_fd_error(s);
     }
     g_free(s->buffer);
+    g_free(s->chunks);
     return NULL;
 }
 
 static const QEMUFileOps buffered_file_ops = {
     .get_fd =         buffered_get_fd,
     .put_buffer =     buffered_put_buffer,
+    .put_buffer_async = buffered_put_buffer_async,
     .close =          buffered_close,
     .rate_limit =     buffered_rate_limit,
     .get_rate_limit = buffered_get_rate_limit,
@@ -774,9 +1051,14 @@ void migrate_fd_connect(MigrationState *s)
     s->buffer = NULL;
     s->buffer_size = 0;
     s->buffer_capacity = 0;
+    s->chunks = NULL;
+    s->nb_chunks = 0;
+    s->chunks_capacity = 0;
 
     s->xfer_limit = s->bandwidth_limit / XFER_LIMIT_RATIO;
     s->complete = false;
+    s->postcopy = false;
+    s->rp_len = 0;
 
     s->file = qemu_fopen_ops(s, &buffered_file_ops);
 
@@ -67,6 +67,7 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
+#include "qemu/bitmap.h"
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -171,14 +172,17 @@ typedef struct MonitorControl {
 /*
  * To prevent flooding clients, events can be throttled. The
  * throttling is calculated globally, rather than per-Monitor
- * instance.
+ * instance.  Events from several sources, told apart by the
+ * value of a member of their data, are coalesced separately:
+ * the last event of each source is kept.
  */
 typedef struct MonitorEventState {
     MonitorEvent event; /* Event being tracked */
     int64_t rate;       /* Period over which to throttle. 0 to disable */
     int64_t last;       /* Time at which event was last emitted */
     QEMUTimer *timer;   /* Timer for handling delayed events */
-    QObject *data;      /* Event pending delayed dispatch */
+    const char *key;    /* Data member naming the source, or NULL */
+    QDict *pending;     /* Events pending delayed dispatch, by source */
 } MonitorEventState;
 
 struct Monitor {
@@ -196,6 +200,8 @@ struct Monitor {
     void *password_opaque;
     QError *error;
     QLIST_HEAD(,mon_fd_t) fds;
+    /* Events sent to this QMP monitor (see set-event-filter) */
+    DECLARE_BITMAP(events, QEVENT_MAX);
     QLIST_ENTRY(Monitor) entry;
 };
 
@@ -463,6 +469,12 @@ static const char *monitor_event_names[] = {
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
     [QEVENT_SPICE_MIGRATE_COMPLETED] = "SPICE_MIGRATE_COMPLETED",
+    [QEVENT_STM32_CLOCK_CHANGE] = "STM32_CLOCK_CHANGE",
+    [QEVENT_GPIO_INDICATOR] = "GPIO_INDICATOR",
+    [QEVENT_STM32_GPIO_OUTPUT] = "STM32_GPIO_OUTPUT",
+    [QEVENT_STM32_EXTI_PENDING] = "STM32_EXTI_PENDING",
+    [QEVENT_STM32_UART_OVERRUN] = "STM32_UART_OVERRUN",
+    [QEVENT_STM32_TIMER_PWM] = "STM32_TIMER_PWM",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -480,12 +492,31 @@ monitor_protocol_event_emit(MonitorEvent event,
 
     trace_monitor_protocol_event_emit(event, data);
     QLIST_FOREACH(mon, &mon_list, entry) {
-        if (monitor_ctrl_mode(mon) && qmp_cmd_mode(mon)) {
+        if (monitor_ctrl_mode(mon) && qmp_cmd_mode(mon) &&
+            test_bit(event, mon->events)) {
             monitor_json_emitter(mon, data);
         }
     }
 }
 
+/*
+ * Returns the source of a throttled event, as the JSON of
+ * the member of its data named by the key
+ */
+static QString *monitor_protocol_event_source(MonitorEventState *evstate,
+                                              QObject *data)
+{
+    QDict *event_data;
+
+    if (evstate->key) {
+        event_data = qdict_get_qdict(qobject_to_qdict(data), "data");
+        if (event_data && qdict_haskey(event_data, evstate->key)) {
+            return qobject_to_json(qdict_get(event_data, evstate->key));
+        }
+    }
+    return qstring_new();
+}
+
 
 /*
  * Queue a new event for emission to Monitor instances,
@@ -513,20 +544,21 @@ monitor_protocol_event_queue(MonitorEvent event,
         evstate->last = now;
     } else {
         int64_t delta = now - evstate->last;
-        if (evstate->data ||
+        if (qdict_size(evstate->pending) ||
             delta < evstate->rate) {
-            /* If there's an existing event pending, replace
-             * it with the new event, otherwise schedule a
-             * timer for delayed emission
+            /* If there's an existing event pending from the same
+             * source, replace it with the new event.  Schedule a
+             * timer for delayed emission if none was pending.
              */
-            if (evstate->data) {
-                qobject_decref(evstate->data);
-            } else {
+            QString *source = monitor_protocol_event_source(evstate, data);
+
+            if (!qdict_size(evstate->pending)) {
                 int64_t then = evstate->last + evstate->rate;
                 qemu_mod_timer_ns(evstate->timer, then);
             }
-            evstate->data = data;
-            qobject_incref(evstate->data);
+            qobject_incref(data);
+            qdict_put_obj(evstate->pending, qstring_get_str(source), data);
+            QDECREF(source);
         } else {
             monitor_protocol_event_emit(event, data);
             evstate->last = now;
@@ -536,9 +568,17 @@ monitor_protocol_event_queue(MonitorEvent event,
 }
 
 
+static void monitor_protocol_event_emit_pending(const char *source,
+                                               QObject *data, void *opaque)
+{
+    MonitorEventState *evstate = opaque;
+
+    monitor_protocol_event_emit(evstate->event, data);
+}
+
 /*
- * The callback invoked by QemuTimer when a delayed
- * event is ready to be emitted
+ * The callback invoked by QemuTimer when delayed
+ * events are ready to be emitted
  */
 static void monitor_protocol_event_handler(void *opaque)
 {
@@ -548,13 +588,14 @@ static void monitor_protocol_event_handler(void *opaque)
     qemu_mutex_lock(&monitor_event_state_lock);
 
     trace_monitor_protocol_event_handler(evstate->event,
-                                         evstate->data,
+                                         evstate->pending,
                                          evstate->last,
                                          now);
-    if (evstate->data) {
-        monitor_protocol_event_emit(evstate->event, evstate->data);
-        qobject_decref(evstate->data);
-        evstate->data = NULL;
+    if (qdict_size(evstate->pending)) {
+        qdict_iter(evstate->pending, monitor_protocol_event_emit_pending,
+                   evstate);
+        QDECREF(evstate->pending);
+        evstate->pending = qdict_new();
     }
     evstate->last = now;
     qemu_mutex_unlock(&monitor_event_state_lock);
@@ -564,14 +605,16 @@ static void monitor_protocol_event_handler(void *opaque)
 /*
  * @event: the event ID to be limited
  * @rate: the rate limit in milliseconds
+ * @key: the data member naming the source of the event, or NULL
  *
  * Sets a rate limit on a particular event, so no
- * more than 1 event will be emitted within @rate
- * milliseconds
+ * more than 1 event (of each source) will be emitted
+ * within @rate milliseconds
  */
 static void
 monitor_protocol_event_throttle(MonitorEvent event,
-                                int64_t rate)
+                                int64_t rate,
+                                const char *key)
 {
     MonitorEventState *evstate;
     assert(event < QEVENT_MAX);
@@ -586,7 +629,8 @@ monitor_protocol_event_throttle(MonitorEvent event,
                                     monitor_protocol_event_handler,
                                     evstate);
     evstate->last = 0;
-    evstate->data = NULL;
+    evstate->key = key;
+    evstate->pending = qdict_new();
 }
 
 
@@ -596,9 +640,15 @@ static void monitor_protocol_event_init(void)
 {
     qemu_mutex_init(&monitor_event_state_lock);
     /* Limit RTC & BALLOON events to 1 per second */
-    monitor_protocol_event_throttle(QEVENT_RTC_CHANGE, 1000);
-    monitor_protocol_event_throttle(QEVENT_BALLOON_CHANGE, 1000);
-    monitor_protocol_event_throttle(QEVENT_WATCHDOG, 1000);
+    monitor_protocol_event_throttle(QEVENT_RTC_CHANGE, 1000, NULL);
+    monitor_protocol_event_throttle(QEVENT_BALLOON_CHANGE, 1000, NULL);
+    monitor_protocol_event_throttle(QEVENT_WATCHDOG, 1000, NULL);
+    /* Device activity, 10 per second for each port, line, UART or timer */
+    monitor_protocol_event_throttle(QEVENT_STM32_GPIO_OUTPUT, 100, "port");
+    monitor_protocol_event_throttle(QEVENT_STM32_EXTI_PENDING, 100, "line");
+    monitor_protocol_event_throttle(QEVENT_STM32_UART_OVERRUN, 100,
+                                    "device");
+    monitor_protocol_event_throttle(QEVENT_STM32_TIMER_PWM, 100, "timer");
 }
 
 /**
@@ -629,6 +679,26 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
     QDECREF(qmp);
 }
 
+/**
+ * monitor_protocol_event_wanted(): Whether a QMP monitor receives an event
+ *
+ * Events sent at a high rate need not be built when nobody listens.
+ */
+bool monitor_protocol_event_wanted(MonitorEvent event)
+{
+    Monitor *mon;
+
+    assert(event < QEVENT_MAX);
+
+    QLIST_FOREACH(mon, &mon_list, entry) {
+        if (monitor_ctrl_mode(mon) && qmp_cmd_mode(mon) &&
+            test_bit(event, mon->events)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int do_qmp_capabilities(Monitor *mon, const QDict *params,
                                QObject **ret_data)
 {
@@ -852,6 +922,35 @@ EventInfoList *qmp_query_events(Error **errp)
     return ev_list;
 }
 
+void qmp_set_event_filter(bool has_events, strList *events, Error **errp)
+{
+    DECLARE_BITMAP(filter, QEVENT_MAX);
+    MonitorEvent e;
+
+    if (!has_events) {
+        bitmap_fill(filter, QEVENT_MAX);
+    } else {
+        bitmap_zero(filter, QEVENT_MAX);
+        for (; events; events = events->next) {
+            for (e = 0; e < QEVENT_MAX; e++) {
+                if (!strcmp(events->value, monitor_event_names[e])) {
+                    break;
+                }
+            }
+            if (e == QEVENT_MAX) {
+                error_set(errp, QERR_INVALID_PARAMETER_VALUE, "events",
+                          "a list of event names");
+                return;
+            }
+            set_bit(e, filter);
+        }
+    }
+
+    qemu_mutex_lock(&monitor_event_state_lock);
+    bitmap_copy(cur_mon->events, filter, QEVENT_MAX);
+    qemu_mutex_unlock(&monitor_event_state_lock);
+}
+
 /* set the current CPU defined by the user */
 int monitor_set_cpu(int cpu_index)
 {
@@ -895,6 +994,17 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_tlb_stats(Monitor *mon, const QDict *qdict)
+{
+    dump_tlb_stats((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_tbs(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf,
+                    qdict_get_try_int(qdict, "count", 20));
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -2547,6 +2657,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "tbs",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed TBs (-tcg profile=on)",
+        .mhandler.cmd = do_info_tbs,
+    },
+    {
+        .name       = "tlb-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show softmmu TLB miss statistics",
+        .mhandler.cmd = do_info_tlb_stats,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -4613,6 +4737,7 @@ static void monitor_control_event(void *opaque, int event)
     switch (event) {
     case CHR_EVENT_OPENED:
         mon->mc->command_mode = 0;
+        bitmap_fill(mon->events, QEVENT_MAX);
         data = get_qmp_greeting();
         monitor_json_emitter(mon, data);
         qobject_decref(data);
@@ -4715,6 +4840,7 @@ void monitor_init(CharDriverState *chr, int flags)
 
     mon->chr = chr;
     mon->flags = flags;
+    bitmap_fill(mon->events, QEVENT_MAX);
     if (flags & MONITOR_USE_READLINE) {
         mon->rs = readline_init(mon, monitor_find_completion);
         monitor_read_command(mon, 0);
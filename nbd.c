@@ -34,6 +34,7 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/sendfile.h>
 #endif
 
 #include "qemu/sockets.h"
@@ -86,6 +87,11 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+
+    /* Read replies from a raw image are sent from this file descriptor
+     * and offset instead of from data, if fd is not -1.  */
+    int fd;
+    off_t offset;
 };
 
 struct NBDExport {
@@ -866,6 +872,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     }
     nbd_client_get(client);
     req->client = client;
+    req->fd = -1;
     return req;
 }
 
@@ -989,6 +996,34 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
+#ifdef __linux__
+static ssize_t nbd_co_sendfile(int csock, int fd, off_t offset, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = sendfile(csock, fd, &offset, len - done);
+        if (ret > 0) {
+            done += ret;
+        } else if (ret == 0) {
+            /* The image file is shorter than the export */
+            break;
+        } else if (errno == EAGAIN) {
+            qemu_coroutine_yield();
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    return done;
+}
+#else
+static ssize_t nbd_co_sendfile(int csock, int fd, off_t offset, size_t len)
+{
+    abort();
+}
+#endif
+
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
@@ -1007,7 +1042,11 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
         socket_set_cork(csock, 1);
         rc = nbd_send_reply(csock, reply);
         if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
+            if (req->fd != -1) {
+                ret = nbd_co_sendfile(csock, req->fd, req->offset, len);
+            } else {
+                ret = qemu_co_send(csock, req->data, len);
+            }
             if (ret != len) {
                 rc = -EIO;
             }
@@ -1121,12 +1160,20 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
-        if (ret < 0) {
-            LOG("reading from file failed");
-            reply.error = -ret;
-            goto error_reply;
+        /* Zero copy for raw images.  A read error can only show up once
+         * the reply has gone out, and then loses the connection.  */
+        req->fd = raw_get_sendfile_fd(exp->bs);
+        if (req->fd >= 0) {
+            req->offset = request.from + exp->dev_offset;
+        } else {
+            req->fd = -1;
+            ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
+                            req->data, request.len / 512);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                reply.error = -ret;
+                goto error_reply;
+            }
         }
 
         TRACE("Read %u byte(s)", request.len);
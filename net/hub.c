@@ -17,38 +17,107 @@
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * Like a learning switch, a hub remembers which port each source MAC address
+ * was last seen on, and sends unicast frames for a known address only to
+ * that port.  Broadcast, multicast and frames for unknown addresses still go
+ * to every port, and so does everything to ports a dump client sits on.
  */
 
+#define HUB_MAC_TABLE_SIZE  256     /* power of two */
+#define HUB_MAC_AGE_NS      (300 * 1000000000LL)
+
 typedef struct NetHub NetHub;
+typedef struct NetHubPort NetHubPort;
+
+typedef struct NetHubMacEntry {
+    uint8_t mac[6];
+    NetHubPort *port;
+    int64_t seen;
+} NetHubMacEntry;
 
-typedef struct NetHubPort {
+struct NetHubPort {
     NetClientState nc;
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
-} NetHubPort;
+};
 
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMacEntry macs[HUB_MAC_TABLE_SIZE];
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
+static NetHubMacEntry *net_hub_mac_entry(NetHub *hub, const uint8_t *mac)
+{
+    unsigned int h = mac[3] ^ (mac[4] << 3) ^ (mac[5] << 5) ^ mac[2];
+
+    return &hub->macs[h & (HUB_MAC_TABLE_SIZE - 1)];
+}
+
+/* Remember that the source of the frame HDR is behind SOURCE_PORT and
+ * return the only port the frame needs to go to, or NULL to flood it.
+ * HDR holds the destination and source addresses.  */
+static NetHubPort *net_hub_switch(NetHub *hub, NetHubPort *source_port,
+                                  const uint8_t *hdr)
+{
+    const uint8_t *dst = hdr, *src = hdr + 6;
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    NetHubMacEntry *e;
+
+    if (!(src[0] & 1)) {
+        e = net_hub_mac_entry(hub, src);
+        memcpy(e->mac, src, 6);
+        e->port = source_port;
+        e->seen = now;
+    }
+
+    if (dst[0] & 1) {
+        return NULL;
+    }
+    e = net_hub_mac_entry(hub, dst);
+    if (!e->port || memcmp(e->mac, dst, 6) != 0 ||
+        now - e->seen > HUB_MAC_AGE_NS) {
+        return NULL;
+    }
+    return e->port;
+}
+
+/* Whether PORT gets the frame when the hub has decided to send it only
+ * to DEST, or to every port if DEST is NULL.  */
+static bool net_hub_port_wants(NetHubPort *port, NetHubPort *source_port,
+                               NetHubPort *dest)
+{
+    if (port == source_port) {
+        return false;
+    }
+    return !dest || port == dest ||
+        (port->nc.peer &&
+         port->nc.peer->info->type == NET_CLIENT_OPTIONS_KIND_DUMP);
+}
+
 static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
                                const uint8_t *buf, size_t len)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest = NULL;
+
+    if (len >= 12) {
+        dest = net_hub_switch(hub, source_port, buf);
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
+        if (!net_hub_port_wants(port, source_port, dest)) {
             continue;
         }
 
@@ -60,11 +129,16 @@ static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest = NULL;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t hdr[12];
+
+    if (iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr)) == sizeof(hdr)) {
+        dest = net_hub_switch(hub, source_port, hdr);
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
+        if (!net_hub_port_wants(port, source_port, dest)) {
             continue;
         }
 
@@ -77,7 +151,7 @@ static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
 
-    hub = g_malloc(sizeof(*hub));
+    hub = g_malloc0(sizeof(*hub));
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
@@ -122,10 +196,38 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
+static void net_hub_port_burst_begin(NetClientState *nc)
+{
+    NetHubPort *port, *src_port = DO_UPCAST(NetHubPort, nc, nc);
+
+    QLIST_FOREACH(port, &src_port->hub->ports, next) {
+        if (port != src_port) {
+            qemu_send_burst_begin(&port->nc);
+        }
+    }
+}
+
+static void net_hub_port_burst_end(NetClientState *nc)
+{
+    NetHubPort *port, *src_port = DO_UPCAST(NetHubPort, nc, nc);
+
+    QLIST_FOREACH(port, &src_port->hub->ports, next) {
+        if (port != src_port) {
+            qemu_send_burst_end(&port->nc);
+        }
+    }
+}
+
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    int i;
 
+    for (i = 0; i < HUB_MAC_TABLE_SIZE; i++) {
+        if (port->hub->macs[i].port == port) {
+            port->hub->macs[i].port = NULL;
+        }
+    }
     QLIST_REMOVE(port, next);
 }
 
@@ -135,6 +237,8 @@ static NetClientInfo net_hub_port_info = {
     .can_receive = net_hub_port_can_receive,
     .receive = net_hub_port_receive,
     .receive_iov = net_hub_port_receive_iov,
+    .receive_burst_begin = net_hub_port_burst_begin,
+    .receive_burst_end = net_hub_port_burst_end,
     .cleanup = net_hub_port_cleanup,
 };
 
@@ -338,3 +442,17 @@ void net_hub_check_clients(void)
         }
     }
 }
+
+bool net_hub_flush(NetClientState *nc)
+{
+    NetHubPort *port;
+    NetHubPort *source_port = DO_UPCAST(NetHubPort, nc, nc);
+    int ret = 0;
+
+    QLIST_FOREACH(port, &source_port->hub->ports, next) {
+        if (port != source_port) {
+            ret += qemu_net_queue_flush(port->nc.send_queue);
+        }
+    }
+    return ret ? true : false;
+}
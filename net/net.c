@@ -437,11 +437,48 @@ void qemu_purge_queued_packets(NetClientState *nc)
     qemu_net_queue_purge(nc->peer->send_queue, nc);
 }
 
+static void qemu_receive_burst_begin(NetClientState *nc)
+{
+    if (nc && nc->info->receive_burst_begin) {
+        nc->info->receive_burst_begin(nc);
+    }
+}
+
+static void qemu_receive_burst_end(NetClientState *nc)
+{
+    if (nc && nc->info->receive_burst_end) {
+        nc->info->receive_burst_end(nc);
+    }
+}
+
+/* The packets SENDER sends until qemu_send_burst_end() are one burst.  */
+void qemu_send_burst_begin(NetClientState *sender)
+{
+    qemu_receive_burst_begin(sender->peer);
+}
+
+void qemu_send_burst_end(NetClientState *sender)
+{
+    qemu_receive_burst_end(sender->peer);
+}
+
 void qemu_flush_queued_packets(NetClientState *nc)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
-    if (qemu_net_queue_flush(nc->send_queue)) {
+    /* The packets for a client behind a hub are queued on the other
+     * ports of the hub. */
+    if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_HUBPORT) {
+        if (net_hub_flush(nc->peer)) {
+            qemu_notify_event();
+        }
+    }
+    qemu_receive_burst_begin(nc);
+    flushed = qemu_net_queue_flush(nc->send_queue);
+    qemu_receive_burst_end(nc);
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -44,10 +44,85 @@ struct NetPacket {
     NetClientState *sender;
     unsigned flags;
     int size;
+    int pool_class;
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
 
+/* Queued packets come from a pool with one free list per power of two
+ * size, from 256 bytes up to the largest tap packet.  Bigger ones are
+ * allocated and freed as they come, and at most NET_PACKET_POOL_MAX
+ * bytes are kept on the free lists.  Everything here runs under the
+ * global mutex.  */
+#define NET_PACKET_POOL_MIN_SHIFT   8
+#define NET_PACKET_POOL_CLASSES     10
+#define NET_PACKET_POOL_MAX         (4 * 1024 * 1024)
+
+static struct {
+    QTAILQ_HEAD(, NetPacket) free[NET_PACKET_POOL_CLASSES];
+    size_t free_bytes;
+    bool initialized;
+} net_packet_pool;
+
+static size_t net_packet_class_size(int pool_class)
+{
+    return (size_t)1 << (NET_PACKET_POOL_MIN_SHIFT + pool_class);
+}
+
+static NetPacket *net_packet_alloc(size_t size)
+{
+    NetPacket *packet;
+    int pool_class;
+
+    if (!net_packet_pool.initialized) {
+        for (pool_class = 0; pool_class < NET_PACKET_POOL_CLASSES;
+             pool_class++) {
+            QTAILQ_INIT(&net_packet_pool.free[pool_class]);
+        }
+        net_packet_pool.initialized = true;
+    }
+
+    size += sizeof(NetPacket);
+    for (pool_class = 0; pool_class < NET_PACKET_POOL_CLASSES; pool_class++) {
+        if (size <= net_packet_class_size(pool_class)) {
+            break;
+        }
+    }
+    if (pool_class == NET_PACKET_POOL_CLASSES) {
+        packet = g_malloc(size);
+        packet->pool_class = -1;
+        return packet;
+    }
+
+    packet = QTAILQ_FIRST(&net_packet_pool.free[pool_class]);
+    if (packet) {
+        QTAILQ_REMOVE(&net_packet_pool.free[pool_class], packet, entry);
+        net_packet_pool.free_bytes -= net_packet_class_size(pool_class);
+    } else {
+        packet = g_malloc(net_packet_class_size(pool_class));
+        packet->pool_class = pool_class;
+    }
+    return packet;
+}
+
+static void net_packet_free(NetPacket *packet)
+{
+    size_t size;
+
+    if (packet->pool_class < 0) {
+        g_free(packet);
+        return;
+    }
+    size = net_packet_class_size(packet->pool_class);
+    if (net_packet_pool.free_bytes + size > NET_PACKET_POOL_MAX) {
+        g_free(packet);
+        return;
+    }
+    QTAILQ_INSERT_HEAD(&net_packet_pool.free[packet->pool_class], packet,
+                       entry);
+    net_packet_pool.free_bytes += size;
+}
+
 struct NetQueue {
     void *opaque;
 
@@ -77,7 +152,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        net_packet_free(packet);
     }
 
     g_free(queue);
@@ -92,7 +167,7 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = net_packet_alloc(size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -117,7 +192,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = net_packet_alloc(max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -220,7 +295,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            net_packet_free(packet);
         }
     }
 }
@@ -248,7 +323,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        net_packet_free(packet);
     }
     return true;
 }
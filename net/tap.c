@@ -49,6 +49,9 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Packets read per wakeup, handed to the peer as one burst.  */
+#define TAP_BURST 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -193,8 +196,10 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
+    int packets = 0;
     int size;
 
+    qemu_send_burst_begin(&s->nc);
     do {
         uint8_t *buf = s->buf;
 
@@ -212,7 +217,9 @@ static void tap_send(void *opaque)
         if (size == 0) {
             tap_read_poll(s, false);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && ++packets < TAP_BURST &&
+             qemu_can_send_packet(&s->nc));
+    qemu_send_burst_end(&s->nc);
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -34,26 +34,78 @@
     do { } while (0)
 #endif
 
-typedef struct CacheItem CacheItem;
+/*
+ * The pages are kept back to back in one arena per table, which is left
+ * to huge pages where the host has them and is only backed by memory as
+ * pages are inserted.  The address and age of each slot are kept apart
+ * from the pages, so that lookups only touch the small tag array.
+ *
+ * Resizing is done bit by bit: cache_resize() just records the size it
+ * was asked for, and cache_insert() then starts a new table of that size
+ * and moves CACHE_RESIZE_STEP slots of the old one to it at every call.
+ * Lookups look at both tables in the meantime.  Only the thread that
+ * inserts pages changes the tables, so cache_resize() may be called from
+ * any thread without a lock.
+ */
+
+#define CACHE_EMPTY ((uint64_t)-1)
+
+/* old slots moved to the new table by each insertion while resizing */
+#define CACHE_RESIZE_STEP 64
 
-struct CacheItem {
+typedef struct CacheTag CacheTag;
+
+struct CacheTag {
     uint64_t it_addr;
     uint64_t it_age;
-    uint8_t *it_data;
+};
+
+typedef struct CacheTable CacheTable;
+
+struct CacheTable {
+    uint8_t *data;
+    CacheTag *tags;
+    int64_t max_num_items;
 };
 
 struct PageCache {
-    CacheItem *page_cache;
+    CacheTable table;
+    /* table being moved to table, data is NULL if none */
+    CacheTable old;
+    int64_t old_pos;
+    /* size asked for by cache_resize(), 0 if none */
+    int64_t resize_to;
     unsigned int page_size;
-    int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static void cache_table_init(CacheTable *t, int64_t num_pages,
+                             unsigned int page_size)
 {
+    size_t size = num_pages * page_size;
     int64_t i;
 
+    t->max_num_items = num_pages;
+    t->data = qemu_vmalloc(size);
+    qemu_madvise(t->data, size, QEMU_MADV_HUGEPAGE);
+    t->tags = g_malloc(num_pages * sizeof(*t->tags));
+    for (i = 0; i < num_pages; i++) {
+        t->tags[i].it_addr = CACHE_EMPTY;
+        t->tags[i].it_age = 0;
+    }
+}
+
+static void cache_table_fini(CacheTable *t)
+{
+    qemu_vfree(t->data);
+    g_free(t->tags);
+    t->data = NULL;
+    t->tags = NULL;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -61,7 +113,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
+    cache = g_malloc0(sizeof(*cache));
 
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
@@ -71,148 +123,173 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 "\n", num_pages);
 
-    cache->page_cache = g_malloc((cache->max_num_items) *
-                                 sizeof(*cache->page_cache));
-
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
+    cache_table_init(&cache->table, num_pages, page_size);
 
     return cache;
 }
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->table.data);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+    cache_table_fini(&cache->table);
+    if (cache->old.data) {
+        cache_table_fini(&cache->old);
     }
-
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
 }
 
 static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+                                  const CacheTable *t, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
+    g_assert(t->max_num_items);
+    pos = (address / cache->page_size) & (t->max_num_items - 1);
     return pos;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static uint8_t *cache_find(const PageCache *cache, uint64_t addr)
 {
+    const CacheTable *t = &cache->table;
     size_t pos;
 
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(t->data);
 
-    pos = cache_get_cache_pos(cache, addr);
+    pos = cache_get_cache_pos(cache, t, addr);
+    if (t->tags[pos].it_addr == addr) {
+        return t->data + pos * cache->page_size;
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    /* moved slots are left empty in the old table */
+    t = &cache->old;
+    if (t->data) {
+        pos = cache_get_cache_pos(cache, t, addr);
+        if (t->tags[pos].it_addr == addr) {
+            return t->data + pos * cache->page_size;
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    return cache_find(cache, addr) != NULL;
+}
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+{
+    return cache_find(cache, addr);
+}
+
+/* Move up to COUNT slots of the old table to the new one, keeping the MRU
+   page on collisions.  */
+static void cache_move_old(PageCache *cache, int64_t count)
+{
+    CacheTable *t = &cache->table;
+    CacheTable *old = &cache->old;
+    int64_t end = MIN(cache->old_pos + count, old->max_num_items);
+    int64_t i;
 
-    pos = cache_get_cache_pos(cache, addr);
+    for (i = cache->old_pos; i < end; i++) {
+        CacheTag *old_tag = &old->tags[i];
+        CacheTag *tag;
+        size_t pos;
 
-    return &cache->page_cache[pos];
+        if (old_tag->it_addr == CACHE_EMPTY) {
+            continue;
+        }
+        pos = cache_get_cache_pos(cache, t, old_tag->it_addr);
+        tag = &t->tags[pos];
+        if (tag->it_addr == CACHE_EMPTY || tag->it_age < old_tag->it_age) {
+            if (tag->it_addr == CACHE_EMPTY) {
+                cache->num_items++;
+            }
+            memcpy(t->data + pos * cache->page_size,
+                   old->data + i * cache->page_size, cache->page_size);
+            *tag = *old_tag;
+        }
+        old_tag->it_addr = CACHE_EMPTY;
+    }
+    cache->old_pos = end;
+
+    if (end == old->max_num_items) {
+        DPRINTF("Resized to %" PRId64 " pages\n", t->max_num_items);
+        cache_table_fini(old);
+    }
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+static void cache_resize_step(PageCache *cache)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    int64_t num_pages = __sync_lock_test_and_set(&cache->resize_to, 0);
+
+    if (num_pages && num_pages != cache->table.max_num_items) {
+        if (cache->old.data) {
+            cache_move_old(cache, cache->old.max_num_items);
+        }
+        cache->old = cache->table;
+        cache->old_pos = 0;
+        cache->num_items = 0;
+        cache_table_init(&cache->table, num_pages, cache->page_size);
+    }
+
+    if (cache->old.data) {
+        cache_move_old(cache, CACHE_RESIZE_STEP);
+    }
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+void cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 {
-
-    CacheItem *it = NULL;
+    CacheTable *t = &cache->table;
+    CacheTag *tag;
+    size_t pos;
 
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(t->data);
+
+    cache_resize_step(cache);
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    pos = cache_get_cache_pos(cache, t, addr);
+    tag = &t->tags[pos];
 
-    if (!it->it_data) {
+    if (tag->it_addr == CACHE_EMPTY) {
         cache->num_items++;
     }
 
-    it->it_data = pdata;
-    it->it_age = ++cache->max_item_age;
-    it->it_addr = addr;
+    memcpy(t->data + pos * cache->page_size, pdata, cache->page_size);
+    tag->it_age = ++cache->max_item_age;
+    tag->it_addr = addr;
+
+    /* an older copy must not be moved over this one */
+    if (cache->old.data) {
+        pos = cache_get_cache_pos(cache, &cache->old, addr);
+        if (cache->old.tags[pos].it_addr == addr) {
+            cache->old.tags[pos].it_addr = CACHE_EMPTY;
+        }
+    }
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
-    int64_t i;
-
-    CacheItem *old_it, *new_it;
-
     g_assert(cache);
 
     /* cache was not inited */
-    if (cache->page_cache == NULL) {
+    if (cache->table.data == NULL) {
         return -1;
     }
 
-    /* same size */
-    if (pow2floor(new_num_pages) == cache->max_num_items) {
-        return cache->max_num_items;
-    }
-
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
-        DPRINTF("Error creating new cache\n");
+    if (new_num_pages <= 0) {
+        DPRINTF("invalid number of pages\n");
         return -1;
     }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
-        }
-    }
-
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
+    new_num_pages = pow2floor(new_num_pages);
+    __sync_lock_test_and_set(&cache->resize_to, new_num_pages);
 
-    return cache->max_num_items;
+    return new_num_pages;
 }
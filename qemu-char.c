@@ -25,7 +25,9 @@
 #include "monitor/monitor.h"
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/replay.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "char/char.h"
 #include "hw/usb.h"
 #include "hw/baum.h"
@@ -144,6 +146,12 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+void qemu_chr_fe_set_write_unblocked(CharDriverState *s,
+                                     void (*fd_write_unblocked)(void *opaque))
+{
+    s->chr_write_unblocked = fd_write_unblocked;
+}
+
 int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -160,11 +168,21 @@ int qemu_chr_be_can_write(CharDriverState *s)
 
 void qemu_chr_be_write(CharDriverState *s, uint8_t *buf, int len)
 {
+    if (replay_mode != REPLAY_MODE_NONE && replay_char_write(s, buf, len)) {
+        return;
+    }
     if (s->chr_read) {
         s->chr_read(s->handler_opaque, buf, len);
     }
 }
 
+void qemu_chr_be_write_unblocked(CharDriverState *s)
+{
+    if (s->chr_write_unblocked) {
+        s->chr_write_unblocked(s->handler_opaque);
+    }
+}
+
 int qemu_chr_fe_get_msgfd(CharDriverState *s)
 {
     return s->get_msgfd ? s->get_msgfd(s) : -1;
@@ -201,6 +219,7 @@ void qemu_chr_add_handlers(CharDriverState *s,
     if (!opaque && !fd_can_read && !fd_read && !fd_event) {
         /* chr driver being released. */
         ++s->avail_connections;
+        s->chr_write_unblocked = NULL;
     }
     s->chr_can_read = fd_can_read;
     s->chr_read = fd_read;
@@ -230,6 +249,87 @@ static CharDriverState *qemu_chr_open_null(QemuOpts *opts)
     return chr;
 }
 
+/* In-process pair: what is written to one end is received by the frontend
+   of the other.  Whatever that frontend cannot take yet is buffered on its
+   end and handed over when the frontend accepts input again, and the
+   frontend of the other end is then told that it can write again.  */
+#define PAIR_BUFFER_SIZE 256
+
+typedef struct {
+    CharDriverState *peer;
+    uint8_t buf[PAIR_BUFFER_SIZE];
+    int cons;
+    int count;
+    /* A write from the peer did not fit in buf */
+    bool peer_blocked;
+} PairDriver;
+
+/* Hands the data buffered on chr to its frontend.  */
+static void pair_chr_accept_input(CharDriverState *chr)
+{
+    PairDriver *d = chr->opaque;
+    uint8_t *p;
+    int len;
+
+    while (d->count > 0) {
+        len = MIN(d->count, PAIR_BUFFER_SIZE - d->cons);
+        len = MIN(len, qemu_chr_be_can_write(chr));
+        if (len <= 0) {
+            break;
+        }
+        /* Consume the data first, the frontend may ask for more while it
+           is receiving it.  */
+        p = d->buf + d->cons;
+        d->cons = (d->cons + len) % PAIR_BUFFER_SIZE;
+        d->count -= len;
+        qemu_chr_be_write(chr, p, len);
+    }
+
+    if (d->peer_blocked && d->count < PAIR_BUFFER_SIZE) {
+        d->peer_blocked = false;
+        qemu_chr_be_write_unblocked(d->peer);
+    }
+}
+
+static int pair_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
+{
+    CharDriverState *peer = ((PairDriver *)chr->opaque)->peer;
+    PairDriver *d = peer->opaque;
+    int i;
+
+    /* The writer learns from the return value until this one is short */
+    d->peer_blocked = false;
+    for (i = 0; i < len && d->count < PAIR_BUFFER_SIZE; i++) {
+        d->buf[(d->cons + d->count) % PAIR_BUFFER_SIZE] = buf[i];
+        d->count++;
+    }
+    pair_chr_accept_input(peer);
+    /* Only set now, so that the writer is not told while writing */
+    if (i < len) {
+        d->peer_blocked = true;
+    }
+    return i;
+}
+
+void qemu_chr_open_pair(CharDriverState **chr0, CharDriverState **chr1)
+{
+    CharDriverState *chr[2];
+    PairDriver *d[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        chr[i] = g_malloc0(sizeof(CharDriverState));
+        d[i] = g_malloc0(sizeof(PairDriver));
+        chr[i]->opaque = d[i];
+        chr[i]->chr_write = pair_chr_write;
+        chr[i]->chr_accept_input = pair_chr_accept_input;
+    }
+    d[0]->peer = chr[1];
+    d[1]->peer = chr[0];
+    *chr0 = chr[0];
+    *chr1 = chr[1];
+}
+
 /* MUX driver for serial I/O splitting */
 #define MAX_MUX 4
 #define MUX_BUFFER_SIZE 32	/* Must be a power of 2.  */
@@ -2646,34 +2746,96 @@ size_t qemu_chr_mem_osize(const CharDriverState *chr)
 /*********************************************************/
 /* Ring buffer chardev */
 
+/* With path=, the ring lives in a file that a reader outside QEMU maps
+   as well: this header, then the data from RINGBUF_SHM_DATA on.  Both
+   indices are free-running byte counts in host byte order.  QEMU only
+   ever moves prod and dropped, the reader only cons, so the reader can
+   take characters without system calls or locks, and QEMU never waits
+   for it: what does not fit is dropped and counted.  Magic is written
+   last, once the rest of the header is valid.  */
+#define RINGBUF_SHM_MAGIC       0x474e5251      /* "QRNG" */
+#define RINGBUF_SHM_VERSION     1
+#define RINGBUF_SHM_DATA        4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint8_t pad0[48];
+    /* On cache lines of their own, as the two sides write them.  */
+    uint64_t prod;
+    uint64_t dropped;
+    uint8_t pad1[48];
+    uint64_t cons;
+} RingBufShared;
+
 typedef struct {
     size_t size;
     size_t prod;
     size_t cons;
     uint8_t *cbuf;
+    RingBufShared *shm;
 } RingBufCharDriver;
 
+static size_t ringbuf_cons(const RingBufCharDriver *d)
+{
+    if (d->shm) {
+        return *(volatile uint64_t *)&d->shm->cons;
+    }
+    return d->cons;
+}
+
 static size_t ringbuf_count(const CharDriverState *chr)
 {
     const RingBufCharDriver *d = chr->opaque;
 
-    return d->prod - d->cons;
+    return d->prod - ringbuf_cons(d);
+}
+
+static void ringbuf_copy_in(RingBufCharDriver *d, const uint8_t *buf,
+                            size_t len)
+{
+    size_t pos = d->prod & (d->size - 1);
+    size_t first = MIN(len, d->size - pos);
+
+    memcpy(d->cbuf + pos, buf, first);
+    memcpy(d->cbuf, buf + first, len - first);
+    d->prod += len;
 }
 
 static int ringbuf_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     RingBufCharDriver *d = chr->opaque;
-    int i;
+    size_t room;
 
     if (!buf || (len < 0)) {
         return -1;
     }
 
-    for (i = 0; i < len; i++ ) {
-        d->cbuf[d->prod++ & (d->size - 1)] = buf[i];
-        if (d->prod - d->cons > d->size) {
-            d->cons = d->prod - d->size;
+    if (d->shm) {
+        /* The data must not be written before the reader is seen to have
+           finished with it, nor prod moved before the data is in.  */
+        room = d->size - (d->prod - ringbuf_cons(d));
+        smp_mb();
+        if (len > room) {
+            d->shm->dropped += len - room;
+            len = room;
         }
+        ringbuf_copy_in(d, buf, len);
+        smp_wmb();
+        d->shm->prod = d->prod;
+        return 0;
+    }
+
+    /* Only the newest size bytes are kept.  */
+    if (len > d->size) {
+        buf += len - d->size;
+        d->prod += len - d->size;
+        len = d->size;
+    }
+    ringbuf_copy_in(d, buf, len);
+    if (d->prod - d->cons > d->size) {
+        d->cons = d->prod - d->size;
     }
 
     return 0;
@@ -2682,10 +2844,18 @@ static int ringbuf_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 static int ringbuf_chr_read(CharDriverState *chr, uint8_t *buf, int len)
 {
     RingBufCharDriver *d = chr->opaque;
+    size_t cons = ringbuf_cons(d);
     int i;
 
-    for (i = 0; i < len && d->cons != d->prod; i++) {
-        buf[i] = d->cbuf[d->cons++ & (d->size - 1)];
+    smp_rmb();
+    for (i = 0; i < len && cons != d->prod; i++) {
+        buf[i] = d->cbuf[cons++ & (d->size - 1)];
+    }
+    if (d->shm) {
+        smp_mb();
+        d->shm->cons = cons;
+    } else {
+        d->cons = cons;
     }
 
     return i;
@@ -2695,15 +2865,60 @@ static void ringbuf_chr_close(struct CharDriverState *chr)
 {
     RingBufCharDriver *d = chr->opaque;
 
-    g_free(d->cbuf);
+#ifndef _WIN32
+    if (d->shm) {
+        munmap(d->shm, RINGBUF_SHM_DATA + d->size);
+    } else
+#endif
+    {
+        g_free(d->cbuf);
+    }
     g_free(d);
     chr->opaque = NULL;
 }
 
+#ifndef _WIN32
+static RingBufShared *ringbuf_shm_open(const char *path, size_t size)
+{
+    RingBufShared *shm;
+    int fd;
+
+    TFR(fd = qemu_open(path, O_RDWR | O_CREAT | O_BINARY, 0600));
+    if (fd < 0) {
+        error_report("ringbuf: %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, RINGBUF_SHM_DATA + size) < 0) {
+        error_report("ringbuf: %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    shm = mmap(NULL, RINGBUF_SHM_DATA + size, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        error_report("ringbuf: %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    shm->magic = 0;
+    smp_wmb();
+    shm->version = RINGBUF_SHM_VERSION;
+    shm->size = size;
+    shm->prod = 0;
+    shm->dropped = 0;
+    shm->cons = 0;
+    smp_wmb();
+    shm->magic = RINGBUF_SHM_MAGIC;
+    return shm;
+}
+#endif
+
 static CharDriverState *qemu_chr_open_ringbuf(QemuOpts *opts)
 {
     CharDriverState *chr;
     RingBufCharDriver *d;
+    const char *path = qemu_opt_get(opts, "path");
 
     chr = g_malloc0(sizeof(CharDriverState));
     d = g_malloc(sizeof(*d));
@@ -2721,7 +2936,21 @@ static CharDriverState *qemu_chr_open_ringbuf(QemuOpts *opts)
 
     d->prod = 0;
     d->cons = 0;
-    d->cbuf = g_malloc0(d->size);
+    d->shm = NULL;
+    if (path) {
+#ifndef _WIN32
+        d->shm = ringbuf_shm_open(path, d->size);
+        if (!d->shm) {
+            goto fail;
+        }
+        d->cbuf = (uint8_t *)d->shm + RINGBUF_SHM_DATA;
+#else
+        error_report("ringbuf: path is not supported on this host");
+        goto fail;
+#endif
+    } else {
+        d->cbuf = g_malloc0(d->size);
+    }
 
     chr->opaque = d;
     chr->chr_write = ringbuf_chr_write;
@@ -2982,6 +3211,7 @@ static const struct {
     { .name = "msmouse",   .open = qemu_chr_open_msmouse },
     { .name = "vc",        .open = text_console_init },
     { .name = "memory",    .open = qemu_chr_open_ringbuf },
+    { .name = "ringbuf",   .open = qemu_chr_open_ringbuf },
 #ifdef _WIN32
     { .name = "file",      .open = qemu_chr_open_win_file_out },
     { .name = "pipe",      .open = qemu_chr_open_win_pipe },
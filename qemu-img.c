@@ -88,6 +88,9 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for convert, 8 by default (1 to 16)\n"
+           "  '-W' allow convert to write out of order, which is faster but may\n"
+           "       fragment images in growable formats\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -578,6 +581,11 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
+    if (is_zero) {
+        /* Zero runs are the common case, skip them in one go.  */
+        *pnum = buffer_find_nonzero_offset(buf, n * 512) / 512;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
@@ -662,18 +670,238 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 }
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    int buf_sectors;
+    bool wr_in_order;
+    int num_coroutines;
+
+    /* Chunks are handed out under lock, which is held across the
+     * allocation query for the chunk.  */
+    CoMutex lock;
+    int64_t sector_num;     /* first sector not yet handed out */
+    int64_t wr_offs;        /* first sector not yet written, if in order */
+    int ret;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+} ImgConvertState;
+
+/* Returns how many sectors from sector_num on can be read from one
+ * source image, and which image and where in it they are.  */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num,
+                                     int *src_cur, int64_t *src_sector)
+{
+    int64_t offset = 0;
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        if (sector_num < offset + s->src_sectors[i]) {
+            break;
+        }
+        offset += s->src_sectors[i];
+    }
+    assert(i < s->src_num);
+
+    *src_cur = i;
+    *src_sector = sector_num - offset;
+    return MIN(s->buf_sectors, offset + s->src_sectors[i] - sector_num);
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n = nb_sectors;
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/*
+ * Every coroutine reads a chunk of up to buf_sectors and writes it out,
+ * then goes for the next one, so that num_coroutines requests are in
+ * flight at any time.  Unless out of order writes were asked for, a
+ * coroutine that has read its chunk waits for the one before to be
+ * written first, which keeps formats that allocate clusters as they go
+ * from scattering them over the image.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int index = -1;
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int64_t sector_num, src_sector;
+        int src_cur, n, ret;
+        bool copy = true;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        sector_num = s->sector_num;
+        n = convert_iteration_sectors(s, sector_num, &src_cur, &src_sector);
+        if (s->has_zero_init && s->target_has_backing) {
+            /* Sectors that are unallocated in the input image are present
+               in both the output's and input's base images (no need to
+               copy them). */
+            copy = bdrv_co_is_allocated(s->src[src_cur], src_sector, n, &n);
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (copy) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_readv(s->src[src_cur], src_sector, n, &qiov);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             src_sector, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        if (copy) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Let the coroutine with the next chunk write it.  */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+        qemu_progress_print(100.0f * n / s->total_sectors, 100);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+
+    if (s->ret != -EINPROGRESS) {
+        /* Nobody is going to write the chunks that are waiting.  */
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] != -1) {
+                qemu_coroutine_enter(s->co[i], NULL);
+            }
+        }
+    } else if (!s->running_coroutines) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->ret = -EINPROGRESS;
+    s->running_coroutines = 0;
+
+    /* All coroutines must be known before the first one looks itself up.  */
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    return s->ret;
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t *src_sectors = NULL;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -681,6 +909,8 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -688,7 +918,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -742,7 +972,28 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
         }
+        case 'W':
+            wr_in_order = false;
+            break;
+        }
+    }
+
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        return 1;
     }
 
     bs_n = argc - optind - 1;
@@ -770,6 +1021,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    src_sectors = g_new(int64_t, bs_n);
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -780,6 +1032,7 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        src_sectors[bs_i] = bs_sectors;
         total_sectors += bs_sectors;
     }
 
@@ -901,9 +1154,9 @@ static int img_convert(int argc, char **argv)
     bs_i = 0;
     bs_offset = 0;
     bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
 
     if (compress) {
+        buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
             error_report("could not get block driver info");
@@ -989,98 +1242,28 @@ static int img_convert(int argc, char **argv)
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+        ImgConvertState state = {
+            .src                = bs,
+            .src_sectors        = src_sectors,
+            .src_num            = bs_n,
+            .total_sectors      = total_sectors,
+            .target             = out_bs,
+            .has_zero_init      = bdrv_has_zero_init(out_bs),
+            .target_has_backing = out_baseimg != NULL,
+            .min_sparse         = min_sparse,
+            .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .wr_in_order        = wr_in_order,
+            .num_coroutines     = num_coroutines,
+        };
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        ret = convert_do_copy(&state);
     }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
     qemu_vfree(buf);
+    g_free(src_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -16,9 +16,11 @@
 
 #include "qemu-common.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "block/block_int.h"
 #include "cmd.h"
 #include "trace/control.h"
+#include "qemu/config-file.h"
 
 #define VERSION	"0.0.1"
 
@@ -1379,6 +1381,330 @@ static int aio_write_f(int argc, char **argv)
     return 0;
 }
 
+struct bench_ctx {
+    int64_t offset;
+    int64_t len;
+    int bsize;
+    int count;
+    int issued;
+    int completed;
+    int in_flight;
+    int errors;
+    int wflag;
+    int rflag;
+    uint64_t seed;
+    int64_t *latency;
+};
+
+struct bench_req {
+    struct bench_ctx *ctx;
+    QEMUIOVector qiov;
+    char *buf;
+    int64_t t1;
+};
+
+/* xorshift64*, so that random runs can be repeated with the same seed */
+static int64_t bench_next_offset(struct bench_ctx *ctx)
+{
+    int64_t nr_blocks = ctx->len / ctx->bsize;
+    int64_t block;
+
+    if (ctx->rflag) {
+        ctx->seed ^= ctx->seed >> 12;
+        ctx->seed ^= ctx->seed << 25;
+        ctx->seed ^= ctx->seed >> 27;
+        block = (ctx->seed * 2685821657736338717ULL) % nr_blocks;
+    } else {
+        block = ctx->issued % nr_blocks;
+    }
+    return ctx->offset + block * ctx->bsize;
+}
+
+static void bench_done(void *opaque, int ret);
+
+static void bench_submit(struct bench_req *req)
+{
+    struct bench_ctx *ctx = req->ctx;
+    int64_t offset = bench_next_offset(ctx);
+
+    ctx->issued++;
+    ctx->in_flight++;
+    req->t1 = get_clock();
+    if (ctx->wflag) {
+        bdrv_aio_writev(bs, offset >> 9, &req->qiov, ctx->bsize >> 9,
+                        bench_done, req);
+    } else {
+        bdrv_aio_readv(bs, offset >> 9, &req->qiov, ctx->bsize >> 9,
+                       bench_done, req);
+    }
+}
+
+static void bench_done(void *opaque, int ret)
+{
+    struct bench_req *req = opaque;
+    struct bench_ctx *ctx = req->ctx;
+
+    ctx->latency[ctx->completed++] = get_clock() - req->t1;
+    ctx->in_flight--;
+
+    if (ret < 0) {
+        if (!ctx->errors) {
+            printf("bench: %s failed: %s\n", ctx->wflag ? "write" : "read",
+                   strerror(-ret));
+        }
+        ctx->errors++;
+    }
+
+    /* Keep the queue full until all the requests are issued */
+    if (ctx->issued < ctx->count && !ctx->errors) {
+        bench_submit(req);
+    }
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency in microseconds below which pct percent of the requests are */
+static double bench_percentile(struct bench_ctx *ctx, double pct)
+{
+    int i = (int)(pct / 100 * ctx->completed + 0.999999) - 1;
+
+    return ctx->latency[MAX(i, 0)] / 1000.0;
+}
+
+static void bench_report(struct bench_ctx *ctx, int depth, int64_t t,
+                         int Cflag)
+{
+    double total = (double)ctx->completed * ctx->bsize;
+    double avg = 0;
+    char s1[64], s2[64], ts[64];
+    struct timeval tv;
+    int i;
+
+    for (i = 0; i < ctx->completed; i++) {
+        avg += ctx->latency[i];
+    }
+    avg /= ctx->completed * 1000.0;
+    qsort(ctx->latency, ctx->completed, sizeof(ctx->latency[0]),
+          bench_compare);
+
+    tv.tv_sec = t / 1000000000LL;
+    tv.tv_usec = t % 1000000000LL / 1000;
+    timestr(&tv, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+
+    if (!Cflag) {
+        cvtstr(total, s1, sizeof(s1));
+        cvtstr(tdiv(total, tv), s2, sizeof(s2));
+        printf("%s %d x %d bytes, %s, queue depth %d\n",
+               ctx->wflag ? "wrote" : "read", ctx->completed, ctx->bsize,
+               ctx->rflag ? "random" : "sequential", depth);
+        printf("%s, %d ops; %s (%s/sec and %.4f ops/sec)\n",
+               s1, ctx->completed, ts, s2, tdiv(ctx->completed, tv));
+        printf("latency (usec): min %.1f, avg %.1f, max %.1f; "
+               "50%% %.1f, 90%% %.1f, 99%% %.1f, 99.9%% %.1f\n",
+               ctx->latency[0] / 1000.0, avg,
+               ctx->latency[ctx->completed - 1] / 1000.0,
+               bench_percentile(ctx, 50), bench_percentile(ctx, 90),
+               bench_percentile(ctx, 99), bench_percentile(ctx, 99.9));
+    } else {/* bytes,ops,time,bytes/sec,ops/sec,min,avg,max,50%,90%,99%,99.9% */
+        printf("%.0f,%d,%s,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               total, ctx->completed, ts, tdiv(total, tv),
+               tdiv(ctx->completed, tv),
+               ctx->latency[0] / 1000.0, avg,
+               ctx->latency[ctx->completed - 1] / 1000.0,
+               bench_percentile(ctx, 50), bench_percentile(ctx, 90),
+               bench_percentile(ctx, 99), bench_percentile(ctx, 99.9));
+    }
+}
+
+static void bench_help(void)
+{
+    printf(
+"\n"
+" drives a workload through the asynchronous I/O path and reports its\n"
+" throughput and latency\n"
+"\n"
+" Example:\n"
+" 'bench -r -d 32 -n 10000 -s 4k' - 10000 random 4k reads, 32 at a time\n"
+"\n"
+" Requests of the same size are issued over a range of the currently open\n"
+" file, and a new request is issued as soon as one completes, so that the\n"
+" given number of them is always in flight.  Sequential requests start\n"
+" again from the beginning of the range when they reach its end.\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- number of requests in flight (default 1)\n"
+" -l, -- length of the range (default: up to the end of the file)\n"
+" -n, -- number of requests (default: as many as fit in the range)\n"
+" -o, -- start of the range (default 0)\n"
+" -P, -- use different pattern to fill file (default 0xcd)\n"
+" -q, -- quiet mode, do not show I/O statistics\n"
+" -r, -- random offsets instead of sequential ones\n"
+" -R, -- seed of the random offsets (default 1)\n"
+" -s, -- size of the requests (default 4k)\n"
+" -w, -- write instead of read\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 0,
+    .argmax     = -1,
+    .args       = "[-Cqrw] [-d depth] [-l len] [-n count] [-o off] "
+                  "[-P pattern] [-R seed] [-s size]",
+    .oneline    = "measures the throughput and latency of a workload",
+    .help       = bench_help,
+};
+
+static int bench_f(int argc, char **argv)
+{
+    struct bench_ctx ctx = { .bsize = 4096, .count = -1, .seed = 1 };
+    struct bench_req *reqs;
+    int Cflag = 0, qflag = 0;
+    int depth = 1, pattern = 0xcd;
+    int64_t size, len = -1, t1, t2, val;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "Cd:l:n:o:P:qrR:s:w")) != EOF) {
+        switch (c) {
+        case 'C':
+            Cflag = 1;
+            break;
+        case 'd':
+            depth = cvtnum(optarg);
+            if (depth <= 0) {
+                printf("invalid queue depth -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'l':
+            len = cvtnum(optarg);
+            if (len < 0) {
+                printf("non-numeric length argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'n':
+            val = cvtnum(optarg);
+            if (val <= 0 || val > INT_MAX) {
+                printf("invalid request count -- %s\n", optarg);
+                return 0;
+            }
+            ctx.count = val;
+            break;
+        case 'o':
+            ctx.offset = cvtnum(optarg);
+            if (ctx.offset < 0) {
+                printf("non-numeric offset argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'P':
+            pattern = parse_pattern(optarg);
+            if (pattern < 0) {
+                return 0;
+            }
+            break;
+        case 'q':
+            qflag = 1;
+            break;
+        case 'r':
+            ctx.rflag = 1;
+            break;
+        case 'R':
+            ctx.seed = cvtnum(optarg);
+            if (ctx.seed == 0 || (int64_t)ctx.seed < 0) {
+                printf("invalid seed -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 's':
+            val = cvtnum(optarg);
+            if (val <= 0 || val > INT_MAX) {
+                printf("non-numeric length argument -- %s\n", optarg);
+                return 0;
+            }
+            ctx.bsize = val;
+            break;
+        case 'w':
+            ctx.wflag = 1;
+            break;
+        default:
+            return command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind != argc) {
+        return command_usage(&bench_cmd);
+    }
+
+    if (ctx.offset & 0x1ff) {
+        printf("offset %" PRId64 " is not sector aligned\n", ctx.offset);
+        return 0;
+    }
+    if (ctx.bsize & 0x1ff) {
+        printf("size %d is not sector aligned\n", ctx.bsize);
+        return 0;
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        printf("getlength: %s\n", strerror(-size));
+        return 0;
+    }
+    if (len < 0) {
+        len = size - ctx.offset;
+    }
+    if (len < ctx.bsize || ctx.offset + len > size) {
+        printf("range of %" PRId64 " bytes at offset %" PRId64
+               " does not fit %d byte requests\n", len, ctx.offset,
+               ctx.bsize);
+        return 0;
+    }
+    ctx.len = len;
+    if (ctx.count < 0) {
+        ctx.count = MIN(len / ctx.bsize, INT_MAX);
+    }
+    depth = MIN(depth, ctx.count);
+
+    ctx.latency = g_new(int64_t, ctx.count);
+    reqs = g_new0(struct bench_req, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].ctx = &ctx;
+        reqs[i].buf = qemu_io_alloc(ctx.bsize, pattern);
+        qemu_iovec_init(&reqs[i].qiov, 1);
+        qemu_iovec_add(&reqs[i].qiov, reqs[i].buf, ctx.bsize);
+    }
+
+    t1 = get_clock();
+    for (i = 0; i < depth; i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (ctx.in_flight) {
+        main_loop_wait(false);
+    }
+    t2 = get_clock();
+
+    if (!qflag && !ctx.errors) {
+        /* Finally, report back -- -C gives a parsable format */
+        bench_report(&ctx, depth, t2 - t1, Cflag);
+    }
+
+    for (i = 0; i < depth; i++) {
+        qemu_iovec_destroy(&reqs[i].qiov);
+        qemu_io_free(reqs[i].buf);
+    }
+    g_free(reqs);
+    g_free(ctx.latency);
+    return 0;
+}
+
 static int aio_flush_f(int argc, char **argv)
 {
     bdrv_drain_all();
@@ -1888,6 +2214,7 @@ static void usage(const char *name)
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
+"  --qcow2 OPTS         qcow2 cache sizes, see -qcow2 of qemu-system\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n",
@@ -1913,11 +2240,13 @@ int main(int argc, char **argv)
         { "native-aio", 0, NULL, 'k' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
+        { "qcow2", 1, NULL, 'Q' },
         { NULL, 0, NULL, 0 }
     };
     int c;
     int opt_index = 0;
     int flags = 0;
+    const char *qcow2_opts = NULL;
 
     progname = basename(argv[0]);
 
@@ -1955,6 +2284,9 @@ int main(int argc, char **argv)
                 exit(1); /* error message will have been printed */
             }
             break;
+        case 'Q':
+            qcow2_opts = optarg;
+            break;
         case 'V':
             printf("%s version %s\n", progname, VERSION);
             exit(0);
@@ -1975,6 +2307,12 @@ int main(int argc, char **argv)
     qemu_init_main_loop();
     bdrv_init();
 
+    /* the option group only exists once the drivers are registered */
+    if (qcow2_opts &&
+        !qemu_opts_parse(qemu_find_opts("qcow2"), qcow2_opts, 0)) {
+        exit(1);
+    }
+
     /* initialize commands */
     quit_init();
     help_init();
@@ -1988,6 +2326,7 @@ int main(int argc, char **argv)
     add_command(&aio_read_cmd);
     add_command(&aio_write_cmd);
     add_command(&aio_flush_cmd);
+    add_command(&bench_cmd);
     add_command(&flush_cmd);
     add_command(&truncate_cmd);
     add_command(&length_cmd);
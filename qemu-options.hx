@@ -35,7 +35,14 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                mem-hugepages=on|off back large RAM blocks with huge pages (default: on)\n"
+    "                part=name selects the microcontroller of STM32 boards\n"
+    "                nodes=n number of microcontrollers of multi-node boards\n"
+    "                quantum=ns lockstep quantum of multi-node boards (with -icount)\n"
+    "                fast-reset=on|off reset by restoring the state after the first reset (default: off)\n"
+    "                rng=id RNG backend object of the STM32 RNG\n"
+    "                rng-seed=n reproducible random numbers for the STM32 RNG\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +65,37 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item mem-hugepages=on|off
+Asks for transparent huge pages for the RAM blocks of at least 2 MiB that
+are not already backed by hugetlbfs through @option{-mem-path}.  The default
+is on.  When the option is given, the pages each block got are reported at
+startup.
+@item part=@var{name}
+Selects the microcontroller part number (e.g. STM32F103C8) of STM32 boards.
+Only the memory and peripherals of that part are emulated.  An unknown name
+lists the supported parts.
+@item nodes=@var{n}
+Sets the number of microcontrollers that multi-node boards such as
+stm32-p103-multi create, each with its own CPU and address space.
+@item quantum=@var{ns}
+With @option{-icount}, runs the microcontrollers of multi-node boards in
+turn, each for at most @var{ns} nanoseconds of virtual time per round, so
+that they all see the same time advance (default 10000).
+@item fast-reset=on|off
+Takes a copy of RAM and of the device state once the machine has been reset
+at startup (after @option{-loadvm} or @option{-loadstate-shm}, if given), and
+makes every later reset go back to it.  Only the RAM pages that changed are
+copied back, and the code translated from the others is kept, which makes
+resets between test runs cheap.  Devices that cannot be migrated rule it out.
+The default is off.
+@item rng=@var{id}
+Feeds the RNG of STM32F2 microcontrollers from the RNG backend created with
+@option{-object} and the given @var{id}, instead of from /dev/urandom.  The
+entropy is fetched in chunks of a few KiB ahead of the reads.
+@item rng-seed=@var{n}
+Makes the RNG of STM32F2 microcontrollers return the same numbers on every
+run, generated from the seed @var{n} (and back from it at every reset)
+instead of taken from the host.
 @end table
 ETEXI
 
@@ -151,6 +189,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,throttle_group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -1196,6 +1237,12 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings allows to restore the original static behavior of encodings
 like Tight.
 
+@item workers=@var{n}
+
+Encode updates on @var{n} threads instead of one.  The updates of each client
+are still encoded one at a time and in order, so this only helps when several
+clients are connected.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1338,7 +1385,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1355,6 +1402,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to create a multiqueue tap with n queues, or\n"
+    "                'fds=x:y:...:z' and 'vhostfds=x:y:...:z' to connect to already\n"
+    "                opened multiqueue tap and vhost net devices\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1573,6 +1623,16 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+With @option{queues}=@var{n} on a host whose TAP driver supports multiple
+queues, the interface is opened @var{n} times, and each queue gets its own
+file descriptor and, with @option{vhost=on}, its own vhost-net worker.
+A virtio-net device with @option{mq=on} on such a netdev gets @var{n}
+queue pairs, one for each of them, and the host kernel steers the packets of
+a flow to the queue the guest last sent that flow on.  Without vhost each
+queue pair has its own transmit bottom half in QEMU.  Give the device
+2 * @var{n} + 2 MSI-X @option{vectors} so that every queue can interrupt
+on its own.
+
 Examples:
 
 @example
@@ -1588,6 +1648,14 @@ qemu-system-i386 linux.img \
                  -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+@example
+#launch a QEMU instance with a four queue virtio-net device,
+#each queue pair served by its own vhost-net worker
+qemu-system-i386 linux.img \
+                 -netdev tap,id=hn0,queues=4,vhost=on \
+                 -device virtio-net-pci,netdev=hn0,mq=on,vectors=10
+@end example
+
 @example
 #launch a QEMU instance with the default network helper to
 #connect a TAP device to bridge br0
@@ -1736,7 +1804,7 @@ DEF("chardev", HAS_ARG, QEMU_OPTION_chardev,
     "-chardev msmouse,id=id[,mux=on|off]\n"
     "-chardev vc,id=id[[,width=width][,height=height]][[,cols=cols][,rows=rows]]\n"
     "         [,mux=on|off]\n"
-    "-chardev ringbuf,id=id[,size=size]\n"
+    "-chardev ringbuf,id=id[,size=size][,path=path]\n"
     "-chardev file,id=id,path=path[,mux=on|off]\n"
     "-chardev pipe,id=id,path=path[,mux=on|off]\n"
 #ifdef _WIN32
@@ -1887,11 +1955,24 @@ the console, in pixels.
 @option{cols} and @option{rows} specify that the console be sized to fit a text
 console with the given dimensions.
 
-@item -chardev ringbuf ,id=@var{id} [,size=@var{size}]
+@item -chardev ringbuf ,id=@var{id} [,size=@var{size}] [,path=@var{path}]
 
 Create a ring buffer with fixed size @option{size}.
 @var{size} must be a power of two, and defaults to @code{64K}).
 
+With @option{path}, the ring buffer is kept in the file @var{path}, which
+QEMU creates or truncates and maps shared, so that another process can map
+it too and read the output without system calls.  Its first 4096 bytes are
+a header, in host byte order: a 32-bit magic @code{0x474e5251} at offset 0
+(written last, once the rest is valid), a 32-bit version (1) at offset 4,
+the 64-bit size at offset 8, and three free-running 64-bit byte counters:
+the producer index at offset 64, the number of bytes dropped at offset 72
+and the consumer index at offset 128.  The data follows the header.  The
+reader copies out the bytes between the consumer and the producer index,
+at their offsets modulo the size, and then advances the consumer index.
+QEMU never waits for the reader: output that does not fit in the ring is
+dropped and counted.
+
 @item -chardev file ,id=@var{id} ,path=@var{path}
 
 Log all traffic received from the guest to a file.
@@ -2116,6 +2197,19 @@ See also @url{http://www.gluster.org}.
 @end table
 ETEXI
 
+DEF("qcow2", HAS_ARG, QEMU_OPTION_qcow2,
+    "-qcow2 [l2-cache-size=size][,refcount-cache-size=size]\n"
+    "                qcow2 metadata cache sizes\n", QEMU_ARCH_ALL)
+STEXI
+@item -qcow2 [l2-cache-size=@var{size}][,refcount-cache-size=@var{size}]
+@findex -qcow2
+Set the size of the caches of L2 tables and refcount blocks every qcow2
+image keeps in memory, in bytes or with a k, M or G suffix.  The defaults
+are 16 L2 tables and 4 refcount blocks, of one cluster each; every table
+of 64k clusters maps 512M of the image.  Larger L2 caches speed up random
+I/O on large images.
+ETEXI
+
 DEFHEADING(Bluetooth(R) options:)
 
 DEF("bt", HAS_ARG, QEMU_OPTION_bt, \
@@ -2599,6 +2693,20 @@ STEXI
 Start right away with a saved state (@code{loadvm} in monitor)
 ETEXI
 
+DEF("loadstate-shm", HAS_ARG, QEMU_OPTION_loadstate_shm, \
+    "-loadstate-shm file\n" \
+    "                start right away with a machine state saved by state-save\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -loadstate-shm @var{file}
+@findex -loadstate-shm
+Start right away with the machine state that the QMP command
+@code{state-save} wrote to @var{file}.  The file is mapped rather than read,
+so when it is on tmpfs (e.g. in @file{/dev/shm}) the QEMUs started from it
+share its pages.  Unlike @option{-loadvm}, this needs no snapshot-capable
+drive; the contents of the drives are not restored.
+ETEXI
+
 #ifndef _WIN32
 DEF("daemonize", 0, QEMU_OPTION_daemonize, \
     "-daemonize      daemonize QEMU after initializing\n", QEMU_ARCH_ALL)
@@ -2682,6 +2790,81 @@ order cores with complex cache hierarchies.  The number of instructions
 executed often has little or no correlation with actual performance.
 ETEXI
 
+DEF("replay", HAS_ARG, QEMU_OPTION_replay, \
+    "-replay record=file|play=file\n" \
+    "                record device input to a journal, or play it back\n" \
+    "                (requires -icount N)\n", QEMU_ARCH_ALL)
+STEXI
+@item -replay record=@var{file}|play=@var{file}
+@findex -replay
+Record the input that devices receive from their character devices into
+@var{file}, stamped with the virtual time at which it arrived, or play a
+journal back.  When playing, the live character device backends are
+ignored and every device gets the recorded input at the recorded time,
+so a session can be repeated exactly.  Both runs need the same machine,
+command line and firmware, and @option{-icount} with a fixed shift.
+
+Only devices that register with the journal take part; on the STM32
+boards these are the USARTs, the pin bus, the ADC sample streams and
+the USB host link.
+ETEXI
+
+DEF("pcsample", HAS_ARG, QEMU_OPTION_pcsample, \
+    "-pcsample [file=]file[,interval=us][,unwind=none|lr|fp][,depth=n]\n" \
+    "                sample the guest PC and write a folded stacks profile\n",
+    QEMU_ARCH_ARM)
+STEXI
+@item -pcsample [file=]@var{file}[,interval=@var{us}][,unwind=none|lr|fp][,depth=@var{n}]
+@findex -pcsample
+Sample the program counter of an ARMv7-M CPU every @var{us} microseconds
+of virtual time (1000 by default) and write the samples to @var{file} in
+the folded stacks format read by flame graph tools, one line per call
+stack with its sample count.  PCs are resolved with the symbols of the ELF
+image given to @option{-kernel}.  The file is written whenever the guest
+stops and when QEMU exits.  With @option{-icount} the samples fall every
+so many guest instructions.
+
+@option{unwind} chooses how the callers are found.  With @code{lr}, the
+default, the caller is taken from the link register, which is only
+reliable in leaf functions.  With @code{fp}, the frame records that r7
+points to are followed, up to @var{n} frames (32 by default); the
+firmware must be built with frame pointers in the "push @{r7, lr@}; mov
+r7, sp" layout, as Clang emits for Thumb.  Where the stacked exception
+frame can be found, both carry on into the code that an exception
+interrupted.  With @code{none} only the sampled function is recorded.
+ETEXI
+
+DEF("fuzz", HAS_ARG, QEMU_OPTION_fuzz, \
+    "-fuzz [chardev=]name[,input=file][,timeout=ms][,idle=us]\n" \
+    "                run inputs through character device name from a snapshot\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -fuzz [chardev=]@var{name}[,input=@var{file}][,timeout=@var{ms}][,idle=@var{us}]
+@findex -fuzz
+Run the firmware on fuzzer generated inputs.  Every run starts from the
+state right after the first reset, kept in memory as with
+@option{-machine fast-reset=on}, and hands the input to the device behind
+character device @var{name}, such as @code{serial0} for the USART of the
+first serial port, as fast as it takes it.  A run ends when the guest has
+had all the input and then run @var{us} microseconds (1000 by default)
+without more, when an ARMv7-M CPU takes a HardFault, or after @var{ms}
+milliseconds (1000 by default), all of virtual time.
+
+With @option{input}, afl-fuzz drives the runs through its fork server
+pipes, reading each input from @var{file}.  QEMU serves all runs in one
+process, and reports a HardFault as a crash and a timeout as a hang, as
+a child killed by SIGSEGV or SIGKILL would be.  The machine does not run
+until afl-fuzz asks for the first run.  Use it with
+@option{-tcg coverage=on}, and @option{-icount} to make runs repeatable:
+
+@example
+afl-fuzz -i in -o out -- qemu-system-arm -M stm32-p103 -kernel fw.elf \
+    -serial null -icount 0 -tcg coverage=on -fuzz serial0,input=@@@@
+@end example
+
+The QMP command @code{fuzz-input} gives the device more input at any time.
+ETEXI
+
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
     "-watchdog i6300esb|ib700\n" \
     "                enable virtual hardware watchdog [default=none]\n",
@@ -2783,6 +2966,99 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tcg", HAS_ARG, QEMU_OPTION_tcg, \
+    "-tcg [traces=on|off][,profile=on|off][,profile-file=file][,profile-interval=ms]\n"
+    "     [,pretranslate=on|off][,ebb=on|off][,cycles=on|off][,coverage=on|off]\n"
+    "     [,hugepages=on|off|hugetlb][,memfuncs=on|off]\n"
+    "                traces: continue translation blocks across direct branches\n"
+    "                profile: count executions, exits and MMIO accesses per\n"
+    "                translation block, and dump them to file every interval\n"
+    "                pretranslate: translate the guest's entry points before it starts\n"
+    "                ebb: keep guest registers in host registers across branches\n"
+    "                inside a translation block\n"
+    "                cycles: make -icount count estimated core clock cycles\n"
+    "                coverage: count branch edges in an AFL compatible bitmap\n"
+    "                hugepages: pages of the translation buffer\n"
+    "                memfuncs: run the guest's memcpy and memset on the host\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcg [traces=on|off][,profile=on|off][,profile-file=@var{file}][,profile-interval=@var{ms}][,pretranslate=on|off][,ebb=on|off][,cycles=on|off][,coverage=on|off][,hugepages=on|off|hugetlb][,memfuncs=on|off]
+@findex -tcg
+With @option{traces=on}, the translator does not end a translation block
+at a direct branch to a later address in the same page, but carries on
+translating at the branch target.  The straight-line path through a loop
+then runs as one block.  This is currently implemented for ARM targets.
+@code{info jit} reports how many blocks and branches this affected.
+
+With @option{profile=on}, each translation block counts how often it
+runs, how often it returns to the main loop through a jump that is not
+chained, and how many MMIO accesses it makes.  @code{info tbs} lists the
+busiest blocks with their guest symbol.  Execution counts are currently
+collected for ARM targets only.  The counts of a block are lost when it
+is flushed or invalidated.  @option{profile-file} implies
+@option{profile=on}, and rewrites @var{file} with all the counts every
+@var{ms} milliseconds (default 1000).  The file holds a 24-byte header
+(the string @code{QEMUTBP}, a version and block count, and the number
+of indirect exits).  One 32-byte record per block follows (guest pc,
+executions, unchained exits, MMIO accesses, host code size, guest code
+size and helper calls), all little endian.
+
+With @option{pretranslate=on}, the board translates the code at the
+guest's known entry points when the machine starts, so that their first
+run does not pay for translation.  ARMv7-M boards translate the reset
+and exception handlers named by the vector table in flash, following on
+into the code after each block.  @code{info jit} reports how many blocks
+were translated this way.
+
+With @option{ebb=on}, the register allocator treats the code between
+forward branches of a translation block as one extended basic block.
+Guest registers that sit in the same host register on all the paths to
+a branch target stay there, instead of being reloaded after every
+conditional branch, as in predicated Thumb code.  @code{info jit}
+reports how many labels and registers this affected.
+
+With @option{cycles=on}, the instruction counter of @option{-icount}
+counts clock cycles instead of instructions, and the option implies
+@option{-icount 0} if it is not given (@code{auto} is not supported).
+The translator estimates the cycles of each block from the instruction
+timings of the Cortex-M3 and Cortex-M4, including the wait states of
+code and literals fetched from on-chip flash as programmed in the flash
+access control register, and exception entry and return take their
+documented latencies.  Boards that know their core clock, such as the
+STM32 ones, make each cycle last one period of it, rounded to whole
+nanoseconds as SysTick is, so SysTick counts the estimated cycles.  The
+estimate ignores bus contention and charges conditional branches the
+mean of their taken and not taken costs.  Other CPUs count one cycle per
+instruction.
+
+With @option{coverage=on}, each translation block counts the edge it was
+entered by, chained or not, in a 64 KiB bitmap laid out as AFL's: the
+byte at the hashed address of the block xor half that of the previous
+block is incremented.  If the environment variable @env{__AFL_SHM_ID} is
+set, the bitmap is that shared memory segment, otherwise it is private
+to QEMU.  This is currently implemented for ARM targets.  See
+@option{-fuzz} for running inputs against a snapshot.
+
+@option{hugepages} selects the pages of the translation buffer.
+@code{on} aligns it to 2 MiB and asks for transparent huge pages, and
+@code{hugetlb} maps it from the hugetlbfs pool, or falls back to
+@code{on} if the pool is too small.  @code{off} keeps small pages.
+When the option is given, the pages obtained are reported at
+startup.  Without it, transparent huge pages are asked for without a
+report.  @code{info jit} always shows them.
+
+With @option{memfuncs=on}, a call to one of the @code{memcpy},
+@code{memmove} or @code{memset} functions of the guest, or to their
+@code{__aeabi_} variants, is run as a single copy or fill by QEMU when
+all the bytes it touches are RAM.  The functions are found by name in
+the symbols of the ELF image given with @option{-kernel}.  The memory,
+the return value and the return address are those of the guest
+function, but the registers it may clobber keep their values, and the
+call takes no time for @option{-icount}.  Calls that touch MMIO, ROM or
+unmapped memory, or watched addresses, run the guest code.  This is
+currently implemented for ARMv7-M targets.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -2842,6 +3118,24 @@ STEXI
 @item -semihosting
 @findex -semihosting
 Semihosting mode (ARM, M68K, Xtensa only).
+
+On ARM M-profile CPUs, @code{bkpt 0xab} is recognized when translated
+and makes the call directly, without going through the debug exception.
+SYS_EXIT_EXTENDED makes QEMU exit with the status code the guest gives,
+so that test firmware can report its result.
+ETEXI
+DEF("semihosting-console", HAS_ARG, QEMU_OPTION_semihosting_console,
+    "-semihosting-console chardev\n"
+    "                semihosting mode, console output to chardev\n",
+    QEMU_ARCH_ARM)
+STEXI
+@item -semihosting-console @var{chardev}
+@findex -semihosting-console
+Semihosting mode, with the output of SYS_WRITEC and SYS_WRITE0, and of
+SYS_WRITE to the console, sent to the character device with id
+@var{chardev} rather than to the standard output and error of QEMU
+(ARM only).  This output is buffered in either case and written out by
+the main loop.
 ETEXI
 DEF("old-param", 0, QEMU_OPTION_old_param,
     "-old-param      old param mode\n", QEMU_ARCH_ARM)
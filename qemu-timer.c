@@ -44,8 +44,17 @@
 #define QEMU_CLOCK_VIRTUAL  1
 #define QEMU_CLOCK_HOST     2
 
+/* The active timers of a clock are kept in a binary min-heap ordered by
+   expiry time, so that arming and deleting a timer is O(log n) and the
+   next deadline is always at the root.  Timers that expire at the same
+   time run in the order they were armed, as they did when the timers
+   were kept in a sorted list; each arm takes a sequence number for
+   that.  */
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    QEMUTimer **heap;
+    int heap_len;
+    int heap_size;
+    uint64_t seq;
 
     NotifierList reset_notifiers;
     int64_t last;
@@ -59,8 +68,10 @@ struct QEMUTimer {
     QEMUClock *clock;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;
+    int heap_index;             /* -1 when not pending */
     int scale;
+    int64_t slack;              /* in nanoseconds */
 };
 
 struct qemu_alarm_timer {
@@ -85,24 +96,103 @@ static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+static inline QEMUTimer *qemu_clock_first_timer(QEMUClock *clock)
+{
+    return clock->heap_len ? clock->heap[0] : NULL;
+}
+
+static inline bool qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time
+        || (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static inline void timer_heap_set(QEMUClock *clock, int i, QEMUTimer *ts)
+{
+    clock->heap[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->heap[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!qemu_timer_before(ts, clock->heap[parent])) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->heap[parent]);
+        i = parent;
+    }
+    timer_heap_set(clock, i, ts);
+}
+
+static void timer_heap_sift_down(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->heap[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= clock->heap_len) {
+            break;
+        }
+        if (child + 1 < clock->heap_len
+            && qemu_timer_before(clock->heap[child + 1], clock->heap[child])) {
+            child++;
+        }
+        if (!qemu_timer_before(clock->heap[child], ts)) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->heap[child]);
+        i = child;
+    }
+    timer_heap_set(clock, i, ts);
+}
+
+static void timer_heap_insert(QEMUClock *clock, QEMUTimer *ts)
+{
+    if (clock->heap_len == clock->heap_size) {
+        clock->heap_size = clock->heap_size ? clock->heap_size * 2 : 16;
+        clock->heap = g_renew(QEMUTimer *, clock->heap, clock->heap_size);
+    }
+    timer_heap_set(clock, clock->heap_len++, ts);
+    timer_heap_sift_up(clock, ts->heap_index);
+}
+
+static void timer_heap_remove(QEMUClock *clock, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last = clock->heap[--clock->heap_len];
+
+    ts->heap_index = -1;
+    if (last != ts) {
+        timer_heap_set(clock, i, last);
+        timer_heap_sift_up(clock, i);
+        timer_heap_sift_down(clock, last->heap_index);
+    }
+}
+
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta = INT64_MAX;
     int64_t rtdelta;
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
+    if (!use_icount && vm_clock->enabled && vm_clock->heap_len) {
+        delta = vm_clock->heap[0]->expire_time -
                      qemu_get_clock_ns(vm_clock);
     }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
+    if (host_clock->enabled && host_clock->heap_len) {
+        int64_t hdelta = host_clock->heap[0]->expire_time -
                  qemu_get_clock_ns(host_clock);
         if (hdelta < delta) {
             delta = hdelta;
         }
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
+    if (rt_clock->enabled && rt_clock->heap_len) {
+        rtdelta = (rt_clock->heap[0]->expire_time -
                  qemu_get_clock_ns(rt_clock));
         if (rtdelta < delta) {
             delta = rtdelta;
@@ -254,13 +344,13 @@ void qemu_clock_enable(QEMUClock *clock, bool enabled)
 
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return clock->heap_len != 0;
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    return (clock->heap_len &&
+            clock->heap[0]->expire_time < qemu_get_clock_ns(clock));
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
@@ -268,8 +358,8 @@ int64_t qemu_clock_deadline(QEMUClock *clock)
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    if (clock->heap_len) {
+        delta = clock->heap[0]->expire_time - qemu_get_clock_ns(clock);
     }
     if (delta < 0) {
         delta = 0;
@@ -286,6 +376,7 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->clock = clock;
     ts->cb = cb;
     ts->opaque = opaque;
+    ts->heap_index = -1;
     ts->scale = scale;
     return ts;
 }
@@ -298,48 +389,44 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (ts->heap_index >= 0) {
+        timer_heap_remove(ts->clock, ts);
     }
 }
 
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
-void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
+/* Let the timer fire up to SLACK nanoseconds late.  The expiry time is
+   rounded up to a multiple of the slack, so that timers with the same
+   slack whose deadlines fall in the same window expire together and the
+   host is woken once for all of them.  Under -icount the virtual clock
+   does not drive the host alarm, and its timers stay exact.  */
+void qemu_timer_set_slack_ns(QEMUTimer *ts, int64_t slack)
 {
-    QEMUTimer **pt, *t;
+    ts->slack = slack > 1 ? slack : 0;
+}
 
-    qemu_del_timer(ts);
+void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
+{
+    QEMUClock *clock = ts->clock;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
+    if (ts->slack && (clock != vm_clock || !use_icount)
+        && expire_time > 0 && expire_time <= INT64_MAX - ts->slack) {
+        expire_time = QEMU_ALIGN_UP(expire_time, ts->slack);
     }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = clock->seq++;
+    if (ts->heap_index >= 0) {
+        /* A pending timer moves in place: up if it now expires sooner,
+           otherwise down.  */
+        timer_heap_sift_up(clock, ts->heap_index);
+        timer_heap_sift_down(clock, ts->heap_index);
+    } else {
+        timer_heap_insert(clock, ts);
+    }
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
+    if (ts->heap_index == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -358,13 +445,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_index >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -382,13 +463,12 @@ void qemu_run_timers(QEMUClock *clock)
 
     current_time = qemu_get_clock_ns(clock);
     for(;;) {
-        ts = clock->active_timers;
+        ts = qemu_clock_first_timer(clock);
         if (!qemu_timer_expired_ns(ts, current_time)) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        clock->active_timers = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(clock, ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
@@ -450,6 +530,9 @@ void qemu_run_all_timers(void)
 
     /* vm time timers */
     qemu_run_timers(vm_clock);
+    /* Goes on to the next one if the CPUs are still idle and they
+     * fast-forward (see cpu_set_fast_forward).  */
+    qemu_clock_warp(vm_clock);
     qemu_run_timers(rt_clock);
     qemu_run_timers(host_clock);
 
@@ -439,6 +439,73 @@ Example:
                             "filename": "/tmp/physical-mem-dump" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-memory",
+        .args_type  = "ranges:q,physical:b?,cpu-index:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_memory,
+    },
+
+SQMP
+query-memory
+------------
+
+Read ranges of guest memory, base64 encoded.  The guest does not run in
+between, so the ranges are consistent with each other.
+
+Arguments:
+
+- "ranges": json-array of objects with:
+  - "addr": the starting address (json-int)
+  - "size": the memory size, in bytes, up to 16 MiB (json-int)
+- "physical": whether the addresses are physical (json-bool, optional,
+              default false)
+- "cpu-index": virtual CPU index translating virtual addresses (json-int,
+               optional, default 0)
+
+Example:
+
+-> { "execute": "query-memory",
+             "arguments": { "ranges": [ { "addr": 536870912, "size": 4 },
+                                        { "addr": 536871936, "size": 2 } ],
+                            "physical": true } }
+<- { "return": [ { "addr": 536870912, "data": "AQIDBA==" },
+                 { "addr": 536871936, "data": "AAA=" } ] }
+
+EQMP
+
+    {
+        .name       = "write-memory",
+        .args_type  = "ranges:q,physical:b?,cpu-index:i?",
+        .mhandler.cmd_new = qmp_marshal_input_write_memory,
+    },
+
+SQMP
+write-memory
+------------
+
+Write ranges of guest memory, base64 encoded, in order.  As with the
+debugger, ROM is written too.
+
+Arguments:
+
+- "ranges": json-array of objects with:
+  - "addr": the starting address (json-int)
+  - "data": the bytes, base64 encoded (json-string)
+- "physical": whether the addresses are physical (json-bool, optional,
+              default false)
+- "cpu-index": virtual CPU index translating virtual addresses (json-int,
+               optional, default 0)
+
+Example:
+
+-> { "execute": "write-memory",
+             "arguments": { "ranges": [ { "addr": 536870912,
+                                          "data": "AQIDBA==" } ],
+                            "physical": true } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -658,6 +725,30 @@ Example:
 -> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
 <- { "return": {} }
 
+EQMP
+    {
+        .name       = "migrate-set-encode-threads",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_encode_threads,
+    },
+
+SQMP
+migrate-set-encode-threads
+--------------------------
+
+Set the number of threads that help the migration thread to check pages
+for duplicates and XBZRLE encode them.  The pages are still sent in
+order.  The number takes effect from the next migration.
+
+Arguments:
+
+- "value": number of threads, 0 to 64 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-encode-threads", "arguments": { "value": 4 } }
+<- { "return": {} }
+
 EQMP
     {
         .name       = "query-migrate-cache-size",
@@ -1006,7 +1097,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1033,6 +1124,8 @@ Arguments:
 - "granularity": granularity of the dirty bitmap, in bytes (json-int, optional)
 - "buf_size": maximum amount of data in flight from source to target, in bytes
   (json-int, default 10M)
+- "max-in-flight": maximum number of read or write operations in flight at
+  the same time (json-int, default 16)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
   allocated in the topmost image, or "none" to only replicate new I/O
@@ -1047,6 +1140,11 @@ between 4096 and 65536, if the image format defines one.  If the format
 does not define a cluster size, the default value of the granularity
 is 65536.
 
+Adjacent dirty clusters are copied together, as long as they fit in the
+buffer.  Clusters that are not allocated anywhere in the backing chain of
+the source, or that read back as zeroes, are zeroed on the target instead
+of being written.
+
 
 Example:
 
@@ -1056,6 +1154,96 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-backup-tracking",
+        .args_type  = "device:B,file:s,granularity:i?",
+        .mhandler.cmd_new = qmp_marshal_input_block_backup_tracking,
+    },
+
+SQMP
+block-backup-tracking
+---------------------
+
+Start tracking the writes to a block device for incremental backups (see
+drive-backup).  The bitmap of the writes is saved to file when the device
+is closed, and taken over from there by the next block-backup-tracking;
+if there is none, everything is considered written.  The file is removed
+while tracking is on, so that the writes done before a crash are not
+forgotten.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "file": file where the bitmap is kept (json-string)
+- "granularity": granularity of the bitmap, in bytes, unless it is read
+  from file (json-int, optional, default 65536)
+
+Example:
+
+-> { "execute": "block-backup-tracking",
+     "arguments": { "device": "ide-hd0",
+                    "file": "/some/place/my-image.bitmap" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "device:B,target:s,format:s?,mode:s?,incremental:b?,"
+                      "speed:i?,max-in-flight:i?,"
+                      "on-source-error:s?,on-target-error:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start copying a block device to a new destination, in the background.
+target specifies the target of the new image. If the file exists, or if it
+is a device, it will be used as the destination.  If it does not exist, a
+new file without a backing file will be created.  format specifies the
+format of the backup image, default is to probe if mode='existing', else
+qcow2.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "target": name of the backup image file (json-string)
+- "format": format of the backup image (json-string, optional)
+- "mode": how an image file should be created into the target
+  file/device (NewImageMode, optional, default 'absolute-paths')
+- "incremental": copy only the clusters written since the last backup,
+  which requires block-backup-tracking (json-bool, optional, default
+  false: copy the clusters allocated in the backing chain)
+- "speed": maximum speed of the backup job, in bytes per second
+  (json-int, optional)
+- "max-in-flight": maximum number of read or write operations in flight at
+  the same time (json-int, optional, default 16)
+- "on-source-error": the action to take on an error on the source
+  (BlockdevOnError, default 'report')
+- "on-target-error": the action to take on an error on the target
+  (BlockdevOnError, default 'report')
+
+Writes made once the job started are tracked for the next backup.  If the
+job fails or is cancelled, the clusters it was to copy are tracked again.
+Clusters that read back as zeroes are zeroed on the target instead of
+being written.  query-block-jobs reports the bytes copied in "offset", out
+of "len", and the average rate in "throughput".
+
+An incremental backup only holds the clusters that changed; make the
+previous backup its backing file, as with "qemu-img rebase -u", to read it
+as a whole disk.
+
+Example:
+
+-> { "execute": "drive-backup", "arguments": { "device": "ide-hd0",
+                                               "target": "/some/place/backup-2",
+                                               "incremental": true } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1312,7 +1500,9 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1331,6 +1521,19 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total bytes allowed in a burst(json-int, optional)
+- "bps_rd_max":  read bytes allowed in a burst(json-int, optional)
+- "bps_wr_max":  write bytes allowed in a burst(json-int, optional)
+- "iops_max":  total I/O operations allowed in a burst(json-int, optional)
+- "iops_rd_max":  read I/O operations allowed in a burst(json-int, optional)
+- "iops_wr_max":  write I/O operations allowed in a burst(json-int, optional)
+- "group":  throttle group whose limits the device shares; "" leaves it
+            (json-string, optional)
+
+Each limit is a leaky bucket: a burst of up to its burst size (by default,
+a tenth of a second at the limit) goes at full speed, and the average stays
+at the limit.  The devices of a group share the buckets, and the limits last
+given to any of them.
 
 Example:
 
@@ -1607,6 +1810,32 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_events,
     },
 
+    {
+        .name       = "set-event-filter",
+        .args_type  = "events:q?",
+        .mhandler.cmd_new = qmp_marshal_input_set_event_filter,
+    },
+
+SQMP
+set-event-filter
+----------------
+
+Choose the events sent to this QMP connection.  Other connections are not
+affected, and a new connection receives every event again.
+
+Arguments:
+
+- "events": json-array of event names (json-string) to receive, as
+            returned by query-events (optional, all events if omitted)
+
+Example:
+
+-> { "execute": "set-event-filter",
+     "arguments": { "events": [ "STM32_GPIO_OUTPUT", "WATCHDOG" ] } }
+<- { "return": {} }
+
+EQMP
+
 SQMP
 query-chardev
 -------------
@@ -1681,6 +1910,16 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total bytes allowed in a burst (json-int, optional)
+         - "bps_rd_max": read bytes allowed in a burst (json-int, optional)
+         - "bps_wr_max": write bytes allowed in a burst (json-int, optional)
+         - "iops_max": total operations allowed in a burst
+                       (json-int, optional)
+         - "iops_rd_max": read operations allowed in a burst
+                          (json-int, optional)
+         - "iops_wr_max": write operations allowed in a burst
+                          (json-int, optional)
+         - "group": throttle group (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -2572,6 +2811,7 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "postcopy": start the destination before all the pages are sent
 
 Arguments:
 
@@ -2774,4 +3014,259 @@ Example:
 -> { "execute": "chardev-remove", "arguments": { "id" : "foo" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-stm32-clocks",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_stm32_clocks,
+    },
+
+SQMP
+query-stm32-clocks
+------------------
+
+Show the clock tree of an STM32 microcontroller.
+
+Return a json-array of json-objects, one for each clock, with the following
+information:
+
+- "name": clock name (json-string)
+- "input": name of the selected input clock (json-string, optional)
+- "input-freq": input frequency in Hz (json-int)
+- "output-freq": output frequency in Hz, 0 if disabled (json-int)
+- "multiplier": multiplier (json-int)
+- "divisor": divisor (json-int)
+- "enabled": true if the clock output is enabled (json-bool)
+- "max-freq": maximum output frequency in Hz (json-int, optional)
+- "outputs": clocks driven by this one (json-array of json-objects with the
+             name in "str")
+- "users": number of devices notified of changes (json-int)
+
+Example:
+
+-> { "execute": "query-stm32-clocks" }
+<- { "return": [
+       { "name": "HSI", "input-freq": 8000000, "output-freq": 8000000,
+         "multiplier": 1, "divisor": 1, "enabled": true,
+         "outputs": [ { "str": "HSI/2" }, { "str": "SYSCLK" }, ... ],
+         "users": 0 },
+       { "name": "HCLK", "input": "SYSCLK", "input-freq": 8000000,
+         "output-freq": 8000000, "multiplier": 1, "divisor": 1,
+         "enabled": true, "max-freq": 72000000,
+         "outputs": [ { "str": "PCLK1" }, { "str": "PCLK2" }, ... ],
+         "users": 1 },
+       ...
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "state-save",
+        .args_type  = "path:s?",
+        .mhandler.cmd_new = qmp_marshal_input_state_save,
+    },
+
+SQMP
+state-save
+----------
+
+Save the whole machine state, RAM included, to a file or to memory.  The
+drives are not saved.
+
+Arguments:
+
+- "path": file to write the state to, replaced as a whole (json-string,
+          optional).  Without it the state is kept in memory.
+
+Example:
+
+-> { "execute": "state-save", "arguments": { "path": "/dev/shm/ready" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "state-load",
+        .args_type  = "path:s?",
+        .mhandler.cmd_new = qmp_marshal_input_state_load,
+    },
+
+SQMP
+state-load
+----------
+
+Reset the machine and load a state saved with state-save.
+
+Arguments:
+
+- "path": file to load the state from (json-string, optional).  Without it
+          the state last kept in memory is loaded.
+
+Example:
+
+-> { "execute": "state-load" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "vm-fork",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_vm_fork,
+    },
+
+SQMP
+vm-fork
+-------
+
+Duplicate QEMU with fork() at a quiescent point.  The child replies first,
+on the same connection, and carries on from the current state with a
+copy-on-write copy of the guest RAM.  The parent replies once the child has
+exited, and is still in the state it forked in.
+
+Return a json-object with:
+
+- "pid": 0 in the child, the child's process ID in the parent (json-int)
+- "status": in the parent, the exit status of the child, or 128 plus the
+            signal that killed it (json-int, optional)
+
+Example:
+
+-> { "execute": "vm-fork" }
+<- { "return": { "pid": 0 } }
+   ... the test run, talking to the child ...
+-> { "execute": "quit" }
+<- { "return": {} }
+<- { "return": { "pid": 4242, "status": 0 } }
+
+EQMP
+
+    {
+        .name       = "fuzz-input",
+        .args_type  = "data:s",
+        .mhandler.cmd_new = qmp_marshal_input_fuzz_input,
+    },
+
+SQMP
+fuzz-input
+----------
+
+Give the device behind the character device of -fuzz more input.  It is
+handed over as fast as the device takes it, in virtual time.
+
+Arguments:
+
+- "data": the input, base64 encoded (json-string)
+
+Example:
+
+-> { "execute": "fuzz-input", "arguments": { "data": "AAECAw==" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mmio-stats-enable",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_mmio_stats_enable,
+    },
+
+SQMP
+mmio-stats-enable
+-----------------
+
+Start or stop counting accesses to MMIO regions.  Starting discards the
+counts gathered so far.
+
+Arguments:
+
+- "enable": true to start counting, false to stop (json-bool)
+
+Example:
+
+-> { "execute": "mmio-stats-enable", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-mmio-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_mmio_stats,
+    },
+
+SQMP
+query-mmio-stats
+----------------
+
+Show how often each MMIO region was accessed while counting was enabled
+with mmio-stats-enable.
+
+Return a json-array of json-objects, one for each region accessed, most
+accessed first, with the following information:
+
+- "name": region name (json-string)
+- "address": address of the region (json-int)
+- "size": size of the region (json-int)
+- "bucket-size": size of the ranges of offsets in "buckets"; 4 for regions
+                 of up to 1k, so that each is a 32-bit register (json-int)
+- "reads": number of reads (json-int)
+- "writes": number of writes (json-int)
+- "buckets": json-array of json-objects, one for each range accessed, most
+             accessed first:
+  - "offset": start of the range within the region (json-int)
+  - "reads": number of reads (json-int)
+  - "writes": number of writes (json-int)
+
+Example:
+
+-> { "execute": "query-mmio-stats" }
+<- { "return": [
+       { "name": "rcc", "address": 1073876992, "size": 4096,
+         "bucket-size": 16, "reads": 20480, "writes": 12,
+         "buckets": [ { "offset": 0, "reads": 20470, "writes": 2 },
+                      { "offset": 4, "reads": 10, "writes": 10 } ] },
+       ...
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-gpio-indicators",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_gpio_indicators,
+    },
+
+SQMP
+query-gpio-indicators
+---------------------
+
+Show the state of the gpio-indicator devices, such as the LEDs of the
+STM32 boards, with their latest transitions.
+
+Return a json-array of json-objects, one for each indicator, with the
+following information:
+
+- "name": indicator name (json-string)
+- "state": true if the line is high (json-bool)
+- "toggles": number of changes of the line since reset (json-int)
+- "transitions": json-array of json-objects, newest first, at most
+                 log-size of them:
+  - "time": virtual time of the change in ns (json-int)
+  - "state": true if the line went high (json-bool)
+
+Example:
+
+-> { "execute": "query-gpio-indicators" }
+<- { "return": [
+       { "name": "led", "state": true, "toggles": 3,
+         "transitions": [ { "time": 1500000000, "state": true },
+                          { "time": 1000000000, "state": false },
+                          { "time": 500000000, "state": true } ] }
+     ]
+   }
+
 EQMP
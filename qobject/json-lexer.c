@@ -276,6 +276,32 @@ void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
     lexer->x = lexer->y = 0;
 }
 
+/* Starts a new token.  The emitter takes a reference to the tokens it
+ * keeps; the others, such as whitespace, are emptied and used again.
+ */
+static void json_lexer_new_token(JSONLexer *lexer)
+{
+    if (lexer->token->base.refcnt > 1) {
+        QDECREF(lexer->token);
+        lexer->token = qstring_new();
+    } else {
+        lexer->token->length = 0;
+        lexer->token->string[0] = 0;
+    }
+}
+
+/* Do not let a single token grow to an arbitrarily large size,
+ * this is a security consideration.
+ */
+static void json_lexer_check_size(JSONLexer *lexer)
+{
+    if (lexer->token->length > MAX_TOKEN_SIZE) {
+        lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
+        json_lexer_new_token(lexer);
+        lexer->state = IN_START;
+    }
+}
+
 static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
 {
     int char_consumed, new_state;
@@ -303,8 +329,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
             lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
             /* fall through */
         case JSON_SKIP:
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            json_lexer_new_token(lexer);
             new_state = IN_START;
             break;
         case IN_ERROR:
@@ -322,8 +347,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
              * induce an error/flush state.
              */
             lexer->emit(lexer, lexer->token, JSON_ERROR, lexer->x, lexer->y);
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            json_lexer_new_token(lexer);
             new_state = IN_START;
             lexer->state = new_state;
             return 0;
@@ -333,26 +357,53 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         lexer->state = new_state;
     } while (!char_consumed && !flush);
 
-    /* Do not let a single token grow to an arbitrarily large size,
-     * this is a security consideration.
-     */
-    if (lexer->token->length > MAX_TOKEN_SIZE) {
-        lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
-        QDECREF(lexer->token);
-        lexer->token = qstring_new();
-        lexer->state = IN_START;
-    }
+    json_lexer_check_size(lexer);
 
     return 0;
 }
 
+/* Takes the characters at the start of buffer which leave the lexer in its
+ * state, such as the contents of a string or the digits of a number, at
+ * once, and returns how many there were.
+ */
+static size_t json_lexer_feed_run(JSONLexer *lexer, const char *buffer,
+                                  size_t size)
+{
+    const uint8_t *next = json_lexer[lexer->state];
+    size_t n;
+
+    /* Stop where json_lexer_feed_char() would have cut the token */
+    size = MIN(size, MAX_TOKEN_SIZE + 1 - lexer->token->length);
+
+    for (n = 0; n < size && next[(uint8_t)buffer[n]] == lexer->state; n++) {
+        lexer->x++;
+        if (buffer[n] == '\n') {
+            lexer->x = 0;
+            lexer->y++;
+        }
+    }
+
+    if (n > 0) {
+        qstring_append_len(lexer->token, buffer, n);
+        json_lexer_check_size(lexer);
+    }
+
+    return n;
+}
+
 int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
 {
-    size_t i;
+    size_t i, run;
 
     for (i = 0; i < size; i++) {
         int err;
 
+        run = json_lexer_feed_run(lexer, buffer + i, size - i);
+        if (run > 0) {
+            i += run - 1;
+            continue;
+        }
+
         err = json_lexer_feed_char(lexer, buffer[i], false);
         if (err < 0) {
             return err;
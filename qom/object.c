@@ -426,10 +426,39 @@ Object *object_dynamic_cast(Object *obj, const char *typename)
     return NULL;
 }
 
+/* Looks typename up in the cast cache of class, by address. */
+static bool object_class_cast_cached(ObjectClass *class, const char *typename)
+{
+    int i;
+
+    for (i = 0; i < OBJECT_CLASS_CAST_CACHE; i++) {
+        if (class->cast_cache[i] == typename) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void object_class_cast_cache_add(ObjectClass *class,
+                                        const char *typename)
+{
+    int i;
+
+    for (i = OBJECT_CLASS_CAST_CACHE - 1; i > 0; i--) {
+        class->cast_cache[i] = class->cast_cache[i - 1];
+    }
+    class->cast_cache[0] = typename;
+}
+
 Object *object_dynamic_cast_assert(Object *obj, const char *typename)
 {
+#ifdef CONFIG_QOM_CAST_DEBUG
     Object *inst;
 
+    if (obj && object_class_cast_cached(obj->class, typename)) {
+        return obj;
+    }
+
     inst = object_dynamic_cast(obj, typename);
 
     if (!inst && obj) {
@@ -438,7 +467,14 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename)
         abort();
     }
 
+    if (inst) {
+        object_class_cast_cache_add(obj->class, typename);
+    }
+
     return inst;
+#else
+    return obj;
+#endif
 }
 
 ObjectClass *object_class_dynamic_cast(ObjectClass *class,
@@ -475,7 +511,15 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
 ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
                                               const char *typename)
 {
-    ObjectClass *ret = object_class_dynamic_cast(class, typename);
+    ObjectClass *ret;
+
+    /* A cast to an interface gives another class, so only casts which gave
+     * class itself are cached. */
+    if (object_class_cast_cached(class, typename)) {
+        return class;
+    }
+
+    ret = object_class_dynamic_cast(class, typename);
 
     if (!ret) {
         fprintf(stderr, "Object %p is not an instance of type %s\n",
@@ -483,6 +527,10 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
         abort();
     }
 
+    if (ret == class) {
+        object_class_cast_cache_add(class, typename);
+    }
+
     return ret;
 }
 
@@ -117,8 +117,46 @@ static bool qtest_opened;
  * where NUM is an IRQ number.  For the PC, interrupts can be intercepted
  * simply with "irq_intercept_in ioapic" (note that IRQ0 comes out with
  * NUM=0 even though it is remapped to GSI 2).
+ *
+ * Batches:
+ *
+ *  > batch LEN
+ *  > ...LEN bytes of operations...
+ *  < OK LEN
+ *  < ...LEN bytes of results...
+ *
+ * Runs a vector of operations in binary form and sends all their results
+ * in a single reply, saving a round trip and the text formatting for
+ * every register access.  Each operation is an opcode byte followed by
+ * its operands; all integers are little endian:
+ *
+ *  0x01 read       LEN (4), ADDR (8)        result: LEN bytes of memory
+ *  0x02 write      LEN (4), ADDR (8), DATA (LEN bytes)
+ *  0x03 in         SIZE (1), ADDR (2)       result: VALUE (4)
+ *  0x04 out        SIZE (1), ADDR (2), VALUE (4)
+ *  0x05 clock_step NS (8), or -1 for the next deadline
+ *                                            result: clock value (8)
+ *  0x06 clock_set  NS (8)                   result: clock value (8)
+ *
+ * SIZE is 1, 2 or 4.  The results are in the order of the operations.
+ * IRQ messages raised by the batch come before the reply.  If an
+ * operation is malformed, the ones before it have been run and the reply
+ * is "FAIL malformed batch at offset OFFSET".
  */
 
+enum {
+    QTEST_BATCH_READ = 0x01,
+    QTEST_BATCH_WRITE = 0x02,
+    QTEST_BATCH_IN = 0x03,
+    QTEST_BATCH_OUT = 0x04,
+    QTEST_BATCH_CLOCK_STEP = 0x05,
+    QTEST_BATCH_CLOCK_SET = 0x06,
+};
+
+/* Bytes of batch operations that follow the current "batch" line.  */
+static size_t batch_len;
+static bool batch_pending;
+
 static int hex2nib(char ch)
 {
     if (ch >= '0' && ch <= '9') {
@@ -344,21 +382,142 @@ static void qtest_process_command(CharDriverState *chr, gchar **words)
         qtest_clock_warp(ns);
         qtest_send_prefix(chr);
         qtest_send(chr, "OK %"PRIi64"\n", (int64_t)qemu_get_clock_ns(vm_clock));
+    } else if (strcmp(words[0], "batch") == 0) {
+        g_assert(words[1]);
+        batch_len = strtoull(words[1], NULL, 0);
+        batch_pending = true;
     } else {
         qtest_send_prefix(chr);
         qtest_send(chr, "FAIL Unknown command `%s'\n", words[0]);
     }
 }
 
+static int64_t qtest_batch_clock(int64_t ns)
+{
+    qtest_clock_warp(ns);
+    return qemu_get_clock_ns(vm_clock);
+}
+
+static void qtest_process_batch(CharDriverState *chr, const uint8_t *ops,
+                                size_t len)
+{
+    GByteArray *res = g_byte_array_new();
+    const uint8_t *p = ops, *end = ops + len;
+    uint8_t buf[8];
+
+    while (p < end) {
+        uint32_t size, value;
+        uint64_t addr;
+        int64_t ns;
+
+        switch (*p) {
+        case QTEST_BATCH_READ:
+        case QTEST_BATCH_WRITE:
+            if (end - p < 13) {
+                goto malformed;
+            }
+            size = ldl_le_p(p + 1);
+            addr = ldq_le_p(p + 5);
+            if (*p == QTEST_BATCH_READ) {
+                p += 13;
+                g_byte_array_set_size(res, res->len + size);
+                cpu_physical_memory_read(addr, res->data + res->len - size,
+                                         size);
+            } else {
+                if (end - p - 13 < size) {
+                    goto malformed;
+                }
+                cpu_physical_memory_write(addr, p + 13, size);
+                p += 13 + size;
+            }
+            break;
+        case QTEST_BATCH_IN:
+        case QTEST_BATCH_OUT:
+            if (end - p < (*p == QTEST_BATCH_IN ? 4 : 8)) {
+                goto malformed;
+            }
+            size = p[1];
+            addr = lduw_le_p(p + 2);
+            if (size != 1 && size != 2 && size != 4) {
+                goto malformed;
+            }
+            if (*p == QTEST_BATCH_IN) {
+                p += 4;
+                value = size == 1 ? cpu_inb(addr)
+                      : size == 2 ? cpu_inw(addr) : cpu_inl(addr);
+                stl_le_p(buf, value);
+                g_byte_array_append(res, buf, 4);
+            } else {
+                value = ldl_le_p(p + 4);
+                p += 8;
+                if (size == 1) {
+                    cpu_outb(addr, value);
+                } else if (size == 2) {
+                    cpu_outw(addr, value);
+                } else {
+                    cpu_outl(addr, value);
+                }
+            }
+            break;
+        case QTEST_BATCH_CLOCK_STEP:
+        case QTEST_BATCH_CLOCK_SET:
+            if (end - p < 9) {
+                goto malformed;
+            }
+            ns = ldq_le_p(p + 1);
+            if (*p == QTEST_BATCH_CLOCK_SET) {
+                ns = qtest_batch_clock(ns);
+            } else if (ns == -1) {
+                ns = qtest_batch_clock(qemu_get_clock_ns(vm_clock) +
+                                       qemu_clock_deadline(vm_clock));
+            } else {
+                ns = qtest_batch_clock(qemu_get_clock_ns(vm_clock) + ns);
+            }
+            p += 9;
+            stq_le_p(buf, ns);
+            g_byte_array_append(res, buf, 8);
+            break;
+        default:
+            goto malformed;
+        }
+    }
+
+    qtest_send_prefix(chr);
+    qtest_send(chr, "OK %u\n", res->len);
+    qemu_chr_fe_write(chr, res->data, res->len);
+    g_byte_array_free(res, TRUE);
+    return;
+
+malformed:
+    qtest_send_prefix(chr);
+    qtest_send(chr, "FAIL malformed batch at offset %zu\n", (size_t)(p - ops));
+    g_byte_array_free(res, TRUE);
+}
+
 static void qtest_process_inbuf(CharDriverState *chr, GString *inbuf)
 {
     char *end;
 
-    while ((end = strchr(inbuf->str, '\n')) != NULL) {
+    for (;;) {
         size_t offset;
         GString *cmd;
         gchar **words;
 
+        /* The operations of a batch are binary and follow its line.  */
+        if (batch_pending) {
+            if (inbuf->len < batch_len) {
+                break;
+            }
+            qtest_process_batch(chr, (uint8_t *)inbuf->str, batch_len);
+            g_string_erase(inbuf, 0, batch_len);
+            batch_pending = false;
+            continue;
+        }
+
+        end = memchr(inbuf->str, '\n', inbuf->len);
+        if (!end) {
+            break;
+        }
         offset = end - inbuf->str;
 
         cmd = g_string_new_len(inbuf->str, offset);
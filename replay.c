@@ -0,0 +1,311 @@
+/*
+ * Record and replay of device input
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "sysemu/replay.h"
+#include "sysemu/sysemu.h"
+#include "qemu/timer.h"
+#include "char/char.h"
+
+/**
+ * Journal format
+ *
+ * With a fixed -icount shift the guest runs deterministically, and the
+ * only thing that can make two runs differ is input from the outside
+ * world.  For the microcontroller boards that input arrives through
+ * character devices: USART receive data, GPIO levels from the pin bus,
+ * sample streams for the ADC and the USB host link.  Recording writes
+ * every chunk of input those devices are given, stamped with the
+ * virtual clock.  Playing ignores the live backends and hands the same
+ * chunks to the same devices at the same virtual time.
+ *
+ * The journal is a 4 byte magic and a version byte, followed by records
+ * made of a type byte and unsigned LEB128 fields:
+ *
+ *  CHAR_DEFINE  id, label length, label
+ *      written when a device puts its character device under replay
+ *      control.  IDs are handed out in registration order, which only
+ *      depends on the machine configuration.
+ *
+ *  CHAR_DATA    time delta, id, length, data
+ *      input for character device ID.  The delta is in vm_clock
+ *      nanoseconds since the previous CHAR_DATA record.
+ */
+
+#define REPLAY_MAGIC            "QRPL"
+#define REPLAY_VERSION          1
+
+enum {
+    REPLAY_CHAR_DEFINE = 1,
+    REPLAY_CHAR_DATA = 2,
+};
+
+ReplayMode replay_mode;
+
+static const char *replay_filename;
+static FILE *replay_file;
+static CharDriverState **replay_chars;
+static unsigned replay_char_count;
+static int64_t replay_time;
+
+/* The next record to play, read ahead of its time.  */
+static QEMUTimer *replay_timer;
+static bool replay_pending;
+static unsigned replay_next_id;
+static uint8_t *replay_buf;
+static uint64_t replay_buf_len, replay_buf_size;
+
+static void GCC_FMT_ATTR(1, 2) replay_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "qemu: replay %s: ", replay_filename);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static void replay_put_uleb(uint64_t val)
+{
+    do {
+        uint8_t byte = val & 0x7f;
+
+        val >>= 7;
+        putc(val ? byte | 0x80 : byte, replay_file);
+    } while (val);
+}
+
+static bool replay_get_uleb(uint64_t *val)
+{
+    uint64_t result = 0;
+    int shift = 0;
+    int c;
+
+    do {
+        c = getc(replay_file);
+        if (c == EOF || shift > 63) {
+            return false;
+        }
+        result |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    *val = result;
+    return true;
+}
+
+static void replay_get_bytes(uint8_t *buf, uint64_t len)
+{
+    if (fread(buf, 1, len, replay_file) != len) {
+        replay_error("truncated record");
+    }
+}
+
+static int replay_char_id(CharDriverState *chr)
+{
+    unsigned i;
+
+    for (i = 0; i < replay_char_count; i++) {
+        if (replay_chars[i] == chr) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Read the next CHAR_DATA record.  Returns false at the end of the
+ * journal.  */
+static bool replay_read_data(void)
+{
+    uint64_t delta, id;
+    int type;
+
+    type = getc(replay_file);
+    if (type == EOF) {
+        return false;
+    }
+    if (type == REPLAY_CHAR_DEFINE) {
+        replay_error("recorded with more character devices than this "
+                     "machine has");
+    }
+    if (type != REPLAY_CHAR_DATA
+        || !replay_get_uleb(&delta)
+        || !replay_get_uleb(&id)
+        || !replay_get_uleb(&replay_buf_len)) {
+        replay_error("malformed record");
+    }
+    if (id >= replay_char_count) {
+        replay_error("input for unknown character device %" PRIu64, id);
+    }
+    if (replay_buf_len > replay_buf_size) {
+        replay_buf_size = replay_buf_len;
+        replay_buf = g_realloc(replay_buf, replay_buf_size);
+    }
+    replay_get_bytes(replay_buf, replay_buf_len);
+
+    replay_time += delta;
+    replay_next_id = id;
+    return true;
+}
+
+static void replay_timer_expire(void *opaque)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    CharDriverState *chr;
+
+    while (replay_pending && replay_time <= now) {
+        chr = replay_chars[replay_next_id];
+        if (chr->chr_read && replay_buf_len) {
+            chr->chr_read(chr->handler_opaque, replay_buf, replay_buf_len);
+        }
+        replay_pending = replay_read_data();
+    }
+    if (replay_pending) {
+        qemu_mod_timer(replay_timer, replay_time);
+    }
+}
+
+static void replay_machine_init_done(Notifier *notifier, void *data)
+{
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        replay_timer = qemu_new_timer_ns(vm_clock, replay_timer_expire, NULL);
+        replay_pending = replay_read_data();
+        if (replay_pending) {
+            qemu_mod_timer(replay_timer, replay_time);
+        }
+    }
+}
+
+static Notifier replay_init_done_notifier = {
+    .notify = replay_machine_init_done,
+};
+
+static void replay_finish(void)
+{
+    if (replay_file) {
+        fclose(replay_file);
+        replay_file = NULL;
+    }
+}
+
+void replay_register_char_driver(CharDriverState *chr)
+{
+    uint64_t id, len;
+    char *label;
+    size_t label_len;
+
+    if (replay_mode == REPLAY_MODE_NONE || !chr || replay_char_id(chr) >= 0) {
+        return;
+    }
+
+    replay_chars = g_renew(CharDriverState *, replay_chars,
+                           replay_char_count + 1);
+    replay_chars[replay_char_count] = chr;
+    label_len = chr->label ? strlen(chr->label) : 0;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        putc(REPLAY_CHAR_DEFINE, replay_file);
+        replay_put_uleb(replay_char_count);
+        replay_put_uleb(label_len);
+        fwrite(chr->label, 1, label_len, replay_file);
+        fflush(replay_file);
+    } else {
+        if (getc(replay_file) != REPLAY_CHAR_DEFINE
+            || !replay_get_uleb(&id) || id != replay_char_count
+            || !replay_get_uleb(&len)) {
+            replay_error("recorded with fewer character devices than this "
+                         "machine has");
+        }
+        label = g_malloc0(len + 1);
+        replay_get_bytes((uint8_t *)label, len);
+        if (len != label_len || memcmp(label, chr->label, len) != 0) {
+            fprintf(stderr, "qemu: replay %s: character device %" PRIu64
+                    " was '%s' when recording, now '%s'\n",
+                    replay_filename, id, label, chr->label);
+        }
+        g_free(label);
+    }
+
+    replay_char_count++;
+}
+
+bool replay_char_write(CharDriverState *chr, const uint8_t *buf, int len)
+{
+    int64_t now;
+    int id;
+
+    id = replay_char_id(chr);
+    if (id < 0) {
+        return false;
+    }
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        return true;
+    }
+
+    now = qemu_get_clock_ns(vm_clock);
+    putc(REPLAY_CHAR_DATA, replay_file);
+    replay_put_uleb(now - replay_time);
+    replay_put_uleb(id);
+    replay_put_uleb(len);
+    fwrite(buf, 1, len, replay_file);
+    /* The session being recorded is usually a failing one, so do not
+       lose its tail if it ends in abort().  */
+    fflush(replay_file);
+    replay_time = now;
+    return false;
+}
+
+void replay_configure(const char *option)
+{
+    char header[sizeof(REPLAY_MAGIC) - 1];
+    const char *file;
+
+    if (!option) {
+        return;
+    }
+
+    if (strstart(option, "record=", &file)) {
+        replay_mode = REPLAY_MODE_RECORD;
+    } else if (strstart(option, "play=", &file)) {
+        replay_mode = REPLAY_MODE_PLAY;
+    } else {
+        fprintf(stderr, "qemu: -replay: expected record=FILE or play=FILE\n");
+        exit(1);
+    }
+    replay_filename = file;
+
+    /* With icount auto the clock rate follows the host, so inputs could
+       not be put back at the same instruction.  */
+    if (use_icount != 1) {
+        fprintf(stderr, "qemu: -replay requires -icount with a fixed "
+                "shift\n");
+        exit(1);
+    }
+
+    replay_file = fopen(file, replay_mode == REPLAY_MODE_RECORD ? "wb" : "rb");
+    if (!replay_file) {
+        replay_error("%s", strerror(errno));
+    }
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        fwrite(REPLAY_MAGIC, 1, sizeof(header), replay_file);
+        putc(REPLAY_VERSION, replay_file);
+        fflush(replay_file);
+    } else {
+        if (fread(header, 1, sizeof(header), replay_file) != sizeof(header)
+            || memcmp(header, REPLAY_MAGIC, sizeof(header)) != 0) {
+            replay_error("not a replay journal");
+        }
+        if (getc(replay_file) != REPLAY_VERSION) {
+            replay_error("unsupported journal version");
+        }
+    }
+
+    atexit(replay_finish);
+    qemu_add_machine_init_done_notifier(&replay_init_done_notifier);
+}
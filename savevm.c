@@ -425,6 +425,43 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/* A file in memory, that outlives the QEMUFile it is written through.  */
+typedef struct QEMUFileMem {
+    uint8_t *data;
+    size_t size;
+} QEMUFileMem;
+
+static int mem_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileMem *m = opaque;
+
+    m->data = g_realloc(m->data, m->size + size);
+    memcpy(m->data + m->size, buf, size);
+    m->size += size;
+    return size;
+}
+
+static int mem_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileMem *m = opaque;
+
+    if (pos >= m->size) {
+        return 0;
+    }
+    size = MIN(size, m->size - pos);
+    memcpy(buf, m->data + pos, size);
+    return size;
+}
+
+static const QEMUFileOps mem_read_ops = {
+    .get_buffer = mem_get_buffer,
+};
+
+static const QEMUFileOps mem_write_ops = {
+    .put_buffer = mem_put_buffer,
+};
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -453,7 +490,7 @@ static void qemu_file_set_error(QEMUFile *f, int ret)
 /** Flushes QEMUFile buffer
  *
  */
-static int qemu_fflush(QEMUFile *f)
+int qemu_fflush(QEMUFile *f)
 {
     int ret = 0;
 
@@ -569,6 +606,38 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    int ret;
+
+    if (!f->ops->put_buffer_async) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    /* what was put before goes first */
+    f->is_write = 1;
+    ret = qemu_fflush(f);
+    if (ret >= 0) {
+        ret = f->ops->put_buffer_async(f->opaque, buf, f->buf_offset, size);
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+    f->buf_offset += size;
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (f->last_error) {
@@ -1566,6 +1635,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY             0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1683,13 +1753,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1710,6 +1778,20 @@ int qemu_savevm_state_complete(QEMUFile *f)
             return ret;
         }
     }
+    return 0;
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f);
+    if (ret < 0) {
+        return ret;
+    }
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1802,15 +1884,11 @@ out:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+/* Writes the sections of everything but RAM.  */
+static void qemu_save_device_sections(QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1835,12 +1913,53 @@ static int qemu_save_device_state(QEMUFile *f)
 
         vmstate_save(f, se);
     }
+}
+
+static int qemu_save_device_state(QEMUFile *f)
+{
+    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
+    cpu_synchronize_all_states();
+    qemu_save_device_sections(f);
     qemu_put_byte(f, QEMU_VM_EOF);
 
     return qemu_file_get_error(f);
 }
 
+/* Like qemu_savevm_state_complete(), with RAM in the postcopy phase: the
+ * destination has to be able to request pages before its devices are
+ * loaded, since loading them may touch guest memory.  The devices go in
+ * one QEMU_VM_POSTCOPY section, a savevm stream of their own that the
+ * destination loads with qemu_loadvm_postcopy_devices().
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    QEMUFileMem m = { NULL, 0 };
+    QEMUFile *mf;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    mf = qemu_fopen_ops(&m, &mem_write_ops);
+    qemu_save_device_state(mf);
+    ret = qemu_fclose(mf);
+    if (ret >= 0) {
+        qemu_put_byte(f, QEMU_VM_POSTCOPY);
+        qemu_put_be32(f, m.size);
+        qemu_put_buffer(f, m.data, m.size);
+        qemu_put_byte(f, QEMU_VM_EOF);
+        ret = qemu_file_get_error(f);
+    }
+    g_free(m.data);
+    return ret;
+}
+
 static SaveStateEntry *find_se(const char *idstr, int instance_id)
 {
     SaveStateEntry *se;
@@ -1941,6 +2060,9 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
+/* The devices of a postcopy migration, see qemu_savevm_state_postcopy() */
+static QEMUFileMem postcopy_devices;
+
 int qemu_loadvm_state(QEMUFile *f)
 {
     QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
@@ -2036,6 +2158,12 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
             break;
+        case QEMU_VM_POSTCOPY:
+            g_free(postcopy_devices.data);
+            postcopy_devices.size = qemu_get_be32(f);
+            postcopy_devices.data = g_malloc(postcopy_devices.size);
+            qemu_get_buffer(f, postcopy_devices.data, postcopy_devices.size);
+            break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
@@ -2060,6 +2188,24 @@ out:
     return ret;
 }
 
+/* Loads the devices that came with the switch to postcopy, if they did.  */
+int qemu_loadvm_postcopy_devices(void)
+{
+    QEMUFile *mf;
+    int ret;
+
+    if (!postcopy_devices.data) {
+        return 0;
+    }
+    mf = qemu_fopen_ops(&postcopy_devices, &mem_read_ops);
+    ret = qemu_loadvm_state(mf);
+    qemu_fclose(mf);
+    g_free(postcopy_devices.data);
+    postcopy_devices.data = NULL;
+    postcopy_devices.size = 0;
+    return ret;
+}
+
 static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
                               const char *name)
 {
@@ -2109,6 +2255,153 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/*
+ * Live snapshots
+ *
+ * "savevm -l" only stops the VM to save the devices, in memory, and to
+ * snapshot the disks other than the one the VM state goes to.  RAM goes
+ * to that one while the guest runs, as it was at that point (see
+ * ram_snapshot_cow()), then the devices, and its snapshot is taken last.
+ * Nothing may write to it meanwhile, so it must not be the guest's.
+ */
+
+/* Each slice of the save takes the iothread lock for that long, and there
+   is as long again for the guest between them.  */
+#define LIVE_SNAPSHOT_SLICE_MS 10
+
+typedef struct LiveSnapshot {
+    BlockDriverState *bs;
+    QEMUFile *f;
+    QEMUSnapshotInfo sn;
+    SaveStateEntry *ram;
+    QEMUFileMem devices;
+    QEMUTimer *timer;
+    Error *blocker;
+} LiveSnapshot;
+
+static LiveSnapshot *live_snapshot;
+
+static void savevm_live_end(LiveSnapshot *ls, int ret)
+{
+    BlockDriverState *bs1;
+
+    ram_snapshot_end();
+    if (ls->f) {
+        qemu_fclose(ls->f);
+    }
+    if (ret < 0) {
+        error_report("Live snapshot '%s' failed: %s", ls->sn.name,
+                     strerror(-ret));
+        bs1 = NULL;
+        while ((bs1 = bdrv_next(bs1))) {
+            if (bs1 != ls->bs && bdrv_can_snapshot(bs1)) {
+                bdrv_snapshot_delete(bs1, ls->sn.name);
+            }
+        }
+    }
+    if (ls->timer) {
+        qemu_del_timer(ls->timer);
+        qemu_free_timer(ls->timer);
+    }
+    if (ls->blocker) {
+        migrate_del_blocker(ls->blocker);
+        error_free(ls->blocker);
+    }
+    g_free(ls->devices.data);
+    g_free(ls);
+    live_snapshot = NULL;
+}
+
+static void savevm_live_slice(void *opaque)
+{
+    LiveSnapshot *ls = opaque;
+    uint64_t vm_state_size = 0;
+    int ret;
+
+    qemu_put_byte(ls->f, QEMU_VM_SECTION_PART);
+    qemu_put_be32(ls->f, ls->ram->section_id);
+    ret = ram_snapshot_save(ls->f, LIVE_SNAPSHOT_SLICE_MS * SCALE_MS);
+    if (ret == 0) {
+        qemu_mod_timer(ls->timer, qemu_get_clock_ms(rt_clock) +
+                       LIVE_SNAPSHOT_SLICE_MS);
+        return;
+    }
+
+    if (ret > 0) {
+        qemu_put_buffer(ls->f, ls->devices.data, ls->devices.size);
+        qemu_put_byte(ls->f, QEMU_VM_EOF);
+        vm_state_size = qemu_ftell(ls->f);
+        ret = qemu_fclose(ls->f);
+        ls->f = NULL;
+    }
+    if (ret >= 0) {
+        ls->sn.vm_state_size = vm_state_size;
+        ret = bdrv_snapshot_create(ls->bs, &ls->sn);
+    }
+    savevm_live_end(ls, ret);
+}
+
+/* Starts a live snapshot to BS.  Called with the VM stopped.  */
+static int savevm_live_start(BlockDriverState *bs, QEMUSnapshotInfo *sn)
+{
+    LiveSnapshot *ls;
+    BlockDriverState *bs1;
+    QEMUFile *mf;
+    int len, ret;
+
+    ls = g_new0(LiveSnapshot, 1);
+    ls->bs = bs;
+    ls->sn = *sn;
+    ls->ram = find_se("ram", 0);
+    ls->f = qemu_fopen_bdrv(bs, 1);
+    if (!ls->ram || !ls->f) {
+        savevm_live_end(ls, -EIO);
+        return -EIO;
+    }
+    live_snapshot = ls;
+
+    qemu_put_be32(ls->f, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(ls->f, QEMU_VM_FILE_VERSION);
+    qemu_put_byte(ls->f, QEMU_VM_SECTION_START);
+    qemu_put_be32(ls->f, ls->ram->section_id);
+    len = strlen(ls->ram->idstr);
+    qemu_put_byte(ls->f, len);
+    qemu_put_buffer(ls->f, (uint8_t *)ls->ram->idstr, len);
+    qemu_put_be32(ls->f, ls->ram->instance_id);
+    qemu_put_be32(ls->f, ls->ram->version_id);
+    ret = ram_snapshot_begin(ls->f);
+    if (ret < 0) {
+        savevm_live_end(ls, ret);
+        return ret;
+    }
+
+    cpu_synchronize_all_states();
+    mf = qemu_fopen_ops(&ls->devices, &mem_write_ops);
+    qemu_save_device_sections(mf);
+    ret = qemu_fclose(mf);
+    if (ret < 0) {
+        savevm_live_end(ls, ret);
+        return ret;
+    }
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bs1 != bs && bdrv_can_snapshot(bs1)) {
+            ls->sn.vm_state_size = 0;
+            if (bdrv_snapshot_create(bs1, &ls->sn) < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+            }
+        }
+    }
+
+    error_setg(&ls->blocker, "A live snapshot is in progress");
+    migrate_add_blocker(ls->blocker);
+    ls->timer = qemu_new_timer_ms(rt_clock, savevm_live_slice, ls);
+    qemu_mod_timer(ls->timer, qemu_get_clock_ms(rt_clock));
+    return 0;
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
@@ -2120,6 +2413,20 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     qemu_timeval tv;
     struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool live = qdict_get_try_bool(qdict, "live", 0);
+
+    if (live_snapshot) {
+        monitor_printf(mon, "A live snapshot is in progress\n");
+        return;
+    }
+    if (live && !tcg_enabled()) {
+        monitor_printf(mon, "Live snapshots need TCG\n");
+        return;
+    }
+    if (live && migration_is_active(migrate_get_current())) {
+        monitor_printf(mon, "A migration is in progress\n");
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2141,6 +2448,11 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "No block device can accept snapshots\n");
         return;
     }
+    if (live && bdrv_get_attached_dev(bs) && !bdrv_is_read_only(bs)) {
+        monitor_printf(mon, "Device '%s', that the VM state goes to, is in "
+                       "use by the guest\n", bdrv_get_device_name(bs));
+        return;
+    }
 
     saved_vm_running = runstate_is_running();
     vm_stop(RUN_STATE_SAVE_VM);
@@ -2172,6 +2484,14 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         goto the_end;
     }
 
+    if (live) {
+        ret = savevm_live_start(bs, sn);
+        if (ret < 0) {
+            monitor_printf(mon, "Error %d while starting the snapshot\n", ret);
+        }
+        goto the_end;
+    }
+
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
@@ -2238,6 +2558,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (live_snapshot) {
+        error_report("A live snapshot is in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2311,6 +2636,240 @@ int load_vmstate(const char *name)
     return 0;
 }
 
+/* Machine states kept in memory rather than in a snapshot of a drive.  The
+ * RAM of a microcontroller is small enough for a full state to be saved
+ * in a few milliseconds, and a state file on tmpfs is mapped by every QEMU
+ * that loads it, instead of being read by each of them.
+ */
+typedef struct QEMUFileBuffer {
+    const uint8_t *data;
+    size_t len;
+} QEMUFileBuffer;
+
+/* The last state saved by state-save without a path */
+static GByteArray *saved_state;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    g_byte_array_append(opaque, buf, size);
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                             int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    if (pos >= b->len) {
+        return 0;
+    }
+    size = MIN(size, b->len - pos);
+    memcpy(buf, b->data + pos, size);
+    return size;
+}
+
+static const QEMUFileOps buffer_read_ops = {
+    .get_buffer = buffer_get_buffer,
+};
+
+static const QEMUFileOps buffer_write_ops = {
+    .put_buffer = buffer_put_buffer,
+};
+
+static int load_vmstate_buffer(const uint8_t *data, size_t len)
+{
+    QEMUFileBuffer b = { .data = data, .len = len };
+    QEMUFile *f;
+    int ret;
+
+    bdrv_drain_all();
+
+    f = qemu_fopen_ops(&b, &buffer_read_ops);
+    qemu_system_reset(VMRESET_SILENT);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+
+    return ret;
+}
+
+int load_vmstate_shm(const char *path)
+{
+    GMappedFile *file;
+    GError *err = NULL;
+    int ret;
+
+    file = g_mapped_file_new(path, FALSE, &err);
+    if (!file) {
+        error_report("Could not open VM state file: %s", err->message);
+        g_error_free(err);
+        return -EINVAL;
+    }
+
+    ret = load_vmstate_buffer((uint8_t *)g_mapped_file_get_contents(file),
+                              g_mapped_file_get_length(file));
+    g_mapped_file_unref(file);
+    if (ret < 0) {
+        error_report("Error %d while loading VM state from '%s'", ret, path);
+    }
+    return ret;
+}
+
+void qmp_state_save(bool has_path, const char *path, Error **errp)
+{
+    GByteArray *state;
+    GError *err = NULL;
+    QEMUFile *f;
+    int saved_vm_running;
+    int ret;
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    state = g_byte_array_new();
+    f = qemu_fopen_ops(state, &buffer_write_ops);
+    ret = qemu_savevm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        g_byte_array_free(state, TRUE);
+        goto the_end;
+    }
+
+    if (!has_path) {
+        if (saved_state) {
+            g_byte_array_free(saved_state, TRUE);
+        }
+        saved_state = state;
+        goto the_end;
+    }
+
+    /* The file is replaced as a whole, so that a QEMU starting up with
+     * -loadstate-shm never sees half of it. */
+    if (!g_file_set_contents(path, (gchar *)state->data, state->len, &err)) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, path);
+        g_error_free(err);
+    }
+    g_byte_array_free(state, TRUE);
+
+ the_end:
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+void qmp_state_load(bool has_path, const char *path, Error **errp)
+{
+    int saved_vm_running;
+    int ret;
+
+    if (!has_path && !saved_state) {
+        error_setg(errp, "No machine state has been saved");
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    if (has_path) {
+        ret = load_vmstate_shm(path);
+    } else {
+        ret = load_vmstate_buffer(saved_state->data, saved_state->len);
+    }
+    if (ret < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+/* State that system_reset goes back to with -machine fast-reset=on: a copy
+ * of every RAM block and the device state, taken once the machine is first
+ * reset.  Only the pages the guest changed since are copied back, so code
+ * translated from the others, flash in particular, is not translated again.
+ */
+typedef struct ResetRAMBlock {
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint8_t *data;
+} ResetRAMBlock;
+
+static ResetRAMBlock *reset_ram;
+static int nb_reset_ram;
+static GByteArray *reset_devices;
+
+int qemu_savevm_reset_state(void)
+{
+    Error *local_err = NULL;
+    RAMBlock *block;
+    QEMUFile *f;
+    int i;
+
+    if (reset_devices) {
+        return 0;
+    }
+    if (qemu_savevm_state_blocked(&local_err)) {
+        error_report("fast-reset: %s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EINVAL;
+    }
+
+    reset_devices = g_byte_array_new();
+    f = qemu_fopen_ops(reset_devices, &buffer_write_ops);
+    if (qemu_save_device_state(f) < 0) {
+        error_report("fast-reset: could not save the device state");
+        g_byte_array_free(reset_devices, TRUE);
+        reset_devices = NULL;
+    }
+    qemu_fclose(f);
+    if (!reset_devices) {
+        return -EIO;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        nb_reset_ram++;
+    }
+    reset_ram = g_new0(ResetRAMBlock, nb_reset_ram);
+    i = 0;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        reset_ram[i].offset = block->offset;
+        reset_ram[i].length = block->length;
+        reset_ram[i].data = g_memdup(qemu_get_ram_ptr(block->offset),
+                                     block->length);
+        i++;
+    }
+    return 0;
+}
+
+void qemu_loadvm_reset_state(void)
+{
+    QEMUFileBuffer b;
+    QEMUFile *f;
+    int i, ret;
+
+    if (!reset_devices) {
+        return;
+    }
+
+    for (i = 0; i < nb_reset_ram; i++) {
+        qemu_ram_restore(reset_ram[i].offset, reset_ram[i].data,
+                         reset_ram[i].length);
+    }
+
+    b.data = reset_devices->data;
+    b.len = reset_devices->len;
+    f = qemu_fopen_ops(&b, &buffer_read_ops);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("fast-reset: error %d while loading the device state",
+                     ret);
+    }
+}
+
 void do_delvm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
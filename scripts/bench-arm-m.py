@@ -0,0 +1,181 @@
+#!/usr/bin/env python
+#
+# Boot-time and throughput benchmark for the ARM M-profile boards
+#
+# Boots the firmware built in tests/tcg/arm-m on each board and reports,
+# per board:
+#
+#   boot_ms        host time from reset to the first UART byte
+#   run_s          host time from reset to the firmware's "done" line
+#   insns, mips    guest instructions (from the DWT cycle counter under
+#                  -icount 0) and millions of them per host second
+#   tb_count       translation blocks, "info jit"
+#   tb_gen_ms      host time spent translating, "info jit"
+#   exec_s         run_s less the translation time
+#   tb_execs       TB executions, from a second run with -tcg profile=on
+#   mmio_accesses  MMIO accesses from translated code, same run
+#
+# Results are printed as a table and appended to a file as one JSON
+# object per board and run, for tracking them over time.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import json
+import optparse
+import os
+import re
+import select
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'QMP'))
+import qmp
+
+MACHINES = ['stm32-p103', 'stm32-p205', 'lm3s6965evb']
+TIMEOUT = 120
+
+jit_fields = {
+    'tb_count': re.compile(r'^TB count\s+(\d+)', re.M),
+    'tb_gen_ms': re.compile(r'^TB gen time\s+([\d.]+) ms', re.M),
+    'tb_execs': re.compile(r'^TB exec count\s+(\d+)', re.M),
+    'mmio_accesses': re.compile(r'^TB MMIO accesses\s+(\d+)', re.M),
+}
+done_re = re.compile(r'done insns=(\d+) sum=([0-9a-f]+)')
+
+class BenchError(Exception):
+    pass
+
+def run_firmware(qemu, machine, firmware, extra_args):
+    '''Boot FIRMWARE and return the console timings and "info jit"'''
+    tmpdir = tempfile.mkdtemp(prefix='bench-arm-m.')
+    qmp_path = os.path.join(tmpdir, 'qmp.sock')
+    serial_path = os.path.join(tmpdir, 'serial.sock')
+    serial = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    serial.bind(serial_path)
+    serial.listen(1)
+    mon = qmp.QEMUMonitorProtocol(qmp_path, server=True)
+
+    args = [qemu, '-machine', machine, '-kernel', firmware,
+            '-display', 'none', '-S', '-icount', '0',
+            '-serial', 'unix:' + serial_path,
+            '-qmp', 'unix:' + qmp_path] + extra_args
+    devnull = open(os.devnull, 'r+')
+    proc = subprocess.Popen(args, stdin=devnull, stdout=devnull)
+    try:
+        mon.accept()
+        conn, _ = serial.accept()
+
+        # The clock starts when the CPU leaves reset.
+        start = time.time()
+        mon.cmd('cont')
+        console = ''
+        first_byte = None
+        while not done_re.search(console):
+            rlist, _, _ = select.select([conn], [], [], TIMEOUT)
+            if not rlist:
+                raise BenchError('%s: no output for %d s' % (machine, TIMEOUT))
+            data = conn.recv(4096)
+            if not data:
+                raise BenchError('%s: console closed' % machine)
+            if first_byte is None:
+                first_byte = time.time()
+            console += data
+        end = time.time()
+
+        jit = mon.cmd('human-monitor-command',
+                      {'command-line': 'info jit'})['return']
+        mon.cmd('quit')
+        proc.wait()
+    finally:
+        if proc.poll() is None:
+            proc.kill()
+            proc.wait()
+        mon.close()
+        serial.close()
+        for path in (qmp_path, serial_path):
+            if os.path.exists(path):
+                os.remove(path)
+        os.rmdir(tmpdir)
+
+    m = done_re.search(console)
+    return {
+        'boot_ms': (first_byte - start) * 1e3,
+        'run_s': end - start,
+        'insns': int(m.group(1)),
+        'sum': m.group(2),
+    }, jit
+
+def parse_jit(jit, names):
+    result = {}
+    for name in names:
+        m = jit_fields[name].search(jit)
+        if not m:
+            raise BenchError('"info jit" has no %s' % name)
+        result[name] = float(m.group(1)) if '.' in m.group(1) \
+                       else int(m.group(1))
+    return result
+
+def bench(qemu, machine, firmware, runs):
+    result = {'machine': machine, 'firmware': os.path.basename(firmware)}
+
+    # The timings are the best of RUNS, the counts are the same each time.
+    best = None
+    for i in range(runs):
+        console, jit = run_firmware(qemu, machine, firmware, [])
+        if best is None or console['run_s'] < best[0]['run_s']:
+            best = console, jit
+    console, jit = best
+    result.update(console)
+    result.update(parse_jit(jit, ['tb_count', 'tb_gen_ms']))
+    result['exec_s'] = result['run_s'] - result['tb_gen_ms'] / 1e3
+    result['mips'] = result['insns'] / result['run_s'] / 1e6
+
+    # Counting executions slows the guest down, so it gets a run of its own.
+    console, jit = run_firmware(qemu, machine, firmware,
+                                ['-tcg', 'profile=on'])
+    if console['sum'] != result['sum']:
+        raise BenchError('%s: result differs with -tcg profile=on' % machine)
+    result.update(parse_jit(jit, ['tb_execs', 'mmio_accesses']))
+    return result
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [MACHINE...]')
+    parser.add_option('--qemu', default='arm-softmmu/qemu-system-arm',
+                      help='QEMU binary [%default]')
+    parser.add_option('--firmware-dir', default='tests/tcg/arm-m',
+                      help='where bench-MACHINE.elf are [%default]')
+    parser.add_option('--output', metavar='FILE',
+                      help='append the results to FILE as JSON lines')
+    parser.add_option('--runs', type='int', default=3,
+                      help='timing runs per board, best one counts [%default]')
+    opts, machines = parser.parse_args()
+
+    stamp = time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime())
+    out = open(opts.output, 'a') if opts.output else None
+    fmt = '%-14s %9s %8s %12s %8s %8s %10s %8s %12s %12s\n'
+    sys.stdout.write(fmt % ('machine', 'boot_ms', 'run_s', 'insns', 'mips',
+                            'tb_count', 'tb_gen_ms', 'exec_s', 'tb_execs',
+                            'mmio'))
+    for machine in machines or MACHINES:
+        firmware = os.path.join(opts.firmware_dir, 'bench-%s.elf' % machine)
+        try:
+            r = bench(opts.qemu, machine, firmware, opts.runs)
+        except BenchError, err:
+            sys.stderr.write('bench-arm-m: %s\n' % err)
+            return 1
+        sys.stdout.write(fmt % (machine, '%.1f' % r['boot_ms'],
+                                '%.3f' % r['run_s'], r['insns'],
+                                '%.1f' % r['mips'], r['tb_count'],
+                                '%.1f' % r['tb_gen_ms'], '%.3f' % r['exec_s'],
+                                r['tb_execs'], r['mmio_accesses']))
+        if out:
+            r['time'] = stamp
+            out.write(json.dumps(r, sort_keys=True) + '\n')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+#
+# Random read benchmark for the qcow2 metadata cache
+#
+# Creates a qcow2 image with preallocated metadata, 1T by default, and
+# times random 4k reads from it with qemu-io for a range of L2 cache
+# sizes (-qcow2 l2-cache-size).  With 64k clusters every L2 table maps
+# 512M of the image, so the whole of a 1T image needs a 128M cache.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import optparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+CACHE_SIZES = ['default', '1M', '16M', '128M']
+
+def create_image(qemu_img, path, size, cluster_size):
+    subprocess.check_call([qemu_img, 'create', '-f', 'qcow2', '-o',
+                           'preallocation=metadata,cluster_size=%s'
+                           % cluster_size, path, size],
+                          stdout=open(os.devnull, 'w'))
+
+def parse_size(size):
+    suffixes = {'k': 1 << 10, 'M': 1 << 20, 'G': 1 << 30, 'T': 1 << 40}
+    if size[-1] in suffixes:
+        return int(size[:-1]) * suffixes[size[-1]]
+    return int(size)
+
+def run_reads(qemu_io, path, cmds, cache_size):
+    args = [qemu_io, '-r']
+    if cache_size != 'default':
+        args += ['--qcow2', 'l2-cache-size=' + cache_size]
+    args.append(path)
+
+    start = time.time()
+    proc = subprocess.Popen(args, stdin=subprocess.PIPE,
+                            stdout=open(os.devnull, 'w'))
+    proc.communicate(cmds)
+    end = time.time()
+    if proc.returncode != 0:
+        raise Exception('qemu-io exited with %d' % proc.returncode)
+    return end - start
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--qemu-img', default='./qemu-img',
+                      help='qemu-img binary [%default]')
+    parser.add_option('--qemu-io', default='./qemu-io',
+                      help='qemu-io binary [%default]')
+    parser.add_option('--size', default='1T',
+                      help='image size [%default]')
+    parser.add_option('--cluster-size', default='64k',
+                      help='image cluster size [%default]')
+    parser.add_option('--reads', type='int', default=20000,
+                      help='random 4k reads per run [%default]')
+    parser.add_option('--dir', default=tempfile.gettempdir(),
+                      help='where to put the image [%default]')
+    opts, args = parser.parse_args()
+    if args:
+        parser.error('no arguments expected')
+
+    size = parse_size(opts.size)
+    rand = random.Random(1)
+    cmds = ''.join('read -q %d 4k\n' % (rand.randrange(size >> 12) << 12)
+                   for i in range(opts.reads))
+    cmds += 'quit\n'
+
+    fd, path = tempfile.mkstemp(prefix='qcow2-cache-bench.', suffix='.qcow2',
+                                dir=opts.dir)
+    os.close(fd)
+    try:
+        create_image(opts.qemu_img, path, opts.size, opts.cluster_size)
+        sys.stdout.write('%-14s %10s %12s\n' % ('l2-cache-size', 'time_s',
+                                                 'reads/s'))
+        for cache_size in CACHE_SIZES:
+            t = run_reads(opts.qemu_io, path, cmds, cache_size)
+            sys.stdout.write('%-14s %10.3f %12.0f\n'
+                             % (cache_size, t, opts.reads / t))
+    finally:
+        os.remove(path)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -17,7 +17,9 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+/* With fewer mbufs than this recycled, a guest streaming over TCP spends
+ * much of its time in malloc() and free().  */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
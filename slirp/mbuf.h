@@ -79,6 +79,12 @@ struct m_hdr {
 #define M_FREEROOM(m) (M_ROOM(m) - (m)->m_len)
 #define M_TRAILINGSPACE M_FREEROOM
 
+/*
+ * How much room there is in front of m_data
+ */
+#define M_LEADINGSPACE(m) ((m)->m_data - \
+			   (((m)->m_flags & M_EXT) ? (m)->m_ext : (m)->m_dat))
+
 struct mbuf {
 	struct	m_hdr m_hdr;
 	Slirp *slirp;
@@ -708,11 +708,12 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 int if_encap(Slirp *slirp, struct mbuf *ifm)
 {
     uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    struct ethhdr *eh;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
+    bool in_place = M_LEADINGSPACE(ifm) >= ETH_HLEN;
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    if (!in_place && ifm->m_len + ETH_HLEN > sizeof(buf)) {
         return 1;
     }
 
@@ -754,13 +755,21 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        /* Most mbufs keep IF_MAXLINKHDR bytes free in front of the IP
+         * header, so the ethernet header can go there rather than the
+         * whole packet being copied.  */
+        if (in_place) {
+            eh = (struct ethhdr *)(ifm->m_data - ETH_HLEN);
+        } else {
+            eh = (struct ethhdr *)buf;
+            memcpy(buf + ETH_HLEN, ifm->m_data, ifm->m_len);
+        }
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
-        slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        slirp_output(slirp->opaque, (uint8_t *)eh, ifm->m_len + ETH_HLEN);
         return 1;
     }
 }
@@ -4,3 +4,8 @@
 void monitor_protocol_event(MonitorEvent event, QObject *data)
 {
 }
+
+bool monitor_protocol_event_wanted(MonitorEvent event)
+{
+    return false;
+}
@@ -40,6 +40,8 @@
 
 #define TARGET_PAGE_BITS 13
 
+#define TARGET_ALIGNED_ONLY
+
 #ifdef CONFIG_USER_ONLY
 /* ??? The kernel likes to give addresses in high memory.  If the host has
    more virtual address space than the guest, this can lead to impossible
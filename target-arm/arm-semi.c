@@ -35,6 +35,9 @@
 #include "qemu-common.h"
 #include "exec/gdbstub.h"
 #include "hw/arm-misc.h"
+#include "qemu/main-loop.h"
+#include "char/char.h"
+#include "sysemu/sysemu.h"
 #endif
 
 #define TARGET_SYS_OPEN        0x01
@@ -57,6 +60,10 @@
 #define TARGET_SYS_GET_CMDLINE 0x15
 #define TARGET_SYS_HEAPINFO    0x16
 #define TARGET_SYS_EXIT        0x18
+#define TARGET_SYS_EXIT_EXTENDED 0x20
+
+/* The reason SYS_EXIT and SYS_EXIT_EXTENDED give for a normal exit.  */
+#define ADP_Stopped_ApplicationExit 0x20026
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -114,6 +121,75 @@ static inline uint32_t set_swi_errno(CPUARMState *env, uint32_t code)
 }
 
 #include "exec/softmmu-semi.h"
+
+/*
+ * Console output is collected and written out by a bottom half, so that
+ * a guest printing one character at a time through SYS_WRITEC does not
+ * cost a host write() each.  It goes to the -semihosting-console
+ * character device if there is one, else to the host file it was meant
+ * for.
+ */
+#define SEMI_CONSOLE_BUF_SIZE 4096
+
+static struct {
+    char buf[SEMI_CONSOLE_BUF_SIZE];
+    int len;
+    int fd;
+    QEMUBH *bh;
+} semi_console;
+
+static void semi_console_flush(void)
+{
+    int done = 0, ret;
+
+    if (semihosting_chr) {
+        qemu_chr_fe_write(semihosting_chr, (uint8_t *)semi_console.buf,
+                          semi_console.len);
+        done = semi_console.len;
+    }
+    while (done < semi_console.len) {
+        ret = write(semi_console.fd, semi_console.buf + done,
+                    semi_console.len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    semi_console.len = 0;
+}
+
+static void semi_console_bh(void *opaque)
+{
+    semi_console_flush();
+}
+
+static void semi_console_write(int fd, const char *buf, int len)
+{
+    int n;
+
+    if (!semi_console.bh) {
+        semi_console.bh = qemu_bh_new(semi_console_bh, NULL);
+        atexit(semi_console_flush);
+    }
+    if (semi_console.len && fd != semi_console.fd) {
+        semi_console_flush();
+    }
+    semi_console.fd = fd;
+    while (len) {
+        n = MIN(len, SEMI_CONSOLE_BUF_SIZE - semi_console.len);
+        memcpy(semi_console.buf + semi_console.len, buf, n);
+        semi_console.len += n;
+        buf += n;
+        len -= n;
+        if (semi_console.len == SEMI_CONSOLE_BUF_SIZE) {
+            semi_console_flush();
+        }
+    }
+    qemu_bh_schedule(semi_console.bh);
+}
 #endif
 
 static target_ulong arm_semi_syscall_len;
@@ -192,6 +268,13 @@ uint32_t do_arm_semihosting(CPUARMState *env)
 
     nr = env->regs[0];
     args = env->regs[1];
+#ifndef CONFIG_USER_ONLY
+    /* Keep the console output in order with whatever the call does.  */
+    if (nr != TARGET_SYS_WRITEC && nr != TARGET_SYS_WRITE0 &&
+        nr != TARGET_SYS_WRITE) {
+        semi_console_flush();
+    }
+#endif
     switch (nr) {
     case TARGET_SYS_OPEN:
         GET_ARG(0);
@@ -240,7 +323,12 @@ uint32_t do_arm_semihosting(CPUARMState *env)
                 gdb_do_syscall(arm_semi_cb, "write,2,%x,1", args);
                 return env->regs[0];
           } else {
+#ifdef CONFIG_USER_ONLY
                 return write(STDERR_FILENO, &c, 1);
+#else
+                semi_console_write(STDERR_FILENO, &c, 1);
+                return 1;
+#endif
           }
         }
     case TARGET_SYS_WRITE0:
@@ -252,7 +340,12 @@ uint32_t do_arm_semihosting(CPUARMState *env)
             gdb_do_syscall(arm_semi_cb, "write,2,%x,%x\n", args, len);
             ret = env->regs[0];
         } else {
+#ifdef CONFIG_USER_ONLY
             ret = write(STDERR_FILENO, s, len);
+#else
+            semi_console_write(STDERR_FILENO, s, len);
+            ret = len;
+#endif
         }
         unlock_user(s, args, 0);
         return ret;
@@ -271,6 +364,14 @@ uint32_t do_arm_semihosting(CPUARMState *env)
                 /* FIXME - should this error code be -TARGET_EFAULT ? */
                 return (uint32_t)-1;
             }
+#ifndef CONFIG_USER_ONLY
+            if (arg0 == STDOUT_FILENO || arg0 == STDERR_FILENO) {
+                semi_console_write(arg0, s, len);
+                unlock_user(s, arg1, 0);
+                return 0;
+            }
+            semi_console_flush();
+#endif
             ret = set_swi_errno(ts, write(arg0, s, len));
             unlock_user(s, arg1, 0);
             if (ret == (uint32_t)-1)
@@ -545,8 +646,18 @@ uint32_t do_arm_semihosting(CPUARMState *env)
             return 0;
         }
     case TARGET_SYS_EXIT:
-        gdb_exit(env, 0);
-        exit(0);
+        /* The reason is in r1 itself, not in a parameter block.  */
+        ret = args == ADP_Stopped_ApplicationExit ? 0 : 1;
+        gdb_exit(env, ret);
+        exit(ret);
+    case TARGET_SYS_EXIT_EXTENDED:
+        /* Lets test firmware return a status code: the subcode of an
+         * application exit is the exit status.  */
+        GET_ARG(0);
+        GET_ARG(1);
+        ret = arg0 == ADP_Stopped_ApplicationExit ? arg1 : 1;
+        gdb_exit(env, ret);
+        exit(ret);
     default:
         fprintf(stderr, "qemu: Unsupported SemiHosting SWI 0x%02x\n", nr);
         cpu_dump_state(env, stderr, fprintf, 0);
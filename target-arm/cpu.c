@@ -22,6 +22,7 @@
 #include "qemu-common.h"
 #if !defined(CONFIG_USER_ONLY)
 #include "hw/loader.h"
+#include "exec/address-spaces.h"
 #endif
 #include "sysemu/sysemu.h"
 
@@ -92,13 +93,15 @@ static void arm_cpu_reset(CPUState *s)
 #else
     /* SVC mode with interrupts disabled.  */
     env->uncached_cpsr = ARM_CPU_MODE_SVC | CPSR_A | CPSR_F | CPSR_I;
-    /* On ARMv7-M the CPSR_I is the value of the PRIMASK register, and is
-       clear at reset.  Initial SP and PC are loaded from ROM.  */
+    /* On ARMv7-M the CPSR_I and CPSR_F are the values of the PRIMASK and
+       FAULTMASK registers, and are clear at reset.  Initial SP and PC are
+       loaded from ROM.  */
     if (IS_M(env)) {
         uint32_t pc;
         uint8_t *rom;
-        env->uncached_cpsr &= ~CPSR_I;
-        rom = rom_ptr(0);
+        env->uncached_cpsr &= ~(CPSR_I | CPSR_F);
+        /* ROM images are only ever loaded into the system address space */
+        rom = s->as == &address_space_memory ? rom_ptr(0) : NULL;
         if (rom) {
             /* We should really use ldl_phys here, in case the guest
                modified flash and reset itself.  However images
@@ -106,8 +109,21 @@ static void arm_cpu_reset(CPUState *s)
                values directly from there.  */
             env->regs[13] = ldl_p(rom);
             pc = ldl_p(rom + 4);
-            env->thumb = pc & 1;
-            env->regs[15] = pc & ~1;
+        } else {
+            /* No image was loaded, so the board's flash already holds the
+               vector table.  */
+            uint8_t vectors[8];
+
+            address_space_read(s->as, 0, vectors, sizeof(vectors));
+            env->regs[13] = ldl_p(vectors);
+            pc = ldl_p(vectors + 4);
+        }
+        env->thumb = pc & 1;
+        env->regs[15] = pc & ~1;
+        /* Automatic and lazy floating point context preservation are
+           both enabled at reset.  */
+        if (arm_feature(env, ARM_FEATURE_VFP)) {
+            env->v7m.fpccr = V7M_FPCCR_ASPEN | V7M_FPCCR_LSPEN;
         }
     }
     env->vfp.xregs[ARM_VFP_FPEXC] = 0;
@@ -401,6 +417,24 @@ static void cortex_m3_initfn(Object *obj)
     cpu->midr = 0x410fc231;
 }
 
+static void cortex_m4_initfn(Object *obj)
+{
+    ARMCPU *cpu = ARM_CPU(obj);
+    set_feature(&cpu->env, ARM_FEATURE_V7);
+    set_feature(&cpu->env, ARM_FEATURE_M);
+    cpu->midr = 0x410fc241;
+}
+
+static void cortex_m4f_initfn(Object *obj)
+{
+    ARMCPU *cpu = ARM_CPU(obj);
+    /* Cortex-M4 with the single precision FPv4-SP extension.  */
+    cortex_m4_initfn(obj);
+    set_feature(&cpu->env, ARM_FEATURE_VFP4);
+    cpu->mvfr0 = 0x10110021;
+    cpu->mvfr1 = 0x11000011;
+}
+
 static const ARMCPRegInfo cortexa8_cp_reginfo[] = {
     { .name = "L2LOCKDOWN", .cp = 15, .crn = 9, .crm = 0, .opc1 = 1, .opc2 = 0,
       .access = PL1_RW, .type = ARM_CP_CONST, .resetvalue = 0 },
@@ -756,6 +790,8 @@ static const ARMCPUInfo arm_cpus[] = {
     { .name = "arm1176",     .initfn = arm1176_initfn },
     { .name = "arm11mpcore", .initfn = arm11mpcore_initfn },
     { .name = "cortex-m3",   .initfn = cortex_m3_initfn },
+    { .name = "cortex-m4",   .initfn = cortex_m4_initfn },
+    { .name = "cortex-m4f",  .initfn = cortex_m4f_initfn },
     { .name = "cortex-a8",   .initfn = cortex_a8_initfn },
     { .name = "cortex-a9",   .initfn = cortex_a9_initfn },
     { .name = "cortex-a15",  .initfn = cortex_a15_initfn },
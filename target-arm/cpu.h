@@ -40,7 +40,6 @@
 #define EXCP_IRQ             5
 #define EXCP_FIQ             6
 #define EXCP_BKPT            7
-#define EXCP_EXCEPTION_EXIT  8   /* Return from v7M exception.  */
 #define EXCP_KERNEL_TRAP     9   /* Jumped to kernel code page.  */
 #define EXCP_STREX          10
 
@@ -162,6 +161,18 @@ typedef struct CPUARMState {
         int current_sp;
         int exception;
         int pending_exception;
+        /* Floating point extension (FPv4-SP) control registers.  */
+        uint32_t cpacr;
+        uint32_t fpccr;
+        uint32_t fpcar;
+        uint32_t fpdscr;
+        /* Fault status and PMSAv7 MPU registers.  */
+        uint32_t cfsr;
+        uint32_t mmfar;
+        uint32_t mpu_ctrl;
+        uint32_t mpu_rnr;
+        uint32_t mpu_rbar[8];
+        uint32_t mpu_rasr[8];
     } v7m;
 
     /* Thumb-2 EE state.  */
@@ -228,6 +239,18 @@ typedef struct CPUARMState {
 
     void *nvic;
     const struct arm_boot_info *boot_info;
+
+    /* On-chip flash as seen by instruction fetches, for -tcg cycles=on.
+       Set by the flash interface of the SoC; SIZE is 0 if there is none.
+       With BOOT_ALIAS, the flash also appears at address 0.  */
+    struct {
+        uint32_t base;
+        uint32_t size;
+        bool boot_alias;
+        int line_bytes;
+        int wait_states;
+        bool prefetch;
+    } flash_timing;
 } CPUARMState;
 
 #include "cpu-qom.h"
@@ -404,6 +427,8 @@ void arm_cpu_list(FILE *f, fprintf_function cpu_fprintf);
 void armv7m_nvic_set_pending(void *opaque, int irq);
 int armv7m_nvic_acknowledge_irq(void *opaque);
 void armv7m_nvic_complete_irq(void *opaque, int irq);
+bool armv7m_nvic_can_take_pending_exception(void *opaque);
+void armv7m_nvic_wfi(void *opaque);
 
 /* Interface for defining coprocessor registers.
  * Registers are defined in tables of arm_cp_reginfo structs
@@ -610,6 +635,29 @@ static inline bool cp_access_ok(CPUARMState *env,
 
 #define IS_M(env) arm_feature(env, ARM_FEATURE_M)
 
+/* v7-M CONTROL.FPCA and FPCCR bits.  */
+#define V7M_CONTROL_FPCA (1 << 2)
+#define V7M_FPCCR_LSPACT (1 << 0)
+#define V7M_FPCCR_LSPEN  (1u << 30)
+#define V7M_FPCCR_ASPEN  (1u << 31)
+
+/* v7-M MemManage fault status (the low byte of CFSR) and MPU_CTRL bits.  */
+#define V7M_MMFSR_IACCVIOL   (1 << 0)
+#define V7M_MMFSR_DACCVIOL   (1 << 1)
+#define V7M_MMFSR_MMARVALID  (1 << 7)
+#define V7M_MPU_CTRL_ENABLE     (1 << 0)
+#define V7M_MPU_CTRL_HFNMIENA   (1 << 1)
+#define V7M_MPU_CTRL_PRIVDEFENA (1 << 2)
+
+/* Guest library functions that -tcg memfuncs=on runs on the host, by the
+   order of their arguments.  */
+enum {
+    ARM_MEMFUNC_COPY,           /* memcpy (dst, src, n) and relatives */
+    ARM_MEMFUNC_SET,            /* memset (dst, c, n) */
+    ARM_MEMFUNC_AEABI_SET,      /* __aeabi_memset (dst, n, c) */
+    ARM_MEMFUNC_AEABI_CLR,      /* __aeabi_memclr (dst, n) */
+};
+
 #define ARM_CPUID_TI915T      0x54029152
 #define ARM_CPUID_TI925T      0x54029252
 
@@ -639,7 +687,7 @@ static inline CPUARMState *cpu_init(const char *cpu_model)
 #define cpu_signal_handler cpu_arm_signal_handler
 #define cpu_list arm_cpu_list
 
-#define CPU_SAVE_VERSION 9
+#define CPU_SAVE_VERSION 11
 
 /* MMU modes definitions */
 #define MMU_MODE0_SUFFIX _kernel
@@ -647,6 +695,10 @@ static inline CPUARMState *cpu_init(const char *cpu_model)
 #define MMU_USER_IDX 1
 static inline int cpu_mmu_index (CPUARMState *env)
 {
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        /* Unprivileged Thread mode.  */
+        return env->v7m.exception == 0 && (env->v7m.control & 1) ? 1 : 0;
+    }
     return (env->uncached_cpsr & CPSR_M) == ARM_CPU_MODE_USR ? 1 : 0;
 }
 
@@ -676,7 +728,24 @@ static inline void cpu_clone_regs(CPUARMState *env, target_ulong newsp)
 #define ARM_TBFLAG_CONDEXEC_MASK    (0xff << ARM_TBFLAG_CONDEXEC_SHIFT)
 #define ARM_TBFLAG_BSWAP_CODE_SHIFT 16
 #define ARM_TBFLAG_BSWAP_CODE_MASK  (1 << ARM_TBFLAG_BSWAP_CODE_SHIFT)
-/* Bits 31..17 are currently unused. */
+/* Set if the C and V flags may be computed lazily (see gen_flush_cc):
+ * only on M profile cores while their MPU is disabled, when loads and
+ * stores cannot leave the TB half way through, and not when that can
+ * happen anyway because of icount I/O or watchpoints.  An MPU fault
+ * would raise MemManage with the pending C and V still in temps, so
+ * enabling the MPU also flushes the TBs.  */
+#define ARM_TBFLAG_LAZY_CC_SHIFT    17
+#define ARM_TBFLAG_LAZY_CC_MASK     (1 << ARM_TBFLAG_LAZY_CC_SHIFT)
+/* Set on M profile cores with an FPU if the first floating point
+ * instruction must first save the lazily stacked context or set
+ * CONTROL.FPCA (see HELPER(v7m_preserve_fp)).  */
+#define ARM_TBFLAG_V7M_FPPREP_SHIFT 18
+#define ARM_TBFLAG_V7M_FPPREP_MASK  (1 << ARM_TBFLAG_V7M_FPPREP_SHIFT)
+/* Set on M profile cores while the process stack pointer is the current
+ * one, so that MRS and MSR of MSP and PSP know which one r13 holds.  */
+#define ARM_TBFLAG_V7M_PSP_SHIFT    19
+#define ARM_TBFLAG_V7M_PSP_MASK     (1 << ARM_TBFLAG_V7M_PSP_SHIFT)
+/* Bits 31..20 are currently unused. */
 
 /* some convenience accessor macros */
 #define ARM_TBFLAG_THUMB(F) \
@@ -693,6 +762,12 @@ static inline void cpu_clone_regs(CPUARMState *env, target_ulong newsp)
     (((F) & ARM_TBFLAG_CONDEXEC_MASK) >> ARM_TBFLAG_CONDEXEC_SHIFT)
 #define ARM_TBFLAG_BSWAP_CODE(F) \
     (((F) & ARM_TBFLAG_BSWAP_CODE_MASK) >> ARM_TBFLAG_BSWAP_CODE_SHIFT)
+#define ARM_TBFLAG_LAZY_CC(F) \
+    (((F) & ARM_TBFLAG_LAZY_CC_MASK) >> ARM_TBFLAG_LAZY_CC_SHIFT)
+#define ARM_TBFLAG_V7M_FPPREP(F) \
+    (((F) & ARM_TBFLAG_V7M_FPPREP_MASK) >> ARM_TBFLAG_V7M_FPPREP_SHIFT)
+#define ARM_TBFLAG_V7M_PSP(F) \
+    (((F) & ARM_TBFLAG_V7M_PSP_MASK) >> ARM_TBFLAG_V7M_PSP_SHIFT)
 
 static inline void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
                                         target_ulong *cs_base, int *flags)
@@ -713,9 +788,29 @@ static inline void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
     if (privmode) {
         *flags |= ARM_TBFLAG_PRIV_MASK;
     }
-    if (env->vfp.xregs[ARM_VFP_FPEXC] & (1 << 30)) {
+    if (arm_feature(env, ARM_FEATURE_M)) {
+        /* The FPU is enabled by the CP10 field of CPACR, either for
+           privileged code only or for everyone.  */
+        int cp10 = (env->v7m.cpacr >> 20) & 3;
+        if (cp10 == 3 || (cp10 == 1 && privmode)) {
+            *flags |= ARM_TBFLAG_VFPEN_MASK;
+        }
+        if ((env->v7m.fpccr & V7M_FPCCR_LSPACT)
+            || ((env->v7m.fpccr & V7M_FPCCR_ASPEN)
+                && !(env->v7m.control & V7M_CONTROL_FPCA))) {
+            *flags |= ARM_TBFLAG_V7M_FPPREP_MASK;
+        }
+        if (env->v7m.current_sp) {
+            *flags |= ARM_TBFLAG_V7M_PSP_MASK;
+        }
+    } else if (env->vfp.xregs[ARM_VFP_FPEXC] & (1 << 30)) {
         *flags |= ARM_TBFLAG_VFPEN_MASK;
     }
+    if (arm_feature(env, ARM_FEATURE_M) && !use_icount &&
+        !(env->v7m.mpu_ctrl & V7M_MPU_CTRL_ENABLE) &&
+        QTAILQ_EMPTY(&env->watchpoints)) {
+        *flags |= ARM_TBFLAG_LAZY_CC_MASK;
+    }
 }
 
 static inline bool cpu_has_work(CPUState *cpu)
@@ -3,9 +3,14 @@
 #include "helper.h"
 #include "qemu/host-utils.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/fuzz.h"
 #include "qemu/bitops.h"
+#include <float.h>
+#include <math.h>
 
 #ifndef CONFIG_USER_ONLY
+#include "exec/memory.h"
+
 static inline int get_phys_addr(CPUARMState *env, uint32_t address,
                                 int access_type, int is_user,
                                 hwaddr *phys_ptr, int *prot,
@@ -1597,6 +1602,15 @@ uint32_t HELPER(v7m_mrs)(CPUARMState *env, uint32_t reg)
   return 0;
 }
 
+void HELPER(v7m_preserve_fp)(CPUARMState *env)
+{
+}
+
+void HELPER(v7m_exception_exit)(CPUARMState *env)
+{
+  cpu_abort(env, "v7m exception exit\n");
+}
+
 void switch_mode(CPUARMState *env, int mode)
 {
   if (mode != ARM_CPU_MODE_USR)
@@ -1666,18 +1680,81 @@ void switch_mode(CPUARMState *env, int mode)
   env->spsr = env->banked_spsr[i];
 }
 
-static void v7m_push(CPUARMState *env, uint32_t val)
+/* The basic exception frame is eight words: r0-r3, r12, lr, pc and xPSR,
+   from the lowest address up.  When the stack is in RAM the whole frame is
+   accessed through one host mapping, otherwise (MMIO, or a frame that
+   straddles the end of RAM) a word at a time.  */
+#define V7M_FRAME_WORDS 8
+
+/* Latencies of exception entry, return and tail-chaining on Cortex-M3
+   and M4, for -tcg cycles=on.  */
+#define V7M_ENTRY_CYCLES 12
+#define V7M_RETURN_CYCLES 10
+#define V7M_TAIL_CHAIN_CYCLES 6
+
+/* Word accesses through the address space of the CPU, which a board that
+   runs several machines gives each CPU its own.  */
+static uint32_t v7m_ldl(CPUARMState *env, uint32_t addr)
 {
-  env->regs[13] -= 4;
-  stl_phys(env->regs[13], val);
+  uint8_t buf[4];
+
+  address_space_read(ENV_GET_CPU(env)->as, addr, buf, 4);
+  return ldl_p(buf);
 }
 
-static uint32_t v7m_pop(CPUARMState *env)
+static void v7m_stl(CPUARMState *env, uint32_t addr, uint32_t val)
 {
-  uint32_t val;
-  val = ldl_phys(env->regs[13]);
-  env->regs[13] += 4;
-  return val;
+  uint8_t buf[4];
+
+  stl_p(buf, val);
+  address_space_write(ENV_GET_CPU(env)->as, addr, buf, 4);
+}
+
+static void v7m_push_frame(CPUARMState *env,
+                           const uint32_t frame[V7M_FRAME_WORDS])
+{
+  hwaddr len = V7M_FRAME_WORDS * 4;
+  uint8_t *p;
+  int i;
+
+  env->regs[13] -= V7M_FRAME_WORDS * 4;
+  p = address_space_map(ENV_GET_CPU(env)->as, env->regs[13], &len, 1);
+  if (p && len == V7M_FRAME_WORDS * 4) {
+    for (i = 0; i < V7M_FRAME_WORDS; i++) {
+      stl_p(p + i * 4, frame[i]);
+    }
+    address_space_unmap(ENV_GET_CPU(env)->as, p, len, 1, len);
+    return;
+  }
+  if (p) {
+    address_space_unmap(ENV_GET_CPU(env)->as, p, len, 1, 0);
+  }
+  for (i = V7M_FRAME_WORDS - 1; i >= 0; i--) {
+    v7m_stl(env, env->regs[13] + i * 4, frame[i]);
+  }
+}
+
+static void v7m_pop_frame(CPUARMState *env, uint32_t frame[V7M_FRAME_WORDS])
+{
+  hwaddr len = V7M_FRAME_WORDS * 4;
+  uint8_t *p;
+  int i;
+
+  p = address_space_map(ENV_GET_CPU(env)->as, env->regs[13], &len, 0);
+  if (p && len == V7M_FRAME_WORDS * 4) {
+    for (i = 0; i < V7M_FRAME_WORDS; i++) {
+      frame[i] = ldl_p(p + i * 4);
+    }
+    address_space_unmap(ENV_GET_CPU(env)->as, p, len, 0, len);
+  } else {
+    if (p) {
+      address_space_unmap(ENV_GET_CPU(env)->as, p, len, 0, 0);
+    }
+    for (i = 0; i < V7M_FRAME_WORDS; i++) {
+      frame[i] = v7m_ldl(env, env->regs[13] + i * 4);
+    }
+  }
+  env->regs[13] += V7M_FRAME_WORDS * 4;
 }
 
 /* Switch to V7M main or process stack pointer.  */
@@ -1692,8 +1769,84 @@ static void switch_v7m_sp(CPUARMState *env, int process)
   }
 }
 
+/* With the floating point extension, an exception taken while CONTROL.FPCA
+   is set stacks an extended frame: s0-s15, FPSCR and a reserved word above
+   the basic frame.  With lazy stacking (FPCCR.LSPEN) only the space is
+   reserved on entry; FPCCR.LSPACT then records that FPCAR holds its
+   address, and the registers are saved there by the first floating point
+   instruction of the handler, if there is one.  */
+#define V7M_FP_FRAME_WORDS 18
+
+static uint32_t v7m_get_sreg(CPUARMState *env, int reg)
+{
+  CPU_DoubleU u;
+
+  u.d = env->vfp.regs[reg >> 1];
+  return (reg & 1) ? u.l.upper : u.l.lower;
+}
+
+static void v7m_set_sreg(CPUARMState *env, int reg, uint32_t val)
+{
+  CPU_DoubleU u;
+
+  u.d = env->vfp.regs[reg >> 1];
+  if (reg & 1) {
+    u.l.upper = val;
+  } else {
+    u.l.lower = val;
+  }
+  env->vfp.regs[reg >> 1] = u.d;
+}
+
+static void v7m_save_fp(CPUARMState *env, uint32_t addr)
+{
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    v7m_stl(env, addr + i * 4, v7m_get_sreg(env, i));
+  }
+  v7m_stl(env, addr + 16 * 4, vfp_get_fpscr(env));
+}
+
+static void v7m_restore_fp(CPUARMState *env, uint32_t addr)
+{
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    v7m_set_sreg(env, i, v7m_ldl(env, addr + i * 4));
+  }
+  vfp_set_fpscr(env, v7m_ldl(env, addr + 16 * 4));
+}
+
+/* Called by the first floating point instruction of a TB translated with
+   ARM_TBFLAG_V7M_FPPREP.  */
+void HELPER(v7m_preserve_fp)(CPUARMState *env)
+{
+  if (env->v7m.fpccr & V7M_FPCCR_LSPACT) {
+    v7m_save_fp(env, env->v7m.fpcar);
+    env->v7m.fpccr &= ~V7M_FPCCR_LSPACT;
+  }
+  if ((env->v7m.fpccr & V7M_FPCCR_ASPEN)
+      && !(env->v7m.control & V7M_CONTROL_FPCA)) {
+    /* A new floating point context starts with the default FPSCR.  */
+    env->v7m.control |= V7M_CONTROL_FPCA;
+    vfp_set_fpscr(env, env->v7m.fpdscr & 0x07c00000);
+  }
+}
+
+/* Jump to the handler of the exception in env->v7m.exception.  */
+static void v7m_load_vector(CPUARMState *env)
+{
+  uint32_t addr;
+
+  addr = v7m_ldl(env, env->v7m.vecbase + env->v7m.exception * 4);
+  env->regs[15] = addr & 0xfffffffe;
+  env->thumb = addr & 1;
+}
+
 static void do_v7m_exception_exit(CPUARMState *env)
 {
+  uint32_t frame[V7M_FRAME_WORDS];
   uint32_t type;
   uint32_t xpsr;
 
@@ -1701,18 +1854,54 @@ static void do_v7m_exception_exit(CPUARMState *env)
   if (env->v7m.exception != 0)
     armv7m_nvic_complete_irq(env->nvic, env->v7m.exception);
 
+  /* The local monitor is cleared on exception return, which is what lets
+     STREX skip comparing the memory with what LDREX read.  */
+  env->exclusive_addr = -1;
+
+  /* Tail-chaining: if a pending exception can preempt the context we are
+     returning to, enter its handler directly.  The frame already on the
+     stack is the one the new handler returns through, so it is neither
+     popped nor pushed again and LR keeps the same EXC_RETURN value.  */
+  if (!(env->uncached_cpsr & CPSR_I)
+      && armv7m_nvic_can_take_pending_exception(env->nvic)) {
+    env->v7m.exception = armv7m_nvic_acknowledge_irq(env->nvic);
+    env->regs[14] = type | 1;
+    env->v7m.control &= ~V7M_CONTROL_FPCA;
+    v7m_load_vector(env);
+    cpu_icount_charge(env, V7M_TAIL_CHAIN_CYCLES);
+    return;
+  }
+
+  cpu_icount_charge(env, V7M_RETURN_CYCLES);
+
   /* Switch to the target stack.  */
   switch_v7m_sp(env, (type & 4) != 0);
   /* Pop registers.  */
-  env->regs[0] = v7m_pop(env);
-  env->regs[1] = v7m_pop(env);
-  env->regs[2] = v7m_pop(env);
-  env->regs[3] = v7m_pop(env);
-  env->regs[12] = v7m_pop(env);
-  env->regs[14] = v7m_pop(env);
-  env->regs[15] = v7m_pop(env);
-  xpsr = v7m_pop(env);
+  v7m_pop_frame(env, frame);
+  env->regs[0] = frame[0];
+  env->regs[1] = frame[1];
+  env->regs[2] = frame[2];
+  env->regs[3] = frame[3];
+  env->regs[12] = frame[4];
+  env->regs[14] = frame[5];
+  env->regs[15] = frame[6];
+  xpsr = frame[7];
   xpsr_write(env, xpsr, 0xfffffdff);
+  if (arm_feature(env, ARM_FEATURE_VFP)) {
+    if (!(type & 0x10)) {
+      /* Extended frame.  If lazy stacking is still pending the handler
+         did not touch the FPU, and the registers are already right.  */
+      if (env->v7m.fpccr & V7M_FPCCR_LSPACT) {
+        env->v7m.fpccr &= ~V7M_FPCCR_LSPACT;
+      } else {
+        v7m_restore_fp(env, env->regs[13]);
+      }
+      env->regs[13] += V7M_FP_FRAME_WORDS * 4;
+      env->v7m.control |= V7M_CONTROL_FPCA;
+    } else {
+      env->v7m.control &= ~V7M_CONTROL_FPCA;
+    }
+  }
   /* Undo stack alignment.  */
   if (xpsr & 0x200)
     env->regs[13] |= 4;
@@ -1723,11 +1912,37 @@ static void do_v7m_exception_exit(CPUARMState *env)
    pointer.  */
 }
 
+/* A branch to the EXC_RETURN value now in the PC, caught at translation
+   time.  In Thread mode there is no exception to return from, and the
+   fetch from there faults.  */
+void HELPER(v7m_exception_exit)(CPUARMState *env)
+{
+  if (env->v7m.exception == 0) {
+    env->exception_index = EXCP_PREFETCH_ABORT;
+    cpu_loop_exit(env);
+  }
+  do_v7m_exception_exit(env);
+}
+
+/* Whether the v7-M MPU is checking accesses.  HardFault, NMI and
+   FAULTMASK run at negative priority, which bypasses the MPU unless
+   MPU_CTRL.HFNMIENA is set.  */
+static bool v7m_mpu_enabled(CPUARMState *env)
+{
+  if (!(env->v7m.mpu_ctrl & V7M_MPU_CTRL_ENABLE))
+    return false;
+  if (env->v7m.mpu_ctrl & V7M_MPU_CTRL_HFNMIENA)
+    return true;
+  return !(env->v7m.exception == ARMV7M_EXCP_NMI
+           || env->v7m.exception == ARMV7M_EXCP_HARD
+           || (env->uncached_cpsr & CPSR_F));
+}
+
 static void do_interrupt_v7m(CPUARMState *env)
 {
+  uint32_t frame[V7M_FRAME_WORDS];
   uint32_t xpsr = xpsr_read(env);
   uint32_t lr;
-  uint32_t addr;
 
   lr = 0xfffffff1;
   if (env->v7m.current_sp)
@@ -1735,6 +1950,9 @@ static void do_interrupt_v7m(CPUARMState *env)
   if (env->v7m.exception == 0)
     lr |= 8;
 
+  /* And on exception entry.  */
+  env->exclusive_addr = -1;
+
   /* For exceptions we just mark as pending on the NVIC, and let that
    handle it.  */
   /* TODO: Need to escalate if the current priority is higher than the
@@ -1765,10 +1983,9 @@ static void do_interrupt_v7m(CPUARMState *env)
       return;
     case EXCP_IRQ:
       env->v7m.exception = armv7m_nvic_acknowledge_irq(env->nvic);
+      if (env->v7m.exception == ARMV7M_EXCP_HARD)
+        fuzz_guest_fault();
       break;
-    case EXCP_EXCEPTION_EXIT:
-      do_v7m_exception_exit(env);
-      return;
     default:
       cpu_abort(env, "Unhandled exception 0x%x\n", env->exception_index);
       return; /* Never happens.  Keep compiler happy.  */
@@ -1781,22 +1998,33 @@ static void do_interrupt_v7m(CPUARMState *env)
     env->regs[13] -= 4;
     xpsr |= 0x200;
   }
+  if (env->v7m.control & V7M_CONTROL_FPCA) {
+    env->regs[13] -= V7M_FP_FRAME_WORDS * 4;
+    if (env->v7m.fpccr & V7M_FPCCR_LSPEN) {
+      env->v7m.fpcar = env->regs[13];
+      env->v7m.fpccr |= V7M_FPCCR_LSPACT;
+    } else {
+      v7m_save_fp(env, env->regs[13]);
+    }
+    env->v7m.control &= ~V7M_CONTROL_FPCA;
+    lr &= ~0x10;
+  }
   /* Switch to the handler mode.  */
-  v7m_push(env, xpsr);
-  v7m_push(env, env->regs[15]);
-  v7m_push(env, env->regs[14]);
-  v7m_push(env, env->regs[12]);
-  v7m_push(env, env->regs[3]);
-  v7m_push(env, env->regs[2]);
-  v7m_push(env, env->regs[1]);
-  v7m_push(env, env->regs[0]);
+  frame[0] = env->regs[0];
+  frame[1] = env->regs[1];
+  frame[2] = env->regs[2];
+  frame[3] = env->regs[3];
+  frame[4] = env->regs[12];
+  frame[5] = env->regs[14];
+  frame[6] = env->regs[15];
+  frame[7] = xpsr;
+  v7m_push_frame(env, frame);
   switch_v7m_sp(env, 0);
   /* Clear IT bits */
   env->condexec_bits = 0;
   env->regs[14] = lr;
-  addr = ldl_phys(env->v7m.vecbase + env->v7m.exception * 4);
-  env->regs[15] = addr & 0xfffffffe;
-  env->thumb = addr & 1;
+  v7m_load_vector(env);
+  cpu_icount_charge(env, V7M_ENTRY_CYCLES);
 }
 
 /* Handle a CPU exception.  */
@@ -1808,7 +2036,13 @@ void do_interrupt(CPUARMState *env)
   uint32_t offset;
 
   if (IS_M(env)) {
+    bool mpu_enabled = v7m_mpu_enabled(env);
+
     do_interrupt_v7m(env);
+    /* Entering or leaving HardFault and NMI can turn the MPU on or off.  */
+    if (v7m_mpu_enabled(env) != mpu_enabled) {
+      tlb_flush(env, 1);
+    }
     return;
   }
   /* TODO: Vectored interrupt controller.  */
@@ -2423,6 +2657,89 @@ static int get_phys_addr_mpu(CPUARMState *env, uint32_t address,
   return 0;
 }
 
+/* PMSAv7 region lookup for M profile cores.  The result is cached in the
+   softmmu TLB for the whole TARGET_PAGE_SIZE page, so regions and
+   subregions smaller than a page are resolved at page granularity, using
+   the permissions of the address that missed.  Changes to the MPU
+   registers flush the TLB.  */
+static int get_phys_addr_pmsav7(CPUARMState *env, uint32_t address,
+                                int access_type, int is_user,
+                                hwaddr *phys_ptr, int *prot)
+{
+  uint32_t rasr = 0;
+  int n;
+
+  *phys_ptr = address;
+  /* The Private Peripheral Bus is never covered by the MPU, and the
+     EXC_RETURN addresses only look like an instruction fetch.  */
+  if (!v7m_mpu_enabled(env)
+      || (address >= 0xe0000000 && address < 0xe0100000)
+      || (access_type == 2 && address >= 0xfffffff0)) {
+    *prot = PAGE_READ | PAGE_WRITE | PAGE_EXEC;
+    return 0;
+  }
+
+  /* The highest numbered matching region wins.  */
+  for (n = 7; n >= 0; n--) {
+    int size_log2;
+    uint32_t mask;
+
+    rasr = env->v7m.mpu_rasr[n];
+    if (!(rasr & 1))
+      continue;
+    size_log2 = ((rasr >> 1) & 0x1f) + 1;
+    if (size_log2 < 5)
+      continue;
+    mask = size_log2 < 32 ? (1u << size_log2) - 1 : ~0u;
+    if (((env->v7m.mpu_rbar[n] ^ address) & ~mask) != 0)
+      continue;
+    /* Regions of 256 bytes or more have eight subregions.  */
+    if (size_log2 >= 8
+        && (rasr & (1 << (8 + ((address >> (size_log2 - 3)) & 7)))))
+      continue;
+    break;
+  }
+
+  if (n < 0) {
+    /* Background region: the default memory map, privileged only.  */
+    if (is_user || !(env->v7m.mpu_ctrl & V7M_MPU_CTRL_PRIVDEFENA))
+      return 1;
+    *prot = PAGE_READ | PAGE_WRITE;
+    if (address < 0x40000000
+        || (address >= 0x60000000 && address < 0xa0000000))
+      *prot |= PAGE_EXEC;
+  } else {
+    switch ((rasr >> 24) & 7) {
+      case 1:
+        *prot = is_user ? 0 : PAGE_READ | PAGE_WRITE;
+        break;
+      case 2:
+        *prot = is_user ? PAGE_READ : PAGE_READ | PAGE_WRITE;
+        break;
+      case 3:
+        *prot = PAGE_READ | PAGE_WRITE;
+        break;
+      case 5:
+        *prot = is_user ? 0 : PAGE_READ;
+        break;
+      case 6:
+      case 7:
+        *prot = PAGE_READ;
+        break;
+      default:
+        /* No access, or reserved.  */
+        *prot = 0;
+        break;
+    }
+    /* XN applies on top of the access permissions.  */
+    if (*prot && !(rasr & (1 << 28)))
+      *prot |= PAGE_EXEC;
+  }
+  if (!(*prot & (1 << access_type)))
+    return 1;
+  return 0;
+}
+
 /* get_phys_addr - get the physical address for this virtual address
  *
  * Find the physical address corresponding to the given virtual address,
@@ -2451,6 +2768,12 @@ static inline int get_phys_addr(CPUARMState *env, uint32_t address,
                                 hwaddr *phys_ptr, int *prot,
                                 target_ulong *page_size)
 {
+  if (IS_M(env)) {
+    *page_size = TARGET_PAGE_SIZE;
+    return get_phys_addr_pmsav7(env, address, access_type, is_user, phys_ptr,
+                                prot);
+  }
+
   /* Fast Context Switch Extension.  */
   if (address < 0x02000000)
     address += env->cp15.c13_fcse;
@@ -2496,6 +2819,19 @@ int cpu_arm_handle_mmu_fault (CPUARMState *env, target_ulong address,
     return 0;
   }
 
+  if (IS_M(env)) {
+    /* MemManage fault, taken through do_interrupt_v7m.  */
+    if (access_type == 2) {
+      env->v7m.cfsr |= V7M_MMFSR_IACCVIOL;
+      env->exception_index = EXCP_PREFETCH_ABORT;
+    } else {
+      env->v7m.cfsr |= V7M_MMFSR_DACCVIOL | V7M_MMFSR_MMARVALID;
+      env->v7m.mmfar = address;
+      env->exception_index = EXCP_DATA_ABORT;
+    }
+    return 1;
+  }
+
   if (access_type == 2) {
     env->cp15.c5_insn = ret;
     env->cp15.c6_insn = address;
@@ -2517,6 +2853,10 @@ hwaddr cpu_get_phys_page_debug(CPUARMState *env, target_ulong addr)
   int prot;
   int ret;
 
+  /* The MPU does not translate, and the debugger may look anywhere.  */
+  if (IS_M(env))
+    return addr;
+
   ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot, &page_size);
 
   if (ret != 0)
@@ -2631,13 +2971,19 @@ void HELPER(v7m_msr)(CPUARMState *env, uint32_t reg, uint32_t val)
         env->v7m.basepri = val;
       break;
     case 19: /* FAULTMASK */
+    {
+      bool mpu_enabled = v7m_mpu_enabled(env);
+
       if (val & 1)
         env->uncached_cpsr |= CPSR_F;
       else
         env->uncached_cpsr &= ~CPSR_F;
+      if (v7m_mpu_enabled(env) != mpu_enabled)
+        tlb_flush(env, 1);
       break;
+    }
     case 20: /* CONTROL */
-      env->v7m.control = val & 3;
+      env->v7m.control = val & (arm_feature(env, ARM_FEATURE_VFP) ? 7 : 3);
       switch_v7m_sp(env, (val & 2) != 0);
       break;
     default:
@@ -2653,6 +2999,15 @@ void HELPER(v7m_msr)(CPUARMState *env, uint32_t reg, uint32_t val)
  careful to use unsigned types where modulo arithmetic is required.
  Failure to do so _will_ break on newer gcc.  */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* The saturating forms and USAD8 map directly onto SSE2 instructions
+   working on the low word of a vector register.  */
+#define SSE2_WORD(op, a, b) ((uint32_t)_mm_cvtsi128_si32( \
+    op(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b))))
+#endif
+
 /* Signed saturating arithmetic.  */
 
 /* Perform 16-bit signed saturating addition.  */
@@ -2719,6 +3074,12 @@ static inline uint8_t sub8_sat(uint8_t a, uint8_t b)
 #define SUB16(a, b, n) RESULT(sub16_sat(a, b), n, 16);
 #define ADD8(a, b, n)  RESULT(add8_sat(a, b), n, 8);
 #define SUB8(a, b, n)  RESULT(sub8_sat(a, b), n, 8);
+#ifdef __SSE2__
+#define ADD16_WORD(a, b) SSE2_WORD(_mm_adds_epi16, a, b)
+#define SUB16_WORD(a, b) SSE2_WORD(_mm_subs_epi16, a, b)
+#define ADD8_WORD(a, b)  SSE2_WORD(_mm_adds_epi8, a, b)
+#define SUB8_WORD(a, b)  SSE2_WORD(_mm_subs_epi8, a, b)
+#endif
 #define PFX q
 
 #include "op_addsub.h"
@@ -2762,6 +3123,12 @@ static inline uint8_t sub8_usat(uint8_t a, uint8_t b)
 #define SUB16(a, b, n) RESULT(sub16_usat(a, b), n, 16);
 #define ADD8(a, b, n)  RESULT(add8_usat(a, b), n, 8);
 #define SUB8(a, b, n)  RESULT(sub8_usat(a, b), n, 8);
+#ifdef __SSE2__
+#define ADD16_WORD(a, b) SSE2_WORD(_mm_adds_epu16, a, b)
+#define SUB16_WORD(a, b) SSE2_WORD(_mm_subs_epu16, a, b)
+#define ADD8_WORD(a, b)  SSE2_WORD(_mm_adds_epu8, a, b)
+#define SUB8_WORD(a, b)  SSE2_WORD(_mm_subs_epu8, a, b)
+#endif
 #define PFX uq
 
 #include "op_addsub.h"
@@ -2868,12 +3235,16 @@ static inline uint8_t do_usad(uint8_t a, uint8_t b)
 /* Unsigned sum of absolute byte differences.  */
 uint32_t HELPER(usad8)(uint32_t a, uint32_t b)
 {
+#ifdef __SSE2__
+  return SSE2_WORD(_mm_sad_epu8, a, b);
+#else
   uint32_t sum;
   sum = do_usad(a, b);
   sum += do_usad(a >> 8, b >> 8);
   sum += do_usad(a >> 16, b >>16);
   sum += do_usad(a >> 24, b >> 24);
   return sum;
+#endif
 }
 
 /* For ARMv6 SEL instruction.  */
@@ -3009,10 +3380,78 @@ void vfp_set_fpscr(CPUARMState *env, uint32_t val)
 
 #define VFP_HELPER(name, p) HELPER(glue(glue(vfp_,name),p))
 
+/* Single precision add, sub, mul and div are computed with host floats
+   when that is sure to give the softfloat result and flags: round to
+   nearest, inputs that are zero or normal (so that flushing denormals does
+   not matter), the sticky inexact flag already set and a normal result.
+   Everything else, including overflow, underflow and NaNs, goes through
+   softfloat.  This needs a host that evaluates floats in single precision,
+   which rules out x87.  */
+enum {
+  VFP_HOST_add,
+  VFP_HOST_sub,
+  VFP_HOST_mul,
+  VFP_HOST_div,
+};
+
+static inline int vfp_host_zero_or_normal_s(float32 a)
+{
+  uint32_t exp = (float32_val(a) >> 23) & 0xff;
+
+  return (exp != 0 && exp != 0xff) || float32_is_zero(a);
+}
+
+static inline int vfp_host_binop_s(int op, float32 a, float32 b,
+                                   float_status *fpst, float32 *res)
+{
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+  union {
+    float f;
+    uint32_t u;
+  } ua, ub, ur;
+
+  if (fpst->float_rounding_mode != float_round_nearest_even
+      || !(fpst->float_exception_flags & float_flag_inexact)
+      || !vfp_host_zero_or_normal_s(a) || !vfp_host_zero_or_normal_s(b)) {
+    return 0;
+  }
+  ua.u = float32_val(a);
+  ub.u = float32_val(b);
+  switch (op) {
+    case VFP_HOST_add:
+      ur.f = ua.f + ub.f;
+      break;
+    case VFP_HOST_sub:
+      ur.f = ua.f - ub.f;
+      break;
+    case VFP_HOST_mul:
+      ur.f = ua.f * ub.f;
+      break;
+    default:
+      if (float32_is_zero(b)) {
+        return 0;
+      }
+      ur.f = ua.f / ub.f;
+      break;
+  }
+  if (!(fabsf(ur.f) > FLT_MIN && fabsf(ur.f) <= FLT_MAX)) {
+    return 0;
+  }
+  *res = make_float32(ur.u);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 #define VFP_BINOP(name) \
 float32 VFP_HELPER(name, s)(float32 a, float32 b, void *fpstp) \
 { \
 float_status *fpst = fpstp; \
+float32 r; \
+if (vfp_host_binop_s(VFP_HOST_ ## name, a, b, fpst, &r)) { \
+return r; \
+} \
 return float32_ ## name(a, b, fpst); \
 } \
 float64 VFP_HELPER(name, d)(float64 a, float64 b, void *fpstp) \
@@ -106,6 +106,18 @@ void cpu_save(QEMUFile *f, void *opaque)
         qemu_put_be32(f, env->v7m.control);
         qemu_put_be32(f, env->v7m.current_sp);
         qemu_put_be32(f, env->v7m.exception);
+        qemu_put_be32(f, env->v7m.cpacr);
+        qemu_put_be32(f, env->v7m.fpccr);
+        qemu_put_be32(f, env->v7m.fpcar);
+        qemu_put_be32(f, env->v7m.fpdscr);
+        qemu_put_be32(f, env->v7m.cfsr);
+        qemu_put_be32(f, env->v7m.mmfar);
+        qemu_put_be32(f, env->v7m.mpu_ctrl);
+        qemu_put_be32(f, env->v7m.mpu_rnr);
+        for (i = 0; i < 8; i++) {
+            qemu_put_be32(f, env->v7m.mpu_rbar[i]);
+            qemu_put_be32(f, env->v7m.mpu_rasr[i]);
+        }
     }
 
     if (arm_feature(env, ARM_FEATURE_THUMB2EE)) {
@@ -226,6 +238,18 @@ int cpu_load(QEMUFile *f, void *opaque, int version_id)
         env->v7m.control = qemu_get_be32(f);
         env->v7m.current_sp = qemu_get_be32(f);
         env->v7m.exception = qemu_get_be32(f);
+        env->v7m.cpacr = qemu_get_be32(f);
+        env->v7m.fpccr = qemu_get_be32(f);
+        env->v7m.fpcar = qemu_get_be32(f);
+        env->v7m.fpdscr = qemu_get_be32(f);
+        env->v7m.cfsr = qemu_get_be32(f);
+        env->v7m.mmfar = qemu_get_be32(f);
+        env->v7m.mpu_ctrl = qemu_get_be32(f);
+        env->v7m.mpu_rnr = qemu_get_be32(f);
+        for (i = 0; i < 8; i++) {
+            env->v7m.mpu_rbar[i] = qemu_get_be32(f);
+            env->v7m.mpu_rasr[i] = qemu_get_be32(f);
+        }
     }
 
     if (arm_feature(env, ARM_FEATURE_THUMB2EE)) {
@@ -22,6 +22,9 @@
 
 uint32_t HELPER(glue(PFX,add16))(uint32_t a, uint32_t b GE_ARG)
 {
+#ifdef ADD16_WORD
+    return ADD16_WORD(a, b);
+#else
     uint32_t res = 0;
     DECLARE_GE;
 
@@ -29,10 +32,14 @@ uint32_t HELPER(glue(PFX,add16))(uint32_t a, uint32_t b GE_ARG)
     ADD16(a >> 16, b >> 16, 1);
     SET_GE;
     return res;
+#endif
 }
 
 uint32_t HELPER(glue(PFX,add8))(uint32_t a, uint32_t b GE_ARG)
 {
+#ifdef ADD8_WORD
+    return ADD8_WORD(a, b);
+#else
     uint32_t res = 0;
     DECLARE_GE;
 
@@ -42,10 +49,14 @@ uint32_t HELPER(glue(PFX,add8))(uint32_t a, uint32_t b GE_ARG)
     ADD8(a >> 24, b >> 24, 3);
     SET_GE;
     return res;
+#endif
 }
 
 uint32_t HELPER(glue(PFX,sub16))(uint32_t a, uint32_t b GE_ARG)
 {
+#ifdef SUB16_WORD
+    return SUB16_WORD(a, b);
+#else
     uint32_t res = 0;
     DECLARE_GE;
 
@@ -53,10 +64,14 @@ uint32_t HELPER(glue(PFX,sub16))(uint32_t a, uint32_t b GE_ARG)
     SUB16(a >> 16, b >> 16, 1);
     SET_GE;
     return res;
+#endif
 }
 
 uint32_t HELPER(glue(PFX,sub8))(uint32_t a, uint32_t b GE_ARG)
 {
+#ifdef SUB8_WORD
+    return SUB8_WORD(a, b);
+#else
     uint32_t res = 0;
     DECLARE_GE;
 
@@ -66,6 +81,7 @@ uint32_t HELPER(glue(PFX,sub8))(uint32_t a, uint32_t b GE_ARG)
     SUB8(a >> 24, b >> 24, 3);
     SET_GE;
     return res;
+#endif
 }
 
 uint32_t HELPER(glue(PFX,subaddx))(uint32_t a, uint32_t b GE_ARG)
@@ -101,3 +117,7 @@ uint32_t HELPER(glue(PFX,addsubx))(uint32_t a, uint32_t b GE_ARG)
 #undef SUB16
 #undef ADD8
 #undef SUB8
+#undef ADD16_WORD
+#undef SUB16_WORD
+#undef ADD8_WORD
+#undef SUB8_WORD
@@ -18,6 +18,9 @@
  */
 #include "cpu.h"
 #include "helper.h"
+#include "tcg.h"
+#include "exec/gdbstub.h"
+#include "qemu/atomic.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -53,6 +56,7 @@ uint32_t HELPER(neon_tbl)(CPUARMState *env, uint32_t ireg, uint32_t def,
 #if !defined(CONFIG_USER_ONLY)
 
 #include "exec/softmmu_exec.h"
+#include "exec/address-spaces.h"
 
 #define MMUSUFFIX _mmu
 
@@ -85,6 +89,173 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+
+/* The host address of the words of an LDM or STM of the registers in
+   list from addr, if they are all in one RAM page that the TLB maps for
+   the access.  I/O, pages holding translated code or being tracked for
+   migration, and watchpoints all set flags in the TLB address, so that
+   nothing can fault or have side effects on the way.  */
+static uint8_t *ldst_multiple_host(CPUARMState *env, uint32_t addr,
+                                   uint32_t list, int is_write)
+{
+    int mmu_idx = cpu_mmu_index(env);
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *tlb = &env->tlb_table[mmu_idx][index];
+    target_ulong tlb_addr = is_write ? tlb->addr_write : tlb->addr_read;
+    uint32_t last = addr - 4;
+
+    for (; list; list &= list - 1) {
+        last += 4;
+    }
+    if ((addr & 3) != 0
+        || (last & TARGET_PAGE_MASK) != (addr & TARGET_PAGE_MASK)
+        || tlb_addr != (addr & TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+    return (uint8_t *)(uintptr_t)(addr + tlb->addend);
+}
+
+/* LDM and STM of a whole block with a single TLB check.  Return 0, having
+   done nothing, if the generated code must do the accesses one by one.  */
+uint32_t HELPER(ldm_fast)(CPUARMState *env, uint32_t addr, uint32_t list)
+{
+    uint8_t *host = ldst_multiple_host(env, addr, list, 0);
+    int i;
+
+    if (!host) {
+        return 0;
+    }
+    for (i = 0; i < 15; i++) {
+        if (list & (1 << i)) {
+            env->regs[i] = ldl_p(host);
+            host += 4;
+        }
+    }
+    return 1;
+}
+
+uint32_t HELPER(stm_fast)(CPUARMState *env, uint32_t addr, uint32_t list)
+{
+    uint8_t *host = ldst_multiple_host(env, addr, list, 1);
+    int i;
+
+    if (!host) {
+        return 0;
+    }
+    for (i = 0; i < 15; i++) {
+        if (list & (1 << i)) {
+            stl_p(host, env->regs[i]);
+            host += 4;
+        }
+    }
+    return 1;
+}
+
+/* The host address of the len bytes from addr, if they are all in one
+   RAM region that can be accessed for a write, or a read if is_write is
+   0.  ROM can be read, but MMIO, which includes ROM devices, cannot.  */
+static uint8_t *memfunc_host(uint32_t addr, uint32_t len, int is_write)
+{
+    MemoryRegionSection section;
+    hwaddr plen = len;
+    void *host;
+
+    section = memory_region_find(get_system_memory(), addr, len);
+    if (section.size != len || !memory_region_is_ram(section.mr)) {
+        return NULL;
+    }
+    if (!is_write) {
+        return (uint8_t *)memory_region_get_ram_ptr(section.mr)
+            + section.offset_within_region;
+    }
+    if (section.readonly || memory_region_is_rom(section.mr)) {
+        return NULL;
+    }
+    host = address_space_map(&address_space_memory, addr, &plen, 1);
+    if (plen != len) {
+        address_space_unmap(&address_space_memory, host, plen, 1, 0);
+        return NULL;
+    }
+    return host;
+}
+
+/* Run the guest function of the given kind, that the TB of its entry
+   point is calling, as one host memmove or memset, and return to the
+   caller.  The registers that the AAPCS lets it clobber are left alone.
+   Return 0, having done nothing, if the guest code must run: whenever
+   the memory is not plain RAM in the system address space, the MPU or
+   watchpoints might see the accesses, or the return is not an ordinary
+   one to Thumb code.  */
+uint32_t HELPER(memfunc)(CPUARMState *env, uint32_t kind)
+{
+    uint32_t dst = env->regs[0];
+    uint32_t lr = env->regs[14];
+    uint32_t src = 0, len;
+    int c = 0;
+    uint8_t *dst_host, *src_host = NULL;
+
+    switch (kind) {
+    case ARM_MEMFUNC_COPY:
+        src = env->regs[1];
+        len = env->regs[2];
+        break;
+    case ARM_MEMFUNC_SET:
+        c = env->regs[1];
+        len = env->regs[2];
+        break;
+    case ARM_MEMFUNC_AEABI_SET:
+        len = env->regs[1];
+        c = env->regs[2];
+        break;
+    default:
+        len = env->regs[1];
+        break;
+    }
+
+    if (ENV_GET_CPU(env)->as != &address_space_memory
+        || (env->v7m.mpu_ctrl & V7M_MPU_CTRL_ENABLE)
+        || !QTAILQ_EMPTY(&env->watchpoints)
+        || !(lr & 1) || lr >= 0xf0000000) {
+        return 0;
+    }
+
+    if (len) {
+        if (kind == ARM_MEMFUNC_COPY) {
+            src_host = memfunc_host(src, len, 0);
+            if (!src_host) {
+                return 0;
+            }
+        }
+        dst_host = memfunc_host(dst, len, 1);
+        if (!dst_host) {
+            return 0;
+        }
+        if (src_host) {
+            memmove(dst_host, src_host, len);
+        } else {
+            memset(dst_host, c, len);
+        }
+        address_space_unmap(&address_space_memory, dst_host, len, 1, len);
+    }
+
+    env->regs[15] = lr & ~1;
+    return 1;
+}
+#else
+uint32_t HELPER(ldm_fast)(CPUARMState *env, uint32_t addr, uint32_t list)
+{
+    return 0;
+}
+
+uint32_t HELPER(stm_fast)(CPUARMState *env, uint32_t addr, uint32_t list)
+{
+    return 0;
+}
+
+uint32_t HELPER(memfunc)(CPUARMState *env, uint32_t kind)
+{
+    return 0;
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
@@ -218,17 +389,61 @@ uint32_t HELPER(usat16)(CPUARMState *env, uint32_t x, uint32_t shift)
 
 void HELPER(wfi)(CPUARMState *env)
 {
+#ifndef CONFIG_USER_ONLY
+    if (IS_M(env)) {
+        armv7m_nvic_wfi(env->nvic);
+    }
+#endif
     env->exception_index = EXCP_HLT;
     env->halted = 1;
     cpu_loop_exit(env);
 }
 
+/* Find the TB an indirect branch continues in, so that generated code
+   can jump straight to it instead of returning to cpu_exec.  This is
+   the tb_jmp_cache lookup of tb_find_fast; a miss, or any pending
+   interrupt or exit request, goes back to cpu_exec instead.  The TB
+   becomes current_tb, as it would when entered from cpu_exec, and checks
+   tcg_exit_req on entry like any other.  */
+void *HELPER(lookup_tb_ptr)(CPUARMState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = tb_jmp_cache_get(env, pc);
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return code_gen_epilogue;
+    }
+    env->current_tb = tb;
+    /* cpu_exit runs in a signal handler on this thread.  */
+    barrier();
+    if (env->interrupt_request || env->exit_request || exit_request) {
+        return code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 void HELPER(exception)(CPUARMState *env, uint32_t excp)
 {
     env->exception_index = excp;
     cpu_loop_exit(env);
 }
 
+/* A semihosting bkpt recognized at translation time, at the PC.  Calls
+ * forwarded to gdb stop the CPU, so take the exception for those.  */
+void HELPER(semihosting)(CPUARMState *env)
+{
+    if (use_gdb_syscalls()) {
+        env->exception_index = EXCP_BKPT;
+        cpu_loop_exit(env);
+    }
+    env->regs[15] += 2;
+    env->regs[0] = do_arm_semihosting(env);
+}
+
 uint32_t HELPER(cpsr_read)(CPUARMState *env)
 {
     return cpsr_read(env) & ~CPSR_EXEC;
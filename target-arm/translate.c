@@ -28,6 +28,10 @@
 #include "disas/disas.h"
 #include "tcg-op.h"
 #include "qemu/log.h"
+#include "qemu/host-utils.h"
+#ifndef CONFIG_USER_ONLY
+#include "sysemu/sysemu.h"
+#endif
 
 #include "helper.h"
 #define GEN_HELPER 1
@@ -56,18 +60,56 @@ typedef struct DisasContext {
     /* Thumb-2 conditional execution bits.  */
     int condexec_mask;
     int condexec_cond;
+    /* Condition tested for the instructions skipped to condlabel.  */
+    int it_cond;
+    /* Nonzero if the last instruction leaves the flags alone in an IT
+       block, so that the next one can share its condition test.  */
+    int it_keeps_flags;
     struct TranslationBlock *tb;
     int singlestep_enabled;
     int thumb;
     int bswap_code;
+    /* Nonzero for M profile cores, which have no ARM mode, coprocessors,
+       VFP, Neon or SPSR.  */
+    int m_profile;
 #if !defined(CONFIG_USER_ONLY)
     int user;
 #endif
     int vfp_enabled;
+    /* Nonzero if floating point instructions must call
+       gen_helper_v7m_preserve_fp first (ARM_TBFLAG_V7M_FPPREP).  */
+    int v7m_fpprep;
+    /* Nonzero if r13 is the process stack pointer (ARM_TBFLAG_V7M_PSP).  */
+    int v7m_psp;
     int vec_len;
     int vec_stride;
+    /* Nonzero if C and V may be left pending (see gen_flush_cc).  */
+    int lazy_cc;
+    /* Operation whose C and V flags are pending, and which of them.  */
+    int cc_op;
+    int cc_pending;
+    /* Direct branches to targets below this address are followed within
+       the TB (-tcg traces=on), and the number followed so far.  */
+    target_ulong trace_limit;
+    int trace_jmps;
+    /* Cycle estimate state (-tcg cycles=on): nonzero for a Cortex-M4,
+       nonzero if the last instruction was a single load or store, and
+       the flash line being executed from, how many cycles have been spent
+       in it, and the address the next sequential fetch would be from.  */
+    int cycles_m4;
+    int cycles_ldst;
+    uint32_t fetch_line;
+    int fetch_cycles;
+    uint32_t fetch_next;
 } DisasContext;
 
+/* Lazy C and V flags.  */
+#define CC_OP_ADD 0
+#define CC_OP_SUB 1
+
+#define CC_PENDING_C 1
+#define CC_PENDING_V 2
+
 static uint32_t gen_opc_condexec_bits[OPC_BUF_SIZE];
 
 #if defined(CONFIG_USER_ONLY)
@@ -97,6 +139,8 @@ static TCGv_i32 cpu_exclusive_info;
 /* FIXME:  These should be removed.  */
 static TCGv cpu_F0s, cpu_F1s;
 static TCGv_i64 cpu_F0d, cpu_F1d;
+/* Operands and result of the last add or sub with pending flags.  */
+static TCGv cpu_cc_src1, cpu_cc_src2, cpu_cc_dst;
 
 #include "exec/gen-icount.h"
 
@@ -180,6 +224,21 @@ static inline TCGv load_reg(DisasContext *s, int reg)
     return tmp;
 }
 
+/* End the TB after an indirect branch, continuing directly in the next
+   TB if it is in the jump cache.  The helper recomputes the TB flags, so
+   this also serves BX changing the instruction set.  */
+static void gen_lookup_and_goto_ptr(void)
+{
+#if TCG_TARGET_HAS_goto_ptr
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+    gen_helper_lookup_tb_ptr(ptr, cpu_env);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+#else
+    tcg_gen_exit_tb(0);
+#endif
+}
+
 /* Set a CPU register.  The source must be a temporary and will be
    marked as dead.  */
 static void store_reg(DisasContext *s, int reg, TCGv var)
@@ -401,10 +460,58 @@ static void gen_sub_carry(TCGv dest, TCGv t0, TCGv t1)
     tcg_gen_subi_i32(dest, dest, 1);
 }
 
+/* In a translation block with lazy_cc set, gen_add_CC and gen_sub_CC only
+   compute N and Z (which are plain copies of the result) and record the
+   operands, leaving C and V pending.  They are computed by gen_flush_cc
+   before anything can read them or leave the TB; an instruction that
+   overwrites C by itself only drops the pending C.  Operations executed
+   conditionally always compute the flags straight away.  */
+static void gen_flush_cc(DisasContext *s)
+{
+    TCGv tmp;
+
+    if (s->cc_pending & CC_PENDING_C) {
+        if (s->cc_op == CC_OP_ADD) {
+            tcg_gen_setcond_i32(TCG_COND_LTU, cpu_CF, cpu_cc_dst, cpu_cc_src1);
+        } else {
+            tcg_gen_setcond_i32(TCG_COND_GEU, cpu_CF, cpu_cc_src1, cpu_cc_src2);
+        }
+    }
+    if (s->cc_pending & CC_PENDING_V) {
+        tcg_gen_xor_i32(cpu_VF, cpu_cc_dst, cpu_cc_src1);
+        tmp = tcg_temp_new_i32();
+        tcg_gen_xor_i32(tmp, cpu_cc_src1, cpu_cc_src2);
+        if (s->cc_op == CC_OP_ADD) {
+            tcg_gen_andc_i32(cpu_VF, cpu_VF, tmp);
+        } else {
+            tcg_gen_and_i32(cpu_VF, cpu_VF, tmp);
+        }
+        tcg_temp_free_i32(tmp);
+    }
+    s->cc_pending = 0;
+}
+
+/* Record T0 op T1 (already in cpu_NF) for lazy C and V computation.  */
+static void gen_lazy_CC(DisasContext *s, int op)
+{
+    tcg_gen_mov_i32(cpu_ZF, cpu_NF);
+    tcg_gen_mov_i32(cpu_cc_dst, cpu_NF);
+    s->cc_op = op;
+    s->cc_pending = CC_PENDING_C | CC_PENDING_V;
+}
+
 /* dest = T0 + T1. Compute C, N, V and Z flags */
-static void gen_add_CC(TCGv dest, TCGv t0, TCGv t1)
+static void gen_add_CC(DisasContext *s, TCGv dest, TCGv t0, TCGv t1)
 {
     TCGv tmp;
+    if (s->lazy_cc && !s->condjmp) {
+        tcg_gen_mov_i32(cpu_cc_src1, t0);
+        tcg_gen_mov_i32(cpu_cc_src2, t1);
+        tcg_gen_add_i32(cpu_NF, t0, t1);
+        gen_lazy_CC(s, CC_OP_ADD);
+        tcg_gen_mov_i32(dest, cpu_NF);
+        return;
+    }
     tcg_gen_add_i32(cpu_NF, t0, t1);
     tcg_gen_mov_i32(cpu_ZF, cpu_NF);
     tcg_gen_setcond_i32(TCG_COND_LTU, cpu_CF, cpu_NF, t0);
@@ -414,12 +521,21 @@ static void gen_add_CC(TCGv dest, TCGv t0, TCGv t1)
     tcg_gen_andc_i32(cpu_VF, cpu_VF, tmp);
     tcg_temp_free_i32(tmp);
     tcg_gen_mov_i32(dest, cpu_NF);
+    s->cc_pending = 0;
 }
 
 /* dest = T0 - T1. Compute C, N, V and Z flags */
-static void gen_sub_CC(TCGv dest, TCGv t0, TCGv t1)
+static void gen_sub_CC(DisasContext *s, TCGv dest, TCGv t0, TCGv t1)
 {
     TCGv tmp;
+    if (s->lazy_cc && !s->condjmp) {
+        tcg_gen_mov_i32(cpu_cc_src1, t0);
+        tcg_gen_mov_i32(cpu_cc_src2, t1);
+        tcg_gen_sub_i32(cpu_NF, t0, t1);
+        gen_lazy_CC(s, CC_OP_SUB);
+        tcg_gen_mov_i32(dest, cpu_NF);
+        return;
+    }
     tcg_gen_sub_i32(cpu_NF, t0, t1);
     tcg_gen_mov_i32(cpu_ZF, cpu_NF);
     tcg_gen_setcond_i32(TCG_COND_GEU, cpu_CF, t0, t1);
@@ -429,6 +545,7 @@ static void gen_sub_CC(TCGv dest, TCGv t0, TCGv t1)
     tcg_gen_and_i32(cpu_VF, cpu_VF, tmp);
     tcg_temp_free_i32(tmp);
     tcg_gen_mov_i32(dest, cpu_NF);
+    s->cc_pending = 0;
 }
 
 #define GEN_SHIFT(name)                                               \
@@ -561,6 +678,146 @@ static inline void gen_arm_shift_reg(TCGv var, int shiftop,
     tcg_temp_free_i32(shift);
 }
 
+/* Signed saturation of VAR to SHIFT + 1 bits, setting Q if it clips.  */
+static void gen_ssat(TCGv var, int shift)
+{
+    TCGv res, lim, tmp;
+
+    if (shift == 31)
+        return;
+    res = tcg_temp_new_i32();
+    lim = tcg_const_i32((1u << shift) - 1);
+    tcg_gen_movcond_i32(TCG_COND_GT, res, var, lim, lim, var);
+    tcg_gen_not_i32(lim, lim);
+    tcg_gen_movcond_i32(TCG_COND_LT, res, res, lim, lim, res);
+    tcg_temp_free_i32(lim);
+    tmp = tcg_temp_new_i32();
+    tcg_gen_setcond_i32(TCG_COND_NE, tmp, res, var);
+    tcg_gen_mov_i32(var, res);
+    tcg_gen_ld_i32(res, cpu_env, offsetof(CPUARMState, QF));
+    tcg_gen_or_i32(res, res, tmp);
+    tcg_gen_st_i32(res, cpu_env, offsetof(CPUARMState, QF));
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(res);
+}
+
+/* Unsigned saturation of VAR to SHIFT bits, setting Q if it clips.  */
+static void gen_usat(TCGv var, int shift)
+{
+    TCGv res, lim, tmp;
+
+    res = tcg_temp_new_i32();
+    lim = tcg_const_i32(0);
+    tcg_gen_movcond_i32(TCG_COND_LT, res, var, lim, lim, var);
+    tcg_gen_movi_i32(lim, (1u << shift) - 1);
+    tcg_gen_movcond_i32(TCG_COND_GT, res, res, lim, lim, res);
+    tcg_temp_free_i32(lim);
+    tmp = tcg_temp_new_i32();
+    tcg_gen_setcond_i32(TCG_COND_NE, tmp, res, var);
+    tcg_gen_mov_i32(var, res);
+    tcg_gen_ld_i32(res, cpu_env, offsetof(CPUARMState, QF));
+    tcg_gen_or_i32(res, res, tmp);
+    tcg_gen_st_i32(res, cpu_env, offsetof(CPUARMState, QF));
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(res);
+}
+
+/* Inline expansion of the modulo and halving add forms of the parallel
+   add and subtract instructions, which are the ones codec and DSP inner
+   loops use most.  All lanes are done by one 32-bit operation: the top
+   bit of each lane is masked off so that no carry crosses into the next
+   lane, and is then put back with an xor.  The GE bits are recovered
+   from the carry (or borrow) out of each lane.  OP1 and OP2 use the
+   Thumb-2 encoding.  Returns nonzero if code was generated.  */
+static int gen_pas_inline(int op1, int op2, TCGv a, TCGv b)
+{
+    uint32_t top;
+    int sub, is_unsigned;
+    TCGv res, tmp, ge;
+
+    if ((op1 & 2) || (op2 & 1) || (op2 & 3) == 3)
+        return 0;
+    top = (op1 & 1) ? 0x80008000 : 0x80808080;
+    sub = op1 & 4;
+    is_unsigned = op2 & 4;
+    if (op2 & 2) {
+        /* Halving add: (a & b) + ((a ^ b) >> 1) in each lane.  The signed
+           form biases the lanes to unsigned and back.  */
+        if (sub)
+            return 0;
+        if (!is_unsigned) {
+            tcg_gen_xori_i32(a, a, top);
+            tcg_gen_xori_i32(b, b, top);
+        }
+        tmp = tcg_temp_new_i32();
+        tcg_gen_xor_i32(tmp, a, b);
+        tcg_gen_shri_i32(tmp, tmp, 1);
+        tcg_gen_andi_i32(tmp, tmp, ~top);
+        tcg_gen_and_i32(a, a, b);
+        tcg_gen_add_i32(a, a, tmp);
+        tcg_temp_free_i32(tmp);
+        if (!is_unsigned)
+            tcg_gen_xori_i32(a, a, top);
+        return 1;
+    }
+
+    res = tcg_temp_new_i32();
+    tmp = tcg_temp_new_i32();
+    ge = tcg_temp_new_i32();
+    tcg_gen_andi_i32(tmp, b, ~top);
+    if (sub) {
+        tcg_gen_ori_i32(res, a, top);
+        tcg_gen_sub_i32(res, res, tmp);
+        tcg_gen_eqv_i32(tmp, a, b);
+    } else {
+        tcg_gen_andi_i32(res, a, ~top);
+        tcg_gen_add_i32(res, res, tmp);
+        tcg_gen_xor_i32(tmp, a, b);
+    }
+    tcg_gen_andi_i32(ge, tmp, top);
+    tcg_gen_xor_i32(res, res, ge);
+
+    /* Carry out of the top of each lane, or borrow for subtraction.  */
+    if (sub) {
+        tcg_gen_and_i32(ge, tmp, res);
+        tcg_gen_andc_i32(a, b, a);
+    } else {
+        tcg_gen_andc_i32(ge, tmp, res);
+        tcg_gen_and_i32(a, a, b);
+    }
+    tcg_gen_or_i32(ge, ge, a);
+    /* GE is the carry for UADD, no borrow for USUB, and the sign of the
+       widened result clear for the signed forms.  */
+    if (is_unsigned) {
+        if (sub)
+            tcg_gen_not_i32(ge, ge);
+    } else if (sub) {
+        tcg_gen_xor_i32(ge, ge, tmp);
+    } else {
+        tcg_gen_eqv_i32(ge, ge, tmp);
+    }
+    tcg_gen_andi_i32(ge, ge, top);
+    if (op1 & 1) {
+        /* Bits 15 and 31 to GE[1:0] and GE[3:2].  */
+        tcg_gen_shri_i32(ge, ge, 15);
+        tcg_gen_muli_i32(ge, ge, 3);
+        tcg_gen_shri_i32(tmp, ge, 14);
+        tcg_gen_or_i32(ge, ge, tmp);
+    } else {
+        /* Gather bits 7, 15, 23 and 31 into bits 21 to 24.  */
+        tcg_gen_shri_i32(ge, ge, 7);
+        tcg_gen_muli_i32(ge, ge, 0x00204081);
+        tcg_gen_shri_i32(ge, ge, 21);
+    }
+    tcg_gen_andi_i32(ge, ge, 0xf);
+    tcg_gen_st_i32(ge, cpu_env, offsetof(CPUARMState, GE));
+    tcg_gen_mov_i32(a, res);
+    tcg_temp_free_i32(ge);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(res);
+    return 1;
+}
+
 #define PAS_OP(pfx) \
     switch (op2) {  \
     case 0: gen_pas_helper(glue(pfx,add16)); break; \
@@ -572,8 +829,11 @@ static inline void gen_arm_shift_reg(TCGv var, int shiftop,
     }
 static void gen_arm_parallel_addsub(int op1, int op2, TCGv a, TCGv b)
 {
+    static const int thumb2_op[8] = { 1, 2, 6, 5, 0, 3, 3, 4 };
     TCGv_ptr tmp;
 
+    if (gen_pas_inline(thumb2_op[op2], op1 - 1, a, b))
+        return;
     switch (op1) {
 #define gen_pas_helper(name) glue(gen_helper_,name)(a, a, b, tmp)
     case 1:
@@ -621,6 +881,8 @@ static void gen_thumb2_parallel_addsub(int op1, int op2, TCGv a, TCGv b)
 {
     TCGv_ptr tmp;
 
+    if (gen_pas_inline(op1, op2, a, b))
+        return;
     switch (op2) {
 #define gen_pas_helper(name) glue(gen_helper_,name)(a, a, b, tmp)
     case 0:
@@ -762,10 +1024,41 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
     tcg_gen_movi_i32(cpu_R[15], addr & ~1);
 }
 
+#ifndef CONFIG_USER_ONLY
+/* On M profile, a branch to an EXC_RETURN value returns from the exception
+   right away, instead of fetching from there.  var is marked as dead.  */
+static void gen_bx_v7m(DisasContext *s, TCGv var)
+{
+    int normal = gen_new_label();
+    int done = gen_new_label();
+    TCGv tmp;
+
+    /* Neither var nor the lazy flags would survive the branch.  */
+    gen_flush_cc(s);
+    tcg_gen_mov_i32(cpu_R[15], var);
+    tcg_temp_free_i32(var);
+    tcg_gen_brcondi_i32(TCG_COND_LTU, cpu_R[15], 0xffffffe0, normal);
+    gen_helper_v7m_exception_exit(cpu_env);
+    tcg_gen_br(done);
+    gen_set_label(normal);
+    tmp = tcg_temp_new_i32();
+    tcg_gen_andi_i32(tmp, cpu_R[15], 1);
+    store_cpu_field(tmp, thumb);
+    tcg_gen_andi_i32(cpu_R[15], cpu_R[15], ~1);
+    gen_set_label(done);
+}
+#endif
+
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
+#ifndef CONFIG_USER_ONLY
+    if (s->m_profile) {
+        gen_bx_v7m(s, var);
+        return;
+    }
+#endif
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -798,6 +1091,55 @@ static inline void store_reg_from_load(CPUARMState *env, DisasContext *s,
     }
 }
 
+#ifndef CONFIG_USER_ONLY
+/* LDM, STM, PUSH and POP of at least this many registers first try to
+   move the whole block at once.  */
+#define LDST_MULTIPLE_FAST_MIN 4
+#endif
+
+/* Start an LDM or STM of the registers in list, with base register rn,
+ * from the address in addr, which must be a local temporary.  If this
+ * returns a label, the whole block may have been moved with a single TLB
+ * check (see HELPER(ldm_fast)) and advance added to addr; the code emitted
+ * up to the label, which does the accesses one by one and must have
+ * advanced addr by as much, is then skipped.  A loaded PC is left to the
+ * code after the label, which is placed before its load: the check
+ * covers its word too, and setting it has more to do than a register
+ * write.  Otherwise it returns -1.
+ */
+static int gen_ldst_multiple_fast(DisasContext *s, TCGv addr, uint32_t list,
+                                  int rn, int load, int32_t advance)
+{
+#ifndef CONFIG_USER_ONLY
+    int slow, done;
+    TCGv tmp;
+
+    if (ctpop16(list) < LDST_MULTIPLE_FAST_MIN || (list & (1 << rn))
+        || (!load && (list & (1 << 15)))) {
+        return -1;
+    }
+
+    /* The lazy flags would not survive the branches.  */
+    gen_flush_cc(s);
+    slow = gen_new_label();
+    done = gen_new_label();
+    tmp = tcg_const_i32(list);
+    if (load) {
+        gen_helper_ldm_fast(tmp, cpu_env, addr, tmp);
+    } else {
+        gen_helper_stm_fast(tmp, cpu_env, addr, tmp);
+    }
+    tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 0, slow);
+    tcg_temp_free_i32(tmp);
+    tcg_gen_addi_i32(addr, addr, advance);
+    tcg_gen_br(done);
+    gen_set_label(slow);
+    return done;
+#else
+    return -1;
+#endif
+}
+
 static inline TCGv gen_ld8s(TCGv addr, int index)
 {
     TCGv tmp = tcg_temp_new_i32();
@@ -855,6 +1197,49 @@ static inline void gen_st64(TCGv_i64 val, TCGv addr, int index)
     tcg_temp_free_i64(val);
 }
 
+/* Load the literal word at ADDR (also in the temp TADDR).  On M profile
+   cores a literal in the first page of the TB is read at translation
+   time, so that the peripheral base addresses in literal pools become
+   constants and tcg can call the device access helpers directly.  The
+   page already holds the TB's code; the word is added to the TB's
+   literal range so that stores to it invalidate the TB as well.  The
+   PMSAv7 MPU needs read permission for instruction fetches, so only a
+   region boundary between the code and its literals could make the
+   load fault where the fetch does not.  */
+static TCGv gen_ld32_literal(CPUARMState *env, DisasContext *s,
+                             uint32_t addr, TCGv taddr, int index)
+{
+#ifndef CONFIG_USER_ONLY
+    TranslationBlock *tb = s->tb;
+    uint32_t page = tb->pc & TARGET_PAGE_MASK;
+    uint32_t start = addr - page;
+    TCGv tmp;
+
+    if (s->m_profile && (addr & 3) == 0 && (addr & TARGET_PAGE_MASK) == page
+        && QTAILQ_EMPTY(&env->watchpoints)) {
+        if (tb->lit_start == tb->lit_end) {
+            tb->lit_start = start;
+            tb->lit_end = start + 4;
+        } else {
+            tb->lit_start = MIN(tb->lit_start, start);
+            tb->lit_end = MAX(tb->lit_end, start + 4);
+        }
+        tmp = tcg_temp_new_i32();
+        tcg_gen_movi_i32(tmp, cpu_ldl_code(env, addr));
+        return tmp;
+    }
+#endif
+    return gen_ld32(taddr, index);
+}
+
+/* Device ranges of the ARMv7-M memory map: Peripheral, External device
+   and System.  Constant addresses in them are accessed through direct
+   helper calls instead of the inline TLB lookup (see tcg_ctx).  */
+static bool arm_v7m_direct_io_addr(tcg_target_ulong addr)
+{
+    return (addr >= 0x40000000 && addr < 0x60000000) || addr >= 0xa0000000;
+}
+
 static inline void gen_set_pc_im(uint32_t val)
 {
     tcg_gen_movi_i32(cpu_R[15], val);
@@ -867,6 +1252,83 @@ static inline void gen_lookup_tb(DisasContext *s)
     s->is_jmp = DISAS_UPDATE;
 }
 
+/* MRS on M profile, into a new temporary.  The registers an RTOS switches
+   contexts with are read inline.  */
+static TCGv gen_v7m_mrs(DisasContext *s, int sysm)
+{
+    TCGv tmp = tcg_temp_new_i32();
+    TCGv tmp2;
+
+    switch (sysm) {
+    case 8: /* MSP */
+    case 9: /* PSP */
+        if ((sysm == 9) == s->v7m_psp) {
+            tcg_gen_mov_i32(tmp, cpu_R[13]);
+        } else {
+            tcg_gen_ld_i32(tmp, cpu_env,
+                           offsetof(CPUARMState, v7m.other_sp));
+        }
+        return tmp;
+    case 16: /* PRIMASK */
+        tcg_gen_ld_i32(tmp, cpu_env, offsetof(CPUARMState, uncached_cpsr));
+        tcg_gen_andi_i32(tmp, tmp, CPSR_I);
+        tcg_gen_setcondi_i32(TCG_COND_NE, tmp, tmp, 0);
+        return tmp;
+    case 17: /* BASEPRI */
+    case 18: /* BASEPRI_MAX */
+        tcg_gen_ld_i32(tmp, cpu_env, offsetof(CPUARMState, v7m.basepri));
+        return tmp;
+    }
+
+    tmp2 = tcg_const_i32(sysm);
+    gen_helper_v7m_mrs(tmp, cpu_env, tmp2);
+    tcg_temp_free_i32(tmp2);
+    return tmp;
+}
+
+/* MSR on M profile.  val is marked as dead.  As for MRS, the registers an
+   RTOS switches contexts with are written inline.  */
+static void gen_v7m_msr(DisasContext *s, int sysm, TCGv val)
+{
+    TCGv tmp;
+
+    switch (sysm) {
+    case 8: /* MSP */
+    case 9: /* PSP */
+        /* Nothing the TB depends on changes.  */
+        if ((sysm == 9) == s->v7m_psp) {
+            tcg_gen_mov_i32(cpu_R[13], val);
+        } else {
+            tcg_gen_st_i32(val, cpu_env,
+                           offsetof(CPUARMState, v7m.other_sp));
+        }
+        tcg_temp_free_i32(val);
+        return;
+    case 16: /* PRIMASK */
+        tmp = load_cpu_field(uncached_cpsr);
+        tcg_gen_andi_i32(tmp, tmp, ~CPSR_I);
+        tcg_gen_andi_i32(val, val, 1);
+        tcg_gen_shli_i32(val, val, 7); /* CPSR_I */
+        tcg_gen_or_i32(tmp, tmp, val);
+        tcg_temp_free_i32(val);
+        store_cpu_field(tmp, uncached_cpsr);
+        /* Unmasking may let an interrupt in.  */
+        gen_lookup_tb(s);
+        return;
+    case 17: /* BASEPRI */
+        tcg_gen_andi_i32(val, val, 0xff);
+        store_cpu_field(val, v7m.basepri);
+        gen_lookup_tb(s);
+        return;
+    }
+
+    tmp = tcg_const_i32(sysm);
+    gen_helper_v7m_msr(cpu_env, tmp, val);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i32(val);
+    gen_lookup_tb(s);
+}
+
 static inline void gen_add_data_offset(DisasContext *s, unsigned int insn,
                                        TCGv var)
 {
@@ -2473,7 +2935,7 @@ static int disas_dsp_insn(CPUARMState *env, DisasContext *s, uint32_t insn)
 #define VFP_SREG(insn, bigbit, smallbit) \
   ((VFP_REG_SHR(insn, bigbit - 1) & 0x1e) | (((insn) >> (smallbit)) & 1))
 #define VFP_DREG(reg, insn, bigbit, smallbit) do { \
-    if (arm_feature(env, ARM_FEATURE_VFP3)) { \
+    if (arm_feature(env, ARM_FEATURE_VFP3) && !s->m_profile) { \
         reg = (((insn) >> (bigbit)) & 0x0f) \
               | (((insn) >> ((smallbit) - 4)) & 0x10); \
     } else { \
@@ -2571,7 +3033,7 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
 
     if (!s->vfp_enabled) {
         /* VFP disabled.  Only allow fmxr/fmrx to/from some control regs.  */
-        if ((insn & 0x0fe00fff) != 0x0ee00a10)
+        if (s->m_profile || (insn & 0x0fe00fff) != 0x0ee00a10)
             return 1;
         rn = (insn >> 16) & 0xf;
         if (rn != ARM_VFP_FPSID && rn != ARM_VFP_FPEXC
@@ -2579,6 +3041,23 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
             return 1;
     }
     dp = ((insn & 0xf00) == 0xb00);
+    if (s->m_profile) {
+        /* FPv4-SP: FPSCR is the only system register, and there is no
+           double precision arithmetic or conversion to double.  */
+        if ((insn & 0x0fe00fff) == 0x0ee00a10
+            && ((insn >> 16) & 0xf) != ARM_VFP_FPSCR)
+            return 1;
+        if ((insn & 0x0f000010) == 0x0e000000
+            && (dp || (insn & 0x00bf0fc0) == 0x00b70ac0))
+            return 1;
+        if (s->v7m_fpprep) {
+            gen_helper_v7m_preserve_fp(cpu_env);
+            /* Later ones run after it, unless this one is skipped.  */
+            if (!s->condjmp) {
+                s->v7m_fpprep = 0;
+            }
+        }
+    }
     switch ((insn >> 24) & 0xf) {
     case 0xe:
         if (insn & (1 << 4)) {
@@ -3380,6 +3859,12 @@ static inline void gen_jmp (DisasContext *s, uint32_t dest)
         if (s->thumb)
             dest |= 1;
         gen_bx_im(s, dest);
+    } else if (!s->condjmp && dest >= s->pc && dest < s->trace_limit) {
+        /* Carry on translating at the target.  Only forward branches in
+           the same page are followed, so the TB still covers all of its
+           code and page invalidation keeps it coherent.  */
+        s->pc = dest;
+        s->trace_jmps++;
     } else {
         gen_goto_tb(s, 0, dest);
         s->is_jmp = DISAS_TB_JUMP;
@@ -3496,6 +3981,7 @@ gen_set_condexec (DisasContext *s)
 
 static void gen_exception_insn(DisasContext *s, int offset, int excp)
 {
+    gen_flush_cc(s);
     gen_set_condexec(s);
     gen_set_pc_im(s->pc - offset);
     gen_exception(excp);
@@ -6444,7 +6930,21 @@ static void gen_logicq_cc(TCGv_i64 val)
 
    In system emulation mode only one CPU will be running at once, so
    this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   throw an exception and handle the atomic operation elsewhere.
+
+   M profile cores clear the monitor on exception entry and return (see
+   do_interrupt_v7m), and nothing else can store between the two
+   instructions of a single core, so there STREX only checks the address
+   and LDREX does not keep the value.  */
+static inline int gen_exclusive_monitor_only(DisasContext *s)
+{
+#ifdef CONFIG_USER_ONLY
+    return 0;
+#else
+    return s->m_profile;
+#endif
+}
+
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv addr, int size)
 {
@@ -6464,14 +6964,18 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
     default:
         abort();
     }
-    tcg_gen_mov_i32(cpu_exclusive_val, tmp);
+    if (!gen_exclusive_monitor_only(s)) {
+        tcg_gen_mov_i32(cpu_exclusive_val, tmp);
+    }
     store_reg(s, rt, tmp);
     if (size == 3) {
         TCGv tmp2 = tcg_temp_new_i32();
         tcg_gen_addi_i32(tmp2, addr, 4);
         tmp = gen_ld32(tmp2, IS_USER(s));
         tcg_temp_free_i32(tmp2);
-        tcg_gen_mov_i32(cpu_exclusive_high, tmp);
+        if (!gen_exclusive_monitor_only(s)) {
+            tcg_gen_mov_i32(cpu_exclusive_high, tmp);
+        }
         store_reg(s, rt2, tmp);
     }
     tcg_gen_mov_i32(cpu_exclusive_addr, addr);
@@ -6508,6 +7012,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     fail_label = gen_new_label();
     done_label = gen_new_label();
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
+    if (gen_exclusive_monitor_only(s)) {
+        goto store;
+    }
     switch (size) {
     case 0:
         tmp = gen_ld8u(addr, IS_USER(s));
@@ -6532,6 +7039,7 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
         tcg_gen_brcond_i32(TCG_COND_NE, tmp, cpu_exclusive_high, fail_label);
         tcg_temp_free_i32(tmp);
     }
+store:
     tmp = load_reg(s, rt);
     switch (size) {
     case 0:
@@ -6574,7 +7082,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
     s->pc += 4;
 
     /* M variants do not implement ARM mode.  */
-    if (IS_M(env))
+    if (s->m_profile)
         goto illegal_op;
     cond = insn >> 28;
     if (cond == 0xf){
@@ -7041,11 +7549,11 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 if (IS_USER(s)) {
                     goto illegal_op;
                 }
-                gen_sub_CC(tmp, tmp, tmp2);
+                gen_sub_CC(s, tmp, tmp, tmp2);
                 gen_exception_return(s, tmp);
             } else {
                 if (set_cc) {
-                    gen_sub_CC(tmp, tmp, tmp2);
+                    gen_sub_CC(s, tmp, tmp, tmp2);
                 } else {
                     tcg_gen_sub_i32(tmp, tmp, tmp2);
                 }
@@ -7054,7 +7562,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
             break;
         case 0x03:
             if (set_cc) {
-                gen_sub_CC(tmp, tmp2, tmp);
+                gen_sub_CC(s, tmp, tmp2, tmp);
             } else {
                 tcg_gen_sub_i32(tmp, tmp2, tmp);
             }
@@ -7062,7 +7570,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
             break;
         case 0x04:
             if (set_cc) {
-                gen_add_CC(tmp, tmp, tmp2);
+                gen_add_CC(s, tmp, tmp, tmp2);
             } else {
                 tcg_gen_add_i32(tmp, tmp, tmp2);
             }
@@ -7108,13 +7616,13 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
             break;
         case 0x0a:
             if (set_cc) {
-                gen_sub_CC(tmp, tmp, tmp2);
+                gen_sub_CC(s, tmp, tmp, tmp2);
             }
             tcg_temp_free_i32(tmp);
             break;
         case 0x0b:
             if (set_cc) {
-                gen_add_CC(tmp, tmp, tmp2);
+                gen_add_CC(s, tmp, tmp, tmp2);
             }
             tcg_temp_free_i32(tmp);
             break;
@@ -7429,12 +7937,10 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                             tcg_gen_shli_i32(tmp, tmp, shift);
                         }
                         sh = (insn >> 16) & 0x1f;
-                        tmp2 = tcg_const_i32(sh);
                         if (insn & (1 << 22))
-                          gen_helper_usat(tmp, cpu_env, tmp, tmp2);
+                            gen_usat(tmp, sh);
                         else
-                          gen_helper_ssat(tmp, cpu_env, tmp, tmp2);
-                        tcg_temp_free_i32(tmp2);
+                            gen_ssat(tmp, sh);
                         store_reg(s, rd, tmp);
                     } else if ((insn & 0x00300fe0) == 0x00200f20) {
                         /* [us]sat16 */
@@ -7706,7 +8212,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
         case 0x08:
         case 0x09:
             {
-                int j, n, user, loaded_base;
+                int j, n, user, loaded_base, done;
                 TCGv loaded_var;
                 /* load/store multiple words */
                 /* XXX: store correct base if write back */
@@ -7719,7 +8225,8 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                         user = 1;
                 }
                 rn = (insn >> 16) & 0xf;
-                addr = load_reg(s, rn);
+                addr = tcg_temp_local_new_i32();
+                load_reg_var(s, addr, rn);
 
                 /* compute total size */
                 loaded_base = 0;
@@ -7747,9 +8254,21 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                         tcg_gen_addi_i32(addr, addr, -((n - 1) * 4));
                     }
                 }
+                if (insn & (1 << 22)) {
+                    done = -1;
+                } else {
+                    /* addr is left on the last word transferred.  */
+                    done = gen_ldst_multiple_fast(s, addr, insn & 0xffff, rn,
+                                                  insn & (1 << 20),
+                                                  (n - 1) * 4);
+                }
                 j = 0;
                 for(i=0;i<16;i++) {
                     if (insn & (1 << i)) {
+                        if (i == 15 && done >= 0) {
+                            gen_set_label(done);
+                            done = -1;
+                        }
                         if (insn & (1 << 20)) {
                             /* load */
                             tmp = gen_ld32(addr, IS_USER(s));
@@ -7787,6 +8306,9 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                             tcg_gen_addi_i32(addr, addr, 4);
                     }
                 }
+                if (done >= 0) {
+                    gen_set_label(done);
+                }
                 if (insn & (1 << 21)) {
                     /* write back */
                     if (insn & (1 << 23)) {
@@ -7901,7 +8423,7 @@ gen_thumb2_data_op(DisasContext *s, int op, int conds, uint32_t shifter_out, TCG
         break;
     case 8: /* add */
         if (conds)
-            gen_add_CC(t0, t0, t1);
+            gen_add_CC(s, t0, t0, t1);
         else
             tcg_gen_add_i32(t0, t0, t1);
         break;
@@ -7919,13 +8441,13 @@ gen_thumb2_data_op(DisasContext *s, int op, int conds, uint32_t shifter_out, TCG
         break;
     case 13: /* sub */
         if (conds)
-            gen_sub_CC(t0, t0, t1);
+            gen_sub_CC(s, t0, t0, t1);
         else
             tcg_gen_sub_i32(t0, t0, t1);
         break;
     case 14: /* rsb */
         if (conds)
-            gen_sub_CC(t0, t1, t0);
+            gen_sub_CC(s, t0, t1, t0);
         else
             tcg_gen_sub_i32(t0, t1, t0);
         break;
@@ -7956,8 +8478,7 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
     int conds;
     int logic_cc;
 
-    if (!(arm_feature(env, ARM_FEATURE_THUMB2)
-          || arm_feature (env, ARM_FEATURE_M))) {
+    if (!(s->m_profile || arm_feature(env, ARM_FEATURE_THUMB2))) {
         /* Thumb-1 cores may need to treat bl and blx as a pair of
            16-bit instructions to get correct prefetch abort behavior.  */
         insn = insn_hw1;
@@ -8163,10 +8684,11 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     }
                 }
             } else {
-                int i, loaded_base = 0;
+                int i, loaded_base = 0, done;
                 TCGv loaded_var;
                 /* Load/store multiple.  */
-                addr = load_reg(s, rn);
+                addr = tcg_temp_local_new_i32();
+                load_reg_var(s, addr, rn);
                 offset = 0;
                 for (i = 0; i < 16; i++) {
                     if (insn & (1 << i))
@@ -8176,10 +8698,17 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     tcg_gen_addi_i32(addr, addr, -offset);
                 }
 
+                done = gen_ldst_multiple_fast(s, addr, insn & 0xffff, rn,
+                                              insn & (1 << 20),
+                                              ctpop16(insn & 0x7fff) * 4);
                 TCGV_UNUSED(loaded_var);
                 for (i = 0; i < 16; i++) {
                     if ((insn & (1 << i)) == 0)
                         continue;
+                    if (i == 15 && done >= 0) {
+                        gen_set_label(done);
+                        done = -1;
+                    }
                     if (insn & (1 << 20)) {
                         /* Load.  */
                         tmp = gen_ld32(addr, IS_USER(s));
@@ -8198,6 +8727,9 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     }
                     tcg_gen_addi_i32(addr, addr, 4);
                 }
+                if (done >= 0) {
+                    gen_set_label(done);
+                }
                 if (loaded_base) {
                     store_reg(s, rn, loaded_var);
                 }
@@ -8528,7 +9060,13 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
         }
         break;
     case 6: case 7: case 14: case 15:
-        /* Coprocessor.  */
+        /* Coprocessor.  M profile only has the floating point extension
+           in CP10 and CP11.  */
+        if (s->m_profile && (!arm_feature(env, ARM_FEATURE_VFP)
+                             || ((insn >> 9) & 7) != 5
+                             || ((insn >> 24) & 3) == 3)) {
+            goto illegal_op;
+        }
         if (((insn >> 24) & 3) == 3) {
             /* Translate into the equivalent ARM encoding.  */
             insn = (insn & 0xe2ffffff) | ((insn & (1 << 28)) >> 4) | (1 << 28);
@@ -8583,18 +9121,13 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     op = (insn >> 20) & 7;
                     switch (op) {
                     case 0: /* msr cpsr.  */
-                        if (IS_M(env)) {
-                            tmp = load_reg(s, rn);
-                            addr = tcg_const_i32(insn & 0xff);
-                            gen_helper_v7m_msr(cpu_env, addr, tmp);
-                            tcg_temp_free_i32(addr);
-                            tcg_temp_free_i32(tmp);
-                            gen_lookup_tb(s);
+                        if (s->m_profile) {
+                            gen_v7m_msr(s, insn & 0xff, load_reg(s, rn));
                             break;
                         }
                         /* fall through */
                     case 1: /* msr spsr.  */
-                        if (IS_M(env))
+                        if (s->m_profile)
                             goto illegal_op;
                         tmp = load_reg(s, rn);
                         if (gen_set_psr(s,
@@ -8638,9 +9171,13 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                             break;
                         case 4: /* dsb */
                         case 5: /* dmb */
-                        case 6: /* isb */
                             /* These execute as NOPs.  */
                             break;
+                        case 6: /* isb */
+                            /* End the TB, so that state written by earlier
+                               instructions (e.g. CPACR) takes effect.  */
+                            gen_lookup_tb(s);
+                            break;
                         default:
                             goto illegal_op;
                         }
@@ -8662,19 +9199,17 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                         gen_exception_return(s, tmp);
                         break;
                     case 6: /* mrs cpsr.  */
-                        tmp = tcg_temp_new_i32();
-                        if (IS_M(env)) {
-                            addr = tcg_const_i32(insn & 0xff);
-                            gen_helper_v7m_mrs(tmp, cpu_env, addr);
-                            tcg_temp_free_i32(addr);
+                        if (s->m_profile) {
+                            tmp = gen_v7m_mrs(s, insn & 0xff);
                         } else {
+                            tmp = tcg_temp_new_i32();
                             gen_helper_cpsr_read(tmp, cpu_env);
                         }
                         store_reg(s, rd, tmp);
                         break;
                     case 7: /* mrs spsr.  */
                         /* Not accessible in user mode.  */
-                        if (IS_USER(s) || IS_M(env))
+                        if (IS_USER(s) || s->m_profile)
                             goto illegal_op;
                         tmp = load_cpu_field(spsr);
                         store_reg(s, rd, tmp);
@@ -8753,21 +9288,18 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                             else
                                 tcg_gen_shli_i32(tmp, tmp, shift);
                         }
-                        tmp2 = tcg_const_i32(imm);
-                        if (op & 4) {
-                            /* Unsigned.  */
-                            if ((op & 1) && shift == 0)
+                        if ((op & 1) && shift == 0) {
+                            tmp2 = tcg_const_i32(imm);
+                            if (op & 4)
                                 gen_helper_usat16(tmp, cpu_env, tmp, tmp2);
                             else
-                                gen_helper_usat(tmp, cpu_env, tmp, tmp2);
-                        } else {
-                            /* Signed.  */
-                            if ((op & 1) && shift == 0)
                                 gen_helper_ssat16(tmp, cpu_env, tmp, tmp2);
-                            else
-                                gen_helper_ssat(tmp, cpu_env, tmp, tmp2);
+                            tcg_temp_free_i32(tmp2);
+                        } else if (op & 4) {
+                            gen_usat(tmp, imm);
+                        } else {
+                            gen_ssat(tmp, imm);
                         }
-                        tcg_temp_free_i32(tmp2);
                         break;
                     }
                     store_reg(s, rd, tmp);
@@ -8863,7 +9395,7 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
         int writeback = 0;
         int user;
         if ((insn & 0x01100000) == 0x01000000) {
-            if (disas_neon_ls_insn(env, s, insn))
+            if (s->m_profile || disas_neon_ls_insn(env, s, insn))
                 goto illegal_op;
             break;
         }
@@ -8971,7 +9503,13 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
             case 4: tmp = gen_ld8s(addr, user); break;
             case 1: tmp = gen_ld16u(addr, user); break;
             case 5: tmp = gen_ld16s(addr, user); break;
-            case 2: tmp = gen_ld32(addr, user); break;
+            case 2:
+                if (rn == 15) {
+                    tmp = gen_ld32_literal(env, s, imm, addr, user);
+                } else {
+                    tmp = gen_ld32(addr, user);
+                }
+                break;
             default:
                 tcg_temp_free_i32(addr);
                 goto illegal_op;
@@ -9010,26 +9548,491 @@ illegal_op:
     return 1;
 }
 
+/* Classify a Thumb instruction for lazy flag evaluation.  */
+#define CC_INSN_FLUSH   0   /* May read C or V, branch or leave the TB.  */
+#define CC_INSN_KEEP    1   /* Neither reads nor writes C or V.  */
+#define CC_INSN_SETS_C  2   /* Overwrites C, does not read C or V.  */
+
+static int thumb2_insn_cc(uint32_t insn)
+{
+    int op, conds;
+
+    op = (insn >> 21) & 0xf;
+    conds = (insn & (1 << 20)) != 0;
+    switch ((insn >> 25) & 0xf) {
+    case 4:
+        /* Load/store multiple.  */
+        if ((insn & (1 << 22)) == 0
+            && ((insn >> 23) & 1) != ((insn >> 24) & 1)) {
+            return CC_INSN_KEEP;
+        }
+        return CC_INSN_FLUSH;
+    case 5:
+        /* Data processing register constant shift.  */
+        if (op == 6) {
+            return CC_INSN_KEEP;
+        }
+        if ((insn & 0x70f0) == 0x0030) {
+            /* RRX reads C.  */
+            return CC_INSN_FLUSH;
+        }
+        if (op <= 4) {
+            if (!conds || ((insn & 0x70f0) == 0)) {
+                return CC_INSN_KEEP;
+            }
+            return CC_INSN_SETS_C;
+        }
+        if (op == 8 || op == 13 || op == 14) {
+            return CC_INSN_KEEP;
+        }
+        return CC_INSN_FLUSH;
+    case 8: case 9: case 10: case 11:
+        if (insn & (1 << 15)) {
+            /* Branches and miscellaneous control.  */
+            return CC_INSN_FLUSH;
+        }
+        if (insn & (1 << 25)) {
+            /* Bitfield, saturate and plain binary immediate.  */
+            return CC_INSN_KEEP;
+        }
+        /* Modified 12-bit immediate.  */
+        if (op <= 4) {
+            if (conds && (insn & 0x04004000)) {
+                return CC_INSN_SETS_C;
+            }
+            return CC_INSN_KEEP;
+        }
+        if (op == 8 || op == 13 || op == 14) {
+            return CC_INSN_KEEP;
+        }
+        return CC_INSN_FLUSH;
+    case 12:
+        /* Load/store single data item.  */
+        if ((insn & 0x01100000) == 0x01000000) {
+            return CC_INSN_FLUSH;
+        }
+        return CC_INSN_KEEP;
+    case 13:
+        /* Multiply, multiply accumulate and divide.  */
+        if (insn & (1 << 24)) {
+            return CC_INSN_KEEP;
+        }
+        return CC_INSN_FLUSH;
+    default:
+        return CC_INSN_FLUSH;
+    }
+}
+
+static int thumb_insn_cc(CPUARMState *env, DisasContext *s)
+{
+    uint32_t insn, op;
+
+    insn = arm_lduw_code(env, s->pc, s->bswap_code);
+    switch (insn >> 12) {
+    case 0: case 1:
+        if ((insn & 0x1800) == 0x1800) {
+            /* add/sub */
+            return CC_INSN_KEEP;
+        }
+        /* shift immediate */
+        if ((insn & 0x07c0) == 0 && (insn & 0x1800) == 0) {
+            return CC_INSN_KEEP;
+        }
+        return CC_INSN_SETS_C;
+    case 2: case 3:
+        /* arithmetic large immediate */
+        return CC_INSN_KEEP;
+    case 4:
+        if ((insn & 0x0c00) == 0) {
+            /* data processing register */
+            op = (insn >> 6) & 0xf;
+            if (op >= 2 && op <= 7) {
+                return CC_INSN_FLUSH;
+            }
+        }
+        /* data processing extended, bx, load literal */
+        return CC_INSN_KEEP;
+    case 5: case 6: case 7: case 8: case 9: case 10: case 12:
+        /* load/store, add to pc or sp, ldm/stm */
+        return CC_INSN_KEEP;
+    case 11:
+        switch ((insn >> 8) & 0xf) {
+        case 0: case 2: case 4: case 5: case 0xa: case 0xc: case 0xd:
+            /* adjust sp, extend, push/pop, rev */
+            return CC_INSN_KEEP;
+        case 0xf:
+            /* it, nop */
+            if ((insn & 0xf) != 0 || (insn & 0xff) == 0) {
+                return CC_INSN_KEEP;
+            }
+            return CC_INSN_FLUSH;
+        default:
+            return CC_INSN_FLUSH;
+        }
+    case 14: case 15:
+        if ((insn >> 11) >= 0x1d) {
+            return thumb2_insn_cc((insn << 16)
+                | arm_lduw_code(env, s->pc + 2, s->bswap_code));
+        }
+        return CC_INSN_FLUSH;
+    default:
+        return CC_INSN_FLUSH;
+    }
+}
+
+/* Return nonzero if the 16-bit Thumb instruction INSN does not write
+   the flags when executed in an IT block.  */
+static int thumb_it_insn_keeps_flags(uint32_t insn)
+{
+    if ((insn & 0xf800) == 0x2800                       /* cmp imm */
+        || ((insn & 0xff00) == 0x4200
+            && (insn & 0x00c0) != 0x0040)               /* tst, cmp, cmn */
+        || (insn & 0xff00) == 0x4500                    /* cmp hi */
+        || (insn & 0xff00) == 0xb600                    /* cps */
+        || (insn >> 11) >= 0x1d) {                      /* 32-bit */
+        return 0;
+    }
+    return 1;
+}
+
+/* Compute or drop pending flags as required by the next instruction.  */
+static void gen_thumb_insn_cc(CPUARMState *env, DisasContext *s)
+{
+    if (s->condexec_mask) {
+        gen_flush_cc(s);
+        return;
+    }
+    switch (thumb_insn_cc(env, s)) {
+    case CC_INSN_FLUSH:
+        gen_flush_cc(s);
+        break;
+    case CC_INSN_SETS_C:
+        s->cc_pending &= ~CC_PENDING_C;
+        break;
+    }
+}
+
+/* Estimated Cortex-M3/M4 execution times, from the instruction timing
+   tables of their Technical Reference Manuals.  A taken branch refills
+   the pipeline, which takes 1 to 3 cycles.  The cost of a TB is fixed
+   when it is translated, so conditional branches are charged halfway
+   between taken and not taken, and divides their typical time.  */
+#define CYCLES_REFILL   2
+#define CYCLES_BRANCH   (1 + CYCLES_REFILL)
+#define CYCLES_BCOND    (1 + CYCLES_REFILL / 2)
+#define CYCLES_LOAD     2
+#define CYCLES_DIV      7
+#define CYCLES_VDIV     14
+
+/* Wait states of a read from ADDR.  On-chip flash is the only memory
+   that has any.  */
+static int arm_flash_wait_states(CPUARMState *env, uint32_t addr)
+{
+    if ((addr - env->flash_timing.base < env->flash_timing.size) ||
+        (env->flash_timing.boot_alias && addr < env->flash_timing.size)) {
+        return env->flash_timing.wait_states;
+    }
+    return 0;
+}
+
+/* Stall cycles for fetching the LEN byte instruction at s->pc, which
+   executes in CYCLES.  Flash is read a line at a time.  The first line
+   after a branch always waits.  Without the prefetch buffer so does
+   every line, with it the next line is fetched while the current one
+   executes.  */
+static int thumb_fetch_cycles(CPUARMState *env, DisasContext *s, int len,
+                              int cycles)
+{
+    int ws = arm_flash_wait_states(env, s->pc);
+    uint32_t last;
+    int stall = 0;
+
+    if (ws == 0) {
+        s->fetch_next = 1;
+        return 0;
+    }
+    last = (s->pc + len - 1) / env->flash_timing.line_bytes;
+    if (s->pc != s->fetch_next) {
+        stall = ws;
+        s->fetch_line = s->pc / env->flash_timing.line_bytes;
+        s->fetch_cycles = 0;
+    }
+    while (s->fetch_line != last) {
+        s->fetch_line++;
+        if (env->flash_timing.prefetch) {
+            stall += MAX(0, ws + 1 - s->fetch_cycles);
+        } else {
+            stall += ws;
+        }
+        s->fetch_cycles = 0;
+    }
+    s->fetch_cycles += cycles;
+    s->fetch_next = s->pc + len;
+    return stall;
+}
+
+static int vfp_insn_cycles(uint32_t hw1, uint32_t hw2)
+{
+    if ((hw1 & 0xef00) == 0xee00) {
+        if (hw2 & (1 << 4)) {
+            /* vmov, vmrs, vmsr */
+            return 1;
+        }
+        switch ((hw1 >> 4) & 0xb) {
+        case 0: case 1: case 9: case 0xa:
+            /* vmla, vmls, vnmla, vnmls, vfma, vfms, vfnma, vfnms */
+            return 3;
+        case 8:
+            /* vdiv */
+            return CYCLES_VDIV;
+        case 0xb:
+            if ((hw1 & 0xf) == 1 && (hw2 & 0xc0) == 0xc0) {
+                /* vsqrt */
+                return CYCLES_VDIV;
+            }
+            /* vmov imm, vabs, vneg, vcmp, vcvt */
+            return 1;
+        default:
+            /* vmul, vnmul, vadd, vsub */
+            return 1;
+        }
+    }
+    if ((hw1 & 0xffe0) == 0xec40) {
+        /* vmov between two core registers and a pair */
+        return 2;
+    }
+    if ((hw1 & 0xef20) == 0xed00) {
+        /* vldr, vstr */
+        return CYCLES_LOAD;
+    }
+    /* vldm, vstm, vpush, vpop */
+    return 1 + (hw2 & 0xff);
+}
+
+/* LDST is set for single loads and stores, LITERAL for loads relative
+   to the PC.  */
+static int thumb2_insn_cycles(DisasContext *s, uint32_t hw1, uint32_t hw2,
+                              int *ldst, int *literal)
+{
+    int cycles;
+
+    switch (hw1 >> 11) {
+    case 0x1d:
+        if ((hw1 & 0xec00) == 0xec00) {
+            return vfp_insn_cycles(hw1, hw2);
+        }
+        if ((hw1 & 0xfe40) == 0xe800) {
+            /* ldm, stm */
+            cycles = 1 + ctpop16(hw2);
+            if ((hw1 & (1 << 4)) && (hw2 & (1 << 15))) {
+                cycles += CYCLES_REFILL;
+            }
+            return cycles;
+        }
+        if ((hw1 & 0xfe40) == 0xe840) {
+            if ((hw1 & 0xfff0) == 0xe8d0 && (hw2 & 0xffe0) == 0xf000) {
+                /* tbb, tbh */
+                return CYCLES_LOAD + CYCLES_REFILL;
+            }
+            if (hw1 & 0x0120) {
+                /* ldrd, strd */
+                *literal = (hw1 & 0x1f) == 0x1f;
+                return 1 + CYCLES_LOAD;
+            }
+            /* load/store exclusive */
+            return CYCLES_LOAD;
+        }
+        /* data processing register */
+        return 1;
+    case 0x1e:
+        if ((hw2 & (1 << 15)) == 0) {
+            /* data processing immediate */
+            return 1;
+        }
+        if (hw2 & (1 << 12)) {
+            /* b, bl */
+            return CYCLES_BRANCH;
+        }
+        if (((hw1 >> 6) & 0xe) != 0xe) {
+            /* conditional branch */
+            return CYCLES_BCOND;
+        }
+        if ((hw1 & 0xfff0) == 0xf3b0 && ((hw2 >> 4) & 0xf) == 6) {
+            /* isb */
+            return 1 + CYCLES_REFILL;
+        }
+        if ((hw1 & 0xffe0) == 0xf380 || (hw1 & 0xffe0) == 0xf3e0 ||
+            (hw1 & 0xfff0) == 0xf3b0) {
+            /* msr, mrs, dsb, dmb */
+            return 2;
+        }
+        /* hints */
+        return 1;
+    default:
+        if ((hw1 & 0xec00) == 0xec00) {
+            return vfp_insn_cycles(hw1, hw2);
+        }
+        if ((hw1 & 0xfe00) == 0xf800) {
+            /* load/store single */
+            *ldst = 1;
+            *literal = (hw1 & 0x1f) == 0x1f;
+            if ((hw1 & (1 << 4)) && (hw2 >> 12) == 15) {
+                return CYCLES_LOAD + CYCLES_REFILL;
+            }
+            return CYCLES_LOAD;
+        }
+        if ((hw1 & 0xff80) == 0xfb00) {
+            if ((hw1 & 0x70) == 0 && (hw2 >> 12) != 15 && !s->cycles_m4) {
+                /* mla, mls */
+                return 2;
+            }
+            /* mul, dsp multiplies */
+            return 1;
+        }
+        if ((hw1 & 0xff80) == 0xfb80) {
+            switch ((hw1 >> 4) & 7) {
+            case 1: case 3:
+                /* sdiv, udiv */
+                return CYCLES_DIV;
+            case 0: case 2:
+                /* smull, umull */
+                return s->cycles_m4 ? 1 : 4;
+            default:
+                /* smlal, umlal and variants */
+                return s->cycles_m4 ? 1 : 5;
+            }
+        }
+        /* data processing register */
+        return 1;
+    }
+}
+
+/* Cycles the instruction at s->pc takes to fetch and execute, for
+   -tcg cycles=on.  */
+static int thumb_insn_cycles(CPUARMState *env, DisasContext *s)
+{
+    uint32_t insn;
+    int cycles, len = 2;
+    int ldst = 0, literal = 0;
+
+    insn = arm_lduw_code(env, s->pc, s->bswap_code);
+    switch (insn >> 12) {
+    case 0: case 1: case 2: case 3:
+        /* shift, add, sub, mov, cmp */
+        cycles = 1;
+        break;
+    case 4:
+        if (insn & (1 << 11)) {
+            /* load literal */
+            cycles = CYCLES_LOAD;
+            ldst = literal = 1;
+        } else if ((insn & 0x0f00) == 0x0700) {
+            /* bx, blx */
+            cycles = CYCLES_BRANCH;
+        } else if ((insn & 0x0c87) == 0x0487 && (insn & 0x0300) != 0x0100) {
+            /* add or mov to pc */
+            cycles = CYCLES_BRANCH;
+        } else {
+            /* data processing register, including mul */
+            cycles = 1;
+        }
+        break;
+    case 5: case 6: case 7: case 8: case 9:
+        /* load/store single */
+        cycles = CYCLES_LOAD;
+        ldst = 1;
+        break;
+    case 11:
+        switch ((insn >> 8) & 0xf) {
+        case 4: case 5:
+            /* push */
+            cycles = 1 + ctpop8(insn & 0xff) + ((insn >> 8) & 1);
+            break;
+        case 0xc: case 0xd:
+            /* pop */
+            cycles = 1 + ctpop8(insn & 0xff);
+            if (insn & (1 << 8)) {
+                cycles += 1 + CYCLES_REFILL;
+            }
+            break;
+        case 1: case 3: case 9: case 0xb:
+            /* cbz, cbnz */
+            cycles = CYCLES_BCOND;
+            break;
+        default:
+            /* adjust sp, extend, rev, cps, bkpt, it, hints */
+            cycles = 1;
+            break;
+        }
+        break;
+    case 12:
+        /* ldm, stm */
+        cycles = 1 + ctpop8(insn & 0xff);
+        break;
+    case 13:
+        /* conditional branch, udf, svc */
+        cycles = ((insn >> 8) & 0xf) >= 0xe ? 1 : CYCLES_BCOND;
+        break;
+    case 14:
+        if ((insn >> 11) == 0x1c) {
+            /* unconditional branch */
+            cycles = CYCLES_BRANCH;
+            break;
+        }
+        /* fall through */
+    case 15:
+        len = 4;
+        cycles = thumb2_insn_cycles(s, insn,
+                                    arm_lduw_code(env, s->pc + 2,
+                                                  s->bswap_code),
+                                    &ldst, &literal);
+        break;
+    default:
+        /* adr, add sp */
+        cycles = 1;
+        break;
+    }
+
+    /* Neighbouring loads and stores overlap their address and data
+       phases.  */
+    if (ldst && s->cycles_ldst) {
+        cycles--;
+    }
+    s->cycles_ldst = ldst;
+    if (literal) {
+        cycles += arm_flash_wait_states(env, s->pc);
+    }
+    return cycles + thumb_fetch_cycles(env, s, len, cycles);
+}
+
 static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
 {
     uint32_t val, insn, op, rm, rn, rd, shift, cond;
     int32_t offset;
-    int i;
+    int i, done;
     TCGv tmp;
     TCGv tmp2;
     TCGv addr;
 
+    if (s->cc_pending) {
+        gen_thumb_insn_cc(env, s);
+    }
+
     if (s->condexec_mask) {
         cond = s->condexec_cond;
-        if (cond != 0x0e) {     /* Skip conditional when condition is AL. */
+        /* Skip conditional when condition is AL, or when the condition
+           test of a previous instruction in the IT block still applies. */
+        if (cond != 0x0e && !s->condjmp) {
           s->condlabel = gen_new_label();
           gen_test_cc(cond ^ 1, s->condlabel);
           s->condjmp = 1;
+          s->it_cond = cond;
         }
     }
 
     insn = arm_lduw_code(env, s->pc, s->bswap_code);
     s->pc += 2;
+    s->it_keeps_flags = thumb_it_insn_keeps_flags(insn);
 
     switch (insn >> 12) {
     case 0: case 1:
@@ -9053,12 +10056,12 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 if (s->condexec_mask)
                     tcg_gen_sub_i32(tmp, tmp, tmp2);
                 else
-                    gen_sub_CC(tmp, tmp, tmp2);
+                    gen_sub_CC(s, tmp, tmp, tmp2);
             } else {
                 if (s->condexec_mask)
                     tcg_gen_add_i32(tmp, tmp, tmp2);
                 else
-                    gen_add_CC(tmp, tmp, tmp2);
+                    gen_add_CC(s, tmp, tmp, tmp2);
             }
             tcg_temp_free_i32(tmp2);
             store_reg(s, rd, tmp);
@@ -9089,7 +10092,7 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
             tcg_gen_movi_i32(tmp2, insn & 0xff);
             switch (op) {
             case 1: /* cmp */
-                gen_sub_CC(tmp, tmp, tmp2);
+                gen_sub_CC(s, tmp, tmp, tmp2);
                 tcg_temp_free_i32(tmp);
                 tcg_temp_free_i32(tmp2);
                 break;
@@ -9097,7 +10100,7 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 if (s->condexec_mask)
                     tcg_gen_add_i32(tmp, tmp, tmp2);
                 else
-                    gen_add_CC(tmp, tmp, tmp2);
+                    gen_add_CC(s, tmp, tmp, tmp2);
                 tcg_temp_free_i32(tmp2);
                 store_reg(s, rd, tmp);
                 break;
@@ -9105,7 +10108,7 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 if (s->condexec_mask)
                     tcg_gen_sub_i32(tmp, tmp, tmp2);
                 else
-                    gen_sub_CC(tmp, tmp, tmp2);
+                    gen_sub_CC(s, tmp, tmp, tmp2);
                 tcg_temp_free_i32(tmp2);
                 store_reg(s, rd, tmp);
                 break;
@@ -9120,7 +10123,7 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
             val &= ~(uint32_t)2;
             addr = tcg_temp_new_i32();
             tcg_gen_movi_i32(addr, val);
-            tmp = gen_ld32(addr, IS_USER(s));
+            tmp = gen_ld32_literal(env, s, val, addr, IS_USER(s));
             tcg_temp_free_i32(addr);
             store_reg(s, rd, tmp);
             break;
@@ -9141,7 +10144,7 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
             case 1: /* cmp */
                 tmp = load_reg(s, rd);
                 tmp2 = load_reg(s, rm);
-                gen_sub_CC(tmp, tmp, tmp2);
+                gen_sub_CC(s, tmp, tmp, tmp2);
                 tcg_temp_free_i32(tmp2);
                 tcg_temp_free_i32(tmp);
                 break;
@@ -9254,14 +10257,14 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
             if (s->condexec_mask)
                 tcg_gen_neg_i32(tmp, tmp2);
             else
-                gen_sub_CC(tmp, tmp, tmp2);
+                gen_sub_CC(s, tmp, tmp, tmp2);
             break;
         case 0xa: /* cmp */
-            gen_sub_CC(tmp, tmp, tmp2);
+            gen_sub_CC(s, tmp, tmp, tmp2);
             rd = 16;
             break;
         case 0xb: /* cmn */
-            gen_add_CC(tmp, tmp, tmp2);
+            gen_add_CC(s, tmp, tmp, tmp2);
             rd = 16;
             break;
         case 0xc: /* orr */
@@ -9471,7 +10474,8 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
             break;
         case 4: case 5: case 0xc: case 0xd:
             /* push/pop */
-            addr = load_reg(s, 13);
+            addr = tcg_temp_local_new_i32();
+            load_reg_var(s, addr, 13);
             if (insn & (1 << 8))
                 offset = 4;
             else
@@ -9483,6 +10487,12 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
             if ((insn & (1 << 11)) == 0) {
                 tcg_gen_addi_i32(addr, addr, -offset);
             }
+            val = insn & 0xff;
+            if (insn & (1 << 8)) {
+                val |= 1 << ((insn & (1 << 11)) ? 15 : 14);
+            }
+            done = gen_ldst_multiple_fast(s, addr, val, 13, insn & (1 << 11),
+                                          ctpop16(val & 0x7fff) * 4);
             for (i = 0; i < 8; i++) {
                 if (insn & (1 << i)) {
                     if (insn & (1 << 11)) {
@@ -9499,6 +10509,10 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 }
             }
             TCGV_UNUSED(tmp);
+            if ((val & (1 << 15)) && done >= 0) {
+                gen_set_label(done);
+                done = -1;
+            }
             if (insn & (1 << 8)) {
                 if (insn & (1 << 11)) {
                     /* pop pc */
@@ -9512,6 +10526,9 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 }
                 tcg_gen_addi_i32(addr, addr, 4);
             }
+            if (done >= 0) {
+                gen_set_label(done);
+            }
             if ((insn & (1 << 11)) == 0) {
                 tcg_gen_addi_i32(addr, addr, -offset);
             }
@@ -9552,6 +10569,18 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
 
         case 0xe: /* bkpt */
             ARCH(5);
+#ifndef CONFIG_USER_ONLY
+            /* Make M-profile semihosting calls directly rather than
+             * through the debug exception.  */
+            if (IS_M(env) && semihosting_enabled && (insn & 0xff) == 0xab) {
+                gen_flush_cc(s);
+                gen_set_condexec(s);
+                gen_set_pc_im(s->pc - 2);
+                gen_helper_semihosting(cpu_env);
+                gen_lookup_tb(s);
+                break;
+            }
+#endif
             gen_exception_insn(s, 2, EXCP_BKPT);
             break;
 
@@ -9585,21 +10614,17 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 if (IS_USER(s)) {
                     break;
                 }
-                if (IS_M(env)) {
-                    tmp = tcg_const_i32((insn & (1 << 4)) != 0);
+                if (s->m_profile) {
                     /* FAULTMASK */
                     if (insn & 1) {
-                        addr = tcg_const_i32(19);
-                        gen_helper_v7m_msr(cpu_env, addr, tmp);
-                        tcg_temp_free_i32(addr);
+                        tmp = tcg_const_i32((insn & (1 << 4)) != 0);
+                        gen_v7m_msr(s, 19, tmp);
                     }
                     /* PRIMASK */
                     if (insn & 2) {
-                        addr = tcg_const_i32(16);
-                        gen_helper_v7m_msr(cpu_env, addr, tmp);
-                        tcg_temp_free_i32(addr);
+                        tmp = tcg_const_i32((insn & (1 << 4)) != 0);
+                        gen_v7m_msr(s, 16, tmp);
                     }
-                    tcg_temp_free_i32(tmp);
                     gen_lookup_tb(s);
                 } else {
                     if (insn & (1 << 4)) {
@@ -9626,7 +10651,11 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
         TCGv loaded_var;
         TCGV_UNUSED(loaded_var);
         rn = (insn >> 8) & 0x7;
-        addr = load_reg(s, rn);
+        addr = tcg_temp_local_new_i32();
+        load_reg_var(s, addr, rn);
+        done = gen_ldst_multiple_fast(s, addr, insn & 0xff, rn,
+                                      insn & (1 << 11),
+                                      ctpop8(insn & 0xff) * 4);
         for (i = 0; i < 8; i++) {
             if (insn & (1 << i)) {
                 if (insn & (1 << 11)) {
@@ -9646,6 +10675,9 @@ static void disas_thumb_insn(CPUARMState *env, DisasContext *s)
                 tcg_gen_addi_i32(addr, addr, 4);
             }
         }
+        if (done >= 0) {
+            gen_set_label(done);
+        }
         if ((insn & (1 << rn)) == 0) {
             /* base reg not in list: base register writeback */
             store_reg(s, rn, addr);
@@ -9709,6 +10741,78 @@ undef:
     gen_exception_insn(s, 2, EXCP_UDEF);
 }
 
+#ifndef CONFIG_USER_ONLY
+static const struct {
+    const char *name;
+    int kind;
+} memfunc_names[] = {
+    { "memcpy", ARM_MEMFUNC_COPY },
+    { "memmove", ARM_MEMFUNC_COPY },
+    { "__aeabi_memcpy", ARM_MEMFUNC_COPY },
+    { "__aeabi_memcpy4", ARM_MEMFUNC_COPY },
+    { "__aeabi_memcpy8", ARM_MEMFUNC_COPY },
+    { "__aeabi_memmove", ARM_MEMFUNC_COPY },
+    { "__aeabi_memmove4", ARM_MEMFUNC_COPY },
+    { "__aeabi_memmove8", ARM_MEMFUNC_COPY },
+    { "memset", ARM_MEMFUNC_SET },
+    { "__aeabi_memset", ARM_MEMFUNC_AEABI_SET },
+    { "__aeabi_memset4", ARM_MEMFUNC_AEABI_SET },
+    { "__aeabi_memset8", ARM_MEMFUNC_AEABI_SET },
+    { "__aeabi_memclr", ARM_MEMFUNC_AEABI_CLR },
+    { "__aeabi_memclr4", ARM_MEMFUNC_AEABI_CLR },
+    { "__aeabi_memclr8", ARM_MEMFUNC_AEABI_CLR },
+};
+
+/* The entry points of the functions above in the guest image, looked up
+   when the first TB is translated, after the board has loaded it.  */
+static hwaddr memfunc_addr[ARRAY_SIZE(memfunc_names)];
+static bool memfunc_found[ARRAY_SIZE(memfunc_names)];
+static bool memfunc_resolved;
+
+/* With -tcg memfuncs=on, the TB at the entry point of one of the guest's
+   memory functions first tries to do the whole call in
+   HELPER(memfunc), and leaves having returned from it if that worked.
+   This must be decided the same way when search_pc retranslates the TB.  */
+static void gen_memfunc(CPUARMState *env, DisasContext *dc)
+{
+    int i, done;
+    TCGv tmp;
+
+    if (!tcg_memfuncs || !dc->m_profile || !dc->thumb
+        || dc->condexec_mask || dc->condexec_cond
+        || dc->singlestep_enabled
+        || (unlikely(!QTAILQ_EMPTY(&env->breakpoints))
+            && cpu_breakpoint_at(env, dc->pc))) {
+        return;
+    }
+
+    if (!memfunc_resolved) {
+        for (i = 0; i < ARRAY_SIZE(memfunc_names); i++) {
+            memfunc_found[i] = lookup_symbol_addr(memfunc_names[i].name,
+                                                  &memfunc_addr[i]);
+        }
+        memfunc_resolved = true;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(memfunc_names); i++) {
+        if (memfunc_found[i] && memfunc_addr[i] == dc->pc) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(memfunc_names)) {
+        return;
+    }
+
+    done = gen_new_label();
+    tmp = tcg_const_i32(memfunc_names[i].kind);
+    gen_helper_memfunc(tmp, cpu_env, tmp);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 0, done);
+    tcg_temp_free_i32(tmp);
+    tcg_gen_exit_tb(0);
+    gen_set_label(done);
+}
+#endif
+
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
    basic block 'tb'. If search_pc is TRUE, also generate PC
    information for each intermediate instruction. */
@@ -9717,18 +10821,20 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
                                                   int search_pc)
 {
     DisasContext dc1, *dc = &dc1;
-    CPUBreakpoint *bp;
     uint16_t *gen_opc_end;
     int j, lj;
     target_ulong pc_start;
     uint32_t next_page_start;
     int num_insns;
     int max_insns;
+    int num_cycles, max_cycles, cycles;
 
     /* generate intermediate code */
     pc_start = tb->pc;
 
     dc->tb = tb;
+    tb->lit_start = 0;
+    tb->lit_end = 0;
 
     gen_opc_end = tcg_ctx.gen_opc_buf + OPC_MAX_SIZE;
 
@@ -9738,12 +10844,16 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
     dc->condjmp = 0;
     dc->thumb = ARM_TBFLAG_THUMB(tb->flags);
     dc->bswap_code = ARM_TBFLAG_BSWAP_CODE(tb->flags);
+    dc->m_profile = IS_M(env);
+    tcg_ctx.direct_io_addr = dc->m_profile ? arm_v7m_direct_io_addr : NULL;
     dc->condexec_mask = (ARM_TBFLAG_CONDEXEC(tb->flags) & 0xf) << 1;
     dc->condexec_cond = ARM_TBFLAG_CONDEXEC(tb->flags) >> 4;
 #if !defined(CONFIG_USER_ONLY)
     dc->user = (ARM_TBFLAG_PRIV(tb->flags) == 0);
 #endif
     dc->vfp_enabled = ARM_TBFLAG_VFPEN(tb->flags);
+    dc->v7m_fpprep = ARM_TBFLAG_V7M_FPPREP(tb->flags);
+    dc->v7m_psp = ARM_TBFLAG_V7M_PSP(tb->flags);
     dc->vec_len = ARM_TBFLAG_VECLEN(tb->flags);
     dc->vec_stride = ARM_TBFLAG_VECSTRIDE(tb->flags);
     cpu_F0s = tcg_temp_new_i32();
@@ -9754,14 +10864,41 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
     cpu_V1 = cpu_F1d;
     /* FIXME: cpu_M0 can probably be the same as cpu_V0.  */
     cpu_M0 = tcg_temp_new_i64();
+    dc->lazy_cc = dc->thumb && ARM_TBFLAG_LAZY_CC(tb->flags);
+    dc->cc_pending = 0;
+    if (dc->lazy_cc) {
+        cpu_cc_src1 = tcg_temp_new_i32();
+        cpu_cc_src2 = tcg_temp_new_i32();
+        cpu_cc_dst = tcg_temp_new_i32();
+    }
     next_page_start = (pc_start & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+    dc->trace_limit = tcg_traces ? next_page_start : 0;
+    dc->trace_jmps = 0;
+    dc->cycles_m4 = (arm_env_get_cpu(env)->midr & 0xfff0) == 0xc240;
+    dc->cycles_ldst = 0;
+    /* Never a Thumb pc, so the first fetch counts as a branch target.  */
+    dc->fetch_next = 1;
     lj = -1;
     num_insns = 0;
     max_insns = tb->cflags & CF_COUNT_MASK;
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
+    /* The instruction counter counts cycles with -tcg cycles=on.  The
+       count limit is then in cycles too, except for the instruction
+       count that cpu_io_recompile asks for.  */
+    num_cycles = 0;
+    max_cycles = 0;
+    if (tcg_cycles && !(tb->cflags & CF_LAST_IO)) {
+        max_cycles = tb->cflags & CF_COUNT_MASK;
+        max_insns = CF_COUNT_MASK;
+    }
 
     gen_icount_start();
+    gen_tb_profile(tb);
+    gen_tb_coverage(tb);
+#ifndef CONFIG_USER_ONLY
+    gen_memfunc(env, dc);
+#endif
 
     tcg_clear_temp_count();
 
@@ -9814,28 +10951,27 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
             dc->is_jmp = DISAS_UPDATE;
             break;
         }
-#else
-        if (dc->pc >= 0xfffffff0 && IS_M(env)) {
-            /* We always get here via a jump, so know we are not in a
-               conditional execution block.  */
-            gen_exception(EXCP_EXCEPTION_EXIT);
-            dc->is_jmp = DISAS_UPDATE;
-            break;
-        }
 #endif
 
-        if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
-            QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
-                if (bp->pc == dc->pc) {
-                    gen_exception_insn(dc, 0, EXCP_DEBUG);
-                    /* Advance PC so that clearing the breakpoint will
-                       invalidate this TB.  */
-                    dc->pc += 2;
-                    goto done_generating;
-                    break;
-                }
+        if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))
+            && cpu_breakpoint_at(env, dc->pc)) {
+            gen_exception_insn(dc, 0, EXCP_DEBUG);
+            /* Advance PC so that clearing the breakpoint will
+               invalidate this TB.  */
+            dc->pc += 2;
+            goto done_generating;
+        }
+        cycles = 1;
+        if (tcg_cycles && dc->m_profile) {
+            cycles = thumb_insn_cycles(env, dc);
+            /* The first instruction always goes in, so that the CPU can
+               make progress on whatever is left of its budget.  */
+            if (max_cycles && num_insns > 0 &&
+                num_cycles + cycles > max_cycles) {
+                break;
             }
         }
+
         if (search_pc) {
             j = tcg_ctx.gen_opc_ptr - tcg_ctx.gen_opc_buf;
             if (lj < j) {
@@ -9846,7 +10982,7 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
             tcg_ctx.gen_opc_pc[lj] = dc->pc;
             gen_opc_condexec_bits[lj] = (dc->condexec_cond << 4) | (dc->condexec_mask >> 1);
             tcg_ctx.gen_opc_instr_start[lj] = 1;
-            tcg_ctx.gen_opc_icount[lj] = num_insns;
+            tcg_ctx.gen_opc_icount[lj] = num_cycles;
         }
 
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO))
@@ -9871,8 +11007,29 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         }
 
         if (dc->condjmp && !dc->is_jmp) {
-            gen_set_label(dc->condlabel);
-            dc->condjmp = 0;
+            if (dc->thumb && dc->condexec_mask && dc->it_keeps_flags
+                && !(tb->cflags & CF_LAST_IO)
+                && QTAILQ_EMPTY(&env->breakpoints)
+                && !env->singlestep_enabled && !singlestep
+                && dc->pc < next_page_start
+                && num_insns + 1 < max_insns
+                && !max_cycles
+                && tcg_ctx.gen_opc_ptr < gen_opc_end) {
+                /* The flags have not changed, so the rest of the IT block
+                   is translated within the same condition test.  An else
+                   instruction starts at the label, and the then part
+                   branches over it.  */
+                if (dc->condexec_cond != dc->it_cond) {
+                    int label = gen_new_label();
+                    tcg_gen_br(label);
+                    gen_set_label(dc->condlabel);
+                    dc->condlabel = label;
+                    dc->it_cond = dc->condexec_cond;
+                }
+            } else {
+                gen_set_label(dc->condlabel);
+                dc->condjmp = 0;
+            }
         }
 
         if (tcg_check_temp_count()) {
@@ -9884,12 +11041,15 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
          * Also stop translation when a page boundary is reached.  This
          * ensures prefetch aborts occur at the right place.  */
         num_insns ++;
+        num_cycles += cycles;
     } while (!dc->is_jmp && tcg_ctx.gen_opc_ptr < gen_opc_end &&
              !env->singlestep_enabled &&
              !singlestep &&
              dc->pc < next_page_start &&
              num_insns < max_insns);
 
+    gen_flush_cc(dc);
+
     if (tb->cflags & CF_LAST_IO) {
         if (dc->condjmp) {
             /* FIXME:  This can theoretically happen with self-modifying
@@ -9939,8 +11099,10 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            gen_lookup_and_goto_ptr();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -9964,7 +11126,10 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
     }
 
 done_generating:
-    gen_icount_end(tb, num_insns);
+    if (max_cycles) {
+        num_cycles = MIN(num_cycles, max_cycles);
+    }
+    gen_icount_end(tb, num_cycles);
     *tcg_ctx.gen_opc_ptr = INDEX_op_end;
 
 #ifdef DEBUG_DISAS
@@ -9983,7 +11148,12 @@ done_generating:
             tcg_ctx.gen_opc_instr_start[lj++] = 0;
     } else {
         tb->size = dc->pc - pc_start;
-        tb->icount = num_insns;
+        tb->icount = num_cycles;
+        tb_gen_insn_count += num_insns;
+        if (dc->trace_jmps) {
+            tb_trace_count++;
+            tb_trace_jmp_count += dc->trace_jmps;
+        }
     }
 }
 
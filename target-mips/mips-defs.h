@@ -8,6 +8,8 @@
 #define TARGET_PAGE_BITS 12
 #define MIPS_TLB_MAX 128
 
+#define TARGET_ALIGNED_ONLY
+
 #if defined(TARGET_MIPS64)
 #define TARGET_LONG_BITS 64
 #define TARGET_PHYS_ADDR_SPACE_BITS 36
@@ -23,6 +23,8 @@
 # endif
 #endif
 
+#define TARGET_ALIGNED_ONLY
+
 #define CPUArchState struct CPUSPARCState
 
 #include "exec/cpu-defs.h"
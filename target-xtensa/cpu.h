@@ -46,6 +46,8 @@
 #define TARGET_VIRT_ADDR_SPACE_BITS 32
 #define TARGET_PAGE_BITS 12
 
+#define TARGET_ALIGNED_ONLY
+
 enum {
     /* Additional instructions */
     XTENSA_OPTION_CODE_DENSITY,
@@ -0,0 +1,1545 @@
+/*
+ * Tiny Code Generator for QEMU
+ *
+ * AArch64 host backend
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
+    "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7",
+    "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+    "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+    "x24", "x25", "x26", "x27", "x28", "fp", "lr", "sp",
+};
+#endif
+
+static const int tcg_target_reg_alloc_order[] = {
+    /* callee saved registers first, they survive helper calls */
+    TCG_REG_X20, TCG_REG_X21, TCG_REG_X22, TCG_REG_X23,
+    TCG_REG_X24, TCG_REG_X25, TCG_REG_X26, TCG_REG_X27,
+    TCG_REG_X28,
+
+    TCG_REG_X8, TCG_REG_X9, TCG_REG_X10, TCG_REG_X11,
+    TCG_REG_X12, TCG_REG_X13, TCG_REG_X14, TCG_REG_X15,
+    TCG_REG_X16, TCG_REG_X17,
+
+    /* argument registers last, qemu_ld/st and calls need them */
+    TCG_REG_X7, TCG_REG_X6, TCG_REG_X5, TCG_REG_X4,
+    TCG_REG_X3, TCG_REG_X2, TCG_REG_X1, TCG_REG_X0,
+};
+
+static const int tcg_target_call_iarg_regs[8] = {
+    TCG_REG_X0, TCG_REG_X1, TCG_REG_X2, TCG_REG_X3,
+    TCG_REG_X4, TCG_REG_X5, TCG_REG_X6, TCG_REG_X7,
+};
+static const int tcg_target_call_oarg_regs[1] = {
+    TCG_REG_X0,
+};
+
+/* Scratch register for the backend.  The link register is saved by the
+   prologue and only clobbered by calls, so it is free inside an op.  */
+#define TCG_REG_TMP TCG_REG_LR
+
+#ifndef CONFIG_SOFTMMU
+/* Holds GUEST_BASE for the whole TB, loaded by the prologue.  */
+# define TCG_REG_GUEST_BASE TCG_REG_X28
+#endif
+
+static uint8_t *tb_ret_addr;
+
+/* Direct branches and calls reach +-128MB.  */
+static inline bool reloc_pc26_ok(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long offset = (target - (tcg_target_long)code_ptr) >> 2;
+    return offset >= -0x2000000 && offset < 0x2000000;
+}
+
+static inline void reloc_pc26(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long offset = (target - (tcg_target_long)code_ptr) >> 2;
+    uint32_t insn = *(uint32_t *)code_ptr;
+
+    assert(offset >= -0x2000000 && offset < 0x2000000);
+    *(uint32_t *)code_ptr = (insn & ~0x3ffffff) | (offset & 0x3ffffff);
+}
+
+static inline void reloc_pc19(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long offset = (target - (tcg_target_long)code_ptr) >> 2;
+    uint32_t insn = *(uint32_t *)code_ptr;
+
+    assert(offset >= -0x40000 && offset < 0x40000);
+    *(uint32_t *)code_ptr = (insn & ~(0x7ffff << 5)) | (offset & 0x7ffff) << 5;
+}
+
+static void patch_reloc(uint8_t *code_ptr, int type,
+                        tcg_target_long value, tcg_target_long addend)
+{
+    value += addend;
+
+    switch (type) {
+    case R_AARCH64_JUMP26:
+    case R_AARCH64_CALL26:
+        reloc_pc26(code_ptr, value);
+        break;
+    case R_AARCH64_CONDBR19:
+        reloc_pc19(code_ptr, value);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+/* parse target specific constraints */
+static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
+{
+    const char *ct_str = *pct_str;
+
+    switch (ct_str[0]) {
+    case 'r':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffff);
+        break;
+    case 'l': /* qemu_ld / qemu_st address, data_reg */
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffff);
+#ifdef CONFIG_SOFTMMU
+        /* x0 to x3 are used for the TLB lookup and the helper call */
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X0);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X1);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X2);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X3);
+#endif
+        break;
+    case 'w': /* the constant is the operand of a 32-bit operation */
+        ct->ct |= TCG_CT_CONST_IS32;
+        break;
+    case 'A': /* add/sub/cmp immediate */
+        ct->ct |= TCG_CT_CONST_AIMM;
+        break;
+    case 'L': /* logical immediate */
+        ct->ct |= TCG_CT_CONST_LIMM;
+        break;
+    case 'Z': /* zero, as the zero register */
+        ct->ct |= TCG_CT_CONST_ZERO;
+        break;
+    default:
+        return -1;
+    }
+
+    ct_str++;
+    *pct_str = ct_str;
+    return 0;
+}
+
+/* Whether VAL, or its negation, fits the 12-bit, optionally shifted,
+   immediate of add and sub.  */
+static inline bool is_aimm(uint64_t val)
+{
+    return (val & ~0xfff) == 0 || (val & ~0xfff000) == 0;
+}
+
+/* Encode VAL as the N:immr:imms field of a logical immediate of width
+   64 (or 32 if !EXT).  Returns false if VAL is not a replicated rotated
+   run of ones, or is all zeros or all ones.  */
+static bool encode_limm(uint64_t val, bool ext, uint32_t *field)
+{
+    unsigned size, len, rot;
+    uint64_t mask, elt;
+
+    if (!ext) {
+        val = (uint32_t)val;
+        val |= val << 32;
+    }
+    if (val == 0 || val == ~(uint64_t)0) {
+        return false;
+    }
+
+    /* find the smallest element size that VAL repeats with */
+    for (size = 64; size > 2; size /= 2) {
+        mask = (1ull << (size / 2)) - 1;
+        if ((val & mask) != ((val >> (size / 2)) & mask)) {
+            break;
+        }
+    }
+    mask = size == 64 ? ~(uint64_t)0 : (1ull << size) - 1;
+    elt = val & mask;
+
+    /* rotate the element right until it is a run of ones starting at
+       bit 0; the rotation is then the amount needed to rotate it back */
+    for (rot = 0; rot < size; rot++) {
+        if ((elt & 1) && !((elt >> (size - 1)) & 1)) {
+            break;
+        }
+        elt = ((elt >> 1) | (elt << (size - 1))) & mask;
+    }
+    if (rot == size) {
+        return false;
+    }
+    len = ctz64(~elt);
+    if (elt != (len == 64 ? ~(uint64_t)0 : (1ull << len) - 1)) {
+        return false;
+    }
+    rot = (size - rot) & (size - 1);
+
+    /* N:imms is the element size (encoded with leading ones) and the
+       run length less one */
+    *field = ((size == 64) << 22) | (rot << 16)
+             | (((~(size * 2 - 1)) & 0x3f) | (len - 1)) << 10;
+    return true;
+}
+
+/* test if a constant matches the constraint */
+static int tcg_target_const_match(tcg_target_long val,
+                                  const TCGArgConstraint *arg_ct)
+{
+    int ct = arg_ct->ct;
+    uint32_t field;
+
+    if (ct & TCG_CT_CONST) {
+        return 1;
+    }
+    if (ct & TCG_CT_CONST_IS32) {
+        val = (int32_t)val;
+    }
+    if ((ct & TCG_CT_CONST_AIMM) && (is_aimm(val) || is_aimm(-val))) {
+        return 1;
+    }
+    if ((ct & TCG_CT_CONST_LIMM)
+        && encode_limm(val, !(ct & TCG_CT_CONST_IS32), &field)) {
+        return 1;
+    }
+    if ((ct & TCG_CT_CONST_ZERO) && val == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+enum aarch64_cond_code {
+    COND_EQ = 0x0,
+    COND_NE = 0x1,
+    COND_CS = 0x2,     /* Unsigned greater or equal */
+    COND_HS = COND_CS, /* ALIAS greater or equal */
+    COND_CC = 0x3,     /* Unsigned less than */
+    COND_LO = COND_CC, /* ALIAS Lower */
+    COND_MI = 0x4,     /* Negative */
+    COND_PL = 0x5,     /* Zero or greater */
+    COND_VS = 0x6,     /* Overflow */
+    COND_VC = 0x7,     /* No overflow */
+    COND_HI = 0x8,     /* Unsigned greater than */
+    COND_LS = 0x9,     /* Unsigned less or equal */
+    COND_GE = 0xa,
+    COND_LT = 0xb,
+    COND_GT = 0xc,
+    COND_LE = 0xd,
+    COND_AL = 0xe,
+};
+
+static const enum aarch64_cond_code tcg_cond_to_aarch64[] = {
+    [TCG_COND_EQ] = COND_EQ,
+    [TCG_COND_NE] = COND_NE,
+    [TCG_COND_LT] = COND_LT,
+    [TCG_COND_GE] = COND_GE,
+    [TCG_COND_LE] = COND_LE,
+    [TCG_COND_GT] = COND_GT,
+    /* unsigned */
+    [TCG_COND_LTU] = COND_LO,
+    [TCG_COND_GTU] = COND_HI,
+    [TCG_COND_GEU] = COND_HS,
+    [TCG_COND_LEU] = COND_LS,
+};
+
+/* Instruction encodings, without the sf bit (31) that selects the 64-bit
+   form where there is one.  */
+typedef enum {
+    /* add/subtract (immediate) */
+    I3401_ADDI      = 0x11000000,
+    I3401_ADDSI     = 0x31000000,
+    I3401_SUBI      = 0x51000000,
+    I3401_SUBSI     = 0x71000000,
+
+    /* logical (immediate) */
+    I3404_ANDI      = 0x12000000,
+    I3404_ORRI      = 0x32000000,
+    I3404_EORI      = 0x52000000,
+
+    /* move wide (immediate) */
+    I3405_MOVN      = 0x12800000,
+    I3405_MOVZ      = 0x52800000,
+    I3405_MOVK      = 0x72800000,
+
+    /* bitfield */
+    I3402_SBFM      = 0x13000000,
+    I3402_BFM       = 0x33000000,
+    I3402_UBFM      = 0x53000000,
+
+    /* extract */
+    I3403_EXTR      = 0x13800000,
+
+    /* logical (shifted register) */
+    I3510_AND       = 0x0a000000,
+    I3510_BIC       = 0x0a200000,
+    I3510_ORR       = 0x2a000000,
+    I3510_ORN       = 0x2a200000,
+    I3510_EOR       = 0x4a000000,
+    I3510_EON       = 0x4a200000,
+
+    /* add/subtract (shifted register) */
+    I3502_ADD       = 0x0b000000,
+    I3502_ADDS      = 0x2b000000,
+    I3502_SUB       = 0x4b000000,
+    I3502_SUBS      = 0x6b000000,
+
+    /* data-processing (2 source) */
+    I3508_UDIV      = 0x1ac00800,
+    I3508_SDIV      = 0x1ac00c00,
+    I3508_LSLV      = 0x1ac02000,
+    I3508_LSRV      = 0x1ac02400,
+    I3508_ASRV      = 0x1ac02800,
+    I3508_RORV      = 0x1ac02c00,
+
+    /* data-processing (3 source) */
+    I3509_MADD      = 0x1b000000,
+    I3509_MSUB      = 0x1b008000,
+
+    /* data-processing (1 source); these include the sf bit */
+    I3507_REV16     = 0x5ac00400,
+    I3507_REV32     = 0x5ac00800, /* rev of a W register */
+    I3507_REV64     = 0xdac00c00,
+
+    /* conditional select */
+    I3506_CSEL      = 0x1a800000,
+    I3506_CSINC     = 0x1a800400,
+
+    /* load/store register, unsigned immediate, with size and opc */
+    I3312_STRB      = 0x39000000,
+    I3312_STRH      = 0x79000000,
+    I3312_STRW      = 0xb9000000,
+    I3312_STRX      = 0xf9000000,
+    I3312_LDRB      = 0x39400000,
+    I3312_LDRH      = 0x79400000,
+    I3312_LDRW      = 0xb9400000,
+    I3312_LDRX      = 0xf9400000,
+    I3312_LDRSBX    = 0x39800000,
+    I3312_LDRSHX    = 0x79800000,
+    I3312_LDRSWX    = 0xb9800000,
+
+    /* load/store pair, signed offset or pre/post-indexed */
+    I3314_STP       = 0xa9000000,
+    I3314_LDP       = 0xa9400000,
+    I3314_STP_PRE   = 0xa9800000,
+    I3314_LDP_POST  = 0xa8c00000,
+
+    /* branches */
+    I3206_B         = 0x14000000,
+    I3206_BL        = 0x94000000,
+    I3202_B_C       = 0x54000000,
+    I3207_BR        = 0xd61f0000,
+    I3207_BLR       = 0xd63f0000,
+    I3207_RET       = 0xd65f0000,
+
+    NOP             = 0xd503201f,
+} AArch64Insn;
+
+/* The offset of the unsigned immediate (I3312) form is scaled by the
+   access size, held in the top two bits.  */
+#define LDST_SIZE(insn)             ((insn) >> 30)
+/* The other addressing modes of the unsigned immediate encodings.  */
+#define LDST_UNSCALED(insn)         ((insn) & ~0x01000000)
+#define LDST_REGOFF(insn, ext)      (((insn) & ~0x01000000) | 0x00200800 \
+                                     | ((ext) << 13))
+#define LDST_EXT_UXTW               2
+#define LDST_EXT_LSL                3
+
+static inline void tcg_out_insn_3401(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, uint64_t aimm)
+{
+    if (aimm > 0xfff) {
+        assert((aimm & 0xfff) == 0);
+        aimm >>= 12;
+        assert(aimm <= 0xfff);
+        aimm |= 1 << 12;
+    }
+    tcg_out32(s, insn | ext << 31 | aimm << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3402(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn,
+                                     unsigned immr, unsigned imms)
+{
+    tcg_out32(s, insn | ext << 31 | ext << 22 | immr << 16 | imms << 10
+              | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3403(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, TCGReg rm,
+                                     unsigned imms)
+{
+    tcg_out32(s, insn | ext << 31 | ext << 22 | rm << 16 | imms << 10
+              | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3404(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, uint32_t field)
+{
+    tcg_out32(s, insn | ext << 31 | field | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3405(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, uint16_t half, unsigned shift)
+{
+    assert((shift & ~0x30) == 0);
+    tcg_out32(s, insn | ext << 31 | shift << (21 - 4) | half << 5 | rd);
+}
+
+/* shifted register operand (I3502, I3510) with an LSL */
+static inline void tcg_out_insn_3502(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, TCGReg rm,
+                                     unsigned lsl)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | lsl << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3506(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, TCGReg rm,
+                                     enum aarch64_cond_code c)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | c << 12 | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3508(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3509(TCGContext *s, AArch64Insn insn, int ext,
+                                     TCGReg rd, TCGReg rn, TCGReg rm,
+                                     TCGReg ra)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | ra << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_insn_3314(TCGContext *s, AArch64Insn insn,
+                                     TCGReg r1, TCGReg r2, TCGReg rn,
+                                     int offset)
+{
+    assert((offset & 7) == 0 && offset >= -512 && offset < 512);
+    tcg_out32(s, insn | (offset / 8 & 0x7f) << 15 | r2 << 10 | rn << 5 | r1);
+}
+
+static inline void tcg_out_mov(TCGContext *s, TCGType type,
+                               TCGReg ret, TCGReg arg)
+{
+    if (ret == arg) {
+        return;
+    }
+    if (ret == TCG_REG_SP || arg == TCG_REG_SP) {
+        /* mov to or from sp is an add #0 */
+        tcg_out_insn_3401(s, I3401_ADDI, type == TCG_TYPE_I64, ret, arg, 0);
+    } else {
+        /* orr ret, xzr, arg */
+        tcg_out_insn_3502(s, I3510_ORR, type == TCG_TYPE_I64,
+                          ret, TCG_REG_XZR, arg, 0);
+    }
+}
+
+static void tcg_out_movi(TCGContext *s, TCGType type,
+                         TCGReg rd, tcg_target_long value)
+{
+    int ext = type == TCG_TYPE_I64;
+    uint64_t uval = ext ? value : (uint32_t)value;
+    int i, n, zeros = 0, ones = 0;
+    uint32_t field;
+
+    n = ext ? 4 : 2;
+    for (i = 0; i < n; i++) {
+        uint16_t half = uval >> (i * 16);
+        zeros += half == 0;
+        ones += half == 0xffff;
+    }
+
+    /* at most one halfword differs from all-zeros or all-ones: a single
+       movz or movn */
+    if (zeros >= n - 1 || ones >= n - 1) {
+        uint16_t skip = zeros >= ones ? 0 : 0xffff;
+
+        for (i = n - 1; i > 0 && (uint16_t)(uval >> (i * 16)) == skip; i--) {
+            continue;
+        }
+        if (skip == 0) {
+            tcg_out_insn_3405(s, I3405_MOVZ, ext, rd,
+                              uval >> (i * 16), i * 16);
+        } else {
+            tcg_out_insn_3405(s, I3405_MOVN, ext, rd,
+                              ~(uval >> (i * 16)), i * 16);
+        }
+        return;
+    }
+
+    /* a logical immediate: orr rd, xzr, #imm */
+    if (encode_limm(uval, ext, &field)) {
+        tcg_out_insn_3404(s, I3404_ORRI, ext, rd, TCG_REG_XZR, field);
+        return;
+    }
+
+    /* start from whichever of zeros and ones needs the fewer movk */
+    if (ones > zeros) {
+        for (i = 0; (uval >> (i * 16) & 0xffff) == 0xffff; i++) {
+            continue;
+        }
+        tcg_out_insn_3405(s, I3405_MOVN, ext, rd, ~(uval >> (i * 16)), i * 16);
+        for (i++; i < n; i++) {
+            uint16_t half = uval >> (i * 16);
+            if (half != 0xffff) {
+                tcg_out_insn_3405(s, I3405_MOVK, ext, rd, half, i * 16);
+            }
+        }
+    } else {
+        for (i = 0; !(uval >> (i * 16) & 0xffff); i++) {
+            continue;
+        }
+        tcg_out_insn_3405(s, I3405_MOVZ, ext, rd, uval >> (i * 16), i * 16);
+        for (i++; i < n; i++) {
+            uint16_t half = uval >> (i * 16);
+            if (half != 0) {
+                tcg_out_insn_3405(s, I3405_MOVK, ext, rd, half, i * 16);
+            }
+        }
+    }
+}
+
+/* Load or store RD at [RN + OFFSET], INSN being the unsigned immediate
+   form of the access.  */
+static void tcg_out_ldst(TCGContext *s, AArch64Insn insn,
+                         TCGReg rd, TCGReg rn, tcg_target_long offset)
+{
+    unsigned size = LDST_SIZE(insn);
+
+    if (offset >= 0 && !(offset & ((1 << size) - 1))
+        && (offset >> size) <= 0xfff) {
+        tcg_out32(s, insn | (offset >> size) << 10 | rn << 5 | rd);
+    } else if (offset >= -256 && offset < 256) {
+        tcg_out32(s, LDST_UNSCALED(insn) | (offset & 0x1ff) << 12
+                  | rn << 5 | rd);
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, offset);
+        tcg_out32(s, LDST_REGOFF(insn, LDST_EXT_LSL) | TCG_REG_TMP << 16
+                  | rn << 5 | rd);
+    }
+}
+
+static inline void tcg_out_ld(TCGContext *s, TCGType type, TCGReg arg,
+                              TCGReg arg1, tcg_target_long arg2)
+{
+    tcg_out_ldst(s, type == TCG_TYPE_I32 ? I3312_LDRW : I3312_LDRX,
+                 arg, arg1, arg2);
+}
+
+static inline void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg,
+                              TCGReg arg1, tcg_target_long arg2)
+{
+    tcg_out_ldst(s, type == TCG_TYPE_I32 ? I3312_STRW : I3312_STRX,
+                 arg, arg1, arg2);
+}
+
+/* rd = rn + imm, for any imm; rd and rn may not be sp */
+static void tcg_out_addi(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                         tcg_target_long imm)
+{
+    AArch64Insn insn = I3401_ADDI;
+
+    if (!ext) {
+        imm = (int32_t)imm;
+    }
+    if (imm < 0) {
+        imm = -imm;
+        insn = I3401_SUBI;
+    }
+    if (imm <= 0xffffff) {
+        if (imm & 0xfff000) {
+            tcg_out_insn_3401(s, insn, ext, rd, rn, imm & 0xfff000);
+            rn = rd;
+        }
+        if ((imm & 0xfff) || rn != rd) {
+            tcg_out_insn_3401(s, insn, ext, rd, rn, imm & 0xfff);
+        }
+    } else {
+        tcg_out_movi(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, TCG_REG_TMP,
+                     insn == I3401_ADDI ? imm : -imm);
+        tcg_out_insn_3502(s, I3502_ADD, ext, rd, rn, TCG_REG_TMP, 0);
+    }
+}
+
+static void tcg_out_logicali(TCGContext *s, AArch64Insn insn, int ext,
+                             TCGReg rd, TCGReg rn, uint64_t imm)
+{
+    uint32_t field;
+
+    if (!encode_limm(imm, ext, &field)) {
+        tcg_abort();
+    }
+    tcg_out_insn_3404(s, insn, ext, rd, rn, field);
+}
+
+static void tcg_out_cmp(TCGContext *s, int ext, TCGReg a,
+                        tcg_target_long b, int const_b)
+{
+    if (const_b) {
+        if (!ext) {
+            b = (int32_t)b;
+        }
+        /* cmp is subs xzr, cmn is adds xzr */
+        if (b >= 0) {
+            tcg_out_insn_3401(s, I3401_SUBSI, ext, TCG_REG_XZR, a, b);
+        } else {
+            tcg_out_insn_3401(s, I3401_ADDSI, ext, TCG_REG_XZR, a, -b);
+        }
+    } else {
+        tcg_out_insn_3502(s, I3502_SUBS, ext, TCG_REG_XZR, a, b, 0);
+    }
+}
+
+static inline void tcg_out_goto(TCGContext *s, tcg_target_long target)
+{
+    tcg_target_long offset = (target - (tcg_target_long)s->code_ptr) >> 2;
+
+    assert(offset >= -0x2000000 && offset < 0x2000000);
+    tcg_out32(s, I3206_B | (offset & 0x3ffffff));
+}
+
+/* A branch whose target is patched later.  The old target bits are kept,
+   so that retranslating a TB in place rewrites the same code.  */
+static inline void tcg_out_goto_noaddr(TCGContext *s)
+{
+    uint32_t old = *(uint32_t *)s->code_ptr & 0x3ffffff;
+    tcg_out32(s, I3206_B | old);
+}
+
+static inline void tcg_out_goto_cond_noaddr(TCGContext *s,
+                                            enum aarch64_cond_code c)
+{
+    uint32_t old = *(uint32_t *)s->code_ptr & (0x7ffff << 5);
+    tcg_out32(s, I3202_B_C | old | c);
+}
+
+static void tcg_out_goto_label(TCGContext *s, int label_index)
+{
+    TCGLabel *l = &s->labels[label_index];
+
+    if (l->has_value) {
+        tcg_out_goto(s, l->u.value);
+    } else {
+        tcg_out_reloc(s, s->code_ptr, R_AARCH64_JUMP26, label_index, 0);
+        tcg_out_goto_noaddr(s);
+    }
+}
+
+static void tcg_out_goto_label_cond(TCGContext *s, enum aarch64_cond_code c,
+                                    int label_index)
+{
+    TCGLabel *l = &s->labels[label_index];
+
+    if (l->has_value) {
+        tcg_target_long offset = (l->u.value
+                                  - (tcg_target_long)s->code_ptr) >> 2;
+        assert(offset >= -0x40000 && offset < 0x40000);
+        tcg_out32(s, I3202_B_C | (offset & 0x7ffff) << 5 | c);
+    } else {
+        tcg_out_reloc(s, s->code_ptr, R_AARCH64_CONDBR19, label_index, 0);
+        tcg_out_goto_cond_noaddr(s, c);
+    }
+}
+
+static void tcg_out_call(TCGContext *s, tcg_target_long target)
+{
+    if (reloc_pc26_ok(s->code_ptr, target)) {
+        tcg_target_long offset = (target - (tcg_target_long)s->code_ptr) >> 2;
+        tcg_out32(s, I3206_BL | (offset & 0x3ffffff));
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+        tcg_out32(s, I3207_BLR | TCG_REG_TMP << 5);
+    }
+}
+
+void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr)
+{
+    /* the code buffer is small enough for b to reach any TB */
+    reloc_pc26((void *)jmp_addr, addr);
+    flush_icache_range(jmp_addr, jmp_addr + 4);
+}
+
+static inline void tcg_out_sbfx(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                                unsigned bits)
+{
+    tcg_out_insn_3402(s, I3402_SBFM, ext, rd, rn, 0, bits - 1);
+}
+
+static inline void tcg_out_ubfx(TCGContext *s, TCGReg rd, TCGReg rn,
+                                unsigned bits)
+{
+    /* the 32-bit form zero-extends into the whole register */
+    tcg_out_insn_3402(s, I3402_UBFM, 0, rd, rn, 0, bits - 1);
+}
+
+static inline void tcg_out_shli(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                                unsigned n)
+{
+    unsigned bits = ext ? 64 : 32;
+    n &= bits - 1;
+    tcg_out_insn_3402(s, I3402_UBFM, ext, rd, rn, -n & (bits - 1),
+                      bits - 1 - n);
+}
+
+static inline void tcg_out_shri(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                                unsigned n)
+{
+    unsigned bits = ext ? 64 : 32;
+    tcg_out_insn_3402(s, I3402_UBFM, ext, rd, rn, n & (bits - 1), bits - 1);
+}
+
+static inline void tcg_out_sari(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                                unsigned n)
+{
+    unsigned bits = ext ? 64 : 32;
+    tcg_out_insn_3402(s, I3402_SBFM, ext, rd, rn, n & (bits - 1), bits - 1);
+}
+
+static inline void tcg_out_rotri(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                                 unsigned n)
+{
+    /* ror is extr with both sources the same */
+    tcg_out_insn_3403(s, I3403_EXTR, ext, rd, rn, rn, n & (ext ? 63 : 31));
+}
+
+static inline void tcg_out_dep(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                               unsigned ofs, unsigned len)
+{
+    /* bfi is bfm with immr = -ofs and imms = len - 1 */
+    unsigned bits = ext ? 64 : 32;
+    tcg_out_insn_3402(s, I3402_BFM, ext, rd, rn, -ofs & (bits - 1), len - 1);
+}
+
+static inline void tcg_out_rev(TCGContext *s, AArch64Insn insn,
+                               TCGReg rd, TCGReg rn)
+{
+    tcg_out32(s, insn | rn << 5 | rd);
+}
+
+static void tcg_out_brcond(TCGContext *s, int ext, TCGCond cond, TCGArg a,
+                           TCGArg b, int const_b, int label_index)
+{
+    tcg_out_cmp(s, ext, a, b, const_b);
+    tcg_out_goto_label_cond(s, tcg_cond_to_aarch64[cond], label_index);
+}
+
+static void tcg_out_setcond(TCGContext *s, int ext, TCGCond cond, TCGReg rd,
+                            TCGReg a, tcg_target_long b, int const_b)
+{
+    tcg_out_cmp(s, ext, a, b, const_b);
+    /* cset rd, cond is csinc rd, xzr, xzr, !cond */
+    tcg_out_insn_3506(s, I3506_CSINC, 0, rd, TCG_REG_XZR, TCG_REG_XZR,
+                      tcg_cond_to_aarch64[tcg_invert_cond(cond)]);
+}
+
+#if defined(CONFIG_SOFTMMU)
+
+#include "exec/softmmu_defs.h"
+
+/* helper signature: helper_ld_mmu(CPUState *env, target_ulong addr,
+   int mmu_idx) */
+static const void * const qemu_ld_helpers[4] = {
+    helper_ldb_mmu,
+    helper_ldw_mmu,
+    helper_ldl_mmu,
+    helper_ldq_mmu,
+};
+
+/* helper signature: helper_st_mmu(CPUState *env, target_ulong addr,
+   uintxx_t val, int mmu_idx) */
+static const void * const qemu_st_helpers[4] = {
+    helper_stb_mmu,
+    helper_stw_mmu,
+    helper_stl_mmu,
+    helper_stq_mmu,
+};
+
+/* Look up ADDR_REG in the TLB of MEM_INDEX.  On a hit x1 holds the TLB
+   addend and execution falls through; otherwise the returned b.ne must
+   be patched to the slow path.  Clobbers x0 to x3.  */
+static uint8_t *tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg,
+                                 int s_bits, int mem_index, int is_read)
+{
+    int ext = TARGET_LONG_BITS == 64;
+    tcg_target_long tlb_offset;
+    TCGReg base = TCG_AREG0;
+    uint8_t *label_ptr;
+
+    tlb_offset = is_read ?
+        offsetof(CPUArchState, tlb_table[mem_index][0].addr_read) :
+        offsetof(CPUArchState, tlb_table[mem_index][0].addr_write);
+
+    /* x0 = TLB index */
+    tcg_out_insn_3402(s, I3402_UBFM, ext, TCG_REG_X0, addr_reg,
+                      TARGET_PAGE_BITS, TARGET_PAGE_BITS + CPU_TLB_BITS - 1);
+    /* x3 = page of the address, keeping the low bits that must be zero
+       for an aligned access so that unaligned ones miss */
+    tcg_out_logicali(s, I3404_ANDI, ext, TCG_REG_X3, addr_reg,
+                     TARGET_PAGE_MASK | ((1 << s_bits) - 1));
+    /* x2 = &env->tlb_table[mem_index][index] */
+    if (tlb_offset & 0xfff000) {
+        tcg_out_insn_3401(s, I3401_ADDI, 1, TCG_REG_X2, base,
+                          tlb_offset & 0xfff000);
+        base = TCG_REG_X2;
+    }
+    tcg_out_insn_3502(s, I3502_ADD, 1, TCG_REG_X2, base, TCG_REG_X0,
+                      CPU_TLB_ENTRY_BITS);
+    tlb_offset &= 0xfff;
+
+    /* x0 = comparator, x1 = addend */
+    tcg_out_ldst(s, ext ? I3312_LDRX : I3312_LDRW, TCG_REG_X0, TCG_REG_X2,
+                 tlb_offset);
+    tcg_out_ldst(s, I3312_LDRX, TCG_REG_X1, TCG_REG_X2,
+                 tlb_offset + offsetof(CPUTLBEntry, addend)
+                 - (is_read ? offsetof(CPUTLBEntry, addr_read)
+                    : offsetof(CPUTLBEntry, addr_write)));
+    tcg_out_cmp(s, ext, TCG_REG_X0, TCG_REG_X3, 0);
+
+    label_ptr = s->code_ptr;
+    tcg_out_goto_cond_noaddr(s, COND_NE);
+    return label_ptr;
+}
+
+#endif /* CONFIG_SOFTMMU */
+
+/* The guest address extended to 64 bits by the addressing mode */
+#define LDST_EXT_GUEST \
+    (TARGET_LONG_BITS == 64 ? LDST_EXT_LSL : LDST_EXT_UXTW)
+
+static void tcg_out_qemu_ld_direct(TCGContext *s, int opc, TCGReg data_r,
+                                   TCGReg base_r, TCGReg addr_r)
+{
+    static const AArch64Insn ld_insn[8] = {
+        I3312_LDRB, I3312_LDRH, I3312_LDRW, I3312_LDRX,
+        I3312_LDRSBX, I3312_LDRSHX, I3312_LDRSWX, I3312_LDRX,
+    };
+#ifdef TARGET_WORDS_BIGENDIAN
+    /* load unsigned, then swap and extend */
+    int bswap = opc & 3;
+    AArch64Insn insn = ld_insn[bswap ? opc & 3 : opc];
+#else
+    AArch64Insn insn = ld_insn[opc];
+#endif
+
+    tcg_out32(s, LDST_REGOFF(insn, LDST_EXT_GUEST) | addr_r << 16
+              | base_r << 5 | data_r);
+#ifdef TARGET_WORDS_BIGENDIAN
+    switch (bswap ? opc : 0) {
+    case 1:
+        tcg_out_rev(s, I3507_REV16, data_r, data_r);
+        break;
+    case 1 | 4:
+        tcg_out_rev(s, I3507_REV16, data_r, data_r);
+        tcg_out_sbfx(s, 1, data_r, data_r, 16);
+        break;
+    case 2:
+        tcg_out_rev(s, I3507_REV32, data_r, data_r);
+        break;
+    case 2 | 4:
+        tcg_out_rev(s, I3507_REV32, data_r, data_r);
+        tcg_out_sbfx(s, 1, data_r, data_r, 32);
+        break;
+    case 3:
+        tcg_out_rev(s, I3507_REV64, data_r, data_r);
+        break;
+    }
+#endif
+}
+
+static void tcg_out_qemu_st_direct(TCGContext *s, int opc, TCGReg data_r,
+                                   TCGReg base_r, TCGReg addr_r)
+{
+    static const AArch64Insn st_insn[4] = {
+        I3312_STRB, I3312_STRH, I3312_STRW, I3312_STRX,
+    };
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    switch (opc) {
+    case 1:
+        tcg_out_rev(s, I3507_REV16, TCG_REG_TMP, data_r);
+        data_r = TCG_REG_TMP;
+        break;
+    case 2:
+        tcg_out_rev(s, I3507_REV32, TCG_REG_TMP, data_r);
+        data_r = TCG_REG_TMP;
+        break;
+    case 3:
+        tcg_out_rev(s, I3507_REV64, TCG_REG_TMP, data_r);
+        data_r = TCG_REG_TMP;
+        break;
+    }
+#endif
+    tcg_out32(s, LDST_REGOFF(st_insn[opc], LDST_EXT_GUEST) | addr_r << 16
+              | base_r << 5 | data_r);
+}
+
+static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
+{
+    TCGReg data_reg = args[0];
+    TCGReg addr_reg = args[1];
+#ifdef CONFIG_SOFTMMU
+    int mem_index = args[2];
+    int s_bits = opc & 3;
+    uint8_t *label_ptr, *done_ptr;
+
+    label_ptr = tcg_out_tlb_read(s, addr_reg, s_bits, mem_index, 1);
+    tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_REG_X1, addr_reg);
+    done_ptr = s->code_ptr;
+    tcg_out_goto_noaddr(s);
+
+    /* slow path */
+    reloc_pc19(label_ptr, (tcg_target_long)s->code_ptr);
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_REG_X0, TCG_AREG0);
+    tcg_out_mov(s, TARGET_LONG_BITS == 64 ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                TCG_REG_X1, addr_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X2, mem_index);
+    tcg_out_call(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
+
+    /* the helpers return narrow types, whose upper bits are undefined */
+    switch (opc) {
+    case 0:
+        tcg_out_ubfx(s, data_reg, TCG_REG_X0, 8);
+        break;
+    case 0 | 4:
+        tcg_out_sbfx(s, 1, data_reg, TCG_REG_X0, 8);
+        break;
+    case 1:
+        tcg_out_ubfx(s, data_reg, TCG_REG_X0, 16);
+        break;
+    case 1 | 4:
+        tcg_out_sbfx(s, 1, data_reg, TCG_REG_X0, 16);
+        break;
+    case 2:
+        tcg_out_mov(s, TCG_TYPE_I32, data_reg, TCG_REG_X0);
+        break;
+    case 2 | 4:
+        tcg_out_sbfx(s, 1, data_reg, TCG_REG_X0, 32);
+        break;
+    case 3:
+        tcg_out_mov(s, TCG_TYPE_I64, data_reg, TCG_REG_X0);
+        break;
+    default:
+        tcg_abort();
+    }
+
+    reloc_pc26(done_ptr, (tcg_target_long)s->code_ptr);
+#else /* !CONFIG_SOFTMMU */
+    tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_REG_GUEST_BASE, addr_reg);
+#endif
+}
+
+static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
+{
+    TCGReg data_reg = args[0];
+    TCGReg addr_reg = args[1];
+#ifdef CONFIG_SOFTMMU
+    int mem_index = args[2];
+    int s_bits = opc & 3;
+    uint8_t *label_ptr, *done_ptr;
+
+    label_ptr = tcg_out_tlb_read(s, addr_reg, s_bits, mem_index, 0);
+    tcg_out_qemu_st_direct(s, opc, data_reg, TCG_REG_X1, addr_reg);
+    done_ptr = s->code_ptr;
+    tcg_out_goto_noaddr(s);
+
+    /* slow path */
+    reloc_pc19(label_ptr, (tcg_target_long)s->code_ptr);
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_REG_X0, TCG_AREG0);
+    tcg_out_mov(s, TARGET_LONG_BITS == 64 ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                TCG_REG_X1, addr_reg);
+    tcg_out_mov(s, s_bits == 3 ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                TCG_REG_X2, data_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X3, mem_index);
+    tcg_out_call(s, (tcg_target_long)qemu_st_helpers[s_bits]);
+
+    reloc_pc26(done_ptr, (tcg_target_long)s->code_ptr);
+#else /* !CONFIG_SOFTMMU */
+    tcg_out_qemu_st_direct(s, opc, data_reg, TCG_REG_GUEST_BASE, addr_reg);
+#endif
+}
+
+static void tcg_out_op(TCGContext *s, TCGOpcode opc,
+                       const TCGArg *args, const int *const_args)
+{
+    /* 99% of the time, we can signal the use of extension registers
+       by looking to see if the opcode handles 64-bit data.  */
+    int ext = (tcg_op_defs[opc].flags & TCG_OPF_64BIT) != 0;
+    TCGArg a0 = args[0], a1 = args[1], a2 = args[2];
+    int c2 = const_args[2];
+
+    switch (opc) {
+    case INDEX_op_exit_tb:
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, a0);
+        tcg_out_goto(s, (tcg_target_long)tb_ret_addr);
+        break;
+
+    case INDEX_op_goto_tb:
+#ifndef USE_DIRECT_JUMP
+#error "USE_DIRECT_JUMP required for aarch64"
+#endif
+        assert(s->tb_jmp_offset != NULL); /* consistency for USE_DIRECT_JUMP */
+        s->tb_jmp_offset[a0] = s->code_ptr - s->code_buf;
+        /* actual branch destination will be patched by
+           aarch64_tb_set_jmp_target later, beware retranslation. */
+        tcg_out_goto_noaddr(s);
+        s->tb_next_offset[a0] = s->code_ptr - s->code_buf;
+        break;
+
+    case INDEX_op_goto_ptr:
+        tcg_out32(s, I3207_BR | a0 << 5);
+        break;
+
+    case INDEX_op_call:
+        if (const_args[0]) {
+            tcg_out_call(s, a0);
+        } else {
+            tcg_out32(s, I3207_BLR | a0 << 5);
+        }
+        break;
+
+    case INDEX_op_br:
+        tcg_out_goto_label(s, a0);
+        break;
+
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8u_i64:
+        tcg_out_ldst(s, I3312_LDRB, a0, a1, a2);
+        break;
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_ld8s_i64:
+        tcg_out_ldst(s, I3312_LDRSBX, a0, a1, a2);
+        break;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16u_i64:
+        tcg_out_ldst(s, I3312_LDRH, a0, a1, a2);
+        break;
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_ld16s_i64:
+        tcg_out_ldst(s, I3312_LDRSHX, a0, a1, a2);
+        break;
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+        tcg_out_ldst(s, I3312_LDRW, a0, a1, a2);
+        break;
+    case INDEX_op_ld32s_i64:
+        tcg_out_ldst(s, I3312_LDRSWX, a0, a1, a2);
+        break;
+    case INDEX_op_ld_i64:
+        tcg_out_ldst(s, I3312_LDRX, a0, a1, a2);
+        break;
+
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        tcg_out_ldst(s, I3312_STRB, a0, a1, a2);
+        break;
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        tcg_out_ldst(s, I3312_STRH, a0, a1, a2);
+        break;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        tcg_out_ldst(s, I3312_STRW, a0, a1, a2);
+        break;
+    case INDEX_op_st_i64:
+        tcg_out_ldst(s, I3312_STRX, a0, a1, a2);
+        break;
+
+    case INDEX_op_add_i32:
+    case INDEX_op_add_i64:
+        if (c2) {
+            tcg_out_addi(s, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3502(s, I3502_ADD, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_sub_i32:
+    case INDEX_op_sub_i64:
+        if (c2) {
+            tcg_out_addi(s, ext, a0, a1, -a2);
+        } else {
+            tcg_out_insn_3502(s, I3502_SUB, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_neg_i32:
+    case INDEX_op_neg_i64:
+        tcg_out_insn_3502(s, I3502_SUB, ext, a0, TCG_REG_XZR, a1, 0);
+        break;
+
+    case INDEX_op_and_i32:
+    case INDEX_op_and_i64:
+        if (c2) {
+            tcg_out_logicali(s, I3404_ANDI, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3502(s, I3510_AND, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_andc_i32:
+    case INDEX_op_andc_i64:
+        if (c2) {
+            tcg_out_logicali(s, I3404_ANDI, ext, a0, a1, ~a2);
+        } else {
+            tcg_out_insn_3502(s, I3510_BIC, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_or_i32:
+    case INDEX_op_or_i64:
+        if (c2) {
+            tcg_out_logicali(s, I3404_ORRI, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3502(s, I3510_ORR, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_orc_i32:
+    case INDEX_op_orc_i64:
+        if (c2) {
+            tcg_out_logicali(s, I3404_ORRI, ext, a0, a1, ~a2);
+        } else {
+            tcg_out_insn_3502(s, I3510_ORN, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_xor_i32:
+    case INDEX_op_xor_i64:
+        if (c2) {
+            tcg_out_logicali(s, I3404_EORI, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3502(s, I3510_EOR, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_eqv_i32:
+    case INDEX_op_eqv_i64:
+        if (c2) {
+            tcg_out_logicali(s, I3404_EORI, ext, a0, a1, ~a2);
+        } else {
+            tcg_out_insn_3502(s, I3510_EON, ext, a0, a1, a2, 0);
+        }
+        break;
+
+    case INDEX_op_not_i32:
+    case INDEX_op_not_i64:
+        tcg_out_insn_3502(s, I3510_ORN, ext, a0, TCG_REG_XZR, a1, 0);
+        break;
+
+    case INDEX_op_mul_i32:
+    case INDEX_op_mul_i64:
+        tcg_out_insn_3509(s, I3509_MADD, ext, a0, a1, a2, TCG_REG_XZR);
+        break;
+
+    case INDEX_op_div_i32:
+    case INDEX_op_div_i64:
+        tcg_out_insn_3508(s, I3508_SDIV, ext, a0, a1, a2);
+        break;
+    case INDEX_op_divu_i32:
+    case INDEX_op_divu_i64:
+        tcg_out_insn_3508(s, I3508_UDIV, ext, a0, a1, a2);
+        break;
+
+    case INDEX_op_rem_i32:
+    case INDEX_op_rem_i64:
+        tcg_out_insn_3508(s, I3508_SDIV, ext, TCG_REG_TMP, a1, a2);
+        tcg_out_insn_3509(s, I3509_MSUB, ext, a0, TCG_REG_TMP, a2, a1);
+        break;
+    case INDEX_op_remu_i32:
+    case INDEX_op_remu_i64:
+        tcg_out_insn_3508(s, I3508_UDIV, ext, TCG_REG_TMP, a1, a2);
+        tcg_out_insn_3509(s, I3509_MSUB, ext, a0, TCG_REG_TMP, a2, a1);
+        break;
+
+    case INDEX_op_shl_i32:
+    case INDEX_op_shl_i64:
+        if (c2) {
+            tcg_out_shli(s, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3508(s, I3508_LSLV, ext, a0, a1, a2);
+        }
+        break;
+
+    case INDEX_op_shr_i32:
+    case INDEX_op_shr_i64:
+        if (c2) {
+            tcg_out_shri(s, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3508(s, I3508_LSRV, ext, a0, a1, a2);
+        }
+        break;
+
+    case INDEX_op_sar_i32:
+    case INDEX_op_sar_i64:
+        if (c2) {
+            tcg_out_sari(s, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3508(s, I3508_ASRV, ext, a0, a1, a2);
+        }
+        break;
+
+    case INDEX_op_rotr_i32:
+    case INDEX_op_rotr_i64:
+        if (c2) {
+            tcg_out_rotri(s, ext, a0, a1, a2);
+        } else {
+            tcg_out_insn_3508(s, I3508_RORV, ext, a0, a1, a2);
+        }
+        break;
+
+    case INDEX_op_rotl_i32:
+    case INDEX_op_rotl_i64:
+        if (c2) {
+            tcg_out_rotri(s, ext, a0, a1, -a2);
+        } else {
+            tcg_out_insn_3502(s, I3502_SUB, 0, TCG_REG_TMP, TCG_REG_XZR, a2, 0);
+            tcg_out_insn_3508(s, I3508_RORV, ext, a0, a1, TCG_REG_TMP);
+        }
+        break;
+
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        tcg_out_brcond(s, ext, a2, a0, a1, const_args[1], args[3]);
+        break;
+
+    case INDEX_op_setcond_i32:
+    case INDEX_op_setcond_i64:
+        tcg_out_setcond(s, ext, args[3], a0, a1, a2, c2);
+        break;
+
+    case INDEX_op_movcond_i32:
+    case INDEX_op_movcond_i64:
+        tcg_out_cmp(s, ext, a1, a2, c2);
+        tcg_out_insn_3506(s, I3506_CSEL, ext, a0,
+                          const_args[3] ? TCG_REG_XZR : args[3],
+                          const_args[4] ? TCG_REG_XZR : args[4],
+                          tcg_cond_to_aarch64[args[5]]);
+        break;
+
+    case INDEX_op_qemu_ld8u:
+        tcg_out_qemu_ld(s, args, 0);
+        break;
+    case INDEX_op_qemu_ld8s:
+        tcg_out_qemu_ld(s, args, 0 | 4);
+        break;
+    case INDEX_op_qemu_ld16u:
+        tcg_out_qemu_ld(s, args, 1);
+        break;
+    case INDEX_op_qemu_ld16s:
+        tcg_out_qemu_ld(s, args, 1 | 4);
+        break;
+    case INDEX_op_qemu_ld32:
+    case INDEX_op_qemu_ld32u:
+        tcg_out_qemu_ld(s, args, 2);
+        break;
+    case INDEX_op_qemu_ld32s:
+        tcg_out_qemu_ld(s, args, 2 | 4);
+        break;
+    case INDEX_op_qemu_ld64:
+        tcg_out_qemu_ld(s, args, 3);
+        break;
+    case INDEX_op_qemu_st8:
+        tcg_out_qemu_st(s, args, 0);
+        break;
+    case INDEX_op_qemu_st16:
+        tcg_out_qemu_st(s, args, 1);
+        break;
+    case INDEX_op_qemu_st32:
+        tcg_out_qemu_st(s, args, 2);
+        break;
+    case INDEX_op_qemu_st64:
+        tcg_out_qemu_st(s, args, 3);
+        break;
+
+    case INDEX_op_bswap16_i32:
+    case INDEX_op_bswap16_i64:
+        /* the high bytes of the input are zero, so the 32-bit rev16
+           leaves them alone */
+        tcg_out_rev(s, I3507_REV16, a0, a1);
+        break;
+    case INDEX_op_bswap32_i32:
+    case INDEX_op_bswap32_i64:
+        tcg_out_rev(s, I3507_REV32, a0, a1);
+        break;
+    case INDEX_op_bswap64_i64:
+        tcg_out_rev(s, I3507_REV64, a0, a1);
+        break;
+
+    case INDEX_op_ext8s_i32:
+    case INDEX_op_ext8s_i64:
+        tcg_out_sbfx(s, ext, a0, a1, 8);
+        break;
+    case INDEX_op_ext16s_i32:
+    case INDEX_op_ext16s_i64:
+        tcg_out_sbfx(s, ext, a0, a1, 16);
+        break;
+    case INDEX_op_ext32s_i64:
+        tcg_out_sbfx(s, 1, a0, a1, 32);
+        break;
+    case INDEX_op_ext8u_i32:
+    case INDEX_op_ext8u_i64:
+        tcg_out_ubfx(s, a0, a1, 8);
+        break;
+    case INDEX_op_ext16u_i32:
+    case INDEX_op_ext16u_i64:
+        tcg_out_ubfx(s, a0, a1, 16);
+        break;
+    case INDEX_op_ext32u_i64:
+        /* a 32-bit mov clears the high half */
+        tcg_out_insn_3502(s, I3510_ORR, 0, a0, TCG_REG_XZR, a1, 0);
+        break;
+
+    case INDEX_op_deposit_i32:
+    case INDEX_op_deposit_i64:
+        tcg_out_dep(s, ext, a0, c2 ? TCG_REG_XZR : a2, args[3], args[4]);
+        break;
+
+    case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
+    case INDEX_op_mov_i64:
+    case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
+    case INDEX_op_movi_i64:
+    default:
+        tcg_abort();
+    }
+}
+
+static const TCGTargetOpDef aarch64_op_defs[] = {
+    { INDEX_op_exit_tb, { } },
+    { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
+    { INDEX_op_call, { "ri" } },
+    { INDEX_op_br, { } },
+
+    { INDEX_op_mov_i32, { "r", "r" } },
+    { INDEX_op_mov_i64, { "r", "r" } },
+
+    { INDEX_op_movi_i32, { "r" } },
+    { INDEX_op_movi_i64, { "r" } },
+
+    { INDEX_op_ld8u_i32, { "r", "r" } },
+    { INDEX_op_ld8s_i32, { "r", "r" } },
+    { INDEX_op_ld16u_i32, { "r", "r" } },
+    { INDEX_op_ld16s_i32, { "r", "r" } },
+    { INDEX_op_ld_i32, { "r", "r" } },
+    { INDEX_op_ld8u_i64, { "r", "r" } },
+    { INDEX_op_ld8s_i64, { "r", "r" } },
+    { INDEX_op_ld16u_i64, { "r", "r" } },
+    { INDEX_op_ld16s_i64, { "r", "r" } },
+    { INDEX_op_ld32u_i64, { "r", "r" } },
+    { INDEX_op_ld32s_i64, { "r", "r" } },
+    { INDEX_op_ld_i64, { "r", "r" } },
+
+    { INDEX_op_st8_i32, { "r", "r" } },
+    { INDEX_op_st16_i32, { "r", "r" } },
+    { INDEX_op_st_i32, { "r", "r" } },
+    { INDEX_op_st8_i64, { "r", "r" } },
+    { INDEX_op_st16_i64, { "r", "r" } },
+    { INDEX_op_st32_i64, { "r", "r" } },
+    { INDEX_op_st_i64, { "r", "r" } },
+
+    { INDEX_op_add_i32, { "r", "r", "rwA" } },
+    { INDEX_op_add_i64, { "r", "r", "rA" } },
+    { INDEX_op_sub_i32, { "r", "r", "rwA" } },
+    { INDEX_op_sub_i64, { "r", "r", "rA" } },
+    { INDEX_op_mul_i32, { "r", "r", "r" } },
+    { INDEX_op_mul_i64, { "r", "r", "r" } },
+    { INDEX_op_div_i32, { "r", "r", "r" } },
+    { INDEX_op_div_i64, { "r", "r", "r" } },
+    { INDEX_op_divu_i32, { "r", "r", "r" } },
+    { INDEX_op_divu_i64, { "r", "r", "r" } },
+    { INDEX_op_rem_i32, { "r", "r", "r" } },
+    { INDEX_op_rem_i64, { "r", "r", "r" } },
+    { INDEX_op_remu_i32, { "r", "r", "r" } },
+    { INDEX_op_remu_i64, { "r", "r", "r" } },
+    { INDEX_op_and_i32, { "r", "r", "rwL" } },
+    { INDEX_op_and_i64, { "r", "r", "rL" } },
+    { INDEX_op_or_i32, { "r", "r", "rwL" } },
+    { INDEX_op_or_i64, { "r", "r", "rL" } },
+    { INDEX_op_xor_i32, { "r", "r", "rwL" } },
+    { INDEX_op_xor_i64, { "r", "r", "rL" } },
+    { INDEX_op_andc_i32, { "r", "r", "r" } },
+    { INDEX_op_andc_i64, { "r", "r", "r" } },
+    { INDEX_op_orc_i32, { "r", "r", "r" } },
+    { INDEX_op_orc_i64, { "r", "r", "r" } },
+    { INDEX_op_eqv_i32, { "r", "r", "r" } },
+    { INDEX_op_eqv_i64, { "r", "r", "r" } },
+
+    { INDEX_op_neg_i32, { "r", "r" } },
+    { INDEX_op_neg_i64, { "r", "r" } },
+    { INDEX_op_not_i32, { "r", "r" } },
+    { INDEX_op_not_i64, { "r", "r" } },
+
+    { INDEX_op_shl_i32, { "r", "r", "ri" } },
+    { INDEX_op_shr_i32, { "r", "r", "ri" } },
+    { INDEX_op_sar_i32, { "r", "r", "ri" } },
+    { INDEX_op_rotl_i32, { "r", "r", "ri" } },
+    { INDEX_op_rotr_i32, { "r", "r", "ri" } },
+    { INDEX_op_shl_i64, { "r", "r", "ri" } },
+    { INDEX_op_shr_i64, { "r", "r", "ri" } },
+    { INDEX_op_sar_i64, { "r", "r", "ri" } },
+    { INDEX_op_rotl_i64, { "r", "r", "ri" } },
+    { INDEX_op_rotr_i64, { "r", "r", "ri" } },
+
+    { INDEX_op_brcond_i32, { "r", "rwA" } },
+    { INDEX_op_brcond_i64, { "r", "rA" } },
+    { INDEX_op_setcond_i32, { "r", "r", "rwA" } },
+    { INDEX_op_setcond_i64, { "r", "r", "rA" } },
+    { INDEX_op_movcond_i32, { "r", "r", "rwA", "rZ", "rZ" } },
+    { INDEX_op_movcond_i64, { "r", "r", "rA", "rZ", "rZ" } },
+
+    { INDEX_op_qemu_ld8u, { "r", "l" } },
+    { INDEX_op_qemu_ld8s, { "r", "l" } },
+    { INDEX_op_qemu_ld16u, { "r", "l" } },
+    { INDEX_op_qemu_ld16s, { "r", "l" } },
+    { INDEX_op_qemu_ld32, { "r", "l" } },
+    { INDEX_op_qemu_ld32u, { "r", "l" } },
+    { INDEX_op_qemu_ld32s, { "r", "l" } },
+    { INDEX_op_qemu_ld64, { "r", "l" } },
+    { INDEX_op_qemu_st8, { "l", "l" } },
+    { INDEX_op_qemu_st16, { "l", "l" } },
+    { INDEX_op_qemu_st32, { "l", "l" } },
+    { INDEX_op_qemu_st64, { "l", "l" } },
+
+    { INDEX_op_bswap16_i32, { "r", "r" } },
+    { INDEX_op_bswap32_i32, { "r", "r" } },
+    { INDEX_op_bswap16_i64, { "r", "r" } },
+    { INDEX_op_bswap32_i64, { "r", "r" } },
+    { INDEX_op_bswap64_i64, { "r", "r" } },
+
+    { INDEX_op_ext8s_i32, { "r", "r" } },
+    { INDEX_op_ext16s_i32, { "r", "r" } },
+    { INDEX_op_ext8u_i32, { "r", "r" } },
+    { INDEX_op_ext16u_i32, { "r", "r" } },
+
+    { INDEX_op_ext8s_i64, { "r", "r" } },
+    { INDEX_op_ext16s_i64, { "r", "r" } },
+    { INDEX_op_ext32s_i64, { "r", "r" } },
+    { INDEX_op_ext8u_i64, { "r", "r" } },
+    { INDEX_op_ext16u_i64, { "r", "r" } },
+    { INDEX_op_ext32u_i64, { "r", "r" } },
+
+    { INDEX_op_deposit_i32, { "r", "0", "rZ" } },
+    { INDEX_op_deposit_i64, { "r", "0", "rZ" } },
+
+    { -1 },
+};
+
+static void tcg_target_init(TCGContext *s)
+{
+#if !defined(CONFIG_USER_ONLY)
+    /* fail safe */
+    if ((1 << CPU_TLB_ENTRY_BITS) != sizeof(CPUTLBEntry)) {
+        tcg_abort();
+    }
+#endif
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffffffff);
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffffffff);
+
+    tcg_regset_set32(tcg_target_call_clobber_regs, 0,
+                     (1 << TCG_REG_X0) | (1 << TCG_REG_X1) |
+                     (1 << TCG_REG_X2) | (1 << TCG_REG_X3) |
+                     (1 << TCG_REG_X4) | (1 << TCG_REG_X5) |
+                     (1 << TCG_REG_X6) | (1 << TCG_REG_X7) |
+                     (1 << TCG_REG_X8) | (1 << TCG_REG_X9) |
+                     (1 << TCG_REG_X10) | (1 << TCG_REG_X11) |
+                     (1 << TCG_REG_X12) | (1 << TCG_REG_X13) |
+                     (1 << TCG_REG_X14) | (1 << TCG_REG_X15) |
+                     (1 << TCG_REG_X16) | (1 << TCG_REG_X17) |
+                     (1 << TCG_REG_X18) | (1 << TCG_REG_LR));
+
+    tcg_regset_clear(s->reserved_regs);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_SP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_FP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_TMP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_X18); /* platform register */
+#ifdef TCG_REG_GUEST_BASE
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_GUEST_BASE);
+#endif
+
+    tcg_add_target_add_op_defs(aarch64_op_defs);
+}
+
+/* Saved registers: fp and lr, then the callee saved x19 to x28.  */
+#define PUSH_SIZE  ((30 - 19 + 1) * 8)
+
+#define FRAME_SIZE \
+    ((PUSH_SIZE \
+      + TCG_STATIC_CALL_ARGS_SIZE \
+      + CPU_TEMP_BUF_NLONGS * sizeof(long) \
+      + TCG_TARGET_STACK_ALIGN - 1) \
+     & ~(TCG_TARGET_STACK_ALIGN - 1))
+
+static void tcg_target_qemu_prologue(TCGContext *s)
+{
+    int r;
+
+    /* stp fp, lr, [sp, #-PUSH_SIZE]! ; mov fp, sp */
+    tcg_out_insn_3314(s, I3314_STP_PRE, TCG_REG_FP, TCG_REG_LR,
+                      TCG_REG_SP, -PUSH_SIZE);
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_REG_FP, TCG_REG_SP);
+
+    /* stp x19, x20, [sp, #16] ... stp x27, x28, [sp, #80] */
+    for (r = TCG_REG_X19; r <= TCG_REG_X27; r += 2) {
+        tcg_out_insn_3314(s, I3314_STP, r, r + 1, TCG_REG_SP,
+                          (r - TCG_REG_X19 + 2) * 8);
+    }
+
+    /* outgoing call arguments and the TCG temporaries */
+    tcg_out_insn_3401(s, I3401_SUBI, 1, TCG_REG_SP, TCG_REG_SP,
+                      FRAME_SIZE - PUSH_SIZE);
+    tcg_set_frame(s, TCG_REG_SP, TCG_STATIC_CALL_ARGS_SIZE,
+                  CPU_TEMP_BUF_NLONGS * sizeof(long));
+
+#ifdef TCG_REG_GUEST_BASE
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_GUEST_BASE, GUEST_BASE);
+#endif
+
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
+    tcg_out32(s, I3207_BR | tcg_target_call_iarg_regs[1] << 5);
+
+    /* Return value 0 for a goto_ptr that did not find a TB.  */
+    code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, 0);
+
+    /* TB epilogue */
+    tb_ret_addr = s->code_ptr;
+
+    tcg_out_insn_3401(s, I3401_ADDI, 1, TCG_REG_SP, TCG_REG_SP,
+                      FRAME_SIZE - PUSH_SIZE);
+    for (r = TCG_REG_X19; r <= TCG_REG_X27; r += 2) {
+        tcg_out_insn_3314(s, I3314_LDP, r, r + 1, TCG_REG_SP,
+                          (r - TCG_REG_X19 + 2) * 8);
+    }
+    /* ldp fp, lr, [sp], #PUSH_SIZE */
+    tcg_out_insn_3314(s, I3314_LDP_POST, TCG_REG_FP, TCG_REG_LR,
+                      TCG_REG_SP, PUSH_SIZE);
+    tcg_out32(s, I3207_RET | TCG_REG_LR << 5);
+}
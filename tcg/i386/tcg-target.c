@@ -1071,13 +1071,26 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     }
 
     tcg_out_mov(s, type, r0, addrlo);
+    /* The targets that define TARGET_ALIGNED_ONLY fault on unaligned
+       accesses, which only the slow path checks (see ALIGNED_ONLY in
+       softmmu_template.h), so the low bits of the address must miss.  */
+#ifdef TARGET_ALIGNED_ONLY
     tcg_out_mov(s, type, r1, addrlo);
+#else
+    /* Compare the page of the last byte, so that unaligned accesses hit
+       unless they cross into the next page, which is in another entry.  */
+    tcg_out_modrm_offset(s, OPC_LEA + rexw, r1, addrlo, (1 << s_bits) - 1);
+#endif
 
     tcg_out_shifti(s, SHIFT_SHR + rexw, r0,
                    TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
 
+#ifdef TARGET_ALIGNED_ONLY
     tgen_arithi(s, ARITH_AND + rexw, r1,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
+#else
+    tgen_arithi(s, ARITH_AND + rexw, r1, TARGET_PAGE_MASK, 0);
+#endif
     tgen_arithi(s, ARITH_AND + rexw, r0,
                 (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
 
@@ -1695,6 +1708,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -2029,6 +2046,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2242,6 +2260,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return value 0 for a goto_ptr that did not find a TB.  */
+    code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -51,10 +51,38 @@ struct tcg_temp_info {
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* CPU state fields accessed with ld/st through the env pointer whose
+   contents are known to be held in a temp.  STORE_INDEX is the index of
+   the op which stored the field if nothing can have read it since, or
+   -1.  */
+#define TCG_OPT_MAX_MEMS 16
+
+struct tcg_mem_info {
+    tcg_target_long offset;
+    int size;
+    TCGArg val;
+    int store_index;
+};
+
+static struct tcg_mem_info mems[TCG_OPT_MAX_MEMS];
+static int nb_mems;
+
+static void reset_mem(int i)
+{
+    mems[i] = mems[--nb_mems];
+}
+
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
 static void reset_temp(TCGArg temp)
 {
+    int i;
+
+    for (i = nb_mems - 1; i >= 0; i--) {
+        if (mems[i].val == temp) {
+            reset_mem(i);
+        }
+    }
     if (temps[temp].state == TCG_TEMP_COPY) {
         if (temps[temp].prev_copy == temps[temp].next_copy) {
             temps[temps[temp].next_copy].state = TCG_TEMP_UNDEF;
@@ -75,6 +103,25 @@ static void reset_all_temps(int nb_temps)
         temps[i].state = TCG_TEMP_UNDEF;
         temps[i].mask = -1;
     }
+    nb_mems = 0;
+}
+
+/* Reset the temporaries which die at the end of a basic block.  Globals
+   and local temps keep their value on the fall-through path of a
+   conditional branch, but a store can now be observed on the other
+   path.  */
+static void reset_bb_temps(TCGContext *s)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (!s->temps[i].temp_local) {
+            reset_temp(i);
+        }
+    }
+    for (i = 0; i < nb_mems; i++) {
+        mems[i].store_index = -1;
+    }
 }
 
 static int op_bits(TCGOpcode op)
@@ -196,6 +243,122 @@ static TCGOpcode op_to_mov(TCGOpcode op)
     }
 }
 
+static bool is_env_ptr(TCGContext *s, TCGArg arg)
+{
+    return s->temps[arg].fixed_reg && s->temps[arg].reg == TCG_AREG0;
+}
+
+static int ldst_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        fprintf(stderr, "ldst_size: unexpected opcode %d.\n", op);
+        tcg_abort();
+    }
+}
+
+/* Return the operation which extracts the result of the load OP from a
+   temp holding the loaded field, or INDEX_op_nop if the host can't.  */
+static TCGOpcode ld_to_ext(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_ld_i32:
+        return INDEX_op_mov_i32;
+    case INDEX_op_ld_i64:
+        return INDEX_op_mov_i64;
+    case INDEX_op_ld8u_i32:
+        return TCG_TARGET_HAS_ext8u_i32 ? INDEX_op_ext8u_i32 : INDEX_op_nop;
+    case INDEX_op_ld8s_i32:
+        return TCG_TARGET_HAS_ext8s_i32 ? INDEX_op_ext8s_i32 : INDEX_op_nop;
+    case INDEX_op_ld16u_i32:
+        return TCG_TARGET_HAS_ext16u_i32 ? INDEX_op_ext16u_i32 : INDEX_op_nop;
+    case INDEX_op_ld16s_i32:
+        return TCG_TARGET_HAS_ext16s_i32 ? INDEX_op_ext16s_i32 : INDEX_op_nop;
+    case INDEX_op_ld8u_i64:
+        return TCG_TARGET_HAS_ext8u_i64 ? INDEX_op_ext8u_i64 : INDEX_op_nop;
+    case INDEX_op_ld8s_i64:
+        return TCG_TARGET_HAS_ext8s_i64 ? INDEX_op_ext8s_i64 : INDEX_op_nop;
+    case INDEX_op_ld16u_i64:
+        return TCG_TARGET_HAS_ext16u_i64 ? INDEX_op_ext16u_i64 : INDEX_op_nop;
+    case INDEX_op_ld16s_i64:
+        return TCG_TARGET_HAS_ext16s_i64 ? INDEX_op_ext16s_i64 : INDEX_op_nop;
+    case INDEX_op_ld32u_i64:
+        return TCG_TARGET_HAS_ext32u_i64 ? INDEX_op_ext32u_i64 : INDEX_op_nop;
+    case INDEX_op_ld32s_i64:
+        return TCG_TARGET_HAS_ext32s_i64 ? INDEX_op_ext32s_i64 : INDEX_op_nop;
+    default:
+        return INDEX_op_nop;
+    }
+}
+
+static int find_mem(tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_mems; i++) {
+        if (mems[i].offset == offset && mems[i].size == size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool mem_overlaps(int i, tcg_target_long offset, int size)
+{
+    return (mems[i].offset < offset + size
+            && offset < mems[i].offset + mems[i].size);
+}
+
+/* The field at OFFSET is about to be read from memory: the stores to it
+   are no longer dead.  */
+static void mem_observe(tcg_target_long offset, int size)
+{
+    int i;
+
+    for (i = 0; i < nb_mems; i++) {
+        if (mem_overlaps(i, offset, size)) {
+            mems[i].store_index = -1;
+        }
+    }
+}
+
+static void mem_record(tcg_target_long offset, int size, TCGArg val,
+                       int store_index)
+{
+    int i;
+
+    for (i = nb_mems - 1; i >= 0; i--) {
+        if (mem_overlaps(i, offset, size)) {
+            reset_mem(i);
+        }
+    }
+    if (nb_mems == TCG_OPT_MAX_MEMS) {
+        reset_mem(0);
+    }
+    mems[nb_mems].offset = offset;
+    mems[nb_mems].size = size;
+    mems[nb_mems].val = val;
+    mems[nb_mems].store_index = store_index;
+    nb_mems++;
+}
+
 static TCGArg do_constant_folding_2(TCGOpcode op, TCGArg x, TCGArg y)
 {
     switch (op) {
@@ -483,7 +646,7 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
-    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
+    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args, size;
     tcg_target_ulong mask, affected;
     TCGOpcode op;
     const TCGOpDef *def;
@@ -646,10 +809,19 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = 0xffff;
             goto and_const;
         case INDEX_op_ext32s_i64:
-            if ((temps[args[1]].mask & 0x80000000) != 0) {
+        case INDEX_op_ext32u_i64:
+            /* These also extend i32 temps, whose high part is undefined
+               whatever the mask says.  */
+            if (s->temps[args[1]].type == TCG_TYPE_I32) {
+                if (op == INDEX_op_ext32u_i64) {
+                    mask = 0xffffffffU;
+                }
+                break;
+            }
+            if (op == INDEX_op_ext32s_i64
+                && (temps[args[1]].mask & 0x80000000) != 0) {
                 break;
             }
-        case INDEX_op_ext32u_i64:
             mask = 0xffffffffU;
             goto and_const;
 
@@ -662,22 +834,37 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = temps[args[1]].mask & mask;
             break;
 
-        CASE_OP_32_64(sar):
+        case INDEX_op_sar_i32:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                mask = ((int32_t)temps[args[1]].mask
+                        >> (temps[args[2]].val & 31));
+            }
+            break;
+
+        case INDEX_op_sar_i64:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
                 mask = ((tcg_target_long)temps[args[1]].mask
-                        >> temps[args[2]].val);
+                        >> (temps[args[2]].val & 63));
             }
             break;
 
-        CASE_OP_32_64(shr):
+        case INDEX_op_shr_i32:
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                mask = ((uint32_t)temps[args[1]].mask
+                        >> (temps[args[2]].val & 31));
+            }
+            break;
+
+        case INDEX_op_shr_i64:
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask >> temps[args[2]].val;
+                mask = temps[args[1]].mask >> (temps[args[2]].val & 63);
             }
             break;
 
         CASE_OP_32_64(shl):
             if (temps[args[2]].state == TCG_TEMP_CONST) {
-                mask = temps[args[1]].mask << temps[args[2]].val;
+                mask = (temps[args[1]].mask
+                        << (temps[args[2]].val & (op_bits(op) - 1)));
             }
             break;
 
@@ -705,10 +892,30 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             mask = temps[args[3]].mask | temps[args[4]].mask;
             break;
 
+        CASE_OP_32_64(ld8u):
+        case INDEX_op_qemu_ld8u:
+            mask = 0xff;
+            break;
+
+        CASE_OP_32_64(ld16u):
+        case INDEX_op_qemu_ld16u:
+            mask = 0xffff;
+            break;
+
+        case INDEX_op_ld32u_i64:
+            mask = 0xffffffffU;
+            break;
+
         default:
             break;
         }
 
+        /* Only the low half of an i32 temp is defined.  */
+        if (op_bits(op) == 32 && !(def->flags & TCG_OPF_CALL_CLOBBER)) {
+            mask &= 0xffffffffU;
+            affected &= 0xffffffffU;
+        }
+
         if (mask == 0) {
             assert(def->nb_oargs == 1);
             s->gen_opc_buf[op_index] = op_to_movi(op);
@@ -997,7 +1204,7 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                        && temps[args[3]].val == 0) {
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
-                reset_all_temps(nb_temps);
+                reset_bb_temps(s);
                 s->gen_opc_buf[op_index] = INDEX_op_brcond_i32;
                 gen_args[0] = args[1];
                 gen_args[1] = args[3];
@@ -1035,6 +1242,101 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             args += 6;
             break;
 
+        CASE_OP_32_64(ld8u):
+        CASE_OP_32_64(ld8s):
+        CASE_OP_32_64(ld16u):
+        CASE_OP_32_64(ld16s):
+        case INDEX_op_ld_i32:
+        case INDEX_op_ld32u_i64:
+        case INDEX_op_ld32s_i64:
+        case INDEX_op_ld_i64:
+            if (!is_env_ptr(s, args[1])) {
+                /* The pointer may well point into env.  */
+                for (i = 0; i < nb_mems; i++) {
+                    mems[i].store_index = -1;
+                }
+                goto do_default;
+            }
+            size = ldst_size(op);
+            i = find_mem(args[2], size);
+            if (i >= 0 && ld_to_ext(op) != INDEX_op_nop
+                && s->temps[mems[i].val].type == s->temps[args[0]].type) {
+                /* Forward the value stored or loaded last.  */
+                tmp = mems[i].val;
+                op = ld_to_ext(op);
+                if (temps[tmp].state == TCG_TEMP_CONST) {
+                    s->gen_opc_buf[op_index] = op_to_movi(op);
+                    tcg_opt_gen_movi(gen_args, args[0],
+                                     op == op_to_mov(op) ? temps[tmp].val
+                                     : do_constant_folding(op, temps[tmp].val,
+                                                           0));
+                    gen_args += 2;
+                } else if (op == op_to_mov(op)) {
+                    if (temps_are_copies(args[0], tmp)) {
+                        s->gen_opc_buf[op_index] = INDEX_op_nop;
+                    } else {
+                        s->gen_opc_buf[op_index] = op;
+                        tcg_opt_gen_mov(s, gen_args, args[0], tmp);
+                        gen_args += 2;
+                    }
+                } else {
+                    s->gen_opc_buf[op_index] = op;
+                    reset_temp(args[0]);
+                    temps[args[0]].mask = mask;
+                    gen_args[0] = args[0];
+                    gen_args[1] = tmp;
+                    gen_args += 2;
+                }
+                args += 3;
+                break;
+            }
+            mem_observe(args[2], size);
+            reset_temp(args[0]);
+            temps[args[0]].mask = mask;
+            mem_record(args[2], size, args[0], -1);
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            args += 3;
+            gen_args += 3;
+            break;
+
+        CASE_OP_32_64(st8):
+        CASE_OP_32_64(st16):
+        case INDEX_op_st_i32:
+        case INDEX_op_st32_i64:
+        case INDEX_op_st_i64:
+            if (!is_env_ptr(s, args[1])) {
+                nb_mems = 0;
+                goto do_default;
+            }
+            size = ldst_size(op);
+            i = find_mem(args[2], size);
+            if (i >= 0) {
+                tmp = mems[i].val;
+                if (temps_are_copies(args[0], tmp)
+                    || (temps[args[0]].state == TCG_TEMP_CONST
+                        && temps[tmp].state == TCG_TEMP_CONST
+                        && ((temps[args[0]].val ^ temps[tmp].val)
+                            & (-1ull >> (64 - size * 8))) == 0)) {
+                    /* The field already holds this value.  */
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                    args += 3;
+                    break;
+                }
+                if (mems[i].store_index >= 0) {
+                    /* Nothing read the previous store.  */
+                    s->gen_opc_buf[mems[i].store_index] = INDEX_op_nop3;
+                }
+            }
+            mem_record(args[2], size, args[0], op_index);
+            gen_args[0] = args[0];
+            gen_args[1] = args[1];
+            gen_args[2] = args[2];
+            args += 3;
+            gen_args += 3;
+            break;
+
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
             if (!(args[nb_call_args + 1] & (TCG_CALL_NO_READ_GLOBALS |
@@ -1043,6 +1345,12 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                     reset_temp(i);
                 }
             }
+            if (!(args[nb_call_args + 1] & TCG_CALL_NO_SIDE_EFFECTS)) {
+                nb_mems = 0;
+            }
+            for (i = 0; i < nb_mems; i++) {
+                mems[i].store_index = -1;
+            }
             for (i = 0; i < (args[0] >> 16); i++) {
                 reset_temp(args[i + 1]);
             }
@@ -1063,11 +1371,22 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                block, otherwise we only trash the output args.  "mask" is
                the non-zero bits mask for the first output arg.  */
             if (def->flags & TCG_OPF_BB_END) {
-                reset_all_temps(nb_temps);
+                if (op == INDEX_op_brcond_i32 || op == INDEX_op_brcond_i64
+                    || op == INDEX_op_brcond2_i32) {
+                    reset_bb_temps(s);
+                } else {
+                    reset_all_temps(nb_temps);
+                }
             } else {
+                if (def->flags & TCG_OPF_SIDE_EFFECTS) {
+                    nb_mems = 0;
+                }
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
                 }
+                if (def->nb_oargs == 1) {
+                    temps[args[0]].mask = mask;
+                }
             }
             for (i = 0; i < def->nb_args; i++) {
                 gen_args[i] = args[i];
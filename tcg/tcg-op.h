@@ -2374,6 +2374,17 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to the host code at PTR, which is either the start of a TB or
+   code_gen_epilogue.  Only for hosts with TCG_TARGET_HAS_goto_ptr.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#else
+    tcg_gen_op1_i64(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#endif
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -791,6 +791,10 @@ static void tcg_reg_alloc_start(TCGContext *s)
     for(i = 0; i < TCG_TARGET_NB_REGS; i++) {
         s->reg_to_temp[i] = -1;
     }
+    if (s->label_flags) {
+        s->label_regs = tcg_malloc(s->nb_labels * s->nb_globals *
+                                   sizeof(int16_t));
+    }
 }
 
 static char *tcg_get_arg_str_idx(TCGContext *s, char *buf, int buf_size,
@@ -1211,6 +1215,93 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* Label state for extended basic blocks.  A label qualifies when every
+   branch to it is a forward one; the liveness pass runs backwards, so a
+   branch met before its label is a backward branch.  */
+#define TCG_LABEL_SEEN      1  /* set_label met by the liveness pass */
+#define TCG_LABEL_BACKWARD  2  /* some branch to the label comes after it */
+#define TCG_LABEL_REACHED   4  /* a branch to it has been allocated */
+
+/* If 'op' is a branch or label that can keep globals in registers,
+   return its label, otherwise -1.  */
+static int tcg_ebb_label(TCGContext *s, TCGOpcode op, const TCGArg *args)
+{
+    int label;
+
+    if (!s->label_flags) {
+        return -1;
+    }
+    switch (op) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+    case INDEX_op_brcond2_i32:
+        label = args[tcg_op_defs[op].nb_args - 1];
+        break;
+    default:
+        return -1;
+    }
+    return s->label_flags[label] & TCG_LABEL_BACKWARD ? -1 : label;
+}
+
+/* liveness analysis: forward branch or label of an extended basic
+   block.  Temps are dead as at the end of a basic block, and globals
+   must be in sync with memory, since the allocator falls back to
+   memory wherever the branches disagree.  A global is live before a
+   branch if it is live at its label or on the fall through path.  */
+static void tcg_la_ebb_end(TCGContext *s, TCGOpcode op, const TCGArg *args,
+                           uint8_t *dead_temps, uint8_t *mem_temps)
+{
+    uint8_t *label_dead;
+    int i;
+
+    if (s->label_flags) {
+        int label = args[tcg_op_defs[op].nb_args - 1];
+
+        switch (op) {
+        case INDEX_op_set_label:
+            s->label_flags[label] |= TCG_LABEL_SEEN;
+            break;
+        case INDEX_op_br:
+        case INDEX_op_brcond_i32:
+        case INDEX_op_brcond_i64:
+        case INDEX_op_brcond2_i32:
+            if (!(s->label_flags[label] & TCG_LABEL_SEEN)) {
+                s->label_flags[label] |= TCG_LABEL_BACKWARD;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    i = tcg_ebb_label(s, op, args);
+    if (i < 0) {
+        tcg_la_bb_end(s, dead_temps, mem_temps);
+        return;
+    }
+
+    label_dead = &s->label_dead[i * s->nb_globals];
+    switch (op) {
+    case INDEX_op_set_label:
+        memcpy(label_dead, dead_temps, s->nb_globals);
+        break;
+    case INDEX_op_br:
+        memcpy(dead_temps, label_dead, s->nb_globals);
+        break;
+    default:
+        for (i = 0; i < s->nb_globals; i++) {
+            dead_temps[i] &= label_dead[i];
+        }
+        break;
+    }
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        dead_temps[i] = 1;
+        mem_temps[i] = s->temps[i].temp_local;
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1235,6 +1326,13 @@ static void tcg_liveness_analysis(TCGContext *s)
     mem_temps = tcg_malloc(s->nb_temps);
     tcg_la_func_end(s, dead_temps, mem_temps);
 
+    s->label_flags = NULL;
+    if (s->ebb && s->nb_labels) {
+        s->label_flags = tcg_malloc(s->nb_labels);
+        memset(s->label_flags, 0, s->nb_labels);
+        s->label_dead = tcg_malloc(s->nb_labels * s->nb_globals);
+    }
+
     args = s->gen_opparam_ptr;
     op_index = nb_ops - 1;
     while (op_index >= 0) {
@@ -1413,7 +1511,7 @@ static void tcg_liveness_analysis(TCGContext *s)
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, dead_temps, mem_temps);
+                    tcg_la_ebb_end(s, op, args, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     memset(mem_temps, 1, s->nb_globals);
@@ -1450,6 +1548,8 @@ static void tcg_liveness_analysis(TCGContext *s)
     memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
     memset(s->op_sync_args, 0, nb_ops * sizeof(uint8_t));
+    /* extended basic blocks need the liveness information */
+    s->label_flags = NULL;
 }
 #endif
 
@@ -1657,12 +1757,17 @@ static inline void temp_save(TCGContext *s, int temp, TCGRegSet allocated_regs)
 {
 #ifdef USE_LIVENESS_ANALYSIS
     /* The liveness analysis already ensures that globals are back
-       in memory. Keep an assert for safety. */
-    assert(s->temps[temp].val_type == TEMP_VAL_MEM || s->temps[temp].fixed_reg);
-#else
+       in memory. Keep an assert for safety.  In an extended basic
+       block a global can stay in a register past its last use, but
+       it is in sync and dropping it costs nothing.  */
+    if (!s->label_flags) {
+        assert(s->temps[temp].val_type == TEMP_VAL_MEM ||
+               s->temps[temp].fixed_reg);
+        return;
+    }
+#endif
     temp_sync(s, temp, allocated_regs);
     temp_dead(s, temp);
-#endif
 }
 
 /* save globals to their canonical location and assume they can be
@@ -1694,9 +1799,9 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
-/* at the end of a basic block, we assume all temporaries are dead and
-   all globals are stored at their canonical location. */
-static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+/* at the end of a basic block, temporaries are dead and local
+   temporaries are stored at their canonical location. */
+static void temps_bb_end(TCGContext *s, TCGRegSet allocated_regs)
 {
     TCGTemp *ts;
     int i;
@@ -1715,10 +1820,151 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
 #endif
         }
     }
+}
 
+/* at the end of a basic block, we assume all temporaries are dead and
+   all globals are stored at their canonical location. */
+static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+{
+    temps_bb_end(s, allocated_regs);
     save_globals(s, allocated_regs);
 }
 
+/* Forward branch inside an extended basic block: sync the globals but
+   leave them in their registers, and record at the label which globals
+   are in the same register on every branch to it.  */
+static void tcg_reg_alloc_ebb_branch(TCGContext *s, TCGOpcode opc, int label,
+                                     TCGRegSet allocated_regs)
+{
+    int16_t *regs = &s->label_regs[label * s->nb_globals];
+    int reached = s->label_flags[label] & TCG_LABEL_REACHED;
+    TCGTemp *ts;
+    int i, reg;
+
+    temps_bb_end(s, allocated_regs);
+    /* Syncing a constant can spill another global, so sync them all
+       before looking at the registers.  */
+    for (i = 0; i < s->nb_globals; i++) {
+        temp_sync(s, i, allocated_regs);
+    }
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        reg = -1;
+        if (!ts->fixed_reg && ts->val_type == TEMP_VAL_REG) {
+            reg = ts->reg;
+        }
+        if (!reached) {
+            regs[i] = reg;
+        } else if (regs[i] != reg) {
+            regs[i] = -1;
+        }
+    }
+    s->label_flags[label] |= TCG_LABEL_REACHED;
+
+    if (opc == INDEX_op_br) {
+        /* Nothing falls through.  */
+        for (i = 0; i < s->nb_globals; i++) {
+            temp_dead(s, i);
+        }
+    }
+}
+
+/* Label of an extended basic block.  A live global stays in its
+   register if the branches and the fall through path agree on it; the
+   fall through path moves it if the register is free.  Everywhere else
+   the global goes back to memory, where all the paths have stored it.
+   Return the number of globals kept, or -1 if this is a plain basic
+   block end.  */
+static int tcg_reg_alloc_label(TCGContext *s, int label, int fallthrough)
+{
+    uint8_t *label_dead;
+    int16_t *regs;
+    TCGTemp *ts;
+    int i, want, progress, kept = 0;
+
+    if (!s->label_flags || (s->label_flags[label] & TCG_LABEL_BACKWARD)) {
+        tcg_reg_alloc_bb_end(s, s->reserved_regs);
+        return -1;
+    }
+    temps_bb_end(s, s->reserved_regs);
+
+    label_dead = &s->label_dead[label * s->nb_globals];
+    regs = &s->label_regs[label * s->nb_globals];
+    for (i = 0; i < s->nb_globals; i++) {
+        if (label_dead[i]) {
+            regs[i] = -1;
+        }
+    }
+    if (!(s->label_flags[label] & TCG_LABEL_REACHED)) {
+        /* No branch to it: the state is that of the fall through path.  */
+        for (i = 0; i < s->nb_globals; i++) {
+            ts = &s->temps[i];
+            if (!fallthrough || label_dead[i]) {
+                temp_sync(s, i, s->reserved_regs);
+                temp_dead(s, i);
+            } else if (!ts->fixed_reg && ts->val_type == TEMP_VAL_REG) {
+                kept++;
+            }
+        }
+        return kept;
+    }
+
+    if (!fallthrough) {
+        for (i = 0; i < s->nb_globals; i++) {
+            temp_dead(s, i);
+        }
+        for (i = 0; i < s->nb_globals; i++) {
+            ts = &s->temps[i];
+            if (!ts->fixed_reg && regs[i] >= 0) {
+                ts->val_type = TEMP_VAL_REG;
+                ts->reg = regs[i];
+                ts->mem_coherent = 1;
+                s->reg_to_temp[ts->reg] = i;
+                kept++;
+            }
+        }
+        return kept;
+    }
+
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (!ts->fixed_reg && ts->val_type == TEMP_VAL_REG && regs[i] < 0) {
+            temp_sync(s, i, s->reserved_regs);
+            temp_dead(s, i);
+        }
+    }
+    do {
+        progress = 0;
+        for (i = 0; i < s->nb_globals; i++) {
+            ts = &s->temps[i];
+            want = regs[i];
+            if (ts->fixed_reg || want < 0 || ts->val_type != TEMP_VAL_REG ||
+                ts->reg == want || s->reg_to_temp[want] != -1) {
+                continue;
+            }
+            tcg_out_mov(s, ts->type, want, ts->reg);
+            s->reg_to_temp[ts->reg] = -1;
+            s->reg_to_temp[want] = i;
+            ts->reg = want;
+            progress = 1;
+        }
+    } while (progress);
+
+    for (i = 0; i < s->nb_globals; i++) {
+        ts = &s->temps[i];
+        if (ts->fixed_reg || ts->val_type != TEMP_VAL_REG) {
+            continue;
+        }
+        if (ts->reg == regs[i]) {
+            kept++;
+        } else {
+            temp_sync(s, i, s->reserved_regs);
+            temp_dead(s, i);
+        }
+    }
+    return kept;
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -1922,7 +2168,13 @@ static void tcg_reg_alloc_op(TCGContext *s,
     }
 
     if (def->flags & TCG_OPF_BB_END) {
-        tcg_reg_alloc_bb_end(s, allocated_regs);
+        int label = tcg_ebb_label(s, opc, args);
+
+        if (label >= 0) {
+            tcg_reg_alloc_ebb_branch(s, opc, label, allocated_regs);
+        } else {
+            tcg_reg_alloc_bb_end(s, allocated_regs);
+        }
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
             /* XXX: permit generic clobber register list ? */ 
@@ -2179,6 +2431,152 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     return nb_iargs + nb_oargs + def->nb_cargs + 1;
 }
 
+#if defined(CONFIG_SOFTMMU) && TARGET_LONG_BITS == 32
+/* Load the value of temp 'arg' into the call argument register 'reg'. */
+static void tcg_reg_alloc_call_arg(TCGContext *s, int reg, TCGArg arg)
+{
+    TCGTemp *ts = &s->temps[arg];
+
+    if (ts->val_type == TEMP_VAL_REG && ts->reg == reg) {
+        return;
+    }
+    tcg_reg_free(s, reg);
+    if (ts->val_type == TEMP_VAL_REG) {
+        tcg_out_mov(s, ts->type, reg, ts->reg);
+    } else if (ts->val_type == TEMP_VAL_MEM) {
+        tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+    } else if (ts->val_type == TEMP_VAL_CONST) {
+        tcg_out_movi(s, ts->type, reg, ts->val);
+    } else {
+        tcg_abort();
+    }
+}
+
+/* Emit a qemu_ld/st whose address is a translation time constant inside
+   a device range as a plain call to the matching helper_direct_* helper.
+   The helper still goes through the TLB, so memory map and protection
+   changes need no TB invalidation; what is saved is the inline TLB
+   compare (which always misses on MMIO pages) and the generic I/O
+   dispatch.  Returns false if the op must be allocated normally. */
+static bool tcg_reg_alloc_direct_io(TCGContext *s, const TCGOpDef *def,
+                                    TCGOpcode opc, const TCGArg *args,
+                                    uint16_t dead_args, uint8_t sync_args)
+{
+    const TCGArgConstraint *arg_ct;
+    TCGRegSet allocated_regs;
+    tcg_target_long func_addr;
+    TCGArg func_arg;
+    int const_func_arg, mem_reg, i, reg;
+    TCGTemp *ts;
+    bool is_ld;
+
+    if (!s->direct_io_addr || ARRAY_SIZE(tcg_target_call_iarg_regs) < 4) {
+        return false;
+    }
+    ts = &s->temps[args[1]];
+    if (ts->val_type != TEMP_VAL_CONST || !s->direct_io_addr(ts->val)) {
+        return false;
+    }
+
+    switch (opc) {
+    case INDEX_op_qemu_ld8u:
+        func_addr = (tcg_target_long)helper_direct_ldb_mmu;
+        break;
+    case INDEX_op_qemu_ld16u:
+        func_addr = (tcg_target_long)helper_direct_ldw_mmu;
+        break;
+    case INDEX_op_qemu_ld32:
+        func_addr = (tcg_target_long)helper_direct_ldl_mmu;
+        break;
+    case INDEX_op_qemu_st8:
+        func_addr = (tcg_target_long)helper_direct_stb_mmu;
+        break;
+    case INDEX_op_qemu_st16:
+        func_addr = (tcg_target_long)helper_direct_stw_mmu;
+        break;
+    case INDEX_op_qemu_st32:
+        func_addr = (tcg_target_long)helper_direct_stl_mmu;
+        break;
+    default:
+        return false;
+    }
+    is_ld = def->nb_oargs == 1;
+
+    /* (env, addr, mmu_idx) or (env, addr, val, mmu_idx); the value goes
+       first as it may live in one of the other argument registers */
+    tcg_regset_set(allocated_regs, s->reserved_regs);
+    if (!is_ld) {
+        reg = tcg_target_call_iarg_regs[2];
+        tcg_reg_alloc_call_arg(s, reg, args[0]);
+        tcg_regset_set_reg(allocated_regs, reg);
+    }
+    reg = tcg_target_call_iarg_regs[0];
+    tcg_reg_free(s, reg);
+    tcg_out_mov(s, TCG_TYPE_PTR, reg, TCG_AREG0);
+    tcg_regset_set_reg(allocated_regs, reg);
+    reg = tcg_target_call_iarg_regs[1];
+    tcg_reg_free(s, reg);
+    tcg_out_movi(s, TCG_TYPE_I32, reg, ts->val);
+    tcg_regset_set_reg(allocated_regs, reg);
+    mem_reg = tcg_target_call_iarg_regs[is_ld ? 2 : 3];
+    tcg_reg_free(s, mem_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, mem_reg, args[2]);
+    tcg_regset_set_reg(allocated_regs, mem_reg);
+
+    for (i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
+        if (IS_DEAD_ARG(i)) {
+            temp_dead(s, args[i]);
+        }
+    }
+    for (reg = 0; reg < TCG_TARGET_NB_REGS; reg++) {
+        if (tcg_regset_test_reg(tcg_target_call_clobber_regs, reg)) {
+            tcg_reg_free(s, reg);
+        }
+    }
+    /* like any qemu_ld/st, the access may fault and device callbacks
+       only see the synced CPU state */
+    sync_globals(s, allocated_regs);
+
+    arg_ct = &tcg_op_defs[INDEX_op_call].args_ct[0];
+    if (tcg_target_const_match(func_addr, arg_ct)) {
+        const_func_arg = 1;
+        func_arg = func_addr;
+    } else {
+        reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
+        tcg_out_movi(s, TCG_TYPE_PTR, reg, func_addr);
+        const_func_arg = 0;
+        func_arg = reg;
+    }
+    tcg_out_op(s, INDEX_op_call, &func_arg, &const_func_arg);
+
+    if (is_ld) {
+        ts = &s->temps[args[0]];
+        reg = tcg_target_call_oarg_regs[0];
+        assert(s->reg_to_temp[reg] == -1);
+        if (ts->fixed_reg) {
+            if (ts->reg != reg) {
+                tcg_out_mov(s, ts->type, ts->reg, reg);
+            }
+        } else {
+            if (ts->val_type == TEMP_VAL_REG) {
+                s->reg_to_temp[ts->reg] = -1;
+            }
+            ts->val_type = TEMP_VAL_REG;
+            ts->reg = reg;
+            ts->mem_coherent = 0;
+            s->reg_to_temp[reg] = args[0];
+            if (NEED_SYNC_ARG(0)) {
+                tcg_reg_sync(s, reg);
+            }
+            if (IS_DEAD_ARG(0)) {
+                temp_dead(s, args[0]);
+            }
+        }
+    }
+    return true;
+}
+#endif
+
 #ifdef CONFIG_PROFILER
 
 static int64_t tcg_table_op_count[NB_OPS];
@@ -2203,6 +2601,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     int op_index;
     const TCGOpDef *def;
     const TCGArg *args;
+    int fallthrough = 1;
 
 #ifdef DEBUG_DISAS
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
@@ -2285,7 +2684,14 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
             temp_dead(s, args[0]);
             break;
         case INDEX_op_set_label:
-            tcg_reg_alloc_bb_end(s, s->reserved_regs);
+            {
+                int kept = tcg_reg_alloc_label(s, args[0], fallthrough);
+
+                if (kept >= 0 && search_pc < 0) {
+                    s->ebb_label_count++;
+                    s->ebb_kept_count += kept;
+                }
+            }
             tcg_out_label(s, args[0], s->code_ptr);
             break;
         case INDEX_op_call:
@@ -2295,6 +2701,23 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
             goto next;
         case INDEX_op_end:
             goto the_end;
+#if defined(CONFIG_SOFTMMU) && TARGET_LONG_BITS == 32
+        case INDEX_op_qemu_ld8u:
+        case INDEX_op_qemu_ld16u:
+        case INDEX_op_qemu_st8:
+        case INDEX_op_qemu_st16:
+        case INDEX_op_qemu_ld32:
+        case INDEX_op_qemu_st32:
+            if (tcg_reg_alloc_direct_io(s, def, opc, args,
+                                        s->op_dead_args[op_index],
+                                        s->op_sync_args[op_index])) {
+                if (search_pc < 0) {
+                    s->direct_io_count++;
+                }
+                break;
+            }
+            /* fall through */
+#endif
         default:
             /* Sanity check that we've not introduced any unhandled opcodes. */
             if (def->flags & TCG_OPF_NOT_PRESENT) {
@@ -2309,6 +2732,22 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
         }
         args += def->nb_args;
     next:
+        switch (opc) {
+        case INDEX_op_br:
+        case INDEX_op_exit_tb:
+            fallthrough = 0;
+            break;
+        case INDEX_op_debug_insn_start:
+        case INDEX_op_nop:
+        case INDEX_op_nop1:
+        case INDEX_op_nop2:
+        case INDEX_op_nop3:
+        case INDEX_op_nopn:
+            break;
+        default:
+            fallthrough = 1;
+            break;
+        }
         if (search_pc >= 0 && search_pc < s->code_ptr - gen_code_buf) {
             return op_index;
         }
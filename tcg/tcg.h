@@ -411,6 +411,26 @@ struct TCGContext {
     uint8_t *op_sync_args;  /* for each operation, each bit tells if the
                                corresponding output argument needs to be
                                sync to memory. */
+
+    /* extended basic blocks (-tcg ebb=on): globals may stay in host
+       registers across forward branches inside a TB */
+    int ebb;
+    uint8_t *label_flags;   /* TCG_LABEL_* for each label, NULL when the
+                               current TB is not allocated this way */
+    uint8_t *label_dead;    /* for each label and global, whether the
+                               global is dead at the label */
+    int16_t *label_regs;    /* for each label and global, the host register
+                               holding the global on all the branches to
+                               the label allocated so far, or -1 */
+    int64_t ebb_label_count;
+    int64_t ebb_kept_count;
+
+    /* constant-address device accesses: when set, qemu_ld/st ops whose
+       address is a known constant accepted by this predicate are emitted
+       as a direct call to the helper_direct_* softmmu helpers instead of
+       the inline TLB lookup */
+    bool (*direct_io_addr)(tcg_target_ulong addr);
+    int64_t direct_io_count;
     
     /* tells in which temporary a given register is. It does not take
        into account fixed registers */
@@ -659,6 +679,7 @@ TCGv_i32 tcg_const_local_i32(int32_t val);
 TCGv_i64 tcg_const_local_i64(int64_t val);
 
 extern uint8_t *code_gen_prologue;
+extern uint8_t *code_gen_epilogue;
 
 /* TCG targets may use a different definition of tcg_qemu_tb_exec. */
 #if !defined(tcg_qemu_tb_exec)
@@ -433,9 +433,41 @@ static void tcg_out64(TCGContext *s, uint64_t v)
     s->code_ptr += sizeof(v);
 }
 
-/* Write opcode. */
+/* Opcodes are written as one byte. */
+QEMU_BUILD_BUG_ON(TCI_NB_OPS > 256);
+
+/* The last two ops written, to make superinstructions. */
+static uint8_t *tci_last_op;
+static uint8_t *tci_prev_op;
+
+/* Whether the op written at op_ptr, if any, ends at end.  Its size is
+   only set once it is complete. */
+static bool tci_op_ends_at(const uint8_t *op_ptr, const uint8_t *end)
+{
+    return op_ptr && op_ptr[1] != 0 && op_ptr + op_ptr[1] == end;
+}
+
+/* Write opcode.  The ops just before it are turned into a superinstruction
+   when they make one with it: since the bytes of the sequence follow each
+   other, this holds whatever TB or label they belong to. */
 static void tcg_out_op_t(TCGContext *s, TCGOpcode op)
 {
+    uint8_t *last = tci_last_op;
+
+    if (tci_op_ends_at(last, s->code_ptr)) {
+        if (last[0] == INDEX_op_setcond_i32 && op == INDEX_op_brcond_i32) {
+            last[0] = INDEX_op_tci_setcond_brcond_i32;
+        } else if (last[0] == INDEX_op_ld_i32 && op == INDEX_op_add_i32) {
+            last[0] = INDEX_op_tci_ld_add_i32;
+        } else if (last[0] == INDEX_op_add_i32 && op == INDEX_op_st_i32 &&
+                   tci_op_ends_at(tci_prev_op, last) &&
+                   tci_prev_op[0] == INDEX_op_tci_ld_add_i32) {
+            tci_prev_op[0] = INDEX_op_tci_ld_add_st_i32;
+        }
+    }
+    tci_prev_op = last;
+    tci_last_op = s->code_ptr;
+
     tcg_out8(s, op);
     tcg_out8(s, 0);
 }
@@ -55,6 +55,17 @@
 #endif
 #endif
 
+/* Superinstructions: the backend gives the first op of some common
+ * sequences one of these opcodes in place of its own (see tcg_out_op_t),
+ * and the interpreter then runs the whole sequence without dispatching
+ * between its ops.  The other ops keep their own opcodes, so that a
+ * branch to one of them still works.
+ */
+#define INDEX_op_tci_setcond_brcond_i32 (NB_OPS + 0)
+#define INDEX_op_tci_ld_add_i32         (NB_OPS + 1)
+#define INDEX_op_tci_ld_add_st_i32      (NB_OPS + 2)
+#define TCI_NB_OPS                      (NB_OPS + 3)
+
 /* Optional instructions. */
 
 #define TCG_TARGET_HAS_bswap16_i32      1
@@ -76,6 +87,7 @@
 #define TCG_TARGET_HAS_orc_i32          0
 #define TCG_TARGET_HAS_rot_i32          1
 #define TCG_TARGET_HAS_movcond_i32      0
+#define TCG_TARGET_HAS_goto_ptr         0
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_bswap16_i64      1
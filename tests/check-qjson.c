@@ -17,6 +17,8 @@
 #include "qapi/qmp/qfloat.h"
 #include "qapi/qmp/qbool.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/json-streamer.h"
+#include "qapi/qmp/json-parser.h"
 
 #include "qemu-common.h"
 
@@ -518,6 +520,57 @@ static void large_dict(void)
     g_string_free(gstr, true);
 }
 
+typedef struct ChunkedState
+{
+    JSONMessageParser parser;
+    QObject *result;
+} ChunkedState;
+
+static void chunked_emit(JSONMessageParser *parser, QList *tokens)
+{
+    ChunkedState *s = container_of(parser, ChunkedState, parser);
+
+    g_assert(s->result == NULL);
+    s->result = json_parser_parse(tokens, NULL);
+}
+
+/* The same input split anywhere gives the same object. */
+static void chunked_input(void)
+{
+    GString *gstr = g_string_new("");
+    QObject *obj;
+    QString *expected, *str;
+    ChunkedState s;
+    size_t chunk, i;
+
+    gen_test_json(gstr, 5, 20);
+    g_string_append(gstr, " \n");
+    obj = qobject_from_json(gstr->str);
+    g_assert(obj != NULL);
+    expected = qobject_to_json(obj);
+    qobject_decref(obj);
+
+    for (chunk = 1; chunk <= 7; chunk++) {
+        s.result = NULL;
+        json_message_parser_init(&s.parser, chunked_emit);
+        for (i = 0; i < gstr->len; i += chunk) {
+            json_message_parser_feed(&s.parser, gstr->str + i,
+                                     MIN(chunk, gstr->len - i));
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        g_assert(s.result != NULL);
+        str = qobject_to_json(s.result);
+        g_assert_cmpstr(qstring_get_str(str), ==, qstring_get_str(expected));
+        QDECREF(str);
+        qobject_decref(s.result);
+    }
+
+    QDECREF(expected);
+    g_string_free(gstr, true);
+}
+
 static void simple_list(void)
 {
     int i;
@@ -759,6 +812,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
+    g_test_add_func("/dicts/chunked_input", chunked_input);
     g_test_add_func("/lists/simple_list", simple_list);
 
     g_test_add_func("/whitespace/simple_whitespace", simple_whitespace);
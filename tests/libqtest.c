@@ -180,19 +180,15 @@ void qtest_quit(QTestState *s)
     g_free(s->qmp_socket_path);
 }
 
-static void socket_sendf(int fd, const char *fmt, va_list ap)
+static void socket_send(int fd, const char *buf, size_t size)
 {
-    gchar *str;
-    size_t size, offset;
-
-    str = g_strdup_vprintf(fmt, ap);
-    size = strlen(str);
+    size_t offset;
 
     offset = 0;
     while (offset < size) {
         ssize_t len;
 
-        len = write(fd, str + offset, size - offset);
+        len = write(fd, buf + offset, size - offset);
         if (len == -1 && errno == EINTR) {
             continue;
         }
@@ -204,6 +200,15 @@ static void socket_sendf(int fd, const char *fmt, va_list ap)
     }
 }
 
+static void socket_sendf(int fd, const char *fmt, va_list ap)
+{
+    gchar *str;
+
+    str = g_strdup_vprintf(fmt, ap);
+    socket_send(fd, str, strlen(str));
+    g_free(str);
+}
+
 static void GCC_FMT_ATTR(2, 3) qtest_sendf(QTestState *s, const char *fmt, ...)
 {
     va_list ap;
@@ -213,27 +218,33 @@ static void GCC_FMT_ATTR(2, 3) qtest_sendf(QTestState *s, const char *fmt, ...)
     va_end(ap);
 }
 
+static void qtest_recv(QTestState *s)
+{
+    ssize_t len;
+    char buffer[1024];
+
+    do {
+        len = read(s->fd, buffer, sizeof(buffer));
+    } while (len == -1 && errno == EINTR);
+
+    if (len == -1 || len == 0) {
+        fprintf(stderr, "Broken pipe\n");
+        exit(1);
+    }
+
+    g_string_append_len(s->rx, buffer, len);
+}
+
 static GString *qtest_recv_line(QTestState *s)
 {
     GString *line;
     size_t offset;
     char *eol;
 
-    while ((eol = strchr(s->rx->str, '\n')) == NULL) {
-        ssize_t len;
-        char buffer[1024];
-
-        len = read(s->fd, buffer, sizeof(buffer));
-        if (len == -1 && errno == EINTR) {
-            continue;
-        }
-
-        if (len == -1 || len == 0) {
-            fprintf(stderr, "Broken pipe\n");
-            exit(1);
-        }
-
-        g_string_append_len(s->rx, buffer, len);
+    /* The results of a batch may follow the line, so do not stop at
+     * a NUL.  */
+    while ((eol = memchr(s->rx->str, '\n', s->rx->len)) == NULL) {
+        qtest_recv(s);
     }
 
     offset = eol - s->rx->str;
@@ -479,3 +490,150 @@ void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size)
     qtest_sendf(s, "\n");
     qtest_rsp(s, 0);
 }
+
+enum {
+    QTEST_BATCH_READ = 0x01,
+    QTEST_BATCH_WRITE = 0x02,
+    QTEST_BATCH_IN = 0x03,
+    QTEST_BATCH_OUT = 0x04,
+    QTEST_BATCH_CLOCK_STEP = 0x05,
+    QTEST_BATCH_CLOCK_SET = 0x06,
+};
+
+/* Where the results of a batch go, in the order they come back.  */
+typedef struct QTestBatchResult {
+    void *dest;
+    size_t size;
+    bool integer;
+} QTestBatchResult;
+
+struct QTestBatch
+{
+    GString *ops;
+    GArray *results;
+};
+
+static void batch_put(QTestBatch *b, uint64_t val, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        g_string_append_c(b->ops, (char)(val >> (i * 8)));
+    }
+}
+
+static void batch_expect(QTestBatch *b, void *dest, size_t size, bool integer)
+{
+    QTestBatchResult r = { .dest = dest, .size = size, .integer = integer };
+
+    g_array_append_val(b->results, r);
+}
+
+QTestBatch *qtest_batch_new(void)
+{
+    QTestBatch *b = g_malloc(sizeof(*b));
+
+    b->ops = g_string_new("");
+    b->results = g_array_new(FALSE, FALSE, sizeof(QTestBatchResult));
+    return b;
+}
+
+void qtest_batch_free(QTestBatch *b)
+{
+    g_string_free(b->ops, TRUE);
+    g_array_free(b->results, TRUE);
+    g_free(b);
+}
+
+void qtest_batch_memread(QTestBatch *b, uint64_t addr, void *data, size_t size)
+{
+    batch_put(b, QTEST_BATCH_READ, 1);
+    batch_put(b, size, 4);
+    batch_put(b, addr, 8);
+    batch_expect(b, data, size, false);
+}
+
+void qtest_batch_memwrite(QTestBatch *b, uint64_t addr, const void *data,
+                          size_t size)
+{
+    batch_put(b, QTEST_BATCH_WRITE, 1);
+    batch_put(b, size, 4);
+    batch_put(b, addr, 8);
+    g_string_append_len(b->ops, data, size);
+}
+
+void qtest_batch_in(QTestBatch *b, uint16_t addr, int size, uint32_t *value)
+{
+    g_assert(size == 1 || size == 2 || size == 4);
+    batch_put(b, QTEST_BATCH_IN, 1);
+    batch_put(b, size, 1);
+    batch_put(b, addr, 2);
+    batch_expect(b, value, sizeof(*value), true);
+}
+
+void qtest_batch_out(QTestBatch *b, uint16_t addr, int size, uint32_t value)
+{
+    g_assert(size == 1 || size == 2 || size == 4);
+    batch_put(b, QTEST_BATCH_OUT, 1);
+    batch_put(b, size, 1);
+    batch_put(b, addr, 2);
+    batch_put(b, value, 4);
+}
+
+void qtest_batch_clock_step(QTestBatch *b, int64_t step, int64_t *clock)
+{
+    batch_put(b, QTEST_BATCH_CLOCK_STEP, 1);
+    batch_put(b, step, 8);
+    batch_expect(b, clock, sizeof(*clock), true);
+}
+
+void qtest_batch_clock_set(QTestBatch *b, int64_t val, int64_t *clock)
+{
+    batch_put(b, QTEST_BATCH_CLOCK_SET, 1);
+    batch_put(b, val, 8);
+    batch_expect(b, clock, sizeof(*clock), true);
+}
+
+void qtest_batch_run(QTestState *s, QTestBatch *b)
+{
+    const uint8_t *p;
+    gchar **args;
+    size_t len, i, j;
+
+    qtest_sendf(s, "batch %zu\n", b->ops->len);
+    socket_send(s->fd, b->ops->str, b->ops->len);
+
+    args = qtest_rsp(s, 2);
+    len = strtoul(args[1], NULL, 0);
+    g_strfreev(args);
+    while (s->rx->len < len) {
+        qtest_recv(s);
+    }
+
+    p = (const uint8_t *)s->rx->str;
+    for (i = 0; i < b->results->len; i++) {
+        QTestBatchResult *r = &g_array_index(b->results, QTestBatchResult, i);
+        size_t size = r->size;
+
+        g_assert_cmpint(p + size - (const uint8_t *)s->rx->str, <=, len);
+        if (r->integer) {
+            uint64_t val = 0;
+
+            for (j = 0; j < size; j++) {
+                val |= (uint64_t)p[j] << (j * 8);
+            }
+            if (size == 4) {
+                *(uint32_t *)r->dest = val;
+            } else {
+                *(int64_t *)r->dest = val;
+            }
+        } else if (r->dest) {
+            memcpy(r->dest, p, size);
+        }
+        p += size;
+    }
+    g_string_erase(s->rx, 0, len);
+
+    g_string_truncate(b->ops, 0);
+    g_array_set_size(b->results, 0);
+}
@@ -20,6 +20,7 @@
 #include <sys/types.h>
 
 typedef struct QTestState QTestState;
+typedef struct QTestBatch QTestBatch;
 
 extern QTestState *global_qtest;
 
@@ -183,6 +184,89 @@ int64_t qtest_clock_step(QTestState *s, int64_t step);
  */
 int64_t qtest_clock_set(QTestState *s, int64_t val);
 
+/**
+ * qtest_batch_new:
+ *
+ * Returns an empty batch.  Operations added to a batch are all sent to
+ * QEMU by qtest_batch_run(), which waits for their results only once.
+ */
+QTestBatch *qtest_batch_new(void);
+
+/**
+ * qtest_batch_free:
+ * @b: Batch to free.
+ */
+void qtest_batch_free(QTestBatch *b);
+
+/**
+ * qtest_batch_memread:
+ * @b: Batch to add to.
+ * @addr: Guest address to read from.
+ * @data: Pointer to where memory contents will be stored, or %NULL.
+ * @size: Number of bytes to read.
+ *
+ * Read guest memory into a buffer when the batch is run.
+ */
+void qtest_batch_memread(QTestBatch *b, uint64_t addr, void *data, size_t size);
+
+/**
+ * qtest_batch_memwrite:
+ * @b: Batch to add to.
+ * @addr: Guest address to write to.
+ * @data: Pointer to the bytes that will be written to guest memory.
+ * @size: Number of bytes to write.
+ *
+ * Write a buffer to guest memory when the batch is run.  The bytes are
+ * copied into the batch.
+ */
+void qtest_batch_memwrite(QTestBatch *b, uint64_t addr, const void *data,
+                          size_t size);
+
+/**
+ * qtest_batch_in:
+ * @b: Batch to add to.
+ * @addr: I/O port to read from.
+ * @size: Access size, 1, 2 or 4 bytes.
+ * @value: Where the value read will be stored.
+ */
+void qtest_batch_in(QTestBatch *b, uint16_t addr, int size, uint32_t *value);
+
+/**
+ * qtest_batch_out:
+ * @b: Batch to add to.
+ * @addr: I/O port to write to.
+ * @size: Access size, 1, 2 or 4 bytes.
+ * @value: Value being written.
+ */
+void qtest_batch_out(QTestBatch *b, uint16_t addr, int size, uint32_t value);
+
+/**
+ * qtest_batch_clock_step:
+ * @b: Batch to add to.
+ * @step: Number of nanoseconds to advance the clock by, or -1 to advance
+ * it to the next deadline.
+ * @clock: Where the value of the vm_clock afterwards will be stored.
+ */
+void qtest_batch_clock_step(QTestBatch *b, int64_t step, int64_t *clock);
+
+/**
+ * qtest_batch_clock_set:
+ * @b: Batch to add to.
+ * @val: Nanoseconds value to advance the clock to.
+ * @clock: Where the value of the vm_clock afterwards will be stored.
+ */
+void qtest_batch_clock_set(QTestBatch *b, int64_t val, int64_t *clock);
+
+/**
+ * qtest_batch_run:
+ * @s: QTestState instance to operate on.
+ * @b: Batch to run.
+ *
+ * Run the operations of @b in order, store their results, and empty @b
+ * so that it can be filled again.
+ */
+void qtest_batch_run(QTestState *s, QTestBatch *b);
+
 /**
  * qtest_get_arch:
  *
@@ -343,4 +427,13 @@ void qtest_add_func(const char *str, void (*fn));
  */
 #define clock_set(val) qtest_clock_set(global_qtest, val)
 
+/**
+ * batch_run:
+ * @b: Batch to run.
+ *
+ * Run the operations of @b in order, store their results, and empty @b
+ * so that it can be filled again.
+ */
+#define batch_run(b) qtest_batch_run(global_qtest, b)
+
 #endif
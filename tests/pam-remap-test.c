@@ -0,0 +1,97 @@
+/*
+ * QTest testcase and benchmark for memory topology updates
+ *
+ * Toggles an i440FX PAM register, which remaps 0xc0000-0xc7fff between
+ * RAM and PCI, and times a large number of remaps.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "libqtest.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define I440FX_PAM1     0x5a    /* 0xc0000-0xc3fff and 0xc4000-0xc7fff */
+#define PAM_RW          0x33
+#define PAM_PCI         0x00
+
+#define PAM1_BASE       0xc0000
+
+#define REMAP_COUNT     10000
+
+static void pci_config_writeb(uint8_t reg, uint8_t val)
+{
+    outl(0xcf8, 0x80000000 | (reg & ~3));
+    outb(0xcfc + (reg & 3), val);
+}
+
+static uint8_t pci_config_readb(uint8_t reg)
+{
+    outl(0xcf8, 0x80000000 | (reg & ~3));
+    return inb(0xcfc + (reg & 3));
+}
+
+static void test_remap(void)
+{
+    pci_config_writeb(I440FX_PAM1, PAM_RW);
+    g_assert_cmphex(pci_config_readb(I440FX_PAM1), ==, PAM_RW);
+    writeb(PAM1_BASE, 0x5a);
+    g_assert_cmphex(readb(PAM1_BASE), ==, 0x5a);
+
+    /* Writing the current value again must not disturb the mapping.  */
+    pci_config_writeb(I440FX_PAM1, PAM_RW);
+    g_assert_cmphex(readb(PAM1_BASE), ==, 0x5a);
+
+    /* With PCI decoding the RAM is hidden, but keeps its contents.  */
+    pci_config_writeb(I440FX_PAM1, PAM_PCI);
+    g_assert_cmphex(readb(PAM1_BASE), !=, 0x5a);
+    pci_config_writeb(I440FX_PAM1, PAM_RW);
+    g_assert_cmphex(readb(PAM1_BASE), ==, 0x5a);
+}
+
+static void test_remap_bench(void)
+{
+    gdouble elapsed;
+    int i;
+
+    pci_config_writeb(I440FX_PAM1, PAM_RW);
+    writeb(PAM1_BASE, 0xa5);
+
+    g_test_timer_start();
+    for (i = 0; i < REMAP_COUNT; i++) {
+        pci_config_writeb(I440FX_PAM1, i & 1 ? PAM_RW : PAM_PCI);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    pci_config_writeb(I440FX_PAM1, PAM_RW);
+    g_assert_cmphex(readb(PAM1_BASE), ==, 0xa5);
+
+    g_test_message("%d remaps in %.3f s (%.1f us each, including qtest I/O)",
+                   REMAP_COUNT, elapsed, elapsed * 1e6 / REMAP_COUNT);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    s = qtest_start("-display none");
+
+    qtest_add_func("/pam/remap", test_remap);
+    if (g_test_perf()) {
+        qtest_add_func("/pam/remap-bench", test_remap_bench);
+    }
+
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
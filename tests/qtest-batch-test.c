@@ -0,0 +1,122 @@
+/*
+ * QTest testcase and benchmark for batched qtest operations
+ *
+ * Runs guest memory, I/O port and clock operations in batches and checks
+ * them against the line based commands.  The ports are the index and data
+ * registers of the PC's CMOS RAM.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "libqtest.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define CMOS_INDEX      0x70
+#define CMOS_DATA       0x71
+#define CMOS_SCRATCH    0x38
+
+#define RAM_BASE        0x100000
+
+#define BENCH_OPS       100000
+#define BENCH_BATCH     1000
+
+static void test_batch(void)
+{
+    QTestBatch *b = qtest_batch_new();
+    uint8_t out[16], in[16], text[16];
+    uint32_t cmos;
+    int64_t clock, step, next;
+    int i;
+
+    for (i = 0; i < sizeof(out); i++) {
+        out[i] = 0xa0 + i;
+    }
+
+    clock = clock_step(0);
+    qtest_batch_memwrite(b, RAM_BASE, out, sizeof(out));
+    qtest_batch_memread(b, RAM_BASE + 4, in, 8);
+    qtest_batch_out(b, CMOS_INDEX, 1, CMOS_SCRATCH);
+    qtest_batch_out(b, CMOS_DATA, 1, 0x5a);
+    qtest_batch_out(b, CMOS_INDEX, 1, CMOS_SCRATCH);
+    qtest_batch_in(b, CMOS_DATA, 1, &cmos);
+    qtest_batch_clock_step(b, 1000, &step);
+    qtest_batch_clock_set(b, clock + 5000, &next);
+    batch_run(b);
+
+    g_assert(memcmp(in, out + 4, 8) == 0);
+    g_assert_cmphex(cmos, ==, 0x5a);
+    g_assert_cmpint(step, ==, clock + 1000);
+    g_assert_cmpint(next, ==, clock + 5000);
+
+    /* What a batch wrote is what the line based commands see.  */
+    memread(RAM_BASE, text, sizeof(text));
+    g_assert(memcmp(text, out, sizeof(out)) == 0);
+    g_assert_cmpint(clock_step(0), ==, clock + 5000);
+
+    /* The batch is empty once run, and can be reused.  */
+    batch_run(b);
+    qtest_batch_memread(b, RAM_BASE, in, 1);
+    batch_run(b);
+    g_assert_cmphex(in[0], ==, out[0]);
+
+    qtest_batch_free(b);
+}
+
+static void test_batch_bench(void)
+{
+    QTestBatch *b = qtest_batch_new();
+    uint32_t value;
+    gdouble text, batched;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_OPS; i += 2) {
+        outb(CMOS_INDEX, CMOS_SCRATCH);
+        inb(CMOS_DATA);
+    }
+    text = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_OPS; i += 2) {
+        qtest_batch_out(b, CMOS_INDEX, 1, CMOS_SCRATCH);
+        qtest_batch_in(b, CMOS_DATA, 1, &value);
+        if ((i + 2) % BENCH_BATCH == 0) {
+            batch_run(b);
+        }
+    }
+    batch_run(b);
+    batched = g_test_timer_elapsed();
+
+    g_test_message("%d I/O operations: %.0f ops/s one at a time, "
+                   "%.0f ops/s in batches of %d", BENCH_OPS,
+                   BENCH_OPS / text, BENCH_OPS / batched, BENCH_BATCH);
+
+    qtest_batch_free(b);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    s = qtest_start("-display none");
+
+    qtest_add_func("/qtest/batch", test_batch);
+    if (g_test_perf()) {
+        qtest_add_func("/qtest/batch-bench", test_batch_bench);
+    }
+
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    return ret;
+}
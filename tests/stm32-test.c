@@ -0,0 +1,885 @@
+/*
+ * QTest testcases and benchmarks for the STM32F1xx peripherals
+ *
+ * Runs against the stm32-p103 board.  Pin levels are driven and watched
+ * through the GPIO pin bus chardev, and USART2 is connected to a socket
+ * through -serial, so that the tests see the peripherals the way an
+ * external harness would.  The benchmarks measure MMIO operations per
+ * second, the latency from a pin edge to the NVIC seeing the EXTI
+ * interrupt, and USART transmit throughput.  The timer captures the edges
+ * driven on its channel pin, I2S2 takes its samples from DMA at the
+ * sample rate, the ADC's analog watchdog is enabled for each group in
+ * turn, and the stimulus player drives PB12 from a VCD file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "libqtest.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RCC_BASE                0x40021000
+#define RCC_CR                  (RCC_BASE + 0x00)
+#define RCC_CR_HSEON            (1 << 16)
+#define RCC_CR_HSERDY           (1 << 17)
+#define RCC_CR_PLLON            (1 << 24)
+#define RCC_CR_PLLRDY           (1 << 25)
+#define RCC_CR_HSION            (1 << 0)
+#define RCC_CFGR                (RCC_BASE + 0x04)
+#define RCC_CFGR_SW_PLL         0x2
+#define RCC_CFGR_SWS_MASK       0xc
+#define RCC_CFGR_SWS_PLL        0x8
+#define RCC_CFGR_PLLSRC_HSE     (1 << 16)
+#define RCC_CFGR_PLLMUL_9       (7 << 18)
+#define RCC_CFGR_PPRE1_DIV2     (4 << 8)
+#define RCC_CFGR_ADCPRE_DIV6    (2 << 14)
+#define RCC_AHBENR              (RCC_BASE + 0x14)
+#define RCC_AHBENR_DMA1EN       (1 << 0)
+#define RCC_AHBENR_CRCEN        (1 << 6)
+#define RCC_APB2ENR             (RCC_BASE + 0x18)
+#define RCC_APB2ENR_AFIOEN      (1 << 0)
+#define RCC_APB2ENR_IOPAEN      (1 << 2)
+#define RCC_APB2ENR_IOPBEN      (1 << 3)
+#define RCC_APB2ENR_ADC1EN      (1 << 9)
+#define RCC_APB1ENR             (RCC_BASE + 0x1c)
+#define RCC_APB1ENR_TIM3EN      (1 << 1)
+#define RCC_APB1ENR_SPI2EN      (1 << 14)
+#define RCC_APB1ENR_USART2EN    (1 << 17)
+
+#define GPIOA_BASE              0x40010800
+#define GPIOB_BASE              0x40010c00
+#define GPIO_CRL                0x00
+#define GPIO_IDR                0x08
+#define GPIO_ODR                0x0c
+#define GPIO_BSRR               0x10
+#define GPIO_BRR                0x14
+
+#define AFIO_BASE               0x40010000
+#define AFIO_EXTICR1            (AFIO_BASE + 0x08)
+#define AFIO_EXTICR4            (AFIO_BASE + 0x14)
+
+#define EXTI_BASE               0x40010400
+#define EXTI_IMR                (EXTI_BASE + 0x00)
+#define EXTI_RTSR               (EXTI_BASE + 0x08)
+#define EXTI_FTSR               (EXTI_BASE + 0x0c)
+#define EXTI_SWIER              (EXTI_BASE + 0x10)
+#define EXTI_PR                 (EXTI_BASE + 0x14)
+
+#define USART2_BASE             0x40004400
+#define USART_SR                (USART2_BASE + 0x00)
+#define USART_SR_RXNE           (1 << 5)
+#define USART_SR_TC             (1 << 6)
+#define USART_SR_TXE            (1 << 7)
+#define USART_DR                (USART2_BASE + 0x04)
+#define USART_BRR               (USART2_BASE + 0x08)
+#define USART_CR1               (USART2_BASE + 0x0c)
+#define USART_CR1_RE            (1 << 2)
+#define USART_CR1_TE            (1 << 3)
+#define USART_CR1_UE            (1 << 13)
+
+#define CRC_BASE                0x40023000
+#define CRC_DR                  (CRC_BASE + 0x00)
+#define CRC_IDR                 (CRC_BASE + 0x04)
+#define CRC_CR                  (CRC_BASE + 0x08)
+#define CRC_CR_RESET            (1 << 0)
+
+#define TIM3_BASE               0x40000400
+#define TIM_CR1                 (TIM3_BASE + 0x00)
+#define TIM_CR1_CEN             (1 << 0)
+#define TIM_SR                  (TIM3_BASE + 0x10)
+#define TIM_SR_CC1IF            (1 << 1)
+#define TIM_SR_CC1OF            (1 << 9)
+#define TIM_CCMR1               (TIM3_BASE + 0x18)
+#define TIM_CCMR1_CC1S_TI1      (1 << 0)
+#define TIM_CCER                (TIM3_BASE + 0x20)
+#define TIM_CCER_CC1E           (1 << 0)
+#define TIM_CNT                 (TIM3_BASE + 0x24)
+#define TIM_CCR1                (TIM3_BASE + 0x34)
+
+#define SPI2_BASE               0x40003800
+#define SPI_CR2                 (SPI2_BASE + 0x04)
+#define SPI_CR2_TXDMAEN         (1 << 1)
+#define SPI_SR                  (SPI2_BASE + 0x08)
+#define SPI_SR_TXE              (1 << 1)
+#define SPI_DR                  (SPI2_BASE + 0x0c)
+#define SPI_I2SCFGR             (SPI2_BASE + 0x1c)
+#define SPI_I2SCFGR_MASTER_TX   (2 << 8)
+#define SPI_I2SCFGR_I2SE        (1 << 10)
+#define SPI_I2SCFGR_I2SMOD      (1 << 11)
+#define SPI_I2SPR               (SPI2_BASE + 0x20)
+
+#define ADC1_BASE               0x40012400
+#define ADC_SR                  (ADC1_BASE + 0x00)
+#define ADC_SR_AWD              (1 << 0)
+#define ADC_SR_EOC              (1 << 1)
+#define ADC_SR_JEOC             (1 << 2)
+#define ADC_CR1                 (ADC1_BASE + 0x04)
+#define ADC_CR1_JAWDEN          (1 << 22)
+#define ADC_CR1_AWDEN           (1 << 23)
+#define ADC_CR2                 (ADC1_BASE + 0x08)
+#define ADC_CR2_ADON            (1 << 0)
+#define ADC_CR2_JEXTSEL_JSWSTART (7 << 12)
+#define ADC_CR2_JEXTTRIG        (1 << 15)
+#define ADC_CR2_EXTSEL_SWSTART  (7 << 17)
+#define ADC_CR2_EXTTRIG         (1 << 20)
+#define ADC_CR2_JSWSTART        (1 << 21)
+#define ADC_CR2_SWSTART         (1 << 22)
+#define ADC_HTR                 (ADC1_BASE + 0x24)
+#define ADC_LTR                 (ADC1_BASE + 0x28)
+
+#define DMA1_BASE               0x40020000
+#define DMA_ISR                 (DMA1_BASE + 0x00)
+#define DMA_ISR_TCIF1           (1 << 1)
+#define DMA_ISR_TCIF5           (1 << 17)
+#define DMA_ISR_HTIF5           (1 << 18)
+#define DMA_CCR1                (DMA1_BASE + 0x08)
+#define DMA_CCR_EN              (1 << 0)
+#define DMA_CCR_DIR             (1 << 4)
+#define DMA_CCR_CIRC            (1 << 5)
+#define DMA_CCR_MINC            (1 << 7)
+#define DMA_CCR_PSIZE_16        (1 << 8)
+#define DMA_CCR_PSIZE_32        (2 << 8)
+#define DMA_CCR_MSIZE_16        (1 << 10)
+#define DMA_CCR_MSIZE_32        (2 << 10)
+#define DMA_CCR_MEM2MEM         (1 << 14)
+#define DMA_CNDTR1              (DMA1_BASE + 0x0c)
+#define DMA_CPAR1               (DMA1_BASE + 0x10)
+#define DMA_CMAR1               (DMA1_BASE + 0x14)
+#define DMA_CCR5                (DMA1_BASE + 0x58)
+#define DMA_CNDTR5              (DMA1_BASE + 0x5c)
+#define DMA_CPAR5               (DMA1_BASE + 0x60)
+#define DMA_CMAR5               (DMA1_BASE + 0x64)
+#define DMA_IFCR                (DMA1_BASE + 0x04)
+
+#define FLASH_BASE              0x08000000
+#define FLASH_KEYR              0x40022004
+#define FLASH_KEY1              0x45670123
+#define FLASH_KEY2              0xcdef89ab
+#define FLASH_SR                0x4002200c
+#define FLASH_SR_EOP            (1 << 5)
+#define FLASH_CR                0x40022010
+#define FLASH_CR_PG             (1 << 0)
+#define FLASH_CR_MER            (1 << 2)
+#define FLASH_CR_STRT           (1 << 6)
+#define FLASH_CR_LOCK           (1 << 7)
+/* A page well past the first, with 1 KB pages */
+#define FLASH_TEST_OFFSET       0x1800
+
+#define SRAM_BASE               0x20000000
+
+/* NVIC interrupt numbers */
+#define EXTI0_IRQ               6
+#define EXTI1_IRQ               7
+#define EXTI2_IRQ               8
+#define USART2_IRQ              38
+
+#define HSE_STARTUP_US          1500
+#define PLL_LOCK_US             200
+#define PINBUS_RECORD_SIZE      16
+#define WAIT_MS                 5000
+
+#define BENCH_MMIO_OPS          100000
+#define BENCH_BATCH             1000
+#define BENCH_IRQ_EDGES         1000
+#define BENCH_UART_BYTES        100000
+
+static int pinbus_fd;
+static int serial_fd;
+/* USART2 at 115200 baud from an 8 MHz PCLK1 */
+static uint32_t usart_brr = 8000000 / 115200;
+static int64_t usart_ns_per_char;
+
+static uint32_t readl(uint64_t addr)
+{
+    uint8_t buf[4];
+
+    memread(addr, buf, 4);
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void writel(uint64_t addr, uint32_t val)
+{
+    uint8_t buf[4] = { val, val >> 8, val >> 16, val >> 24 };
+
+    memwrite(addr, buf, 4);
+}
+
+static void batch_writel(QTestBatch *b, uint64_t addr, uint32_t val)
+{
+    uint8_t buf[4] = { val, val >> 8, val >> 16, val >> 24 };
+
+    qtest_batch_memwrite(b, addr, buf, 4);
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(sock, !=, -1);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    g_assert_cmpint(bind(sock, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(sock, 1), ==, 0);
+    return sock;
+}
+
+static int accept_socket(int sock, const char *path)
+{
+    int fd;
+
+    do {
+        fd = accept(sock, NULL, NULL);
+    } while (fd == -1 && errno == EINTR);
+    g_assert_cmpint(fd, !=, -1);
+    close(sock);
+    unlink(path);
+    return fd;
+}
+
+/* Reads exactly LEN bytes from FD, failing after WAIT_MS without data.  */
+static void read_all(int fd, void *buf, size_t len)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint8_t *p = buf;
+    ssize_t n;
+
+    while (len) {
+        g_assert_cmpint(poll(&pfd, 1, WAIT_MS), ==, 1);
+        n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(n, >, 0);
+        p += n;
+        len -= n;
+    }
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(n, >, 0);
+        p += n;
+        len -= n;
+    }
+}
+
+/* Drives the pins in MASK of a GPIO port to VALUE through the pin bus.  */
+static void pinbus_drive(int port, uint16_t mask, uint16_t value)
+{
+    uint8_t rec[PINBUS_RECORD_SIZE] = { 0 };
+
+    rec[8] = port;
+    rec[10] = mask;
+    rec[11] = mask >> 8;
+    rec[12] = value;
+    rec[13] = value >> 8;
+    write_all(pinbus_fd, rec, sizeof(rec));
+}
+
+/* Waits for the output record of a GPIO port change.  */
+static void pinbus_expect(int port, uint16_t mask, uint16_t value)
+{
+    uint8_t rec[PINBUS_RECORD_SIZE];
+
+    read_all(pinbus_fd, rec, sizeof(rec));
+    g_assert_cmpint(rec[8], ==, port);
+    g_assert_cmphex(rec[10] | (rec[11] << 8), ==, mask);
+    g_assert_cmphex((rec[12] | (rec[13] << 8)) & mask, ==, value);
+}
+
+/* The pin bus input is applied when QEMU gets to it, which may be after
+ * the qtest commands that follow.  */
+static void wait_irq(int irq, bool level)
+{
+    gint64 end = g_get_monotonic_time() + WAIT_MS * 1000;
+
+    while (get_irq(irq) != level) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+    }
+}
+
+static void wait_reg(uint64_t addr, uint32_t mask, uint32_t value)
+{
+    gint64 end = g_get_monotonic_time() + WAIT_MS * 1000;
+
+    while ((readl(addr) & mask) != value) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+    }
+}
+
+static void test_rcc(void)
+{
+    uint32_t cfgr;
+
+    /* HSI is the system clock out of reset.  */
+    g_assert_cmphex(readl(RCC_CR) & (RCC_CR_HSION | RCC_CR_HSEON), ==,
+                    RCC_CR_HSION);
+    g_assert_cmphex(readl(RCC_CFGR) & RCC_CFGR_SWS_MASK, ==, 0);
+
+    /* HSE is only ready after its start-up time.  */
+    writel(RCC_CR, RCC_CR_HSION | RCC_CR_HSEON);
+    g_assert_cmphex(readl(RCC_CR) & RCC_CR_HSERDY, ==, 0);
+    clock_step(HSE_STARTUP_US * 1000);
+    g_assert_cmphex(readl(RCC_CR) & RCC_CR_HSERDY, ==, RCC_CR_HSERDY);
+
+    /* 72 MHz from the PLL, with PCLK1 at 36 MHz.  The switch happens once
+     * the PLL has locked.  */
+    cfgr = RCC_CFGR_PLLSRC_HSE | RCC_CFGR_PLLMUL_9 | RCC_CFGR_PPRE1_DIV2;
+    writel(RCC_CFGR, cfgr);
+    writel(RCC_CR, RCC_CR_HSION | RCC_CR_HSEON | RCC_CR_PLLON);
+    writel(RCC_CFGR, cfgr | RCC_CFGR_SW_PLL);
+    g_assert_cmphex(readl(RCC_CFGR) & RCC_CFGR_SWS_MASK, ==, 0);
+    clock_step(PLL_LOCK_US * 1000);
+    g_assert_cmphex(readl(RCC_CR) & RCC_CR_PLLRDY, ==, RCC_CR_PLLRDY);
+    g_assert_cmphex(readl(RCC_CFGR) & RCC_CFGR_SWS_MASK, ==,
+                    RCC_CFGR_SWS_PLL);
+    g_assert_cmphex(readl(RCC_CFGR) & ~RCC_CFGR_SWS_MASK, ==,
+                    cfgr | RCC_CFGR_SW_PLL);
+
+    /* The USART divider follows the new PCLK1.  */
+    usart_brr = 36000000 / 115200;
+
+    writel(RCC_APB2ENR, RCC_APB2ENR_AFIOEN | RCC_APB2ENR_IOPAEN |
+                        RCC_APB2ENR_IOPBEN);
+    writel(RCC_APB1ENR, RCC_APB1ENR_USART2EN);
+    g_assert_cmphex(readl(RCC_APB2ENR), ==, RCC_APB2ENR_AFIOEN |
+                    RCC_APB2ENR_IOPAEN | RCC_APB2ENR_IOPBEN);
+}
+
+static void test_gpio(void)
+{
+    /* PB5 as a push-pull output.  */
+    writel(GPIOB_BASE + GPIO_CRL, 0x44344444);
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_CRL), ==, 0x44344444);
+
+    writel(GPIOB_BASE + GPIO_BSRR, 1 << 5);
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_ODR), ==, 1 << 5);
+    pinbus_expect(1, 1 << 5, 1 << 5);
+
+    /* Reset wins over set in BSRR only for the other pins.  */
+    writel(GPIOB_BASE + GPIO_BSRR, (1 << (16 + 5)) | (1 << 6));
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_ODR), ==, 1 << 6);
+    /* PB6 is an input, so only PB5 changes on the pins.  */
+    pinbus_expect(1, 1 << 5, 0);
+
+    writel(GPIOB_BASE + GPIO_BRR, 1 << 6);
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_ODR), ==, 0);
+
+    /* Inputs come from outside.  */
+    pinbus_drive(0, 1 << 3, 1 << 3);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 3, 1 << 3);
+    pinbus_drive(0, 1 << 3, 0);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 3, 0);
+}
+
+static void test_exti(void)
+{
+    irq_intercept_in("nvic");
+
+    /* A software interrupt needs the line to be unmasked.  */
+    writel(EXTI_SWIER, 1 << 2);
+    g_assert_cmphex(readl(EXTI_PR), ==, 0);
+    g_assert(!get_irq(EXTI2_IRQ));
+
+    writel(EXTI_IMR, 1 << 1);
+    writel(EXTI_SWIER, 1 << 1);
+    g_assert_cmphex(readl(EXTI_PR), ==, 1 << 1);
+    g_assert(get_irq(EXTI1_IRQ));
+
+    /* Writing one to PR clears the line and SWIER.  */
+    writel(EXTI_PR, 1 << 1);
+    g_assert_cmphex(readl(EXTI_PR), ==, 0);
+    g_assert_cmphex(readl(EXTI_SWIER) & (1 << 1), ==, 0);
+    g_assert(!get_irq(EXTI1_IRQ));
+
+    /* Rising edges of PA0, which EXTI0 follows out of reset.  */
+    writel(EXTI_IMR, 1 << 0);
+    writel(EXTI_RTSR, 1 << 0);
+    pinbus_drive(0, 1 << 0, 1 << 0);
+    wait_irq(EXTI0_IRQ, true);
+    g_assert_cmphex(readl(EXTI_PR), ==, 1 << 0);
+    writel(EXTI_PR, 1 << 0);
+    g_assert(!get_irq(EXTI0_IRQ));
+
+    /* The falling edge is not selected.  */
+    pinbus_drive(0, 1 << 0, 0);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 0, 0);
+    g_assert_cmphex(readl(EXTI_PR), ==, 0);
+    g_assert(!get_irq(EXTI0_IRQ));
+}
+
+static void test_afio(void)
+{
+    /* Route EXTI0 to PB0.  */
+    writel(AFIO_EXTICR1, 0x1);
+    g_assert_cmphex(readl(AFIO_EXTICR1), ==, 0x1);
+
+    pinbus_drive(0, 1 << 0, 1 << 0);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 0, 1 << 0);
+    g_assert_cmphex(readl(EXTI_PR), ==, 0);
+
+    pinbus_drive(1, 1 << 0, 1 << 0);
+    wait_irq(EXTI0_IRQ, true);
+    writel(EXTI_PR, 1 << 0);
+
+    pinbus_drive(0, 1 << 0, 0);
+    pinbus_drive(1, 1 << 0, 0);
+    wait_reg(GPIOB_BASE + GPIO_IDR, 1 << 0, 0);
+    writel(AFIO_EXTICR1, 0);
+}
+
+static void usart_enable(void)
+{
+    /* PA2 (TX) as an alternate function push-pull output.  */
+    writel(GPIOA_BASE + GPIO_CRL, 0x44444b44);
+    writel(USART_BRR, usart_brr);
+    writel(USART_CR1, USART_CR1_UE | USART_CR1_TE | USART_CR1_RE);
+    usart_ns_per_char = 10 * (1000000000LL / (36000000 / usart_brr));
+}
+
+static void test_uart(void)
+{
+    static const char msg[] = "hello\n";
+    char buf[sizeof(msg) - 1];
+    int i;
+
+    usart_enable();
+    g_assert_cmphex(readl(USART_SR) & (USART_SR_TXE | USART_SR_TC), ==,
+                    USART_SR_TXE | USART_SR_TC);
+
+    for (i = 0; i < sizeof(buf); i++) {
+        wait_reg(USART_SR, USART_SR_TXE, USART_SR_TXE);
+        writel(USART_DR, msg[i]);
+        clock_step(usart_ns_per_char);
+    }
+    clock_step(usart_ns_per_char);
+    g_assert_cmphex(readl(USART_SR) & USART_SR_TC, ==, USART_SR_TC);
+    read_all(serial_fd, buf, sizeof(buf));
+    g_assert(memcmp(buf, msg, sizeof(buf)) == 0);
+
+    /* Received characters take a character time to arrive.  */
+    write_all(serial_fd, "ok", 2);
+    for (i = 0; i < 2; i++) {
+        gint64 end = g_get_monotonic_time() + WAIT_MS * 1000;
+
+        while (!(readl(USART_SR) & USART_SR_RXNE)) {
+            g_assert_cmpint(g_get_monotonic_time(), <, end);
+            clock_step(usart_ns_per_char);
+        }
+        g_assert_cmphex(readl(USART_DR), ==, "ok"[i]);
+    }
+}
+
+static void test_crc(void)
+{
+    uint8_t buf[64 * 4];
+    uint32_t crc;
+    int i;
+
+    writel(RCC_AHBENR, RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN);
+    g_assert_cmphex(readl(CRC_DR), ==, 0xffffffff);
+
+    /* The CRC-32 of the Ethernet polynomial, MSB first.  */
+    writel(CRC_DR, 0x12345678);
+    g_assert_cmphex(readl(CRC_DR), ==, 0xdf8a8a2b);
+    writel(CRC_CR, CRC_CR_RESET);
+    g_assert_cmphex(readl(CRC_DR), ==, 0xffffffff);
+    writel(CRC_IDR, 0x1a5);
+    g_assert_cmphex(readl(CRC_IDR), ==, 0xa5);
+
+    /* A memory-to-memory DMA transfer gives the same CRC as word writes,
+     * with an odd number of words.  */
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 7 + 3;
+    }
+    for (i = 0; i < 63 * 4; i += 4) {
+        writel(CRC_DR, buf[i] | (buf[i + 1] << 8) | (buf[i + 2] << 16) |
+                       ((uint32_t)buf[i + 3] << 24));
+    }
+    crc = readl(CRC_DR);
+    writel(CRC_CR, CRC_CR_RESET);
+
+    memwrite(SRAM_BASE, buf, sizeof(buf));
+    writel(DMA_CPAR1, CRC_DR);
+    writel(DMA_CMAR1, SRAM_BASE);
+    writel(DMA_CNDTR1, 63);
+    writel(DMA_CCR1, DMA_CCR_MEM2MEM | DMA_CCR_MSIZE_32 | DMA_CCR_PSIZE_32 |
+                     DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN);
+    g_assert_cmphex(readl(DMA_ISR) & DMA_ISR_TCIF1, ==, DMA_ISR_TCIF1);
+    g_assert_cmphex(readl(DMA_CNDTR1), ==, 0);
+    g_assert_cmphex(readl(CRC_DR), ==, crc);
+    writel(DMA_CCR1, 0);
+}
+
+static void test_timer(void)
+{
+    uint32_t ccr;
+
+    writel(RCC_APB1ENR, RCC_APB1ENR_USART2EN | RCC_APB1ENR_TIM3EN);
+
+    /* CC1 captures the rising edges of TI1, which is PA6.  */
+    writel(TIM_CCMR1, TIM_CCMR1_CC1S_TI1);
+    writel(TIM_CCER, TIM_CCER_CC1E);
+    writel(TIM_CR1, TIM_CR1_CEN);
+    clock_step(100 * 1000);
+
+    /* vm_clock stands still between the edge and the reads, so the counter
+     * has not moved since it was captured.  */
+    pinbus_drive(0, 1 << 6, 1 << 6);
+    wait_reg(TIM_SR, TIM_SR_CC1IF, TIM_SR_CC1IF);
+    ccr = readl(TIM_CCR1);
+    g_assert_cmpint(ccr, >, 0);
+    g_assert_cmphex(ccr, ==, readl(TIM_CNT));
+    g_assert_cmphex(readl(TIM_SR) & TIM_SR_CC1IF, ==, 0);
+
+    /* The falling edge is not selected.  */
+    pinbus_drive(0, 1 << 6, 0);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 6, 0);
+    g_assert_cmphex(readl(TIM_SR) & TIM_SR_CC1IF, ==, 0);
+
+    /* A second capture before the first is read sets the overcapture
+     * flag.  */
+    clock_step(10 * 1000);
+    pinbus_drive(0, 1 << 6, 1 << 6);
+    wait_reg(TIM_SR, TIM_SR_CC1IF, TIM_SR_CC1IF);
+    pinbus_drive(0, 1 << 6, 0);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 6, 0);
+    clock_step(10 * 1000);
+    pinbus_drive(0, 1 << 6, 1 << 6);
+    wait_reg(TIM_SR, TIM_SR_CC1OF, TIM_SR_CC1OF);
+    g_assert_cmphex(readl(TIM_CCR1), ==, readl(TIM_CNT));
+
+    pinbus_drive(0, 1 << 6, 0);
+    wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 6, 0);
+    writel(TIM_CR1, 0);
+    writel(TIM_CCER, 0);
+    writel(TIM_SR, 0);
+}
+
+static void test_i2s(void)
+{
+    writel(RCC_APB1ENR, RCC_APB1ENR_USART2EN | RCC_APB1ENR_SPI2EN);
+
+    /* 45 kHz stereo from the 72 MHz SYSCLK (I2SDIV 25), out of a circular
+     * buffer of 20 ms.  The timer runs every quarter of the buffer, 225
+     * frames, and takes that much from the channel each time.  */
+    writel(SPI_I2SPR, 25);
+    writel(DMA_CPAR5, SPI_DR);
+    writel(DMA_CMAR5, SRAM_BASE);
+    writel(DMA_CNDTR5, 1800);
+    writel(DMA_CCR5, DMA_CCR_MSIZE_16 | DMA_CCR_PSIZE_16 | DMA_CCR_MINC |
+                     DMA_CCR_CIRC | DMA_CCR_DIR | DMA_CCR_EN);
+    writel(SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD | SPI_I2SCFGR_MASTER_TX);
+    writel(SPI_CR2, SPI_CR2_TXDMAEN);
+    writel(SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD | SPI_I2SCFGR_MASTER_TX |
+                        SPI_I2SCFGR_I2SE);
+    g_assert_cmpint(readl(DMA_CNDTR5), ==, 1800);
+
+    clock_step(5 * 1000 * 1000);
+    g_assert_cmpint(readl(DMA_CNDTR5), ==, 1350);
+    g_assert_cmphex(readl(DMA_ISR) & DMA_ISR_HTIF5, ==, 0);
+    clock_step(5 * 1000 * 1000);
+    g_assert_cmpint(readl(DMA_CNDTR5), ==, 900);
+    g_assert_cmphex(readl(DMA_ISR) & (DMA_ISR_HTIF5 | DMA_ISR_TCIF5), ==,
+                    DMA_ISR_HTIF5);
+    clock_step(10 * 1000 * 1000);
+    g_assert_cmpint(readl(DMA_CNDTR5), ==, 1800);
+    g_assert_cmphex(readl(DMA_ISR) & DMA_ISR_TCIF5, ==, DMA_ISR_TCIF5);
+    writel(DMA_CCR5, 0);
+    writel(DMA_IFCR, 0x0fffffff);
+
+    /* Without DMA, TXE stays set until two periods of samples are
+     * written.  */
+    writel(SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD | SPI_I2SCFGR_MASTER_TX);
+    writel(SPI_CR2, 0);
+    writel(SPI_I2SCFGR, SPI_I2SCFGR_I2SMOD | SPI_I2SCFGR_MASTER_TX |
+                        SPI_I2SCFGR_I2SE);
+    while (readl(SPI_SR) & SPI_SR_TXE) {
+        writel(SPI_DR, 0);
+    }
+    clock_step(10 * 1000 * 1000);
+    g_assert_cmphex(readl(SPI_SR) & SPI_SR_TXE, ==, SPI_SR_TXE);
+
+    writel(SPI_I2SCFGR, 0);
+    writel(RCC_APB1ENR, RCC_APB1ENR_USART2EN);
+}
+
+/* Converts channel 0 once in the regular group, then once in the injected
+ * one, and returns the status flags of the two conversions.  */
+static uint32_t adc_convert_both(void)
+{
+    uint32_t sr;
+
+    writel(ADC_SR, 0);
+    writel(ADC_CR2, ADC_CR2_ADON | ADC_CR2_EXTTRIG | ADC_CR2_EXTSEL_SWSTART |
+                    ADC_CR2_JEXTTRIG | ADC_CR2_JEXTSEL_JSWSTART |
+                    ADC_CR2_SWSTART);
+    clock_step(10 * 1000);
+    sr = readl(ADC_SR);
+    g_assert_cmphex(sr & ADC_SR_EOC, ==, ADC_SR_EOC);
+    writel(ADC_SR, 0);
+    writel(ADC_CR2, ADC_CR2_ADON | ADC_CR2_EXTTRIG | ADC_CR2_EXTSEL_SWSTART |
+                    ADC_CR2_JEXTTRIG | ADC_CR2_JEXTSEL_JSWSTART |
+                    ADC_CR2_JSWSTART);
+    clock_step(10 * 1000);
+    g_assert_cmphex(readl(ADC_SR) & ADC_SR_JEOC, ==, ADC_SR_JEOC);
+    return (sr & ADC_SR_AWD) | ((readl(ADC_SR) & ADC_SR_AWD) << 1);
+}
+
+static void test_adc(void)
+{
+    writel(RCC_CFGR, readl(RCC_CFGR) | RCC_CFGR_ADCPRE_DIV6);
+    writel(RCC_APB2ENR, readl(RCC_APB2ENR) | RCC_APB2ENR_ADC1EN);
+    writel(ADC_CR2, ADC_CR2_ADON);
+
+    /* The input stays at 0, below the watchdog's low threshold.  The
+     * watchdog only looks at the group it is enabled for.  */
+    writel(ADC_LTR, 0x100);
+    writel(ADC_HTR, 0xfff);
+    writel(ADC_CR1, 0);
+    g_assert_cmphex(adc_convert_both(), ==, 0);
+    writel(ADC_CR1, ADC_CR1_AWDEN);
+    g_assert_cmphex(adc_convert_both(), ==, 1);
+    writel(ADC_CR1, ADC_CR1_JAWDEN);
+    g_assert_cmphex(adc_convert_both(), ==, 2);
+    writel(ADC_CR1, ADC_CR1_AWDEN | ADC_CR1_JAWDEN);
+    g_assert_cmphex(adc_convert_both(), ==, 3);
+
+    /* Within the thresholds.  */
+    writel(ADC_LTR, 0);
+    g_assert_cmphex(adc_convert_both(), ==, 0);
+
+    writel(ADC_CR1, 0);
+    writel(ADC_CR2, 0);
+    writel(ADC_SR, 0);
+    writel(RCC_APB2ENR, readl(RCC_APB2ENR) & ~RCC_APB2ENR_ADC1EN);
+}
+
+static void flash_mass_erase(void)
+{
+    writel(FLASH_CR, FLASH_CR_MER);
+    writel(FLASH_CR, FLASH_CR_MER | FLASH_CR_STRT);
+    g_assert_cmphex(readl(FLASH_SR) & FLASH_SR_EOP, ==, FLASH_SR_EOP);
+    writel(FLASH_SR, FLASH_SR_EOP);
+}
+
+/* A mass erase spans many pages, and has to reach the last ones too.
+ * There is no CPU running under qtest, so what is checked is the array
+ * itself rather than code fetched from it.  */
+static void test_flash(void)
+{
+    static const uint8_t half[2] = {0x34, 0x12};
+
+    writel(FLASH_KEYR, FLASH_KEY1);
+    writel(FLASH_KEYR, FLASH_KEY2);
+    g_assert_cmphex(readl(FLASH_CR) & FLASH_CR_LOCK, ==, 0);
+
+    flash_mass_erase();
+    writel(FLASH_CR, FLASH_CR_PG);
+    memwrite(FLASH_BASE + FLASH_TEST_OFFSET, half, sizeof(half));
+    g_assert_cmphex(readl(FLASH_SR) & FLASH_SR_EOP, ==, FLASH_SR_EOP);
+    writel(FLASH_SR, FLASH_SR_EOP);
+    g_assert_cmphex(readl(FLASH_BASE + FLASH_TEST_OFFSET), ==, 0xffff1234);
+    /* The alias at 0 shares the array.  */
+    g_assert_cmphex(readl(FLASH_TEST_OFFSET), ==, 0xffff1234);
+
+    flash_mass_erase();
+    g_assert_cmphex(readl(FLASH_BASE + FLASH_TEST_OFFSET), ==, 0xffffffff);
+    g_assert_cmphex(readl(FLASH_TEST_OFFSET), ==, 0xffffffff);
+
+    writel(FLASH_CR, FLASH_CR_LOCK);
+}
+
+/* PB12 pulses for 1 us, STIMULUS_TIME_NS after the reset.  */
+#define STIMULUS_TIME_NS        20000000000LL
+
+static const char stimulus_vcd[] =
+    "$timescale 1ns $end\n"
+    "$var wire 1 ! PB12 $end\n"
+    "$enddefinitions $end\n"
+    "#20000000000\n"
+    "1!\n"
+    "#20000001000\n"
+    "0!\n";
+
+static void test_stimulus(void)
+{
+    clock_set(STIMULUS_TIME_NS - 1);
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_IDR) & (1 << 12), ==, 0);
+    clock_set(STIMULUS_TIME_NS);
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_IDR) & (1 << 12), ==, 1 << 12);
+    clock_step(1000);
+    g_assert_cmphex(readl(GPIOB_BASE + GPIO_IDR) & (1 << 12), ==, 0);
+}
+
+/* EXTICR4 routes lines that are never unmasked, so writing it has no side
+ * effects, and in particular sends nothing down the pin bus.  */
+static void test_mmio_bench(void)
+{
+    QTestBatch *b = qtest_batch_new();
+    gdouble text, batched;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_MMIO_OPS; i++) {
+        writel(AFIO_EXTICR4, i & 0x1111);
+    }
+    text = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_MMIO_OPS; i++) {
+        batch_writel(b, AFIO_EXTICR4, i & 0x1111);
+        if ((i + 1) % BENCH_BATCH == 0) {
+            batch_run(b);
+        }
+    }
+    batch_run(b);
+    batched = g_test_timer_elapsed();
+    writel(AFIO_EXTICR4, 0);
+
+    g_test_message("AFIO register writes: %.0f ops/s one at a time, "
+                   "%.0f ops/s in batches of %d",
+                   BENCH_MMIO_OPS / text, BENCH_MMIO_OPS / batched,
+                   BENCH_BATCH);
+    qtest_batch_free(b);
+}
+
+static void test_irq_latency_bench(void)
+{
+    gdouble elapsed;
+    int i;
+
+    writel(EXTI_IMR, 1 << 0);
+    writel(EXTI_RTSR, 1 << 0);
+    writel(EXTI_FTSR, 0);
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_IRQ_EDGES; i++) {
+        pinbus_drive(0, 1 << 0, 1 << 0);
+        wait_irq(EXTI0_IRQ, true);
+        writel(EXTI_PR, 1 << 0);
+        pinbus_drive(0, 1 << 0, 0);
+        wait_reg(GPIOA_BASE + GPIO_IDR, 1 << 0, 0);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_message("%d pin edges to NVIC pending: %.1f us each, "
+                   "including the pin bus and qtest round trips",
+                   BENCH_IRQ_EDGES, elapsed * 1e6 / BENCH_IRQ_EDGES);
+}
+
+static void test_uart_bench(void)
+{
+    QTestBatch *b = qtest_batch_new();
+    uint8_t *buf = g_malloc(BENCH_UART_BYTES);
+    gdouble elapsed;
+    int i;
+
+    usart_enable();
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_UART_BYTES; i++) {
+        batch_writel(b, USART_DR, 'a' + i % 26);
+        qtest_batch_clock_step(b, usart_ns_per_char, NULL);
+        if ((i + 1) % BENCH_BATCH == 0) {
+            batch_run(b);
+        }
+    }
+    batch_run(b);
+    read_all(serial_fd, buf, BENCH_UART_BYTES);
+    elapsed = g_test_timer_elapsed();
+
+    for (i = 0; i < BENCH_UART_BYTES; i++) {
+        g_assert_cmpint(buf[i], ==, 'a' + i % 26);
+    }
+    g_test_message("USART2 transmit: %.0f bytes/s through the socket",
+                   BENCH_UART_BYTES / elapsed);
+
+    g_free(buf);
+    qtest_batch_free(b);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    char *pinbus_path, *serial_path, *stimulus_path, *args;
+    int pinbus_sock, serial_sock, stimulus_fd;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    pinbus_path = g_strdup_printf("/tmp/qtest-%d-pinbus.sock", getpid());
+    serial_path = g_strdup_printf("/tmp/qtest-%d-serial.sock", getpid());
+    pinbus_sock = listen_socket(pinbus_path);
+    serial_sock = listen_socket(serial_path);
+    stimulus_fd = g_file_open_tmp("qtest-stimulus-XXXXXX.vcd",
+                                  &stimulus_path, NULL);
+    g_assert(stimulus_fd >= 0);
+    g_assert_cmpint(write(stimulus_fd, stimulus_vcd, strlen(stimulus_vcd)),
+                    ==, strlen(stimulus_vcd));
+    close(stimulus_fd);
+
+    args = g_strdup_printf("-display none -machine stm32-p103 "
+                           "-global stm32f1xx_rcc.hse_startup_us=%d "
+                           "-global stm32f1xx_rcc.pll_lock_us=%d "
+                           "-chardev socket,id=stm32-pinbus,path=%s "
+                           "-serial unix:%s "
+                           "-global stm32_stimulus.file=%s",
+                           HSE_STARTUP_US, PLL_LOCK_US, pinbus_path,
+                           serial_path, stimulus_path);
+    s = qtest_start(args);
+    pinbus_fd = accept_socket(pinbus_sock, pinbus_path);
+    serial_fd = accept_socket(serial_sock, serial_path);
+
+    /* The cases build on each other, starting with the clocks.  */
+    qtest_add_func("/stm32/rcc", test_rcc);
+    qtest_add_func("/stm32/gpio", test_gpio);
+    qtest_add_func("/stm32/exti", test_exti);
+    qtest_add_func("/stm32/afio", test_afio);
+    qtest_add_func("/stm32/uart", test_uart);
+    qtest_add_func("/stm32/crc", test_crc);
+    qtest_add_func("/stm32/timer", test_timer);
+    qtest_add_func("/stm32/i2s", test_i2s);
+    qtest_add_func("/stm32/adc", test_adc);
+    qtest_add_func("/stm32/flash", test_flash);
+    qtest_add_func("/stm32/stimulus", test_stimulus);
+    if (g_test_perf()) {
+        qtest_add_func("/stm32/mmio-bench", test_mmio_bench);
+        qtest_add_func("/stm32/irq-latency-bench", test_irq_latency_bench);
+        qtest_add_func("/stm32/uart-bench", test_uart_bench);
+    }
+
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+    close(pinbus_fd);
+    close(serial_fd);
+    g_free(pinbus_path);
+    g_free(serial_path);
+    unlink(stimulus_path);
+    g_free(stimulus_path);
+    g_free(args);
+
+    return ret;
+}
@@ -0,0 +1,153 @@
+/*
+ * M-profile benchmark firmware
+ *
+ * Prints "boot" as soon as the console is up, so that the harness can time
+ * reset to first UART byte, then runs a mix of integer loops (a bitwise
+ * CRC, a small matrix product and a prime sieve) with a progress dot over
+ * the UART every few rounds.  The last line gives the instructions spent,
+ * from the DWT cycle counter, which counts instructions under -icount:
+ *
+ *   done insns=<decimal> sum=<hex>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "bench.h"
+
+#ifndef ROUNDS
+#define ROUNDS          200
+#endif
+#define DOT_ROUNDS      10
+
+#define DWT_CTRL        (*(volatile uint32_t *)0xe0001000)
+#define DWT_CYCCNT      (*(volatile uint32_t *)0xe0001004)
+
+#define CRC_BYTES       1024
+#define MAT_N           12
+#define SIEVE_N         2048
+
+static uint8_t crc_buf[CRC_BYTES];
+static int32_t mat_a[MAT_N][MAT_N], mat_b[MAT_N][MAT_N], mat_c[MAT_N][MAT_N];
+static uint8_t sieve[SIEVE_N];
+
+static void puts_(const char *s)
+{
+    while (*s) {
+        uart_putc(*s++);
+    }
+}
+
+static void put_dec(uint32_t v)
+{
+    char buf[11];
+    int i = sizeof(buf);
+
+    buf[--i] = 0;
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    puts_(&buf[i]);
+}
+
+static void put_hex(uint32_t v)
+{
+    int i;
+
+    for (i = 28; i >= 0; i -= 4) {
+        uart_putc("0123456789abcdef"[(v >> i) & 0xf]);
+    }
+}
+
+static uint32_t crc32(const uint8_t *p, int len)
+{
+    uint32_t crc = ~0;
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t matmul(void)
+{
+    uint32_t sum = 0;
+    int i, j, k;
+
+    for (i = 0; i < MAT_N; i++) {
+        for (j = 0; j < MAT_N; j++) {
+            int32_t acc = 0;
+
+            for (k = 0; k < MAT_N; k++) {
+                acc += mat_a[i][k] * mat_b[k][j];
+            }
+            mat_c[i][j] = acc;
+            sum += acc;
+        }
+    }
+    return sum;
+}
+
+static uint32_t primes(void)
+{
+    uint32_t count = 0;
+    int i, j;
+
+    for (i = 2; i < SIEVE_N; i++) {
+        sieve[i] = 1;
+    }
+    for (i = 2; i < SIEVE_N; i++) {
+        if (sieve[i]) {
+            count++;
+            for (j = i + i; j < SIEVE_N; j += i) {
+                sieve[j] = 0;
+            }
+        }
+    }
+    return count;
+}
+
+int main(void)
+{
+    uint32_t sum = 0;
+    int i, j;
+
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1;
+
+    uart_init();
+    puts_("boot\n");
+
+    for (i = 0; i < CRC_BYTES; i++) {
+        crc_buf[i] = i * 7;
+    }
+    for (i = 0; i < MAT_N; i++) {
+        for (j = 0; j < MAT_N; j++) {
+            mat_a[i][j] = i + j;
+            mat_b[i][j] = i - j;
+        }
+    }
+
+    for (i = 0; i < ROUNDS; i++) {
+        crc_buf[i % CRC_BYTES] ^= sum;
+        sum += crc32(crc_buf, CRC_BYTES);
+        mat_a[i % MAT_N][0] = sum;
+        sum += matmul();
+        sum += primes();
+        if (i % DOT_ROUNDS == DOT_ROUNDS - 1) {
+            uart_putc('.');
+        }
+    }
+
+    puts_("\ndone insns=");
+    put_dec(DWT_CYCCNT);
+    puts_(" sum=");
+    put_hex(sum);
+    puts_("\n");
+    return 0;
+}
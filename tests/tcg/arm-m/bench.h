@@ -0,0 +1,16 @@
+/*
+ * M-profile benchmark firmware
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+void uart_init(void);
+void uart_putc(char c);
+
+#endif
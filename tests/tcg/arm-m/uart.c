@@ -0,0 +1,93 @@
+/*
+ * Console UART of each benchmark board
+ *
+ * stm32-p103 and stm32-p205 connect the first serial port to USART2 (TX on
+ * PA2), lm3s6965evb to UART0.  The UARTs run at 115200 baud from the
+ * reset clocks.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "bench.h"
+
+#define REG(addr)       (*(volatile uint32_t *)(addr))
+
+#if defined(BOARD_STM32F1)
+
+#define RCC_APB2ENR     REG(0x40021018)
+#define RCC_APB1ENR     REG(0x4002101c)
+#define GPIOA_CRL       REG(0x40010800)
+#define USART2_BASE     0x40004400
+#define USART_PCLK      8000000
+
+#elif defined(BOARD_STM32F2)
+
+#define RCC_AHB1ENR     REG(0x40023830)
+#define RCC_APB1ENR     REG(0x40023840)
+#define GPIOA_MODER     REG(0x40020000)
+#define GPIOA_AFRL      REG(0x40020020)
+#define USART2_BASE     0x40004400
+#define USART_PCLK      16000000
+
+#elif defined(BOARD_STELLARIS)
+
+#define UART0_DR        REG(0x4000c000)
+#define UART0_FR        REG(0x4000c018)
+#define UART0_FR_TXFF   (1 << 5)
+#define UART0_IBRD      REG(0x4000c024)
+#define UART0_FBRD      REG(0x4000c028)
+#define UART0_LCRH      REG(0x4000c02c)
+#define UART0_CR        REG(0x4000c030)
+
+#else
+#error "define BOARD_STM32F1, BOARD_STM32F2 or BOARD_STELLARIS"
+#endif
+
+#ifdef USART2_BASE
+#define USART_SR        REG(USART2_BASE + 0x00)
+#define USART_SR_TXE    (1 << 7)
+#define USART_DR        REG(USART2_BASE + 0x04)
+#define USART_BRR       REG(USART2_BASE + 0x08)
+#define USART_CR1       REG(USART2_BASE + 0x0c)
+#define USART_CR1_TE    (1 << 3)
+#define USART_CR1_UE    (1 << 13)
+#endif
+
+void uart_init(void)
+{
+#if defined(BOARD_STM32F1)
+    RCC_APB2ENR |= (1 << 2) | (1 << 0);         /* IOPAEN, AFIOEN */
+    RCC_APB1ENR |= 1 << 17;                     /* USART2EN */
+    /* PA2 as an alternate function push-pull output */
+    GPIOA_CRL = (GPIOA_CRL & ~(0xf << 8)) | (0xb << 8);
+#elif defined(BOARD_STM32F2)
+    RCC_AHB1ENR |= 1 << 0;                      /* GPIOAEN */
+    RCC_APB1ENR |= 1 << 17;                     /* USART2EN */
+    /* PA2 as alternate function 7 */
+    GPIOA_MODER = (GPIOA_MODER & ~(3 << 4)) | (2 << 4);
+    GPIOA_AFRL = (GPIOA_AFRL & ~(0xf << 8)) | (7 << 8);
+#endif
+#ifdef USART2_BASE
+    USART_BRR = USART_PCLK / 115200;
+    USART_CR1 = USART_CR1_UE | USART_CR1_TE;
+#else
+    UART0_IBRD = 6;                             /* 12 MHz / (16 * 115200) */
+    UART0_FBRD = 33;
+    UART0_LCRH = 3 << 5;                        /* 8N1 */
+    UART0_CR = (1 << 8) | (1 << 0);             /* TXE, UARTEN */
+#endif
+}
+
+void uart_putc(char c)
+{
+#ifdef USART2_BASE
+    while (!(USART_SR & USART_SR_TXE)) {
+    }
+    USART_DR = c;
+#else
+    while (UART0_FR & UART0_FR_TXFF) {
+    }
+    UART0_DR = c;
+#endif
+}
@@ -0,0 +1,96 @@
+/*
+ * Zero buffer detection unit-tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BUF_SIZE            8192
+#define BENCH_PAGES         (256 * 1024)
+#define PAGE_SIZE           4096
+
+static char buffer[BUF_SIZE + 64] __attribute__((aligned(64)));
+
+static void test_zero(void)
+{
+    size_t len, off;
+
+    memset(buffer, 0, sizeof(buffer));
+    /* Once for every implementation */
+    do {
+        for (off = 0; off < 64; off += sizeof(long)) {
+            for (len = 0; len <= BUF_SIZE; len += 4 * sizeof(long)) {
+                g_assert(buffer_is_zero(buffer + off, len));
+                g_assert_cmpint(buffer_find_nonzero_offset(buffer + off, len),
+                                ==, len);
+            }
+        }
+    } while (test_buffer_is_zero_next_accel());
+}
+
+/* A single non-zero byte anywhere in buffers of various lengths and
+ * alignments, so that it falls in vector chunks and in the tails.  */
+static void test_nonzero(void)
+{
+    const size_t unit = 4 * sizeof(long);
+    size_t len, off, i;
+
+    memset(buffer, 0, sizeof(buffer));
+    /* Once for every implementation */
+    do {
+        for (off = 0; off < 64; off += sizeof(long)) {
+            for (len = unit; len <= 1024; len += unit) {
+                for (i = 0; i < len; i++) {
+                    buffer[off + i] = 1;
+                    g_assert(!buffer_is_zero(buffer + off, len));
+                    g_assert_cmpint(buffer_find_nonzero_offset(buffer + off,
+                                                               len),
+                                    ==, i - i % unit);
+                    buffer[off + i] = 0;
+                }
+            }
+        }
+        /* Non-zero bytes just outside the buffer do not count.  */
+        buffer[63] = 1;
+        buffer[BUF_SIZE] = 1;
+        g_assert(buffer_is_zero(buffer + 64, BUF_SIZE - 64));
+        buffer[63] = 0;
+        buffer[BUF_SIZE] = 0;
+    } while (test_buffer_is_zero_next_accel());
+}
+
+static void test_bench(void)
+{
+    char *pages = g_malloc0(PAGE_SIZE * 16);
+    gdouble elapsed;
+    int n = 0;
+    int i;
+
+    /* Once for every implementation */
+    do {
+        g_test_timer_start();
+        for (i = 0; i < BENCH_PAGES; i++) {
+            g_assert(buffer_is_zero(pages + (i % 16) * PAGE_SIZE, PAGE_SIZE));
+        }
+        elapsed = g_test_timer_elapsed();
+        g_test_message("implementation %d: %d zero pages in %.3f s "
+                       "(%.1f GB/s)", n++, BENCH_PAGES, elapsed,
+                       (double)BENCH_PAGES * PAGE_SIZE / elapsed / 1e9);
+    } while (test_buffer_is_zero_next_accel());
+
+    g_free(pages);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferiszero/zero", test_zero);
+    g_test_add_func("/cutils/bufferiszero/nonzero", test_nonzero);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/bufferiszero/bench", test_bench);
+    }
+    return g_test_run();
+}
@@ -369,6 +369,92 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_next_dirty_area(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, L2 + 5, 100);
+    hbitmap_test_set(data, 3 * L2, 2 * L1);
+
+    start = 0;
+    count = L3;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L2 + 5);
+    g_assert_cmpint(count, ==, 100);
+
+    start = L2 + 50;
+    count = 10;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L2 + 50);
+    g_assert_cmpint(count, ==, 10);
+
+    start = L2 + 105;
+    count = L3;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, 3 * L2);
+    g_assert_cmpint(count, ==, 2 * L1);
+
+    start = 3 * L2 + 2 * L1;
+    count = L3;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, &count));
+
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 5), ==, L2 + 105);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 3 * L2 + 1), ==,
+                    3 * L2 + 2 * L1);
+
+    hbitmap_test_set(data, L3 - L1, L1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - L1), <, 0);
+}
+
+/* Check that the bitmap survives serialization, and return its size. */
+static size_t hbitmap_test_serialize(TestHBitmapData *data)
+{
+    HBitmap *hb;
+    uint8_t *buf;
+    size_t len;
+
+    buf = hbitmap_serialize(data->hb, &len);
+    buf[0] ^= 1;
+    g_assert(hbitmap_deserialize(buf, len) == NULL);
+    buf[0] ^= 1;
+
+    hb = hbitmap_deserialize(buf, len);
+    g_assert(hb != NULL);
+    g_free(buf);
+    g_assert_cmpint(hbitmap_granularity(hb), ==, data->granularity);
+
+    hbitmap_free(data->hb);
+    data->hb = hb;
+    hbitmap_test_check(data, 0);
+    return len;
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t i;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_serialize(data);
+
+    /* Runs are a few bytes each */
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L2 + 5, 100);
+    hbitmap_test_set(data, L3 - L1, L1);
+    g_assert_cmpint(hbitmap_test_serialize(data), <, 32);
+
+    /* Fragmented bitmaps take one bit per bit */
+    hbitmap_test_teardown(data, NULL);
+    hbitmap_test_init(data, L2, 0);
+    for (i = 0; i < L2; i += 2) {
+        hbitmap_test_set(data, i, 1);
+    }
+    g_assert_cmpint(hbitmap_test_serialize(data), <=, 16 + L2 / 8);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +481,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/next-dirty-area", test_hbitmap_next_dirty_area);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
     g_test_run();
 
     return 0;
@@ -145,6 +145,72 @@ static void test_to_from_buf(void)
     }
 }
 
+static void test_cursor(void)
+{
+    unsigned niov, i;
+    struct iovec *iov;
+    size_t sz, offset, len, done;
+    unsigned char *ibuf, *obuf;
+    IOVCursor cur;
+
+    iov_random(&iov, &niov);
+    sz = iov_size(iov, niov);
+    ibuf = g_malloc(sz);
+    obuf = g_malloc(sz);
+    for (i = 0; i < sz; ++i) {
+        ibuf[i] = i & 255;
+    }
+
+    for (offset = 0; offset <= sz; ++offset) {
+        /* Fill the iovec in random pieces */
+        memset(obuf, 0xff, sz);
+        iov_from_buf(iov, niov, 0, obuf, sz);
+        g_assert(iov_cursor_init(&cur, iov, niov, offset) == offset);
+        for (done = offset; done < sz; done += len) {
+            len = g_test_rand_int_range(0, 8);
+            g_assert(iov_cursor_from_buf(&cur, ibuf + done, len) ==
+                     MIN(len, sz - done));
+        }
+        test_iov_bytes(iov, niov, offset, sz - offset);
+
+        /* and read it back the same way, skipping some of it */
+        iov_cursor_init(&cur, iov, niov, offset);
+        for (done = offset; done < sz; done += len) {
+            len = g_test_rand_int_range(0, 8);
+            len = MIN(len, sz - done);
+            if (g_test_rand_bit()) {
+                g_assert(iov_cursor_skip(&cur, len) == len);
+            } else {
+                g_assert(iov_cursor_to_buf(&cur, obuf, len) == len);
+                g_assert(!memcmp(obuf, ibuf + done, len));
+            }
+        }
+        g_assert(iov_cursor_to_buf(&cur, obuf, 1) == 0);
+    }
+
+    g_free(ibuf);
+    g_free(obuf);
+    iov_free(iov, niov);
+}
+
+static void test_qiov_local(void)
+{
+    QEMUIOVector qiov;
+    char buf[16];
+    int i;
+
+    qemu_iovec_init(&qiov, 2);
+    for (i = 0; i < 16; i++) {
+        qemu_iovec_add(&qiov, buf + i, 1);
+        g_assert(qiov.niov == i + 1);
+        g_assert((qiov.iov == qiov.local) == (i < QEMU_IOVEC_LOCAL));
+        g_assert(qiov.iov[0].iov_base == buf);
+        g_assert(qiov.iov[i].iov_base == buf + i);
+    }
+    g_assert(qiov.size == 16);
+    qemu_iovec_destroy(&qiov);
+}
+
 static void test_io(void)
 {
 #ifndef _WIN32
@@ -403,6 +469,8 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/basic/iov/from-to-buf", test_to_from_buf);
+    g_test_add_func("/basic/iov/cursor", test_cursor);
+    g_test_add_func("/basic/iov/qiov-local", test_qiov_local);
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
@@ -0,0 +1,157 @@
+/*
+ * QEMUTimer tests and rearm benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+
+#define ORDER_TIMERS    200
+#define BENCH_TIMERS    1000
+#define BENCH_REARMS    1000000
+
+typedef struct {
+    QEMUTimer *timer;
+    int id;
+} TimerTestData;
+
+static int fired[ORDER_TIMERS];
+static int fired_count;
+
+static void timer_test_cb(void *opaque)
+{
+    TimerTestData *data = opaque;
+
+    g_assert_cmpint(fired_count, <, ORDER_TIMERS);
+    fired[fired_count++] = data->id;
+}
+
+static TimerTestData *timers_new(int n)
+{
+    TimerTestData *data = g_new0(TimerTestData, n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        data[i].id = i;
+        data[i].timer = qemu_new_timer_ns(vm_clock, timer_test_cb, &data[i]);
+    }
+    return data;
+}
+
+static void timers_free(TimerTestData *data, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        qemu_del_timer(data[i].timer);
+        qemu_free_timer(data[i].timer);
+    }
+    g_free(data);
+}
+
+/* Timers in the past all fire on the next run, earliest first, and in
+   the order they were armed when they expire together.  */
+static void test_order(void)
+{
+    TimerTestData *data = timers_new(ORDER_TIMERS);
+    int i;
+
+    fired_count = 0;
+    for (i = 0; i < ORDER_TIMERS; i++) {
+        /* Expiry times 1..25 in scrambled order, each used 8 times.  */
+        qemu_mod_timer_ns(data[i].timer, 1 + (i * 7) % 25);
+    }
+    /* Moving an armed timer sends it behind the others at its time.  */
+    qemu_mod_timer_ns(data[0].timer, 1);
+
+    qemu_run_timers(vm_clock);
+    g_assert_cmpint(fired_count, ==, ORDER_TIMERS);
+    for (i = 1; i < ORDER_TIMERS; i++) {
+        int64_t prev = 1 + (fired[i - 1] * 7) % 25;
+        int64_t cur = 1 + (fired[i] * 7) % 25;
+
+        g_assert_cmpint(prev, <=, cur);
+        if (prev == cur && fired[i] != 0) {
+            g_assert_cmpint(fired[i - 1], <, fired[i]);
+        }
+    }
+    g_assert_cmpint(fired[ORDER_TIMERS / 25 - 1], ==, 0);
+    g_assert(!qemu_clock_has_timers(vm_clock));
+
+    timers_free(data, ORDER_TIMERS);
+}
+
+static void test_mod_del(void)
+{
+    TimerTestData *data = timers_new(3);
+    int64_t later = qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() * 3600;
+
+    qemu_mod_timer_ns(data[0].timer, later);
+    qemu_mod_timer_ns(data[1].timer, later + 1);
+    qemu_mod_timer_ns(data[2].timer, later + 2);
+    g_assert(qemu_timer_pending(data[1].timer));
+    g_assert_cmpuint(qemu_timer_expire_time_ns(data[0].timer), ==, later);
+
+    /* The deadline follows the earliest timer as timers come and go.  */
+    qemu_del_timer(data[0].timer);
+    g_assert(!qemu_timer_pending(data[0].timer));
+    g_assert_cmpuint(qemu_timer_expire_time_ns(data[0].timer), ==, -1);
+    qemu_mod_timer_ns(data[2].timer, 1);
+    g_assert_cmpint(qemu_clock_deadline(vm_clock), ==, 0);
+
+    fired_count = 0;
+    qemu_run_timers(vm_clock);
+    g_assert_cmpint(fired_count, ==, 1);
+    g_assert_cmpint(fired[0], ==, 2);
+    g_assert(qemu_timer_pending(data[1].timer));
+    g_assert(qemu_clock_has_timers(vm_clock));
+
+    timers_free(data, 3);
+    g_assert(!qemu_clock_has_timers(vm_clock));
+}
+
+/* Rearm timers at pseudo-random times with many other timers pending,
+   as peripheral models do on every register write.  */
+static void test_rearm_bench(void)
+{
+    TimerTestData *data = timers_new(BENCH_TIMERS);
+    int64_t later = qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() * 3600;
+    uint32_t x = 1;
+    gdouble elapsed;
+    int i;
+
+    for (i = 0; i < BENCH_TIMERS; i++) {
+        qemu_mod_timer_ns(data[i].timer, later + i * 1000);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < BENCH_REARMS; i++) {
+        x = x * 1103515245 + 12345;
+        qemu_mod_timer_ns(data[(x >> 8) % BENCH_TIMERS].timer,
+                          later + (x >> 12));
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_message("%d rearms with %d timers pending in %.3f s "
+                   "(%.1f ns each)", BENCH_REARMS, BENCH_TIMERS, elapsed,
+                   elapsed * 1e9 / BENCH_REARMS);
+
+    timers_free(data, BENCH_TIMERS);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    init_timer_alarm();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timer/order", test_order);
+    g_test_add_func("/timer/mod-del", test_mod_del);
+    if (g_test_perf()) {
+        g_test_add_func("/timer/rearm-bench", test_rearm_bench);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,142 @@
+/*
+ * softfloat host FPU fast path unit-tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "fpu/softfloat.h"
+
+#define TEST_OPS            (1024 * 1024)
+#define BENCH_OPS           (16 * 1024 * 1024)
+
+typedef float32 Float32Op(float32 a, float32 b, float_status *status);
+typedef float64 Float64Op(float64 a, float64 b, float_status *status);
+
+typedef struct {
+    const char *name;
+    Float32Op *op32;
+    Float64Op *op64;
+} FloatOp;
+
+static const FloatOp ops[] = {
+    { "add", float32_add, float64_add },
+    { "sub", float32_sub, float64_sub },
+    { "mul", float32_mul, float64_mul },
+    { "div", float32_div, float64_div },
+};
+
+static uint64_t rand64(void)
+{
+    return ((uint64_t)g_test_rand_int() << 32) | (uint32_t)g_test_rand_int();
+}
+
+/* With inexact already raised, the host FPU computes the results which it
+ * can; without, everything is done in software.  Both must agree, on zeros,
+ * denormals, infinities and NaNs as well.  Half of the pairs have close
+ * exponents, so that cancellations and exact results are common. */
+static void test_float32(void)
+{
+    float_status soft = { }, host = { };
+    unsigned i, j;
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        for (j = 0; j < TEST_OPS; j++) {
+            float32 a = make_float32(g_test_rand_int());
+            float32 b = make_float32(g_test_rand_int());
+            float32 zs, zh;
+
+            if (j & 1) {
+                b = make_float32((float32_val(b) & 0x807fffff) |
+                                 (float32_val(a) & 0x7f800000));
+            }
+            soft.float_exception_flags = 0;
+            host.float_exception_flags = float_flag_inexact;
+            zs = ops[i].op32(a, b, &soft);
+            zh = ops[i].op32(a, b, &host);
+            g_assert_cmphex(float32_val(zh), ==, float32_val(zs));
+            g_assert_cmphex(host.float_exception_flags, ==,
+                            soft.float_exception_flags | float_flag_inexact);
+        }
+    }
+}
+
+static void test_float64(void)
+{
+    float_status soft = { }, host = { };
+    unsigned i, j;
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        for (j = 0; j < TEST_OPS; j++) {
+            float64 a = make_float64(rand64());
+            float64 b = make_float64(rand64());
+            float64 zs, zh;
+
+            if (j & 1) {
+                b = make_float64((float64_val(b) & 0x800fffffffffffffULL) |
+                                 (float64_val(a) & 0x7ff0000000000000ULL));
+            }
+            soft.float_exception_flags = 0;
+            host.float_exception_flags = float_flag_inexact;
+            zs = ops[i].op64(a, b, &soft);
+            zh = ops[i].op64(a, b, &host);
+            g_assert_cmphex(float64_val(zh), ==, float64_val(zs));
+            g_assert_cmphex(host.float_exception_flags, ==,
+                            soft.float_exception_flags | float_flag_inexact);
+        }
+    }
+}
+
+/* A chain of dependent operations on values near 1, as in guest loops */
+static void test_bench(void)
+{
+    float_status status = { };
+    gdouble elapsed;
+    unsigned i, j;
+    int fast;
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        for (fast = 0; fast <= 1; fast++) {
+            float32 z32 = float32_one;
+            float64 z64 = float64_one;
+
+            g_test_timer_start();
+            for (j = 0; j < BENCH_OPS; j++) {
+                status.float_exception_flags = fast ? float_flag_inexact : 0;
+                z32 = ops[i].op32(z32, make_float32(0x3f800001), &status);
+                z32 = ops[i].op32(z32, make_float32(0x3f7ffffe), &status);
+            }
+            elapsed = g_test_timer_elapsed();
+            g_test_message("float32_%s, %s: %.1f Mops/s", ops[i].name,
+                           fast ? "host" : "soft",
+                           2.0 * BENCH_OPS / elapsed / 1e6);
+
+            g_test_timer_start();
+            for (j = 0; j < BENCH_OPS; j++) {
+                status.float_exception_flags = fast ? float_flag_inexact : 0;
+                z64 = ops[i].op64(z64,
+                                  make_float64(0x3ff0000000000001ULL),
+                                  &status);
+                z64 = ops[i].op64(z64,
+                                  make_float64(0x3feffffffffffffeULL),
+                                  &status);
+            }
+            elapsed = g_test_timer_elapsed();
+            g_test_message("float64_%s, %s: %.1f Mops/s", ops[i].name,
+                           fast ? "host" : "soft",
+                           2.0 * BENCH_OPS / elapsed / 1e6);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/softfloat/float32", test_float32);
+    g_test_add_func("/softfloat/float64", test_float64);
+    if (g_test_perf()) {
+        g_test_add_func("/softfloat/bench", test_bench);
+    }
+    return g_test_run();
+}
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #ifndef _WIN32
 #include <signal.h>
@@ -32,12 +33,11 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Each thread that traces gets its own ring buffer, so that recording an
+ * event takes no lock and does not contend with other threads.  Records are written out by a dedicated thread.  The thread waits
+ * for records to become available, merges the rings by timestamp, writes the
+ * records out, and then waits again.
  */
 static GStaticMutex trace_lock = G_STATIC_MUTEX_INIT;
 
@@ -56,13 +56,34 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
-    TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_RING_LEN = 4096 * 16,     /* must be a power of two */
+    TRACE_RING_FLUSH_THRESHOLD = TRACE_RING_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * A single-producer, single-consumer ring.  Positions are free-running byte
+ * counts; the offset in buf is the position modulo TRACE_RING_LEN.  Records
+ * between tail and head are complete.
+ */
+typedef struct TraceRing {
+    /* Written by the owning thread only */
+    volatile unsigned int head;
+    bool busy;                  /* a record is being filled in */
+    volatile gint dropped;      /* reset by the writeout thread */
+    volatile gint exited;
+
+    /* Written by the writeout thread only */
+    volatile unsigned int tail;
+    unsigned int writeout_end;  /* head when the current writeout started */
+
+    struct TraceRing *next;
+    uint8_t buf[TRACE_RING_LEN];
+} TraceRing;
+
+/* Rings are added at the head by the tracing threads, and unlinked by the
+ * writeout thread once their thread has exited and they are empty. */
+static TraceRing *volatile trace_rings;
+/* Events dropped because a thread could not get a ring */
 static volatile gint dropped_events;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -83,53 +104,95 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void trace_ring_exit(gpointer data)
+{
+    TraceRing *ring = data;
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+    g_atomic_int_set(&ring->exited, 1);
+}
+
+#if GLIB_CHECK_VERSION(2, 31, 0)
+static GPrivate trace_ring_key = G_PRIVATE_INIT(trace_ring_exit);
+
+static inline TraceRing *get_trace_ring_key(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    return g_private_get(&trace_ring_key);
+}
+
+static inline void set_trace_ring_key(TraceRing *ring)
+{
+    g_private_set(&trace_ring_key, ring);
 }
+#else
+static GStaticPrivate trace_ring_key = G_STATIC_PRIVATE_INIT;
+
+static inline TraceRing *get_trace_ring_key(void)
+{
+    return g_static_private_get(&trace_ring_key);
+}
+
+static inline void set_trace_ring_key(TraceRing *ring)
+{
+    g_static_private_set(&trace_ring_key, ring, trace_ring_exit);
+}
+#endif
+
 /**
- * Read a trace record from the trace buffer
+ * Get the trace ring of the calling thread, creating it on first use
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
+ * Returns NULL if no memory is available.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceRing *get_trace_ring(void)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    TraceRing *ring = get_trace_ring_key();
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    if (likely(ring)) {
+        return ring;
     }
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    ring = calloc(1, sizeof(*ring)); /* dont use g_malloc, can deadlock when traced */
+    if (!ring) {
+        return NULL;
+    }
+    set_trace_ring_key(ring);
+    do {
+        ring->next = trace_rings;
+    } while (!g_atomic_pointer_compare_and_exchange((volatile gpointer *)&trace_rings,
+                                                    ring->next, ring));
+    return ring;
+}
+
+static void read_from_ring(TraceRing *ring, unsigned int pos,
+                           void *dataptr, size_t size)
+{
+    unsigned int idx = pos % TRACE_RING_LEN;
+    size_t len = MIN(size, TRACE_RING_LEN - idx);
+
+    memcpy(dataptr, &ring->buf[idx], len);
+    memcpy((uint8_t *)dataptr + len, ring->buf, size - len);
+}
+
+static unsigned int write_to_ring(TraceRing *ring, unsigned int pos,
+                                  const void *dataptr, size_t size)
+{
+    unsigned int idx = pos % TRACE_RING_LEN;
+    size_t len = MIN(size, TRACE_RING_LEN - idx);
+
+    memcpy(&ring->buf[idx], dataptr, len);
+    memcpy(ring->buf, (const uint8_t *)dataptr + len, size - len);
+    return pos + size; /* most callers wants to know where to write next */
+}
+
+static void write_ring_to_file(TraceRing *ring, unsigned int pos, size_t size)
+{
+    unsigned int idx = pos % TRACE_RING_LEN;
+    size_t len = MIN(size, TRACE_RING_LEN - idx);
+    size_t unused __attribute__ ((unused));
+
+    unused = fwrite(&ring->buf[idx], len, 1, trace_fp);
+    if (size > len) {
+        unused = fwrite(ring->buf, size - len, 1, trace_fp);
+    }
 }
 
 /**
@@ -162,123 +225,180 @@ static void wait_for_trace_records_available(void)
     g_static_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+/* Read and reset a dropped events counter */
+static int take_dropped_count(volatile gint *counter)
+{
+    int count;
+
+    do {
+        count = g_atomic_int_get(counter);
+    } while (!g_atomic_int_compare_and_exchange(counter, count, 0));
+    return count;
+}
+
+static void write_dropped_record(void)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
+    TraceRing *ring;
+    uint64_t dropped_count;
     size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    dropped_count = take_dropped_count(&dropped_events);
+    for (ring = trace_rings; ring; ring = ring->next) {
+        dropped_count += take_dropped_count(&ring->dropped);
+    }
+    if (!dropped_count) {
+        return;
+    }
+
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+    dropped.rec.reserved = 0;
+    dropped.rec.arguments[0] = dropped_count;
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
+
+/* Write out the records that were complete when called, oldest first. */
+static void write_ring_records(void)
+{
+    TraceRing *ring, *oldest;
+    TraceRecord record, oldest_record;
+
+    for (ring = trace_rings; ring; ring = ring->next) {
+        ring->writeout_end = ring->head;
+        smp_rmb(); /* read memory barrier before accessing the records */
+    }
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.reserved = 0;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+    for (;;) {
+        oldest = NULL;
+        for (ring = trace_rings; ring; ring = ring->next) {
+            if (ring->tail == ring->writeout_end) {
+                continue;
+            }
+            read_from_ring(ring, ring->tail, &record, sizeof(record));
+            if (!oldest || record.timestamp_ns < oldest_record.timestamp_ns) {
+                oldest = ring;
+                oldest_record = record;
+            }
         }
+        if (!oldest) {
+            break;
+        }
+
+        write_ring_to_file(oldest, oldest->tail, oldest_record.length);
+        smp_mb(); /* finish reading the record before it can be reused */
+        g_atomic_int_set((volatile gint *)&oldest->tail,
+                         oldest->tail + oldest_record.length);
+    }
+}
+
+/* Free the rings of threads that have exited once they have been written
+ * out.  Only the writeout thread unlinks rings, so only the list head can
+ * change under its feet. */
+static void free_exited_rings(void)
+{
+    TraceRing **prev = (TraceRing **)&trace_rings;
+    TraceRing *ring;
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+    while ((ring = *prev) != NULL) {
+        smp_rmb();
+        if (!g_atomic_int_get(&ring->exited) ||
+            ring->tail != ring->head ||
+            g_atomic_int_get(&ring->dropped)) {
+            prev = &ring->next;
+            continue;
+        }
+        if (prev == (TraceRing **)&trace_rings) {
+            if (!g_atomic_pointer_compare_and_exchange((volatile gpointer *)&trace_rings,
+                                                       ring, ring->next)) {
+                /* A new ring was added in front, look again. */
+                continue;
+            }
+        } else {
+            *prev = ring->next;
         }
+        free(ring); /* dont use g_free, can deadlock when traced */
+    }
+}
 
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+
+        write_dropped_record();
+        write_ring_records();
         fflush(trace_fp);
+        free_exited_rings();
     }
     return NULL;
 }
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_ring(rec->ring, rec->rec_off, &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_ring(rec->ring, rec->rec_off, &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_ring(rec->ring, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceRing *ring = get_trace_ring();
+    TraceRecord record;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t timestamp_ns = get_clock();
 
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
+    if (unlikely(!ring)) {
+        g_atomic_int_inc(&dropped_events);
+        return -ENOMEM;
+    }
 
-    idx = old_idx % TRACE_BUF_LEN;
+    /* A signal handler that traces while the thread is filling in a record
+     * would corrupt it, so drop the nested event. */
+    if (ring->busy ||
+        ring->head + rec_len - g_atomic_int_get((volatile gint *)&ring->tail)
+        > TRACE_RING_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        g_atomic_int_inc(&ring->dropped);
+        return -ENOSPC;
+    }
+    ring->busy = true;
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    record.event = event;
+    record.timestamp_ns = get_clock();
+    record.length = rec_len;
+    record.reserved = 0;
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->ring = ring;
+    rec->tbuf_idx = ring->head;
+    rec->rec_off = write_to_ring(ring, ring->head, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
-
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
-
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    TraceRing *ring = rec->ring;
+    unsigned int tail;
+
+    smp_wmb(); /* write barrier before publishing the record */
+    ring->head = rec->rec_off;
+    barrier();
+    ring->busy = false;
+
+    /* Kick the writeout thread once per crossing of the threshold, rather
+     * than on every record while it catches up. */
+    tail = g_atomic_int_get((volatile gint *)&ring->tail);
+    if (rec->rec_off - tail > TRACE_RING_FLUSH_THRESHOLD &&
+        rec->tbuf_idx - tail <= TRACE_RING_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
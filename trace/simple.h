@@ -28,8 +28,9 @@ bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
 
 typedef struct {
-    unsigned int tbuf_idx;
-    unsigned int rec_off;
+    struct TraceRing *ring;     /* ring of the calling thread */
+    unsigned int tbuf_idx;      /* start of the record in the ring */
+    unsigned int rec_off;       /* where the next argument goes */
 } TraceBufferRecord;
 
 /* Note for hackers: Make sure MAX_TRACE_LEN < sizeof(uint32_t) */
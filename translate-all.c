@@ -21,6 +21,7 @@
 #else
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/shm.h>
 #endif
 #include <stdarg.h>
 #include <stdlib.h>
@@ -72,20 +73,62 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
-/* Code generation and translation blocks */
+/* When the translation buffer is full, the oldest 1/CODE_GEN_REGIONS of
+   it is evicted rather than the whole buffer flushed.  */
+#define CODE_GEN_REGIONS 8
+
+/* Code generation and translation blocks.  Both tbs[] and the code buffer
+   are used as rings: TB i in allocation order is tbs[(tb_first + i) %
+   code_gen_max_blocks], and its host code follows that of TB i - 1,
+   wrapping back to the start of the buffer when the end is reached.  */
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
+static int tb_first;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
 uint8_t *code_gen_prologue;
+/* Host code doing exit_tb(0), for goto_ptr when no TB was found.  */
+uint8_t *code_gen_epilogue;
 static uint8_t *code_gen_buffer;
 static size_t code_gen_buffer_size;
 /* threshold to flush the translated code buffer */
 static size_t code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
+/* end of the host code written before the last wrap */
+static uint8_t *code_gen_wrap_ptr;
+
+/* Physical TB hash table, keyed on (phys_pc, pc, cs_base, flags).  It is
+   open addressed with linear probing, and each slot holds the full hash
+   of its TB so that most mismatches are rejected without loading the TB.
+   The table doubles in size when it becomes half full.  */
+typedef struct TBHashSlot {
+    uint32_t hash;
+    TranslationBlock *tb;
+} TBHashSlot;
+
+static TBHashSlot *tb_phys_hash;
+static unsigned int tb_phys_hash_mask;
+static unsigned int tb_phys_hash_count;
+static int tb_phys_hash_resize_count;
+
+/* In icount mode, the TBs that were cut short by cpu_io_recompile because
+   they did device I/O before their last instruction.  Each entry records
+   the cflags the TB was regenerated with, so that later translations of
+   the same code end on the I/O insn straight away instead of faulting
+   and being recompiled again.  The table is direct mapped: a collision
+   only loses a hint, which costs one more recompile.  */
+#define IO_HINT_BITS 10
+#define IO_HINT_SIZE (1 << IO_HINT_BITS)
+
+typedef struct IOHintSlot {
+    tb_page_addr_t phys_pc;
+    uint64_t flags;
+    int cflags;
+} IOHintSlot;
+
+static IOHintSlot io_hints[IO_HINT_SIZE];
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -93,7 +136,11 @@ typedef struct PageDesc {
     /* in order to optimize self modifying code, we count the number
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
+    /* one bit per byte of the page that holds translated code; once
+       built it is kept up to date while TBs are added, and rebuilt on
+       the next write after TBs have been removed */
     uint8_t *code_bitmap;
+    bool code_bitmap_stale;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -133,16 +180,98 @@ uintptr_t qemu_host_page_mask;
    The bottom level has pointers to PageDesc.  */
 static void *l1_map[V_L1_SIZE];
 
+#if !defined(CONFIG_USER_ONLY)
+/* RAM offsets are handed out densely from zero, so a guest with little
+   RAM has its pages kept in a flat array instead, sized from the RAM
+   layout when the first TB is created.  Pages past its end still go in
+   l1_map.  */
+#define PAGE_FLAT_MAX_RAM (16 * 1024 * 1024)
+static PageDesc *page_flat;
+static tb_page_addr_t page_flat_pages;
+static bool page_flat_done;
+#endif
+
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_evict_count;
+static int tb_evicted_count;
+static int tb_smc_write_count;
+static int tb_smc_filtered_count;
+static int tb_smc_invalidate_count;
+
+/* Set by -tcg traces=on: targets may continue a TB across direct
+   branches.  They count the TBs and branches concerned here.  */
+int tcg_traces;
+int tb_trace_count;
+int tb_trace_jmp_count;
+
+/* Set by -tcg ebb=on: the TCG register allocator keeps globals in host
+   registers across forward branches inside a TB.  */
+int tcg_ebb;
+
+/* Set by -tcg pretranslate=on: boards may translate likely entry points
+   before the guest first runs them.  */
+int tcg_pretranslate;
+
+/* Set by -tcg hugepages=: the pages asked for the code buffer.  Unless
+   the option is given, transparent huge pages are asked for quietly.  */
+int tcg_hugepages;
+static const char *code_gen_buffer_backing;
+static int tb_pretranslate_count;
+/* Host time spent in cpu_gen_code, which is cheap enough to measure
+   without CONFIG_PROFILER, and the part of it spent in the target's
+   decoder.  Targets that count the guest instructions they translate
+   add them to tb_gen_insn_count.  */
+static int64_t tb_gen_time_ns;
+static int64_t tb_gen_decode_ns;
+int64_t tb_gen_insn_count;
+
+/* Set by -tcg profile=on: count executions, exits and MMIO accesses of
+   each TB.  Indirect exits have no TB to charge them to.  */
+int tcg_tb_profile;
+static uint64_t tb_profile_indirect_exits;
+
+/* Set by -tcg cycles=on: the instruction counter counts the core clock
+   cycles the translator estimates for each TB instead of instructions.  */
+int tcg_cycles;
+
+/* Set by -tcg memfuncs=on: calls to the guest's memcpy, memset and their
+   relatives run as one host copy or fill when the memory is plain RAM.  */
+int tcg_memfuncs;
+
+/* Set by -tcg coverage=on: each TB counts the edge it is entered by in
+   tcg_coverage_map, laid out as AFL's shared memory bitmap.  The previous
+   location is shifted so that A->B and B->A are different edges.  */
+int tcg_coverage;
+uint8_t *tcg_coverage_map;
+uint32_t tcg_coverage_prev;
+
+/* The map is AFL's if it started us, otherwise a private one.  It must
+   not move once code that points into it has been generated.  */
+void tcg_coverage_init(void)
+{
+#ifndef _WIN32
+    const char *id = getenv("__AFL_SHM_ID");
+
+    if (id) {
+        tcg_coverage_map = shmat(atoi(id), NULL, 0);
+        if (tcg_coverage_map == (void *)-1) {
+            fprintf(stderr, "qemu: coverage: cannot attach shared memory "
+                    "%s: %s\n", id, strerror(errno));
+            exit(1);
+        }
+        return;
+    }
+#endif
+    tcg_coverage_map = g_malloc0(TCG_COVERAGE_MAP_SIZE);
+}
 
 /* code generation context */
 TCGContext tcg_ctx;
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
-static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 void cpu_gen_init(void)
 {
@@ -160,6 +289,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     TCGContext *s = &tcg_ctx;
     uint8_t *gen_code_buf;
     int gen_code_size;
+    int64_t t0;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -171,7 +301,19 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #endif
     tcg_func_start(s);
 
+    t0 = get_clock();
     gen_intermediate_code(env, tb);
+    tb_gen_decode_ns += get_clock() - t0;
+
+    if (tcg_tb_profile) {
+        uint16_t *opc;
+
+        for (opc = s->gen_opc_buf; opc < s->gen_opc_ptr; opc++) {
+            if (*opc == INDEX_op_call) {
+                tb->helper_calls++;
+            }
+        }
+    }
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
@@ -210,13 +352,14 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
+/* The cpu state corresponding to 'searched_pc' is restored.  Returns the
+   number of guest instructions of TB that ran before it, or -1.
  */
 static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
                                      uintptr_t searched_pc)
 {
     TCGContext *s = &tcg_ctx;
-    int j;
+    int i, j, n;
     uintptr_t tc_ptr;
 #ifdef CONFIG_PROFILER
     int64_t ti;
@@ -260,11 +403,18 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
 
     restore_state_to_opc(env, tb, j);
 
+    /* gen_opc_icount counts cycles under -tcg cycles=on, so count the
+       instruction starts instead.  */
+    n = 0;
+    for (i = 0; i < j; i++) {
+        n += s->gen_opc_instr_start[i];
+    }
+
 #ifdef CONFIG_PROFILER
     s->restore_time += profile_getclock() - ti;
     s->restore_count++;
 #endif
-    return 0;
+    return n;
 }
 
 bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
@@ -398,6 +548,23 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
     void **lp;
     int i;
 
+#if !defined(CONFIG_USER_ONLY)
+    if (index < page_flat_pages) {
+        return page_flat + index;
+    }
+    if (alloc && !page_flat_done) {
+        page_flat_done = true;
+        if (last_ram_offset() <= PAGE_FLAT_MAX_RAM) {
+            page_flat_pages = TARGET_PAGE_ALIGN(last_ram_offset())
+                >> TARGET_PAGE_BITS;
+            page_flat = g_new0(PageDesc, page_flat_pages);
+            if (index < page_flat_pages) {
+                return page_flat + index;
+            }
+        }
+    }
+#endif
+
 #if defined(CONFIG_USER_ONLY)
     /* We can't use g_malloc because it may recurse into a locked mutex. */
 # define ALLOC(P, SIZE)                                 \
@@ -481,6 +648,9 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 # define MAX_CODE_GEN_BUFFER_SIZE  (2ul * 1024 * 1024 * 1024)
 #elif defined(__arm__)
 # define MAX_CODE_GEN_BUFFER_SIZE  (16u * 1024 * 1024)
+#elif defined(__aarch64__)
+  /* B and BL reach +- 128MB.  */
+# define MAX_CODE_GEN_BUFFER_SIZE  (128ul * 1024 * 1024)
 #elif defined(__s390x__)
   /* We have a +- 4GB range on the branches; leave some slop.  */
 # define MAX_CODE_GEN_BUFFER_SIZE  (3ul * 1024 * 1024 * 1024)
@@ -490,6 +660,9 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 
 #define DEFAULT_CODE_GEN_BUFFER_SIZE_1 (32u * 1024 * 1024)
 
+/* Huge page size of x86 hosts, and the usual one of other Linux hosts.  */
+#define CODE_GEN_HUGEPAGE_SIZE (2u * 1024 * 1024)
+
 #define DEFAULT_CODE_GEN_BUFFER_SIZE \
   (DEFAULT_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
    ? DEFAULT_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
@@ -531,7 +704,8 @@ static inline void *alloc_code_gen_buffer(void)
 static inline void *alloc_code_gen_buffer(void)
 {
     int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    uintptr_t start = 0;
+    uintptr_t start = 0, aligned;
+    size_t align = 0;
     void *buf;
 
     /* Constrain the position of the buffer based on the host cpu.
@@ -556,9 +730,41 @@ static inline void *alloc_code_gen_buffer(void)
     start = 0x90000000ul;
 # endif
 
-    buf = mmap((void *)start, code_gen_buffer_size,
+#ifdef MAP_HUGETLB
+    if (tcg_hugepages == TCG_HUGEPAGES_HUGETLB) {
+        size_t size = QEMU_ALIGN_UP(code_gen_buffer_size,
+                                    CODE_GEN_HUGEPAGE_SIZE);
+
+        buf = mmap((void *)start, size, PROT_WRITE | PROT_READ | PROT_EXEC,
+                   flags | MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED) {
+            code_gen_buffer_size = size;
+            code_gen_buffer_backing = "hugetlbfs pages";
+            return buf;
+        }
+    }
+#endif
+
+    /* Transparent huge pages only back aligned ranges: map one more huge
+       page than needed, and unmap what sticks out on both sides.  */
+    if (tcg_hugepages != TCG_HUGEPAGES_OFF && start == 0) {
+        align = CODE_GEN_HUGEPAGE_SIZE;
+    }
+    buf = mmap((void *)start, code_gen_buffer_size + align,
                PROT_WRITE | PROT_READ | PROT_EXEC, flags, -1, 0);
-    return buf == MAP_FAILED ? NULL : buf;
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+    if (align) {
+        aligned = QEMU_ALIGN_UP((uintptr_t)buf, align);
+        if (aligned != (uintptr_t)buf) {
+            munmap(buf, aligned - (uintptr_t)buf);
+        }
+        munmap((void *)(aligned + code_gen_buffer_size),
+               (uintptr_t)buf + align - aligned);
+        buf = (void *)aligned;
+    }
+    return buf;
 }
 #else
 static inline void *alloc_code_gen_buffer(void)
@@ -581,7 +787,19 @@ static inline void code_gen_alloc(size_t tb_size)
         exit(1);
     }
 
-    qemu_madvise(code_gen_buffer, code_gen_buffer_size, QEMU_MADV_HUGEPAGE);
+    if (!code_gen_buffer_backing) {
+        if (tcg_hugepages != TCG_HUGEPAGES_OFF &&
+            qemu_madvise(code_gen_buffer, code_gen_buffer_size,
+                         QEMU_MADV_HUGEPAGE) == 0) {
+            code_gen_buffer_backing = "transparent huge pages";
+        } else {
+            code_gen_buffer_backing = "small pages";
+        }
+    }
+    if (tcg_hugepages != TCG_HUGEPAGES_AUTO) {
+        fprintf(stderr, "qemu: translation buffer of %zu KiB uses %s\n",
+                code_gen_buffer_size / 1024, code_gen_buffer_backing);
+    }
 
     /* Steal room for the prologue at the end of the buffer.  This ensures
        (via the MAX_CODE_GEN_BUFFER_SIZE limits above) that direct branches
@@ -595,6 +813,8 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    tb_phys_hash = g_new0(TBHashSlot, CODE_GEN_PHYS_HASH_SIZE);
+    tb_phys_hash_mask = CODE_GEN_PHYS_HASH_SIZE - 1;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -605,6 +825,7 @@ void tcg_exec_init(unsigned long tb_size)
     cpu_gen_init();
     code_gen_alloc(tb_size);
     code_gen_ptr = code_gen_buffer;
+    tcg_ctx.ebb = tcg_ebb;
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -619,19 +840,57 @@ bool tcg_enabled(void)
     return code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* The I-th TB in allocation order, the oldest being 0.  */
+static inline TranslationBlock *tb_nth(int i)
+{
+    return &tbs[(tb_first + i) % code_gen_max_blocks];
+}
+
+/* Distance of host code address P from the code of the oldest TB, going
+   round the code buffer.  This increases along the TBs in allocation
+   order.  */
+static size_t tb_code_offset(const uint8_t *p)
+{
+    const uint8_t *base = nb_tbs > 0 ? tb_nth(0)->tc_ptr : code_gen_ptr;
+
+    return p >= base ? p - base : p + code_gen_buffer_size - base;
+}
+
+/* Whether a TB of the largest size can be generated at code_gen_ptr
+   without overwriting the code of a live TB.  */
+static bool tb_code_room(void)
+{
+    uint8_t *oldest;
+
+    if (nb_tbs == 0) {
+        return (code_gen_ptr - code_gen_buffer) < code_gen_buffer_max_size;
+    }
+    oldest = tb_nth(0)->tc_ptr;
+    if (oldest < code_gen_ptr) {
+        return (code_gen_ptr - code_gen_buffer) < code_gen_buffer_max_size;
+    }
+    return (oldest - code_gen_ptr) >=
+        code_gen_buffer_size - code_gen_buffer_max_size;
+}
+
+/* Allocate a new translation block.  Return NULL if too many translation
+   blocks or too much generated code; tb_evict() then makes room.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size) {
+    if (nb_tbs >= code_gen_max_blocks || !tb_code_room()) {
         return NULL;
     }
-    tb = &tbs[nb_tbs++];
+    tb = tb_nth(nb_tbs++);
     tb->pc = pc;
     tb->cflags = 0;
+    tb->lit_start = 0;
+    tb->lit_end = 0;
+    tb->exec_count = 0;
+    tb->chain_exits = 0;
+    tb->io_count = 0;
+    tb->helper_calls = 0;
     return tb;
 }
 
@@ -640,12 +899,61 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (nb_tbs > 0 && tb == tb_nth(nb_tbs - 1)) {
         code_gen_ptr = tb->tc_ptr;
         nb_tbs--;
     }
 }
 
+static void tb_evict_oldest(void)
+{
+    TranslationBlock *tb = tb_nth(0);
+
+    if (!(tb->cflags & CF_INVALID)) {
+        tb_phys_invalidate(tb, -1);
+    }
+    tb_first = (tb_first + 1) % code_gen_max_blocks;
+    nb_tbs--;
+    tb_evicted_count++;
+}
+
+/* Make room for a new TB by invalidating the oldest ones, so that the
+   rest of the translations survive.  A region's worth of code, or of
+   TB descriptors, is freed at a time so this does not happen on every
+   allocation.  */
+static void tb_evict(void)
+{
+    size_t region;
+    uint8_t *oldest;
+
+    region = MAX(code_gen_buffer_size / CODE_GEN_REGIONS,
+                 code_gen_buffer_size - code_gen_buffer_max_size);
+    while (nb_tbs > code_gen_max_blocks -
+           code_gen_max_blocks / CODE_GEN_REGIONS) {
+        tb_evict_oldest();
+    }
+    for (;;) {
+        if (nb_tbs == 0) {
+            code_gen_ptr = code_gen_buffer;
+            break;
+        }
+        oldest = tb_nth(0)->tc_ptr;
+        if (oldest < code_gen_ptr) {
+            if ((code_gen_ptr - code_gen_buffer) < code_gen_buffer_max_size) {
+                break;
+            }
+            /* the oldest TBs are now those at the start of the buffer */
+            code_gen_wrap_ptr = code_gen_ptr;
+            code_gen_ptr = code_gen_buffer;
+        } else if (oldest - code_gen_ptr < region) {
+            tb_evict_oldest();
+        } else {
+            break;
+        }
+    }
+    tb_evict_count++;
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     if (p->code_bitmap) {
@@ -655,6 +963,12 @@ static inline void invalidate_page_bitmap(PageDesc *p)
     p->code_write_count = 0;
 }
 
+/* A TB was removed from the page: its bits may no longer be code.  */
+static inline void stale_page_bitmap(PageDesc *p)
+{
+    p->code_bitmap_stale = p->code_bitmap != NULL;
+}
+
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
 static void page_flush_tb_1(int level, void **lp)
 {
@@ -686,6 +1000,12 @@ static void page_flush_tb(void)
     for (i = 0; i < V_L1_SIZE; i++) {
         page_flush_tb_1(V_L1_SHIFT / L2_BITS - 1, l1_map + i);
     }
+#if !defined(CONFIG_USER_ONLY)
+    for (i = 0; i < page_flat_pages; i++) {
+        page_flat[i].first_tb = NULL;
+        invalidate_page_bitmap(page_flat + i);
+    }
+#endif
 }
 
 /* flush all the translation blocks */
@@ -705,12 +1025,17 @@ void tb_flush(CPUArchState *env1)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
     nb_tbs = 0;
+    tb_first = 0;
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+        tb_flush_jmp_cache_all(env);
     }
 
-    memset(tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    /* the table is only allocated once TCG is initialised */
+    if (tb_phys_hash) {
+        memset(tb_phys_hash, 0, (tb_phys_hash_mask + 1) * sizeof(TBHashSlot));
+    }
+    tb_phys_hash_count = 0;
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
@@ -727,14 +1052,13 @@ static void tb_invalidate_check(target_ulong address)
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
+    for (i = 0; i <= tb_phys_hash_mask; i++) {
+        tb = tb_phys_hash[i].tb;
+        if (tb && !(address + TARGET_PAGE_SIZE <= tb->pc ||
+                    address >= tb->pc + tb->size)) {
+            printf("ERROR invalidate: address=" TARGET_FMT_lx
+                   " PC=%08lx size=%04x\n",
+                   address, (long)tb->pc, tb->size);
         }
     }
 }
@@ -745,32 +1069,152 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
+    for (i = 0; i <= tb_phys_hash_mask; i++) {
+        tb = tb_phys_hash[i].tb;
+        if (!tb) {
+            continue;
+        }
+        flags1 = page_get_flags(tb->pc);
+        flags2 = page_get_flags(tb->pc + tb->size - 1);
+        if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+            printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+                   (long)tb->pc, tb->size, flags1, flags2);
         }
     }
 }
 
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static inline uint32_t tb_phys_hash_func(tb_page_addr_t phys_pc,
+                                         target_ulong pc,
+                                         target_ulong cs_base,
+                                         uint64_t flags)
 {
-    TranslationBlock *tb1;
+    uint64_t h;
+
+    h = (uint64_t)phys_pc * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)pc + cs_base) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= flags * 0x165667b19e3779f9ULL;
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
+static inline uint32_t tb_hash(TranslationBlock *tb)
+{
+    return tb_phys_hash_func(tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK),
+                             tb->pc, tb->cs_base, tb->flags);
+}
+
+static inline IOHintSlot *io_hint_slot(tb_page_addr_t phys_pc,
+                                       target_ulong pc, uint64_t flags)
+{
+    return &io_hints[tb_phys_hash_func(phys_pc, pc, 0, flags)
+                     & (IO_HINT_SIZE - 1)];
+}
+
+static int io_hint_find(tb_page_addr_t phys_pc, target_ulong pc,
+                        uint64_t flags)
+{
+    IOHintSlot *slot = io_hint_slot(phys_pc, pc, flags);
+
+    if (slot->cflags && slot->phys_pc == phys_pc && slot->flags == flags) {
+        return slot->cflags;
+    }
+    return 0;
+}
+
+static void io_hint_add(tb_page_addr_t phys_pc, target_ulong pc,
+                        uint64_t flags, int cflags)
+{
+    IOHintSlot *slot = io_hint_slot(phys_pc, pc, flags);
+
+    slot->phys_pc = phys_pc;
+    slot->flags = flags;
+    slot->cflags = cflags;
+}
+
+static void tb_hash_insert_slot(TBHashSlot *table, unsigned int mask,
+                                uint32_t hash, TranslationBlock *tb)
+{
+    unsigned int i;
+
+    for (i = hash & mask; table[i].tb; i = (i + 1) & mask) {
+    }
+    table[i].hash = hash;
+    table[i].tb = tb;
+}
+
+static void tb_hash_insert(TranslationBlock *tb)
+{
+    TBHashSlot *old = tb_phys_hash;
+    unsigned int i, old_mask = tb_phys_hash_mask;
+
+    if (++tb_phys_hash_count > (old_mask + 1) / 2) {
+        tb_phys_hash_mask = old_mask * 2 + 1;
+        tb_phys_hash = g_new0(TBHashSlot, tb_phys_hash_mask + 1);
+        for (i = 0; i <= old_mask; i++) {
+            if (old[i].tb) {
+                tb_hash_insert_slot(tb_phys_hash, tb_phys_hash_mask,
+                                    old[i].hash, old[i].tb);
+            }
+        }
+        g_free(old);
+        tb_phys_hash_resize_count++;
+    }
+    tb_hash_insert_slot(tb_phys_hash, tb_phys_hash_mask, tb_hash(tb), tb);
+}
+
+static void tb_hash_remove(TranslationBlock *tb)
+{
+    unsigned int i, j, home, mask = tb_phys_hash_mask;
+
+    for (i = tb_hash(tb) & mask; tb_phys_hash[i].tb != tb;
+         i = (i + 1) & mask) {
+        if (!tb_phys_hash[i].tb) {
+            return;
+        }
+    }
+    /* Move back any later entry of the probe sequence that would no
+       longer be reachable across the hole.  */
+    for (j = (i + 1) & mask; tb_phys_hash[j].tb; j = (j + 1) & mask) {
+        home = tb_phys_hash[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            tb_phys_hash[i] = tb_phys_hash[j];
+            i = j;
         }
-        ptb = &tb1->phys_hash_next;
     }
+    tb_phys_hash[i].tb = NULL;
+    tb_phys_hash_count--;
+}
+
+/* Find the TB translated for PC at physical address PHYS_PC in the given
+   CPU state, or return NULL.  */
+TranslationBlock *tb_find_phys(CPUArchState *env, target_ulong pc,
+                               tb_page_addr_t phys_pc, target_ulong cs_base,
+                               uint64_t flags)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    uint32_t hash = tb_phys_hash_func(phys_pc, pc, cs_base, flags);
+    unsigned int i;
+
+    for (i = hash & tb_phys_hash_mask; (tb = tb_phys_hash[i].tb);
+         i = (i + 1) & tb_phys_hash_mask) {
+        if (tb_phys_hash[i].hash == hash &&
+            tb->pc == pc &&
+            tb->page_addr[0] == phys_page1 &&
+            tb->cs_base == cs_base &&
+            tb->flags == flags) {
+            /* check next page if needed */
+            if (tb->page_addr[1] == -1 ||
+                tb->page_addr[1] == get_page_addr_code(env,
+                    (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE)) {
+                return tb;
+            }
+        }
+    }
+    return NULL;
 }
 
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
@@ -832,24 +1276,21 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUArchState *env;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tb_phys_hash[h], tb);
+    /* remove the TB from the hash table */
+    tb_hash_remove(tb);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        stale_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        stale_page_bitmap(p);
     }
 
     tb_invalidated_flag = 1;
@@ -857,8 +1298,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        if (env->tb_jmp_cache[h] == tb) {
-            env->tb_jmp_cache[h] = NULL;
+        if (env->tb_jmp_cache[h].tb == tb) {
+            env->tb_jmp_cache[h].tb = NULL;
         }
     }
 
@@ -881,6 +1322,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    tb->cflags |= CF_INVALID;
     tb_phys_invalidate_count++;
 }
 
@@ -911,31 +1353,45 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+/* Mark the code of TB that lies in its page N in the page's bitmap.  */
+static void tb_set_page_bits(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+        set_bits(p->code_bitmap, tb->lit_start, tb->lit_end - tb->lit_start);
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    if (p->code_bitmap) {
+        memset(p->code_bitmap, 0, TARGET_PAGE_SIZE / 8);
+    } else {
+        p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    }
+    p->code_bitmap_stale = false;
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        tb_set_page_bits(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -949,12 +1405,16 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t ti;
 
     phys_pc = get_page_addr_code(env, pc);
+    if (use_icount && cflags == 0) {
+        cflags = io_hint_find(phys_pc, pc, flags);
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* evict the oldest TBs */
+        tb_evict();
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -965,7 +1425,9 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    ti = get_clock();
     cpu_gen_code(env, tb, &code_gen_size);
+    tb_gen_time_ns += get_clock() - ti;
     code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
                              CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -979,6 +1441,37 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     return tb;
 }
 
+/* Translate the code at PC for the current CPU state before it first
+   runs, then carry on with the code that follows each block, for at most
+   MAX blocks.  Blocks that already exist are skipped over.  The walk
+   stays below END, and leaves the last page before it alone since a
+   block there may read past it.  Returns the number of new blocks.  */
+int tb_pretranslate(CPUArchState *env, target_ulong pc, target_ulong end,
+                    int max)
+{
+    TranslationBlock *tb;
+    target_ulong cur_pc, cs_base;
+    tb_page_addr_t phys_pc;
+    int flags, n = 0;
+
+    cpu_get_tb_cpu_state(env, &cur_pc, &cs_base, &flags);
+    while (max-- > 0 && pc < end && end - pc > TARGET_PAGE_SIZE) {
+        phys_pc = get_page_addr_code(env, pc);
+        tb = tb_find_phys(env, pc, phys_pc, cs_base, flags);
+        if (!tb) {
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
+            tb_jmp_cache_set(env, pc, tb);
+            n++;
+        }
+        if (tb->size == 0) {
+            break;
+        }
+        pc += tb->size;
+    }
+    tb_pretranslate_count += n;
+    return n;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1049,7 +1542,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
             tb_start = tb->page_addr[1];
             tb_end = tb_start + ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
         }
-        if (!(tb_end <= start || tb_start >= end)) {
+        if (!(tb_end <= start || tb_start >= end)
+            || (n == 0 && tb->lit_start != tb->lit_end
+                && start < tb->page_addr[0] + tb->lit_end
+                && end > tb->page_addr[0] + tb->lit_start)) {
 #ifdef TARGET_HAS_PRECISE_SMC
             if (current_tb_not_found) {
                 current_tb_not_found = 0;
@@ -1080,6 +1576,9 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                 saved_tb = env->current_tb;
                 env->current_tb = NULL;
             }
+            if (is_cpu_write_access) {
+                tb_smc_invalidate_count++;
+            }
             tb_phys_invalidate(tb, -1);
             if (env) {
                 env->current_tb = saved_tb;
@@ -1130,12 +1629,17 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
+    tb_smc_write_count++;
     if (p->code_bitmap) {
+        if (p->code_bitmap_stale) {
+            build_page_bitmap(p);
+        }
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
         if (b & ((1 << len) - 1)) {
             goto do_invalidate;
         }
+        tb_smc_filtered_count++;
     } else {
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
@@ -1220,7 +1724,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap && !p->code_bitmap_stale) {
+        tb_set_page_bits(p, tb, n);
+    }
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -1268,17 +1774,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1288,6 +1786,9 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb->page_addr[1] = -1;
     }
 
+    /* add in the physical hash table */
+    tb_hash_insert(tb);
+
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
     tb->jmp_next[0] = NULL;
     tb->jmp_next[1] = NULL;
@@ -1319,17 +1820,21 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
-static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
-    uintptr_t v;
+    size_t v, off;
     TranslationBlock *tb;
 
     if (nb_tbs <= 0) {
         return NULL;
     }
     if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+        tc_ptr >= (uintptr_t)(code_gen_buffer + code_gen_buffer_size)) {
+        return NULL;
+    }
+    off = tb_code_offset((uint8_t *)tc_ptr);
+    if (off >= tb_code_offset(code_gen_ptr)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
@@ -1337,66 +1842,17 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     m_max = nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
-        v = (uintptr_t)tb->tc_ptr;
-        if (v == tc_ptr) {
+        tb = tb_nth(m);
+        v = tb_code_offset(tb->tc_ptr);
+        if (v == off) {
             return tb;
-        } else if (tc_ptr < v) {
+        } else if (off < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
-}
-
-static void tb_reset_jump_recursive(TranslationBlock *tb);
-
-static inline void tb_reset_jump_recursive2(TranslationBlock *tb, int n)
-{
-    TranslationBlock *tb1, *tb_next, **ptb;
-    unsigned int n1;
-
-    tb1 = tb->jmp_next[n];
-    if (tb1 != NULL) {
-        /* find head of list */
-        for (;;) {
-            n1 = (uintptr_t)tb1 & 3;
-            tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
-            if (n1 == 2) {
-                break;
-            }
-            tb1 = tb1->jmp_next[n1];
-        }
-        /* we are now sure now that tb jumps to tb1 */
-        tb_next = tb1;
-
-        /* remove tb from the jmp_first list */
-        ptb = &tb_next->jmp_first;
-        for (;;) {
-            tb1 = *ptb;
-            n1 = (uintptr_t)tb1 & 3;
-            tb1 = (TranslationBlock *)((uintptr_t)tb1 & ~3);
-            if (n1 == n && tb1 == tb) {
-                break;
-            }
-            ptb = &tb1->jmp_next[n1];
-        }
-        *ptb = tb->jmp_next[n];
-        tb->jmp_next[n] = NULL;
-
-        /* suppress the jump to next tb in generated code */
-        tb_reset_jump(tb, n);
-
-        /* suppress jumps in the tb on which we could have jumped */
-        tb_reset_jump_recursive(tb_next);
-    }
-}
-
-static void tb_reset_jump_recursive(TranslationBlock *tb)
-{
-    tb_reset_jump_recursive2(tb, 0);
-    tb_reset_jump_recursive2(tb, 1);
+    return tb_nth(m_max);
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1417,24 +1873,14 @@ void tb_invalidate_phys_addr(hwaddr addr)
 }
 #endif /* TARGET_HAS_ICE && !defined(CONFIG_USER_ONLY) */
 
-void cpu_unlink_tb(CPUArchState *env)
+/* Account for a return to cpu_exec with value NEXT_TB.  */
+void tb_profile_exit(uintptr_t next_tb)
 {
-    /* FIXME: TB unchaining isn't SMP safe.  For now just ignore the
-       problem and hope the cpu will stop of its own accord.  For userspace
-       emulation this often isn't actually as bad as it sounds.  Often
-       signals are used primarily to interrupt blocking syscalls.  */
-    TranslationBlock *tb;
-    static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCKED;
-
-    spin_lock(&interrupt_lock);
-    tb = env->current_tb;
-    /* if the cpu is currently executing code, we must unlink it and
-       all the potentially executing TB */
-    if (tb) {
-        env->current_tb = NULL;
-        tb_reset_jump_recursive(tb);
+    if (next_tb == 0) {
+        tb_profile_indirect_exits++;
+    } else if ((next_tb & 3) < 2) {
+        ((TranslationBlock *)(next_tb & ~3))->chain_exits++;
     }
-    spin_unlock(&interrupt_lock);
 }
 
 void tb_check_watchpoint(CPUArchState *env)
@@ -1476,7 +1922,7 @@ static void tcg_handle_interrupt(CPUArchState *env, int mask)
             cpu_abort(env, "Raised interrupt while not in I/O function");
         }
     } else {
-        cpu_unlink_tb(env);
+        env->tcg_exit_req = 1;
     }
 }
 
@@ -1496,11 +1942,9 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
         cpu_abort(env, "cpu_io_recompile: could not find TB for pc=%p",
                   (void *)retaddr);
     }
-    n = env->icount_decr.u16.low + tb->icount;
-    cpu_restore_state_from_tb(tb, env, retaddr);
     /* Calculate how many instructions had been executed before the fault
        occurred.  */
-    n = n - env->icount_decr.u16.low;
+    n = cpu_restore_state_from_tb(tb, env, retaddr);
     /* Generate a new TB ending on the I/O insn.  */
     n++;
     /* On MIPS and SH, delay slot instructions can only be restarted if
@@ -1530,6 +1974,8 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     pc = tb->pc;
     cs_base = tb->cs_base;
     flags = tb->flags;
+    io_hint_add(tb->page_addr[0] + (pc & ~TARGET_PAGE_MASK), pc, flags,
+                cflags);
     tb_phys_invalidate(tb, -1);
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
@@ -1542,25 +1988,61 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     cpu_resume_from_signal(env, NULL);
 }
 
-void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
+/* Take CYCLES off the instruction counter of ENV for work the CPU does
+   outside translated code, such as stacking registers on exception entry.
+   Only -tcg cycles=on counts it.  The charge is capped at what is left of
+   the budget, so that virtual time does not run past the deadline that
+   the budget was computed for.  */
+void cpu_icount_charge(CPUArchState *env, int cycles)
 {
-    unsigned int i;
+    int n;
 
+    if (!use_icount || !tcg_cycles) {
+        return;
+    }
+    n = MIN(cycles, env->icount_extra);
+    env->icount_extra -= n;
+    cycles -= n;
+    n = MIN(cycles, env->icount_decr.u16.low);
+    env->icount_decr.u16.low -= n;
+}
+
+/* Invalidate the entries of the jump cache slice that starts at entry i.
+   They are only cleared when its generation wraps, so that an entry
+   from 2^32 flushes ago cannot come back.  */
+static inline void tb_flush_jmp_cache_slice(CPUArchState *env,
+                                            unsigned int i)
+{
+    if (++env->tb_jmp_cache_gen[i >> TB_JMP_PAGE_BITS] == 0) {
+        memset(&env->tb_jmp_cache[i], 0,
+               TB_JMP_PAGE_SIZE * sizeof(CPUTBJmpCacheEntry));
+    }
+}
+
+void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
+{
     /* Discard jump cache entries for any tb which might potentially
        overlap the flushed page.  */
-    i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
-    memset(&env->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    tb_flush_jmp_cache_slice(env,
+                             tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE));
+    tb_flush_jmp_cache_slice(env, tb_jmp_cache_hash_page(addr));
+}
 
-    i = tb_jmp_cache_hash_page(addr);
-    memset(&env->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+void tb_flush_jmp_cache_all(CPUArchState *env)
+{
+    unsigned int i;
+
+    for (i = 0; i < TB_JMP_CACHE_SIZE; i += TB_JMP_PAGE_SIZE) {
+        tb_flush_jmp_cache_slice(env, i);
+    }
 }
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    unsigned int probe, max_probe;
+    uint64_t total_probe;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -1569,7 +2051,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
     for (i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
+        tb = tb_nth(i);
         target_code_size += tb->size;
         if (tb->size > max_target_code_size) {
             max_target_code_size = tb->size;
@@ -1584,18 +2066,29 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
             }
         }
     }
+    total_probe = 0;
+    max_probe = 0;
+    /* the table is only allocated once TCG is initialised */
+    for (i = 0; tb_phys_hash && i <= tb_phys_hash_mask; i++) {
+        if (tb_phys_hash[i].tb) {
+            probe = ((i - tb_phys_hash[i].hash) & tb_phys_hash_mask) + 1;
+            total_probe += probe;
+            max_probe = MAX(max_probe, probe);
+        }
+    }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                tb_code_offset(code_gen_ptr), code_gen_buffer_max_size);
     cpu_fprintf(f, "TB count            %d/%d\n",
                 nb_tbs, code_gen_max_blocks);
+    cpu_fprintf(f, "gen code pages      %s\n", code_gen_buffer_backing);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer)
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? tb_code_offset(code_gen_ptr) / nb_tbs : 0,
+                target_code_size ? (double) tb_code_offset(code_gen_ptr)
                 / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
@@ -1605,19 +2098,202 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    if (tb_phys_hash) {
+        cpu_fprintf(f, "TB hash table       %u/%u used (%u%%), %d resizes\n",
+                    tb_phys_hash_count, tb_phys_hash_mask + 1,
+                    (unsigned)((tb_phys_hash_count * 100ULL) /
+                               (tb_phys_hash_mask + 1)),
+                    tb_phys_hash_resize_count);
+        cpu_fprintf(f, "TB hash probes      avg %0.2f max %u\n",
+                    tb_phys_hash_count ?
+                    (double)total_probe / tb_phys_hash_count : 0,
+                    max_probe);
+    }
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB evict count      %d (%d TBs)\n",
+                tb_evict_count, tb_evicted_count);
+    cpu_fprintf(f, "TB SMC invalidated  %d (%d code page writes, "
+                "%d outside code)\n", tb_smc_invalidate_count,
+                tb_smc_write_count, tb_smc_filtered_count);
+    cpu_fprintf(f, "TB trace count      %d (%d branches followed)\n",
+                tb_trace_count, tb_trace_jmp_count);
+    cpu_fprintf(f, "TB pretranslated    %d\n", tb_pretranslate_count);
+    cpu_fprintf(f, "TB gen time         %0.3f ms (%0.3f ms decoding)\n",
+                tb_gen_time_ns / 1e6, tb_gen_decode_ns / 1e6);
+    if (tb_gen_insn_count && tb_gen_decode_ns) {
+        cpu_fprintf(f, "TB gen rate         %0.0f guest insns/s "
+                    "(%0.0f decoding only)\n",
+                    tb_gen_insn_count * 1e9 / tb_gen_time_ns,
+                    tb_gen_insn_count * 1e9 / tb_gen_decode_ns);
+    }
+    cpu_fprintf(f, "direct I/O accesses %" PRId64 "\n",
+                tcg_ctx.direct_io_count);
+    if (tcg_ebb) {
+        cpu_fprintf(f, "EBB labels          %" PRId64 " (%" PRId64
+                    " globals kept in registers)\n",
+                    tcg_ctx.ebb_label_count, tcg_ctx.ebb_kept_count);
+    }
+    if (tcg_tb_profile) {
+        uint64_t execs = 0, chain_exits = 0, io = 0;
+
+        for (i = 0; i < nb_tbs; i++) {
+            tb = tb_nth(i);
+            execs += tb->exec_count;
+            chain_exits += tb->chain_exits;
+            io += tb->io_count;
+        }
+        cpu_fprintf(f, "TB exec count       %" PRIu64 "\n", execs);
+        cpu_fprintf(f, "TB exits            %" PRIu64 " unchained, %"
+                    PRIu64 " indirect\n",
+                    chain_exits, tb_profile_indirect_exits);
+        cpu_fprintf(f, "TB MMIO accesses    %" PRIu64 "\n", io);
+    }
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* Host code size of TB I in allocation order; its code ends where the
+   next TB's starts, unless the buffer wrapped in between.  */
+static int tb_host_size(int i)
+{
+    uint8_t *start = tb_nth(i)->tc_ptr;
+    uint8_t *end;
+
+    end = i + 1 < nb_tbs ? tb_nth(i + 1)->tc_ptr : code_gen_ptr;
+    if (end < start) {
+        end = code_gen_wrap_ptr;
+    }
+    return end - start;
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    uint64_t ca = tb_nth(*(const int *)a)->exec_count;
+    uint64_t cb = tb_nth(*(const int *)b)->exec_count;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TranslationBlock *tb;
+    int *order;
+    int i;
+
+    if (!tcg_tb_profile) {
+        cpu_fprintf(f, "TB profiling is off (use -tcg profile=on)\n");
+        return;
+    }
+    order = g_new(int, nb_tbs);
+    for (i = 0; i < nb_tbs; i++) {
+        order[i] = i;
+    }
+    qsort(order, nb_tbs, sizeof(*order), tb_profile_cmp);
+    if (max <= 0 || max > nb_tbs) {
+        max = nb_tbs;
+    }
+    cpu_fprintf(f, "%-*s %12s %8s %8s %5s %5s %5s  %s\n",
+                (int)sizeof(target_ulong) * 2, "pc", "execs",
+                "exits", "mmio", "calls", "size", "host", "symbol");
+    for (i = 0; i < max; i++) {
+        tb = tb_nth(order[i]);
+        if (!tb->exec_count) {
+            break;
+        }
+        cpu_fprintf(f, TARGET_FMT_lx " %12" PRIu64 " %8u %8u %5u %5u %5d  %s\n",
+                    tb->pc, tb->exec_count, tb->chain_exits, tb->io_count,
+                    tb->helper_calls, tb->size, tb_host_size(order[i]),
+                    lookup_symbol(tb->pc));
+    }
+    g_free(order);
+}
+
+/* Binary TB profile written by -tcg profile-file: a TBProfileHeader and
+   then one TBProfileRecord per TB, all little endian.  The file is
+   rewritten with the current counts every interval.  */
+typedef struct QEMU_PACKED TBProfileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t indirect_exits;
+} TBProfileHeader;
+
+typedef struct QEMU_PACKED TBProfileRecord {
+    uint64_t pc;
+    uint64_t exec_count;
+    uint32_t chain_exits;
+    uint32_t io_count;
+    uint32_t host_size;
+    uint16_t size;
+    uint16_t helper_calls;
+} TBProfileRecord;
+
+static char *tb_profile_filename;
+static QEMUTimer *tb_profile_timer;
+static int64_t tb_profile_interval;
+
+static void tb_profile_dump(void *opaque)
+{
+    TBProfileHeader hdr;
+    TBProfileRecord rec;
+    TranslationBlock *tb;
+    FILE *f;
+    int i;
+
+    f = fopen(tb_profile_filename, "wb");
+    if (f) {
+        memcpy(hdr.magic, "QEMUTBP", 8);
+        hdr.version = cpu_to_le32(1);
+        hdr.count = cpu_to_le32(nb_tbs);
+        hdr.indirect_exits = cpu_to_le64(tb_profile_indirect_exits);
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        for (i = 0; i < nb_tbs; i++) {
+            tb = tb_nth(i);
+            rec.pc = cpu_to_le64(tb->pc);
+            rec.exec_count = cpu_to_le64(tb->exec_count);
+            rec.chain_exits = cpu_to_le32(tb->chain_exits);
+            rec.io_count = cpu_to_le32(tb->io_count);
+            rec.host_size = cpu_to_le32(tb_host_size(i));
+            rec.size = cpu_to_le16(tb->size);
+            rec.helper_calls = cpu_to_le16(tb->helper_calls);
+            fwrite(&rec, sizeof(rec), 1, f);
+        }
+        fclose(f);
+    }
+    qemu_mod_timer(tb_profile_timer,
+                   qemu_get_clock_ms(rt_clock) + tb_profile_interval);
+}
+
+void tb_profile_dump_init(const char *filename, int64_t interval_ms)
+{
+    tb_profile_filename = g_strdup(filename);
+    tb_profile_interval = interval_ms > 0 ? interval_ms : 1000;
+    tb_profile_timer = qemu_new_timer_ms(rt_clock, tb_profile_dump, NULL);
+    qemu_mod_timer(tb_profile_timer,
+                   qemu_get_clock_ms(rt_clock) + tb_profile_interval);
+}
+
+void tb_profile_io(MemoryRegion *mr, uintptr_t retaddr)
+{
+    TranslationBlock *tb;
+
+    if (mr == &io_mem_ram || mr == &io_mem_rom || mr == &io_mem_notdirty) {
+        return;
+    }
+    tb = tb_find_pc(retaddr);
+    if (tb) {
+        tb->io_count++;
+    }
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUArchState *env, int mask)
 {
     env->interrupt_request |= mask;
-    cpu_unlink_tb(env);
+    env->tcg_exit_req = 1;
 }
 
 /*
@@ -168,8 +168,47 @@ static int nb_consoles = 0;
 
 void vga_hw_update(void)
 {
-    if (active_console && active_console->hw_update)
+    if (active_console && active_console->hw_update) {
+        DisplayState *ds = active_console->ds;
+
+        /* Nothing to redraw */
+        if (ds->damage_driven && ds->damage_x0 >= ds->damage_x1) {
+            return;
+        }
         active_console->hw_update(active_console->hw);
+    }
+}
+
+void dpy_gfx_damage(DisplayState *s, int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+    if (s->damage_x0 >= s->damage_x1) {
+        s->damage_x0 = x;
+        s->damage_y0 = y;
+        s->damage_x1 = x + w;
+        s->damage_y1 = y + h;
+    } else {
+        s->damage_x0 = MIN(s->damage_x0, x);
+        s->damage_y0 = MIN(s->damage_y0, y);
+        s->damage_x1 = MAX(s->damage_x1, x + w);
+        s->damage_y1 = MAX(s->damage_y1, y + h);
+    }
+    s->damage_driven = true;
+}
+
+bool dpy_gfx_take_damage(DisplayState *s, int *x, int *y, int *w, int *h)
+{
+    if (s->damage_x0 >= s->damage_x1) {
+        return false;
+    }
+    *x = s->damage_x0;
+    *y = s->damage_y0;
+    *w = s->damage_x1 - s->damage_x0;
+    *h = s->damage_y1 - s->damage_y0;
+    s->damage_x0 = s->damage_x1 = 0;
+    return true;
 }
 
 void vga_hw_invalidate(void)
@@ -41,28 +41,37 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, the VncDisplay global lock is held
+ * shared to avoid screen corruption (this does not block vnc_refresh() because
+ * it uses trylock()) but the output lock is not held because the thread works
+ * on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several worker threads can encode at once, but only for different clients:
+ * the jobs of a client are encoded one at a time and in order, since its
+ * updates must reach it in order and its zlib streams carry state from one
+ * update to the next.
  */
 
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
     bool exit;
+    int n_workers;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
+typedef struct VncWorker {
+    VncJobQueue *queue;
+    QemuThread thread;
+    Buffer buffer;
+} VncWorker;
+
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, shared by all the encoding threads
  */
 static VncJobQueue *queue;
 
@@ -142,7 +151,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* The workers remove the jobs they are encoding */
+        if ((job->vs == vs || !vs) && !job->encoding) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -179,7 +189,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncWorker *worker, VncState *orig,
+                                     VncState *local)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -193,13 +204,14 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output =  worker->buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncWorker *worker, VncState *orig,
+                                   VncState *local)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -207,11 +219,37 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    worker->buffer = local->output;
+}
+
+/*
+ * The first job which no other worker is encoding, and which no job of the
+ * same client comes before
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->encoding) {
+            continue;
+        }
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static int vnc_worker_thread_loop(VncWorker *worker)
 {
+    VncJobQueue *queue = worker->queue;
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
@@ -219,16 +257,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!(job = vnc_next_job_locked(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->encoding = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -238,7 +275,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(worker, job->vs, &vs);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -247,12 +284,12 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             goto disconnected;
         }
 
@@ -264,7 +301,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -276,7 +313,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(worker, job->vs, &vs);
 
 	qemu_bh_schedule(job->vs->bh);
     }
@@ -305,19 +342,30 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
+
+    qemu_thread_get_self(&worker->thread);
+
+    while (!vnc_worker_thread_loop(worker)) ;
 
-    qemu_thread_get_self(&queue->thread);
+    buffer_free(&worker->buffer);
+    g_free(worker);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    /* The last worker to leave frees the queue */
+    vnc_lock_queue(queue);
+    last = --queue->n_workers == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -326,16 +374,23 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
-void vnc_start_worker_thread(void)
+void vnc_start_worker_threads(int n)
 {
-    VncJobQueue *q;
+    VncWorker *worker;
 
-    if (vnc_worker_thread_running())
-        return ;
+    if (!vnc_worker_thread_running()) {
+        queue = vnc_queue_init(); /* Set global queue */
+    }
 
-    q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
-    queue = q; /* Set global queue */
+    vnc_lock_queue(queue);
+    while (queue->n_workers < n) {
+        worker = g_malloc0(sizeof(VncWorker));
+        worker->queue = queue;
+        queue->n_workers++;
+        qemu_thread_create(&worker->thread, vnc_worker_thread, worker,
+                           QEMU_THREAD_DETACHED);
+    }
+    vnc_unlock_queue(queue);
 }
 
 void vnc_stop_worker_thread(void)
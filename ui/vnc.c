@@ -2850,7 +2850,7 @@ void vnc_display_init(DisplayState *ds)
         exit(1);
 
     qemu_mutex_init(&vs->mutex);
-    vnc_start_worker_thread();
+    vnc_start_worker_threads(1);
 
     dcl->dpy_gfx_copy = vnc_dpy_copy;
     dcl->dpy_gfx_update = vnc_dpy_update;
@@ -3074,6 +3074,14 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
             vs->lossy = true;
         } else if (strncmp(options, "non-adaptive", 12) == 0) {
             vs->non_adaptive = true;
+        } else if (strncmp(options, "workers=", 8) == 0) {
+            char *end;
+
+            vs->workers = strtol(options + 8, &end, 10);
+            if (vs->workers < 1 || (*end != '\0' && *end != ',')) {
+                error_setg(errp, "invalid vnc workers= option");
+                goto fail;
+            }
         } else if (strncmp(options, "share=", 6) == 0) {
             if (strncmp(options+6, "ignore", 6) == 0) {
                 vs->share_policy = VNC_SHARE_POLICY_IGNORE;
@@ -3088,6 +3096,10 @@ void vnc_display_open(DisplayState *ds, const char *display, Error **errp)
         }
     }
 
+    if (vs->workers) {
+        vnc_start_worker_threads(vs->workers);
+    }
+
 #ifdef CONFIG_VNC_TLS
     if (acl && x509 && vs->tls.x509verify) {
         if (!(vs->tls.acl = qemu_acl_init("vnc.x509dname"))) {
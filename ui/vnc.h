@@ -154,6 +154,8 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    /* Worker threads holding mutex shared (see vnc_lock_display_shared) */
+    int readers;
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -168,6 +170,7 @@ struct VncDisplay
     int auth;
     bool lossy;
     bool non_adaptive;
+    int workers;
 #ifdef CONFIG_VNC_TLS
     int subauth; /* Used by VeNCrypt */
     VncDisplayTLS tls;
@@ -238,6 +241,8 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    /* A worker thread is encoding it */
+    bool encoding;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
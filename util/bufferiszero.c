@@ -0,0 +1,231 @@
+/*
+ * Zero buffer detection
+ *
+ * The vector implementations are picked at startup, the best one the
+ * host CPU supports.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+
+/*
+ * All implementations return the offset of the first chunk of LEN that
+ * is not all zeroes, or LEN.  LEN is a multiple of their chunk size.
+ */
+
+/* Chunks of 4 * sizeof(long), any alignment that long allows */
+static size_t find_nonzero_long(const void *buf, size_t len)
+{
+    const long *data = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(long); i += 4) {
+        if (data[i + 0] | data[i + 1] | data[i + 2] | data[i + 3]) {
+            break;
+        }
+    }
+    return i * sizeof(long);
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_FIND_NONZERO_SIMD
+#define SIMD_CHUNK          (4 * sizeof(__m128i))
+#define SIMD_ALIGN          sizeof(__m128i)
+
+static size_t find_nonzero_simd(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m128i); i += 4) {
+        __m128i t = _mm_or_si128(_mm_or_si128(p[i + 0], p[i + 1]),
+                                 _mm_or_si128(p[i + 2], p[i + 3]));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
+            break;
+        }
+    }
+    return i * sizeof(__m128i);
+}
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_FIND_NONZERO_SIMD
+#define SIMD_CHUNK          (4 * sizeof(uint8x16_t))
+#define SIMD_ALIGN          1
+
+static size_t find_nonzero_simd(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i += SIMD_CHUNK) {
+        uint8x16_t t = vorrq_u8(vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+                                vorrq_u8(vld1q_u8(p + i + 32),
+                                         vld1q_u8(p + i + 48)));
+        uint64x2_t t64 = vreinterpretq_u64_u8(t);
+
+        if (vgetq_lane_u64(t64, 0) | vgetq_lane_u64(t64, 1)) {
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AVX2_CHUNK          (4 * sizeof(__m256i))
+
+#ifndef bit_AVX2
+#define bit_AVX2            (1 << 5)
+#endif
+
+static size_t find_nonzero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(__m256i); i += 4) {
+        __m256i t = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(p + i + 0),
+                            _mm256_loadu_si256(p + i + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(p + i + 2),
+                            _mm256_loadu_si256(p + i + 3)));
+
+        if (!_mm256_testz_si256(t, t)) {
+            break;
+        }
+    }
+    return i * sizeof(__m256i);
+}
+
+static bool cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* The OS must also save the YMM registers */
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+#pragma GCC pop_options
+#endif
+
+enum {
+    ACCEL_NONE,
+    ACCEL_SIMD,                 /* SSE2 or NEON */
+    ACCEL_AVX2,
+};
+
+static int accel;
+static size_t (*find_nonzero_accel)(const void *buf, size_t len);
+static size_t accel_chunk;
+static size_t accel_align;
+
+static void set_accel(int level)
+{
+    switch (level) {
+#ifdef CONFIG_AVX2_OPT
+    case ACCEL_AVX2:
+        find_nonzero_accel = find_nonzero_avx2;
+        accel_chunk = AVX2_CHUNK;
+        accel_align = 1;
+        break;
+#endif
+#ifdef HAVE_FIND_NONZERO_SIMD
+    case ACCEL_SIMD:
+        find_nonzero_accel = find_nonzero_simd;
+        accel_chunk = SIMD_CHUNK;
+        accel_align = SIMD_ALIGN;
+        break;
+#endif
+    default:
+        /* Not built in, fall through to the next one */
+        if (level > ACCEL_NONE) {
+            set_accel(level - 1);
+            return;
+        }
+        find_nonzero_accel = NULL;
+        break;
+    }
+    accel = level;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    int level = ACCEL_SIMD;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cpu_has_avx2()) {
+        level = ACCEL_AVX2;
+    }
+#endif
+    set_accel(level);
+}
+
+/*
+ * Switches to the next slower implementation and returns true.  Once the
+ * plain C one is in use, goes back to the best one and returns false.
+ * Only for tests.
+ */
+bool test_buffer_is_zero_next_accel(void)
+{
+    if (accel == ACCEL_NONE) {
+        init_accel();
+        return false;
+    }
+    set_accel(accel - 1);
+    return true;
+}
+
+/*
+ * Returns how many bytes at the start of a buffer are zero, rounded down
+ * to a multiple of 4 * sizeof(long), or len if they all are.  The same
+ * restriction on len as for buffer_is_zero applies.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    size_t done = 0;
+
+    assert(len % (4 * sizeof(long)) == 0);
+
+    if (find_nonzero_accel && len >= accel_chunk &&
+        (uintptr_t)buf % accel_align == 0) {
+        done = find_nonzero_accel(buf, len - len % accel_chunk);
+    }
+
+    /* The tail, or narrowing a non-zero chunk down to the unit the
+     * caller expects.  */
+    return done + find_nonzero_long((const char *)buf + done, len - done);
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * Attention! The len must be a multiple of 4 * sizeof(long) due to
+ * restriction of optimizations in this function.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_find_nonzero_offset(buf, len) == len;
+}
@@ -177,6 +177,11 @@ int hbitmap_granularity(const HBitmap *hb)
     return hb->granularity;
 }
 
+uint64_t hbitmap_size(const HBitmap *hb)
+{
+    return hb->size << hb->granularity;
+}
+
 uint64_t hbitmap_count(const HBitmap *hb)
 {
     return hb->count << hb->granularity;
@@ -242,15 +247,17 @@ static void hb_set_between(HBitmap *hb, int level, uint64_t start, uint64_t last
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
         changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+
+        /* The words in between are filled at once.  Setting them in the
+         * layer above even if they were not zero is harmless.
+         */
+        if (++i < lastpos) {
+            memset(&hb->levels[level][i], 0xff,
+                   (lastpos - i) * sizeof(unsigned long));
+            changed = true;
+            i = lastpos;
         }
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
     changed |= hb_set_elem(&hb->levels[level][i], start, last);
 
@@ -319,15 +326,16 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
             pos++;
         }
 
-        for (;;) {
-            start = next;
-            next += BITS_PER_LONG;
-            if (++i == lastpos) {
-                break;
-            }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+        /* The words in between are cleared at once; they are all zero
+         * now, so blanking them in the layer above is correct.
+         */
+        if (++i < lastpos) {
+            memset(&hb->levels[level][i], 0,
+                   (lastpos - i) * sizeof(unsigned long));
+            changed = true;
+            i = lastpos;
         }
+        start = (uint64_t)lastpos << BITS_PER_LEVEL;
     }
 
     /* Same as above, this time for lastpos.  */
@@ -366,6 +374,248 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+/* Return the first clear bit at or after pos in the last layer, or
+ * hb->size if there is none.  Not accounting for the granularity.
+ */
+static uint64_t hb_next_zero(const HBitmap *hb, uint64_t pos)
+{
+    const unsigned long *elem = hb->levels[HBITMAP_LEVELS - 1];
+    size_t i = pos >> BITS_PER_LEVEL;
+    size_t n = (hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    unsigned long cur;
+
+    if (pos >= hb->size) {
+        return hb->size;
+    }
+
+    cur = ~elem[i] & ~((1UL << (pos & (BITS_PER_LONG - 1))) - 1);
+    while (cur == 0 && ++i < n) {
+        cur = ~elem[i];
+    }
+    if (cur == 0) {
+        return hb->size;
+    }
+
+    pos = ((uint64_t)i << BITS_PER_LEVEL) + bitops_ctzl(cur);
+    return MIN(pos, hb->size);
+}
+
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
+{
+    uint64_t pos = hb_next_zero(hb, start >> hb->granularity);
+
+    if (pos >= hb->size) {
+        return -1;
+    }
+    return MAX(pos << hb->granularity, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    HBitmapIter hbi;
+    uint64_t end, first, zero;
+    int64_t next;
+
+    end = hb->size << hb->granularity;
+    if (*count == 0 || *start >= end) {
+        return false;
+    }
+    if (*count < end - *start) {
+        end = *start + *count;
+    }
+
+    hbitmap_iter_init(&hbi, hb, *start);
+    next = hbitmap_iter_next(&hbi);
+    if (next < 0 || next >= end) {
+        return false;
+    }
+
+    first = MAX(next, *start);
+    zero = hb_next_zero(hb, first >> hb->granularity) << hb->granularity;
+    *start = first;
+    *count = MIN(zero, end) - first;
+    return true;
+}
+
+/* Serialization.  The header is the magic, the granularity, the format and
+ * the size in bits of the last layer (as a varint, see below).  Then come
+ * either:
+ *
+ *  - HBITMAP_SERIAL_RUNS: the lengths of the runs of clear and set bits,
+ *    alternating and starting with a run of clear bits that may be empty,
+ *    up to the last set bit;
+ *  - HBITMAP_SERIAL_RAW: the bits, 8 to a byte, least significant first,
+ *    for bitmaps too fragmented for runs to be shorter.
+ *
+ * Varints are little-endian groups of 7 bits, with the top bit of each byte
+ * set when another byte follows.  The result does not depend on the host.
+ */
+#define HBITMAP_VARINT_MAX     10
+#define HBITMAP_SERIAL_MAGIC   "HBM1"
+#define HBITMAP_SERIAL_HEADER  (4 + 2 + HBITMAP_VARINT_MAX)
+
+enum {
+    HBITMAP_SERIAL_RUNS,
+    HBITMAP_SERIAL_RAW,
+};
+
+static size_t hb_put_varint(uint8_t *p, uint64_t value)
+{
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+static bool hb_get_varint(const uint8_t **p, const uint8_t *end,
+                          uint64_t *value)
+{
+    unsigned shift;
+
+    *value = 0;
+    for (shift = 0; *p < end && shift < 7 * HBITMAP_VARINT_MAX; shift += 7) {
+        uint8_t byte = *(*p)++;
+
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Store the runs after the header at out, giving up once they would take
+ * more than limit bytes.  Return the end of the data or NULL.
+ */
+static uint8_t *hb_serialize_runs(const HBitmap *hb, uint8_t *out,
+                                  size_t limit)
+{
+    const uint8_t *end = out + limit;
+    HBitmapIter hbi;
+    uint64_t pos = 0, set, zero;
+    int64_t next;
+
+    if (hb->size == 0) {
+        return out;
+    }
+
+    hbitmap_iter_init(&hbi, hb, 0);
+    while (pos < hb->size) {
+        next = hbitmap_iter_next(&hbi);
+        if (next < 0) {
+            break;
+        }
+        set = next >> hb->granularity;
+        zero = hb_next_zero(hb, set);
+        if (end - out < 2 * HBITMAP_VARINT_MAX) {
+            return NULL;
+        }
+        out += hb_put_varint(out, set - pos);
+        out += hb_put_varint(out, zero - set);
+        pos = zero;
+        if (pos < hb->size) {
+            hbitmap_iter_init(&hbi, hb, pos << hb->granularity);
+        }
+    }
+    return out;
+}
+
+static uint8_t *hb_serialize_raw(const HBitmap *hb, uint8_t *out)
+{
+    const unsigned long *elem = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t i, len = (hb->size + 7) / 8;
+
+    for (i = 0; i < len; i++) {
+        unsigned long word = elem[i / sizeof(unsigned long)];
+
+        *out++ = word >> (8 * (i % sizeof(unsigned long)));
+    }
+    return out;
+}
+
+uint8_t *hbitmap_serialize(const HBitmap *hb, size_t *len)
+{
+    size_t raw = (hb->size + 7) / 8;
+    uint8_t *buf = g_malloc(HBITMAP_SERIAL_HEADER + raw);
+    uint8_t *out = buf, *end;
+
+    memcpy(out, HBITMAP_SERIAL_MAGIC, 4);
+    out[4] = hb->granularity;
+    out[5] = HBITMAP_SERIAL_RUNS;
+    out += 6;
+    out += hb_put_varint(out, hb->size);
+
+    end = hb_serialize_runs(hb, out, raw);
+    if (end == NULL) {
+        buf[5] = HBITMAP_SERIAL_RAW;
+        end = hb_serialize_raw(hb, out);
+    }
+
+    *len = end - buf;
+    return buf;
+}
+
+HBitmap *hbitmap_deserialize(const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf + 6, *end = buf + len;
+    uint64_t size, pos, run, i;
+    int granularity;
+    HBitmap *hb;
+
+    if (len < 6 || memcmp(buf, HBITMAP_SERIAL_MAGIC, 4) != 0 ||
+        buf[4] >= 64 || buf[5] > HBITMAP_SERIAL_RAW ||
+        !hb_get_varint(&p, end, &size) ||
+        size > ((uint64_t)1 << HBITMAP_LOG_MAX_SIZE) ||
+        ((size << buf[4]) >> buf[4]) != size) {
+        return NULL;
+    }
+
+    granularity = buf[4];
+    hb = hbitmap_alloc(size << granularity, granularity);
+
+    if (buf[5] == HBITMAP_SERIAL_RAW) {
+        if (end - p != (size + 7) / 8) {
+            goto fail;
+        }
+        /* Set each run of set bits at once */
+        for (pos = 0; pos < size; pos = i) {
+            for (i = pos; i < size && (p[i / 8] >> (i % 8)) & 1; i++) {
+            }
+            if (i > pos) {
+                hbitmap_set(hb, pos << granularity, (i - pos) << granularity);
+            }
+            for (; i < size && !((p[i / 8] >> (i % 8)) & 1); i++) {
+            }
+        }
+        return hb;
+    }
+
+    pos = 0;
+    while (p < end) {
+        if (!hb_get_varint(&p, end, &run) || run > size - pos ||
+            (run == 0 && pos != 0)) {
+            goto fail;
+        }
+        pos += run;
+        if (!hb_get_varint(&p, end, &run) || run == 0 ||
+            run > size - pos) {
+            goto fail;
+        }
+        hbitmap_set(hb, pos << granularity, run << granularity);
+        pos += run;
+    }
+    return hb;
+
+fail:
+    hbitmap_free(hb);
+    return NULL;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -26,8 +26,8 @@
 # include <sys/socket.h>
 #endif
 
-size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
-                    size_t offset, const void *buf, size_t bytes)
+size_t iov_from_buf_full(const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, const void *buf, size_t bytes)
 {
     size_t done;
     unsigned int i;
@@ -45,8 +45,8 @@ size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
     return done;
 }
 
-size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
-                  size_t offset, void *buf, size_t bytes)
+size_t iov_to_buf_full(const struct iovec *iov, const unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes)
 {
     size_t done;
     unsigned int i;
@@ -64,6 +64,59 @@ size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
     return done;
 }
 
+/*
+ * Moves the cursor `bytes' on, copying them from `from' to the iovec or
+ * from the iovec to `to' when not NULL.
+ */
+static size_t iov_cursor_copy(IOVCursor *cur, const void *from, void *to,
+                              size_t bytes)
+{
+    size_t done = 0, len;
+    const struct iovec *v;
+
+    while (done < bytes && cur->idx < cur->iov_cnt) {
+        v = &cur->iov[cur->idx];
+        len = MIN(v->iov_len - cur->offset, bytes - done);
+        if (from) {
+            memcpy(v->iov_base + cur->offset, from + done, len);
+        } else if (to) {
+            memcpy(to + done, v->iov_base + cur->offset, len);
+        }
+        done += len;
+        cur->offset += len;
+        if (cur->offset == v->iov_len) {
+            cur->idx++;
+            cur->offset = 0;
+        }
+    }
+    return done;
+}
+
+size_t iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                       unsigned int iov_cnt, size_t offset)
+{
+    cur->iov = iov;
+    cur->iov_cnt = iov_cnt;
+    cur->idx = 0;
+    cur->offset = 0;
+    return iov_cursor_copy(cur, NULL, NULL, offset);
+}
+
+size_t iov_cursor_skip(IOVCursor *cur, size_t bytes)
+{
+    return iov_cursor_copy(cur, NULL, NULL, bytes);
+}
+
+size_t iov_cursor_from_buf(IOVCursor *cur, const void *buf, size_t bytes)
+{
+    return iov_cursor_copy(cur, buf, NULL, bytes);
+}
+
+size_t iov_cursor_to_buf(IOVCursor *cur, void *buf, size_t bytes)
+{
+    return iov_cursor_copy(cur, NULL, buf, bytes);
+}
+
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes)
 {
@@ -256,9 +309,14 @@ unsigned iov_copy(struct iovec *dst_iov, unsigned int dst_iov_cnt,
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
 {
-    qiov->iov = g_malloc(alloc_hint * sizeof(struct iovec));
+    if (alloc_hint <= QEMU_IOVEC_LOCAL) {
+        qiov->iov = qiov->local;
+        qiov->nalloc = QEMU_IOVEC_LOCAL;
+    } else {
+        qiov->iov = g_malloc(alloc_hint * sizeof(struct iovec));
+        qiov->nalloc = alloc_hint;
+    }
     qiov->niov = 0;
-    qiov->nalloc = alloc_hint;
     qiov->size = 0;
 }
 
@@ -280,7 +338,13 @@ void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
 
     if (qiov->niov == qiov->nalloc) {
         qiov->nalloc = 2 * qiov->nalloc + 1;
-        qiov->iov = g_realloc(qiov->iov, qiov->nalloc * sizeof(struct iovec));
+        if (qiov->iov == qiov->local) {
+            qiov->iov = g_malloc(qiov->nalloc * sizeof(struct iovec));
+            memcpy(qiov->iov, qiov->local, qiov->niov * sizeof(struct iovec));
+        } else {
+            qiov->iov = g_realloc(qiov->iov,
+                                  qiov->nalloc * sizeof(struct iovec));
+        }
     }
     qiov->iov[qiov->niov].iov_base = base;
     qiov->iov[qiov->niov].iov_len = len;
@@ -343,7 +407,9 @@ void qemu_iovec_destroy(QEMUIOVector *qiov)
     assert(qiov->nalloc != -1);
 
     qemu_iovec_reset(qiov);
-    g_free(qiov->iov);
+    if (qiov->iov != qiov->local) {
+        g_free(qiov->iov);
+    }
     qiov->nalloc = 0;
     qiov->iov = NULL;
 }
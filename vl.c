@@ -153,6 +153,8 @@ int main(int argc, char **argv)
 #include "fsdev/qemu-fsdev.h"
 #endif
 #include "sysemu/qtest.h"
+#include "sysemu/replay.h"
+#include "sysemu/fuzz.h"
 
 #include "disas/disas.h"
 
@@ -225,6 +227,8 @@ const char *watchdog;
 QEMUOptionRom option_rom[MAX_OPTION_ROMS];
 int nb_option_roms;
 int semihosting_enabled = 0;
+CharDriverState *semihosting_chr;
+static const char *semihosting_console;
 int old_param = 0;
 const char *qemu_name;
 int alt_grab = 0;
@@ -269,6 +273,7 @@ bool xen_allowed;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
 static int tcg_tb_size;
+static size_t tcg_default_tb_size;
 
 static int default_serial = 1;
 static int default_parallel = 1;
@@ -280,6 +285,9 @@ static int default_cdrom = 1;
 static int default_sdcard = 1;
 static int default_vga = 1;
 
+/* When main() was entered, for the vl_init_stage trace event */
+static int64_t init_start_time;
+
 static struct {
     const char *driver;
     int *flag;
@@ -320,6 +328,89 @@ static QemuOptsList qemu_rtc_opts = {
     },
 };
 
+static QemuOptsList qemu_tcg_opts = {
+    .name = "tcg",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_tcg_opts.head),
+    .desc = {
+        {
+            .name = "traces",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "profile",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "profile-file",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "profile-interval",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "pretranslate",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "ebb",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "cycles",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "coverage",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "hugepages",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "memfuncs",
+            .type = QEMU_OPT_BOOL,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_pcsample_opts = {
+    .name = "pcsample",
+    .implied_opt_name = "file",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_pcsample_opts.head),
+    .desc = {
+        {
+            .name = "file",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "interval",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "unwind",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "depth",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_fuzz_opts = {
+    .name = "fuzz",
+    .implied_opt_name = "chardev",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_fuzz_opts.head),
+    .desc = {
+        {
+            .name = "chardev",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "input",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "timeout",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "idle",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_sandbox_opts = {
     .name = "sandbox",
     .implied_opt_name = "enable",
@@ -423,10 +514,42 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mem-merge",
             .type = QEMU_OPT_BOOL,
             .help = "enable/disable memory merge support",
+        },{
+            .name = "mem-hugepages",
+            .type = QEMU_OPT_BOOL,
+            .help = "Back large RAM blocks with transparent huge pages",
         },{
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        }, {
+            .name = "part",
+            .type = QEMU_OPT_STRING,
+            .help = "Microcontroller part number (STM32 boards)",
+        }, {
+            .name = "nodes",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of microcontrollers (multi-node STM32 boards)",
+        }, {
+            .name = "quantum",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Lockstep quantum in ns (multi-node STM32 boards)",
+        }, {
+            .name = "lcd",
+            .type = QEMU_OPT_BOOL,
+            .help = "Attach a TFT LCD to the FSMC (STM32 boards)",
+        }, {
+            .name = "fast-reset",
+            .type = QEMU_OPT_BOOL,
+            .help = "Reset by restoring the state after the first reset",
+        }, {
+            .name = "rng",
+            .type = QEMU_OPT_STRING,
+            .help = "Id of the RNG backend of the STM32 RNG",
+        }, {
+            .name = "rng-seed",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Seed of the reproducible random numbers of the STM32 RNG",
         },
         { /* End of list */ }
     },
@@ -1831,6 +1954,7 @@ void qemu_system_reset(bool report)
     } else {
         qemu_devices_reset();
     }
+    qemu_loadvm_reset_state();
     if (report) {
         monitor_protocol_event(QEVENT_RESET, NULL);
     }
@@ -2583,7 +2707,8 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
-    tcg_exec_init(tcg_tb_size * 1024 * 1024);
+    tcg_exec_init(tcg_tb_size ? tcg_tb_size * 1024 * 1024
+                              : tcg_default_tb_size);
     return 0;
 }
 
@@ -2795,11 +2920,19 @@ static int object_create(QemuOpts *opts, void *opaque)
     return 0;
 }
 
+/* Records with a trace event how long startup took up to stage, so that a
+ * trace of a run shows where the time goes. */
+static void init_stage(const char *stage)
+{
+    trace_vl_init_stage(stage, get_clock() - init_start_time);
+}
+
 int main(int argc, char **argv, char **envp)
 {
     int i;
     int snapshot, linux_boot;
     const char *icount_option = NULL;
+    const char *replay_option = NULL;
     const char *initrd_filename;
     const char *kernel_filename, *kernel_cmdline;
     char boot_devices[33] = "";
@@ -2810,6 +2943,7 @@ int main(int argc, char **argv, char **envp)
     int optind;
     const char *optarg;
     const char *loadvm = NULL;
+    const char *loadstate = NULL;
     QEMUMachine *machine;
     const char *cpu_model;
     const char *vga_model = "none";
@@ -2830,6 +2964,8 @@ int main(int argc, char **argv, char **envp)
     const char *trace_events = NULL;
     const char *trace_file = NULL;
 
+    init_start_time = get_clock();
+
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
 
@@ -2858,6 +2994,9 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_machine_opts);
     qemu_add_opts(&qemu_boot_opts);
     qemu_add_opts(&qemu_sandbox_opts);
+    qemu_add_opts(&qemu_tcg_opts);
+    qemu_add_opts(&qemu_pcsample_opts);
+    qemu_add_opts(&qemu_fuzz_opts);
     qemu_add_opts(&qemu_add_fd_opts);
     qemu_add_opts(&qemu_object_opts);
 
@@ -3160,6 +3299,12 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_qcow2:
+                opts = qemu_opts_parse(qemu_find_opts("qcow2"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
 #ifdef CONFIG_LIBISCSI
             case QEMU_OPTION_iscsi:
                 opts = qemu_opts_parse(qemu_find_opts("iscsi"), optarg, 0);
@@ -3460,6 +3605,9 @@ int main(int argc, char **argv, char **envp)
 	    case QEMU_OPTION_loadvm:
 		loadvm = optarg;
 		break;
+            case QEMU_OPTION_loadstate_shm:
+                loadstate = optarg;
+                break;
             case QEMU_OPTION_full_screen:
                 full_screen = 1;
                 break;
@@ -3640,6 +3788,10 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_semihosting:
                 semihosting_enabled = 1;
                 break;
+            case QEMU_OPTION_semihosting_console:
+                semihosting_enabled = 1;
+                semihosting_console = optarg;
+                break;
             case QEMU_OPTION_tdf:
                 fprintf(stderr, "Warning: user space PIT time drift fix "
                                 "is no longer supported.\n");
@@ -3689,9 +3841,50 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tcg:
+                opts = qemu_opts_parse(qemu_find_opts("tcg"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                tcg_traces = qemu_opt_get_bool(opts, "traces", 0);
+                tcg_tb_profile = qemu_opt_get_bool(opts, "profile", 0) ||
+                                 qemu_opt_get(opts, "profile-file");
+                tcg_pretranslate = qemu_opt_get_bool(opts, "pretranslate", 0);
+                tcg_ebb = qemu_opt_get_bool(opts, "ebb", 0);
+                tcg_cycles = qemu_opt_get_bool(opts, "cycles", 0);
+                tcg_coverage = qemu_opt_get_bool(opts, "coverage", 0);
+                tcg_memfuncs = qemu_opt_get_bool(opts, "memfuncs", 0);
+                optarg = qemu_opt_get(opts, "hugepages");
+                if (!optarg) {
+                    tcg_hugepages = TCG_HUGEPAGES_AUTO;
+                } else if (!strcmp(optarg, "on")) {
+                    tcg_hugepages = TCG_HUGEPAGES_THP;
+                } else if (!strcmp(optarg, "off")) {
+                    tcg_hugepages = TCG_HUGEPAGES_OFF;
+                } else if (!strcmp(optarg, "hugetlb")) {
+                    tcg_hugepages = TCG_HUGEPAGES_HUGETLB;
+                } else {
+                    fprintf(stderr, "qemu: invalid -tcg hugepages value "
+                            "'%s' (on, off or hugetlb)\n", optarg);
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
+            case QEMU_OPTION_replay:
+                replay_option = optarg;
+                break;
+            case QEMU_OPTION_pcsample:
+                if (!qemu_opts_parse(qemu_find_opts("pcsample"), optarg, 1)) {
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_fuzz:
+                if (!qemu_opts_parse(qemu_find_opts("fuzz"), optarg, 1)) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 runstate_set(RUN_STATE_INMIGRATE);
@@ -3873,6 +4066,7 @@ int main(int argc, char **argv, char **envp)
     if (!trace_backend_init(trace_events, trace_file)) {
         exit(1);
     }
+    init_stage("options");
 
     /* If no data_dir is specified then try to find it relative to the
        executable path.  */
@@ -3932,6 +4126,11 @@ int main(int argc, char **argv, char **envp)
     if (machine->no_sdcard) {
         default_sdcard = 0;
     }
+    /* Saves setting up a NIC and user networking nothing would use; an
+     * explicit -net or -netdev still works. */
+    if (machine->no_net) {
+        default_net = 0;
+    }
 
     if (is_daemonized()) {
         /* According to documentation and historically, -nographic redirects
@@ -3995,6 +4194,14 @@ int main(int argc, char **argv, char **envp)
 
     if (qemu_opts_foreach(qemu_find_opts("chardev"), chardev_init_func, NULL, 1) != 0)
         exit(1);
+    if (semihosting_console) {
+        semihosting_chr = qemu_chr_find(semihosting_console);
+        if (!semihosting_chr) {
+            fprintf(stderr, "qemu: -semihosting-console: no character "
+                    "device '%s'\n", semihosting_console);
+            exit(1);
+        }
+    }
 #ifdef CONFIG_VIRTFS
     if (qemu_opts_foreach(qemu_find_opts("fsdev"), fsdev_init_func, NULL, 1) != 0) {
         exit(1);
@@ -4018,8 +4225,19 @@ int main(int argc, char **argv, char **envp)
         exit(0);
     }
 
+    if (machine->tb_size) {
+        tcg_default_tb_size = machine->tb_size();
+    }
+
     configure_accelerator();
 
+    opts = qemu_opts_find(qemu_find_opts("tcg"), NULL);
+    if (opts && qemu_opt_get(opts, "profile-file")) {
+        tb_profile_dump_init(qemu_opt_get(opts, "profile-file"),
+                             qemu_opt_get_number(opts, "profile-interval",
+                                                 1000));
+    }
+
     machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
     if (machine_opts) {
         kernel_filename = qemu_opt_get(machine_opts, "kernel");
@@ -4065,6 +4283,11 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     configure_icount(icount_option);
+    replay_configure(replay_option);
+    if (tcg_coverage) {
+        tcg_coverage_init();
+    }
+    fuzz_configure(qemu_opts_find(qemu_find_opts("fuzz"), NULL));
 
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
@@ -4188,6 +4411,8 @@ int main(int argc, char **argv, char **envp)
 
     qdev_machine_init();
 
+    init_stage("backends");
+
     QEMUMachineInitArgs args = { .ram_size = ram_size,
                                  .boot_device = (boot_devices[0] == '\0') ?
                                                 machine->boot_order :
@@ -4197,6 +4422,7 @@ int main(int argc, char **argv, char **envp)
                                  .initrd_filename = initrd_filename,
                                  .cpu_model = cpu_model };
     machine->init(&args);
+    init_stage("machine");
 
     cpu_synchronize_all_post_init();
 
@@ -4302,11 +4528,21 @@ int main(int argc, char **argv, char **envp)
     qemu_run_machine_init_done_notifiers();
 
     qemu_system_reset(VMRESET_SILENT);
+    init_stage("reset");
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
         }
     }
+    if (loadstate) {
+        if (load_vmstate_shm(loadstate) < 0) {
+            autostart = 0;
+        }
+    }
+    if (machine_opts && qemu_opt_get_bool(machine_opts, "fast-reset", false)) {
+        qemu_savevm_reset_state();
+    }
+    fuzz_start();
 
     if (incoming) {
         Error *local_err = NULL;
@@ -4323,6 +4559,7 @@ int main(int argc, char **argv, char **envp)
     os_setup_post();
 
     resume_all_vcpus();
+    init_stage("ready");
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
@@ -11,8 +11,20 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Bit n is set if byte n of the 16 at A and B is the same.  */
+static inline uint32_t xbzrle_eq_mask(uint8_t *a, uint8_t *b)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)a),
+                                            _mm_loadu_si128((__m128i *)b)));
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -48,6 +60,23 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             res--;
         }
 
+#ifdef __SSE2__
+        /* sixteen bytes at a time, up to the first difference */
+        if (!res) {
+            while (i + 16 <= slen) {
+                uint32_t eq = xbzrle_eq_mask(old_buf + i, new_buf + i);
+                if (eq != 0xffff) {
+                    i += ctz32(~eq);
+                    zrun_len += ctz32(~eq);
+                    break;
+                }
+                i += 16;
+                zrun_len += 16;
+            }
+            res = (slen - i) % sizeof(long);
+        }
+#endif
+
         /* word at a time for speed */
         if (!res) {
             while (i < slen &&
@@ -90,6 +119,24 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             res--;
         }
 
+#ifdef __SSE2__
+        /* sixteen bytes at a time, up to the first byte that is the same */
+        if (!res) {
+            while (i + 16 <= slen) {
+                uint32_t eq = xbzrle_eq_mask(old_buf + i, new_buf + i);
+                if (eq) {
+                    i += ctz32(eq);
+                    nzrun_len += ctz32(eq);
+                    /* the run has ended, skip the word loop */
+                    res = 1;
+                    break;
+                }
+                i += 16;
+                nzrun_len += 16;
+            }
+        }
+#endif
+
         /* word at a time for speed, use of 32-bit long okay */
         if (!res) {
             /* truncation to 32-bit long okay */